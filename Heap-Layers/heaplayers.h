@@ -45,6 +45,14 @@ namespace HL {}
 
 #define HL_EXECUTABLE_HEAP 0
 
+// Define HL_ASYNC_MUNMAP as 1 to have large mappings unmapped on a
+// background thread, once UnmapQueue::start() has been called (see
+// utility/unmapqueue.h).
+
+#if !defined(HL_ASYNC_MUNMAP)
+#define HL_ASYNC_MUNMAP 0
+#endif
+
 #if defined(_MSC_VER)
 
 // Microsoft Visual Studio
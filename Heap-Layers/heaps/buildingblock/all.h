@@ -1,6 +1,12 @@
 #include "adaptheap.h"
+#include "batchheap.h"
 #include "boundedfreelistheap.h"
 #include "chunkheap.h"
 #include "coalesceheap.h"
+#include "comallocheap.h"
+#include "deferredcoalesceheap.h"
 #include "freelistheap.h"
+#include "lockfreefreelistheap.h"
+#include "sizepassingheap.h"
+#include "slabheap.h"
 
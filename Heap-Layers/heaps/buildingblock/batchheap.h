@@ -0,0 +1,79 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_BATCHHEAP_H
+#define HL_BATCHHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+/**
+ * @class BatchHeap
+ * @brief Adds the batch protocol (mallocBatch / freeBatch) to a heap.
+ *
+ * mallocBatch (sz, n, ptrs) fills ptrs with up to n objects of size
+ * sz and returns how many it actually obtained; freeBatch (ptrs, n)
+ * frees n objects at once.
+ *
+ * This layer supplies the default implementation, a loop over
+ * malloc and free, so that it can sit directly on top of any source
+ * heap. Layers that can do better override these methods: for
+ * example, LockedHeap acquires its lock once per batch rather than
+ * once per object, and FreelistHeap uses mallocBatch to refill its
+ * free list several objects at a time.
+ */
+
+namespace HL {
+
+  template <class SuperHeap>
+  class BatchHeap : public SuperHeap {
+  public:
+
+    enum { Alignment = SuperHeap::Alignment };
+
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      int i;
+      for (i = 0; i < n; i++) {
+	void * ptr = SuperHeap::malloc (sz);
+	if (ptr == NULL) {
+	  break;
+	}
+	ptrs[i] = ptr;
+      }
+      return i;
+    }
+
+    inline void freeBatch (void ** ptrs, int n) {
+      for (int i = 0; i < n; i++) {
+	SuperHeap::free (ptrs[i]);
+      }
+    }
+
+  };
+
+}
+
+#endif
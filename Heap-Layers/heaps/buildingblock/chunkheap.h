@@ -33,17 +33,19 @@
  * @class ChunkHeap
  * @brief Allocates memory from the superheap in chunks.
  * @param ChunkSize The minimum size for allocating memory from the superheap.
+ * @param MaxChunkSize The most the chunk size doubles to, one chunk at a time.
  */
 
 namespace HL {
 
-  template <int ChunkSize, class SuperHeap>
+  template <int ChunkSize, class SuperHeap, int MaxChunkSize = ChunkSize>
   class ChunkHeap : public SuperHeap {
   public:
 
     inline ChunkHeap (void)
       : buffer (NULL),
-	eob (NULL)
+	eob (NULL),
+	chunkSize (ChunkSize)
     {}
 
     inline void * malloc (const size_t sz) {
@@ -61,6 +63,7 @@ namespace HL {
     inline void clear (void) {
       buffer = NULL;
       eob = NULL;
+      chunkSize = ChunkSize;
       SuperHeap::clear ();
     }
 
@@ -72,11 +75,17 @@ namespace HL {
     void * getMoreMemory (size_t sz) {
       assert (sz > 0);
       // Round sz to the next chunk size.
-      size_t reqSize = (((sz-1) / ChunkSize) + 1) * ChunkSize;
+      size_t reqSize = (((sz-1) / chunkSize) + 1) * chunkSize;
       char * buf = (char *) SuperHeap::malloc (reqSize);
       if (buf == NULL) {
 	return NULL;
       }
+      if (chunkSize < (size_t) MaxChunkSize) {
+	chunkSize *= 2;
+	if (chunkSize > (size_t) MaxChunkSize) {
+	  chunkSize = MaxChunkSize;
+	}
+      }
       // If the current end of buffer is not the same as the new buffer,
       // reset the buffer pointer.
       if (eob != buf) {
@@ -98,6 +107,9 @@ namespace HL {
 
     /// The end of the buffer.
     char * eob;
+
+    /// The size that requests are rounded up to.
+    size_t chunkSize;
   };
 
 }
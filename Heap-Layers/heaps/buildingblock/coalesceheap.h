@@ -30,6 +30,8 @@
 #include <assert.h>
 
 #include "heaplayers.h"
+#include "utility/align.h"
+#include "wrappers/mallocinfo.h"
 
 /**
  * @class CoalesceHeap
@@ -44,8 +46,12 @@ namespace HL {
   class CoalesceHeap : public super {
   public:
 
-    inline void * malloc (const size_t sz)
+    inline void * malloc (size_t sz)
     {
+      // Every object must be able to hold a free list's links.
+      if (sz < MinObjectSize) {
+	sz = MinObjectSize;
+      }
       void * ptr = super::malloc (sz);
       if (ptr != NULL) {
 	super::markInUse (ptr);
@@ -73,13 +79,13 @@ namespace HL {
       void * next = super::getNext (ptr);
       assert (prev != ptr);
 
-      if (super::isPrevFree(ptr)) {
+      if (super::isPrevFree(ptr) && canCoalesce (prev, ptr)) {
 	assert (super::isFree(prev));
 	super::remove (prev);
 	coalesce (prev, ptr);
 	ptr = prev;
       }
-      if (super::isFree(next)) {
+      if (super::isFree(next) && canCoalesce (ptr, next)) {
 	super::remove (next);
 	coalesce (ptr, next);
       }
@@ -90,8 +96,95 @@ namespace HL {
       super::free (ptr);
     }
 
+    /// Grow an object in place by absorbing its successor, if that
+    /// one is free and big enough (any excess is split off again).
+    /// Returns true if the object now holds at least newSize bytes.
+    inline bool resize (void * ptr, const size_t newSize)
+    {
+      if (super::getSize(ptr) >= newSize) {
+	return true;
+      }
+      void * next = super::getNext (ptr);
+      // As in free, only look at a neighbor we can verify.
+      if ((super::getPrev(next) != ptr) || !super::isFree(next)) {
+	return false;
+      }
+      if ((((size_t) next - (size_t) ptr) + super::getSize(next) < newSize)
+	  || !canCoalesce (ptr, next)) {
+	return false;
+      }
+      super::remove (next);
+      coalesce (ptr, next);
+      super::markInUse (ptr);
+      void * splitPiece = split (ptr, newSize);
+      if (splitPiece != NULL) {
+	super::markFree (splitPiece);
+	super::free (splitPiece);
+      }
+      return true;
+    }
+
+    /// Allocate n objects as one block, split in place, so that they
+    /// are contiguous and in order (see ComallocHeap). Each is an
+    /// object like any other, and is freed on its own.
+    inline bool comalloc (size_t n, const size_t * sizes, void ** ptrs)
+    {
+      if (n == 0) {
+	return true;
+      }
+      // The pieces and the headers between them.
+      size_t total = 0;
+      for (size_t i = 0; i < n; i++) {
+	if (sizes[i] > super::maxObjectSize()) {
+	  return false;
+	}
+	const size_t sz = pieceSize (sizes[i]) + ((i > 0) ? sizeof(typename super::Header) : 0);
+	if (sz > super::maxObjectSize() - total) {
+	  return false;
+	}
+	total += sz;
+      }
+      void * ptr = super::malloc (total);
+      if (ptr == NULL) {
+	return false;
+      }
+      super::markInUse (ptr);
+      for (size_t i = 0; i < n; i++) {
+	ptrs[i] = ptr;
+	// What is split off is in use, as the whole block was.
+	void * rest = split (ptr, pieceSize (sizes[i]));
+	if (i + 1 < n) {
+	  assert (rest != NULL);
+	  ptr = rest;
+	} else if (rest != NULL) {
+	  super::markFree (rest);
+	  super::free (rest);
+	}
+      }
+      return true;
+    }
+
   private:
 
+    /// The smallest object: big enough for a doubly-linked list entry.
+    enum { MinObjectSize = (2 * sizeof(void *) > sizeof(double)) ? 2 * sizeof(void *) : sizeof(double) };
+
+    // The size of a comalloc piece: enough for sz, and enough that the
+    // next piece is as aligned as this one.
+    inline static size_t pieceSize (size_t sz) {
+      if (sz < MinObjectSize) {
+	sz = MinObjectSize;
+      }
+      return HL::align<HL::MallocInfo::Alignment>(sz + sizeof(typename super::Header))
+	- sizeof(typename super::Header);
+    }
+
+    // Whether the two would fit in one object (as they may not with
+    // compact headers).
+    inline static bool canCoalesce (const void * first, const void * second) {
+      return (((size_t) second - (size_t) first) + super::getSize(second)
+	      <= super::maxObjectSize());
+    }
 
     // Combine the first object with the second.
     inline static void coalesce (void * first, const void * second) {
@@ -101,7 +194,7 @@ namespace HL {
       // Now coalesce.
       size_t newSize = ((size_t) second - (size_t) first) + super::getSize(second);
       super::setSize (first, newSize);
-      setPrevSize (super::getNext(first), newSize);
+      super::setPrevSize (super::getNext(first), newSize);
     }
 
     // Split an object if it is big enough.
@@ -109,7 +202,7 @@ namespace HL {
       assert (super::getSize(obj) >= requestedSize);
       // We split aggressively (for now; this could be a parameter).
       const size_t actualSize = super::getSize(obj);
-      if (actualSize - requestedSize >= sizeof(typename super::Header) + sizeof(double)) {
+      if (actualSize - requestedSize >= sizeof(typename super::Header) + MinObjectSize) {
 	// Split the object.
 	super::setSize(obj, requestedSize);
 	void * splitPiece = (char *) obj + requestedSize + sizeof(typename super::Header);
@@ -120,7 +213,7 @@ namespace HL {
 	// Now that we have a new successor (splitPiece), we need to
 	// mark obj as in use.
 	(super::getHeader(splitPiece))->markPrevInUse();
-	assert (super::getSize(splitPiece) >= sizeof(double));
+	assert (super::getSize(splitPiece) >= MinObjectSize);
 	assert (super::getSize(obj) >= requestedSize);
 	return splitPiece;
       } else {
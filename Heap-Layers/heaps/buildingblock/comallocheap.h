@@ -0,0 +1,74 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_COMALLOCHEAP_H
+#define HL_COMALLOCHEAP_H
+
+#include <stddef.h>
+
+/**
+ * @class ComallocHeap
+ * @brief Adds co-allocation (comalloc) to a heap.
+ *
+ * comalloc (n, sizes, ptrs) allocates n objects, of sizes[0] through
+ * sizes[n - 1] bytes, into ptrs, and returns true; or allocates none
+ * and returns false. Each object is freed on its own, as from malloc.
+ * Heaps that can carve the objects out of one block, in order, so
+ * that related objects (a node and its payload, the arrays of a
+ * struct of arrays) share cache lines, override it: ZoneHeap,
+ * CoalesceHeap and LeaMallocHeap (through dlmalloc's
+ * independent_comalloc) do.
+ *
+ * This layer supplies the default, one malloc per object, so that it
+ * can sit directly on top of any other heap.
+ */
+
+namespace HL {
+
+  template <class SuperHeap>
+  class ComallocHeap : public SuperHeap {
+  public:
+
+    enum { Alignment = SuperHeap::Alignment };
+
+    inline bool comalloc (size_t n, const size_t * sizes, void ** ptrs) {
+      for (size_t i = 0; i < n; i++) {
+	ptrs[i] = SuperHeap::malloc (sizes[i]);
+	if (ptrs[i] == NULL) {
+	  while (i > 0) {
+	    SuperHeap::free (ptrs[--i]);
+	  }
+	  return false;
+	}
+      }
+      return true;
+    }
+
+  };
+
+}
+
+#endif
@@ -0,0 +1,187 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_DEFERREDCOALESCEHEAP_H
+#define HL_DEFERREDCOALESCEHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "heaplayers.h"
+
+/**
+ * @class DeferredCoalesceHeap
+ * @brief Quicklists in front of a coalescing heap, coalesced in batches.
+ *
+ * Freed objects of up to MaxSize bytes go onto exact-size quicklists
+ * (one per Granularity bytes) without touching the superheap, and a
+ * malloc of the same size takes one straight back, so a free and a
+ * malloc of one size cost no coalescing and no splitting. Objects on
+ * the quicklists still look in use to the superheap, so no neighbor
+ * coalesces into them. Once they hold more than BudgetBytes, they
+ * are all sorted by address and freed to the superheap in order, so
+ * that each coalesces with the one freed just before it and the
+ * superheap walks memory upward.
+ *
+ * Only sizes that have been asked for since the last batch are kept;
+ * others are freed (and coalesced) at once, while they are still in
+ * cache, so that sizes that never recur do not just fill the budget.
+ *
+ * The superheap must hand out objects big enough for a link (as
+ * CoalesceHeap does), and report their sizes with getSize:
+ *
+ * <TT>
+ *   DeferredCoalesceHeap<4096, 256 * 1024, DLBigHeapType<...> >
+ * </TT>
+ *
+ * @param MaxSize     The largest object kept on a quicklist.
+ * @param BudgetBytes The most the quicklists hold before a batch.
+ */
+
+namespace HL {
+
+  template <size_t MaxSize, size_t BudgetBytes, class SuperHeap>
+  class DeferredCoalesceHeap : public SuperHeap {
+  public:
+
+    DeferredCoalesceHeap (void)
+      : _bytes (0)
+    {
+      for (int i = 0; i < NumBins; i++) {
+	_bins[i] = NULL;
+	_wanted[i] = false;
+      }
+    }
+
+    inline void * malloc (size_t sz) {
+      if (sz <= MaxSize) {
+	// Every object in this bin holds at least sz bytes.
+	const size_t i = (sz + Granularity - 1) / Granularity;
+	_wanted[i] = true;
+	Entry * e = _bins[i];
+	if (e != NULL) {
+	  _bins[i] = e->next;
+	  _bytes -= SuperHeap::getSize (e);
+	  return (void *) e;
+	}
+      }
+      return SuperHeap::malloc (sz);
+    }
+
+    inline void free (void * ptr) {
+      const size_t sz = SuperHeap::getSize (ptr);
+      const size_t i = sz / Granularity;
+      if ((sz >= (NumBins * Granularity)) || !_wanted[i]) {
+	SuperHeap::free (ptr);
+	return;
+      }
+      Entry * e = (Entry *) ptr;
+      e->next = _bins[i];
+      _bins[i] = e;
+      _bytes += sz;
+      if (_bytes > BudgetBytes) {
+	coalesce();
+      }
+    }
+
+    /// Coalesce everything on the quicklists, then purge the superheap.
+    inline size_t purge (size_t budget) {
+      coalesce();
+      return SuperHeap::purge (budget);
+    }
+
+    /// Free every object on the quicklists to the superheap, in
+    /// address order (within batches of BatchSize).
+    NO_INLINE void coalesce (void) {
+      void * batch[BatchSize];
+      int n = 0;
+      for (int i = 0; i < NumBins; i++) {
+	Entry * e = _bins[i];
+	while (e != NULL) {
+	  if (n == BatchSize) {
+	    release (batch, n);
+	    n = 0;
+	  }
+	  batch[n++] = e;
+	  e = e->next;
+	}
+	_bins[i] = NULL;
+	_wanted[i] = false;
+      }
+      release (batch, n);
+      _bytes = 0;
+    }
+
+  private:
+
+    enum { Granularity = sizeof(double) };
+    enum { NumBins = MaxSize / Granularity + 1 };
+
+    /// The most objects sorted at once. Sorting their addresses on
+    /// the stack, rather than linking through the (cold) objects,
+    /// keeps a batch from costing a cache miss per comparison.
+    enum { BatchSize = 64 };
+
+    class Entry {
+    public:
+      Entry * next;
+    };
+
+    /// Sort the objects by address (a Shell sort), and free them.
+    void release (void ** batch, int n) {
+      int gap = 1;
+      while (gap < n / 3) {
+	gap = 3 * gap + 1;
+      }
+      for (; gap > 0; gap /= 3) {
+	for (int i = gap; i < n; i++) {
+	  void * v = batch[i];
+	  int j = i;
+	  while ((j >= gap) && (batch[j - gap] > v)) {
+	    batch[j] = batch[j - gap];
+	    j -= gap;
+	  }
+	  batch[j] = v;
+	}
+      }
+      for (int i = 0; i < n; i++) {
+	SuperHeap::free (batch[i]);
+      }
+    }
+
+    /// The bytes on the quicklists.
+    size_t _bytes;
+
+    /// The quicklists, by size / Granularity.
+    Entry * _bins[NumBins];
+
+    /// Which quicklists a malloc has asked for since the last batch.
+    bool _wanted[NumBins];
+  };
+
+}
+
+#endif
@@ -34,10 +34,17 @@
  * 
  * Note that the linked list is threaded through the freed objects,
  * meaning that such objects must be at least the size of a pointer.
+ *
+ * @param BatchSize How many objects to request from the superheap
+ *                  whenever the free list is empty. Values above one
+ *                  require the superheap to support mallocBatch
+ *                  (e.g., by way of BatchHeap).
  */
 
 #include <assert.h>
 #include "utility/freesllist.h"
+#include "utility/heapwalk.h"
+#include "utility/istrue.h"
 
 #ifndef NULL
 #define NULL 0
@@ -45,7 +52,7 @@
 
 namespace HL {
 
-  template <class SuperHeap>
+  template <class SuperHeap, int BatchSize = 1>
   class FreelistHeap : public SuperHeap {
   public:
   
@@ -55,7 +62,7 @@ namespace HL {
       // If it's empty, get more memory;
       // otherwise, advance the free list pointer.
       if (ptr == 0) {
-	ptr = SuperHeap::malloc (sz);
+	ptr = refill (sz, IsTrue<(BatchSize > 1)>());
       }
       return ptr;
     }
@@ -67,6 +74,26 @@ namespace HL {
       _freelist.insert (ptr);
     }
 
+    /// Satisfy as much of a batch as possible from the free list,
+    /// then ask the superheap for the remainder.
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      int i = 0;
+      void * ptr;
+      while ((i < n) && ((ptr = _freelist.get()) != NULL)) {
+	ptrs[i++] = ptr;
+      }
+      if (i < n) {
+	i += SuperHeap::mallocBatch (sz, n - i, ptrs + i);
+      }
+      return i;
+    }
+
+    inline void freeBatch (void ** ptrs, int n) {
+      for (int i = 0; i < n; i++) {
+	free (ptrs[i]);
+      }
+    }
+
     inline void clear (void) {
       void * ptr;
       while ((ptr = _freelist.get())) {
@@ -74,8 +101,55 @@ namespace HL {
       }
     }
 
+    /// Give free objects back to the superheap (which must reuse or
+    /// release them, as with clear) until budget bytes have gone,
+    /// then purge the superheap with what is left of the budget.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      void * ptr;
+      while ((released < budget) && ((ptr = _freelist.get()) != NULL)) {
+	released += SuperHeap::getSize (ptr);
+	SuperHeap::free (ptr);
+      }
+      if (released < budget) {
+	released += SuperHeap::purge (budget - released);
+      }
+      return released;
+    }
+
+    /// Report the objects on the free list (sized by getSize).
+    void walk (HeapWalker& w) {
+      HeapUsage u;
+      for (const FreeSLList::Entry * e = _freelist.peek(); e != NULL; e = e->next) {
+	u.freeObjects++;
+	u.freeBytes += SuperHeap::getSize ((void *) e);
+      }
+      u.heldBytes = u.freeBytes;
+      w.visit ("FreelistHeap", u);
+      SuperHeap::walk (w);
+    }
+
   private:
 
+    /// Get one object from the superheap.
+    inline void * refill (size_t sz, IsTrue<false>) {
+      return SuperHeap::malloc (sz);
+    }
+
+    /// Get BatchSize objects from the superheap, returning one and
+    /// putting the rest on the free list.
+    NO_INLINE void * refill (size_t sz, IsTrue<true>) {
+      void * ptrs[BatchSize];
+      int n = SuperHeap::mallocBatch (sz, BatchSize, ptrs);
+      if (n == 0) {
+	return NULL;
+      }
+      for (int i = 1; i < n; i++) {
+	_freelist.insert (ptrs[i]);
+      }
+      return ptrs[0];
+    }
+
     FreeSLList _freelist;
 
   };
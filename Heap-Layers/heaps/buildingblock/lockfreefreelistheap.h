@@ -0,0 +1,154 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+  
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+  
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_LOCKFREEFREELISTHEAP_H
+#define HL_LOCKFREEFREELISTHEAP_H
+
+/**
+ * @class LockFreeFreelistHeap
+ * @brief A FreelistHeap that threads can share without a lock.
+ * @warning This is for one "size class" only.
+ *
+ * The free list is a LockFreeSLList, so malloc and free only lock
+ * when the list runs dry and the superheap is asked for more; the
+ * superheap must be thread-safe (e.g., a LockedHeap), and must not
+ * unmap memory while it is on the list.
+ *
+ * @param BatchSize How many objects to request from the superheap
+ *                  whenever the free list is empty. Values above one
+ *                  require the superheap to support mallocBatch.
+ */
+
+#include <assert.h>
+#include "utility/heapwalk.h"
+#include "utility/istrue.h"
+#include "utility/lockfreesllist.h"
+
+#ifndef NULL
+#define NULL 0
+#endif
+
+namespace HL {
+
+  template <class SuperHeap, int BatchSize = 1>
+  class LockFreeFreelistHeap : public SuperHeap {
+  public:
+
+    inline void * malloc (size_t sz) {
+      void * ptr = _freelist.get();
+      if (ptr == 0) {
+	ptr = refill (sz, IsTrue<(BatchSize > 1)>());
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr == 0) {
+	return;
+      }
+      _freelist.insert (ptr);
+    }
+
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      int i = 0;
+      void * ptr;
+      while ((i < n) && ((ptr = _freelist.get()) != NULL)) {
+	ptrs[i++] = ptr;
+      }
+      if (i < n) {
+	i += SuperHeap::mallocBatch (sz, n - i, ptrs + i);
+      }
+      return i;
+    }
+
+    inline void freeBatch (void ** ptrs, int n) {
+      for (int i = 0; i < n; i++) {
+	free (ptrs[i]);
+      }
+    }
+
+    /// Return everything on the free list to the superheap. Only
+    /// safe when no other thread is using this heap.
+    inline void clear (void) {
+      void * ptr;
+      while ((ptr = _freelist.get())) {
+	SuperHeap::free (ptr);
+      }
+    }
+
+    /// As in FreelistHeap: give free objects back until budget bytes
+    /// have gone, then purge the superheap.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      void * ptr;
+      while ((released < budget) && ((ptr = _freelist.get()) != NULL)) {
+	released += SuperHeap::getSize (ptr);
+	SuperHeap::free (ptr);
+      }
+      if (released < budget) {
+	released += SuperHeap::purge (budget - released);
+      }
+      return released;
+    }
+
+    /// Report the objects on the free list (sized by getSize); the
+    /// counts are a snapshot if other threads are busy.
+    void walk (HeapWalker& w) {
+      HeapUsage u;
+      for (const LockFreeSLList::Entry * e = _freelist.peek(); e != NULL; e = e->next) {
+	u.freeObjects++;
+	u.freeBytes += SuperHeap::getSize ((void *) e);
+      }
+      u.heldBytes = u.freeBytes;
+      w.visit ("LockFreeFreelistHeap", u);
+      SuperHeap::walk (w);
+    }
+
+  private:
+
+    inline void * refill (size_t sz, IsTrue<false>) {
+      return SuperHeap::malloc (sz);
+    }
+
+    NO_INLINE void * refill (size_t sz, IsTrue<true>) {
+      void * ptrs[BatchSize];
+      int n = SuperHeap::mallocBatch (sz, BatchSize, ptrs);
+      if (n == 0) {
+	return NULL;
+      }
+      for (int i = 1; i < n; i++) {
+	_freelist.insert (ptrs[i]);
+      }
+      return ptrs[0];
+    }
+
+    LockFreeSLList _freelist;
+
+  };
+
+}
+
+#endif
@@ -0,0 +1,81 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_SIZEPASSINGHEAP_H
+#define HL_SIZEPASSINGHEAP_H
+
+#include <stddef.h>
+
+/**
+ * @class SizePassingHeap
+ * @brief Adds the size-passing protocol (mallocSized / sized free) to a heap.
+ *
+ * mallocSized (sz, &actual) allocates as malloc does and sets actual
+ * to the object's size, as getSize would report it; free (ptr, sz)
+ * frees an object whose size, as getSize would report it, the caller
+ * already has (say, from mallocSized). A layer that needs the size
+ * (to count it, or to find its size class) takes it from its caller
+ * and passes it on, rather than each layer of a stack reading the
+ * same header again with getSize.
+ *
+ * This layer supplies the default implementation, getSize once after
+ * malloc and a plain free, so that it can sit on top of any heap with
+ * getSize. Layers that use the size override these methods: SegHeap
+ * picks the size class from it, and ProfileHeap, AllocatedHeap and
+ * the statistics layers count it and pass it on.
+ *
+ * Note that some source heaps (MmapHeap, ReservedHeap) have a free
+ * (ptr, sz) of their own, which takes the size they were asked for;
+ * put this layer between them and anything that passes sizes down.
+ */
+
+namespace HL {
+
+  template <class SuperHeap>
+  class SizePassingHeap : public SuperHeap {
+  public:
+
+    enum { Alignment = SuperHeap::Alignment };
+
+    inline void * mallocSized (size_t sz, size_t * actual) {
+      void * ptr = SuperHeap::malloc (sz);
+      *actual = (ptr != NULL) ? SuperHeap::getSize (ptr) : 0;
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      SuperHeap::free (ptr);
+    }
+
+    inline void free (void * ptr, size_t) {
+      SuperHeap::free (ptr);
+    }
+
+  };
+
+}
+
+#endif
@@ -0,0 +1,457 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_SLABHEAP_H
+#define HL_SLABHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "utility/bitops.h"
+#include "utility/gcd.h"
+#include "utility/heapwalk.h"
+#include "utility/sassert.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class SlabHeap
+ * @brief Carves aligned page runs into objects of one size (a BiBOP).
+ * @warning This is for one "size class" only.
+ *
+ * Each run of PageRunSize bytes, aligned to its size, starts with a
+ * header holding a bitmap of its free objects, so that free finds the
+ * header by masking the pointer and every page holds objects of just
+ * one size. malloc takes the lowest free object of the most recently
+ * used run with room. A run whose objects are all freed goes back to
+ * the superheap (one is kept in reserve, so that a malloc/free pair at
+ * a run's boundary does not get and return a run each time), where
+ * its pages can then be released. No free object is written to, so
+ * the pages of a run that is mostly free stay untouched, and purge
+ * can hand back to the OS those pages of a run that hold only free
+ * objects.
+ *
+ * Over a superheap whose memory can be aliased (MemfdHeap), mesh
+ * also frees runs that are sparse but never empty, as Mesh does
+ * (Powers et al., PLDI 2019): two runs whose allocated objects do not
+ * overlap are merged by copying one's objects into the other at the
+ * same offsets, and then pointing the first run's pages at the
+ * other's, so that every pointer into either stays good.
+ *
+ * @param ObjectSize The size of every object.
+ * @param PageRunSize The size of each run (a power of two).
+ * @param SuperHeap The source of runs; it must have memalign.
+ */
+
+namespace HL {
+
+  template <size_t ObjectSize, size_t PageRunSize, class SuperHeap>
+  class SlabHeap : public SuperHeap {
+  private:
+
+    enum { BitsPerWord = sizeof(unsigned long) * 8 };
+    enum { MaxObjects = PageRunSize / ObjectSize };
+    enum { BitmapWords = (MaxObjects + BitsPerWord - 1) / BitsPerWord };
+
+    /// Purge releases pages in groups, one bit each in a run.
+    enum { GroupSize = ((size_t) PageRunSize / BitsPerWord > (size_t) MmapWrapper::Size)
+	   ? (size_t) PageRunSize / BitsPerWord : (size_t) MmapWrapper::Size };
+    enum { Groups = (PageRunSize + GroupSize - 1) / GroupSize };
+
+    class Run {
+    public:
+      Run * prev;
+      Run * next;
+      int nFree;
+      /// The page groups purge has released.
+      unsigned long releasedGroups;
+      unsigned long freeMap[BitmapWords];
+    };
+
+    enum { HeaderAlignment = 16 };
+    enum { HeaderSize = (sizeof(Run) + HeaderAlignment - 1) & ~(HeaderAlignment - 1) };
+
+  public:
+
+    /// How many objects one run holds.
+    enum { ObjectsPerRun = (PageRunSize - HeaderSize) / ObjectSize };
+
+    enum { Alignment = gcd<(int) ObjectSize, (int) HeaderAlignment>::value };
+
+    SlabHeap (void)
+      : _partial (NULL),
+	_full (NULL),
+	_spare (NULL),
+	_runs (0)
+    {
+      sassert<((PageRunSize & (PageRunSize - 1)) == 0)
+	&& (ObjectSize > 0)
+	&& (ObjectsPerRun > 0)> verifyParameters;
+      verifyParameters = verifyParameters;
+    }
+
+    ~SlabHeap (void) {
+      clear();
+    }
+
+    inline void * malloc (size_t sz) {
+      if (sz > ObjectSize) {
+	return NULL;
+      }
+      Run * r = _partial;
+      if (r == NULL) {
+	r = newRun();
+	if (r == NULL) {
+	  return NULL;
+	}
+      }
+      // Take the lowest free object.
+      int w = 0;
+      while (r->freeMap[w] == 0) {
+	w++;
+	assert (w < BitmapWords);
+      }
+      const int bit = BitOps::lowestBit (r->freeMap[w]);
+      r->freeMap[w] &= ~(1UL << bit);
+      if (--r->nFree == 0) {
+	unlink (_partial, r);
+	push (_full, r);
+      }
+      void * ptr = objectAt (r, w * BitsPerWord + bit);
+      if (r->releasedGroups != 0) {
+	// The object's pages come back from the OS as it is used.
+	const size_t first = ((char *) ptr - (char *) r) / GroupSize;
+	const size_t last = ((char *) ptr + ObjectSize - 1 - (char *) r) / GroupSize;
+	for (size_t g = first; g <= last; g++) {
+	  r->releasedGroups &= ~(1UL << g);
+	}
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      Run * r = getRun (ptr);
+      const size_t index = ((char *) ptr - ((char *) r + HeaderSize)) / ObjectSize;
+      assert ((char *) ptr == (char *) objectAt (r, (int) index));
+      assert (index < (size_t) ObjectsPerRun);
+      const unsigned long mask = 1UL << (index % BitsPerWord);
+      assert ((r->freeMap[index / BitsPerWord] & mask) == 0);
+      r->freeMap[index / BitsPerWord] |= mask;
+      const bool wasFull = (r->nFree++ == 0);
+      if (r->nFree == ObjectsPerRun) {
+	// The run is empty.
+	unlink (wasFull ? _full : _partial, r);
+	retire (r);
+      } else if (wasFull) {
+	unlink (_full, r);
+	push (_partial, r);
+      }
+    }
+
+    inline size_t getSize (void *) const {
+      return ObjectSize;
+    }
+
+    /// The allocated object that ptr (from this heap, but not
+    /// necessarily an object's start) falls in: [start, end). Returns
+    /// false if ptr is in a run's header or tail, or in a free object.
+    static bool getBounds (const void * ptr, void *& start, void *& end) {
+      Run * r = getRun ((void *) ptr);
+      const size_t offset = (const char *) ptr - (char *) r;
+      if (offset < (size_t) HeaderSize) {
+	return false;
+      }
+      const size_t index = (offset - HeaderSize) / ObjectSize;
+      if ((index >= (size_t) ObjectsPerRun)
+	  || (r->freeMap[index / BitsPerWord] & (1UL << (index % BitsPerWord)))) {
+	return false;
+      }
+      start = objectAt (r, (int) index);
+      end = (char *) start + ObjectSize;
+      return true;
+    }
+
+    /// Return every run to the superheap.
+    void clear (void) {
+      freeRuns (_partial);
+      freeRuns (_full);
+      if (_spare != NULL) {
+	SuperHeap::free (_spare);
+	_spare = NULL;
+      }
+      _partial = _full = NULL;
+      _runs = 0;
+    }
+
+    /// Give back the spare run (empty runs are already gone), then
+    /// release the pages of partial runs that hold only free objects,
+    /// then purge the superheap.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      if (_spare != NULL) {
+	SuperHeap::free (_spare);
+	_spare = NULL;
+	_runs--;
+	released = PageRunSize;
+      }
+      for (Run * r = _partial; (r != NULL) && (released < budget); r = r->next) {
+	released += releaseGroups (r);
+      }
+      if (released < budget) {
+	released += SuperHeap::purge (budget - released);
+      }
+      return released;
+    }
+
+    /// Merge pairs of partial runs whose allocated objects do not
+    /// overlap, each onto one run's pages, returning how many bytes
+    /// that frees. Each run is tried against the next MeshProbes
+    /// runs. Runs of few objects (a page or so) mesh far more often
+    /// than big ones. Only superheaps with alias (such as MemfdHeap)
+    /// have what this needs. Nothing may touch the objects meanwhile:
+    /// callers whose objects other threads can reach must stop them
+    /// first.
+    size_t mesh (size_t budget) {
+      size_t released = 0;
+      Run * r = _partial;
+      while ((r != NULL) && (released < budget)) {
+	Run * s = findMate (r);
+	if ((s == NULL) || !meshInto (r, s)) {
+	  r = r->next;
+	  continue;
+	}
+	released += PageRunSize;
+	if (r->nFree == 0) {
+	  Run * next = r->next;
+	  unlink (_partial, r);
+	  push (_full, r);
+	  r = next;
+	}
+      }
+      return released;
+    }
+
+    /// Report the runs and their free objects.
+    void walk (HeapWalker& w) {
+      HeapUsage u;
+      u.heldBytes = _runs * PageRunSize;
+      for (Run * r = _partial; r != NULL; r = r->next) {
+	u.freeObjects += r->nFree;
+      }
+      u.freeBytes = u.freeObjects * ObjectSize;
+      if (_spare != NULL) {
+	u.freeBytes += PageRunSize;
+      }
+      // Each run's header and tail.
+      u.wastedBytes = ((_spare != NULL) ? (_runs - 1) : _runs) * (PageRunSize - ObjectsPerRun * ObjectSize);
+      w.visit ("SlabHeap", u);
+      SuperHeap::walk (w);
+    }
+
+  private:
+
+    static inline Run * getRun (void * ptr) {
+      return (Run *) ((size_t) ptr & ~(PageRunSize - 1));
+    }
+
+    static inline void * objectAt (Run * r, int index) {
+      return (char *) r + HeaderSize + (size_t) index * ObjectSize;
+    }
+
+    /// The spare run, or a fresh one, put on the partial list.
+    NO_INLINE Run * newRun (void) {
+      Run * r = _spare;
+      if (r != NULL) {
+	_spare = NULL;
+      } else {
+	r = (Run *) SuperHeap::memalign (PageRunSize, PageRunSize);
+	if (r == NULL) {
+	  return NULL;
+	}
+	assert (getRun (r) == r);
+	_runs++;
+      }
+      // Every object is free.
+      for (int i = 0; i < BitmapWords; i++) {
+	r->freeMap[i] = 0;
+      }
+      for (int i = 0; i < ObjectsPerRun / BitsPerWord; i++) {
+	r->freeMap[i] = ~0UL;
+      }
+      if (ObjectsPerRun % BitsPerWord != 0) {
+	r->freeMap[ObjectsPerRun / BitsPerWord] = (1UL << (ObjectsPerRun % BitsPerWord)) - 1;
+      }
+      r->nFree = ObjectsPerRun;
+      r->releasedGroups = 0;
+      push (_partial, r);
+      return r;
+    }
+
+    /// Release r's page groups that hold only free objects (but not
+    /// the header's), returning how many bytes went.
+    size_t releaseGroups (Run * r) {
+      size_t released = 0;
+      for (int g = HeaderSize / GroupSize + 1; g < Groups; g++) {
+	if (r->releasedGroups & (1UL << g)) {
+	  continue;
+	}
+	const size_t start = (size_t) g * GroupSize;
+	const size_t end = ((size_t) (g + 1) * GroupSize < (size_t) PageRunSize)
+	  ? (size_t) (g + 1) * GroupSize : (size_t) PageRunSize;
+	// The objects that overlap the group.
+	const size_t first = (start - HeaderSize) / ObjectSize;
+	size_t last = (end - 1 - HeaderSize) / ObjectSize;
+	if (last >= (size_t) ObjectsPerRun) {
+	  last = ObjectsPerRun - 1;
+	}
+	bool allFree = true;
+	for (size_t i = first; (i <= last) && allFree; i++) {
+	  allFree = ((r->freeMap[i / BitsPerWord] >> (i % BitsPerWord)) & 1);
+	}
+	if (allFree) {
+	  released += MmapWrapper::release ((char *) r + start, end - start);
+	  r->releasedGroups |= (1UL << g);
+	}
+      }
+      return released;
+    }
+
+    enum { MeshProbes = 64 };
+
+    /// Which of a run's free-map bits stand for objects.
+    static inline unsigned long objectBits (int w) {
+      if ((w + 1) * BitsPerWord <= ObjectsPerRun) {
+	return ~0UL;
+      }
+      return (1UL << (ObjectsPerRun % BitsPerWord)) - 1;
+    }
+
+    /// A later partial run with no object where r has one, or NULL.
+    Run * findMate (Run * r) {
+      int probes = MeshProbes;
+      for (Run * s = r->next; (s != NULL) && (probes-- > 0); s = s->next) {
+	int w = 0;
+	while ((w < BitmapWords) && ((r->freeMap[w] | s->freeMap[w]) == objectBits (w))) {
+	  w++;
+	}
+	if (w == BitmapWords) {
+	  return s;
+	}
+      }
+      return NULL;
+    }
+
+    /// Copy s's objects into r, and give s's pages back, leaving its
+    /// address range on r's pages (including its header, so that a
+    /// free through s finds r).
+    bool meshInto (Run * r, Run * s) {
+      const int copied = ObjectsPerRun - s->nFree;
+      unsigned long freeMap[BitmapWords];
+      for (int w = 0; w < BitmapWords; w++) {
+	freeMap[w] = r->freeMap[w];
+	unsigned long used = ~s->freeMap[w] & objectBits (w);
+	while (used != 0) {
+	  const int bit = BitOps::lowestBit (used);
+	  used &= used - 1;
+	  const int index = w * BitsPerWord + bit;
+	  memcpy (objectAt (r, index), objectAt (s, index), ObjectSize);
+	  r->freeMap[w] &= ~(1UL << bit);
+	}
+      }
+      unlink (_partial, s);
+      if (!SuperHeap::alias (s, r)) {
+	// Both runs stay as they were.
+	for (int w = 0; w < BitmapWords; w++) {
+	  r->freeMap[w] = freeMap[w];
+	}
+	push (_partial, s);
+	return false;
+      }
+      r->nFree -= copied;
+      // The copies brought back whatever pages purge had released.
+      r->releasedGroups = 0;
+      _runs--;
+      return true;
+    }
+
+    /// Keep an empty run as the spare, or give it back.
+    void retire (Run * r) {
+      if (_spare == NULL) {
+	_spare = r;
+      } else {
+	_runs--;
+	SuperHeap::free (r);
+      }
+    }
+
+    void freeRuns (Run * r) {
+      while (r != NULL) {
+	Run * next = r->next;
+	SuperHeap::free (r);
+	r = next;
+      }
+    }
+
+    static inline void push (Run *& head, Run * r) {
+      r->prev = NULL;
+      r->next = head;
+      if (head != NULL) {
+	head->prev = r;
+      }
+      head = r;
+    }
+
+    static inline void unlink (Run *& head, Run * r) {
+      if (r->prev != NULL) {
+	r->prev->next = r->next;
+      } else {
+	head = r->next;
+      }
+      if (r->next != NULL) {
+	r->next->prev = r->prev;
+      }
+    }
+
+    /// Runs with at least one free and one allocated object (or, at
+    /// the head, a fresh one).
+    Run * _partial;
+
+    /// Runs with no free object.
+    Run * _full;
+
+    /// One empty run, held back from the superheap.
+    Run * _spare;
+
+    /// How many runs this heap holds, including the spare.
+    size_t _runs;
+  };
+
+}
+
+#endif
@@ -1,5 +1,7 @@
 #include "hybridheap.h"
+#include "lifetimeheap.h"
 #include "segheap.h"
 #include "strictsegheap.h"
 #include "tryheap.h"
+#include "twolevelsegheap.h"
 
@@ -62,6 +62,48 @@ namespace HL {
       return ptr;
     }
   
+    /// Zero-filled memory; big objects come from BigHeap, which
+    /// can often hand out fresh memory without clearing it.
+    inline void * mallocZeroed (size_t sz) {
+      if (sz <= BigSize) {
+	return SmallHeap::mallocZeroed (sz);
+      } else {
+	return bm.mallocZeroed (sz);
+      }
+    }
+
+    inline void * memalign (size_t alignment, size_t sz) {
+      if (sz <= BigSize) {
+	return SmallHeap::memalign (alignment, sz);
+      } else {
+	return bm.memalign (alignment, sz);
+      }
+    }
+
+    /// Objects can only be resized without crossing BigSize.
+    inline bool resize (void * ptr, size_t sz) {
+      const bool isSmall = (SmallHeap::getSize(ptr) <= BigSize);
+      if (isSmall != (sz <= BigSize)) {
+	return false;
+      }
+      if (isSmall) {
+	return SmallHeap::resize (ptr, sz);
+      } else {
+	return bm.resize (ptr, sz);
+      }
+    }
+
+    /// A small object can be no bigger than BigSize, or free would
+    /// hand it to BigHeap.
+    inline size_t goodSize (size_t sz) {
+      if (sz <= BigSize) {
+	const size_t good = SmallHeap::goodSize (sz);
+	return (good <= BigSize) ? good : sz;
+      } else {
+	return bm.goodSize (sz);
+      }
+    }
+
     inline void free (void * ptr) {
       if (SmallHeap::getSize(ptr) <= BigSize) {
 	SmallHeap::free (ptr);
@@ -74,6 +116,14 @@ namespace HL {
       bm.clear();
       SmallHeap::clear();
     }
+
+    inline size_t purge (size_t budget) {
+      size_t released = SmallHeap::purge (budget);
+      if (released < budget) {
+	released += bm.purge (budget - released);
+      }
+      return released;
+    }
   
 
   private:
@@ -0,0 +1,356 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_LIFETIMEHEAP_H
+#define HL_LIFETIMEHEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "locks/spinlock.h"
+#include "utility/bitops.h"
+#include "utility/gcd.h"
+#include "utility/heapwalk.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class LifetimeHeap
+ * @brief Sends objects predicted to live long to a heap of their own.
+ *
+ * Objects that die young and objects that live on, on the same pages,
+ * keep each other's pages from ever being freed. Each malloc here
+ * predicts its object's lifetime from its allocation site (a hash of
+ * the last few return addresses and the size's power of two) and
+ * takes objects predicted to live long from LongHeap, and the rest
+ * from ShortHeap. A site's prediction is a saturating counter, learned
+ * from sampled objects: one in about every SampleBytes bytes is timed,
+ * and counts as long-lived once it has lived LongMillis milliseconds
+ * (when it is freed, or when a sweep finds it still live), and as
+ * short-lived if it is freed before. New sites start out short.
+ *
+ * A malloc costs a short walk of frame pointers and a table lookup;
+ * build the program with -fno-omit-frame-pointer (otherwise every
+ * object seems to come from a handful of sites). A free asks LongHeap
+ * whose object it is, so LongHeap must have isValid (as a heap over
+ * its own ReservedHeap or MemfdHeap does), and probes a table of
+ * sampled objects while any are live. The counts are in the
+ * StatsRegistry as "lifetime".
+ *
+ * @param ShortHeap The heap for objects predicted to die young.
+ * @param LongHeap The heap for the others; it must have isValid.
+ * @param LongMillis How long an object lives to count as long-lived.
+ * @param SampleBytes The mean bytes allocated between samples.
+ */
+
+namespace HL {
+
+  template <class ShortHeap,
+	    class LongHeap,
+	    int LongMillis = 1000,
+	    size_t SampleBytes = 256 * 1024>
+  class LifetimeHeap : public ShortHeap {
+  public:
+
+    enum { Alignment = gcd<(int) ShortHeap::Alignment, (int) LongHeap::Alignment>::value };
+
+    enum { MaxSites = 4096 };
+    enum { MaxSamples = 4096 };
+
+    LifetimeHeap (void)
+      : _samples (NULL),
+	_liveSamples (0),
+	_sampled (0),
+	_short (0),
+	_long (0),
+	_dropped (0),
+	_stats ("lifetime", this)
+    {
+      for (int i = 0; i < MaxSites; i++) {
+	_sites[i] = 0;
+      }
+    }
+
+    inline void * malloc (size_t sz) {
+      const int site = getSite (sz);
+      void * ptr;
+      if (_sites[site] > 0) {
+	ptr = _longHeap.malloc (sz);
+      } else {
+	ptr = ShortHeap::malloc (sz);
+      }
+      if (ptr != NULL) {
+	ThreadState& t = getThreadState();
+	t.left -= (long long) sz;
+	if (t.left < 0) {
+	  sample (t, ptr, site);
+	}
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      if (_liveSamples > 0) {
+	unsample (ptr);
+      }
+      if (_longHeap.isValid (ptr)) {
+	_longHeap.free (ptr);
+      } else {
+	ShortHeap::free (ptr);
+      }
+    }
+
+    inline size_t getSize (void * ptr) {
+      if (_longHeap.isValid (ptr)) {
+	return _longHeap.getSize (ptr);
+      }
+      return ShortHeap::getSize (ptr);
+    }
+
+    inline size_t purge (size_t budget) {
+      size_t released = ShortHeap::purge (budget);
+      if (released < budget) {
+	released += _longHeap.purge (budget - released);
+      }
+      return released;
+    }
+
+    void walk (HeapWalker& w) {
+      ShortHeap::walk (w);
+      _longHeap.walk (w);
+    }
+
+    /// Whether objects from this many bytes at the calling site would
+    /// now come from LongHeap.
+    NO_INLINE bool predictsLong (size_t sz) {
+      return (_sites[getSite (sz)] > 0);
+    }
+
+    void writeStats (StatsWriter& w) {
+      int longSites = 0;
+      for (int i = 0; i < MaxSites; i++) {
+	longSites += (_sites[i] > 0);
+      }
+      w.field ("long_millis", (unsigned long) LongMillis);
+      w.field ("samples", _sampled);
+      w.field ("short_lived", _short);
+      w.field ("long_lived", _long);
+      w.field ("dropped", _dropped);
+      w.field ("long_sites", (unsigned long) longSites);
+    }
+
+  private:
+
+    /// How many frames a site's hash takes in.
+    enum { SiteDepth = 4 };
+
+    /// A counter's range: this many long-lived samples in a row make a
+    /// site long-lived, and as many short-lived ones make it short.
+    enum { MaxCount = 3 };
+
+    /// Sweep the samples for long-lived ones every so many samples.
+    enum { SweepInterval = 256 };
+
+    struct ThreadState {
+      long long left;		// bytes until the next sample
+      uint64_t rng;		// 0 until the thread's first malloc
+    };
+
+    struct Sample {
+      void * volatile ptr;	// NULL for an empty slot
+      int site;
+      bool counted;		// already counted as long-lived
+      unsigned long birth;	// in milliseconds
+    };
+
+    static inline ThreadState& getThreadState (void) {
+#if defined(_WIN32)
+      static __declspec(thread) ThreadState t;
+#else
+      static __thread ThreadState t;
+#endif
+      return t;
+    }
+
+    /// The site of a malloc for sz bytes made by our caller's caller.
+    static inline int getSite (size_t sz) {
+      uint64_t h = (uint64_t) BitOps::highestBit (sz | 1);
+#if defined(__GNUC__) && !defined(_WIN32)
+      void ** fp = (void **) __builtin_frame_address (0);
+      for (int d = 0; (fp != NULL) && (d < SiteDepth); d++) {
+	h = (h ^ (uint64_t) (size_t) fp[1]) * 0x100000001b3ULL;
+	// As in SampleHeap: stop where the chain looks wrong.
+	void ** next = (void **) fp[0];
+	if ((next <= fp) ||
+	    ((char *) next - (char *) fp > 1024 * 1024) ||
+	    (((size_t) next & (sizeof(void *) - 1)) != 0)) {
+	  break;
+	}
+	fp = next;
+      }
+#endif
+      return (int) ((h * 0x9e3779b97f4a7c15ULL) >> 52) & (MaxSites - 1);
+    }
+
+    static inline unsigned long now (void) {
+#if defined(_WIN32)
+      return (unsigned long) GetTickCount();
+#elif defined(CLOCK_MONOTONIC_COARSE)
+      struct timespec ts;
+      clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+      return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+      struct timespec ts;
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+      return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+    }
+
+    // xorshift64*, then a gap uniform in [1, 2 * SampleBytes].
+    static inline long long nextGap (ThreadState& t) {
+      t.rng ^= t.rng >> 12;
+      t.rng ^= t.rng << 25;
+      t.rng ^= t.rng >> 27;
+      return (long long) (((t.rng * 2685821657736338717ULL) >> 11) % (2 * (uint64_t) SampleBytes)) + 1;
+    }
+
+    static inline int sampleSlot (void * ptr) {
+      return (int) ((((uint64_t) (size_t) ptr >> 4) * 0x9e3779b97f4a7c15ULL) >> 48) & (MaxSamples - 1);
+    }
+
+    /// Nudge a site's counter toward long- or short-lived (under the
+    /// lock; malloc reads the counters without it).
+    inline void learn (int site, bool isLong) {
+      const int c = _sites[site];
+      if (isLong) {
+	_long++;
+	if (c < MaxCount) {
+	  _sites[site] = (signed char) (c + 1);
+	}
+      } else {
+	_short++;
+	if (c > -MaxCount) {
+	  _sites[site] = (signed char) (c - 1);
+	}
+      }
+    }
+
+    NO_INLINE void sample (ThreadState& t, void * ptr, int site) {
+      if (t.rng == 0) {
+	// A new thread: start the clock without a sample.
+	t.rng = ((uint64_t) (size_t) &t * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) time (NULL);
+	if (t.rng == 0) {
+	  t.rng = 1;
+	}
+	t.left = nextGap (t);
+	return;
+      }
+      t.left = nextGap (t);
+      const unsigned long birth = now();
+      _lock.lock();
+      if (_samples == NULL) {
+	_samples = (Sample *) MmapWrapper::map (sizeof(Sample) * MaxSamples);
+	if (_samples == NULL) {
+	  _lock.unlock();
+	  return;
+	}
+      }
+      Sample& s = _samples[sampleSlot (ptr)];
+      if (s.ptr != NULL) {
+	_dropped++;
+      } else {
+	s.site = site;
+	s.counted = false;
+	s.birth = birth;
+	s.ptr = ptr;
+	_liveSamples++;
+      }
+      if (++_sampled % SweepInterval == 0) {
+	sweep (birth);
+      }
+      _lock.unlock();
+    }
+
+    /// Count the samples that have lived long as long-lived.
+    void sweep (unsigned long time) {
+      for (int i = 0; i < MaxSamples; i++) {
+	Sample& s = _samples[i];
+	if ((s.ptr != NULL) && !s.counted && (time - s.birth >= (unsigned long) LongMillis)) {
+	  s.counted = true;
+	  learn (s.site, true);
+	}
+      }
+    }
+
+    inline void unsample (void * ptr) {
+      // Most objects were never sampled: look without the lock first.
+      Sample * samples = _samples;
+      if ((samples == NULL) || (samples[sampleSlot (ptr)].ptr != ptr)) {
+	return;
+      }
+      removeSample (ptr);
+    }
+
+    NO_INLINE void removeSample (void * ptr) {
+      const unsigned long death = now();
+      _lock.lock();
+      Sample& s = _samples[sampleSlot (ptr)];
+      if (s.ptr == ptr) {
+	if (!s.counted) {
+	  learn (s.site, (death - s.birth >= (unsigned long) LongMillis));
+	}
+	s.ptr = NULL;
+	_liveSamples--;
+      }
+      _lock.unlock();
+    }
+
+    LongHeap _longHeap;
+
+    /// Each site's counter: above zero predicts long-lived.
+    volatile signed char _sites[MaxSites];
+
+    Sample * volatile _samples;
+    volatile int _liveSamples;
+    unsigned long _sampled;
+    unsigned long _short;
+    unsigned long _long;
+    unsigned long _dropped;
+    SpinLockType _lock;
+    LayerStats<LifetimeHeap> _stats;
+  };
+
+}
+
+#endif
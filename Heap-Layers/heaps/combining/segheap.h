@@ -58,6 +58,12 @@
 
 #include <assert.h>
 
+#include "utility/bitops.h"
+#include "utility/heaptraits.h"
+#include "utility/heapwalk.h"
+#include "utility/istrue.h"
+#include "utility/probes.h"
+
 namespace HL {
 
   template <int NumBins,
@@ -92,7 +98,7 @@ namespace HL {
       return LittleHeap::getSize (ptr);
     }
 
-    inline void * malloc (const size_t sz) {
+    inline void * malloc (size_t sz) {
       void * ptr = NULL;
       if (sz > maxObjectSize) {
 	goto GET_MEMORY;
@@ -102,40 +108,37 @@ namespace HL {
 	const int sc = ((scFunction) getSizeClass)(sz);
 	assert (sc >= 0);
 	assert (sc < NumBins);
+	// Ask for the whole class, so that goodSize holds and the
+	// object goes back to this class when freed.
+	sz = ((csFunction) getClassMaxSize)(sc);
 	int idx = sc;
-	int block = idx2block (idx);
-	unsigned long map = binmap[block];
-	unsigned long bit = idx2bit (idx);
-    
+
 	for (;;) {
-	  if (bit > map || bit == 0) {
-	    do {
-	      if (++block >= NUM_ULONGS) {
-		goto GET_MEMORY;
-		// return bigheap.malloc (sz);
-	      }
-	    } while ( (map = binmap[block]) == 0);
-
-	    idx = block << SHIFTS_PER_ULONG;
-	    bit = 1;
+	  // Find the first marked bin at or past idx: mask off the bins
+	  // below it in its word, skip empty words, and take the lowest
+	  // bit of the first non-empty one.
+	  int block = idx >> SHIFTS_PER_ULONG;
+	  if (block >= NUM_ULONGS) {
+	    goto GET_MEMORY;
 	  }
-	
-	  while ((bit & map) == 0) {
-	    bit <<= 1;
-	    assert(bit != 0);
-	    idx++;
+	  unsigned long map = binmap[block] & ~(idx2bit (idx) - 1);
+	  while (map == 0) {
+	    if (++block >= NUM_ULONGS) {
+	      goto GET_MEMORY;
+	    }
+	    map = binmap[block];
 	  }
-      
+	  idx = (block << SHIFTS_PER_ULONG) + BitOps::lowestBit (map);
+
 	  assert (idx < NumBins);
 	  ptr = myLittleHeap[idx].malloc (sz);
-      
-	  if (ptr == NULL) {
-	    binmap[block] = map &= ~bit; // Write through
-	    idx++;
-	    bit <<= 1;
-	  } else {
+
+	  if (ptr != NULL) {
 	    return ptr;
 	  }
+	  // The bin was empty after all.
+	  unmark_bin (idx);
+	  idx++;
 	}
       }
 
@@ -143,16 +146,75 @@ namespace HL {
       if (ptr == NULL) {
 	// There was no free memory in any of the bins.
 	// Get some memory.
+	HL_PROBE1 (segheap_refill_start, sz);
 	ptr = bigheap.malloc (sz);
+	HL_PROBE2 (segheap_refill_done, sz, ptr);
       }
     
       return ptr;
     }
 
 
+    /**
+     * Use the smallest size class whose size is a multiple of the
+     * alignment (with power-of-two classes, that is the usual class),
+     * and reuse a free object of that class if it happens to be
+     * aligned. Otherwise, take an object of a class with room for the
+     * alignment as well, and have the little heap slide it up to an
+     * aligned address, header and all (see SizeHeap::memalign); it
+     * goes back to a smaller class when freed. Little heaps without
+     * memalign keep no header (as PageMapHeap), so the big heap's
+     * aligned objects are theirs to free.
+     */
+    inline void * memalign (size_t alignment, size_t sz) {
+      if (sz <= maxObjectSize) {
+	int sc = ((scFunction) getSizeClass)(sz);
+	while ((sc < NumBins) && (((csFunction) getClassMaxSize)(sc) % alignment != 0)) {
+	  sc++;
+	}
+	if (sc < NumBins) {
+	  const size_t classSize = ((csFunction) getClassMaxSize)(sc);
+	  void * ptr = myLittleHeap[sc].malloc (classSize);
+	  if (ptr != NULL) {
+	    if ((size_t) ptr % alignment == 0) {
+	      return ptr;
+	    }
+	    myLittleHeap[sc].free (ptr);
+	  }
+	}
+	if (alignment <= maxObjectSize - sz) {
+	  sc = ((scFunction) getSizeClass)(sz + alignment);
+	  return slideMemalign (sc, alignment, sz, IsTrue<(bool) HasMemalign<LittleHeap>::value>());
+	}
+      }
+      return bigheap.memalign (alignment, sz);
+    }
+
+    /// The size malloc (sz) makes usable: that of its size class,
+    /// or, for big objects, what the big heap says.
+    inline size_t goodSize (size_t sz) {
+      if (sz > maxObjectSize) {
+	return bigheap.goodSize (sz);
+      }
+      return ((csFunction) getClassMaxSize)(((scFunction) getSizeClass)(sz));
+    }
+
     inline void free (void * ptr) {
-      // printf ("Free: %x (%d bytes)\n", ptr, getSize(ptr));
-      const size_t objectSize = getSize(ptr); // was bigheap.getSize(ptr)
+      free (ptr, getSize (ptr)); // was bigheap.getSize(ptr)
+    }
+
+    /// The size-passing protocol (see SizePassingHeap): the size
+    /// picks the size class, with no getSize. Big objects go back to
+    /// the big heap with a plain free, since its own sized free (if
+    /// any) may want another size.
+    inline void * mallocSized (size_t sz, size_t * actual) {
+      void * ptr = malloc (sz);
+      *actual = (ptr != NULL) ? getSize (ptr) : 0;
+      return ptr;
+    }
+
+    inline void free (void * ptr, size_t objectSize) {
+      assert (objectSize == getSize (ptr));
       if (objectSize > maxObjectSize) {
 	// printf ("free up! (size class = %d)\n", objectSizeClass);
 	bigheap.free (ptr);
@@ -180,6 +242,34 @@ namespace HL {
     }
 
 
+    /// Walk each bin that holds memory, then the big heap.
+    void walk (HeapWalker& w) {
+      w.enter ("SegHeap", -1);
+      for (int i = 0; i < NumBins; i++) {
+	w.enter ("bin", i);
+	myLittleHeap[i].walk (w);
+	w.leave();
+      }
+      w.enter ("big", -1);
+      bigheap.walk (w);
+      w.leave();
+      w.leave();
+    }
+
+    /// Purge each bin, then the big heap. Bins that purge to empty
+    /// keep their bits until malloc finds them empty.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      for (int i = 0; (i < NumBins) && (released < budget); i++) {
+	released += myLittleHeap[i].purge (budget - released);
+      }
+      memoryHeld -= (released < memoryHeld) ? released : memoryHeld;
+      if (released < budget) {
+	released += bigheap.purge (budget - released);
+      }
+      return released;
+    }
+
     void clear (void) {
       int i;
       for (i = 0; i < NumBins; i++) {
@@ -213,6 +303,16 @@ namespace HL {
       return bit;
     }
 
+    /// An object of class sc, slid up to alignment by its little heap.
+    inline void * slideMemalign (int sc, size_t alignment, size_t, IsTrue<true>) {
+      const size_t classSize = ((csFunction) getClassMaxSize)(sc);
+      return myLittleHeap[sc].memalign (alignment, classSize - alignment);
+    }
+
+    inline void * slideMemalign (int, size_t alignment, size_t sz, IsTrue<false>) {
+      return bigheap.memalign (alignment, sz);
+    }
+
 
   protected:
 
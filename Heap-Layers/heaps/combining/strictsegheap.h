@@ -92,12 +92,14 @@ namespace HL {
      * (don't look in every small heap, as in SegHeap).
      */
 
-    inline void * malloc (const size_t sz) {
+    inline void * malloc (size_t sz) {
       void * ptr = NULL;
       if (sz <= SuperHeap::maxObjectSize) {
 	const int sizeClass = ((scFunction) getSizeClass) (sz);
 	assert (sizeClass >= 0);
 	assert (sizeClass < NumBins);
+	// As in SegHeap, the whole class.
+	sz = ((csFunction) getClassMaxSize)(sizeClass);
 	ptr = SuperHeap::myLittleHeap[sizeClass].malloc (sz);
       }
       if (!ptr) {
@@ -107,7 +109,18 @@ namespace HL {
     }
 
     inline void free (void * ptr) {
-      const size_t objectSize = SuperHeap::getSize(ptr);
+      free (ptr, SuperHeap::getSize (ptr));
+    }
+
+    /// The size-passing protocol (see SizePassingHeap), as in SegHeap.
+    inline void * mallocSized (size_t sz, size_t * actual) {
+      void * ptr = malloc (sz);
+      *actual = (ptr != NULL) ? SuperHeap::getSize (ptr) : 0;
+      return ptr;
+    }
+
+    inline void free (void * ptr, size_t objectSize) {
+      assert (objectSize == SuperHeap::getSize (ptr));
       if (objectSize > SuperHeap::maxObjectSize) {
 	SuperHeap::bigheap.free (ptr);
       } else {
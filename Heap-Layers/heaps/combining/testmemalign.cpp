@@ -0,0 +1,54 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "heaplayers.h"
+
+using namespace HL;
+
+// Aligned objects from SegHeap keep the header its little heaps read,
+// so that getSize and free work on them as on any other.
+
+typedef KingsleyHeap<SizeHeap<FreelistHeap<BumpAlloc<65536, MmapHeap> > >, MmapHeap> FreelistKingsley;
+
+typedef KingsleyHeap<SizeHeap<FreelistHeap<ZoneHeap<MmapHeap, 65536> > >,
+		     SizeHeap<UniqueHeap<ZoneHeap<MmapHeap, 65536> > > > ZoneKingsley;
+
+template <class Heap>
+static void
+test (const char * name)
+{
+  static Heap heap;
+  void * ptrs[64];
+  for (size_t alignment = 16; alignment <= 4096; alignment *= 2) {
+    for (size_t sz = 1; sz <= 3000; sz = sz * 3 + 1) {
+      for (int i = 0; i < 64; i++) {
+	ptrs[i] = heap.memalign (alignment, sz);
+	assert (ptrs[i] != NULL);
+	assert ((size_t) ptrs[i] % alignment == 0);
+	assert (heap.getSize (ptrs[i]) >= sz);
+	memset (ptrs[i], 0xab, sz);
+      }
+      for (int i = 0; i < 64; i++) {
+	heap.free (ptrs[i]);
+      }
+      // The freed objects come back from malloc whole.
+      for (int i = 0; i < 64; i++) {
+	ptrs[i] = heap.malloc (sz);
+	assert (heap.getSize (ptrs[i]) >= sz);
+	memset (ptrs[i], 0xcd, sz);
+      }
+      for (int i = 0; i < 64; i++) {
+	heap.free (ptrs[i]);
+      }
+    }
+  }
+  printf ("%s: ok\n", name);
+}
+
+int
+main (int argc, char * argv[])
+{
+  test<FreelistKingsley> ("SizeHeap<FreelistHeap<BumpAlloc> > bins");
+  test<ZoneKingsley> ("SizeHeap<UniqueHeap<ZoneHeap> > big heap");
+  return 0;
+}
@@ -0,0 +1,251 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/**
+ * @file twolevelsegheap.h
+ * @brief Definition of TwoLevelSegHeap.
+ */
+
+#ifndef HL_TWOLEVELSEGHEAP_H
+#define HL_TWOLEVELSEGHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "utility/bitops.h"
+#include "utility/heapwalk.h"
+#include "utility/sassert.h"
+
+/**
+ * @class TwoLevelSegHeap
+ * @brief Segregated fits indexed by a two-level bitmap, as in TLSF.
+ *
+ * Free objects are binned first by their power of two and then by
+ * 2^SLBits equal steps within it (below 2^(SLBits+3) bytes, by 8-byte
+ * steps). malloc rounds the request up to the next step, so that any
+ * object in the bin it lands on fits, and finds the first non-empty
+ * bin at or after that one with two bit scans, whatever the number of
+ * free objects or how fragmented they are. This makes it a drop-in
+ * for SegHeap under a CoalesceHeap, where the remainders of splits
+ * and coalesced neighbors come and go from the bins all the time.
+ *
+ * A bin that empties through remove (rather than malloc) keeps its
+ * bit until the next malloc that looks there finds it empty.
+ *
+ * @param LittleHeap The subheap class (one per bin), with getSize and remove.
+ * @param BigHeap The parent class, used for objects no bin holds.
+ * @param SLBits log2 of the number of bins per power of two.
+ *
+ * @see Masmano et al., "TLSF: a New Dynamic Memory Allocator for
+ * Real-Time Systems", ECRTS 2004.
+ **/
+
+namespace HL {
+
+  template <class LittleHeap,
+	    class BigHeap,
+	    int SLBits = 4>
+  class TwoLevelSegHeap : public LittleHeap {
+  public:
+
+    inline TwoLevelSegHeap (void)
+      : memoryHeld (0),
+	flBitmap (0)
+    {
+      sassert<(SLBits >= 1) && ((1 << SLBits) <= 32)> verifySLBits;
+      verifySLBits = verifySLBits;
+      for (int i = 0; i < FLCount; i++) {
+	slBitmap[i] = 0;
+      }
+    }
+
+    inline size_t getMemoryHeld (void) const {
+      return memoryHeld;
+    }
+
+    size_t getSize (void * ptr) {
+      return LittleHeap::getSize (ptr);
+    }
+
+    inline void * malloc (const size_t sz) {
+      if (sz <= MaxObjectSize) {
+	int fl, sl;
+	mapping (roundUp (sz), fl, sl);
+	while (fl < FLCount) {
+	  // The first non-empty bin in this row at or past sl, or else
+	  // the first one in the next non-empty row.
+	  unsigned long map = slBitmap[fl] & (~0UL << sl);
+	  if (map == 0) {
+	    const unsigned long rows = flBitmap & (~0UL << (fl + 1));
+	    if (rows == 0) {
+	      break;
+	    }
+	    fl = BitOps::lowestBit (rows);
+	    map = slBitmap[fl];
+	  }
+	  sl = BitOps::lowestBit (map);
+	  void * ptr = bins[fl][sl].malloc (sz);
+	  if (ptr != NULL) {
+	    assert (getSize (ptr) >= sz);
+	    memoryHeld -= getSize (ptr);
+	    return ptr;
+	  }
+	  // The bin was emptied by remove: clear its bit, and go on.
+	  unmarkBin (fl, sl);
+	  if (++sl == SLCount) {
+	    fl++;
+	    sl = 0;
+	  }
+	}
+      }
+      // There was no free memory in any of the bins.
+      return bigheap.malloc (sz);
+    }
+
+    inline void free (void * ptr) {
+      const size_t objectSize = getSize (ptr);
+      if (objectSize > MaxObjectSize) {
+	bigheap.free (ptr);
+	return;
+      }
+      // Bin it by its size rounded down, so that everything in a bin
+      // is at least the bin's size.
+      int fl, sl;
+      mapping (objectSize, fl, sl);
+      bins[fl][sl].free (ptr);
+      markBin (fl, sl);
+      memoryHeld += objectSize;
+    }
+
+    /// Walk each bin that holds memory, then the big heap.
+    void walk (HeapWalker& w) {
+      w.enter ("TwoLevelSegHeap", -1);
+      for (int fl = 0; fl < FLCount; fl++) {
+	for (int sl = 0; sl < SLCount; sl++) {
+	  w.enter ("bin", fl * SLCount + sl);
+	  bins[fl][sl].walk (w);
+	  w.leave();
+	}
+      }
+      w.enter ("big", -1);
+      bigheap.walk (w);
+      w.leave();
+      w.leave();
+    }
+
+    /// Purge each bin, then the big heap. Bins that purge to empty
+    /// keep their bits until malloc finds them empty.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      for (int fl = 0; (fl < FLCount) && (released < budget); fl++) {
+	for (int sl = 0; (sl < SLCount) && (released < budget); sl++) {
+	  released += bins[fl][sl].purge (budget - released);
+	}
+      }
+      memoryHeld -= (released < memoryHeld) ? released : memoryHeld;
+      if (released < budget) {
+	released += bigheap.purge (budget - released);
+      }
+      return released;
+    }
+
+    void clear (void) {
+      for (int fl = 0; fl < FLCount; fl++) {
+	for (int sl = 0; sl < SLCount; sl++) {
+	  bins[fl][sl].clear();
+	}
+	slBitmap[fl] = 0;
+      }
+      flBitmap = 0;
+      bigheap.clear();
+      memoryHeld = 0;
+    }
+
+  private:
+
+    enum { SLCount = 1 << SLBits };
+
+    /// Row 0 holds the sizes below 2^MinFLBits, in 8-byte steps.
+    enum { MinFLBits = SLBits + 3 };
+
+    /// Objects of 2^MaxSizeBits bytes or more go to the big heap.
+    enum { MaxSizeBits = 31 };
+
+    enum { FLCount = MaxSizeBits - MinFLBits + 1 };
+
+    static const size_t MaxObjectSize = ((size_t) 1 << MaxSizeBits) - 1;
+
+    /// The bin of objects of at least sz bytes (and less than the next bin).
+    static inline void mapping (size_t sz, int& fl, int& sl) {
+      if (sz < ((size_t) 1 << MinFLBits)) {
+	fl = 0;
+	sl = (int) (sz >> 3);
+      } else {
+	const int log2 = BitOps::highestBit (sz);
+	fl = log2 - MinFLBits + 1;
+	sl = (int) (sz >> (log2 - SLBits)) - SLCount;
+      }
+      assert (sl >= 0);
+      assert (sl < SLCount);
+    }
+
+    /// The smallest bin size that is at least sz.
+    static inline size_t roundUp (size_t sz) {
+      if (sz < ((size_t) 1 << MinFLBits)) {
+	return (sz + 7) & ~((size_t) 7);
+      }
+      return sz + ((size_t) 1 << (BitOps::highestBit (sz) - SLBits)) - 1;
+    }
+
+    inline void markBin (int fl, int sl) {
+      slBitmap[fl] |= (1UL << sl);
+      flBitmap |= (1UL << fl);
+    }
+
+    inline void unmarkBin (int fl, int sl) {
+      slBitmap[fl] &= ~(1UL << sl);
+      if (slBitmap[fl] == 0) {
+	flBitmap &= ~(1UL << fl);
+      }
+    }
+
+    BigHeap bigheap;
+
+    size_t memoryHeld;
+
+    /// Which rows have a non-empty bin.
+    unsigned long flBitmap;
+
+    /// Which bins in each row are non-empty.
+    unsigned long slBitmap[FLCount];
+
+    // The little heaps.
+    LittleHeap bins[FLCount][SLCount];
+  };
+
+}
+
+#endif
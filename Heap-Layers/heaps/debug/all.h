@@ -1,6 +1,10 @@
+#include "asynclogheap.h"
 #include "checkheap.h"
 #include "debugheap.h"
+#include "guardpageheap.h"
+#include "latencyheap.h"
 #include "logheap.h"
 #include "sanitycheckheap.h"
+#include "shadowcheckheap.h"
 #include "statsheap.h"
 
@@ -0,0 +1,349 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_ASYNCLOGHEAP_H
+#define HL_ASYNCLOGHEAP_H
+
+#if defined(_WIN32)
+#error "This functionality currently is not implemented for Windows."
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "threads/cpuinfo.h"
+#include "utility/traceformat.h"
+#include "wrappers/mmapwrapper.h"
+
+namespace HL {
+
+  /**
+   * @class AsyncLog
+   * @brief A binary log of mallocs and frees that the caller never waits on.
+   *
+   * Every thread appends LogRecords to a ring of its own, with a plain
+   * store and a release store of the tail, and a writer thread (started
+   * by the first record) drains the rings straight to the file with
+   * write(2), about every millisecond. A ring that is full drops the
+   * record and counts it, rather than stall the allocating thread.
+   *
+   * Rings are mapped, not allocated. The ring of a thread that exits is
+   * drained and then handed to the next new thread.
+   */
+
+  template <int RingRecords = 4096>
+  class AsyncLog {
+  public:
+
+    AsyncLog (void)
+      : _fd (-1),
+	_rings (NULL),
+	_writerState (Idle),
+	_dropped (0)
+    {}
+
+    ~AsyncLog (void) {
+      close();
+    }
+
+    void open (const char * fname) {
+      if (_fd >= 0) {
+	return;
+      }
+      _fd = ::open (fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (_fd < 0) {
+	return;
+      }
+      _startTicks = ticks();
+      _startNanos = nanos();
+      LogHeader h;
+      makeHeader (h, 0);
+      write (&h, sizeof(h));
+      getKey();
+    }
+
+    /// Stop the writer, write out what is left, and put the clock rate
+    /// and drop count in the header.
+    void close (void) {
+      if (_fd < 0) {
+	return;
+      }
+      if (__sync_bool_compare_and_swap (&_writerState, Running, Stopping)) {
+	pthread_join (_writer, NULL);
+      }
+      drain();
+      const uint64_t t = ticks() - _startTicks;
+      const uint64_t ns = nanos() - _startNanos;
+      LogHeader h;
+      makeHeader (h, (ns > 0) ? (uint64_t) ((double) t * 1e9 / (double) ns) : 0);
+      ::pwrite (_fd, &h, sizeof(h), 0);
+      ::close (_fd);
+      _fd = -1;
+    }
+
+    /// Append a record for the calling thread.
+    inline void record (int op, void * ptr, size_t sz, void * caller) {
+      if (_fd < 0) {
+	return;
+      }
+      Ring * r = getRing();
+      const size_t tail = r->tail;
+      if (tail - __atomic_load_n (&r->head, __ATOMIC_ACQUIRE) == RingRecords) {
+	__atomic_add_fetch (&_dropped, 1, __ATOMIC_RELAXED);
+	return;
+      }
+      LogRecord& rec = r->records[tail % RingRecords];
+      rec.time = ticks() - _startTicks;
+      rec.ptr = (uint64_t) (size_t) ptr;
+      rec.size = sz;
+      rec.caller = (uint64_t) (size_t) caller;
+      rec.thread = r->thread;
+      rec.op = op;
+      __atomic_store_n (&r->tail, tail + 1, __ATOMIC_RELEASE);
+      if (_writerState == Idle) {
+	startWriter();
+      }
+    }
+
+    unsigned long long getDropped (void) const {
+      return _dropped;
+    }
+
+  private:
+
+    enum { CacheLineSize = 64 };
+    enum { Idle, Starting, Running, Stopping };
+    enum { Free, Owned, Orphaned };
+
+    struct Ring {
+      volatile size_t head;	// the writer's
+      char pad0[CacheLineSize - sizeof(size_t)];
+      volatile size_t tail;	// the owning thread's
+      char pad1[CacheLineSize - sizeof(size_t)];
+      volatile int state;
+      unsigned int thread;
+      Ring * next;
+      LogRecord records[RingRecords];
+    };
+
+    static inline uint64_t ticks (void) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+      unsigned int lo, hi;
+      asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+      return ((uint64_t) hi << 32) | lo;
+#else
+      return nanos();
+#endif
+    }
+
+    static inline uint64_t nanos (void) {
+      struct timespec ts;
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+      return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    void makeHeader (LogHeader& h, uint64_t ticksPerSecond) {
+      memset (&h, 0, sizeof(h));
+      memcpy (h.magic, "HLLOG", 6);
+      h.version = LogHeader::Version;
+      h.recordSize = sizeof(LogRecord);
+      h.ticksPerSecond = ticksPerSecond;
+      h.dropped = _dropped;
+    }
+
+    static pthread_key_t& getKey (void) {
+      static pthread_key_t key;
+      static int r = pthread_key_create (&key, orphanRing);
+      return key;
+    }
+
+    // Called as the owning thread exits: the writer drains the ring
+    // and frees it for reuse.
+    static void orphanRing (void * r) {
+      __atomic_store_n (&((Ring *) r)->state, (int) Orphaned, __ATOMIC_RELEASE);
+    }
+
+    inline Ring * getRing (void) {
+      Ring * r = (Ring *) pthread_getspecific (getKey());
+      if (r == NULL) {
+	r = newRing();
+      }
+      return r;
+    }
+
+    Ring * newRing (void) {
+      Ring * r;
+      for (r = _rings; r != NULL; r = r->next) {
+	if (__sync_bool_compare_and_swap (&r->state, (int) Free, (int) Owned)) {
+	  break;
+	}
+      }
+      if (r == NULL) {
+	r = (Ring *) MmapWrapper::map (sizeof(Ring));
+	r->head = r->tail = 0;
+	r->state = Owned;
+	do {
+	  r->next = _rings;
+	} while (!__sync_bool_compare_and_swap (&_rings, r->next, r));
+      }
+      r->thread = CPUInfo::getThreadId();
+      pthread_setspecific (getKey(), r);
+      return r;
+    }
+
+    void startWriter (void) {
+      if (__sync_bool_compare_and_swap (&_writerState, Idle, Starting)) {
+	// pthread_create may allocate; the state keeps that from
+	// getting back here.
+	if (pthread_create (&_writer, NULL, writer, this) == 0) {
+	  _writerState = Running;
+	} else {
+	  _writerState = Idle;
+	}
+      }
+    }
+
+    static void * writer (void * arg) {
+      AsyncLog * log = (AsyncLog *) arg;
+      struct timespec nap;
+      nap.tv_sec = 0;
+      nap.tv_nsec = 1000000;
+      while (log->_writerState != Stopping) {
+	if (log->drain() == 0) {
+	  nanosleep (&nap, NULL);
+	}
+      }
+      return NULL;
+    }
+
+    /// Write out every ring's records; returns how many there were.
+    size_t drain (void) {
+      size_t total = 0;
+      for (Ring * r = _rings; r != NULL; r = r->next) {
+	const int state = __atomic_load_n (&r->state, __ATOMIC_ACQUIRE);
+	const size_t head = r->head;
+	const size_t tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+	if (head != tail) {
+	  // At most two pieces: up to the end of the ring, then from
+	  // its start.
+	  const size_t first = head % RingRecords;
+	  const size_t n = tail - head;
+	  const size_t upToEnd = (first + n > RingRecords) ? RingRecords - first : n;
+	  write (&r->records[first], upToEnd * sizeof(LogRecord));
+	  write (&r->records[0], (n - upToEnd) * sizeof(LogRecord));
+	  __atomic_store_n (&r->head, tail, __ATOMIC_RELEASE);
+	  total += n;
+	}
+	if (state == Orphaned) {
+	  // Read before the tail, so these are its last records.
+	  r->state = Free;
+	}
+      }
+      return total;
+    }
+
+    void write (const void * buf, size_t len) {
+      const char * p = (const char *) buf;
+      while (len > 0) {
+	const long n = (long) ::write (_fd, p, len);
+	if (n <= 0) {
+	  break;
+	}
+	p += n;
+	len -= n;
+      }
+    }
+
+    int _fd;
+    uint64_t _startTicks;
+    uint64_t _startNanos;
+    Ring * volatile _rings;
+    volatile int _writerState;
+    pthread_t _writer;
+    volatile unsigned long long _dropped;
+  };
+
+
+  /**
+   * @class AsyncLogHeap
+   * @brief Logs mallocs and frees to "log-<Number>.bin", off the allocating thread.
+   *
+   * Like BinaryTraceHeap, but the allocating thread only stores a
+   * record in its own ring (see AsyncLog), so a call costs a few
+   * nanoseconds and never a write(2). With RecordCaller, each record
+   * also holds the return address of the malloc or free.
+   */
+
+  template <class Super, int Number, bool RecordCaller = false>
+  class AsyncLogHeap : public Super {
+  public:
+
+    AsyncLogHeap (void)
+    {
+      char fname[255];
+      sprintf (fname, "log-%d.bin", Number);
+      getLog().open (fname);
+    }
+
+    inline void * malloc (size_t sz) {
+      void * ptr = Super::malloc (sz);
+      if (ptr != NULL) {
+	getLog().record (TraceMalloc, ptr, sz,
+			 RecordCaller ? __builtin_return_address (0) : NULL);
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr != NULL) {
+	getLog().record (TraceFree, ptr, 0,
+			 RecordCaller ? __builtin_return_address (0) : NULL);
+      }
+      Super::free (ptr);
+    }
+
+    /// Records lost because a thread's ring was full.
+    unsigned long long getDropped (void) {
+      return getLog().getDropped();
+    }
+
+  private:
+
+    static AsyncLog<>& getLog (void) {
+      static AsyncLog<> log;
+      return log;
+    }
+
+  };
+
+}
+
+#endif
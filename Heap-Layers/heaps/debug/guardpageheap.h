@@ -0,0 +1,296 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_GUARDPAGEHEAP_H
+#define HL_GUARDPAGEHEAP_H
+
+#if defined(_WIN32)
+#error "This functionality currently is not implemented for Windows."
+#endif
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "locks/spinlock.h"
+#include "utility/sassert.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/**
+ * @class GuardPageHeap
+ * @brief Puts sampled objects against guard pages, Electric Fence style.
+ *
+ * About one malloc in SampleRate (per thread, at random) of at most
+ * SlotPages pages goes to a slot of its own in a pool reserved up
+ * front: the object ends where the slot's PROT_NONE guard page begins,
+ * so running off its end faults at the faulting instruction. Freeing it
+ * makes the whole slot PROT_NONE and puts it at the back of a
+ * quarantine ring of QuarantineSlots, so uses after the free fault too
+ * until the slot comes out of the ring to be used again. A second free
+ * of a slot aborts.
+ *
+ * Everything else goes to SuperHeap untouched, and a free costs one
+ * range check, so this can stay on (as in GWP-ASan). If a fault lands
+ * in the pool, a SIGSEGV handler prints what it was -- overflow or use
+ * after free, which object and its size -- and then lets the fault take
+ * its usual course. Overruns smaller than the alignment padding at the
+ * object's end, and underruns, go unnoticed. Place this over DebugHeap
+ * to check the other objects' canaries as well.
+ */
+
+namespace HL {
+
+  template <class SuperHeap,
+	    int SampleRate = 1000,
+	    int Slots = 256,
+	    int QuarantineSlots = 128,
+	    int SlotPages = 1>
+  class GuardPageHeap : public SuperHeap {
+  public:
+
+    GuardPageHeap (void)
+    {
+      sassert<(QuarantineSlots < Slots) && (SampleRate > 0)> verifyParameters;
+      verifyParameters = verifyParameters;
+    }
+
+    inline void * malloc (size_t sz) {
+      long& left = getCountdown();
+      if ((--left <= 0) && (sz <= (size_t) SlotPages * pageSize())) {
+	void * ptr = guardedMalloc (sz, left);
+	if (ptr != NULL) {
+	  return ptr;
+	}
+      }
+      return SuperHeap::malloc (sz);
+    }
+
+    inline void free (void * ptr) {
+      if (inPool (ptr)) {
+	guardedFree (ptr);
+      } else {
+	SuperHeap::free (ptr);
+      }
+    }
+
+    inline size_t getSize (void * ptr) {
+      if (inPool (ptr)) {
+	return getPool().slots[slotOf (ptr)].size;
+      }
+      return SuperHeap::getSize (ptr);
+    }
+
+  private:
+
+    enum { Free, Live, Quarantined };
+    enum { ObjectAlignment = 16 };
+
+    struct Slot {
+      size_t size;
+      int state;
+    };
+
+    struct Pool {
+      char * volatile base;	// Slots * (SlotPages + 1) pages, or NULL
+      size_t bytes;
+      Slot slots[Slots];
+      int ring[QuarantineSlots];	// quarantined slots, oldest first
+      int ringHead;
+      int ringCount;
+      int nextFree;
+      SpinLockType lock;
+      struct sigaction previous;
+    };
+
+    static Pool& getPool (void) {
+      static Pool pool;
+      return pool;
+    }
+
+    static long& getCountdown (void) {
+      static __thread long left;
+      return left;
+    }
+
+    static inline size_t pageSize (void) {
+      static size_t sz = (size_t) sysconf (_SC_PAGESIZE);
+      return sz;
+    }
+
+    static inline size_t slotBytes (void) {
+      return (SlotPages + 1) * pageSize();
+    }
+
+    static inline bool inPool (void * ptr) {
+      Pool& p = getPool();
+      return ((size_t) ptr - (size_t) p.base < p.bytes);
+    }
+
+    static inline int slotOf (void * ptr) {
+      return (int) (((size_t) ptr - (size_t) getPool().base) / slotBytes());
+    }
+
+    // The next gap between samples, uniform in [1, 2 * SampleRate - 1].
+    static long nextGap (void) {
+      static __thread uint64_t x;
+      if (x == 0) {
+	x = ((uint64_t) (size_t) &x * 0x9e3779b97f4a7c15ULL) | 1;
+      }
+      x ^= x >> 12;
+      x ^= x << 25;
+      x ^= x >> 27;
+      return 1 + (long) ((x * 2685821657736338717ULL) >> 33) % (2 * SampleRate - 1);
+    }
+
+    NO_INLINE void * guardedMalloc (size_t sz, long& left) {
+      left = nextGap();
+      Pool& p = getPool();
+      p.lock.lock();
+      if ((p.base == NULL) && !reserve (p)) {
+	p.lock.unlock();
+	return NULL;
+      }
+      // Free slots are handed out in turn, so a freed slot waits in
+      // quarantine and then behind all the others.
+      int s = -1;
+      for (int n = 0; n < Slots; n++) {
+	const int i = (p.nextFree + n) % Slots;
+	if (p.slots[i].state == Free) {
+	  s = i;
+	  break;
+	}
+      }
+      if (s < 0) {
+	p.lock.unlock();
+	return NULL;
+      }
+      p.nextFree = (s + 1) % Slots;
+      char * slot = p.base + s * slotBytes();
+      if (mprotect (slot, SlotPages * pageSize(), PROT_READ | PROT_WRITE) != 0) {
+	p.lock.unlock();
+	return NULL;
+      }
+      p.slots[s].state = Live;
+      p.slots[s].size = sz;
+      p.lock.unlock();
+      const size_t rounded = (sz + ObjectAlignment - 1) & ~(size_t) (ObjectAlignment - 1);
+      return slot + SlotPages * pageSize() - rounded;
+    }
+
+    NO_INLINE void guardedFree (void * ptr) {
+      Pool& p = getPool();
+      const int s = slotOf (ptr);
+      char * slot = p.base + s * slotBytes();
+      p.lock.lock();
+      if (p.slots[s].state != Live) {
+	p.lock.unlock();
+	fail ("double free of a guarded object", ptr);
+      }
+      mprotect (slot, SlotPages * pageSize(), PROT_NONE);
+      // Give back the pages; the slot comes back zeroed.
+      madvise (slot, SlotPages * pageSize(), MADV_DONTNEED);
+      p.slots[s].state = Quarantined;
+      if (p.ringCount == QuarantineSlots) {
+	p.slots[p.ring[p.ringHead]].state = Free;
+	p.ringHead = (p.ringHead + 1) % QuarantineSlots;
+	p.ringCount--;
+      }
+      p.ring[(p.ringHead + p.ringCount) % QuarantineSlots] = s;
+      p.ringCount++;
+      p.lock.unlock();
+    }
+
+    static bool reserve (Pool& p) {
+      const size_t bytes = Slots * slotBytes();
+      void * base = mmap (NULL, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (base == MAP_FAILED) {
+	return false;
+      }
+      for (int i = 0; i < Slots; i++) {
+	p.slots[i].state = Free;
+      }
+      // Base first: a free that reads a stale size of 0 is just not
+      // in the pool, which no object of it is yet.
+      p.base = (char *) base;
+      p.bytes = bytes;
+      struct sigaction sa;
+      memset (&sa, 0, sizeof(sa));
+      sa.sa_sigaction = onFault;
+      sa.sa_flags = SA_SIGINFO;
+      sigemptyset (&sa.sa_mask);
+      sigaction (SIGSEGV, &sa, &p.previous);
+      return true;
+    }
+
+    // Explain a fault in the pool, then put back the previous handler
+    // and return, so the fault happens again and takes its usual course.
+    static void onFault (int sig, siginfo_t * info, void * context) {
+      Pool& p = getPool();
+      char * addr = (char *) info->si_addr;
+      if (inPool (addr)) {
+	const int s = slotOf (addr);
+	char * end = p.base + s * slotBytes() + SlotPages * pageSize();
+	const size_t rounded = (p.slots[s].size + ObjectAlignment - 1) & ~(size_t) (ObjectAlignment - 1);
+	char buf[256];
+	const int n =
+	  snprintf (buf, sizeof(buf),
+		    "GuardPageHeap: %s at %p, of the %lu-byte object at %p.\n",
+		    (p.slots[s].state == Live) ? "buffer overflow" : "use after free",
+		    (void *) addr, (unsigned long) p.slots[s].size, (void *) (end - rounded));
+	if (n > 0) {
+	  ::write (2, buf, n);
+	}
+      } else if (p.previous.sa_flags & SA_SIGINFO) {
+	if (p.previous.sa_sigaction != NULL) {
+	  p.previous.sa_sigaction (sig, info, context);
+	  return;
+	}
+      } else if ((p.previous.sa_handler != SIG_DFL) &&
+		 (p.previous.sa_handler != SIG_IGN)) {
+	p.previous.sa_handler (sig);
+	return;
+      }
+      sigaction (SIGSEGV, &p.previous, NULL);
+    }
+
+    static void fail (const char * what, const void * ptr) {
+      fprintf (stderr, "GuardPageHeap: %s (%p).\n", what, ptr);
+      abort();
+    }
+
+  };
+
+}
+
+#endif
@@ -0,0 +1,270 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_LATENCYHEAP_H
+#define HL_LATENCYHEAP_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "threads/atomic.h"
+#include "threads/cpuinfo.h"
+#include "utility/bitops.h"
+#include "utility/sassert.h"
+#include "utility/statsregistry.h"
+#include "utility/tsc.h"
+
+/**
+ * @class LatencyHeap
+ * @brief Histograms of how long the heap below takes to malloc and free.
+ *
+ * One call in SampleEvery (per thread) is timed with fenced TSC reads
+ * (see TSC) and counted in a log-linear histogram: values under 8
+ * ticks have a bucket each, and every power of two above that is cut
+ * into 8 buckets, so a bucket is within 12.5% of its values, up to
+ * 2^MaxBits ticks (the last bucket takes everything longer). What
+ * timing an empty interval costs (see TSC::getOverhead) is taken off
+ * each time. The untimed calls cost a countdown.
+ *
+ * As in ThreadStatsHeap, each thread (by thread id mod MaxThreads)
+ * counts in its own cache lines with relaxed atomic adds, and the
+ * histograms are summed only on read, so it is cheap enough to leave
+ * in a production binary. The heap lists itself in the StatsRegistry
+ * as "latency", with the count, mean, max and 50th, 90th, 99th and
+ * 99.9th percentiles of each, in nanoseconds.
+ *
+ * @param SuperHeap The heap to time.
+ * @param SampleEvery Time one call in this many (a power of two).
+ * @param MaxThreads The number of per-thread histograms.
+ */
+
+namespace HL {
+
+  template <class SuperHeap, int SampleEvery = 16, int MaxThreads = 64>
+  class LatencyHeap : public SuperHeap {
+  public:
+
+    enum { Malloc = 0, Free = 1, NumOps = 2 };
+
+    enum { SubBits = 3 };
+    enum { MaxBits = 40 };
+    enum { NumBuckets = (MaxBits - SubBits + 1) << SubBits };
+
+    LatencyHeap (void)
+      : _stats ("latency", this)
+    {
+      sassert<((SampleEvery & (SampleEvery - 1)) == 0)> verifySampleEvery;
+      verifySampleEvery = verifySampleEvery;
+      memset (_buf, 0, sizeof(_buf));
+    }
+
+    inline void * malloc (size_t sz) {
+      Histogram& h = getCounters(getIndex()).ops[Malloc];
+      if (!sampleNow (h)) {
+	return SuperHeap::malloc (sz);
+      }
+      const TSC::TickType t0 = TSC::begin();
+      void * ptr = SuperHeap::malloc (sz);
+      record (h, TSC::end() - t0);
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      Histogram& h = getCounters(getIndex()).ops[Free];
+      if ((ptr == NULL) || !sampleNow (h)) {
+	SuperHeap::free (ptr);
+	return;
+      }
+      const TSC::TickType t0 = TSC::begin();
+      SuperHeap::free (ptr);
+      record (h, TSC::end() - t0);
+    }
+
+    /// The number of timed calls of op (Malloc or Free).
+    unsigned long long getCount (int op) {
+      unsigned long long total = 0;
+      for (int b = 0; b < NumBuckets; b++) {
+	total += getBucketCount (op, b);
+      }
+      return total;
+    }
+
+    /// The number of timed calls of op that fell in bucket b.
+    unsigned long long getBucketCount (int op, int b) {
+      long long total = 0;
+      for (int i = 0; i < MaxThreads; i++) {
+	total += getCounters(i).ops[op].buckets[b];
+      }
+      return (unsigned long long) total;
+    }
+
+    /// The latency, in nanoseconds, under which the fraction q of the
+    /// timed calls of op fell (by the top of its bucket).
+    unsigned long long getPercentile (int op, double q) {
+      const unsigned long long count = getCount (op);
+      if (count == 0) {
+	return 0;
+      }
+      unsigned long long rank = (unsigned long long) (q * (double) count);
+      if (rank >= count) {
+	rank = count - 1;
+      }
+      unsigned long long seen = 0;
+      for (int b = 0; b < NumBuckets; b++) {
+	seen += getBucketCount (op, b);
+	if (seen > rank) {
+	  return TSC::toNanos (bucketTop (b));
+	}
+      }
+      return TSC::toNanos (bucketTop (NumBuckets - 1));
+    }
+
+    /// The longest timed call of op, in nanoseconds.
+    unsigned long long getMax (int op) {
+      TSC::TickType m = 0;
+      for (int i = 0; i < MaxThreads; i++) {
+	const TSC::TickType t = (TSC::TickType) getCounters(i).ops[op].max;
+	if (t > m) {
+	  m = t;
+	}
+      }
+      return TSC::toNanos (m);
+    }
+
+    /// The mean timed call of op, in nanoseconds.
+    unsigned long long getMean (int op) {
+      const unsigned long long count = getCount (op);
+      if (count == 0) {
+	return 0;
+      }
+      long long sum = 0;
+      for (int i = 0; i < MaxThreads; i++) {
+	sum += getCounters(i).ops[op].ticks;
+      }
+      return TSC::toNanos ((TSC::TickType) sum / count);
+    }
+
+    /// Rename this heap in the StatsRegistry.
+    void setStatsName (const char * name) {
+      _stats.setStatsName (name);
+    }
+
+    void writeStats (StatsWriter& w) {
+      const char * names[NumOps] = { "malloc", "free" };
+      w.field ("sample_every", SampleEvery);
+      for (int op = 0; op < NumOps; op++) {
+	w.beginObject (names[op]);
+	w.field ("count", getCount (op));
+	w.field ("mean_ns", getMean (op));
+	w.field ("p50_ns", getPercentile (op, 0.50));
+	w.field ("p90_ns", getPercentile (op, 0.90));
+	w.field ("p99_ns", getPercentile (op, 0.99));
+	w.field ("p999_ns", getPercentile (op, 0.999));
+	w.field ("max_ns", getMax (op));
+	w.endObject();
+      }
+    }
+
+    /// The bucket of a latency of t ticks.
+    static inline int getBucket (TSC::TickType t) {
+      if (t < (1 << SubBits)) {
+	return (int) t;
+      }
+      if (t >> MaxBits) {
+	return NumBuckets - 1;
+      }
+      const int e = ((t >> 32) != 0)
+	? (32 + BitOps::highestBit ((size_t) (t >> 32)))
+	: BitOps::highestBit ((size_t) t);
+      return ((e - SubBits + 1) << SubBits) + (int) ((t >> (e - SubBits)) & ((1 << SubBits) - 1));
+    }
+
+    /// The largest latency, in ticks, in bucket b.
+    static inline TSC::TickType bucketTop (int b) {
+      if (b < (1 << SubBits)) {
+	return (TSC::TickType) b;
+      }
+      const int e = (b >> SubBits) + SubBits - 1;
+      const TSC::TickType sub = (TSC::TickType) (b & ((1 << SubBits) - 1));
+      return (((TSC::TickType) (1 << SubBits) + sub + 1) << (e - SubBits)) - 1;
+    }
+
+  private:
+
+    enum { CacheLineSize = 64 };
+
+    struct Histogram {
+      volatile long long buckets[NumBuckets];
+      volatile long long ticks;
+      volatile long long max;
+      int countdown;
+    };
+
+    struct Counters {
+      Histogram ops[NumOps];
+    };
+
+    static inline bool sampleNow (Histogram& h) {
+      if (SampleEvery == 1) {
+	return true;
+      }
+      // A thread that shares the line may lose a tick of this; it only
+      // moves the next sample.
+      const int n = h.countdown;
+      h.countdown = (n + 1) & (SampleEvery - 1);
+      return (n == 0);
+    }
+
+    static inline void record (Histogram& h, TSC::TickType t) {
+      // Leave out what timing an empty interval costs.
+      const TSC::TickType overhead = TSC::getOverhead();
+      t = (t > overhead) ? (t - overhead) : 0;
+      Atomic::addRelaxed (&h.buckets[getBucket (t)], 1);
+      Atomic::addRelaxed (&h.ticks, (long long) t);
+      if ((long long) t > h.max) {
+	h.max = (long long) t;
+      }
+    }
+
+    static inline int getIndex (void) {
+      return (int) (CPUInfo::getThreadId() % (unsigned int) MaxThreads);
+    }
+
+    inline Counters& getCounters (int i) {
+      char * base = (char *) (((size_t) _buf + CacheLineSize - 1) & ~((size_t) CacheLineSize - 1));
+      return *((Counters *) (base + i * LineBytes));
+    }
+
+    enum { LineBytes = ((sizeof(Counters) + CacheLineSize - 1) / CacheLineSize) * CacheLineSize };
+
+    char _buf[MaxThreads * LineBytes + CacheLineSize];
+
+    LayerStats<LatencyHeap> _stats;
+  };
+
+}
+
+#endif
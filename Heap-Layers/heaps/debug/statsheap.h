@@ -3,7 +3,14 @@
 #ifndef HL_STATS_H
 #define HL_STATS_H
 
+#include <assert.h>
 #include <map>
+#include <stddef.h>
+#include <string.h>
+
+#include "threads/atomic.h"
+#include "threads/cpuinfo.h"
+#include "utility/statsregistry.h"
 
 namespace HL {
 
@@ -40,6 +47,31 @@ namespace HL {
       SuperHeap::free (ptr);
     }
 
+    /// The size-passing protocol (see SizePassingHeap), passed
+    /// through; the map still has the size that was asked for.
+    void * mallocSized (size_t sz, size_t * actual) {
+      void * ptr = SuperHeap::mallocSized (sz, actual);
+      if (ptr != NULL) {
+	inUse += sz;
+	if (maxInUse < inUse) {
+	  maxInUse = inUse;
+	}
+	allocatedObjects.insert (std::pair<void *, int>(ptr, sz));
+      }
+      return ptr;
+    }
+
+    void free (void * ptr, size_t sz) {
+      mapType::iterator i;
+      i = allocatedObjects.find (ptr);
+      if (i == allocatedObjects.end()) {
+	assert (0);
+      }
+      inUse -= (*i).second;
+      allocatedObjects.erase (i);
+      SuperHeap::free (ptr, sz);
+    }
+
     int getInUse (void) const {
       return inUse;
     }
@@ -77,6 +109,23 @@ namespace HL {
       allocated -= SuperHeap::getSize(ptr);
       SuperHeap::free (ptr);
     }
+
+    /// The size-passing protocol (see SizePassingHeap).
+    void * mallocSized (size_t sz, size_t * actual) {
+      void * ptr = SuperHeap::mallocSized (sz, actual);
+      if (ptr != NULL) {
+	allocated += *actual;
+	if (maxAllocated < allocated) {
+	  maxAllocated = allocated;
+	}
+      }
+      return ptr;
+    }
+
+    void free (void * ptr, size_t sz) {
+      allocated -= sz;
+      SuperHeap::free (ptr, sz);
+    }
     
     int getAllocated (void) const {
       return allocated;
@@ -91,6 +140,296 @@ namespace HL {
   };
 
 
+  /**
+   * @class ThreadStatsHeap
+   * @brief Allocation statistics cheap enough to leave on in production.
+   *
+   * Each thread counts its allocs, frees and bytes (by getSize, so no
+   * side table) in its own cache line of 64-bit counters, picked like
+   * ThreadHeap picks a heap: by thread id mod MaxThreads. The adds are
+   * relaxed atomics, so threads that share a line stay exact. The
+   * getters sum the lines, and so are approximate while other threads
+   * run.
+   *
+   * getMaxInUse is an estimate: the sum of each line's own high-water
+   * mark of bytes in use, which is exact for one thread and an upper
+   * bound on the true peak otherwise.
+   *
+   * The heap lists itself in the StatsRegistry as "threadstats"; put it
+   * over any part of a stack (a SegHeap's big-object heap, an MmapHeap)
+   * to see that part's traffic, and setStatsName to tell them apart.
+   */
+
+  template <class SuperHeap, int MaxThreads = 64>
+  class ThreadStatsHeap : public SuperHeap {
+  public:
+
+    ThreadStatsHeap (void)
+      : _stats ("threadstats", this)
+    {
+      for (int i = 0; i < MaxThreads; i++) {
+	Counters& c = getCounters (i);
+	c.allocs = c.frees = c.allocBytes = c.freeBytes = 0;
+	c.net = c.peak = 0;
+      }
+    }
+
+    inline void * malloc (size_t sz) {
+      void * ptr = SuperHeap::malloc (sz);
+      if (ptr != NULL) {
+	countMalloc ((long long) SuperHeap::getSize (ptr));
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr != NULL) {
+	countFree ((long long) SuperHeap::getSize (ptr));
+      }
+      SuperHeap::free (ptr);
+    }
+
+    /// The size-passing protocol (see SizePassingHeap).
+    inline void * mallocSized (size_t sz, size_t * actual) {
+      void * ptr = SuperHeap::mallocSized (sz, actual);
+      if (ptr != NULL) {
+	countMalloc ((long long) *actual);
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr, size_t sz) {
+      if (ptr != NULL) {
+	countFree ((long long) sz);
+      }
+      SuperHeap::free (ptr, sz);
+    }
+
+    unsigned long long getAllocs (void) {
+      return sum (&Counters::allocs);
+    }
+
+    unsigned long long getFrees (void) {
+      return sum (&Counters::frees);
+    }
+
+    unsigned long long getAllocatedBytes (void) {
+      return sum (&Counters::allocBytes);
+    }
+
+    unsigned long long getInUse (void) {
+      const long long n = sum (&Counters::allocBytes) - sum (&Counters::freeBytes);
+      return (n > 0) ? n : 0;
+    }
+
+    unsigned long long getMaxInUse (void) {
+      const unsigned long long peak = sum (&Counters::peak);
+      const unsigned long long now = getInUse();
+      return (peak > now) ? peak : now;
+    }
+
+    /// Rename this heap in the StatsRegistry.
+    void setStatsName (const char * name) {
+      _stats.setStatsName (name);
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("allocs", getAllocs());
+      w.field ("frees", getFrees());
+      w.field ("allocated_bytes", getAllocatedBytes());
+      w.field ("in_use_bytes", getInUse());
+      w.field ("max_in_use_bytes", getMaxInUse());
+    }
+
+  private:
+
+    enum { CacheLineSize = 64 };
+
+    struct Counters {
+      volatile long long allocs;
+      volatile long long frees;
+      volatile long long allocBytes;
+      volatile long long freeBytes;
+      volatile long long net;	// allocBytes - freeBytes of this line
+      volatile long long peak;	// the high-water mark of net
+    };
+
+    static inline int getIndex (void) {
+      return (int) (CPUInfo::getThreadId() % (unsigned int) MaxThreads);
+    }
+
+    inline void countMalloc (long long bytes) {
+      Counters& c = getCounters (getIndex());
+      Atomic::addRelaxed (&c.allocs, 1);
+      Atomic::addRelaxed (&c.allocBytes, bytes);
+      const long long net = Atomic::addRelaxed (&c.net, bytes);
+      if (net > c.peak) {
+	c.peak = net;
+      }
+    }
+
+    inline void countFree (long long bytes) {
+      Counters& c = getCounters (getIndex());
+      Atomic::addRelaxed (&c.frees, 1);
+      Atomic::addRelaxed (&c.freeBytes, bytes);
+      Atomic::addRelaxed (&c.net, -bytes);
+    }
+
+    inline Counters& getCounters (int i) {
+      char * base = (char *) (((size_t) _buf + CacheLineSize - 1) & ~((size_t) CacheLineSize - 1));
+      return *((Counters *) (base + i * LineBytes));
+    }
+
+    long long sum (volatile long long Counters::* field) {
+      long long total = 0;
+      for (int i = 0; i < MaxThreads; i++) {
+	total += getCounters(i).*field;
+      }
+      return total;
+    }
+
+    /// Whole cache lines per thread, so no two threads share one.
+    enum { LineBytes = ((sizeof(Counters) + CacheLineSize - 1) / CacheLineSize) * CacheLineSize };
+
+    char _buf[MaxThreads * LineBytes + CacheLineSize];
+
+    LayerStats<ThreadStatsHeap> _stats;
+  };
+
+
+  /**
+   * @class SizeClassStatsHeap
+   * @brief Per-size-class histograms of allocs and live objects.
+   *
+   * Class c counts the objects whose size (by getSize) lies in
+   * [2^c, 2^(c+1)). As in ThreadStatsHeap, each thread (by thread id
+   * mod MaxThreads) counts in its own cache lines with relaxed atomic
+   * adds, and the histograms are summed only on read. Listed in the
+   * StatsRegistry as "sizeclasses", with one "allocs" and one "live"
+   * array entry per class up to the largest class seen.
+   */
+
+  template <class SuperHeap, int MaxThreads = 64>
+  class SizeClassStatsHeap : public SuperHeap {
+  public:
+
+    enum { NumClasses = sizeof(size_t) * 8 };
+
+    SizeClassStatsHeap (void)
+      : _stats ("sizeclasses", this)
+    {
+      memset (_buf, 0, sizeof(_buf));
+    }
+
+    inline void * malloc (size_t sz) {
+      void * ptr = SuperHeap::malloc (sz);
+      if (ptr != NULL) {
+	const int c = getClass (SuperHeap::getSize (ptr));
+	Atomic::addRelaxed (&getCounters(getIndex()).allocs[c], 1);
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr != NULL) {
+	const int c = getClass (SuperHeap::getSize (ptr));
+	Atomic::addRelaxed (&getCounters(getIndex()).frees[c], 1);
+      }
+      SuperHeap::free (ptr);
+    }
+
+    /// The size-passing protocol (see SizePassingHeap).
+    inline void * mallocSized (size_t sz, size_t * actual) {
+      void * ptr = SuperHeap::mallocSized (sz, actual);
+      if (ptr != NULL) {
+	Atomic::addRelaxed (&getCounters(getIndex()).allocs[getClass (*actual)], 1);
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr, size_t sz) {
+      if (ptr != NULL) {
+	Atomic::addRelaxed (&getCounters(getIndex()).frees[getClass (sz)], 1);
+      }
+      SuperHeap::free (ptr, sz);
+    }
+
+    /// The number of objects of class c ever allocated.
+    unsigned long long getAllocs (int c) {
+      long long total = 0;
+      for (int i = 0; i < MaxThreads; i++) {
+	total += getCounters(i).allocs[c];
+      }
+      return total;
+    }
+
+    /// The number of objects of class c now in use.
+    unsigned long long getLive (int c) {
+      long long total = 0;
+      for (int i = 0; i < MaxThreads; i++) {
+	total += getCounters(i).allocs[c] - getCounters(i).frees[c];
+      }
+      return (total > 0) ? total : 0;
+    }
+
+    /// Rename this heap in the StatsRegistry.
+    void setStatsName (const char * name) {
+      _stats.setStatsName (name);
+    }
+
+    void writeStats (StatsWriter& w) {
+      int last = -1;
+      for (int c = 0; c < NumClasses; c++) {
+	if (getAllocs (c) > 0) {
+	  last = c;
+	}
+      }
+      w.beginArray ("allocs");
+      for (int c = 0; c <= last; c++) {
+	w.value (getAllocs (c));
+      }
+      w.endArray();
+      w.beginArray ("live");
+      for (int c = 0; c <= last; c++) {
+	w.value (getLive (c));
+      }
+      w.endArray();
+    }
+
+    static inline int getClass (size_t sz) {
+      int c = 0;
+      while (sz >>= 1) {
+	c++;
+      }
+      return c;
+    }
+
+  private:
+
+    enum { CacheLineSize = 64 };
+
+    struct Counters {
+      volatile long long allocs[NumClasses];
+      volatile long long frees[NumClasses];
+    };
+
+    static inline int getIndex (void) {
+      return (int) (CPUInfo::getThreadId() % (unsigned int) MaxThreads);
+    }
+
+    inline Counters& getCounters (int i) {
+      char * base = (char *) (((size_t) _buf + CacheLineSize - 1) & ~((size_t) CacheLineSize - 1));
+      return *((Counters *) (base + i * LineBytes));
+    }
+
+    enum { LineBytes = ((sizeof(Counters) + CacheLineSize - 1) / CacheLineSize) * CacheLineSize };
+
+    char _buf[MaxThreads * LineBytes + CacheLineSize];
+
+    LayerStats<SizeClassStatsHeap> _stats;
+  };
+
+
   template <class SuperHeap>
   class StatsHeap : public SuperHeap {
   public:
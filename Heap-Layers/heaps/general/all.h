@@ -2,3 +2,5 @@
 #include "kingsleyheap.h"
 #include "leamallocheap.h"
 
+#include "statictlsfheap.h"
+#include "tlsfheap.h"
@@ -36,8 +36,12 @@
 #include <assert.h>
 
 #include "heaps/buildingblock/adaptheap.h"
+#include "heaps/buildingblock/deferredcoalesceheap.h"
+#include "heaps/combining/twolevelsegheap.h"
 #include "utility/dllist.h"
+#include "utility/sassert.h"
 #include "utility/sllist.h"
+#include "utility/statsregistry.h"
 #include "heaps/objectrep/coalesceableheap.h"
 
 #ifndef TRUE
@@ -54,14 +58,21 @@
 
 namespace HL {
 
-template <class Mmap>
-class CoalesceableMmapHeap : public RequireCoalesceable<Mmap> {
+template <class Mmap, class SizeType = size_t>
+class CoalesceableMmapHeap : public RequireCoalesceable<Mmap, SizeType> {
 public:
-  typedef RequireCoalesceable<Mmap> super;
-  typedef typename RequireCoalesceable<Mmap>::Header Header;
+  typedef RequireCoalesceable<Mmap, SizeType> super;
+  typedef typename RequireCoalesceable<Mmap, SizeType>::Header Header;
 
   inline void * malloc (const size_t sz) {
-    void * buf = super::malloc (sz + sizeof(Header));
+    if (sz > Header::maxObjectSize()) {
+      return NULL;
+    }
+    // makeObject also writes the prevSize of the header that follows.
+    void * buf = super::malloc (sz + 2 * sizeof(Header));
+    if (buf == NULL) {
+      return NULL;
+    }
     void * ptr = Header::makeObject (buf, 0, sz);
     super::markMmapped (ptr);
     super::markInUse (ptr);
@@ -120,9 +131,126 @@ public:
     sm.clear();
     super::clear();
   }
+  inline size_t purge (size_t budget) {
+    size_t released = sm.purge (budget);
+    if (released < budget) {
+      released += super::purge (budget - released);
+    }
+    return released;
+  }
+
+private:
+  SmallHeap sm;
+};
+
+
+/**
+ * @class AdaptiveSelectMmapHeap
+ * @brief SelectMmapHeap with a threshold that rises to fit the workload.
+ *
+ * Like glibc's malloc, whenever an mmapped object no bigger than
+ * MaxThresholdBytes is freed, the threshold rises to its size, so that
+ * later requests like it come from SmallHeap instead of a fresh
+ * mmap and munmap each. A program that keeps allocating and freeing
+ * objects of a size just above the initial threshold pays for one
+ * mmap, not one per object. The threshold never falls.
+ *
+ * Objects are freed back to where they came from by their mmapped
+ * bit, not their size, so moving the threshold is always safe.
+ * The threshold and its changes are in the StatsRegistry as "mmap-threshold".
+ *
+ * @param InitialThresholdBytes The starting threshold.
+ * @param MaxThresholdBytes The threshold never rises above this.
+ * @param SmallHeap The heap for "small" objects.
+ * @param super The heap for "large" objects.
+ */
+
+template <int InitialThresholdBytes,
+	  size_t MaxThresholdBytes,
+	  class SmallHeap,
+	  class super>
+class AdaptiveSelectMmapHeap : public super {
+public:
+
+  AdaptiveSelectMmapHeap (void)
+    : threshold (InitialThresholdBytes),
+      thresholdChanges (0),
+      mmaps (0),
+      munmaps (0),
+      _stats ("mmap-threshold", this)
+  {
+    sassert<((size_t) InitialThresholdBytes <= MaxThresholdBytes)> verifyThresholds;
+    verifyThresholds = verifyThresholds;
+  }
+
+  inline void * malloc (const size_t sz) {
+    void * ptr = NULL;
+    if (sz <= threshold) {
+      ptr = sm.malloc (sz);
+    }
+
+    // Fall-through: go ahead and try mmap if the small heap is out of memory.
+
+    if (ptr == NULL) {
+      ptr = super::malloc (sz);
+      if (ptr != NULL) {
+	super::markMmapped (ptr);
+	mmaps++;
+      }
+    }
+    return ptr;
+  }
+  inline void free (void * ptr) {
+    if (super::isMmapped(ptr)) {
+      const size_t sz = super::getSize (ptr);
+      if ((sz > threshold) && (sz <= MaxThresholdBytes)) {
+	threshold = sz;
+	thresholdChanges++;
+      }
+      munmaps++;
+      super::free (ptr);
+    } else {
+      sm.free (ptr);
+    }
+  }
+  inline int remove (void * ptr) {
+    if (super::isMmapped(ptr)) {
+      return super::remove (ptr);
+    } else {
+      return sm.remove (ptr);
+    }
+  }
+  inline void clear (void) {
+    sm.clear();
+    super::clear();
+  }
+  inline size_t purge (size_t budget) {
+    size_t released = sm.purge (budget);
+    if (released < budget) {
+      released += super::purge (budget - released);
+    }
+    return released;
+  }
+
+  /// The largest request that currently goes to SmallHeap.
+  inline size_t getThreshold (void) const {
+    return threshold;
+  }
+
+  void writeStats (StatsWriter& w) {
+    w.field ("threshold", threshold);
+    w.field ("threshold_changes", thresholdChanges);
+    w.field ("mmaps", mmaps);
+    w.field ("munmaps", munmaps);
+  }
 
 private:
+  size_t threshold;
+  unsigned long thresholdChanges;
+  unsigned long mmaps;
+  unsigned long munmaps;
   SmallHeap sm;
+  LayerStats<AdaptiveSelectMmapHeap> _stats;
 };
 
 
@@ -381,7 +509,7 @@ CoalesceHeap<RequireCoalesceable<
 	  super> > >
 {};
 
-#else
+#elif 0
 
 template <class super>
 class DLBigHeapType :
@@ -394,6 +522,20 @@ CoalesceHeap<RequireCoalesceable<
 	  super> > >
 {};
 
+#else
+
+// The free blocks are indexed by a two-level bitmap, so finding one
+// that fits takes constant time however fragmented the heap is.
+// SizeType must match the CoalesceableHeap underneath.
+
+template <class super, class SizeType = size_t>
+class DLBigHeapType :
+  public 
+CoalesceHeap<RequireCoalesceable<
+  TwoLevelSegHeap<AdaptHeap<DLList, NullHeap<super> >,
+		  super>, SizeType> >
+{};
+
 #endif
 
 /**
@@ -402,25 +544,38 @@ CoalesceHeap<RequireCoalesceable<
  * @author Emery Berger
  */
 
-template <class super>
+template <class super, class SizeType = size_t>
 class DLSmallHeapType :
   public RequireCoalesceable<
   StrictSegHeap<DLSmallHeapNS::NUMBINS,
 		DLSmallHeapNS::getSizeClass,
 		DLSmallHeapNS::getClassSize,
 		AdaptHeap<HL::SLList, NullHeap<super> >,
-		super> > {};
+		super>, SizeType> {};
 
 
+/**
+ * @class DLMediumHeapType
+ * @brief The big heap behind quicklists for objects up to 4K, which
+ *        are coalesced only in batches (see DeferredCoalesceHeap).
+ */
+
+template <class super, class SizeType = size_t>
+class DLMediumHeapType :
+  public DeferredCoalesceHeap<4096, 256 * 1024, DLBigHeapType<super, SizeType> >
+{};
+
 /**
  * @class LeaHeap
  * @brief This heap approximates the algorithms used by DLmalloc 2.7.0.
  * 
  * The whole thing. Big objects are allocated via mmap.
  * Other objects are first allocated from the special thresholded quicklists,
- * or if they're too big, they're allocated from the coalescing big heap. 
+ * or if they're too big, they're allocated from the coalescing big heap
+ * (medium ones through quicklists of their own, coalesced in batches). 
  *
- * @param Sbrk An sbrk-like heap, for small object allocation.
+ * @param Sbrk An sbrk-like (contiguous) heap, for small object allocation,
+ *             such as SbrkHeap or ReservedHeap.
  * @param Mmap An mmap-like heap, for large object allocation.
  */
   
@@ -429,10 +584,28 @@ class LeaHeap :
   public
     SelectMmapHeap<128 * 1024,
 		   Threshold<4096,
-			     DLSmallHeapType<DLBigHeapType<CoalesceableHeap<Sbrk> > > >,
+			     DLSmallHeapType<DLMediumHeapType<CoalesceableHeap<Sbrk> > > >,
 		   CoalesceableMmapHeap<Mmap> >
 {};
 
+/**
+ * @class AdaptiveLeaHeap
+ * @brief LeaHeap with glibc's sliding mmap threshold.
+ *
+ * The threshold starts at 128K, as in LeaHeap, and can rise up to
+ * glibc's limit of 4M * sizeof(long) (32MB on 64-bit systems).
+ */
+
+template <class Sbrk, class Mmap>
+class AdaptiveLeaHeap :
+  public
+    AdaptiveSelectMmapHeap<128 * 1024,
+			   4 * 1024 * 1024 * sizeof(long),
+			   Threshold<4096,
+				     DLSmallHeapType<DLMediumHeapType<CoalesceableHeap<Sbrk> > > >,
+			   CoalesceableMmapHeap<Mmap> >
+{};
+
 }
 
 #endif
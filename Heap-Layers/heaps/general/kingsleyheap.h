@@ -28,6 +28,7 @@
 #define HL_KINGSLEYHEAP_H
 
 #include "heaps/combining/strictsegheap.h"
+#include "utility/bitops.h"
 
 /**
  * @file kingsleyheap.h
@@ -77,17 +78,10 @@ namespace Kingsley {
       assert (class2Size(cl[sz >> 3]) >= sz);
       return cl[(sz - 1) >> 3];
     } else {
-      //
-      // We know that the object is more than 128 bytes long,
-      // so we can avoid iterating 5 times.
-      //
-      int c = 5;
-      size_t sz1 = ((sz - 1) >> 5);
-      while (sz1 > 7) {
-	sz1 >>= 1;
-	c++;
-      }
+      // The smallest power of two of at least sz, less the 8 of class 0.
+      const int c = HL::BitOps::highestBit (sz - 1) - 2;
       assert (class2Size(c) >= sz);
+      assert (class2Size(c - 1) < sz);
       return c;
     }
 #endif
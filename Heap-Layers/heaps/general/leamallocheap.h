@@ -37,6 +37,7 @@
 extern "C" void * dlmalloc (size_t);
 extern "C" void   dlfree (void *);
 extern "C" size_t dlmalloc_usable_size (void *);
+extern "C" void ** dlindependent_comalloc (size_t, size_t *, void **);
 
 namespace HL {
 
@@ -54,6 +55,11 @@ namespace HL {
     inline size_t getSize (const void * p) {
       return dlmalloc_usable_size ((void *) p);
     }
+
+    /// dlmalloc carves the objects out of one chunk (see ComallocHeap).
+    inline bool comalloc (size_t n, const size_t * sizes, void ** ptrs) {
+      return (dlindependent_comalloc (n, (size_t *) sizes, ptrs) != NULL);
+    }
   };
 
 }
@@ -0,0 +1,129 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_STATICTLSFHEAP_H
+#define HL_STATICTLSFHEAP_H
+
+#include <stddef.h>
+
+#include "heaps/general/dlheap.h"
+#include "heaps/objectrep/coalesceableheap.h"
+#include "heaps/top/staticheap.h"
+#include "heaps/utility/oneheap.h"
+#include "utility/heapwalk.h"
+#include "utility/statsregistry.h"
+
+/**
+ * @class StaticTLSFHeap
+ * @brief A heap in a fixed-size static buffer, with bounded-time malloc and free.
+ *
+ * This is DLBigHeapType (coalescing, with free blocks indexed by
+ * TwoLevelSegHeap's two-level bitmap, as in TLSF) over one StaticHeap
+ * of MemorySize bytes, which every bin shares through OneHeap. Finding
+ * a block, splitting it and coalescing it with its neighbors on free
+ * all take a bounded number of steps, and nothing calls into the OS,
+ * ever. When the buffer is used up (or too fragmented), malloc returns
+ * NULL.
+ *
+ * The bytes in use and their high-water mark are in the StatsRegistry
+ * as "static-tlsf". Like the heaps it is built from, it has no lock;
+ * put a LockedHeap over it to share it between threads.
+ *
+ * @param MemorySize The size of the buffer.
+ */
+
+namespace HL {
+
+  template <int MemorySize>
+  class StaticTLSFHeap :
+    public DLBigHeapType<CoalesceableHeap<OneHeap<StaticHeap<MemorySize> > > > {
+  private:
+
+    typedef DLBigHeapType<CoalesceableHeap<OneHeap<StaticHeap<MemorySize> > > > SuperHeap;
+
+  public:
+
+    enum { Alignment = 16 };
+
+    StaticTLSFHeap (void)
+      : _inUse (0),
+	_highWater (0),
+	_failures (0),
+	_stats ("static-tlsf", this)
+    {}
+
+    inline void * malloc (size_t sz) {
+      // Keep every block a multiple of the alignment, so they all stay aligned.
+      sz = (sz + Alignment - 1) & ~((size_t) Alignment - 1);
+      if (sz == 0) {
+	sz = Alignment;
+      }
+      void * ptr = SuperHeap::malloc (sz);
+      if (ptr == NULL) {
+	_failures++;
+	return NULL;
+      }
+      _inUse += SuperHeap::getSize (ptr);
+      if (_inUse > _highWater) {
+	_highWater = _inUse;
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      _inUse -= SuperHeap::getSize (ptr);
+      SuperHeap::free (ptr);
+    }
+
+    inline size_t getInUse (void) const {
+      return _inUse;
+    }
+
+    inline size_t getHighWater (void) const {
+      return _highWater;
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("capacity_bytes", (size_t) MemorySize);
+      w.field ("in_use_bytes", _inUse);
+      w.field ("high_water_bytes", _highWater);
+      w.field ("failed_allocs", _failures);
+    }
+
+  private:
+
+    size_t _inUse;
+    size_t _highWater;
+    unsigned long _failures;
+    LayerStats<StaticTLSFHeap> _stats;
+  };
+
+}
+
+#endif
@@ -0,0 +1,488 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_TLSFHEAP_H
+#define HL_TLSFHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "heaps/general/dlheap.h"
+#include "heaps/objectrep/coalesceableheap.h"
+#include "utility/bitops.h"
+#include "utility/heapwalk.h"
+
+/**
+ * @class TLSFHeap
+ * @brief Two-level segregated fit (TLSF) over areas from the superheap.
+ *
+ * The whole of TLSF in one layer. Free blocks are binned first by
+ * their power of two and then by 16 equal steps within it (below 128
+ * bytes, by 8-byte steps). Two bit scans find a block that fits, and
+ * it is split, and freed blocks are coalesced with both neighbors,
+ * each in a bounded number of steps. Only growing the heap, by
+ * another area of AreaSize bytes (or one big enough for the request)
+ * from Super, takes more, and so does freeing the last object in an
+ * area bigger than AreaSize, which gives the area straight back.
+ *
+ * Unlike DLBigHeapType, which coalesces only across memory that the
+ * superheap hands out contiguously (an sbrk), each area is fenced off
+ * at both ends, so Super can be any source heap and TLSFHeap keeps no
+ * global state: every instance is independent and can sit under
+ * ThreadSpecificHeap or any per-thread or per-CPU layer. Objects
+ * carry RequireCoalesceable headers (of SizeType), so the layers that
+ * LeaHeap stacks over its big heap work over this one unchanged (see
+ * TLSFLeaHeap). There is no lock.
+ *
+ * clear gives every area back to Super, and purge gives back the areas
+ * that are wholly free.
+ *
+ * @param Super The source of areas.
+ * @param AreaSize The size of each area (the most fragmentation one
+ *                 small request can cost).
+ * @param SizeType As for RequireCoalesceable.
+ *
+ * @see Masmano et al., "TLSF: a New Dynamic Memory Allocator for
+ * Real-Time Systems", ECRTS 2004.
+ */
+
+namespace HL {
+
+  template <class Super,
+	    int AreaSize = 1024 * 1024,
+	    class SizeType = size_t>
+  class TLSFHeap : public RequireCoalesceable<Super, SizeType> {
+  private:
+
+    typedef RequireCoalesceable<Super, SizeType> SuperHeap;
+
+  public:
+
+    typedef typename SuperHeap::Header Header;
+
+    enum { Alignment = sizeof(Header) };
+
+    TLSFHeap (void)
+      : _areas (NULL),
+	_heldBytes (0),
+	_freeBytes (0),
+	_flBitmap (0)
+    {
+      for (int fl = 0; fl < FLCount; fl++) {
+	_slBitmap[fl] = 0;
+	for (int sl = 0; sl < SLCount; sl++) {
+	  _bins[fl][sl] = NULL;
+	}
+      }
+    }
+
+    inline void * malloc (size_t sz) {
+      if (sz > MaxRequest) {
+	return NULL;
+      }
+      sz = (sz < MinObjectSize) ? MinObjectSize : ((sz + Alignment - 1) & ~((size_t) Alignment - 1));
+      void * ptr = findFit (sz);
+      if (ptr != NULL) {
+	remove (ptr);
+      } else if ((ptr = addArea (sz)) == NULL) {
+	return NULL;
+      }
+      SuperHeap::markInUse (ptr);
+      split (ptr, sz);
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      assert (!SuperHeap::isFree (ptr));
+      ptr = release (ptr);
+      Area * a = getArea (ptr);
+      if ((a != NULL) && (a->size > (size_t) AreaSize)) {
+	remove (ptr);
+	removeArea (a);
+      }
+    }
+
+    inline static size_t getSize (const void * ptr) {
+      return SuperHeap::getSize (ptr);
+    }
+
+    /// Grow an object into a free successor, or shrink it, in place.
+    /// Returns true if the object now holds at least newSize bytes.
+    inline bool resize (void * ptr, size_t newSize) {
+      if (newSize > MaxRequest) {
+	return false;
+      }
+      newSize = (newSize < MinObjectSize) ? MinObjectSize : ((newSize + Alignment - 1) & ~((size_t) Alignment - 1));
+      if (getSize (ptr) < newSize) {
+	void * next = SuperHeap::getNext (ptr);
+	if (!SuperHeap::isFree (next)
+	    || (getSize (ptr) + sizeof(Header) + getSize (next) < newSize)) {
+	  return false;
+	}
+	remove (next);
+	merge (ptr, next);
+	SuperHeap::markInUse (ptr);
+      }
+      split (ptr, newSize);
+      return true;
+    }
+
+    /// The size malloc (sz) makes usable: sz rounded to the
+    /// alignment. (A block is only split if the rest can be a block,
+    /// so it can come out a little bigger.)
+    inline size_t goodSize (size_t sz) {
+      if (sz > MaxRequest) {
+	return sz;
+      }
+      return (sz < MinObjectSize) ? MinObjectSize : ((sz + Alignment - 1) & ~((size_t) Alignment - 1));
+    }
+
+    /// The bytes held in free blocks.
+    inline size_t getMemoryHeld (void) const {
+      return _freeBytes;
+    }
+
+    /// Give every area back to Super: every object is freed at once.
+    void clear (void) {
+      while (_areas != NULL) {
+	Area * a = _areas;
+	_areas = a->next;
+	Super::free (a->base);
+      }
+      for (int fl = 0; fl < FLCount; fl++) {
+	_slBitmap[fl] = 0;
+	for (int sl = 0; sl < SLCount; sl++) {
+	  _bins[fl][sl] = NULL;
+	}
+      }
+      _flBitmap = 0;
+      _heldBytes = 0;
+      _freeBytes = 0;
+    }
+
+    /// Give back areas that hold no objects, then purge Super.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      Area * a = _areas;
+      while ((a != NULL) && (released < budget)) {
+	Area * next = a->next;
+	if (getArea (a->first()) != NULL) {
+	  remove (a->first());
+	  released += a->size;
+	  removeArea (a);
+	}
+	a = next;
+      }
+      if (released < budget) {
+	released += Super::purge (budget - released);
+      }
+      return released;
+    }
+
+    void walk (HeapWalker& w) {
+      HeapUsage u;
+      u.heldBytes = _heldBytes;
+      u.freeBytes = _freeBytes;
+      for (int fl = 0; fl < FLCount; fl++) {
+	for (int sl = 0; sl < SLCount; sl++) {
+	  for (FreeObject * f = _bins[fl][sl]; f != NULL; f = f->next) {
+	    u.freeObjects++;
+	  }
+	}
+      }
+      w.visit ("TLSFHeap", u);
+      Super::walk (w);
+    }
+
+  private:
+
+    // Disabled.
+    TLSFHeap (const TLSFHeap&);
+    TLSFHeap& operator= (const TLSFHeap&);
+
+    /// A free block's links, in its first bytes.
+    class FreeObject {
+    public:
+      FreeObject * next;
+      FreeObject * prev;
+    };
+
+    /// The start of every area: the list of areas, then the first
+    /// block, and after the last block two headers, so that the last
+    /// block's successor (of size 0) looks in use.
+    class Area {
+    public:
+      Area * next;
+      Area * prev;
+      size_t size;
+      void * base;		// What Super returned, if not aligned.
+      inline void * first (void) {
+	return (char *) this + AreaHeaderSize + sizeof(Header);
+      }
+    };
+
+    enum { AreaHeaderSize = ((sizeof(Area) + Alignment - 1) / Alignment) * Alignment };
+
+    enum { AreaOverhead = AreaHeaderSize + 3 * sizeof(Header) };
+
+    enum { MinObjectSize = (sizeof(FreeObject) > (size_t) Alignment) ? sizeof(FreeObject) : Alignment };
+
+    enum { SLBits = 4 };
+
+    enum { SLCount = 1 << SLBits };
+
+    /// Row 0 holds the sizes below 2^MinFLBits, in 8-byte steps.
+    enum { MinFLBits = SLBits + 3 };
+
+    /// Enough rows for every size a header can hold.
+    enum { FLCount = sizeof(SizeType) * 8 - 2 - MinFLBits + 1 };
+
+    /// Past this, the request, its rounding and an area's overhead
+    /// would not fit in a header.
+    static const size_t MaxRequest = (((size_t) 1 << (sizeof(SizeType) * 8 - 3)) - 1);
+
+    /// The bin of blocks of at least sz bytes (and less than the next bin).
+    static inline void mapping (size_t sz, int& fl, int& sl) {
+      if (sz < ((size_t) 1 << MinFLBits)) {
+	fl = 0;
+	sl = (int) (sz >> 3);
+      } else {
+	const int log2 = BitOps::highestBit (sz);
+	fl = log2 - MinFLBits + 1;
+	sl = (int) (sz >> (log2 - SLBits)) - SLCount;
+      }
+      assert (sl >= 0);
+      assert (sl < SLCount);
+    }
+
+    /// A free block of at least sz bytes, or NULL. Rounding sz up to
+    /// the next bin means any block in the bin found fits.
+    inline void * findFit (size_t sz) {
+      if (sz >= ((size_t) 1 << MinFLBits)) {
+	sz += ((size_t) 1 << (BitOps::highestBit (sz) - SLBits)) - 1;
+      }
+      int fl, sl;
+      mapping (sz, fl, sl);
+      if (fl >= FLCount) {
+	return NULL;
+      }
+      unsigned long map = _slBitmap[fl] & (~0UL << sl);
+      if (map == 0) {
+	const unsigned long rows = (fl + 1 < FLCount) ? (_flBitmap & (~0UL << (fl + 1))) : 0;
+	if (rows == 0) {
+	  return NULL;
+	}
+	fl = BitOps::lowestBit (rows);
+	map = _slBitmap[fl];
+      }
+      sl = BitOps::lowestBit (map);
+      assert (_bins[fl][sl] != NULL);
+      return _bins[fl][sl];
+    }
+
+    /// Put a block, already coalesced, on its bin and mark it free.
+    inline void insert (void * ptr) {
+      int fl, sl;
+      mapping (getSize (ptr), fl, sl);
+      FreeObject * f = (FreeObject *) ptr;
+      f->prev = NULL;
+      f->next = _bins[fl][sl];
+      if (f->next != NULL) {
+	f->next->prev = f;
+      }
+      _bins[fl][sl] = f;
+      _slBitmap[fl] |= (1UL << sl);
+      _flBitmap |= (1UL << fl);
+      _freeBytes += getSize (ptr);
+      SuperHeap::markFree (ptr);
+    }
+
+    /// Take a free block off its bin (it is still marked free).
+    inline void remove (void * ptr) {
+      int fl, sl;
+      mapping (getSize (ptr), fl, sl);
+      FreeObject * f = (FreeObject *) ptr;
+      if (f->prev != NULL) {
+	f->prev->next = f->next;
+      } else {
+	_bins[fl][sl] = f->next;
+	if (f->next == NULL) {
+	  _slBitmap[fl] &= ~(1UL << sl);
+	  if (_slBitmap[fl] == 0) {
+	    _flBitmap &= ~(1UL << fl);
+	  }
+	}
+      }
+      if (f->next != NULL) {
+	f->next->prev = f->prev;
+      }
+      _freeBytes -= getSize (ptr);
+    }
+
+    /// Make first take in second, its successor.
+    inline static void merge (void * first, void * second) {
+      assert (SuperHeap::getNext (first) == second);
+      const size_t newSize = ((size_t) second - (size_t) first) + getSize (second);
+      SuperHeap::setSize (first, newSize);
+      SuperHeap::setPrevSize (SuperHeap::getNext (first), newSize);
+    }
+
+    /// Coalesce a block with its free neighbors and bin it. Returns
+    /// the coalesced block.
+    inline void * release (void * ptr) {
+      if (SuperHeap::isPrevFree (ptr)) {
+	void * prev = SuperHeap::getPrev (ptr);
+	remove (prev);
+	merge (prev, ptr);
+	ptr = prev;
+      }
+      void * next = SuperHeap::getNext (ptr);
+      if (SuperHeap::isFree (next)) {
+	remove (next);
+	merge (ptr, next);
+      }
+      insert (ptr);
+      return ptr;
+    }
+
+    /// The area of a free block that fills it (from the first block,
+    /// of prevSize 0, to the fence), or NULL.
+    inline static Area * getArea (void * ptr) {
+      if (!SuperHeap::isFree (ptr)
+	  || (SuperHeap::getPrevSize (ptr) != 0)
+	  || (getSize (SuperHeap::getNext (ptr)) != 0)) {
+	return NULL;
+      }
+      return (Area *) ((char *) SuperHeap::getHeader (ptr) - AreaHeaderSize);
+    }
+
+    /// Unlink an area, whose one block is off its bin, and give it back.
+    inline void removeArea (Area * a) {
+      if (a->prev != NULL) {
+	a->prev->next = a->next;
+      } else {
+	_areas = a->next;
+      }
+      if (a->next != NULL) {
+	a->next->prev = a->prev;
+      }
+      _heldBytes -= a->size;
+      Super::free (a->base);
+    }
+
+    /// Cut an in-use block down to sz bytes, if what is left over
+    /// makes a block, and free that.
+    inline void split (void * ptr, size_t sz) {
+      const size_t actualSize = getSize (ptr);
+      assert (actualSize >= sz);
+      if (actualSize - sz < sizeof(Header) + MinObjectSize) {
+	return;
+      }
+      SuperHeap::setSize (ptr, sz);
+      void * piece = (char *) ptr + sz + sizeof(Header);
+      SuperHeap::makeObject ((void *) SuperHeap::getHeader (piece), sz,
+			     actualSize - sz - sizeof(Header));
+      SuperHeap::getHeader (piece)->markPrevInUse();
+      release (piece);
+    }
+
+    /// Get an area from Super for a request of sz bytes, and return
+    /// it as one block (in use, in no bin).
+    void * addArea (size_t sz) {
+      size_t areaSize = sz + AreaOverhead;
+      if (areaSize < (size_t) AreaSize) {
+	areaSize = AreaSize;
+      }
+      areaSize = (areaSize + Alignment - 1) & ~((size_t) Alignment - 1);
+      // Super may align less (SbrkHeap, after its first object).
+      char * base = (char *) Super::malloc (areaSize + Alignment - 1);
+      if (base == NULL) {
+	return NULL;
+      }
+      Area * a = (Area *) (((size_t) base + Alignment - 1) & ~((size_t) Alignment - 1));
+      a->base = base;
+      a->size = areaSize;
+      a->prev = NULL;
+      a->next = _areas;
+      if (_areas != NULL) {
+	_areas->prev = a;
+      }
+      _areas = a;
+      _heldBytes += areaSize;
+      void * ptr = SuperHeap::makeObject ((char *) a + AreaHeaderSize, 0,
+					  areaSize - AreaOverhead);
+      SuperHeap::getHeader (ptr)->markPrevInUse();
+      // The fence: a block of size 0, whose successor marks it in use.
+      Header * fence = SuperHeap::getHeader (SuperHeap::getNext (ptr));
+      fence->setSize (0);
+      fence->markNotMmapped();
+      (fence + 1)->setPrevSize (0);
+      (fence + 1)->markPrevInUse();
+      return ptr;
+    }
+
+    /// The areas, most recent first, doubly linked so that any of them
+    /// can be given back.
+    Area * _areas;
+
+    /// The bytes in all areas, and in free blocks.
+    size_t _heldBytes;
+    size_t _freeBytes;
+
+    /// Which rows have a non-empty bin, and which bins in each row.
+    unsigned long _flBitmap;
+    unsigned long _slBitmap[FLCount];
+
+    /// The free blocks, doubly linked so that coalescing can take any
+    /// of them out of its bin.
+    FreeObject * _bins[FLCount][SLCount];
+  };
+
+
+  /**
+   * @class TLSFLeaHeap
+   * @brief LeaHeap with TLSFHeap as its big heap.
+   *
+   * As LeaHeap, but objects between the fastbins and the mmap
+   * threshold come from a TLSFHeap over Sbrk, which need not be
+   * contiguous.
+   */
+
+  template <class Sbrk, class Mmap>
+  class TLSFLeaHeap :
+    public
+      SelectMmapHeap<128 * 1024,
+		     Threshold<4096,
+			       DLSmallHeapType<TLSFHeap<Sbrk> > >,
+		     CoalesceableMmapHeap<Mmap> >
+  {};
+
+}
+
+#endif
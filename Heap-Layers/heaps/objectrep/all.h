@@ -1,5 +1,7 @@
 #include "addheap.h"
+#include "coloredheap.h"
 #include "coalesceableheap.h"
+#include "pagemapheap.h"
 #include "sizeheap.h"
 #include "sizeownerheap.h"
 
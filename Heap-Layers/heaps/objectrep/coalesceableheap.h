@@ -34,20 +34,31 @@
 #define HL_COALESCEABLEHEAP_H
 
 #include <assert.h>
+#include <stddef.h>
 
 #define MULTIPLE_HEAP_SUPPORT 0
 
 /**
  * @class RequireCoalesceable
  * @brief Provides support for coalescing objects.
+ *
+ * Every object has a header with its size and its predecessor's size
+ * (less two bits of flags), each a SizeType. The default of size_t
+ * makes a 16-byte header on 64-bit systems. A uint32_t makes it
+ * 8 bytes, and objects 8-aligned (if the source heap is), for objects
+ * under maxObjectSize (1GB). Every layer over the same memory must
+ * use the same SizeType.
  */
 
 namespace HL {
 
-template <class SuperHeap>
+template <class SuperHeap, class SizeType = size_t>
 class RequireCoalesceable : public SuperHeap {
 public:
 
+  /// The largest object size a header can hold.
+  inline static size_t maxObjectSize (void) { return Header::maxObjectSize(); }
+
   // Some thin wrappers over Header methods.
   inline static int getHeap (void * ptr)          { return Header::getHeader(ptr)->getHeap(); }
   inline static void setHeap (void * ptr, int h)  { Header::getHeader(ptr)->setHeap(h); }
@@ -71,7 +82,7 @@ public:
 
   // The Header for every object, allocated or freed.
   class Header {
-	  friend class RequireCoalesceable<SuperHeap>;
+	  friend class RequireCoalesceable<SuperHeap, SizeType>;
   public:
 
     //
@@ -92,7 +103,7 @@ public:
     inline void sanityCheck (void) {
 #ifndef NDEBUG
       int headerSize = sizeof(Header);
-      assert (headerSize <= sizeof(double));
+      assert (headerSize <= (int) (2 * sizeof(size_t)));
       assert (getSize() == getNextHeader()->getPrevSize());
       assert (isFree() == getNextHeader()->isPrevFree());
       assert (getNextHeader()->getPrev() == getObject(this));
@@ -110,8 +121,12 @@ public:
     // Get the object for a given header.
     inline static void * getObject (const Header * hd)  { return (void *) (hd + 1); }
 
-    inline void setSize (const size_t sz)    { _size = sz; }
-    inline void setPrevSize (const size_t sz){ _prevSize = sz; }
+    inline void setSize (const size_t sz)    { assert (sz <= maxObjectSize()); _size = sz; }
+    inline void setPrevSize (const size_t sz){ assert (sz <= maxObjectSize()); _prevSize = sz; }
+
+    inline static size_t maxObjectSize (void) {
+      return ((size_t) 1 << (sizeof(SizeType) * 8 - NUM_BITS_STOLEN_FROM_PREVSIZE)) - 1;
+    }
 
 //  private:
     inline size_t getPrevSize (void) const { return _prevSize; }
@@ -176,7 +191,7 @@ public:
       _currHeap (0)
 #endif
     {
-      assert (sizeof(Header) <= sizeof(double));
+      assert (sizeof(Header) <= 2 * sizeof(size_t));
     }
 
     inline Header * getNextHeader (void) const {
@@ -186,21 +201,24 @@ public:
 
 #if !(MULTIPLE_HEAP_SUPPORT) // original
 
+    // All the fields are SizeTypes, so the flags share a word with
+    // _prevSize.
+
     // Is the previous object free or in use?
     enum { PREV_INUSE = 0, PREV_FREE = 1 };
-    unsigned int _prevStatus : 1;
+    SizeType _prevStatus : 1;
 
     // Is the current object mmapped?
     enum { NOT_MMAPPED = 0, IS_MMAPPED = 1 };
-    unsigned int _isMmapped : 1;
+    SizeType _isMmapped : 1;
 
     // The size of the previous object.
     enum { NUM_BITS_STOLEN_FROM_PREVSIZE = 2 };
-    size_t _prevSize : sizeof(size_t) * 8 - NUM_BITS_STOLEN_FROM_PREVSIZE;
+    SizeType _prevSize : sizeof(SizeType) * 8 - NUM_BITS_STOLEN_FROM_PREVSIZE;
 
     // The size of the current object.
     enum { NUM_BITS_STOLEN_FROM_SIZE = 0 };
-    size_t _size; // : sizeof(size_t) * 8 - NUM_BITS_STOLEN_FROM_SIZE;
+    SizeType _size; // : sizeof(SizeType) * 8 - NUM_BITS_STOLEN_FROM_SIZE;
 
 
 #else // new support for scalability...
@@ -255,18 +273,24 @@ public:
 /**
  * @class CoalesceableHeap
  * @brief Manages coalesceable memory.
+ *
+ * @param SizeType The type of the sizes in each header (see
+ *                 RequireCoalesceable).
  */
 
-template <class SuperHeap>
-class CoalesceableHeap : public RequireCoalesceable<SuperHeap> {
+template <class SuperHeap, class SizeType = size_t>
+class CoalesceableHeap : public RequireCoalesceable<SuperHeap, SizeType> {
 public:
 
-  typedef typename RequireCoalesceable<SuperHeap>::Header Header;
+  typedef typename RequireCoalesceable<SuperHeap, SizeType>::Header Header;
 
   inline CoalesceableHeap (void)
   { }
 
   inline void * malloc (const size_t sz) {
+    if (sz > Header::maxObjectSize()) {
+      return NULL;
+    }
     void * buf = SuperHeap::malloc (sz + sizeof(Header));
     if (buf) {
       Header * header = (Header *) buf;
@@ -326,7 +350,7 @@ public:
   }
   
   inline void free (void * ptr) {
-    assert (SuperHeap::isFree(ptr));
+    assert ((RequireCoalesceable<SuperHeap, SizeType>::isFree(ptr)));
     SuperHeap::free ((Header *) ptr - 1);
   }
 
@@ -0,0 +1,181 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_COLOREDHEAP_H
+#define HL_COLOREDHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "utility/lcm.h"
+#include "utility/sassert.h"
+
+/**
+ * @class ColoredHeap
+ * @brief Spreads the objects of each size class across cache sets.
+ *
+ * Power-of-two sized buffers from a segregated heap usually start at
+ * the same offset within a cache way, so they compete for the same
+ * few cache sets. This layer shifts every object by up to
+ * NumColors - 1 cache lines so that the successive objects of a size
+ * class (a power of two) start in successive "colors", where the color
+ * of an address is its cache set (as in CAMA's set_from_addr) modulo
+ * NumColors. The shift is kept in a word just in front of the object.
+ *
+ * Every object costs a header plus up to NumColors - 1 lines, so
+ * color only the large objects, e.g.
+ *
+ * <TT>
+ *   HybridHeap<4096, SmallHeap, ColoredHeap<BigHeap> > heap;
+ * </TT>
+ *
+ * Like FreelistHeap, this layer is not thread-safe by itself.
+ *
+ * @param SuperHeap The heap to color.
+ * @param NumSets   The number of sets of the cache to color for.
+ * @param LineSize  The cache line size of that cache.
+ * @param NumColors How many colors to rotate through.
+ */
+
+namespace HL {
+
+  template <class SuperHeap,
+	    int NumSets = 64,
+	    int LineSize = 64,
+	    int NumColors = 8>
+  class ColoredHeap : public SuperHeap {
+  public:
+
+    /// Shifting by lines keeps at most a line of the superheap's alignment.
+    enum { Alignment = ((int) SuperHeap::Alignment < LineSize) ? (int) SuperHeap::Alignment : LineSize };
+
+    ColoredHeap (void)
+    {
+      sassert<((NumSets & (NumSets - 1)) == 0)> verifyNumSets;
+      sassert<((NumColors & (NumColors - 1)) == 0) && (NumColors <= NumSets)> verifyNumColors;
+      sassert<((LineSize & (LineSize - 1)) == 0)> verifyLineSize;
+      verifyNumSets = verifyNumSets;
+      verifyNumColors = verifyNumColors;
+      verifyLineSize = verifyLineSize;
+      for (int i = 0; i < NumClasses; i++) {
+	_nextColor[i] = 0;
+      }
+    }
+
+    inline void * malloc (size_t sz) {
+      char * ptr = (char *) SuperHeap::malloc (sz + HeaderSize + MaxShift);
+      return color (ptr, HeaderSize, sz);
+    }
+
+    inline void * mallocZeroed (size_t sz) {
+      char * ptr = (char *) SuperHeap::mallocZeroed (sz + HeaderSize + MaxShift);
+      return color (ptr, HeaderSize, sz);
+    }
+
+    /// Shifts by whole lines keep any alignment up to a line, so only
+    /// the header needs padding. Coarser alignments leave no room for
+    /// coloring; those objects just get a header.
+    inline void * memalign (size_t alignment, size_t sz) {
+      if (alignment <= (size_t) Alignment) {
+	return malloc (sz);
+      }
+      const size_t header = (HeaderSize + alignment - 1) & ~(alignment - 1);
+      if (alignment > (size_t) LineSize) {
+	char * ptr = (char *) SuperHeap::memalign (alignment, sz + header);
+	return (ptr == NULL) ? NULL : record (ptr, ptr + header);
+      }
+      char * ptr = (char *) SuperHeap::memalign (alignment, sz + header + MaxShift);
+      return color (ptr, header, sz);
+    }
+
+    inline void free (void * ptr) {
+      SuperHeap::free (getOriginal (ptr));
+    }
+
+    inline bool resize (void * ptr, size_t sz) {
+      return SuperHeap::resize (getOriginal (ptr), sz + getShift (ptr));
+    }
+
+    inline size_t getSize (void * ptr) {
+      return SuperHeap::getSize (getOriginal (ptr)) - getShift (ptr);
+    }
+
+    /// The cache set an address maps to.
+    static inline unsigned int getSet (const void * ptr) {
+      return (unsigned int) (((size_t) ptr / LineSize) & (NumSets - 1));
+    }
+
+  private:
+
+    enum { HeaderSize = lcm<(int) Alignment, (int) sizeof(size_t)>::value };
+    enum { MaxShift = (NumColors - 1) * LineSize };
+    enum { NumClasses = sizeof(size_t) * 8 };
+
+    static inline int getSizeClass (size_t sz) {
+      int c = 0;
+      while (sz >>= 1) {
+	c++;
+      }
+      return c;
+    }
+
+    /// Place an object of size sz, with room for a header of the
+    /// given size, so that it starts at the next color of its class.
+    inline void * color (char * ptr, size_t header, size_t sz) {
+      if (ptr == NULL) {
+	return NULL;
+      }
+      const int c = getSizeClass (sz);
+      const unsigned int wanted = _nextColor[c];
+      _nextColor[c] = (wanted + 1) & (NumColors - 1);
+      char * obj = ptr + header;
+      const unsigned int lines = (wanted - getSet (obj)) & (NumColors - 1);
+      obj += lines * LineSize;
+      assert (getSet (obj) % NumColors == wanted);
+      return record (ptr, obj);
+    }
+
+    static inline void * record (char * ptr, char * obj) {
+      ((size_t *) obj)[-1] = obj - ptr;
+      return obj;
+    }
+
+    static inline size_t getShift (void * obj) {
+      return ((size_t *) obj)[-1];
+    }
+
+    static inline void * getOriginal (void * obj) {
+      return (char *) obj - getShift (obj);
+    }
+
+    /// The color the next object of each size class gets.
+    unsigned int _nextColor[NumClasses];
+
+  };
+
+}
+
+#endif
@@ -0,0 +1,251 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_PAGEMAPHEAP_H
+#define HL_PAGEMAPHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "utility/pagemap.h"
+#include "utility/sassert.h"
+#include "utility/singleton.h"
+#include "wrappers/mallocinfo.h"
+
+/**
+ * @class PageMapHeap
+ * @brief Headerless objects whose sizes live in a global page map (BiBOP).
+ * @author Emery Berger
+ *
+ * Small requests are rounded up to their size class and carved out
+ * of ChunkSize-byte chunks that hold objects of just that one size;
+ * every page of a chunk records the object size in a PageMap, so
+ * getSize is a radix-tree lookup and objects need no header. Requests
+ * at least half a chunk in size get their own (page-rounded) chunk.
+ *
+ * Small objects are never returned to the superheap, so put a free
+ * list above this layer. Since each bin of a SegHeap is a separate
+ * instance, every instance sees just one size class and fills its
+ * chunks completely:
+ *
+ * <TT>
+ *   typedef PageMapHeap<Kingsley::size2Class, Kingsley::class2Size, 65536, MmapHeap> PMH;<BR>
+ *   KingsleyHeap<FreelistHeap<PMH>, PMH> heap;
+ * </TT>
+ *
+ * The map is shared by all instances, so getSize works for any object
+ * allocated by any PageMapHeap. A second map holds, for every page,
+ * the start of its chunk or large object, so getBounds finds the
+ * object that an interior pointer points into with two lookups.
+ *
+ * @param getSizeClass    Function to compute size class from size.
+ * @param getClassMaxSize Function to compute the largest size for a given size class.
+ * @param ChunkSize       How much memory to request from the superheap at a time.
+ * @param SuperHeap       A source of page-aligned memory, such as MmapHeap.
+ */
+
+namespace HL {
+
+  template <int (*getSizeClass) (const size_t),
+	    size_t (*getClassMaxSize) (const int),
+	    int ChunkSize,
+	    class SuperHeap>
+  class PageMapHeap : public SuperHeap {
+  public:
+
+    typedef PageMap<size_t> PageMapType;
+
+    /// Each page's chunk, or the large object that covers it.
+    typedef PageMap<char *> StartMapType;
+
+    enum { Alignment = HL::MallocInfo::Alignment };
+
+    PageMapHeap (void)
+      : _bump (NULL),
+	_remaining (0),
+	_objectSize (0)
+    {
+      sassert<(ChunkSize % PageMapType::PageSize == 0)> verifyChunkSize;
+      verifyChunkSize = verifyChunkSize;
+    }
+
+    inline void * malloc (size_t sz) {
+      const size_t objectSize = roundUp (sz);
+      if (objectSize >= ChunkSize / 2) {
+	return bigMalloc (objectSize);
+      }
+      if ((objectSize != _objectSize) || (_remaining < objectSize)) {
+	if (!refill (objectSize)) {
+	  return NULL;
+	}
+      }
+      void * ptr = _bump;
+      _bump += objectSize;
+      _remaining -= objectSize;
+      assert ((size_t) ptr % Alignment == 0);
+      return ptr;
+    }
+
+    /// Objects in a chunk are aligned to any power of two that divides
+    /// their size (chunks are page-aligned), so round the size up to
+    /// a class that is a multiple of the alignment. Alignments beyond
+    /// a page need SuperHeap::memalign.
+    inline void * memalign (size_t alignment, size_t sz) {
+      if (alignment > PageMapType::PageSize) {
+	const size_t objectSize = roundUp (sz);
+	return bigMalloc (objectSize < ChunkSize / 2 ? (size_t) ChunkSize / 2 : objectSize, alignment);
+      }
+      size_t objectSize = roundUp (sz);
+      while ((objectSize % alignment != 0) && (objectSize < ChunkSize / 2)) {
+	objectSize = roundUp (objectSize + 1);
+      }
+      return malloc (objectSize);
+    }
+
+    /// Large objects go back to the superheap. Small objects can't be
+    /// returned individually (use a free list above this layer).
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      const size_t objectSize = getSize (ptr);
+      if (objectSize >= ChunkSize / 2) {
+	getMap().set (ptr, 0);
+	getStarts().setRange (ptr, objectSize, NULL);
+	SuperHeap::free (ptr);
+      }
+    }
+
+    inline static size_t getSize (const void * ptr) {
+      return getMap().get (ptr);
+    }
+
+    /// The object that ptr (which need not be its start) falls in:
+    /// [start, end). Returns false if ptr is in no PageMapHeap chunk
+    /// or large object, or in the unused tail of a chunk. A small
+    /// object's bounds are found whether or not it is allocated.
+    static bool getBounds (const void * ptr, void *& start, void *& end) {
+      char * base = getStarts().get (ptr);
+      if (base == NULL) {
+	return false;
+      }
+      const size_t objectSize = getSize (base);
+      if (objectSize >= ChunkSize / 2) {
+	start = base;
+	end = base + objectSize;
+	return true;
+      }
+      char * s = base + ((const char *) ptr - base) / objectSize * objectSize;
+      if (s + objectSize > base + ChunkSize) {
+	return false;
+      }
+      start = s;
+      end = s + objectSize;
+      return true;
+    }
+
+  private:
+
+    static inline PageMapType& getMap (void) {
+      return singleton<PageMapType>::getInstance();
+    }
+
+    static inline StartMapType& getStarts (void) {
+      return singleton<StartMapType>::getInstance();
+    }
+
+    static inline size_t roundUp (size_t sz) {
+      size_t objectSize = getClassMaxSize (getSizeClass (sz));
+      assert (objectSize >= sz);
+      // Keep every object in a chunk aligned.
+      return (objectSize + Alignment - 1) & ~((size_t) Alignment - 1);
+    }
+
+    NO_INLINE void * bigMalloc (size_t objectSize) {
+      return record (SuperHeap::malloc (pageRound (objectSize)), objectSize);
+    }
+
+    NO_INLINE void * bigMalloc (size_t objectSize, size_t alignment) {
+      return record (SuperHeap::memalign (alignment, pageRound (objectSize)), objectSize);
+    }
+
+    static inline size_t pageRound (size_t sz) {
+      return (sz + PageMapType::PageSize - 1) & ~((size_t) PageMapType::PageSize - 1);
+    }
+
+    /// Note the size of a freshly allocated large object.
+    inline void * record (void * ptr, size_t objectSize) {
+      if (ptr == NULL) {
+	return NULL;
+      }
+      assert ((size_t) ptr % PageMapType::PageSize == 0);
+      // Only the first page holds the size; getBounds reaches it
+      // from any other page through the start map.
+      if (!getMap().set (ptr, objectSize)
+	  || !getStarts().setRange (ptr, objectSize, (char *) ptr)) {
+	// Clear what was set before the failure.
+	getMap().set (ptr, 0);
+	getStarts().setRange (ptr, objectSize, NULL);
+	SuperHeap::free (ptr);
+	return NULL;
+      }
+      return ptr;
+    }
+
+    /// Start a new chunk for objects of the given size.
+    NO_INLINE bool refill (size_t objectSize) {
+      char * chunk = (char *) SuperHeap::malloc (ChunkSize);
+      if (chunk == NULL) {
+	return false;
+      }
+      assert ((size_t) chunk % PageMapType::PageSize == 0);
+      if (!getMap().setRange (chunk, ChunkSize, objectSize)
+	  || !getStarts().setRange (chunk, ChunkSize, chunk)) {
+	// As in record, clear what was set before the failure.
+	getMap().setRange (chunk, ChunkSize, 0);
+	getStarts().setRange (chunk, ChunkSize, NULL);
+	SuperHeap::free (chunk);
+	return false;
+      }
+      _bump = chunk;
+      _remaining = ChunkSize;
+      _objectSize = objectSize;
+      return true;
+    }
+
+    /// The bump pointer into the current chunk.
+    char * _bump;
+
+    /// How much space remains in the current chunk.
+    size_t _remaining;
+
+    /// The size of every object in the current chunk.
+    size_t _objectSize;
+  };
+
+}
+
+#endif
@@ -43,15 +43,23 @@ namespace HL {
   /**
    * @class SizeHeap
    * @brief Allocates extra room for the size of an object.
+   *
+   * The size is a SizeType in a header of HeaderAlignment bytes, which
+   * objects are then aligned to (if the superheap's are). The default
+   * is a size_t in MallocInfo::Alignment bytes; a uint32_t in 8 bytes
+   * halves that on 64-bit systems, for objects under 4GB that do not
+   * need 16-byte alignment.
    */
   
-  template <class SuperHeap>
+  template <class SuperHeap,
+	    class SizeType = size_t,
+	    int HeaderAlignment = HL::MallocInfo::Alignment>
   class SizeHeap : public SuperHeap {
     
   private:
     union freeObject {
-      size_t _sz;
-      char _buf[HL::MallocInfo::Alignment];
+      SizeType _sz;
+      char _buf[HeaderAlignment];
     };
     
   public:
@@ -62,21 +70,80 @@ namespace HL {
     virtual ~SizeHeap (void) {}
     
     inline void * malloc (size_t sz) {
+      if (!fits (sz)) {
+	return NULL;
+      }
       freeObject * p = (freeObject *) SuperHeap::malloc (sz + sizeof(freeObject));
+      if (p == NULL) {
+	return NULL;
+      }
+      p->_sz = sz;
+      return (void *) (p + 1);
+    }
+
+    inline void * mallocZeroed (size_t sz) {
+      if (!fits (sz)) {
+	return NULL;
+      }
+      freeObject * p = (freeObject *) SuperHeap::mallocZeroed (sz + sizeof(freeObject));
+      if (p == NULL) {
+	return NULL;
+      }
       p->_sz = sz;
       return (void *) (p + 1);
     }
     
+    /// Allocates as for malloc (sz + alignment) and slides the object
+    /// up to an aligned address, with its header just before it; the
+    /// header gives the room left from there to the end (at least sz).
+    /// The bytes skipped stay with the object, so the superheap must
+    /// take back a pointer into its objects (as free lists and zones
+    /// do). The alignment is a power of two.
+    inline void * memalign (size_t alignment, size_t sz) {
+      if ((sz + alignment < sz) || !fits (sz + alignment)) {
+	return NULL;
+      }
+      char * p = (char *) SuperHeap::malloc (sz + alignment + sizeof(freeObject));
+      if (p == NULL) {
+	return NULL;
+      }
+      char * end = p + sizeof(freeObject) + sz + alignment;
+      char * ptr = (char *) (((size_t) p + sizeof(freeObject) + alignment - 1) & ~(alignment - 1));
+      setSize (ptr, end - ptr);
+      return (void *) ptr;
+    }
+
     inline void free (void * ptr) {
       SuperHeap::free (getHeader(ptr));
     }
+
+    inline bool resize (void * ptr, size_t sz) {
+      if (!fits (sz)) {
+	return false;
+      }
+      if (!SuperHeap::resize (getHeader(ptr), sz + sizeof(freeObject))) {
+	return false;
+      }
+      setSize (ptr, sz);
+      return true;
+    }
     
     inline static size_t getSize (const void * ptr) {
       size_t size = getHeader(ptr)->_sz;
       return size;
     }
+
+    /// The header records the size asked for, and getSize reports it.
+    inline static size_t goodSize (size_t sz) {
+      return sz;
+    }
     
   private:
+
+    /// Whether a header can hold sz (and sz plus the header doesn't overflow).
+    inline static bool fits (size_t sz) {
+      return ((size_t) (SizeType) sz == sz) && (sz + sizeof(freeObject) > sz);
+    }
     
     inline static void setSize (void * ptr, size_t sz) {
       getHeader(ptr)->_sz = sz;
@@ -1,5 +1,7 @@
 #include "bumpalloc.h"
+#include "hugepageheap.h"
 #include "nestedheap.h"
+#include "reapheap.h"
 #include "xallocheap.h"
 #include "zoneheap.h"
 
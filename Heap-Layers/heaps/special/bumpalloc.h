@@ -31,12 +31,17 @@
  * @class BumpAlloc
  * @brief Obtains memory in chunks and bumps a pointer through the chunks.
  * @author Emery Berger <http://www.cs.umass.edu/~emery>
+ *
+ * The first chunk is ChunkSize bytes, and each one after that twice
+ * the last, up to MaxChunkSize (by default, all are ChunkSize), so an
+ * arena that turns out to be big needs few trips to the superheap.
  */
 
 namespace HL {
 
   template <int ChunkSize,
-	    class Super>
+	    class Super,
+	    int MaxChunkSize = ChunkSize>
   class BumpAlloc : public Super {
   public:
 
@@ -44,39 +49,75 @@ namespace HL {
 
     BumpAlloc (void)
       : _bump (NULL),
-	_remaining (0)
+	_last (NULL),
+	_remaining (0),
+	_chunkSize (ChunkSize)
     {}
 
     inline void * malloc (size_t sz) {
       // If there's not enough space left to fulfill this request, get
       // another chunk.
       if (_remaining < sz) {
-	refill(sz);
+	if (!refill(sz)) {
+	  return NULL;
+	}
       }
       char * old = _bump;
       _bump += sz;
       _remaining -= sz;
+      _last = old;
       return old;
     }
 
     /// Free is disabled (we only bump, never reclaim).
     inline bool free (void *) { return false; }
 
+    /// Grow or shrink the most recent object in place.
+    inline bool resize (void * ptr, size_t sz) {
+      if ((ptr == NULL) || (ptr != _last)) {
+	return false;
+      }
+      const size_t available = (size_t) (_bump - _last) + _remaining;
+      if (sz > available) {
+	return false;
+      }
+      _bump = _last + sz;
+      _remaining = available - sz;
+      return true;
+    }
+
   private:
 
     /// The bump pointer.
     char * _bump;
 
+    /// The last object allocated (the only one resize can change).
+    char * _last;
+
     /// How much space remains in the current chunk.
     size_t _remaining;
 
+    /// The size of the next chunk.
+    size_t _chunkSize;
+
     // Get another chunk.
-    void refill (size_t sz) {
-      if (sz < ChunkSize) {
-	sz = ChunkSize;
+    bool refill (size_t sz) {
+      if (sz < _chunkSize) {
+	sz = _chunkSize;
       }
-      _bump = (char *) Super::malloc (sz);
+      char * buf = (char *) Super::malloc (sz);
+      if (buf == NULL) {
+	return false;
+      }
+      _bump = buf;
       _remaining = sz;
+      if (_chunkSize < (size_t) MaxChunkSize) {
+	_chunkSize *= 2;
+	if (_chunkSize > (size_t) MaxChunkSize) {
+	  _chunkSize = MaxChunkSize;
+	}
+      }
+      return true;
     }
 
   };
@@ -0,0 +1,111 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_HUGEPAGEHEAP_H
+#define HL_HUGEPAGEHEAP_H
+
+#include <stddef.h>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class HugePageHeap
+ * @brief Hands out big chunks on huge-page boundaries, optionally prefaulted.
+ *
+ * Meant to sit between a chunk-carving layer (BumpAlloc, ChunkHeap,
+ * ZoneHeap) and a source heap with memalign, such as MmapHeap.
+ * Requests of a huge page or more are rounded up to whole huge pages,
+ * aligned to one, and marked MADV_HUGEPAGE, so transparent huge pages
+ * can back them from the first touch. Smaller requests pass through.
+ *
+ * With Prefault, every chunk is faulted in before it is returned
+ * (MADV_POPULATE_WRITE where the kernel has it, otherwise by touching
+ * each page), so a latency-sensitive arena takes its page faults up
+ * front rather than while it serves requests.
+ *
+ * Example: BumpAlloc<65536, HugePageHeap<MmapHeap>, 8388608>
+ * doubles its chunks from 64K up to 8MB, the bigger ones on huge pages.
+ */
+
+namespace HL {
+
+  template <class SuperHeap, bool Prefault = false>
+  class HugePageHeap : public SuperHeap {
+  public:
+
+    enum { HugePageSize = 2 * 1024 * 1024 };
+
+    enum { Alignment = SuperHeap::Alignment };
+
+    inline void * malloc (size_t sz) {
+      void * ptr;
+      if (sz < (size_t) HugePageSize) {
+	ptr = SuperHeap::malloc (sz);
+      } else {
+	const size_t rounded = (sz + HugePageSize - 1) & ~((size_t) HugePageSize - 1);
+	if (rounded < sz) {
+	  // Overflow.
+	  return NULL;
+	}
+	sz = rounded;
+	ptr = SuperHeap::memalign (HugePageSize, sz);
+#if defined(MADV_HUGEPAGE)
+	if (ptr != NULL) {
+	  madvise (ptr, sz, MADV_HUGEPAGE);
+	}
+#endif
+      }
+      if (Prefault && (ptr != NULL)) {
+	prefault (ptr, sz);
+      }
+      return ptr;
+    }
+
+  private:
+
+    static void prefault (void * ptr, size_t sz) {
+#if defined(MADV_POPULATE_WRITE)
+      if (((size_t) ptr % MmapWrapper::Size == 0) &&
+	  (madvise (ptr, sz, MADV_POPULATE_WRITE) == 0)) {
+	return;
+      }
+#endif
+      // Write each page (with what it already holds).
+      volatile char * p = (volatile char *) ptr;
+      for (size_t i = 0; i < sz; i += MmapWrapper::Size) {
+	p[i] = p[i];
+      }
+    }
+
+  };
+
+}
+
+#endif
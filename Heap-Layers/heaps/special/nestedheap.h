@@ -28,122 +28,231 @@
 #define _NESTEDHEAP_H_
 
 #include <assert.h>
+#include <stddef.h>
+
+#include "locks/spinlock.h"
+#include "utility/align.h"
+#include "utility/guard.h"
+#include "utility/lockfreesllist.h"
+#include "wrappers/mallocinfo.h"
 
 /**
  * @class NestedHeap
  * @brief Hierarchical heaps.
  * @author Emery Berger <http://www.cs.umass.edu/~emery>
+ *
+ * Each NestedHeap is a region that bumps objects out of chunks and
+ * frees them all at once when it is cleared or destroyed. Regions form
+ * a tree (with addChild), and clearing one clears its whole subtree.
+ *
+ * Every chunk comes from the root's SuperHeap, which must therefore be
+ * thread-safe (as MmapHeap is). Clearing a subtree splices the chunk
+ * lists of its regions together and pushes them onto the root's
+ * lock-free chunk cache with one compare-and-swap, so it takes time in
+ * the number of regions, not of chunks. Every region in the tree takes
+ * its chunks from that cache first. Children of one parent can thus
+ * allocate at the same time, one thread each, and can be added and
+ * destroyed at the same time (the child list has a lock). A region
+ * itself is not thread-safe, and a subtree must not be cleared while
+ * other threads allocate in it.
+ *
+ * Objects larger than a chunk get chunks of their own, which go back to
+ * SuperHeap when cleared. The cached chunks go back when the root is
+ * destroyed. A region must be destroyed before its parent.
  */
 
 namespace HL {
 
-template <class SuperHeap>
+template <class SuperHeap, size_t ChunkSize = 65536>
 class NestedHeap : public SuperHeap {
 public:
 
+  /// Objects are bumped along at MallocInfo::Alignment, whatever the
+  /// chunks themselves are aligned to.
+  enum { Alignment = ((int) SuperHeap::Alignment < (int) HL::MallocInfo::Alignment)
+	 ? (int) SuperHeap::Alignment : (int) HL::MallocInfo::Alignment };
+
   NestedHeap (void)
     : parent (NULL),
       child (NULL),
       prev (NULL),
-      next (NULL)
+      next (NULL),
+      root (this),
+      cursor (NULL),
+      limit (NULL),
+      chunks (NULL),
+      lastChunk (NULL),
+      bigChunks (NULL)
   {
   }
 
   ~NestedHeap (void)
   {
+    assert (child == NULL);
     clear();
     if (parent != NULL) {
       parent->removeChild (this);
     }
-    removeSibling (this);
+    if (root == this) {
+      // Give back the chunks the tree has cached.
+      void * ch;
+      while ((ch = cache.get()) != NULL) {
+	SuperHeap::free (ch);
+      }
+    }
   }
 
-  inline void clear (void) {
-
-    // Clear this heap.
-    SuperHeap::clear();
-
-#if 0
-    //
-    // Iterate through all children and delete them.
-    //
-
-    if (child != NULL) {
-      NestedHeap<SuperHeap> * nextChild = child->next;
-      while (child != NULL) {
-	NestedHeap<SuperHeap> * prevChild = child->prev;
-	delete child;
-	child = prevChild;
-      }
-      child = nextChild;
-      while (child != NULL) {
-	nextChild = child->next;
-	delete child;
-	child = nextChild;
-      }
+  inline void * malloc (size_t sz) {
+    sz = HL::align<HL::MallocInfo::Alignment>(sz);
+    if ((size_t) (limit - cursor) < sz) {
+      return slowMalloc (sz);
     }
-    assert (child == NULL);
+    void * ptr = cursor;
+    cursor += sz;
+    assert ((size_t) ptr % Alignment == 0);
+    return ptr;
+  }
 
-#else // clear all the children.
+  /// Objects are only freed by clear.
+  inline void free (void *) {}
 
-    NestedHeap<SuperHeap> * ch = child;
-    while (ch != NULL) {
-      NestedHeap<SuperHeap> * nextChild = ch->next;
-      ch->clear();
-      ch = nextChild;
+  /// Frees every object in this region and in all its descendants.
+  inline void clear (void) {
+    Chunk * first = NULL;
+    Chunk * last = NULL;
+    collect (first, last);
+    if (first != NULL) {
+      root->cache.insertList (first, last);
     }
-#endif
-
   }
 
-  void addChild (NestedHeap<SuperHeap> * ch)
+  /// Makes ch (an empty region, with no children) a child of this one.
+  void addChild (NestedHeap * ch)
   {
-    if (child == NULL) {
-      child = ch;
-      child->prev = NULL;
-      child->next = NULL;
-    } else {
-      assert (child->prev == NULL);
-      assert (ch->next == NULL);
-      ch->prev = NULL;
-      ch->next = child;
+    assert (ch->parent == NULL);
+    assert (ch->child == NULL);
+    assert ((ch->chunks == NULL) && (ch->bigChunks == NULL));
+    assert (ch->cache.peek() == NULL);
+    Guard<SpinLockType> l (childLock);
+    ch->parent = this;
+    ch->root = root;
+    ch->prev = NULL;
+    ch->next = child;
+    if (child != NULL) {
       child->prev = ch;
-      child = ch;
     }
-    child->parent = this;
+    child = ch;
   }
 
 private:
 
-  void removeChild (NestedHeap<SuperHeap> * ch)
+  NestedHeap (const NestedHeap&);
+  NestedHeap& operator=(const NestedHeap&);
+
+  class Chunk {
+  public:
+    Chunk * next;
+  };
+
+  /// Objects start this far into a chunk, so they stay aligned.
+  enum { ChunkHeaderSize =
+	 (sizeof(Chunk) + HL::MallocInfo::Alignment - 1) & ~(HL::MallocInfo::Alignment - 1) };
+
+  /// Gets a new chunk (from the cache, if it has one) for sz bytes.
+  void * slowMalloc (size_t sz)
   {
-    assert (ch != NULL);
-    if (child == ch) {
-      if (ch->prev) {
-	child = ch->prev;
-      } else if (ch->next) {
-	child = ch->next;
-      } else {
-	child = NULL;
+    if (sz > ChunkSize - ChunkHeaderSize) {
+      // Too big to share a chunk.
+      Chunk * c = (Chunk *) root->SuperHeap::malloc (ChunkHeaderSize + sz);
+      if (c == NULL) {
+	return NULL;
+      }
+      c->next = bigChunks;
+      bigChunks = c;
+      return (char *) c + ChunkHeaderSize;
+    }
+    Chunk * c = (Chunk *) root->cache.get();
+    if (c == NULL) {
+      c = (Chunk *) root->SuperHeap::malloc (ChunkSize);
+      if (c == NULL) {
+	return NULL;
       }
     }
-    removeSibling (ch);
+    c->next = chunks;
+    chunks = c;
+    if (lastChunk == NULL) {
+      lastChunk = c;
+    }
+    cursor = (char *) c + ChunkHeaderSize;
+    limit = (char *) c + ChunkSize;
+    void * ptr = cursor;
+    cursor += sz;
+    return ptr;
   }
 
-  inline static void removeSibling (NestedHeap<SuperHeap> * sib)
+  /// Empties this subtree, splicing its chunks onto first..last.
+  void collect (Chunk *& first, Chunk *& last)
   {
-    if (sib->prev) {
-      sib->prev->next = sib->next;
+    while (bigChunks != NULL) {
+      Chunk * c = bigChunks;
+      bigChunks = c->next;
+      root->SuperHeap::free (c);
     }
-    if (sib->next) {
-      sib->next->prev = sib->prev;
+    if (chunks != NULL) {
+      lastChunk->next = first;
+      first = chunks;
+      if (last == NULL) {
+	last = lastChunk;
+      }
+      chunks = lastChunk = NULL;
+    }
+    cursor = limit = NULL;
+    Guard<SpinLockType> l (childLock);
+    for (NestedHeap * ch = child; ch != NULL; ch = ch->next) {
+      ch->collect (first, last);
     }
   }
 
-  NestedHeap<SuperHeap> * parent;
-  NestedHeap<SuperHeap> * child;
-  NestedHeap<SuperHeap> * prev;
-  NestedHeap<SuperHeap> * next;
+  void removeChild (NestedHeap * ch)
+  {
+    assert (ch != NULL);
+    Guard<SpinLockType> l (childLock);
+    if (child == ch) {
+      child = ch->next;
+    }
+    if (ch->prev) {
+      ch->prev->next = ch->next;
+    }
+    if (ch->next) {
+      ch->next->prev = ch->prev;
+    }
+    ch->parent = ch->prev = ch->next = NULL;
+  }
+
+  NestedHeap * parent;
+  NestedHeap * child;
+  NestedHeap * prev;
+  NestedHeap * next;
+
+  /// The top of the tree, whose SuperHeap and cache everyone uses.
+  NestedHeap * root;
+
+  /// The unused part of the current chunk.
+  char * cursor;
+  char * limit;
+
+  /// The standard chunks, newest first, and the oldest.
+  Chunk * chunks;
+  Chunk * lastChunk;
+
+  /// The chunks of objects too big for a standard one.
+  Chunk * bigChunks;
+
+  /// Guards the child list.
+  SpinLockType childLock;
+
+  /// Standard chunks freed anywhere in the tree (used at the root).
+  LockFreeSLList cache;
 
 };
 
@@ -32,6 +32,8 @@
 
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <new>
 
 #include "utility/align.h"
@@ -40,15 +42,65 @@
 /**
  * @class ObstackHeap
  * @brief Implements obstack functionality (as in the GNU obstack library).
+ *
+ * Each new chunk is twice the size of the last (from ChunkSize up to
+ * GrowthLimit times that), and an object grown past the end of its
+ * chunk moves to one at least twice its size, so building an object
+ * of n bytes copies O(n) bytes in all, however it is grown. If
+ * ResizeChunks is true, the chunk is first grown in place with
+ * SuperHeap::resize (which for MmapHeap is an mremap that succeeds
+ * when nothing is mapped just past the chunk), and the object does
+ * not move at all; failing that, a chunk holding nothing but the
+ * object is moved with SuperHeap::remap (mremap, for MmapHeap), which
+ * remaps its pages rather than copying them.
+ *
+ * finish ends the current object and returns it where it was built.
+ *
+ * @param ChunkSize The size of the first chunk.
+ * @param SuperHeap The source of chunks.
+ * @param ResizeChunks Whether SuperHeap has resize and remap to try first.
  */
 
 namespace HL {
 
-  template <int ChunkSize, class SuperHeap>
+  /// Grows an obstack chunk in place, if the source heap can.
+  template <bool ResizeChunks>
+  class ObstackChunkResizer {
+  public:
+    template <class Heap>
+    static inline bool resize (Heap&, void *, size_t) {
+      return false;
+    }
+    template <class Heap>
+    static inline void * remap (Heap&, void *, size_t) {
+      return NULL;
+    }
+  };
+
+  template <>
+  class ObstackChunkResizer<true> {
+  public:
+    template <class Heap>
+    static inline bool resize (Heap& h, void * ptr, size_t sz) {
+      return h.resize (ptr, sz);
+    }
+    template <class Heap>
+    static inline void * remap (Heap& h, void * ptr, size_t sz) {
+      return h.remap (ptr, sz);
+    }
+  };
+
+  template <int ChunkSize, class SuperHeap, bool ResizeChunks = false>
   class ObstackHeap : public SuperHeap {
   public:
 
+    enum { Alignment = HL::MallocInfo::Alignment };
+
+    /// How many times ChunkSize chunks grow to, at most.
+    enum { GrowthLimit = 64 };
+
     ObstackHeap (void)
+      : nextChunkSize (ChunkSize)
     {
       // Get one chunk and set the current position marker.
       currentChunk = makeChunk (NULL, ChunkSize);
@@ -74,19 +126,13 @@ namespace HL {
       // If we've grown beyond the confines of this chunk,
       // get a new one.
       assert (isValid());
-      if ((int) ((char *) currentChunk->getLimit() - (char *) nextPos) < sz) {
-	ChunkHeader * newCurrent = copyToNew(sz);
-	if (newCurrent == NULL)
+      if (room() < sz) {
+	if (!extend (sz)) {
 	  return NULL;
-#if 0
-	// Now delete the previous chunk if this was the only object in it.
-	if (deleteChunk != NULL) {
-	  SuperHeap::free (deleteChunk);
 	}
-#endif
 	assert (isValid());
       }
-      assert (((int) ((char *) currentChunk->getLimit() - (char *) nextPos) >= sz));
+      assert (room() >= sz);
       assert ((char *) (sz + nextPos) <= currentChunk->getLimit());
       // Bump the pointer for the next object.
       void * prevNextPos = nextPos;
@@ -95,6 +141,28 @@ namespace HL {
       return prevNextPos;
     }
 
+    /// Add one byte to the current object.
+    inline bool grow1 (char c) {
+      if (nextPos < currentChunk->getLimit()) {
+	*nextPos++ = c;
+	return true;
+      }
+      char * ptr = (char *) grow (1);
+      if (ptr == NULL) {
+	return false;
+      }
+      *ptr = c;
+      return true;
+    }
+
+    /// End the current object, and return it (without copying it).
+    inline void * finish (void) {
+      assert (isValid());
+      void * ptr = currentBase;
+      finalize();
+      return ptr;
+    }
+
 
     inline void * malloc (size_t sz) {
       assert (isValid());
@@ -104,16 +172,17 @@ namespace HL {
       //sz = align(sz > 0 ? sz : 1);
       // If this object can't fit in the current chunk,
       // get another one.
-      if ((int) ((char *) currentChunk->getLimit() - (char *) nextPos) < sz) {
+      if (room() < sz) {
 	// Allocate a chunk that's large enough to hold the requested size.
-	currentChunk = makeChunk (currentChunk, sz);
-	if (currentChunk == NULL) {
+	ChunkHeader * newChunk = makeChunk (currentChunk, sz);
+	if (newChunk == NULL) {
 	  return NULL;
 	}
+	currentChunk = newChunk;
 	currentBase = nextPos = (char *) (currentChunk + 1);
 	assert (isValid());
       }
-      assert (((int) ((char *) currentChunk->getLimit() - (char *) nextPos) >= sz));
+      assert (room() >= sz);
       assert ((char *) (sz + nextPos) <= currentChunk->getLimit());
       // Bump the pointers forward.
       currentBase = nextPos;
@@ -147,6 +216,7 @@ namespace HL {
 	  abort();
 	} else {
 	  // Get one chunk.
+	  nextChunkSize = ChunkSize;
 	  currentChunk = makeChunk (NULL, ChunkSize);
 	  currentBase = nextPos = (char *) (currentChunk + 1);
 	  assert (isValid());
@@ -160,10 +230,18 @@ namespace HL {
       return currentBase;
     }
 
+    /// The size of the current object, so far.
+    inline size_t getObjectSize (void) {
+      return objectSize();
+    }
+
 
     inline void finalize (void) {
       assert (isValid());
-      nextPos = (char *) HL::align<HL::MallocInfo::Alignment>((int) nextPos);
+      nextPos = (char *) HL::align<Alignment>((size_t) nextPos);
+      if (nextPos > currentChunk->getLimit()) {
+	nextPos = currentChunk->getLimit();
+      }
       currentBase = nextPos;
       assert (isValid());
     }
@@ -172,10 +250,14 @@ namespace HL {
   private:
 
 
-    inline int objectSize (void) {
-      int diff = (int) (nextPos - currentBase);
-      assert (diff >= 0);
-      return diff;
+    inline size_t objectSize (void) {
+      assert (nextPos >= currentBase);
+      return (size_t) (nextPos - currentBase);
+    }
+
+    // The space left in the current chunk.
+    inline size_t room (void) {
+      return (size_t) (currentChunk->getLimit() - nextPos);
     }
 
 
@@ -211,6 +293,9 @@ namespace HL {
       // Return the end of the current chunk.
       inline char * getLimit (void) { return _pastEnd; }
 
+      // The chunk now has sz bytes past the header.
+      inline void setSize (size_t sz) { _pastEnd = (char *) (this + 1) + sz; }
+
       // Return the previous chunk.
       inline ChunkHeader * getPrevChunk (void) { return _prevChunk; }
 
@@ -225,39 +310,75 @@ namespace HL {
 
     // Make a new chunk of at least sz bytes.
     inline ChunkHeader * makeChunk (ChunkHeader * ch, size_t sz) {
-      // Round up the allocation size to at least one chunk.
+      // Round up the allocation size to at least the next chunk size.
+      const size_t minSize = nextChunkSize - sizeof(ChunkHeader);
       size_t allocSize
-	= HL::align<sizeof(double)>((sz > ChunkSize - sizeof(ChunkHeader)) ? sz : ChunkSize - sizeof(ChunkHeader));
+	= HL::align<Alignment>((sz > minSize) ? sz : minSize);
       // Make a new chunk.
-      ChunkHeader * newChunk 
-	= new (SuperHeap::malloc (sizeof(ChunkHeader) + allocSize)) ChunkHeader (ch, allocSize);
+      void * ptr = SuperHeap::malloc (sizeof(ChunkHeader) + allocSize);
+      if (ptr == NULL) {
+	return NULL;
+      }
+      ChunkHeader * newChunk = new (ptr) ChunkHeader (ch, allocSize);
+      // Make the next one bigger.
+      if (nextChunkSize < (size_t) ChunkSize * GrowthLimit) {
+	nextChunkSize *= 2;
+      }
       return newChunk;
     }
 
 
-    // Copy the current object to a new chunk.
-    // sz = the minimum amount of extra space we need.
+    // Make room for sz more bytes of the current object.
+    inline bool extend (size_t sz) {
+      const size_t objSize = objectSize();
+      // At least double the object's room, so it is moved O(log n) times.
+      const size_t newSize = 2 * (objSize + sz);
+      char * const start = (char *) (currentChunk + 1);
+      const size_t used = (size_t) (currentBase - start);
+      const size_t oldChunkSize = currentChunk->getLimit() - start;
+      size_t chunkSize = HL::align<Alignment>(used + newSize);
+      if (chunkSize < 2 * oldChunkSize) {
+	chunkSize = 2 * oldChunkSize;
+      }
+      if (ObstackChunkResizer<ResizeChunks>::resize (static_cast<SuperHeap&>(*this),
+						      currentChunk,
+						      sizeof(ChunkHeader) + chunkSize)) {
+	currentChunk->setSize (chunkSize);
+	return true;
+      }
+      // If the object is all that's in the chunk, the chunk can move
+      // (and mremap moves its pages without copying them).
+      if (used == 0) {
+	void * ptr
+	  = ObstackChunkResizer<ResizeChunks>::remap (static_cast<SuperHeap&>(*this),
+						      currentChunk,
+						      sizeof(ChunkHeader) + chunkSize);
+	if (ptr != NULL) {
+	  currentChunk = (ChunkHeader *) ptr;
+	  currentChunk->setSize (chunkSize);
+	  currentBase = (char *) (currentChunk + 1);
+	  nextPos = currentBase + objSize;
+	  return true;
+	}
+      }
+      return (copyToNew (newSize) != NULL);
+    }
+
+
+    // Copy the current object to a new chunk, of at least sz bytes.
     inline ChunkHeader * copyToNew (size_t sz) {
-      size_t obj_size = objectSize();
-      size_t new_size = obj_size + sz + (obj_size >> 3) + 100;
-      //size_t new_size = 2 * (obj_size + sz);
-      ChunkHeader * newChunk;
-#if 0
+      const size_t obj_size = objectSize();
       // This variable will hold the chunk to be deleted (if any).
       ChunkHeader * deleteChunk = NULL;
+      ChunkHeader * prev = currentChunk;
       // If this object was the only one in the chunk,
       // link back past this chunk.
       if (currentBase == (char *) (currentChunk + 1)) {
-	newChunk = makeChunk (currentChunk->getPrevChunk(), new_size);
+	prev = currentChunk->getPrevChunk();
 	deleteChunk = currentChunk;
-      } else {
-	newChunk = makeChunk (currentChunk, new_size);
       }
-#else
-      newChunk = makeChunk (currentChunk, new_size);
-#endif
+      ChunkHeader * newChunk = makeChunk (prev, sz);
       if (newChunk == NULL) {
-	currentChunk = NULL;
 	return NULL;
       }
       // Copy the current object to the new chunk.
@@ -265,11 +386,9 @@ namespace HL {
       currentChunk = newChunk;
       currentBase = (char *) (currentChunk + 1);
       nextPos = currentBase + obj_size;
-#if 0
       if (deleteChunk != NULL) {
 	SuperHeap::free (deleteChunk);
       }
-#endif
       return currentChunk;
     }
 
@@ -283,6 +402,9 @@ namespace HL {
     // My current chunk.
     ChunkHeader * currentChunk;
 
+    // The size of the next chunk, with its header.
+    size_t nextChunkSize;
+
   };
 
 #if 0
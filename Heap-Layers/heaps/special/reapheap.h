@@ -0,0 +1,158 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/**
+ * @class ReapHeap
+ * @brief A region that also supports individual frees (a "reap").
+ *
+ * Objects are bumped out of the arenas of a ZoneHeap, each behind a
+ * header that holds its size class. Freed objects go on a free list
+ * per class, and malloc takes from those lists before bumping, so a
+ * region whose objects are partly freed early stays bounded by its
+ * live data rather than by everything it ever allocated. freeAll
+ * frees the whole region in one call, and the arenas are kept for
+ * what follows (see ZoneHeap::reset).
+ *
+ * Classes are multiples of MallocInfo::Alignment up to MaxExact
+ * bytes, and powers of two beyond that.
+ *
+ * @see Berger, Zorn and McKinley, "Reconsidering Custom Memory
+ * Allocation", OOPSLA 2002.
+ */
+
+#ifndef HL_REAPHEAP_H
+#define HL_REAPHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "heaps/special/zoneheap.h"
+#include "utility/align.h"
+#include "utility/freesllist.h"
+#include "wrappers/mallocinfo.h"
+
+namespace HL {
+
+  template <class SuperHeap, size_t ChunkSize>
+  class ReapHeap : public ZoneHeap<SuperHeap, ChunkSize> {
+  public:
+
+    typedef ZoneHeap<SuperHeap, ChunkSize> Zone;
+
+    enum { Alignment = Zone::Alignment };
+
+    inline void * malloc (size_t sz) {
+      if (sz > MaxObjectSize) {
+	return NULL;
+      }
+      const int c = getSizeClass (sz);
+      Header * h = (Header *) _free[c].get();
+      if (h == NULL) {
+	h = (Header *) Zone::malloc (getClassSize (c) + sizeof(Header));
+	if (h == NULL) {
+	  return NULL;
+	}
+      }
+      // (The free list's link overwrote the class.)
+      h->sizeClass = c;
+      void * ptr = (void *) (h + 1);
+      assert ((size_t) ptr % Alignment == 0);
+      return ptr;
+    }
+
+    /// Puts the object on its class's free list, for reuse in this region.
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      Header * h = (Header *) ptr - 1;
+      assert (h->sizeClass < (size_t) NumClasses);
+      _free[h->sizeClass].insert (h);
+    }
+
+    inline size_t getSize (void * ptr) {
+      return getClassSize ((int) ((Header *) ptr - 1)->sizeClass);
+    }
+
+    /// Frees every object in the region at once.
+    void freeAll (void) {
+      for (int i = 0; i < NumClasses; i++) {
+	_free[i].clear();
+      }
+      Zone::reset();
+    }
+
+  private:
+
+    /// The zone's own bookkeeping would miss freed objects.
+    void reset (void);
+    typename Zone::Mark mark (void) const;
+    void rollback (const typename Zone::Mark&);
+    bool resize (void *, size_t);
+
+    /// The zone's rounding, and so the step between exact classes.
+    enum { Granularity = HL::MallocInfo::Alignment };
+
+    /// Keeps the object after it aligned.
+    class Header {
+    public:
+      size_t sizeClass;
+      char _pad[Granularity - sizeof(size_t)];
+    };
+
+    enum { MaxExact = 1024 };
+    enum { NumExactClasses = MaxExact / Granularity };
+    enum { MaxPowerBits = (sizeof(size_t) == 4) ? 30 : 40 };
+    enum { NumClasses = NumExactClasses + (MaxPowerBits - 10) };
+
+    static const size_t MaxObjectSize = (size_t) 1 << MaxPowerBits;
+
+    static inline int getSizeClass (size_t sz) {
+      if (sz <= MaxExact) {
+	return (sz == 0) ? 0 : (int) ((sz + Granularity - 1) / Granularity) - 1;
+      }
+      int c = NumExactClasses;
+      size_t classSize = MaxExact * 2;
+      while (classSize < sz) {
+	classSize <<= 1;
+	c++;
+      }
+      return c;
+    }
+
+    static inline size_t getClassSize (int c) {
+      if (c < NumExactClasses) {
+	return (size_t) (c + 1) * Granularity;
+      }
+      return (size_t) MaxExact << (c - NumExactClasses + 1);
+    }
+
+    FreeSLList _free[NumClasses];
+  };
+
+}
+
+#endif
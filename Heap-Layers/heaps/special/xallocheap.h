@@ -27,6 +27,31 @@
 #ifndef HL_XALLOCHEAP_H
 #define HL_XALLOCHEAP_H
 
+#include <assert.h>
+#include <stddef.h>
+
+#include "utility/align.h"
+#include "utility/bitops.h"
+
+/**
+ * @class XallocHeap
+ * @brief A stack of arenas for objects that are mostly freed last in,
+ * first out, as with xalloc.
+ *
+ * Objects are bumped off the top of the current arena. Freeing the one
+ * on top moves the top back over it, and over the free block below it
+ * if there is one (free blocks never touch each other or the top), so
+ * top frees are O(1). An object freed further down is coalesced with
+ * its free neighbours, found through boundary tags (a size in every
+ * header and a footer in every free block), and filed by size in a
+ * segregated index that malloc searches before it bumps.
+ *
+ * When the current arena is full another is pushed, of ArenaSize or
+ * big enough for the object, and the rest of the full one is indexed.
+ * When the top of an arena goes back to its start, the arena is popped
+ * and kept as a spare (until the next one is popped).
+ */
+
 namespace HL {
 
   template <int ArenaSize, class SuperHeap>
@@ -34,85 +59,309 @@ namespace HL {
 
   public:
 
-    inline XallocHeap (void) {
-      start_of_array = (char *) SuperHeap::malloc (ArenaSize);
-      end_of_array = start_of_array + HL::align<sizeof(double)>(sizeof(Nuggie));
-      size_lval(end_of_array) = 0;
-      last_block = NULL;
+    enum { Alignment = sizeof(double) };
+
+    inline XallocHeap (void)
+      : current (NULL),
+	spare (NULL),
+	end_of_array (NULL),
+	top_limit (NULL),
+	binMap (0)
+    {
+      for (int i = 0; i < NumBins; i++) {
+	bins[i] = NULL;
+      }
     }
 
     inline ~XallocHeap (void) {
-      SuperHeap::free (start_of_array);
+      while (current != NULL) {
+	Arena * a = current;
+	current = a->prev;
+	SuperHeap::free (a);
+      }
+      if (spare != NULL) {
+	SuperHeap::free (spare);
+      }
     }
 
     inline void * malloc (size_t size) {
-      char * old_end_of_array = end_of_array;
-      end_of_array += HL::align<sizeof(double)>(size + sizeof(Nuggie));
-      if (old_end_of_array + size >= start_of_array + ArenaSize) {
-	// We're out of memory.
+      const size_t sz = blockSize (size);
+      if (sz == 0) {
 	return NULL;
       }
-      size_lval(end_of_array) = end_of_array - old_end_of_array;
-      clear_use(end_of_array);  /* this is not necessary, cause it will be zero */
-      set_use(old_end_of_array);
-      last_block = old_end_of_array;
-      return old_end_of_array;
+      // Reuse a freed block if there is one.
+      if (binMap != 0) {
+	char * p = takeFree (sz);
+	if (p != NULL) {
+	  return p;
+	}
+      }
+      if ((size_t) (top_limit - end_of_array) < sz) {
+	if (!pushArena (sz)) {
+	  // We're out of memory.
+	  return NULL;
+	}
+      }
+      char * p = end_of_array;
+      end_of_array += sz;
+      // The block below the top is always in use.
+      size_lval(p) = sz | IN_USE | PREV_IN_USE;
+      return p;
     }
 
     inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
       char * p = (char *) ptr;
-      char * q;
-      /* At this point we could check that the in_use bit for this block
-	 is set, and also check that the size is right */
-      clear_use(p);  /* mark this block as unused */
-      if (p == last_block) {
-	while (1) {
-	  q = prev_block(p);
-	  if (q == p) {
-	    last_block = NULL;
-	    end_of_array = p;
-	    break;  /* only happens when we get to the beginning */
-	  }
-	  if (in_use(q)) {
-	    last_block = q;
-	    end_of_array = p;
-	    break;
-	  }
-	  p = q;
+      assert (in_use(p));
+      size_t sz = block_size(p);
+      char * next = p + sz;
+      if (next == end_of_array) {
+	// The object on top: move the top back.
+	if (!prev_in_use(p)) {
+	  p = prev_block(p);
+	  unlink (p);
+	}
+	end_of_array = p;
+	while ((end_of_array == first(current)) && (current->prev != NULL)) {
+	  popArena();
 	}
+	return;
+      }
+      if (!in_use(next)) {
+	unlink (next);
+	sz += block_size(next);
+      }
+      if (!prev_in_use(p)) {
+	p = prev_block(p);
+	unlink (p);
+	sz += block_size(p);
       }
+      makeFree (p, sz);
+    }
+
+    static inline size_t getSize (void * ptr) {
+      return block_size((char *) ptr) - sizeof(Nuggie);
     }
 
   private:
 
+    XallocHeap (const XallocHeap&);
+    XallocHeap& operator=(const XallocHeap&);
+
+    class Nuggie {
+    public:
+      size_t size;
+    };
+
+    class FreeBlock {
+    public:
+      FreeBlock * next;
+      FreeBlock * prev;
+    };
+
+    class Arena {
+    public:
+      Arena * prev;
+      char * limit;
+      // Where its top was when it was covered by another arena.
+      char * top;
+    };
+
+    enum { IN_USE = 1, PREV_IN_USE = 2, FLAGS = 3 };
+
+    /// A free block holds a header, its links, and a footer.
+    enum { MinBlock = (sizeof(Nuggie) + sizeof(FreeBlock) + sizeof(size_t) + Alignment - 1)
+	   & ~(Alignment - 1) };
+
+    /// The first header follows the arena's own.
+    enum { FirstOffset = ((sizeof(Arena) + Alignment - 1) & ~(Alignment - 1)) + sizeof(Nuggie) };
+
+    enum { NumBins = sizeof(size_t) * 8 };
+
+    // The header before every block holds its size and flags.
     static inline size_t& size_lval (char * x) {
       return (((Nuggie *)(((char *)x) - sizeof(Nuggie)))->size);
     }
 
-    static inline char * prev_block (char * x) {
-      return (((char *) x) - (size_lval(x) & (~1)));
+    static inline size_t block_size (char * x) {
+      return (size_lval(x) & ~(size_t) FLAGS);
     }
 
     static inline int in_use (char * x) {
-      return (size_lval(x) & (1));
+      return (size_lval(x) & IN_USE);
     }
 
-    static inline void set_use (char * x) {
-      (size_lval(x) |= (1));
+    static inline int prev_in_use (char * x) {
+      return (size_lval(x) & PREV_IN_USE);
     }
 
-    static inline void clear_use (char * x) {
-      (size_lval(x) &= (~1));
+    // A free block's size is also in its last word, its footer.
+    static inline size_t& footer (char * x, size_t sz) {
+      return *((size_t *) (x + sz - sizeof(Nuggie) - sizeof(size_t)));
     }
 
-    class Nuggie {
-    public:
-      size_t size;
-    };
+    // Only for a block whose predecessor is free.
+    static inline char * prev_block (char * x) {
+      return x - *((size_t *) (x - sizeof(Nuggie) - sizeof(size_t)));
+    }
+
+    static inline size_t blockSize (size_t size) {
+      const size_t sz = HL::align<Alignment>(size + sizeof(Nuggie));
+      if (sz < size) {
+	// Overflow.
+	return 0;
+      }
+      return (sz < (size_t) MinBlock) ? (size_t) MinBlock : sz;
+    }
+
+    static inline char * first (Arena * a) {
+      return (char *) a + FirstOffset;
+    }
+
+    static inline int binOf (size_t sz) {
+      return BitOps::highestBit (sz);
+    }
+
+    /// Marks x free, files it, and tells the next block.
+    inline void makeFree (char * x, size_t sz) {
+      // Its predecessor is in use, or they would have coalesced.
+      size_lval(x) = sz | PREV_IN_USE;
+      footer(x, sz) = sz;
+      size_lval(x + sz) &= ~(size_t) PREV_IN_USE;
+      const int b = binOf (sz);
+      FreeBlock * f = (FreeBlock *) x;
+      f->prev = NULL;
+      f->next = bins[b];
+      if (f->next != NULL) {
+	f->next->prev = f;
+      }
+      bins[b] = f;
+      binMap |= (size_t) 1 << b;
+    }
+
+    inline void unlink (char * x) {
+      assert (!in_use(x));
+      FreeBlock * f = (FreeBlock *) x;
+      if (f->prev != NULL) {
+	f->prev->next = f->next;
+      } else {
+	const int b = binOf (block_size(x));
+	bins[b] = f->next;
+	if (f->next == NULL) {
+	  binMap &= ~((size_t) 1 << b);
+	}
+      }
+      if (f->next != NULL) {
+	f->next->prev = f->prev;
+      }
+    }
 
+    /// A freed block of at least sz bytes, or NULL.
+    char * takeFree (size_t sz) {
+      const int b = binOf (sz);
+      char * x = NULL;
+      // The blocks in sz's own bin may be too small,
+      for (FreeBlock * f = bins[b]; f != NULL; f = f->next) {
+	if (block_size((char *) f) >= sz) {
+	  x = (char *) f;
+	  break;
+	}
+      }
+      // but any in a higher one will do.
+      if (x == NULL) {
+	const size_t higher = binMap & ~(((size_t) 2 << b) - 1);
+	if (higher == 0) {
+	  return NULL;
+	}
+	x = (char *) bins[BitOps::lowestBit (higher)];
+      }
+      unlink (x);
+      const size_t total = block_size(x);
+      if (total - sz >= (size_t) MinBlock) {
+	size_lval(x) = sz | IN_USE | PREV_IN_USE;
+	makeFree (x + sz, total - sz);
+      } else {
+	size_lval(x) = total | IN_USE | PREV_IN_USE;
+	size_lval(x + total) |= PREV_IN_USE;
+      }
+      return x;
+    }
+
+    /// Covers the current arena with one that has room for sz bytes.
+    bool pushArena (size_t sz) {
+      Arena * a = NULL;
+      size_t allocSize = ArenaSize;
+      if (sz > allocSize - FirstOffset) {
+	allocSize = FirstOffset + sz;
+	if (allocSize < sz) {
+	  return false;
+	}
+      } else if (spare != NULL) {
+	a = spare;
+	spare = NULL;
+      }
+      if (a == NULL) {
+	a = (Arena *) SuperHeap::malloc (allocSize);
+	if (a == NULL) {
+	  return false;
+	}
+	a->limit = (char *) a + allocSize;
+      }
+      if (current != NULL) {
+	// Index what is left of the current arena, and end it with an
+	// in-use header for coalescing to stop at.
+	const size_t room = top_limit - end_of_array;
+	if (room >= (size_t) MinBlock) {
+	  current->top = top_limit;
+	  size_lval(top_limit) = IN_USE;
+	  makeFree (end_of_array, room);
+	} else {
+	  current->top = end_of_array;
+	  size_lval(end_of_array) = IN_USE | PREV_IN_USE;
+	}
+      }
+      a->prev = current;
+      current = a;
+      end_of_array = first(a);
+      top_limit = a->limit;
+      return true;
+    }
+
+    /// Drops the (empty) current arena, and uncovers the one below.
+    void popArena (void) {
+      Arena * a = current;
+      current = a->prev;
+      if (a->limit - (char *) a == ArenaSize) {
+	if (spare != NULL) {
+	  SuperHeap::free (spare);
+	}
+	spare = a;
+      } else {
+	SuperHeap::free (a);
+      }
+      end_of_array = current->top;
+      top_limit = current->limit;
+      if (!prev_in_use(end_of_array)) {
+	end_of_array = prev_block(end_of_array);
+	unlink (end_of_array);
+      }
+    }
+
+    /// The arena on top of the stack, and a popped one kept for reuse.
+    Arena * current;
+    Arena * spare;
+
+    /// Where the next object goes, and the end of its arena.
     char * end_of_array;
-    char * start_of_array;
-    char * last_block;
+    char * top_limit;
+
+    /// The free blocks, by the floors of the logs of their sizes.
+    FreeBlock * bins[NumBins];
+
+    /// Which bins have blocks.
+    size_t binMap;
   };
 
 }
@@ -33,6 +33,16 @@
  * Uses the superclass to obtain large chunks of memory that are only
  * returned when the heap itself is destroyed.
  *
+ * A zone can also be emptied with reset(), or taken back to a mark()
+ * with rollback(), like an obstack. Either way the chunks it no longer
+ * needs are kept as spares for the allocations that follow, so a zone
+ * that is reset per request does no system calls once it has grown to
+ * fit. With RecycleChunks, a zone's chunks go to a pool shared by all
+ * the zones of its type when it is destroyed, and new zones draw from
+ * that pool first; the pooled chunks are never returned to the
+ * superheap, so this suits stateless superheaps (like MmapHeap) whose
+ * chunks any zone could have allocated.
+ *
 */
 
 #ifndef HL_ZONEHEAP_H
@@ -41,37 +51,63 @@
 #include <assert.h>
 
 #include "utility/align.h"
+#include "utility/heapwalk.h"
+#include "utility/lockfreesllist.h"
 #include "wrappers/mallocinfo.h"
-#include "utility/sassert.h"
 
 namespace HL {
 
-  template <class SuperHeap, size_t ChunkSize>
+  template <class SuperHeap, size_t ChunkSize, bool RecycleChunks = false>
   class ZoneHeap : public SuperHeap {
+  private:
+
+    class Arena;
+
   public:
 
-    enum { Alignment = SuperHeap::Alignment };
+    /// Objects are bumped along at MallocInfo::Alignment, whatever
+    /// the arenas themselves are aligned to.
+    enum { Alignment = ((int) SuperHeap::Alignment < (int) HL::MallocInfo::Alignment)
+	   ? (int) SuperHeap::Alignment : (int) HL::MallocInfo::Alignment };
+
+    /// A point in the zone that rollback can return to.
+    class Mark {
+    public:
+      Mark (void)
+	: arena (NULL),
+	  space (NULL)
+      {}
+    private:
+      friend class ZoneHeap;
+      Arena * arena;
+      char * space;
+    };
 
     ZoneHeap (void)
       : _sizeRemaining (-1),
+	_last (NULL),
 	_currentArena (NULL),
-	_pastArenas (NULL)
+	_pastArenas (NULL),
+	_spareArenas (NULL),
+	_heldBytes (0),
+	_wastedBytes (0),
+	_spareBytes (0)
     {}
 
     ~ZoneHeap (void)
     {
-      // printf ("deleting arenas!\n");
       // Delete all of our arenas.
-      Arena * ptr = _pastArenas;
+      reset();
+      Arena * ptr = _spareArenas;
       while (ptr != NULL) {
-	void * oldPtr = (void *) ptr;
-	ptr = ptr->nextArena;
-	//printf ("deleting %x\n", ptr);
-	SuperHeap::free (oldPtr);
-      }
-      if (_currentArena != NULL)
-	//printf ("deleting %x\n", _currentArena);
-	SuperHeap::free ((void *) _currentArena);
+	Arena * next = ptr->nextArena;
+	if (RecycleChunks) {
+	  chunkPool().insert (ptr);
+	} else {
+	  SuperHeap::free ((void *) ptr);
+	}
+	ptr = next;
+      }
     }
 
     inline void * malloc (size_t sz) {
@@ -83,68 +119,254 @@ namespace HL {
     /// Free in a zone allocator is a no-op.
     inline void free (void *) {}
 
+    /// Only the most recent object can change size in place (by
+    /// moving the bump pointer); returns false for any other.
+    inline bool resize (void * ptr, size_t sz) {
+      if ((ptr == NULL) || (ptr != _last)) {
+	return false;
+      }
+      sz = HL::align<HL::MallocInfo::Alignment>(sz);
+      const long oldSize = _currentArena->arenaSpace - (char *) ptr;
+      if ((long) sz - oldSize > _sizeRemaining) {
+	return false;
+      }
+      _sizeRemaining -= (long) sz - oldSize;
+      _currentArena->arenaSpace = (char *) ptr + sz;
+      return true;
+    }
+
+    /// Bump the pointer once for n objects, so that they are
+    /// contiguous and in order (see ComallocHeap).
+    inline bool comalloc (size_t n, const size_t * sizes, void ** ptrs) {
+      if (n == 0) {
+	return true;
+      }
+      size_t total = 0;
+      for (size_t i = 0; i < n; i++) {
+	const size_t sz = pieceSize (sizes[i]);
+	if ((sz < sizes[i]) || (total + sz < total)) {
+	  return false;
+	}
+	total += sz;
+      }
+      char * ptr = (char *) zoneMalloc (total);
+      if (ptr == NULL) {
+	return false;
+      }
+      for (size_t i = 0; i < n; i++) {
+	ptrs[i] = ptr;
+	ptr += pieceSize (sizes[i]);
+      }
+      // Only the last one can be resized.
+      _last = ptrs[n - 1];
+      return true;
+    }
+
     /// Remove in a zone allocator is a no-op.
     inline int remove (void *) { return 0; }
 
+    /// Frees every object at once, keeping the arenas to reuse.
+    void reset (void) {
+      rollback (Mark());
+    }
+
+    /// Where the next object will go.
+    inline Mark mark (void) const {
+      Mark m;
+      if (_currentArena != NULL) {
+	m.arena = _currentArena;
+	m.space = _currentArena->arenaSpace;
+      }
+      return m;
+    }
+
+    /// Frees every object allocated since the mark was taken.
+    void rollback (const Mark& m) {
+      while (_currentArena != m.arena) {
+	assert (_currentArena != NULL);
+	Arena * a = _currentArena;
+	_currentArena = _pastArenas;
+	if (_currentArena != NULL) {
+	  _pastArenas = _currentArena->nextArena;
+	  // Its unused end, counted as waste when it was retired, is
+	  // taken up again below.
+	  _wastedBytes -= _currentArena->arenaEnd - _currentArena->arenaSpace;
+	}
+	retire (a);
+      }
+      _last = NULL;
+      if (_currentArena == NULL) {
+	_sizeRemaining = -1;
+	return;
+      }
+      _currentArena->arenaSpace = m.space;
+      _sizeRemaining = _currentArena->arenaEnd - _currentArena->arenaSpace;
+    }
+
+    /// Give spare arenas back to the superheap (not to the pool of
+    /// RecycleChunks) until budget bytes have gone, then purge it.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      while ((released < budget) && (_spareArenas != NULL)) {
+	Arena * a = _spareArenas;
+	_spareArenas = a->nextArena;
+	_spareBytes -= ChunkSize;
+	_heldBytes -= ChunkSize + ArenaHeaderSize;
+	_wastedBytes -= ArenaHeaderSize;
+	SuperHeap::free ((void *) a);
+	released += ChunkSize + ArenaHeaderSize;
+      }
+      if (released < budget) {
+	released += SuperHeap::purge (budget - released);
+      }
+      return released;
+    }
+
+    /// The arenas held; what is left of the current one is free, as
+    /// are the spares, and the arena headers and the unused ends of
+    /// past arenas are wasted.
+    void walk (HeapWalker& w) {
+      HeapUsage u;
+      u.heldBytes = _heldBytes;
+      if ((_currentArena != NULL) && (_sizeRemaining > 0)) {
+	u.freeBytes = _sizeRemaining;
+      }
+      u.freeBytes += _spareBytes;
+      u.wastedBytes = _wastedBytes;
+      w.visit ("ZoneHeap", u);
+      SuperHeap::walk (w);
+    }
+
 
   private:
 
     ZoneHeap (const ZoneHeap&);
     ZoneHeap& operator=(const ZoneHeap&);
 
+    /// Every comalloc piece gets a distinct, aligned address.
+    static inline size_t pieceSize (size_t sz) {
+      return HL::align<HL::MallocInfo::Alignment>((sz > 0) ? sz : 1);
+    }
+
     inline void * zoneMalloc (size_t sz) {
       void * ptr;
       // Round up size to an aligned value.
       sz = HL::align<HL::MallocInfo::Alignment>(sz);
       // Get more space in our arena if there's not enough room in this one.
-      if ((_currentArena == NULL) || (_sizeRemaining < (int) sz)) {
-	// First, add this arena to our past arena list.
-	if (_currentArena != NULL) {
-	  _currentArena->nextArena = _pastArenas;
-	  _pastArenas = _currentArena;
-	}
-	// Now get more memory.
-	size_t allocSize = ChunkSize;
-	if (allocSize < sz) {
-	  allocSize = sz;
-	}
-	_currentArena =
-	  (Arena *) SuperHeap::malloc (allocSize + sizeof(Arena));
-	if (_currentArena == NULL) {
+      if ((_currentArena == NULL) || (_sizeRemaining < (long) sz)) {
+	if (!newArena (sz)) {
 	  return NULL;
 	}
-	_currentArena->arenaSpace = (char *) (_currentArena + 1);
-	_currentArena->nextArena = NULL;
-	_sizeRemaining = ChunkSize;
       }
       // Bump the pointer and update the amount of memory remaining.
       _sizeRemaining -= sz;
       ptr = _currentArena->arenaSpace;
       _currentArena->arenaSpace += sz;
+      _last = ptr;
       assert (ptr != NULL);
-      assert ((size_t) ptr % SuperHeap::Alignment == 0);
+      assert ((size_t) ptr % Alignment == 0);
       return ptr;
     }
-  
-    class Arena {
-    public:
-      Arena() {
-	sassert<(sizeof(Arena) % HL::MallocInfo::Alignment == 0)> verifyAlignment;
+
+    /// Makes a new current arena with room for sz bytes, from the
+    /// spares or the pool if it is a standard one. If there is none,
+    /// the current arena stays as it was.
+    bool newArena (size_t sz) {
+      size_t allocSize = ChunkSize;
+      if (allocSize < sz) {
+	allocSize = sz;
       }
+      Arena * a = NULL;
+      if (allocSize == ChunkSize) {
+	if (_spareArenas != NULL) {
+	  a = _spareArenas;
+	  _spareArenas = a->nextArena;
+	  _spareBytes -= ChunkSize;
+	} else if (RecycleChunks) {
+	  a = (Arena *) chunkPool().get();
+	  if (a != NULL) {
+	    _heldBytes += ChunkSize + ArenaHeaderSize;
+	    _wastedBytes += ArenaHeaderSize;
+	  }
+	}
+      }
+      if (a == NULL) {
+	// Now get more memory.
+	a = (Arena *) SuperHeap::malloc (allocSize + ArenaHeaderSize);
+	if (a == NULL) {
+	  return false;
+	}
+	_heldBytes += allocSize + ArenaHeaderSize;
+	_wastedBytes += ArenaHeaderSize;
+      }
+      // Add the current arena to our past arena list.
+      if (_currentArena != NULL) {
+	_currentArena->nextArena = _pastArenas;
+	_pastArenas = _currentArena;
+	if (_sizeRemaining > 0) {
+	  _wastedBytes += _sizeRemaining;
+	}
+      }
+      a->arenaSpace = (char *) a + ArenaHeaderSize;
+      a->arenaEnd = a->arenaSpace + allocSize;
+      a->nextArena = NULL;
+      _currentArena = a;
+      _sizeRemaining = allocSize;
+      return true;
+    }
+
+    /// Keeps a standard arena as a spare; gives back an oversized one.
+    void retire (Arena * a) {
+      const size_t allocSize = a->arenaEnd - ((char *) a + ArenaHeaderSize);
+      if (allocSize == ChunkSize) {
+	a->nextArena = _spareArenas;
+	_spareArenas = a;
+	_spareBytes += ChunkSize;
+      } else {
+	_heldBytes -= allocSize + ArenaHeaderSize;
+	_wastedBytes -= ArenaHeaderSize;
+	SuperHeap::free ((void *) a);
+      }
+    }
+
+    /// The standard arenas of destroyed zones, when RecycleChunks.
+    static LockFreeSLList& chunkPool (void) {
+      static LockFreeSLList pool;
+      return pool;
+    }
 
+    class Arena {
+    public:
       Arena * nextArena;
       char * arenaSpace;
-      long long _dummy; // For alignment.
+      char * arenaEnd;
     };
-    
+
+    /// Objects start this far into an arena, so they stay aligned.
+    enum { ArenaHeaderSize =
+	   (sizeof(Arena) + HL::MallocInfo::Alignment - 1) & ~(HL::MallocInfo::Alignment - 1) };
+
     /// Space left in the current arena.
     long _sizeRemaining;
 
+    /// The last object allocated (the only one resize can change).
+    void * _last;
+
     /// The current arena.
     Arena * _currentArena;
 
     /// A linked list of past arenas.
     Arena * _pastArenas;
+
+    /// Standard arenas freed by reset or rollback, ready for reuse.
+    Arena * _spareArenas;
+
+    /// Bytes of all the arenas, and of their headers and unused ends.
+    size_t _heldBytes;
+    size_t _wastedBytes;
+
+    /// Bytes in the spare arenas.
+    size_t _spareBytes;
   };
 
 }
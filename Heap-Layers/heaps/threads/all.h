@@ -1,6 +1,14 @@
 #include "lockedheap.h"
+#include "coroutineframeheap.h"
+#include "epochreclaimheap.h"
+#include "magazineheap.h"
+#include "perclasspool.h"
+#include "percpuheap.h"
+#include "pernodeheap.h"
 #include "phothreadheap.h"
+#include "remotefreeheap.h"
 #include "threadheap.h"
 #include "threadspecificheap.h"
+#include "tlsheap.h"
 #include "sizethreadheap.h"
 
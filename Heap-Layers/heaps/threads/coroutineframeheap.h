@@ -0,0 +1,366 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_COROUTINEFRAMEHEAP_H
+#define HL_COROUTINEFRAMEHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <new>
+
+#if defined(_WIN32)
+#error "This functionality currently is not implemented for Windows."
+#endif
+
+#include <pthread.h>
+
+#include "locks/spinlock.h"
+#include "utility/guard.h"
+#include "utility/heapwalk.h"
+#include "utility/singleton.h"
+#include "utility/statsregistry.h"
+
+#if !defined(HL_INITIAL_EXEC)
+#if defined(__GNUC__)
+#define HL_INITIAL_EXEC __attribute__((tls_model ("initial-exec")))
+#else
+#define HL_INITIAL_EXEC
+#endif
+#endif
+
+/**
+ * @class CoroutineFrameHeap
+ * @brief Per-thread free lists of coroutine frames, by frame size, over a shared pool.
+ *
+ * Every coroutine of one function has a frame of the same size, so
+ * frames are a natural fit for size classes. Sizes up to MaxFrameSize
+ * are rounded up to a multiple of Granularity, and each thread keeps
+ * a free list per class, from which it mallocs and frees with no lock
+ * or atomic operation. A coroutine that is resumed (and finishes) on
+ * another thread than the one that started it frees its frame there,
+ * so a thread that frees more than it allocates hands BatchSize
+ * frames at a time to the shared pool once its list holds twice that,
+ * and one whose list is empty takes a batch back before going to the
+ * superheap. The pool and the superheap are under one lock, so the
+ * superheap need not be thread-safe. A thread's lists go to the pool
+ * when it exits.
+ *
+ * Frames are freed with their size, as the sized operator delete of a
+ * promise type gives it; malloc of more than MaxFrameSize returns
+ * NULL. All CoroutineFrameHeaps with the same parameters share their
+ * pool and superheap. The pool is in the StatsRegistry as
+ * "coroutine_frames".
+ *
+ * @see CoroutineFrameAllocator
+ */
+
+namespace HL {
+
+  template <class SuperHeap,
+	    size_t MaxFrameSize = 4096,
+	    int BatchSize = 32>
+  class CoroutineFrameHeap {
+  public:
+
+    enum { Granularity = 16 };
+    enum { NumClasses = (MaxFrameSize + Granularity - 1) / Granularity };
+    enum { Alignment = SuperHeap::Alignment };
+
+    inline void * malloc (size_t sz) {
+      if (sz > MaxFrameSize) {
+	return NULL;
+      }
+      const int c = getSizeClass (sz);
+      List& l = getCache().lists[c];
+      Frame * f = l.head;
+      if (f != NULL) {
+	l.head = f->next;
+	l.count--;
+	return f;
+      }
+      return getPool().refill (c, getCache());
+    }
+
+    inline void free (void * ptr, size_t sz) {
+      if (ptr == NULL) {
+	return;
+      }
+      assert (sz <= MaxFrameSize);
+      const int c = getSizeClass (sz);
+      Cache& cache = getCache();
+      if (!cache.attached) {
+	// A thread may free frames without ever allocating one.
+	getPool().attach (cache);
+      }
+      List& l = cache.lists[c];
+      Frame * f = (Frame *) ptr;
+      f->next = l.head;
+      l.head = f;
+      if (++l.count > 2 * BatchSize) {
+	getPool().drain (c, cache);
+      }
+    }
+
+    /// Free the frames in the pool.
+    size_t purge (size_t budget) {
+      return getPool().purge (budget);
+    }
+
+    void walk (HeapWalker& w) {
+      getPool().walk (w);
+    }
+
+    static inline int getSizeClass (size_t sz) {
+      return (sz == 0) ? 0 : (int) ((sz - 1) / Granularity);
+    }
+
+    static inline size_t getClassMaxSize (int c) {
+      return (c + 1) * Granularity;
+    }
+
+  private:
+
+    /// A free frame; a batch in the pool is a chain of them.
+    class Frame {
+    public:
+      Frame * next;
+      Frame * nextBatch;	// in the first frame of a batch in the pool
+    };
+
+    class List {
+    public:
+      Frame * head;
+      int count;
+    };
+
+    /// A thread's free lists.
+    class Cache {
+    public:
+      bool attached;
+      List lists[NumClasses];
+    };
+
+    class Pool {
+    public:
+
+      Pool (void)
+	: _batchCount (0),
+	  _superMallocs (0),
+	  _stats ("coroutine_frames", this)
+      {
+	for (int i = 0; i < NumClasses; i++) {
+	  _batches[i] = NULL;
+	}
+	pthread_key_create (&_key, flush);
+      }
+
+      /// malloc found the free list of class c empty.
+      NO_INLINE void * refill (int c, Cache& cache) {
+	attach (cache);
+	Guard<SpinLockType> l (_lock);
+	Frame * b = _batches[c];
+	if (b == NULL) {
+	  _superMallocs++;
+	  return _heap.malloc (getClassMaxSize (c));
+	}
+	_batches[c] = b->nextBatch;
+	_batchCount--;
+	// Batches from exiting threads may be short, so count this one.
+	List& list = cache.lists[c];
+	list.head = b->next;
+	list.count = 0;
+	for (Frame * f = b->next; f != NULL; f = f->next) {
+	  list.count++;
+	}
+	return b;
+      }
+
+      /// free left the free list of class c too long: give a batch
+      /// back to the pool.
+      NO_INLINE void drain (int c, Cache& cache) {
+	List& list = cache.lists[c];
+	Frame * b = list.head;
+	Frame * last = b;
+	for (int i = 1; i < BatchSize; i++) {
+	  last = last->next;
+	}
+	list.head = last->next;
+	list.count -= BatchSize;
+	last->next = NULL;
+	Guard<SpinLockType> l (_lock);
+	push (c, b);
+      }
+
+      size_t purge (size_t budget) {
+	Guard<SpinLockType> l (_lock);
+	size_t released = 0;
+	for (int c = 0; (c < NumClasses) && (released < budget); c++) {
+	  while ((_batches[c] != NULL) && (released < budget)) {
+	    Frame * f = _batches[c];
+	    _batches[c] = f->nextBatch;
+	    _batchCount--;
+	    while (f != NULL) {
+	      Frame * next = f->next;
+	      _heap.free (f);
+	      released += getClassMaxSize (c);
+	      f = next;
+	    }
+	  }
+	}
+	if (released < budget) {
+	  released += _heap.purge (budget - released);
+	}
+	return released;
+      }
+
+      void walk (HeapWalker& w) {
+	Guard<SpinLockType> l (_lock);
+	HeapUsage u;
+	for (int c = 0; c < NumClasses; c++) {
+	  for (Frame * b = _batches[c]; b != NULL; b = b->nextBatch) {
+	    for (Frame * f = b; f != NULL; f = f->next) {
+	      u.freeObjects++;
+	      u.freeBytes += getClassMaxSize (c);
+	    }
+	  }
+	}
+	u.heldBytes = u.freeBytes;
+	w.visit ("CoroutineFrameHeap", u);
+	_heap.walk (w);
+      }
+
+      void writeStats (StatsWriter& w) {
+	w.field ("batches", _batchCount);
+	w.field ("super_mallocs", _superMallocs);
+      }
+
+      /// Have this thread's lists given back when it exits.
+      inline void attach (Cache& c) {
+	if (!c.attached) {
+	  c.attached = true;
+	  pthread_setspecific (_key, (void *) &c);
+	}
+      }
+
+    private:
+
+      /// Runs at thread exit.
+      static void flush (void * ptr) {
+	Cache& cache = *((Cache *) ptr);
+	Pool& p = getPool();
+	Guard<SpinLockType> l (p._lock);
+	for (int c = 0; c < NumClasses; c++) {
+	  List& list = cache.lists[c];
+	  while (list.head != NULL) {
+	    Frame * b = list.head;
+	    Frame * last = b;
+	    for (int i = 1; (i < BatchSize) && (last->next != NULL); i++) {
+	      last = last->next;
+	    }
+	    list.head = last->next;
+	    last->next = NULL;
+	    p.push (c, b);
+	  }
+	  list.count = 0;
+	}
+	cache.attached = false;
+      }
+
+      inline void push (int c, Frame * b) {
+	b->nextBatch = _batches[c];
+	_batches[c] = b;
+	_batchCount++;
+      }
+
+      SpinLockType _lock;
+      Frame * _batches[NumClasses];
+      size_t _batchCount;
+      unsigned long _superMallocs;
+      pthread_key_t _key;
+      SuperHeap _heap;
+      LayerStats<Pool> _stats;
+    };
+
+    static inline Pool& getPool (void) {
+      return singleton<Pool>::getInstance();
+    }
+
+    static inline Cache& getCache (void) {
+      static __thread Cache cache HL_INITIAL_EXEC;
+      return cache;
+    }
+  };
+
+
+  /**
+   * @class CoroutineFrameAllocator
+   * @brief Gives a coroutine promise type frames from a CoroutineFrameHeap.
+   *
+   * A C++20 coroutine's frame is allocated with its promise type's
+   * operator new, if it has one, and freed with its operator delete,
+   * sized if that is declared. Deriving the promise type from this
+   * class makes both go to a CoroutineFrameHeap:
+   *
+   * <TT>
+   *   struct promise_type : HL::CoroutineFrameAllocator<MmapHeap> { ... };
+   * </TT>
+   *
+   * Frames of more than MaxFrameSize bytes go to the global operator
+   * new instead. The heap keeps no state of its own, so a temporary
+   * one will do.
+   */
+
+  template <class SuperHeap,
+	    size_t MaxFrameSize = 4096,
+	    int BatchSize = 32>
+  class CoroutineFrameAllocator {
+  public:
+
+    typedef CoroutineFrameHeap<SuperHeap, MaxFrameSize, BatchSize> FrameHeap;
+
+    static inline void * operator new (size_t sz) {
+      if (sz > MaxFrameSize) {
+	return ::operator new (sz);
+      }
+      void * ptr = FrameHeap().malloc (sz);
+      if (ptr == NULL) {
+	throw std::bad_alloc();
+      }
+      return ptr;
+    }
+
+    static inline void operator delete (void * ptr, size_t sz) {
+      if (sz > MaxFrameSize) {
+	::operator delete (ptr);
+      } else {
+	FrameHeap().free (ptr, sz);
+      }
+    }
+  };
+
+}
+
+#endif
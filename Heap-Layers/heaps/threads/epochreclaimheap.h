@@ -0,0 +1,377 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_EPOCHRECLAIMHEAP_H
+#define HL_EPOCHRECLAIMHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <new>
+
+#if defined(_WIN32)
+#error "This functionality currently is not implemented for Windows."
+#endif
+
+#include <pthread.h>
+
+#include "locks/spinlock.h"
+#include "threads/atomic.h"
+#include "utility/guard.h"
+#include "wrappers/mmapwrapper.h"
+
+#if !defined(HL_INITIAL_EXEC)
+#if defined(__GNUC__)
+#define HL_INITIAL_EXEC __attribute__((tls_model ("initial-exec")))
+#else
+#define HL_INITIAL_EXEC
+#endif
+#endif
+
+/**
+ * @class EpochReclaimHeap
+ * @brief Epoch-based reclamation: frees retired objects once no thread can reach them.
+ *
+ * A lock-free structure that unlinks an object passes it to retire
+ * rather than free, and its threads bracket every operation with
+ * enter and leave (or a Critical on the stack). A thread that enters
+ * publishes the global epoch it saw; retired objects go on a list
+ * for the epoch they were retired in. The global epoch advances only
+ * when every thread inside a critical section has seen it, so two
+ * advances after an object was retired, no thread can still hold a
+ * pointer to it, and its whole list goes to the superheap at once.
+ *
+ * Entering and leaving cost a store and a fence. Every Batch retires,
+ * the retiring thread scans the other threads' epochs, tries to
+ * advance the global one, and frees what has become safe; no thread
+ * ever waits on another.
+ *
+ * The frees happen on the retiring thread, so with per-thread heaps
+ * that return remote frees to their owners, each object goes back to
+ * the heap that allocated it, in a batch when that heap next mallocs:
+ *
+ * <TT>
+ *   EpochReclaimHeap<TLSHeap<RemoteFreeHeap<MyLocalHeap> > > heap;
+ * </TT>
+ *
+ * All heaps of one type share the epoch and the per-thread records.
+ * The record of a thread that exits, with whatever it has retired
+ * and not yet freed, goes to the next new thread.
+ */
+
+namespace HL {
+
+  template <class SuperHeap, int Batch = 64>
+  class EpochReclaimHeap : public SuperHeap {
+  public:
+
+    enum { Alignment = SuperHeap::Alignment };
+
+    /// A critical section for as long as it is in scope.
+    class Critical {
+    public:
+      explicit Critical (EpochReclaimHeap& heap)
+	: _heap (heap)
+      {
+	_heap.enter();
+      }
+
+      ~Critical (void) {
+	_heap.leave();
+      }
+
+    private:
+      Critical (const Critical&);
+      Critical& operator= (const Critical&);
+
+      EpochReclaimHeap& _heap;
+    };
+
+    EpochReclaimHeap (void)
+    {
+      pthread_once (&(getOnce()), createKey);
+    }
+
+    /// Begin a critical section, in which objects reached through a
+    /// structure stay valid even if another thread retires them.
+    /// Critical sections nest.
+    inline void enter (void) {
+      Record * r = getRecord();
+      if (r->nesting++ == 0) {
+	r->epoch = getEpoch() | Active;
+	// Publish the epoch before reading anything it protects.
+	Atomic::memoryBarrier();
+      }
+    }
+
+    /// End a critical section.
+    inline void leave (void) {
+      Record * r = getRecord();
+      assert (r->nesting > 0);
+      if (--r->nesting == 0) {
+	// Finish reading before letting the epoch move on.
+	Atomic::memoryBarrier();
+	r->epoch = 0;
+      }
+    }
+
+    /// Free ptr once no thread in a critical section can reach it.
+    /// It must already be unreachable for threads that enter anew.
+    inline void retire (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      Record * r = getRecord();
+      const unsigned long e = getEpoch();
+      Limbo& l = r->limbo[(e / Step) % NumLimbos];
+      if (l.epoch != e) {
+	// Its objects were retired at least NumLimbos epochs ago.
+	release (r, l);
+	l.epoch = e;
+      }
+      push (r, l, ptr);
+      if (++r->retired >= Batch) {
+	r->retired = 0;
+	reclaim (r);
+      }
+    }
+
+    /// Try to advance the epoch, and free whatever the calling thread
+    /// retired that is now safe (e.g., before it goes idle).
+    inline void reclaim (void) {
+      reclaim (getRecord());
+    }
+
+  private:
+
+    /// Epochs count by two; the low bit of a thread's says it is in a
+    /// critical section.
+    enum { Active = 1, Step = 2 };
+
+    /// Objects retired in epoch e are safe once the epoch is e + 2,
+    /// so three lists suffice.
+    enum { NumLimbos = 3 };
+
+    /// A page of retired objects. The objects themselves may still be
+    /// read, so they cannot hold the links.
+    class Block {
+    public:
+      enum { Capacity = (4096 - 2 * sizeof(void *)) / sizeof(void *) };
+      Block * next;
+      size_t count;
+      void * ptrs[Capacity];
+    };
+
+    /// The objects a thread retired in one epoch.
+    class Limbo {
+    public:
+      Limbo (void)
+	: epoch (0),
+	  head (NULL)
+      {}
+      unsigned long epoch;
+      Block * head;
+    };
+
+    /// A thread's epoch and retired objects.
+    class Record {
+    public:
+      Record (void)
+	: epoch (0),
+	  nesting (0),
+	  retired (0),
+	  spare (NULL),
+	  next (NULL),
+	  nextIdle (NULL)
+      {}
+      /// Read by the other threads; written only by this one.
+      volatile unsigned long epoch;
+      int nesting;
+      int retired;
+      Limbo limbo[NumLimbos];
+      Block * spare;
+      /// Every record ever made, for the scan.
+      Record * next;
+      Record * nextIdle;
+    };
+
+    static inline unsigned long getEpoch (void) {
+      return getEpochWord();
+    }
+
+    static volatile unsigned long& getEpochWord (void) {
+      static volatile unsigned long epoch = Step;
+      return epoch;
+    }
+
+    /// Advance the epoch if every thread in a critical section has
+    /// seen the current one.
+    static bool tryAdvance (void) {
+      const unsigned long e = getEpoch();
+      Atomic::memoryBarrier();
+      for (Record * r = getRecords(); r != NULL; r = r->next) {
+	const unsigned long re = r->epoch;
+	if ((re & Active) && (re != (e | Active))) {
+	  return false;
+	}
+      }
+      return Atomic::compareAndSwap (&getEpochWord(), e, e + Step);
+    }
+
+    void reclaim (Record * r) {
+      tryAdvance();
+      const unsigned long e = getEpoch();
+      for (int i = 0; i < NumLimbos; i++) {
+	Limbo& l = r->limbo[i];
+	if ((l.head != NULL) && (l.epoch + 2 * Step <= e)) {
+	  release (r, l);
+	}
+      }
+    }
+
+    inline void push (Record * r, Limbo& l, void * ptr) {
+      Block * b = l.head;
+      if ((b == NULL) || (b->count == Block::Capacity)) {
+	b = r->spare;
+	if (b != NULL) {
+	  r->spare = b->next;
+	} else {
+	  b = (Block *) HL::MmapWrapper::map (sizeof(Block));
+	}
+	b->count = 0;
+	b->next = l.head;
+	l.head = b;
+      }
+      b->ptrs[b->count++] = ptr;
+    }
+
+    /// Free a list's objects, keeping its blocks for reuse.
+    void release (Record * r, Limbo& l) {
+      Block * b = l.head;
+      while (b != NULL) {
+	for (size_t i = 0; i < b->count; i++) {
+	  SuperHeap::free (b->ptrs[i]);
+	}
+	Block * next = b->next;
+	b->next = r->spare;
+	r->spare = b;
+	b = next;
+      }
+      l.head = NULL;
+    }
+
+    static void createKey (void) {
+      pthread_key_create (&getKey(), detachRecord);
+      pthread_atfork (lockIdle, unlockIdle, unlockIdle);
+    }
+
+    static void lockIdle (void) {
+      getIdleLock().lock();
+    }
+
+    static void unlockIdle (void) {
+      getIdleLock().unlock();
+    }
+
+    static pthread_key_t& getKey() {
+      static pthread_key_t key;
+      return key;
+    }
+
+    static pthread_once_t& getOnce() {
+      static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+      return initOnce;
+    }
+
+    static Record *& getCurrent() {
+      static __thread Record * current HL_INITIAL_EXEC;
+      return current;
+    }
+
+    static Record * volatile& getRecords() {
+      static Record * volatile records = NULL;
+      return records;
+    }
+
+    static Record *& getIdle() {
+      static Record * idle = NULL;
+      return idle;
+    }
+
+    static SpinLockType& getIdleLock() {
+      static SpinLockType lock;
+      return lock;
+    }
+
+    static inline Record * getRecord() {
+      Record * r = getCurrent();
+      if (r == NULL) {
+	r = attachRecord();
+      }
+      return r;
+    }
+
+    /// Gives this thread a record: one left by an exited thread if
+    /// there is one, or else a new one, added to the list for good.
+    NO_INLINE static Record * attachRecord() {
+      pthread_once (&(getOnce()), createKey);
+      Record * r;
+      {
+	Guard<SpinLockType> l (getIdleLock());
+	r = getIdle();
+	if (r != NULL) {
+	  getIdle() = r->nextIdle;
+	}
+      }
+      if (r == NULL) {
+	void * buf = HL::MmapWrapper::map (sizeof(Record));
+	r = new (buf) Record;
+	Record * head;
+	do {
+	  head = getRecords();
+	  r->next = head;
+	} while (!Atomic::compareAndSwap (&getRecords(), head, r));
+      }
+      getCurrent() = r;
+      pthread_setspecific (getKey(), (void *) r);
+      return r;
+    }
+
+    /// Runs at thread exit: the record, and what it has retired, go
+    /// on the idle list for the next thread.
+    static void detachRecord (void * ptr) {
+      Record * r = (Record *) ptr;
+      getCurrent() = NULL;
+      r->nesting = 0;
+      r->epoch = 0;
+      Guard<SpinLockType> l (getIdleLock());
+      r->nextIdle = getIdle();
+      getIdle() = r;
+    }
+  };
+
+}
+
+#endif
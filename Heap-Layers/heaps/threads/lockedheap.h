@@ -28,6 +28,7 @@
 #define HL_LOCKEDHEAP_H
 
 #include "utility/guard.h"
+#include "utility/heapwalk.h"
 
 namespace HL {
 
@@ -47,6 +48,49 @@ namespace HL {
       Super::free (ptr);
     }
 
+    /// The size-passing protocol (see SizePassingHeap).
+    inline void * mallocSized (size_t sz, size_t * actual) {
+      Guard<LockType> l (thelock);
+      return Super::mallocSized (sz, actual);
+    }
+
+    inline void free (void * ptr, size_t sz) {
+      Guard<LockType> l (thelock);
+      Super::free (ptr, sz);
+    }
+
+    inline void * mallocZeroed (size_t sz) {
+      Guard<LockType> l (thelock);
+      return Super::mallocZeroed (sz);
+    }
+
+    inline void * memalign (size_t alignment, size_t sz) {
+      Guard<LockType> l (thelock);
+      return Super::memalign (alignment, sz);
+    }
+
+    inline bool resize (void * ptr, size_t sz) {
+      Guard<LockType> l (thelock);
+      return Super::resize (ptr, sz);
+    }
+
+    /// Take the lock once for the whole batch.
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      Guard<LockType> l (thelock);
+      return Super::mallocBatch (sz, n, ptrs);
+    }
+
+    inline void freeBatch (void ** ptrs, int n) {
+      Guard<LockType> l (thelock);
+      Super::freeBatch (ptrs, n);
+    }
+
+    /// Take the lock once for all the objects.
+    inline bool comalloc (size_t n, const size_t * sizes, void ** ptrs) {
+      Guard<LockType> l (thelock);
+      return Super::comalloc (n, sizes, ptrs);
+    }
+
     inline size_t getSize (void * ptr) const {
       Guard<LockType> l (thelock);
       return Super::getSize (ptr);
@@ -57,6 +101,21 @@ namespace HL {
       return Super::getSize (ptr);
     }
 
+    inline void walk (HeapWalker& w) {
+      Guard<LockType> l (thelock);
+      Super::walk (w);
+    }
+
+    inline size_t purge (size_t budget) {
+      Guard<LockType> l (thelock);
+      return Super::purge (budget);
+    }
+
+    /// Only reads size classes, so takes no lock.
+    inline size_t goodSize (size_t sz) {
+      return Super::goodSize (sz);
+    }
+
     inline void lock (void) {
       thelock.lock();
     }
@@ -64,6 +123,11 @@ namespace HL {
     inline void unlock (void) {
       thelock.unlock(); 
     }
+
+    /// Access the lock itself (e.g., for its contention counters).
+    inline LockType& getLock (void) {
+      return thelock;
+    }
  
   private:
     //    char dummy[128]; // an effort to avoid false sharing.
@@ -0,0 +1,331 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_MAGAZINEHEAP_H
+#define HL_MAGAZINEHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#if defined(_WIN32)
+#error "This functionality currently is not implemented for Windows."
+#endif
+
+#include <pthread.h>
+
+#include "locks/spinlock.h"
+#include "utility/guard.h"
+#include "utility/heapwalk.h"
+#include "utility/singleton.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+#if !defined(HL_INITIAL_EXEC)
+#if defined(__GNUC__)
+#define HL_INITIAL_EXEC __attribute__((tls_model ("initial-exec")))
+#else
+#define HL_INITIAL_EXEC
+#endif
+#endif
+
+/**
+ * @class MagazineHeap
+ * @brief Per-thread magazines of objects of one size, over a shared depot.
+ *
+ * Each thread holds two magazines (stacks of up to MagazineSize free
+ * objects) and mallocs and frees from them with no lock or atomic
+ * operation. When both are empty (for malloc) or full (for free), it
+ * trades one with the depot, a locked list of full and of empty
+ * magazines, so the lock is taken about once per MagazineSize
+ * operations whichever threads allocate and free. Only when the depot
+ * has no full magazine does malloc go to the superheap, under the same
+ * lock, so the superheap need not be thread-safe. A thread's magazines
+ * are emptied into the superheap when it exits.
+ *
+ * Every object is ObjectSize bytes (malloc of more returns NULL). All
+ * MagazineHeaps with the same parameters share one depot and
+ * superheap, so objects can be freed through any of them. The trades
+ * with the depot are in the StatsRegistry as "magazine".
+ *
+ * @param SuperHeap The source of objects.
+ * @param ObjectSize The size of every object.
+ * @param MagazineSize How many objects a magazine holds.
+ *
+ * @see Bonwick and Adams, "Magazines and Vmem: Extending the Slab
+ * Allocator to Many CPUs and Arbitrary Resources", USENIX 2001.
+ */
+
+namespace HL {
+
+  template <class SuperHeap, size_t ObjectSize, int MagazineSize = 32>
+  class MagazineHeap {
+  private:
+
+    class Magazine {
+    public:
+      Magazine * next;
+      int rounds;
+      void * round[MagazineSize];
+    };
+
+    /// A thread's two magazines.
+    class Cache {
+    public:
+      Magazine * loaded;
+      Magazine * previous;
+    };
+
+  public:
+
+    enum { Alignment = SuperHeap::Alignment };
+
+    inline void * malloc (size_t sz) {
+      if (sz > ObjectSize) {
+	return NULL;
+      }
+      Magazine * m = getCache().loaded;
+      if ((m != NULL) && (m->rounds > 0)) {
+	return m->round[--m->rounds];
+      }
+      return getDepot().refill (getCache());
+    }
+
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      Magazine * m = getCache().loaded;
+      if ((m != NULL) && (m->rounds < MagazineSize)) {
+	m->round[m->rounds++] = ptr;
+	return;
+      }
+      getDepot().drain (getCache(), ptr);
+    }
+
+    inline size_t getSize (void *) const {
+      return ObjectSize;
+    }
+
+    /// Free the objects in the depot's full magazines.
+    size_t purge (size_t budget) {
+      return getDepot().purge (budget);
+    }
+
+    void walk (HeapWalker& w) {
+      getDepot().walk (w);
+    }
+
+  private:
+
+    class Depot {
+    public:
+
+      Depot (void)
+	: _full (NULL),
+	  _empty (NULL),
+	  _fullCount (0),
+	  _trades (0),
+	  _superMallocs (0),
+	  _stats ("magazine", this)
+      {
+	pthread_key_create (&_key, flush);
+      }
+
+      /// malloc found both magazines empty.
+      NO_INLINE void * refill (Cache& c) {
+	if ((c.previous != NULL) && (c.previous->rounds > 0)) {
+	  swap (c);
+	  return c.loaded->round[--c.loaded->rounds];
+	}
+	Guard<SpinLockType> l (_lock);
+	attach (c);
+	if (_full != NULL) {
+	  // Trade the (empty) previous magazine for a full one.
+	  if (c.previous != NULL) {
+	    push (_empty, c.previous);
+	  }
+	  c.previous = c.loaded;
+	  c.loaded = pop (_full);
+	  _fullCount--;
+	  _trades++;
+	  return c.loaded->round[--c.loaded->rounds];
+	}
+	if (c.loaded == NULL) {
+	  c.loaded = getEmpty();
+	}
+	_superMallocs++;
+	return _heap.malloc (ObjectSize);
+      }
+
+      /// free found both magazines full.
+      NO_INLINE void drain (Cache& c, void * ptr) {
+	if ((c.previous != NULL) && (c.previous->rounds < MagazineSize)) {
+	  swap (c);
+	  c.loaded->round[c.loaded->rounds++] = ptr;
+	  return;
+	}
+	Guard<SpinLockType> l (_lock);
+	attach (c);
+	Magazine * m = getEmpty();
+	if (m == NULL) {
+	  _heap.free (ptr);
+	  return;
+	}
+	// Trade the (full) previous magazine for an empty one.
+	if (c.previous != NULL) {
+	  push (_full, c.previous);
+	  _fullCount++;
+	  _trades++;
+	}
+	c.previous = c.loaded;
+	c.loaded = m;
+	m->round[m->rounds++] = ptr;
+      }
+
+      size_t purge (size_t budget) {
+	Guard<SpinLockType> l (_lock);
+	size_t released = 0;
+	while ((_full != NULL) && (released < budget)) {
+	  Magazine * m = pop (_full);
+	  _fullCount--;
+	  released += empty (m);
+	  push (_empty, m);
+	}
+	if (released < budget) {
+	  released += _heap.purge (budget - released);
+	}
+	return released;
+      }
+
+      void walk (HeapWalker& w) {
+	Guard<SpinLockType> l (_lock);
+	HeapUsage u;
+	u.freeObjects = _fullCount * MagazineSize;
+	u.freeBytes = u.freeObjects * ObjectSize;
+	u.heldBytes = u.freeBytes;
+	w.visit ("MagazineHeap", u);
+	_heap.walk (w);
+      }
+
+      void writeStats (StatsWriter& w) {
+	w.field ("full_magazines", _fullCount);
+	w.field ("trades", _trades);
+	w.field ("super_mallocs", _superMallocs);
+      }
+
+    private:
+
+      /// Have this thread's magazines emptied when it exits.
+      inline void attach (Cache& c) {
+	if ((c.loaded == NULL) && (c.previous == NULL)) {
+	  pthread_setspecific (_key, (void *) &c);
+	}
+      }
+
+      /// Runs at thread exit.
+      static void flush (void * ptr) {
+	Cache& c = *((Cache *) ptr);
+	Depot& d = getDepot();
+	Guard<SpinLockType> l (d._lock);
+	Magazine * m[2] = { c.loaded, c.previous };
+	c.loaded = c.previous = NULL;
+	for (int i = 0; i < 2; i++) {
+	  if (m[i] != NULL) {
+	    d.empty (m[i]);
+	    push (d._empty, m[i]);
+	  }
+	}
+      }
+
+      /// Free a magazine's objects to the superheap.
+      size_t empty (Magazine * m) {
+	for (int i = 0; i < m->rounds; i++) {
+	  _heap.free (m->round[i]);
+	}
+	const size_t bytes = m->rounds * ObjectSize;
+	m->rounds = 0;
+	return bytes;
+      }
+
+      static inline void swap (Cache& c) {
+	Magazine * m = c.loaded;
+	c.loaded = c.previous;
+	c.previous = m;
+      }
+
+      /// An empty magazine, carving new ones a page at a time.
+      Magazine * getEmpty (void) {
+	if (_empty == NULL) {
+	  enum { PerMap = (MmapWrapper::Size > sizeof(Magazine)) ? MmapWrapper::Size / sizeof(Magazine) : 1 };
+	  Magazine * ms = (Magazine *) MmapWrapper::map (PerMap * sizeof(Magazine));
+	  if (ms == NULL) {
+	    return NULL;
+	  }
+	  for (int i = 0; i < (int) PerMap; i++) {
+	    ms[i].rounds = 0;
+	    push (_empty, &ms[i]);
+	  }
+	}
+	Magazine * m = pop (_empty);
+	m->rounds = 0;
+	return m;
+      }
+
+      static inline void push (Magazine *& head, Magazine * m) {
+	m->next = head;
+	head = m;
+      }
+
+      static inline Magazine * pop (Magazine *& head) {
+	Magazine * m = head;
+	head = m->next;
+	return m;
+      }
+
+      SpinLockType _lock;
+      Magazine * _full;
+      Magazine * _empty;
+      size_t _fullCount;
+      unsigned long _trades;
+      unsigned long _superMallocs;
+      pthread_key_t _key;
+      SuperHeap _heap;
+      LayerStats<Depot> _stats;
+    };
+
+    static inline Depot& getDepot (void) {
+      return singleton<Depot>::getInstance();
+    }
+
+    static inline Cache& getCache (void) {
+      static __thread Cache cache HL_INITIAL_EXEC;
+      return cache;
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_PERCLASSPOOL_H
+#define HL_PERCLASSPOOL_H
+
+#include <stddef.h>
+#include <new>
+
+#include "heaps/threads/magazineheap.h"
+
+/**
+ * @class PerClassPool
+ * @brief Like PerClassHeap, but for objects new'd and deleted by many threads.
+ *
+ * The class's objects come from a MagazineHeap of sizeof(Object)-byte
+ * objects over one SuperHeap, so that each thread news and deletes
+ * them from magazines of its own, and the SuperHeap (which needs no
+ * lock) is only touched once per MagazineSize or so of them, whichever
+ * thread deletes what another newed. Name the class itself as Object:
+ *
+ * <TT>
+ *   class Message : public PerClassPool<Message, FreelistHeap<MallocHeap> > { ... };
+ * </TT>
+ *
+ * Subclasses larger than Object, and arrays, go to the global operator
+ * new, sized delete telling them apart.
+ */
+
+namespace HL {
+
+  template <class Object, class SuperHeap, int MagazineSize = 32>
+  class PerClassPool {
+  public:
+    inline void * operator new (size_t sz) {
+      typedef MagazineHeap<SuperHeap, sizeof(Object), MagazineSize> PoolType;
+      if (sz > sizeof(Object)) {
+	return ::operator new (sz);
+      }
+      void * ptr = PoolType().malloc (sz);
+      if (ptr == NULL) {
+	throw std::bad_alloc();
+      }
+      return ptr;
+    }
+    inline void operator delete (void * ptr, size_t sz) {
+      typedef MagazineHeap<SuperHeap, sizeof(Object), MagazineSize> PoolType;
+      if (sz > sizeof(Object)) {
+	::operator delete (ptr);
+      } else {
+	PoolType().free (ptr);
+      }
+    }
+    inline void * operator new[] (size_t sz) {
+      return ::operator new[] (sz);
+    }
+    inline void operator delete[] (void * ptr) {
+      ::operator delete[] (ptr);
+    }
+    // As in PerClassHeap.
+    inline void * operator new (size_t, void * p) { return p; }
+    inline void * operator new[] (size_t, void * p) { return p; }
+
+    // NB: Object is still incomplete where this class is, so its size
+    // is only used inside the bodies (a MagazineHeap keeps no state of
+    // its own, so a temporary one will do).
+  };
+
+}
+
+#endif
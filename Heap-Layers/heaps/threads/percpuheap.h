@@ -0,0 +1,107 @@
+/* -*- C++ -*- */
+
+#ifndef HL_PERCPUHEAP_H
+#define HL_PERCPUHEAP_H
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+  
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+  
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include <assert.h>
+
+#include "threads/cpuinfo.h"
+
+/*
+
+  A PerCPUHeap comprises NumHeaps "per-CPU" heaps.
+
+  To pick a heap, we use the processor the current thread is running
+  on (via restartable sequences where available, or sched_getcpu),
+  mod NumHeaps. With NumHeaps at least the number of cores, contention
+  depends on the number of cores rather than the number of threads.
+
+  malloc gets memory from the current CPU's heap.
+  free returns memory to the current CPU's heap.
+
+  NB: A thread can migrate between choosing a heap and using it, so
+  the per-CPU heaps must still be locked (e.g., with a LockedHeap);
+  the lock is just almost never contended.  */
+
+namespace HL {
+
+  template <int NumHeaps, class PerCPUHeapType>
+  class PerCPUHeap : public PerCPUHeapType {
+  public:
+
+    enum { Alignment = PerCPUHeapType::Alignment };
+
+    inline void * malloc (size_t sz) {
+      return getHeap(getIndex())->malloc (sz);
+    }
+
+    inline void free (void * ptr) {
+      getHeap(getIndex())->free (ptr);
+    }
+
+    /// The batch protocol (see BatchHeap), all from one CPU's heap.
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      return getHeap(getIndex())->mallocBatch (sz, n, ptrs);
+    }
+
+    inline void freeBatch (void ** ptrs, int n) {
+      getHeap(getIndex())->freeBatch (ptrs, n);
+    }
+
+    inline size_t getSize (void * ptr) {
+      return getHeap(getIndex())->getSize (ptr);
+    }
+
+  private:
+
+    static inline int getIndex (void) {
+      int cpu = CPUInfo::getCurrentCPU() % NumHeaps;
+      assert (cpu >= 0);
+      assert (cpu < NumHeaps);
+      return cpu;
+    }
+
+    // Access the given heap within the buffer.
+    inline PerCPUHeapType * getHeap (int index) {
+      assert (index >= 0);
+      assert (index < NumHeaps);
+      return &cpuHeaps[index];
+    }
+
+    // Keep each heap on its own cache line(s).
+    class PaddedHeap : public PerCPUHeapType {
+      char _pad[64];
+    };
+
+    PaddedHeap cpuHeaps[NumHeaps];
+
+  };
+
+}
+
+
+#endif
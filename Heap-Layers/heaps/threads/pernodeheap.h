@@ -0,0 +1,175 @@
+/* -*- C++ -*- */
+
+#ifndef HL_PERNODEHEAP_H
+#define HL_PERNODEHEAP_H
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "heaps/top/numammapheap.h"
+#include "threads/cpuinfo.h"
+#include "utility/heapwalk.h"
+
+/*
+
+  A PerNodeHeap comprises one heap per NUMA node, NodeHeap<0> through
+  NodeHeap<NumNodes - 1>, where NodeHeap<N> should get its memory from
+  NUMAMmapHeap<N>:
+
+    template <int N>
+    class MyNodeHeap : public LockedHeap<SpinLockType, ... NUMAMmapHeap<N> ...> {};
+
+    PerNodeHeap<2, MyNodeHeap> heap;
+
+  malloc gets memory from the heap for the node of the processor the
+  current thread is running on (mod NumNodes).
+
+  free returns memory to the heap of the node it came from, which
+  NUMAMmapHeap's page map knows, so that freed memory is reused on its
+  own node rather than wherever the thread that frees it happens to
+  run. Memory no NUMAMmapHeap mapped goes to the current node's heap.
+
+  NB: Threads on the same node share its heap, and one can migrate
+  between choosing a heap and using it, so the per-node heaps must be
+  locked (e.g., with a LockedHeap or a ThreadHeap of their own).  */
+
+namespace HL {
+
+  /// NodeHeap<0> through NodeHeap<N - 1>, reached by node number.
+  template <int N, template <int> class NodeHeap>
+  class NodeHeapArray : public NodeHeapArray<N - 1, NodeHeap> {
+  private:
+
+    typedef NodeHeapArray<N - 1, NodeHeap> Rest;
+
+  public:
+
+    inline void * malloc (int node, size_t sz) {
+      return (node == N - 1) ? _heap.malloc (sz) : Rest::malloc (node, sz);
+    }
+
+    inline void * memalign (int node, size_t alignment, size_t sz) {
+      return (node == N - 1) ? _heap.memalign (alignment, sz) : Rest::memalign (node, alignment, sz);
+    }
+
+    inline void free (int node, void * ptr) {
+      if (node == N - 1) {
+	_heap.free (ptr);
+      } else {
+	Rest::free (node, ptr);
+      }
+    }
+
+    inline size_t getSize (int node, void * ptr) {
+      return (node == N - 1) ? _heap.getSize (ptr) : Rest::getSize (node, ptr);
+    }
+
+    size_t purge (size_t budget) {
+      size_t released = _heap.purge (budget);
+      if (released < budget) {
+	released += Rest::purge (budget - released);
+      }
+      return released;
+    }
+
+    void walk (HeapWalker& w) {
+      Rest::walk (w);
+      _heap.walk (w);
+    }
+
+  private:
+
+    // Keep each heap on its own cache line(s).
+    char _pad[64];
+    NodeHeap<N - 1> _heap;
+  };
+
+  template <template <int> class NodeHeap>
+  class NodeHeapArray<0, NodeHeap> {
+  public:
+    inline void * malloc (int, size_t) { return NULL; }
+    inline void * memalign (int, size_t, size_t) { return NULL; }
+    inline void free (int, void *) {}
+    inline size_t getSize (int, void *) { return 0; }
+    size_t purge (size_t) { return 0; }
+    void walk (HeapWalker&) {}
+  };
+
+
+  template <int NumNodes, template <int> class NodeHeap>
+  class PerNodeHeap {
+  public:
+
+    enum { Alignment = NodeHeap<0>::Alignment };
+
+    inline void * malloc (size_t sz) {
+      return _heaps.malloc (getCurrentNode(), sz);
+    }
+
+    inline void * memalign (size_t alignment, size_t sz) {
+      return _heaps.memalign (getCurrentNode(), alignment, sz);
+    }
+
+    inline void free (void * ptr) {
+      if (ptr != NULL) {
+	_heaps.free (getOwner (ptr), ptr);
+      }
+    }
+
+    inline size_t getSize (void * ptr) {
+      return _heaps.getSize (getOwner (ptr), ptr);
+    }
+
+    size_t purge (size_t budget) {
+      return _heaps.purge (budget);
+    }
+
+    void walk (HeapWalker& w) {
+      _heaps.walk (w);
+    }
+
+  private:
+
+    static inline int getCurrentNode (void) {
+      const int node = CPUInfo::getCurrentNode() % NumNodes;
+      assert (node >= 0);
+      return node;
+    }
+
+    /// The node ptr's memory came from, or else the current one.
+    static inline int getOwner (void * ptr) {
+      const int node = NUMAMmapHeap<0>::getNode (ptr);
+      return ((node >= 0) && (node < NumNodes)) ? node : getCurrentNode();
+    }
+
+    NodeHeapArray<NumNodes, NodeHeap> _heaps;
+  };
+
+}
+
+
+#endif
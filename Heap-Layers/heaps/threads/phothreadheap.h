@@ -4,8 +4,16 @@
 #define HL_PHOTHREADHEAP_H
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#include "locks/spinlock.h"
 #include "threads/cpuinfo.h"
+#include "utility/dllist.h"
+#include "utility/geometricclasses.h"
+#include "utility/guard.h"
+#include "utility/lockfreesllist.h"
+#include "utility/sassert.h"
 
 using namespace HL;
 
@@ -48,50 +56,332 @@ public:
 
 /*
 
-A PHOThreadHeap comprises NumHeaps "per-thread" heaps.
+A PHOThreadHeap comprises NumHeaps "per-thread" heaps, with
+ownership, in the manner of Hoard.
 
-To pick a per-thread heap, the current thread id is hashed (mod NumHeaps).
+To pick a per-thread heap, the current thread id is hashed (mod
+NumHeaps). Each heap has its own lock, which (with no more threads
+than heaps) only its thread takes, so malloc and a free by the
+allocating thread are uncontended.
 
-malloc gets memory from its hashed per-thread heap.
-free returns memory to its originating heap.
+Objects come from superblocks of SuperblockSize bytes (aligned to
+their size, so an object's superblock is found by masking), each
+holding one size class, and each owned by one heap or by the global
+pool. A free by the owner's thread goes straight back to the
+superblock. A free from any other thread pushes the object onto the
+owner's lock-free return list, which the owner drains on its next
+malloc; objects whose superblock has since changed hands are passed
+on to the new owner.
 
-NB: We assume that the thread heaps are 'locked' as needed.  */
+A heap whose free memory exceeds both EmptySuperblocks superblocks
+and 1/EmptyFraction of what it holds gives back the superblock it
+has just freed into, if that one is at least 1/EmptyFraction free,
+to the global pool; a heap that runs out adopts a superblock from
+there before asking SuperHeap for more. That bounds each heap's
+free memory (and so the blowup) to a constant factor of what it
+uses. The pool keeps up to NumHeaps completely empty superblocks,
+which any size class can reuse, and returns the rest to SuperHeap.
 
+Objects larger than SuperblockSize / 8 bytes get a superblock of
+their own, straight from SuperHeap. SuperHeap must provide memalign
+and be thread-safe (MmapHeap, for instance).
 
-template <int NumHeaps, class SuperHeap>
-class PHOThreadHeap { // : public MarkThreadHeap<NumHeaps, SuperHeap> {
+*/
+
+
+template <int NumHeaps, class SuperHeap, size_t SuperblockSize = 65536>
+class PHOThreadHeap : public SuperHeap {
 public:
 
+  enum { Alignment = 16 };
+
+  /// A heap returns memory past this many superblocks' worth...
+  enum { EmptySuperblocks = 4 };
+
+  /// ...and past this fraction (1/EmptyFraction) of what it holds.
+  enum { EmptyFraction = 4 };
+
+  PHOThreadHeap (void)
+    : _globalEmptyCount (0)
+  {
+    for (int h = 0; h < NumHeaps; h++) {
+      for (int c = 0; c < NumClasses; c++) {
+	_heaps[h].current[c] = NULL;
+      }
+      _heaps[h].held = 0;
+      _heaps[h].inUse = 0;
+    }
+  }
+
   inline void * malloc (size_t sz) {
-    int tid = CPUInfo::getThreadId() % NumHeaps;
-    void * ptr = selectHeap(tid)->malloc (sz);
-    return ptr;
+    if (sz > (size_t) MaxObjectSize) {
+      return bigMalloc (sz);
+    }
+    const int c = SizeClasses::getSizeClass (sz);
+    const int h = CPUInfo::getThreadId() % NumHeaps;
+    PerThread& t = _heaps[h];
+    Guard<SpinLockType> l (t.lock);
+    if (t.returned.peek() != NULL) {
+      drain (h);
+    }
+    Superblock * sb = t.current[c];
+    if ((sb == NULL) || sb->isFull()) {
+      sb = refill (h, c);
+      if (sb == NULL) {
+	return NULL;
+      }
+    }
+    t.inUse += sb->objectSize;
+    return sb->allocate();
   }
 
   inline void free (void * ptr) {
-    int tid = SuperHeap::getHeap(ptr);
-    selectHeap(tid)->free (ptr);
+    if (ptr == NULL) {
+      return;
+    }
+    Superblock * sb = getSuperblock (ptr);
+    if (sb->objectSize == 0) {
+      SuperHeap::free (sb);
+      return;
+    }
+    const int h = CPUInfo::getThreadId() % NumHeaps;
+    if (sb->owner == h) {
+      PerThread& t = _heaps[h];
+      Guard<SpinLockType> l (t.lock);
+      // Only a holder of our lock can give the superblock away.
+      if (sb->owner == h) {
+	localFree (h, sb, ptr);
+	return;
+      }
+    }
+    remoteFree (ptr);
   }
 
-
-  inline int remove (void * ptr);
-#if 0
-  {
-    int tid = SuperHeap::getHeap(ptr);
-    selectHeap(tid)->remove (ptr);
+  inline size_t getSize (void * ptr) {
+    Superblock * sb = getSuperblock (ptr);
+    return sb->objectSize ? sb->objectSize : sb->bigSize;
   }
-#endif
 
 private:
 
-  // Access the given heap within the buffer.
-  MarkThreadHeap<NumHeaps, SuperHeap> * selectHeap (int index) {
-    assert (index >= 0);
-    assert (index < NumHeaps);
-    return &ptHeaps[index];
+  enum { MaxObjectSize = SuperblockSize / 8 };
+
+  typedef GeometricSizeClasses<Alignment, 4, MaxObjectSize> SizeClasses;
+
+  enum { NumClasses = SizeClasses::NumBins };
+
+  /// The owner of a superblock in the global pool.
+  enum { Global = NumHeaps };
+
+  class Superblock : public DLList::Entry {
+  public:
+
+    inline void format (int c) {
+      sizeClass = c;
+      objectSize = SizeClasses::getClassMaxSize (c);
+      total = (int) ((SuperblockSize - HeaderSize) / objectSize);
+      inUse = 0;
+      freed = NULL;
+      bump = (char *) this + HeaderSize;
+    }
+
+    inline bool isFull (void) const {
+      return inUse == total;
+    }
+
+    inline bool isEmpty (void) const {
+      return inUse == 0;
+    }
+
+    inline void * allocate (void) {
+      assert (!isFull());
+      inUse++;
+      if (freed != NULL) {
+	void * ptr = freed;
+	freed = freed->next;
+	return ptr;
+      }
+      void * ptr = bump;
+      bump += objectSize;
+      return ptr;
+    }
+
+    inline void deallocate (void * ptr) {
+      assert (inUse > 0);
+      inUse--;
+      FreeObject * f = (FreeObject *) ptr;
+      f->next = freed;
+      freed = f;
+    }
+
+    class FreeObject {
+    public:
+      FreeObject * next;
+    };
+
+    volatile int owner;		// a heap, or Global
+    int sizeClass;
+    size_t objectSize;		// 0 for a large object
+    size_t bigSize;		// the size of a large object
+    int total;
+    int inUse;
+    FreeObject * freed;
+    char * bump;
+  };
+
+  enum { HeaderSize = 64 };
+
+  class PerThread {
+  public:
+    SpinLockType lock;
+    LockFreeSLList returned;	// freed by other threads
+    Superblock * current[NumClasses];
+    DLList available[NumClasses]; // neither current nor full
+    size_t held;		// bytes of superblocks owned
+    size_t inUse;		// bytes of objects allocated from them
+    char _pad[64];
+  };
+
+  inline static Superblock * getSuperblock (void * ptr) {
+    return (Superblock *) ((uintptr_t) ptr & ~((uintptr_t) SuperblockSize - 1));
+  }
+
+  NO_INLINE void * bigMalloc (size_t sz) {
+    sassert<(sizeof(Superblock) <= HeaderSize)> verifyHeader;
+    verifyHeader = verifyHeader;
+    if (sz > (size_t) -1 - HeaderSize) {
+      return NULL;
+    }
+    Superblock * sb = (Superblock *) SuperHeap::memalign (SuperblockSize, sz + HeaderSize);
+    if (sb == NULL) {
+      return NULL;
+    }
+    sb->objectSize = 0;
+    sb->bigSize = sz;
+    return (char *) sb + HeaderSize;
+  }
+
+  /// Replace heap h's full current superblock for class c. Call with
+  /// h's lock held.
+  NO_INLINE Superblock * refill (int h, int c) {
+    PerThread& t = _heaps[h];
+    // The full one goes on no list until a free makes room in it.
+    Superblock * sb = static_cast<Superblock *>(t.available[c].get());
+    if (sb == NULL) {
+      sb = adopt (h, c);
+    }
+    t.current[c] = sb;
+    return sb;
+  }
+
+  /// Take a superblock of class c from the global pool (or, failing
+  /// that, SuperHeap) for heap h. Call with h's lock held.
+  Superblock * adopt (int h, int c) {
+    Guard<SpinLockType> l (_globalLock);
+    Superblock * sb = static_cast<Superblock *>(_globalAvailable[c].get());
+    if (sb == NULL) {
+      sb = static_cast<Superblock *>(_globalEmpty.get());
+      if (sb != NULL) {
+	_globalEmptyCount--;
+      } else {
+	sb = (Superblock *) SuperHeap::memalign (SuperblockSize, SuperblockSize);
+	if (sb == NULL) {
+	  return NULL;
+	}
+      }
+      sb->format (c);
+    }
+    sb->owner = h;
+    _heaps[h].held += SuperblockSize;
+    _heaps[h].inUse += sb->inUse * sb->objectSize;
+    return sb;
+  }
+
+  /// Free ptr into sb, which heap h owns. Call with h's lock held.
+  void localFree (int h, Superblock * sb, void * ptr) {
+    PerThread& t = _heaps[h];
+    const bool wasFull = sb->isFull();
+    sb->deallocate (ptr);
+    t.inUse -= sb->objectSize;
+    if (sb == t.current[sb->sizeClass]) {
+      return;
+    }
+    if (wasFull) {
+      t.available[sb->sizeClass].insert (sb);
+    }
+    // The emptiness invariant: give back sb if we hold too much.
+    if ((t.inUse + EmptySuperblocks * SuperblockSize < t.held)
+	&& (t.inUse * EmptyFraction < t.held * (EmptyFraction - 1))
+	&& (sb->inUse * EmptyFraction <= sb->total * (EmptyFraction - 1))) {
+      t.available[sb->sizeClass].remove (sb);
+      t.held -= SuperblockSize;
+      t.inUse -= sb->inUse * sb->objectSize;
+      Guard<SpinLockType> l (_globalLock);
+      sb->owner = Global;
+      if (sb->isEmpty()) {
+	releaseEmpty (sb);
+      } else {
+	_globalAvailable[sb->sizeClass].insert (sb);
+      }
+    }
+  }
+
+  /// Free ptr, whose superblock is owned by another heap or the pool.
+  void remoteFree (void * ptr) {
+    Superblock * sb = getSuperblock (ptr);
+    while (true) {
+      const int owner = sb->owner;
+      if (owner != Global) {
+	// If the owner gives sb away first, it passes ptr on.
+	_heaps[owner].returned.insert (ptr);
+	return;
+      }
+      Guard<SpinLockType> l (_globalLock);
+      if (sb->owner == Global) {
+	const bool wasEmpty = sb->isEmpty();
+	sb->deallocate (ptr);
+	assert (!wasEmpty);
+	if (sb->isEmpty()) {
+	  _globalAvailable[sb->sizeClass].remove (sb);
+	  releaseEmpty (sb);
+	}
+	return;
+      }
+    }
+  }
+
+  /// Free the objects other threads returned to heap h. Call with
+  /// h's lock held.
+  NO_INLINE void drain (int h) {
+    PerThread& t = _heaps[h];
+    void * ptr;
+    while ((ptr = t.returned.get()) != NULL) {
+      Superblock * sb = getSuperblock (ptr);
+      if (sb->owner == h) {
+	localFree (h, sb, ptr);
+      } else {
+	remoteFree (ptr);
+      }
+    }
   }
 
-  MarkThreadHeap<NumHeaps, SuperHeap> ptHeaps[NumHeaps];
+  /// Keep an empty superblock for reuse, or give it back to SuperHeap.
+  /// Call with the global lock held.
+  void releaseEmpty (Superblock * sb) {
+    if (_globalEmptyCount < NumHeaps) {
+      _globalEmpty.insert (sb);
+      _globalEmptyCount++;
+    } else {
+      SuperHeap::free (sb);
+    }
+  }
+
+  PerThread _heaps[NumHeaps];
+
+  SpinLockType _globalLock;
+  DLList _globalAvailable[NumClasses];
+  DLList _globalEmpty;
+  int _globalEmptyCount;
 
 };
 
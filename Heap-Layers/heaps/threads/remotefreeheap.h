@@ -0,0 +1,156 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_REMOTEFREEHEAP_H
+#define HL_REMOTEFREEHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "threads/atomic.h"
+#include "utility/gcd.h"
+#include "wrappers/mallocinfo.h"
+
+/**
+ * @class RemoteFreeHeap
+ * @brief Returns freed objects to the heap that allocated them.
+ *
+ * Every object carries a header naming its owner. Freeing an
+ * object owned by this heap goes straight to the superheap; freeing
+ * one owned by another heap pushes it onto that owner's lock-free
+ * remote-free stack (any number of producers). The owner, the only
+ * consumer, detaches the whole stack with one atomic exchange on its
+ * next malloc and frees the objects locally in a batch.
+ *
+ * Use this as the per-thread heap of a ThreadSpecificHeap or ThreadHeap,
+ * which always call free on the calling thread's heap:
+ *
+ * <TT>
+ *   ThreadSpecificHeap<RemoteFreeHeap<MyLocalHeap> > heap;
+ * </TT>
+ *
+ * NB: malloc and clear must be serialized per heap (one thread per
+ * heap, or a LockedHeap above this one). Owners must also outlive
+ * the objects they allocated.
+ */
+
+namespace HL {
+
+  template <class SuperHeap>
+  class RemoteFreeHeap : public SuperHeap {
+  private:
+
+    union Header {
+      RemoteFreeHeap * _owner;
+      char _buf[HL::MallocInfo::Alignment];
+    };
+
+    class RemoteObject {
+    public:
+      RemoteObject * next;
+    };
+
+  public:
+
+    enum { Alignment = gcd<(int) SuperHeap::Alignment,
+	   (int) sizeof(Header)>::value };
+
+    RemoteFreeHeap (void)
+      : _remoteFrees (NULL)
+    {}
+
+    inline void * malloc (size_t sz) {
+      if (_remoteFrees != NULL) {
+	drainRemoteFrees();
+      }
+      Header * h = (Header *) SuperHeap::malloc (sz + sizeof(Header));
+      if (h == NULL) {
+	return NULL;
+      }
+      h->_owner = this;
+      return (void *) (h + 1);
+    }
+
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      RemoteFreeHeap * owner = getOwner (ptr);
+      if (owner == this) {
+	SuperHeap::free (getHeader (ptr));
+      } else {
+	owner->remoteFree (ptr);
+      }
+    }
+
+    inline size_t getSize (void * ptr) {
+      return SuperHeap::getSize (getHeader (ptr)) - sizeof(Header);
+    }
+
+    /// Return the heap that allocated the given object.
+    static inline RemoteFreeHeap * getOwner (void * ptr) {
+      return getHeader(ptr)->_owner;
+    }
+
+    /// Push an object onto this heap's remote-free stack.
+    /// Safe to call from any thread.
+    inline void remoteFree (void * ptr) {
+      RemoteObject * obj = (RemoteObject *) getHeader (ptr);
+      RemoteObject * head;
+      do {
+	head = _remoteFrees;
+	obj->next = head;
+      } while (!Atomic::compareAndSwap (&_remoteFrees, head, obj));
+    }
+
+    inline void clear (void) {
+      drainRemoteFrees();
+      SuperHeap::clear();
+    }
+
+  private:
+
+    /// Detach the remote-free stack and free everything on it locally.
+    NO_INLINE void drainRemoteFrees (void) {
+      RemoteObject * obj = Atomic::exchange (&_remoteFrees, (RemoteObject *) NULL);
+      while (obj != NULL) {
+	RemoteObject * next = obj->next;
+	SuperHeap::free (obj);
+	obj = next;
+      }
+    }
+
+    inline static Header * getHeader (void * ptr) {
+      return ((Header *) ptr - 1);
+    }
+
+    /// Objects freed by other threads, awaiting return to this heap.
+    RemoteObject * volatile _remoteFrees;
+  };
+
+}
+
+#endif
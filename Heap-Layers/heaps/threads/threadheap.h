@@ -31,6 +31,7 @@
 #include <new>
 
 #include "threads/cpuinfo.h"
+#include "utility/heapwalk.h"
 
 #if !defined(_WIN32)
 #include <pthread.h>
@@ -73,6 +74,22 @@ namespace HL {
       getHeap(tid)->free (ptr);
     }
 
+    /// The batch protocol (see BatchHeap): one per-thread heap for
+    /// the whole batch, which can then take its lock once.
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      int tid = CPUInfo::getThreadId() % NumHeaps;
+      assert (tid >= 0);
+      assert (tid < NumHeaps);
+      return getHeap(tid)->mallocBatch (sz, n, ptrs);
+    }
+
+    inline void freeBatch (void ** ptrs, int n) {
+      int tid = CPUInfo::getThreadId() % NumHeaps;
+      assert (tid >= 0);
+      assert (tid < NumHeaps);
+      getHeap(tid)->freeBatch (ptrs, n);
+    }
+
     inline size_t getSize (void * ptr) {
       int tid = CPUInfo::getThreadId() % NumHeaps;
       assert (tid >= 0);
@@ -80,7 +97,25 @@ namespace HL {
       return getHeap(tid)->getSize (ptr);
     }
 
-    
+    /// Purge each per-thread heap in turn.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      for (int i = 0; (i < NumHeaps) && (released < budget); i++) {
+	released += getHeap(i)->purge (budget - released);
+      }
+      return released;
+    }
+
+    void walk (HeapWalker& w) {
+      w.enter ("ThreadHeap", -1);
+      for (int i = 0; i < NumHeaps; i++) {
+	w.enter ("heap", i);
+	getHeap(i)->walk (w);
+	w.leave();
+      }
+      w.leave();
+    }
+
   private:
 
     // Access the given heap within the buffer.
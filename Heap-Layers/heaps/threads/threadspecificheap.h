@@ -31,13 +31,29 @@
 #include <new>
 
 #if defined(_WIN32)
-#error "This functionality currently is not implemented for Windows."
-#endif
-
+#include <windows.h>
+#else
 #include <pthread.h>
+#endif
 
+#include "locks/spinlock.h"
+#include "utility/guard.h"
 #include "wrappers/mmapwrapper.h"
 
+/**
+ * @class ThreadSpecificHeap
+ * @brief A heap per thread, kept under a pthread key.
+ *
+ * When a thread exits, its heap (and any memory cached in it) is
+ * orphaned rather than unmapped, and the next thread to need a heap
+ * adopts it, so short-lived threads do not leak what they had freed.
+ *
+ * On Windows the heap is kept in a fiber-local storage slot, whose
+ * callback orphans it when the thread exits; unlike a TLS slot or
+ * DLL_THREAD_DETACH, that works from a static library as well as from
+ * a DLL. A thread that runs fibers has a heap per fiber.
+ */
+
 namespace HL {
 
   template <class PerThreadHeap>
@@ -46,8 +62,13 @@ namespace HL {
 
     ThreadSpecificHeap (void)
     {
+#if defined(_WIN32)
+      // Make the slot (once: it is a function-level static).
+      getHeapKey();
+#else
       // Initialize the heap exactly once.
       pthread_once (&(getOnce()), initializeHeap);
+#endif
     }
 
     virtual ~ThreadSpecificHeap()
@@ -62,6 +83,15 @@ namespace HL {
       getHeap()->free (ptr);
     }
 
+    /// The batch protocol (see BatchHeap), all from this thread's heap.
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      return getHeap()->mallocBatch (sz, n, ptrs);
+    }
+
+    inline void freeBatch (void ** ptrs, int n) {
+      getHeap()->freeBatch (ptrs, n);
+    }
+
     inline size_t getSize (void * ptr) {
       return getHeap()->getSize(ptr);
     }
@@ -70,6 +100,37 @@ namespace HL {
 
   private:
 
+    /// A heap, and its link on the list of orphaned heaps.
+    class Node {
+    public:
+      PerThreadHeap heap;
+      Node * next;
+    };
+
+#if defined(_WIN32)
+
+    static DWORD getHeapKey() {
+      static DWORD heapKey = FlsAlloc (flsDeleteHeap);
+      return heapKey;
+    }
+
+    static void WINAPI flsDeleteHeap (void * ptr) {
+      // Also called, with NULL, for threads that never had a heap.
+      if (ptr != NULL) {
+	deleteHeap (ptr);
+      }
+    }
+
+    static inline void * getSpecific() {
+      return FlsGetValue (getHeapKey());
+    }
+
+    static inline void setSpecific (void * ptr) {
+      FlsSetValue (getHeapKey(), ptr);
+    }
+
+#else
+
     static void initializeHeap() {
       getHeap();
     }
@@ -85,23 +146,56 @@ namespace HL {
       return initOnce;
     }
 
-    static void deleteHeap (void *) {
-      PerThreadHeap * heap = getHeap();
-      HL::MmapWrapper::unmap (heap, sizeof(PerThreadHeap));
+    static inline void * getSpecific() {
+      return pthread_getspecific (getHeapKey());
+    }
+
+    static inline void setSpecific (void * ptr) {
+      pthread_setspecific (getHeapKey(), ptr);
+    }
+
+#endif
+
+    static Node *& getOrphans() {
+      static Node * orphans = NULL;
+      return orphans;
+    }
+
+    static SpinLockType& getOrphansLock() {
+      static SpinLockType lock;
+      return lock;
+    }
+
+    /// Runs at thread exit with the thread's heap, which is orphaned
+    /// for the next thread to adopt.
+    static void deleteHeap (void * ptr) {
+      Node * n = (Node *) ptr;
+      Guard<SpinLockType> l (getOrphansLock());
+      n->next = getOrphans();
+      getOrphans() = n;
     }
 
     // Access the given heap.
     static PerThreadHeap * getHeap() {
-      PerThreadHeap * heap =
-	(PerThreadHeap *) pthread_getspecific (getHeapKey());
-      if (heap == NULL)  {
-	// Grab some memory from a source, initialize the heap inside,
-	// and store it in the thread-local area.
-	void * buf = HL::MmapWrapper::map (sizeof(PerThreadHeap));
-	heap = new (buf) PerThreadHeap;
-	pthread_setspecific (getHeapKey(), (void *) heap);
+      Node * n = (Node *) getSpecific();
+      if (n == NULL)  {
+	// Adopt an orphaned heap if there is one; otherwise grab some
+	// memory from a source and initialize a heap inside. Either
+	// way, store it in the thread-local area.
+	{
+	  Guard<SpinLockType> l (getOrphansLock());
+	  n = getOrphans();
+	  if (n != NULL) {
+	    getOrphans() = n->next;
+	  }
+	}
+	if (n == NULL) {
+	  void * buf = HL::MmapWrapper::map (sizeof(Node));
+	  n = new (buf) Node;
+	}
+	setSpecific ((void *) n);
       }
-      return heap;
+      return &n->heap;
     }
   };
 
@@ -0,0 +1,201 @@
+/* -*- C++ -*- */
+
+#ifndef HL_TLSHEAP_H
+#define HL_TLSHEAP_H
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include <assert.h>
+#include <new>
+
+#if defined(_WIN32)
+#error "This functionality currently is not implemented for Windows."
+#endif
+
+#include <pthread.h>
+
+#include "locks/spinlock.h"
+#include "utility/guard.h"
+#include "wrappers/mmapwrapper.h"
+
+#if defined(__GNUC__)
+#define HL_INITIAL_EXEC __attribute__((tls_model ("initial-exec")))
+#else
+#define HL_INITIAL_EXEC
+#endif
+
+/**
+ * @class TLSHeap
+ * @brief A heap per thread, like ThreadSpecificHeap, found with one TLS load.
+ *
+ * Each thread's heap is kept in a __thread pointer (initial-exec, so
+ * reading it is a single load off the thread pointer); the pthread
+ * key is there only so its destructor runs when the thread exits.
+ * The heap of an exited thread is not unmapped but put on a list,
+ * along with whatever memory it holds, and handed to the next new
+ * thread. Thread pools that churn threads thus reuse warm heaps
+ * instead of mapping and filling new ones.
+ *
+ * The child of a fork gets only the forking thread. The idle list's
+ * lock is held across the fork, so the list is whole in the child;
+ * the heaps of the threads left behind, which may have been in the
+ * middle of a call, are simply left where they are. That costs the
+ * child nothing, however many there were, and keeps their pages
+ * shared with the parent rather than copied.
+ *
+ * Libraries meant to be dlopen'ed rather than preloaded or linked in
+ * should use ThreadSpecificHeap, since the initial-exec model may not
+ * find room for their TLS.
+ */
+
+namespace HL {
+
+  template <class PerThreadHeap>
+  class TLSHeap {
+  public:
+
+    TLSHeap (void)
+    {
+      pthread_once (&(getOnce()), createKey);
+    }
+
+    virtual ~TLSHeap()
+    {
+    }
+
+    inline void * malloc (size_t sz) {
+      return getHeap()->malloc (sz);
+    }
+
+    inline void free (void * ptr) {
+      getHeap()->free (ptr);
+    }
+
+    /// The batch protocol (see BatchHeap), all from this thread's heap.
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      return getHeap()->mallocBatch (sz, n, ptrs);
+    }
+
+    inline void freeBatch (void ** ptrs, int n) {
+      getHeap()->freeBatch (ptrs, n);
+    }
+
+    inline size_t getSize (void * ptr) {
+      return getHeap()->getSize(ptr);
+    }
+
+    enum { Alignment = PerThreadHeap::Alignment };
+
+  private:
+
+    /// A heap, and its link on the list of heaps with no thread.
+    class Node {
+    public:
+      PerThreadHeap heap;
+      Node * next;
+    };
+
+    static void createKey (void) {
+      pthread_key_create (&getHeapKey(), detachHeap);
+      pthread_atfork (lockIdle, unlockIdle, unlockIdle);
+    }
+
+    static void lockIdle (void) {
+      getIdleLock().lock();
+    }
+
+    static void unlockIdle (void) {
+      getIdleLock().unlock();
+    }
+
+    static pthread_key_t& getHeapKey() {
+      static pthread_key_t heapKey;
+      return heapKey;
+    }
+
+    static pthread_once_t& getOnce() {
+      static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+      return initOnce;
+    }
+
+    static Node *& getCurrent() {
+      static __thread Node * current HL_INITIAL_EXEC;
+      return current;
+    }
+
+    static Node *& getIdle() {
+      static Node * idle = NULL;
+      return idle;
+    }
+
+    static SpinLockType& getIdleLock() {
+      static SpinLockType lock;
+      return lock;
+    }
+
+    static inline PerThreadHeap * getHeap() {
+      Node * n = getCurrent();
+      if (n == NULL) {
+	n = attachHeap();
+      }
+      return &n->heap;
+    }
+
+    /// Gives this thread a heap: one left by an exited thread if
+    /// there is one, or else a new one.
+    NO_INLINE static Node * attachHeap() {
+      pthread_once (&(getOnce()), createKey);
+      Node * n;
+      {
+	Guard<SpinLockType> l (getIdleLock());
+	n = getIdle();
+	if (n != NULL) {
+	  getIdle() = n->next;
+	}
+      }
+      if (n == NULL) {
+	void * buf = HL::MmapWrapper::map (sizeof(Node));
+	n = new (buf) Node;
+      }
+      getCurrent() = n;
+      pthread_setspecific (getHeapKey(), (void *) n);
+      return n;
+    }
+
+    /// Runs at thread exit: the heap goes on the idle list for the
+    /// next thread. Should a later destructor on this thread allocate,
+    /// it gets a heap (and a key destructor) afresh.
+    static void detachHeap (void * ptr) {
+      Node * n = (Node *) ptr;
+      getCurrent() = NULL;
+      Guard<SpinLockType> l (getIdleLock());
+      n->next = getIdle();
+      getIdle() = n;
+    }
+  };
+
+}
+
+#endif
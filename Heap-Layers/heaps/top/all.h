@@ -1,5 +1,16 @@
+#include "cachedmmapheap.h"
+#include "compressedheap.h"
+#include "filemappedheap.h"
+#include "hugetlbheap.h"
 #include "mallocheap.h"
+#include "memfdheap.h"
 #include "mmapheap.h"
+#include "numammapheap.h"
+#include "pinnedheap.h"
+#include "prefaultedmmapheap.h"
+#include "reservedheap.h"
 #include "sbrkheap.h"
+#include "sharedmemoryheap.h"
 #include "staticheap.h"
+#include "uringbufferpool.h"
 
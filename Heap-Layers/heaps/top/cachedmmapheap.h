@@ -0,0 +1,330 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_CACHEDMMAPHEAP_H
+#define HL_CACHEDMMAPHEAP_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "heaps/top/mmapheap.h"
+#include "locks/posixlock.h"
+#include "utility/bitops.h"
+#include "utility/guard.h"
+#include "utility/heapwalk.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class CachedMmapHeap
+ * @brief An MmapHeap that keeps freed mappings for reuse instead of
+ * unmapping them.
+ *
+ * munmap costs a TLB shootdown on every CPU running the process, and
+ * mapping the range again costs a fresh page fault per page. Here a
+ * freed mapping instead has its pages released with MADV_FREE (or,
+ * where the kernel lacks it, MADV_DONTNEED) and goes into a cache
+ * bucketed by the power of two of its page count; malloc takes the
+ * first one in its bucket that is big enough. The kernel can reclaim
+ * the pages whenever it needs them, so the cache costs address space,
+ * not memory.
+ *
+ * A mapping is unmapped only when the cache is full (more than
+ * MaxCachedBytes, or its bucket has no free slot), when it has sat
+ * there through MaxAge frees (each free ages one bucket), or on purge.
+ * Memory from the cache is not zeroed, so unlike MmapHeap,
+ * ZeroMemory is 0 and mallocZeroed clears what it reuses. The hits
+ * and misses are in the StatsRegistry as "mmap-cache".
+ *
+ * @param MaxCachedBytes The most address space the cache keeps.
+ * @param MaxAge How many frees a mapping stays cached for.
+ */
+
+namespace HL {
+
+#if defined(_WIN32)
+
+  // VirtualFree does not shoot down TLBs the way munmap does on
+  // Unix, so there is no cache.
+  template <size_t MaxCachedBytes = 64 * 1024 * 1024, int MaxAge = 4096>
+  class CachedMmapHeap : public MmapHeap {};
+
+#else
+
+  template <size_t MaxCachedBytes = 64 * 1024 * 1024, int MaxAge = 4096>
+  class CachedMmapHeap : public MmapHeap {
+  public:
+
+    enum { ZeroMemory = 0 };
+
+    enum { Alignment = MmapHeap::Alignment };
+
+    CachedMmapHeap (void)
+      : _cachedBytes (0),
+	_frees (0),
+	_hand (0),
+	_hits (0),
+	_misses (0),
+	_evictions (0),
+	_stats ("mmap-cache", this)
+    {
+      memset (_slots, 0, sizeof(_slots));
+    }
+
+    ~CachedMmapHeap (void) {
+      purge ((size_t) -1);
+    }
+
+    inline void * malloc (size_t sz) {
+      bool zeroed;
+      void * ptr = fromCache (sz, zeroed);
+      if (ptr == NULL) {
+	ptr = MmapHeap::malloc (sz);
+      }
+      return ptr;
+    }
+
+    inline void * mallocZeroed (size_t sz) {
+      bool zeroed;
+      void * ptr = fromCache (sz, zeroed);
+      if (ptr == NULL) {
+	return MmapHeap::malloc (sz);
+      }
+      if (!zeroed) {
+	memset (ptr, 0, sz);
+      }
+      return ptr;
+    }
+
+    /// Cached mappings are only page-aligned, so bigger alignments
+    /// get a fresh one.
+    inline void * memalign (size_t alignment, size_t sz) {
+      if (alignment <= (size_t) MmapWrapper::Size) {
+	return malloc (sz);
+      }
+      return MmapHeap::memalign (alignment, sz);
+    }
+
+    inline void free (void * ptr) {
+      const size_t sz = MyMap.erase (ptr);
+      if (sz == 0) {
+	return;
+      }
+      if (!toCache (ptr, pageRound (sz))) {
+	MmapHeap::free (ptr, sz);
+      }
+    }
+
+    inline void free (void * ptr, size_t) {
+      free (ptr);
+    }
+
+    /// Unmap cached mappings until budget bytes have gone.
+    size_t purge (size_t budget) {
+      Guard<PosixLockType> l (_lock);
+      size_t released = 0;
+      for (int b = 0; (b < NumBuckets) && (released < budget); b++) {
+	for (int i = 0; (i < SlotsPerBucket) && (released < budget); i++) {
+	  if (_slots[b][i].ptr != NULL) {
+	    released += _slots[b][i].size;
+	    evict (_slots[b][i]);
+	  }
+	}
+      }
+      return released;
+    }
+
+    /// The cached mappings are free, but hold no memory until touched.
+    void walk (HeapWalker& w) {
+      HeapUsage u;
+      for (int b = 0; b < NumBuckets; b++) {
+	for (int i = 0; i < SlotsPerBucket; i++) {
+	  if (_slots[b][i].ptr != NULL) {
+	    u.freeObjects++;
+	  }
+	}
+      }
+      u.heldBytes = u.freeBytes = _cachedBytes;
+      w.visit ("CachedMmapHeap", u);
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("cached_bytes", _cachedBytes);
+      w.field ("hits", _hits);
+      w.field ("misses", _misses);
+      w.field ("evictions", _evictions);
+    }
+
+  private:
+
+    enum { SlotsPerBucket = 4 };
+    enum { NumBuckets = sizeof(size_t) * 8 - 12 };
+
+    class Slot {
+    public:
+      void * ptr;
+      size_t size;
+      /// When it was cached, in frees.
+      unsigned long stamp;
+      /// Whether its pages read as zero (after MADV_DONTNEED).
+      bool zeroed;
+    };
+
+    static inline size_t pageRound (size_t sz) {
+      return (sz + MmapWrapper::Size - 1) & ~((size_t) MmapWrapper::Size - 1);
+    }
+
+    /// Mappings of 2^b up to 2^(b+1) - 1 pages.
+    static inline int bucketOf (size_t sz) {
+      const int b = BitOps::highestBit (sz / MmapWrapper::Size);
+      return (b < NumBuckets) ? b : NumBuckets - 1;
+    }
+
+    void * fromCache (size_t sz, bool& zeroed) {
+      if (sz == 0) {
+	return NULL;
+      }
+      const size_t rounded = pageRound (sz);
+      if (rounded < sz) {
+	return NULL;
+      }
+      void * ptr = NULL;
+      {
+	Guard<PosixLockType> l (_lock);
+	Slot * s = _slots[bucketOf (rounded)];
+	for (int i = 0; i < SlotsPerBucket; i++) {
+	  if ((s[i].ptr != NULL) && (s[i].size >= rounded)) {
+	    ptr = s[i].ptr;
+	    zeroed = s[i].zeroed;
+	    // The object gets the whole mapping.
+	    sz = s[i].size;
+	    _cachedBytes -= s[i].size;
+	    s[i].ptr = NULL;
+	    break;
+	  }
+	}
+	if (ptr == NULL) {
+	  _misses++;
+	  return NULL;
+	}
+	_hits++;
+      }
+      MyMap.set (ptr, sz);
+      return ptr;
+    }
+
+    /// Release the pages of a mapping and cache it, if there is room.
+    bool toCache (void * ptr, size_t sz) {
+      if (sz > MaxCachedBytes) {
+	return false;
+      }
+      bool zeroed = false;
+#if defined(MADV_FREE)
+      if (madvise (ptr, sz, MADV_FREE) != 0)
+#endif
+      {
+	if (madvise (ptr, sz, MADV_DONTNEED) != 0) {
+	  return false;
+	}
+	zeroed = true;
+      }
+      Guard<PosixLockType> l (_lock);
+      const unsigned long now = ++_frees;
+      age (now);
+      // Unmap the oldest mappings while it would go over the limit.
+      while (_cachedBytes + sz > MaxCachedBytes) {
+	Slot * oldest = findOldest (NULL, NumBuckets);
+	if (oldest == NULL) {
+	  break;
+	}
+	evict (*oldest);
+      }
+      Slot * s = _slots[bucketOf (sz)];
+      Slot * slot = NULL;
+      for (int i = 0; i < SlotsPerBucket; i++) {
+	if (s[i].ptr == NULL) {
+	  slot = &s[i];
+	  break;
+	}
+      }
+      if (slot == NULL) {
+	slot = findOldest (s, 1);
+	evict (*slot);
+      }
+      slot->ptr = ptr;
+      slot->size = sz;
+      slot->stamp = now;
+      slot->zeroed = zeroed;
+      _cachedBytes += sz;
+      return true;
+    }
+
+    /// Unmap what has been in the next bucket for MaxAge frees.
+    void age (unsigned long now) {
+      Slot * s = _slots[_hand];
+      _hand = (_hand + 1) % NumBuckets;
+      for (int i = 0; i < SlotsPerBucket; i++) {
+	if ((s[i].ptr != NULL) && (now - s[i].stamp > (unsigned long) MaxAge)) {
+	  evict (s[i]);
+	}
+      }
+    }
+
+    /// The oldest mapping in n buckets starting at first (or in all).
+    Slot * findOldest (Slot * first, int n) {
+      Slot * s = (first != NULL) ? first : &_slots[0][0];
+      Slot * oldest = NULL;
+      for (int i = 0; i < n * SlotsPerBucket; i++) {
+	if ((s[i].ptr != NULL) && ((oldest == NULL) || (s[i].stamp < oldest->stamp))) {
+	  oldest = &s[i];
+	}
+      }
+      return oldest;
+    }
+
+    void evict (Slot& s) {
+      MmapHeap::free (s.ptr, s.size);
+      _cachedBytes -= s.size;
+      s.ptr = NULL;
+      _evictions++;
+    }
+
+    PosixLockType _lock;
+    Slot _slots[NumBuckets][SlotsPerBucket];
+    size_t _cachedBytes;
+    unsigned long _frees;
+    int _hand;
+    unsigned long _hits;
+    unsigned long _misses;
+    unsigned long _evictions;
+    LayerStats<CachedMmapHeap> _stats;
+  };
+
+#endif
+
+}
+
+#endif
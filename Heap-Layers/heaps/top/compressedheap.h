@@ -0,0 +1,218 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_COMPRESSEDHEAP_H
+#define HL_COMPRESSEDHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iterator>
+
+#include "heaps/top/reservedheap.h"
+
+/**
+ * @class CompressedHeap
+ * @brief A source heap whose objects can all be named by 32-bit offsets.
+ *
+ * Everything comes from one region of 4GB (on 64-bit systems; 512MB
+ * on others), reserved up front and aligned to its own size, so the
+ * low 32 bits of any pointer into it are its offset, and putting the
+ * region's base back is one OR. That is the trick behind a JVM's
+ * compressed oops: a structure full of links (a graph, a tree, an
+ * index) that stores CompressedPtrs instead of pointers spends half
+ * as much memory on them, and so fits more of itself in cache.
+ *
+ * Like ReservedHeap (which it is, with the region as the reservation),
+ * it only bumps a pointer, so put a heap that reuses memory on top:
+ *
+ * <TT>
+ *   SegHeap<..., FreelistHeap<CompressedHeap<> >, CompressedHeap<> >
+ * </TT>
+ *
+ * Every CompressedHeap with the same CommitBytes shares the region, so
+ * an offset means the same thing whichever of them handed it out.
+ * Offset 0 is never handed out, and stands for NULL.
+ *
+ * @param CommitBytes How much more of the region to make accessible at a time.
+ */
+
+namespace HL {
+
+  template <size_t CommitBytes = 1024 * 1024>
+  class CompressedHeap :
+    public ReservedHeap<(size_t) 1 << ((sizeof(void *) == 8) ? 32 : 29),
+			CommitBytes,
+			(size_t) 1 << ((sizeof(void *) == 8) ? 32 : 29)>
+  {
+    typedef ReservedHeap<(size_t) 1 << ((sizeof(void *) == 8) ? 32 : 29),
+			 CommitBytes,
+			 (size_t) 1 << ((sizeof(void *) == 8) ? 32 : 29)> SuperHeap;
+
+  public:
+
+    /// The offset of ptr (which must be NULL or in the region).
+    static inline uint32_t compress (const void * ptr) {
+      assert ((ptr == NULL) || SuperHeap::getRange().isValid (ptr));
+      return (uint32_t) ((size_t) ptr - (size_t) base());
+    }
+
+    /// The pointer at offset (NULL for 0).
+    static inline void * decompress (uint32_t offset) {
+      if (offset == 0) {
+	return NULL;
+      }
+      return (void *) ((size_t) base() | offset);
+    }
+
+    /// The start of the region.
+    static inline char * base (void) {
+      return SuperHeap::getRange().base();
+    }
+  };
+
+
+  /**
+   * @class CompressedPtr
+   * @brief A pointer to a T in a CompressedHeap's region, in 32 bits.
+   *
+   * It converts to and from T *, so it can stand in for one in a
+   * structure's links (node->next = new node, node->next->value, and
+   * if (node->next) all work), and it does pointer arithmetic, so it
+   * can be a container's pointer type (see CompressedAllocator).
+   */
+
+  template <class T, class Region = CompressedHeap<> >
+  class CompressedPtr {
+  public:
+
+    typedef T element_type;
+    typedef T value_type;
+    typedef T * pointer;
+    typedef T & reference;
+    typedef ptrdiff_t difference_type;
+    typedef std::random_access_iterator_tag iterator_category;
+
+    template <class U>
+    struct rebind {
+      typedef CompressedPtr<U, Region> other;
+    };
+
+    CompressedPtr (void)
+      : _offset (0)
+    {}
+
+    CompressedPtr (T * ptr)
+      : _offset (Region::compress (ptr))
+    {}
+
+    /// Converts wherever U * converts to T *.
+    template <class U>
+    CompressedPtr (const CompressedPtr<U, Region>& p)
+      : _offset (Region::compress (static_cast<T *>(p.get())))
+    {}
+
+    static CompressedPtr pointer_to (T& r) {
+      return CompressedPtr (&r);
+    }
+
+    inline T * get (void) const {
+      return (T *) Region::decompress (_offset);
+    }
+
+    inline uint32_t offset (void) const {
+      return _offset;
+    }
+
+    inline operator T * (void) const {
+      return get();
+    }
+
+    inline T * operator-> (void) const {
+      return get();
+    }
+
+    inline T& operator* (void) const {
+      return *get();
+    }
+
+    inline T& operator[] (difference_type i) const {
+      return get()[i];
+    }
+
+    inline CompressedPtr& operator+= (difference_type i) {
+      _offset += (uint32_t) (i * (difference_type) sizeof(T));
+      return *this;
+    }
+
+    inline CompressedPtr& operator-= (difference_type i) {
+      _offset -= (uint32_t) (i * (difference_type) sizeof(T));
+      return *this;
+    }
+
+    inline CompressedPtr& operator++ (void) {
+      return *this += 1;
+    }
+
+    inline CompressedPtr& operator-- (void) {
+      return *this -= 1;
+    }
+
+    inline CompressedPtr operator++ (int) {
+      CompressedPtr p (*this);
+      *this += 1;
+      return p;
+    }
+
+    inline CompressedPtr operator-- (int) {
+      CompressedPtr p (*this);
+      *this -= 1;
+      return p;
+    }
+
+    inline CompressedPtr operator+ (difference_type i) const {
+      CompressedPtr p (*this);
+      return p += i;
+    }
+
+    inline CompressedPtr operator- (difference_type i) const {
+      CompressedPtr p (*this);
+      return p -= i;
+    }
+
+    inline difference_type operator- (const CompressedPtr& p) const {
+      return ((difference_type) _offset - (difference_type) p._offset) / (difference_type) sizeof(T);
+    }
+
+  private:
+
+    uint32_t _offset;
+  };
+
+}
+
+#endif
@@ -0,0 +1,187 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_FILEMAPPEDHEAP_H
+#define HL_FILEMAPPEDHEAP_H
+
+#include <stddef.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "heaps/top/sharedmemoryheap.h"
+
+/**
+ * @class FileMappedHeap
+ * @brief A heap kept in a file, which a restarted program reopens
+ * with everything it had allocated still there.
+ *
+ * This is SharedMemoryHeap's allocator (size-class free lists and all,
+ * in the region's first page) over a file mapped MAP_SHARED, so the
+ * heap and its objects outlive the process, in the page cache and then
+ * on disk. The program leaves a root object, from which it can find
+ * the rest, and a later run picks it up:
+ *
+ * <TT>
+ *   typedef FileMappedHeap<> Persistent;
+ *   Persistent::arena().open ("/var/cache/app.heap", 8UL << 30);
+ *   Cache * c = (Cache *) Persistent::arena().getRoot();
+ *   if (c == NULL) {
+ *     c = new (Persistent().malloc (sizeof(Cache))) Cache;
+ *     Persistent::arena().setRoot (c);
+ *   }
+ * </TT>
+ *
+ * The file records where it was first mapped, and open maps it there
+ * again if that address is free, so that pointers between objects in
+ * the heap stay good. If it is not, relocated() says so, and only the
+ * offsets (offsetOf, pointerAt) can be relied on. Nothing in the heap
+ * may point outside it.
+ *
+ * Allocating and freeing take no lock, so a program that dies (or is
+ * killed) leaves the heap usable, short of at most a block it was in
+ * the middle of handing out; the objects themselves are as consistent
+ * as the program left them. The kernel writes the pages back when it
+ * likes; sync() waits until they are on disk, which is what survives
+ * a crash of the machine.
+ *
+ * Blocks freed to a heap layered above (FreelistHeap's list, say) are
+ * in the process, not the file, and are lost to the heap when it
+ * exits; so a persistent heap uses the arena's own size classes, and
+ * layers above it should not keep freed objects.
+ *
+ * The file cannot grow: open makes a new (or empty) file of bytes, and
+ * takes an existing one at its size.
+ *
+ * @param Id Distinguishes the arenas of separate files.
+ */
+
+namespace HL {
+
+  class FileMappedArena : public SharedMemoryArena {
+  public:
+
+    FileMappedArena (void)
+      : _relocated (false)
+    {}
+
+    /// Open (or make) the heap in the file at path. Opens of the same
+    /// file are serialized by flock, so only one of them makes it.
+    bool open (const char * path, size_t bytes) {
+#if !defined(_WIN32)
+      if (_base != NULL) {
+	return false;
+      }
+      const int fd = ::open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+      if (fd < 0) {
+	return false;
+      }
+      flock (fd, LOCK_EX);
+      const bool ok = openLocked (fd, bytes);
+      flock (fd, LOCK_UN);
+      if (!ok) {
+	::close (fd);
+      }
+      return ok;
+#else
+      return false;
+#endif
+    }
+
+    /// Whether open had to map the heap somewhere other than where it
+    /// was made, so that pointers between its objects are wrong.
+    inline bool relocated (void) const {
+      return _relocated;
+    }
+
+    /// Write the heap back to the file, and wait for the disk.
+    bool sync (void) {
+#if !defined(_WIN32)
+      return ((_base != NULL) && (msync (_base, _size, MS_SYNC) == 0));
+#else
+      return false;
+#endif
+    }
+
+    /// Unmap the heap, leaving the file as it is.
+    void close (void) {
+      detach();
+      _relocated = false;
+    }
+
+  private:
+
+#if !defined(_WIN32)
+    bool openLocked (int fd, size_t bytes) {
+      struct stat st;
+      Header h;
+      if (fstat (fd, &st) != 0) {
+	return false;
+      }
+      // A file that format never finished (or an empty one) is made
+      // afresh.
+      if ((st.st_size == 0)
+	  || ((pread (fd, &h.magic, sizeof(h.magic), 0) == (ssize_t) sizeof(h.magic))
+	      && (h.magic == 0))) {
+	if ((bytes < HeaderBytes + Alignment) || (bytes >= ((uint64_t) 1 << OffsetBits))) {
+	  return false;
+	}
+	bytes = (bytes + MmapWrapper::Size - 1) & ~((size_t) MmapWrapper::Size - 1);
+	_relocated = false;
+	return format (fd, bytes, NULL);
+      }
+      if ((pread (fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h))
+	  || (h.magic != Magic) || (h.size != (uint64_t) st.st_size)) {
+	return false;
+      }
+      void * where = (void *) (size_t) h.base;
+      if (!map (fd, (size_t) h.size, where)) {
+	return false;
+      }
+      _relocated = ((void *) _base != where);
+      if (!formatted()) {
+	unmap();
+	return false;
+      }
+      return true;
+    }
+#endif
+
+    bool _relocated;
+  };
+
+
+  template <int Id = 0>
+  class FileMappedHeap : public SharedMemoryHeap<Id, FileMappedArena> {};
+
+}
+
+#endif
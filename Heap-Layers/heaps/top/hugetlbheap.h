@@ -0,0 +1,280 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_HUGETLBHEAP_H
+#define HL_HUGETLBHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "heaps/top/mmapheap.h"
+#include "locks/posixlock.h"
+#include "threads/atomic.h"
+#include "utility/geometricclasses.h"
+#include "utility/heapwalk.h"
+#include "utility/openhashmap.h"
+#include "utility/sassert.h"
+#include "utility/singleton.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class HugeTLBHeap
+ * @brief A source heap of explicit huge pages (hugetlbfs), with a fallback.
+ *
+ * Unlike HugePageHeap, which only asks for transparent huge pages (and
+ * gets them when khugepaged and fragmentation allow), this maps pages
+ * of PageSize (2MB or 1GB on x86-64) from the kernel's reserved pool,
+ * with MAP_HUGETLB, or, if HL_HUGETLBFS names a hugetlbfs mount, from
+ * an unlinked file there (the mount's page size must be PageSize). The
+ * kernel reserves the pages when the mapping is made, so a pool that
+ * has run out shows up as a failed mmap rather than as a SIGBUS later;
+ * then, with Fallback, the object comes from PrivateMmapHeap instead,
+ * aligned to PageSize and marked MADV_HUGEPAGE. Every size is rounded
+ * up to whole huge pages, so put a chunk-carving layer on top, with
+ * chunks a little under a multiple of PageSize:
+ *
+ * <TT>
+ *   ZoneHeap<HugeTLBHeap<>, 2 * 1024 * 1024 - 64> arena;
+ * </TT>
+ *
+ * How many objects got huge pages, fell back, or got nothing at all is
+ * in the StatsRegistry, as "hugetlb". Elsewhere than Linux there are
+ * no huge pages here, so everything falls back.
+ *
+ * @param PageSize The huge page size (a power of two).
+ * @param Fallback Whether to use ordinary pages when there are no huge ones.
+ */
+
+namespace HL {
+
+  /// Maps huge pages and counts how that went, for all the
+  /// HugeTLBHeaps of one page size.
+  template <size_t PageSize>
+  class HugeTLBPool {
+  public:
+
+    HugeTLBPool (void)
+      : _dir (getenv ("HL_HUGETLBFS")),
+	_hugeMaps (0),
+	_fallbacks (0),
+	_failures (0),
+	_stats ("hugetlb", this)
+    {
+      sassert<((PageSize & (PageSize - 1)) == 0)
+	&& (PageSize >= (size_t) MmapWrapper::Size)> verifyParameters;
+      verifyParameters = verifyParameters;
+    }
+
+    /// Map sz bytes (a multiple of PageSize) of huge pages, or NULL.
+    void * map (size_t sz) {
+      void * ptr = (_dir != NULL) ? mapFile (sz) : mapAnonymous (sz);
+      if (ptr != NULL) {
+	Atomic::fetchAndAdd (&_hugeMaps, 1);
+      }
+      return ptr;
+    }
+
+    inline void countFallback (void) {
+      Atomic::fetchAndAdd (&_fallbacks, 1);
+    }
+
+    inline void countFailure (void) {
+      Atomic::fetchAndAdd (&_failures, 1);
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("page_size", (size_t) PageSize);
+      w.field ("huge_maps", _hugeMaps);
+      w.field ("fallbacks", _fallbacks);
+      w.field ("failures", _failures);
+    }
+
+  private:
+
+#if defined(__linux__)
+
+    static void * mapAnonymous (size_t sz) {
+#if defined(MAP_HUGETLB)
+#if defined(MAP_HUGE_SHIFT)
+      // Say which size, in case it is not the kernel's default one.
+      const int sizeFlag = StaticLog2<PageSize>::VALUE << MAP_HUGE_SHIFT;
+#else
+      const int sizeFlag = 0;
+#endif
+      void * ptr = mmap (NULL, sz, HL_MMAP_PROTECTION_MASK,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag, -1, 0);
+      return (ptr == MAP_FAILED) ? NULL : ptr;
+#else
+      return NULL;
+#endif
+    }
+
+    /// Map a new file in the hugetlbfs mount, unlinked at once so it
+    /// goes away with the mapping.
+    void * mapFile (size_t sz) {
+      static const char name[] = "/hl-hugetlb-XXXXXX";
+      char path[256];
+      const size_t len = strlen (_dir);
+      if (len + sizeof(name) > sizeof(path)) {
+	return NULL;
+      }
+      memcpy (path, _dir, len);
+      memcpy (path + len, name, sizeof(name));
+      const int fd = mkstemp (path);
+      if (fd < 0) {
+	return NULL;
+      }
+      unlink (path);
+      void * ptr = MAP_FAILED;
+      if (ftruncate (fd, (off_t) sz) == 0) {
+	ptr = mmap (NULL, sz, HL_MMAP_PROTECTION_MASK, MAP_SHARED, fd, 0);
+      }
+      close (fd);
+      return (ptr == MAP_FAILED) ? NULL : ptr;
+    }
+
+#else
+
+    static void * mapAnonymous (size_t) {
+      return NULL;
+    }
+
+    void * mapFile (size_t) {
+      return NULL;
+    }
+
+#endif
+
+    /// The hugetlbfs mount, if any.
+    const char * const _dir;
+
+    volatile long _hugeMaps;
+    volatile long _fallbacks;
+    volatile long _failures;
+    LayerStats<HugeTLBPool> _stats;
+  };
+
+
+  template <size_t PageSize = 2 * 1024 * 1024, bool Fallback = true>
+  class HugeTLBHeap {
+  public:
+
+    /// All memory from here is zeroed.
+    enum { ZeroMemory = 1 };
+
+    enum { Alignment = PageSize };
+
+    inline void * malloc (size_t sz) {
+      const size_t rounded = pageRound (sz);
+      if ((rounded < sz) || (sz == 0)) {
+	return NULL;
+      }
+      void * ptr = getPool().map (rounded);
+      if ((ptr == NULL) && Fallback) {
+	ptr = PrivateMmapHeap::memalign (PageSize, rounded);
+#if defined(MADV_HUGEPAGE)
+	if (ptr != NULL) {
+	  madvise (ptr, rounded, MADV_HUGEPAGE);
+	}
+#endif
+	getPool().countFallback();
+      }
+      if ((ptr != NULL) && !_sizes.set (ptr, rounded)) {
+	// As in MmapHeap, a mapping we could not note is of no use.
+	PrivateMmapHeap::free (ptr, rounded);
+	ptr = NULL;
+      }
+      if (ptr == NULL) {
+	getPool().countFailure();
+	return NULL;
+      }
+      return ptr;
+    }
+
+    inline void * mallocZeroed (size_t sz) {
+      return malloc (sz);
+    }
+
+    /// Everything is aligned to PageSize, and no more.
+    inline void * memalign (size_t alignment, size_t sz) {
+      if (alignment > PageSize) {
+	return NULL;
+      }
+      return malloc (sz);
+    }
+
+    inline size_t getSize (void * ptr) {
+      return _sizes.get (ptr);
+    }
+
+    inline void free (void * ptr) {
+      assert (reinterpret_cast<size_t>(ptr) % PageSize == 0);
+      // As in MmapHeap, forget the size before the address can be reused.
+      const size_t sz = _sizes.erase (ptr);
+      if (sz != 0) {
+	PrivateMmapHeap::free (ptr, sz);
+      }
+    }
+
+    inline void free (void * ptr, size_t) {
+      free (ptr);
+    }
+
+    /// Everything here is in use, so there is nothing to purge.
+    size_t purge (size_t) {
+      return 0;
+    }
+
+    /// A source heap: the walk ends here (the counts are in the
+    /// StatsRegistry, as "hugetlb").
+    void walk (HeapWalker&) {}
+
+  private:
+
+    static inline size_t pageRound (size_t sz) {
+      return (sz + PageSize - 1) & ~((size_t) PageSize - 1);
+    }
+
+    static inline HugeTLBPool<PageSize>& getPool (void) {
+      return singleton<HugeTLBPool<PageSize> >::getInstance();
+    }
+
+    /// The size of each mapping, since a huge page has no room for a header.
+    StripedHashMap<void *, size_t, PosixLockType> _sizes;
+  };
+
+}
+
+#endif
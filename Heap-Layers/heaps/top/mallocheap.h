@@ -40,6 +40,7 @@ extern "C" size_t malloc_usable_size (void *) throw ();
  * @brief A "source heap" that uses malloc and free.
  */
 
+#include "utility/heapwalk.h"
 #include "wrappers/mallocinfo.h"
 
 
@@ -74,6 +75,19 @@ namespace HL {
       return ::malloc_size (ptr);
     }
 #endif
+
+    /// A source heap: the walk ends here.
+    void walk (HeapWalker&) {}
+
+    /// Everything here is in use, so there is nothing to purge.
+    size_t purge (size_t) {
+      return 0;
+    }
+
+    /// The C library's size classes are its own business.
+    inline size_t goodSize (size_t sz) {
+      return sz;
+    }
   
   };
 
@@ -0,0 +1,432 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_MEMFDHEAP_H
+#define HL_MEMFDHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "locks/spinlock.h"
+#include "utility/guard.h"
+#include "utility/heapwalk.h"
+#include "utility/sassert.h"
+#include "utility/singleton.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+#define HL_MEMFD_SUPPORTED 1
+#else
+#define HL_MEMFD_SUPPORTED 0
+#endif
+
+/**
+ * @class MemfdHeap
+ * @brief Chunks of one memory file, whose pages chunks can share.
+ *
+ * The arena is an anonymous memory file (from memfd_create) of
+ * ArenaBytes, which costs nothing until written, mapped whole and
+ * shared, so that a chunk's address range can be pointed at another
+ * chunk's pages. malloc hands out chunks of ChunkBytes, aligned to
+ * their size. alias(dst, src) maps dst (and any chunk already sharing
+ * its pages) onto src's pages with mmap(MAP_FIXED) and gives dst's own
+ * pages back to the OS: from then on the two chunks are one piece of
+ * memory at two addresses. This is how SlabHeap::mesh frees a page run
+ * without moving any of its objects. Freeing any chunk frees every
+ * chunk that shares its pages, and gives the pages back.
+ *
+ * Each alias splits the arena's mapping, so a process can alias about
+ * as many chunks as vm.max_map_count allows (65530 by default).
+ *
+ * A child process would otherwise share the heap with its parent, so
+ * a fork copies the chunks in use to a fresh file in the child (which
+ * costs as much as the heap holds), and the child aborts if it cannot.
+ *
+ * All the MemfdHeaps with the same parameters share one arena. Only
+ * Linux has memfd_create; elsewhere, malloc always returns NULL.
+ *
+ * @param ChunkBytes The size of every chunk (a power of two, at least a page).
+ * @param ArenaBytes How much address space (and file) to reserve.
+ */
+
+namespace HL {
+
+  template <size_t ChunkBytes, size_t ArenaBytes>
+  class MemfdArena {
+  public:
+
+    enum { Chunks = ArenaBytes / ChunkBytes };
+
+    MemfdArena (void)
+      : _fd (-1),
+	_base (NULL),
+	_frames (NULL),
+	_ring (NULL),
+	_freeChunks (NULL),
+	_nFree (0),
+	_next (0),
+	_inUse (0),
+	_aliases (0),
+	_forkCopies (0),
+	_stats ("memfd", this)
+    {
+      sassert<((ChunkBytes & (ChunkBytes - 1)) == 0)
+	&& (ChunkBytes >= (size_t) MmapWrapper::Size)
+	&& ((ArenaBytes % ChunkBytes) == 0)
+	&& (Chunks > 0)> verifyParameters;
+      verifyParameters = verifyParameters;
+#if HL_MEMFD_SUPPORTED
+      _fd = makeFile();
+      if (_fd < 0) {
+	return;
+      }
+      char * base = (char *) reserve();
+      unsigned int * maps = (unsigned int *) MmapWrapper::map (3 * (size_t) Chunks * sizeof(unsigned int));
+      if ((base == NULL) || (maps == NULL)
+	  || (mmap (base, ArenaBytes, HL_MMAP_PROTECTION_MASK, MAP_SHARED | MAP_FIXED, _fd, 0) == MAP_FAILED)) {
+	::close (_fd);
+	_fd = -1;
+	return;
+      }
+      _frames = maps;
+      _ring = maps + Chunks;
+      _freeChunks = maps + 2 * Chunks;
+      _base = base;
+      pthread_atfork (lockBeforeFork, unlockAfterFork, copyAfterFork);
+#endif
+    }
+
+    inline void * memalign (size_t alignment, size_t sz) {
+      if ((sz > ChunkBytes) || (alignment > ChunkBytes) || (_base == NULL)) {
+	return NULL;
+      }
+      Guard<SpinLockType> l (_lock);
+      unsigned int c;
+      if (_nFree > 0) {
+	c = _freeChunks[--_nFree];
+      } else if (_next < (unsigned int) Chunks) {
+	c = _next++;
+      } else {
+	return NULL;
+      }
+      _frames[c] = c;
+      _ring[c] = c;
+      _inUse++;
+      return chunk (c);
+    }
+
+    /// Free a chunk and every chunk sharing its pages, and give the
+    /// pages back. Each chunk gets its own (empty) pages back too.
+    void free (void * ptr) {
+      if (!isValid (ptr)) {
+	return;
+      }
+      Guard<SpinLockType> l (_lock);
+      const unsigned int c = index (ptr);
+      const unsigned int frame = _frames[c];
+      assert (frame != NoFrame);
+      unsigned int w = c;
+      do {
+	const unsigned int next = _ring[w];
+	if (w != frame) {
+	  remap (w, w);
+	}
+	_frames[w] = NoFrame;
+	_freeChunks[_nFree++] = w;
+	_inUse--;
+	w = next;
+      } while (w != c);
+      punch (frame);
+    }
+
+    /// Make dst (and the chunks sharing its pages) use src's pages,
+    /// and give back dst's. Whatever dst held is lost.
+    bool alias (void * dst, void * src) {
+      if (!isValid (dst) || !isValid (src)) {
+	return false;
+      }
+      Guard<SpinLockType> l (_lock);
+      const unsigned int d = index (dst);
+      const unsigned int s = index (src);
+      const unsigned int from = _frames[d];
+      const unsigned int to = _frames[s];
+      assert ((from != NoFrame) && (to != NoFrame));
+      if (from == to) {
+	return true;
+      }
+      unsigned int w = d;
+      do {
+	if (!remap (w, to)) {
+	  // Put back the ones already moved.
+	  for (unsigned int v = d; v != w; v = _ring[v]) {
+	    remap (v, from);
+	    _frames[v] = from;
+	  }
+	  return false;
+	}
+	_frames[w] = to;
+	w = _ring[w];
+      } while (w != d);
+      punch (from);
+      // Join the two rings.
+      const unsigned int t = _ring[d];
+      _ring[d] = _ring[s];
+      _ring[s] = t;
+      _aliases++;
+      return true;
+    }
+
+    inline bool isValid (const void * ptr) const {
+      return ((_base != NULL)
+	      && ((const char *) ptr >= _base)
+	      && ((const char *) ptr < _base + ArenaBytes));
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("chunk_bytes", (size_t) ChunkBytes);
+      w.field ("chunks_in_use", _inUse);
+      w.field ("aliases", _aliases);
+      w.field ("fork_copies", _forkCopies);
+    }
+
+  private:
+
+    // Disable copying and assignment.
+    MemfdArena (const MemfdArena&);
+    MemfdArena& operator= (const MemfdArena&);
+
+    /// The frame of a free chunk.
+    enum { NoFrame = ~0U };
+
+    inline char * chunk (unsigned int c) const {
+      return _base + (size_t) c * ChunkBytes;
+    }
+
+    inline unsigned int index (const void * ptr) const {
+      return (unsigned int) (((const char *) ptr - _base) / ChunkBytes);
+    }
+
+#if HL_MEMFD_SUPPORTED
+
+    static int makeFile (void) {
+      // MFD_CLOEXEC, from <linux/memfd.h>.
+      const int fd = (int) syscall (SYS_memfd_create, "heaplayers", 1U);
+      if ((fd >= 0) && (ftruncate (fd, ArenaBytes) != 0)) {
+	::close (fd);
+	return -1;
+      }
+      return fd;
+    }
+
+    /// Address space for the arena, aligned to ChunkBytes.
+    static void * reserve (void) {
+      char * ptr = (char *) mmap (NULL, ArenaBytes + ChunkBytes, PROT_NONE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (ptr == (char *) MAP_FAILED) {
+	return NULL;
+      }
+      char * base = (char *) (((size_t) ptr + ChunkBytes - 1) & ~(ChunkBytes - 1));
+      if (base > ptr) {
+	munmap (ptr, base - ptr);
+      }
+      munmap (base + ArenaBytes, (ptr + ChunkBytes) - base);
+      return base;
+    }
+
+    /// Point chunk c at frame f's pages.
+    inline bool remap (unsigned int c, unsigned int f) {
+      return (mmap (chunk (c), ChunkBytes, HL_MMAP_PROTECTION_MASK,
+		    MAP_SHARED | MAP_FIXED, _fd, (off_t) f * ChunkBytes) != MAP_FAILED);
+    }
+
+    /// Give frame f's pages back to the OS.
+    inline void punch (unsigned int f) {
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+      fallocate (_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) f * ChunkBytes, ChunkBytes);
+#else
+      MmapWrapper::release (chunk (f), ChunkBytes);
+#endif
+    }
+
+    static inline MemfdArena& getArena (void) {
+      return singleton<MemfdArena>::getInstance();
+    }
+
+    static void lockBeforeFork (void) {
+      getArena()._lock.lock();
+    }
+
+    static void unlockAfterFork (void) {
+      getArena()._lock.unlock();
+    }
+
+    /// In the child: move everything onto a file of its own.
+    static void copyAfterFork (void) {
+      MemfdArena& a = getArena();
+      if (!a.copyFile()) {
+	fprintf (stderr, "MemfdHeap: could not copy the heap after fork.\n");
+	abort();
+      }
+      a._forkCopies++;
+      a._lock.unlock();
+    }
+
+    bool copyFile (void) {
+      const int fd = makeFile();
+      if (fd < 0) {
+	return false;
+      }
+      // Every frame in use is still mapped by its own chunk.
+      for (unsigned int c = 0; c < _next; c++) {
+	if ((_frames[c] == c)
+	    && (pwrite (fd, chunk (c), ChunkBytes, (off_t) c * ChunkBytes) != (ssize_t) ChunkBytes)) {
+	  ::close (fd);
+	  return false;
+	}
+      }
+      if (mmap (_base, ArenaBytes, HL_MMAP_PROTECTION_MASK, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+	::close (fd);
+	return false;
+      }
+      ::close (_fd);
+      _fd = fd;
+      for (unsigned int c = 0; c < _next; c++) {
+	if ((_frames[c] != NoFrame) && (_frames[c] != c) && !remap (c, _frames[c])) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+#else
+
+    static int makeFile (void) {
+      return -1;
+    }
+
+    inline bool remap (unsigned int, unsigned int) {
+      return false;
+    }
+
+    inline void punch (unsigned int) {}
+
+#endif
+
+    /// The memory file.
+    int _fd;
+
+    /// Where it is mapped.
+    char * _base;
+
+    /// The frame (file chunk) whose pages each chunk uses.
+    unsigned int * _frames;
+
+    /// The next chunk with the same frame, in a circular list.
+    unsigned int * _ring;
+
+    /// A stack of the free chunks below _next.
+    unsigned int * _freeChunks;
+    unsigned int _nFree;
+
+    /// The first chunk never handed out.
+    unsigned int _next;
+
+    SpinLockType _lock;
+    unsigned long _inUse;
+    unsigned long _aliases;
+    unsigned long _forkCopies;
+    LayerStats<MemfdArena> _stats;
+  };
+
+
+  template <size_t ChunkBytes = 64 * 1024,
+	    size_t ArenaBytes = (size_t) 1 << ((sizeof(void *) == 8) ? 36 : 29)>
+  class MemfdHeap {
+  public:
+
+    typedef MemfdArena<ChunkBytes, ArenaBytes> ArenaType;
+
+    enum { Alignment = ChunkBytes };
+
+    inline void * malloc (size_t sz) {
+      return getArena().memalign (ChunkBytes, sz);
+    }
+
+    inline void * memalign (size_t alignment, size_t sz) {
+      return getArena().memalign (alignment, sz);
+    }
+
+    inline void free (void * ptr) {
+      getArena().free (ptr);
+    }
+
+    inline void free (void * ptr, size_t) {
+      getArena().free (ptr);
+    }
+
+    inline size_t getSize (void *) const {
+      return ChunkBytes;
+    }
+
+    /// Make dst share src's pages (see above).
+    inline bool alias (void * dst, void * src) {
+      return getArena().alias (dst, src);
+    }
+
+    inline bool isValid (const void * ptr) {
+      return getArena().isValid (ptr);
+    }
+
+    /// Freed chunks' pages go back as they are freed.
+    size_t purge (size_t) {
+      return 0;
+    }
+
+    /// A source heap: the walk ends here (the arena is in the
+    /// StatsRegistry, as "memfd").
+    void walk (HeapWalker&) {}
+
+  private:
+
+    static inline ArenaType& getArena (void) {
+      return singleton<ArenaType>::getInstance();
+    }
+  };
+
+}
+
+#endif
@@ -46,8 +46,11 @@
 #include "heaps/special/bumpalloc.h"
 #include "heaps/threads/lockedheap.h"
 #include "locks/posixlock.h"
-#include "utility/myhashmap.h"
+#include "utility/heapwalk.h"
+#include "utility/openhashmap.h"
+#include "utility/probes.h"
 #include "utility/sassert.h"
+#include "utility/unmapqueue.h"
 #include "wrappers/mmapwrapper.h"
 #include "wrappers/stlallocator.h"
 
@@ -89,6 +92,36 @@ namespace HL {
 #endif
       return (void *) ptr;
     }
+
+    /// VirtualAlloc always returns zero-filled pages.
+    static inline void * mallocZeroed (size_t sz) {
+      return malloc (sz);
+    }
+
+    static void * memalign (size_t alignment, size_t sz) {
+      if (alignment <= Alignment) {
+	return malloc (sz);
+      }
+      // Find an aligned address inside a large enough reservation,
+      // release it, and then claim just the aligned part. Another
+      // thread may grab the range in between, in which case we retry.
+      while (true) {
+	char * ptr = (char *) VirtualAlloc (NULL, sz + alignment, MEM_RESERVE, PAGE_NOACCESS);
+	if (ptr == NULL) {
+	  return NULL;
+	}
+	char * aligned = (char *) (((size_t) ptr + alignment - 1) & ~(alignment - 1));
+	VirtualFree (ptr, 0, MEM_RELEASE);
+#if HL_EXECUTABLE_HEAP
+	ptr = (char *) VirtualAlloc (aligned, sz, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+#else
+	ptr = (char *) VirtualAlloc (aligned, sz, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#endif
+	if (ptr != NULL) {
+	  return (void *) ptr;
+	}
+      }
+    }
   
     static inline void free (void * ptr, size_t) {
       // No need to keep track of sizes in Windows.
@@ -123,12 +156,49 @@ namespace HL {
       }
       return ptr;
     }
+
+    /// Fresh mappings are always zero-filled.
+    static inline void * mallocZeroed (size_t sz) {
+      return malloc (sz);
+    }
+
+    /// Map enough to contain an aligned block, then unmap the slop
+    /// on either side, so only sz bytes (rounded to pages) stay mapped.
+    static void * memalign (size_t alignment, size_t sz) {
+      if (alignment <= Alignment) {
+	return malloc (sz);
+      }
+      sz = (sz + Alignment - 1) & ~((size_t) Alignment - 1);
+      const size_t mapSize = sz + alignment - Alignment;
+      if (mapSize < sz) {
+	// Overflow.
+	return NULL;
+      }
+      char * ptr = (char *) malloc (mapSize);
+      if (ptr == NULL) {
+	return NULL;
+      }
+      char * aligned = (char *) (((size_t) ptr + alignment - 1) & ~(alignment - 1));
+      char * end = ptr + mapSize;
+      if (aligned > ptr) {
+	munmap (ptr, aligned - ptr);
+      }
+      if (aligned + sz < end) {
+	munmap (aligned + sz, end - (aligned + sz));
+      }
+      return (void *) aligned;
+    }
     
     static void free (void * ptr, size_t sz)
     {
       if ((long) sz < 0) {
 	abort();
       }
+#if HL_ASYNC_MUNMAP
+      if (UnmapQueue::defer (ptr, sz)) {
+	return;
+      }
+#endif
       munmap (reinterpret_cast<char *>(ptr), sz);
     }
 
@@ -142,36 +212,99 @@ namespace HL {
 
   private:
 
-    // Note: we never reclaim memory obtained for MyHeap, even when
-    // this heap is destroyed.
-    class MyHeap : public LockedHeap<PosixLockType, FreelistHeap<BumpAlloc<16384, PrivateMmapHeap> > > {
-    };
-
-    typedef MyHashMap<void *, size_t, MyHeap> mapType;
+    // Maps each mapping's address to its size. The map is striped
+    // and resizable, so large-object operations on different
+    // stripes run in parallel and lookups stay O(1).
+    typedef StripedHashMap<void *, size_t, PosixLockType> mapType;
 
   protected:
     mapType MyMap;
 
-    PosixLockType MyMapLock;
-
   public:
 
+    enum { ZeroMemory = PrivateMmapHeap::ZeroMemory };
+
     enum { Alignment = PrivateMmapHeap::Alignment };
 
     inline void * malloc (size_t sz) {
+      HL_PROBE1 (mmap_alloc_start, sz);
       void * ptr = PrivateMmapHeap::malloc (sz);
-      MyMapLock.lock();
-      MyMap.set (ptr, sz);
-      MyMapLock.unlock();
+      if ((ptr != NULL) && !MyMap.set (ptr, sz)) {
+	// With no record of its size, it could never be freed.
+	PrivateMmapHeap::free (ptr, sz);
+	ptr = NULL;
+      }
+      HL_PROBE2 (mmap_alloc_done, sz, ptr);
       assert (reinterpret_cast<size_t>(ptr) % Alignment == 0);
       return const_cast<void *>(ptr);
     }
 
+    inline void * mallocZeroed (size_t sz) {
+      return malloc (sz);
+    }
+
+    inline void * memalign (size_t alignment, size_t sz) {
+      void * ptr = PrivateMmapHeap::memalign (alignment, sz);
+      if ((ptr != NULL) && !MyMap.set (ptr, sz)) {
+	PrivateMmapHeap::free (ptr, sz);
+	ptr = NULL;
+      }
+      assert (reinterpret_cast<size_t>(ptr) % alignment == 0);
+      return ptr;
+    }
+
     inline size_t getSize (void * ptr) {
-      MyMapLock.lock();
-      size_t sz = MyMap.get (ptr);
-      MyMapLock.unlock();
-      return sz;
+      return MyMap.get (ptr);
+    }
+
+    /// Grow or shrink a mapping without moving it: mremap on Linux,
+    /// elsewhere just unmap the tail when shrinking.
+    inline bool resize (void * ptr, size_t sz) {
+      const size_t oldSize = MyMap.get (ptr);
+      if ((oldSize == 0) || (sz == 0)) {
+	return false;
+      }
+      const size_t oldMapped = pageRound (oldSize);
+      const size_t newMapped = pageRound (sz);
+      if (newMapped != oldMapped) {
+#if defined(__linux__)
+	if (mremap (ptr, oldMapped, newMapped, 0) == MAP_FAILED) {
+	  return false;
+	}
+#else
+	if (newMapped > oldMapped) {
+	  return false;
+	}
+	PrivateMmapHeap::free ((char *) ptr + newMapped, oldMapped - newMapped);
+#endif
+      }
+      MyMap.set (ptr, sz);
+      return true;
+    }
+
+    /// Grow or shrink a mapping, moving it if need be: on Linux, an
+    /// mremap that moves the pages rather than copying them. Returns
+    /// the new address, or NULL (leaving ptr as it was) if it can't.
+    inline void * remap (void * ptr, size_t sz) {
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+      // As in free, remove the entry before the old address can be reused.
+      const size_t oldSize = MyMap.erase (ptr);
+      if ((oldSize == 0) || (sz == 0)) {
+	if (oldSize != 0) {
+	  MyMap.set (ptr, oldSize);
+	}
+	return NULL;
+      }
+      void * newPtr = mremap (ptr, pageRound (oldSize), pageRound (sz), MREMAP_MAYMOVE);
+      if (newPtr == MAP_FAILED) {
+	MyMap.set (ptr, oldSize);
+	return NULL;
+      }
+      MyMap.set (newPtr, sz);
+      return newPtr;
+#else
+      return resize (ptr, sz) ? ptr : NULL;
+#endif
     }
 
     // WORKAROUND: apparent gcc bug.
@@ -181,11 +314,34 @@ namespace HL {
 
     inline void free (void * ptr) {
       assert (reinterpret_cast<size_t>(ptr) % Alignment == 0);
-      MyMapLock.lock();
-      size_t sz = MyMap.get (ptr);
-      PrivateMmapHeap::free (ptr, sz);
-      MyMap.erase (ptr);
-      MyMapLock.unlock();
+      // Remove the entry before unmapping, so that a concurrent mmap
+      // that reuses this address cannot have its entry erased.
+      size_t sz = MyMap.erase (ptr);
+      if (sz != 0) {
+	HL_PROBE2 (mmap_free_start, sz, ptr);
+	PrivateMmapHeap::free (ptr, sz);
+	HL_PROBE2 (mmap_free_done, sz, ptr);
+      }
+    }
+
+    /// A source heap: the walk ends here.
+    void walk (HeapWalker&) {}
+
+    /// Everything here is in use, so there is nothing to purge.
+    size_t purge (size_t) {
+      return 0;
+    }
+
+    /// getSize reports the size asked for, so that is all a caller
+    /// can count on.
+    inline size_t goodSize (size_t sz) {
+      return sz;
+    }
+
+  private:
+
+    static inline size_t pageRound (size_t sz) {
+      return (sz + MmapWrapper::Size - 1) & ~((size_t) MmapWrapper::Size - 1);
     }
 #endif
   };
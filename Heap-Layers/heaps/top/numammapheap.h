@@ -0,0 +1,205 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_NUMAMMAPHEAP_H
+#define HL_NUMAMMAPHEAP_H
+
+#include <stddef.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "heaps/top/mmapheap.h"
+#include "utility/pagemap.h"
+#include "utility/sassert.h"
+#include "utility/singleton.h"
+
+/**
+ * @class NUMAMmapHeap
+ * @brief An MmapHeap whose mappings come from one NUMA node.
+ *
+ * Each fresh mapping gets a memory policy (with mbind, before any of
+ * its pages are touched) that puts its pages on the given node. The
+ * policy is MPOL_PREFERRED rather than MPOL_BIND, so that a node that
+ * runs out of memory spills to the others instead of failing. A node
+ * the machine does not have gets the default policy.
+ *
+ * The node of every page mapped by any NUMAMmapHeap is kept in a page
+ * map, so getNode tells which node's heap an object (or anything
+ * carved from one) came from, without a system call; PerNodeHeap uses
+ * it to send each free to its owner.
+ *
+ * Elsewhere than Linux, it only keeps the page map; on Windows, it is
+ * just an MmapHeap.
+ *
+ * @param Node The node to allocate from.
+ */
+
+namespace HL {
+
+  /// The node each NUMAMmapHeap page came from, plus one (0 if none).
+  class NUMANodeMap : public PageMap<int> {};
+
+#if defined(_WIN32)
+
+  template <int Node>
+  class NUMAMmapHeap : public MmapHeap {
+  public:
+    static inline int getNode (const void *) {
+      return -1;
+    }
+  };
+
+#else
+
+  template <int Node>
+  class NUMAMmapHeap : public MmapHeap {
+  public:
+
+    enum { Alignment = MmapHeap::Alignment };
+
+    NUMAMmapHeap (void)
+    {
+      sassert<(Node >= 0)> verifyNode;
+      verifyNode = verifyNode;
+    }
+
+    inline void * malloc (size_t sz) {
+      return placed (MmapHeap::malloc (sz), sz);
+    }
+
+    inline void * mallocZeroed (size_t sz) {
+      return malloc (sz);
+    }
+
+    inline void * memalign (size_t alignment, size_t sz) {
+      return placed (MmapHeap::memalign (alignment, sz), sz);
+    }
+
+    inline bool resize (void * ptr, size_t sz) {
+      const size_t oldSize = MmapHeap::getSize (ptr);
+      if (!MmapHeap::resize (ptr, sz)) {
+	return false;
+      }
+      if (sz > oldSize) {
+	placed (ptr, sz);
+      } else {
+	const size_t keep = pageRound (sz);
+	if (keep < pageRound (oldSize)) {
+	  getMap().setRange ((char *) ptr + keep, pageRound (oldSize) - keep, 0);
+	}
+      }
+      return true;
+    }
+
+    /// The pages keep their policy when mremap moves them.
+    inline void * remap (void * ptr, size_t sz) {
+      const size_t oldSize = MmapHeap::getSize (ptr);
+      if (oldSize != 0) {
+	getMap().setRange (ptr, oldSize, 0);
+      }
+      void * newPtr = MmapHeap::remap (ptr, sz);
+      if (newPtr == NULL) {
+	if (oldSize != 0) {
+	  getMap().setRange (ptr, oldSize, Node + 1);
+	}
+	return NULL;
+      }
+      getMap().setRange (newPtr, sz, Node + 1);
+      if (sz > oldSize) {
+	bind (newPtr, pageRound (sz));
+      }
+      return newPtr;
+    }
+
+    inline void free (void * ptr) {
+      const size_t sz = MmapHeap::getSize (ptr);
+      if (sz != 0) {
+	getMap().setRange (ptr, sz, 0);
+      }
+      MmapHeap::free (ptr);
+    }
+
+    inline void free (void * ptr, size_t) {
+      free (ptr);
+    }
+
+    /// The node whose NUMAMmapHeap mapped ptr, or -1 if none did.
+    static inline int getNode (const void * ptr) {
+      return getMap().get (ptr) - 1;
+    }
+
+  private:
+
+    static inline NUMANodeMap& getMap (void) {
+      return singleton<NUMANodeMap>::getInstance();
+    }
+
+    static inline size_t pageRound (size_t sz) {
+      return (sz + MmapWrapper::Size - 1) & ~((size_t) MmapWrapper::Size - 1);
+    }
+
+    /// Put a fresh mapping's pages on the node, and note that they are.
+    inline void * placed (void * ptr, size_t sz) {
+      if (ptr == NULL) {
+	return NULL;
+      }
+      bind (ptr, pageRound (sz));
+      getMap().setRange (ptr, sz, Node + 1);
+      return ptr;
+    }
+
+#if defined(__linux__) && defined(SYS_mbind)
+
+    // MPOL_PREFERRED, from <linux/mempolicy.h> (libnuma is not needed).
+    enum { PreferredPolicy = 1 };
+
+    enum { BitsPerWord = sizeof(unsigned long) * 8 };
+    enum { MaskWords = Node / BitsPerWord + 1 };
+
+    static void bind (void * ptr, size_t sz) {
+      unsigned long mask[MaskWords] = { 0 };
+      mask[Node / BitsPerWord] = 1UL << (Node % BitsPerWord);
+      // The kernel reads one bit fewer than maxnode says.
+      syscall (SYS_mbind, ptr, sz, (int) PreferredPolicy, mask,
+	       (unsigned long) (MaskWords * BitsPerWord + 1), 0U);
+    }
+
+#else
+
+    static void bind (void *, size_t) {}
+
+#endif
+
+  };
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,376 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_PINNEDHEAP_H
+#define HL_PINNEDHEAP_H
+
+#include <stddef.h>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#include "heaps/buildingblock/freelistheap.h"
+#include "heaps/combining/segheap.h"
+#include "heaps/top/mmapheap.h"
+#include "locks/spinlock.h"
+#include "utility/geometricclasses.h"
+#include "utility/guard.h"
+#include "utility/heapwalk.h"
+#include "utility/sassert.h"
+#include "utility/singleton.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class PinnedHeap
+ * @brief Page-aligned buffers in pinned, registered slabs, for devices
+ * that read and write them directly (NICs, RDMA).
+ *
+ * The memory comes in slabs of SlabBytes, each locked in memory with
+ * mlock and handed once to Registrar::registerSlab (which, for a
+ * verbs stack, would call ibv_reg_mr and return the memory region), so
+ * that no I/O has to pin or register its buffer. registration(ptr)
+ * finds the handle of the slab that holds any buffer, without a lock:
+ * slabs are aligned to their size, and the first page of each records
+ * its handle and the length of each buffer in it.
+ *
+ * PinnedSlabHeap is the source heap. It carves buffers of a power of
+ * two pages from the current slab and never takes them back (freeing
+ * one does nothing), except that a buffer of more than half a slab
+ * gets slabs of its own, which it unregisters, unlocks and unmaps when
+ * freed. PinnedHeap puts FreelistHeaps of each power of two pages in
+ * front of it, which is where freed buffers wait, pinned and
+ * registered, for the next I/O of their size:
+ *
+ * <TT>
+ *   class Verbs {  // The Registrar.
+ *   public:
+ *     ibv_pd * pd;
+ *     void * registerSlab (void * p, size_t n) {
+ *       return ibv_reg_mr (pd, p, n, IBV_ACCESS_LOCAL_WRITE);
+ *     }
+ *     void deregisterSlab (void * mr, void *, size_t) {
+ *       ibv_dereg_mr ((ibv_mr *) mr);
+ *     }
+ *   };
+ *   typedef PinnedHeap<4194304, Verbs> Buffers;
+ *   Buffers::registrar().pd = pd;
+ *   LockedHeap<SpinLockType, Buffers> buffers;
+ *   void * buf = buffers.malloc (9000);
+ *   ibv_mr * mr = (ibv_mr *) Buffers::registration (buf);
+ * </TT>
+ *
+ * Like SegHeap, PinnedHeap itself takes no lock; the slabs, which all
+ * the PinnedHeaps with the same parameters share, do. A slab that
+ * cannot be locked (RLIMIT_MEMLOCK) or registered (a NULL handle) is
+ * unmapped, and malloc returns NULL.
+ *
+ * @param SlabBytes The size of a slab (a power of two, of at least four pages).
+ * @param Registrar How to register slabs (NoRegistration does nothing).
+ */
+
+namespace HL {
+
+  /// A Registrar for memory that only needs to be pinned.
+  class NoRegistration {
+  public:
+
+    /// The handle for a new slab, or NULL if it cannot be registered.
+    inline void * registerSlab (void * ptr, size_t) {
+      return ptr;
+    }
+
+    inline void deregisterSlab (void *, void *, size_t) {}
+  };
+
+
+  template <size_t SlabBytes, class Registrar>
+  class PinnedArena {
+  public:
+
+    enum { PageSize = MmapWrapper::Size };
+    enum { SlabPages = SlabBytes / PageSize };
+
+    /// Buffers of up to this many pages share slabs.
+    enum { MaxSmallPages = SlabPages / 2 };
+
+    PinnedArena (void)
+      : _current (NULL),
+	_used (0),
+	_slabs (0),
+	_pinnedBytes (0),
+	_failures (0),
+	_stats ("pinned", this)
+    {
+      sassert<((SlabBytes & (SlabBytes - 1)) == 0)
+	&& ((size_t) SlabPages >= 4 * (size_t) HeaderPages)
+	&& (MaxSmallPages <= 65535)> verifyParameters;
+      verifyParameters = verifyParameters;
+    }
+
+    inline Registrar& registrar (void) {
+      return _registrar;
+    }
+
+    void * malloc (size_t sz) {
+      size_t pages = (sz + PageSize - 1) / PageSize;
+      if (pages > (size_t) MaxSmallPages) {
+	return mallocLarge (pages);
+      }
+      size_t rounded = 1;
+      while (rounded < pages) {
+	rounded <<= 1;
+      }
+      Guard<SpinLockType> l (_lock);
+      if ((_current == NULL) || (_used + rounded > (size_t) SlabPages)) {
+	// The rest of the current slab is not used.
+	Slab * s = newSlab (SlabBytes);
+	if (s == NULL) {
+	  return NULL;
+	}
+	_current = s;
+	_used = HeaderPages;
+      }
+      _current->pages[_used] = (unsigned short) rounded;
+      char * ptr = (char *) _current + _used * PageSize;
+      _used += rounded;
+      return ptr;
+    }
+
+    /// Small buffers stay in their slab; a large one's slabs go.
+    void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      Slab * s = slabOf (ptr);
+      if (s->largePages != 0) {
+	deleteSlab (s);
+      }
+    }
+
+    inline size_t getSize (void * ptr) const {
+      if (ptr == NULL) {
+	return 0;
+      }
+      const Slab * s = slabOf (ptr);
+      if (s->largePages != 0) {
+	return s->largePages * PageSize;
+      }
+      return (size_t) s->pages[((char *) ptr - (char *) s) / PageSize] * PageSize;
+    }
+
+    /// The Registrar's handle for the slab holding ptr.
+    static inline void * registration (const void * ptr) {
+      return slabOf (ptr)->handle;
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("slab_bytes", (size_t) SlabBytes);
+      w.field ("slabs", _slabs);
+      w.field ("pinned_bytes", _pinnedBytes);
+      w.field ("failures", _failures);
+    }
+
+  private:
+
+    // Disable copying and assignment.
+    PinnedArena (const PinnedArena&);
+    PinnedArena& operator= (const PinnedArena&);
+
+    /// The first page(s) of every slab.
+    struct Slab {
+      void * handle;
+      /// How much is mapped, locked and registered.
+      size_t bytes;
+      /// For a large buffer's slabs, the buffer's pages (0 otherwise).
+      size_t largePages;
+      /// The pages of the buffer that starts at each page.
+      unsigned short pages[SlabPages];
+    };
+
+    enum { HeaderPages = (sizeof(Slab) + PageSize - 1) / PageSize };
+
+    static inline Slab * slabOf (const void * ptr) {
+      return (Slab *) ((size_t) ptr & ~(SlabBytes - 1));
+    }
+
+    NO_INLINE void * mallocLarge (size_t pages) {
+      const size_t bytes = ((pages + HeaderPages) * PageSize + SlabBytes - 1) & ~(SlabBytes - 1);
+      if (bytes / PageSize < pages) {
+	// Overflow.
+	return NULL;
+      }
+      Slab * s;
+      {
+	Guard<SpinLockType> l (_lock);
+	s = newSlab (bytes);
+      }
+      if (s == NULL) {
+	return NULL;
+      }
+      s->largePages = pages;
+      return (char *) s + HeaderPages * PageSize;
+    }
+
+    /// Map, pin and register a slab of bytes.
+    NO_INLINE Slab * newSlab (size_t bytes) {
+#if !defined(_WIN32)
+      void * ptr = PrivateMmapHeap::memalign (SlabBytes, bytes);
+      if (ptr == NULL) {
+	_failures++;
+	return NULL;
+      }
+      if (mlock (ptr, bytes) != 0) {
+	PrivateMmapHeap::free (ptr, bytes);
+	_failures++;
+	return NULL;
+      }
+      void * handle = _registrar.registerSlab (ptr, bytes);
+      if (handle == NULL) {
+	munlock (ptr, bytes);
+	PrivateMmapHeap::free (ptr, bytes);
+	_failures++;
+	return NULL;
+      }
+      Slab * s = (Slab *) ptr;
+      s->handle = handle;
+      s->bytes = bytes;
+      _slabs++;
+      _pinnedBytes += bytes;
+      return s;
+#else
+      return NULL;
+#endif
+    }
+
+    void deleteSlab (Slab * s) {
+#if !defined(_WIN32)
+      const size_t bytes = s->bytes;
+      {
+	Guard<SpinLockType> l (_lock);
+	_registrar.deregisterSlab (s->handle, s, bytes);
+	_slabs--;
+	_pinnedBytes -= bytes;
+      }
+      munlock (s, bytes);
+      PrivateMmapHeap::free (s, bytes);
+#endif
+    }
+
+    SpinLockType _lock;
+    Registrar _registrar;
+
+    /// The slab small buffers come from, and its first unused page.
+    Slab * _current;
+    size_t _used;
+
+    unsigned long _slabs;
+    size_t _pinnedBytes;
+    unsigned long _failures;
+    LayerStats<PinnedArena> _stats;
+  };
+
+
+  /// Buffers of a power of two pages, up to half a slab.
+  template <size_t SlabBytes>
+  class PinnedSizeClasses {
+  public:
+
+    enum { PageSize = MmapWrapper::Size };
+    enum { NumBins = StaticLog2<SlabBytes / PageSize / 2>::VALUE + 1 };
+
+    static int getSizeClass (const size_t sz) {
+      int c = 0;
+      while (((size_t) PageSize << c) < sz) {
+	c++;
+      }
+      return c;
+    }
+
+    static size_t getClassMaxSize (const int c) {
+      return (size_t) PageSize << c;
+    }
+  };
+
+
+  template <size_t SlabBytes = 4194304, class Registrar = NoRegistration>
+  class PinnedSlabHeap {
+  public:
+
+    typedef PinnedArena<SlabBytes, Registrar> ArenaType;
+
+    enum { Alignment = MmapWrapper::Size };
+
+    inline void * malloc (size_t sz) {
+      return getArena().malloc (sz);
+    }
+
+    inline void free (void * ptr) {
+      getArena().free (ptr);
+    }
+
+    inline size_t getSize (void * ptr) const {
+      return getArena().getSize (ptr);
+    }
+
+    static inline void * registration (const void * ptr) {
+      return ArenaType::registration (ptr);
+    }
+
+    static inline Registrar& registrar (void) {
+      return getArena().registrar();
+    }
+
+    /// Pinned memory stays pinned.
+    size_t purge (size_t) {
+      return 0;
+    }
+
+    /// A source heap: the walk ends here (the slabs are in the
+    /// StatsRegistry, as "pinned").
+    void walk (HeapWalker&) {}
+
+  private:
+
+    static inline ArenaType& getArena (void) {
+      return singleton<ArenaType>::getInstance();
+    }
+  };
+
+
+  template <size_t SlabBytes = 4194304, class Registrar = NoRegistration>
+  class PinnedHeap :
+    public SegHeap<PinnedSizeClasses<SlabBytes>::NumBins,
+		   PinnedSizeClasses<SlabBytes>::getSizeClass,
+		   PinnedSizeClasses<SlabBytes>::getClassMaxSize,
+		   FreelistHeap<PinnedSlabHeap<SlabBytes, Registrar> >,
+		   PinnedSlabHeap<SlabBytes, Registrar> >
+  {};
+
+}
+
+#endif
@@ -0,0 +1,354 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_PREFAULTEDMMAPHEAP_H
+#define HL_PREFAULTEDMMAPHEAP_H
+
+#include <stddef.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#include "heaps/top/mmapheap.h"
+#include "utility/geometricclasses.h"
+#include "utility/heapwalk.h"
+#include "utility/sassert.h"
+#include "utility/singleton.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class PrefaultedMmapHeap
+ * @brief An MmapHeap whose large objects come already faulted in.
+ *
+ * A fresh mapping costs a page fault (and the kernel zeroing a page)
+ * the first time each of its pages is touched, which for an object of
+ * a few megabytes adds up to milliseconds on the thread that asked for
+ * it. Here a background thread keeps Depth mappings of each power of
+ * two from MinBytes to MaxBytes mapped with MAP_POPULATE (or touched,
+ * where there is no MAP_POPULATE), so they are backed and zero before
+ * anyone asks; malloc of MinBytes to MaxBytes takes the smallest one
+ * that fits, and wakes the thread to map another:
+ *
+ * <TT>
+ *   typedef PrefaultedMmapHeap<> Big;
+ *   Big::prefault();  // Fill the pool before the latency-critical part.
+ *   void * frame = Big().malloc (6 << 20);  // An 8 MB mapping, zero and backed.
+ * </TT>
+ *
+ * The object gets the whole mapping (getSize says how big), so it can
+ * hold up to twice what was asked for, and the pool holds about
+ * 2 * Depth * MaxBytes of memory. Objects of other sizes, and those
+ * asked for when the pool has none big enough, are plain MmapHeap
+ * mappings; so is everything after a fork, until the next malloc
+ * starts the child's own thread. Freeing unmaps, as in MmapHeap. All
+ * PrefaultedMmapHeaps with the same parameters share the pool, whose
+ * hits and misses are in the StatsRegistry as "prefault-pool".
+ *
+ * @param MinBytes The smallest mapping kept ready (a power of two).
+ * @param MaxBytes The largest (a power of two).
+ * @param Depth How many of each size are kept ready.
+ */
+
+namespace HL {
+
+#if defined(_WIN32)
+
+  // Windows commits pages on first touch all the same, but there is
+  // no pool here yet.
+  template <size_t MinBytes = 1048576, size_t MaxBytes = 16777216, int Depth = 2>
+  class PrefaultedMmapHeap : public MmapHeap {
+  public:
+    static inline void prefault (void) {}
+  };
+
+#else
+
+  template <size_t MinBytes, size_t MaxBytes, int Depth>
+  class PrefaultPool {
+  public:
+
+    enum { NumBuckets = StaticLog2<MaxBytes / MinBytes>::VALUE + 1 };
+
+    PrefaultPool (void)
+      : _workerState (Idle),
+	_wanted (true),
+	_readyBytes (0),
+	_hits (0),
+	_misses (0),
+	_failures (0),
+	_stats ("prefault-pool", this)
+    {
+      sassert<((MinBytes & (MinBytes - 1)) == 0)
+	&& ((MaxBytes & (MaxBytes - 1)) == 0)
+	&& (MinBytes >= (size_t) MmapWrapper::Size)
+	&& (MaxBytes >= MinBytes)
+	&& (Depth > 0)> verifyParameters;
+      verifyParameters = verifyParameters;
+      pthread_mutex_init (&_lock, NULL);
+      pthread_cond_init (&_wake, NULL);
+      for (int b = 0; b < NumBuckets; b++) {
+	_count[b] = 0;
+      }
+      pthread_atfork (lockBeforeFork, unlockAfterFork, resetAfterFork);
+    }
+
+    /// Take a ready mapping of at least sz bytes (setting mapped to
+    /// its size), or NULL.
+    void * take (size_t sz, size_t& mapped) {
+      if ((sz < MinBytes) || (sz > MaxBytes)) {
+	return NULL;
+      }
+      start();
+      int b = 0;
+      while ((MinBytes << b) < sz) {
+	b++;
+      }
+      void * ptr = NULL;
+      pthread_mutex_lock (&_lock);
+      for (; b < NumBuckets; b++) {
+	if (_count[b] > 0) {
+	  ptr = _ready[b][--_count[b]];
+	  mapped = MinBytes << b;
+	  _readyBytes -= mapped;
+	  break;
+	}
+      }
+      if (ptr != NULL) {
+	_hits++;
+      } else {
+	_misses++;
+      }
+      // Either way, a bucket is short now.
+      _wanted = true;
+      pthread_cond_signal (&_wake);
+      pthread_mutex_unlock (&_lock);
+      return ptr;
+    }
+
+    /// Start the thread, if it is not running, so it fills the pool.
+    void start (void) {
+      if (_workerState != Idle) {
+	return;
+      }
+      if (__sync_bool_compare_and_swap (&_workerState, Idle, Starting)) {
+	// pthread_create may allocate; the state keeps that from
+	// getting back here.
+	pthread_t worker;
+	pthread_attr_t attr;
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create (&worker, &attr, refill, this) == 0) {
+	  _workerState = Running;
+	} else {
+	  _workerState = Idle;
+	}
+	pthread_attr_destroy (&attr);
+      }
+    }
+
+    /// Unmap ready mappings until budget bytes have gone. The thread
+    /// maps them again on the next take.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      pthread_mutex_lock (&_lock);
+      for (int b = NumBuckets - 1; (b >= 0) && (released < budget); b--) {
+	while ((_count[b] > 0) && (released < budget)) {
+	  PrivateMmapHeap::free (_ready[b][--_count[b]], MinBytes << b);
+	  released += MinBytes << b;
+	}
+      }
+      _readyBytes -= released;
+      pthread_mutex_unlock (&_lock);
+      return released;
+    }
+
+    inline size_t readyBytes (void) const {
+      return _readyBytes;
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("ready_bytes", _readyBytes);
+      w.field ("hits", _hits);
+      w.field ("misses", _misses);
+      w.field ("failures", _failures);
+    }
+
+  private:
+
+    // Disable copying and assignment.
+    PrefaultPool (const PrefaultPool&);
+    PrefaultPool& operator= (const PrefaultPool&);
+
+    enum { Idle, Starting, Running };
+
+    static void * refill (void * arg) {
+      PrefaultPool * p = (PrefaultPool *) arg;
+      pthread_mutex_lock (&p->_lock);
+      while (true) {
+	while (!p->_wanted) {
+	  pthread_cond_wait (&p->_wake, &p->_lock);
+	}
+	p->_wanted = false;
+	for (int b = 0; b < NumBuckets; b++) {
+	  while (p->_count[b] < Depth) {
+	    // Fault the pages in without holding up take.
+	    pthread_mutex_unlock (&p->_lock);
+	    void * ptr = populate (MinBytes << b);
+	    pthread_mutex_lock (&p->_lock);
+	    if (ptr == NULL) {
+	      // Out of memory: try again on the next take.
+	      p->_failures++;
+	      b = NumBuckets;
+	      break;
+	    }
+	    p->_ready[b][p->_count[b]++] = ptr;
+	    p->_readyBytes += MinBytes << b;
+	  }
+	}
+      }
+      return NULL;
+    }
+
+    /// A mapping of sz bytes with every page backed (and zero).
+    static void * populate (size_t sz) {
+#if defined(MAP_POPULATE) && defined(MAP_ANONYMOUS)
+      void * ptr = mmap (NULL, sz, HL_MMAP_PROTECTION_MASK, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+      return (ptr == MAP_FAILED) ? NULL : ptr;
+#else
+      volatile char * ptr = (volatile char *) PrivateMmapHeap::malloc (sz);
+      if (ptr != NULL) {
+	for (size_t i = 0; i < sz; i += MmapWrapper::Size) {
+	  ptr[i] = 0;
+	}
+      }
+      return (void *) ptr;
+#endif
+    }
+
+    static inline PrefaultPool& getPool (void) {
+      return singleton<PrefaultPool>::getInstance();
+    }
+
+    static void lockBeforeFork (void) {
+      pthread_mutex_lock (&getPool()._lock);
+    }
+
+    static void unlockAfterFork (void) {
+      pthread_mutex_unlock (&getPool()._lock);
+    }
+
+    /// In the child: the thread did not come along (and a mapping it
+    /// was populating is lost), so the next take starts another.
+    static void resetAfterFork (void) {
+      PrefaultPool& p = getPool();
+      pthread_mutex_unlock (&p._lock);
+      pthread_cond_init (&p._wake, NULL);
+      p._workerState = Idle;
+      p._wanted = true;
+    }
+
+    pthread_mutex_t _lock;
+    pthread_cond_t _wake;
+    volatile int _workerState;
+    bool _wanted;
+
+    void * _ready[NumBuckets][Depth];
+    int _count[NumBuckets];
+
+    size_t _readyBytes;
+    unsigned long _hits;
+    unsigned long _misses;
+    unsigned long _failures;
+    LayerStats<PrefaultPool> _stats;
+  };
+
+
+  template <size_t MinBytes = 1048576, size_t MaxBytes = 16777216, int Depth = 2>
+  class PrefaultedMmapHeap : public MmapHeap {
+  public:
+
+    enum { ZeroMemory = 1 };
+
+    enum { Alignment = MmapHeap::Alignment };
+
+    typedef PrefaultPool<MinBytes, MaxBytes, Depth> PoolType;
+
+    /// Start filling the pool now, instead of on the first malloc.
+    static inline void prefault (void) {
+      getPool().start();
+    }
+
+    inline void * malloc (size_t sz) {
+      size_t mapped;
+      void * ptr = getPool().take (sz, mapped);
+      if (ptr == NULL) {
+	return MmapHeap::malloc (sz);
+      }
+      MyMap.set (ptr, mapped);
+      return ptr;
+    }
+
+    /// Everything here is zero.
+    inline void * mallocZeroed (size_t sz) {
+      return malloc (sz);
+    }
+
+    /// Ready mappings are only page-aligned, so bigger alignments
+    /// get a fresh one.
+    inline void * memalign (size_t alignment, size_t sz) {
+      if (alignment <= (size_t) MmapWrapper::Size) {
+	return malloc (sz);
+      }
+      return MmapHeap::memalign (alignment, sz);
+    }
+
+    /// Unmap ready mappings.
+    size_t purge (size_t budget) {
+      return getPool().purge (budget);
+    }
+
+    /// The ready mappings are free, and backed.
+    void walk (HeapWalker& w) {
+      HeapUsage u;
+      u.heldBytes = u.freeBytes = getPool().readyBytes();
+      w.visit ("PrefaultedMmapHeap", u);
+    }
+
+  private:
+
+    static inline PoolType& getPool (void) {
+      return singleton<PoolType>::getInstance();
+    }
+  };
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,356 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_RESERVEDHEAP_H
+#define HL_RESERVEDHEAP_H
+
+#include <stddef.h>
+
+#include "locks/spinlock.h"
+#include "threads/atomic.h"
+#include "utility/guard.h"
+#include "utility/heapwalk.h"
+#include "utility/sassert.h"
+#include "utility/singleton.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class ReservedHeap
+ * @brief A contiguous heap, like SbrkHeap, carved from one reservation.
+ *
+ * The constructor reserves ReserveBytes of address space (inaccessible,
+ * and so costing no memory), and malloc hands out consecutive pieces of
+ * it by bumping a pointer with compare-and-swap, so it needs no lock
+ * and, unlike sbrk, neither makes a system call per request nor gets in
+ * the way of anything else using the program break. The pages are made
+ * accessible CommitBytes at a time, past the end of what has been handed
+ * out, under a lock that only that slow path takes.
+ *
+ * Everything comes out in address order with no gaps (sizes are not
+ * rounded, so objects are as aligned as the sizes asked for, and the
+ * reservation is page-aligned), so ReservedHeap can stand in for
+ * SbrkHeap under a coalescing heap, such as LeaHeap's (which writes a
+ * boundary tag just past the last object, and reads one just before
+ * the first; there is always room for both):
+ *
+ * <TT>
+ *   LeaHeap<ReservedHeap<>, MmapHeap> heap;
+ * </TT>
+ *
+ * All the ReservedHeaps with the same parameters share one reservation
+ * (so the many copies of a source heap inside a segregated heap still
+ * make one contiguous heap), which lasts as long as the process.
+ *
+ * Objects are not freed one at a time, except that freeing the most
+ * recent one (with its size) moves the pointer back, as sbrk with a
+ * negative increment would. purge gives the pages past the pointer back
+ * to the OS and makes them inaccessible again.
+ *
+ * @param ReserveBytes How much address space to reserve.
+ * @param CommitBytes How much more to make accessible at a time (a multiple of the page size).
+ * @param BaseAlignment What to align the reservation to (a power of two), if more than a page.
+ */
+
+namespace HL {
+
+  /// The reservation that every ReservedHeap of the same parameters
+  /// shares (just as every SbrkHeap shares the program break).
+  template <size_t ReserveBytes, size_t CommitBytes, size_t BaseAlignment = 0>
+  class ReservedRange {
+  public:
+
+    /// What memalign aligns to at least, and the boundary tag's room.
+    enum { Alignment = 16 };
+
+    /// The room kept accessible past the end of what has been handed
+    /// out: a boundary tag, and the one after it, which a coalescing
+    /// heap reads to see whether the boundary tag's object is free.
+    enum { TagRoom = 2 * Alignment };
+
+    ReservedRange (void)
+      : _base ((char *) reserve (ReserveBytes, BaseAlignment)),
+	_bump (_base + ((_base != NULL) ? (size_t) Alignment : 0)),
+	_committed (_base),
+	_commits (0),
+	_decommits (0),
+	_stats ("reserved", this)
+    {
+      sassert<((CommitBytes % MmapWrapper::Size) == 0)
+	&& ((ReserveBytes % CommitBytes) == 0)
+	&& ((BaseAlignment & (BaseAlignment - 1)) == 0)> verifyParameters;
+      verifyParameters = verifyParameters;
+    }
+
+    inline void * malloc (size_t sz) {
+      return memalign (1, sz);
+    }
+
+    /// Alignments skip (and so waste) the space in between.
+    inline void * memalign (size_t alignment, size_t sz) {
+      if (sz > ReserveBytes) {
+	return NULL;
+      }
+      if (sz == 0) {
+	sz = Alignment;
+      }
+      char * ptr;
+      char * end;
+      do {
+	char * old = _bump;
+	ptr = (char *) align ((size_t) old, alignment);
+	// Keep room for a boundary tag past the end.
+	if ((ptr < old) || (ptr + sz + TagRoom > _base + ReserveBytes) || (_base == NULL)) {
+	  return NULL;
+	}
+	end = ptr + sz;
+	if (Atomic::compareAndSwap (&_bump, old, end)) {
+	  break;
+	}
+      } while (true);
+      if (end + TagRoom > _committed) {
+	if (!commit (end + TagRoom)) {
+	  // What was handed out can't be used, but stays reserved.
+	  return NULL;
+	}
+      }
+      return ptr;
+    }
+
+    /// Freeing the last object handed out hands its space back.
+    inline void free (void * ptr, size_t sz) {
+      char * end = (char *) ptr + ((sz == 0) ? (size_t) Alignment : sz);
+      Atomic::compareAndSwap (&_bump, end, (char *) ptr);
+    }
+
+    /// The start of the reservation (NULL if it could not be made).
+    inline char * base (void) const {
+      return _base;
+    }
+
+    /// Whether ptr is inside the reservation.
+    inline bool isValid (const void * ptr) const {
+      return (((const char *) ptr >= _base) && ((const char *) ptr < _base + ReserveBytes));
+    }
+
+    /// Give back the committed pages past the end of what has been
+    /// handed out, keeping the first CommitBytes of them.
+    size_t purge (size_t budget) {
+      Guard<SpinLockType> l (_lock);
+      char * const top = _committed;
+      char * keep = (char *) align ((size_t) _bump + TagRoom, CommitBytes);
+      if (keep >= top) {
+	return 0;
+      }
+      if (budget < (size_t) (top - keep)) {
+	keep = top - align (budget, MmapWrapper::Size);
+      }
+      // Lower the mark first, so that a malloc that bumps past it from
+      // now on takes the lock (and waits), then see if one already had.
+      _committed = keep;
+      Atomic::memoryBarrier();
+      char * const needed = (char *) align ((size_t) _bump + TagRoom, MmapWrapper::Size);
+      if (needed > keep) {
+	keep = needed;
+      }
+      if (keep >= top) {
+	_committed = top;
+	return 0;
+      }
+      _committed = keep;
+      decommit (keep, top - keep);
+      _decommits++;
+      return top - keep;
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("reserved_bytes", (size_t) ReserveBytes);
+      w.field ("committed_bytes", (size_t) (_committed - _base));
+      w.field ("used_bytes", (size_t) (_bump - _base));
+      w.field ("commits", _commits);
+      w.field ("decommits", _decommits);
+    }
+
+  private:
+
+    // Disable copying and assignment.
+    ReservedRange (const ReservedRange&);
+    ReservedRange& operator= (const ReservedRange&);
+
+    static inline size_t align (size_t v, size_t a) {
+      return (v + a - 1) & ~(a - 1);
+    }
+
+    /// Make everything up to end accessible, and then some.
+    NO_INLINE bool commit (char * end) {
+      Guard<SpinLockType> l (_lock);
+      char * const top = _committed;
+      if (end <= top) {
+	return true;
+      }
+      char * newTop = (char *) align ((size_t) end, CommitBytes);
+      if (newTop > _base + ReserveBytes) {
+	newTop = _base + ReserveBytes;
+      }
+      if (!makeAccessible (top, newTop - top)) {
+	return false;
+      }
+      _commits++;
+      Atomic::memoryBarrier();
+      _committed = newTop;
+      return true;
+    }
+
+#if defined(_WIN32)
+
+    static void * reserve (size_t sz, size_t alignment) {
+      if (alignment <= MmapWrapper::Alignment) {
+	return VirtualAlloc (NULL, sz, MEM_RESERVE, PAGE_NOACCESS);
+      }
+      // Find an aligned spot by reserving more than enough, then
+      // reserve just the aligned part of it (which another thread may
+      // take in between, so try again).
+      for (int i = 0; i < 8; i++) {
+	void * ptr = VirtualAlloc (NULL, sz + alignment, MEM_RESERVE, PAGE_NOACCESS);
+	if (ptr == NULL) {
+	  return NULL;
+	}
+	VirtualFree (ptr, 0, MEM_RELEASE);
+	ptr = VirtualAlloc ((void *) align ((size_t) ptr, alignment), sz, MEM_RESERVE, PAGE_NOACCESS);
+	if (ptr != NULL) {
+	  return ptr;
+	}
+      }
+      return NULL;
+    }
+
+    static bool makeAccessible (void * ptr, size_t sz) {
+      return (VirtualAlloc (ptr, sz, MEM_COMMIT, PAGE_READWRITE) != NULL);
+    }
+
+    static void decommit (void * ptr, size_t sz) {
+      VirtualFree (ptr, sz, MEM_DECOMMIT);
+    }
+
+#else
+
+    static void * reserve (size_t sz, size_t alignment) {
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+      if (alignment < MmapWrapper::Alignment) {
+	alignment = MmapWrapper::Alignment;
+      }
+      // Reserve enough to hold an aligned range, and trim the rest.
+      const size_t extra = alignment - MmapWrapper::Alignment;
+      void * ptr = mmap (NULL, sz + extra, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (ptr == MAP_FAILED) {
+	return NULL;
+      }
+      char * const start = (char *) ptr;
+      char * const aligned = (char *) align ((size_t) start, alignment);
+      if (aligned > start) {
+	munmap (start, aligned - start);
+      }
+      if (start + extra > aligned) {
+	munmap (aligned + sz, (start + extra) - aligned);
+      }
+      return aligned;
+    }
+
+    static bool makeAccessible (void * ptr, size_t sz) {
+      return (mprotect (ptr, sz, HL_MMAP_PROTECTION_MASK) == 0);
+    }
+
+    static void decommit (void * ptr, size_t sz) {
+      MmapWrapper::release (ptr, sz);
+      mprotect (ptr, sz, PROT_NONE);
+    }
+
+#endif
+
+    /// The reservation.
+    char * const _base;
+
+    /// The end of what has been handed out.
+    char * volatile _bump;
+
+    /// The end of the accessible pages (changed only under the lock).
+    char * volatile _committed;
+
+    SpinLockType _lock;
+    unsigned long _commits;
+    unsigned long _decommits;
+    LayerStats<ReservedRange> _stats;
+  };
+
+
+  template <size_t ReserveBytes = (size_t) 1 << ((sizeof(void *) == 8) ? 36 : 29),
+	    size_t CommitBytes = 1024 * 1024,
+	    size_t BaseAlignment = 0>
+  class ReservedHeap {
+  public:
+
+    typedef ReservedRange<ReserveBytes, CommitBytes, BaseAlignment> RangeType;
+
+    enum { Alignment = RangeType::Alignment };
+
+    inline void * malloc (size_t sz) {
+      return getRange().malloc (sz);
+    }
+
+    inline void * memalign (size_t alignment, size_t sz) {
+      return getRange().memalign (alignment, sz);
+    }
+
+    inline void free (void *) {}
+
+    inline void free (void * ptr, size_t sz) {
+      getRange().free (ptr, sz);
+    }
+
+    inline bool isValid (const void * ptr) {
+      return getRange().isValid (ptr);
+    }
+
+    size_t purge (size_t budget) {
+      return getRange().purge (budget);
+    }
+
+    /// A source heap: the walk ends here (the range is in the
+    /// StatsRegistry, as "reserved").
+    void walk (HeapWalker&) {}
+
+  protected:
+
+    static inline RangeType& getRange (void) {
+      return singleton<RangeType>::getInstance();
+    }
+  };
+
+}
+
+#endif
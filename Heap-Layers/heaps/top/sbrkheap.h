@@ -12,6 +12,8 @@ extern "C" void * sbrk (size_t sz);
 
 #endif
 
+#include "utility/heapwalk.h"
+
 /*
  * @class SbrkHeap
  * @brief A source heap that is a thin wrapper over sbrk.
@@ -47,6 +49,14 @@ namespace HL {
       return sbrk(sz);
     }
     inline void free (void *) { }
+
+    /// A source heap: the walk ends here.
+    void walk (HeapWalker&) {}
+
+    /// Everything here is in use, so there is nothing to purge.
+    size_t purge (size_t) {
+      return 0;
+    }
   };
 
 }
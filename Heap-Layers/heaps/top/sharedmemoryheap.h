@@ -0,0 +1,468 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_SHAREDMEMORYHEAP_H
+#define HL_SHAREDMEMORYHEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#include "utility/heapwalk.h"
+#include "utility/singleton.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class SharedMemoryHeap
+ * @brief A source heap in memory that several processes share.
+ *
+ * The memory is a POSIX shared memory object (shm_open, which older C
+ * libraries keep in -lrt) or, without a name, a memory file
+ * (memfd_create, Linux only) whose descriptor is passed to the other
+ * processes, by fork or over a Unix socket. Each process maps it
+ * wherever it likes, so nothing in it is a pointer: the arena keeps
+ * offsets from its start, and processes exchange the objects they
+ * allocate as offsets too:
+ *
+ * <TT>
+ *   typedef SharedMemoryHeap<> Shared;
+ *   Shared::arena().create ("/ingest", 1UL << 30);   // one process
+ *   Shared::arena().attach ("/ingest");              // the others
+ *   size_t off = Shared::offsetOf (buf);             // send this...
+ *   char * buf = (char *) Shared::pointerAt (off);   // ...and map it back
+ * </TT>
+ *
+ * The first page holds the allocator's state: a bump offset, and a free
+ * list of blocks per size class. Both change only by compare-and-swap,
+ * the free lists' heads carrying a count against ABA, so there is no
+ * lock that a process could die holding; one killed in the middle of a
+ * malloc loses at most that block. A block holds a power of two bytes
+ * (so that a segregated heap above files a freed one back in the class
+ * it came from), after a 16-byte header that names its class. Freed
+ * blocks go back on their class's list for any process to reuse, and
+ * are never merged or given back to the OS (purge does nothing).
+ *
+ * All the SharedMemoryHeaps with the same Id use one arena, so that the
+ * copies of a source heap inside FreelistHeap or SegHeap all allocate
+ * from the one region:
+ *
+ * <TT>
+ *   SegHeap<Kingsley::NUMBINS, Kingsley::size2Class, Kingsley::class2Size,
+ *           FreelistHeap<Shared>, Shared> messages;
+ * </TT>
+ *
+ * (Objects on such a process-local free list stay with their process
+ * until it frees them to the arena.) Until the arena is created or
+ * attached, malloc returns NULL, as it does on Windows.
+ *
+ * @param Id Distinguishes the arenas of separate regions.
+ * @param Arena The kind of region (FileMappedHeap's is a file's).
+ */
+
+namespace HL {
+
+  class SharedMemoryArena {
+  public:
+
+    enum { Alignment = 16 };
+
+    /// Offsets are kept in 40 bits, so a region is less than 1 TB.
+    enum { OffsetBits = 40 };
+
+    SharedMemoryArena (void)
+      : _base (NULL),
+	_size (0),
+	_fd (-1)
+    {}
+
+    ~SharedMemoryArena (void) {
+      detach();
+    }
+
+    /// Make a new region of bytes (and attach it): the shared memory
+    /// object name, which must not exist, or if name is NULL, a memory
+    /// file, whose descriptor fd() returns.
+    bool create (const char * name, size_t bytes) {
+#if !defined(_WIN32)
+      if ((_base != NULL) || (bytes < HeaderBytes + Alignment)
+	  || (bytes >= ((uint64_t) 1 << OffsetBits))) {
+	return false;
+      }
+      bytes = (bytes + MmapWrapper::Size - 1) & ~((size_t) MmapWrapper::Size - 1);
+      int fd;
+      if (name != NULL) {
+	fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+      } else {
+#if defined(__linux__) && defined(SYS_memfd_create)
+	fd = (int) syscall (SYS_memfd_create, "heaplayers-shared", 0);
+#else
+	fd = -1;
+#endif
+      }
+      if (fd < 0) {
+	return false;
+      }
+      if (!format (fd, bytes, NULL)) {
+	::close (fd);
+	if (name != NULL) {
+	  shm_unlink (name);
+	}
+	return false;
+      }
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    /// Attach the region that create made under name.
+    bool attach (const char * name) {
+#if !defined(_WIN32)
+      if (_base != NULL) {
+	return false;
+      }
+      const int fd = shm_open (name, O_RDWR, 0);
+      if (fd < 0) {
+	return false;
+      }
+      if (!attach (fd)) {
+	::close (fd);
+	return false;
+      }
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    /// Attach a region by its descriptor, which the arena then owns.
+    bool attach (int fd) {
+#if !defined(_WIN32)
+      struct stat st;
+      if ((_base != NULL) || (fstat (fd, &st) != 0)
+	  || ((size_t) st.st_size < HeaderBytes + Alignment)
+	  || !map (fd, (size_t) st.st_size, NULL)) {
+	return false;
+      }
+      if (!formatted()) {
+	unmap();
+	return false;
+      }
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    /// Unmap the region. It lasts until every process has detached and
+    /// (if it has a name) it has been unlinked.
+    void detach (void) {
+#if !defined(_WIN32)
+      if (_base != NULL) {
+	unmap();
+	::close (_fd);
+	_fd = -1;
+      }
+#endif
+    }
+
+    /// Remove a region's name (shm_unlink).
+    static bool unlink (const char * name) {
+#if !defined(_WIN32)
+      return (shm_unlink (name) == 0);
+#else
+      return false;
+#endif
+    }
+
+    inline int fd (void) const {
+      return _fd;
+    }
+
+    inline void * malloc (size_t sz) {
+      const unsigned int c = sizeClass (sz);
+      if ((c >= Classes) || (_base == NULL)) {
+	return NULL;
+      }
+      uint64_t off = pop (c);
+      if (off == 0) {
+	off = bump (((uint64_t) 1 << (c + MinClassBits)) + sizeof(Block));
+	if (off == 0) {
+	  return NULL;
+	}
+      }
+      Block * b = block (off);
+      b->sizeClass = c;
+      return (void *) (b + 1);
+    }
+
+    inline void free (void * ptr) {
+      if (!isValid (ptr)) {
+	return;
+      }
+      Block * b = (Block *) ptr - 1;
+      push ((unsigned int) b->sizeClass, (uint64_t) ((char *) b - _base));
+    }
+
+    inline size_t getSize (void * ptr) const {
+      const Block * b = (const Block *) ptr - 1;
+      return (size_t) 1 << (b->sizeClass + MinClassBits);
+    }
+
+    inline bool isValid (const void * ptr) const {
+      return ((_base != NULL)
+	      && ((const char *) ptr >= _base + HeaderBytes)
+	      && ((const char *) ptr < _base + _size));
+    }
+
+    /// Where ptr is in the region (0 for NULL), the same in every process.
+    inline size_t offsetOf (const void * ptr) const {
+      return (ptr == NULL) ? 0 : (size_t) ((const char *) ptr - _base);
+    }
+
+    /// The object at an offset from offsetOf.
+    inline void * pointerAt (size_t offset) const {
+      return (offset == 0) ? NULL : (void *) (_base + offset);
+    }
+
+    /// Name an object (or NULL) that every process can find with getRoot.
+    inline void setRoot (void * ptr) {
+      __atomic_store_n (&header()->root, (uint64_t) offsetOf (ptr), __ATOMIC_RELEASE);
+    }
+
+    inline void * getRoot (void) const {
+      return pointerAt ((size_t) __atomic_load_n (&header()->root, __ATOMIC_ACQUIRE));
+    }
+
+  protected:
+
+    /// "HSHMEM01".
+    static const uint64_t Magic = 0x4853484d454d3031ULL;
+
+    /// The smallest block holds 16 bytes, the largest half the offset range.
+    enum { MinClassBits = 4 };
+    enum { Classes = OffsetBits - MinClassBits };
+
+    /// The first page, shared by every process.
+    struct Header {
+      uint64_t magic;
+      uint64_t size;
+      /// Where the process that made the region mapped it.
+      uint64_t base;
+      /// The offset of the root object.
+      uint64_t root;
+      /// The start of the space never handed out.
+      uint64_t top;
+      /// Each class's free list: the first block's offset, with a change
+      /// count above it.
+      uint64_t heads[Classes];
+    };
+
+    enum { HeaderBytes = MmapWrapper::Size };
+
+    inline Header * header (void) const {
+      return (Header *) _base;
+    }
+
+#if !defined(_WIN32)
+    /// Size the empty file fd to bytes, map it (where, if possible), and
+    /// lay out an empty heap in it.
+    bool format (int fd, size_t bytes, void * where) {
+      if ((ftruncate (fd, bytes) != 0) || !map (fd, bytes, where)) {
+	return false;
+      }
+      // The file is zero-filled; the magic number, last, says the rest
+      // of the header is ready.
+      Header * h = header();
+      h->size = bytes;
+      h->base = (uint64_t) (size_t) _base;
+      h->top = HeaderBytes;
+      __atomic_store_n (&h->magic, Magic, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    /// Whether the mapped region holds a heap that format finished.
+    bool formatted (void) const {
+      const Header * h = header();
+      return ((__atomic_load_n (&h->magic, __ATOMIC_ACQUIRE) == Magic)
+	      && (h->size == (uint64_t) _size));
+    }
+
+    /// Map bytes of fd, at where if that is free (or anywhere).
+    bool map (int fd, size_t bytes, void * where) {
+      void * ptr = mmap (where, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (ptr == MAP_FAILED) {
+	return false;
+      }
+      _base = (char *) ptr;
+      _size = bytes;
+      _fd = fd;
+      return true;
+    }
+
+    void unmap (void) {
+      munmap (_base, _size);
+      _base = NULL;
+      _size = 0;
+    }
+#endif
+
+    /// Where this process mapped the region.
+    char * _base;
+    size_t _size;
+    int _fd;
+
+  private:
+
+    // Disable copying and assignment.
+    SharedMemoryArena (const SharedMemoryArena&);
+    SharedMemoryArena& operator= (const SharedMemoryArena&);
+
+    /// A block's header; the object follows it.
+    struct Block {
+      uint64_t sizeClass;
+      /// The next free block's offset, on a free list.
+      uint64_t next;
+    };
+
+    static inline unsigned int sizeClass (size_t sz) {
+      unsigned int c = 0;
+      while (((uint64_t) 1 << (c + MinClassBits)) < (uint64_t) sz) {
+	if (++c >= Classes) {
+	  break;
+	}
+      }
+      return c;
+    }
+
+    inline Block * block (uint64_t off) const {
+      return (Block *) (_base + off);
+    }
+
+    static const uint64_t OffsetMask = ((uint64_t) 1 << OffsetBits) - 1;
+
+    inline uint64_t pop (unsigned int c) {
+      uint64_t * head = &header()->heads[c];
+      uint64_t old = __atomic_load_n (head, __ATOMIC_ACQUIRE);
+      while ((old & OffsetMask) != 0) {
+	// The block may be taken (and written) from under us, but the
+	// region stays mapped, and the count makes the swap fail.
+	const uint64_t next = __atomic_load_n (&block (old & OffsetMask)->next, __ATOMIC_RELAXED);
+	const uint64_t desired = ((old & ~OffsetMask) + ((uint64_t) 1 << OffsetBits)) | next;
+	if (__atomic_compare_exchange_n (head, &old, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	  return old & OffsetMask;
+	}
+      }
+      return 0;
+    }
+
+    inline void push (unsigned int c, uint64_t off) {
+      uint64_t * head = &header()->heads[c];
+      uint64_t old = __atomic_load_n (head, __ATOMIC_RELAXED);
+      uint64_t desired;
+      do {
+	__atomic_store_n (&block (off)->next, old & OffsetMask, __ATOMIC_RELAXED);
+	desired = ((old & ~OffsetMask) + ((uint64_t) 1 << OffsetBits)) | off;
+      } while (!__atomic_compare_exchange_n (head, &old, desired, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    /// Carve sz fresh bytes (a multiple of Alignment) off the top.
+    inline uint64_t bump (uint64_t sz) {
+      uint64_t * top = &header()->top;
+      uint64_t old = __atomic_load_n (top, __ATOMIC_RELAXED);
+      do {
+	if (sz > _size - old) {
+	  return 0;
+	}
+      } while (!__atomic_compare_exchange_n (top, &old, old + sz, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+      return old;
+    }
+  };
+
+
+  template <int Id = 0, class Arena = SharedMemoryArena>
+  class SharedMemoryHeap {
+  public:
+
+    enum { Alignment = Arena::Alignment };
+
+    /// The arena every copy of this heap allocates from.
+    static inline Arena& arena (void) {
+      return singleton<ArenaType>::getInstance();
+    }
+
+    inline void * malloc (size_t sz) {
+      return arena().malloc (sz);
+    }
+
+    inline void free (void * ptr) {
+      arena().free (ptr);
+    }
+
+    inline void free (void * ptr, size_t) {
+      arena().free (ptr);
+    }
+
+    inline size_t getSize (void * ptr) const {
+      return arena().getSize (ptr);
+    }
+
+    inline bool isValid (const void * ptr) const {
+      return arena().isValid (ptr);
+    }
+
+    static inline size_t offsetOf (const void * ptr) {
+      return arena().offsetOf (ptr);
+    }
+
+    static inline void * pointerAt (size_t offset) {
+      return arena().pointerAt (offset);
+    }
+
+    /// Freed blocks stay on the shared free lists.
+    size_t purge (size_t) {
+      return 0;
+    }
+
+    /// A source heap: the walk ends here.
+    void walk (HeapWalker&) {}
+
+  private:
+
+    /// A type of its own for each Id, so each has its own singleton.
+    class ArenaType : public Arena {};
+  };
+
+}
+
+#endif
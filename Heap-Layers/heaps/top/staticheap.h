@@ -28,23 +28,40 @@
 
   StaticHeap: manage a fixed range of memory.
 
+  Memory comes out in address order with no gaps (sizes are not
+  rounded), starting at a 16-byte boundary. The first and last
+  Alignment bytes of the buffer are never handed out, so that a
+  coalescing heap above (see StaticTLSFHeap) has room for the boundary
+  tags it reads before the first object and writes after the last.
+  The high-water mark is in the StatsRegistry as "static".
+
 */
 
 #ifndef HL_STATICHEAP_H
 #define HL_STATICHEAP_H
 
+#include <stddef.h>
+
+#include "utility/heapwalk.h"
+#include "utility/sassert.h"
+#include "utility/statsregistry.h"
+
 namespace HL {
 
   template <int MemorySize>
   class StaticHeap {
   public:
 
-    StaticHeap (void)
-      : ptr (&buf[0]),
-	remaining (MemorySize)
-    {}
+    enum { Alignment = 16 };
 
-    enum { Alignment = 1 };
+    StaticHeap (void)
+      : ptr (start() + Alignment),
+	remaining (MemorySize - 3 * Alignment),
+	_stats ("static", this)
+    {
+      sassert<(MemorySize >= 4 * Alignment)> verifySize;
+      verifySize = verifySize;
+    }
 
     inline void * malloc (size_t sz) {
       if (remaining < sz) {
@@ -59,9 +76,28 @@ namespace HL {
     void free (void *) {}
     int remove (void *) { return 0; }
 
-    int isValid (void * ptr) {
-      return (((size_t) ptr >= (size_t) buf) &&
-	      ((size_t) ptr < (size_t) buf));
+    void walk (HeapWalker& w) {
+      HeapUsage u;
+      u.heldBytes = MemorySize;
+      u.freeBytes = remaining;
+      w.visit ("StaticHeap", u);
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("capacity_bytes", (size_t) MemorySize);
+      // Nothing is freed here, so what has been used is the high-water mark.
+      w.field ("high_water_bytes", (size_t) (ptr - (start() + Alignment)));
+      w.field ("remaining_bytes", remaining);
+    }
+
+    /// The buffer is not the OS's to take back.
+    size_t purge (size_t) {
+      return 0;
+    }
+
+    int isValid (void * p) {
+      return (((size_t) p >= (size_t) buf) &&
+	      ((size_t) p < (size_t) buf + MemorySize));
     }
 
   private:
@@ -70,9 +106,16 @@ namespace HL {
     StaticHeap (const StaticHeap& treap);
     StaticHeap& operator= (const StaticHeap& treap);
 
+    /// The buffer, from its first 16-byte boundary (some of the
+    /// 3 * Alignment bytes kept back make up for it).
+    inline char * start (void) {
+      return (char *) (((size_t) buf + Alignment - 1) & ~((size_t) Alignment - 1));
+    }
+
     char buf[MemorySize];
     char * ptr;
     size_t remaining;
+    LayerStats<StaticHeap> _stats;
   };
 
 }
@@ -0,0 +1,200 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_URINGBUFFERPOOL_H
+#define HL_URINGBUFFERPOOL_H
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "heaps/threads/magazineheap.h"
+#include "heaps/top/pinnedheap.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_register) && defined(IORING_RSRC_REGISTER_SPARSE)
+#define HL_URING_SUPPORTED 1
+#else
+#define HL_URING_SUPPORTED 0
+#endif
+
+/**
+ * @class UringBufferPool
+ * @brief Buffers of one size, registered with an io_uring as fixed
+ * buffers, for READ_FIXED and WRITE_FIXED.
+ *
+ * The buffers come from PinnedHeap's slabs, with UringRegistrar as
+ * the Registrar: each slab becomes one entry of the ring's table of
+ * fixed buffers (a sparse table of MaxSlabs entries, registered with
+ * the first slab, and updated one entry at a time after that), so a
+ * slab is pinned and registered once, and an I/O on any buffer in it
+ * names the slab's entry:
+ *
+ * <TT>
+ *   typedef UringBufferPool<65536> Blocks;
+ *   Blocks::registrar().attach (ring_fd);
+ *   void * buf = Blocks().malloc (65536);
+ *   sqe->opcode = IORING_OP_READ_FIXED;
+ *   sqe->addr = (size_t) buf;
+ *   sqe->buf_index = Blocks::bufferIndex (buf);
+ * </TT>
+ *
+ * Each thread mallocs and frees through magazines of its own (a
+ * MagazineHeap over the slabs), so recycling a buffer takes no lock
+ * most of the time, and a buffer can be freed by another thread than
+ * the one that got it (the one that reaped the completion, say).
+ *
+ * All the pools with the same SlabBytes share the slabs and the ring,
+ * whatever their BufferBytes. Buffers are rounded up to a power of two
+ * pages in the slabs; malloc of more than BufferBytes returns NULL, as
+ * does everything before attach, or where the kernel has no sparse
+ * buffer tables (5.13 and up) or refuses to register more.
+ *
+ * @param BufferBytes The size of every buffer.
+ * @param SlabBytes The size of a slab, and so of a fixed buffer (at most 1 GB).
+ * @param MaxSlabs The entries in the ring's table (at most 16384).
+ * @param MagazineSize How many buffers a magazine holds.
+ */
+
+namespace HL {
+
+  template <int MaxSlabs = 1024>
+  class UringRegistrar {
+  public:
+
+    UringRegistrar (void)
+      : _ring (-1),
+	_registered (false),
+	_nFree (0),
+	_next (0)
+    {}
+
+    /// Register slabs with the ring ring_fd from now on.
+    inline void attach (int ring_fd) {
+      _ring = ring_fd;
+    }
+
+    /// The slab's index in the ring's buffer table, plus one.
+    void * registerSlab (void * ptr, size_t bytes) {
+#if HL_URING_SUPPORTED
+      if ((_ring < 0) || (!_registered && !registerTable())) {
+	return NULL;
+      }
+      int slot;
+      if (_nFree > 0) {
+	slot = _freeSlots[--_nFree];
+      } else if (_next < MaxSlabs) {
+	slot = _next++;
+      } else {
+	return NULL;
+      }
+      if (!update (slot, ptr, bytes)) {
+	_freeSlots[_nFree++] = slot;
+	return NULL;
+      }
+      return (void *) (size_t) (slot + 1);
+#else
+      return NULL;
+#endif
+    }
+
+    void deregisterSlab (void * handle, void *, size_t) {
+#if HL_URING_SUPPORTED
+      const int slot = (int) (size_t) handle - 1;
+      update (slot, NULL, 0);
+      _freeSlots[_nFree++] = slot;
+#endif
+    }
+
+  private:
+
+#if HL_URING_SUPPORTED
+    bool registerTable (void) {
+      struct io_uring_rsrc_register r;
+      memset (&r, 0, sizeof(r));
+      r.nr = MaxSlabs;
+      r.flags = IORING_RSRC_REGISTER_SPARSE;
+      _registered = (syscall (__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS2,
+			      &r, sizeof(r)) == 0);
+      return _registered;
+    }
+
+    /// Point entry slot at bytes at ptr (or, with NULL, empty it).
+    bool update (int slot, void * ptr, size_t bytes) {
+      struct iovec iov;
+      iov.iov_base = ptr;
+      iov.iov_len = bytes;
+      struct io_uring_rsrc_update2 u;
+      memset (&u, 0, sizeof(u));
+      u.offset = slot;
+      u.data = (size_t) &iov;
+      u.nr = 1;
+      return (syscall (__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS_UPDATE,
+		       &u, sizeof(u)) == 1);
+    }
+#endif
+
+    int _ring;
+    bool _registered;
+
+    /// The entries given back, and the first never used.
+    int _freeSlots[MaxSlabs];
+    int _nFree;
+    int _next;
+  };
+
+
+  template <size_t BufferBytes,
+	    size_t SlabBytes = 4194304,
+	    int MaxSlabs = 1024,
+	    int MagazineSize = 32>
+  class UringBufferPool :
+    public MagazineHeap<PinnedSlabHeap<SlabBytes, UringRegistrar<MaxSlabs> >,
+			BufferBytes, MagazineSize>
+  {
+  public:
+
+    typedef PinnedSlabHeap<SlabBytes, UringRegistrar<MaxSlabs> > SlabHeap;
+
+    /// The ring's registrar, to attach the ring to.
+    static inline UringRegistrar<MaxSlabs>& registrar (void) {
+      return SlabHeap::registrar();
+    }
+
+    /// The buf_index of an I/O on ptr (which may be anywhere in a buffer).
+    static inline int bufferIndex (const void * ptr) {
+      return (int) (size_t) SlabHeap::registration (ptr) - 1;
+    }
+  };
+
+}
+
+#endif
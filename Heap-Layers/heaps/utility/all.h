@@ -1,11 +1,15 @@
 #include "exceptionheap.h"
 #include "nullheap.h"
+#include "objectcache.h"
 #include "perclassheap.h"
 #include "slopheap.h"
 #include "uniqueheap.h"
 #include "localmallocheap.h"
 #include "oneheap.h"
 #include "profileheap.h"
+#include "sampleheap.h"
+#include "tenantheap.h"
 #include "traceheap.h"
 
 
+#include "zeroheap.h"
@@ -32,6 +32,9 @@
 /**
  * @class NullHeap
  * @brief A source heap that does nothing.
+ *
+ * Sizes still come from the superheap, since the objects a layer above
+ * keeps (as in AdaptHeap) came from there.
  */
 
 namespace HL {
@@ -43,7 +46,7 @@ namespace HL {
     inline void free (void *) const {}
     inline int remove (void *) const { return 0; }
     inline void clear (void) const {}
-    inline size_t getSize (void *) const { return 0; }
+    inline size_t getSize (void * ptr) { return SuperHeap::getSize (ptr); }
   };
 
 }
@@ -0,0 +1,146 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_OBJECTCACHE_H
+#define HL_OBJECTCACHE_H
+
+#include <stddef.h>
+#include <new>
+
+/**
+ * @class ObjectCache
+ * @brief A cache of constructed objects of type T, as in Bonwick's slab allocator.
+ *
+ * Where PerClassHeap and FreelistHeap hand back raw memory, to be
+ * constructed on every new and destroyed on every delete, this keeps
+ * up to MaxCached objects that have been put back in their
+ * constructed state: their mutexes, buffers and preallocated vectors
+ * survive from one use to the next. get() hands out a cached object
+ * after calling Reset::reset on it, and only constructs (with T's
+ * default constructor, in memory from Heap) when the cache is empty;
+ * put() caches the object, and destroys it only when the cache is
+ * full. Reset::reset should restore whatever a user of the object
+ * may have changed, and keep what is expensive to rebuild:
+ *
+ * <TT>
+ *   struct ResetRequest {<BR>
+ *     static void reset (Request& r) { r.headers.clear(); }<BR>
+ *   };<BR>
+ *   ObjectCache<Request, FreelistHeap<MallocHeap>, ResetRequest> requests;<BR>
+ *   Request * r = requests.get(); ... requests.put (r);
+ * </TT>
+ *
+ * Like FreelistHeap, a cache takes no lock: give each thread its own,
+ * or wrap one in a lock.
+ */
+
+namespace HL {
+
+  /// The default reset hook, for objects that need nothing restored.
+  template <class T>
+  class NoObjectReset {
+  public:
+    static inline void reset (T&) {}
+  };
+
+  template <class T,
+	    class Heap,
+	    class Reset = NoObjectReset<T>,
+	    int MaxCached = 64>
+  class ObjectCache : public Heap {
+  public:
+
+    ObjectCache (void)
+      : _count (0)
+    {}
+
+    ~ObjectCache (void) {
+      clear();
+    }
+
+    /// A constructed object, or NULL if Heap is out of memory.
+    inline T * get (void) {
+      if (_count > 0) {
+	T * obj = _cached[--_count];
+	Reset::reset (*obj);
+	return obj;
+      }
+      void * ptr = Heap::malloc (sizeof(T));
+      if (ptr == NULL) {
+	return NULL;
+      }
+      return new (ptr) T;
+    }
+
+    /// Give back an object from get(), still constructed.
+    inline void put (T * obj) {
+      if (obj == NULL) {
+	return;
+      }
+      if (_count < MaxCached) {
+	_cached[_count++] = obj;
+      } else {
+	destroy (obj);
+      }
+    }
+
+    /// Destroy every cached object, giving its memory back to Heap.
+    inline void clear (void) {
+      while (_count > 0) {
+	destroy (_cached[--_count]);
+      }
+    }
+
+    /// Destroy cached objects until budget bytes have gone back to
+    /// Heap, returning how many did.
+    size_t purge (size_t budget) {
+      size_t released = 0;
+      while ((released < budget) && (_count > 0)) {
+	destroy (_cached[--_count]);
+	released += sizeof(T);
+      }
+      return released;
+    }
+
+    /// The number of objects cached.
+    inline int cached (void) const {
+      return _count;
+    }
+
+  private:
+
+    inline void destroy (T * obj) {
+      obj->~T();
+      Heap::free (obj);
+    }
+
+    int _count;
+    T * _cached[MaxCached];
+  };
+
+}
+
+#endif
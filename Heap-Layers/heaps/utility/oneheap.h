@@ -3,6 +3,9 @@
 #ifndef HL_ONEHEAP_H
 #define HL_ONEHEAP_H
 
+#include <stddef.h>
+
+#include "utility/heapwalk.h"
 #include "utility/singleton.h"
 
 namespace HL {
@@ -17,13 +20,21 @@ namespace HL {
       return singleton<TheHeap>::getInstance().malloc (sz);
     }
     
-    static inline bool free (void * ptr) {
-      return singleton<TheHeap>::getInstance().free (ptr);
+    static inline void free (void * ptr) {
+      singleton<TheHeap>::getInstance().free (ptr);
     }
     
     static inline size_t getSize (void * ptr) {
       return singleton<TheHeap>::getInstance().getSize (ptr);
     }
+
+    static inline size_t purge (size_t budget) {
+      return singleton<TheHeap>::getInstance().purge (budget);
+    }
+
+    /// Every copy shares the one heap, which would otherwise be
+    /// counted once per copy (e.g., per bin of a SegHeap).
+    void walk (HeapWalker&) {}
   };
 
 }
@@ -29,8 +29,11 @@
 
 #include <cstdio>
 
+#include "utility/statsregistry.h"
+
 // Maintain & print memory usage info.
 // Requires a superheap with the size() method (e.g., SizeHeap).
+// The numbers are also in the StatsRegistry, as "profile-<HeapNumber>".
 
 namespace HL {
 
@@ -40,7 +43,8 @@ namespace HL {
     
     ProfileHeap (void)
       : memRequested (0),
-	maxMemRequested (0)
+	maxMemRequested (0),
+	_stats (getName(), this)
     {
     }
     
@@ -66,8 +70,34 @@ namespace HL {
       memRequested -= SuperHeap::getSize (ptr);
       SuperHeap::free (ptr);
     }
+
+    /// The size-passing protocol (see SizePassingHeap).
+    inline void * mallocSized (size_t sz, size_t * actual) {
+      void * ptr = SuperHeap::mallocSized (sz, actual);
+      memRequested += *actual;
+      if (memRequested > maxMemRequested) {
+	maxMemRequested = memRequested;
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr, size_t sz) {
+      memRequested -= sz;
+      SuperHeap::free (ptr, sz);
+    }
     
+    void writeStats (StatsWriter& w) {
+      w.field ("requested", memRequested);
+      w.field ("max_requested", maxMemRequested);
+    }
+
   private:
+    static const char * getName (void) {
+      static char name[32];
+      sprintf (name, "profile-%d", HeapNumber);
+      return name;
+    }
+
     void stats (void) {
       printf ("Heap: %d\n", HeapNumber);
       printf ("Max memory requested = %d\n", maxMemRequested);
@@ -76,6 +106,7 @@ namespace HL {
     
     unsigned long memRequested;
     unsigned long maxMemRequested;
+    LayerStats<ProfileHeap> _stats;
   };
 
 }
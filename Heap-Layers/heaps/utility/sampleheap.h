@@ -0,0 +1,368 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_SAMPLEHEAP_H
+#define HL_SAMPLEHEAP_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "locks/spinlock.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class SampleHeap
+ * @brief Attributes live memory to call sites, by sampling.
+ *
+ * One allocation in about every SampleBytes bytes (the gaps drawn at
+ * random, per thread, as in tcmalloc's sampler) records the call stack
+ * that made it. Stacks are kept once each in a table of call sites, and
+ * every sample adds its weight -- the bytes it stands for, its size
+ * over its chance of being sampled -- to its site's live and allocated
+ * bytes until it is freed.
+ *
+ * Unsampled mallocs cost a thread-local subtraction; frees, one probe
+ * of the table of sampled objects while any are live. The sites are in
+ * the StatsRegistry as "samples", with each stack as return addresses
+ * (for addr2line). Stacks are walked by frame pointer, so build the
+ * program with -fno-omit-frame-pointer; on Windows they come from
+ * CaptureStackBackTrace. Samples that find a table full are dropped
+ * and counted.
+ */
+
+namespace HL {
+
+  template <class SuperHeap,
+	    size_t SampleBytes = 512 * 1024,
+	    int MaxDepth = 32>
+  class SampleHeap : public SuperHeap {
+  public:
+
+    enum { MaxSites = 4096 };
+    enum { MaxObjects = 65536 };
+
+    SampleHeap (void)
+      : _sites (NULL),
+	_objects (NULL),
+	_liveSamples (0),
+	_version (0),
+	_dropped (0),
+	_stats ("samples", this)
+    {}
+
+    inline void * malloc (size_t sz) {
+      void * ptr = SuperHeap::malloc (sz);
+      if (ptr != NULL) {
+	ThreadState& t = getThreadState();
+	t.left -= (long long) sz;
+	if (t.left < 0) {
+	  sample (t, ptr, sz);
+	}
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if ((_liveSamples > 0) && (ptr != NULL)) {
+	unsample (ptr);
+      }
+      SuperHeap::free (ptr);
+    }
+
+    /// Samples lost to a full table.
+    unsigned long long getDropped (void) const {
+      return _dropped;
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("sample_bytes", (unsigned long long) SampleBytes);
+      w.field ("dropped", getDropped());
+      w.beginArray ("sites");
+      for (int i = 0; (_sites != NULL) && (i < MaxSites); i++) {
+	Site& s = _sites[i];
+	if (s.allocs == 0) {
+	  continue;
+	}
+	w.beginObject();
+	w.field ("live_bytes", (unsigned long long) s.liveBytes);
+	w.field ("live_objects", s.liveObjects);
+	w.field ("allocated_bytes", (unsigned long long) s.allocBytes);
+	w.field ("allocs", s.allocs);
+	w.beginArray ("stack");
+	for (int d = 0; d < s.depth; d++) {
+	  char buf[2 + 2 * sizeof(void *) + 1];
+	  w.value (toHex (s.pcs[d], buf));
+	}
+	w.endArray();
+	w.endObject();
+      }
+      w.endArray();
+    }
+
+  private:
+
+    struct ThreadState {
+      long long left;		// bytes until the next sample
+      uint64_t rng;		// 0 until the thread's first malloc
+    };
+
+    struct Site {
+      uint64_t hash;
+      int depth;		// 0 for an empty slot
+      void * pcs[MaxDepth];
+      double liveBytes;
+      double allocBytes;
+      unsigned long liveObjects;
+      unsigned long allocs;
+    };
+
+    struct Object {
+      void * volatile ptr;	// NULL for an empty slot
+      int site;
+      double weight;
+    };
+
+    static inline ThreadState& getThreadState (void) {
+#if defined(_WIN32)
+      static __declspec(thread) ThreadState t;
+#else
+      static __thread ThreadState t;
+#endif
+      return t;
+    }
+
+    // xorshift64*, then an exponential gap with mean SampleBytes.
+    static long long nextGap (ThreadState& t) {
+      t.rng ^= t.rng >> 12;
+      t.rng ^= t.rng << 25;
+      t.rng ^= t.rng >> 27;
+      const double u = (double) ((t.rng * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+      return (long long) (-log (1.0 - u) * (double) SampleBytes) + 1;
+    }
+
+    NO_INLINE void sample (ThreadState& t, void * ptr, size_t sz) {
+      if (t.rng == 0) {
+	// A new thread: start the clock without a sample.
+	t.rng = ((uint64_t) (size_t) &t * 0x9e3779b97f4a7c15ULL) ^ (uint64_t) time (NULL);
+	if (t.rng == 0) {
+	  t.rng = 1;
+	}
+	t.left = nextGap (t);
+	return;
+      }
+      t.left = nextGap (t);
+      const double weight = (double) sz / (1.0 - exp (-(double) sz / (double) SampleBytes));
+      void * pcs[MaxDepth];
+      const int depth = getStack (pcs);
+
+      _lock.lock();
+      if (_sites == NULL) {
+	_sites = (Site *) MmapWrapper::map (sizeof(Site) * MaxSites);
+	_objects = (Object *) MmapWrapper::map (sizeof(Object) * MaxObjects);
+      }
+      // Keep the object table at most half full, so probes stay short.
+      const int site = (_liveSamples < MaxObjects / 2) ? findSite (pcs, depth) : -1;
+      if (site < 0) {
+	_dropped++;
+	_lock.unlock();
+	return;
+      }
+      int i = objectSlot (ptr);
+      while (_objects[i].ptr != NULL) {
+	i = (i + 1) & (MaxObjects - 1);
+      }
+      _objects[i].site = site;
+      _objects[i].weight = weight;
+      _objects[i].ptr = ptr;
+      Site& s = _sites[site];
+      s.liveBytes += weight;
+      s.allocBytes += weight;
+      s.liveObjects++;
+      s.allocs++;
+      _liveSamples++;
+      _lock.unlock();
+    }
+
+    inline void unsample (void * ptr) {
+      // Look without the lock first: most objects were never sampled.
+      // A removal moves entries, so a miss counts only if no removal
+      // ran meanwhile (_version is odd during one).
+      const unsigned long v = __atomic_load_n (&_version, __ATOMIC_ACQUIRE);
+      if ((findObject (ptr) < 0) &&
+	  ((v & 1) == 0) &&
+	  (__atomic_load_n (&_version, __ATOMIC_ACQUIRE) == v)) {
+	return;
+      }
+      removeObject (ptr);
+    }
+
+    NO_INLINE void removeObject (void * ptr) {
+      _lock.lock();
+      int i = findObject (ptr);
+      if (i >= 0) {
+	Site& s = _sites[_objects[i].site];
+	s.liveBytes -= _objects[i].weight;
+	s.liveObjects--;
+	_liveSamples--;
+	__atomic_add_fetch (&_version, 1, __ATOMIC_RELEASE);
+	// Delete by shifting back the entries after it that hash at or
+	// before the hole, so no probe needs a tombstone.
+	int hole = i;
+	for (int j = (i + 1) & (MaxObjects - 1);
+	     _objects[j].ptr != NULL;
+	     j = (j + 1) & (MaxObjects - 1)) {
+	  const int home = objectSlot (_objects[j].ptr);
+	  if (((j - home) & (MaxObjects - 1)) >= ((j - hole) & (MaxObjects - 1))) {
+	    _objects[hole].site = _objects[j].site;
+	    _objects[hole].weight = _objects[j].weight;
+	    _objects[hole].ptr = _objects[j].ptr;
+	    hole = j;
+	  }
+	}
+	_objects[hole].ptr = NULL;
+	__atomic_add_fetch (&_version, 1, __ATOMIC_RELEASE);
+      }
+      _lock.unlock();
+    }
+
+    inline int findObject (void * ptr) {
+      Object * objects = _objects;
+      if (objects == NULL) {
+	return -1;
+      }
+      for (int i = objectSlot (ptr); ; i = (i + 1) & (MaxObjects - 1)) {
+	void * p = objects[i].ptr;
+	if (p == ptr) {
+	  return i;
+	}
+	if (p == NULL) {
+	  return -1;
+	}
+      }
+    }
+
+    static inline int objectSlot (void * ptr) {
+      return (int) ((((uint64_t) (size_t) ptr >> 4) * 0x9e3779b97f4a7c15ULL) >> 48) & (MaxObjects - 1);
+    }
+
+    /// The site of this stack, added if new; -1 if the table is full.
+    int findSite (void ** pcs, int depth) {
+      uint64_t h = (uint64_t) depth;
+      for (int d = 0; d < depth; d++) {
+	h = (h ^ (uint64_t) (size_t) pcs[d]) * 0x100000001b3ULL;
+      }
+      for (int n = 0, i = (int) (h % MaxSites); n < MaxSites; n++, i = (i + 1) % MaxSites) {
+	Site& s = _sites[i];
+	if (s.allocs == 0) {
+	  s.hash = h;
+	  s.depth = depth;
+	  for (int d = 0; d < depth; d++) {
+	    s.pcs[d] = pcs[d];
+	  }
+	  return i;
+	}
+	if ((s.hash == h) && (s.depth == depth) && sameStack (s.pcs, pcs, depth)) {
+	  return i;
+	}
+      }
+      return -1;
+    }
+
+    static bool sameStack (void ** a, void ** b, int depth) {
+      for (int d = 0; d < depth; d++) {
+	if (a[d] != b[d]) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+    /// Fill pcs with the return addresses above sample().
+    static NO_INLINE int getStack (void ** pcs) {
+#if defined(_WIN32)
+      return (int) CaptureStackBackTrace (2, MaxDepth, pcs, NULL);
+#elif defined(__GNUC__)
+      void ** fp = (void **) __builtin_frame_address (0);
+      int depth = 0;
+      for (int skip = 1; (fp != NULL) && (depth < MaxDepth); ) {
+	void * ret = fp[1];
+	if (ret == NULL) {
+	  break;
+	}
+	if (skip > 0) {
+	  skip--;
+	} else {
+	  pcs[depth++] = ret;
+	}
+	// The next frame must be above this one, close by, and aligned;
+	// otherwise the walk has gone astray.
+	void ** next = (void **) fp[0];
+	if ((next <= fp) ||
+	    ((char *) next - (char *) fp > 1024 * 1024) ||
+	    (((size_t) next & (sizeof(void *) - 1)) != 0)) {
+	  break;
+	}
+	fp = next;
+      }
+      return depth;
+#else
+      return 0;
+#endif
+    }
+
+    static const char * toHex (void * p, char * buf) {
+      static const char digits[] = "0123456789abcdef";
+      size_t v = (size_t) p;
+      char * q = buf + 2 + 2 * sizeof(void *);
+      *q = '\0';
+      do {
+	*--q = digits[v & 15];
+	v >>= 4;
+      } while (v > 0);
+      *--q = 'x';
+      *--q = '0';
+      return q;
+    }
+
+    Site * _sites;
+    Object * volatile _objects;
+    volatile int _liveSamples;
+    volatile unsigned long _version;
+    unsigned long long _dropped;
+    SpinLockType _lock;
+    LayerStats<SampleHeap> _stats;
+  };
+
+}
+
+#endif
@@ -0,0 +1,344 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_TENANTHEAP_H
+#define HL_TENANTHEAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "threads/atomic.h"
+#include "threads/cpuinfo.h"
+#include "utility/gcd.h"
+#include "utility/statsregistry.h"
+#include "wrappers/mallocinfo.h"
+
+#if !defined(NO_INLINE)
+#if defined(__GNUC__)
+#define NO_INLINE __attribute__ ((noinline))
+#else
+#define NO_INLINE
+#endif
+#endif
+
+#if !defined(HL_INITIAL_EXEC)
+#if defined(__GNUC__)
+#define HL_INITIAL_EXEC __attribute__((tls_model ("initial-exec")))
+#else
+#define HL_INITIAL_EXEC
+#endif
+#endif
+
+namespace HL {
+
+  /**
+   * @class TenantContext
+   * @brief The tenant that the calling thread allocates for.
+   *
+   * Tenant 0 (every thread's to start with) stands for no tenant in
+   * particular; it is counted like the others, but has no limits
+   * unless some are set for it.
+   */
+
+  class TenantContext {
+  public:
+
+    static inline int get (void) {
+      return getSlot();
+    }
+
+    static inline void set (int tenant) {
+      getSlot() = tenant;
+    }
+
+    /// Allocates for tenant until the end of the scope, then for
+    /// whichever tenant came before.
+    class Scope {
+    public:
+      explicit Scope (int tenant)
+	: _previous (get())
+      {
+	set (tenant);
+      }
+
+      ~Scope (void) {
+	set (_previous);
+      }
+
+    private:
+      const int _previous;
+    };
+
+  private:
+
+    static inline int& getSlot (void) {
+#if defined(_WIN32)
+      static __declspec(thread) int tenant;
+#else
+      static __thread int tenant HL_INITIAL_EXEC;
+#endif
+      return tenant;
+    }
+  };
+
+
+  /**
+   * @class TenantHeap
+   * @brief Counts, and caps, the memory each tenant has in use.
+   *
+   * Each object is tagged, in a header, with the tenant its thread was
+   * allocating for (see TenantContext), so that freeing it (from any
+   * thread) gives the bytes back to the same tenant. The bytes are
+   * those getSize reports for the object with its header, so there is
+   * no table on the side.
+   *
+   * Counting costs no shared write on the fast path: each CPU (as
+   * CPUInfo::getCurrentCPU sees it, mod NumShards) has its own cache
+   * lines of counts per tenant, which are only added into the tenant's
+   * shared total when they have drifted Batch bytes away from zero, as
+   * a Linux percpu_counter does. A tenant's limits are checked then,
+   * against the total, which is so up to NumShards * Batch bytes out;
+   * once a tenant is that close to its hard limit, each of its mallocs
+   * and frees adds into the total (and checks) at once, so the limit
+   * holds to within what other CPUs had counted but not yet added in.
+   * Crossing the soft limit calls the handler once, until usage falls
+   * below it again; crossing the hard limit calls the handler and
+   * makes malloc return NULL.
+   *
+   * Example:
+   * <TT>
+   *   ANSIWrapper<TenantHeap<KingsleyHeap<...> > > heap;<BR>
+   *   heap.setLimits (7, 256 << 20, 512 << 20);<BR>
+   *   TenantContext::Scope s (7);  // Allocations here count for tenant 7.<BR>
+   * </TT>
+   *
+   * The totals are in the StatsRegistry, as "tenants".
+   *
+   * @param MaxTenants Tenant ids run from 0 to MaxTenants - 1.
+   * @param NumShards How many sets of per-CPU counts to keep.
+   * @param Batch How far a CPU's count drifts before it is added in.
+   */
+
+  template <class SuperHeap,
+	    int MaxTenants = 64,
+	    int NumShards = 16,
+	    long Batch = 64 * 1024>
+  class TenantHeap : public SuperHeap {
+  private:
+
+    union Header {
+      uint32_t _tenant;
+      char _buf[HL::MallocInfo::Alignment];
+    };
+
+  public:
+
+    /// Told when tenant has bytes in use, past limit (hard or soft).
+    typedef void (*LimitHandler) (int tenant, size_t bytes, size_t limit, bool hard);
+
+    enum { Alignment = gcd<(int) SuperHeap::Alignment, (int) sizeof(Header)>::value };
+
+    TenantHeap (void)
+      : _handler (NULL),
+	_stats ("tenants", this)
+    {
+      memset ((void *) _shards, 0, sizeof(_shards));
+      memset ((void *) _tenants, 0, sizeof(_tenants));
+    }
+
+    inline void * malloc (size_t sz) {
+      if (sz + sizeof(Header) < sz) {
+	return NULL;
+      }
+      Header * h = (Header *) SuperHeap::malloc (sz + sizeof(Header));
+      if (h == NULL) {
+	return NULL;
+      }
+      const int tenant = current();
+      h->_tenant = (uint32_t) tenant;
+      const long long bytes = (long long) SuperHeap::getSize (h);
+      volatile long long * count = &getShard().count[tenant];
+      const long long c = Atomic::addRelaxed (count, bytes);
+      if (((c >= Batch) || _tenants[tenant].nearHard) && !addIn (tenant, count, c, bytes)) {
+	SuperHeap::free (h);
+	return NULL;
+      }
+      return (void *) (h + 1);
+    }
+
+    inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      Header * h = getHeader (ptr);
+      const int tenant = (int) h->_tenant;
+      const long long bytes = (long long) SuperHeap::getSize (h);
+      volatile long long * count = &getShard().count[tenant];
+      const long long c = Atomic::addRelaxed (count, -bytes);
+      if ((c <= -Batch) || _tenants[tenant].nearHard) {
+	addIn (tenant, count, c, 0);
+      }
+      SuperHeap::free (h);
+    }
+
+    inline size_t getSize (void * ptr) {
+      return SuperHeap::getSize (getHeader (ptr)) - sizeof(Header);
+    }
+
+    /// The tenant that allocated ptr.
+    static inline int getTenant (const void * ptr) {
+      return (int) getHeader (ptr)->_tenant;
+    }
+
+    /// Limits of 0 are no limit.
+    void setLimits (int tenant, size_t soft, size_t hard) {
+      assert ((tenant >= 0) && (tenant < MaxTenants));
+      Tenant& t = _tenants[tenant];
+      t.soft = soft;
+      t.hard = hard;
+      t.nearHard = (hard != 0) && (getInUse (tenant) + (size_t) NumShards * Batch > hard);
+    }
+
+    void setLimitHandler (LimitHandler handler) {
+      _handler = handler;
+    }
+
+    /// The bytes tenant has in use, summed over every CPU's count.
+    size_t getInUse (int tenant) {
+      long long total = _tenants[tenant].total;
+      for (int i = 0; i < NumShards; i++) {
+	total += _shards[i].count[tenant];
+      }
+      return (total > 0) ? (size_t) total : 0;
+    }
+
+    /// How many times malloc has returned NULL for tenant's hard limit.
+    unsigned long getRefusals (int tenant) {
+      return _tenants[tenant].refusals;
+    }
+
+    /// Rename this heap in the StatsRegistry.
+    void setStatsName (const char * name) {
+      _stats.setStatsName (name);
+    }
+
+    void writeStats (StatsWriter& w) {
+      int last = -1;
+      for (int t = 0; t < MaxTenants; t++) {
+	if ((getInUse (t) > 0) || (_tenants[t].refusals > 0)) {
+	  last = t;
+	}
+      }
+      w.beginArray ("in_use");
+      for (int t = 0; t <= last; t++) {
+	w.value ((unsigned long long) getInUse (t));
+      }
+      w.endArray();
+      w.beginArray ("refusals");
+      for (int t = 0; t <= last; t++) {
+	w.value ((unsigned long long) _tenants[t].refusals);
+      }
+      w.endArray();
+    }
+
+  private:
+
+    enum { CacheLineSize = 64 };
+
+    /// One CPU's counts of bytes, not yet added in, per tenant.
+    struct Shard {
+      volatile long long count[MaxTenants];
+      char _pad[CacheLineSize];
+    };
+
+    struct Tenant {
+      volatile long long total;
+      size_t soft;
+      size_t hard;
+      volatile bool overSoft;
+      volatile bool nearHard;	// within NumShards * Batch of hard
+      unsigned long refusals;
+      char _pad[CacheLineSize];
+    };
+
+    /// The tenant to charge; ids out of range count as tenant 0.
+    static inline int current (void) {
+      const int tenant = TenantContext::get();
+      assert ((tenant >= 0) && (tenant < MaxTenants));
+      return ((unsigned int) tenant < (unsigned int) MaxTenants) ? tenant : 0;
+    }
+
+    inline Shard& getShard (void) {
+      return _shards[(unsigned int) CPUInfo::getCurrentCPU() % (unsigned int) NumShards];
+    }
+
+    static inline Header * getHeader (const void * ptr) {
+      return ((Header *) ptr - 1);
+    }
+
+    /// Move a CPU's count c into the tenant's total, and check the
+    /// limits. Returns false (having taken back the object of bytes
+    /// that pushed it over) if that was past the hard limit.
+    NO_INLINE bool addIn (int tenant, volatile long long * count, long long c, long long bytes) {
+      Tenant& t = _tenants[tenant];
+      Atomic::addRelaxed (count, -c);
+      const long long total = Atomic::addRelaxed (&t.total, c);
+      if (t.hard != 0) {
+	t.nearHard = (total + (long long) NumShards * Batch > (long long) t.hard);
+      }
+      if ((t.hard != 0) && (bytes > 0) && (total > (long long) t.hard)) {
+	Atomic::addRelaxed (&t.total, -bytes);
+	t.refusals++;
+	if (_handler != NULL) {
+	  (*_handler) (tenant, (size_t) total, t.hard, true);
+	}
+	return false;
+      }
+      if (t.soft != 0) {
+	const bool over = (total > (long long) t.soft);
+	if (over && !t.overSoft) {
+	  t.overSoft = true;
+	  if (_handler != NULL) {
+	    (*_handler) (tenant, (size_t) total, t.soft, false);
+	  }
+	} else if (!over) {
+	  t.overSoft = false;
+	}
+      }
+      return true;
+    }
+
+    Shard _shards[NumShards];
+    Tenant _tenants[MaxTenants];
+    LimitHandler _handler;
+    LayerStats<TenantHeap> _stats;
+  };
+
+}
+
+#endif
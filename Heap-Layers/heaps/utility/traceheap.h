@@ -39,6 +39,17 @@
 #include <string.h>
 #include <cstdio>
 
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "locks/spinlock.h"
+#include "threads/cpuinfo.h"
+#include "utility/traceformat.h"
+
 // An object that manages direct writing to a file.
 
 namespace HL {
@@ -70,6 +81,7 @@ namespace HL {
     {
 #if 1
       _file = fopen(fname, "w+");
+      _isOpen = (_file != NULL);
 #else
 #ifdef WIN32
       _file = _open(fname, _O_WRONLY | _O_CREAT, _S_IREAD | _S_IWRITE);
@@ -197,6 +209,158 @@ namespace HL {
     }
  
   };
+
+  /**
+   * @class TraceLog
+   * @brief Buffers trace records and appends them to a binary trace file.
+   *
+   * Records are stamped and buffered under a spin lock, so their order
+   * in the file is the order of the calls; the buffer goes out with one
+   * write(2) when it fills and when the log is destroyed.  The log never
+   * allocates, so it is safe to use from inside an allocator.
+   */
+
+  class TraceLog {
+  public:
+
+    TraceLog (void)
+      : _fd (-1),
+	_count (0)
+    {}
+
+    ~TraceLog (void) {
+      close();
+    }
+
+    void open (const char * fname) {
+      _lock.lock();
+      if (_fd < 0) {
+	_fd = ::open (fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	_start = now();
+	TraceHeader h;
+	memset (&h, 0, sizeof(h));
+	memcpy (h.magic, "HLTRACE", 8);
+	h.version = TraceHeader::Version;
+	h.recordSize = sizeof(TraceRecord);
+	write (&h, sizeof(h));
+      }
+      _lock.unlock();
+    }
+
+    void close (void) {
+      _lock.lock();
+      if (_fd >= 0) {
+	flush();
+	::close (_fd);
+	_fd = -1;
+      }
+      _lock.unlock();
+    }
+
+    /// Append a record, stamped with the current time. Call this after a
+    /// malloc has returned and before a free is passed on, so that a
+    /// free never appears ahead of the malloc of the same object.
+    inline void record (int op, void * ptr, size_t sz) {
+      const unsigned int tid = CPUInfo::getThreadId();
+      _lock.lock();
+      if (_fd >= 0) {
+	TraceRecord& r = _buf[_count];
+	r.time = now() - _start;
+	r.ptr = (uint64_t) (size_t) ptr;
+	r.size = sz;
+	r.thread = tid;
+	r.op = op;
+	if (++_count == BufferRecords) {
+	  flush();
+	}
+      }
+      _lock.unlock();
+    }
+
+  private:
+
+    enum { BufferRecords = 1024 };
+
+    static inline uint64_t now (void) {
+#if defined(_WIN32)
+      LARGE_INTEGER t, f;
+      QueryPerformanceCounter (&t);
+      QueryPerformanceFrequency (&f);
+      return (uint64_t) ((double) t.QuadPart * 1e9 / (double) f.QuadPart);
+#else
+      struct timespec ts;
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+      return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+    void flush (void) {
+      write (_buf, _count * sizeof(TraceRecord));
+      _count = 0;
+    }
+
+    void write (const void * buf, size_t len) {
+      const char * p = (const char *) buf;
+      while (len > 0) {
+	const long n = (long) ::write (_fd, p, len);
+	if (n <= 0) {
+	  break;
+	}
+	p += n;
+	len -= n;
+      }
+    }
+
+    int _fd;
+    int _count;
+    uint64_t _start;
+    SpinLockType _lock;
+    TraceRecord _buf[BufferRecords];
+  };
+
+  /**
+   * @class BinaryTraceHeap
+   * @brief Traces mallocs and frees to "trace-<Number>.bin".
+   *
+   * Like TraceHeap, but in the binary format of TraceRecord, with
+   * timestamps and thread ids, which util/bench/replay can play back
+   * against any allocator.
+   */
+
+  template <class Super, int Number>
+  class BinaryTraceHeap : public Super {
+  public:
+
+    BinaryTraceHeap (void)
+    {
+      char fname[255];
+      sprintf (fname, "trace-%d.bin", Number);
+      getLog().open (fname);
+    }
+
+    inline void * malloc (size_t sz) {
+      void * ptr = Super::malloc (sz);
+      if (ptr != NULL) {
+	getLog().record (TraceMalloc, ptr, sz);
+      }
+      return ptr;
+    }
+
+    inline void free (void * ptr) {
+      if (ptr != NULL) {
+	getLog().record (TraceFree, ptr, 0);
+      }
+      Super::free (ptr);
+    }
+
+  private:
+
+    static TraceLog& getLog (void) {
+      static TraceLog log;
+      return log;
+    }
+
+  };
  
 }
  
@@ -0,0 +1,69 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+  
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+  
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_ZEROHEAP_H
+#define HL_ZEROHEAP_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "utility/streamingcopy.h"
+
+/**
+ * @class ZeroHeap
+ * @brief Supplies mallocZeroed for heaps that cannot prove memory is fresh.
+ *
+ * mallocZeroed (sz) returns sz bytes of zero-filled memory. Source
+ * heaps whose memory always arrives zeroed (those that declare
+ * ZeroMemory = 1, like MmapHeap) implement it as plain malloc;
+ * combining layers such as HybridHeap and LockedHeap pass it through
+ * to the heap that will serve the request. Put this layer above any
+ * heap that recycles memory, so that calloc skips the memset only
+ * when it is safe to do so:
+ *
+ * <TT>
+ *   HybridHeap<BigSize, ZeroHeap<SmallHeap>, SizeHeap<MmapHeap> >
+ * </TT>
+ */
+
+namespace HL {
+
+  template <class SuperHeap>
+  class ZeroHeap : public SuperHeap {
+  public:
+
+    inline void * mallocZeroed (size_t sz) {
+      void * ptr = SuperHeap::malloc (sz);
+      if (ptr != NULL) {
+	StreamingCopy::zero (ptr, sz);
+      }
+      return ptr;
+    }
+  };
+
+}
+
+#endif
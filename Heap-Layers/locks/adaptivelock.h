@@ -0,0 +1,160 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+  
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+  
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_ADAPTIVELOCK_H
+#define HL_ADAPTIVELOCK_H
+
+#if defined(__linux)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#include "threads/atomic.h"
+#include "utility/probes.h"
+
+/**
+ * @class AdaptiveLockType
+ * @brief Spin with bounded exponential backoff, then park.
+ *
+ * An uncontended acquire is a single compare-and-swap. Under
+ * contention, we spin (using PAUSE) for exponentially longer
+ * intervals up to MAX_SPIN_LIMIT, which wins when the holder is
+ * running on another core; if that fails, the thread parks on a futex
+ * (Linux) or yields (elsewhere), which wins when cores are
+ * oversubscribed. This is the three-state mutex from Drepper's
+ * "Futexes Are Tricky".
+ *
+ * The lock counts contended acquisitions and parks. The counters
+ * are updated while holding the lock, so they need no atomics; read
+ * them through LockedHeap::getLock(). Contended acquisitions also
+ * fire the lock_contended_start and lock_contended_done probes (see
+ * probes.h), the latter with 1 if the thread parked.
+ */
+
+namespace HL {
+
+  class AdaptiveLockType {
+  private:
+
+    enum { UNLOCKED = 0, LOCKED = 1, LOCKED_WITH_WAITERS = 2 };
+
+  public:
+
+    AdaptiveLockType (void)
+      : _state (UNLOCKED),
+	_contended (0),
+	_parked (0)
+    {}
+
+    inline void lock (void) {
+      if (!Atomic::compareAndSwap (&_state, UNLOCKED, LOCKED)) {
+	contendedLock();
+      }
+    }
+
+    inline void unlock (void) {
+      if (Atomic::exchange (&_state, UNLOCKED) == LOCKED_WITH_WAITERS) {
+	wake();
+      }
+    }
+
+    /// How many acquisitions found the lock held.
+    inline unsigned long getContended (void) const {
+      return _contended;
+    }
+
+    /// How many of those acquisitions had to park.
+    inline unsigned long getParked (void) const {
+      return _parked;
+    }
+
+  private:
+
+    enum { MAX_SPIN_LIMIT = 1024 };
+
+    NO_INLINE void contendedLock (void) {
+      HL_PROBE1 (lock_contended_start, this);
+      // Spin first, backing off exponentially.
+      for (int spins = 1; spins <= MAX_SPIN_LIMIT; spins <<= 1) {
+	for (int i = 0; i < spins; i++) {
+	  pause();
+	}
+	if ((_state == UNLOCKED) &&
+	    Atomic::compareAndSwap (&_state, UNLOCKED, LOCKED)) {
+	  _contended++;
+	  HL_PROBE2 (lock_contended_done, this, 0);
+	  return;
+	}
+      }
+      // Now park until the lock is released. Since we don't know
+      // whether anyone else is waiting, we must leave the state as
+      // LOCKED_WITH_WAITERS once we get it.
+      while (Atomic::exchange (&_state, LOCKED_WITH_WAITERS) != UNLOCKED) {
+	wait();
+      }
+      _contended++;
+      _parked++;
+      HL_PROBE2 (lock_contended_done, this, 1);
+    }
+
+    static inline void pause (void) {
+#if defined(__i386__) || defined(__x86_64__)
+      asm volatile ("pause" : : : "memory");
+#elif defined(_WIN32)
+      YieldProcessor();
+#endif
+    }
+
+    inline void wait (void) {
+#if defined(__linux)
+      syscall (SYS_futex, (int *) &_state, FUTEX_WAIT_PRIVATE, LOCKED_WITH_WAITERS, NULL, NULL, 0);
+#elif defined(_WIN32)
+      Sleep (0);
+#else
+      sched_yield();
+#endif
+    }
+
+    inline void wake (void) {
+#if defined(__linux)
+      syscall (SYS_futex, (int *) &_state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+
+    volatile int _state;
+
+    unsigned long _contended;
+    unsigned long _parked;
+  };
+
+}
+
+#endif
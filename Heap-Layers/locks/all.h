@@ -1,4 +1,7 @@
+#include "adaptivelock.h"
+#include "cohortlock.h"
 #include "maclock.h"
+#include "mcslock.h"
 #include "posixlock.h"
 #include "recursivelock.h"
 #include "spinlock.h"
@@ -0,0 +1,115 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_COHORTLOCK_H
+#define HL_COHORTLOCK_H
+
+#include "locks/mcslock.h"
+#include "threads/atomic.h"
+#include "threads/cpuinfo.h"
+
+/**
+ * @class CohortLockType
+ * @brief A NUMA-aware lock: an MCS lock per node, under a global lock.
+ *
+ * This is the C-TKT-MCS lock of Dice, Marathe and Shavit's "Lock
+ * Cohorting". A thread first queues on the MCS lock of the NUMA node
+ * it is running on, and then takes a global ticket lock. On release,
+ * if a thread of the same node is waiting, the holder passes it the
+ * local lock together with the global one, so the lock (and the data
+ * it protects) stays on one node for a run of acquisitions rather
+ * than crossing the interconnect every time. After MaxHandoffs
+ * passes in a row, the holder releases the global lock instead, so
+ * other nodes, which queue on it in ticket order, are not starved.
+ *
+ * Nodes beyond MaxNodes share local locks (node modulo MaxNodes),
+ * which is still correct, only less local.
+ */
+
+namespace HL {
+
+  template <int MaxHandoffs = 64,
+	    int MaxNodes = 8>
+  class CohortLockType {
+  public:
+
+    CohortLockType (void)
+      : _nextTicket (0),
+	_nowServing (0),
+	_holder (0)
+    {}
+
+    inline void lock (void) {
+      Local * l = &_local[CPUInfo::getCurrentNode() % MaxNodes];
+      if (l->mcs.acquire() != PASSED) {
+	// We must take the global lock ourselves.
+	const long ticket = Atomic::fetchAndAdd (&_nextTicket, 1);
+	int spins = 0;
+	while (_nowServing != ticket) {
+	  MCSLockType::relax (spins);
+	}
+	Atomic::memoryBarrier();
+	l->handoffs = 0;
+      }
+      _holder = l;
+    }
+
+    inline void unlock (void) {
+      Local * l = _holder;
+      if ((l->handoffs < MaxHandoffs) && l->mcs.hasWaiters()) {
+	// Keep the global lock on this node.
+	l->handoffs++;
+	l->mcs.release (PASSED);
+      } else {
+	Atomic::memoryBarrier();
+	_nowServing = _nowServing + 1;
+	l->mcs.release (MCSLockType::GRANTED);
+      }
+    }
+
+  private:
+
+    enum { PASSED = MCSLockType::GRANTED + 1 };
+
+    enum { CacheLineSize = 64 };
+
+    struct Local {
+      MCSLockType mcs;
+      int handoffs;		// passes in a row; only the holder uses it
+      char _pad[CacheLineSize - sizeof(MCSLockType) - sizeof(int)];
+    };
+
+    volatile long _nextTicket;
+    char _pad1[CacheLineSize - sizeof(long)];
+    volatile long _nowServing;
+    Local * _holder;		// only the holder reads or writes this
+    char _pad2[CacheLineSize - sizeof(long) - sizeof(Local *)];
+    Local _local[MaxNodes];
+  };
+
+}
+
+#endif
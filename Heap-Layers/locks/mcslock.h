@@ -0,0 +1,205 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_MCSLOCK_H
+#define HL_MCSLOCK_H
+
+#include <assert.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#include "threads/atomic.h"
+
+#if !defined(HL_INITIAL_EXEC)
+#if defined(__GNUC__)
+#define HL_INITIAL_EXEC __attribute__((tls_model ("initial-exec")))
+#else
+#define HL_INITIAL_EXEC
+#endif
+#endif
+
+/**
+ * @class MCSLockType
+ * @brief The queue lock of Mellor-Crummey and Scott.
+ *
+ * Waiters form a queue, each spinning on a flag in its own queue
+ * node, and the holder hands the lock to the next in line by clearing
+ * that flag. Under contention, then, every acquisition moves one
+ * cache line from the releasing core to the acquiring one, where a
+ * spin lock has every waiter hammering the same line; and the lock
+ * is granted in arrival order.
+ *
+ * The queue nodes come from a small per-thread pool (a thread may
+ * hold up to MaxHeld MCS locks at once), and the holder's node is
+ * kept in the lock, so this fits the plain lock()/unlock() interface
+ * of LockedHeap.
+ *
+ * A waiter that has spun for SpinLimit pauses starts yielding the
+ * processor between checks, since when there are more threads than
+ * cores, the next in line may well not be running.
+ *
+ * acquire(), hasWaiters() and release() let CohortLockType pass a
+ * value to the next holder along with the lock.
+ */
+
+namespace HL {
+
+  class MCSLockType {
+  public:
+
+    /// The most MCS locks a thread may hold at once.
+    enum { MaxHeld = 16 };
+
+    MCSLockType (void)
+      : _tail (0),
+	_owner (0)
+    {}
+
+    inline void lock (void) {
+      acquire();
+    }
+
+    inline void unlock (void) {
+      release (GRANTED);
+    }
+
+    /// Wait for the lock, returning the grant its last holder passed.
+    inline int acquire (void) {
+      Node * n = getNode();
+      n->next = 0;
+      n->grant = WAITING;
+      Node * pred = Atomic::exchange (&_tail, n);
+      if (pred) {
+	pred->next = n;
+	int spins = 0;
+	while (n->grant == WAITING) {
+	  relax (spins);
+	}
+      } else {
+	n->grant = GRANTED;
+      }
+      Atomic::memoryBarrier();
+      _owner = n;
+      return n->grant;
+    }
+
+    /// True if another thread is queued behind the holder.
+    inline bool hasWaiters (void) const {
+      return (_owner->next != 0) || (_tail != _owner);
+    }
+
+    /// Release the lock, handing grant (which must not be WAITING)
+    /// to the next waiter, if any.
+    inline void release (int grant) {
+      Node * n = _owner;
+      if (n->next == 0) {
+	if (Atomic::compareAndSwap (&_tail, n, (Node *) 0)) {
+	  putNode (n);
+	  return;
+	}
+	// A waiter has swapped itself in but not yet linked itself.
+	int spins = 0;
+	while (n->next == 0) {
+	  relax (spins);
+	}
+      }
+      Node * succ = n->next;
+      Atomic::memoryBarrier();
+      succ->grant = grant;
+      putNode (n);
+    }
+
+    enum { WAITING = 0, GRANTED = 1 };
+
+    /// Wait a little, in the spins'th round of waiting.
+    static inline void relax (int& spins) {
+      if (spins < SpinLimit) {
+	spins++;
+#if defined(__i386__) || defined(__x86_64__)
+	asm volatile ("pause" : : : "memory");
+#elif defined(_WIN32)
+	YieldProcessor();
+#endif
+      } else {
+#if defined(_WIN32)
+	Sleep (0);
+#else
+	sched_yield();
+#endif
+      }
+    }
+
+  private:
+
+    enum { SpinLimit = 1024 };
+
+    enum { CacheLineSize = 64 };
+
+    struct Node {
+      Node * volatile next;
+      volatile int grant;
+      char _pad[CacheLineSize - sizeof(Node *) - sizeof(int)];
+    };
+
+    struct Pool {
+      unsigned long used;		// bit i set if nodes[i] is in use
+      Node nodes[MaxHeld];
+    };
+
+    static inline Pool& getPool (void) {
+      static __thread Pool pool HL_INITIAL_EXEC;
+      return pool;
+    }
+
+    static inline Node * getNode (void) {
+      Pool& p = getPool();
+      // Holding MaxHeld MCS locks already, we have no node to queue with.
+      assert (p.used != (1UL << MaxHeld) - 1);
+      if (p.used == (1UL << MaxHeld) - 1) {
+	abort();
+      }
+      const int i = __builtin_ctzl (~p.used);
+      p.used |= (1UL << i);
+      return &p.nodes[i];
+    }
+
+    static inline void putNode (Node * n) {
+      Pool& p = getPool();
+      p.used &= ~(1UL << (n - p.nodes));
+    }
+
+    Node * volatile _tail;
+    Node * _owner;			// only the holder reads or writes this
+  };
+
+}
+
+#endif
@@ -44,6 +44,7 @@
 #endif
 
 #include "threads/cpuinfo.h"
+#include "utility/probes.h"
 
 #if defined(_MSC_VER)
 
@@ -143,9 +144,11 @@ namespace HL {
 
     NO_INLINE
     void contendedLock (void) {
+      HL_PROBE1 (lock_contended_start, this);
       while (true) {
 	if (MyInterlockedExchange (const_cast<unsigned long *>(&mutex), LOCKED)
 	    == UNLOCKED) {
+	  HL_PROBE2 (lock_contended_done, this, 0);
 	  return;
 	}
 	while (mutex == LOCKED) {
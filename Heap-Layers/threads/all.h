@@ -1,2 +1,3 @@
+#include "atomic.h"
 #include "cpuinfo.h"
 #include "fred.h"
@@ -0,0 +1,131 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_ATOMIC_H
+#define HL_ATOMIC_H
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+/**
+ * @class Atomic
+ * @brief Architecture-independent wrappers for atomic operations.
+ *
+ * All operations act on word-sized (or pointer-sized) values and
+ * imply a full memory barrier.
+ */
+
+namespace HL {
+
+  class Atomic {
+  public:
+
+    /// Atomically: if (*ptr == oldval) { *ptr = newval; return true; }
+    template <class T>
+    static inline bool compareAndSwap (T * volatile * ptr, T * oldval, T * newval) {
+#if defined(_WIN32)
+      return (InterlockedCompareExchangePointer ((PVOID volatile *) ptr, newval, oldval) == oldval);
+#elif defined(__GNUC__)
+      return __sync_bool_compare_and_swap (ptr, oldval, newval);
+#else
+#error "No atomic compare-and-swap is available for this platform."
+#endif
+    }
+
+    static inline bool compareAndSwap (volatile unsigned long * ptr,
+				       unsigned long oldval,
+				       unsigned long newval) {
+#if defined(_WIN32)
+      return ((unsigned long) InterlockedCompareExchange ((volatile LONG *) ptr, newval, oldval) == oldval);
+#elif defined(__GNUC__)
+      return __sync_bool_compare_and_swap (ptr, oldval, newval);
+#endif
+    }
+
+    static inline bool compareAndSwap (volatile int * ptr,
+				       int oldval,
+				       int newval) {
+#if defined(_WIN32)
+      return (InterlockedCompareExchange ((volatile LONG *) ptr, newval, oldval) == oldval);
+#elif defined(__GNUC__)
+      return __sync_bool_compare_and_swap (ptr, oldval, newval);
+#endif
+    }
+
+    /// Atomically: retval = *ptr; *ptr = newval; return retval.
+    template <class T>
+    static inline T * exchange (T * volatile * ptr, T * newval) {
+#if defined(_WIN32)
+      return (T *) InterlockedExchangePointer ((PVOID volatile *) ptr, newval);
+#elif defined(__GNUC__)
+      // __sync_lock_test_and_set is only an acquire barrier.
+      __sync_synchronize();
+      return __sync_lock_test_and_set (ptr, newval);
+#endif
+    }
+
+    static inline int exchange (volatile int * ptr, int newval) {
+#if defined(_WIN32)
+      return InterlockedExchange ((volatile LONG *) ptr, newval);
+#elif defined(__GNUC__)
+      __sync_synchronize();
+      return __sync_lock_test_and_set (ptr, newval);
+#endif
+    }
+
+    /// Atomically: retval = *ptr; *ptr += delta; return retval.
+    static inline long fetchAndAdd (volatile long * ptr, long delta) {
+#if defined(_WIN32)
+      return InterlockedExchangeAdd ((volatile LONG *) ptr, delta);
+#elif defined(__GNUC__)
+      return __sync_fetch_and_add (ptr, delta);
+#endif
+    }
+
+    /// Atomically: *ptr += delta; return *ptr. 64 bits even on 32-bit
+    /// hosts, and no ordering beyond the add itself, for counters.
+    static inline long long addRelaxed (volatile long long * ptr, long long delta) {
+#if defined(_WIN32)
+      return InterlockedExchangeAdd64 ((volatile LONGLONG *) ptr, delta) + delta;
+#elif defined(__GNUC__)
+      return __atomic_add_fetch (ptr, delta, __ATOMIC_RELAXED);
+#endif
+    }
+
+    static inline void memoryBarrier (void) {
+#if defined(_WIN32)
+      MemoryBarrier();
+#elif defined(__GNUC__)
+      __sync_synchronize();
+#endif
+    }
+
+  };
+
+}
+
+#endif
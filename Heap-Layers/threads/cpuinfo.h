@@ -54,6 +54,25 @@ extern "C" int _thr_self(void);
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
+// Restartable sequences (glibc 2.35 and later register an rseq area
+// for every thread, whose cpu_id field the kernel keeps current).
+#if !defined(HL_USE_RSEQ)
+#if defined(__linux) && defined(__GLIBC__) && defined(__GNUC__) && (__GNUC__ >= 11) \
+  && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 35)))
+#define HL_USE_RSEQ 1
+#else
+#define HL_USE_RSEQ 0
+#endif
+#endif
+
+#if HL_USE_RSEQ
+#include <sys/rseq.h>
 #endif
 
 #if defined(__APPLE__)
@@ -85,7 +104,8 @@ namespace HL {
  * @class CPUInfo
  * @author Emery Berger <http://www.cs.umass.edu/~emery>
  *
- * @brief Architecture-independent wrapper to get number of CPUs. 
+ * @brief Architecture-independent wrapper to get number of CPUs,
+ * and the rest of the machine's topology and cache geometry.
  */
 
 class CPUInfo {
@@ -104,6 +124,62 @@ public:
   static inline unsigned int getThreadId (void);
   inline static int computeNumProcessors (void);
 
+  /// The processor the calling thread is running on (which may
+  /// change at any moment, so use it only as a hint).
+  static inline int getCurrentCPU (void);
+
+  /// The NUMA node of the processor the calling thread is running on
+  /// (0 where there is no way to ask), a hint like getCurrentCPU.
+  static inline int getCurrentNode (void);
+
+  /// The shape of the machine, found once (from sysfs on Linux and
+  /// sysctl on Mac OS X); whatever cannot be found gets a guess that
+  /// is right for most x86 machines.
+  struct Topology {
+    int sockets;		///< physical packages
+    int nodes;			///< NUMA nodes
+    int cores;			///< physical cores, over all sockets
+    int threadsPerCore;		///< SMT siblings per core
+    size_t cacheSize[4];	///< by level: [1] is L1 data; 0 if absent
+    size_t cacheLineSize;
+    size_t pageSize;		///< the base page size
+    size_t hugePageSize;	///< the (transparent) huge page size
+  };
+
+  static inline const Topology& getTopology (void) {
+    static Topology _topology = computeTopology();
+    return _topology;
+  }
+
+  static inline int getNumSockets (void)	{ return getTopology().sockets; }
+  static inline int getNumNodes (void)		{ return getTopology().nodes; }
+  static inline int getNumCores (void)		{ return getTopology().cores; }
+  static inline int getThreadsPerCore (void)	{ return getTopology().threadsPerCore; }
+  static inline size_t getCacheLineSize (void)	{ return getTopology().cacheLineSize; }
+  static inline size_t getPageSize (void)	{ return getTopology().pageSize; }
+  static inline size_t getHugePageSize (void)	{ return getTopology().hugePageSize; }
+
+  /// The size of the level 1 (data), 2 or 3 cache, or 0 if there is none.
+  static inline size_t getCacheSize (int level) {
+    return ((level >= 1) && (level <= 3)) ? getTopology().cacheSize[level] : 0;
+  }
+
+  /// The size of the last-level cache.
+  static inline size_t getLastLevelCacheSize (void) {
+    const Topology& t = getTopology();
+    return t.cacheSize[3] ? t.cacheSize[3] : t.cacheSize[2] ? t.cacheSize[2] : t.cacheSize[1];
+  }
+
+private:
+
+  static inline Topology computeTopology (void);
+
+#if defined(__linux)
+  static inline bool readFile (const char * path, char * buf, size_t len);
+  static inline long readNumber (const char * path);
+  static inline int countList (const char * path, int * first);
+#endif
+
 };
 
 
@@ -136,6 +212,242 @@ int CPUInfo::computeNumProcessors (void)
   }
 }
 
+int CPUInfo::getCurrentCPU (void)
+{
+#if HL_USE_RSEQ
+  if (__rseq_size > 0) {
+    // Read the kernel-maintained cpu_id without a system call.
+    const struct rseq * rs =
+      (const struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+    int cpu = (int) *((volatile const unsigned int *) &rs->cpu_id);
+    if (cpu >= 0) {
+      return cpu;
+    }
+  }
+#endif
+#if defined(__linux)
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return cpu;
+  }
+#elif defined(_WIN32) && (_WIN32_WINNT >= 0x0600)
+  return (int) GetCurrentProcessorNumber();
+#endif
+  // No way to ask: fall back to the thread id.
+  return (int) (getThreadId() % (unsigned int) getNumProcessors());
+}
+
+int CPUInfo::getCurrentNode (void)
+{
+#if defined(__linux)
+  unsigned int cpu, node;
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 29)))
+  // Through the vDSO, so (on x86) without a system call.
+  if (getcpu (&cpu, &node) == 0) {
+    return (int) node;
+  }
+#elif defined(SYS_getcpu)
+  if (syscall (SYS_getcpu, &cpu, &node, NULL) == 0) {
+    return (int) node;
+  }
+#endif
+#elif defined(_WIN32) && (_WIN32_WINNT >= 0x0601)
+  PROCESSOR_NUMBER pn;
+  USHORT node;
+  GetCurrentProcessorNumberEx (&pn);
+  if (GetNumaProcessorNodeEx (&pn, &node)) {
+    return (int) node;
+  }
+#endif
+  return 0;
+}
+
+CPUInfo::Topology CPUInfo::computeTopology (void)
+{
+  Topology t;
+  t.sockets = 1;
+  t.nodes = 1;
+  t.cores = getNumProcessors();
+  t.threadsPerCore = 1;
+  t.cacheSize[0] = 0;
+  t.cacheSize[1] = 32 * 1024;
+  t.cacheSize[2] = 256 * 1024;
+  t.cacheSize[3] = 0;
+  t.cacheLineSize = 64;
+  t.pageSize = PageSize;
+  t.hugePageSize = 2 * 1024 * 1024;
+
+#if defined(__linux)
+  // This can run inside malloc, so we read sysfs with read() into
+  // buffers on the stack, never with stdio.
+  char path[128];
+  int first;
+  long v;
+  if (sysconf (_SC_PAGESIZE) > 0) {
+    t.pageSize = (size_t) sysconf (_SC_PAGESIZE);
+  }
+  if ((v = readNumber ("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size")) > 0) {
+    t.hugePageSize = (size_t) v;
+  }
+  const int n = countList ("/sys/devices/system/node/online", &first);
+  if (n > 0) {
+    t.nodes = n;
+  }
+  // Count the packages (by id) and the cores (as the CPUs that come
+  // first among their SMT siblings) of the online CPUs.
+  enum { MaxSockets = 256 };
+  bool seen[MaxSockets] = { false };
+  int sockets = 0, cores = 0, found = 0;
+  for (int cpu = 0; found < getNumProcessors() && cpu < 8192; cpu++) {
+    sprintf (path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    const int siblings = countList (path, &first);
+    if (siblings <= 0) {
+      continue;
+    }
+    found++;
+    if (first == cpu) {
+      cores++;
+    }
+    if (cpu == 0) {
+      t.threadsPerCore = siblings;
+    }
+    sprintf (path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    v = readNumber (path);
+    if ((v >= 0) && (v < MaxSockets) && !seen[v]) {
+      seen[v] = true;
+      sockets++;
+    }
+  }
+  if (cores > 0) {
+    t.cores = cores;
+  }
+  if (sockets > 0) {
+    t.sockets = sockets;
+  }
+  // The caches of CPU 0 (skipping instruction caches).
+  bool foundCache = false;
+  for (int i = 0; i < 8; i++) {
+    char type[16];
+    sprintf (path, "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+    if (!readFile (path, type, sizeof(type))) {
+      break;
+    }
+    if (strncmp (type, "Instruction", 11) == 0) {
+      continue;
+    }
+    sprintf (path, "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+    const long level = readNumber (path);
+    sprintf (path, "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+    const long size = readNumber (path);
+    if ((level >= 1) && (level <= 3) && (size > 0)) {
+      if (!foundCache) {
+	t.cacheSize[1] = t.cacheSize[2] = t.cacheSize[3] = 0;
+	foundCache = true;
+      }
+      t.cacheSize[level] = (size_t) size;
+    }
+    sprintf (path, "/sys/devices/system/cpu/cpu0/cache/index%d/coherency_line_size", i);
+    if ((level == 1) && ((v = readNumber (path)) > 0)) {
+      t.cacheLineSize = (size_t) v;
+    }
+  }
+#if defined(_SC_LEVEL1_DCACHE_SIZE)
+  if (!foundCache) {
+    // Where sysfs has no caches, the C library may know (from CPUID).
+    if ((v = sysconf (_SC_LEVEL1_DCACHE_SIZE)) > 0)	t.cacheSize[1] = (size_t) v;
+    if ((v = sysconf (_SC_LEVEL2_CACHE_SIZE)) > 0)	t.cacheSize[2] = (size_t) v;
+    if ((v = sysconf (_SC_LEVEL3_CACHE_SIZE)) > 0)	t.cacheSize[3] = (size_t) v;
+    if ((v = sysconf (_SC_LEVEL1_DCACHE_LINESIZE)) > 0)	t.cacheLineSize = (size_t) v;
+  }
+#endif
+
+#elif defined(__APPLE__)
+  int i;
+  int64_t v;
+  size_t len;
+  len = sizeof(i); if (sysctlbyname ("hw.packages", &i, &len, NULL, 0) == 0) t.sockets = i;
+  len = sizeof(i); if (sysctlbyname ("hw.physicalcpu", &i, &len, NULL, 0) == 0) t.cores = i;
+  if (t.cores > 0) {
+    t.threadsPerCore = getNumProcessors() / t.cores;
+  }
+  len = sizeof(v); if (sysctlbyname ("hw.l1dcachesize", &v, &len, NULL, 0) == 0) t.cacheSize[1] = (size_t) v;
+  len = sizeof(v); if (sysctlbyname ("hw.l2cachesize", &v, &len, NULL, 0) == 0) t.cacheSize[2] = (size_t) v;
+  len = sizeof(v); if (sysctlbyname ("hw.l3cachesize", &v, &len, NULL, 0) == 0) t.cacheSize[3] = (size_t) v;
+  len = sizeof(v); if (sysctlbyname ("hw.cachelinesize", &v, &len, NULL, 0) == 0) t.cacheLineSize = (size_t) v;
+  len = sizeof(v); if (sysctlbyname ("hw.pagesize", &v, &len, NULL, 0) == 0) t.pageSize = (size_t) v;
+#endif
+
+  if (t.threadsPerCore < 1) {
+    t.threadsPerCore = 1;
+  }
+  return t;
+}
+
+#if defined(__linux)
+
+bool CPUInfo::readFile (const char * path, char * buf, size_t len)
+{
+  const int fd = open (path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  const ssize_t r = read (fd, buf, len - 1);
+  close (fd);
+  if (r <= 0) {
+    return false;
+  }
+  buf[r] = '\0';
+  return true;
+}
+
+// The number in a sysfs file, with any K, M or G suffix applied, or
+// -1 if it cannot be read.
+long CPUInfo::readNumber (const char * path)
+{
+  char buf[32];
+  if (!readFile (path, buf, sizeof(buf)) || (buf[0] < '0') || (buf[0] > '9')) {
+    return -1;
+  }
+  char * end;
+  long v = strtol (buf, &end, 10);
+  switch (*end) {
+  case 'K': v <<= 10; break;
+  case 'M': v <<= 20; break;
+  case 'G': v <<= 30; break;
+  }
+  return v;
+}
+
+// How many ids a list such as "0-3,8-11" names, setting first to the
+// first of them; or -1 if it cannot be read.
+int CPUInfo::countList (const char * path, int * first)
+{
+  char buf[256];
+  if (!readFile (path, buf, sizeof(buf))) {
+    return -1;
+  }
+  int count = 0;
+  char * p = buf;
+  *first = -1;
+  while ((*p >= '0') && (*p <= '9')) {
+    const long lo = strtol (p, &p, 10);
+    long hi = lo;
+    if (*p == '-') {
+      hi = strtol (p + 1, &p, 10);
+    }
+    if (*first < 0) {
+      *first = (int) lo;
+    }
+    count += (int) (hi - lo + 1);
+    if (*p == ',') {
+      p++;
+    }
+  }
+  return count;
+}
+
+#endif
+
 #if defined(USE_THREAD_KEYWORD)
   extern __thread int localThreadId;
 #endif
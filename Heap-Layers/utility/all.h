@@ -4,16 +4,30 @@
 #include "bins4k.h"
 #include "bins64k.h"
 #include "bins8k.h"
+#include "bitops.h"
 #include "dllist.h"
 #include "dynarray.h"
 #include "freesllist.h"
 #include "hash.h"
+#include "heaptraits.h"
+#include "heapwalk.h"
+#include "lockfreesllist.h"
 #include "gcd.h"
+#include "geometricclasses.h"
 #include "guard.h"
 #include "istrue.h"
 #include "lcm.h"
 #include "myhashmap.h"
+#include "openhashmap.h"
+#include "pagemap.h"
+#include "probes.h"
 #include "sassert.h"
 #include "sllist.h"
+#include "streamingcopy.h"
+#include "statsregistry.h"
+#include "tablesizeclasses.h"
 #include "timer.h"
+#include "traceformat.h"
+#include "tsc.h"
+#include "unmapqueue.h"
 
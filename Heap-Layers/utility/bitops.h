@@ -0,0 +1,94 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_BITOPS_H
+#define HL_BITOPS_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#if defined(_WIN32)
+#include <intrin.h>
+#endif
+
+/**
+ * @file bitops.h
+ * @brief Finding the lowest and highest set bits of a word, for bitmaps
+ * of bins.
+ */
+
+namespace HL {
+
+  class BitOps {
+  public:
+
+    /// The index of the lowest set bit (which there must be).
+    static inline int lowestBit (unsigned long v) {
+      assert (v != 0);
+#if defined(__GNUC__)
+      return __builtin_ctzl (v);
+#elif defined(_WIN32)
+      unsigned long index;
+      _BitScanForward (&index, v);
+      return (int) index;
+#else
+      int i = 0;
+      while ((v & 1) == 0) {
+	v >>= 1;
+	i++;
+      }
+      return i;
+#endif
+    }
+
+    /// The index of the highest set bit (which there must be): floor(log2(v)).
+    static inline int highestBit (size_t v) {
+      assert (v != 0);
+#if defined(__GNUC__)
+      return (int) (sizeof(unsigned long long) * 8) - 1 - __builtin_clzll ((unsigned long long) v);
+#elif defined(_WIN64)
+      unsigned long index;
+      _BitScanReverse64 (&index, v);
+      return (int) index;
+#elif defined(_WIN32)
+      unsigned long index;
+      _BitScanReverse (&index, v);
+      return (int) index;
+#else
+      int i = 0;
+      while (v > 1) {
+	v >>= 1;
+	i++;
+      }
+      return i;
+#endif
+    }
+
+  };
+
+}
+
+#endif
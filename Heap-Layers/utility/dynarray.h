@@ -28,12 +28,22 @@
 #define HL_DYNARRAY_H
 
 #include <assert.h>
-#include <cstdlib>
+#include <stddef.h>
+
+#include "wrappers/mmapwrapper.h"
 
 /**
  * @class DynamicArray
  * @brief A dynamic array that grows to fit any index for assignment.
  *
+ * The elements live in segments mapped straight from MmapWrapper,
+ * each twice the size of the one before, so growing maps one more
+ * segment and never copies or moves an element: indexing is O(1),
+ * with no pause however big the array gets, and references stay
+ * good. New elements are zero (as the segments are fresh mappings);
+ * no constructors or destructors run, so ObjType should be plain old
+ * data, such as the pointers these arrays usually hold.
+ *
  * This array also features a clear() method,
  * to free the entire array, and a trim(n) method,
  * which tells the array it is no bigger than n elements.
@@ -45,8 +55,8 @@ namespace HL {
     class DynamicArray {
   public:
     DynamicArray (void)
-      : internalArray (NULL),
-      internalArrayLength (0)
+      : internalArrayLength (0),
+	numSegments (0)
 	{}
 
     ~DynamicArray (void)
@@ -56,46 +66,29 @@ namespace HL {
 
     /// Clear deletes everything in the array.
     inline void clear (void) {
-      if (internalArray != NULL) {
-	delete internalArray;
-	internalArray = NULL;
-	internalArrayLength = 0;
-	//printf ("\ninternalArrayLength %x = %d\n", this, internalArrayLength);
-      }
+      releaseSegments (0);
     }
 
     /// Read-only access to an array element; asserts that index is in range.
     inline const ObjType& operator[] (int index) const {
       assert (index < internalArrayLength);
       assert (index >= 0);
-      return internalArray[index];
+      int offset;
+      const int s = segmentOf (index, offset);
+      return segments[s][offset];
     }
 
     /// Access an array index by reference, growing the array if necessary.
     inline ObjType& operator[] (int index) {
       assert (index >= 0);
-      if (index >= internalArrayLength) {
-
-	// This index is beyond the current size of the array.
-	// Grow the array by doubling and copying the old array into the new.
-
-	const int newSize = index * 2 + 1;
-	ObjType * arr = new ObjType[newSize];
-#if MALLOC_TRACE
-	printf ("m %x %d\n", arr, newSize * sizeof(ObjType));
-#endif
-	if (internalArray != NULL) {
-	  memcpy (arr, internalArray, internalArrayLength * sizeof(ObjType));
-	  delete internalArray;
-#if MALLOC_TRACE
-	  printf ("f %x\n", internalArray);
-#endif
-	}
-	internalArray = arr;
-	internalArrayLength = newSize;
-	//printf ("\ninternalArrayLength %x = %d\n", this, internalArrayLength);
+      int offset;
+      const int s = segmentOf (index, offset);
+      if (s >= numSegments) {
+	// This index is beyond the current size of the array: map
+	// the segments up to the one it falls in.
+	grow (s);
       }
-      return internalArray[index];
+      return segments[s][offset];
     }
 
     /**
@@ -104,37 +97,79 @@ namespace HL {
      * shrinking of the array.
      */
     inline void trim (int nelts) {
+      // Keep one segment beyond the one holding the last element, so
+      // a stack that moves back and forth across a boundary does not
+      // map and unmap each time.
+      if (nelts <= 0) {
+	releaseSegments (1);
+	return;
+      }
+      int offset;
+      const int s = segmentOf (nelts - 1, offset);
+      if (s + 2 < numSegments) {
+	releaseSegments (s + 2);
+      }
+      assert (nelts <= internalArrayLength);
+    }
 
-      // Halve the array if the number of elements
-      // drops below one-fourth of the array size.
 
-      if (internalArray != NULL) {
-	if (nelts * 4 < internalArrayLength) {
-	  const int newSize = nelts * 2;
-	  ObjType * arr = new ObjType[newSize];
-#if MALLOC_TRACE
-	  printf ("m %x %d\n", arr, newSize * sizeof(ObjType));
-#endif
-	  memcpy (arr, internalArray, sizeof(ObjType) * nelts);
-	  delete internalArray;
-#if MALLOC_TRACE
-	  printf ("f %x\n", internalArray);
-#endif
-	  internalArray = arr;
-	  internalArrayLength = newSize;
-	}
-	assert (nelts <= internalArrayLength);
+  private:
+
+    /// Elements in the first segment: at least a page's worth.
+    enum { FirstSegmentBytes = 4096 };
+    enum { FirstSegmentLength =
+	   (sizeof(ObjType) >= FirstSegmentBytes) ? 1 :
+	   ((FirstSegmentBytes / sizeof(ObjType)) >= 512) ? 512 :
+	   ((FirstSegmentBytes / sizeof(ObjType)) >= 64) ? 64 :
+	   ((FirstSegmentBytes / sizeof(ObjType)) >= 8) ? 8 : 1 };
+
+    /// Enough segments to hold any non-negative int index.
+    enum { MaxSegments = 32 };
+
+    /// Segment s holds FirstSegmentLength * 2^s elements, starting at
+    /// index FirstSegmentLength * (2^s - 1).
+    static inline int segmentOf (int index, int& offset) {
+      const unsigned int q = (unsigned int) index / FirstSegmentLength + 1;
+      int s = 0;
+      while ((q >> (s + 1)) != 0) {
+	s++;
       }
+      offset = index - (int) (FirstSegmentLength * ((1U << s) - 1));
+      return s;
     }
 
+    static inline size_t segmentBytes (int s) {
+      return (size_t) FirstSegmentLength * ((size_t) 1 << s) * sizeof(ObjType);
+    }
 
-  private:
+    void grow (int s) {
+      assert (s < MaxSegments);
+      while (numSegments <= s) {
+	void * buf = MmapWrapper::map (segmentBytes (numSegments));
+	assert (buf != NULL);
+	segments[numSegments] = (ObjType *) buf;
+	numSegments++;
+	internalArrayLength = (int) (FirstSegmentLength * ((1U << numSegments) - 1));
+      }
+    }
 
-    /// The pointer to the current array.
-    ObjType * internalArray;
+    /// Unmap every segment from the given one on.
+    void releaseSegments (int keep) {
+      while (numSegments > keep) {
+	numSegments--;
+	MmapWrapper::unmap (segments[numSegments], segmentBytes (numSegments));
+      }
+      internalArrayLength = (int) (FirstSegmentLength * ((1U << numSegments) - 1));
+    }
 
-    /// The length of the internal array, in elements.
+    /// The segments mapped so far.
+    ObjType * segments[MaxSegments];
+
+    /// The length of the array, in elements.
     int internalArrayLength;
+
+    /// How many segments are mapped.
+    int numSegments;
   };
 
 }
@@ -42,12 +42,23 @@ public:
     return const_cast<Entry *>(e);
   }
   
+  /// The first entry, for walking the list without taking from it.
+  inline const Entry * peek (void) const {
+    return head.next;
+  }
+
   inline void insert (void * e) {
     Entry * entry = reinterpret_cast<Entry *>(e);
     entry->next = head.next;
     head.next = entry;
   }
 
+  /// Insert a chain of entries, already linked from first to last.
+  inline void insertList (void * first, void * last) {
+    reinterpret_cast<Entry *>(last)->next = head.next;
+    head.next = reinterpret_cast<Entry *>(first);
+  }
+
   class Entry {
   public:
     Entry (void)
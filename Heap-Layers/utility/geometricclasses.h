@@ -0,0 +1,176 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_GEOMETRICCLASSES_H
+#define HL_GEOMETRICCLASSES_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "utility/sassert.h"
+
+#if __cplusplus >= 201402L
+#define HL_GEOMETRICCLASSES_CONSTEXPR constexpr
+#else
+#define HL_GEOMETRICCLASSES_CONSTEXPR inline
+#endif
+
+/**
+ * @class GeometricSizeClasses
+ * @brief Size classes spaced by a fixed fraction, for SegHeap and StrictSegHeap.
+ *
+ * Classes are Granularity apart up to Granularity * Steps bytes, and
+ * from there on each power of two is cut into Steps equal classes,
+ * so no object wastes more than 1/Steps of its size to rounding
+ * (12.5% for the default of 8, against up to 50% for powers of two).
+ * Beyond Granularity * Steps, the class is computed from the position
+ * of the highest bit, with no branches or loops; below it (and, in
+ * C++14, up to TableMax bytes) a table built at compile time is used.
+ * The functions are static, so they can be SegHeap's template
+ * arguments and inline there:
+ *
+ * <TT>
+ * typedef GeometricSizeClasses<> SC;<BR>
+ * SegHeap<SC::NumBins, SC::getSizeClass, SC::getClassMaxSize, ...>
+ * </TT>
+ *
+ * @param Granularity The smallest class, and the step between small ones (a power of two).
+ * @param Steps The classes per power of two (a power of two).
+ * @param MaxSize The largest class (a power of two).
+ */
+
+namespace HL {
+
+  template <int N>
+  class StaticLog2 {
+  public:
+    enum { VALUE = StaticLog2<N / 2>::VALUE + 1 };
+  };
+
+  template <>
+  class StaticLog2<1> {
+  public:
+    enum { VALUE = 0 };
+  };
+
+  template <size_t Granularity = 16,
+	    int Steps = 8,
+	    size_t MaxSize = 1048576>
+  class GeometricSizeClasses {
+  public:
+
+    enum { GranularityBits = StaticLog2<Granularity>::VALUE };
+    enum { StepBits = StaticLog2<Steps>::VALUE };
+
+    /// The end of the evenly spaced classes.
+    enum { LinearMax = Granularity * Steps };
+    enum { LinearMaxBits = GranularityBits + StepBits };
+
+    enum { NumBins = Steps + (StaticLog2<MaxSize>::VALUE - LinearMaxBits) * Steps };
+
+    enum { TableMax = 1024 };
+
+    static inline int getSizeClass (const size_t sz) {
+      verifyParameters();
+#if __cplusplus >= 201402L
+      if (sz <= (size_t) TableMax) {
+	return table.classOf[(sz + Granularity - 1) >> GranularityBits];
+      }
+#endif
+      return computeSizeClass (sz);
+    }
+
+    static inline size_t getClassMaxSize (const int c) {
+      assert (c >= 0);
+      assert (c < NumBins);
+      if (c < Steps) {
+	return (size_t) (c + 1) << GranularityBits;
+      }
+      const int j = c - Steps;
+      const int log2 = LinearMaxBits + (j >> StepBits);
+      const int within = j & (Steps - 1);
+      return ((size_t) 1 << log2) + ((size_t) (within + 1) << (log2 - StepBits));
+    }
+
+  private:
+
+    /// The formula, for any size up to MaxSize.
+    static HL_GEOMETRICCLASSES_CONSTEXPR int computeSizeClass (const size_t sz) {
+      return (sz <= (size_t) LinearMax)
+	? ((sz == 0) ? 0 : (int) ((sz - 1) >> GranularityBits))
+	: Steps
+	+ ((highestBit (sz - 1) - LinearMaxBits) << StepBits)
+	+ (int) (((sz - 1) >> (highestBit (sz - 1) - StepBits)) & (Steps - 1));
+    }
+
+    /// floor(log2(v)), as in BitOps, but usable at compile time.
+    static HL_GEOMETRICCLASSES_CONSTEXPR int highestBit (const size_t v) {
+#if defined(__GNUC__)
+      return (int) (sizeof(unsigned long long) * 8) - 1 - __builtin_clzll ((unsigned long long) v);
+#else
+      int i = 0;
+      for (size_t x = v; x > 1; x >>= 1) {
+	i++;
+      }
+      return i;
+#endif
+    }
+
+    static inline void verifyParameters (void) {
+      sassert<((Granularity & (Granularity - 1)) == 0)
+	&& ((Steps & (Steps - 1)) == 0)
+	&& ((MaxSize & (MaxSize - 1)) == 0)
+	&& (MaxSize > (size_t) LinearMax)> verify;
+      verify = verify;
+    }
+
+#if __cplusplus >= 201402L
+    /// The class of each multiple of Granularity up to TableMax.
+    struct Table {
+      constexpr Table (void)
+	: classOf ()
+      {
+	for (size_t i = 0; i <= (size_t) TableMax / Granularity; i++) {
+	  classOf[i] = (unsigned char) computeSizeClass (i * Granularity);
+	}
+      }
+      unsigned char classOf[TableMax / Granularity + 1];
+    };
+
+    static constexpr Table table = Table();
+#endif
+
+  };
+
+#if __cplusplus >= 201402L
+  template <size_t Granularity, int Steps, size_t MaxSize>
+  constexpr typename GeometricSizeClasses<Granularity, Steps, MaxSize>::Table
+  GeometricSizeClasses<Granularity, Steps, MaxSize>::table;
+#endif
+
+}
+
+#endif
@@ -0,0 +1,106 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_HEAPTRAITS_H
+#define HL_HEAPTRAITS_H
+
+/**
+ * @file heaptraits.h
+ * @brief Compile-time tests for the optional parts of the heap protocol
+ * (C++11 and up, but for HasMemalign's value), for adapters that use
+ * them when a heap has them.
+ */
+
+#if __cplusplus >= 201103L
+
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+
+namespace HL {
+
+  /// Whether Heap has a sized free, free (ptr, sz) (as MmapHeap does).
+  template <class Heap>
+  class HasSizedFree {
+    template <class H>
+    static auto test (int) -> decltype (std::declval<H&>().free ((void *) 0, (size_t) 0), std::true_type());
+    template <class H>
+    static std::false_type test (...);
+  public:
+    typedef decltype (test<Heap>(0)) type;
+    enum { value = type::value };
+  };
+
+  /// Whether Heap has memalign (alignment, sz) (as MmapHeap and SegHeap do).
+  template <class Heap>
+  class HasMemalign {
+    template <class H>
+    static auto test (int) -> decltype (std::declval<H&>().memalign ((size_t) 0, (size_t) 0), std::true_type());
+    template <class H>
+    static std::false_type test (...);
+  public:
+    typedef decltype (test<Heap>(0)) type;
+    enum { value = type::value };
+  };
+
+  /// Heap::Alignment, or sizeof(double) for heaps that do not say.
+  template <class Heap>
+  class HeapAlignment {
+    template <class H>
+    static std::integral_constant<size_t, (size_t) H::Alignment> test (int);
+    template <class H>
+    static std::integral_constant<size_t, sizeof(double)> test (...);
+  public:
+    enum { value = decltype (test<Heap>(0))::value };
+  };
+
+}
+
+#else
+
+namespace HL {
+
+  /// Whether Heap has a member named memalign: if it does, naming it
+  /// in a class that also inherits Fallback's is ambiguous, and the
+  /// first test drops out.
+  template <class Heap>
+  class HasMemalign {
+    struct Fallback { int memalign; };
+    struct Derived : Heap, Fallback { };
+    template <class U, U> struct Check;
+    template <class U>
+    static char (&test (Check<int Fallback::*, &U::memalign> *))[1];
+    template <class U>
+    static char (&test (...))[2];
+  public:
+    enum { value = (sizeof(test<Derived>(0)) == 2) };
+  };
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_HEAPWALK_H
+#define HL_HEAPWALK_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * @file heapwalk.h
+ * @brief The walk protocol: where a heap's memory sits, layer by layer.
+ *
+ * A layer that holds memory it is not using -- objects on a free list,
+ * the rest of an arena -- implements
+ *
+ * <TT>
+ *   void walk (HeapWalker& w);
+ * </TT>
+ *
+ * which reports its own HeapUsage and then walks the heaps under it
+ * (its superheap, or the subheaps it holds, between enter and leave).
+ * Layers that hold nothing inherit walk from their superheap, and the
+ * source heaps (MallocHeap, MmapHeap, SbrkHeap, StaticHeap) end the
+ * walk. Walking takes no locks but LockedHeap's and touches every free
+ * object, so it is for inspection, not for the fast path.
+ *
+ * printHeapUsage walks a heap and prints each layer's share.
+ */
+
+namespace HL {
+
+  /// What one layer holds.
+  struct HeapUsage {
+    HeapUsage (void)
+      : heldBytes (0),
+	freeBytes (0),
+	freeObjects (0),
+	wastedBytes (0)
+    {}
+
+    /// Memory this layer got from below and has not given back.
+    size_t heldBytes;
+
+    /// Of that, memory free for reuse (external fragmentation, from
+    /// the point of view of the program).
+    size_t freeBytes;
+    size_t freeObjects;
+
+    /// Of that, memory neither in use nor reusable, such as the tails
+    /// of retired arenas (internal fragmentation).
+    size_t wastedBytes;
+  };
+
+
+  class HeapWalker {
+  public:
+    virtual ~HeapWalker (void) {}
+
+    /// A layer's own numbers.
+    virtual void visit (const char * layer, const HeapUsage& u) = 0;
+
+    /// Around the subheaps of a layer that holds several (index is
+    /// the subheap's number, or -1 for a single one).
+    virtual void enter (const char *, int) {}
+    virtual void leave (void) {}
+  };
+
+
+  /// Prints every layer that holds memory, indented under the heaps
+  /// that contain it, and the totals.
+  class HeapUsagePrinter : public HeapWalker {
+  public:
+
+    explicit HeapUsagePrinter (FILE * out)
+      : _out (out),
+	_depth (0),
+	_printed (0)
+    {}
+
+    void visit (const char * layer, const HeapUsage& u) {
+      _total.heldBytes += u.heldBytes;
+      _total.freeBytes += u.freeBytes;
+      _total.freeObjects += u.freeObjects;
+      _total.wastedBytes += u.wastedBytes;
+      if (u.heldBytes > 0) {
+	line (layer, u);
+      }
+    }
+
+    void enter (const char * name, int index) {
+      if (_depth < MaxDepth) {
+	_names[_depth] = name;
+	_indices[_depth] = index;
+      }
+      _depth++;
+    }
+
+    void leave (void) {
+      _depth--;
+      if (_printed > _depth) {
+	_printed = _depth;
+      }
+    }
+
+    void printTotals (void) {
+      line ("total", _total);
+    }
+
+  private:
+
+    enum { MaxDepth = 32 };
+
+    void line (const char * layer, const HeapUsage& u) {
+      // The headers of the enclosing heaps, the first time something
+      // inside them is printed.
+      for (; (_printed >= 0) && (_printed < _depth) && (_printed < MaxDepth); _printed++) {
+	if (_indices[_printed] >= 0) {
+	  fprintf (_out, "%*s%s %d:\n", 2 * _printed, "", _names[_printed], _indices[_printed]);
+	} else {
+	  fprintf (_out, "%*s%s:\n", 2 * _printed, "", _names[_printed]);
+	}
+      }
+      const double held = (u.heldBytes > 0) ? (double) u.heldBytes : 1.0;
+      fprintf (_out,
+	       "%*s%-16s held %10lu  free %10lu (%5.1f%%, %lu objects)  wasted %10lu (%5.1f%%)\n",
+	       2 * _depth, "", layer,
+	       (unsigned long) u.heldBytes,
+	       (unsigned long) u.freeBytes, 100.0 * (double) u.freeBytes / held,
+	       (unsigned long) u.freeObjects,
+	       (unsigned long) u.wastedBytes, 100.0 * (double) u.wastedBytes / held);
+    }
+
+    FILE * _out;
+    int _depth;
+    int _printed;		// how many of the enclosing headers are out
+    const char * _names[MaxDepth];
+    int _indices[MaxDepth];
+    HeapUsage _total;
+  };
+
+
+  /// Walk heap and print where its memory is.
+  template <class Heap>
+  void printHeapUsage (Heap& heap, FILE * out = stderr) {
+    HeapUsagePrinter p (out);
+    heap.walk (p);
+    p.printTotals();
+  }
+
+}
+
+#endif
@@ -0,0 +1,220 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_LOCKFREESLLIST_H
+#define HL_LOCKFREESLLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HL_LOCKFREESLLIST_CMPXCHG16B 1
+#elif defined(__GNUC__) && (__SIZEOF_POINTER__ == 4) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+#define HL_LOCKFREESLLIST_CAS64 1
+#else
+#include "locks/spinlock.h"
+#include "utility/freesllist.h"
+#include "utility/guard.h"
+#endif
+
+/**
+ * @class LockFreeSLList
+ * @brief A "memory neutral" singly-linked list that threads can share
+ * without a lock.
+ *
+ * Like FreeSLList, it threads its links through the objects on it.
+ * The head is a pointer and a version tag that every update bumps,
+ * changed together with a double-width compare-and-swap (cmpxchg16b
+ * on x86-64, a 64-bit CAS on 32-bit hosts), so a get that races with
+ * a get and an insert of the same object cannot be fooled (the ABA
+ * problem). On other hosts it falls back to a spin lock.
+ *
+ * A get may read the link of an object that another thread has just
+ * taken, so the objects must stay mapped while the list is in use,
+ * as they do under a free list heap.
+ */
+
+namespace HL {
+
+  class LockFreeSLList {
+  public:
+
+    class Entry {
+    public:
+      Entry * next;
+    };
+
+    LockFreeSLList (void)
+    {
+      clear();
+    }
+
+    inline void clear (void) {
+#if defined(HL_LOCKFREESLLIST_CMPXCHG16B) || defined(HL_LOCKFREESLLIST_CAS64)
+      Head * h = head();
+      h->ptr = NULL;
+      h->tag = 0;
+#else
+      _list.clear();
+#endif
+    }
+
+    /// Take the first entry, or NULL if the list is empty.
+    inline Entry * get (void) {
+#if defined(HL_LOCKFREESLLIST_CMPXCHG16B) || defined(HL_LOCKFREESLLIST_CAS64)
+      volatile Head * h = head();
+      Head old;
+      old.tag = h->tag;
+      old.ptr = h->ptr;
+      while (true) {
+	if (old.ptr == NULL) {
+	  return NULL;
+	}
+	// A stale read of next fails the CAS below, since the tag moved.
+	Head now;
+	now.ptr = old.ptr->next;
+	now.tag = old.tag + 1;
+	if (compareAndSwap (h, old, now)) {
+	  return old.ptr;
+	}
+      }
+#else
+      Guard<SpinLockType> l (_lock);
+      return (Entry *) _list.get();
+#endif
+    }
+
+    inline void insert (void * e) {
+#if defined(HL_LOCKFREESLLIST_CMPXCHG16B) || defined(HL_LOCKFREESLLIST_CAS64)
+      Entry * entry = reinterpret_cast<Entry *>(e);
+      volatile Head * h = head();
+      Head old;
+      old.tag = h->tag;
+      old.ptr = h->ptr;
+      while (true) {
+	entry->next = old.ptr;
+	Head now;
+	now.ptr = entry;
+	now.tag = old.tag + 1;
+	if (compareAndSwap (h, old, now)) {
+	  return;
+	}
+      }
+#else
+      Guard<SpinLockType> l (_lock);
+      _list.insert (e);
+#endif
+    }
+
+    /// Insert a chain of entries, already linked from first to last,
+    /// with one compare-and-swap.
+    inline void insertList (void * first, void * last) {
+#if defined(HL_LOCKFREESLLIST_CMPXCHG16B) || defined(HL_LOCKFREESLLIST_CAS64)
+      Entry * tail = reinterpret_cast<Entry *>(last);
+      volatile Head * h = head();
+      Head old;
+      old.tag = h->tag;
+      old.ptr = h->ptr;
+      while (true) {
+	tail->next = old.ptr;
+	Head now;
+	now.ptr = reinterpret_cast<Entry *>(first);
+	now.tag = old.tag + 1;
+	if (compareAndSwap (h, old, now)) {
+	  return;
+	}
+      }
+#else
+      Guard<SpinLockType> l (_lock);
+      _list.insertList (first, last);
+#endif
+    }
+
+    /// The first entry, for walking a list nobody else is changing.
+    inline const Entry * peek (void) {
+#if defined(HL_LOCKFREESLLIST_CMPXCHG16B) || defined(HL_LOCKFREESLLIST_CAS64)
+      return head()->ptr;
+#else
+      return (const Entry *) _list.peek();
+#endif
+    }
+
+  private:
+
+    LockFreeSLList (const LockFreeSLList&);
+    LockFreeSLList& operator=(const LockFreeSLList&);
+
+#if defined(HL_LOCKFREESLLIST_CMPXCHG16B) || defined(HL_LOCKFREESLLIST_CAS64)
+
+    struct Head {
+      Entry * ptr;
+      uintptr_t tag;
+    };
+
+    /// Atomically: if (*h == old) { *h = now; return true; }
+    /// else { old = *h; return false; }
+    static inline bool compareAndSwap (volatile Head * h, Head& old, const Head& now) {
+#if defined(HL_LOCKFREESLLIST_CMPXCHG16B)
+      bool ok;
+      __asm__ __volatile__ ("lock; cmpxchg16b %1\n\tsetz %0"
+			    : "=q" (ok), "+m" (*h), "+a" (old.ptr), "+d" (old.tag)
+			    : "b" (now.ptr), "c" (now.tag)
+			    : "cc", "memory");
+      return ok;
+#else
+      unsigned long long o = ((unsigned long long) old.tag << 32) | (uintptr_t) old.ptr;
+      unsigned long long n = ((unsigned long long) now.tag << 32) | (uintptr_t) now.ptr;
+      unsigned long long seen =
+	__sync_val_compare_and_swap ((volatile unsigned long long *) h, o, n);
+      if (seen == o) {
+	return true;
+      }
+      old.ptr = (Entry *) (uintptr_t) seen;
+      old.tag = (uintptr_t) (seen >> 32);
+      return false;
+#endif
+    }
+
+    /// The head, at an address aligned for the double-width CAS
+    /// (which the list itself, say inside a malloc'ed heap, may not be).
+    inline Head * head (void) {
+      return (Head *) (((uintptr_t) _space + sizeof(Head) - 1) & ~(uintptr_t) (sizeof(Head) - 1));
+    }
+
+    char _space[2 * sizeof(Head)];
+
+#else
+
+    SpinLockType _lock;
+    FreeSLList _list;
+
+#endif
+
+  };
+
+}
+
+#endif
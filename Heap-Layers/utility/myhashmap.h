@@ -29,7 +29,22 @@
 
 
 #include <assert.h>
+#include <new>
 #include "hash.h"
+#include "dynarray.h"
+
+/**
+ * @class MyHashMap
+ * @brief A chained hash map that grows a bin at a time.
+ *
+ * The map grows by linear hashing: whenever the average chain would
+ * pass MaxLoad, the single bin at the split pointer is divided in two
+ * with the next bin appended, so there is never a full rehash and no
+ * insertion pays for more than one chain. The bins are a DynamicArray,
+ * which maps more room without moving the bins it has. Keys are mixed
+ * before use, since pointers (whose low bits are all zero) would
+ * otherwise crowd a few bins.
+ */
 
 namespace HL {
 
@@ -41,17 +56,18 @@ namespace HL {
   public:
 
     MyHashMap (unsigned int size = INITIAL_NUM_BINS)
-      : _numBins (size)
+      : _numBins (size ? size : 1),
+	_level (0),
+	_split (0),
+	_count (0)
     {
-      void * buf = _allocator.malloc (sizeof(ListNodePtr) * _numBins); 
-      _bins = new (buf) ListNodePtr[_numBins];
-      for (unsigned int i = 0 ; i < _numBins; i++) {
+      for (unsigned long i = 0 ; i < _numBins; i++) {
 	_bins[i] = NULL;
       }
     }
 
     void set (Key k, Value v) {
-      unsigned int binIndex = (unsigned int) (Hash<Key>::hash(k) % _numBins);
+      unsigned long binIndex = binOf (k);
       ListNode * l = _bins[binIndex];
       while (l != NULL) {
 	if (l->key == k) {
@@ -65,7 +81,7 @@ namespace HL {
     }
 
     Value get (Key k) {
-      unsigned int binIndex = (unsigned int) Hash<Key>::hash(k) % _numBins;
+      unsigned long binIndex = binOf (k);
       ListNode * l = _bins[binIndex];
       while (l != NULL) {
 	if (l->key == k) {
@@ -78,7 +94,7 @@ namespace HL {
     }
 
     void erase (Key k) {
-      unsigned int binIndex = (unsigned int) Hash<Key>::hash(k) % _numBins;
+      unsigned long binIndex = binOf (k);
       ListNode * curr = _bins[binIndex];
       ListNode * prev = NULL;
       while (curr != NULL) {
@@ -93,6 +109,7 @@ namespace HL {
 	    _allocator.free (_bins[binIndex]);
 	    _bins[binIndex] = n;
 	  }
+	  _count--;
 	  return;
 	}
 	prev = curr;
@@ -104,7 +121,7 @@ namespace HL {
   private:
 
     void insert (Key k, Value v) {
-      unsigned int binIndex = (unsigned int) Hash<Key>::hash(k) % _numBins;
+      unsigned long binIndex = binOf (k);
       void * ptr = _allocator.malloc (sizeof(ListNode));
       if (ptr) {
 	ListNode * l = new (ptr) ListNode;
@@ -112,11 +129,18 @@ namespace HL {
 	l->value = v;
 	l->next = _bins[binIndex];
 	_bins[binIndex] = l;
+	_count++;
+	if (_count > MaxLoad * (roundBins() + _split)) {
+	  splitOne();
+	}
       }
     }
 
     enum { INITIAL_NUM_BINS = 511 };
 
+    /// The most entries per bin, on average, before a bin is split.
+    enum { MaxLoad = 2 };
+
     class ListNode {
     public:
       ListNode (void)
@@ -127,10 +151,77 @@ namespace HL {
       ListNode * next;
     };
 
-    unsigned long 	_numBins;
+    /// Spreads the bits of a key's hash (Fibonacci hashing).
+    static inline size_t mix (Key k) {
+      size_t h = Hash<Key>::hash (k);
+#if defined(__LP64__) || defined(_LP64) || defined(_WIN64)
+      h *= (size_t) 0x9E3779B97F4A7C15ULL;
+      return h ^ (h >> 32);
+#else
+      h *= (size_t) 0x9E3779B9UL;
+      return h ^ (h >> 16);
+#endif
+    }
+
+    /// The number of bins at the start of this round of splits.
+    inline unsigned long roundBins (void) const {
+      return _numBins << _level;
+    }
+
+    inline unsigned long binOf (Key k) const {
+      const size_t h = mix (k);
+      unsigned long b = (unsigned long) (h % roundBins());
+      if (b < _split) {
+	// This bin has been split already this round.
+	b = (unsigned long) (h % (roundBins() << 1));
+      }
+      return b;
+    }
+
+    /// Splits the bin at the split pointer, moving the entries that
+    /// now hash to the new bin at the end.
+    void splitOne (void) {
+      const unsigned long from = _split;
+      const unsigned long to = _split + roundBins();
+      if (to >= (unsigned long) MaxBins) {
+	// No more room: just let the chains get longer.
+	return;
+      }
+      _bins[to] = NULL;
+      ListNode * l = _bins[from];
+      _bins[from] = NULL;
+      while (l != NULL) {
+	ListNode * next = l->next;
+	const unsigned long b = (unsigned long) (mix (l->key) % (roundBins() << 1));
+	assert ((b == from) || (b == to));
+	l->next = _bins[b];
+	_bins[b] = l;
+	l = next;
+      }
+      _split++;
+      if (_split == roundBins()) {
+	_level++;
+	_split = 0;
+      }
+    }
+
+    /// The most bins a DynamicArray (indexed by int) can hold.
+    enum { MaxBins = 1 << 30 };
+
+    /// The number of bins to begin with.
+    const unsigned long _numBins;
+
+    /// How many times the bins have doubled.
+    unsigned int _level;
+
+    /// The next bin to split.
+    unsigned long _split;
+
+    /// The number of entries.
+    unsigned long _count;
 
     typedef ListNode * 	ListNodePtr;
-    ListNodePtr * 	_bins;
+    DynamicArray<ListNodePtr> _bins;
     Allocator 		_allocator;
   };
 
@@ -0,0 +1,269 @@
+// -*- C++ -*-
+
+#ifndef HL_OPENHASHMAP_H
+#define HL_OPENHASHMAP_H
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "hash.h"
+#include "guard.h"
+#include "wrappers/mmapwrapper.h"
+
+namespace HL {
+
+  /**
+   * @class OpenHashMap
+   * @brief A resizable hash map using open addressing (linear probing).
+   *
+   * The table doubles whenever it becomes more than half full, and
+   * erase uses backward-shift deletion, so there are no tombstones
+   * and lookups stay short. Storage comes straight from MmapWrapper.
+   *
+   * NB: the key 0 is reserved to mark empty slots, and get returns
+   * 0 for missing keys (as with MyHashMap).
+   */
+
+  template <typename Key,
+	    typename Value>
+  class OpenHashMap {
+  public:
+
+    OpenHashMap (void)
+      : _entries (NULL),
+	_mask (0),
+	_count (0)
+    {}
+
+    ~OpenHashMap (void) {
+      if (_entries) {
+	MmapWrapper::unmap (_entries, (_mask + 1) * sizeof(Entry));
+      }
+    }
+
+    /// Returns false (leaving the map as it was) if k is new and
+    /// there was no memory to grow the table for it.
+    bool set (Key k, Value v) {
+      assert (k != 0);
+      size_t i = 0;
+      if (_entries != NULL) {
+	i = home (k);
+	while (_entries[i].key != 0) {
+	  if (_entries[i].key == k) {
+	    _entries[i].value = v;
+	    return true;
+	  }
+	  i = (i + 1) & _mask;
+	}
+      }
+      if (2 * (_count + 1) > _mask + 1) {
+	if (grow()) {
+	  i = home (k);
+	  while (_entries[i].key != 0) {
+	    i = (i + 1) & _mask;
+	  }
+	} else if ((_entries == NULL) || (_count + 1 > _mask)) {
+	  // Keep a slot empty, or probes for missing keys never end.
+	  return false;
+	}
+      }
+      _entries[i].key = k;
+      _entries[i].value = v;
+      _count++;
+      return true;
+    }
+
+    Value get (Key k) const {
+      if (_entries == NULL) {
+	return 0;
+      }
+      size_t i = home (k);
+      while (_entries[i].key != 0) {
+	if (_entries[i].key == k) {
+	  return _entries[i].value;
+	}
+	i = (i + 1) & _mask;
+      }
+      // Didn't find it.
+      return 0;
+    }
+
+    /// Remove the key, returning its value (or 0 if it was absent).
+    Value erase (Key k) {
+      if (_entries == NULL) {
+	return 0;
+      }
+      size_t i = home (k);
+      while (_entries[i].key != k) {
+	if (_entries[i].key == 0) {
+	  // Didn't find it.
+	  return 0;
+	}
+	i = (i + 1) & _mask;
+      }
+      Value v = _entries[i].value;
+      // Shift back any later entries in this run that would no
+      // longer be reachable from their home slot.
+      size_t j = i;
+      while (true) {
+	j = (j + 1) & _mask;
+	if (_entries[j].key == 0) {
+	  break;
+	}
+	size_t h = home (_entries[j].key);
+	bool reachable = (i <= j) ? ((i < h) && (h <= j)) : ((i < h) || (h <= j));
+	if (!reachable) {
+	  _entries[i] = _entries[j];
+	  i = j;
+	}
+      }
+      _entries[i].key = 0;
+      _count--;
+      return v;
+    }
+
+    size_t size (void) const {
+      return _count;
+    }
+
+  private:
+
+    OpenHashMap (const OpenHashMap&);
+    OpenHashMap& operator=(const OpenHashMap&);
+
+    enum { INITIAL_NUM_ENTRIES = 256 };
+
+    class Entry {
+    public:
+      Key key;
+      Value value;
+    };
+
+    inline size_t home (Key k) const {
+      return mix (Hash<Key>::hash (k)) & _mask;
+    }
+
+    /// Scramble the hash, since pointers (in particular) have
+    /// too many zero low-order bits to index the table directly.
+    static inline size_t mix (size_t h) {
+      h ^= h >> 16;
+      h *= 0x45d9f3b;
+      h ^= h >> 16;
+      return h;
+    }
+
+    /// Double the table (or make the first one). Returns false,
+    /// leaving the table as it was, if it can't be mapped.
+    bool grow (void) {
+      size_t oldSize = _mask + 1;
+      Entry * oldEntries = _entries;
+      size_t newSize = (oldEntries == NULL) ? (size_t) INITIAL_NUM_ENTRIES : 2 * oldSize;
+      // Mapped memory arrives zeroed, so every slot starts out empty.
+      Entry * newEntries = (Entry *) MmapWrapper::map (newSize * sizeof(Entry));
+      if (newEntries == NULL) {
+	return false;
+      }
+      _entries = newEntries;
+      _mask = newSize - 1;
+      if (oldEntries) {
+	for (size_t i = 0; i < oldSize; i++) {
+	  if (oldEntries[i].key != 0) {
+	    size_t j = home (oldEntries[i].key);
+	    while (_entries[j].key != 0) {
+	      j = (j + 1) & _mask;
+	    }
+	    _entries[j] = oldEntries[i];
+	  }
+	}
+	MmapWrapper::unmap (oldEntries, oldSize * sizeof(Entry));
+      }
+      return true;
+    }
+
+    Entry * _entries;
+    size_t  _mask;
+    size_t  _count;
+  };
+
+
+  /**
+   * @class StripedHashMap
+   * @brief A thread-safe OpenHashMap split into independently locked stripes.
+   *
+   * Keys are spread across NumStripes sub-maps, each with its own
+   * lock and its own resizing, so operations on different stripes
+   * (including lookups) proceed in parallel.
+   */
+
+  template <typename Key,
+	    typename Value,
+	    class LockType,
+	    int NumStripes = 64>
+  class StripedHashMap {
+  public:
+
+    /// As OpenHashMap::set, false if there was no memory for k.
+    bool set (Key k, Value v) {
+      Stripe& s = getStripe (k);
+      Guard<LockType> l (s.lock);
+      return s.map.set (k, v);
+    }
+
+    Value get (Key k) {
+      Stripe& s = getStripe (k);
+      Guard<LockType> l (s.lock);
+      return s.map.get (k);
+    }
+
+    Value erase (Key k) {
+      Stripe& s = getStripe (k);
+      Guard<LockType> l (s.lock);
+      return s.map.erase (k);
+    }
+
+  private:
+
+    class Stripe {
+    public:
+      LockType lock;
+      OpenHashMap<Key, Value> map;
+      char _pad[64]; // Avoid false sharing between adjacent stripes.
+    };
+
+    inline Stripe& getStripe (Key k) {
+      // Use different bits than OpenHashMap does to pick a slot.
+      size_t h = Hash<Key>::hash (k);
+      h = (h >> 12) ^ (h >> 20) ^ (h >> 28);
+      return _stripes[h % NumStripes];
+    }
+
+    Stripe _stripes[NumStripes];
+  };
+
+}
+
+#endif
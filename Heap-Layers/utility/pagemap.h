@@ -0,0 +1,171 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_PAGEMAP_H
+#define HL_PAGEMAP_H
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "threads/atomic.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @class PageMap
+ * @brief A three-level radix tree mapping page addresses to values.
+ * @author Emery Berger
+ *
+ * Modeled on TCMalloc_PageMap3 (see tcmalloc's pagemap.h). Interior
+ * and leaf nodes are mapped lazily and never freed; installing a node
+ * uses compare-and-swap, so set may be called concurrently for
+ * different pages and get never needs a lock.
+ *
+ * get returns 0 for pages that were never set.
+ *
+ * @param Value    The type stored per page (must fit in a word).
+ * @param PageBits log2 of the page size tracked by the map.
+ */
+
+namespace HL {
+
+  template <class Value, int PageBits = 12>
+  class PageMap {
+  public:
+
+    enum { PageSize = 1 << PageBits };
+
+    PageMap (void)
+    {
+      for (int i = 0; i < ROOT_LENGTH; i++) {
+	_root[i] = NULL;
+      }
+    }
+
+    inline Value get (const void * ptr) const {
+      const size_t k = pageNumber (ptr);
+      Node * n = _root[k >> (LEAF_BITS + INTERIOR_BITS)];
+      if (n == NULL) {
+	return 0;
+      }
+      Leaf * l = n->leaves[(k >> LEAF_BITS) & (INTERIOR_LENGTH - 1)];
+      if (l == NULL) {
+	return 0;
+      }
+      return l->values[k & (LEAF_LENGTH - 1)];
+    }
+
+    /// Set the value for the page holding ptr.
+    /// Returns false if we could not allocate the tree nodes.
+    inline bool set (const void * ptr, Value v) {
+      const size_t k = pageNumber (ptr);
+      Leaf * l = getLeaf (k);
+      if (l == NULL) {
+	return false;
+      }
+      l->values[k & (LEAF_LENGTH - 1)] = v;
+      return true;
+    }
+
+    /// Set the value for every page in [ptr, ptr + sz).
+    bool setRange (const void * ptr, size_t sz, Value v) {
+      const char * p = (const char *) ptr;
+      const char * end = p + sz;
+      for (; p < end; p += PageSize) {
+	if (!set (p, v)) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+  private:
+
+    PageMap (const PageMap&);
+    PageMap& operator=(const PageMap&);
+
+    // Number of bits in a page number (48-bit virtual addresses on 64-bit platforms).
+    enum { ADDRESS_BITS = (sizeof(void *) == 8) ? 48 : 32 };
+    enum { BITS = ADDRESS_BITS - PageBits };
+
+    enum { INTERIOR_BITS = (BITS + 2) / 3 };
+    enum { INTERIOR_LENGTH = 1 << INTERIOR_BITS };
+    enum { LEAF_BITS = BITS - 2 * INTERIOR_BITS };
+    enum { LEAF_LENGTH = 1 << LEAF_BITS };
+    enum { ROOT_LENGTH = 1 << INTERIOR_BITS };
+
+    class Leaf {
+    public:
+      Value values[LEAF_LENGTH];
+    };
+
+    class Node {
+    public:
+      Leaf * volatile leaves[INTERIOR_LENGTH];
+    };
+
+    static inline size_t pageNumber (const void * ptr) {
+      const size_t k = (size_t) ptr >> PageBits;
+      assert ((k >> BITS) == 0);
+      return k;
+    }
+
+    /// Install a freshly mapped (and therefore zeroed) node,
+    /// unless some other thread beat us to it.
+    template <class T>
+    static T * install (T * volatile * slot) {
+      T * n = (T *) MmapWrapper::map (sizeof(T));
+      if (n == NULL) {
+	return NULL;
+      }
+      if (!Atomic::compareAndSwap (slot, (T *) NULL, n)) {
+	MmapWrapper::unmap (n, sizeof(T));
+      }
+      return *slot;
+    }
+
+    Leaf * getLeaf (size_t k) {
+      Node * volatile * ns = &_root[k >> (LEAF_BITS + INTERIOR_BITS)];
+      Node * n = *ns;
+      if (n == NULL) {
+	n = install (ns);
+	if (n == NULL) {
+	  return NULL;
+	}
+      }
+      Leaf * volatile * ls = &n->leaves[(k >> LEAF_BITS) & (INTERIOR_LENGTH - 1)];
+      Leaf * l = *ls;
+      if (l == NULL) {
+	l = install (ls);
+      }
+      return l;
+    }
+
+    Node * volatile _root[ROOT_LENGTH];
+  };
+
+}
+
+#endif
@@ -0,0 +1,69 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_PROBES_H
+#define HL_PROBES_H
+
+/**
+ * @file probes.h
+ * @brief USDT probes on the slow paths, for bpftrace, perf and SystemTap.
+ *
+ * HL_PROBEn (name, args...) places a statically defined tracing probe
+ * named name, with n arguments, under the provider "heaplayers". A
+ * probe is a single NOP until a tracer attaches to it, but its
+ * arguments are computed whether or not anyone is tracing, so pass
+ * values already at hand. Probes
+ * need <sys/sdt.h> (from systemtap-sdt-dev); without it, or with
+ * HL_NO_PROBES defined, they compile to nothing.
+ *
+ * Slow paths have a name_start and a name_done probe, and the tracer
+ * times them, so untraced code pays for no clock reads:
+ *
+ * <TT>
+ *   usdt:./app:heaplayers:mmap_alloc_start { @t[tid] = nsecs; }<BR>
+ *   usdt:./app:heaplayers:mmap_alloc_done /@t[tid]/ {<BR>
+ *     @ns[arg0] = hist(nsecs - @t[tid]); delete(@t[tid]); }
+ * </TT>
+ */
+
+#if !defined(HL_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HL_PROBES_ENABLED 1
+#endif
+#endif
+
+#if defined(HL_PROBES_ENABLED)
+#define HL_PROBE1(name, a) DTRACE_PROBE1 (heaplayers, name, a)
+#define HL_PROBE2(name, a, b) DTRACE_PROBE2 (heaplayers, name, a, b)
+#define HL_PROBE3(name, a, b, c) DTRACE_PROBE3 (heaplayers, name, a, b, c)
+#else
+#define HL_PROBE1(name, a)
+#define HL_PROBE2(name, a, b)
+#define HL_PROBE3(name, a, b, c)
+#endif
+
+#endif
@@ -0,0 +1,379 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_STATSREGISTRY_H
+#define HL_STATSREGISTRY_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <signal.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#include <io.h>
+#endif
+
+/**
+ * @file statsregistry.h
+ * @brief A runtime statistics surface for heap layers.
+ *
+ * A layer that keeps statistics holds a StatsSource (a LayerStats),
+ * giving it a name, and writes its numbers in writeStats. Every live source is
+ * listed in the StatsRegistry, which dumps them all as one JSON object
+ *
+ * <TT>
+ *   {"heaps": [{"name": "profile-0", "requested": 123, ...}, ...]}
+ * </TT>
+ *
+ * to a file descriptor: on demand (StatsRegistry::dump, or malloc_stats
+ * through wrapper.cpp), or whenever the process gets a signal
+ * (StatsRegistry::dumpOnSignal). Setting HL_STATS_SIGNAL=<signal number>
+ * (and optionally HL_STATS_FD, which defaults to 2) in the environment
+ * does the latter when the first source registers.
+ *
+ * Nothing here allocates or takes a lock, so a dump is safe inside a
+ * signal handler and inside the allocator; the numbers read are those
+ * of the moment, not a consistent snapshot.
+ */
+
+namespace HL {
+
+  /// Writes a JSON document to a file descriptor through a small
+  /// buffer, with async-signal-safe number formatting.
+  class StatsWriter {
+  public:
+
+    explicit StatsWriter (int fd)
+      : _fd (fd),
+	_len (0),
+	_first (true)
+    {}
+
+    ~StatsWriter (void) {
+      flush();
+    }
+
+    /// Start an object, as the value of name (or bare, if name is NULL).
+    void beginObject (const char * name = NULL) {
+      key (name);
+      put ('{');
+      _first = true;
+    }
+
+    void endObject (void) {
+      put ('}');
+      _first = false;
+    }
+
+    void beginArray (const char * name) {
+      key (name);
+      put ('[');
+      _first = true;
+    }
+
+    void endArray (void) {
+      put (']');
+      _first = false;
+    }
+
+    void field (const char * name, unsigned long long v) {
+      key (name);
+      number (v);
+    }
+
+    void field (const char * name, long long v) {
+      key (name);
+      if (v < 0) {
+	put ('-');
+	v = -v;
+      }
+      number ((unsigned long long) v);
+    }
+
+    void field (const char * name, unsigned long v) {
+      field (name, (unsigned long long) v);
+    }
+
+    void field (const char * name, long v) {
+      field (name, (long long) v);
+    }
+
+    void field (const char * name, unsigned int v) {
+      field (name, (unsigned long long) v);
+    }
+
+    void field (const char * name, int v) {
+      field (name, (long long) v);
+    }
+
+    void field (const char * name, const char * s) {
+      key (name);
+      string (s);
+    }
+
+    /// An array element.
+    void value (unsigned long long v) {
+      key (NULL);
+      number (v);
+    }
+
+    void value (const char * s) {
+      key (NULL);
+      string (s);
+    }
+
+    void flush (void) {
+      const char * p = _buf;
+      while (_len > 0) {
+	const long n = (long) ::write (_fd, p, _len);
+	if (n <= 0) {
+	  break;
+	}
+	p += n;
+	_len -= n;
+      }
+      _len = 0;
+    }
+
+  private:
+
+    void put (char c) {
+      if (_len == sizeof(_buf)) {
+	flush();
+      }
+      _buf[_len++] = c;
+    }
+
+    void key (const char * name) {
+      if (!_first) {
+	put (',');
+	put (' ');
+      }
+      _first = false;
+      if (name != NULL) {
+	string (name);
+	put (':');
+	put (' ');
+      }
+    }
+
+    // Names are the layers' own, so only quotes and backslashes need
+    // escaping.
+    void string (const char * s) {
+      put ('"');
+      for (; *s; s++) {
+	if ((*s == '"') || (*s == '\\')) {
+	  put ('\\');
+	}
+	put (*s);
+      }
+      put ('"');
+    }
+
+    void number (unsigned long long v) {
+      char digits[24];
+      int i = 0;
+      do {
+	digits[i++] = (char) ('0' + (int) (v % 10));
+	v /= 10;
+      } while (v > 0);
+      while (i > 0) {
+	put (digits[--i]);
+      }
+    }
+
+    int _fd;
+    size_t _len;
+    bool _first;
+    char _buf[512];
+  };
+
+
+  /// A source of statistics, listed in the StatsRegistry for as long as
+  /// it lives.
+  class StatsSource {
+  public:
+
+    inline StatsSource (const char * name);
+    inline virtual ~StatsSource (void);
+
+    /// Write this source's fields (between the braces of its object).
+    virtual void writeStats (StatsWriter& w) = 0;
+
+    const char * getStatsName (void) const {
+      return _statsName;
+    }
+
+    /// Rename this source, e.g. to tell apart two heaps of one type.
+    /// The string must outlive the source.
+    void setStatsName (const char * name) {
+      _statsName = name;
+    }
+
+  private:
+    const char * _statsName;
+  };
+
+
+  /// The StatsSource of a layer, kept as a member rather than a base so
+  /// that stacked layers each keep their own: it forwards writeStats to
+  /// the owner's.
+  template <class Owner>
+  class LayerStats : public StatsSource {
+  public:
+
+    LayerStats (const char * name, Owner * owner)
+      : StatsSource (name),
+	_owner (owner)
+    {}
+
+    void writeStats (StatsWriter& w) {
+      _owner->writeStats (w);
+    }
+
+  private:
+    Owner * _owner;
+  };
+
+
+  class StatsRegistry {
+  public:
+
+    enum { MaxSources = 256 };
+
+    /// List a source. Returns false if the registry is full.
+    static bool add (StatsSource * s) {
+      static bool checkedEnvironment = false;
+      if (!checkedEnvironment) {
+	checkedEnvironment = true;
+	fromEnvironment();
+      }
+      for (int i = 0; i < MaxSources; i++) {
+	if (compareAndSwap (&getSources()[i], NULL, s)) {
+	  return true;
+	}
+      }
+      return false;
+    }
+
+    static void remove (StatsSource * s) {
+      for (int i = 0; i < MaxSources; i++) {
+	compareAndSwap (&getSources()[i], s, NULL);
+      }
+    }
+
+    /// Write every source's statistics to fd.
+    static void dump (int fd) {
+      StatsWriter w (fd);
+      w.beginObject();
+      w.beginArray ("heaps");
+      for (int i = 0; i < MaxSources; i++) {
+	StatsSource * s = getSources()[i];
+	if (s != NULL) {
+	  w.beginObject();
+	  w.field ("name", s->getStatsName());
+	  s->writeStats (w);
+	  w.endObject();
+	}
+      }
+      w.endArray();
+      w.endObject();
+      w.flush();
+      static const char nl = '\n';
+      (void) ::write (fd, &nl, 1);
+    }
+
+#if !defined(_WIN32)
+    /// Dump to fd whenever the process receives sig.
+    static bool dumpOnSignal (int sig, int fd) {
+      getSignalFd() = fd;
+      struct sigaction sa;
+      memset (&sa, 0, sizeof(sa));
+      sa.sa_handler = onSignal;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset (&sa.sa_mask);
+      return (sigaction (sig, &sa, NULL) == 0);
+    }
+#endif
+
+  private:
+
+    static StatsSource * volatile * getSources (void) {
+      static StatsSource * volatile sources[MaxSources];
+      return sources;
+    }
+
+    static bool compareAndSwap (StatsSource * volatile * p,
+				StatsSource * oldval,
+				StatsSource * newval) {
+#if defined(_WIN32)
+      return (InterlockedCompareExchangePointer ((PVOID volatile *) p, newval, oldval) == oldval);
+#else
+      return __sync_bool_compare_and_swap (p, oldval, newval);
+#endif
+    }
+
+    static void fromEnvironment (void) {
+#if !defined(_WIN32)
+      const char * sig = getenv ("HL_STATS_SIGNAL");
+      if ((sig != NULL) && (atoi (sig) > 0)) {
+	const char * fd = getenv ("HL_STATS_FD");
+	dumpOnSignal (atoi (sig), (fd != NULL) ? atoi (fd) : 2);
+      }
+#endif
+    }
+
+#if !defined(_WIN32)
+    static int& getSignalFd (void) {
+      static int fd = 2;
+      return fd;
+    }
+
+    static void onSignal (int) {
+      dump (getSignalFd());
+    }
+#endif
+
+  };
+
+
+  StatsSource::StatsSource (const char * name)
+    : _statsName (name)
+  {
+    StatsRegistry::add (this);
+  }
+
+  StatsSource::~StatsSource (void)
+  {
+    StatsRegistry::remove (this);
+  }
+
+}
+
+#endif
@@ -0,0 +1,248 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_STREAMINGCOPY_H
+#define HL_STREAMINGCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "threads/cpuinfo.h"
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(_WIN32)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HL_STREAMING_SUPPORTED 1
+#endif
+
+/**
+ * @class StreamingCopy
+ * @brief memcpy and memset that bypass the cache for large blocks.
+ *
+ * Copying or zeroing a block bigger than the last-level cache with
+ * memcpy or memset brings every line of it into the cache, evicting
+ * everything the other threads on the socket were using. Above
+ * getThreshold() bytes, copy and zero write with non-temporal stores
+ * instead (AVX-512, AVX2 or SSE2, whichever the CPU has), so the
+ * destination goes straight to memory. The threshold is half the
+ * last-level cache, found the first time it is needed; below it, or
+ * off x86-64, these are plain memcpy and memset. realloc and calloc in
+ * the wrappers, and ZeroHeap, use them.
+ */
+
+namespace HL {
+
+  class StreamingCopy {
+  public:
+
+    /// Used when the cache size cannot be found.
+    enum { DefaultThreshold = 4 * 1024 * 1024 };
+
+    /// The threshold is never below this.
+    enum { MinThreshold = 256 * 1024 };
+
+    /// Copy sz bytes from src to dst (which must not overlap).
+    static inline void copy (void * dst, const void * src, size_t sz) {
+#if HL_STREAMING_SUPPORTED
+      if (sz >= getThreshold()) {
+	streamCopy ((char *) dst, (const char *) src, sz);
+	return;
+      }
+#endif
+      memcpy (dst, src, sz);
+    }
+
+    /// Zero sz bytes at dst.
+    static inline void zero (void * dst, size_t sz) {
+#if HL_STREAMING_SUPPORTED
+      if (sz >= getThreshold()) {
+	streamZero ((char *) dst, sz);
+	return;
+      }
+#endif
+      memset (dst, 0, sz);
+    }
+
+    /// The size from which copies and zeroing stream.
+    static size_t getThreshold (void) {
+      static size_t threshold = findThreshold();
+      return threshold;
+    }
+
+  private:
+
+    static size_t findThreshold (void) {
+      const size_t llc = CPUInfo::getLastLevelCacheSize();
+      if (llc == 0) {
+	return DefaultThreshold;
+      }
+      if (llc / 2 < (size_t) MinThreshold) {
+	return MinThreshold;
+      }
+      return llc / 2;
+    }
+
+#if HL_STREAMING_SUPPORTED
+
+    enum { SSE2, AVX2, AVX512 };
+
+    static int getKind (void) {
+      static int kind = findKind();
+      return kind;
+    }
+
+    static int findKind (void) {
+      unsigned int a, b, c, d;
+      if (!__get_cpuid (1, &a, &b, &c, &d)) {
+	return SSE2;
+      }
+      // The OS must save the wider registers (OSXSAVE, then XCR0).
+      if (!(c & bit_OSXSAVE)) {
+	return SSE2;
+      }
+      unsigned int lo, hi;
+      asm volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+      if ((lo & 0x6) != 0x6) {
+	return SSE2;
+      }
+      if (!__get_cpuid_count (7, 0, &a, &b, &c, &d)) {
+	return SSE2;
+      }
+      if ((b & bit_AVX512F) && ((lo & 0xe6) == 0xe6)) {
+	return AVX512;
+      }
+      if (b & bit_AVX2) {
+	return AVX2;
+      }
+      return SSE2;
+    }
+
+    // Each kernel does the unaligned head with memcpy or memset, the
+    // body a cache line at a time with streaming stores, then the
+    // tail, and fences so the stores are visible before we return.
+
+    static void streamCopy (char * dst, const char * src, size_t sz) {
+      const size_t head = (64 - ((uintptr_t) dst & 63)) & 63;
+      memcpy (dst, src, head);
+      dst += head;
+      src += head;
+      sz -= head;
+      const size_t body = sz & ~(size_t) 63;
+      switch (getKind()) {
+      case AVX512:
+	copy512 (dst, src, body);
+	break;
+      case AVX2:
+	copy256 (dst, src, body);
+	break;
+      default:
+	copy128 (dst, src, body);
+	break;
+      }
+      _mm_sfence();
+      memcpy (dst + body, src + body, sz - body);
+    }
+
+    static void streamZero (char * dst, size_t sz) {
+      const size_t head = (64 - ((uintptr_t) dst & 63)) & 63;
+      memset (dst, 0, head);
+      dst += head;
+      sz -= head;
+      const size_t body = sz & ~(size_t) 63;
+      switch (getKind()) {
+      case AVX512:
+	zero512 (dst, body);
+	break;
+      case AVX2:
+	zero256 (dst, body);
+	break;
+      default:
+	zero128 (dst, body);
+	break;
+      }
+      _mm_sfence();
+      memset (dst + body, 0, sz - body);
+    }
+
+    __attribute__((target("avx512f")))
+    static void copy512 (char * dst, const char * src, size_t sz) {
+      for (size_t i = 0; i < sz; i += 64) {
+	__m512i v = _mm512_loadu_si512 ((const void *) (src + i));
+	_mm512_stream_si512 ((__m512i *) (dst + i), v);
+      }
+    }
+
+    __attribute__((target("avx2")))
+    static void copy256 (char * dst, const char * src, size_t sz) {
+      for (size_t i = 0; i < sz; i += 64) {
+	__m256i v0 = _mm256_loadu_si256 ((const __m256i *) (src + i));
+	__m256i v1 = _mm256_loadu_si256 ((const __m256i *) (src + i + 32));
+	_mm256_stream_si256 ((__m256i *) (dst + i), v0);
+	_mm256_stream_si256 ((__m256i *) (dst + i + 32), v1);
+      }
+    }
+
+    static void copy128 (char * dst, const char * src, size_t sz) {
+      for (size_t i = 0; i < sz; i += 64) {
+	for (size_t j = 0; j < 64; j += 16) {
+	  __m128i v = _mm_loadu_si128 ((const __m128i *) (src + i + j));
+	  _mm_stream_si128 ((__m128i *) (dst + i + j), v);
+	}
+      }
+    }
+
+    __attribute__((target("avx512f")))
+    static void zero512 (char * dst, size_t sz) {
+      const __m512i z = _mm512_setzero_si512();
+      for (size_t i = 0; i < sz; i += 64) {
+	_mm512_stream_si512 ((__m512i *) (dst + i), z);
+      }
+    }
+
+    __attribute__((target("avx2")))
+    static void zero256 (char * dst, size_t sz) {
+      const __m256i z = _mm256_setzero_si256();
+      for (size_t i = 0; i < sz; i += 64) {
+	_mm256_stream_si256 ((__m256i *) (dst + i), z);
+	_mm256_stream_si256 ((__m256i *) (dst + i + 32), z);
+      }
+    }
+
+    static void zero128 (char * dst, size_t sz) {
+      const __m128i z = _mm_setzero_si128();
+      for (size_t i = 0; i < sz; i += 16) {
+	_mm_stream_si128 ((__m128i *) (dst + i), z);
+      }
+    }
+
+#endif
+
+  };
+
+}
+
+#endif
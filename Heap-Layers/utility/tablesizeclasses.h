@@ -0,0 +1,85 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_TABLESIZECLASSES_H
+#define HL_TABLESIZECLASSES_H
+
+#include <assert.h>
+#include <stddef.h>
+
+/**
+ * @class TableSizeClasses
+ * @brief Size classes from a table, for SegHeap and StrictSegHeap.
+ *
+ * Where GeometricSizeClasses computes its classes from a formula,
+ * these come from a list, such as util/bench/sizeclasses fits to the
+ * sizes a program actually asks for. Table supplies NumBins and
+ * sizes(), which returns the class sizes in ascending order; the
+ * class of a size is found by binary search over them. As with
+ * GeometricSizeClasses, the functions are static:
+ *
+ * <TT>
+ * #include "myclasses.h" // written by sizeclasses -H<BR>
+ * typedef TableSizeClasses<MyClassesTable> SC;<BR>
+ * SegHeap<SC::NumBins, SC::getSizeClass, SC::getClassMaxSize, ...>
+ * </TT>
+ */
+
+namespace HL {
+
+  template <class Table>
+  class TableSizeClasses {
+  public:
+
+    enum { NumBins = Table::NumBins };
+
+    /// The smallest class that holds sz, for any sz up to the largest class.
+    static inline int getSizeClass (const size_t sz) {
+      const size_t * sizes = Table::sizes();
+      assert (sz <= sizes[NumBins - 1]);
+      int lo = 0;
+      int hi = NumBins - 1;
+      while (lo < hi) {
+	const int mid = (lo + hi) / 2;
+	if (sizes[mid] < sz) {
+	  lo = mid + 1;
+	} else {
+	  hi = mid;
+	}
+      }
+      return lo;
+    }
+
+    static inline size_t getClassMaxSize (const int c) {
+      assert (c >= 0);
+      assert (c < NumBins);
+      return Table::sizes()[c];
+    }
+  };
+
+}
+
+#endif
@@ -51,80 +51,42 @@
 #include <sys/time.h>
 #endif
 
-#if defined(linux) && defined(__GNUG__) && defined(__i386__)
-
-#include <cstdio>
-#include <limits.h>
-#include <time.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <string.h>
-
-static void getTime (unsigned long& tlo, unsigned long& thi) {
-  asm volatile ("rdtsc"
-		: "=a"(tlo),
-		"=d" (thi));
-}
-
-
-static double getFrequency (void) {
-  static double freq = 0.0;
-  static bool initialized = false;
-  unsigned long LTime0, LTime1, HTime0, HTime1;
-  if (!initialized) { 
-
-    // Compute MHz directly.
-    // Wait for approximately one second.
-    
-    getTime (LTime0, HTime0);
-    //    printf ("waiting...\n");
-    sleep (1);
-    // printf ("done.\n");
-    getTime (LTime1, HTime1);
-
-    freq = (double)(LTime1 - LTime0) + (double)(UINT_MAX)*(double)(HTime1 - HTime0);
-    if (LTime1 < LTime0) {
-      freq -= (double)UINT_MAX;
-    }
-    initialized = true;
+#if !defined(_WIN32)
+#include "utility/tsc.h"
+#endif
 
-  } else {
-    // printf ("wha?\n");
-  }
-  return freq;
-}
+#if !defined(_WIN32) && (HL_TSC_SUPPORTED || defined(CLOCK_MONOTONIC))
 
+// Time by fenced reads of the time stamp counter where it is usable,
+// and by CLOCK_MONOTONIC_RAW elsewhere (see TSC).
 
 namespace HL {
 
 class Timer {
 public:
+
+  /// Initializes the timer.
   Timer (void)
-    : timeElapsed (0.0)
-  {
-    _frequency = getFrequency();
-    //    printf ("wooo!\n");
-    //  printf ("freq = %lf\n", frequency);
-  }
-  void start (void) {
-    getTime (currentLo, currentHi);
-  }
-  void stop (void) {
-    unsigned long lo, hi;
-    getTime (lo, hi);
-    double now = (double) hi * 4294967296.0 + lo;
-    double prev = (double) currentHi * 4294967296.0 + currentLo;
-    timeElapsed = (now - prev) / _frequency;
-  }
+    : _starttime (0),
+      _elapsedtime (0)
+  {}
 
-  operator double (void) {
-    return timeElapsed;
-  }
+  /// Start the timer.
+  void start (void) { _starttime = TSC::begin(); }
+
+  /// Stop the timer.
+  void stop (void) { _elapsedtime += TSC::end() - _starttime; }
+
+  /// Reset the timer.
+  void reset (void) { _elapsedtime = 0; }
+
+  /// Return the number of seconds elapsed.
+  operator double (void) { return TSC::toSeconds (_elapsedtime); }
+
+  static double currentTime (void) { return TSC::toSeconds (TSC::begin()); }
 
 private:
-  double timeElapsed;
-  unsigned long currentLo, currentHi;
-  double _frequency;
+  TSC::TickType _starttime, _elapsedtime;
 };
 
 }
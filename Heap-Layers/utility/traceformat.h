@@ -0,0 +1,87 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+  
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+  
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_TRACEFORMAT_H
+#define HL_TRACEFORMAT_H
+
+#include <stdint.h>
+
+namespace HL {
+
+  /**
+   * The binary trace format written by BinaryTraceHeap: a TraceHeader,
+   * then one TraceRecord per malloc or free, in the order they happened
+   * (across all threads).  Fields are in the byte order of the traced
+   * machine.
+   */
+
+  struct TraceHeader {
+    char     magic[8];		///< "HLTRACE" followed by a NUL
+    uint32_t version;		///< TraceHeader::Version
+    uint32_t recordSize;	///< sizeof(TraceRecord)
+
+    enum { Version = 1 };
+  };
+
+  struct TraceRecord {
+    uint64_t time;		///< nanoseconds since the trace was opened
+    uint64_t ptr;		///< the object
+    uint64_t size;		///< requested size (mallocs only)
+    uint32_t thread;		///< the calling thread (CPUInfo::getThreadId)
+    uint32_t op;		///< TraceMalloc or TraceFree
+  };
+
+  enum { TraceMalloc = 1, TraceFree = 2 };
+
+  /**
+   * The binary log format written by AsyncLogHeap: a LogHeader, then
+   * LogRecords in chunks of one thread's calls at a time. Within a
+   * thread the records are in call order; across threads, order them
+   * by time.
+   */
+
+  struct LogHeader {
+    char     magic[8];		///< "HLLOG" followed by NULs
+    uint32_t version;		///< LogHeader::Version
+    uint32_t recordSize;	///< sizeof(LogRecord)
+    uint64_t ticksPerSecond;	///< the rate of LogRecord::time (0 if not closed)
+    uint64_t dropped;		///< records lost to full buffers
+
+    enum { Version = 1 };
+  };
+
+  struct LogRecord {
+    uint64_t time;		///< clock ticks since the log was opened
+    uint64_t ptr;		///< the object
+    uint64_t size;		///< requested size (mallocs only)
+    uint64_t caller;		///< return address of the call, or 0
+    uint32_t thread;		///< the calling thread (CPUInfo::getThreadId)
+    uint32_t op;		///< TraceMalloc or TraceFree
+  };
+
+}
+
+#endif
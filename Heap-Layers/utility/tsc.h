@@ -0,0 +1,235 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_TSC_H
+#define HL_TSC_H
+
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && !defined(_WIN32)
+#include <cpuid.h>
+#define HL_TSC_SUPPORTED 1
+#endif
+
+/**
+ * @class TSC
+ * @brief Fenced time stamp counter reads, in ticks convertible to nanoseconds.
+ *
+ * A bare rdtsc may execute before the instructions ahead of it are
+ * done, or after those behind it have started, so short intervals
+ * timed with it are off by tens of cycles either way. begin() reads
+ * the counter between two lfences; end() reads it with rdtscp (which
+ * waits for everything before it) followed by an lfence. Time the
+ * interval between a begin() and an end().
+ *
+ * The counter is used only where it is invariant (it ticks at one
+ * rate whatever the core's clock, and in step across cores) and
+ * rdtscp exists. Ticks convert to nanoseconds at a rate calibrated, on
+ * the first conversion, against CLOCK_MONOTONIC_RAW over at least
+ * CalibrateMillis since the first read. Everywhere else a tick is a
+ * nanosecond of CLOCK_MONOTONIC_RAW (or CLOCK_MONOTONIC, or on
+ * Windows, the performance counter).
+ */
+
+namespace HL {
+
+  class TSC {
+  public:
+
+    typedef unsigned long long TickType;
+
+    enum { CalibrateMillis = 10 };
+    enum { OverheadRounds = 64 };
+
+    /// Read the clock at the start of an interval.
+    static inline TickType begin (void) {
+#if HL_TSC_SUPPORTED
+      if (getState().counter) {
+	unsigned int lo, hi;
+	asm volatile ("lfence\n\trdtsc\n\tlfence" : "=a" (lo), "=d" (hi) : : "memory");
+	return ((TickType) hi << 32) | lo;
+      }
+#endif
+      return clockNanos();
+    }
+
+    /// Read the clock at the end of an interval.
+    static inline TickType end (void) {
+#if HL_TSC_SUPPORTED
+      if (getState().counter) {
+	unsigned int lo, hi, cpu;
+	asm volatile ("rdtscp\n\tlfence" : "=a" (lo), "=d" (hi), "=c" (cpu) : : "memory");
+	return ((TickType) hi << 32) | lo;
+      }
+#endif
+      return clockNanos();
+    }
+
+    /// The least a begin() and end() with nothing between measure, in
+    /// ticks.
+    static TickType getOverhead (void) {
+      return getState().overhead;
+    }
+
+    /// Whether ticks are counter cycles (rather than nanoseconds).
+    static bool isCounter (void) {
+      return getState().counter;
+    }
+
+    static double nanosPerTick (void) {
+      State& s = getState();
+      if (s.nanosPerTick == 0.0) {
+	calibrate (s);
+      }
+      return s.nanosPerTick;
+    }
+
+    static unsigned long long toNanos (TickType t) {
+      return (unsigned long long) ((double) t * nanosPerTick());
+    }
+
+    static double toSeconds (TickType t) {
+      return (double) t * nanosPerTick() / 1.0e9;
+    }
+
+    /// Nanoseconds by the fallback clock.
+    static inline TickType clockNanos (void) {
+#if defined(_WIN32)
+      LARGE_INTEGER t, f;
+      QueryPerformanceCounter (&t);
+      QueryPerformanceFrequency (&f);
+      return (TickType) ((double) t.QuadPart * 1.0e9 / (double) f.QuadPart);
+#else
+      struct timespec ts;
+#if defined(CLOCK_MONOTONIC_RAW)
+      clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+#else
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+#endif
+      return (TickType) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+  private:
+
+    struct State {
+      bool counter;
+      TickType ticks0;		// a counter reading...
+      TickType nanos0;		// ...and the clock at the same moment
+      TickType overhead;
+      volatile double nanosPerTick;	// 0 until calibrated
+    };
+
+    static State& getState (void) {
+      static State s = makeState();
+      return s;
+    }
+
+    static State makeState (void) {
+      State s;
+      s.counter = false;
+      s.ticks0 = 0;
+      s.nanos0 = 0;
+      s.nanosPerTick = 1.0;
+      s.overhead = 0;
+#if HL_TSC_SUPPORTED
+      unsigned int a, b, c, d;
+      if (__get_cpuid (0x80000000, &a, &b, &c, &d) && (a >= 0x80000007)) {
+	__get_cpuid (0x80000001, &a, &b, &c, &d);
+	const bool rdtscp = (d & (1U << 27)) != 0;
+	__get_cpuid (0x80000007, &a, &b, &c, &d);
+	const bool invariant = (d & (1U << 8)) != 0;
+	if (rdtscp && invariant) {
+	  s.counter = true;
+	  s.nanosPerTick = 0.0;
+	  pair (s.ticks0, s.nanos0);
+	}
+      }
+#endif
+      s.overhead = measureOverhead (s.counter);
+      return s;
+    }
+
+#if HL_TSC_SUPPORTED
+    static inline TickType rdtsc (void) {
+      unsigned int lo, hi;
+      asm volatile ("lfence\n\trdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+      return ((TickType) hi << 32) | lo;
+    }
+#endif
+
+    static TickType measureOverhead (bool counter) {
+      TickType least = (TickType) -1;
+      for (int i = 0; i < OverheadRounds; i++) {
+	TickType t0, t1;
+#if HL_TSC_SUPPORTED
+	if (counter) {
+	  unsigned int lo, hi, cpu;
+	  asm volatile ("lfence\n\trdtsc\n\tlfence" : "=a" (lo), "=d" (hi) : : "memory");
+	  t0 = ((TickType) hi << 32) | lo;
+	  asm volatile ("rdtscp\n\tlfence" : "=a" (lo), "=d" (hi), "=c" (cpu) : : "memory");
+	  t1 = ((TickType) hi << 32) | lo;
+	} else
+#endif
+	{
+	  t0 = clockNanos();
+	  t1 = clockNanos();
+	}
+	if (t1 - t0 < least) {
+	  least = t1 - t0;
+	}
+      }
+      return least;
+    }
+
+    /// Read the counter and the clock together.
+    static void pair (TickType& ticks, TickType& nanos) {
+#if HL_TSC_SUPPORTED
+      const TickType t0 = rdtsc();
+      nanos = clockNanos();
+      const TickType t1 = rdtsc();
+      ticks = t0 + (t1 - t0) / 2;
+#else
+      ticks = nanos = clockNanos();
+#endif
+    }
+
+    static void calibrate (State& s) {
+      TickType ticks, nanos;
+      do {
+	pair (ticks, nanos);
+      } while (nanos - s.nanos0 < (TickType) CalibrateMillis * 1000000);
+      s.nanosPerTick = (double) (nanos - s.nanos0) / (double) (ticks - s.ticks0);
+    }
+  };
+
+}
+
+#endif
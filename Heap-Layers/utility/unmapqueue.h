@@ -0,0 +1,322 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_UNMAPQUEUE_H
+#define HL_UNMAPQUEUE_H
+
+#include <stddef.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#endif
+
+#include "utility/singleton.h"
+#include "utility/statsregistry.h"
+
+/**
+ * @class UnmapQueue
+ * @brief Hands munmap calls to a background thread.
+ *
+ * Unmapping a large mapping frees every page in it and shoots down the
+ * TLBs of every CPU running the process: for gigabytes, tens of
+ * milliseconds, on the thread that freed it. Built with
+ * HL_ASYNC_MUNMAP, PrivateMmapHeap::free (and so MmapHeap's and the
+ * heaps over it) instead queues mappings of MinBytes or more here, and
+ * returns at once; a thread of its own unmaps them in order. The
+ * address range stays mapped until then, so nothing else can be given
+ * it meanwhile.
+ *
+ * The queue is a ring of Capacity entries that any thread can add to
+ * without a lock. When it is full, or already holds MaxPendingBytes
+ * (which are still resident until unmapped), defer returns false and
+ * the caller unmaps the mapping itself, which holds freeing threads to the pace of
+ * the one unmapping rather than letting the backlog grow. Nothing is
+ * queued until start() is called, since creating the thread can
+ * allocate, and free may be holding the heap's lock:
+ *
+ * <TT>
+ *   int main (void) {
+ *     UnmapQueue::start();
+ *     ...
+ *   }
+ * </TT>
+ *
+ * A forked child has no such thread: it unmaps what was queued, then
+ * unmaps inline until it calls start() itself. The counts are in the
+ * StatsRegistry as "munmap-queue".
+ */
+
+namespace HL {
+
+#if defined(_WIN32)
+
+  // VirtualFree does not shoot down TLBs the way munmap does.
+  class UnmapQueue {
+  public:
+    static inline bool start (void) { return false; }
+    static inline bool defer (void *, size_t) { return false; }
+    static inline void drain (void) {}
+  };
+
+#else
+
+  class UnmapQueue {
+  public:
+
+    enum { Capacity = 256 };
+    enum { MinBytes = 1024 * 1024 };
+    enum { MaxPendingBytes = 1024 * 1024 * 1024 };
+
+    /// Start the thread; true once it is running.
+    static inline bool start (void) {
+      return getQueue().startWorker();
+    }
+
+    /// Queue the mapping for unmapping, returning true if it was.
+    static inline bool defer (void * ptr, size_t sz) {
+      if (sz < (size_t) MinBytes) {
+	return false;
+      }
+      return getQueue().push (ptr, sz);
+    }
+
+    /// Wait until everything queued so far has been unmapped.
+    static void drain (void) {
+      UnmapQueue& q = getQueue();
+      const size_t last = __atomic_load_n (&q._tail, __ATOMIC_ACQUIRE);
+      while ((q._state == Running)
+	     && ((ptrdiff_t) (__atomic_load_n (&q._unmapped, __ATOMIC_ACQUIRE) - last) < 0)) {
+	q.wake();
+	sched_yield();
+      }
+    }
+
+    void writeStats (StatsWriter& w) {
+      w.field ("deferred", _deferred);
+      w.field ("inline", _inline);
+      w.field ("pending", _tail - _unmapped);
+      w.field ("pending_bytes", _pendingBytes);
+    }
+
+    UnmapQueue (void)
+      : _tail (0),
+	_head (0),
+	_unmapped (0),
+	_pendingBytes (0),
+	_state (Idle),
+	_sleeping (false),
+	_deferred (0),
+	_inline (0),
+	_stats ("munmap-queue", this)
+    {
+      for (int i = 0; i < Capacity; i++) {
+	_cells[i].seq = i;
+      }
+      pthread_mutex_init (&_lock, NULL);
+      pthread_cond_init (&_wake, NULL);
+      pthread_atfork (lockBeforeFork, unlockAfterFork, resetAfterFork);
+    }
+
+  private:
+
+    // Disable copying and assignment.
+    UnmapQueue (const UnmapQueue&);
+    UnmapQueue& operator= (const UnmapQueue&);
+
+    enum { Idle, Starting, Running };
+
+    /// An entry of the ring. seq is the position it is next free to
+    /// be written at, or that plus one once it has been.
+    class Cell {
+    public:
+      volatile size_t seq;
+      void * ptr;
+      size_t sz;
+    };
+
+    static inline UnmapQueue& getQueue (void) {
+      return singleton<UnmapQueue>::getInstance();
+    }
+
+    bool startWorker (void) {
+      if (__sync_bool_compare_and_swap (&_state, Idle, Starting)) {
+	pthread_t worker;
+	pthread_attr_t attr;
+	sigset_t set, old;
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	// The thread should never field the program's signals.
+	sigfillset (&set);
+	pthread_sigmask (SIG_SETMASK, &set, &old);
+	const bool started = (pthread_create (&worker, &attr, run, this) == 0);
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy (&attr);
+	_state = started ? Running : Idle;
+      }
+      return (_state == Running);
+    }
+
+    bool push (void * ptr, size_t sz) {
+      if (_state != Running) {
+	return false;
+      }
+      // One mapping bigger than the limit still goes, by itself.
+      const size_t before = __atomic_fetch_add (&_pendingBytes, sz, __ATOMIC_RELAXED);
+      if ((before != 0) && (before + sz > (size_t) MaxPendingBytes)) {
+	__atomic_sub_fetch (&_pendingBytes, sz, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&_inline, 1, __ATOMIC_RELAXED);
+	return false;
+      }
+      size_t pos = __atomic_load_n (&_tail, __ATOMIC_RELAXED);
+      Cell * c;
+      while (true) {
+	c = &_cells[pos % Capacity];
+	const ptrdiff_t d = (ptrdiff_t) (__atomic_load_n (&c->seq, __ATOMIC_ACQUIRE) - pos);
+	if (d == 0) {
+	  if (__atomic_compare_exchange_n (&_tail, &pos, pos + 1, false,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	    break;
+	  }
+	} else if (d < 0) {
+	  // Full: the caller unmaps it.
+	  __atomic_sub_fetch (&_pendingBytes, sz, __ATOMIC_RELAXED);
+	  __atomic_add_fetch (&_inline, 1, __ATOMIC_RELAXED);
+	  return false;
+	} else {
+	  pos = __atomic_load_n (&_tail, __ATOMIC_RELAXED);
+	}
+      }
+      c->ptr = ptr;
+      c->sz = sz;
+      __atomic_store_n (&c->seq, pos + 1, __ATOMIC_RELEASE);
+      __atomic_add_fetch (&_deferred, 1, __ATOMIC_RELAXED);
+      // The thread sets _sleeping before it looks at the ring a last
+      // time, and we look at _sleeping after adding to it, so one of
+      // us sees the other.
+      if (__atomic_load_n (&_sleeping, __ATOMIC_SEQ_CST)) {
+	wake();
+      }
+      return true;
+    }
+
+    void wake (void) {
+      pthread_mutex_lock (&_lock);
+      pthread_cond_signal (&_wake);
+      pthread_mutex_unlock (&_lock);
+    }
+
+    /// The next entry, if there is one (only the thread calls this).
+    bool pop (void *& ptr, size_t& sz) {
+      Cell * c = &_cells[_head % Capacity];
+      if (__atomic_load_n (&c->seq, __ATOMIC_ACQUIRE) != _head + 1) {
+	return false;
+      }
+      ptr = c->ptr;
+      sz = c->sz;
+      __atomic_store_n (&c->seq, _head + Capacity, __ATOMIC_RELEASE);
+      _head++;
+      return true;
+    }
+
+    static void * run (void * arg) {
+      UnmapQueue * q = (UnmapQueue *) arg;
+#if defined(__linux__) && defined(SCHED_IDLE)
+      // Run only when nothing else wants the CPU, so that waking up
+      // does not preempt the thread that freed (if there is no such
+      // time, the ring fills up and frees unmap inline again).
+      struct sched_param param;
+      param.sched_priority = 0;
+      pthread_setschedparam (pthread_self(), SCHED_IDLE, &param);
+#endif
+      void * ptr;
+      size_t sz;
+      while (true) {
+	while (q->pop (ptr, sz)) {
+	  munmap (ptr, sz);
+	  __atomic_sub_fetch (&q->_pendingBytes, sz, __ATOMIC_RELAXED);
+	  __atomic_add_fetch (&q->_unmapped, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_lock (&q->_lock);
+	__atomic_store_n (&q->_sleeping, true, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&q->_cells[q->_head % Capacity].seq, __ATOMIC_SEQ_CST) != q->_head + 1) {
+	  pthread_cond_wait (&q->_wake, &q->_lock);
+	}
+	q->_sleeping = false;
+	pthread_mutex_unlock (&q->_lock);
+      }
+      return NULL;
+    }
+
+    static void lockBeforeFork (void) {
+      pthread_mutex_lock (&getQueue()._lock);
+    }
+
+    static void unlockAfterFork (void) {
+      pthread_mutex_unlock (&getQueue()._lock);
+    }
+
+    /// In the child: the thread did not come along, so unmap what it
+    /// had not got to yet (the one it was unmapping, if any, stays
+    /// mapped) and go back to unmapping inline.
+    static void resetAfterFork (void) {
+      UnmapQueue& q = getQueue();
+      pthread_mutex_unlock (&q._lock);
+      pthread_cond_init (&q._wake, NULL);
+      q._state = Idle;
+      q._sleeping = false;
+      void * ptr;
+      size_t sz;
+      while (q.pop (ptr, sz)) {
+	munmap (ptr, sz);
+	q._pendingBytes -= sz;
+	q._unmapped++;
+      }
+    }
+
+    Cell _cells[Capacity];
+    volatile size_t _tail;
+    size_t _head;
+    volatile size_t _unmapped;
+    size_t _pendingBytes;
+
+    pthread_mutex_t _lock;
+    pthread_cond_t _wake;
+    volatile int _state;
+    volatile bool _sleeping;
+
+    unsigned long _deferred;
+    unsigned long _inline;
+    LayerStats<UnmapQueue> _stats;
+  };
+
+#endif
+
+}
+
+#endif
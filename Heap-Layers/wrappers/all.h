@@ -1,4 +1,6 @@
 #include "ansiwrapper.h"
 #include "macinterpose.h"
+#include "maczoneheap.h"
+#include "memoryresource.h"
 #include "mmapwrapper.h"
 #include "stlallocator.h"
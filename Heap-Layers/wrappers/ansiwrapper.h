@@ -38,28 +38,118 @@ namespace HL {
       if (sz > HL::MallocInfo::MaxSize) {
 	return NULL;
       }
-      if (sz < HL::MallocInfo::MinSize) {
-      	sz = HL::MallocInfo::MinSize;
-      }
-      // Enforce alignment requirements: round up allocation sizes if needed.
-      // NOTE: Alignment needs to be a power of two.
-      sassert<(HL::MallocInfo::Alignment & (HL::MallocInfo::Alignment - 1)) == 0> powTwo;
-      powTwo = powTwo;
-
-      // Enforce alignment.
-      sz = (sz + HL::MallocInfo::Alignment - 1) & ~(HL::MallocInfo::Alignment - 1);
+      void * ptr = SuperHeap::malloc (roundUp (sz));
+      assert ((size_t) ptr % HL::MallocInfo::Alignment == 0);
+      return ptr;
+    }
 
-      void * ptr = SuperHeap::malloc (sz);
+    /// Zero-filled memory, for heaps that support mallocZeroed (see ZeroHeap).
+    inline void * mallocZeroed (size_t sz) {
+      if (sz > HL::MallocInfo::MaxSize) {
+	return NULL;
+      }
+      void * ptr = SuperHeap::mallocZeroed (roundUp (sz));
       assert ((size_t) ptr % HL::MallocInfo::Alignment == 0);
       return ptr;
     }
  
+    /// Aligned memory, for heaps that support memalign (such as
+    /// SegHeap, PageMapHeap and MmapHeap).
+    inline void * memalign (size_t alignment, size_t sz) {
+      if ((alignment == 0) || (alignment & (alignment - 1))) {
+	// Not a power of two.
+	return NULL;
+      }
+      if (alignment <= HL::MallocInfo::Alignment) {
+	return malloc (sz);
+      }
+      if (sz > HL::MallocInfo::MaxSize) {
+	return NULL;
+      }
+      void * ptr = SuperHeap::memalign (alignment, roundUp (sz));
+      assert ((size_t) ptr % alignment == 0);
+      return ptr;
+    }
+
+    /// Try to change an object's size without moving it, for heaps
+    /// that support resize. Returns true on success.
+    inline bool resize (void * ptr, size_t sz) {
+      if ((ptr == 0) || (sz > HL::MallocInfo::MaxSize)) {
+	return false;
+      }
+      return SuperHeap::resize (ptr, roundUp (sz));
+    }
+
+    /// The usable size malloc (sz) would give, for heaps that support
+    /// goodSize (such as SegHeap and TLSFHeap).
+    inline size_t goodSize (size_t sz) {
+      if (sz > HL::MallocInfo::MaxSize) {
+	return sz;
+      }
+      return SuperHeap::goodSize (roundUp (sz));
+    }
+
     inline void free (void * ptr) {
       if (ptr != 0) {
       	SuperHeap::free (ptr);
       }
     }
 
+    /// The size-passing protocol, for heaps that support it (see
+    /// SizePassingHeap): actual is what getSize would say, and is
+    /// what the sized free wants back.
+    inline void * mallocSized (size_t sz, size_t * actual) {
+      if (sz > HL::MallocInfo::MaxSize) {
+	*actual = 0;
+	return NULL;
+      }
+      void * ptr = SuperHeap::mallocSized (roundUp (sz), actual);
+      assert ((size_t) ptr % HL::MallocInfo::Alignment == 0);
+      return ptr;
+    }
+
+    inline void free (void * ptr, size_t sz) {
+      if (ptr != 0) {
+	SuperHeap::free (ptr, sz);
+      }
+    }
+
+    /// The batch protocol, for heaps that support it (see BatchHeap).
+    inline int mallocBatch (size_t sz, int n, void ** ptrs) {
+      if (sz > HL::MallocInfo::MaxSize) {
+	return 0;
+      }
+      return SuperHeap::mallocBatch (roundUp (sz), n, ptrs);
+    }
+
+    /// Frees the non-NULL entries of ptrs, a run at a time.
+    inline void freeBatch (void ** ptrs, int n) {
+      int i = 0;
+      while (i < n) {
+	if (ptrs[i] == 0) {
+	  i++;
+	  continue;
+	}
+	int j = i + 1;
+	while ((j < n) && (ptrs[j] != 0)) {
+	  j++;
+	}
+	SuperHeap::freeBatch (ptrs + i, j - i);
+	i = j;
+      }
+    }
+
+    /// Co-allocation, for heaps that support it (see ComallocHeap),
+    /// which align each object themselves.
+    inline bool comalloc (size_t n, const size_t * sizes, void ** ptrs) {
+      for (size_t i = 0; i < n; i++) {
+	if (sizes[i] > HL::MallocInfo::MaxSize) {
+	  return false;
+	}
+      }
+      return SuperHeap::comalloc (n, sizes, ptrs);
+    }
+
     inline void * calloc (const size_t s1, const size_t s2) {
       char * ptr = (char *) malloc (s1 * s2);
       if (ptr) {
@@ -105,6 +195,21 @@ namespace HL {
 	return 0;
       }
     }
+
+  private:
+
+    static inline size_t roundUp (size_t sz) {
+      if (sz < HL::MallocInfo::MinSize) {
+      	sz = HL::MallocInfo::MinSize;
+      }
+      // Enforce alignment requirements: round up allocation sizes if needed.
+      // NOTE: Alignment needs to be a power of two.
+      sassert<(HL::MallocInfo::Alignment & (HL::MallocInfo::Alignment - 1)) == 0> powTwo;
+      powTwo = powTwo;
+
+      // Enforce alignment.
+      return (sz + HL::MallocInfo::Alignment - 1) & ~(HL::MallocInfo::Alignment - 1);
+    }
   };
 
 }
@@ -17,24 +17,45 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <new>
 
-#include "heaplayers.h"
+#include "threads/cpuinfo.h"
+#include "utility/streamingcopy.h"
 
 /*
   To use this library,
   you only need to define the following allocation functions:
-  
+
   - xxmalloc
   - xxfree
   - xxmalloc_usable_size
   - xxmalloc_lock
   - xxmalloc_unlock
 
+  and, optionally, xxmemalign, xxmalloc_purge, xxmalloc_object_bounds,
+  xxmalloc_good_size, xxmalloc_sized and xxmalloc_comalloc.
+
+  Built with -DGNUWRAPPER_THREAD_CACHE=1, small objects go through
+  per-thread caches in front of xxmalloc and xxfree (see
+  xxthreadcache.h), so an allocator that locks on every call scales
+  with threads without any change to it.
+
+  Built with -DGNUWRAPPER_PRESSURE_MONITOR=1, a thread watches for
+  memory pressure (see pressuremonitor.h) and, when there is some,
+  gives memory back through xxmalloc_purge, if the allocator has it.
+
   See the extern "C" block below for function prototypes and more
   details. YOU SHOULD NOT NEED TO MODIFY ANY OF THE CODE HERE TO
   SUPPORT ANY ALLOCATOR.
 
+  The malloc family is replaced by defining it here, so that a
+  library built with this file and LD_PRELOADed (or linked ahead of
+  libc) interposes on glibc's: no __malloc_hook (which glibc 2.34
+  removed), and so no hook to go through on every call. The __libc_
+  entry points are defined too, for callers that reach for glibc's
+  allocator by name.
+
 
   LIMITATIONS:
 
@@ -45,8 +66,6 @@
 
 */
 
-static bool initialized = false;
-
 extern "C" {
 
   void * xxmalloc (size_t);
@@ -55,155 +74,198 @@ extern "C" {
   void   xxmalloc_lock (void);
   void   xxmalloc_unlock (void);
 
-  static void my_init_hook (void);
-
-  // New hooks for allocation functions.
-  static void * my_malloc_hook (size_t, const void *);
-  static void   my_free_hook (void *, const void *);
-  static void * my_realloc_hook (void *, size_t, const void *);
-  static void * my_memalign_hook (size_t, size_t, const void *);
-
-  // Store the old hooks just in case.
-  static void * (*old_malloc_hook) (size_t, const void *);
-  static void   (*old_free_hook) (void *, const void *);
-  static void * (*old_realloc_hook)(void *ptr, size_t size, const void *caller);
-  static void * (*old_memalign_hook)(size_t alignment, size_t size, const void *caller);
-
-// From GNU libc 2.14 this macro is defined, to declare
-// hook variables as volatile. Define it as empty for
-// older glibc versions
-#ifndef __MALLOC_HOOK_VOLATILE
- #define __MALLOC_HOOK_VOLATILE
-#endif
+  // Optional: returns memory aligned to the given power of two,
+  // which can be passed to xxfree. Without it, memalign may return a
+  // pointer into a bigger object, so define it unless xxfree takes
+  // such pointers.
+  void * xxmemalign (size_t, size_t) __attribute__((weak));
 
-  void (*__MALLOC_HOOK_VOLATILE __malloc_initialize_hook) (void) = my_init_hook;
+  // Optional: gives unused memory back to the OS, up to about the
+  // given number of bytes (as a Heap Layers heap's purge does), and
+  // returns how much went.
+  size_t xxmalloc_purge (size_t) __attribute__((weak));
 
-  static void my_init_hook (void) {
-    if (!initialized) {
-      // Store the old hooks.
-      old_malloc_hook = __malloc_hook;
-      old_free_hook = __free_hook;
-      old_realloc_hook = __realloc_hook;
-      old_memalign_hook = __memalign_hook;
-      
-      // Point the hooks to the replacement functions.
-      __malloc_hook = my_malloc_hook;
-      __free_hook = my_free_hook;
-      __realloc_hook = my_realloc_hook;
-      __memalign_hook = my_memalign_hook;
+  // Optional: sets [*start, *end) to the allocated object that the
+  // pointer points into, or returns zero if there is none.
+  int xxmalloc_object_bounds (void *, void **, void **) __attribute__((weak));
 
-      // Set up everything so that fork behaves properly.
-      pthread_atfork(xxmalloc_lock, xxmalloc_unlock, xxmalloc_unlock);
+  // Optional: returns the usable size that xxmalloc would give an
+  // object of the given size (its size class), without allocating.
+  size_t xxmalloc_good_size (size_t) __attribute__((weak));
 
-      initialized = true;
+  // Optional: allocates as xxmalloc does, and sets *actual to the
+  // object's usable size.
+  void * xxmalloc_sized (size_t, size_t *) __attribute__((weak));
 
-    }
+  // Optional: allocates n objects of the given sizes into the array,
+  // contiguously, returning non-zero, or allocates none and returns
+  // zero.
+  int xxmalloc_comalloc (size_t, const size_t *, void **) __attribute__((weak));
+
+}
+
+#if GNUWRAPPER_THREAD_CACHE
+#include "wrappers/xxthreadcache.h"
+// Everything below allocates and frees through the cache.
+#define xxmalloc(sz)  HL::XXThreadCache<>::malloc (sz)
+#define xxfree(ptr)   HL::XXThreadCache<>::free (ptr)
+#endif
 
+#if GNUWRAPPER_PRESSURE_MONITOR
+#include "wrappers/pressuremonitor.h"
+
+static size_t gnuwrapper_release (size_t budget) {
+  return xxmalloc_purge (budget);
+}
+#endif
+
+// The exception specifications of operator new and delete, which
+// C++11 changed.
+#if __cplusplus >= 201103L
+#define GNUWRAPPER_THROW_BAD_ALLOC
+#define GNUWRAPPER_NOTHROW noexcept
+#else
+#define GNUWRAPPER_THROW_BAD_ALLOC throw (std::bad_alloc)
+#define GNUWRAPPER_NOTHROW throw ()
+#endif
+
+// Set up everything so that fork behaves properly.
+static void __attribute__((constructor)) gnuwrapper_init (void) {
+  pthread_atfork (xxmalloc_lock, xxmalloc_unlock, xxmalloc_unlock);
+#if GNUWRAPPER_PRESSURE_MONITOR
+  if (xxmalloc_purge) {
+    HL::PressureMonitor::start (gnuwrapper_release);
   }
+#endif
+}
 
-  static void * my_malloc_hook (size_t size, const void *) {
-    return xxmalloc(size);
+static void * gnuwrapper_realloc (void * ptr, size_t sz) {
+  // NULL ptr = malloc.
+  if (ptr == NULL) {
+    return xxmalloc(sz);
   }
 
-  static void my_free_hook (void * ptr, const void *) {
-    xxfree(ptr);
+  if (sz == 0) {
+    // For POSIX, don't return anything.
+    xxfree (ptr);
+    return NULL;
   }
 
-  static void * my_realloc_hook (void * ptr, size_t sz, const void *) {
-    // NULL ptr = malloc.
-    if (ptr == NULL) {
-      return xxmalloc(sz);
-    }
+  size_t objSize = xxmalloc_usable_size(ptr);
 
-    if (sz == 0) {
-      xxfree (ptr);
-#if defined(__APPLE__)
-      // 0 size = free. We return a small object.  This behavior is
-      // apparently required under Mac OS X and optional under POSIX.
-      return xxmalloc(1);
-#else
-      // For POSIX, don't return anything.
-      return NULL;
-#endif
-    }
+  void * buf = xxmalloc(sz);
 
-    size_t objSize = xxmalloc_usable_size(ptr);
+  if (buf != NULL) {
+    // Successful malloc.
+    // Copy the contents of the original object
+    // up to the size of the new block.
+    size_t minSize = (objSize < sz) ? objSize : sz;
+    HL::StreamingCopy::copy (buf, ptr, minSize);
+    xxfree (ptr);
+  }
 
-#if 0
-    // Custom logic here to ensure we only do a logarithmic number of
-    // reallocations (with a constant space overhead).
+  // Return a pointer to the new one.
+  return buf;
+}
 
-    // Don't change size if the object is shrinking by less than half.
-    if ((objSize / 2 < sz) && (sz <= objSize)) {
-      // Do nothing.
-      return ptr;
-    }
-    // If the object is growing by less than 2X, double it.
-    if ((objSize < sz) && (sz < objSize * 2)) {
-      sz = objSize * 2;
+static void * gnuwrapper_memalign (size_t alignment, size_t size) {
+  // Check for non power-of-two alignment.
+  if ((alignment == 0) ||
+      (alignment & (alignment - 1)))
+    {
+      errno = EINVAL;
+      return NULL;
     }
-#endif
 
-    void * buf = xxmalloc(sz);
+  if (xxmemalign) {
+    return xxmemalign (alignment, size);
+  }
 
-    if (buf != NULL) {
-      // Successful malloc.
-      // Copy the contents of the original object
-      // up to the size of the new block.
-      size_t minSize = (objSize < sz) ? objSize : sz;
-      memcpy (buf, ptr, minSize);
-      xxfree (ptr);
-    }
+  // Try to just allocate an object of the requested size.
+  // If it happens to be aligned properly, just return it.
+  void * ptr = xxmalloc (size);
+  if (((size_t) ptr & (alignment - 1)) == 0) {
+    // It is already aligned just fine; return it.
+    return ptr;
+  }
 
-    // Return a pointer to the new one.
-    return buf;
+  // It was not aligned as requested: free the object.
+  xxfree (ptr);
+
+  // Now get a big chunk of memory and align the object within it.
+  // NOTE: this REQUIRES that the underlying allocator be able
+  // to free the aligned object, or ignore the free request.
+  void * buf = xxmalloc (2 * alignment + size);
+  if (buf == NULL) {
+    return NULL;
   }
+  void * alignedPtr = (void *) (((size_t) buf + alignment - 1) & ~(alignment - 1));
 
-  static void * my_memalign_hook (size_t size, size_t alignment, const void *) {
-    // Check for non power-of-two alignment, or mistake in size.
-    if ((alignment == 0) ||
-	(alignment & (alignment - 1)))
-      {
-	return NULL;
-      }
+  return alignedPtr;
+}
 
-    // Try to just allocate an object of the requested size.
-    // If it happens to be aligned properly, just return it.
-    void * ptr = xxmalloc (size);
-    if (((size_t) ptr & (alignment - 1)) == (size_t) ptr) {
-      // It is already aligned just fine; return it.
-      return ptr;
-    }
+extern "C" {
+
+  //// DIRECT REPLACEMENTS FOR MALLOC FAMILY.
+
+  void * malloc (size_t sz) __THROW {
+    return xxmalloc (sz);
+  }
 
-    // It was not aligned as requested: free the object.
+  void free (void * ptr) __THROW {
     xxfree (ptr);
+  }
 
-    // Now get a big chunk of memory and align the object within it.
-    // NOTE: this REQUIRES that the underlying allocator be able
-    // to free the aligned object, or ignore the free request.
-    void * buf = xxmalloc (2 * alignment + size);
-    void * alignedPtr = (void *) (((size_t) buf + alignment - 1) & ~(alignment - 1));
+  void cfree (void * ptr) __THROW {
+    xxfree (ptr);
+  }
 
-    return alignedPtr;
+  void * calloc (size_t nelem, size_t elsize) __THROW {
+    size_t n = nelem * elsize;
+    // Check for overflow.
+    if ((elsize != 0) && (n / elsize != nelem)) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    void * ptr = xxmalloc (n);
+    if (ptr != NULL) {
+      HL::StreamingCopy::zero (ptr, n);
+    }
+    return ptr;
   }
 
-  ////// END OF HOOK FUNCTIONS
+  void * realloc (void * ptr, size_t sz) __THROW {
+    return gnuwrapper_realloc (ptr, sz);
+  }
 
-  // This is here because, for some reason, the GNU hooks don't
-  // necessarily replace all memory operations as they should.
+  void * reallocarray (void * ptr, size_t nelem, size_t elsize) __THROW {
+    size_t n = nelem * elsize;
+    // Check for overflow.
+    if ((elsize != 0) && (n / elsize != nelem)) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    return gnuwrapper_realloc (ptr, n);
+  }
+
+  void * memalign (size_t alignment, size_t sz) __THROW {
+    return gnuwrapper_memalign (alignment, sz);
+  }
+
+  void * aligned_alloc (size_t alignment, size_t sz) __THROW {
+    return gnuwrapper_memalign (alignment, sz);
+  }
 
-  int posix_memalign (void **memptr, size_t alignment, size_t size) throw()
+  int posix_memalign (void **memptr, size_t alignment, size_t size) __THROW
   {
-    if (!initialized) {
-      my_init_hook();
-    }
     // Check for non power-of-two alignment.
     if ((alignment == 0) ||
-	(alignment & (alignment - 1)))
+	(alignment & (alignment - 1)) ||
+	(alignment % sizeof(void *) != 0))
       {
 	return EINVAL;
       }
-    void * ptr = my_memalign_hook (size, alignment, NULL);
+    void * ptr = gnuwrapper_memalign (alignment, size);
     if (!ptr) {
       return ENOMEM;
     } else {
@@ -212,90 +274,153 @@ extern "C" {
     }
   }
 
-  //// DIRECT REPLACEMENTS FOR MALLOC FAMILY.
-
-  size_t malloc_usable_size (void * ptr) throw() {
-    return xxmalloc_usable_size (ptr);
+  void * valloc (size_t sz) __THROW {
+    return gnuwrapper_memalign (HL::CPUInfo::PageSize, sz);
   }
 
-  int mallopt (int param, int value) throw() {
-    // NOP.
-    param = param;
-    value = value;
-    return 1; // success.
+  void * pvalloc (size_t sz) __THROW {
+    return valloc ((sz + HL::CPUInfo::PageSize - 1) & ~(HL::CPUInfo::PageSize - 1));
   }
 
-  int malloc_trim (size_t pad) throw() {
-    // NOP.
-    pad = pad;
-    return 0; // no memory returned to OS.
+  size_t malloc_usable_size (void * ptr) __THROW {
+    if (ptr == NULL) {
+      return 0;
+    }
+    return xxmalloc_usable_size (ptr);
   }
 
-  void malloc_stats (void) throw() {
-    // NOP.
+  size_t malloc_size (void * p) {
+    return xxmalloc_usable_size (p);
   }
 
-  void * malloc_get_state (void) throw() {
-    return NULL; // always returns "error".
+  // The usable size malloc (sz) would return, so that a growing buffer
+  // can use the whole size class (as on Darwin). Without the hook,
+  // just sz.
+  size_t malloc_good_size (size_t sz) __THROW {
+    if (xxmalloc_good_size) {
+      return xxmalloc_good_size (sz);
+    }
+    return sz;
   }
 
-  int malloc_set_state (void * ptr) throw() {
-    ptr = ptr;
-    return 0; // success.
+  // malloc, also setting *actual to the usable size of the object.
+  void * malloc_sized (size_t sz, size_t * actual) __THROW {
+#if !GNUWRAPPER_THREAD_CACHE
+    if (xxmalloc_sized) {
+      return xxmalloc_sized (sz, actual);
+    }
+#endif
+    void * ptr = xxmalloc (sz);
+    if (ptr != NULL) {
+      *actual = xxmalloc_usable_size (ptr);
+    }
+    return ptr;
   }
 
-  struct mallinfo mallinfo(void) throw() {
-    // For now, we return useless stats.
-    struct mallinfo m;
-    m.arena = 0;
-    m.ordblks = 0;
-    m.smblks = 0;
-    m.hblks = 0;
-    m.hblkhd = 0;
-    m.usmblks = 0;
-    m.fsmblks = 0;
-    m.uordblks = 0;
-    m.fordblks = 0;
-    m.keepcost = 0;
-    return m;
+  // dlmalloc's co-allocation: n objects of the given sizes, each
+  // freed on its own, carved out of one block if the allocator has
+  // xxmalloc_comalloc. With chunks NULL, the array is allocated too.
+  void ** independent_comalloc (size_t n, size_t * sizes, void ** chunks) __THROW {
+    void ** ptrs = chunks;
+    if (ptrs == NULL) {
+      if (n > (size_t) -1 / sizeof(void *)) {
+	return NULL;
+      }
+      ptrs = (void **) xxmalloc (n * sizeof(void *));
+      if (ptrs == NULL) {
+	return NULL;
+      }
+    }
+    if (xxmalloc_comalloc) {
+      if (xxmalloc_comalloc (n, sizes, ptrs)) {
+	return ptrs;
+      }
+    } else {
+      size_t i;
+      for (i = 0; i < n; i++) {
+	ptrs[i] = xxmalloc (sizes[i]);
+	if (ptrs[i] == NULL) {
+	  break;
+	}
+      }
+      if (i == n) {
+	return ptrs;
+      }
+      while (i > 0) {
+	xxfree (ptrs[--i]);
+      }
+    }
+    if (chunks == NULL) {
+      xxfree (ptrs);
+    }
+    return NULL;
   }
 
-  void * malloc (size_t sz) throw () {
-    return xxmalloc (sz);
-  }
+  // glibc's own names for its allocator.
 
-  void free (void * ptr) throw() {
-    xxfree (ptr);
+#if __GNUC__ >= 9
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-attributes"
+#endif
+  void * __libc_malloc (size_t) __attribute__((alias ("malloc")));
+  void   __libc_free (void *) __attribute__((alias ("free")));
+  void   __libc_cfree (void *) __attribute__((alias ("cfree")));
+  void * __libc_calloc (size_t, size_t) __attribute__((alias ("calloc")));
+  void * __libc_realloc (void *, size_t) __attribute__((alias ("realloc")));
+  void * __libc_memalign (size_t, size_t) __attribute__((alias ("memalign")));
+  void * __libc_valloc (size_t) __attribute__((alias ("valloc")));
+  void * __libc_pvalloc (size_t) __attribute__((alias ("pvalloc")));
+  int    __posix_memalign (void **, size_t, size_t) __attribute__((alias ("posix_memalign")));
+#if __GNUC__ >= 9
+#pragma GCC diagnostic pop
+#endif
+
+  int mallopt (int, int) __THROW {
+    // NOP.
+    return 1; // success.
   }
 
-  void * realloc (void * ptr, size_t sz) throw () {
-    return my_realloc_hook (ptr, sz, NULL);
+  int malloc_trim (size_t) __THROW {
+#if GNUWRAPPER_THREAD_CACHE
+    HL::XXThreadCache<>::flush();
+#endif
+    if (xxmalloc_purge) {
+      return (xxmalloc_purge ((size_t) -1) > 0);
+    }
+    return 0; // no memory returned to OS.
   }
 
-  void * memalign (size_t sz, size_t alignment) throw() {
-    return my_memalign_hook (sz, alignment, NULL);
+  void malloc_stats (void) __THROW {
+    // NOP.
   }
 
-  void cfree (void * ptr) throw () {
-    xxfree (ptr);
+  void * malloc_get_state (void) __THROW {
+    return NULL; // always returns "error".
   }
 
-  size_t malloc_size (void * p) {
-    return xxmalloc_usable_size (p);
+  int malloc_set_state (void *) __THROW {
+    return 0; // success.
   }
 
-  void * valloc (size_t sz) throw() {
-    return my_memalign_hook (sz, HL::CPUInfo::PageSize, NULL);
+  struct mallinfo mallinfo (void) __THROW {
+    // For now, we return useless stats.
+    struct mallinfo m;
+    memset (&m, 0, sizeof(m));
+    return m;
   }
 
-  void * pvalloc (size_t sz) throw() {
-    return valloc ((sz + HL::CPUInfo::PageSize - 1) & ~(HL::CPUInfo::PageSize - 1));
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mallinfo2 (void) __THROW {
+    struct mallinfo2 m;
+    memset (&m, 0, sizeof(m));
+    return m;
   }
+#endif
 
 }
 
 
-void * operator new (size_t sz) throw (std::bad_alloc)
+void * operator new (size_t sz) GNUWRAPPER_THROW_BAD_ALLOC
 {
   void * ptr = xxmalloc (sz);
   if (ptr == NULL) {
@@ -305,18 +430,16 @@ void * operator new (size_t sz) throw (std::bad_alloc)
   }
 }
 
-void operator delete (void * ptr)
-  throw ()
+void operator delete (void * ptr) GNUWRAPPER_NOTHROW
 {
   xxfree (ptr);
 }
 
-void * operator new (size_t sz, const std::nothrow_t&) throw() {
+void * operator new (size_t sz, const std::nothrow_t&) GNUWRAPPER_NOTHROW {
   return xxmalloc(sz);
-} 
+}
 
-void * operator new[] (size_t size) 
-  throw (std::bad_alloc)
+void * operator new[] (size_t size) GNUWRAPPER_THROW_BAD_ALLOC
 {
   void * ptr = xxmalloc(size);
   if (ptr == NULL) {
@@ -326,16 +449,25 @@ void * operator new[] (size_t size)
   }
 }
 
-void * operator new[] (size_t sz, const std::nothrow_t&)
-  throw()
+void * operator new[] (size_t sz, const std::nothrow_t&) GNUWRAPPER_NOTHROW
  {
   return xxmalloc(sz);
-} 
+}
 
-void operator delete[] (void * ptr)
-  throw ()
+void operator delete[] (void * ptr) GNUWRAPPER_NOTHROW
 {
   xxfree (ptr);
 }
 
+#if __cplusplus >= 201402L
+// Sized deallocation (C++14).
+void operator delete (void * ptr, size_t) GNUWRAPPER_NOTHROW
+{
+  xxfree (ptr);
+}
 
+void operator delete[] (void * ptr, size_t) GNUWRAPPER_NOTHROW
+{
+  xxfree (ptr);
+}
+#endif
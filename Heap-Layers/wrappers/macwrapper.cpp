@@ -16,6 +16,7 @@
 #include <string.h>
 #include <malloc/malloc.h>
 #include <errno.h>
+#include <new>
 
 /*
   To use this library,
@@ -26,6 +27,9 @@
   - xxmalloc_usable_size
   - xxmalloc_lock
   - xxmalloc_unlock
+
+  and, optionally, xxmalloc_batch and xxfree_batch (the defaults
+  below just loop over xxmalloc and xxfree), and xxmalloc_good_size.
   
   See the extern "C" block below for function prototypes and more
   details. YOU SHOULD NOT NEED TO MODIFY ANY OF THE CODE HERE TO
@@ -44,6 +48,11 @@
     required by programs that also call fork(). In case your program
     does not, the lock and unlock calls given below can be no-ops.
 
+  Zones made with malloc_create_zone do not use the allocator: each
+  gets a MacZoneHeap of its own (see maczoneheap.h), which
+  malloc_destroy_zone releases whole, and free finds through a page
+  map. Aligned requests (valloc, memalign) still go to the allocator.
+
 */
 
 
@@ -63,9 +72,25 @@ extern "C" {
   // Unlocks the heap(s), after fork().
   void xxmalloc_unlock (void);
 
+  // Optional: allocates up to num objects of sz bytes into results,
+  // returning how many it got, and frees num objects at once (NULL
+  // entries included, as xxfree). malloc_zone_batch_malloc and
+  // malloc_zone_batch_free, which CoreFoundation and the Objective-C
+  // runtime call heavily, go straight to these. Heaps built from Heap
+  // Layers can forward to mallocBatch and freeBatch (see BatchHeap),
+  // which take a lock once per batch.
+  unsigned xxmalloc_batch (size_t sz, void ** results, unsigned num);
+  void     xxfree_batch (void ** ptrs, unsigned num);
+
+  // Optional: returns the usable size an object of sz bytes would
+  // get, for malloc_good_size. The default below allocates one and
+  // looks; heaps built from Heap Layers can forward to goodSize.
+  size_t   xxmalloc_good_size (size_t sz);
+
 }
 
 #include "macinterpose.h"
+#include "heaplayers.h"
 
 //////////
 //////////
@@ -74,54 +99,130 @@ extern "C" {
 
 #define MACWRAPPER_PREFIX(n) macwrapper_##n
 
+// A zone made by malloc_create_zone, and the heap behind it. The
+// zone comes first, so the malloc_zone_t * callers hold converts back.
+
+struct MacZone {
+  MacZone (void)
+    : heap (this),
+      next (NULL)
+  {}
+
+  malloc_zone_t zone;
+  HL::MacZoneHeap heap;
+  MacZone * next;
+};
+
+// All the zones made and not yet destroyed.
+static MacZone * theZones = NULL;
+static HL::SpinLockType theZonesLock;
+
+// Until a zone is made, no object can be in one.
+static volatile bool anyZoneCreated = false;
+
+static inline MacZone * zoneOf (const void * ptr) {
+  if (!anyZoneCreated) {
+    return NULL;
+  }
+  return (MacZone *) HL::MacZoneHeap::ownerOf (ptr);
+}
+
 extern "C" {
 
-  void * MACWRAPPER_PREFIX(malloc) (size_t sz) {
-#if defined(__APPLE__)
-    // Mac OS ABI requires 16-byte alignment, so we round up the size
-    // to the next multiple of 16.
+  // Mac OS ABI requires 16-byte alignment, so we round up the size
+  // to the next multiple of 16.
+  static inline size_t MACWRAPPER_PREFIX(round_size) (size_t sz) {
     if (sz < 16) {
       sz = 16;
     }
     if (sz % 16 != 0) {
       sz += 16 - (sz % 16);
     }
-#endif
-    void * ptr = xxmalloc(sz);
+    return sz;
+  }
+
+  void * MACWRAPPER_PREFIX(malloc) (size_t sz) {
+    void * ptr = xxmalloc(MACWRAPPER_PREFIX(round_size)(sz));
     return ptr;
   }
 
+  // Weak defaults, for allocators that do not batch.
+
+  __attribute__((weak))
+  unsigned xxmalloc_batch (size_t sz, void ** results, unsigned num) {
+    for (unsigned i = 0; i < num; i++) {
+      results[i] = xxmalloc (sz);
+      if (results[i] == NULL) {
+	return i;
+      }
+    }
+    return num;
+  }
+
+  __attribute__((weak))
+  void xxfree_batch (void ** ptrs, unsigned num) {
+    for (unsigned i = 0; i < num; i++) {
+      xxfree (ptrs[i]);
+    }
+  }
+
+  __attribute__((weak))
+  size_t xxmalloc_good_size (size_t sz) {
+    void * ptr = xxmalloc (sz);
+    if (ptr == NULL) {
+      return sz;
+    }
+    size_t objSize = xxmalloc_usable_size (ptr);
+    xxfree (ptr);
+    return objSize;
+  }
+
   size_t MACWRAPPER_PREFIX(malloc_usable_size) (void * ptr) {
     if (ptr == NULL) {
       return 0;
     }
+    MacZone * z = zoneOf (ptr);
+    if (z != NULL) {
+      return z->heap.getSize (ptr);
+    }
     size_t objSize = xxmalloc_usable_size (ptr);
     return objSize;
   }
 
   void   MACWRAPPER_PREFIX(free) (void * ptr) {
+    MacZone * z = zoneOf (ptr);
+    if (z != NULL) {
+      z->heap.free (ptr);
+      return;
+    }
     xxfree (ptr);
   }
 
+  // Allocates from the given zone's heap, or from ours if it is NULL.
+  static inline void * _zone_malloc (MacZone * z, size_t sz) {
+    if (z == NULL) {
+      return MACWRAPPER_PREFIX(malloc)(sz);
+    }
+    return z->heap.malloc (sz);
+  }
+
   size_t MACWRAPPER_PREFIX(malloc_good_size) (size_t sz) {
-    void * ptr = MACWRAPPER_PREFIX(malloc)(sz);
-    size_t objSize = MACWRAPPER_PREFIX(malloc_usable_size)(ptr);
-    MACWRAPPER_PREFIX(free)(ptr);
-    return objSize;
+    return xxmalloc_good_size (MACWRAPPER_PREFIX(round_size)(sz));
   }
 
-  static void * _extended_realloc (void * ptr, size_t sz, bool isReallocf) 
+  // Any new object comes from zone z (NULL meaning our heap).
+  static void * _extended_realloc (MacZone * z, void * ptr, size_t sz, bool isReallocf) 
   {
     // NULL ptr = malloc.
     if (ptr == NULL) {
-      return MACWRAPPER_PREFIX(malloc)(sz);
+      return _zone_malloc (z, sz);
     }
 
     // 0 size = free. We return a small object.  This behavior is
     // apparently required under Mac OS X and optional under POSIX.
     if (sz == 0) {
       MACWRAPPER_PREFIX(free)(ptr);
-      return MACWRAPPER_PREFIX(malloc)(1);
+      return _zone_malloc (z, 1);
     }
 
     size_t objSize = MACWRAPPER_PREFIX(malloc_usable_size)(ptr);
@@ -141,14 +242,14 @@ extern "C" {
     }
 #endif
 
-    void * buf = MACWRAPPER_PREFIX(malloc)((size_t) (sz));
+    void * buf = _zone_malloc (z, sz);
 
     if (buf != NULL) {
       // Successful malloc.
       // Copy the contents of the original object
       // up to the size of the new block.
       size_t minSize = (objSize < sz) ? objSize : sz;
-      memcpy (buf, ptr, minSize);
+      HL::StreamingCopy::copy (buf, ptr, minSize);
       MACWRAPPER_PREFIX(free) (ptr);
     } else {
       if (isReallocf) {
@@ -162,12 +263,14 @@ extern "C" {
     return buf;
   }
 
+  // An object stays in the zone it was allocated from.
+
   void * MACWRAPPER_PREFIX(realloc) (void * ptr, size_t sz) {
-    return _extended_realloc (ptr, sz, false);
+    return _extended_realloc (zoneOf (ptr), ptr, sz, false);
   }
 
   void * MACWRAPPER_PREFIX(reallocf) (void * ptr, size_t sz) {
-    return _extended_realloc (ptr, sz, true);
+    return _extended_realloc (zoneOf (ptr), ptr, sz, true);
   }
 
   void * MACWRAPPER_PREFIX(calloc) (size_t elsize, size_t nelems) {
@@ -177,7 +280,7 @@ extern "C" {
     }
     void * ptr = MACWRAPPER_PREFIX(malloc) (n);
     if (ptr) {
-      memset (ptr, 0, n);
+      HL::StreamingCopy::zero (ptr, n);
     }
     return ptr;
   }
@@ -274,27 +377,46 @@ static malloc_zone_t theDefaultZone;
 
 extern "C" {
 
-  unsigned MACWRAPPER_PREFIX(malloc_zone_batch_malloc)(malloc_zone_t *,
+  // The size function of the zones we make, which is also how we tell
+  // them from any others: 0 for objects that are not in the zone.
+  size_t MACWRAPPER_PREFIX(created_zone_size) (malloc_zone_t * zone, const void * ptr) {
+    MacZone * z = zoneOf (ptr);
+    if ((z == NULL) || (&z->zone != zone)) {
+      return 0;
+    }
+    return z->heap.getSize ((void *) ptr);
+  }
+
+  // The zone, if it is one we made, or NULL.
+  static inline MacZone * createdZone (malloc_zone_t * zone) {
+    if ((zone == NULL) || (zone->size != MACWRAPPER_PREFIX(created_zone_size))) {
+      return NULL;
+    }
+    return (MacZone *) zone;
+  }
+
+  unsigned MACWRAPPER_PREFIX(malloc_zone_batch_malloc)(malloc_zone_t * zone,
 						       size_t sz,
 						       void ** results,
 						       unsigned num_requested)
   {
-    for (unsigned i = 0; i < num_requested; i++) {
-      results[i] = MACWRAPPER_PREFIX(malloc)(sz);
-      if (results[i] == NULL) {
-	return i;
-      }
+    MacZone * z = createdZone (zone);
+    if (z != NULL) {
+      return z->heap.mallocBatch (sz, num_requested, results);
     }
-    return num_requested;
+    return xxmalloc_batch (MACWRAPPER_PREFIX(round_size)(sz), results, num_requested);
   }
 
-  void MACWRAPPER_PREFIX(malloc_zone_batch_free)(malloc_zone_t *,
+  void MACWRAPPER_PREFIX(malloc_zone_batch_free)(malloc_zone_t * zone,
 						 void ** to_be_freed,
 						 unsigned num)
   {
-    for (unsigned i = 0; i < num; i++) {
-      MACWRAPPER_PREFIX(free)(to_be_freed[i]);
+    MacZone * z = createdZone (zone);
+    if (z != NULL) {
+      z->heap.freeBatch (to_be_freed, num);
+      return;
     }
+    xxfree_batch (to_be_freed, num);
   }
 
   bool MACWRAPPER_PREFIX(malloc_zone_check)(malloc_zone_t *) {
@@ -310,37 +432,100 @@ extern "C" {
     // Do nothing.
   }
 
-  const char * MACWRAPPER_PREFIX(malloc_get_zone_name)(malloc_zone_t *) {
+  const char * MACWRAPPER_PREFIX(malloc_get_zone_name)(malloc_zone_t * zone) {
+    if (createdZone (zone) != NULL) {
+      return zone->zone_name;
+    }
     return theDefaultZone.zone_name;
   }
 
-  void MACWRAPPER_PREFIX(malloc_set_zone_name)(malloc_zone_t *, const char *) {
-    // do nothing.
+  void MACWRAPPER_PREFIX(malloc_set_zone_name)(malloc_zone_t * zone, const char * name) {
+    // Only the zones we make can be renamed; the copy lives (and
+    // dies) in the zone's own heap.
+    MacZone * z = createdZone (zone);
+    if ((z == NULL) || (name == NULL)) {
+      return;
+    }
+    size_t len = strlen (name) + 1;
+    char * copy = (char *) z->heap.malloc (len);
+    if (copy == NULL) {
+      return;
+    }
+    memcpy (copy, name, len);
+    if (zone->zone_name != NULL) {
+      z->heap.free ((void *) zone->zone_name);
+    }
+    zone->zone_name = copy;
   }
 
   malloc_zone_t * MACWRAPPER_PREFIX(malloc_create_zone)(vm_size_t,
 							unsigned)
   {
-    return &theDefaultZone;
+    void * buf = HL::MmapWrapper::map (sizeof(MacZone));
+    if (buf == NULL) {
+      return NULL;
+    }
+    MacZone * z = new (buf) MacZone;
+    z->zone = theDefaultZone;
+    z->zone.size = MACWRAPPER_PREFIX(created_zone_size);
+    z->zone.zone_name = NULL;
+    theZonesLock.lock();
+    z->next = theZones;
+    theZones = z;
+    anyZoneCreated = true;
+    theZonesLock.unlock();
+    return &z->zone;
   }
   
   void * MACWRAPPER_PREFIX(malloc_default_zone) (void) {
     return (void *) &theDefaultZone;
   }
 
-  void MACWRAPPER_PREFIX(malloc_destroy_zone) (malloc_zone_t *) {
-    // Do nothing.
+  void MACWRAPPER_PREFIX(malloc_destroy_zone) (malloc_zone_t * zone) {
+    // Releases every object in the zone at once.
+    MacZone * z = createdZone (zone);
+    if (z == NULL) {
+      return;
+    }
+    theZonesLock.lock();
+    MacZone ** prev = &theZones;
+    while ((*prev != NULL) && (*prev != z)) {
+      prev = &(*prev)->next;
+    }
+    if (*prev != NULL) {
+      *prev = z->next;
+    }
+    theZonesLock.unlock();
+    z->~MacZone();
+    HL::MmapWrapper::unmap (z, sizeof(MacZone));
   }
   
-  malloc_zone_t * MACWRAPPER_PREFIX(malloc_zone_from_ptr) (const void *) {
-    return NULL;
+  malloc_zone_t * MACWRAPPER_PREFIX(malloc_zone_from_ptr) (const void * ptr) {
+    MacZone * z = zoneOf (ptr);
+    if (z == NULL) {
+      return NULL;
+    }
+    return &z->zone;
   }
   
-  void * MACWRAPPER_PREFIX(malloc_zone_malloc) (malloc_zone_t *, size_t size) {
+  void * MACWRAPPER_PREFIX(malloc_zone_malloc) (malloc_zone_t * zone, size_t size) {
+    MacZone * z = createdZone (zone);
+    if (z != NULL) {
+      return z->heap.malloc (size);
+    }
     return MACWRAPPER_PREFIX(malloc) (size);
   }
   
-  void * MACWRAPPER_PREFIX(malloc_zone_calloc) (malloc_zone_t *, size_t n, size_t size) {
+  void * MACWRAPPER_PREFIX(malloc_zone_calloc) (malloc_zone_t * zone, size_t n, size_t size) {
+    MacZone * z = createdZone (zone);
+    if (z != NULL) {
+      size_t sz = n * size;
+      void * ptr = z->heap.malloc (sz);
+      if (ptr) {
+	memset (ptr, 0, sz);
+      }
+      return ptr;
+    }
     return MACWRAPPER_PREFIX(calloc) (n, size);
   }
   
@@ -348,8 +533,8 @@ extern "C" {
     return MACWRAPPER_PREFIX(valloc) (size);
   }
   
-  void * MACWRAPPER_PREFIX(malloc_zone_realloc) (malloc_zone_t *, void * ptr, size_t size) {
-    return MACWRAPPER_PREFIX(realloc) (ptr, size);
+  void * MACWRAPPER_PREFIX(malloc_zone_realloc) (malloc_zone_t * zone, void * ptr, size_t size) {
+    return _extended_realloc (createdZone (zone), ptr, size, false);
   }
   
   void * MACWRAPPER_PREFIX(malloc_zone_memalign) (malloc_zone_t *, size_t alignment, size_t size) {
@@ -378,19 +563,34 @@ extern "C" {
     return MACWRAPPER_PREFIX(malloc_usable_size)((void *) ptr);
   }
 
+  // The zones we made are locked along with the allocator.
+
+  static void unlockZones (void) {
+    for (MacZone * z = theZones; z != NULL; z = z->next) {
+      z->heap.unlock();
+    }
+    theZonesLock.unlock();
+  }
+
   void MACWRAPPER_PREFIX(_malloc_fork_prepare)(void) {
     /* Prepare the malloc module for a fork by insuring that no thread is in a malloc critical section */
+    theZonesLock.lock();
+    for (MacZone * z = theZones; z != NULL; z = z->next) {
+      z->heap.lock();
+    }
     xxmalloc_lock();
   }
 
   void MACWRAPPER_PREFIX(_malloc_fork_parent)(void) {
     /* Called in the parent process after a fork() to resume normal operation. */
     xxmalloc_unlock();
+    unlockZones();
   }
 
   void MACWRAPPER_PREFIX(_malloc_fork_child)(void) {
     /* Called in the child process after a fork() to resume normal operation.  In the MTASK case we also have to change memory inheritance so that the child does not share memory with the parent. */
     xxmalloc_unlock();
+    unlockZones();
   }
 
 }
@@ -472,8 +672,8 @@ public:
     theDefaultZone.realloc = MACWRAPPER_PREFIX(malloc_zone_realloc);
     theDefaultZone.size    = MACWRAPPER_PREFIX(internal_malloc_zone_size);
     theDefaultZone.zone_name = theOneTrueZoneName;
-    theDefaultZone.batch_malloc = NULL;
-    theDefaultZone.batch_free   = NULL;
+    theDefaultZone.batch_malloc = MACWRAPPER_PREFIX(malloc_zone_batch_malloc);
+    theDefaultZone.batch_free   = MACWRAPPER_PREFIX(malloc_zone_batch_free);
     theDefaultZone.introspect   = NULL;
     theDefaultZone.memalign     = NULL;
     theDefaultZone.free_definite_size = NULL;
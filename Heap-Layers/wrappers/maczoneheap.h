@@ -0,0 +1,268 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_MACZONEHEAP_H
+#define HL_MACZONEHEAP_H
+
+#if defined(_WIN32)
+#error "This functionality currently is not implemented for Windows."
+#endif
+
+#include <stddef.h>
+
+#include "heaps/special/zoneheap.h"
+#include "locks/spinlock.h"
+#include "utility/freesllist.h"
+#include "utility/guard.h"
+#include "utility/pagemap.h"
+#include "wrappers/mmapwrapper.h"
+
+/**
+ * @file maczoneheap.h
+ * @brief The heaps behind the zones of malloc_create_zone (see macwrapper.cpp).
+ */
+
+namespace HL {
+
+  /**
+   * @class ZoneChunkHeap
+   * @brief Mappings that are listed, so they can all be released at
+   * once, and entered in a page map under their owner.
+   */
+  class ZoneChunkHeap {
+  public:
+
+    enum { Alignment = 16 };
+
+    ZoneChunkHeap (void)
+      : _owner (NULL),
+	_chunks (NULL)
+    {}
+
+    ~ZoneChunkHeap (void) {
+      while (_chunks != NULL) {
+	free (_chunks + 1);
+      }
+    }
+
+    void setOwner (void * owner) {
+      _owner = owner;
+    }
+
+    void * malloc (size_t sz) {
+      const size_t bytes = MmapWrapper::Size * ((sz + sizeof(Chunk) + MmapWrapper::Size - 1) / MmapWrapper::Size);
+      Chunk * c = (Chunk *) MmapWrapper::map (bytes);
+      if (c == NULL) {
+	return NULL;
+      }
+      if (!owners().setRange (c, bytes, _owner)) {
+	MmapWrapper::unmap (c, bytes);
+	return NULL;
+      }
+      c->bytes = bytes;
+      c->prev = NULL;
+      c->next = _chunks;
+      if (_chunks != NULL) {
+	_chunks->prev = c;
+      }
+      _chunks = c;
+      return c + 1;
+    }
+
+    void free (void * ptr) {
+      Chunk * c = (Chunk *) ptr - 1;
+      if (c->prev != NULL) {
+	c->prev->next = c->next;
+      } else {
+	_chunks = c->next;
+      }
+      if (c->next != NULL) {
+	c->next->prev = c->prev;
+      }
+      owners().setRange (c, c->bytes, NULL);
+      MmapWrapper::unmap (c, c->bytes);
+    }
+
+    size_t getSize (void * ptr) {
+      return ((Chunk *) ptr - 1)->bytes - sizeof(Chunk);
+    }
+
+    /// The owner of the chunk holding ptr, or NULL.
+    static inline void * ownerOf (const void * ptr) {
+      return owners().get (ptr);
+    }
+
+  private:
+
+    struct Chunk {
+      Chunk * prev;
+      Chunk * next;
+      size_t bytes;
+      size_t _pad;		// keeps what follows 16-byte aligned
+    };
+
+    static PageMap<void *>& owners (void) {
+      static PageMap<void *> map;
+      return map;
+    }
+
+    void * _owner;
+    Chunk * _chunks;
+  };
+
+
+  /**
+   * @class MacZoneHeap
+   * @brief The heap of one malloc zone, which can be destroyed whole.
+   *
+   * Objects of up to MaxSmall bytes (with a 16-byte header that holds
+   * their class) come in powers of two, carved from a ZoneHeap arena
+   * and recycled through a free list per class; bigger ones get a
+   * mapping of their own. All the mappings are in one ZoneChunkHeap,
+   * so destroying the heap releases everything in O(chunks), with no
+   * walk over the objects, and ownerOf finds a live object's heap
+   * through the page map. All calls take the heap's lock, the batch
+   * calls once per batch.
+   */
+  class MacZoneHeap {
+  public:
+
+    enum { Alignment = 16 };
+
+    explicit MacZoneHeap (void * owner) {
+      _arena.setOwner (owner);
+    }
+
+    void * malloc (size_t sz) {
+      Guard<SpinLockType> l (_lock);
+      return mallocLocked (sz);
+    }
+
+    void free (void * ptr) {
+      Guard<SpinLockType> l (_lock);
+      freeLocked (ptr);
+    }
+
+    int mallocBatch (size_t sz, int n, void ** ptrs) {
+      Guard<SpinLockType> l (_lock);
+      int i;
+      for (i = 0; i < n; i++) {
+	if ((ptrs[i] = mallocLocked (sz)) == NULL) {
+	  break;
+	}
+      }
+      return i;
+    }
+
+    void freeBatch (void ** ptrs, int n) {
+      Guard<SpinLockType> l (_lock);
+      for (int i = 0; i < n; i++) {
+	freeLocked (ptrs[i]);
+      }
+    }
+
+    size_t getSize (void * ptr) {
+      return ((Header *) ptr - 1)->size - sizeof(Header);
+    }
+
+    /// The owner given to the heap of the object at ptr, or NULL.
+    static inline void * ownerOf (const void * ptr) {
+      return ZoneChunkHeap::ownerOf (ptr);
+    }
+
+    void lock (void) {
+      _lock.lock();
+    }
+
+    void unlock (void) {
+      _lock.unlock();
+    }
+
+  private:
+
+    enum { MinClassBits = 5 };		// 32 bytes, header included
+    enum { NumClasses = 11 };
+    enum { MaxSmall = (1 << (MinClassBits + NumClasses - 1)) };
+    enum { ChunkSize = 256 * 1024 };
+
+    struct Header {
+      size_t size;			// of the block, header included
+      size_t _pad;
+    };
+
+    void * mallocLocked (size_t sz) {
+      const size_t total = sz + sizeof(Header);
+      if (total < sz) {
+	return NULL;
+      }
+      if (total > MaxSmall) {
+	// Big objects get a chunk of their own.
+	Header * h = (Header *) _arena.ZoneChunkHeap::malloc (total);
+	if (h == NULL) {
+	  return NULL;
+	}
+	h->size = total;
+	return h + 1;
+      }
+      int c = 0;
+      while ((size_t) (1 << (MinClassBits + c)) < total) {
+	c++;
+      }
+      Header * h = (Header *) _free[c].get();
+      if (h == NULL) {
+	h = (Header *) _arena.malloc ((size_t) 1 << (MinClassBits + c));
+	if (h == NULL) {
+	  return NULL;
+	}
+      }
+      h->size = (size_t) 1 << (MinClassBits + c);
+      return h + 1;
+    }
+
+    void freeLocked (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      Header * h = (Header *) ptr - 1;
+      if (h->size > MaxSmall) {
+	_arena.ZoneChunkHeap::free (h);
+	return;
+      }
+      int c = 0;
+      while ((size_t) (1 << (MinClassBits + c)) < h->size) {
+	c++;
+      }
+      _free[c].insert (h);
+    }
+
+    SpinLockType _lock;
+    ZoneHeap<ZoneChunkHeap, ChunkSize> _arena;
+    FreeSLList _free[NumClasses];
+  };
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+// -*- C++ -*-
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_MEMORYRESOURCE_H
+#define HL_MEMORYRESOURCE_H
+
+#if (__cplusplus >= 201703L) && defined(__has_include)
+#if __has_include(<memory_resource>)
+
+#include <stddef.h>
+#include <memory_resource>
+#include <new>
+
+#include "utility/heaptraits.h"
+
+/**
+ * @class MemoryResource
+ * @brief Makes a heap a std::pmr::memory_resource (C++17).
+ *
+ * Sizes and alignments go to the heap as they come: alignments the
+ * heap already guarantees (its Alignment) to malloc, bigger ones to
+ * its memalign if it has one, and otherwise to an over-sized object
+ * with the real start kept just below the aligned one. Frees go to
+ * the heap's sized free if it has one. Resources are equal only to
+ * themselves. The heap's own discipline still holds: ZoneHeap ignores
+ * deallocation, and ObstackHeap expects it in LIFO order.
+ *
+ * Example:
+ * <TT>
+ *   MemoryResource<ZoneHeap<MmapHeap, 65536> > arena;<BR>
+ *   std::pmr::vector<int> v (&arena);<BR>
+ * </TT>
+ */
+
+namespace HL {
+
+  template <class SuperHeap>
+  class MemoryResource : public SuperHeap, public std::pmr::memory_resource {
+  public:
+
+    using SuperHeap::SuperHeap;
+
+    MemoryResource (void) {}
+
+  protected:
+
+    void * do_allocate (size_t bytes, size_t alignment) override {
+      if (bytes == 0) {
+	bytes = 1;
+      }
+      void * ptr;
+      if (alignment <= (size_t) MinAlignment) {
+	ptr = SuperHeap::malloc (bytes);
+      } else {
+	ptr = mallocAligned (bytes, alignment, typename HasMemalign<SuperHeap>::type());
+      }
+      if (ptr == NULL) {
+	throw std::bad_alloc();
+      }
+      return ptr;
+    }
+
+    void do_deallocate (void * ptr, size_t bytes, size_t alignment) override {
+      if (bytes == 0) {
+	bytes = 1;
+      }
+      if (alignment <= (size_t) MinAlignment) {
+	freeSized (ptr, bytes, typename HasSizedFree<SuperHeap>::type());
+      } else {
+	freeAligned (ptr, bytes, alignment, typename HasMemalign<SuperHeap>::type());
+      }
+    }
+
+    bool do_is_equal (const std::pmr::memory_resource& other) const noexcept override {
+      return (this == &other);
+    }
+
+  private:
+
+    /// What the heap's malloc already guarantees.
+    enum { MinAlignment = HeapAlignment<SuperHeap>::value };
+
+    void * mallocAligned (size_t bytes, size_t alignment, std::true_type) {
+      return SuperHeap::memalign (alignment, bytes);
+    }
+
+    void * mallocAligned (size_t bytes, size_t alignment, std::false_type) {
+      // Since buf is MinAlignment-aligned and alignment is a bigger
+      // power of two, the aligned pointer leaves a word for buf below
+      // it and still ends within bytes + alignment.
+      if (bytes + alignment < bytes) {
+	return NULL;
+      }
+      char * buf = (char *) SuperHeap::malloc (bytes + alignment);
+      if (buf == NULL) {
+	return NULL;
+      }
+      char * ptr = (char *) (((size_t) buf + sizeof(void *) + alignment - 1) & ~(alignment - 1));
+      ((void **) ptr)[-1] = buf;
+      return ptr;
+    }
+
+    void freeAligned (void * ptr, size_t bytes, size_t, std::true_type) {
+      freeSized (ptr, bytes, typename HasSizedFree<SuperHeap>::type());
+    }
+
+    void freeAligned (void * ptr, size_t bytes, size_t alignment, std::false_type) {
+      freeSized (((void **) ptr)[-1], bytes + alignment, typename HasSizedFree<SuperHeap>::type());
+    }
+
+    void freeSized (void * ptr, size_t sz, std::true_type) {
+      SuperHeap::free (ptr, sz);
+    }
+
+    void freeSized (void * ptr, size_t, std::false_type) {
+      SuperHeap::free (ptr);
+    }
+
+    static_assert ((size_t) MinAlignment >= sizeof(void *),
+		   "MemoryResource needs heaps aligned to at least a pointer.");
+  };
+
+}
+
+#endif
+#endif
+
+#endif
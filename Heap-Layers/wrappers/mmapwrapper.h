@@ -73,20 +73,36 @@ namespace HL {
 #endif
 
 
-    // Release the given range of memory to the OS (without unmapping it).
-    void release (void * ptr, size_t sz) {
-      if ((size_t) ptr % Alignment == 0) {
-	// Extra sanity check in case the superheap's declared alignment is wrong!
+    /// Release the whole pages inside the given range to the OS
+    /// (without unmapping them), returning how many bytes that was.
+    /// The pages stay usable, and read as zero (or, on Windows and
+    /// Mac OS X, as anything) until written.
+    static size_t release (void * ptr, size_t sz) {
+      const size_t start = ((size_t) ptr + Size - 1) & ~((size_t) Size - 1);
+      const size_t end = ((size_t) ptr + sz) & ~((size_t) Size - 1);
+      if (end <= start) {
+	return 0;
+      }
+      sz = end - start;
 #if defined(_WIN32)
-	VirtualAlloc (ptr, sz, MEM_RESET, PAGE_NOACCESS);
+      VirtualAlloc ((void *) start, sz, MEM_RESET, PAGE_READWRITE);
 #elif defined(__APPLE__)
-	madvise (ptr, sz, MADV_DONTNEED);
-	madvise (ptr, sz, MADV_FREE);
+      madvise ((void *) start, sz, MADV_DONTNEED);
+      madvise ((void *) start, sz, MADV_FREE);
 #else
-	// Assume Unix platform.
-	madvise ((caddr_t) ptr, sz, MADV_DONTNEED);
+      // Assume Unix platform.
+#if defined(MADV_REMOVE)
+      // Shared memory (as from MemfdHeap) keeps its pages through
+      // MADV_DONTNEED; this frees them, and fails on private memory.
+      if (madvise ((caddr_t) start, sz, MADV_REMOVE) == 0) {
+	return sz;
+      }
 #endif
+      if (madvise ((caddr_t) start, sz, MADV_DONTNEED) != 0) {
+	return 0;
       }
+#endif
+      return sz;
     }
 
 #if defined(_WIN32) 
@@ -0,0 +1,327 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_PRESSUREMONITOR_H
+#define HL_PRESSUREMONITOR_H
+
+#include <stddef.h>
+
+#if !defined(__linux__)
+#error "This functionality currently is only implemented for Linux."
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @class PressureMonitor
+ * @brief A thread that gives memory back when the system runs short.
+ *
+ * Allocators give free memory back to the OS only when asked (purge,
+ * malloc_trim and the like), so a process can be killed for want of
+ * memory it holds but does not use. The monitor asks for it. It
+ * watches, with poll, the process's cgroup (v2): a PSI trigger on
+ * memory.pressure, which fires when tasks stall on memory for
+ * StallMicros in a WindowMicros window, and memory.events, whose high,
+ * max and oom counts rise when the cgroup hits memory.high or its
+ * limit. Outside a cgroup, it watches the system's
+ * /proc/pressure/memory instead.
+ *
+ * On each event it calls the release function with a budget, in bytes,
+ * of MinBudget at first (or as much as memory.current is over
+ * memory.high, if more), and twice the last one while the pressure
+ * lasts. The budget drops back after QuietMillis with no events.
+ *
+ * The thread blocks every signal, and it does not survive a fork
+ * (a child that wants one calls start again).
+ */
+
+namespace HL {
+
+  class PressureMonitor {
+  public:
+
+    /// Gives back up to the given number of bytes, returning how many went.
+    typedef size_t (*ReleaseFunction) (size_t);
+
+    enum { StallMicros = 200 * 1000 };
+    enum { WindowMicros = 2 * 1000 * 1000 };
+    enum { QuietMillis = 10 * 1000 };
+    enum { MinBudget = 1024 * 1024 };
+
+    /// Start the monitor, once. Returns false if there is nothing to
+    /// watch or no thread.
+    static bool start (ReleaseFunction release) {
+      if (getRelease() != NULL) {
+	return true;
+      }
+      Watch * w = (Watch *) ::malloc (sizeof(Watch));
+      if (w == NULL) {
+	return false;
+      }
+      if (!w->open()) {
+	w->close();
+	::free (w);
+	return false;
+      }
+      getRelease() = release;
+      sigset_t all, old;
+      sigfillset (&all);
+      pthread_sigmask (SIG_SETMASK, &all, &old);
+      pthread_attr_t attr;
+      pthread_attr_init (&attr);
+      pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+      pthread_t t;
+      const bool started = (pthread_create (&t, &attr, run, w) == 0);
+      pthread_attr_destroy (&attr);
+      pthread_sigmask (SIG_SETMASK, &old, NULL);
+      if (!started) {
+	getRelease() = NULL;
+	w->close();
+	::free (w);
+      }
+      return started;
+    }
+
+  private:
+
+    enum { PathLength = 512 };
+
+    /// What the thread polls.
+    class Watch {
+    public:
+      int pressure;
+      int events;
+      int current;
+      int high;
+      unsigned long lastEvents;
+
+      bool open (void) {
+	pressure = events = current = high = -1;
+	lastEvents = 0;
+	char dir[PathLength];
+	if (cgroupDir (dir)) {
+	  pressure = trigger (dir, "memory.pressure");
+	  events = openIn (dir, "memory.events", O_RDONLY);
+	  current = openIn (dir, "memory.current", O_RDONLY);
+	  high = openIn (dir, "memory.high", O_RDONLY);
+	  if (events >= 0) {
+	    lastEvents = countEvents (events);
+	  }
+	}
+	if ((pressure < 0) && (events < 0)) {
+	  pressure = trigger ("/proc/pressure", "memory");
+	}
+	return (pressure >= 0) || (events >= 0);
+      }
+
+      void close (void) {
+	int * fds[] = { &pressure, &events, &current, &high };
+	for (int i = 0; i < 4; i++) {
+	  if (*fds[i] >= 0) {
+	    ::close (*fds[i]);
+	    *fds[i] = -1;
+	  }
+	}
+      }
+
+      /// Wait for pressure, returning false on QuietMillis of none.
+      bool wait (void) {
+	while (true) {
+	  struct pollfd fds[2];
+	  int n = 0;
+	  if (pressure >= 0) {
+	    fds[n].fd = pressure;
+	    fds[n].events = POLLPRI;
+	    n++;
+	  }
+	  if (events >= 0) {
+	    fds[n].fd = events;
+	    fds[n].events = POLLPRI;
+	    n++;
+	  }
+	  const int r = poll (fds, n, QuietMillis);
+	  if (r == 0) {
+	    return false;
+	  }
+	  if (r < 0) {
+	    continue;
+	  }
+	  bool hit = false;
+	  for (int i = 0; i < n; i++) {
+	    if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+	      if (fds[i].fd == pressure) {
+		// A trigger that goes away does not come back.
+		::close (pressure);
+		pressure = -1;
+	      }
+	    }
+	    if (fds[i].revents & POLLPRI) {
+	      if (fds[i].fd == events) {
+		// It changes for memory.low too; only these count.
+		const unsigned long e = countEvents (events);
+		hit = hit || (e != lastEvents);
+		lastEvents = e;
+	      } else {
+		hit = true;
+	      }
+	    }
+	  }
+	  if ((pressure < 0) && (events < 0)) {
+	    // Nothing left to watch.
+	    return false;
+	  }
+	  if (hit) {
+	    return true;
+	  }
+	}
+      }
+
+      /// How far memory.current is over memory.high, if it is.
+      size_t overHigh (void) {
+	if ((current < 0) || (high < 0)) {
+	  return 0;
+	}
+	char buf[64];
+	const unsigned long long h = readNumber (high, buf, sizeof(buf));
+	const unsigned long long c = readNumber (current, buf, sizeof(buf));
+	return ((h != 0) && (c > h)) ? (size_t) (c - h) : 0;
+      }
+
+    private:
+
+      /// The cgroup v2 directory of this process.
+      static bool cgroupDir (char * dir) {
+	const int fd = ::open ("/proc/self/cgroup", O_RDONLY);
+	if (fd < 0) {
+	  return false;
+	}
+	char buf[PathLength];
+	const ssize_t n = read (fd, buf, sizeof(buf) - 1);
+	::close (fd);
+	if (n <= 0) {
+	  return false;
+	}
+	buf[n] = '\0';
+	// The v2 hierarchy's line is "0::<path>".
+	char * line = strstr (buf, "0::");
+	if ((line == NULL) || ((line != buf) && (line[-1] != '\n'))) {
+	  return false;
+	}
+	char * path = line + 3;
+	char * end = strchr (path, '\n');
+	if (end != NULL) {
+	  *end = '\0';
+	}
+	snprintf (dir, PathLength, "/sys/fs/cgroup%s", (strcmp (path, "/") == 0) ? "" : path);
+	return true;
+      }
+
+      static int openIn (const char * dir, const char * name, int flags) {
+	char path[PathLength];
+	snprintf (path, sizeof(path), "%s/%s", dir, name);
+	return ::open (path, flags | O_CLOEXEC);
+      }
+
+      static int trigger (const char * dir, const char * name) {
+	const int fd = openIn (dir, name, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+	  return -1;
+	}
+	char t[64];
+	const int len = snprintf (t, sizeof(t), "some %d %d", (int) StallMicros, (int) WindowMicros);
+	if (write (fd, t, len + 1) < 0) {
+	  ::close (fd);
+	  return -1;
+	}
+	return fd;
+      }
+
+      static unsigned long long readNumber (int fd, char * buf, size_t sz) {
+	const ssize_t n = pread (fd, buf, sz - 1, 0);
+	if (n <= 0) {
+	  return 0;
+	}
+	buf[n] = '\0';
+	// memory.high reads "max" when there is none.
+	return strtoull (buf, NULL, 10);
+      }
+
+      /// The sum of the high, max and oom counts in memory.events.
+      static unsigned long countEvents (int fd) {
+	char buf[PathLength];
+	const ssize_t n = pread (fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0) {
+	  return 0;
+	}
+	buf[n] = '\0';
+	unsigned long sum = 0;
+	const char * names[] = { "\nhigh ", "\nmax ", "\noom " };
+	for (int i = 0; i < 3; i++) {
+	  const char * p = strstr (buf, names[i]);
+	  if (p != NULL) {
+	    sum += strtoul (p + strlen (names[i]), NULL, 10);
+	  }
+	}
+	return sum;
+      }
+    };
+
+    static ReleaseFunction& getRelease (void) {
+      static ReleaseFunction release = NULL;
+      return release;
+    }
+
+    static void * run (void * arg) {
+      Watch * w = (Watch *) arg;
+      size_t budget = MinBudget;
+      while (true) {
+	if (!w->wait()) {
+	  if ((w->pressure < 0) && (w->events < 0)) {
+	    break;
+	  }
+	  budget = MinBudget;
+	  continue;
+	}
+	const size_t over = w->overHigh();
+	getRelease() (over > budget ? over : budget);
+	budget = (budget > ((size_t) -1) / 2) ? (size_t) -1 : budget * 2;
+      }
+      w->close();
+      ::free (w);
+      return NULL;
+    }
+  };
+
+}
+
+#endif
@@ -34,6 +34,9 @@
 
 #include <memory> // STL
 
+#include "heaps/top/compressedheap.h"
+#include "utility/heaptraits.h"
+
 // Somewhere someone is defining a max macro (on Windows),
 // and this is a problem -- solved by undefining it.
 
@@ -157,6 +160,200 @@ public:
     return (&a == &b);
   }
 
+  /**
+   * @class CompressedAllocator
+   * @brief An STLAllocator whose pointers are CompressedPtrs.
+   *
+   * Super must get its memory from Region (a CompressedHeap). The
+   * container's pointer type is then a 32-bit CompressedPtr, which
+   * halves the size of the links in containers that store their
+   * pointers as such (and of a user's own nodes that do the same);
+   * containers that keep raw pointers inside still work, since a
+   * CompressedPtr converts to and from a T *.
+   *
+   * Example:
+   * <TT>
+   *   typedef FreelistHeap<CompressedHeap<> > NodeHeap;<BR>
+   *   list<int, CompressedAllocator<int, NodeHeap> > l;<BR>
+   * </TT>
+   */
+
+template <class T, class Super, class Region = CompressedHeap<> >
+class CompressedAllocator : public Super {
+public:
+
+  typedef T value_type;
+  typedef CompressedPtr<T, Region> pointer;
+  typedef CompressedPtr<const T, Region> const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind {
+    typedef CompressedAllocator<U,Super,Region> other;
+  };
+
+  pointer address (reference x) const {
+    return pointer (&x);
+  }
+
+  const_pointer address (const_reference x) const {
+    return const_pointer (&x);
+  }
+
+  CompressedAllocator() throw() {
+  }
+
+  CompressedAllocator (const CompressedAllocator& s) throw()
+    : Super (s)
+  {}
+
+  template <class U> CompressedAllocator (const CompressedAllocator<U, Super, Region> &) throw()
+  {
+  }
+
+  /// The region is the limit.
+  size_type max_size() const
+  {
+    return ((size_type) 1 << ((sizeof(void *) == 8) ? 32 : 29)) / sizeof(T);
+  }
+
+  inline pointer allocate (size_type n,
+			   const void * = 0) {
+    if (n) {
+      return pointer (reinterpret_cast<T *>(Super::malloc (sizeof(T) * n)));
+    } else {
+      return pointer();
+    }
+  }
+
+  inline void deallocate (pointer p, size_type) {
+    Super::free (p.get());
+  }
+
+  void construct (T * p, const T& val) {
+    new ((void *) p) T (val);
+  }
+
+  void destroy (T * p) {
+    p->~T();
+  }
+
+};
+
+  template <typename T, class S, class R>
+  inline bool operator!=(const CompressedAllocator<T,S,R>& a, const CompressedAllocator<T,S,R>& b) {
+    return (&a != &b);
+  }
+
+  template <typename T, class S, class R>
+  inline bool operator==(const CompressedAllocator<T,S,R>& a, const CompressedAllocator<T,S,R>& b) {
+    return (&a == &b);
+  }
+
+#if __cplusplus >= 201103L
+
+  /**
+   * @class HeapAllocator
+   * @brief A C++11 allocator that allocates from a given heap instance.
+   *
+   * Unlike STLAllocator, which makes a heap of its own inside every
+   * copy, this holds a pointer to a heap, so containers can share one
+   * (say, a ZoneHeap per request, dropped along with everything in it)
+   * and allocators compare equal exactly when they share a heap. As
+   * with std::pmr::polymorphic_allocator, the allocator stays with the
+   * container: assignment and swap do not propagate it, so a
+   * long-lived container never ends up holding memory from another's
+   * arena. deallocate passes the size on to the heap's sized free, if
+   * it has one.
+   *
+   * Example:
+   * <TT>
+   *   ZoneHeap<MmapHeap, 65536> arena;<BR>
+   *   std::vector<int, HeapAllocator<int, decltype(arena)> > v (&arena);<BR>
+   * </TT>
+   */
+  template <class T, class Heap>
+  class HeapAllocator {
+  public:
+
+    typedef T value_type;
+    typedef Heap heap_type;
+
+    typedef std::false_type propagate_on_container_copy_assignment;
+    typedef std::false_type propagate_on_container_move_assignment;
+    typedef std::false_type propagate_on_container_swap;
+    typedef std::false_type is_always_equal;
+
+    template <class U>
+    struct rebind {
+      typedef HeapAllocator<U, Heap> other;
+    };
+
+    HeapAllocator (Heap * heap) noexcept
+      : _heap (heap)
+    {}
+
+    template <class U>
+    HeapAllocator (const HeapAllocator<U, Heap>& a) noexcept
+      : _heap (a.heap())
+    {}
+
+    /// Copies of a container share its heap.
+    HeapAllocator select_on_container_copy_construction() const {
+      return *this;
+    }
+
+    T * allocate (std::size_t n) {
+      if (n > max_size()) {
+	throw std::bad_alloc();
+      }
+      void * ptr = _heap->malloc (n * sizeof(T));
+      if (ptr == NULL) {
+	throw std::bad_alloc();
+      }
+      return static_cast<T *>(ptr);
+    }
+
+    void deallocate (T * p, std::size_t n) noexcept {
+      free (p, n * sizeof(T), typename HasSizedFree<Heap>::type());
+    }
+
+    std::size_t max_size() const noexcept {
+      return std::numeric_limits<std::size_t>::max() / sizeof(T);
+    }
+
+    Heap * heap() const noexcept {
+      return _heap;
+    }
+
+  private:
+
+    void free (void * p, std::size_t sz, std::true_type) {
+      _heap->free (p, sz);
+    }
+
+    void free (void * p, std::size_t, std::false_type) {
+      _heap->free (p);
+    }
+
+    Heap * _heap;
+  };
+
+  template <typename T, typename U, class H>
+  inline bool operator==(const HeapAllocator<T,H>& a, const HeapAllocator<U,H>& b) noexcept {
+    return (a.heap() == b.heap());
+  }
+
+  template <typename T, typename U, class H>
+  inline bool operator!=(const HeapAllocator<T,H>& a, const HeapAllocator<U,H>& b) noexcept {
+    return (a.heap() != b.heap());
+  }
+
+#endif
+
 
 }
 
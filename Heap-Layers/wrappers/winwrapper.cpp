@@ -33,6 +33,14 @@
     required by programs that also call fork(). In case your program
     does not, the lock and unlock calls given below can be no-ops.
 
+  THREADS:
+
+  - An allocator with a heap per thread can use ThreadSpecificHeap
+    here just as on other platforms. It finds each thread's heap in a
+    fiber-local storage slot, and orphans it through the slot's
+    callback when the thread exits, so this wrapper needs no DllMain
+    (or DLL_THREAD_DETACH) hook of its own.
+
 */
 
 extern "C" {
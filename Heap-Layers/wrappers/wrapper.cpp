@@ -35,6 +35,9 @@
 #include <stdint.h>
 #include <new>
 
+#include "../utility/statsregistry.h"
+#include "../utility/streamingcopy.h"
+
 
 extern "C" {
 
@@ -50,6 +53,59 @@ extern "C" {
   // Unlocks the heap(s), after fork().
   void xxmalloc_unlock (void);
 
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  // Optional: returns zero-filled memory, skipping the memset when
+  // the heap knows the memory is fresh (e.g., straight from mmap).
+  // Heaps built from Heap Layers can just forward to mallocZeroed.
+  void * xxmalloc_zeroed (size_t) __attribute__((weak));
+
+  // Optional: returns memory aligned to the given power of two
+  // (e.g., from a heap's memalign), which can be passed to xxfree.
+  void * xxmemalign (size_t, size_t) __attribute__((weak));
+
+  // Optional: tries to change an object's size in place (e.g., with
+  // a heap's resize), returning non-zero on success.
+  int xxmalloc_resize (void *, size_t) __attribute__((weak));
+
+  // Optional: frees an object given the size that was requested for
+  // it (as C++14 sized delete supplies), so the heap can skip looking
+  // the size up. Must accept NULL, just like xxfree.
+  void xxfree_sized (void *, size_t) __attribute__((weak));
+
+  // Optional: gives memory the heap holds but does not use back to
+  // the OS, up to about the given number of bytes, and returns how
+  // much went (malloc_trim calls it). Heaps built from Heap Layers can
+  // just forward to purge, which each layer that holds free memory
+  // implements and the rest inherit from their superheap. Memory
+  // counts at each layer that lets go of it, so that is a rough total.
+  size_t xxmalloc_purge (size_t) __attribute__((weak));
+
+  // Optional: finds the allocated object that a pointer points into,
+  // at its start or anywhere inside it, setting [*start, *end) and
+  // returning non-zero, or returns zero if it is in none (so that
+  // checked string and memory functions such as HeapShield's can
+  // bound a copy). Heaps built from Heap Layers can forward to a
+  // page-map layer's getBounds (PageMapHeap's or SlabHeap's).
+  int xxmalloc_object_bounds (void *, void **, void **) __attribute__((weak));
+
+  // Optional: returns the usable size that xxmalloc would give an
+  // object of the given size (its size class), without allocating,
+  // so that growing containers can use the slack. Heaps built from
+  // Heap Layers can forward to goodSize.
+  size_t xxmalloc_good_size (size_t) __attribute__((weak));
+
+  // Optional: allocates as xxmalloc does, and sets *actual to the
+  // object's usable size, saving a separate xxmalloc_usable_size.
+  void * xxmalloc_sized (size_t, size_t *) __attribute__((weak));
+
+  // Optional: allocates n objects of the given sizes into the array,
+  // returning non-zero, or allocates none and returns zero. Each is
+  // freed on its own. Heaps built from Heap Layers can forward to
+  // comalloc, which ZoneHeap, CoalesceHeap and LeaMallocHeap carve
+  // out of one block, so that the objects are contiguous.
+  int xxmalloc_comalloc (size_t, const size_t *, void **) __attribute__((weak));
+#endif
+
 }
 
 #if defined(__APPLE__)
@@ -90,6 +146,9 @@ extern "C" {
 #define CUSTOM_MEMALIGN(x,y) CUSTOM_PREFIX(memalign)(x,y)
 #define CUSTOM_POSIX_MEMALIGN(x,y,z) CUSTOM_PREFIX(posix_memalign)(x,y,z)
 #define CUSTOM_GETSIZE(x)    CUSTOM_PREFIX(malloc_usable_size)(x)
+#define CUSTOM_GOODSIZE(x)   CUSTOM_PREFIX(malloc_good_size)(x)
+#define CUSTOM_MALLOC_SIZED(x,y) CUSTOM_PREFIX(malloc_sized)(x,y)
+#define CUSTOM_COMALLOC(x,y,z) CUSTOM_PREFIX(independent_comalloc)(x,y,z)
 #define CUSTOM_VALLOC(x)     CUSTOM_PREFIX(valloc)(x)
 #define CUSTOM_PVALLOC(x)    CUSTOM_PREFIX(pvalloc)(x)
 #define CUSTOM_RECALLOC(x,y,z)   CUSTOM_PREFIX(recalloc)(x,y,z)
@@ -132,10 +191,19 @@ extern "C" void * MYCDECL CUSTOM_MALLOC(size_t sz)
 extern "C" void * MYCDECL CUSTOM_CALLOC(size_t nelem, size_t elsize)
 {
   size_t n = nelem * elsize;
+  // Check for overflow.
+  if ((elsize != 0) && (n / elsize != nelem)) {
+    return NULL;
+  }
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  if (xxmalloc_zeroed) {
+    return xxmalloc_zeroed (n);
+  }
+#endif
   void * ptr = CUSTOM_MALLOC(n);
   // Zero out the malloc'd block.
   if (ptr != NULL) {
-    memset (ptr, 0, n);
+    HL::StreamingCopy::zero (ptr, n);
   }
   return ptr;
 }
@@ -168,7 +236,15 @@ extern "C" void * MYCDECL CUSTOM_MEMALIGN (size_t alignment, size_t size)
   // NOTE: This function is deprecated.
   if (alignment == sizeof(double)) {
     return CUSTOM_MALLOC (size);
-  } else {
+  }
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  if (xxmemalign) {
+    return xxmemalign (alignment, size);
+  }
+#endif
+  {
+    // Fallback: over-allocate and return an interior pointer
+    // (the heap must accept interior pointers in xxfree).
     void * ptr = CUSTOM_MALLOC (size + 2 * alignment);
     void * alignedPtr = (void *) (((size_t) ptr + alignment - 1) & ~(alignment - 1));
     return alignedPtr;
@@ -180,11 +256,90 @@ extern "C" size_t MYCDECL CUSTOM_GETSIZE (void * ptr)
   return xxmalloc_usable_size (ptr);
 }
 
+extern "C" size_t MYCDECL CUSTOM_GOODSIZE (size_t sz)
+{
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  if (xxmalloc_good_size) {
+    return xxmalloc_good_size (sz);
+  }
+#endif
+  return sz;
+}
+
+extern "C" void * MYCDECL CUSTOM_MALLOC_SIZED (size_t sz, size_t * actual)
+{
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  if (xxmalloc_sized) {
+    return xxmalloc_sized (sz, actual);
+  }
+#endif
+  void * ptr = CUSTOM_MALLOC (sz);
+  if (ptr != NULL) {
+    *actual = CUSTOM_GETSIZE (ptr);
+  }
+  return ptr;
+}
+
 extern "C" void MYCDECL CUSTOM_FREE (void * ptr)
 {
   xxfree (ptr);
 }
 
+// Allocates n objects of the given sizes into chunks, as dlmalloc's
+// independent_comalloc does: contiguously, if the heap supports
+// xxmalloc_comalloc, and otherwise one by one. With chunks NULL, the
+// array is allocated too. Every object, and the array, is freed on
+// its own. Returns the array, or NULL (allocating nothing).
+extern "C" void ** MYCDECL CUSTOM_COMALLOC (size_t n, size_t * sizes, void ** chunks)
+{
+  void ** ptrs = chunks;
+  if (ptrs == NULL) {
+    if (n > (size_t) -1 / sizeof(void *)) {
+      return NULL;
+    }
+    ptrs = (void **) CUSTOM_MALLOC (n * sizeof(void *));
+    if (ptrs == NULL) {
+      return NULL;
+    }
+  }
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  if (xxmalloc_comalloc) {
+    if (xxmalloc_comalloc (n, sizes, ptrs)) {
+      return ptrs;
+    }
+    if (chunks == NULL) {
+      CUSTOM_FREE (ptrs);
+    }
+    return NULL;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) {
+    ptrs[i] = CUSTOM_MALLOC (sizes[i]);
+    if (ptrs[i] == NULL) {
+      while (i > 0) {
+	CUSTOM_FREE (ptrs[--i]);
+      }
+      if (chunks == NULL) {
+	CUSTOM_FREE (ptrs);
+      }
+      return NULL;
+    }
+  }
+  return ptrs;
+}
+
+// Frees an object whose requested size is known.
+static inline void freeSized (void * ptr, size_t sz)
+{
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  if (xxfree_sized) {
+    xxfree_sized (ptr, sz);
+    return;
+  }
+#endif
+  CUSTOM_FREE (ptr);
+}
+
 extern "C" void * MYCDECL CUSTOM_REALLOC (void * ptr, size_t sz)
 {
   if (ptr == NULL) {
@@ -196,6 +351,13 @@ extern "C" void * MYCDECL CUSTOM_REALLOC (void * ptr, size_t sz)
     return NULL;
   }
 
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  // Avoid the copy if the heap can grow or shrink the object in place.
+  if (xxmalloc_resize && xxmalloc_resize (ptr, sz)) {
+    return ptr;
+  }
+#endif
+
   size_t objSize = CUSTOM_GETSIZE (ptr);
 
   void * buf = CUSTOM_MALLOC(sz);
@@ -210,7 +372,7 @@ extern "C" void * MYCDECL CUSTOM_REALLOC (void * ptr, size_t sz)
     // Copy the contents of the original object
     // up to the size of the new block.
     size_t minSize = (objSize < sz) ? objSize : sz;
-    memcpy (buf, ptr, minSize);
+    HL::StreamingCopy::copy (buf, ptr, minSize);
   }
 
   // Free the old block.
@@ -283,12 +445,19 @@ extern "C" int  CUSTOM_MALLOPT (int param, int value) {
 }
 
 extern "C" int CUSTOM_MALLOC_TRIM (size_t pad) {
-  // NOP.
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(__APPLE__)
+  // Purge all the heap can spare; pad (what to leave at the top of
+  // the sbrk heap) has no counterpart here.
+  if (xxmalloc_purge) {
+    return (xxmalloc_purge ((size_t) -1) > 0);
+  }
+#endif
   return 0; // no memory returned to OS.
 }
 
 extern "C" void CUSTOM_MALLOC_STATS(void) {
-  // NOP.
+  // Every layer in the StatsRegistry, as JSON on stderr.
+  HL::StatsRegistry::dump (2);
 }
 
 extern "C" void * CUSTOM_MALLOC_GET_STATE(void) {
@@ -379,6 +548,19 @@ void operator delete[] (void * ptr)
   CUSTOM_FREE (ptr);
 }
 
+// Sized deallocation (C++14): sz is the size that was passed to new.
+void operator delete (void * ptr, size_t sz)
+  throw ()
+{
+  freeSized (ptr, sz);
+}
+
+void operator delete[] (void * ptr, size_t sz)
+  throw ()
+{
+  freeSized (ptr, sz);
+}
+
 #endif
 #endif
 
@@ -0,0 +1,274 @@
+/* -*- C++ -*- */
+
+/*
+
+  Heap Layers: An Extensible Memory Allocation Infrastructure
+
+  Copyright (C) 2000-2012 by Emery Berger
+  http://www.cs.umass.edu/~emery
+  emery@cs.umass.edu
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#ifndef HL_XXTHREADCACHE_H
+#define HL_XXTHREADCACHE_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#error "This functionality currently is not implemented for Windows."
+#endif
+
+#include <pthread.h>
+
+#if !defined(NO_INLINE)
+#if defined(__GNUC__)
+#define NO_INLINE __attribute__ ((noinline))
+#else
+#define NO_INLINE
+#endif
+#endif
+
+#if !defined(HL_INITIAL_EXEC)
+#if defined(__GNUC__)
+#define HL_INITIAL_EXEC __attribute__((tls_model ("initial-exec")))
+#else
+#define HL_INITIAL_EXEC
+#endif
+#endif
+
+extern "C" {
+
+  void * xxmalloc (size_t);
+  void   xxfree (void *);
+  size_t xxmalloc_usable_size (void *);
+
+  // Optional, as in macwrapper: allocates up to num objects of sz
+  // bytes, returning how many it got, and frees num objects at once.
+  // An allocator that takes a lock per call can take it once per
+  // batch here instead.
+  unsigned xxmalloc_batch (size_t, void **, unsigned) __attribute__((weak));
+  void     xxfree_batch (void **, unsigned) __attribute__((weak));
+
+}
+
+/**
+ * @class XXThreadCache
+ * @brief Per-thread caches of small objects in front of xxmalloc.
+ *
+ * Sits between a wrapper and any allocator behind the xxmalloc
+ * protocol, so that an allocator that serializes every call (most of
+ * the shims in the tree) still scales with threads. Each thread keeps
+ * a list of free objects per size class (multiples of Granularity up
+ * to MaxSize), and malloc and free use it with no lock or atomic
+ * operation. An empty list is refilled, and a full one (Capacity
+ * objects) is flushed, Batch objects at a time through xxmalloc_batch
+ * and xxfree_batch if the allocator has them, or through xxmalloc
+ * and xxfree otherwise. (Not under xxmalloc_lock: that is the fork
+ * lock, and most allocators' xxmalloc takes it too.) A thread's
+ * cache is flushed when it exits.
+ *
+ * Cached objects are still allocated as far as the allocator is
+ * concerned, and are binned by xxmalloc_usable_size, so any object
+ * may be freed by any thread. The allocator must report the true size
+ * of objects it hands out, including interior pointers if it has no
+ * xxmemalign.
+ *
+ * @param MaxSize The largest size (in bytes) cached.
+ * @param Capacity How many objects a size class holds per thread.
+ * @param Batch How many objects a refill or flush moves.
+ */
+
+namespace HL {
+
+  template <size_t MaxSize = 1024,
+	    int Capacity = 32,
+	    int Batch = 16>
+  class XXThreadCache {
+  public:
+
+    enum { Granularity = 16 };
+
+    static inline void * malloc (size_t sz) {
+      if (sz <= MaxSize) {
+	const size_t c = (sz <= Granularity) ? 1 : (sz + Granularity - 1) / Granularity;
+	Cache * cache = getCache();
+	if (cache != NULL) {
+	  Bin& b = cache->bins[c];
+	  if (b.head != NULL) {
+	    Object * o = b.head;
+	    b.head = o->next;
+	    b.count--;
+	    return o;
+	  }
+	  return refill (b, c * Granularity);
+	}
+      }
+      return xxmalloc (sz);
+    }
+
+    static inline void free (void * ptr) {
+      if (ptr == NULL) {
+	return;
+      }
+      // Every object in a bin holds at least that bin's size.
+      const size_t c = xxmalloc_usable_size (ptr) / Granularity;
+      if ((c > 0) && (c < NumBins)) {
+	Cache * cache = getCache();
+	if (cache != NULL) {
+	  Bin& b = cache->bins[c];
+	  if (b.count >= Capacity) {
+	    flush (b, Batch);
+	  }
+	  Object * o = (Object *) ptr;
+	  o->next = b.head;
+	  b.head = o;
+	  b.count++;
+	  return;
+	}
+      }
+      xxfree (ptr);
+    }
+
+    /// Return everything the calling thread holds to the allocator.
+    static void flush (void) {
+      Cache * cache = getCache();
+      if (cache != NULL) {
+	flushAll (*cache);
+      }
+    }
+
+  private:
+
+    enum { NumBins = MaxSize / Granularity + 1 };
+
+    class Object {
+    public:
+      Object * next;
+    };
+
+    class Bin {
+    public:
+      Object * head;
+      int count;
+    };
+
+    enum { Unused, Active, Exiting };
+
+    class Cache {
+    public:
+      int state;
+      Bin bins[NumBins];
+    };
+
+    /// The calling thread's cache, or NULL if it may not use one.
+    static inline Cache * getCache (void) {
+      static __thread Cache cache HL_INITIAL_EXEC;
+      if (cache.state == Active) {
+	return &cache;
+      }
+      if (cache.state == Unused) {
+	// pthread_setspecific may call malloc; that call gets no cache.
+	cache.state = Exiting;
+	if (pthread_setspecific (getKey(), (void *) &cache) == 0) {
+	  cache.state = Active;
+	  return &cache;
+	}
+      }
+      return NULL;
+    }
+
+    /// malloc found the bin empty.
+    static NO_INLINE void * refill (Bin& b, size_t sz) {
+      void * objs[Batch];
+      unsigned n;
+      if (xxmalloc_batch) {
+	n = xxmalloc_batch (sz, objs, Batch);
+      } else {
+	for (n = 0; n < (unsigned) Batch; n++) {
+	  objs[n] = xxmalloc (sz);
+	  if (objs[n] == NULL) {
+	    break;
+	  }
+	}
+      }
+      if (n == 0) {
+	return NULL;
+      }
+      for (unsigned i = 1; i < n; i++) {
+	Object * o = (Object *) objs[i];
+	o->next = b.head;
+	b.head = o;
+      }
+      b.count += n - 1;
+      return objs[0];
+    }
+
+    /// Give up to n of a bin's objects back to the allocator.
+    static NO_INLINE void flush (Bin& b, int n) {
+      void * objs[Batch];
+      while ((n > 0) && (b.head != NULL)) {
+	unsigned k = 0;
+	while ((k < (unsigned) Batch) && (n > 0) && (b.head != NULL)) {
+	  objs[k++] = b.head;
+	  b.head = b.head->next;
+	  b.count--;
+	  n--;
+	}
+	if (xxfree_batch) {
+	  xxfree_batch (objs, k);
+	} else {
+	  for (unsigned i = 0; i < k; i++) {
+	    xxfree (objs[i]);
+	  }
+	}
+      }
+    }
+
+    static void flushAll (Cache& c) {
+      for (int i = 0; i < (int) NumBins; i++) {
+	flush (c.bins[i], c.bins[i].count);
+      }
+    }
+
+    /// Runs at thread exit. Later calls from the thread (from other
+    /// destructors) bypass the cache.
+    static void exitThread (void * ptr) {
+      Cache& c = *((Cache *) ptr);
+      c.state = Exiting;
+      flushAll (c);
+    }
+
+    static pthread_key_t getKey (void) {
+      static pthread_once_t once = PTHREAD_ONCE_INIT;
+      pthread_once (&once, makeKey);
+      return getKeyRef();
+    }
+
+    static void makeKey (void) {
+      pthread_key_create (&getKeyRef(), exitThread);
+    }
+
+    static pthread_key_t& getKeyRef (void) {
+      static pthread_key_t key;
+      return key;
+    }
+  };
+
+}
+
+#endif
@@ -1,28 +1,352 @@
-/// @author Emery Berger
-
-#include <iostream>
-using namespace std;
+/*
+ * cama-driver: what CAMA's placement saves in cache conflict misses.
+ *
+ *	cama-driver [-k streams|tiles|hash|all] [-r reps] [-n count]
+ *
+ * Each kernel allocates its objects three ways, and runs reps times
+ * over them (by default, enough times to take a fraction of a second):
+ *
+ *   malloc       the C library's, which knows nothing of the cache.
+ *   camalloc     camalloc(size, set), with the sets spread evenly over
+ *                the objects that are used together.
+ *   carelmalloc  carelmalloc(size, ALLOC_DIFFERENT_SET, ...), naming
+ *                the objects (up to MAXREL of them) allocated before
+ *                it that it is used together with.
+ *
+ * The kernels are sized by the geometry of the cache CAMA colors for
+ * (the L1 data cache, unless camarea2.c was built with another
+ * CACHE_LEVEL), so that their data would fit in it, or in the next
+ * level, if it were spread evenly over the sets:
+ *
+ *   streams  count (16) arrays of four cache ways each, summed in
+ *            lockstep, as a stencil or a structure of arrays is.
+ *   tiles    a multiplication of matrices kept as count (8) by count
+ *            tiles of 16 by 16 doubles, each tile its own object.
+ *   hash     lookups of random keys in a table of count (four times
+ *            the sets) buckets of 8 keys each, each bucket its own
+ *            object.
+ *
+ * For each it prints the time, and the misses the reps took, where
+ * perf_event_open lets it count the program's own user-mode events
+ * (see util/bench/perfcount.h).  The kernels' data stays within the
+ * cache's capacity, so misses beyond what the best placement takes
+ * are conflict misses.  Perf has no generic event for the L2 cache;
+ * "llc-misses" are the last level's.
+ */
 
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 extern "C" {
 #include "camarea.h"
 }
 
+#include "perfcount.h"
+
+#define	MAXREL	16		/* objects carelmalloc is told of */
+
+enum { MALLOC, CAMALLOC, CARELMALLOC, NPLACEMENTS };
+
+static const char *placements[NPLACEMENTS] = {
+	"malloc", "camalloc", "carelmalloc"
+};
+
+struct kernel {
+	const char	*name;
+	uint64_t	(*run)(int placement, int count, int reps,
+			    struct perfcount *pc, double *secs);
+	int		count;		/* defaults */
+	int		reps;
+};
+
+static unsigned sets, line_size;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Allocate size bytes by placement: at set for camalloc, or for
+ * carelmalloc in a set none of the last MAXREL of the nrel objects at
+ * rel start in.
+ */
+static void *
+place(int placement, size_t size, unsigned set, void **rel, int nrel)
+{
+	void *r[MAXREL];
+	int i;
+
+	switch (placement) {
+	case CAMALLOC:
+		return (camalloc(size, set % sets));
+	case CARELMALLOC:
+		/* The list ends at the first null pointer. */
+		for (i = 0; i < MAXREL; i++)
+			r[i] = i < nrel ? rel[nrel - 1 - i] : NULL;
+		return (carelmalloc(size, ALLOC_DIFFERENT_SET,
+		    r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7],
+		    r[8], r[9], r[10], r[11], r[12], r[13], r[14], r[15],
+		    (void *)NULL));
+	default:
+		return (malloc(size));
+	}
+}
+
+static void
+release(int placement, void *ptr)
+{
+	if (placement == MALLOC)
+		free(ptr);
+	else
+		cafree(ptr);
+}
+
+static void *
+xplace(int placement, size_t size, unsigned set, void **rel, int nrel)
+{
+	void *ptr;
+
+	if ((ptr = place(placement, size, set, rel, nrel)) == NULL) {
+		fprintf(stderr, "cama-driver: %s of %zu bytes failed\n",
+		    placements[placement], size);
+		exit(1);
+	}
+	return (ptr);
+}
+
+/*
+ * count arrays, each of four ways, summed element by element.  Lined
+ * up in the same sets, more of them than the cache has ways evict one
+ * another's lines before the rest of each line is read.
+ */
+static uint64_t
+streams(int placement, int count, int reps, struct perfcount *pc,
+    double *secs)
+{
+	size_t n = 4 * sets * line_size / sizeof(uint64_t);
+	uint64_t **a, sum = 0;
+	size_t i;
+	int k, rep;
+	double start;
+
+	a = (uint64_t **)calloc(count, sizeof(*a));
+	for (k = 0; k < count; k++) {
+		a[k] = (uint64_t *)xplace(placement, n * sizeof(uint64_t),
+		    (unsigned)((uint64_t)k * sets / count), (void **)a, k);
+		for (i = 0; i < n; i++)
+			a[k][i] = i + k;
+	}
+
+	start = now();
+	perfcount_start(pc);
+	for (rep = 0; rep < reps; rep++)
+		for (i = 0; i < n; i++)
+			for (k = 0; k < count; k++)
+				sum += a[k][i] ^ rep;
+	perfcount_stop(pc);
+	*secs = now() - start;
+
+	for (k = 0; k < count; k++)
+		release(placement, a[k]);
+	free(a);
+	return (sum);
+}
+
+/*
+ * C = A B, of count by count tiles of T by T.  Each step works on a
+ * tile of each; camalloc puts the three tiles of a step in different
+ * thirds of the sets, and carelmalloc puts each apart from the tiles
+ * of the other matrices at the same place.
+ */
+#define	T	16
+
+static uint64_t
+tiles(int placement, int count, int reps, struct perfcount *pc,
+    double *secs)
+{
+	size_t size = T * T * sizeof(double), ntiles = (size_t)count * count;
+	double **m[3], *a, *b, *c;
+	void *rel[3];
+	uint64_t sum = 0;
+	size_t t;
+	int i, j, k, x, y, z, rep;
+	double start;
+
+	for (x = 0; x < 3; x++)
+		m[x] = (double **)calloc(ntiles, sizeof(double *));
+	for (t = 0; t < ntiles; t++) {
+		for (x = 0; x < 3; x++) {
+			m[x][t] = (double *)xplace(placement, size,
+			    x * sets / 3, rel, x);
+			rel[x] = m[x][t];
+			for (y = 0; y < T * T; y++)
+				m[x][t][y] = x == 2 ? 0 : (double)((t + y) % 7);
+		}
+	}
+
+	start = now();
+	perfcount_start(pc);
+	for (rep = 0; rep < reps; rep++)
+		for (i = 0; i < count; i++)
+			for (j = 0; j < count; j++) {
+				c = m[2][i * count + j];
+				for (k = 0; k < count; k++) {
+					a = m[0][i * count + k];
+					b = m[1][k * count + j];
+					for (x = 0; x < T; x++)
+						for (z = 0; z < T; z++)
+							for (y = 0; y < T; y++)
+								c[x * T + y] +=
+								    a[x * T + z] *
+								    b[z * T + y];
+				}
+			}
+	perfcount_stop(pc);
+	*secs = now() - start;
+
+	for (t = 0; t < ntiles; t++)
+		sum += (uint64_t)m[2][t][t % (T * T)];
+	for (x = 0; x < 3; x++) {
+		for (t = 0; t < ntiles; t++)
+			release(placement, m[x][t]);
+		free(m[x]);
+	}
+	return (sum);
+}
+
+/*
+ * Lookups of random keys in count buckets of SLOTS keys; key k is
+ * in bucket k % nbuckets.  Every bucket is as likely as any other, so
+ * the table is best spread evenly over the sets: camalloc does that,
+ * and carelmalloc keeps each bucket out of the sets the MAXREL buckets
+ * before it start in.
+ */
+#define	SLOTS	8
+
+struct bucket {
+	uint64_t	key[SLOTS];
+	uint64_t	value[SLOTS];
+};
+
+static uint64_t
+hash(int placement, int count, int reps, struct perfcount *pc,
+    double *secs)
+{
+	size_t nbuckets = (size_t)count, nkeys = nbuckets * SLOTS;
+	unsigned lines = (sizeof(struct bucket) + line_size - 1) / line_size;
+	struct bucket **table, *bp;
+	uint64_t key, x = 1, sum = 0;
+	size_t i, b;
+	int rep, s;
+	double start;
+
+	table = (struct bucket **)calloc(nbuckets, sizeof(*table));
+	for (b = 0; b < nbuckets; b++) {
+		table[b] = (struct bucket *)xplace(placement,
+		    sizeof(struct bucket), (unsigned)(b * lines),
+		    (void **)table, (int)b);
+		for (s = 0; s < SLOTS; s++) {
+			table[b]->key[s] = b + s * nbuckets;
+			table[b]->value[s] = b ^ s;
+		}
+	}
+
+	start = now();
+	perfcount_start(pc);
+	for (rep = 0; rep < reps; rep++)
+		for (i = 0; i < nkeys; i++) {
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+			key = (x >> 33) % nkeys;
+			bp = table[key % nbuckets];
+			for (s = 0; s < SLOTS; s++)
+				if (bp->key[s] == key) {
+					sum += bp->value[s];
+					break;
+				}
+		}
+	perfcount_stop(pc);
+	*secs = now() - start;
+
+	for (b = 0; b < nbuckets; b++)
+		release(placement, table[b]);
+	free(table);
+	return (sum);
+}
+
+static struct kernel kernels[] = {
+	{ "streams", streams, 16, 10000 },
+	{ "tiles", tiles, 8, 100 },
+	{ "hash", hash, 0, 10000 },	/* count: four times the sets */
+};
+
+#define	NKERNELS	(int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: cama-driver [-k streams|tiles|hash|all] "
+	    "[-r reps] [-n count]\n");
+	exit(1);
+}
+
 int
-main()
-{
-  cainit();
-  for (int i = 0; i < 100; i++) {
-    for (int j = 0; j < 100; j++) {
-      size_t sz = 16 * (i+1);
-      void * ptr = camalloc (sz, 1);
-      memset (ptr, 0, sz);
-      cout << "size = " << camsize(ptr) << endl;
-      if (ptr != NULL) {
-	cafree (ptr);
-      }
-    }
-  }
-  return 0;
+main(int argc, char *argv[])
+{
+	const char *which = "all";
+	struct perfcount pc;
+	char label[64];
+	uint64_t sum;
+	double secs;
+	int c, k, p, reps = 0, count = 0;
+
+	while ((c = getopt(argc, argv, "k:r:n:")) != -1) {
+		switch (c) {
+		case 'k':
+			which = optarg;
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (reps < 0 || count < 0)
+		usage();
+
+	cainit();
+	cageometry(0, &sets, &line_size);
+	printf("# coloring %u sets of %u-byte lines\n", sets, line_size);
+
+	for (k = 0; k < NKERNELS; k++) {
+		if (strcmp(which, "all") != 0 &&
+		    strcmp(which, kernels[k].name) != 0)
+			continue;
+		for (p = 0; p < NPLACEMENTS; p++) {
+			perfcount_init(&pc);
+			sum = kernels[k].run(p, count > 0 ? count :
+			    kernels[k].count > 0 ? kernels[k].count :
+			    4 * (int)sets,
+			    reps > 0 ? reps : kernels[k].reps, &pc, &secs);
+			printf("%-8s %-12s %8.3f s  (sum %llu)\n",
+			    kernels[k].name, placements[p], secs,
+			    (unsigned long long)sum);
+			snprintf(label, sizeof(label), "%s/%s",
+			    kernels[k].name, placements[p]);
+			perfcount_print(stdout, label, &pc);
+		}
+	}
+	return (0);
 }
@@ -18,17 +18,30 @@ extern "C" {
 #include <stddef.h>
 
 /*
- * Initializes the allocator.
- * A program using CAMAREA needs to call this method once before using
- * camalloc(...) and cafree(...).
+ * Initializes the allocator for the calling thread.
+ * The allocator is thread-safe: every thread allocates from its own
+ * instance, which is set up by its first allocation if cainit() has not
+ * been called by that thread.  Blocks may be freed by any thread.
  */
 void  cainit(void);
+/*
+ * Reports the number of sets and the line size of the data cache at level
+ * level (1 for L1) as detected by the allocator, or of the cache used for
+ * coloring if level is 0.  Set numbers passed to camalloc(...) must be below
+ * the latter number of sets.  Returns 0 if the level is unknown.
+ */
+int   cageometry(unsigned level, unsigned* sets, unsigned* line_size);
 /*
  * Returns a pointer to a memory block of at least size bytes where
  * the first byte is mapped to cache set set; or null if the allocator
  * was unable to satisfy the request.
  */
 void* camalloc(size_t size, unsigned set);
+/*
+ * Like camalloc(...), but returns a multiple of alignment (a power of two),
+ * which need not map to cache set set.  It may be passed to cafree(...).
+ */
+void* camemalign(size_t alignment, size_t size, unsigned set);
 /*
  * Deallocates, i.e. marks as free, the memory block pointed to by ptr. 
  */
@@ -37,6 +50,12 @@ void  cafree(void* ptr);
 /* EDB: Added. */
 size_t camsize(void* ptr);
 
+/*
+ * Acquire/release the locks of all allocator instances, e.g. around fork().
+ */
+void  calock(void);
+void  caunlock(void);
+
 
 /*
  * Cache-set relational allocations add-on:
@@ -22,6 +22,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#	include <cpuid.h>
+#endif
 
 /*
  * CONFIGURATION A
@@ -68,26 +74,58 @@
  * CONFIGURATION B 
  * 
  * Hardware specifics:
+ * ***  cache level whose sets are used for coloring
  * ***  number of cache sets and size of a cache line
  * **** use ld of the respective value to specify
+ * The geometry of each cache level is detected when the allocator is initialized
+ * (sysfs on Linux, CPUID on x86); CACHE_SET_BITS and LINE_SIZE_BITS only apply if
+ * that fails.  Caches with more than 2^MAX_CACHE_SET_BITS sets are colored by the
+ * low bits of their set index, so blocks in different sets still do not conflict.
  */
+#ifndef CACHE_LEVEL
+#define CACHE_LEVEL    1 // color for the L1 data cache
+#endif
+#ifndef CACHE_SET_BITS
 #define CACHE_SET_BITS 7 // 2^7 cache sets
+#endif
+#ifndef LINE_SIZE_BITS
 #define LINE_SIZE_BITS 5 // line size of 2^5 bytes
+#endif
+#define MIN_CACHE_SET_BITS  5 // descriptor blocks take DESC_SETS sets
+#define MAX_CACHE_SET_BITS  8 // SIZE_THRESHOLD grows with the sets and must stay below DESC_SETS lines
+#define MIN_LINE_SIZE_BITS  4
+#define MAX_LINE_SIZE_BITS  7 // the descriptors of a descriptor block are tracked in an unsigned
+#define MAX_CACHE_LEVELS    4
+/*
+ * Every thread gets its own allocator instance, which manages a contiguous
+ * address range of 2^REGION_BITS bytes (reserved, not committed, up front).
+ * This bounds the memory a single thread can allocate.
+ */
+#ifndef REGION_BITS
+#	if UINTPTR_MAX > 0xFFFFFFFFU
+#		define REGION_BITS 32 // 4 GB per thread
+#	else
+#		define REGION_BITS 26 // 64 MB per thread
+#	endif
+#endif
 /*
  * CONFIGURATION C
  * 
  * Automatic precomputations/definitions.
  */
-#define CACHE_SETS     (1U << CACHE_SET_BITS)
-#define LINE_SIZE      (1U << LINE_SIZE_BITS)
+#define CACHE_SETS     (1U << cache_set_bits)
+#define LINE_SIZE      (1U << line_size_bits)
+#define MAX_CACHE_SETS (1U << MAX_CACHE_SET_BITS)
 #define ROUND_LINE_SIZE(x) (((x) + (LINE_SIZE - 1)) & ~(LINE_SIZE - 1))
 #define GRANULARITY (1U << LD_GRANULARITY)
 #define LINEAR_STEPS (1U << LD_LINEAR_STEPS)
 #define WAY_SIZE        (CACHE_SETS * LINE_SIZE)
-#define MULTIBLOCK_SIZE ROUND_LINE_SIZE((CACHE_SETS - DESC_SETS) * LINE_SIZE / (DESC_SETS * LINE_SIZE / sizeof(descriptor)))
-#define SIZE_THRESHOLD  ((MULTIBLOCK_SIZE - sizeof(multi_head)) / 2)
+#define MULTIBLOCK_SIZE multiblock_size
+#define SIZE_THRESHOLD  size_threshold
 #define lengthof(x) (sizeof(x) / sizeof(*(x)))
 #define MAX_ALLOC ((1U << (ALLOC_SIZE - 1)) * (2 * LINEAR_STEPS - 1) / LINEAR_STEPS)
+#define REGION_SIZE ((uintptr_t)1 << REGION_BITS)
+#define COMMIT_SIZE ((uintptr_t)1 << 20) // granularity of making the region accessible
 /*
  *   END OF CONFIGURATION
  */
@@ -185,31 +223,74 @@ union heads
 };
 
 
-// Pointer to current break.
-static char*         curbrk;
-// Pointer to highest-address memory block currently managed by the allocator.
-static descriptor*   tail;
-// Pointer to the descriptor area currently used (i.e., with free descriptor)
-static multi_head*   desc_free_list;
-// Table of free lists.
-static descriptor*   free_lists[CACHE_SETS][ALLOC_SIZE * LINEAR_STEPS];
-// Bit vector. ith bit set iff ith free list contains free blocks (i.e., their descriptors).
-static unsigned long non_empty[(sizeof(free_lists) / sizeof(free_lists[0][0]) + LONG_BIT - 1) / LONG_BIT];
-// Bit vector. ith bit set iff cache set i contains free blocks of at least max_free_level (see below)
-static unsigned long max_free[(CACHE_SETS + LONG_BIT - 1) / LONG_BIT];
-// Number of cache sets for which such blocks are (definitively) available.
-static size_t        n_max_free;
-#ifdef FIXED_MAX_FREE
-static size_t const  max_free_level = FIXED_MAX_FREE;
-#else
-static size_t        max_free_level;
-#endif
+typedef struct cama_heap cama_heap;
+
+/*
+ * One allocator instance.
+ * Every thread allocates from its own instance, so threads do not contend
+ * for the free lists.  An instance manages a contiguous address range of
+ * REGION_SIZE bytes, aligned to REGION_SIZE, that replaces the program break
+ * of the single-threaded allocator; the instance itself lives at the start of
+ * that range.  Hence the instance owning any block is found by rounding the
+ * block address down to REGION_SIZE.
+ */
+struct cama_heap
+{
+	// Taken by the owning thread and by threads freeing blocks of this instance.
+	pthread_mutex_t lock;
+	// Next instance in the list of all instances.
+	cama_heap*    next_heap;
+	// Set when the owning thread has exited; a new thread may then adopt the instance.
+	int           orphaned;
+	// End of the address range reserved for this instance.
+	char*         limit;
+	// End of the part of that range which is accessible.
+	char*         committed;
+	// Pointer to current break.
+	char*         curbrk;
+	// Pointer to highest-address memory block currently managed by the allocator.
+	descriptor*   tail;
+	// Pointer to the descriptor area currently used (i.e., with free descriptor)
+	multi_head*   desc_free_list;
+	// Table of free lists.
+	descriptor*   free_lists[MAX_CACHE_SETS][ALLOC_SIZE * LINEAR_STEPS];
+	// Bit vector. ith bit set iff ith free list contains free blocks (i.e., their descriptors).
+	unsigned long non_empty[(MAX_CACHE_SETS * ALLOC_SIZE * LINEAR_STEPS + LONG_BIT - 1) / LONG_BIT];
+	// Bit vector. ith bit set iff cache set i contains free blocks of at least max_free_level (see below)
+	unsigned long max_free[(MAX_CACHE_SETS + LONG_BIT - 1) / LONG_BIT];
+	// Number of cache sets for which such blocks are (definitively) available.
+	size_t        n_max_free;
+	// Constant FIXED_MAX_FREE if defined.
+	size_t        max_free_level;
+};
+
+// Geometry of the cache levels, index 0 unused; 0 sets if unknown.
+static struct
+{
+	unsigned sets;
+	unsigned line_size;
+} cache_levels[MAX_CACHE_LEVELS + 1];
+// Geometry used for coloring, fixed by detect_geometry() before the first instance is set up.
+static unsigned       cache_set_bits = CACHE_SET_BITS;
+static unsigned       line_size_bits = LINE_SIZE_BITS;
+static size_t         multiblock_size;
+static size_t         size_threshold;
+
+// Instance operated on by the calling thread; only valid while holding its lock.
+static __thread cama_heap* heap;
+// Instance owned by the calling thread.
+static __thread cama_heap* own_heap;
+// List of all instances, protected by heaps_lock.
+static cama_heap*          heaps;
+static pthread_mutex_t     heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t       heap_key;
+static pthread_once_t      init_once = PTHREAD_ONCE_INIT;
 
 
 // Determines to which cache set a given pointer/address is mapped.
 static inline unsigned set_from_addr(void const* const ptr)
 {
-	return (uintptr_t)ptr / LINE_SIZE % CACHE_SETS;
+	return (uintptr_t)ptr >> line_size_bits & (CACHE_SETS - 1);
 }
 
 // Determines the level (within the free table structure) to which a given size belongs.
@@ -221,7 +302,7 @@ static inline unsigned level_from_size(size_t const size)
 		(x - LD_GRANULARITY) * LINEAR_STEPS +
 		/* Linear sub-class, might overflow and then correctly increase size class by 1 */
 		((size + (1 << (x - 2)) - 1) >> (x - 2)) - LINEAR_STEPS;
-	assert(l < lengthof(free_lists[0]));
+	assert(l < lengthof(heap->free_lists[0]));
 	return l;
 }
 
@@ -235,13 +316,13 @@ static inline unsigned level_from_size_down(size_t const size)
 		/* Linear sub-class, might overflow and then correctly increase size class by 1 */
 		(size >> (x - 2)) - LINEAR_STEPS;
 
-	return l < lengthof(free_lists[0]) ? l : lengthof(free_lists[0]) - 1;
+	return l < lengthof(heap->free_lists[0]) ? l : lengthof(heap->free_lists[0]) - 1;
 }
 
 
 static inline unsigned bit_index(unsigned const set, unsigned const level)
 {
-	return lengthof(free_lists[0]) * set + level;
+	return lengthof(heap->free_lists[0]) * set + level;
 }
 
 
@@ -249,7 +330,7 @@ static inline unsigned bit_index(unsigned const set, unsigned const level)
 // START DEBUG FUNCTIONS
 static int in_lr_list(descriptor* const desc)
 {
-	for (descriptor* i = tail; i; i = i->left) {
+	for (descriptor* i = heap->tail; i; i = i->left) {
 		if (i == desc)
 			return 1;
 	}
@@ -257,10 +338,10 @@ static int in_lr_list(descriptor* const desc)
 }
 static void check_heap(void)
 {
-	assert(tail);
-	assert((char*)tail->start + (tail->size < 0 ? -tail->size + tail->extra : tail->size + tail->extra) == curbrk);
+	assert(heap->tail);
+	assert((char*)heap->tail->start + (heap->tail->size < 0 ? -heap->tail->size + heap->tail->extra : heap->tail->size + heap->tail->extra) == heap->curbrk);
 
-	for (descriptor* i = tail; i; i = i->left) {
+	for (descriptor* i = heap->tail; i; i = i->left) {
 		assert(!i->left || i->left->right == i);
 		assert(!i->left || (char*)i->left->start + i->left->extra + (i->left->size < 0 ? -i->left->size : i->left->size) == i->start);
 		assert(i->start);
@@ -272,10 +353,10 @@ static void check_heap(void)
 		}
 	}
 
-	descriptor* const free_head = (descriptor*)(desc_free_list + 1);
+	descriptor* const free_head = (descriptor*)(heap->desc_free_list + 1);
 	assert(free_head->next != free_head);
 
-	for (multi_head* i = desc_free_list; i;) {
+	for (multi_head* i = heap->desc_free_list; i;) {
 		assert(!(i->free & 1));
 		for (size_t k = 0; k != (DESC_SETS * LINE_SIZE - sizeof(multi_head)) / sizeof(descriptor); ++k) {
 			if (i->free & 1U << k)
@@ -286,7 +367,7 @@ static void check_heap(void)
 		}
 
 		descriptor* const self = &((descriptor*)(i + 1))[0];
-		assert((descriptor*)(desc_free_list + 1) == self ? !self->prev_next : *self->prev_next == self);
+		assert((descriptor*)(heap->desc_free_list + 1) == self ? !self->prev_next : *self->prev_next == self);
 		descriptor* const next = self->next;
 		if (!next)
 			break;
@@ -295,36 +376,44 @@ static void check_heap(void)
 
 #ifndef FIXED_MAX_FREE
 	for (size_t i = 0; i != CACHE_SETS; ++i) {
-		assert(!test_bit(CACHE_SETS - 1 - i, max_free) || free_lists[i][max_free_level]);
+		assert(!test_bit(CACHE_SETS - 1 - i, heap->max_free) || heap->free_lists[i][heap->max_free_level]);
 	}
 #endif
 }
 void print_table(void)
 {
+        cama_heap* const heap = own_heap;
+        if (!heap)
+                return;
+
         fprintf(stdout, "Freelist table:\n");
-        for(int i = 0; i < CACHE_SETS; i++)
+        for(unsigned i = 0; i < CACHE_SETS; i++)
         {
                 for(int j = 0; j < ALLOC_SIZE * LINEAR_STEPS; j++)
                 {
-                        if(free_lists[i][j])
+                        if(heap->free_lists[i][j])
                                 fprintf(stdout, "[%d, %d]->", i, j);
-                        for(descriptor* descr = free_lists[i][j]; descr; descr = descr->next)
+                        for(descriptor* descr = heap->free_lists[i][j]; descr; descr = descr->next)
                                 fprintf(stdout, "%p (%Zd)->", descr->start, -descr->size);
-                        if(free_lists[i][j])
+                        if(heap->free_lists[i][j])
                                 fprintf(stdout, "\n");
                 }
         }
 
         fprintf(stdout, "Managed blocks:\n");
-        for (descriptor* i = tail; i; i = i->left) {
+        for (descriptor* i = heap->tail; i; i = i->left) {
                 fprintf(stdout, "@%p (size: %Zd; desc@%p)\n", i->start, i->size, i);
         }
 
-        fprintf(stdout, "Descr. Freelist @%p\n", desc_free_list);
+        fprintf(stdout, "Descr. Freelist @%p\n", heap->desc_free_list);
 }
 void monitor_desc_free_list()
 {
-        fprintf(stdout, "Size of desc_free_list is %Zd.\n", ((descriptor *)desc_free_list->back)->size);
+        cama_heap* const heap = own_heap;
+        if (!heap)
+                return;
+
+        fprintf(stdout, "Size of desc_free_list is %Zd.\n", ((descriptor *)heap->desc_free_list->back)->size);
 }
 // END DEBUG FUNCTIONS
 
@@ -334,12 +423,12 @@ void monitor_desc_free_list()
 // Inserts a given descriptor into the appropriate free block list.
 static unsigned insert_descriptor(descriptor* const desc, size_t const size)
 {
-	assert(size < SIZE_THRESHOLD || size == (desc->size < 0 ? -desc->size : desc->size));
+	assert(size <= SIZE_THRESHOLD || size == (desc->size < 0 ? -desc->size : desc->size));
 	assert(size > 0);
 	assert(desc->start);
 	unsigned     const set    = set_from_addr(desc->start);
 	unsigned     const level  = level_from_size_down(size);
-	descriptor** const anchor = &free_lists[set][level];
+	descriptor** const anchor = &heap->free_lists[set][level];
 	descriptor*  const head   = *anchor;
 
 	desc->prev_next = anchor;
@@ -350,36 +439,36 @@ static unsigned insert_descriptor(descriptor* const desc, size_t const size)
 		assert(head != desc);
 		head->prev_next = &desc->next;
 	} else {
-		assert(!test_bit(bit_index(set, level), non_empty));
-		set_bit(bit_index(set, level), non_empty);
+		assert(!test_bit(bit_index(set, level), heap->non_empty));
+		set_bit(bit_index(set, level), heap->non_empty);
 	}
 
 #ifdef FIXED_MAX_FREE
-	if (level >= max_free_level)
+	if (level >= heap->max_free_level)
 #else
-	if (level == max_free_level)
+	if (level == heap->max_free_level)
 #endif
 	{
 		size_t const set_idx = CACHE_SETS - 1 - set;
-		if (!test_bit(set_idx, max_free)) {
+		if (!test_bit(set_idx, heap->max_free)) {
 			#ifdef VERBOSE_DEBUG 
 			fprintf(stderr, ".max_free insert set %u level %u %p\n", set, level, desc);
 			#endif
 			
-			set_bit(set_idx, max_free);
-			++n_max_free;
+			set_bit(set_idx, heap->max_free);
+			++heap->n_max_free;
 		}
 #ifndef FIXED_MAX_FREE
-	} else if (level > max_free_level) {
+	} else if (level > heap->max_free_level) {
 		#ifdef VERBOSE_DEBUG 		
-		fprintf(stderr, "max_free replace set %u level %u (was %u) %p\n", set, level, max_free_level, desc);
+		fprintf(stderr, "max_free replace set %u level %u (was %u) %p\n", set, level, heap->max_free_level, desc);
 		#endif
 		
 		size_t const set_idx = CACHE_SETS - 1 - set;
-		memset(max_free, 0, sizeof(max_free));
-		set_bit(set_idx, max_free);
-		max_free_level = level;
-		n_max_free     = 1;
+		memset(heap->max_free, 0, sizeof(heap->max_free));
+		set_bit(set_idx, heap->max_free);
+		heap->max_free_level = level;
+		heap->n_max_free     = 1;
 #endif
 	}
 
@@ -391,15 +480,15 @@ static unsigned insert_descriptor(descriptor* const desc, size_t const size)
 static descriptor* unlink_descriptor(unsigned const set, unsigned const idx, unsigned const set_start)
 {
 	size_t       const level  = idx - set_start;
-	descriptor** const anchor = &free_lists[set][level];
+	descriptor** const anchor = &heap->free_lists[set][level];
 	descriptor*  const desc   = *anchor;
 	assert(desc->prev_next = anchor);
 	descriptor* const next = desc->next;
 	*anchor = next;
 	if (!next) {
 		// Removing the last entry on the freelist. Mark it as empty.
-		assert(test_bit(idx, non_empty));
-		clear_bit(idx, non_empty);
+		assert(test_bit(idx, heap->non_empty));
+		clear_bit(idx, heap->non_empty);
 	} else {
 		next->prev_next = anchor;
 	}
@@ -408,29 +497,29 @@ static descriptor* unlink_descriptor(unsigned const set, unsigned const idx, uns
 	assert(desc->size < 0);
 
 #ifdef FIXED_MAX_FREE
-	if (!*anchor && level >= max_free_level)
+	if (!*anchor && level >= heap->max_free_level)
 #else
-	if (!*anchor && level == max_free_level)
+	if (!*anchor && level == heap->max_free_level)
 #endif
 	{
 #ifdef FIXED_MAX_FREE
-		unsigned const nbits   = lengthof(free_lists[0]) * (set + 1);
-		unsigned const bit_pos = bit_index(set, max_free_level);
-		unsigned const idx     = find_next_bit(non_empty, nbits, bit_pos);
+		unsigned const nbits   = lengthof(heap->free_lists[0]) * (set + 1);
+		unsigned const bit_pos = bit_index(set, heap->max_free_level);
+		unsigned const idx     = find_next_bit(heap->non_empty, nbits, bit_pos);
 		if (idx == nbits)
 #endif
 		{
 			size_t const set_idx = CACHE_SETS - 1 - set;
-			if (test_bit(set_idx, max_free)) {
+			if (test_bit(set_idx, heap->max_free)) {
 				#ifdef VERBOSE_DEBUG
 				fprintf(stderr, ".max_free unlink set %u level %u %p\n", set, level, desc);
 				#endif
 
-				clear_bit(set_idx, max_free);
-				--n_max_free;
+				clear_bit(set_idx, heap->max_free);
+				--heap->n_max_free;
 #ifndef FIXED_MAX_FREE
-				if (n_max_free == 0)
-					max_free_level = 0;
+				if (heap->n_max_free == 0)
+					heap->max_free_level = 0;
 #endif
 			}
 		}
@@ -463,21 +552,21 @@ static void remove_descriptor(descriptor* const desc, size_t const size)
 
 	unsigned const set   = set_from_addr(desc->start);
 	unsigned const level = level_from_size_down(size);
-	if (!free_lists[set][level]) {
-		assert(test_bit(bit_index(set, level), non_empty));
-		clear_bit(bit_index(set, level), non_empty);
+	if (!heap->free_lists[set][level]) {
+		assert(test_bit(bit_index(set, level), heap->non_empty));
+		clear_bit(bit_index(set, level), heap->non_empty);
 
 		size_t const set_idx = CACHE_SETS - 1 - set;
 #ifdef FIXED_MAX_FREE
-		if (level >= max_free_level && test_bit(set_idx, max_free))
+		if (level >= heap->max_free_level && test_bit(set_idx, heap->max_free))
 #else
-		if (level == max_free_level && test_bit(set_idx, max_free))
+		if (level == heap->max_free_level && test_bit(set_idx, heap->max_free))
 #endif
 		{
 #ifdef FIXED_MAX_FREE
-			unsigned const nbits   = lengthof(free_lists[0]) * (set + 1);
-			unsigned const bit_pos = bit_index(set, max_free_level);
-			unsigned const idx     = find_next_bit(non_empty, nbits, bit_pos);
+			unsigned const nbits   = lengthof(heap->free_lists[0]) * (set + 1);
+			unsigned const bit_pos = bit_index(set, heap->max_free_level);
+			unsigned const idx     = find_next_bit(heap->non_empty, nbits, bit_pos);
 			if (idx == nbits)
 #endif
 			{
@@ -485,11 +574,11 @@ static void remove_descriptor(descriptor* const desc, size_t const size)
 				fprintf(stderr, "max_free remove set %u level %u %p\n", set, level, desc);
 				#endif
 
-				clear_bit(set_idx, max_free);
-				--n_max_free;
+				clear_bit(set_idx, heap->max_free);
+				--heap->n_max_free;
 #ifndef FIXED_MAX_FREE
-				if (n_max_free == 0)
-					max_free_level = 0;
+				if (heap->n_max_free == 0)
+					heap->max_free_level = 0;
 #endif
 			}
 		}
@@ -531,7 +620,7 @@ static descriptor* copy_desc(descriptor* const dst, descriptor* const src, descr
 			dst->next->prev_next = &dst->next;
 		}
 
-		if (tail == src) tail = dst;
+		if (heap->tail == src) heap->tail = dst;
 	}
 
 	// TODO
@@ -543,8 +632,8 @@ static descriptor* copy_desc(descriptor* const dst, descriptor* const src, descr
 
 static void mark_desc_free(size_t const src_idx)
 {
-	assert(!(desc_free_list->free & 1U << src_idx));
-	desc_free_list->free |= 1U << src_idx;
+	assert(!(heap->desc_free_list->free & 1U << src_idx));
+	heap->desc_free_list->free |= 1U << src_idx;
 }
 
 
@@ -560,13 +649,13 @@ static descriptor* free_descriptor(descriptor* const desc, descriptor* track)
 	if (left)  left->right = right;
 	if (right) right->left = left;
 
-	if (tail == desc) tail = left;
+	if (heap->tail == desc) heap->tail = left;
 
 	memset(desc, 0, sizeof(*desc)); // <----TODO
 
 	// Calcutate descriptor block multi_head address.
-	multi_head* const head = (multi_head*)(((size_t)desc & ~(WAY_SIZE - 1)) + DESC_START_SET * LINE_SIZE);
-	if (head == desc_free_list) {
+	multi_head* const head = (multi_head*)(((uintptr_t)desc & ~(uintptr_t)(WAY_SIZE - 1)) + DESC_START_SET * LINE_SIZE);
+	if (head == heap->desc_free_list) {
 		#ifdef VERBOSE_DEBUG
 		fprintf(stderr, "head == desc_free_list\n");
 		#endif
@@ -586,9 +675,9 @@ static descriptor* free_descriptor(descriptor* const desc, descriptor* track)
 		fprintf(stderr, "head != desc_free_list\n");
 		#endif
 		
-		descriptor* const descs     = (descriptor*)(desc_free_list + 1);
+		descriptor* const descs     = (descriptor*)(heap->desc_free_list + 1);
 		unsigned    const free_mask = (1U << (DESC_SETS * LINE_SIZE - sizeof(multi_head)) / sizeof(descriptor)) - 1 - 1;
-		unsigned          used_idx  = ffs(desc_free_list->free ^ free_mask);
+		unsigned          used_idx  = ffs(heap->desc_free_list->free ^ free_mask);
 		if (used_idx == 0) {
 			#ifdef VERBOSE_DEBUG
 			fprintf(stderr, "used_idx == 0\n");
@@ -597,7 +686,7 @@ static descriptor* free_descriptor(descriptor* const desc, descriptor* track)
 			descriptor* const used_blocks = self->next;
 			self->next               = 0;
 			used_blocks[0].prev_next = 0;
-			desc_free_list           = (multi_head*)used_blocks - 1;
+			heap->desc_free_list           = (multi_head*)used_blocks - 1;
 
 			descriptor* left = self->left;
 			if (left && left->size < 0) {
@@ -606,13 +695,13 @@ static descriptor* free_descriptor(descriptor* const desc, descriptor* track)
 				#endif
 				// Left neighbour is free, merge it.
 				remove_descriptor(left, -left->size);
-				left->size -= self->size;
+				left->size -= self->size + self->extra;
 				left->right = self->right;
 				if (left->right) {
 					self->right->left = left;
 				} else {
-					assert(tail == self);
-					tail = left;
+					assert(heap->tail == self);
+					heap->tail = left;
 				}
 
 				descriptor* const right = self->right;
@@ -627,10 +716,13 @@ static descriptor* free_descriptor(descriptor* const desc, descriptor* track)
 					if (left->right) {
 						left->right->left = left;
 					} else {
-						assert(tail == right);
-						tail = left;
+						assert(heap->tail == right);
+						heap->tail = left;
 					}
 
+					if (track == right)
+						track = left;
+
 					size_t const src_idx = &used_blocks[2] != desc ? 2 : 3;
 					if (left == &used_blocks[src_idx])
 						left = right;
@@ -663,10 +755,13 @@ static descriptor* free_descriptor(descriptor* const desc, descriptor* track)
 					if (desc->right) {
 						desc->right->left = desc;
 					} else {
-						assert(tail == right);
-						tail = desc;
+						assert(heap->tail == right);
+						heap->tail = desc;
 					}
 
+					if (track == right)
+						track = desc;
+
 					// Copy new free head index 1.
 					mark_desc_free(1);
 					track = copy_desc(right, &used_blocks[1], track);
@@ -692,24 +787,42 @@ static descriptor* free_descriptor(descriptor* const desc, descriptor* track)
 }
 
 
+// Merges the free block desc with its right neighbour if that one is free as
+// well.  Returns the new position of track.
+static descriptor* merge_free_right(descriptor* const desc, descriptor* const track)
+{
+	assert(desc->size < 0);
+
+	descriptor* const right = desc->right;
+	if (!right || right->size >= 0)
+		return track;
+
+	remove_descriptor(right, -right->size);
+	remove_descriptor(desc, -desc->size);
+	desc->size += right->size;
+	insert_descriptor(desc, -desc->size);
+	return free_descriptor(right, track);
+}
+
 static inline void setbrk(void* const addr)
 {
 	assert(((uintptr_t)addr & (LINE_SIZE - 1)) == 0);
 
-#ifdef __APPLE__
-	void* res;
-#else
-	int res;
-#endif
-	res = brk(addr);
+	if ((char*)addr <= heap->committed)
+		return;
 
-#ifdef __APPLE__
-	assert(res != (void*)-1);
-#else
-	assert(res != -1);
-#endif
+	if ((char*)addr > heap->limit) {
+		// The address range of an instance cannot grow, it must stay contiguous.
+		fprintf(stderr, "camarea: thread region of %lu MB exhausted\n", (unsigned long)(REGION_SIZE >> 20));
+		abort();
+	}
 
-	(void)res;
+	char* const end = (char*)(((uintptr_t)addr + COMMIT_SIZE - 1) & ~(COMMIT_SIZE - 1));
+	if (mprotect(heap->committed, end - heap->committed, PROT_READ | PROT_WRITE) != 0) {
+		perror("camarea: mprotect");
+		abort();
+	}
+	heap->committed = end;
 }
 
 
@@ -717,30 +830,30 @@ static descriptor* get_descriptor(void)
 {
 	descriptor* res;
 
-	int free_idx = ffs(desc_free_list->free);
+	int free_idx = ffs(heap->desc_free_list->free);
 	if (free_idx == 0) {
 		unsigned const set     = DESC_START_SET;
 		size_t   const size    = DESC_SETS * LINE_SIZE;
 		unsigned const level   = level_from_size(size);
-		unsigned const nbits   = lengthof(free_lists[0]) * (set + 1);
+		unsigned const nbits   = lengthof(heap->free_lists[0]) * (set + 1);
 		unsigned const bit_pos = bit_index(set, level);
-		unsigned       idx     = find_next_bit(non_empty, nbits, bit_pos);
+		unsigned       idx     = find_next_bit(heap->non_empty, nbits, bit_pos);
 		if (idx == nbits) {
 			// No free suitable blocks
-			char*       const oldbrk     = curbrk;
-			unsigned    const oldbrk_set = (uintptr_t)oldbrk / LINE_SIZE % CACHE_SETS;
-			char*             start      = oldbrk - (uintptr_t)oldbrk % WAY_SIZE + DESC_START_SET * LINE_SIZE;
+			char*       const oldbrk     = heap->curbrk;
+			unsigned    const oldbrk_set = set_from_addr(oldbrk);
+			char*             start      = oldbrk - ((uintptr_t)oldbrk & (WAY_SIZE - 1)) + DESC_START_SET * LINE_SIZE;
 			if (DESC_START_SET <= oldbrk_set) start += WAY_SIZE;
 			size_t      const gap        = start - oldbrk;
 			multi_head* const head       = (multi_head*)start;
 			descriptor* const descs      = (descriptor*)(head + 1);
 
-			curbrk = start + DESC_SETS * LINE_SIZE;
-			setbrk(curbrk);
+			heap->curbrk = start + DESC_SETS * LINE_SIZE;
+			setbrk(heap->curbrk);
 
 			head->free = (1U << (DESC_SETS * LINE_SIZE - sizeof(multi_head)) / sizeof(descriptor)) - 1;
 
-			descriptor* const t    = tail;
+			descriptor* const t    = heap->tail;
 			size_t            i    = 0;
 			descriptor* const self = &descs[i];
 			head->free &= ~(1U << i++);
@@ -753,13 +866,13 @@ static descriptor* get_descriptor(void)
 			self->size  = DESC_SETS * LINE_SIZE;
 			head->back  = self;
 			t->right    = self;
-			tail = self;
+			heap->tail = self;
 
-			descriptor* const old_self_head = (descriptor*)(desc_free_list + 1);
+			descriptor* const old_self_head = (descriptor*)(heap->desc_free_list + 1);
 			old_self_head->prev_next = &self->next;
 			self->prev_next          = 0;
 			self->next               = old_self_head;
-			desc_free_list           = head;
+			heap->desc_free_list           = head;
 
 			if (t->size < 0) {
 				// The last block is free, add the gap to it.
@@ -808,11 +921,11 @@ static descriptor* get_descriptor(void)
 			head->back = self;
 			head->free = (1U << (DESC_SETS * LINE_SIZE - sizeof(multi_head)) / sizeof(descriptor)) - 1 - 1;
 
-			descriptor* const old_self_head = (descriptor*)(desc_free_list + 1);
+			descriptor* const old_self_head = (descriptor*)(heap->desc_free_list + 1);
 			old_self_head->prev_next = &self->next;
 			self->prev_next          = 0;
 			self->next               = old_self_head;
-			desc_free_list           = head;
+			heap->desc_free_list           = head;
 
 			size_t const rest_size = -self->size - size;
 			if (rest_size >= SIZE_THRESHOLD) {
@@ -824,12 +937,13 @@ static descriptor* get_descriptor(void)
 
 				rest->start = (char*)self->start + size;
 				rest->size  = -(ssize_t)rest_size;
+				rest->extra = 0;
 				descriptor* const right = self->right;
 				if (right) {
 					right->left = rest;
 				} else {
-					assert(tail == desc);
-					tail = rest;
+					assert(heap->tail == desc);
+					heap->tail = rest;
 				}
 				rest->right = right;
 				rest->left  = self;
@@ -844,8 +958,8 @@ static descriptor* get_descriptor(void)
 		}
 	} else {
 		--free_idx;
-		desc_free_list->free &= ~(1U << free_idx);
-		res = &((descriptor*)(desc_free_list + 1))[free_idx];
+		heap->desc_free_list->free &= ~(1U << free_idx);
+		res = &((descriptor*)(heap->desc_free_list + 1))[free_idx];
 		#ifdef VERBOSE_DEBUG
 		fprintf(stderr, "using %d: %p\n", __LINE__, res);
 		#endif
@@ -861,21 +975,21 @@ static descriptor* allocate_memory(unsigned const set, size_t const size)
 {
 	descriptor* const res = get_descriptor();
 
-	char*    const oldbrk     = curbrk;
-	unsigned const oldbrk_set = (uintptr_t)oldbrk / LINE_SIZE % CACHE_SETS;
-	char*          start      = oldbrk - (uintptr_t)oldbrk % WAY_SIZE + set * LINE_SIZE;
-	if (set < oldbrk_set || (set == oldbrk_set && (uintptr_t)oldbrk % LINE_SIZE != 0)) start += WAY_SIZE;
+	char*    const oldbrk     = heap->curbrk;
+	unsigned const oldbrk_set = set_from_addr(oldbrk);
+	char*          start      = oldbrk - ((uintptr_t)oldbrk & (WAY_SIZE - 1)) + set * LINE_SIZE;
+	if (set < oldbrk_set || (set == oldbrk_set && ((uintptr_t)oldbrk & (LINE_SIZE - 1)) != 0)) start += WAY_SIZE;
 	size_t   const gap        = start - oldbrk;
 
-	curbrk = start + size;
-	setbrk(curbrk);
+	heap->curbrk = start + size;
+	setbrk(heap->curbrk);
 
-	descriptor* const t = tail;
+	descriptor* const t = heap->tail;
 	res->start = start;
 	res->left  = t;
 	res->right = t->right;
 	res->size  = size;
-	tail = res;
+	heap->tail = res;
 
 	if (t->right) {
 		t->right->left = res;
@@ -910,12 +1024,12 @@ static descriptor* allocate_memory(unsigned const set, size_t const size)
 static descriptor* allocate_block(size_t const size, unsigned const set)
 {
 	unsigned const level   = level_from_size(size);
-	unsigned const nbits   = lengthof(free_lists[0]) * (set + 1);
+	unsigned const nbits   = lengthof(heap->free_lists[0]) * (set + 1);
 	unsigned const bit_pos = bit_index(set, level);
-	unsigned const idx     = find_next_bit(non_empty, nbits, bit_pos);
+	unsigned const idx     = find_next_bit(heap->non_empty, nbits, bit_pos);
 	if (idx != nbits) {
 		unsigned    const set_start = bit_index(set, 0);
-		descriptor* const desc      = unlink_descriptor(set, idx, set_start);
+		descriptor*       desc      = unlink_descriptor(set, idx, set_start);
 		assert((size_t)-desc->size >= size);
 		size_t const rest_size = -desc->size - size;
 		if (rest_size >= SIZE_THRESHOLD) {
@@ -928,13 +1042,15 @@ static descriptor* allocate_block(size_t const size, unsigned const set)
 			if (right) {
 				right->left = rest;
 			} else {
-				assert(tail == desc);
-				tail = rest;
+				assert(heap->tail == desc);
+				heap->tail = rest;
 			}
 			rest->right = right;
 			rest->left  = desc;
 			desc->right = rest;
 			insert_descriptor(rest, rest_size);
+			// get_descriptor() may have left a free gap right of rest.
+			desc = merge_free_right(rest, desc);
 		} else {
 			desc->size  = size;
 			desc->extra = rest_size;
@@ -944,17 +1060,17 @@ static descriptor* allocate_block(size_t const size, unsigned const set)
 		return desc;
 	}
 
-	if (level <= max_free_level) {
-		unsigned const max_nbits   = sizeof(max_free) * CHAR_BIT;
+	if (level <= heap->max_free_level) {
+		unsigned const max_nbits   = CACHE_SETS;
 		unsigned const max_bit_pos = CACHE_SETS - 1 - set;
-		unsigned       max_idx     = find_next_bit(max_free, max_nbits, max_bit_pos);
+		unsigned       max_idx     = find_next_bit(heap->max_free, max_nbits, max_bit_pos);
 		size_t         lgap;
 		if (max_idx == max_nbits) {
 			#ifdef VERBOSE_DEBUG
 			fprintf(stderr, "scan 2\n");
 			#endif
 
-			max_idx = find_next_bit(max_free, max_bit_pos, 0);
+			max_idx = find_next_bit(heap->max_free, max_bit_pos, 0);
 			if (max_idx == max_bit_pos)
 				goto allocate;
 			lgap = (CACHE_SETS + max_idx - max_bit_pos) * LINE_SIZE;
@@ -967,21 +1083,21 @@ static descriptor* allocate_block(size_t const size, unsigned const set)
 
 		unsigned const oset = CACHE_SETS - 1 - max_idx;
 #ifdef FIXED_MAX_FREE
-		unsigned const nbits   = lengthof(free_lists[0]) * (oset + 1);
-		unsigned const bit_pos = bit_index(oset, max_free_level);
-		unsigned const idx     = find_next_bit(non_empty, nbits, bit_pos);
+		unsigned const nbits   = lengthof(heap->free_lists[0]) * (oset + 1);
+		unsigned const bit_pos = bit_index(oset, heap->max_free_level);
+		unsigned const idx     = find_next_bit(heap->non_empty, nbits, bit_pos);
 		assert(idx != nbits);
-		unsigned const olevel  = idx - oset * lengthof(free_lists[0]);
+		unsigned const olevel  = idx - oset * lengthof(heap->free_lists[0]);
 #else
-		unsigned const olevel = max_free_level;
+		unsigned const olevel = heap->max_free_level;
 #endif
-		if (lgap + size <= -free_lists[oset][olevel]->size) {
+		if (lgap + size <= -heap->free_lists[oset][olevel]->size) {
 			#ifdef VERBOSE_DEBUG
 			fprintf(stderr, "lgap %zu\n", lgap);
 			#endif
 
 			unsigned    const oset_start = oset * (ALLOC_SIZE * LINEAR_STEPS);
-			descriptor* const desc       = unlink_descriptor(oset, oset_start + olevel, oset_start);
+			descriptor*       desc       = unlink_descriptor(oset, oset_start + olevel, oset_start);
 			assert(lgap + size <= -desc->size);
 
 			#ifdef VERBOSE_DEBUG
@@ -1046,13 +1162,15 @@ static descriptor* allocate_block(size_t const size, unsigned const set)
 				if (desc->right) {
 					desc->right->left = rgap_desc;
 				} else {
-					assert(tail == desc);
-					tail = rgap_desc;
+					assert(heap->tail == desc);
+					heap->tail = rgap_desc;
 				}
 
 				desc->right = rgap_desc;
 				desc->size  = size;
 				desc->extra = 0;
+				// get_descriptor() may have left a free gap right of rgap_desc.
+				desc = merge_free_right(rgap_desc, desc);
 			} else {
 				desc->size  = size;
 				desc->extra = rgap;
@@ -1073,15 +1191,17 @@ allocate:
 
 static inline unsigned subblock_count(size_t const size)
 {
-	unsigned const n = (MULTIBLOCK_SIZE - sizeof(multi_head)) / size;
+	unsigned n = (MULTIBLOCK_SIZE - sizeof(multi_head)) / size;
 	assert(1 < n);
-	assert(n < sizeof(unsigned) * CHAR_BIT);
+	// The slots are tracked in an unsigned: with 64-bit descriptors MULTIBLOCK_SIZE holds more small blocks.
+	if (n >= sizeof(unsigned) * CHAR_BIT)
+		n = sizeof(unsigned) * CHAR_BIT - 1;
 	return n;
 }
 
 
 static size_t here_malloc = 0;
-void* camalloc(size_t size, unsigned set)
+static void* heap_malloc(size_t size, unsigned set)
 {
 	#ifdef VERBOSE_DEBUG
 	fprintf(stderr, "enter camalloc: %zu\n", ++here_malloc);
@@ -1103,14 +1223,20 @@ void* camalloc(size_t size, unsigned set)
 	} else {
 		// A small allocation.
 		unsigned const n_subblocks = subblock_count(size);
-		unsigned const set_range   = (sizeof(multi_head) + (n_subblocks - 1) * size) / LINE_SIZE + 1;
+		unsigned const set_range   = ((sizeof(multi_head) + (n_subblocks - 1) * size) >> line_size_bits) + 1;
 		set = set / set_range * set_range;
 		unsigned    const level = level_from_size(size);
-		descriptor* const desc  = free_lists[set][level];
+		descriptor*       desc  = heap->free_lists[set][level];
+		// Free blocks just above SIZE_THRESHOLD share this level with multi-blocks, skip them.
+		while (desc && desc->size < 0)
+			desc = desc->next;
 
 		if (!desc) {
 			// No free suitable blocks
-			size_t      const multi_size  = ROUND_LINE_SIZE(sizeof(multi_head) + n_subblocks * size);
+			size_t            multi_size  = ROUND_LINE_SIZE(sizeof(multi_head) + n_subblocks * size);
+			// With the subblock count capped the block may be small; free blocks must exceed SIZE_THRESHOLD.
+			if (multi_size <= SIZE_THRESHOLD)
+				multi_size = ROUND_LINE_SIZE(SIZE_THRESHOLD + 1);
 			descriptor* const desc        = allocate_block(multi_size, set);
 			multi_head* const multi       = (multi_head*)desc->start;
 			multi->back = desc;
@@ -1147,6 +1273,20 @@ void* camalloc(size_t size, unsigned set)
 }
 
 
+/*
+ * The header of the block ptr points to.  camemalign(...) puts another one in
+ * front of an aligned address inside the block, which points to the block's
+ * own header with the low bit set: copy_desc(...) keeps only that one up to date.
+ */
+static inline block_head* block_from_ptr(void* const ptr)
+{
+	block_head* const block = (block_head*)ptr - 1;
+	if ((uintptr_t)block->back & 1)
+		return (block_head*)((uintptr_t)block->back & ~(uintptr_t)1);
+	return block;
+}
+
+
 static size_t here = 0;
 
 /* EDB: Added (adapted from cafree, below): returns object size */
@@ -1162,13 +1302,15 @@ size_t camsize(void* const ptr)
 
 	if (!ptr) return 0;
 
-	block_head*  const block = (block_head*)ptr - 1;
+	block_head*  const block = block_from_ptr(ptr);
 	common_head* const head  = block->back;
 	assert(head->size >= 0);
-	return head->size;
+
+	// The room from ptr, which camemalign may have put past the start of the block, to its end.
+	return (char*)block + head->size - (char*)ptr;
 }
 
-void cafree(void* const ptr)
+static void heap_free(void* const ptr)
 {
 	#ifdef VERBOSE_DEBUG
 	fprintf(stderr, "enter %s(%p)\n", __func__, ptr);
@@ -1179,7 +1321,7 @@ void cafree(void* const ptr)
 
 	if (!ptr) return;
 
-	block_head*  const block = (block_head*)ptr - 1;
+	block_head*  const block = block_from_ptr(ptr);
 	common_head* const head  = block->back;
 	assert(head->size >= 0);
 
@@ -1222,11 +1364,13 @@ void cafree(void* const ptr)
 		}
 	}
 
-	for (descriptor* i = tail;; i = i->left) {
+#ifndef NDEBUG
+	for (descriptor* i = heap->tail;; i = i->left) {
 		assert(i);
 		if (i == desc)
 			break;
 	}
+#endif
 
 	// A big block or a completely free multi-block
 	#ifdef VERBOSE_DEBUG
@@ -1274,7 +1418,7 @@ void cafree(void* const ptr)
 		remove_descriptor(left, -left->size);
 		left->size += size;
 		insert_descriptor(left, -left->size);
-		free_descriptor(desc, 0);
+		desc = free_descriptor(desc, left);
 	} else {
 		size_t const extra = left->extra;
 		left->extra  = 0;
@@ -1283,6 +1427,9 @@ void cafree(void* const ptr)
 		assert(desc->size < 0);
 		insert_descriptor(desc, -desc->size);
 	}
+	// Releasing an empty descriptor block above may have freed the memory
+	// right of this block while it was not marked free yet.
+	merge_free_right(desc, 0);
 	// TODO lower brk if this free block ends at the brk
 	#ifdef CHECK_HEAP	
 	check_heap();
@@ -1290,12 +1437,119 @@ void cafree(void* const ptr)
 }
 
 
-void cainit(void)
+#ifdef __linux__
+// Reads a sysfs attribute of cache index of CPU 0; avoids stdio, which may allocate.
+static int read_cache_attr(unsigned const index, char const* const name, char* const buf, size_t const size)
+{
+	char path[96];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/%s", index, name);
+	int const fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ssize_t const n = read(fd, buf, size - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	return 1;
+}
+#endif
+
+static void detect_sysfs(void)
 {
-	char* const old_brk    = sbrk(0);
-	char* const desc_start = (char*)((((uintptr_t)old_brk + (WAY_SIZE - 1) - DESC_START_SET * LINE_SIZE) & ~(WAY_SIZE - 1)) + DESC_START_SET * LINE_SIZE);
-	curbrk = desc_start + DESC_SETS * LINE_SIZE;
-	setbrk(curbrk);
+#ifdef __linux__
+	char buf[32];
+	for (unsigned index = 0; read_cache_attr(index, "level", buf, sizeof(buf)); ++index) {
+		unsigned const level = strtoul(buf, 0, 10);
+		if (level == 0 || level > MAX_CACHE_LEVELS)
+			continue;
+		if (!read_cache_attr(index, "type", buf, sizeof(buf)) || strncmp(buf, "Instruction", 11) == 0)
+			continue;
+		if (!read_cache_attr(index, "number_of_sets", buf, sizeof(buf)))
+			continue;
+		unsigned const sets = strtoul(buf, 0, 10);
+		if (!read_cache_attr(index, "coherency_line_size", buf, sizeof(buf)))
+			continue;
+		cache_levels[level].sets      = sets;
+		cache_levels[level].line_size = strtoul(buf, 0, 10);
+	}
+#endif
+}
+
+static void detect_cpuid(void)
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+		return;
+	// Deterministic cache parameters: leaf 4 on Intel, 0x8000001D on AMD.
+	unsigned leaf = 4;
+	if (ebx == signature_AMD_ebx) {
+		if (__get_cpuid_max(0x80000000, 0) < 0x8000001D)
+			return;
+		leaf = 0x8000001D;
+	} else if (eax < 4) {
+		return;
+	}
+
+	for (unsigned i = 0;; ++i) {
+		__cpuid_count(leaf, i, eax, ebx, ecx, edx);
+		unsigned const type = eax & 0x1F; // 1 data, 2 instruction, 3 unified
+		if (type == 0)
+			break;
+		unsigned const level = eax >> 5 & 0x7;
+		if (type == 2 || level == 0 || level > MAX_CACHE_LEVELS)
+			continue;
+		cache_levels[level].sets      = ecx + 1;
+		cache_levels[level].line_size = (ebx & 0xFFF) + 1;
+	}
+#endif
+}
+
+// Determines the cache geometry; the layout of all instances depends on it.
+static void detect_geometry(void)
+{
+	detect_sysfs();
+	if (cache_levels[CACHE_LEVEL].sets == 0)
+		detect_cpuid();
+
+	unsigned const sets = cache_levels[CACHE_LEVEL].sets;
+	unsigned const line = cache_levels[CACHE_LEVEL].line_size;
+	if (sets != 0 && line != 0 && (line & (line - 1)) == 0) {
+		// Only the power of two part of the set index is a plain address bit field.
+		unsigned set_bits  = ld1(sets & -sets) - 1;
+		unsigned line_bits = ld1(line) - 1;
+		if (set_bits > MAX_CACHE_SET_BITS)
+			set_bits = MAX_CACHE_SET_BITS;
+		if (set_bits >= MIN_CACHE_SET_BITS && MIN_LINE_SIZE_BITS <= line_bits && line_bits <= MAX_LINE_SIZE_BITS) {
+			cache_set_bits = set_bits;
+			line_size_bits = line_bits;
+		}
+	}
+
+	multiblock_size = ROUND_LINE_SIZE((CACHE_SETS - DESC_SETS) * LINE_SIZE / (DESC_SETS * LINE_SIZE / sizeof(descriptor)));
+	size_threshold  = (multiblock_size - sizeof(multi_head)) / 2;
+	assert(size_threshold < DESC_SETS * LINE_SIZE);
+}
+
+// Sets up an empty instance at the start of its reserved address range;
+// h->committed must already cover the instance itself.
+static void init_heap(cama_heap* const h)
+{
+	heap = h;
+	pthread_mutex_init(&h->lock, 0);
+	h->limit          = (char*)h + REGION_SIZE;
+	#ifdef FIXED_MAX_FREE
+	h->max_free_level = FIXED_MAX_FREE;
+	// Multi-blocks are on the free lists too; they must stay below the tracked levels.
+	if (h->max_free_level <= level_from_size_down(SIZE_THRESHOLD))
+		h->max_free_level = level_from_size_down(SIZE_THRESHOLD) + 1;
+	#endif
+
+	char* const old_brk    = (char*)h + ROUND_LINE_SIZE(sizeof(*h));
+	char* const desc_start = (char*)((((uintptr_t)old_brk + (WAY_SIZE - 1) - DESC_START_SET * LINE_SIZE) & ~(uintptr_t)(WAY_SIZE - 1)) + DESC_START_SET * LINE_SIZE);
+	heap->curbrk = desc_start + DESC_SETS * LINE_SIZE;
+	setbrk(heap->curbrk);
 
 	multi_head* const head = (multi_head*)desc_start;
 	head->free = (1U << (DESC_SETS * LINE_SIZE - sizeof(multi_head)) / sizeof(descriptor)) - 1 - 1;
@@ -1314,23 +1568,192 @@ void cainit(void)
 	self->size      = DESC_SETS * LINE_SIZE;
 	head->back      = self;
 
-	desc_free_list = head;
-	tail           = self;
+	heap->desc_free_list = head;
+	heap->tail           = self;
+}
+
+// Reserves the address range for a new instance.
+static cama_heap* new_heap(void)
+{
+	// Reserve twice the size, so the range can be aligned to REGION_SIZE.
+	char* const map = mmap(0, 2 * REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	char* const start = (char*)(((uintptr_t)map + REGION_SIZE - 1) & ~(REGION_SIZE - 1));
+	if (start != map)
+		munmap(map, start - map);
+	munmap(start + REGION_SIZE, map + REGION_SIZE - start);
+
+	// Make the instance itself accessible, init_heap() commits the rest on demand.
+	size_t const header = (sizeof(cama_heap) + COMMIT_SIZE - 1) & ~(COMMIT_SIZE - 1);
+	if (mprotect(start, header, PROT_READ | PROT_WRITE) != 0) {
+		munmap(start, REGION_SIZE);
+		return 0;
+	}
+
+	cama_heap* const h = (cama_heap*)start;
+	h->committed = start + header;
+	init_heap(h);
+
+	pthread_mutex_lock(&heaps_lock);
+	h->next_heap = heaps;
+	heaps        = h;
+	pthread_mutex_unlock(&heaps_lock);
+	return h;
+}
+
+// Called on thread exit: the blocks stay valid, the instance may be adopted.
+static void release_heap(void* const h)
+{
+	pthread_mutex_lock(&heaps_lock);
+	((cama_heap*)h)->orphaned = 1;
+	pthread_mutex_unlock(&heaps_lock);
+}
+
+static void init_allocator(void)
+{
+	detect_geometry();
+	pthread_key_create(&heap_key, release_heap);
+}
+
+// Returns the instance of the calling thread, creating or adopting one if necessary.
+static cama_heap* get_heap(void)
+{
+	cama_heap* h = own_heap;
+	if (h)
+		return h;
+
+	pthread_once(&init_once, init_allocator);
+
+	pthread_mutex_lock(&heaps_lock);
+	for (h = heaps; h && !h->orphaned; h = h->next_heap) {}
+	if (h)
+		h->orphaned = 0;
+	pthread_mutex_unlock(&heaps_lock);
+
+	if (!h) {
+		h = new_heap();
+		if (!h)
+			return 0;
+	}
+
+	own_heap = h;
+	pthread_setspecific(heap_key, h);
+	return h;
+}
+
+static inline cama_heap* heap_from_ptr(void const* const ptr)
+{
+	return (cama_heap*)((uintptr_t)ptr & ~(REGION_SIZE - 1));
+}
+
+
+void cainit(void)
+{
+	get_heap();
+}
+
+int cageometry(unsigned const level, unsigned* const sets, unsigned* const line_size)
+{
+	pthread_once(&init_once, init_allocator);
+
+	if (level == 0) {
+		*sets      = CACHE_SETS;
+		*line_size = LINE_SIZE;
+		return 1;
+	}
+	if (level > MAX_CACHE_LEVELS || cache_levels[level].sets == 0)
+		return 0;
+	*sets      = cache_levels[level].sets;
+	*line_size = cache_levels[level].line_size;
+	return 1;
+}
+
+void* camalloc(size_t const size, unsigned const set)
+{
+	cama_heap* const h = get_heap();
+	if (!h)
+		return 0;
+
+	pthread_mutex_lock(&h->lock);
+	heap = h;
+	// Callers written for a different geometry get the corresponding set of this cache.
+	void* const res = heap_malloc(size, set & (CACHE_SETS - 1));
+	pthread_mutex_unlock(&h->lock);
+	return res;
+}
+
+void* camemalign(size_t const alignment, size_t const size, unsigned const set)
+{
+	size_t const total = size + alignment + sizeof(block_head);
+	if (total < size)
+		return 0;
+	char* const ptr = camalloc(total, set);
+	if (!ptr)
+		return 0;
+	char* aligned = (char*)(((uintptr_t)ptr + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	if (aligned != ptr) {
+		// Room for a header in front of the aligned address (see block_from_ptr).
+		if ((size_t)(aligned - ptr) < sizeof(block_head))
+			aligned += alignment;
+		((block_head*)aligned - 1)->back = (common_head*)((uintptr_t)((block_head*)ptr - 1) | 1);
+	}
+	return aligned;
+}
+
+void cafree(void* const ptr)
+{
+	if (!ptr) return;
+
+	// The block may belong to the instance of another thread.
+	cama_heap* const h = heap_from_ptr(ptr);
+	pthread_mutex_lock(&h->lock);
+	heap = h;
+	heap_free(ptr);
+	pthread_mutex_unlock(&h->lock);
+}
+
+void calock(void)
+{
+	pthread_mutex_lock(&heaps_lock);
+	for (cama_heap* h = heaps; h; h = h->next_heap) {
+		pthread_mutex_lock(&h->lock);
+	}
+}
+
+void caunlock(void)
+{
+	for (cama_heap* h = heaps; h; h = h->next_heap) {
+		pthread_mutex_unlock(&h->lock);
+	}
+	pthread_mutex_unlock(&heaps_lock);
 }
 
 static inline unsigned ptr2set(void const* const ptr)
 {
-	return (uintptr_t)ptr >> LINE_SIZE_BITS & ((1U << CACHE_SET_BITS) - 1);
+	return set_from_addr(ptr);
 }
 
 void* carelmalloc(size_t const size, enum alloc_relation_t const rel, ...)
 {
 	switch (rel) {
 	case ALLOC_DIFFERENT_SET: {
-		unsigned long sets[(CACHE_SETS + LONG_BIT - 1) / LONG_BIT];
+		cama_heap* const h = get_heap();
+		if (!h)
+			return 0;
+
+		unsigned long sets[(MAX_CACHE_SETS + LONG_BIT - 1) / LONG_BIT];
 		for (size_t i = 0; i != 2; ++i) {
 			if (i == 0) {
-				memcpy(sets, max_free, sizeof(sets));
+				// max_free is indexed in reverse set order.
+				memset(sets, 0, sizeof(sets));
+				pthread_mutex_lock(&h->lock);
+				for (unsigned set = 0; set != CACHE_SETS; ++set) {
+					if (test_bit(CACHE_SETS - 1 - set, h->max_free))
+						set_bit(set, sets);
+				}
+				pthread_mutex_unlock(&h->lock);
 			} else {
 				memset(sets, 0xFF, sizeof(sets));
 			}
@@ -77,6 +77,11 @@ public:
     return ptr;
   }
   
+  // An aligned object gets a header of its own, so cafree takes it.
+  void * memalign (size_t alignment, size_t sz) {
+    return camemalign (alignment, sz, 1);
+  }
+
   void free (void * ptr) {
     cafree (ptr);
   }
@@ -85,12 +90,19 @@ public:
     return camsize (ptr);
   }
 
+  // CAMA locks its per-thread instances itself; these are for fork().
+  void lock() {
+    calock();
+  }
+
+  void unlock() {
+    caunlock();
+  }
+
 };
 
 typedef
- ANSIWrapper<
-  LockedHeap<PosixLockType,
-	     CAMAHeap> >
+ ANSIWrapper<CAMAHeap>
 TheCustomHeap;
 
 class TheCustomHeapType : public TheCustomHeap {};
@@ -116,6 +128,10 @@ extern "C" {
     getCustomHeap()->free (ptr);
   }
 
+  void * xxmemalign (size_t alignment, size_t sz) {
+    return getCustomHeap()->memalign (alignment, sz);
+  }
+
   size_t xxmalloc_usable_size (void * ptr) {
     return getCustomHeap()->getSize (ptr);
   }
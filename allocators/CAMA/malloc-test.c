@@ -17,6 +17,9 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #endif
+#ifdef PERFCOUNT
+#include "perfcount.h"
+#endif
 
 #ifndef MEMORY
 #define MEMORY          4000000l
@@ -353,6 +356,9 @@ main(argc, argv) int argc; char *argv[];
         long sbrk_max, sum;
         double sbrk_used_sum, total_size_sum;
         void* dummy = 0;
+#ifdef PERFCOUNT
+        struct perfcount pc;
+#endif
 
         if(argc > 1) max = atoi(argv[1]);
         if(argc > 2) size = atoi(argv[2]);
@@ -391,6 +397,10 @@ main(argc, argv) int argc; char *argv[];
         }
         sbrk_max = 0;
         sbrk_used_sum = total_size_sum = 0.0;
+#ifdef PERFCOUNT
+        perfcount_init(&pc);
+        perfcount_start(&pc);
+#endif
         for(i=next_i=count=0; i<=max;) {
 #if TEST > 1
                 bin_test();
@@ -453,6 +463,9 @@ main(argc, argv) int argc; char *argv[];
                         next_i += I_AVERAGE;
                 }
         }
+#ifdef PERFCOUNT
+        perfcount_stop(&pc);
+#endif
 
         /* Correct sbrk values. */
         sbrk_max -= (long)base_ptr;
@@ -476,6 +489,9 @@ main(argc, argv) int argc; char *argv[];
                    (1.0 - (double)total_size_sum/sbrk_used_sum)*100.0);
         print_times();
         printf("\n");
+#endif
+#ifdef PERFCOUNT
+        perfcount_print(stdout, "all", &pc);
 #endif
         return 0;
 }
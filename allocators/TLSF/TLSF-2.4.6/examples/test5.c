@@ -0,0 +1,101 @@
+/* Realloc latency: a fixed pool, a fixed pseudo-random sequence of
+   reallocs, and the worst case in cycles, which is what a realtime
+   system has to budget for. The same seed gives the same sequence of
+   block layouts on every run, so results can be compared across builds. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tlsf.h"
+
+#define POOL_SIZE       (4 * 1024 * 1024)
+#define NUM_BLOCKS      (512)
+#define SIZE_MAX_BLOCK  (4096)
+#define NUM_REALLOCS    (1000000)
+
+static char pool[POOL_SIZE];
+
+static unsigned long long
+cycles (void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+  unsigned int lo, hi;
+
+  __asm__ __volatile__ ("rdtsc":"=a" (lo), "=d" (hi));
+  return ((unsigned long long) hi << 32) | lo;
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static unsigned int seed = 1;
+
+static size_t
+next_size (void)
+{
+  seed = seed * 1103515245 + 12345;
+  return 1 + (seed >> 8) % SIZE_MAX_BLOCK;
+}
+
+int
+main (void)
+{
+  void *m[NUM_BLOCKS];
+  size_t sz[NUM_BLOCKS];
+  unsigned long long s, d, max = 0, sum = 0;
+  unsigned long moved = 0;
+  size_t t;
+  int i, j;
+
+  /* Fault the pool in first, so page faults do not count as latency */
+  memset (pool, 0, POOL_SIZE);
+  init_memory_pool (POOL_SIZE, pool);
+  for (i = 0; i < NUM_BLOCKS; i++) {
+    sz[i] = next_size ();
+    if (!(m[i] = malloc_ex (sz[i], pool))) {
+      printf ("Error\n");
+      exit (-1);
+    }
+    memset (m[i], i, sz[i]);
+  }
+  for (j = 0; j < NUM_REALLOCS; j++) {
+    void *p;
+
+    i = (int) (next_size () % NUM_BLOCKS);
+    t = next_size ();
+    s = cycles ();
+    p = realloc_ex (m[i], t, pool);
+    d = cycles () - s;
+    if (!p) {
+      printf ("Error\n");
+      exit (-1);
+    }
+    if (*(unsigned char *) p != (unsigned char) i) {
+      printf ("Contents lost\n");
+      exit (-1);
+    }
+    if (p != m[i]) {
+      moved++;
+    }
+    if (d > max) {
+      max = d;
+    }
+    sum += d;
+    memset (p, i, t);
+    m[i] = p;
+    sz[i] = t;
+  }
+  for (i = 0; i < NUM_BLOCKS; i++) {
+    free_ex (m[i], pool);
+  }
+  destroy_memory_pool (pool);
+
+  printf ("realloc: %d calls, %lu moved, mean %llu, worst %llu cycles\n",
+          NUM_REALLOCS, moved, sum / NUM_REALLOCS, max);
+  printf ("Test OK\n");
+  exit (0);
+}
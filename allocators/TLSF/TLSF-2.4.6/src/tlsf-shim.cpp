@@ -4,7 +4,9 @@ extern "C" {
 
   void * tlsf_malloc (size_t);
   void   tlsf_free (void *);
+  void * tlsf_memalign (size_t, size_t);
   size_t tlsf_get_object_size (void *);
+  size_t tlsf_good_size (size_t);
   void   tlsf_lock (void);
   void   tlsf_unlock (void);
 
@@ -15,11 +17,29 @@ extern "C" {
   void xxfree (void * ptr) {
     tlsf_free (ptr);
   }
+
+  // TLSF frees only the start of a block, so aligned objects must be
+  // blocks of their own, not pointers into bigger ones.
+  void * xxmemalign (size_t alignment, size_t sz) {
+    return tlsf_memalign (alignment, sz);
+  }
   
   size_t xxmalloc_usable_size (void * ptr) {
     return tlsf_get_object_size (ptr);
   }
   
+  size_t xxmalloc_good_size (size_t sz) {
+    return tlsf_good_size (sz);
+  }
+
+  void * xxmalloc_sized (size_t sz, size_t * actual) {
+    void * ptr = tlsf_malloc (sz);
+    if (ptr != NULL) {
+      *actual = tlsf_get_object_size (ptr);
+    }
+    return ptr;
+  }
+
   void xxmalloc_lock() {
     tlsf_lock();
   }
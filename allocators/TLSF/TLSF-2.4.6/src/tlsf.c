@@ -74,6 +74,29 @@
 #define	USE_SBRK 	(0)
 #endif
 
+/* With TLSF_MULTI_POOL, tlsf_malloc() and friends give every thread a
+ * pool of its own, so they take no lock. Blocks freed by another thread
+ * are queued back to the pool they came from. */
+#ifndef TLSF_MULTI_POOL
+#define	TLSF_MULTI_POOL	(0)
+#endif
+
+/* Areas obtained from mmap are given back once they are completely
+ * free, as long as the pool keeps more than TLSF_TRIM_THRESHOLD bytes of
+ * such idle areas. Areas from sbrk or from the user are kept. */
+#define	RELEASE_AREAS	(USE_MMAP && !USE_SBRK)
+
+#ifndef TLSF_TRIM_THRESHOLD
+#define	TLSF_TRIM_THRESHOLD	(128*1024)
+#endif
+
+#if TLSF_MULTI_POOL
+#if !USE_MMAP && !USE_SBRK
+#error "TLSF_MULTI_POOL needs USE_MMAP or USE_SBRK"
+#endif
+#include <pthread.h>
+#endif
+
 
 #if TLSF_USE_LOCKS
 #include "target.h"
@@ -128,20 +151,41 @@
 /* Unlike the preview TLSF versions, now they are statics */
 #define BLOCK_ALIGN (sizeof(void *) * 2)
 
-#define MAX_FLI		(30)
-#define MAX_LOG2_SLI	(5)
+/* The first level covers blocks below 2^TLSF_MAX_FLI bytes, and every
+ * first-level range is split into 2^TLSF_MAX_LOG2_SLI lists. More lists
+ * waste less memory on rounding at the price of a larger tlsf_t. */
+#ifndef TLSF_MAX_FLI
+#define TLSF_MAX_FLI	(30)
+#endif
+
+#ifndef TLSF_MAX_LOG2_SLI
+#define TLSF_MAX_LOG2_SLI	(5)
+#endif
+
+#define MAX_FLI		TLSF_MAX_FLI
+#define MAX_LOG2_SLI	TLSF_MAX_LOG2_SLI
 #define MAX_SLI		(1 << MAX_LOG2_SLI)     /* MAX_SLI = 2^MAX_LOG2_SLI */
 
+/* Below 4 a small list would hold more than one block size; above 6 the
+ * second-level bitmap no longer fits in 64 bits. */
+#if MAX_LOG2_SLI < 4 || MAX_LOG2_SLI > 6
+#error "TLSF_MAX_LOG2_SLI must be between 4 and 6"
+#endif
+
 #define FLI_OFFSET	(6)     /* tlsf structure just will manage blocks bigger */
 /* than 128 bytes */
 #define SMALL_BLOCK	(128)
 #define REAL_FLI	(MAX_FLI - FLI_OFFSET)
+
+#if REAL_FLI < 2 || REAL_FLI >= 64
+#error "TLSF_MAX_FLI is out of range"
+#endif
 #define MIN_BLOCK_SIZE	(sizeof (free_ptr_t))
 #define BHDR_OVERHEAD	(sizeof (bhdr_t) - MIN_BLOCK_SIZE)
 #define TLSF_SIGNATURE	(0x2A59FA59)
 
 #define	PTR_MASK	(sizeof(void *) - 1)
-#define BLOCK_SIZE	(0xFFFFFFFF - PTR_MASK)
+#define BLOCK_SIZE	(~(size_t) PTR_MASK)
 
 #define GET_NEXT_BLOCK(_addr, _r) ((bhdr_t *) ((char *) (_addr) + (_r)))
 #define	MEM_ALIGN		  ((BLOCK_ALIGN) - 1)
@@ -182,6 +226,20 @@
 
 typedef unsigned int u32_t;     /* NOTE: Make sure that this type is 4 bytes long on your computer */
 typedef unsigned char u8_t;     /* NOTE: Make sure that this type is 1 byte on your computer */
+typedef unsigned long long u64_t;
+
+/* Each bitmap word is only as wide as the number of lists it tracks */
+#if REAL_FLI < 32
+typedef u32_t fl_bitmap_t;
+#else
+typedef u64_t fl_bitmap_t;
+#endif
+
+#if MAX_SLI <= 32
+typedef u32_t sl_bitmap_t;
+#else
+typedef u64_t sl_bitmap_t;
+#endif
 
 typedef struct free_ptr_struct {
     struct bhdr_struct *prev;
@@ -206,8 +264,17 @@ typedef struct bhdr_struct {
 typedef struct area_info_struct {
     bhdr_t *end;
     struct area_info_struct *next;
+#if RELEASE_AREAS
+    /* Bytes from the start of the area to its end */
+    size_t size;
+    /* AREA_SIGNATURE if the whole area came from get_new_area */
+    u32_t signature;
+#endif
 } area_info_t;
 
+#define AREA_SIGNATURE	(0x5A52A7F5)
+#define AREA_HDR_SIZE	(ROUNDUP_SIZE(sizeof(area_info_t)))
+
 typedef struct TLSF_struct {
     /* the TLSF's structure signature */
     u32_t tlsf_signature;
@@ -226,24 +293,37 @@ typedef struct TLSF_struct {
     /* A linked list holding all the existing areas */
     area_info_t *area_head;
 
+#if RELEASE_AREAS
+    /* Total size of the mapped areas that are completely free */
+    size_t idle_size;
+#endif
+
     /* the first-level bitmap */
     /* This array should have a size of REAL_FLI bits */
-    u32_t fl_bitmap;
+    fl_bitmap_t fl_bitmap;
 
     /* the second-level bitmap */
-    u32_t sl_bitmap[REAL_FLI];
+    sl_bitmap_t sl_bitmap[REAL_FLI];
 
     bhdr_t *matrix[REAL_FLI][MAX_SLI];
+
+#if TLSF_MULTI_POOL
+    /* Blocks freed by other threads, pushed without locking */
+    void *volatile remote_free;
+    /* Blocks taken from remote_free that have not been freed yet */
+    void *pending_free;
+    /* Next pool left behind by an exited thread */
+    struct TLSF_struct *next_orphan;
+#endif
 } tlsf_t;
 
 
 /******************************************************************/
 /**************     Helping functions    **************************/
 /******************************************************************/
-static __inline__ void set_bit(int nr, u32_t * addr);
-static __inline__ void clear_bit(int nr, u32_t * addr);
-static __inline__ int ls_bit(int x);
-static __inline__ int ms_bit(int x);
+static __inline__ int ls_bit(u32_t x);
+static __inline__ int ls_bit64(u64_t x);
+static __inline__ int ms_bit(size_t x);
 static __inline__ void MAPPING_SEARCH(size_t * _r, int *_fl, int *_sl);
 static __inline__ void MAPPING_INSERT(size_t _r, int *_fl, int *_sl);
 static __inline__ bhdr_t *FIND_SUITABLE_BLOCK(tlsf_t * _tlsf, int *_fl, int *_sl);
@@ -251,6 +331,30 @@ static __inline__ bhdr_t *process_area(void *area, size_t size);
 #if USE_SBRK || USE_MMAP
 static __inline__ void *get_new_area(size_t * size);
 #endif
+static size_t insert_area(void *area, size_t area_size, void *mem_pool, int mapped);
+static void free_block(void *ptr, tlsf_t * tlsf, int trim);
+static void *malloc_grow(size_t size, void *mem_pool, char **new_area, size_t *new_area_size);
+static void *memalign_block(size_t align, size_t size, size_t offset, tlsf_t * tlsf);
+
+#if defined(__GNUC__)
+
+/* Both return -1 when no bit is set */
+static __inline__ int ls_bit(u32_t x)
+{
+    return x ? __builtin_ctz(x) : -1;
+}
+
+static __inline__ int ls_bit64(u64_t x)
+{
+    return x ? __builtin_ctzll(x) : -1;
+}
+
+static __inline__ int ms_bit(size_t x)
+{
+    return x ? 63 - __builtin_clzll((u64_t) x) : -1;
+}
+
+#else
 
 static const int table[] = {
     -1, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4,
@@ -279,7 +383,7 @@ static const int table[] = {
     7, 7, 7, 7, 7, 7, 7
 };
 
-static __inline__ int ls_bit(int i)
+static __inline__ int ls_bit(u32_t i)
 {
     unsigned int a;
     unsigned int x = i & -i;
@@ -288,34 +392,55 @@ static __inline__ int ls_bit(int i)
     return table[x >> a] + a;
 }
 
-static __inline__ int ms_bit(int i)
+static __inline__ int ls_bit64(u64_t x)
 {
-    unsigned int a;
-    unsigned int x = (unsigned int) i;
-
-    a = x <= 0xffff ? (x <= 0xff ? 0 : 8) : (x <= 0xffffff ? 16 : 24);
-    return table[x >> a] + a;
+    if ((u32_t) x)
+        return ls_bit((u32_t) x);
+    return (x >> 32) ? ls_bit((u32_t) (x >> 32)) + 32 : -1;
 }
 
-static __inline__ void set_bit(int nr, u32_t * addr)
+static __inline__ int ms_bit(size_t i)
 {
-    addr[nr >> 5] |= 1 << (nr & 0x1f);
-}
+    unsigned int a, b = 0;
+    unsigned int x;
 
-static __inline__ void clear_bit(int nr, u32_t * addr)
-{
-    addr[nr >> 5] &= ~(1 << (nr & 0x1f));
+    /* Split in two steps so that the shift is valid for a 32 bit size_t */
+    if (i >> 16 >> 16) {
+        i = i >> 16 >> 16;
+        b = 32;
+    }
+    x = (unsigned int) i;
+    a = x <= 0xffff ? (x <= 0xff ? 0 : 8) : (x <= 0xffffff ? 16 : 24);
+    return table[x >> a] + a + b;
 }
 
+#endif
+
+/* Pick the search that matches the width of each bitmap */
+#if REAL_FLI < 32
+#define FL_LS_BIT(_x)	ls_bit(_x)
+#else
+#define FL_LS_BIT(_x)	ls_bit64(_x)
+#endif
+
+#if MAX_SLI <= 32
+#define SL_LS_BIT(_x)	ls_bit(_x)
+#else
+#define SL_LS_BIT(_x)	ls_bit64(_x)
+#endif
+
+#define set_bit(_nr, _word, _type)	((_word) |= (_type) 1 << (_nr))
+#define clear_bit(_nr, _word, _type)	((_word) &= ~((_type) 1 << (_nr)))
+
 static __inline__ void MAPPING_SEARCH(size_t * _r, int *_fl, int *_sl)
 {
-    int _t;
+    size_t _t;
 
     if (*_r < SMALL_BLOCK) {
         *_fl = 0;
         *_sl = *_r / (SMALL_BLOCK / MAX_SLI);
     } else {
-        _t = (1 << (ms_bit(*_r) - MAX_LOG2_SLI)) - 1;
+        _t = ((size_t) 1 << (ms_bit(*_r) - MAX_LOG2_SLI)) - 1;
         *_r = *_r + _t;
         *_fl = ms_bit(*_r);
         *_sl = (*_r >> (*_fl - MAX_LOG2_SLI)) - MAX_SLI;
@@ -342,16 +467,16 @@ static __inline__ void MAPPING_INSERT(size_t _r, int *_fl, int *_sl)
 
 static __inline__ bhdr_t *FIND_SUITABLE_BLOCK(tlsf_t * _tlsf, int *_fl, int *_sl)
 {
-    u32_t _tmp = _tlsf->sl_bitmap[*_fl] & (~0 << *_sl);
+    sl_bitmap_t _tmp = _tlsf->sl_bitmap[*_fl] & (~(sl_bitmap_t) 0 << *_sl);
     bhdr_t *_b = NULL;
 
     if (_tmp) {
-        *_sl = ls_bit(_tmp);
+        *_sl = SL_LS_BIT(_tmp);
         _b = _tlsf->matrix[*_fl][*_sl];
     } else {
-        *_fl = ls_bit(_tlsf->fl_bitmap & (~0 << (*_fl + 1)));
+        *_fl = FL_LS_BIT(_tlsf->fl_bitmap & (~(fl_bitmap_t) 0 << (*_fl + 1)));
         if (*_fl > 0) {         /* likely */
-            *_sl = ls_bit(_tlsf->sl_bitmap[*_fl]);
+            *_sl = SL_LS_BIT(_tlsf->sl_bitmap[*_fl]);
             _b = _tlsf->matrix[*_fl][*_sl];
         }
     }
@@ -364,9 +489,9 @@ static __inline__ bhdr_t *FIND_SUITABLE_BLOCK(tlsf_t * _tlsf, int *_fl, int *_sl
 		if (_tlsf -> matrix[_fl][_sl])								\
 			_tlsf -> matrix[_fl][_sl] -> ptr.free_ptr.prev = NULL;	\
 		else {														\
-			clear_bit (_sl, &_tlsf -> sl_bitmap [_fl]);				\
+			clear_bit (_sl, _tlsf -> sl_bitmap [_fl], sl_bitmap_t);				\
 			if (!_tlsf -> sl_bitmap [_fl])							\
-				clear_bit (_fl, &_tlsf -> fl_bitmap);				\
+				clear_bit (_fl, _tlsf -> fl_bitmap, fl_bitmap_t);				\
 		}															\
 		_b -> ptr.free_ptr.prev =  NULL;				\
 		_b -> ptr.free_ptr.next =  NULL;				\
@@ -381,9 +506,9 @@ static __inline__ bhdr_t *FIND_SUITABLE_BLOCK(tlsf_t * _tlsf, int *_fl, int *_sl
 		if (_tlsf -> matrix [_fl][_sl] == _b) {							\
 			_tlsf -> matrix [_fl][_sl] = _b -> ptr.free_ptr.next;		\
 			if (!_tlsf -> matrix [_fl][_sl]) {							\
-				clear_bit (_sl, &_tlsf -> sl_bitmap[_fl]);				\
+				clear_bit (_sl, _tlsf -> sl_bitmap [_fl], sl_bitmap_t);				\
 				if (!_tlsf -> sl_bitmap [_fl])							\
-					clear_bit (_fl, &_tlsf -> fl_bitmap);				\
+					clear_bit (_fl, _tlsf -> fl_bitmap, fl_bitmap_t);				\
 			}															\
 		}																\
 		_b -> ptr.free_ptr.prev = NULL;					\
@@ -396,8 +521,8 @@ static __inline__ bhdr_t *FIND_SUITABLE_BLOCK(tlsf_t * _tlsf, int *_fl, int *_sl
 		if (_tlsf -> matrix [_fl][_sl])									\
 			_tlsf -> matrix [_fl][_sl] -> ptr.free_ptr.prev = _b;		\
 		_tlsf -> matrix [_fl][_sl] = _b;								\
-		set_bit (_sl, &_tlsf -> sl_bitmap [_fl]);						\
-		set_bit (_fl, &_tlsf -> fl_bitmap);								\
+		set_bit (_sl, _tlsf -> sl_bitmap [_fl], sl_bitmap_t);						\
+		set_bit (_fl, _tlsf -> fl_bitmap, fl_bitmap_t);								\
 	} while(0)
 
 #if USE_SBRK || USE_MMAP
@@ -444,9 +569,51 @@ static __inline__ bhdr_t *process_area(void *area, size_t size)
     ai = (area_info_t *) ib->ptr.buffer;
     ai->next = 0;
     ai->end = lb;
+#if RELEASE_AREAS
+    ai->size = size;
+    ai->signature = 0;
+#endif
     return ib;
 }
 
+#if RELEASE_AREAS
+/* Returns the mapped area that the free block b covers entirely, or NULL.
+ * Such a block is the first one after the area header and is followed by
+ * the area's sentinel; the signature keeps user data that merely looks
+ * like a header from matching. */
+static __inline__ area_info_t *idle_area(bhdr_t * b)
+{
+    bhdr_t *next = GET_NEXT_BLOCK(b->ptr.buffer, b->size & BLOCK_SIZE);
+    area_info_t *ai;
+
+    if ((next->size & BLOCK_SIZE) || (b->size & PREV_FREE))
+        return NULL;
+    ai = (area_info_t *) ((char *) b - AREA_HDR_SIZE);
+    if (ai->end != next || ai->signature != AREA_SIGNATURE)
+        return NULL;
+    return ai;
+}
+
+/* Unmaps an idle area whose only block is b */
+static size_t release_area(tlsf_t * tlsf, area_info_t * ai, bhdr_t * b)
+{
+    area_info_t **link;
+    size_t size = ai->size;
+    int fl, sl;
+
+    for (link = &tlsf->area_head; *link != ai; link = &(*link)->next)
+        if (!*link)
+            return 0;
+    *link = ai->next;
+    MAPPING_INSERT(b->size & BLOCK_SIZE, &fl, &sl);
+    EXTRACT_BLOCK(b, tlsf, fl, sl);
+    tlsf->idle_size -= size;
+    ai->signature = 0;
+    munmap((char *) ai - BHDR_OVERHEAD, size);
+    return size;
+}
+#endif
+
 /******************************************************************/
 /******************** Begin of the allocator code *****************/
 /******************************************************************/
@@ -489,7 +656,7 @@ size_t init_memory_pool(size_t mem_pool_size, void *mem_pool)
     ib = process_area(GET_NEXT_BLOCK
                       (mem_pool, ROUNDUP_SIZE(sizeof(tlsf_t))), ROUNDDOWN_SIZE(mem_pool_size - sizeof(tlsf_t)));
     b = GET_NEXT_BLOCK(ib->ptr.buffer, ib->size & BLOCK_SIZE);
-    free_ex(b->ptr.buffer, tlsf);
+    free_block(b->ptr.buffer, tlsf, 0);
     tlsf->area_head = (area_info_t *) ib->ptr.buffer;
 
 #if TLSF_STATISTIC
@@ -504,11 +671,23 @@ size_t init_memory_pool(size_t mem_pool_size, void *mem_pool)
 size_t add_new_area(void *area, size_t area_size, void *mem_pool)
 {
 /******************************************************************/
+    memset(area, 0, area_size);
+    return insert_area(area, area_size, mem_pool, 0);
+}
+
+/* Like add_new_area, but for areas that are already zeroed (fresh from
+ * get_new_area), so their pages are not touched needlessly. */
+static size_t insert_area(void *area, size_t area_size, void *mem_pool, int mapped)
+{
     tlsf_t *tlsf = (tlsf_t *) mem_pool;
     area_info_t *ptr, *ptr_prev, *ai;
     bhdr_t *ib0, *b0, *lb0, *ib1, *b1, *lb1, *next_b;
+#if RELEASE_AREAS
+    size_t size = area_size;
+#else
+    (void) mapped;
+#endif
 
-    memset(area, 0, area_size);
     ptr = tlsf->area_head;
     ptr_prev = 0;
 
@@ -524,6 +703,19 @@ size_t add_new_area(void *area, size_t area_size, void *mem_pool)
         b1 = GET_NEXT_BLOCK(ib1->ptr.buffer, ib1->size & BLOCK_SIZE);
         lb1 = ptr->end;
 
+#if RELEASE_AREAS
+        if (((unsigned long) ib1 == (unsigned long) lb0 + BHDR_OVERHEAD ||
+             (unsigned long) lb1->ptr.buffer == (unsigned long) ib0)) {
+            /* ptr is about to be merged into the new area */
+            if ((b1->size & FREE_BLOCK) && idle_area(b1) == ptr)
+                tlsf->idle_size -= ptr->size;
+            if (ptr->signature != AREA_SIGNATURE)
+                mapped = 0;
+            ptr->signature = 0;
+            size += ptr->size;
+        }
+#endif
+
         /* Merging the new area with the next physically contigous one */
         if ((unsigned long) ib1 == (unsigned long) lb0 + BHDR_OVERHEAD) {
             if (tlsf->area_head == ptr) {
@@ -573,8 +765,12 @@ size_t add_new_area(void *area, size_t area_size, void *mem_pool)
     ai = (area_info_t *) ib0->ptr.buffer;
     ai->next = tlsf->area_head;
     ai->end = lb0;
+#if RELEASE_AREAS
+    ai->size = size;
+    ai->signature = mapped ? AREA_SIGNATURE : 0;
+#endif
     tlsf->area_head = ai;
-    free_ex(b0->ptr.buffer, mem_pool);
+    free_block(b0->ptr.buffer, tlsf, 0);
     return (b0->size & BLOCK_SIZE);
 }
 
@@ -631,6 +827,206 @@ void tlsf_activate(void) {
 #endif
 }
 
+#if TLSF_MULTI_POOL
+
+/* Each block handed out by the tlsf_* functions starts with the pool it
+ * belongs to; the word after it links the block on remote_free. */
+#define MP_HDR_SIZE	BLOCK_ALIGN
+
+#ifndef TLSF_THREAD_POOL_SIZE
+#define TLSF_THREAD_POOL_SIZE	(64*1024)
+#endif
+
+/* Most remotely freed blocks a pool gives back per call, which keeps
+ * the time spent in each call bounded. */
+#ifndef TLSF_REMOTE_DRAIN
+#define TLSF_REMOTE_DRAIN	(8)
+#endif
+
+static __thread tlsf_t *thread_pool;
+static pthread_key_t thread_pool_key;
+static pthread_once_t thread_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static tlsf_t *orphan_pools = NULL;
+
+static void drain_remote_frees(tlsf_t * tlsf, int limit)
+{
+    void **b;
+
+    if (!tlsf->pending_free) {
+        if (!tlsf->remote_free)
+            return;
+        tlsf->pending_free = __sync_lock_test_and_set(&tlsf->remote_free, NULL);
+    }
+    while (limit-- != 0 && (b = (void **) tlsf->pending_free)) {
+        tlsf->pending_free = b[1];
+        free_ex(b, tlsf);
+    }
+}
+
+static void push_remote_free(tlsf_t * tlsf, void **b)
+{
+    void *head;
+
+    do {
+        head = tlsf->remote_free;
+        b[1] = head;
+    } while (__sync_val_compare_and_swap(&tlsf->remote_free, head, (void *) b) != head);
+}
+
+/* Runs at thread exit: the pool may still own blocks in use by other
+ * threads, so it is kept for the next thread that needs one. */
+static void thread_pool_exit(void *arg)
+{
+    tlsf_t *tlsf = (tlsf_t *) arg;
+
+    drain_remote_frees(tlsf, -1);
+    thread_pool = NULL;
+    pthread_mutex_lock(&orphan_lock);
+    tlsf->next_orphan = orphan_pools;
+    orphan_pools = tlsf;
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+static void thread_pool_init(void)
+{
+    pthread_key_create(&thread_pool_key, thread_pool_exit);
+}
+
+static tlsf_t *new_thread_pool(void)
+{
+    tlsf_t *tlsf;
+
+    pthread_once(&thread_pool_once, thread_pool_init);
+    pthread_mutex_lock(&orphan_lock);
+    if ((tlsf = orphan_pools))
+        orphan_pools = tlsf->next_orphan;
+    pthread_mutex_unlock(&orphan_lock);
+    if (!tlsf) {
+        size_t area_size = TLSF_THREAD_POOL_SIZE;
+        void *area = get_new_area(&area_size);
+
+        if (area == ((void *) ~0))
+            return NULL;        /* Not enough system memory */
+        if (init_memory_pool(area_size, area) == (size_t) -1)
+            return NULL;
+        tlsf = (tlsf_t *) area;
+    }
+    tlsf->next_orphan = NULL;
+    pthread_setspecific(thread_pool_key, tlsf);
+    thread_pool = tlsf;
+    return tlsf;
+}
+
+static __inline__ tlsf_t *get_thread_pool(void)
+{
+    tlsf_t *tlsf = thread_pool;
+
+    if (!tlsf)
+        tlsf = new_thread_pool();
+    else
+        drain_remote_frees(tlsf, TLSF_REMOTE_DRAIN);
+    return tlsf;
+}
+
+/* Usable size of a block as seen by tlsf_* callers */
+static __inline__ size_t mp_block_size(void *b)
+{
+    return (((bhdr_t *) ((char *) b - BHDR_OVERHEAD))->size & BLOCK_SIZE) - MP_HDR_SIZE;
+}
+
+static __inline__ void *mp_block(void *ptr, tlsf_t * tlsf)
+{
+    if (!ptr)
+        return NULL;
+    *(tlsf_t **) ptr = tlsf;
+    return (char *) ptr + MP_HDR_SIZE;
+}
+
+/******************************************************************/
+void *tlsf_malloc(size_t size)
+{
+/******************************************************************/
+    tlsf_t *tlsf = get_thread_pool();
+
+    if (!tlsf || size + MP_HDR_SIZE < size)
+        return NULL;
+    return mp_block(malloc_ex(size + MP_HDR_SIZE, tlsf), tlsf);
+}
+
+/******************************************************************/
+void tlsf_free(void *ptr)
+{
+/******************************************************************/
+    void **b;
+
+    if (!ptr)
+        return;
+    b = (void **) ((char *) ptr - MP_HDR_SIZE);
+    if ((tlsf_t *) b[0] == thread_pool) {
+        free_ex(b, thread_pool);
+        drain_remote_frees(thread_pool, TLSF_REMOTE_DRAIN);
+    } else {
+        push_remote_free((tlsf_t *) b[0], b);
+    }
+}
+
+/******************************************************************/
+void *tlsf_realloc(void *ptr, size_t size)
+{
+/******************************************************************/
+    tlsf_t *tlsf;
+    void **b;
+    size_t old_size;
+    void *ret;
+
+    if (!ptr)
+        return tlsf_malloc(size);
+    if (!size) {
+        tlsf_free(ptr);
+        return NULL;
+    }
+    if (!(tlsf = get_thread_pool()) || size + MP_HDR_SIZE < size)
+        return NULL;
+    b = (void **) ((char *) ptr - MP_HDR_SIZE);
+    if ((tlsf_t *) b[0] == tlsf)
+        return mp_block(realloc_ex(b, size + MP_HDR_SIZE, tlsf), tlsf);
+
+    /* Another thread's block: move it into this thread's pool */
+    if (!(ret = mp_block(malloc_ex(size + MP_HDR_SIZE, tlsf), tlsf)))
+        return NULL;
+    old_size = mp_block_size(b);
+    memcpy(ret, ptr, (old_size < size) ? old_size : size);
+    push_remote_free((tlsf_t *) b[0], b);
+    return ret;
+}
+
+/******************************************************************/
+void *tlsf_calloc(size_t nelem, size_t elem_size)
+{
+/******************************************************************/
+    tlsf_t *tlsf = get_thread_pool();
+    size_t size = nelem * elem_size;
+
+    if (!tlsf || (elem_size && size / elem_size != nelem) || size + MP_HDR_SIZE < size)
+        return NULL;            /* Overflow */
+    return mp_block(calloc_ex(1, size + MP_HDR_SIZE, tlsf), tlsf);
+}
+
+/******************************************************************/
+void *tlsf_memalign(size_t align, size_t size)
+{
+/******************************************************************/
+    tlsf_t *tlsf = get_thread_pool();
+
+    if (!tlsf || size + MP_HDR_SIZE < size)
+        return NULL;
+    /* The pool pointer goes just in front of the aligned address */
+    return mp_block(memalign_block(align, size + MP_HDR_SIZE, MP_HDR_SIZE, tlsf), tlsf);
+}
+
+#else /* TLSF_MULTI_POOL */
+
 /******************************************************************/
 void *tlsf_malloc(size_t size)
 {
@@ -699,10 +1095,36 @@ void *tlsf_calloc(size_t nelem, size_t elem_size)
     return ret;
 }
 
+/******************************************************************/
+void *tlsf_memalign(size_t align, size_t size)
+{
+/******************************************************************/
+    void *ret;
+
+    tlsf_activate();
+
+    TLSF_ACQUIRE_LOCK(&((tlsf_t *)mp)->lock);
+
+    ret = memalign_ex(align, size, mp);
+
+    TLSF_RELEASE_LOCK(&((tlsf_t *)mp)->lock);
+
+    return ret;
+}
+
+#endif /* TLSF_MULTI_POOL */
+
 /******************************************************************/
 void *malloc_ex(size_t size, void *mem_pool)
 {
 /******************************************************************/
+    return malloc_grow(size, mem_pool, NULL, NULL);
+}
+
+/* If the pool has to grow, the new (zeroed) area is reported through
+ * new_area and new_area_size when they are not NULL. */
+static void *malloc_grow(size_t size, void *mem_pool, char **new_area, size_t *new_area_size)
+{
     tlsf_t *tlsf = (tlsf_t *) mem_pool;
     bhdr_t *b, *b2, *next_b;
     int fl, sl;
@@ -712,6 +1134,8 @@ void *malloc_ex(size_t size, void *mem_pool)
 
     /* Rounding up the requested size and calculating fl and sl */
     MAPPING_SEARCH(&size, &fl, &sl);
+    if (fl >= REAL_FLI)
+        return NULL;            /* Beyond the largest list */
 
     /* Searching a free block, recall that this function changes the values of fl and sl,
        so they are not longer valid when the function fails */
@@ -726,7 +1150,11 @@ void *malloc_ex(size_t size, void *mem_pool)
         area = get_new_area(&area_size);        /* Call sbrk or mmap */
         if (area == ((void *) ~0))
             return NULL;        /* Not enough system memory */
-        add_new_area(area, area_size, mem_pool);
+        insert_area(area, area_size, mem_pool, 1);
+        if (new_area) {
+            *new_area = (char *) area;
+            *new_area_size = area_size;
+        }
         /* Rounding up the requested size and calculating fl and sl */
         MAPPING_SEARCH(&size, &fl, &sl);
         /* Searching a free block */
@@ -736,6 +1164,10 @@ void *malloc_ex(size_t size, void *mem_pool)
     if (!b)
         return NULL;            /* Not found */
 
+#if RELEASE_AREAS
+    if (idle_area(b))
+        tlsf->idle_size -= idle_area(b)->size;
+#endif
     EXTRACT_BLOCK_HDR(b, tlsf, fl, sl);
 
     /*-- found: */
@@ -765,6 +1197,7 @@ void *malloc_ex(size_t size, void *mem_pool)
 
 
 size_t tlsf_get_object_size (void * ptr);
+size_t tlsf_good_size (size_t size);
 void tlsf_lock (void);
 void tlsf_unlock (void);
 
@@ -781,6 +1214,30 @@ size_t get_object_size_ex (void * ptr, void * mem_pool)
   return b->size & (size_t) ~1UL;
 }
 
+#if TLSF_MULTI_POOL
+
+size_t tlsf_get_object_size (void * ptr)
+{
+  void **b;
+
+  if (!ptr) {
+    return 0;
+  }
+  b = (void **) ((char *) ptr - MP_HDR_SIZE);
+  return mp_block_size (b);
+}
+
+/* Only the list of orphaned pools is shared between threads */
+void tlsf_lock (void) {
+    pthread_mutex_lock(&orphan_lock);
+}
+
+void tlsf_unlock (void) {
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+#else /* TLSF_MULTI_POOL */
+
 size_t tlsf_get_object_size (void * ptr)
 {
   tlsf_activate();
@@ -795,6 +1252,26 @@ void tlsf_unlock (void) {
     TLSF_RELEASE_LOCK(&((tlsf_t *)mp)->lock);
 }
 
+#endif /* TLSF_MULTI_POOL */
+
+/* The usable size tlsf_malloc(size) gives: the size rounded up to the
+ * start of the next list, which malloc_ex splits blocks down to. */
+size_t tlsf_good_size (size_t size)
+{
+    int fl, sl;
+#if TLSF_MULTI_POOL
+    if (size + MP_HDR_SIZE < size)
+        return size;
+    size += MP_HDR_SIZE;
+#endif
+    size = (size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : ROUNDUP_SIZE(size);
+    MAPPING_SEARCH(&size, &fl, &sl);
+#if TLSF_MULTI_POOL
+    size -= MP_HDR_SIZE;
+#endif
+    return size;
+}
+
 
 /**/
 
@@ -803,9 +1280,20 @@ void tlsf_unlock (void) {
 void free_ex(void *ptr, void *mem_pool)
 {
 /******************************************************************/
-    tlsf_t *tlsf = (tlsf_t *) mem_pool;
+    free_block(ptr, (tlsf_t *) mem_pool, 1);
+}
+
+/* free_ex, which only gives back an area that becomes idle if trim is
+ * set: areas being added to a pool must stay. */
+static void free_block(void *ptr, tlsf_t * tlsf, int trim)
+{
     bhdr_t *b, *tmp_b;
     int fl = 0, sl = 0;
+#if RELEASE_AREAS
+    area_info_t *ai;
+#else
+    (void) trim;
+#endif
 
     if (!ptr) {
         return;
@@ -836,6 +1324,36 @@ void free_ex(void *ptr, void *mem_pool)
     tmp_b = GET_NEXT_BLOCK(b->ptr.buffer, b->size & BLOCK_SIZE);
     tmp_b->size |= PREV_FREE;
     tmp_b->prev_hdr = b;
+
+#if RELEASE_AREAS
+    if ((ai = idle_area(b))) {
+        tlsf->idle_size += ai->size;
+        if (trim && tlsf->idle_size > TLSF_TRIM_THRESHOLD)
+            release_area(tlsf, ai, b);
+    }
+#endif
+}
+
+/******************************************************************/
+size_t tlsf_trim(void *mem_pool)
+{
+/******************************************************************/
+    size_t released = 0;
+#if RELEASE_AREAS
+    tlsf_t *tlsf = (tlsf_t *) mem_pool;
+    area_info_t *ai, *next;
+
+    for (ai = tlsf->area_head; ai; ai = next) {
+        bhdr_t *b = (bhdr_t *) ((char *) ai + AREA_HDR_SIZE);
+
+        next = ai->next;
+        if ((b->size & FREE_BLOCK) && idle_area(b) == ai)
+            released += release_area(tlsf, ai, b);
+    }
+#else
+    (void) mem_pool;
+#endif
+    return released;
 }
 
 /******************************************************************/
@@ -844,7 +1362,7 @@ void *realloc_ex(void *ptr, size_t new_size, void *mem_pool)
 /******************************************************************/
     tlsf_t *tlsf = (tlsf_t *) mem_pool;
     void *ptr_aux;
-    unsigned int cpsize;
+    size_t cpsize;
     bhdr_t *b, *tmp_b, *next_b;
     int fl, sl;
     size_t tmp_size;
@@ -911,6 +1429,44 @@ void *realloc_ex(void *ptr, size_t new_size, void *mem_pool)
             return (void *) b->ptr.buffer;
         }
     }
+    if (b->size & PREV_FREE) {
+        /* The previous block, with the next one if that is free too, makes
+           enough room: move the data down into it rather than elsewhere */
+        tmp_b = b->prev_hdr;
+        cpsize = tmp_size;
+        tmp_size += (tmp_b->size & BLOCK_SIZE) + BHDR_OVERHEAD;
+        if (next_b->size & FREE_BLOCK)
+            tmp_size += (next_b->size & BLOCK_SIZE) + BHDR_OVERHEAD;
+        if (new_size <= tmp_size) {
+            TLSF_REMOVE_SIZE(tlsf, b);
+            MAPPING_INSERT(tmp_b->size & BLOCK_SIZE, &fl, &sl);
+            EXTRACT_BLOCK(tmp_b, tlsf, fl, sl);
+            if (next_b->size & FREE_BLOCK) {
+                MAPPING_INSERT(next_b->size & BLOCK_SIZE, &fl, &sl);
+                EXTRACT_BLOCK(next_b, tlsf, fl, sl);
+                next_b = GET_NEXT_BLOCK(next_b->ptr.buffer, next_b->size & BLOCK_SIZE);
+            }
+            /* Before any header is written over the old data */
+            memmove(tmp_b->ptr.buffer, ptr, cpsize);
+            b = tmp_b;
+            b->size = tmp_size | (b->size & PREV_STATE);
+            next_b->prev_hdr = b;
+            next_b->size &= ~PREV_FREE;
+            tmp_size -= new_size;
+            if (tmp_size >= sizeof(bhdr_t)) {
+                tmp_size -= BHDR_OVERHEAD;
+                tmp_b = GET_NEXT_BLOCK(b->ptr.buffer, new_size);
+                tmp_b->size = tmp_size | FREE_BLOCK | PREV_USED;
+                next_b->prev_hdr = tmp_b;
+                next_b->size |= PREV_FREE;
+                MAPPING_INSERT(tmp_size, &fl, &sl);
+                INSERT_BLOCK(tmp_b, tlsf, fl, sl);
+                b->size = new_size | (b->size & PREV_STATE);
+            }
+            TLSF_ADD_SIZE(tlsf, b);
+            return (void *) b->ptr.buffer;
+        }
+    }
 
     if (!(ptr_aux = malloc_ex(new_size, mem_pool))){
         return NULL;
@@ -929,18 +1485,78 @@ void *realloc_ex(void *ptr, size_t new_size, void *mem_pool)
 void *calloc_ex(size_t nelem, size_t elem_size, void *mem_pool)
 {
 /******************************************************************/
-    void *ptr;
+    char *ptr;
+    char *area = NULL;
+    size_t area_size = 0;
+    size_t size;
 
     if (nelem <= 0 || elem_size <= 0)
         return NULL;
 
-    if (!(ptr = malloc_ex(nelem * elem_size, mem_pool)))
+    size = nelem * elem_size;
+    if (size / elem_size != nelem)
+        return NULL;            /* Overflow */
+
+    if (!(ptr = (char *) malloc_grow(size, mem_pool, &area, &area_size)))
         return NULL;
-    memset(ptr, 0, nelem * elem_size);
+
+    if (area && ptr >= area && ptr + size <= area + area_size) {
+        /* The block was carved out of a fresh area: only the free list
+           links that were written into it can be non-zero. */
+        memset(ptr, 0, (size < sizeof(free_ptr_t)) ? size : sizeof(free_ptr_t));
+    } else {
+        memset(ptr, 0, size);
+    }
 
     return ptr;
 }
 
+/******************************************************************/
+void *memalign_ex(size_t align, size_t size, void *mem_pool)
+{
+/******************************************************************/
+    return memalign_block(align, size, 0, (tlsf_t *) mem_pool);
+}
+
+/* A block whose buffer, offset bytes in, is aligned to align (a power
+ * of two): a block with room to spare is split, the part in front of
+ * the aligned address going back to the free lists as a block of its
+ * own, so that the result can be freed like any other. */
+static void *memalign_block(size_t align, size_t size, size_t offset, tlsf_t * tlsf)
+{
+    bhdr_t *b, *b2, *next_b;
+    char *ptr, *aligned;
+    size_t gap;
+
+    if (align <= BLOCK_ALIGN)
+        return malloc_ex(size, tlsf);
+    size = (size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : size;
+    if (size + align + sizeof(bhdr_t) < size)
+        return NULL;            /* Overflow */
+    if (!(ptr = (char *) malloc_ex(size + align + sizeof(bhdr_t), tlsf)))
+        return NULL;
+    aligned = (char *) ROUNDUP((size_t) ptr + offset, align) - offset;
+    if (aligned == ptr)
+        return realloc_ex(ptr, size, tlsf);
+    /* The block in front needs room for its header and free list links */
+    if ((size_t) (aligned - ptr) < sizeof(bhdr_t))
+        aligned += align;
+    gap = aligned - ptr;
+
+    b = (bhdr_t *) (ptr - BHDR_OVERHEAD);
+    b2 = (bhdr_t *) (aligned - BHDR_OVERHEAD);
+    next_b = GET_NEXT_BLOCK(b->ptr.buffer, b->size & BLOCK_SIZE);
+    TLSF_REMOVE_SIZE(tlsf, b);
+    b2->size = ((b->size & BLOCK_SIZE) - gap) | USED_BLOCK | PREV_USED;
+    b->size = (gap - BHDR_OVERHEAD) | USED_BLOCK | (b->size & PREV_STATE);
+    next_b->prev_hdr = b2;
+    TLSF_ADD_SIZE(tlsf, b);
+    TLSF_ADD_SIZE(tlsf, b2);
+    free_block(ptr, tlsf, 0);
+    /* Likewise the slack behind it, if there is enough */
+    return realloc_ex(aligned, size, tlsf);
+}
+
 
 
 #if _DEBUG_TLSF_
@@ -1021,11 +1637,11 @@ void print_tlsf(tlsf_t * tlsf)
 
     PRINT_MSG("\nTLSF at %p\n", tlsf);
 
-    PRINT_MSG("FL bitmap: 0x%x\n\n", (unsigned) tlsf->fl_bitmap);
+    PRINT_MSG("FL bitmap: 0x%llx\n\n", (u64_t) tlsf->fl_bitmap);
 
     for (i = 0; i < REAL_FLI; i++) {
         if (tlsf->sl_bitmap[i])
-            PRINT_MSG("SL bitmap 0x%x\n", (unsigned) tlsf->sl_bitmap[i]);
+            PRINT_MSG("SL bitmap 0x%llx\n", (u64_t) tlsf->sl_bitmap[i]);
         for (j = 0; j < MAX_SLI; j++) {
             next = tlsf->matrix[i][j];
             if (next)
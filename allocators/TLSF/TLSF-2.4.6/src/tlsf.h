@@ -30,10 +30,13 @@ extern void *malloc_ex(size_t, void *);
 extern void free_ex(void *, void *);
 extern void *realloc_ex(void *, size_t, void *);
 extern void *calloc_ex(size_t, size_t, void *);
+extern void *memalign_ex(size_t, size_t, void *);
+extern size_t tlsf_trim(void *);
 
 extern void *tlsf_malloc(size_t size);
 extern void tlsf_free(void *ptr);
 extern void *tlsf_realloc(void *ptr, size_t size);
 extern void *tlsf_calloc(size_t nelem, size_t elem_size);
+extern void *tlsf_memalign(size_t align, size_t size);
 
 #endif
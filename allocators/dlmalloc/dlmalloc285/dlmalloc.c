@@ -260,7 +260,18 @@ MSPACES                  default: 0 (false)
 ONLY_MSPACES             default: 0 (false)
   If true, only compile in mspace versions, not regular versions.
 
-USE_LOCKS                default: 0 (false)
+HUGEPAGE_MSPACES         default: 1 on linux if MSPACES, else 0
+  If true, compile in create_hugepage_mspace. Its spaces obtain and
+  release system memory in HUGEPAGE_SIZE-aligned units of
+  HUGEPAGE_SIZE, mapped with MAP_HUGETLB if asked (and available) or
+  else advised with MADV_HUGEPAGE, so that the kernel can back them
+  with huge pages.
+
+HUGEPAGE_SIZE            default: 2MB
+  The huge page size of the target, used as the granularity of
+  huge-page mspaces.
+
+USE_LOCKS               default: 0 (false)
   Causes each call to each public routine to be surrounded with
   pthread or WIN32 mutex lock/unlock. (If set true, this can be
   overridden on a per-mspace basis for mspace versions.) If set to a
@@ -279,6 +290,18 @@ USE_RECURSIVE_LOCKS      default: not defined
   uses plain mutexes. This is not required for malloc proper, but may
   be needed for layered allocators such as nedmalloc.
 
+THREAD_CACHE             default: 0 (false)
+  If true, each thread keeps small chunks it frees on private lists
+  and reuses them for small requests without taking any lock.  Lists
+  are refilled in batches and given back when full, when the thread
+  exits, or when it next calls malloc_trim/mspace_trim, so the lock
+  of a space is only taken for those.  A thread caches chunks of only
+  one space at a time: the one it most recently allocated from.
+  Requires USE_LOCKS, pthreads, and __thread support; only spaces
+  that use locks are cached.  Cached chunks count as in use in
+  statistics.  Threads that may still hold chunks of an mspace must
+  exit or call mspace_trim on it before it is destroyed.
+
 FOOTERS                  default: 0
   If true, provide extra checking and dispatching by placing
   information in the footers of allocated chunks. This adds
@@ -599,6 +622,12 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define USE_SPIN_LOCKS 0
 #endif /* USE_LOCKS */
 
+#ifndef THREAD_CACHE
+#define THREAD_CACHE 0
+#endif  /* THREAD_CACHE */
+#if THREAD_CACHE && (!USE_LOCKS || USE_LOCKS > 1 || defined(WIN32) || !defined(__GNUC__))
+#error "THREAD_CACHE requires USE_LOCKS with pthreads and gcc"
+#endif /* THREAD_CACHE */
 #ifndef ONLY_MSPACES
 #define ONLY_MSPACES 0
 #endif  /* ONLY_MSPACES */
@@ -609,6 +638,16 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 #define MSPACES 0
 #endif  /* ONLY_MSPACES */
 #endif  /* MSPACES */
+#ifndef HUGEPAGE_MSPACES
+#if MSPACES && defined(linux)
+#define HUGEPAGE_MSPACES 1
+#else   /* MSPACES && linux */
+#define HUGEPAGE_MSPACES 0
+#endif  /* MSPACES && linux */
+#endif  /* HUGEPAGE_MSPACES */
+#ifndef HUGEPAGE_SIZE
+#define HUGEPAGE_SIZE ((size_t)2U * (size_t)1024U * (size_t)1024U)
+#endif  /* HUGEPAGE_SIZE */
 #ifndef MALLOC_ALIGNMENT
 #define MALLOC_ALIGNMENT ((size_t)8U)
 #endif  /* MALLOC_ALIGNMENT */
@@ -1180,10 +1219,12 @@ DLMALLOC_EXPORT void** dlindependent_comalloc(size_t, size_t*, void**);
   bulk_free(void* array[], size_t n_elements)
   Frees and clears (sets to null) each non-null pointer in the given
   array.  This is likely to be faster than freeing them one-by-one.
-  If footers are used, pointers that have been allocated in different
+  The array is sorted by address first (unless it already is), so
+  that chunks that are neighbors in memory are coalesced with each
+  other before being freed, whatever their order in the array.  If
+  footers are used, pointers that have been allocated in different
   mspaces are not freed or cleared, and the count of all such pointers
-  is returned.  For large arrays of pointers with poor locality, it
-  may be worthwhile to sort this array before calling bulk_free.
+  is returned; these are left in the array in address order.
 */
 DLMALLOC_EXPORT size_t  dlbulk_free(void**, size_t n_elements);
 
@@ -1296,6 +1337,24 @@ DLMALLOC_EXPORT size_t destroy_mspace(mspace msp);
 */
 DLMALLOC_EXPORT mspace create_mspace_with_base(void* base, size_t capacity, int locked);
 
+#if HUGEPAGE_MSPACES
+/*
+  create_hugepage_mspace is like create_mspace, except that the space
+  gets its memory from the system in HUGEPAGE_SIZE-aligned multiples
+  of HUGEPAGE_SIZE rather than in granularity units, so that the
+  kernel can back it with huge pages, and releases it (in trimming or
+  destroy_mspace) at huge page boundaries too. If hugetlb is non-zero,
+  regions are mapped with MAP_HUGETLB, falling back to MADV_HUGEPAGE
+  on ordinary pages when no reserved huge pages are left; otherwise
+  MADV_HUGEPAGE alone is used. Large chunks are mapped directly only
+  if they are at least HUGEPAGE_SIZE. Combined with
+  mspace_set_footprint_limit, which is checked before every request
+  to the system, this gives a space a hard cap on the memory it holds.
+*/
+DLMALLOC_EXPORT mspace create_hugepage_mspace(size_t capacity, int locked,
+                                              int hugetlb);
+#endif /* HUGEPAGE_MSPACES */
+
 /*
   mspace_track_large_chunks controls whether requests for large chunks
   are allocated in their own untracked mmapped regions, separate from
@@ -1363,6 +1422,26 @@ DLMALLOC_EXPORT void** mspace_independent_calloc(mspace msp, size_t n_elements,
 DLMALLOC_EXPORT void** mspace_independent_comalloc(mspace msp, size_t n_elements,
                                    size_t sizes[], void* chunks[]);
 
+/*
+  mspace_bulk_free behaves as bulk_free, but operates within
+  the given space.
+*/
+DLMALLOC_EXPORT size_t mspace_bulk_free(mspace msp, void* array[], size_t nelem);
+
+/*
+  mspace_bulk_malloc(mspace msp, size_t size, size_t n, void* out[])
+  allocates n chunks of at least size bytes each and stores pointers
+  to them in out[0..n-1], returning the number of chunks allocated,
+  which is less than n only if memory ran out.  Unlike
+  independent_calloc, the chunks are carved directly from the top of
+  the space under a single lock (extending the space as necessary)
+  without searching the bins, and each can be freed or realloced
+  individually.  Use it to populate large pointer-linked structures
+  whose nodes are later released together with mspace_bulk_free.
+*/
+DLMALLOC_EXPORT size_t mspace_bulk_malloc(mspace msp, size_t size, size_t n,
+                                          void* out[]);
+
 /*
   mspace_footprint() returns the number of bytes obtained from the
   system for this space.
@@ -1491,7 +1570,7 @@ extern void*     sbrk(ptrdiff_t);
 #elif !defined(LACKS_SCHED_H)
 #include <sched.h>
 #endif /* solaris or LACKS_SCHED_H */
-#if (defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0) || !USE_SPIN_LOCKS
+#if (defined(USE_RECURSIVE_LOCKS) && USE_RECURSIVE_LOCKS != 0) || !USE_SPIN_LOCKS || THREAD_CACHE
 #include <pthread.h>
 #endif /* USE_RECURSIVE_LOCKS ... */
 #elif defined(_MSC_VER)
@@ -1758,6 +1837,18 @@ static FORCEINLINE int win32munmap(void* ptr, size_t size) {
 /* segment bit set in create_mspace_with_base */
 #define EXTERN_BIT            (8U)
 
+/* mstate bits set in create_hugepage_mspace */
+#if HUGEPAGE_MSPACES
+#if !HAVE_MMAP
+#error "HUGEPAGE_MSPACES requires HAVE_MMAP"
+#endif /* !HAVE_MMAP */
+#define USE_HUGEPAGE_BIT      (16U)
+#define USE_HUGETLB_BIT       (32U)
+#else  /* HUGEPAGE_MSPACES */
+#define USE_HUGEPAGE_BIT      (0U)
+#define USE_HUGETLB_BIT       (0U)
+#endif /* HUGEPAGE_MSPACES */
+
 
 /* --------------------------- Lock preliminaries ------------------------ */
 
@@ -2648,6 +2739,9 @@ static struct malloc_state _gm_;
 #define use_noncontiguous(M)  ((M)->mflags &   USE_NONCONTIGUOUS_BIT)
 #define disable_contiguous(M) ((M)->mflags |=  USE_NONCONTIGUOUS_BIT)
 
+#define use_hugepage(M)       ((M)->mflags &   USE_HUGEPAGE_BIT)
+#define use_hugetlb(M)        ((M)->mflags &   USE_HUGETLB_BIT)
+
 #define set_lock(M,L)\
  ((M)->mflags = (L)?\
   ((M)->mflags | USE_LOCK_BIT) :\
@@ -2670,6 +2764,13 @@ static struct malloc_state _gm_;
 #define mmap_align(S) page_align(S)
 #endif
 
+/* The unit in which M gets and releases segments, and alignment to it */
+#define seg_granularity(M)\
+  (use_hugepage(M)? HUGEPAGE_SIZE : mparams.granularity)
+#define seg_align(M, S)\
+  (((S) + (seg_granularity(M) - SIZE_T_ONE))\
+   & ~(seg_granularity(M) - SIZE_T_ONE))
+
 /* For sys_alloc, enough padding to ensure can malloc request on success */
 #define SYS_ALLOC_PADDING (TOP_FOOT_SIZE + MALLOC_ALIGNMENT)
 
@@ -3077,6 +3178,12 @@ static size_t traverse_and_check(mstate m);
 
 /* ---------------------------- setting mparams -------------------------- */
 
+#if THREAD_CACHE
+static pthread_key_t tcache_key;   /* flushes a thread's cache at exit */
+static int tcache_enabled;         /* nonzero once tcache_key exists */
+static void tcache_thread_exit(void* unused);
+#endif /* THREAD_CACHE */
+
 /* Initialize mparams */
 static int init_mparams(void) {
 #ifdef NEED_GLOBAL_LOCK_INIT
@@ -3156,6 +3263,9 @@ static int init_mparams(void) {
 #endif
       magic |= (size_t)8U;    /* ensure nonzero */
       magic &= ~(size_t)7U;   /* improve chances of fault for bad values */
+#if THREAD_CACHE
+      tcache_enabled = (pthread_key_create(&tcache_key, tcache_thread_exit) == 0);
+#endif /* THREAD_CACHE */
       /* Until memory modes commonly available, use volatile-write */
       (*(volatile size_t *)(&(mparams.magic))) = magic;
     }
@@ -3799,16 +3909,71 @@ static void internal_malloc_stats(mstate m) {
   requirements (especially in memalign).
 */
 
+#if HUGEPAGE_MSPACES
+/*
+  Map size bytes, a multiple of HUGEPAGE_SIZE, at a HUGEPAGE_SIZE
+  boundary for a huge-page mspace: from the reserved huge pages if it
+  asked for them and some are left, else from ordinary pages advised
+  to be backed with transparent huge pages. Kernels that align large
+  anonymous maps themselves give an aligned region the first time;
+  otherwise we map a huge page more than needed and unmap the ends
+  around an aligned region.
+*/
+static void* huge_mmap(mstate m, size_t size) {
+  char* mm;
+  size_t lead;
+#if defined(MAP_HUGETLB) && defined(MAP_ANONYMOUS)
+  if (use_hugetlb(m)) {
+    mm = (char*)mmap(0, size, MMAP_PROT, MMAP_FLAGS|MAP_HUGETLB, -1, 0);
+    if (mm != CMFAIL)
+      return mm;
+  }
+#endif /* MAP_HUGETLB && MAP_ANONYMOUS */
+  mm = (char*)(CALL_MMAP(size));
+  if (mm == CMFAIL)
+    return MFAIL;
+  lead = (HUGEPAGE_SIZE - ((size_t)mm & (HUGEPAGE_SIZE - SIZE_T_ONE))) &
+    (HUGEPAGE_SIZE - SIZE_T_ONE);
+  if (lead != 0) {
+    CALL_MUNMAP(mm, size);
+    if (size + HUGEPAGE_SIZE <= size) /* Check for wrap around 0 */
+      return MFAIL;
+    mm = (char*)(CALL_MMAP(size + HUGEPAGE_SIZE));
+    if (mm == CMFAIL)
+      return MFAIL;
+    lead = (HUGEPAGE_SIZE - ((size_t)mm & (HUGEPAGE_SIZE - SIZE_T_ONE))) &
+      (HUGEPAGE_SIZE - SIZE_T_ONE);
+    if (lead != 0)
+      CALL_MUNMAP(mm, lead);
+    CALL_MUNMAP(mm + lead + size, HUGEPAGE_SIZE - lead);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(mm + lead, size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+  return mm + lead;
+}
+
+#define CALL_SEG_MMAP(M, s)\
+  (use_hugepage(M)? huge_mmap((M), (s)) : CALL_MMAP(s))
+#define CALL_SEG_DIRECT_MMAP(M, s)\
+  (use_hugepage(M)? huge_mmap((M), (s)) : CALL_DIRECT_MMAP(s))
+#else  /* HUGEPAGE_MSPACES */
+#define CALL_SEG_MMAP(M, s)         CALL_MMAP(s)
+#define CALL_SEG_DIRECT_MMAP(M, s)  CALL_DIRECT_MMAP(s)
+#endif /* HUGEPAGE_MSPACES */
+
 /* Malloc using mmap */
 static void* mmap_alloc(mstate m, size_t nb) {
-  size_t mmsize = mmap_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK);
+  size_t mmsize = (use_hugepage(m)?
+                   seg_align(m, nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK) :
+                   mmap_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK));
   if (m->footprint_limit != 0) {
     size_t fp = m->footprint + mmsize;
     if (fp <= m->footprint || fp > m->footprint_limit)
       return 0;
   }
   if (mmsize > nb) {     /* Check for wrap around 0 */
-    char* mm = (char*)(CALL_DIRECT_MMAP(mmsize));
+    char* mm = (char*)(CALL_SEG_DIRECT_MMAP(m, mmsize));
     if (mm != CMFAIL) {
       size_t offset = align_offset(chunk2mem(mm));
       size_t psize = mmsize - offset - MMAP_FOOT_PAD;
@@ -3839,14 +4004,24 @@ static mchunkptr mmap_resize(mstate m, mchunkptr oldp, size_t nb, int flags) {
     return 0;
   /* Keep old chunk if big enough but not too big */
   if (oldsize >= nb + SIZE_T_SIZE &&
-      (oldsize - nb) <= (mparams.granularity << 1))
+      (oldsize - nb) <= (seg_granularity(m) << 1))
     return oldp;
+  else if (use_hugetlb(m)) /* Regions may be hugetlb, which can't move */
+    return 0;
   else {
     size_t offset = oldp->prev_foot;
     size_t oldmmsize = oldsize + offset + MMAP_FOOT_PAD;
-    size_t newmmsize = mmap_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK);
-    char* cp = (char*)CALL_MREMAP((char*)oldp - offset,
-                                  oldmmsize, newmmsize, flags);
+    size_t newmmsize = (use_hugepage(m)?
+                        seg_align(m, nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK) :
+                        mmap_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK));
+    char* cp;
+    if (m->footprint_limit != 0 && newmmsize > oldmmsize) {
+      size_t fp = m->footprint + (newmmsize - oldmmsize);
+      if (fp <= m->footprint || fp > m->footprint_limit)
+        return 0;
+    }
+    cp = (char*)CALL_MREMAP((char*)oldp - offset,
+                            oldmmsize, newmmsize, flags);
     if (cp != CMFAIL) {
       mchunkptr newp = (mchunkptr)(cp + offset);
       size_t psize = newmmsize - offset - MMAP_FOOT_PAD;
@@ -4020,13 +4195,14 @@ static void* sys_alloc(mstate m, size_t nb) {
   ensure_initialization();
 
   /* Directly map large chunks, but only if already initialized */
-  if (use_mmap(m) && nb >= mparams.mmap_threshold && m->topsize != 0) {
+  if (use_mmap(m) && nb >= mparams.mmap_threshold && m->topsize != 0 &&
+      (!use_hugepage(m) || nb >= HUGEPAGE_SIZE)) {
     void* mem = mmap_alloc(m, nb);
     if (mem != 0)
       return mem;
   }
 
-  asize = granularity_align(nb + SYS_ALLOC_PADDING);
+  asize = seg_align(m, nb + SYS_ALLOC_PADDING);
   if (asize <= nb)
     return 0; /* wraparound */
   if (m->footprint_limit != 0) {
@@ -4118,7 +4294,7 @@ static void* sys_alloc(mstate m, size_t nb) {
   }
 
   if (HAVE_MMAP && tbase == CMFAIL) {  /* Try MMAP */
-    char* mp = (char*)(CALL_MMAP(asize));
+    char* mp = (char*)(CALL_SEG_MMAP(m, asize));
     if (mp != CMFAIL) {
       tbase = mp;
       tsize = asize;
@@ -4171,8 +4347,14 @@ static void* sys_alloc(mstate m, size_t nb) {
     }
 
     else {
-      /* Try to merge with an existing segment */
-      msegmentptr sp = &m->seg;
+      /*
+        Try to merge with an existing segment.  Huge-page spaces keep
+        each mapping a segment of its own instead, which
+        release_unused_segments can unmap again once it is all free:
+        merged, the maps that Linux places below earlier ones would put
+        free space under the malloc_state, where nothing is released.
+      */
+      msegmentptr sp = (use_hugepage(m))? 0 : &m->seg;
       /* Only consider most recent segment if traversal suppressed */
       while (sp != 0 && tbase != sp->base + sp->size)
         sp = (NO_SEGMENT_TRAVERSAL) ? 0 : sp->next;
@@ -4186,7 +4368,7 @@ static void* sys_alloc(mstate m, size_t nb) {
       else {
         if (tbase < m->least_addr)
           m->least_addr = tbase;
-        sp = &m->seg;
+        sp = (use_hugepage(m))? 0 : &m->seg;
         while (sp != 0 && sp->base != tbase + tsize)
           sp = (NO_SEGMENT_TRAVERSAL) ? 0 : sp->next;
         if (sp != 0 &&
@@ -4276,7 +4458,7 @@ static int sys_trim(mstate m, size_t pad) {
 
     if (m->topsize > pad) {
       /* Shrink top space in granularity-size units, keeping at least one */
-      size_t unit = mparams.granularity;
+      size_t unit = seg_granularity(m);
       size_t extra = ((m->topsize - pad + (unit - SIZE_T_ONE)) / unit -
                       SIZE_T_ONE) * unit;
       msegmentptr sp = segment_holding(m, (char*)m->top);
@@ -4287,8 +4469,9 @@ static int sys_trim(mstate m, size_t pad) {
               sp->size >= extra &&
               !has_segment_link(m, sp)) { /* can't shrink if pinned */
             size_t newsize = sp->size - extra;
-            /* Prefer mremap, fall back to munmap */
-            if ((CALL_MREMAP(sp->base, sp->size, newsize, 0) != MFAIL) ||
+            /* Prefer mremap, fall back to munmap (only, for hugetlb) */
+            if ((!use_hugetlb(m) &&
+                 CALL_MREMAP(sp->base, sp->size, newsize, 0) != MFAIL) ||
                 (CALL_MUNMAP(sp->base + newsize, extra) == 0)) {
               released = extra;
             }
@@ -4403,6 +4586,216 @@ static void dispose_chunk(mstate m, mchunkptr p, size_t psize) {
   }
 }
 
+/* ---------------------------- thread cache --------------------------- */
+
+#if THREAD_CACHE
+/*
+  Each thread has one bin per smallbin size, holding chunks that are
+  still marked in use by the space they came from, linked through
+  their first word.  A bin that runs empty is refilled with up to
+  THREAD_CACHE_FILL chunks of its size, taken from the matching
+  smallbin or from top under a single lock; a bin that reaches
+  THREAD_CACHE_COUNT chunks gives half of them back under a single
+  lock.  All cached chunks belong to tcache.owner.
+
+  Caches are also on a list, under tcache_mutex, so that destroy_mspace
+  can drop every thread's chunks of the space it unmaps.  A cache is
+  flushed into an owner other than the caller's space (on switching
+  spaces, or at thread exit) only under the same mutex, so the owner
+  cannot be destroyed in the meantime.
+*/
+
+#ifndef THREAD_CACHE_COUNT
+#define THREAD_CACHE_COUNT  16
+#endif  /* THREAD_CACHE_COUNT */
+#ifndef THREAD_CACHE_FILL
+#define THREAD_CACHE_FILL   8
+#endif  /* THREAD_CACHE_FILL */
+
+struct tcache_bin {
+  void*        head;
+  unsigned int count;
+};
+
+struct thread_cache {
+  mstate               owner;     /* space all cached chunks belong to */
+  int                  state;     /* 0: unused, 1: active, 2: exiting */
+  struct thread_cache* prev;      /* on tcache_list while active */
+  struct thread_cache* next;
+  struct tcache_bin    bins[NSMALLBINS];
+};
+
+static __thread struct thread_cache tcache
+  __attribute__ ((tls_model ("initial-exec")));
+
+static pthread_mutex_t tcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_cache* tcache_list;  /* active caches */
+
+/* Give all but the first keep chunks of nbins bins back to the owner */
+static void tcache_release(struct tcache_bin* b, bindex_t nbins,
+                           unsigned int keep) {
+  mstate m = tcache.owner;
+  if (!PREACTION(m)) {
+    for (; nbins != 0; --nbins, ++b) {
+      void** link = &b->head;
+      void* mem;
+      unsigned int i;
+      for (i = 0; i < keep && *link != 0; ++i)
+        link = (void**)*link;
+      mem = *link;
+      *link = 0;
+      b->count = i;
+      while (mem != 0) {
+        mchunkptr p = mem2chunk(mem);
+        mem = *(void**)mem;
+        check_inuse_chunk(m, p);
+        if (RTCHECK(ok_address(m, p) && ok_inuse(p)))
+          dispose_chunk(m, p, chunksize(p));
+        else
+          CORRUPTION_ERROR_ACTION(m);
+      }
+    }
+    if (should_trim(m, m->topsize))
+      sys_trim(m, 0);
+    POSTACTION(m);
+  }
+}
+
+/* Give all cached chunks back; owner may be destroyed unless locked */
+static void tcache_flush(void) {
+  pthread_mutex_lock(&tcache_mutex);
+  if (tcache.owner != 0)
+    tcache_release(tcache.bins, NSMALLBINS, 0);
+  pthread_mutex_unlock(&tcache_mutex);
+}
+
+/* pthread key destructor; later calls from this thread are uncached */
+static void tcache_thread_exit(void* unused) {
+  tcache.state = 2;
+  pthread_mutex_lock(&tcache_mutex);
+  if (tcache.owner != 0)
+    tcache_release(tcache.bins, NSMALLBINS, 0);
+  if (tcache.prev != 0)
+    tcache.prev->next = tcache.next;
+  else
+    tcache_list = tcache.next;
+  if (tcache.next != 0)
+    tcache.next->prev = tcache.prev;
+  pthread_mutex_unlock(&tcache_mutex);
+}
+
+#if MSPACES
+/* Drop every thread's cached chunks of a space that is going away */
+static void tcache_forget(mstate m) {
+  struct thread_cache* c;
+  pthread_mutex_lock(&tcache_mutex);
+  for (c = tcache_list; c != 0; c = c->next) {
+    if (c->owner == m) {
+      memset(c->bins, 0, sizeof(c->bins));
+      c->owner = 0;
+    }
+  }
+  pthread_mutex_unlock(&tcache_mutex);
+}
+#endif /* MSPACES */
+
+static int tcache_usable(void) {
+  if (tcache.state == 0 && tcache_enabled) {
+    if (pthread_setspecific(tcache_key, &tcache) != 0)
+      tcache.state = 2;
+    else {
+      pthread_mutex_lock(&tcache_mutex);
+      tcache.state = 1;
+      tcache.prev = 0;
+      tcache.next = tcache_list;
+      if (tcache_list != 0)
+        tcache_list->prev = &tcache;
+      tcache_list = &tcache;
+      pthread_mutex_unlock(&tcache_mutex);
+    }
+  }
+  return tcache.state == 1;
+}
+
+/* Take up to THREAD_CACHE_FILL chunks of bin idx from m, returning
+   one of them and caching the rest, or 0 if m has none at hand. */
+static void* tcache_fill(mstate m, struct tcache_bin* b, bindex_t idx) {
+  void* mem = 0;
+  if (!PREACTION(m)) {
+    size_t nb = small_index2size(idx);
+    int n;
+    for (n = 0; n < THREAD_CACHE_FILL; ++n) {
+      mchunkptr p;
+      if (smallmap_is_marked(m, idx)) {
+        mchunkptr bin = smallbin_at(m, idx);
+        p = bin->fd;
+        unlink_first_small_chunk(m, bin, p, idx);
+        set_inuse_and_pinuse(m, p, nb);
+      }
+      else if (nb < m->topsize) {
+        size_t rsize = m->topsize -= nb;
+        p = m->top;
+        m->top = chunk_plus_offset(p, nb);
+        m->top->head = rsize | PINUSE_BIT;
+        set_size_and_pinuse_of_inuse_chunk(m, p, nb);
+        check_top_chunk(m, m->top);
+      }
+      else
+        break;
+      check_malloced_chunk(m, chunk2mem(p), nb);
+      if (mem == 0)
+        mem = chunk2mem(p);
+      else {
+        *(void**)chunk2mem(p) = b->head;
+        b->head = chunk2mem(p);
+        ++b->count;
+      }
+    }
+    POSTACTION(m);
+  }
+  return mem;
+}
+
+/* Serve a small request from the calling thread's cache, or return 0 */
+static void* tcache_malloc(mstate m, size_t bytes) {
+  size_t nb = (bytes < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(bytes);
+  bindex_t idx = small_index(nb);
+  struct tcache_bin* b = &tcache.bins[idx];
+  void* mem;
+  if (!tcache_usable())
+    return 0;
+  if (tcache.owner != m) {
+    tcache_flush();
+    tcache.owner = m;
+  }
+  mem = b->head;
+  if (mem != 0) {
+    b->head = *(void**)mem;
+    --b->count;
+    return mem;
+  }
+  return tcache_fill(m, b, idx);
+}
+
+/* Cache a small chunk freed into the cache's owner; 0 if not cached */
+static int tcache_free(mstate m, mchunkptr p) {
+  size_t psize = chunksize(p);
+  if (m == tcache.owner && tcache.state == 1 &&
+      is_small(psize) && !is_mmapped(p) &&
+      RTCHECK(ok_address(m, p) && ok_inuse(p))) {
+    struct tcache_bin* b = &tcache.bins[small_index(psize)];
+    void* mem = chunk2mem(p);
+    if (b->count >= THREAD_CACHE_COUNT)
+      tcache_release(b, 1, THREAD_CACHE_COUNT / 2);
+    *(void**)mem = b->head;
+    b->head = mem;
+    ++b->count;
+    return 1;
+  }
+  return 0;
+}
+#endif /* THREAD_CACHE */
+
 /* ---------------------------- malloc --------------------------- */
 
 /* allocate a large request from the best fitting chunk in a treebin */
@@ -4544,6 +4937,14 @@ void* dlmalloc(size_t bytes) {
   ensure_initialization(); /* initialize in sys_alloc if not using locks */
 #endif
 
+#if THREAD_CACHE
+  if (bytes <= MAX_SMALL_REQUEST && use_lock(gm)) {
+    void* mem = tcache_malloc(gm, bytes);
+    if (mem != 0)
+      return mem;
+  }
+#endif /* THREAD_CACHE */
+
   if (!PREACTION(gm)) {
     void* mem;
     size_t nb;
@@ -4672,6 +5073,10 @@ void dlfree(void* mem) {
 #else /* FOOTERS */
 #define fm gm
 #endif /* FOOTERS */
+#if THREAD_CACHE
+    if (tcache_free(fm, p))
+      return;
+#endif /* THREAD_CACHE */
     if (!PREACTION(fm)) {
       check_inuse_chunk(fm, p);
       if (RTCHECK(ok_address(fm, p) && ok_inuse(p))) {
@@ -5062,18 +5467,55 @@ static void** ialloc(mstate m,
   return marray;
 }
 
+/*
+  Sort an array of pointers by address with an in-place heapsort;
+  nothing here may call malloc, and that rules out qsort.  Arrays
+  that are sorted already, such as those from ialloc, are detected
+  in one pass and left alone.
+*/
+static void sort_pointers(void* array[], size_t n) {
+  size_t i, start, root, child;
+  char** a = (char**)array;
+  char* t;
+
+  for (i = 1; i < n && a[i-1] <= a[i]; ++i)
+    ;
+  if (i >= n)
+    return;
+  for (start = n / 2; start-- != 0; ) { /* build a max-heap */
+    for (root = start; (child = 2 * root + 1) < n; root = child) {
+      if (child + 1 < n && a[child] < a[child+1])
+        ++child;
+      if (a[root] >= a[child])
+        break;
+      t = a[root]; a[root] = a[child]; a[child] = t;
+    }
+  }
+  while (--n != 0) { /* move the largest to the end, and sift down */
+    t = a[0]; a[0] = a[n]; a[n] = t;
+    for (root = 0; (child = 2 * root + 1) < n; root = child) {
+      if (child + 1 < n && a[child] < a[child+1])
+        ++child;
+      if (a[root] >= a[child])
+        break;
+      t = a[root]; a[root] = a[child]; a[child] = t;
+    }
+  }
+}
+
 /* Try to free all pointers in the given array.
    Note: this could be made faster, by delaying consolidation,
    at the price of disabling some user integrity checks, We
-   still optimize some consolidations by combining adjacent
-   chunks before freeing, which will occur often if allocated
-   with ialloc or the array is sorted.
+   still optimize some consolidations by sorting the array and
+   combining chunks that are adjacent in memory before freeing
+   them.
 */
 static size_t internal_bulk_free(mstate m, void* array[], size_t nelem) {
   size_t unfreed = 0;
   if (!PREACTION(m)) {
     void** a;
     void** fence = &(array[nelem]);
+    sort_pointers(array, nelem);
     for (a = array; a != fence; ++a) {
       void* mem = *a;
       if (mem != 0) {
@@ -5309,6 +5751,10 @@ void dlmalloc_inspect_all(void(*handler)(void *start,
 int dlmalloc_trim(size_t pad) {
   int result = 0;
   ensure_initialization();
+#if THREAD_CACHE
+  if (tcache.owner == gm)
+    tcache_flush();
+#endif /* THREAD_CACHE */
   if (!PREACTION(gm)) {
     result = sys_trim(gm, pad);
     POSTACTION(gm);
@@ -5413,6 +5859,30 @@ mspace create_mspace(size_t capacity, int locked) {
   return (mspace)m;
 }
 
+#if HUGEPAGE_MSPACES
+mspace create_hugepage_mspace(size_t capacity, int locked, int hugetlb) {
+  mstate m = 0;
+  size_t msize;
+  ensure_initialization();
+  msize = pad_request(sizeof(struct malloc_state));
+  if (capacity < (size_t) -(msize + TOP_FOOT_SIZE + HUGEPAGE_SIZE)) {
+    size_t tsize = ((capacity + TOP_FOOT_SIZE + msize + HUGEPAGE_SIZE -
+                     SIZE_T_ONE) & ~(HUGEPAGE_SIZE - SIZE_T_ONE));
+    struct malloc_state ms; /* only says how to map the first segment */
+    char* tbase;
+    ms.mflags = USE_HUGEPAGE_BIT | (hugetlb? USE_HUGETLB_BIT : 0);
+    tbase = (char*)huge_mmap(&ms, tsize);
+    if (tbase != CMFAIL) {
+      m = init_user_mstate(tbase, tsize);
+      m->seg.sflags = USE_MMAP_BIT;
+      m->mflags |= ms.mflags;
+      set_lock(m, locked);
+    }
+  }
+  return (mspace)m;
+}
+#endif /* HUGEPAGE_MSPACES */
+
 mspace create_mspace_with_base(void* base, size_t capacity, int locked) {
   mstate m = 0;
   size_t msize;
@@ -5447,6 +5917,9 @@ size_t destroy_mspace(mspace msp) {
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     msegmentptr sp = &ms->seg;
+#if THREAD_CACHE
+    tcache_forget(ms);
+#endif /* THREAD_CACHE */
     (void)DESTROY_LOCK(&ms->mutex); /* destroy before unmapped */
     while (sp != 0) {
       char* base = sp->base;
@@ -5475,6 +5948,13 @@ void* mspace_malloc(mspace msp, size_t bytes) {
     USAGE_ERROR_ACTION(ms,ms);
     return 0;
   }
+#if THREAD_CACHE
+  if (bytes <= MAX_SMALL_REQUEST && use_lock(ms)) {
+    void* mem = tcache_malloc(ms, bytes);
+    if (mem != 0)
+      return mem;
+  }
+#endif /* THREAD_CACHE */
   if (!PREACTION(ms)) {
     void* mem;
     size_t nb;
@@ -5596,6 +6076,10 @@ void mspace_free(mspace msp, void* mem) {
       USAGE_ERROR_ACTION(fm, p);
       return;
     }
+#if THREAD_CACHE
+    if (tcache_free(fm, p))
+      return;
+#endif /* THREAD_CACHE */
     if (!PREACTION(fm)) {
       check_inuse_chunk(fm, p);
       if (RTCHECK(ok_address(fm, p) && ok_inuse(p))) {
@@ -5817,6 +6301,44 @@ size_t mspace_bulk_free(mspace msp, void* array[], size_t nelem) {
   return internal_bulk_free((mstate)msp, array, nelem);
 }
 
+size_t mspace_bulk_malloc(mspace msp, size_t size, size_t n, void* out[]) {
+  mstate ms = (mstate)msp;
+  size_t nb;
+  size_t i = 0;
+  if (!ok_magic(ms)) {
+    USAGE_ERROR_ACTION(ms,ms);
+    return 0;
+  }
+  if (size >= MAX_REQUEST) {
+    MALLOC_FAILURE_ACTION;
+    return 0;
+  }
+  nb = (size < MIN_REQUEST)? MIN_CHUNK_SIZE : pad_request(size);
+  while (i != n) {
+    void* mem;
+    if (PREACTION(ms))
+      break;
+    while (i != n && nb < ms->topsize) { /* Split top, as in malloc */
+      size_t rsize = ms->topsize -= nb;
+      mchunkptr p = ms->top;
+      mchunkptr r = ms->top = chunk_plus_offset(p, nb);
+      r->head = rsize | PINUSE_BIT;
+      set_size_and_pinuse_of_inuse_chunk(ms, p, nb);
+      out[i++] = mem = chunk2mem(p);
+      check_malloced_chunk(ms, mem, nb);
+    }
+    check_top_chunk(ms, ms->top);
+    POSTACTION(ms);
+    if (i == n)
+      break;
+    /* Let malloc extend the space; top is large enough again after. */
+    if ((mem = mspace_malloc(msp, size)) == 0)
+      break;
+    out[i++] = mem;
+  }
+  return i;
+}
+
 #if MALLOC_INSPECT_ALL
 void mspace_inspect_all(mspace msp,
                         void(*handler)(void *start,
@@ -5841,6 +6363,10 @@ int mspace_trim(mspace msp, size_t pad) {
   int result = 0;
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
+#if THREAD_CACHE
+    if (tcache.owner == ms)
+      tcache_flush();
+#endif /* THREAD_CACHE */
     if (!PREACTION(ms)) {
       result = sys_trim(ms, pad);
       POSTACTION(ms);
@@ -5906,11 +6432,11 @@ size_t mspace_set_footprint_limit(mspace msp, size_t bytes) {
   mstate ms = (mstate)msp;
   if (ok_magic(ms)) {
     if (bytes == 0)
-      result = granularity_align(1); /* Use minimal size */
+      result = seg_align(ms, 1); /* Use minimal size */
     if (bytes == MAX_SIZE_T)
       result = 0;                    /* disable */
     else
-      result = granularity_align(bytes);
+      result = seg_align(ms, bytes);
     ms->footprint_limit = result;
   }
   else {
@@ -0,0 +1,53 @@
+/*
+  Checks that a huge-page mspace gives its memory back: fill one to
+  its footprint limit, free everything, trim, and expect all but the
+  unit holding the malloc_state and the one holding top to be gone.
+
+    gcc -O2 -DMSPACES=1 -DONLY_MSPACES=1 dlmalloc.c hugepage-test.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef void* mspace;
+mspace create_hugepage_mspace(size_t capacity, int locked, int hugetlb);
+size_t destroy_mspace(mspace msp);
+void* mspace_malloc(mspace msp, size_t bytes);
+void mspace_free(mspace msp, void* mem);
+int mspace_trim(mspace msp, size_t pad);
+size_t mspace_footprint(mspace msp);
+size_t mspace_set_footprint_limit(mspace msp, size_t bytes);
+
+#define HUGEPAGE_SIZE ((size_t)2U * (size_t)1024U * (size_t)1024U)
+#define LIMIT         (16 * HUGEPAGE_SIZE)
+#define MAXOBJS       200000
+
+static void* objs[MAXOBJS];
+
+static int check(size_t size) {
+  mspace m = create_hugepage_mspace(0, 0, 0);
+  size_t full, trimmed;
+  int n = 0, i;
+  if (m == 0) {
+    printf("create_hugepage_mspace failed\n");
+    return 1;
+  }
+  mspace_set_footprint_limit(m, LIMIT);
+  while (n < MAXOBJS && (objs[n] = mspace_malloc(m, size)) != 0)
+    ++n;
+  full = mspace_footprint(m);
+  for (i = 0; i < n; ++i)
+    mspace_free(m, objs[i]);
+  mspace_trim(m, 0);
+  trimmed = mspace_footprint(m);
+  destroy_mspace(m);
+  printf("%6lu-byte objects: footprint %lu when full, %lu after trim\n",
+         (unsigned long)size, (unsigned long)full, (unsigned long)trimmed);
+  return (full < LIMIT / 2 || trimmed > 2 * HUGEPAGE_SIZE);
+}
+
+int main(void) {
+  int failed = check(100) | check(5000) | check(60000);
+  printf(failed ? "FAIL\n" : "PASS\n");
+  return failed;
+}
@@ -28,6 +28,9 @@
  * @file   libdlmalloc.cpp
  * @brief  This file replaces malloc etc. in your application.
  * @author Emery Berger <http://www.cs.umass.edu/~emery>
+ *
+ * Built with -DUSE_LOCKS=1 -DTHREAD_CACHE=1 (libdlmalloc-threaded.so in
+ * the compile script), small objects are served from per-thread caches.
  */
 
 #include <stdlib.h>
@@ -43,6 +43,10 @@
  *     rather than as individual pages.  This provides a constant-time
  *     mechanism for associating allocations with particular arenas.
  *
+ *   + Each thread caches a bounded number of small objects per size class,
+ *     so that most small allocation/deallocation requests require neither
+ *     locking nor atomic operations.
+ *
  * Allocation requests are rounded up to the nearest size class, and no record
  * of the original request size is maintained.  Allocations are broken into
  * categories according to size class.  Assuming runtime defaults, 4 kB pages
@@ -63,8 +67,14 @@
  *   |          |                |     496 |
  *   |          |                |     512 |
  *   |          |----------------+---------|
- *   |          | Sub-page       |    1 kB |
- *   |          |                |    2 kB |
+ *   |          | Sub-page       |   640 B |
+ *   |          |                |   768 B |
+ *   |          |                |   896 B |
+ *   |          |                |    1 kB |
+ *   |          |                | 1.25 kB |
+ *   |          |                |     ... |
+ *   |          |                |    3 kB |
+ *   |          |                |  3.5 kB |
  *   |=====================================|
  *   | Large                     |    4 kB |
  *   |                           |    8 kB |
@@ -133,6 +143,61 @@
  */
 #define	MALLOC_LAZY_FREE
 
+/*
+ * MALLOC_TCACHE enables a thread-specific cache of small objects in front of
+ * the arena bins.  Objects are moved between a thread's cache and the arenas
+ * in batches, so the common case of malloc()/free() takes no locks and
+ * performs no atomic operations.
+ */
+#define	MALLOC_TCACHE
+
+/*
+ * MALLOC_DECAY enables time-based purging of dirty pages.  Rather than purging
+ * every dirty page whenever an arena exceeds opt_dirty_max, each arena purges
+ * the pages that it dirtied gradually, over a configurable time window, so
+ * that recently freed memory stays around for reuse and no single
+ * deallocation pays for a large purge.
+ */
+#define	MALLOC_DECAY
+
+/*
+ * MALLOC_UNMAP_THREAD enables a thread that unmaps deallocated chunks, so that
+ * the thread freeing a large object does not wait for munmap(2).
+ */
+#define	MALLOC_UNMAP_THREAD
+
+/*
+ * MALLOC_PERCPU_ARENAS enables an optional mode (the 'C' option) in which
+ * each thread allocates from the arena of the CPU it is running on, as
+ * sched_getcpu(3) reports it, rather than from an arena assigned to it round
+ * robin.  There are then only as many arenas as CPUs, and at most a preempted
+ * thread contends for an arena's lock.
+ */
+#define	MALLOC_PERCPU_ARENAS
+
+/*
+ * MALLOC_HUGEPAGE enables an optional mode (the 'E' option) for transparent
+ * huge pages.  Chunks are then at least a huge page in size, so that they are
+ * aligned to huge page boundaries, and are madvise()d MADV_HUGEPAGE, so that
+ * the kernel can back them with huge pages.  Since purging any part of a huge
+ * page splits it, purging then leaves alone the dirty pages of huge pages
+ * that are mostly in use, as far as opt_dirty_max allows.
+ */
+#define	MALLOC_HUGEPAGE
+
+/*
+ * MALLOC_USDT places USDT probes (provider "jemalloc") on the slow paths, for
+ * bpftrace, perf and SystemTap.  A probe is a NOP until a tracer attaches to
+ * it.  Each slow path has a *_start and a *_done probe, and the tracer times
+ * the interval, so untraced code reads no clocks.  The probes need
+ * <sys/sdt.h>, so this is on only where that header exists.
+ */
+#if defined(__has_include) && !defined(MOZ_MEMORY_WINDOWS)
+#  if __has_include(<sys/sdt.h>)
+#    define	MALLOC_USDT
+#  endif
+#endif
+
 /*
  * MALLOC_BALANCE enables monitoring of arena lock contention and dynamically
  * re-balances arena load if exponentially averaged contention exceeds a
@@ -151,7 +216,7 @@
 #endif
 
 #ifdef MOZ_MEMORY_LINUX
-#define	_GNU_SOURCE /* For mremap(2). */
+#define	_GNU_SOURCE /* For mremap(2) and sched_getcpu(3). */
 #define	issetugid() 0
 #if 0 /* Enable in order to test decommit code on Linux. */
 #  define MALLOC_DECOMMIT
@@ -251,6 +316,9 @@ __FBSDID("$FreeBSD: src/lib/libc/stdlib/malloc.c,v 1.162 2008/02/06 02:59:54 jas
 #ifndef MADV_FREE
 #  define MADV_FREE	MADV_DONTNEED
 #endif
+#ifndef MADV_HUGEPAGE
+#  undef MALLOC_HUGEPAGE
+#endif
 #include <sys/param.h>
 #ifndef MOZ_MEMORY
 #include <sys/stddef.h>
@@ -284,7 +352,11 @@ __FBSDID("$FreeBSD: src/lib/libc/stdlib/malloc.c,v 1.162 2008/02/06 02:59:54 jas
 #define _pthread_mutex_lock pthread_mutex_lock
 #define _pthread_mutex_unlock pthread_mutex_unlock
 #endif
+#ifdef MOZ_MEMORY_LINUX
+#define _pthread_self pthread_self
+#endif
 #include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -294,6 +366,7 @@ __FBSDID("$FreeBSD: src/lib/libc/stdlib/malloc.c,v 1.162 2008/02/06 02:59:54 jas
 #ifndef MOZ_MEMORY_DARWIN
 #include <strings.h>
 #endif
+#include <time.h>
 #include <unistd.h>
 
 #ifdef MOZ_MEMORY_DARWIN
@@ -416,6 +489,35 @@ static const bool __isthreaded = true;
    /* MALLOC_LAZY_FREE requires TLS. */
 #  ifdef MALLOC_LAZY_FREE
 #    undef MALLOC_LAZY_FREE
+#  endif
+   /* MALLOC_TCACHE requires TLS. */
+#  ifdef MALLOC_TCACHE
+#    undef MALLOC_TCACHE
+#  endif
+#endif
+
+#ifdef MOZ_MEMORY_WINDOWS
+   /*
+    * MALLOC_TCACHE relies on __thread variables and pthread TSD destructors,
+    * neither of which is available here.
+    */
+#  ifdef MALLOC_TCACHE
+#    undef MALLOC_TCACHE
+#  endif
+   /* MALLOC_DECAY relies on gettimeofday(2) and pthreads. */
+#  ifdef MALLOC_DECAY
+#    undef MALLOC_DECAY
+#  endif
+   /* MALLOC_UNMAP_THREAD relies on pthreads. */
+#  ifdef MALLOC_UNMAP_THREAD
+#    undef MALLOC_UNMAP_THREAD
+#  endif
+#endif
+
+#ifndef MOZ_MEMORY_LINUX
+   /* MALLOC_PERCPU_ARENAS relies on sched_getcpu(3). */
+#  ifdef MALLOC_PERCPU_ARENAS
+#    undef MALLOC_PERCPU_ARENAS
 #  endif
 #endif
 
@@ -425,9 +527,59 @@ static const bool __isthreaded = true;
  */
 #define	CHUNK_2POW_DEFAULT	20
 
+#ifdef MALLOC_HUGEPAGE
+   /*
+    * Size of a transparent huge page, and so the least chunk size in huge
+    * page mode.  Purging spares a huge page that has fewer than
+    * 1/2^HUGEPAGE_COLD_2POW of its pages dirty.
+    */
+#  define HUGEPAGE_2POW		21
+#  define HUGEPAGE_COLD_2POW	1
+#endif
+
 /* Maximum number of dirty pages per arena. */
 #define	DIRTY_MAX_DEFAULT	(1U << 9)
 
+/*
+ * Size of each huge_rtree node.  Every level resolves as many bits of a chunk
+ * number as fit in one node, so RTREE_HEIGHT_MAX levels are enough even for
+ * 64-bit addresses and the smallest possible chunks.
+ */
+#define	RTREE_NODESIZE_2POW	14
+#define	RTREE_HEIGHT_MAX	8
+
+#ifdef MALLOC_UNMAP_THREAD
+   /*
+    * Maximum number of chunk runs, and of bytes, waiting for the unmap thread.
+    * Past either limit, chunk_dealloc_mmap() unmaps inline, which holds
+    * deallocating threads to the pace of the unmap thread.
+    */
+#  define UNMAP_QUEUE_SIZE	256
+#  define UNMAP_PENDING_MAX	((size_t)1 << 30)
+#endif
+
+#ifdef MALLOC_DECAY
+   /*
+    * Default number of seconds over which the pages that an arena dirties are
+    * purged.  Setting the decay time to 0 reverts to purging all dirty pages
+    * once there are more than opt_dirty_max of them.
+    */
+#  define DECAY_TIME_DEFAULT	10
+
+   /*
+    * The decay time is divided into DECAY_NSTEPS epochs.  Dirty pages are
+    * tracked at epoch granularity, and purging happens at most once per epoch
+    * per arena.
+    */
+#  define DECAY_NSTEPS		200
+
+   /*
+    * The decay curve is a table of binary fixed point fractions, with the
+    * binary point implicitly DECAY_BFP bits to the left.
+    */
+#  define DECAY_BFP		24
+#endif
+
 /*
  * Maximum size of L1 cache line.  This is used to avoid cache line aliasing,
  * so over-estimates are okay (up to a point), but under-estimates will
@@ -447,6 +599,27 @@ static const bool __isthreaded = true;
 #define	SMALL_MAX_2POW_DEFAULT	9
 #define	SMALL_MAX_DEFAULT	(1U << SMALL_MAX_2POW_DEFAULT)
 
+/*
+ * Above small_max and below the page size, each doubling of size is split into
+ * (1U << SUBPAGE_2POW) evenly spaced size classes, so that rounding wastes at
+ * most 1/(1U << SUBPAGE_2POW) of the larger class.  Fewer are used if the
+ * spacing would otherwise drop below the quantum.
+ */
+#define	SUBPAGE_2POW		2
+
+/*
+ * Each element of a run's regs_mask is a 64-bit word, so that allocation can
+ * find a free region among 64 with a single ctz.
+ */
+#define	REGS_MASK_2POW		6
+#define	REGS_MASK_BITS		(1U << REGS_MASK_2POW)
+
+/*
+ * Non-full runs are ranked by how many of their regions are in use, in
+ * (1U << RUN_OCCUPANCY_2POW) classes, and allocation prefers the fullest.
+ */
+#define	RUN_OCCUPANCY_2POW	3
+
 /*
  * RUN_MAX_OVRHD indicates maximum desired run header overhead.  Runs are sized
  * as small as possible such that this setting is still honored, without
@@ -489,6 +662,19 @@ static const bool __isthreaded = true;
 #  define LAZY_FREE_NPROBES	5
 #endif
 
+#ifdef MALLOC_TCACHE
+   /* Default number of objects (2^n) that each thread caches per bin. */
+#  define TCACHE_NSLOTS_2POW_DEFAULT	6
+
+   /*
+    * Default number of allocation/deallocation events (2^n) between complete
+    * sweeps of a thread cache by the incremental garbage collector.  Each
+    * sweep visits every bin once, and flushes objects that went unused since
+    * the bin's previous visit.
+    */
+#  define TCACHE_GC_2POW_DEFAULT	13
+#endif
+
 /*
  * Hyper-threaded CPUs may need a special instruction inside spin loops in
  * order to yield to another virtual CPU.  If no such instruction is defined
@@ -618,6 +804,10 @@ struct arena_stats_s {
 	uint64_t	npurge;
 	uint64_t	nmadvise;
 	uint64_t	purged;
+#ifdef MALLOC_HUGEPAGE
+	/* Total dirty pages that purge sweeps left in hot huge pages. */
+	uint64_t	spared;
+#endif
 #ifdef MALLOC_DECOMMIT
 	/*
 	 * Total number of decommit/commit operations, and total number of
@@ -694,6 +884,24 @@ RB_HEAD(extent_tree_ad_s, extent_node_s);
 typedef struct arena_s arena_t;
 typedef struct arena_bin_s arena_bin_t;
 
+/*
+ * Chunk allocation hooks, which an arena created by mallctl("arenas.create")
+ * may use in place of chunk_alloc() and chunk_dealloc().  alloc must return
+ * size bytes aligned to alignment (a power of two that is at least the chunk
+ * size), zero-filled if zero is true, or NULL.  dalloc is called once for
+ * each range that alloc returned, with the same size, when the arena no longer
+ * needs it.  arena_ind is the index of the arena on whose behalf the hooks are
+ * called.
+ */
+typedef void	*chunk_alloc_t(size_t size, size_t alignment, bool zero,
+    unsigned arena_ind);
+typedef void	chunk_dalloc_t(void *chunk, size_t size, unsigned arena_ind);
+typedef struct chunk_hooks_s chunk_hooks_t;
+struct chunk_hooks_s {
+	chunk_alloc_t	*alloc;
+	chunk_dalloc_t	*dalloc;
+};
+
 /*
  * Each map element contains several flags, plus page position for runs that
  * service small allocations.
@@ -763,8 +971,14 @@ struct arena_run_s {
 	/* Number of free regions in run. */
 	unsigned	nfree;
 
+	/*
+	 * Occupancy class of the run as of its insertion into its bin's tree
+	 * of non-full runs (see arena_run_occupancy()), which keys the tree.
+	 */
+	unsigned	occupancy;
+
 	/* Bitmask of in-use regions (0: in use, 1: free). */
-	unsigned	regs_mask[1]; /* Dynamically sized. */
+	uint64_t	regs_mask[1]; /* Dynamically sized. */
 };
 typedef struct arena_run_tree_s arena_run_tree_t;
 RB_HEAD(arena_run_tree_s, arena_run_s);
@@ -779,9 +993,9 @@ struct arena_bin_s {
 	/*
 	 * Tree of non-full runs.  This tree is used when looking for an
 	 * existing run when runcur is no longer usable.  We choose the
-	 * non-full run that is lowest in memory; this policy tends to keep
-	 * objects packed well, and it can also help reduce the number of
-	 * almost-empty chunks.
+	 * fullest non-full run, and the lowest in memory of those; this
+	 * leaves nearly empty runs alone, so that they drain and their pages
+	 * go back to the chunk, and it tends to keep objects packed well.
 	 */
 	arena_run_tree_t runs;
 
@@ -823,6 +1037,17 @@ struct arena_s {
 	arena_stats_t		stats;
 #endif
 
+	/* Index of this arena in arenas. */
+	unsigned		ind;
+
+	/*
+	 * Hooks that allocate this arena's chunks (including those of huge
+	 * allocations made by threads that use this arena), or all NULL to use
+	 * chunk_alloc() and chunk_dealloc().  They are set before the arena is
+	 * published and never change.
+	 */
+	chunk_hooks_t		chunk_hooks;
+
 	/*
 	 * Tree of chunks this arena manages.
 	 */
@@ -867,6 +1092,26 @@ struct arena_s {
 	uint32_t		contention;
 #endif
 
+#ifdef MALLOC_DECAY
+	/*
+	 * Start time (in microseconds) of the current decay epoch.  The epoch
+	 * advances lazily, when a run is deallocated or the decay thread
+	 * visits the arena.
+	 */
+	uint64_t		decay_epoch;
+
+	/* Value of ndirty right after the previous epoch's purge. */
+	size_t			decay_ndirty;
+
+	/*
+	 * Number of pages dirtied during each of the last DECAY_NSTEPS epochs;
+	 * decay_backlog[DECAY_NSTEPS - 1] is the most recent epoch.  The number
+	 * of dirty pages that the arena may retain is the sum of these counts,
+	 * each weighted according to its age by decay_curve.
+	 */
+	size_t			decay_backlog[DECAY_NSTEPS];
+#endif
+
 #ifdef MALLOC_LAZY_FREE
 	/*
 	 * Deallocation of small objects can be lazy, in which case free_cache
@@ -903,6 +1148,46 @@ struct arena_s {
 	arena_bin_t		bins[1]; /* Dynamically sized. */
 };
 
+#ifdef MALLOC_TCACHE
+typedef struct tcache_bin_s tcache_bin_t;
+struct tcache_bin_s {
+#ifdef MALLOC_STATS
+	/*
+	 * Number of allocation requests serviced by this bin since its
+	 * requests were last merged into an arena bin's statistics.
+	 */
+	uint64_t	nrequests;
+#endif
+
+	/* Number of cached objects. */
+	unsigned	ncached;
+
+	/*
+	 * Minimum value of ncached since the garbage collector last visited
+	 * this bin.  That many objects went unused, so they can be flushed.
+	 */
+	unsigned	low_water;
+
+	/* Stack of cached objects; avail[ncached - 1] is the top. */
+	void		**avail;
+};
+
+typedef struct tcache_s tcache_t;
+struct tcache_s {
+	/* Allocation/deallocation events since the last GC increment. */
+	unsigned	ev_cnt;
+
+	/* Next bin to be visited by the garbage collector. */
+	unsigned	next_gc_bin;
+
+	/*
+	 * One bin per arena bin.  The avail stacks for all bins follow bins
+	 * in the same allocation.
+	 */
+	tcache_bin_t	bins[1]; /* Dynamically sized. */
+};
+#endif
+
 /******************************************************************************/
 /*
  * Data.
@@ -920,7 +1205,8 @@ static size_t		pagesize_2pow;
 static size_t		bin_maxclass; /* Max size class for bins. */
 static unsigned		ntbins; /* Number of (2^n)-spaced tiny bins. */
 static unsigned		nqbins; /* Number of quantum-spaced bins. */
-static unsigned		nsbins; /* Number of (2^n)-spaced sub-page bins. */
+static unsigned		nsbins; /* Number of sub-page bins. */
+static unsigned		subpage_2pow; /* Sub-page bins per doubling, as 2^n. */
 static size_t		small_min;
 static size_t		small_max;
 
@@ -940,11 +1226,25 @@ static size_t		arena_maxclass; /* Max size class for arenas. */
  * Chunks.
  */
 
-/* Protects chunk-related data structures. */
+/*
+ * Protects chunk-related data structures.  Lookups and removals in huge_rtree
+ * do not need it; only insertions (which may have to add interior nodes) and
+ * statistics do.
+ */
 static malloc_mutex_t	huge_mtx;
 
-/* Tree of chunks that are stand-alone huge allocations. */
-static extent_tree_ad_t	huge;
+/*
+ * Radix tree that maps the base address of each stand-alone huge allocation
+ * to its size.  The key is the chunk number, i.e. the address shifted right by
+ * opt_chunk_2pow, and huge_rtree_level_bits[i] bits of it select a slot at
+ * level i.  Interior slots point to the next level; leaf slots hold sizes, and
+ * are 0 for chunks that do not start a huge allocation.  Sizes are multiples
+ * of chunksize, so the low bits of a leaf hold the index of the arena whose
+ * chunk hooks the allocation came from.
+ */
+static void		**huge_rtree_root;
+static unsigned		huge_rtree_height;
+static unsigned		huge_rtree_level_bits[RTREE_HEIGHT_MAX];
 
 #ifdef MALLOC_DSS
 /*
@@ -1003,9 +1303,15 @@ static size_t		base_mapped;
 /*
  * Arenas that are used to service external requests.  Not all elements of the
  * arenas array are necessarily used; arenas are created lazily as needed.
+ * Threads are only assigned to the first narenas automatically; arenas
+ * created through mallctl("arenas.create") follow them, up to narenas_total.
+ * Growing the array replaces it with a larger copy, so readers that do not
+ * hold arenas_lock still see a valid (if stale) array.
  */
 static arena_t		**arenas;
 static unsigned		narenas;
+static unsigned		narenas_total;
+static unsigned		arenas_len; /* Number of slots in arenas. */
 #ifndef NO_TLS
 #  ifdef MALLOC_BALANCE
 static unsigned		narenas_2pow;
@@ -1029,6 +1335,66 @@ static __thread arena_t	*arenas_map;
 #endif
 #endif
 
+#ifdef MALLOC_UNMAP_THREAD
+/*
+ * Chunks waiting for the unmap thread, in a ring that deallocating threads add
+ * to without a lock.  unmap_queue[i].seq is the position that the slot is next
+ * free to be written at, or that plus one once it has been.
+ */
+typedef struct {
+	volatile size_t	seq;
+	void		*chunk;
+	size_t		size;
+} unmap_slot_t;
+static unmap_slot_t	unmap_queue[UNMAP_QUEUE_SIZE];
+static volatile size_t	unmap_tail;
+static size_t		unmap_head;	/* Only the unmap thread uses this. */
+static volatile size_t	unmap_pending;	/* Bytes in the queue. */
+
+/* The unmap thread sleeps on unmap_cv when the queue is empty. */
+static bool		unmap_thread_running = false;
+static volatile bool	unmap_thread_sleeping = false;
+static pthread_mutex_t	unmap_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	unmap_cv = PTHREAD_COND_INITIALIZER;
+
+#  ifdef MALLOC_STATS
+/* Chunk runs unmapped by the unmap thread, and inline because it was behind. */
+static volatile uint64_t	unmap_ndeferred;
+static volatile uint64_t	unmap_ninline;
+#  endif
+#endif
+
+#ifdef MALLOC_DECAY
+/* Length of a decay epoch, in microseconds. */
+static uint64_t		decay_epoch_usec;
+
+/*
+ * decay_curve[i] is the fraction of the pages dirtied during decay epoch
+ * decay_backlog[i] that may remain unpurged.  It follows the smoothstep
+ * function, so purging starts gently, peaks halfway through the decay time,
+ * and tapers off.
+ */
+static uint32_t		decay_curve[DECAY_NSTEPS];
+#endif
+
+#ifdef MALLOC_TCACHE
+/*
+ * Each thread's cache of small objects.  tcache_tsd is only used in order to
+ * have tcache_thread_cleanup() called when a thread exits.  Once a thread's
+ * cache has been cleaned up, tcache_tls is set to TCACHE_DISABLED, so that
+ * deallocations by other TSD destructors do not create another cache.
+ */
+#define	TCACHE_DISABLED		((tcache_t *)(uintptr_t)1)
+static __thread tcache_t	*tcache_tls;
+static pthread_key_t	tcache_tsd;
+
+/* Maximum number of objects per thread cache bin. */
+static unsigned		tcache_nslots;
+
+/* Number of events between visits of successive bins by the GC. */
+static unsigned		tcache_gc_incr;
+#endif
+
 #ifdef MALLOC_STATS
 /* Chunk statistics. */
 static chunk_stats_t	stats_chunks;
@@ -1064,9 +1430,26 @@ static bool	opt_dss = true;
 static bool	opt_mmap = true;
 #endif
 static size_t	opt_dirty_max = DIRTY_MAX_DEFAULT;
+#ifdef MALLOC_DECAY
+static size_t	opt_decay_time = DECAY_TIME_DEFAULT;
+static bool	opt_decay_thread = false;
+#endif
+#ifdef MALLOC_UNMAP_THREAD
+static bool	opt_unmap_thread = false;
+#endif
+#ifdef MALLOC_PERCPU_ARENAS
+static bool	opt_percpu_arenas = false;
+#endif
+#ifdef MALLOC_HUGEPAGE
+static bool	opt_hugepage = false;
+#endif
 #ifdef MALLOC_LAZY_FREE
 static int	opt_lazy_free_2pow = LAZY_FREE_2POW_DEFAULT;
 #endif
+#ifdef MALLOC_TCACHE
+static int	opt_tcache_nslots_2pow = TCACHE_NSLOTS_2POW_DEFAULT;
+static int	opt_tcache_gc_2pow = TCACHE_GC_2POW_DEFAULT;
+#endif
 #ifdef MALLOC_BALANCE
 static uint64_t	opt_balance_threshold = BALANCE_THRESHOLD_DEFAULT;
 #endif
@@ -1107,6 +1490,15 @@ typedef struct {
 #define	UTRACE(a, b, c)
 #endif
 
+#ifdef MALLOC_USDT
+#include <sys/sdt.h>
+#define	PROBE1(name, a)		DTRACE_PROBE1(jemalloc, name, a)
+#define	PROBE2(name, a, b)	DTRACE_PROBE2(jemalloc, name, a, b)
+#else
+#define	PROBE1(name, a)
+#define	PROBE2(name, a, b)
+#endif
+
 /******************************************************************************/
 /*
  * Begin function prototypes for non-inline static functions.
@@ -1149,7 +1541,15 @@ static extent_node_t *chunk_dealloc_dss_record(void *chunk, size_t size);
 static bool	chunk_dealloc_dss(void *chunk, size_t size);
 #endif
 static void	chunk_dealloc_mmap(void *chunk, size_t size);
+#ifdef MALLOC_UNMAP_THREAD
+static bool	unmap_defer(void *chunk, size_t size);
+static void	*unmap_thread_main(void *arg);
+static void	unmap_thread_start(void);
+#endif
 static void	chunk_dealloc(void *chunk, size_t size);
+static void	*chunk_alloc_arena(arena_t *arena, size_t size, size_t alignment,
+    bool zero);
+static void	chunk_dealloc_arena(arena_t *arena, void *chunk, size_t size);
 #ifndef NO_TLS
 static arena_t	*choose_arena_hard(void);
 #endif
@@ -1162,7 +1562,16 @@ static arena_chunk_t *arena_chunk_alloc(arena_t *arena);
 static void	arena_chunk_dealloc(arena_t *arena, arena_chunk_t *chunk);
 static arena_run_t *arena_run_alloc(arena_t *arena, size_t size, bool small,
     bool zero);
-static void	arena_purge(arena_t *arena);
+static void	arena_chunk_purge(arena_t *arena, arena_chunk_t *chunk,
+    size_t first, size_t last, size_t ndirty_limit);
+#ifdef MALLOC_HUGEPAGE
+static void	arena_purge_cold(arena_t *arena, size_t ndirty_limit);
+#endif
+static void	arena_purge(arena_t *arena, size_t ndirty_limit, bool spare);
+#ifdef MALLOC_DECAY
+static void	arena_decay(arena_t *arena, uint64_t now);
+#endif
+static void	arena_purge_all(arena_t *arena);
 static void	arena_run_dalloc(arena_t *arena, arena_run_t *run, bool dirty);
 static void	arena_run_trim_head(arena_t *arena, arena_chunk_t *chunk,
     extent_node_t *nodeB, arena_run_t *run, size_t oldsize, size_t newsize);
@@ -1171,6 +1580,8 @@ static void	arena_run_trim_tail(arena_t *arena, arena_chunk_t *chunk,
     bool dirty);
 static arena_run_t *arena_bin_nonfull_run_get(arena_t *arena, arena_bin_t *bin);
 static void *arena_bin_malloc_hard(arena_t *arena, arena_bin_t *bin);
+static void arena_bin_run_layout(arena_bin_t *bin, size_t run_size,
+    unsigned *nregs, unsigned *mask_nelms, unsigned *reg0_offset);
 static size_t arena_bin_run_size_calc(arena_bin_t *bin, size_t min_run_size);
 #ifdef MALLOC_BALANCE
 static void	arena_lock_balance_hard(arena_t *arena);
@@ -1179,6 +1590,15 @@ static void	*arena_malloc_large(arena_t *arena, size_t size, bool zero);
 static void	*arena_palloc(arena_t *arena, size_t alignment, size_t size,
     size_t alloc_size);
 static size_t	arena_salloc(const void *ptr);
+#ifdef MALLOC_TCACHE
+static size_t	tcache_size(unsigned nslots);
+static tcache_t	*tcache_create(void);
+static void	*tcache_alloc_hard(tcache_bin_t *tbin, unsigned binind);
+static void	tcache_event_hard(tcache_t *tcache);
+static void	tcache_bin_flush(tcache_bin_t *tbin, unsigned binind,
+    unsigned rem);
+static void	tcache_thread_cleanup(void *arg);
+#endif
 #ifdef MALLOC_LAZY_FREE
 static void	arena_dalloc_lazy_hard(arena_t *arena, arena_chunk_t *chunk,
     void *ptr, size_t pageind, arena_chunk_map_t *mapelm);
@@ -1191,12 +1611,21 @@ static bool	arena_ralloc_large_grow(arena_t *arena, arena_chunk_t *chunk,
     void *ptr, size_t size, size_t oldsize);
 static bool	arena_ralloc_large(void *ptr, size_t size, size_t oldsize);
 static void	*arena_ralloc(void *ptr, size_t size, size_t oldsize);
-static bool	arena_new(arena_t *arena);
+static bool	arena_new(arena_t *arena, unsigned ind);
 static arena_t	*arenas_extend(unsigned ind);
+static int	arenas_create(const chunk_hooks_t *chunk_hooks);
 static void	*huge_malloc(size_t size, bool zero);
 static void	*huge_palloc(size_t alignment, size_t size);
+#if (defined(MOZ_MEMORY_LINUX) && defined(MREMAP_FIXED))
+static void	*huge_ralloc_remap(void *ptr, size_t size, size_t oldsize);
+#endif
 static void	*huge_ralloc(void *ptr, size_t size, size_t oldsize);
 static void	huge_dalloc(void *ptr);
+#ifdef MALLOC_DECAY
+static void	decay_time_set(size_t decay_time);
+static void	*decay_thread_main(void *arg);
+static void	decay_thread_start(void);
+#endif
 static void	malloc_print_stats(void);
 #ifndef MOZ_MEMORY_WINDOWS
 static
@@ -1475,6 +1904,30 @@ pow2_ceil(size_t x)
 	return (x);
 }
 
+/* Round a size in (small_max..bin_maxclass] up to its sub-page size class. */
+static inline size_t
+subpage_ceiling(size_t size)
+{
+	size_t spacing;
+
+	spacing = pow2_ceil(size) >> (subpage_2pow + 1);
+	return ((size + spacing - 1) & ~(spacing - 1));
+}
+
+/* Return the index of the least significant bit set in mask, which is not 0. */
+static inline unsigned
+regs_mask_ffs(uint64_t mask)
+{
+
+#ifdef __GNUC__
+	return (__builtin_ctzll(mask));
+#else
+	if ((uint32_t)mask != 0)
+		return (ffs((int)(uint32_t)mask) - 1);
+	return (ffs((int)(uint32_t)(mask >> 32)) + 31);
+#endif
+}
+
 #if (defined(MALLOC_LAZY_FREE) || defined(MALLOC_BALANCE))
 /*
  * Use a simple linear congruential pseudo-random number generator:
@@ -1794,6 +2247,12 @@ stats_print(arena_t *arena)
 	    arena->stats.npurge, arena->stats.npurge == 1 ? "" : "s",
 	    arena->stats.nmadvise, arena->stats.nmadvise == 1 ? "" : "s",
 	    arena->stats.purged, arena->stats.purged == 1 ? "" : "s");
+#  ifdef MALLOC_HUGEPAGE
+	if (opt_hugepage) {
+		malloc_printf("hugepage: %I64u page%s spared\n",
+		    arena->stats.spared, arena->stats.spared == 1 ? "" : "s");
+	}
+#  endif
 #  ifdef MALLOC_DECOMMIT
 	malloc_printf("decommit: %I64u decommit%s, %I64u commit%s,"
 	    " %I64u page%s decommitted\n",
@@ -1822,6 +2281,12 @@ stats_print(arena_t *arena)
 	    arena->stats.npurge, arena->stats.npurge == 1 ? "" : "s",
 	    arena->stats.nmadvise, arena->stats.nmadvise == 1 ? "" : "s",
 	    arena->stats.purged, arena->stats.purged == 1 ? "" : "s");
+#  ifdef MALLOC_HUGEPAGE
+	if (opt_hugepage) {
+		malloc_printf("hugepage: %llu page%s spared\n",
+		    arena->stats.spared, arena->stats.spared == 1 ? "" : "s");
+	}
+#  endif
 #  ifdef MALLOC_DECOMMIT
 	malloc_printf("decommit: %llu decommit%s, %llu commit%s,"
 	    " %llu page%s decommitted\n",
@@ -1940,6 +2405,137 @@ RB_GENERATE_STATIC(extent_tree_ad_s, extent_node_s, link_ad, extent_ad_comp)
  * End extent tree code.
  */
 /******************************************************************************/
+/*
+ * Begin radix tree code.
+ *
+ * Readers never lock.  Interior nodes are only added (under huge_mtx), and are
+ * never removed, so a reader can at worst miss a node that is being added for
+ * a key that is not yet in use.  Setting or clearing a leaf slot is a single
+ * store, and callers never look up a key concurrently with setting it.
+ */
+
+static bool
+huge_rtree_init(void)
+{
+	unsigned bits, bits_per_level, i;
+
+	bits = (sizeof(void *) << 3) - opt_chunk_2pow;
+	bits_per_level = RTREE_NODESIZE_2POW - (ffs(sizeof(void *)) - 1);
+	huge_rtree_height = (bits + bits_per_level - 1) / bits_per_level;
+	assert(huge_rtree_height <= RTREE_HEIGHT_MAX);
+
+	/* Make the root level absorb any remainder. */
+	huge_rtree_level_bits[0] = bits - (bits_per_level * (huge_rtree_height
+	    - 1));
+	for (i = 1; i < huge_rtree_height; i++)
+		huge_rtree_level_bits[i] = bits_per_level;
+
+	huge_rtree_root = (void **)base_alloc(sizeof(void *) <<
+	    huge_rtree_level_bits[0]);
+	if (huge_rtree_root == NULL)
+		return (true);
+	memset(huge_rtree_root, 0, sizeof(void *) << huge_rtree_level_bits[0]);
+
+	return (false);
+}
+
+/*
+ * Return the address of the leaf slot for ptr's chunk, or NULL if the path to
+ * it does not exist (and create is false, or memory is exhausted).
+ */
+static inline void **
+huge_rtree_slot(const void *ptr, bool create)
+{
+	uintptr_t key;
+	void **node, **child;
+	unsigned i, lshift;
+
+	key = (uintptr_t)ptr >> opt_chunk_2pow;
+	node = huge_rtree_root;
+	lshift = (sizeof(void *) << 3) - opt_chunk_2pow;
+	for (i = 0;; i++) {
+		unsigned bits = huge_rtree_level_bits[i];
+		uintptr_t subkey;
+
+		lshift -= bits;
+		subkey = (key >> lshift) & (((uintptr_t)1 << bits) - 1);
+		if (i == huge_rtree_height - 1)
+			return (&node[subkey]);
+
+		child = (void **)node[subkey];
+		if (child == NULL) {
+			size_t size;
+
+			if (create == false)
+				return (NULL);
+			size = sizeof(void *) << huge_rtree_level_bits[i + 1];
+			child = (void **)base_alloc(size);
+			if (child == NULL)
+				return (NULL);
+			memset(child, 0, size);
+			node[subkey] = (void *)child;
+		}
+		node = child;
+	}
+}
+
+/* Return the size of the huge allocation at ptr, or 0 if there is none. */
+static inline size_t
+huge_rtree_get(const void *ptr)
+{
+	void **slot;
+
+	slot = huge_rtree_slot(ptr, false);
+	if (slot == NULL)
+		return (0);
+	return ((size_t)(uintptr_t)*slot & ~chunksize_mask);
+}
+
+/*
+ * Record a huge allocation that was made for arena arena_ind.  The caller must
+ * hold huge_mtx.  Returns true if memory for the tree is exhausted.
+ */
+static bool
+huge_rtree_insert(const void *ptr, size_t size, unsigned arena_ind)
+{
+	void **slot;
+
+	assert(size != 0);
+	assert((size & chunksize_mask) == 0);
+	assert(arena_ind <= chunksize_mask);
+	slot = huge_rtree_slot(ptr, true);
+	if (slot == NULL)
+		return (true);
+	assert(*slot == NULL);
+	*slot = (void *)(uintptr_t)(size | arena_ind);
+
+	return (false);
+}
+
+/*
+ * Forget a huge allocation, returning its size, and storing the index of the
+ * arena it was made for in *arena_ind.
+ */
+static inline size_t
+huge_rtree_remove(const void *ptr, unsigned *arena_ind)
+{
+	void **slot;
+	size_t val;
+
+	slot = huge_rtree_slot(ptr, false);
+	assert(slot != NULL);
+	val = (size_t)(uintptr_t)*slot;
+	assert(val != 0);
+	*slot = NULL;
+
+	*arena_ind = (unsigned)(val & chunksize_mask);
+	return (val & ~chunksize_mask);
+}
+
+/*
+ * End radix tree code.
+ */
+/******************************************************************************/
 /*
  * Begin chunk management functions.
  */
@@ -2311,6 +2907,11 @@ chunk_alloc_mmap(size_t size)
 			ret = (void *)((uintptr_t)ret + (chunksize - offset));
 		}
 	}
+#ifdef MALLOC_HUGEPAGE
+	/* Chunks are whole huge pages, so the kernel can back them with some. */
+	if (opt_hugepage)
+		madvise(ret, size, MADV_HUGEPAGE);
+#endif
 
 	return (ret);
 }
@@ -2324,6 +2925,7 @@ chunk_alloc(size_t size, bool zero)
 	assert(size != 0);
 	assert((size & chunksize_mask) == 0);
 
+	PROBE1(chunk_alloc_start, size);
 #ifdef MALLOC_DSS
 	if (opt_dss) {
 		ret = chunk_recycle_dss(size, zero);
@@ -2355,6 +2957,7 @@ RETURN:
 	if (stats_chunks.curchunks > stats_chunks.highchunks)
 		stats_chunks.highchunks = stats_chunks.curchunks;
 #endif
+	PROBE2(chunk_alloc_done, size, ret);
 
 	assert(CHUNK_ADDR2BASE(ret) == ret);
 	return (ret);
@@ -2478,44 +3081,259 @@ chunk_dealloc_dss(void *chunk, size_t size)
 }
 #endif
 
-static void
-chunk_dealloc_mmap(void *chunk, size_t size)
+#ifdef MALLOC_UNMAP_THREAD
+/*
+ * Queue a chunk run for the unmap thread.  Returns true if it was queued, or
+ * false if the caller needs to unmap it (no thread, or too much pending).  The
+ * address range stays mapped until the thread gets to it, so chunk_alloc()
+ * cannot be handed it meanwhile.
+ */
+static bool
+unmap_defer(void *chunk, size_t size)
 {
+	size_t pos, before;
+	unmap_slot_t *slot;
+	ssize_t d;
 
-	pages_unmap(chunk, size);
-}
-
-static void
-chunk_dealloc(void *chunk, size_t size)
-{
+	if (unmap_thread_running == false)
+		return (false);
 
-	assert(chunk != NULL);
-	assert(CHUNK_ADDR2BASE(chunk) == chunk);
-	assert(size != 0);
-	assert((size & chunksize_mask) == 0);
+	/* A single run larger than the limit may still go, by itself. */
+	before = __sync_fetch_and_add(&unmap_pending, size);
+	if (before != 0 && before + size > UNMAP_PENDING_MAX)
+		goto RETURN_INLINE;
 
+	pos = unmap_tail;
+	while (true) {
+		slot = &unmap_queue[pos % UNMAP_QUEUE_SIZE];
+		d = (ssize_t)(slot->seq - pos);
+		if (d == 0) {
+			if (__sync_bool_compare_and_swap(&unmap_tail, pos,
+			    pos + 1))
+				break;
+			pos = unmap_tail;
+		} else if (d < 0) {
+			/* Full. */
+			goto RETURN_INLINE;
+		} else
+			pos = unmap_tail;
+	}
+	slot->chunk = chunk;
+	slot->size = size;
+	__sync_synchronize();
+	slot->seq = pos + 1;
 #ifdef MALLOC_STATS
-	stats_chunks.curchunks -= (size / chunksize);
+	__sync_fetch_and_add(&unmap_ndeferred, 1);
 #endif
 
-#ifdef MALLOC_DSS
-	if (opt_dss) {
-		if (chunk_dealloc_dss(chunk, size) == false)
-			return;
+	/*
+	 * The thread sets unmap_thread_sleeping before it looks at the queue
+	 * one last time, and we look at unmap_thread_sleeping after adding to
+	 * it, so at least one of us sees the other.
+	 */
+	__sync_synchronize();
+	if (unmap_thread_sleeping) {
+		pthread_mutex_lock(&unmap_mtx);
+		pthread_cond_signal(&unmap_cv);
+		pthread_mutex_unlock(&unmap_mtx);
 	}
-
-	if (opt_mmap)
+	return (true);
+RETURN_INLINE:
+	__sync_fetch_and_sub(&unmap_pending, size);
+#ifdef MALLOC_STATS
+	__sync_fetch_and_add(&unmap_ninline, 1);
 #endif
-		chunk_dealloc_mmap(chunk, size);
+	return (false);
 }
 
-/*
- * End chunk management functions.
- */
-/******************************************************************************/
-/*
- * Begin arena.
+static void *
+unmap_thread_main(void *arg)
+{
+	unmap_slot_t *slot;
+	void *chunk;
+	size_t size;
+#ifdef SCHED_IDLE
+	struct sched_param param;
+
+	/*
+	 * Run only when nothing else wants the CPU, so that waking up does not
+	 * preempt the thread that deallocated.  If there never is such a time,
+	 * the queue fills and chunks are unmapped inline again.
+	 */
+	param.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+	while (true) {
+		slot = &unmap_queue[unmap_head % UNMAP_QUEUE_SIZE];
+		if (slot->seq != unmap_head + 1) {
+			pthread_mutex_lock(&unmap_mtx);
+			unmap_thread_sleeping = true;
+			__sync_synchronize();
+			if (slot->seq != unmap_head + 1)
+				pthread_cond_wait(&unmap_cv, &unmap_mtx);
+			unmap_thread_sleeping = false;
+			pthread_mutex_unlock(&unmap_mtx);
+			continue;
+		}
+		__sync_synchronize();
+		chunk = slot->chunk;
+		size = slot->size;
+		__sync_synchronize();
+		slot->seq = unmap_head + UNMAP_QUEUE_SIZE;
+		unmap_head++;
+
+		pages_unmap(chunk, size);
+		__sync_fetch_and_sub(&unmap_pending, size);
+	}
+
+	return (NULL);
+}
+
+static void
+unmap_thread_start(void)
+{
+	pthread_t thread;
+	sigset_t set, oldset;
+	unsigned i;
+
+	for (i = 0; i < UNMAP_QUEUE_SIZE; i++)
+		unmap_queue[i].seq = i;
+
+	/* The unmap thread should never field the application's signals. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	if (pthread_create(&thread, NULL, unmap_thread_main, NULL) == 0) {
+		pthread_detach(thread);
+		unmap_thread_running = true;
+	} else {
+		_malloc_message(_getprogname(),
+		    ": (malloc) Error creating unmap thread\n", "", "");
+		if (opt_abort)
+			abort();
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+#endif
+
+static void
+chunk_dealloc_mmap(void *chunk, size_t size)
+{
+
+#ifdef MALLOC_UNMAP_THREAD
+	if (unmap_defer(chunk, size))
+		return;
+#endif
+	pages_unmap(chunk, size);
+}
+
+static void
+chunk_dealloc(void *chunk, size_t size)
+{
+
+	assert(chunk != NULL);
+	assert(CHUNK_ADDR2BASE(chunk) == chunk);
+	assert(size != 0);
+	assert((size & chunksize_mask) == 0);
+
+#ifdef MALLOC_STATS
+	stats_chunks.curchunks -= (size / chunksize);
+#endif
+
+#ifdef MALLOC_DSS
+	if (opt_dss) {
+		if (chunk_dealloc_dss(chunk, size) == false)
+			return;
+	}
+
+	if (opt_mmap)
+#endif
+		chunk_dealloc_mmap(chunk, size);
+}
+
+/*
+ * Allocate chunks on behalf of arena, through its chunk hooks if it has any.
+ * Otherwise, alignment must be chunksize.
+ */
+static void *
+chunk_alloc_arena(arena_t *arena, size_t size, size_t alignment, bool zero)
+{
+	void *ret;
+
+	if (arena->chunk_hooks.alloc == NULL) {
+		assert(alignment == chunksize);
+		return (chunk_alloc(size, zero));
+	}
+
+	ret = arena->chunk_hooks.alloc(size, alignment, zero, arena->ind);
+	if (ret == NULL)
+		return (NULL);
+	if (((uintptr_t)ret & (alignment - 1)) != 0) {
+		_malloc_message(_getprogname(),
+		    ": (malloc) Misaligned chunk from chunk hook\n", "", "");
+		if (opt_abort)
+			abort();
+		arena->chunk_hooks.dalloc(ret, size, arena->ind);
+		return (NULL);
+	}
+#ifdef MALLOC_STATS
+	stats_chunks.nchunks += (size / chunksize);
+	stats_chunks.curchunks += (size / chunksize);
+	if (stats_chunks.curchunks > stats_chunks.highchunks)
+		stats_chunks.highchunks = stats_chunks.curchunks;
+#endif
+
+	return (ret);
+}
+
+static void
+chunk_dealloc_arena(arena_t *arena, void *chunk, size_t size)
+{
+
+	if (arena->chunk_hooks.dalloc == NULL) {
+		chunk_dealloc(chunk, size);
+		return;
+	}
+
+#ifdef MALLOC_STATS
+	stats_chunks.curchunks -= (size / chunksize);
+#endif
+	arena->chunk_hooks.dalloc(chunk, size, arena->ind);
+}
+
+/*
+ * End chunk management functions.
+ */
+/******************************************************************************/
+/*
+ * Begin arena.
+ */
+
+#ifdef MALLOC_PERCPU_ARENAS
+/*
+ * Choose the arena of the CPU that the calling thread is running on.  The
+ * thread may migrate at any moment, so this is only a hint, but a good one:
+ * glibc reads the CPU number from the kernel's rseq area or the vDSO, without
+ * a system call.
  */
+static inline arena_t *
+choose_arena_cpu(void)
+{
+	arena_t *ret;
+	int cpu;
+	unsigned ind;
+
+	cpu = sched_getcpu();
+	ind = (cpu < 0) ? 0 : (unsigned)cpu % narenas;
+	if ((ret = arenas[ind]) == NULL) {
+		malloc_spin_lock(&arenas_lock);
+		if ((ret = arenas[ind]) == NULL)
+			ret = arenas_extend(ind);
+		malloc_spin_unlock(&arenas_lock);
+	}
+	return (ret);
+}
+#endif
 
 /*
  * Choose an arena based on a per-thread value (fast-path code, calls slow-path
@@ -2544,10 +3362,22 @@ choose_arena(void)
 #  endif
 
 	if (ret == NULL) {
+#  ifdef MALLOC_PERCPU_ARENAS
+		/*
+		 * Only threads bound to an arena with mallctl("thread.arena")
+		 * have one in TLS in this mode.
+		 */
+		if (opt_percpu_arenas)
+			return (choose_arena_cpu());
+#  endif
 		ret = choose_arena_hard();
 		assert(ret != NULL);
 	}
 #else
+#  ifdef MALLOC_PERCPU_ARENAS
+	if (__isthreaded && opt_percpu_arenas)
+		return (choose_arena_cpu());
+#  endif
 	if (__isthreaded && narenas > 1) {
 		unsigned long ind;
 
@@ -2686,6 +3516,9 @@ arena_run_comp(arena_run_t *a, arena_run_t *b)
 	assert(a != NULL);
 	assert(b != NULL);
 
+	/* Fuller runs first. */
+	if (a->occupancy != b->occupancy)
+		return (a->occupancy > b->occupancy ? -1 : 1);
 	return ((a_run > b_run) - (a_run < b_run));
 }
 
@@ -2724,7 +3557,8 @@ static inline void *
 arena_run_reg_alloc(arena_run_t *run, arena_bin_t *bin)
 {
 	void *ret;
-	unsigned i, mask, bit, regind;
+	unsigned i, bit, regind;
+	uint64_t mask;
 
 	assert(run->magic == ARENA_RUN_MAGIC);
 	assert(run->regs_minelm < bin->regs_mask_nelms);
@@ -2738,15 +3572,15 @@ arena_run_reg_alloc(arena_run_t *run, arena_bin_t *bin)
 	mask = run->regs_mask[i];
 	if (mask != 0) {
 		/* Usable allocation found. */
-		bit = ffs((int)mask) - 1;
+		bit = regs_mask_ffs(mask);
 
-		regind = ((i << (SIZEOF_INT_2POW + 3)) + bit);
+		regind = ((i << REGS_MASK_2POW) + bit);
 		assert(regind < bin->nregs);
 		ret = (void *)(((uintptr_t)run) + bin->reg0_offset
 		    + (bin->reg_size * regind));
 
 		/* Clear bit. */
-		mask ^= (1U << bit);
+		mask &= mask - 1;
 		run->regs_mask[i] = mask;
 
 		return (ret);
@@ -2756,15 +3590,15 @@ arena_run_reg_alloc(arena_run_t *run, arena_bin_t *bin)
 		mask = run->regs_mask[i];
 		if (mask != 0) {
 			/* Usable allocation found. */
-			bit = ffs((int)mask) - 1;
+			bit = regs_mask_ffs(mask);
 
-			regind = ((i << (SIZEOF_INT_2POW + 3)) + bit);
+			regind = ((i << REGS_MASK_2POW) + bit);
 			assert(regind < bin->nregs);
 			ret = (void *)(((uintptr_t)run) + bin->reg0_offset
 			    + (bin->reg_size * regind));
 
 			/* Clear bit. */
-			mask ^= (1U << bit);
+			mask &= mask - 1;
 			run->regs_mask[i] = mask;
 
 			/*
@@ -2817,6 +3651,14 @@ arena_run_reg_dalloc(arena_run_t *run, arena_bin_t *bin, void *ptr, size_t size)
 	    SIZE_INV(60), SIZE_INV(61), SIZE_INV(62), SIZE_INV(63)
 #endif
 	};
+	/*
+	 * Sub-page sizes are a power of two times an odd number below
+	 * (2U << SUBPAGE_2POW); odd_invs[(odd >> 1) - 1] is 2^21 / odd.
+	 */
+#define	ODD_INV(s) (((1U << SIZE_INV_SHIFT) / (s)) + 1)
+	static const unsigned odd_invs[] = {
+	    ODD_INV(3), ODD_INV(5), ODD_INV(7)
+	};
 	unsigned diff, regind, elm, bit;
 
 	assert(run->magic == ARENA_RUN_MAGIC);
@@ -2861,6 +3703,12 @@ arena_run_reg_dalloc(arena_run_t *run, arena_bin_t *bin, void *ptr, size_t size)
 	    << QUANTUM_2POW_MIN) + 2) {
 		regind = size_invs[(size >> QUANTUM_2POW_MIN) - 3] * diff;
 		regind >>= SIZE_INV_SHIFT;
+	} else if (size > small_max) {
+		unsigned shift = ffs((int)size) - 1;
+
+		assert((size >> shift) < (2U << SUBPAGE_2POW));
+		regind = ((diff >> shift) * odd_invs[(size >> (shift + 1)) - 1])
+		    >> SIZE_INV_SHIFT;
 	} else {
 		/*
 		 * size_invs isn't large enough to handle this size class, so
@@ -2873,12 +3721,13 @@ arena_run_reg_dalloc(arena_run_t *run, arena_bin_t *bin, void *ptr, size_t size)
 	assert(diff == regind * size);
 	assert(regind < bin->nregs);
 
-	elm = regind >> (SIZEOF_INT_2POW + 3);
+	elm = regind >> REGS_MASK_2POW;
 	if (elm < run->regs_minelm)
 		run->regs_minelm = elm;
-	bit = regind - (elm << (SIZEOF_INT_2POW + 3));
-	assert((run->regs_mask[elm] & (1U << bit)) == 0);
-	run->regs_mask[elm] |= (1U << bit);
+	bit = regind - (elm << REGS_MASK_2POW);
+	assert((run->regs_mask[elm] & ((uint64_t)1 << bit)) == 0);
+	run->regs_mask[elm] |= ((uint64_t)1 << bit);
+#undef ODD_INV
 #undef SIZE_INV
 #undef SIZE_INV_SHIFT
 }
@@ -2993,7 +3842,8 @@ arena_chunk_alloc(arena_t *arena)
 		chunk = arena->spare;
 		arena->spare = NULL;
 	} else {
-		chunk = (arena_chunk_t *)chunk_alloc(chunksize, true);
+		chunk = (arena_chunk_t *)chunk_alloc_arena(arena, chunksize,
+		    chunksize, true);
 		if (chunk == NULL)
 			return (NULL);
 #ifdef MALLOC_STATS
@@ -3068,7 +3918,7 @@ arena_chunk_dealloc(arena_t *arena, arena_chunk_t *chunk)
 		RB_REMOVE(arena_chunk_tree_s, &chunk->arena->chunks,
 		    arena->spare);
 		arena->ndirty -= arena->spare->ndirty;
-		chunk_dealloc((void *)arena->spare, chunksize);
+		chunk_dealloc_arena(arena, (void *)arena->spare, chunksize);
 #ifdef MALLOC_STATS
 		arena->stats.mapped -= chunksize;
 #endif
@@ -3102,6 +3952,7 @@ arena_run_alloc(arena_t *arena, size_t size, bool small, bool zero)
 	    pagesize_2pow)));
 	assert((size & pagesize_mask) == 0);
 
+	PROBE2(arena_run_alloc_start, size, small);
 	/* Search the arena's chunks for the lowest best fit. */
 	key.addr = NULL;
 	key.size = size;
@@ -3109,6 +3960,7 @@ arena_run_alloc(arena_t *arena, size_t size, bool small, bool zero)
 	if (node != NULL) {
 		run = (arena_run_t *)node->addr;
 		arena_run_split(arena, run, size, small, zero);
+		PROBE2(arena_run_alloc_done, size, run);
 		return (run);
 	}
 
@@ -3116,19 +3968,136 @@ arena_run_alloc(arena_t *arena, size_t size, bool small, bool zero)
 	 * No usable runs.  Create a new chunk from which to allocate the run.
 	 */
 	chunk = arena_chunk_alloc(arena);
-	if (chunk == NULL)
+	if (chunk == NULL) {
+		run = NULL;
+		PROBE2(arena_run_alloc_done, size, run);
 		return (NULL);
+	}
 	run = (arena_run_t *)((uintptr_t)chunk + (arena_chunk_header_npages <<
 	    pagesize_2pow));
 	/* Update page map. */
 	arena_run_split(arena, run, size, small, zero);
+	PROBE2(arena_run_alloc_done, size, run);
 	return (run);
 }
 
+#ifdef MALLOC_DECAY
+/* Return the current time in microseconds. */
+static inline uint64_t
+decay_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec);
+}
+#endif
+
+/*
+ * Purge the dirty pages of chunk among pages [first, last), from the top down,
+ * until no more than ndirty_limit remain in the arena.
+ */
+static void
+arena_chunk_purge(arena_t *arena, arena_chunk_t *chunk, size_t first,
+    size_t last, size_t ndirty_limit)
+{
+	size_t i;
+
+	for (i = last; i > first && arena->ndirty > ndirty_limit;) {
+		i--;
+		if (chunk->map[i] & CHUNK_MAP_DIRTY) {
+			size_t npages;
+
+			chunk->map[i] = (CHUNK_MAP_LARGE |
+#ifdef MALLOC_DECOMMIT
+			    CHUNK_MAP_DECOMMITTED |
+#endif
+			    CHUNK_MAP_POS_MASK);
+			chunk->ndirty--;
+			arena->ndirty--;
+			/* Find adjacent dirty run(s). */
+			for (npages = 1; i > first && (chunk->map[i - 1] &
+			    CHUNK_MAP_DIRTY); npages++) {
+				i--;
+				chunk->map[i] = (CHUNK_MAP_LARGE
+#ifdef MALLOC_DECOMMIT
+				    | CHUNK_MAP_DECOMMITTED
+#endif
+				    | CHUNK_MAP_POS_MASK);
+				chunk->ndirty--;
+				arena->ndirty--;
+			}
+
+#ifdef MALLOC_DECOMMIT
+			pages_decommit((void *)((uintptr_t)chunk + (i <<
+			    pagesize_2pow)), (npages << pagesize_2pow));
+#  ifdef MALLOC_STATS
+			arena->stats.ndecommit++;
+			arena->stats.decommitted += npages;
+#  endif
+#else
+			madvise((void *)((uintptr_t)chunk + (i <<
+			    pagesize_2pow)), pagesize * npages, MADV_FREE);
+#endif
+#ifdef MALLOC_STATS
+			arena->stats.nmadvise++;
+			arena->stats.purged += npages;
+#endif
+		}
+	}
+}
+
+#ifdef MALLOC_HUGEPAGE
+/*
+ * Purge the dirty pages of cold huge pages, those at least 1/2^
+ * HUGEPAGE_COLD_2POW dirty, until no more than ndirty_limit remain.  Purging
+ * a huge page splits it, but these have little left in use to lose it for.
+ */
+static void
+arena_purge_cold(arena_t *arena, size_t ndirty_limit)
+{
+	arena_chunk_t *chunk;
+	size_t hpages = (size_t)1 << (HUGEPAGE_2POW - pagesize_2pow);
+
+	RB_FOREACH_REVERSE(chunk, arena_chunk_tree_s, &arena->chunks) {
+		size_t last;
+
+		if (arena->ndirty <= ndirty_limit)
+			break;
+		if ((chunk->ndirty << HUGEPAGE_COLD_2POW) < hpages)
+			continue;
+		for (last = chunk_npages; last > 0 && arena->ndirty >
+		    ndirty_limit; last -= hpages) {
+			size_t first, i, ndirty;
+
+			first = last - hpages;
+			for (i = first, ndirty = 0; i < last; i++) {
+				if (chunk->map[i] & CHUNK_MAP_DIRTY)
+					ndirty++;
+			}
+			if ((ndirty << HUGEPAGE_COLD_2POW) >= hpages) {
+				arena_chunk_purge(arena, chunk, (first <
+				    arena_chunk_header_npages) ?
+				    arena_chunk_header_npages : first, last,
+				    ndirty_limit);
+			}
+		}
+	}
+}
+#endif
+
+/*
+ * Purge dirty pages until no more than ndirty_limit remain.  In huge page
+ * mode, if spare is true, cold huge pages are purged first, and the dirty
+ * pages of hot ones are purged only past a further opt_dirty_max/2.
+ */
 static void
-arena_purge(arena_t *arena)
+arena_purge(arena_t *arena, size_t ndirty_limit, bool spare)
 {
 	arena_chunk_t *chunk;
+#ifdef MALLOC_HUGEPAGE
+	size_t nspare;
+#endif
 #ifdef MALLOC_DEBUG
 	size_t ndirty;
 
@@ -3138,68 +4107,102 @@ arena_purge(arena_t *arena)
 	}
 	assert(ndirty == arena->ndirty);
 #endif
-	assert(arena->ndirty > opt_dirty_max);
+	assert(arena->ndirty > ndirty_limit);
 
 #ifdef MALLOC_STATS
 	arena->stats.npurge++;
 #endif
+	PROBE2(arena_purge_start, arena->ndirty, ndirty_limit);
 
+#ifdef MALLOC_HUGEPAGE
+	if (opt_hugepage && spare) {
+		arena_purge_cold(arena, ndirty_limit);
+		nspare = opt_dirty_max >> 1;
+		ndirty_limit += nspare;
+	} else
+		nspare = 0;
+#endif
 	/*
 	 * Iterate downward through chunks until enough dirty memory has been
 	 * purged.
 	 */
 	RB_FOREACH_REVERSE(chunk, arena_chunk_tree_s, &arena->chunks) {
+		if (arena->ndirty <= ndirty_limit)
+			break;
 		if (chunk->ndirty > 0) {
-			size_t i;
+			arena_chunk_purge(arena, chunk,
+			    arena_chunk_header_npages, chunk_npages,
+			    ndirty_limit);
+		}
+	}
+#if defined(MALLOC_HUGEPAGE) && defined(MALLOC_STATS)
+	if (arena->ndirty + nspare > ndirty_limit)
+		arena->stats.spared += arena->ndirty + nspare - ndirty_limit;
+#endif
+	PROBE1(arena_purge_done, arena->ndirty);
+}
 
-			for (i = chunk_npages - 1; i >=
-			    arena_chunk_header_npages; i--) {
-				if (chunk->map[i] & CHUNK_MAP_DIRTY) {
-					size_t npages;
+#ifdef MALLOC_DECAY
+/*
+ * Advance the arena's decay epoch to now, if a full epoch has passed, and
+ * purge whatever the decay curve no longer allows the arena to retain.
+ */
+static void
+arena_decay(arena_t *arena, uint64_t now)
+{
+	uint64_t nadvance, limit;
+	unsigned i;
 
-					chunk->map[i] = (CHUNK_MAP_LARGE |
-#ifdef MALLOC_DECOMMIT
-					    CHUNK_MAP_DECOMMITTED |
-#endif
-					    CHUNK_MAP_POS_MASK);
-					chunk->ndirty--;
-					arena->ndirty--;
-					/* Find adjacent dirty run(s). */
-					for (npages = 1; i >
-					    arena_chunk_header_npages &&
-					    (chunk->map[i - 1] &
-					    CHUNK_MAP_DIRTY); npages++) {
-						i--;
-						chunk->map[i] = (CHUNK_MAP_LARGE
-#ifdef MALLOC_DECOMMIT
-						    | CHUNK_MAP_DECOMMITTED
-#endif
-						    | CHUNK_MAP_POS_MASK);
-						chunk->ndirty--;
-						arena->ndirty--;
-					}
+	if (now < arena->decay_epoch) {
+		/* The clock went backward; start over from here. */
+		arena->decay_epoch = now;
+		return;
+	}
+	nadvance = (now - arena->decay_epoch) / decay_epoch_usec;
+	if (nadvance == 0)
+		return;
+	arena->decay_epoch += nadvance * decay_epoch_usec;
 
-#ifdef MALLOC_DECOMMIT
-					pages_decommit((void *)((uintptr_t)
-					    chunk + (i << pagesize_2pow)),
-					    (npages << pagesize_2pow));
-#  ifdef MALLOC_STATS
-					arena->stats.ndecommit++;
-					arena->stats.decommitted += npages;
-#  endif
-#else
-					madvise((void *)((uintptr_t)chunk + (i
-					    << pagesize_2pow)), pagesize *
-					    npages, MADV_FREE);
+	/* Age the backlog, and record the pages dirtied in the last epoch. */
+	if (nadvance >= DECAY_NSTEPS) {
+		memset(arena->decay_backlog, 0, sizeof(arena->decay_backlog));
+	} else {
+		memmove(arena->decay_backlog, &arena->decay_backlog[nadvance],
+		    (DECAY_NSTEPS - nadvance) * sizeof(size_t));
+		memset(&arena->decay_backlog[DECAY_NSTEPS - nadvance], 0,
+		    nadvance * sizeof(size_t));
+	}
+	if (arena->ndirty > arena->decay_ndirty) {
+		arena->decay_backlog[DECAY_NSTEPS - 1] = arena->ndirty -
+		    arena->decay_ndirty;
+	}
+
+	for (i = 0, limit = 0; i < DECAY_NSTEPS; i++) {
+		limit += (uint64_t)arena->decay_backlog[i] * (uint64_t)
+		    decay_curve[i];
+	}
+	limit >>= DECAY_BFP;
+
+	if (arena->ndirty > limit)
+		arena_purge(arena, (size_t)limit, true);
+	arena->decay_ndirty = arena->ndirty;
+}
 #endif
-#ifdef MALLOC_STATS
-					arena->stats.nmadvise++;
-					arena->stats.purged += npages;
+
+/* Purge all of arena's dirty pages, regardless of opt_dirty_max or decay. */
+static void
+arena_purge_all(arena_t *arena)
+{
+
+	malloc_spin_lock(&arena->lock);
+	if (arena->ndirty > 0)
+		arena_purge(arena, 0, false);
+#ifdef MALLOC_DECAY
+	/* Nothing that was dirtied before now remains to decay. */
+	arena->decay_ndirty = 0;
+	memset(arena->decay_backlog, 0, sizeof(arena->decay_backlog));
 #endif
-				}
-			}
-		}
-	}
+	malloc_spin_unlock(&arena->lock);
 }
 
 static void
@@ -3296,9 +4299,15 @@ arena_run_dalloc(arena_t *arena, arena_run_t *run, bool dirty)
 	if (chunk->pages_used == 0)
 		arena_chunk_dealloc(arena, chunk);
 
+#ifdef MALLOC_DECAY
+	if (opt_decay_time > 0) {
+		arena_decay(arena, decay_now());
+		return;
+	}
+#endif
 	/* Enforce opt_dirty_max. */
 	if (arena->ndirty > opt_dirty_max)
-		arena_purge(arena);
+		arena_purge(arena, 0, true);
 }
 
 static void
@@ -3359,6 +4368,15 @@ arena_run_trim_tail(arena_t *arena, arena_chunk_t *chunk, extent_node_t *nodeA,
 	    dirty);
 }
 
+/* The occupancy class of run: higher for runs with more regions in use. */
+static inline unsigned
+arena_run_occupancy(arena_run_t *run, arena_bin_t *bin)
+{
+
+	return (((bin->nregs - run->nfree) << RUN_OCCUPANCY_2POW) /
+	    bin->nregs);
+}
+
 static arena_run_t *
 arena_bin_nonfull_run_get(arena_t *arena, arena_bin_t *bin)
 {
@@ -3384,14 +4402,15 @@ arena_bin_nonfull_run_get(arena_t *arena, arena_bin_t *bin)
 	/* Initialize run internals. */
 	run->bin = bin;
 
-	for (i = 0; i < bin->regs_mask_nelms; i++)
-		run->regs_mask[i] = UINT_MAX;
-	remainder = bin->nregs & ((1U << (SIZEOF_INT_2POW + 3)) - 1);
+	for (i = 0; i < bin->regs_mask_nelms - 1; i++)
+		run->regs_mask[i] = UINT64_MAX;
+	remainder = bin->nregs & (REGS_MASK_BITS - 1);
 	if (remainder != 0) {
 		/* The last element has spare bits that need to be unset. */
-		run->regs_mask[i] = (UINT_MAX >> ((1U << (SIZEOF_INT_2POW + 3))
+		run->regs_mask[i] = (UINT64_MAX >> (REGS_MASK_BITS
 		    - remainder));
-	}
+	} else
+		run->regs_mask[i] = UINT64_MAX;
 
 	run->regs_minelm = 0;
 
@@ -3439,6 +4458,38 @@ arena_bin_malloc_hard(arena_t *arena, arena_bin_t *bin)
 	return (arena_bin_malloc_easy(arena, bin, bin->runcur));
 }
 
+/*
+ * Calculate the number of regions, regs_mask elements, and first region offset
+ * for a run of run_size bytes in bin, fitting as many regions as possible
+ * after the run header.
+ */
+static void
+arena_bin_run_layout(arena_bin_t *bin, size_t run_size, unsigned *nregs,
+    unsigned *mask_nelms, unsigned *reg0_offset)
+{
+	unsigned try_nregs, try_mask_nelms, try_reg0_offset;
+
+	/*
+	 * The do..while loop iteratively reduces the number of regions until
+	 * the run header and the regions no longer overlap.  A closed formula
+	 * would be quite messy, since there is an interdependency between the
+	 * header's mask length and the number of regions.
+	 */
+	try_nregs = ((run_size - sizeof(arena_run_t)) / bin->reg_size)
+	    + 1; /* Counter-act try_nregs-- in loop. */
+	do {
+		try_nregs--;
+		try_mask_nelms = (try_nregs >> REGS_MASK_2POW) +
+		    ((try_nregs & (REGS_MASK_BITS - 1)) ? 1 : 0);
+		try_reg0_offset = run_size - (try_nregs * bin->reg_size);
+	} while (sizeof(arena_run_t) + (sizeof(uint64_t) * (try_mask_nelms - 1))
+	    > try_reg0_offset);
+
+	*nregs = try_nregs;
+	*mask_nelms = try_mask_nelms;
+	*reg0_offset = try_reg0_offset;
+}
+
 /*
  * Calculate bin->run_size such that it meets the following constraints:
  *
@@ -3447,6 +4498,11 @@ arena_bin_malloc_hard(arena_t *arena, arena_bin_t *bin)
  *   *) bin->run_size <= RUN_MAX_SMALL
  *   *) run header overhead <= RUN_MAX_OVRHD (or header overhead relaxed).
  *
+ * Of the run sizes below the smallest one that honors RUN_MAX_OVRHD, the one
+ * that leaves the smallest fraction of the run unused is chosen.  This matters
+ * most for the sub-page size classes, whose regions leave a large tail in some
+ * run sizes and none in others.
+ *
  * bin->nregs, bin->regs_mask_nelms, and bin->reg0_offset are
  * also calculated here, since these settings are all interdependent.
  */
@@ -3461,57 +4517,41 @@ arena_bin_run_size_calc(arena_bin_t *bin, size_t min_run_size)
 	assert(min_run_size <= arena_maxclass);
 	assert(min_run_size <= RUN_MAX_SMALL);
 
-	/*
-	 * Calculate known-valid settings before entering the run_size
-	 * expansion loop, so that the first part of the loop always copies
-	 * valid settings.
-	 *
-	 * The do..while loop iteratively reduces the number of regions until
-	 * the run header and the regions no longer overlap.  A closed formula
-	 * would be quite messy, since there is an interdependency between the
-	 * header's mask length and the number of regions.
-	 */
 	try_run_size = min_run_size;
-	try_nregs = ((try_run_size - sizeof(arena_run_t)) / bin->reg_size)
-	    + 1; /* Counter-act try_nregs-- in loop. */
-	do {
-		try_nregs--;
-		try_mask_nelms = (try_nregs >> (SIZEOF_INT_2POW + 3)) +
-		    ((try_nregs & ((1U << (SIZEOF_INT_2POW + 3)) - 1)) ? 1 : 0);
-		try_reg0_offset = try_run_size - (try_nregs * bin->reg_size);
-	} while (sizeof(arena_run_t) + (sizeof(unsigned) * (try_mask_nelms - 1))
-	    > try_reg0_offset);
+	arena_bin_run_layout(bin, try_run_size, &try_nregs, &try_mask_nelms,
+	    &try_reg0_offset);
+	good_run_size = try_run_size;
+	good_nregs = try_nregs;
+	good_mask_nelms = try_mask_nelms;
+	good_reg0_offset = try_reg0_offset;
 
-	/* run_size expansion loop. */
-	do {
-		/*
-		 * Copy valid settings before trying more aggressive settings.
-		 */
-		good_run_size = try_run_size;
-		good_nregs = try_nregs;
-		good_mask_nelms = try_mask_nelms;
-		good_reg0_offset = try_reg0_offset;
+	/*
+	 * run_size expansion loop.  Stop short of the first run size that
+	 * honors RUN_MAX_OVRHD, as the smaller runs are still preferable, and
+	 * of the first one that is too large.
+	 */
+	while (RUN_MAX_OVRHD * (bin->reg_size << 3) > RUN_MAX_OVRHD_RELAX
+	    && (try_reg0_offset << RUN_BFP) > RUN_MAX_OVRHD * try_run_size) {
+		/* Keep the settings that waste the smallest fraction. */
+		if ((uint64_t)try_reg0_offset * good_run_size <
+		    (uint64_t)good_reg0_offset * try_run_size) {
+			good_run_size = try_run_size;
+			good_nregs = try_nregs;
+			good_mask_nelms = try_mask_nelms;
+			good_reg0_offset = try_reg0_offset;
+		}
 
-		/* Try more aggressive settings. */
 		try_run_size += pagesize;
-		try_nregs = ((try_run_size - sizeof(arena_run_t)) /
-		    bin->reg_size) + 1; /* Counter-act try_nregs-- in loop. */
-		do {
-			try_nregs--;
-			try_mask_nelms = (try_nregs >> (SIZEOF_INT_2POW + 3)) +
-			    ((try_nregs & ((1U << (SIZEOF_INT_2POW + 3)) - 1)) ?
-			    1 : 0);
-			try_reg0_offset = try_run_size - (try_nregs *
-			    bin->reg_size);
-		} while (sizeof(arena_run_t) + (sizeof(unsigned) *
-		    (try_mask_nelms - 1)) > try_reg0_offset);
-	} while (try_run_size <= arena_maxclass && try_run_size <= RUN_MAX_SMALL
-	    && RUN_MAX_OVRHD * (bin->reg_size << 3) > RUN_MAX_OVRHD_RELAX
-	    && (try_reg0_offset << RUN_BFP) > RUN_MAX_OVRHD * try_run_size);
-
-	assert(sizeof(arena_run_t) + (sizeof(unsigned) * (good_mask_nelms - 1))
+		if (try_run_size > arena_maxclass || try_run_size >
+		    RUN_MAX_SMALL)
+			break;
+		arena_bin_run_layout(bin, try_run_size, &try_nregs,
+		    &try_mask_nelms, &try_reg0_offset);
+	}
+
+	assert(sizeof(arena_run_t) + (sizeof(uint64_t) * (good_mask_nelms - 1))
 	    <= good_reg0_offset);
-	assert((good_mask_nelms << (SIZEOF_INT_2POW + 3)) >= good_nregs);
+	assert((good_mask_nelms << REGS_MASK_2POW) >= good_nregs);
 
 	/* Copy final settings. */
 	bin->run_size = good_run_size;
@@ -3579,38 +4619,50 @@ arena_lock_balance_hard(arena_t *arena)
 }
 #endif
 
-static inline void *
-arena_malloc_small(arena_t *arena, size_t size, bool zero)
+/*
+ * Return the index of the bin that services small requests of *size bytes,
+ * and round *size up to that bin's size class.
+ */
+static inline unsigned
+small_size2bin(size_t *size)
 {
-	void *ret;
-	arena_bin_t *bin;
-	arena_run_t *run;
+	unsigned binind;
 
-	if (size < small_min) {
+	if (*size < small_min) {
 		/* Tiny. */
-		size = pow2_ceil(size);
-		bin = &arena->bins[ffs((int)(size >> (TINY_MIN_2POW +
-		    1)))];
-#if (!defined(NDEBUG) || defined(MALLOC_STATS))
-		/*
-		 * Bin calculation is always correct, but we may need
-		 * to fix size for the purposes of assertions and/or
-		 * stats accuracy.
-		 */
-		if (size < (1U << TINY_MIN_2POW))
-			size = (1U << TINY_MIN_2POW);
-#endif
-	} else if (size <= small_max) {
+		*size = pow2_ceil(*size);
+		binind = ffs((int)(*size >> (TINY_MIN_2POW + 1)));
+		if (*size < (1U << TINY_MIN_2POW))
+			*size = (1U << TINY_MIN_2POW);
+	} else if (*size <= small_max) {
 		/* Quantum-spaced. */
-		size = QUANTUM_CEILING(size);
-		bin = &arena->bins[ntbins + (size >> opt_quantum_2pow)
-		    - 1];
+		*size = QUANTUM_CEILING(*size);
+		binind = ntbins + (*size >> opt_quantum_2pow) - 1;
 	} else {
 		/* Sub-page. */
-		size = pow2_ceil(size);
-		bin = &arena->bins[ntbins + nqbins
-		    + (ffs((int)(size >> opt_small_max_2pow)) - 2)];
+		size_t pow2_size;
+		unsigned pow2_2pow;
+
+		*size = subpage_ceiling(*size);
+		pow2_size = pow2_ceil(*size);
+		pow2_2pow = ffs((int)pow2_size) - 1;
+		binind = ntbins + nqbins
+		    + ((pow2_2pow - opt_small_max_2pow - 1) << subpage_2pow)
+		    + ((*size - (pow2_size >> 1)) >> (pow2_2pow - subpage_2pow
+		    - 1)) - 1;
 	}
+
+	return (binind);
+}
+
+static inline void *
+arena_malloc_small(arena_t *arena, size_t size, bool zero)
+{
+	void *ret;
+	arena_bin_t *bin;
+	arena_run_t *run;
+
+	bin = &arena->bins[small_size2bin(&size)];
 	assert(size == bin->reg_size);
 
 #ifdef MALLOC_BALANCE
@@ -3648,6 +4700,128 @@ arena_malloc_small(arena_t *arena, size_t size, bool zero)
 	return (ret);
 }
 
+#ifdef MALLOC_TCACHE
+/*
+ * Return the calling thread's cache, creating it if necessary, or NULL if the
+ * request should bypass the cache.
+ */
+static inline tcache_t *
+tcache_get(void)
+{
+	tcache_t *tcache;
+
+	tcache = tcache_tls;
+	if ((uintptr_t)tcache <= (uintptr_t)TCACHE_DISABLED) {
+		if (tcache == TCACHE_DISABLED || opt_tcache_nslots_2pow < 0)
+			return (NULL);
+		tcache = tcache_create();
+	}
+
+	return (tcache);
+}
+
+static inline void
+tcache_event(tcache_t *tcache)
+{
+
+	if (++tcache->ev_cnt >= tcache_gc_incr)
+		tcache_event_hard(tcache);
+}
+
+static inline void *
+tcache_alloc(tcache_t *tcache, size_t size, bool zero)
+{
+	void *ret;
+	tcache_bin_t *tbin;
+	unsigned binind;
+
+	binind = small_size2bin(&size);
+	tbin = &tcache->bins[binind];
+	if (tbin->ncached > 0) {
+		ret = tbin->avail[--tbin->ncached];
+		if (tbin->ncached < tbin->low_water)
+			tbin->low_water = tbin->ncached;
+	} else {
+		ret = tcache_alloc_hard(tbin, binind);
+		if (ret == NULL)
+			return (NULL);
+	}
+#ifdef MALLOC_STATS
+	tbin->nrequests++;
+#endif
+
+	if (zero == false) {
+#ifdef MALLOC_FILL
+		if (opt_junk)
+			memset(ret, 0xa5, size);
+		else if (opt_zero)
+			memset(ret, 0, size);
+#endif
+	} else
+		memset(ret, 0, size);
+
+	tcache_event(tcache);
+	return (ret);
+}
+
+/*
+ * Re-fill an empty thread cache bin with half of its capacity from the
+ * thread's arena, then return one of the new objects.
+ */
+static void *
+tcache_alloc_hard(tcache_bin_t *tbin, unsigned binind)
+{
+	arena_t *arena;
+	arena_bin_t *bin;
+	arena_run_t *run;
+	unsigned i, nfill;
+
+	assert(tbin->ncached == 0);
+
+	arena = choose_arena();
+	bin = &arena->bins[binind];
+	nfill = (tcache_nslots >> 1) > 0 ? (tcache_nslots >> 1) : 1;
+
+#ifdef MALLOC_BALANCE
+	arena_lock_balance(arena);
+#else
+	malloc_spin_lock(&arena->lock);
+#endif
+	for (i = 0; i < nfill; i++) {
+		void *ptr;
+
+		if ((run = bin->runcur) != NULL && run->nfree > 0)
+			ptr = arena_bin_malloc_easy(arena, bin, run);
+		else
+			ptr = arena_bin_malloc_hard(arena, bin);
+		if (ptr == NULL)
+			break;
+		/*
+		 * Fill the stack top-down, so that objects are handed out in
+		 * the same (address) order that the bin returned them.
+		 */
+		tbin->avail[nfill - 1 - i] = ptr;
+	}
+	if (i < nfill) {
+		/* Slide the objects that were obtained to the bottom. */
+		memmove(tbin->avail, &tbin->avail[nfill - i],
+		    i * sizeof(void *));
+	}
+#ifdef MALLOC_STATS
+	bin->stats.nrequests += tbin->nrequests;
+	tbin->nrequests = 0;
+	arena->stats.nmalloc_small += i;
+	arena->stats.allocated_small += i * bin->reg_size;
+#endif
+	malloc_spin_unlock(&arena->lock);
+
+	if (i == 0)
+		return (NULL);
+	tbin->ncached = i - 1;
+	return (tbin->avail[i - 1]);
+}
+#endif
+
 static void *
 arena_malloc_large(arena_t *arena, size_t size, bool zero)
 {
@@ -3693,6 +4867,16 @@ arena_malloc(arena_t *arena, size_t size, bool zero)
 	assert(QUANTUM_CEILING(size) <= arena_maxclass);
 
 	if (size <= bin_maxclass) {
+#ifdef MALLOC_TCACHE
+		tcache_t *tcache;
+
+		/*
+		 * All callers pass choose_arena(), which is also where the
+		 * thread cache gets its objects from.
+		 */
+		if ((tcache = tcache_get()) != NULL)
+			return (tcache_alloc(tcache, size, zero));
+#endif
 		return (arena_malloc_small(arena, size, zero));
 	} else
 		return (arena_malloc_large(arena, size, zero));
@@ -3953,20 +5137,9 @@ isalloc(const void *ptr)
 
 		ret = arena_salloc(ptr);
 	} else {
-		extent_node_t *node, key;
-
 		/* Chunk (huge allocation). */
-
-		malloc_mutex_lock(&huge_mtx);
-
-		/* Extract from tree of huge allocations. */
-		key.addr = __DECONST(void *, ptr);
-		node = RB_FIND(extent_tree_ad_s, &huge, &key);
-		assert(node != NULL);
-
-		ret = node->size;
-
-		malloc_mutex_unlock(&huge_mtx);
+		ret = huge_rtree_get(ptr);
+		assert(ret != 0);
 	}
 
 	return (ret);
@@ -4016,21 +5189,35 @@ arena_dalloc_small(arena_t *arena, arena_chunk_t *chunk, void *ptr,
 #endif
 	} else if (run->nfree == 1 && run != bin->runcur) {
 		/*
-		 * Make sure that bin->runcur always refers to the lowest
+		 * Make sure that bin->runcur always refers to the fullest
 		 * non-full run, if one exists.
 		 */
+		run->occupancy = arena_run_occupancy(run, bin);
 		if (bin->runcur == NULL)
 			bin->runcur = run;
-		else if ((uintptr_t)run < (uintptr_t)bin->runcur) {
-			/* Switch runcur. */
-			if (bin->runcur->nfree > 0) {
-				/* Insert runcur. */
-				RB_INSERT(arena_run_tree_s, &bin->runs,
-				    bin->runcur);
-			}
-			bin->runcur = run;
-		} else
+		else {
+			bin->runcur->occupancy = arena_run_occupancy(
+			    bin->runcur, bin);
+			if (arena_run_comp(run, bin->runcur) < 0) {
+				/* Switch runcur. */
+				if (bin->runcur->nfree > 0) {
+					/* Insert runcur. */
+					RB_INSERT(arena_run_tree_s, &bin->runs,
+					    bin->runcur);
+				}
+				bin->runcur = run;
+			} else
+				RB_INSERT(arena_run_tree_s, &bin->runs, run);
+		}
+	} else if (run != bin->runcur) {
+		unsigned occupancy = arena_run_occupancy(run, bin);
+
+		/* Move run down the tree once it drops to a lower class. */
+		if (occupancy != run->occupancy) {
+			RB_REMOVE(arena_run_tree_s, &bin->runs, run);
+			run->occupancy = occupancy;
 			RB_INSERT(arena_run_tree_s, &bin->runs, run);
+		}
 	}
 #ifdef MALLOC_STATS
 	arena->stats.allocated_small -= size;
@@ -4122,6 +5309,172 @@ arena_dalloc_lazy_hard(arena_t *arena, arena_chunk_t *chunk, void *ptr,
 }
 #endif
 
+#ifdef MALLOC_TCACHE
+/*
+ * Return all but the rem most recently cached objects in tbin to the arenas
+ * that own them.  Objects may come from several arenas (a thread can free
+ * objects that other threads allocated), so lock the arena that owns the
+ * first remaining object, return everything that belongs to it, and repeat
+ * for whatever was deferred.
+ */
+static void
+tcache_bin_flush(tcache_bin_t *tbin, unsigned binind, unsigned rem)
+{
+	arena_chunk_t *chunk;
+	arena_t *arena;
+	void *ptr;
+	size_t pageind;
+	unsigned i, nflush, ndeferred;
+
+	assert(rem <= tbin->ncached);
+
+	for (nflush = tbin->ncached - rem; nflush > 0; nflush = ndeferred) {
+		chunk = (arena_chunk_t *)CHUNK_ADDR2BASE(tbin->avail[0]);
+		arena = chunk->arena;
+		malloc_spin_lock(&arena->lock);
+#ifdef MALLOC_STATS
+		arena->bins[binind].stats.nrequests += tbin->nrequests;
+		tbin->nrequests = 0;
+#endif
+		ndeferred = 0;
+		for (i = 0; i < nflush; i++) {
+			ptr = tbin->avail[i];
+			chunk = (arena_chunk_t *)CHUNK_ADDR2BASE(ptr);
+			if (chunk->arena == arena) {
+				pageind = (((uintptr_t)ptr - (uintptr_t)chunk)
+				    >> pagesize_2pow);
+				arena_dalloc_small(arena, chunk, ptr, pageind,
+				    chunk->map[pageind]);
+			} else
+				tbin->avail[ndeferred++] = ptr;
+		}
+		malloc_spin_unlock(&arena->lock);
+	}
+
+	if (rem > 0) {
+		memmove(tbin->avail, &tbin->avail[tbin->ncached - rem],
+		    rem * sizeof(void *));
+	}
+	tbin->ncached = rem;
+	if (tbin->low_water > rem)
+		tbin->low_water = rem;
+}
+
+/*
+ * Visit the next bin in turn, and flush most of the objects that it did not
+ * need since the last visit.  This way a thread that stops using a size
+ * class eventually gives those objects back, without any one event paying
+ * for a sweep of the whole cache.
+ */
+static void
+tcache_event_hard(tcache_t *tcache)
+{
+	tcache_bin_t *tbin;
+	unsigned binind;
+
+	tcache->ev_cnt = 0;
+	binind = tcache->next_gc_bin;
+	tbin = &tcache->bins[binind];
+	if (tbin->low_water > 0) {
+		/* Flush (ceiling) 3/4 of the objects below the low water mark. */
+		tcache_bin_flush(tbin, binind, tbin->ncached - tbin->low_water
+		    + (tbin->low_water >> 2));
+	}
+	tbin->low_water = tbin->ncached;
+
+	if (++tcache->next_gc_bin == ntbins + nqbins + nsbins)
+		tcache->next_gc_bin = 0;
+}
+
+static inline void
+tcache_dalloc(tcache_t *tcache, arena_chunk_t *chunk, void *ptr,
+    size_t pageind, arena_chunk_map_t mapelm)
+{
+	arena_run_t *run;
+	tcache_bin_t *tbin;
+	unsigned binind;
+
+	pageind -= (mapelm & CHUNK_MAP_POS_MASK);
+	run = (arena_run_t *)((uintptr_t)chunk + (pageind << pagesize_2pow));
+	assert(run->magic == ARENA_RUN_MAGIC);
+	binind = run->bin - chunk->arena->bins;
+
+#ifdef MALLOC_FILL
+	if (opt_junk)
+		memset(ptr, 0x5a, run->bin->reg_size);
+#endif
+
+	tbin = &tcache->bins[binind];
+	if (tbin->ncached == tcache_nslots)
+		tcache_bin_flush(tbin, binind, tcache_nslots >> 1);
+	assert(tbin->ncached < tcache_nslots);
+	tbin->avail[tbin->ncached++] = ptr;
+
+	tcache_event(tcache);
+}
+
+/*
+ * Size of a thread cache with nslots slots per bin; the stacks start at
+ * tcache_size(0).
+ */
+static size_t
+tcache_size(unsigned nslots)
+{
+	unsigned nbins = ntbins + nqbins + nsbins;
+	size_t size;
+
+	size = sizeof(tcache_t) + (sizeof(tcache_bin_t) * (nbins - 1));
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	return (size + (sizeof(void *) * nbins * nslots));
+}
+
+/*
+ * Create a cache for the calling thread.  If anything fails, disable caching
+ * for this thread rather than propagate the error.
+ */
+static tcache_t *
+tcache_create(void)
+{
+	arena_t *arena;
+	tcache_t *tcache;
+	size_t size;
+	unsigned i;
+	void **stack;
+
+	size = tcache_size(tcache_nslots);
+
+	/*
+	 * Bypass arena_malloc(), which would otherwise try to create the cache
+	 * all over again.
+	 */
+	arena = choose_arena();
+	if (size <= bin_maxclass)
+		tcache = (tcache_t *)arena_malloc_small(arena, size, true);
+	else
+		tcache = (tcache_t *)arena_malloc_large(arena, size, true);
+	if (tcache == NULL) {
+		tcache_tls = TCACHE_DISABLED;
+		return (NULL);
+	}
+
+	stack = (void **)((uintptr_t)tcache + tcache_size(0));
+	for (i = 0; i < ntbins + nqbins + nsbins; i++) {
+		tcache->bins[i].avail = stack;
+		stack += tcache_nslots;
+	}
+
+	/*
+	 * Publish the cache before registering it, in case
+	 * pthread_setspecific() needs to allocate.
+	 */
+	tcache_tls = tcache;
+	pthread_setspecific(tcache_tsd, tcache);
+
+	return (tcache);
+}
+#endif
+
 static void
 arena_dalloc_large(arena_t *arena, arena_chunk_t *chunk, void *ptr)
 {
@@ -4165,6 +5518,9 @@ arena_dalloc(arena_t *arena, arena_chunk_t *chunk, void *ptr)
 {
 	size_t pageind;
 	arena_chunk_map_t *mapelm;
+#ifdef MALLOC_TCACHE
+	tcache_t *tcache;
+#endif
 
 	assert(arena != NULL);
 	assert(arena->magic == ARENA_MAGIC);
@@ -4176,6 +5532,12 @@ arena_dalloc(arena_t *arena, arena_chunk_t *chunk, void *ptr)
 	mapelm = &chunk->map[pageind];
 	if ((*mapelm & CHUNK_MAP_LARGE) == 0) {
 		/* Small allocation. */
+#ifdef MALLOC_TCACHE
+		if ((tcache = tcache_get()) != NULL) {
+			tcache_dalloc(tcache, chunk, ptr, pageind, *mapelm);
+			return;
+		}
+#endif
 #ifdef MALLOC_LAZY_FREE
 		arena_dalloc_lazy(arena, chunk, ptr, pageind, mapelm);
 #else
@@ -4203,6 +5565,26 @@ idalloc(void *ptr)
 		huge_dalloc(ptr);
 }
 
+#ifdef MALLOC_TCACHE
+/* TSD destructor; returns the exiting thread's cached objects. */
+static void
+tcache_thread_cleanup(void *arg)
+{
+	tcache_t *tcache = (tcache_t *)arg;
+	unsigned i;
+
+	tcache_tls = TCACHE_DISABLED;
+	if (tcache == NULL || tcache == TCACHE_DISABLED)
+		return;
+
+	for (i = 0; i < ntbins + nqbins + nsbins; i++) {
+		if (tcache->bins[i].ncached > 0)
+			tcache_bin_flush(&tcache->bins[i], i, 0);
+	}
+	idalloc(tcache);
+}
+#endif
+
 static void
 arena_ralloc_large_shrink(arena_t *arena, arena_chunk_t *chunk, void *ptr,
     size_t size, size_t oldsize)
@@ -4356,7 +5738,7 @@ arena_ralloc(void *ptr, size_t size, size_t oldsize)
 			goto IN_PLACE; /* Same size class. */
 	} else if (size <= bin_maxclass) {
 		if (oldsize > small_max && oldsize <= bin_maxclass &&
-		    pow2_ceil(size) == pow2_ceil(oldsize))
+		    subpage_ceiling(size) == subpage_ceiling(oldsize))
 			goto IN_PLACE; /* Same size class. */
 	} else if (oldsize > bin_maxclass && oldsize <= arena_maxclass) {
 		assert(size > bin_maxclass);
@@ -4410,7 +5792,7 @@ iralloc(void *ptr, size_t size)
 }
 
 static bool
-arena_new(arena_t *arena)
+arena_new(arena_t *arena, unsigned ind)
 {
 	unsigned i;
 	arena_bin_t *bin;
@@ -4423,6 +5805,10 @@ arena_new(arena_t *arena)
 	memset(&arena->stats, 0, sizeof(arena_stats_t));
 #endif
 
+	arena->ind = ind;
+	arena->chunk_hooks.alloc = NULL;
+	arena->chunk_hooks.dalloc = NULL;
+
 	/* Initialize chunks. */
 	RB_INIT(&arena->chunks);
 	arena->spare = NULL;
@@ -4436,6 +5822,11 @@ arena_new(arena_t *arena)
 #ifdef MALLOC_BALANCE
 	arena->contention = 0;
 #endif
+#ifdef MALLOC_DECAY
+	arena->decay_epoch = decay_now();
+	arena->decay_ndirty = 0;
+	memset(arena->decay_backlog, 0, sizeof(arena->decay_backlog));
+#endif
 #ifdef MALLOC_LAZY_FREE
 	if (opt_lazy_free_2pow >= 0) {
 		arena->free_cache = (void **) base_calloc(1, sizeof(void *)
@@ -4480,13 +5871,18 @@ arena_new(arena_t *arena)
 #endif
 	}
 
-	/* (2^n)-spaced sub-page bins. */
+	/* Sub-page bins, (1U << subpage_2pow) per doubling. */
 	for (; i < ntbins + nqbins + nsbins; i++) {
+		unsigned j;
+
 		bin = &arena->bins[i];
 		bin->runcur = NULL;
 		RB_INIT(&bin->runs);
 
-		bin->reg_size = (small_max << (i - (ntbins + nqbins) + 1));
+		j = i - (ntbins + nqbins);
+		pow2_size = small_max << (j >> subpage_2pow);
+		bin->reg_size = pow2_size + (((j & ((1U << subpage_2pow) - 1))
+		    + 1) * (pow2_size >> subpage_2pow));
 
 		prev_run_size = arena_bin_run_size_calc(bin, prev_run_size);
 
@@ -4511,7 +5907,7 @@ arenas_extend(unsigned ind)
 	/* Allocate enough space for trailing bins. */
 	ret = (arena_t *)base_alloc(sizeof(arena_t)
 	    + (sizeof(arena_bin_t) * (ntbins + nqbins + nsbins - 1)));
-	if (ret != NULL && arena_new(ret) == false) {
+	if (ret != NULL && arena_new(ret, ind) == false) {
 		arenas[ind] = ret;
 		return (ret);
 	}
@@ -4531,6 +5927,60 @@ arenas_extend(unsigned ind)
 	return (arenas[0]);
 }
 
+/*
+ * Create an arena that threads are not assigned to automatically, growing the
+ * arenas array if necessary.  The arena uses chunk_hooks, if non-NULL.  Return
+ * its index, or -1 if memory is exhausted.
+ */
+static int
+arenas_create(const chunk_hooks_t *chunk_hooks)
+{
+	arena_t *arena;
+	int ret;
+
+	malloc_spin_lock(&arenas_lock);
+	if (narenas_total == arenas_len) {
+		arena_t **a;
+		unsigned len;
+
+		/* huge_rtree packs arena indices below chunksize. */
+		len = arenas_len << 1;
+		if (len <= arenas_len || len > INT_MAX || len > chunksize) {
+			malloc_spin_unlock(&arenas_lock);
+			return (-1);
+		}
+		/*
+		 * base_alloc() memory is never freed, so readers of the old
+		 * array are unaffected.
+		 */
+		a = (arena_t **)base_alloc(sizeof(arena_t *) * len);
+		if (a == NULL) {
+			malloc_spin_unlock(&arenas_lock);
+			return (-1);
+		}
+		memcpy(a, arenas, sizeof(arena_t *) * arenas_len);
+		memset(&a[arenas_len], 0, sizeof(arena_t *) * (len -
+		    arenas_len));
+		arenas = a;
+		arenas_len = len;
+	}
+
+	arena = (arena_t *)base_alloc(sizeof(arena_t)
+	    + (sizeof(arena_bin_t) * (ntbins + nqbins + nsbins - 1)));
+	if (arena == NULL || arena_new(arena, narenas_total)) {
+		malloc_spin_unlock(&arenas_lock);
+		return (-1);
+	}
+	if (chunk_hooks != NULL)
+		arena->chunk_hooks = *chunk_hooks;
+	ret = (int)narenas_total;
+	arenas[ret] = arena;
+	narenas_total++;
+	malloc_spin_unlock(&arenas_lock);
+
+	return (ret);
+}
+
 /*
  * End arena.
  */
@@ -4544,7 +5994,7 @@ huge_malloc(size_t size, bool zero)
 {
 	void *ret;
 	size_t csize;
-	extent_node_t *node;
+	arena_t *arena;
 
 	/* Allocate one or more contiguous chunks for this request. */
 
@@ -4554,23 +6004,18 @@ huge_malloc(size_t size, bool zero)
 		return (NULL);
 	}
 
-	/* Allocate an extent node with which to track the chunk. */
-	node = base_node_alloc();
-	if (node == NULL)
+	arena = choose_arena();
+	ret = chunk_alloc_arena(arena, csize, chunksize, zero);
+	if (ret == NULL)
 		return (NULL);
 
-	ret = chunk_alloc(csize, zero);
-	if (ret == NULL) {
-		base_node_dealloc(node);
+	/* Insert into huge_rtree. */
+	malloc_mutex_lock(&huge_mtx);
+	if (huge_rtree_insert(ret, csize, arena->ind)) {
+		malloc_mutex_unlock(&huge_mtx);
+		chunk_dealloc_arena(arena, ret, csize);
 		return (NULL);
 	}
-
-	/* Insert node into huge. */
-	node->addr = ret;
-	node->size = csize;
-
-	malloc_mutex_lock(&huge_mtx);
-	RB_INSERT(extent_tree_ad_s, &huge, node);
 #ifdef MALLOC_STATS
 	huge_nmalloc++;
 	huge_allocated += csize;
@@ -4595,7 +6040,20 @@ huge_palloc(size_t alignment, size_t size)
 {
 	void *ret;
 	size_t alloc_size, chunk_size, offset;
-	extent_node_t *node;
+	arena_t *arena;
+
+	assert(alignment >= chunksize);
+
+	chunk_size = CHUNK_CEILING(size);
+
+	arena = choose_arena();
+	if (arena->chunk_hooks.alloc != NULL) {
+		/* Chunk hooks align allocations themselves. */
+		ret = chunk_alloc_arena(arena, chunk_size, alignment, false);
+		if (ret == NULL)
+			return (NULL);
+		goto INSERT;
+	}
 
 	/*
 	 * This allocation requires alignment that is even larger than chunk
@@ -4605,25 +6063,14 @@ huge_palloc(size_t alignment, size_t size)
 	 * alignment, in order to assure the alignment can be achieved, then
 	 * unmap leading and trailing chunks.
 	 */
-	assert(alignment >= chunksize);
-
-	chunk_size = CHUNK_CEILING(size);
-
 	if (size >= alignment)
 		alloc_size = chunk_size + alignment - chunksize;
 	else
 		alloc_size = (alignment << 1) - chunksize;
 
-	/* Allocate an extent node with which to track the chunk. */
-	node = base_node_alloc();
-	if (node == NULL)
-		return (NULL);
-
 	ret = chunk_alloc(alloc_size, false);
-	if (ret == NULL) {
-		base_node_dealloc(node);
+	if (ret == NULL)
 		return (NULL);
-	}
 
 	offset = (uintptr_t)ret & (alignment - 1);
 	assert((offset & chunksize_mask) == 0);
@@ -4649,12 +6096,14 @@ huge_palloc(size_t alignment, size_t size)
 		}
 	}
 
-	/* Insert node into huge. */
-	node->addr = ret;
-	node->size = chunk_size;
-
+INSERT:
+	/* Insert into huge_rtree. */
 	malloc_mutex_lock(&huge_mtx);
-	RB_INSERT(extent_tree_ad_s, &huge, node);
+	if (huge_rtree_insert(ret, chunk_size, arena->ind)) {
+		malloc_mutex_unlock(&huge_mtx);
+		chunk_dealloc_arena(arena, ret, chunk_size);
+		return (NULL);
+	}
 #ifdef MALLOC_STATS
 	huge_nmalloc++;
 	huge_allocated += chunk_size;
@@ -4671,6 +6120,110 @@ huge_palloc(size_t alignment, size_t size)
 	return (ret);
 }
 
+#if (defined(MOZ_MEMORY_LINUX) && defined(MREMAP_FIXED))
+/*
+ * Grow a huge allocation by remapping its pages rather than copying them, so
+ * that the cost depends on the number of page table entries, not the number
+ * of bytes.  Either the mapping grows in place, or the old pages are moved to
+ * the start of a freshly mapped set of chunks.  Returns NULL if the allocation
+ * came from chunk hooks or could not be remapped, in which case the caller
+ * falls back to copying.
+ */
+static void *
+huge_ralloc_remap(void *ptr, size_t size, size_t oldsize)
+{
+	void *ret, **slot;
+	size_t csize;
+#ifdef MALLOC_STATS
+	size_t added;
+#endif
+	unsigned arena_ind;
+	bool in_dss;
+
+	csize = CHUNK_CEILING(size);
+	if (csize == 0)
+		return (NULL);
+	assert(csize > oldsize);
+
+	slot = huge_rtree_slot(ptr, false);
+	assert(slot != NULL);
+	arena_ind = (unsigned)((uintptr_t)*slot & chunksize_mask);
+	if (arenas[arena_ind]->chunk_hooks.alloc != NULL)
+		return (NULL);
+	in_dss = false;
+#ifdef MALLOC_DSS
+	if (opt_dss) {
+		malloc_mutex_lock(&dss_mtx);
+		in_dss = ((uintptr_t)ptr >= (uintptr_t)dss_base &&
+		    (uintptr_t)ptr < (uintptr_t)dss_max);
+		malloc_mutex_unlock(&dss_mtx);
+	}
+#endif
+
+	/*
+	 * Growing DSS chunks in place would extend the mapping past the break,
+	 * so those are always moved.
+	 */
+	if (in_dss == false && mremap(ptr, oldsize, csize, 0) != MAP_FAILED) {
+		ret = ptr;
+#ifdef MALLOC_STATS
+		added = csize - oldsize;
+#endif
+	} else {
+		ret = chunk_alloc_mmap(csize);
+		if (ret == NULL)
+			return (NULL);
+		/*
+		 * Make sure that the new address can be recorded before moving
+		 * any pages, since the move cannot be undone.
+		 */
+		malloc_mutex_lock(&huge_mtx);
+		slot = huge_rtree_slot(ret, true);
+		malloc_mutex_unlock(&huge_mtx);
+		if (slot == NULL || mremap(ptr, oldsize, oldsize, MREMAP_MAYMOVE
+		    | MREMAP_FIXED, ret) == MAP_FAILED) {
+			pages_unmap(ret, csize);
+			return (NULL);
+		}
+#ifdef MALLOC_STATS
+		/* DSS chunks are released below; mapped ones are just gone. */
+		added = in_dss ? csize : csize - oldsize;
+#endif
+	}
+
+	malloc_mutex_lock(&huge_mtx);
+	huge_rtree_remove(ptr, &arena_ind);
+	huge_rtree_insert(ret, csize, arena_ind);
+#ifdef MALLOC_STATS
+	huge_allocated += csize - oldsize;
+	stats_chunks.nchunks += added / chunksize;
+	stats_chunks.curchunks += added / chunksize;
+	if (stats_chunks.curchunks > stats_chunks.highchunks)
+		stats_chunks.highchunks = stats_chunks.curchunks;
+#endif
+	malloc_mutex_unlock(&huge_mtx);
+
+	if (in_dss) {
+		/*
+		 * Fill the hole that the move left in the DSS before giving the
+		 * chunks back.  If that fails, leak the address range rather
+		 * than hand out unmapped memory later.
+		 */
+		if (mmap(ptr, oldsize, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+		    MAP_ANON | MAP_FIXED, -1, 0) != MAP_FAILED)
+			chunk_dealloc(ptr, oldsize);
+	}
+
+#ifdef MALLOC_FILL
+	/* The pages past oldsize are new, hence already zeroed. */
+	if (opt_junk)
+		memset((void *)((uintptr_t)ret + oldsize), 0xa5, csize - oldsize);
+#endif
+
+	return (ret);
+}
+#endif
+
 static void *
 huge_ralloc(void *ptr, size_t size, size_t oldsize)
 {
@@ -4692,6 +6245,14 @@ huge_ralloc(void *ptr, size_t size, size_t oldsize)
 		return (ptr);
 	}
 
+#if (defined(MOZ_MEMORY_LINUX) && defined(MREMAP_FIXED))
+	if (oldsize > arena_maxclass && size > oldsize) {
+		ret = huge_ralloc_remap(ptr, size, oldsize);
+		if (ret != NULL)
+			return (ret);
+	}
+#endif
+
 	/*
 	 * If we get here, then size and oldsize are different enough that we
 	 * need to use a different size class.  In that case, fall back to
@@ -4715,34 +6276,29 @@ huge_ralloc(void *ptr, size_t size, size_t oldsize)
 static void
 huge_dalloc(void *ptr)
 {
-	extent_node_t *node, key;
-
-	malloc_mutex_lock(&huge_mtx);
+	size_t size;
+	unsigned arena_ind;
+	arena_t *arena;
 
-	/* Extract from tree of huge allocations. */
-	key.addr = ptr;
-	node = RB_FIND(extent_tree_ad_s, &huge, &key);
-	assert(node != NULL);
-	assert(node->addr == ptr);
-	RB_REMOVE(extent_tree_ad_s, &huge, node);
+	/* Remove from huge_rtree. */
+	size = huge_rtree_remove(ptr, &arena_ind);
+	arena = arenas[arena_ind];
 
 #ifdef MALLOC_STATS
+	malloc_mutex_lock(&huge_mtx);
 	huge_ndalloc++;
-	huge_allocated -= node->size;
-#endif
-
+	huge_allocated -= size;
 	malloc_mutex_unlock(&huge_mtx);
+#endif
 
 	/* Unmap chunk. */
 #ifdef MALLOC_DSS
 #ifdef MALLOC_FILL
-	if (opt_dss && opt_junk)
-		memset(node->addr, 0x5a, node->size);
+	if (opt_dss && opt_junk && arena->chunk_hooks.dalloc == NULL)
+		memset(ptr, 0x5a, size);
 #endif
 #endif
-	chunk_dealloc(node->addr, node->size);
-
-	base_node_dealloc(node);
+	chunk_dealloc_arena(arena, ptr, size);
 }
 
 #ifdef MOZ_MEMORY_BSD
@@ -4893,6 +6449,81 @@ malloc_ncpus(void)
 }
 #endif
 
+#ifdef MALLOC_DECAY
+/*
+ * Set the decay time, in seconds.  This may be called after initialization,
+ * in which case each arena adopts the new epoch length the next time it
+ * decays.
+ */
+static void
+decay_time_set(size_t decay_time)
+{
+	uint64_t epoch_usec;
+
+	if (decay_time > 0) {
+		epoch_usec = ((uint64_t)decay_time * 1000000) / DECAY_NSTEPS;
+		if (epoch_usec == 0)
+			epoch_usec = 1;
+		decay_epoch_usec = epoch_usec;
+	}
+	opt_decay_time = decay_time;
+}
+
+/*
+ * Without the decay thread, an arena's dirty pages only decay when the arena
+ * deallocates runs, so memory freed just before a thread goes idle lingers.
+ * The decay thread visits every arena once per epoch instead.
+ */
+static void *
+decay_thread_main(void *arg)
+{
+	struct timespec ts;
+	unsigned i;
+	uint64_t now;
+
+	while (true) {
+		/* decay_time_set() may change the epoch length at any time. */
+		ts.tv_sec = decay_epoch_usec / 1000000;
+		ts.tv_nsec = (decay_epoch_usec % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+		if (opt_decay_time == 0)
+			continue;
+		now = decay_now();
+		for (i = 0; i < narenas_total; i++) {
+			arena_t *arena = arenas[i];
+
+			if (arena != NULL) {
+				malloc_spin_lock(&arena->lock);
+				arena_decay(arena, now);
+				malloc_spin_unlock(&arena->lock);
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+decay_thread_start(void)
+{
+	pthread_t thread;
+	sigset_t set, oldset;
+
+	/* The decay thread should never field the application's signals. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	if (pthread_create(&thread, NULL, decay_thread_main, NULL) == 0)
+		pthread_detach(thread);
+	else {
+		_malloc_message(_getprogname(),
+		    ": (malloc) Error creating decay thread\n", "", "");
+		if (opt_abort)
+			abort();
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+#endif
+
 static void
 malloc_print_stats(void)
 {
@@ -4910,9 +6541,15 @@ malloc_print_stats(void)
 		    "\n", "");
 		_malloc_message("Boolean MALLOC_OPTIONS: ",
 		    opt_abort ? "A" : "a", "", "");
+#ifdef MALLOC_PERCPU_ARENAS
+		_malloc_message(opt_percpu_arenas ? "C" : "c", "", "", "");
+#endif
 #ifdef MALLOC_DSS
 		_malloc_message(opt_dss ? "D" : "d", "", "", "");
 #endif
+#ifdef MALLOC_HUGEPAGE
+		_malloc_message(opt_hugepage ? "E" : "e", "", "", "");
+#endif
 #ifdef MALLOC_FILL
 		_malloc_message(opt_junk ? "J" : "j", "", "", "");
 #endif
@@ -4920,12 +6557,18 @@ malloc_print_stats(void)
 		_malloc_message(opt_mmap ? "M" : "m", "", "", "");
 #endif
 		_malloc_message("P", "", "", "");
+#ifdef MALLOC_UNMAP_THREAD
+		_malloc_message(opt_unmap_thread ? "R" : "r", "", "", "");
+#endif
 #ifdef MALLOC_UTRACE
 		_malloc_message(opt_utrace ? "U" : "u", "", "", "");
 #endif
 #ifdef MALLOC_SYSV
 		_malloc_message(opt_sysv ? "V" : "v", "", "", "");
 #endif
+#ifdef MALLOC_DECAY
+		_malloc_message(opt_decay_thread ? "W" : "w", "", "", "");
+#endif
 #ifdef MALLOC_XMALLOC
 		_malloc_message(opt_xmalloc ? "X" : "x", "", "", "");
 #endif
@@ -4943,6 +6586,16 @@ malloc_print_stats(void)
 		} else
 			_malloc_message("Lazy free slots: 0\n", "", "", "");
 #endif
+#ifdef MALLOC_TCACHE
+		if (opt_tcache_nslots_2pow >= 0) {
+			_malloc_message("Thread cache slots per bin: ",
+			    umax2s(tcache_nslots, s), "\n", "");
+			_malloc_message("Thread cache GC sweep interval: ",
+			    umax2s(1U << opt_tcache_gc_2pow, s), "\n", "");
+		} else
+			_malloc_message("Thread cache slots per bin: 0\n", "",
+			    "", "");
+#endif
 #ifdef MALLOC_BALANCE
 		_malloc_message("Arena balance threshold: ",
 		    umax2s(opt_balance_threshold, s), "\n", "");
@@ -4952,6 +6605,14 @@ malloc_print_stats(void)
 		_malloc_message("Quantum size: ", umax2s(quantum, s), "\n", "");
 		_malloc_message("Max small size: ", umax2s(small_max, s), "\n",
 		    "");
+#ifdef MALLOC_DECAY
+		if (opt_decay_time > 0) {
+			_malloc_message("Dirty page decay time: ",
+			    umax2s(opt_decay_time, s), " s", "");
+			_malloc_message(opt_decay_thread ? " (decay thread)\n" :
+			    "\n", "", "", "");
+		} else
+#endif
 		_malloc_message("Max dirty pages per arena: ",
 		    umax2s(opt_dirty_max, s), "\n", "");
 
@@ -4970,7 +6631,7 @@ malloc_print_stats(void)
 			/* Calculate and print allocated/mapped stats. */
 
 			/* arenas. */
-			for (i = 0, allocated = 0; i < narenas; i++) {
+			for (i = 0, allocated = 0; i < narenas_total; i++) {
 				if (arenas[i] != NULL) {
 					malloc_spin_lock(&arenas[i]->lock);
 					allocated +=
@@ -5023,6 +6684,14 @@ malloc_print_stats(void)
 				    chunks_stats.curchunks);
 			}
 
+#ifdef MALLOC_UNMAP_THREAD
+			if (opt_unmap_thread) {
+				malloc_printf("Chunk unmaps deferred: %llu, "
+				    "inline: %llu\n", unmap_ndeferred,
+				    unmap_ninline);
+			}
+#endif
+
 			/* Print chunk stats. */
 			malloc_printf(
 			    "huge: nmalloc      ndalloc    allocated\n");
@@ -5034,7 +6703,7 @@ malloc_print_stats(void)
 			    huge_nmalloc, huge_ndalloc, huge_allocated);
 #endif
 			/* Print stats for each arena. */
-			for (i = 0; i < narenas; i++) {
+			for (i = 0; i < narenas_total; i++) {
 				arena = arenas[i];
 				if (arena != NULL) {
 					malloc_printf(
@@ -5237,6 +6906,14 @@ MALLOC_OUT:
 						opt_balance_threshold <<= 1;
 #endif
 					break;
+#ifdef MALLOC_PERCPU_ARENAS
+				case 'c':
+					opt_percpu_arenas = false;
+					break;
+				case 'C':
+					opt_percpu_arenas = true;
+					break;
+#endif
 				case 'd':
 #ifdef MALLOC_DSS
 					opt_dss = false;
@@ -5247,6 +6924,14 @@ MALLOC_OUT:
 					opt_dss = true;
 #endif
 					break;
+#ifdef MALLOC_HUGEPAGE
+				case 'e':
+					opt_hugepage = false;
+					break;
+				case 'E':
+					opt_hugepage = true;
+					break;
+#endif
 				case 'f':
 					opt_dirty_max >>= 1;
 					break;
@@ -5256,6 +6941,32 @@ MALLOC_OUT:
 					else if ((opt_dirty_max << 1) != 0)
 						opt_dirty_max <<= 1;
 					break;
+				case 'g':
+#ifdef MALLOC_TCACHE
+					if (opt_tcache_gc_2pow > 0)
+						opt_tcache_gc_2pow--;
+#endif
+					break;
+				case 'G':
+#ifdef MALLOC_TCACHE
+					if (opt_tcache_gc_2pow + 1 <
+					    (sizeof(unsigned) << 3))
+						opt_tcache_gc_2pow++;
+#endif
+					break;
+				case 'h':
+#ifdef MALLOC_TCACHE
+					if (opt_tcache_nslots_2pow >= 0)
+						opt_tcache_nslots_2pow--;
+#endif
+					break;
+				case 'H':
+#ifdef MALLOC_TCACHE
+					if (opt_tcache_nslots_2pow + 1 <
+					    (sizeof(unsigned) << 3))
+						opt_tcache_nslots_2pow++;
+#endif
+					break;
 #ifdef MALLOC_FILL
 				case 'j':
 					opt_junk = false;
@@ -5321,6 +7032,14 @@ MALLOC_OUT:
 					    1)
 						opt_quantum_2pow++;
 					break;
+#ifdef MALLOC_UNMAP_THREAD
+				case 'r':
+					opt_unmap_thread = false;
+					break;
+				case 'R':
+					opt_unmap_thread = true;
+					break;
+#endif
 				case 's':
 					if (opt_small_max_2pow >
 					    QUANTUM_2POW_MIN)
@@ -5331,6 +7050,19 @@ MALLOC_OUT:
 					    - 1)
 						opt_small_max_2pow++;
 					break;
+				case 't':
+#ifdef MALLOC_DECAY
+					opt_decay_time >>= 1;
+#endif
+					break;
+				case 'T':
+#ifdef MALLOC_DECAY
+					if (opt_decay_time == 0)
+						opt_decay_time = 1;
+					else if ((opt_decay_time << 1) != 0)
+						opt_decay_time <<= 1;
+#endif
+					break;
 #ifdef MALLOC_UTRACE
 				case 'u':
 					opt_utrace = false;
@@ -5347,6 +7079,16 @@ MALLOC_OUT:
 					opt_sysv = true;
 					break;
 #endif
+				case 'w':
+#ifdef MALLOC_DECAY
+					opt_decay_thread = false;
+#endif
+					break;
+				case 'W':
+#ifdef MALLOC_DECAY
+					opt_decay_thread = true;
+#endif
+					break;
 #ifdef MALLOC_XMALLOC
 				case 'x':
 					opt_xmalloc = false;
@@ -5398,12 +7140,15 @@ MALLOC_OUT:
 	small_max = (1U << opt_small_max_2pow);
 
 	/* Set bin-related variables. */
-	bin_maxclass = (pagesize >> 1);
+	subpage_2pow = SUBPAGE_2POW;
+	if (subpage_2pow > opt_small_max_2pow - opt_quantum_2pow)
+		subpage_2pow = opt_small_max_2pow - opt_quantum_2pow;
+	bin_maxclass = pagesize - (pagesize >> (subpage_2pow + 1));
 	assert(opt_quantum_2pow >= TINY_MIN_2POW);
 	ntbins = opt_quantum_2pow - TINY_MIN_2POW;
 	assert(ntbins <= opt_quantum_2pow);
 	nqbins = (small_max >> opt_quantum_2pow);
-	nsbins = pagesize_2pow - opt_small_max_2pow - 1;
+	nsbins = ((pagesize_2pow - opt_small_max_2pow) << subpage_2pow) - 1;
 
 	/* Set variables according to the value of opt_quantum_2pow. */
 	quantum = (1U << opt_quantum_2pow);
@@ -5414,6 +7159,12 @@ MALLOC_OUT:
 		small_min = 1;
 	assert(small_min <= quantum);
 
+#ifdef MALLOC_HUGEPAGE
+	/* Make chunks whole huge pages, aligned as such. */
+	if (opt_hugepage && opt_chunk_2pow < HUGEPAGE_2POW)
+		opt_chunk_2pow = HUGEPAGE_2POW;
+#endif
+
 	/* Set variables according to the value of opt_chunk_2pow. */
 	chunksize = (1LU << opt_chunk_2pow);
 	chunksize_mask = chunksize - 1;
@@ -5444,6 +7195,47 @@ MALLOC_OUT:
 	while ((sizeof(void *) << opt_lazy_free_2pow) > chunksize)
 		opt_lazy_free_2pow--;
 #endif
+#ifdef MALLOC_TCACHE
+	if (opt_tcache_nslots_2pow >= 0) {
+		/*
+		 * Make sure that a thread cache can be allocated from an
+		 * arena.
+		 */
+		while (tcache_size(1U << opt_tcache_nslots_2pow) >
+		    arena_maxclass)
+			opt_tcache_nslots_2pow--;
+		tcache_nslots = (1U << opt_tcache_nslots_2pow);
+
+		/* Spread each GC sweep evenly over the bins. */
+		tcache_gc_incr = (1U << opt_tcache_gc_2pow) / (ntbins + nqbins
+		    + nsbins);
+		if (tcache_gc_incr == 0)
+			tcache_gc_incr = 1;
+
+		if (pthread_key_create(&tcache_tsd, tcache_thread_cleanup)
+		    != 0)
+			opt_tcache_nslots_2pow = -1;
+	}
+#endif
+#ifdef MALLOC_DECAY
+	/*
+	 * decay_curve[i] = 1 - smoothstep(x), where x runs from 1/n for the
+	 * most recent epoch to 1 for the oldest one.  Compute it even if decay
+	 * is disabled, since mallctl("arenas.decay_time") can enable it later.
+	 */
+	for (i = 0; i < DECAY_NSTEPS; i++) {
+		double x = (double)(DECAY_NSTEPS - i) / DECAY_NSTEPS;
+
+		decay_curve[i] = (uint32_t)((1.0 - x * x * (3.0 - 2.0 * x)) *
+		    (1U << DECAY_BFP));
+	}
+	/* Give decay_thread_main() a sane epoch even if decay is disabled. */
+	decay_epoch_usec = ((uint64_t)DECAY_TIME_DEFAULT * 1000000) /
+	    DECAY_NSTEPS;
+	decay_time_set(opt_decay_time);
+	if (opt_decay_time == 0)
+		opt_decay_thread = false;
+#endif
 
 	UTRACE(0, 0, 0);
 
@@ -5459,7 +7251,6 @@ MALLOC_OUT:
 
 	/* Initialize chunks data. */
 	malloc_mutex_init(&huge_mtx);
-	RB_INIT(&huge);
 #ifdef MALLOC_DSS
 	malloc_mutex_init(&dss_mtx);
 	dss_base = sbrk(0);
@@ -5490,6 +7281,18 @@ MALLOC_OUT:
 	base_nodes = NULL;
 	malloc_mutex_init(&base_mtx);
 
+	/* huge_rtree allocates its nodes with base_alloc(). */
+	if (huge_rtree_init()) {
+		malloc_mutex_unlock(&init_lock);
+		return (true);
+	}
+
+#ifdef MALLOC_PERCPU_ARENAS
+	if (opt_percpu_arenas) {
+		/* One arena per CPU, whatever 'N' and 'n' say. */
+		opt_narenas_lshift = 0;
+	} else
+#endif
 	if (ncpus > 1) {
 		/*
 		 * For SMP systems, create four times as many arenas as there
@@ -5524,7 +7327,11 @@ MALLOC_OUT:
 #endif
 
 #ifdef NO_TLS
+#  ifdef MALLOC_PERCPU_ARENAS
+	if (narenas > 1 && opt_percpu_arenas == false) {
+#  else
 	if (narenas > 1) {
+#  endif
 		static const unsigned primes[] = {1, 3, 5, 7, 11, 13, 17, 19,
 		    23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79, 83,
 		    89, 97, 101, 103, 107, 109, 113, 127, 131, 137, 139, 149,
@@ -5569,6 +7376,8 @@ MALLOC_OUT:
 	 * since it was just mmap()ed, but let's be sure.
 	 */
 	memset(arenas, 0, sizeof(arena_t *) * narenas);
+	narenas_total = narenas;
+	arenas_len = narenas;
 
 	/*
 	 * Initialize one arena here.  The rest are lazily created in
@@ -5585,11 +7394,14 @@ MALLOC_OUT:
 	/*
 	 * Assign the initial arena to the initial thread, in order to avoid
 	 * spurious creation of an extra arena if the application switches to
-	 * threaded mode.
+	 * threaded mode.  With per-CPU arenas, that would bind it to arena 0.
 	 */
 #ifdef MOZ_MEMORY_WINDOWS
 	TlsSetValue(tlsIndex, arenas[0]);
 #else
+#  ifdef MALLOC_PERCPU_ARENAS
+	if (opt_percpu_arenas == false)
+#  endif
 	arenas_map = arenas[0];
 #endif
 #endif
@@ -5611,6 +7423,19 @@ MALLOC_OUT:
 #ifndef MOZ_MEMORY_WINDOWS
 	malloc_mutex_unlock(&init_lock);
 #endif
+
+#ifdef MALLOC_DECAY
+	/*
+	 * Start the decay thread only now, since pthread_create() may need to
+	 * allocate.
+	 */
+	if (opt_decay_thread)
+		decay_thread_start();
+#endif
+#ifdef MALLOC_UNMAP_THREAD
+	if (opt_unmap_thread)
+		unmap_thread_start();
+#endif
 	return (false);
 }
 
@@ -5942,6 +7767,67 @@ malloc_usable_size(const void *ptr)
 	return (isalloc(ptr));
 }
 
+/*
+ * Return the usable size that malloc(size) would return, without allocating,
+ * so that callers that grow buffers can use the whole size class.
+ */
+static size_t
+good_size(size_t size)
+{
+
+	if (size == 0)
+		size = 1;
+	if (size <= bin_maxclass) {
+		small_size2bin(&size);
+		return (size);
+	} else if (size <= arena_maxclass)
+		return (PAGE_CEILING(size));
+	else if (CHUNK_CEILING(size) != 0)
+		return (CHUNK_CEILING(size));
+	/* size is large enough to cause size_t wrap-around. */
+	return (size);
+}
+
+VISIBLE
+#ifdef MOZ_MEMORY_DARWIN
+inline size_t
+moz_malloc_good_size(size_t size)
+#else
+size_t
+malloc_good_size(size_t size)
+#endif
+{
+
+	if (malloc_init())
+		return (size);
+	return (good_size(size));
+}
+
+/*
+ * Like malloc(), but also store the usable size of the object in *usable, if
+ * the allocation succeeds.
+ */
+VISIBLE
+#ifdef MOZ_MEMORY_DARWIN
+inline void *
+moz_malloc_sized(size_t size, size_t *usable)
+#else
+void *
+malloc_sized(size_t size, size_t *usable)
+#endif
+{
+	void *ret;
+
+#ifdef MOZ_MEMORY_DARWIN
+	ret = moz_malloc(size);
+#else
+	ret = malloc(size);
+#endif
+	if (ret != NULL)
+		*usable = isalloc(ret);
+	return (ret);
+}
+
 #ifdef MOZ_MEMORY_WINDOWS
 void*
 _recalloc(void *ptr, size_t count, size_t size)
@@ -5992,6 +7878,654 @@ _msize(const void *ptr)
  * End non-standard functions.
  */
 /******************************************************************************/
+/*
+ * Begin mallctl.
+ *
+ * mallctl() reads and writes settings and statistics by name.  A name is a
+ * dot-separated path through the tree below, in which numeric components
+ * select an arena (<i>) or a bin (<j>).  If oldp is non-NULL, the current value
+ * is copied to it, and *oldlenp must be the size of the value.  If newp is
+ * non-NULL, newlen must be the size of the value, which is then replaced by
+ * *newp.  Actions (type "void") take neither.
+ *
+ * Name                        Type      Access
+ * arenas.narenas              unsigned  r-  Number of arena indices in use.
+ * arenas.quantum              size_t    r-
+ * arenas.pagesize             size_t    r-
+ * arenas.chunksize            size_t    r-
+ * arenas.nbins                unsigned  r-
+ * arenas.bin.<j>.size         size_t    r-
+ * arenas.bin.<j>.nregs        uint32_t  r-
+ * arenas.bin.<j>.run_size     size_t    r-
+ * arenas.dirty_max            size_t    rw  See the F option.
+ * arenas.decay_time           size_t    rw  See the T option.
+ * arenas.create               unsigned  r-  Create an arena that threads are
+ *                                           never assigned to automatically,
+ *                                           and return its index.  newp may
+ *                                           point to the chunk_hooks_t that
+ *                                           the arena is to use.
+ * arenas.purge                void      --  Purge every arena.
+ * arena.<i>.purge             void      --  Purge all of arena <i>'s dirty
+ *                                           pages.
+ * arena.<i>.ndirty            size_t    r-  Dirty pages in arena <i>.
+ * arena.<i>.chunk_hooks       chunk_hooks_t  r-
+ * thread.arena                unsigned  rw  Index of the calling thread's
+ *                                           arena.
+ * thread.tcache.flush         void      --  Return the calling thread's
+ *                                           cached objects to their arenas.
+ * stats.chunks.{total,high,current}           uint64_t, size_t, size_t
+ * stats.huge.{allocated,nmalloc,ndalloc}      size_t, uint64_t, uint64_t
+ * stats.arenas.<i>.mapped                     size_t
+ * stats.arenas.<i>.{npurge,nmadvise,purged}   uint64_t
+ * stats.arenas.<i>.{small,large}.allocated    size_t
+ * stats.arenas.<i>.{small,large}.{nmalloc,ndalloc}  uint64_t
+ * stats.arenas.<i>.bins.<j>.{nrequests,nruns,reruns}  uint64_t
+ * stats.arenas.<i>.bins.<j>.{highruns,curruns}       size_t
+ *
+ * arenas.decay_time only exists if MALLOC_DECAY is defined, thread.* only if
+ * TLS is available (and thread.tcache.flush only if MALLOC_TCACHE is defined),
+ * and stats.* only if MALLOC_STATS is defined.  mallctl() returns 0, or:
+ *
+ *   ENOENT  The name does not exist, or <i> or <j> is out of range.
+ *   EINVAL  *oldlenp or newlen is not the size of the value, or the new value
+ *           is invalid.
+ *   EPERM   The value is read-only.
+ *   EAGAIN  Memory is exhausted.
+ */
+
+/* Maximum number of numeric components in a name. */
+#define	CTL_NIND_MAX	2
+
+typedef int ctl_handler_t(const size_t *ind, void *oldp, size_t *oldlenp,
+    void *newp, size_t newlen);
+
+typedef struct ctl_node_s ctl_node_t;
+struct ctl_node_s {
+	/* Name of this component, or NULL if it is numeric. */
+	const char		*name;
+
+	/* Array of children (NULL-terminated), for interior nodes. */
+	const ctl_node_t	*children;
+
+	/* Handler, for leaf nodes. */
+	ctl_handler_t		*handler;
+};
+
+#define	CTL_NODE(n, c)	{n, c, NULL}
+#define	CTL_INDEX(c)	{NULL, c, NULL}
+#define	CTL_LEAF(n, h)	{n, NULL, h}
+#define	CTL_END		{NULL, NULL, NULL}
+
+#define	CTL_PROTO(n)	static ctl_handler_t n##_ctl;
+
+#define	CTL_READONLY() do {						\
+	if (newp != NULL || newlen != 0)				\
+		return (EPERM);						\
+} while (0)
+
+#define	CTL_VOID() do {							\
+	if (oldp != NULL || oldlenp != NULL || newp != NULL ||		\
+	    newlen != 0)						\
+		return (EINVAL);					\
+} while (0)
+
+#define	CTL_READ(v, t) do {						\
+	if (oldp != NULL && oldlenp != NULL) {				\
+		if (*oldlenp != sizeof(t))				\
+			return (EINVAL);				\
+		*(t *)oldp = (v);					\
+	}								\
+} while (0)
+
+#define	CTL_WRITE(v, t) do {						\
+	if (newp != NULL) {						\
+		if (newlen != sizeof(t))				\
+			return (EINVAL);				\
+		(v) = *(t *)newp;					\
+	}								\
+} while (0)
+
+/* Generate a handler for a read-only value that is set at initialization. */
+#define	CTL_RO_GEN(n, v, t)						\
+static int								\
+n##_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,	\
+    size_t newlen)							\
+{									\
+									\
+	CTL_READONLY();							\
+	CTL_READ(v, t);							\
+	return (0);							\
+}
+
+/*
+ * Generate a handler for a read-only value that is protected by the lock of
+ * arena <i>, which must be named arena in v.
+ */
+#define	CTL_RO_ARENA_GEN(n, v, t)					\
+static int								\
+n##_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,	\
+    size_t newlen)							\
+{									\
+	arena_t *arena;							\
+	t val;								\
+									\
+	CTL_READONLY();							\
+	if ((arena = ctl_arena(ind[0])) == NULL)			\
+		return (ENOENT);					\
+	malloc_spin_lock(&arena->lock);					\
+	val = (t)(v);							\
+	malloc_spin_unlock(&arena->lock);				\
+	CTL_READ(val, t);						\
+	return (0);							\
+}
+
+/* As above, but for bin <j> of arena <i>, which must be named bin in v. */
+#define	CTL_RO_BIN_GEN(n, v, t)						\
+static int								\
+n##_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,	\
+    size_t newlen)							\
+{									\
+	arena_t *arena;							\
+	arena_bin_t *bin;						\
+	t val;								\
+									\
+	CTL_READONLY();							\
+	if ((arena = ctl_arena(ind[0])) == NULL ||			\
+	    ind[1] >= ntbins + nqbins + nsbins)				\
+		return (ENOENT);					\
+	bin = &arena->bins[ind[1]];					\
+	malloc_spin_lock(&arena->lock);					\
+	val = (t)(v);							\
+	malloc_spin_unlock(&arena->lock);				\
+	CTL_READ(val, t);						\
+	return (0);							\
+}
+
+/* Return arena <ind>, or NULL if it does not exist. */
+static arena_t *
+ctl_arena(size_t ind)
+{
+
+	if (ind >= narenas_total)
+		return (NULL);
+	return (arenas[ind]);
+}
+
+CTL_PROTO(arenas_narenas)
+CTL_PROTO(arenas_quantum)
+CTL_PROTO(arenas_pagesize)
+CTL_PROTO(arenas_chunksize)
+CTL_PROTO(arenas_nbins)
+CTL_PROTO(arenas_bin_j_size)
+CTL_PROTO(arenas_bin_j_nregs)
+CTL_PROTO(arenas_bin_j_run_size)
+CTL_PROTO(arenas_dirty_max)
+#ifdef MALLOC_DECAY
+CTL_PROTO(arenas_decay_time)
+#endif
+CTL_PROTO(arenas_create)
+CTL_PROTO(arenas_purge)
+CTL_PROTO(arena_i_purge)
+CTL_PROTO(arena_i_ndirty)
+CTL_PROTO(arena_i_chunk_hooks)
+#ifndef NO_TLS
+CTL_PROTO(thread_arena)
+#  ifdef MALLOC_TCACHE
+CTL_PROTO(thread_tcache_flush)
+#  endif
+#endif
+#ifdef MALLOC_STATS
+CTL_PROTO(stats_chunks_total)
+CTL_PROTO(stats_chunks_high)
+CTL_PROTO(stats_chunks_current)
+CTL_PROTO(stats_huge_allocated)
+CTL_PROTO(stats_huge_nmalloc)
+CTL_PROTO(stats_huge_ndalloc)
+CTL_PROTO(stats_arenas_i_mapped)
+CTL_PROTO(stats_arenas_i_npurge)
+CTL_PROTO(stats_arenas_i_nmadvise)
+CTL_PROTO(stats_arenas_i_purged)
+CTL_PROTO(stats_arenas_i_small_allocated)
+CTL_PROTO(stats_arenas_i_small_nmalloc)
+CTL_PROTO(stats_arenas_i_small_ndalloc)
+CTL_PROTO(stats_arenas_i_large_allocated)
+CTL_PROTO(stats_arenas_i_large_nmalloc)
+CTL_PROTO(stats_arenas_i_large_ndalloc)
+CTL_PROTO(stats_arenas_i_bins_j_nrequests)
+CTL_PROTO(stats_arenas_i_bins_j_nruns)
+CTL_PROTO(stats_arenas_i_bins_j_reruns)
+CTL_PROTO(stats_arenas_i_bins_j_highruns)
+CTL_PROTO(stats_arenas_i_bins_j_curruns)
+#endif
+
+static const ctl_node_t arenas_bin_j_node[] = {
+	CTL_LEAF("size", arenas_bin_j_size_ctl),
+	CTL_LEAF("nregs", arenas_bin_j_nregs_ctl),
+	CTL_LEAF("run_size", arenas_bin_j_run_size_ctl),
+	CTL_END
+};
+
+static const ctl_node_t arenas_bin_node[] = {
+	CTL_INDEX(arenas_bin_j_node),
+	CTL_END
+};
+
+static const ctl_node_t arenas_node[] = {
+	CTL_LEAF("narenas", arenas_narenas_ctl),
+	CTL_LEAF("quantum", arenas_quantum_ctl),
+	CTL_LEAF("pagesize", arenas_pagesize_ctl),
+	CTL_LEAF("chunksize", arenas_chunksize_ctl),
+	CTL_LEAF("nbins", arenas_nbins_ctl),
+	CTL_NODE("bin", arenas_bin_node),
+	CTL_LEAF("dirty_max", arenas_dirty_max_ctl),
+#ifdef MALLOC_DECAY
+	CTL_LEAF("decay_time", arenas_decay_time_ctl),
+#endif
+	CTL_LEAF("create", arenas_create_ctl),
+	CTL_LEAF("purge", arenas_purge_ctl),
+	CTL_END
+};
+
+static const ctl_node_t arena_i_node[] = {
+	CTL_LEAF("purge", arena_i_purge_ctl),
+	CTL_LEAF("ndirty", arena_i_ndirty_ctl),
+	CTL_LEAF("chunk_hooks", arena_i_chunk_hooks_ctl),
+	CTL_END
+};
+
+static const ctl_node_t arena_node[] = {
+	CTL_INDEX(arena_i_node),
+	CTL_END
+};
+
+#ifndef NO_TLS
+#  ifdef MALLOC_TCACHE
+static const ctl_node_t thread_tcache_node[] = {
+	CTL_LEAF("flush", thread_tcache_flush_ctl),
+	CTL_END
+};
+#  endif
+
+static const ctl_node_t thread_node[] = {
+	CTL_LEAF("arena", thread_arena_ctl),
+#  ifdef MALLOC_TCACHE
+	CTL_NODE("tcache", thread_tcache_node),
+#  endif
+	CTL_END
+};
+#endif
+
+#ifdef MALLOC_STATS
+static const ctl_node_t stats_chunks_node[] = {
+	CTL_LEAF("total", stats_chunks_total_ctl),
+	CTL_LEAF("high", stats_chunks_high_ctl),
+	CTL_LEAF("current", stats_chunks_current_ctl),
+	CTL_END
+};
+
+static const ctl_node_t stats_huge_node[] = {
+	CTL_LEAF("allocated", stats_huge_allocated_ctl),
+	CTL_LEAF("nmalloc", stats_huge_nmalloc_ctl),
+	CTL_LEAF("ndalloc", stats_huge_ndalloc_ctl),
+	CTL_END
+};
+
+static const ctl_node_t stats_arenas_i_small_node[] = {
+	CTL_LEAF("allocated", stats_arenas_i_small_allocated_ctl),
+	CTL_LEAF("nmalloc", stats_arenas_i_small_nmalloc_ctl),
+	CTL_LEAF("ndalloc", stats_arenas_i_small_ndalloc_ctl),
+	CTL_END
+};
+
+static const ctl_node_t stats_arenas_i_large_node[] = {
+	CTL_LEAF("allocated", stats_arenas_i_large_allocated_ctl),
+	CTL_LEAF("nmalloc", stats_arenas_i_large_nmalloc_ctl),
+	CTL_LEAF("ndalloc", stats_arenas_i_large_ndalloc_ctl),
+	CTL_END
+};
+
+static const ctl_node_t stats_arenas_i_bins_j_node[] = {
+	CTL_LEAF("nrequests", stats_arenas_i_bins_j_nrequests_ctl),
+	CTL_LEAF("nruns", stats_arenas_i_bins_j_nruns_ctl),
+	CTL_LEAF("reruns", stats_arenas_i_bins_j_reruns_ctl),
+	CTL_LEAF("highruns", stats_arenas_i_bins_j_highruns_ctl),
+	CTL_LEAF("curruns", stats_arenas_i_bins_j_curruns_ctl),
+	CTL_END
+};
+
+static const ctl_node_t stats_arenas_i_bins_node[] = {
+	CTL_INDEX(stats_arenas_i_bins_j_node),
+	CTL_END
+};
+
+static const ctl_node_t stats_arenas_i_node[] = {
+	CTL_LEAF("mapped", stats_arenas_i_mapped_ctl),
+	CTL_LEAF("npurge", stats_arenas_i_npurge_ctl),
+	CTL_LEAF("nmadvise", stats_arenas_i_nmadvise_ctl),
+	CTL_LEAF("purged", stats_arenas_i_purged_ctl),
+	CTL_NODE("small", stats_arenas_i_small_node),
+	CTL_NODE("large", stats_arenas_i_large_node),
+	CTL_NODE("bins", stats_arenas_i_bins_node),
+	CTL_END
+};
+
+static const ctl_node_t stats_arenas_node[] = {
+	CTL_INDEX(stats_arenas_i_node),
+	CTL_END
+};
+
+static const ctl_node_t stats_node[] = {
+	CTL_NODE("chunks", stats_chunks_node),
+	CTL_NODE("huge", stats_huge_node),
+	CTL_NODE("arenas", stats_arenas_node),
+	CTL_END
+};
+#endif
+
+static const ctl_node_t ctl_root_node[] = {
+	CTL_NODE("arenas", arenas_node),
+	CTL_NODE("arena", arena_node),
+#ifndef NO_TLS
+	CTL_NODE("thread", thread_node),
+#endif
+#ifdef MALLOC_STATS
+	CTL_NODE("stats", stats_node),
+#endif
+	CTL_END
+};
+
+/*
+ * Find the leaf that name refers to, and store its numeric components in
+ * ind.  Return NULL if there is no such leaf.
+ */
+static const ctl_node_t *
+ctl_lookup(const char *name, size_t *ind)
+{
+	const ctl_node_t *children, *node;
+	const char *elm, *dot;
+	size_t elen, i, nind;
+
+	children = ctl_root_node;
+	nind = 0;
+	for (elm = name;; elm = dot + 1) {
+		dot = strchr(elm, '.');
+		elen = (dot != NULL) ? (size_t)(dot - elm) : strlen(elm);
+		if (children == NULL || elen == 0)
+			return (NULL);
+
+		for (node = children; node->children != NULL ||
+		    node->handler != NULL; node++) {
+			if (node->name != NULL) {
+				if (strncmp(node->name, elm, elen) == 0 &&
+				    node->name[elen] == '\0')
+					break;
+			} else {
+				size_t val;
+
+				/* Numeric component. */
+				if (nind == CTL_NIND_MAX || elen > 9)
+					return (NULL);
+				for (i = 0, val = 0; i < elen; i++) {
+					if (elm[i] < '0' || elm[i] > '9')
+						return (NULL);
+					val = (val * 10) + (elm[i] - '0');
+				}
+				ind[nind++] = val;
+				break;
+			}
+		}
+		if (node->children == NULL && node->handler == NULL)
+			return (NULL);
+
+		if (dot == NULL)
+			return ((node->handler != NULL) ? node : NULL);
+		children = node->children;
+	}
+}
+
+CTL_RO_GEN(arenas_narenas, narenas_total, unsigned)
+CTL_RO_GEN(arenas_quantum, quantum, size_t)
+CTL_RO_GEN(arenas_pagesize, pagesize, size_t)
+CTL_RO_GEN(arenas_chunksize, chunksize, size_t)
+CTL_RO_GEN(arenas_nbins, ntbins + nqbins + nsbins, unsigned)
+
+/* Every arena's bins have the same layout as arenas[0]'s. */
+#define	CTL_RO_BININFO_GEN(n, f, t)					\
+static int								\
+n##_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,	\
+    size_t newlen)							\
+{									\
+									\
+	CTL_READONLY();							\
+	if (ind[0] >= ntbins + nqbins + nsbins)				\
+		return (ENOENT);					\
+	CTL_READ(arenas[0]->bins[ind[0]].f, t);				\
+	return (0);							\
+}
+CTL_RO_BININFO_GEN(arenas_bin_j_size, reg_size, size_t)
+CTL_RO_BININFO_GEN(arenas_bin_j_nregs, nregs, uint32_t)
+CTL_RO_BININFO_GEN(arenas_bin_j_run_size, run_size, size_t)
+#undef CTL_RO_BININFO_GEN
+
+static int
+arenas_dirty_max_ctl(const size_t *ind, void *oldp, size_t *oldlenp,
+    void *newp, size_t newlen)
+{
+	size_t dirty_max;
+
+	CTL_READ(opt_dirty_max, size_t);
+	dirty_max = opt_dirty_max;
+	CTL_WRITE(dirty_max, size_t);
+	/* Arenas enforce the new limit the next time they free a run. */
+	opt_dirty_max = dirty_max;
+	return (0);
+}
+
+#ifdef MALLOC_DECAY
+static int
+arenas_decay_time_ctl(const size_t *ind, void *oldp, size_t *oldlenp,
+    void *newp, size_t newlen)
+{
+	size_t decay_time;
+
+	CTL_READ(opt_decay_time, size_t);
+	decay_time = opt_decay_time;
+	CTL_WRITE(decay_time, size_t);
+	if (decay_time != opt_decay_time)
+		decay_time_set(decay_time);
+	return (0);
+}
+#endif
+
+static int
+arenas_create_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,
+    size_t newlen)
+{
+	chunk_hooks_t chunk_hooks;
+	int arena_ind;
+
+	if (oldp == NULL || oldlenp == NULL || *oldlenp != sizeof(unsigned))
+		return (EINVAL);
+	chunk_hooks.alloc = NULL;
+	chunk_hooks.dalloc = NULL;
+	CTL_WRITE(chunk_hooks, chunk_hooks_t);
+	if ((chunk_hooks.alloc == NULL) != (chunk_hooks.dalloc == NULL))
+		return (EINVAL);
+	arena_ind = arenas_create(&chunk_hooks);
+	if (arena_ind < 0)
+		return (EAGAIN);
+	CTL_READ((unsigned)arena_ind, unsigned);
+	return (0);
+}
+
+static int
+arenas_purge_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,
+    size_t newlen)
+{
+	unsigned i;
+
+	CTL_VOID();
+	for (i = 0; i < narenas_total; i++) {
+		if (arenas[i] != NULL)
+			arena_purge_all(arenas[i]);
+	}
+	return (0);
+}
+
+static int
+arena_i_purge_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,
+    size_t newlen)
+{
+	arena_t *arena;
+
+	CTL_VOID();
+	if ((arena = ctl_arena(ind[0])) == NULL)
+		return (ENOENT);
+	arena_purge_all(arena);
+	return (0);
+}
+
+CTL_RO_ARENA_GEN(arena_i_ndirty, arena->ndirty, size_t)
+
+static int
+arena_i_chunk_hooks_ctl(const size_t *ind, void *oldp, size_t *oldlenp,
+    void *newp, size_t newlen)
+{
+	arena_t *arena;
+
+	CTL_READONLY();
+	if ((arena = ctl_arena(ind[0])) == NULL)
+		return (ENOENT);
+	CTL_READ(arena->chunk_hooks, chunk_hooks_t);
+	return (0);
+}
+
+#ifndef NO_TLS
+static int
+thread_arena_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,
+    size_t newlen)
+{
+	arena_t *arena;
+	unsigned newind;
+
+	CTL_READ(choose_arena()->ind, unsigned);
+	if (newp != NULL) {
+		newind = narenas_total;
+		CTL_WRITE(newind, unsigned);
+		if (newind >= narenas_total)
+			return (EINVAL);
+		if ((arena = arenas[newind]) == NULL) {
+			/* Automatic arenas are created lazily. */
+			malloc_spin_lock(&arenas_lock);
+			if ((arena = arenas[newind]) == NULL)
+				arena = arenas_extend(newind);
+			malloc_spin_unlock(&arenas_lock);
+		}
+#  ifdef MALLOC_TCACHE
+		/* Cached objects would still come from the old arena. */
+		thread_tcache_flush_ctl(NULL, NULL, NULL, NULL, 0);
+#  endif
+#  ifdef MOZ_MEMORY_WINDOWS
+		TlsSetValue(tlsIndex, arena);
+#  else
+		arenas_map = arena;
+#  endif
+	}
+	return (0);
+}
+
+#  ifdef MALLOC_TCACHE
+static int
+thread_tcache_flush_ctl(const size_t *ind, void *oldp, size_t *oldlenp,
+    void *newp, size_t newlen)
+{
+	tcache_t *tcache;
+	unsigned i;
+
+	CTL_VOID();
+	tcache = tcache_tls;
+	if ((uintptr_t)tcache <= (uintptr_t)TCACHE_DISABLED)
+		return (0);
+	for (i = 0; i < ntbins + nqbins + nsbins; i++) {
+		if (tcache->bins[i].ncached > 0)
+			tcache_bin_flush(&tcache->bins[i], i, 0);
+		tcache->bins[i].low_water = 0;
+	}
+	return (0);
+}
+#  endif
+#endif
+
+#ifdef MALLOC_STATS
+/* Generate a handler for a value that is protected by huge_mtx. */
+#define	CTL_RO_HUGE_GEN(n, v, t)					\
+static int								\
+n##_ctl(const size_t *ind, void *oldp, size_t *oldlenp, void *newp,	\
+    size_t newlen)							\
+{									\
+	t val;								\
+									\
+	CTL_READONLY();							\
+	malloc_mutex_lock(&huge_mtx);					\
+	val = (t)(v);							\
+	malloc_mutex_unlock(&huge_mtx);					\
+	CTL_READ(val, t);						\
+	return (0);							\
+}
+CTL_RO_HUGE_GEN(stats_chunks_total, stats_chunks.nchunks, uint64_t)
+CTL_RO_HUGE_GEN(stats_chunks_high, stats_chunks.highchunks, size_t)
+CTL_RO_HUGE_GEN(stats_chunks_current, stats_chunks.curchunks, size_t)
+CTL_RO_HUGE_GEN(stats_huge_allocated, huge_allocated, size_t)
+CTL_RO_HUGE_GEN(stats_huge_nmalloc, huge_nmalloc, uint64_t)
+CTL_RO_HUGE_GEN(stats_huge_ndalloc, huge_ndalloc, uint64_t)
+#undef CTL_RO_HUGE_GEN
+
+CTL_RO_ARENA_GEN(stats_arenas_i_mapped, arena->stats.mapped, size_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_npurge, arena->stats.npurge, uint64_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_nmadvise, arena->stats.nmadvise, uint64_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_purged, arena->stats.purged, uint64_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_small_allocated,
+    arena->stats.allocated_small, size_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_small_nmalloc, arena->stats.nmalloc_small,
+    uint64_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_small_ndalloc, arena->stats.ndalloc_small,
+    uint64_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_large_allocated,
+    arena->stats.allocated_large, size_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_large_nmalloc, arena->stats.nmalloc_large,
+    uint64_t)
+CTL_RO_ARENA_GEN(stats_arenas_i_large_ndalloc, arena->stats.ndalloc_large,
+    uint64_t)
+
+CTL_RO_BIN_GEN(stats_arenas_i_bins_j_nrequests, bin->stats.nrequests,
+    uint64_t)
+CTL_RO_BIN_GEN(stats_arenas_i_bins_j_nruns, bin->stats.nruns, uint64_t)
+CTL_RO_BIN_GEN(stats_arenas_i_bins_j_reruns, bin->stats.reruns, uint64_t)
+CTL_RO_BIN_GEN(stats_arenas_i_bins_j_highruns, bin->stats.highruns, size_t)
+CTL_RO_BIN_GEN(stats_arenas_i_bins_j_curruns, bin->stats.curruns, size_t)
+#endif
+
+VISIBLE
+int
+mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+    size_t newlen)
+{
+	const ctl_node_t *node;
+	size_t ind[CTL_NIND_MAX];
+
+	if (malloc_init())
+		return (EAGAIN);
+
+	node = ctl_lookup(name, ind);
+	if (node == NULL)
+		return (ENOENT);
+	return (node->handler(ind, oldp, oldlenp, newp, newlen));
+}
+
+/*
+ * End mallctl.
+ */
+/******************************************************************************/
 /*
  * Begin library-private functions, used by threading libraries for protection
  * of malloc during fork().  These functions are only called if the program is
@@ -6007,7 +8541,7 @@ _malloc_prefork(void)
 	/* Acquire all mutexes in a safe order. */
 
 	malloc_spin_lock(&arenas_lock);
-	for (i = 0; i < narenas; i++) {
+	for (i = 0; i < narenas_total; i++) {
 		if (arenas[i] != NULL)
 			malloc_spin_lock(&arenas[i]->lock);
 	}
@@ -6038,7 +8572,7 @@ _malloc_postfork(void)
 	malloc_mutex_unlock(&base_mtx);
 
 	malloc_spin_lock(&arenas_lock);
-	for (i = 0; i < narenas; i++) {
+	for (i = 0; i < narenas_total; i++) {
 		if (arenas[i] != NULL)
 			malloc_spin_unlock(&arenas[i]->lock);
 	}
@@ -6074,8 +8608,8 @@ zone_size(malloc_zone_t *zone, void *ptr)
 	chunk = (arena_chunk_t *)CHUNK_ADDR2BASE(ptr);
 	if (chunk != ptr) {
 		arena_t *arena;
-		unsigned i;
-		arena_t *arenas_snapshot[narenas];
+		unsigned i, n;
+		arena_t *arenas_snapshot[arenas_len];
 
 		/*
 		 * Make a copy of the arenas vector while holding arenas_lock in
@@ -6084,11 +8618,15 @@ zone_size(malloc_zone_t *zone, void *ptr)
 		 * order to reduce lock acquisitions.
 		 */
 		malloc_spin_lock(&arenas_lock);
-		memcpy(&arenas_snapshot, arenas, sizeof(arena_t *) * narenas);
+		n = narenas_total;
+		/* Ignore arenas created since arenas_snapshot was sized. */
+		if (n > sizeof(arenas_snapshot) / sizeof(arena_t *))
+			n = sizeof(arenas_snapshot) / sizeof(arena_t *);
+		memcpy(&arenas_snapshot, arenas, sizeof(arena_t *) * n);
 		malloc_spin_unlock(&arenas_lock);
 
 		/* Region. */
-		for (i = 0; i < narenas; i++) {
+		for (i = 0; i < n; i++) {
 			arena = arenas_snapshot[i];
 
 			if (arena != NULL) {
@@ -6110,18 +8648,8 @@ zone_size(malloc_zone_t *zone, void *ptr)
 			}
 		}
 	} else {
-		extent_node_t *node;
-		extent_node_t key;
-
 		/* Chunk. */
-		key.addr = (void *)chunk;
-		malloc_mutex_lock(&huge_mtx);
-		node = RB_FIND(extent_tree_ad_s, &huge, &key);
-		if (node != NULL)
-			ret = node->size;
-		else
-			ret = 0;
-		malloc_mutex_unlock(&huge_mtx);
+		ret = huge_rtree_get(chunk);
 	}
 
 RETURN:
@@ -6178,22 +8706,8 @@ zone_destroy(malloc_zone_t *zone)
 static size_t
 zone_good_size(malloc_zone_t *zone, size_t size)
 {
-	size_t ret;
-	void *p;
 
-	/*
-	 * Actually create an object of the appropriate size, then find out
-	 * how large it could have been without moving up to the next size
-	 * class.
-	 */
-	p = moz_malloc(size);
-	if (p != NULL) {
-		ret = isalloc(p);
-		moz_free(p);
-	} else
-		ret = size;
-
-	return (ret);
+	return (moz_malloc_good_size(size));
 }
 
 static void
@@ -344,7 +344,51 @@ size_t kmalloc_usable_size (void * cp)
   	ASSERT(op->ov_rmagic == RMAGIC);
 	ASSERT(*(u_short *)((caddr_t)(op + 1) + op->ov_size) == RMAGIC);
 #endif
-  	return op->ov_index;
+	size = 1 << (op->ov_index + 3);
+	if (size < pagesz)
+		size -= sizeof (*op) + RSLOP;
+	else
+		size += pagesz - sizeof (*op) - RSLOP;
+  	return size;
+}
+
+/*
+ * The bucket kmalloc(nbytes) takes its block from, or -1 if there is
+ * none; blocks of one bucket are interchangeable, so callers can keep
+ * their own free lists per bucket.
+ */
+
+int kmalloc_bucket (size_t nbytes)
+{
+	register long n, pg;
+	register unsigned amt;
+	register int bucket;
+
+	pg = pagesz ? pagesz : getpagesize();
+	if (nbytes <= (n = pg - sizeof (union overhead) - RSLOP)) {
+#ifndef RCHECK
+		amt = 8;
+		bucket = 0;
+#else
+		amt = 16;
+		bucket = 1;
+#endif
+		n = -((long)sizeof (union overhead) + RSLOP);
+	} else {
+		amt = 8;
+		bucket = 0;
+		while (pg > amt) {
+			amt <<= 1;
+			bucket++;
+		}
+	}
+	while (nbytes > amt + n) {
+		amt <<= 1;
+		if (amt == 0)
+			return (-1);
+		bucket++;
+	}
+	return (bucket);
 }
 /* End EDB */
 
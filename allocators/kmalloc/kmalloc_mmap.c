@@ -0,0 +1,312 @@
+/*	$NetBSD: malloc.c,v 1.8 1997/04/07 03:12:14 christos Exp $	*/
+
+/*
+ * Copyright (c) 1983 Regents of the University of California.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *	This product includes software developed by the University of
+ *	California, Berkeley and its contributors.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * kmalloc_mmap.c: the Caltech power-of-two allocator of kmalloc.c, on
+ * top of mmap instead of sbrk.
+ *
+ * Every bucket carves its blocks from runs, aligned and power-of-two
+ * sized mappings of at least RUNSIZE bytes and RUNBLKS blocks.  A block
+ * finds its run by masking its address, and a run that becomes entirely
+ * free is unmapped, unless it is the last run of its bucket with free
+ * blocks.  Blocks bigger than MAXRUNBLK are mapped one by one; freeing
+ * one unmaps it, except that each bucket up to MAXSPARE keeps one such
+ * block for the next request.
+ *
+ * Unlike kmalloc.c, a block of bucket i holds 2^(i+3) bytes, overhead
+ * included, for every bucket, and there is no RCHECK or MSTATS.  Like
+ * kmalloc.c, this is not thread-safe by itself; libkmalloc.cpp adds a
+ * lock and per-thread caches.
+ */
+
+#include  <sys/types.h>
+#include  <sys/mman.h>
+#include  <stdint.h>
+#include  <stdlib.h>
+#include  <string.h>
+#include  <unistd.h>
+
+#ifndef MAP_ANONYMOUS
+#define	MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/*
+ * The overhead on a block, as in kmalloc.c.  When free, this space
+ * contains a pointer to the next free block of its run; when in use,
+ * the first byte is set to MAGIC, and the second byte is the bucket.
+ */
+union	overhead {
+	union	overhead *ov_next;	/* when free */
+	struct {
+		u_char	ovu_magic;	/* magic number */
+		u_char	ovu_index;	/* bucket # */
+	} ovu;
+#define	ov_magic	ovu.ovu_magic
+#define	ov_index	ovu.ovu_index
+};
+
+#define	MAGIC		0xef		/* magic # on accounting info */
+
+/*
+ * A run of blocks of one bucket.  The run header takes the first
+ * block(s) of the run.
+ */
+struct	run {
+	struct	run *r_next;		/* runs of the bucket with free blocks */
+	struct	run *r_prev;
+	union	overhead *r_free;	/* freed blocks */
+	caddr_t	r_bump;			/* first block never handed out */
+	caddr_t	r_end;			/* end of the run */
+	int	r_nfree;		/* free and never handed out blocks */
+	int	r_nblks;		/* blocks in the run */
+};
+
+#define	NBUCKETS	30
+#define	RUNSIZE		(64 * 1024)	/* smallest run */
+#define	RUNBLKS		16		/* fewest blocks in a run */
+#define	MAXRUNBLK	(32 * 1024)	/* biggest block carved from runs */
+#define	MAXSPARE	(1024 * 1024)	/* biggest block kept when freed */
+
+#define	BLKSIZE(i)	((size_t)1 << ((i) + 3))
+#define	RUNBYTES(i)	(BLKSIZE(i) * RUNBLKS > RUNSIZE ? \
+			    BLKSIZE(i) * RUNBLKS : RUNSIZE)
+#define	RUNOF(op, i)	((struct run *)((uintptr_t)(op) & ~(RUNBYTES(i) - 1)))
+
+/*
+ * nextf[i] is the list of runs of bucket i which have free blocks.
+ */
+static	struct run *nextf[NBUCKETS];
+
+/*
+ * spare[i] is a freed, still mapped block of bucket i > MAXRUNBLK.
+ */
+static	union overhead *spare[NBUCKETS];
+
+/*
+ * Map sz bytes aligned to align, a power of two no less than the page
+ * size.
+ */
+static void *
+mapaligned(size_t sz, size_t align)
+{
+	caddr_t p, q;
+	size_t lead;
+
+	p = mmap(NULL, sz + align, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return (NULL);
+	q = (caddr_t)(((uintptr_t)p + align - 1) & ~(align - 1));
+	lead = q - p;
+	if (lead)
+		munmap(p, lead);
+	munmap(q + sz, align - lead);
+	return (q);
+}
+
+/*
+ * Map a new run for the indicated bucket.
+ */
+static struct run *
+morecore(int bucket)
+{
+	register struct run *r;
+	size_t sz = BLKSIZE(bucket), amt = RUNBYTES(bucket);
+
+	if ((r = mapaligned(amt, amt)) == NULL)
+		return (NULL);
+	r->r_free = NULL;
+	r->r_bump = (caddr_t)r + ((sizeof (*r) + sz - 1) & ~(sz - 1));
+	r->r_end = (caddr_t)r + amt;
+	r->r_nblks = r->r_nfree = (r->r_end - r->r_bump) / sz;
+	r->r_prev = NULL;
+	r->r_next = nextf[bucket];
+	if (r->r_next)
+		r->r_next->r_prev = r;
+	nextf[bucket] = r;
+	return (r);
+}
+
+static void
+unlink_run(struct run *r, int bucket)
+{
+	if (r->r_prev)
+		r->r_prev->r_next = r->r_next;
+	else
+		nextf[bucket] = r->r_next;
+	if (r->r_next)
+		r->r_next->r_prev = r->r_prev;
+}
+
+int
+kmalloc_bucket(size_t nbytes)
+{
+	register int bucket = 0;
+	register size_t amt = 8;
+
+	nbytes += sizeof (union overhead);
+	while (nbytes > amt) {
+		amt <<= 1;
+		if (++bucket >= NBUCKETS)
+			return (-1);
+	}
+	return (bucket);
+}
+
+void *
+kmalloc(size_t nbytes)
+{
+	register union overhead *op;
+	register struct run *r;
+	register int bucket;
+
+	if ((bucket = kmalloc_bucket(nbytes)) < 0)
+		return (NULL);
+	if (BLKSIZE(bucket) > MAXRUNBLK) {
+		if ((op = spare[bucket]) != NULL)
+			spare[bucket] = NULL;
+		else {
+			op = mmap(NULL, BLKSIZE(bucket), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (op == MAP_FAILED)
+				return (NULL);
+		}
+	} else {
+		if ((r = nextf[bucket]) == NULL &&
+		    (r = morecore(bucket)) == NULL)
+			return (NULL);
+		if ((op = r->r_free) != NULL)
+			r->r_free = op->ov_next;
+		else {
+			op = (union overhead *)r->r_bump;
+			r->r_bump += BLKSIZE(bucket);
+		}
+		/* a full run leaves the list until a block comes back */
+		if (--r->r_nfree == 0)
+			unlink_run(r, bucket);
+	}
+	op->ov_magic = MAGIC;
+	op->ov_index = bucket;
+	return ((char *)(op + 1));
+}
+
+void *
+kcalloc(size_t nelem, size_t elsize)
+{
+	void *ptr;
+
+	if (elsize && nelem > (size_t)-1 / elsize)
+		return (NULL);
+	if ((ptr = kmalloc(nelem * elsize)) != NULL)
+		memset(ptr, 0, nelem * elsize);
+	return (ptr);
+}
+
+void
+kfree(void *cp)
+{
+	register union overhead *op;
+	register struct run *r;
+	register int bucket;
+
+	if (cp == NULL)
+		return;
+	op = (union overhead *)((caddr_t)cp - sizeof (union overhead));
+	if (op->ov_magic != MAGIC)
+		return;				/* sanity */
+	bucket = op->ov_index;
+	if (BLKSIZE(bucket) > MAXRUNBLK) {
+		if (BLKSIZE(bucket) <= MAXSPARE && spare[bucket] == NULL) {
+			op->ov_magic = 0;
+			spare[bucket] = op;
+		} else
+			munmap(op, BLKSIZE(bucket));
+		return;
+	}
+	r = RUNOF(op, bucket);
+	op->ov_next = r->r_free;	/* also clobbers ov_magic */
+	r->r_free = op;
+	if (r->r_nfree++ == 0) {
+		r->r_prev = NULL;
+		r->r_next = nextf[bucket];
+		if (r->r_next)
+			r->r_next->r_prev = r;
+		nextf[bucket] = r;
+	}
+	/* give back an empty run, but keep one to allocate from */
+	if (r->r_nfree == r->r_nblks &&
+	    (r->r_prev != NULL || r->r_next != NULL)) {
+		unlink_run(r, bucket);
+		munmap(r, RUNBYTES(bucket));
+	}
+}
+
+size_t
+kmalloc_usable_size(void *cp)
+{
+	register union overhead *op;
+
+	if (cp == NULL)
+		return 0;
+	op = (union overhead *)((caddr_t)cp - sizeof (union overhead));
+	if (op->ov_magic != MAGIC)
+		return 0;			/* sanity */
+	return BLKSIZE(op->ov_index) - sizeof (union overhead);
+}
+
+void *
+krealloc(void *cp, size_t nbytes)
+{
+	size_t onb;
+	char *res;
+
+	if (cp == NULL)
+		return (kmalloc(nbytes));
+	if (nbytes == 0) {
+		kfree(cp);
+		return (NULL);
+	}
+	/* avoid the copy if same size block */
+	onb = kmalloc_usable_size(cp);
+	if (onb == 0)
+		return (NULL);
+	if (kmalloc_bucket(nbytes) == kmalloc_bucket(onb))
+		return (cp);
+	if ((res = kmalloc(nbytes)) == NULL)
+		return (NULL);
+	memcpy(res, cp, nbytes < onb ? nbytes : onb);
+	kfree(cp);
+	return (res);
+}
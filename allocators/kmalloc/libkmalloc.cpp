@@ -31,6 +31,7 @@
  */
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <new>
 
 class std::bad_alloc;
@@ -39,23 +40,133 @@ extern "C" {
   void * kmalloc (size_t);
   void kfree (void *);
   size_t kmalloc_usable_size (void *);
+  int kmalloc_bucket (size_t);
 }
 
 int anyThreadCreated = 1;
 
+/**
+ * Serializes kmalloc and kfree, which are not thread-safe. Each
+ * thread keeps up to MaxCached freed blocks per bucket (as kmalloc's
+ * own nextf does), so most requests never take the lock; thread exit
+ * hands the cached blocks back.
+ */
+
 class TheCustomHeapType {
 public:
+
+  TheCustomHeapType (void) {
+    pthread_mutex_init (&_lock, NULL);
+    pthread_key_create (&_key, flush);
+  }
+
   inline void * malloc (size_t sz) {
-    return kmalloc(sz);
+    const int b = kmalloc_bucket (sz);
+    if (b >= 0 && b < NumCached) {
+      ThreadCache * c = getCache();
+      if (c && c->nextf[b]) {
+	Block * blk = c->nextf[b];
+	c->nextf[b] = blk->next;
+	c->count[b]--;
+	return blk;
+      }
+    }
+    pthread_mutex_lock (&_lock);
+    void * ptr = kmalloc (sz);
+    pthread_mutex_unlock (&_lock);
+    return ptr;
   }
+
   inline void free (void * ptr) {
-    kfree(ptr);
+    if (ptr == NULL) {
+      return;
+    }
+    const size_t sz = kmalloc_usable_size (ptr);
+    const int b = kmalloc_bucket (sz);
+    // The link goes into the block, so tiny blocks are never cached.
+    if (b >= 0 && b < NumCached && sz >= sizeof(Block)) {
+      ThreadCache * c = getCache();
+      if (c && c->count[b] < MaxCached) {
+	Block * blk = (Block *) ptr;
+	blk->next = c->nextf[b];
+	c->nextf[b] = blk;
+	c->count[b]++;
+	return;
+      }
+    }
+    pthread_mutex_lock (&_lock);
+    kfree (ptr);
+    pthread_mutex_unlock (&_lock);
   }
+
   inline size_t getSize (void * ptr) {
     return kmalloc_usable_size (ptr);
   }
+
+private:
+
+  /// Buckets up to 2^(NumCached+2) bytes are cached.
+  enum { NumCached = 13 };
+  enum { MaxCached = 64 };
+
+  struct Block {
+    Block * next;
+  };
+
+  struct ThreadCache {
+    Block * nextf[NumCached];
+    int count[NumCached];
+  };
+
+  ThreadCache * getCache (void) {
+    ThreadCache * c = _cache;
+    if (c == NULL && !_inCacheSetup) {
+      // pthread_setspecific may call malloc; it gets no cache.
+      _inCacheSetup = true;
+      pthread_mutex_lock (&_lock);
+      c = (ThreadCache *) kmalloc (sizeof(ThreadCache));
+      pthread_mutex_unlock (&_lock);
+      if (c) {
+	for (int i = 0; i < NumCached; i++) {
+	  c->nextf[i] = NULL;
+	  c->count[i] = 0;
+	}
+	_cache = c;
+	pthread_setspecific (_key, c);
+      }
+      _inCacheSetup = false;
+    }
+    return c;
+  }
+
+  static void flush (void * arg);
+
+  static pthread_mutex_t _lock;
+  static pthread_key_t _key;
+  static __thread ThreadCache * _cache;
+  static __thread bool _inCacheSetup;
 };
 
+pthread_mutex_t TheCustomHeapType::_lock;
+pthread_key_t TheCustomHeapType::_key;
+__thread TheCustomHeapType::ThreadCache * TheCustomHeapType::_cache;
+__thread bool TheCustomHeapType::_inCacheSetup;
+
+void TheCustomHeapType::flush (void * arg) {
+  ThreadCache * c = (ThreadCache *) arg;
+  _cache = NULL;
+  pthread_mutex_lock (&_lock);
+  for (int i = 0; i < NumCached; i++) {
+    while (c->nextf[i]) {
+      Block * blk = c->nextf[i];
+      c->nextf[i] = blk->next;
+      kfree (blk);
+    }
+  }
+  kfree (c);
+  pthread_mutex_unlock (&_lock);
+}
+
 
 inline static TheCustomHeapType * getCustomHeap (void) {
   static char thBuf[sizeof(TheCustomHeapType)];
@@ -53,6 +53,42 @@ DEALINGS IN THE SOFTWARE.
 #ifndef DEFAULT_GRANULARITY
 #define DEFAULT_GRANULARITY (1*1024*1024)
 #endif
+/* Gives every pool a set of mspaces per NUMA node, with their memory bound
+to that node, and has each thread use those of the node it was on when it
+got its thread cache. The threads parameter of nedcreatepool() then applies
+per node. Linux only */
+#ifndef NUMAAWARE
+#define NUMAAWARE 0
+#endif
+#if NUMAAWARE
+#ifndef __linux__
+#error NUMAAWARE is only implemented for Linux
+#endif
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define NUMA_MPOL_PREFERRED 1		/* From <numaif.h>, which needs libnuma */
+static int CurrentNode(void)
+{
+	unsigned int cpu, node;
+	if(syscall(SYS_getcpu, &cpu, &node, 0)) return 0;
+	return (int) node;
+}
+static void *NUMAmmap(size_t size)
+{	/* Only a thread placed on an mspace's node grows it, so binding to the
+	caller's node binds the mspace's memory to that node. Preferred rather
+	than strict so that a full node falls back to its neighbours */
+	void *ret=mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	int node=CurrentNode();
+	if(MAP_FAILED!=ret && node<(int)(8*sizeof(unsigned long)))
+	{
+		unsigned long mask=1UL<<node;
+		syscall(SYS_mbind, ret, size, NUMA_MPOL_PREFERRED, &mask, 8*sizeof(mask), 0);
+	}
+	return ret;
+}
+#define CALL_MMAP(s) NUMAmmap(s)
+#endif
 
 /* Disable mspace_malloc() locking */
 static int preactionassert(int v);
@@ -74,7 +110,17 @@ static int preactionassert(int v)
 
 /* The maximum concurrent threads in a pool possible */
 #ifndef MAXTHREADSINPOOL
-#define MAXTHREADSINPOOL 16
+#define MAXTHREADSINPOOL 256
+#endif
+/* The number of mspaces a pool starts out allowing when nedcreatepool()
+is not told how many threads to expect */
+#ifndef DEFAULTTHREADSINPOOL
+#define DEFAULTTHREADSINPOOL 16
+#endif
+/* How many more times FindMSpace() must find every mspace locked than
+find one free before the pool may use another mspace. Zero disables */
+#ifndef MSPACEGROWTHRESHOLD
+#define MSPACEGROWTHRESHOLD 64
 #endif
 /* The maximum number of threadcaches which can be allocated */
 #ifndef THREADCACHEMAXCACHES
@@ -95,6 +141,15 @@ static int preactionassert(int v)
 #ifndef THREADCACHEMAXFREESPACE
 #define THREADCACHEMAXFREESPACE (512*1024)
 #endif
+/* The least a thread cache's garbage collection point is lowered to */
+#ifndef THREADCACHEMINFREESPACE
+#define THREADCACHEMINFREESPACE (2*THREADCACHEMAX)
+#endif
+/* Thread cache mallocs between adjustments of its garbage collection
+point (must be a power of two). Zero disables */
+#ifndef THREADCACHETUNEPERIOD
+#define THREADCACHETUNEPERIOD 4096
+#endif
 
 
 #ifdef WIN32
@@ -178,8 +233,13 @@ typedef struct threadcache_t
 #endif
 	int mymspace;						/* Last mspace entry this thread used */
 	long threadid;
+#if NUMAAWARE
+	int node;							/* NUMA node this thread was placed on */
+#endif
 	unsigned int mallocs, frees, successes;
+	unsigned int tunesuccesses;			/* successes at the last tuning */
 	size_t freeInCache;					/* How much free space is stored in this cache */
+	size_t maxFreeInCache;				/* Point at which free space is garbage collected */
 	threadcacheblk *bins[(THREADCACHEMAXBINS+1)*2];
 #ifdef FULLSANITYCHECKS
 	unsigned int magic2;
@@ -190,12 +250,30 @@ struct nedpool_t
 	MLOCK_T mutex;
 	void *uservalue;
 	int threads;						/* Max entries in m to use */
+	int lockfails;						/* FindMSpace() failures less successes */
 	threadcache *caches[THREADCACHEMAXCACHES];
 	TLSVAR mycache;						/* Thread cache for this thread */
 	mstate m[MAXTHREADSINPOOL+1];		/* mspace entries for this pool */
+#if NUMAAWARE
+	int nodes[MAXTHREADSINPOOL+1];		/* NUMA node of each mspace */
+#endif
 };
 static nedpool syspool;
 
+#if NUMAAWARE
+#define MSPACENODE(p, n) ((p)->nodes[n])
+#else
+#define MSPACENODE(p, n) 0
+#endif
+static FORCEINLINE int ThreadNode(threadcache *tc) THROWSPEC
+{	/* The NUMA node whose mspaces this thread should use */
+#if NUMAAWARE
+	return tc ? tc->node : CurrentNode();
+#else
+	return 0;
+#endif
+}
+
 static FORCEINLINE unsigned int size2binidx(size_t _size) THROWSPEC
 {	/* 8=1000	16=10000	20=10100	24=11000	32=100000	48=110000	4096=1000000000000 */
 	unsigned int topbit, size=(unsigned int)(_size>>4);
@@ -340,6 +418,32 @@ static void DestroyCaches(nedpool *p) THROWSPEC
 	}
 }
 
+#if NUMAAWARE
+static NOINLINE int PlaceOnNode(nedpool *p, int node, long threadid) THROWSPEC
+{	/* Called with the pool locked. Returns one of node's mspaces, spreading
+	threads over them by id, and makes the node's first if it has none.
+	Returns -1 if it has none and none can be made */
+	int n, end, mine=0;
+	mstate temp;
+	for(end=0; p->m[end]; end++)
+	{
+		if(p->nodes[end]==node) mine++;
+	}
+	if(mine)
+	{
+		mine=(int)(threadid % mine);
+		for(n=0; ; n++)
+		{
+			if(p->nodes[n]==node && !mine--) return n;
+		}
+	}
+	if(end>=MAXTHREADSINPOOL || !(temp=(mstate) create_mspace(0, 1))) return -1;
+	temp->extp=p;
+	p->nodes[end]=node;
+	*((volatile struct malloc_state **) &p->m[end])=p->m[end]=temp;
+	return end;
+}
+#endif
 static NOINLINE threadcache *AllocCache(nedpool *p) THROWSPEC
 {
 	threadcache *tc=0;
@@ -363,13 +467,39 @@ static NOINLINE threadcache *AllocCache(nedpool *p) THROWSPEC
 	tc->magic2=*(unsigned int *)"NEDMALC2";
 #endif
 	tc->threadid=(long)(size_t)CURRENT_THREAD;
+	tc->maxFreeInCache=THREADCACHEMAXFREESPACE;
 	for(end=0; p->m[end]; end++);
 	tc->mymspace=tc->threadid % end;
+#if NUMAAWARE
+	tc->node=CurrentNode();
+	if((end=PlaceOnNode(p, tc->node, tc->threadid))>=0)
+		tc->mymspace=end;
+#endif
 	RELEASE_LOCK(&p->mutex);
 	TLSSET(p->mycache, (void *)(size_t)(n+1));
 	return tc;
 }
 
+#if THREADCACHETUNEPERIOD
+static NOINLINE void TuneCache(nedpool *p, threadcache *tc) THROWSPEC
+{	/* Called every THREADCACHETUNEPERIOD mallocs. A cache which misses
+	while holding plenty of free space is keeping blocks of sizes this
+	thread no longer asks for, so it gets a lower garbage collection
+	point and gives back its oldest entries. One which mostly hits is
+	let grow back towards THREADCACHEMAXFREESPACE */
+	unsigned int hits=tc->successes-tc->tunesuccesses;
+	tc->tunesuccesses=tc->successes;
+	if(hits<THREADCACHETUNEPERIOD/2 && tc->freeInCache>=tc->maxFreeInCache/2)
+	{
+		if(tc->maxFreeInCache>THREADCACHEMINFREESPACE)
+			tc->maxFreeInCache>>=1;
+		RemoveCacheEntries(p, tc, THREADCACHETUNEPERIOD);
+	}
+	else if(hits>=THREADCACHETUNEPERIOD-THREADCACHETUNEPERIOD/8 && tc->maxFreeInCache<THREADCACHEMAXFREESPACE)
+		tc->maxFreeInCache<<=1;
+}
+#endif
+
 static void *threadcache_malloc(nedpool *p, threadcache *tc, size_t *size) THROWSPEC
 {
 	void *ret=0;
@@ -444,6 +574,10 @@ static void *threadcache_malloc(nedpool *p, threadcache *tc, size_t *size) THROW
 		tc->freeInCache-=blksize;
 		assert((long) tc->freeInCache>=0);
 	}
+#if THREADCACHETUNEPERIOD
+	if(!(tc->mallocs & (THREADCACHETUNEPERIOD-1)))
+		TuneCache(p, tc);
+#endif
 #if defined(DEBUG) && 0
 	if(!(tc->mallocs & 0xfff))
 	{
@@ -458,9 +592,10 @@ static void *threadcache_malloc(nedpool *p, threadcache *tc, size_t *size) THROW
 }
 static NOINLINE void ReleaseFreeInCache(nedpool *p, threadcache *tc, int mymspace) THROWSPEC
 {
-	unsigned int age=THREADCACHEMAXFREESPACE/8192;
+	unsigned int age=(unsigned int)(tc->maxFreeInCache/8192);
+	if(!age) age=1;
 	/*ACQUIRE_LOCK(&p->m[mymspace]->mutex);*/
-	while(age && tc->freeInCache>=THREADCACHEMAXFREESPACE)
+	while(age && tc->freeInCache>=tc->maxFreeInCache)
 	{
 		RemoveCacheEntries(p, tc, age);
 		/*printf("*** Removing cache entries older than %u (%u)\n", age, (unsigned int) tc->freeInCache);*/
@@ -522,7 +657,7 @@ static void threadcache_free(nedpool *p, threadcache *tc, int mymspace, void *me
 	tcfullsanitycheck(tc);
 #endif
 #if 1
-	if(tc->freeInCache>=THREADCACHEMAXFREESPACE)
+	if(tc->freeInCache>=tc->maxFreeInCache)
 		ReleaseFreeInCache(p, tc, mymspace);
 #endif
 }
@@ -534,10 +669,13 @@ static NOINLINE int InitPool(nedpool *p, size_t capacity, int threads) THROWSPEC
 {	/* threads is -1 for system pool */
 	if(INITIAL_LOCK(&p->mutex)) goto err;
 	ACQUIRE_LOCK(&p->mutex);
-	p->threads=(threads<1 || threads>MAXTHREADSINPOOL) ? MAXTHREADSINPOOL : threads;
+	p->threads=(threads<1) ? DEFAULTTHREADSINPOOL : (threads>MAXTHREADSINPOOL) ? MAXTHREADSINPOOL : threads;
 	if(TLSALLOC(&p->mycache)) goto err;
 	if(!(p->m[0]=(mstate) create_mspace(capacity, 1))) goto err;
 	p->m[0]->extp=p;
+#if NUMAAWARE
+	p->nodes[0]=CurrentNode();
+#endif
 	RELEASE_LOCK(&p->mutex);
 	return 1;
 err:
@@ -561,31 +699,57 @@ static NOINLINE mstate FindMSpace(nedpool *p, threadcache *tc, int *lastUsed, si
 {	/* Gets called when thread's last used mspace is in use. The strategy
 	is to run through the list of all available mspaces looking for an
 	unlocked one and if we fail, we create a new one so long as we don't
-	exceed p->threads */
-	int n, end;
+	exceed p->threads. If it keeps failing, p->threads is raised towards
+	MAXTHREADSINPOOL. lockfails is updated without locking as it is only
+	a hint. With NUMAAWARE only the mspaces of the thread's node count */
+	int n, end, mine, node=ThreadNode(tc);
+	mine=(MSPACENODE(p, *lastUsed)==node);
 	for(n=end=*lastUsed+1; p->m[n]; end=++n)
 	{
+		if(MSPACENODE(p, n)!=node) continue;
+		mine++;
 		if(TRY_LOCK(&p->m[n]->mutex)) goto found;
 	}
 	for(n=0; n<*lastUsed && p->m[n]; n++)
 	{
+		if(MSPACENODE(p, n)!=node) continue;
+		mine++;
 		if(TRY_LOCK(&p->m[n]->mutex)) goto found;
 	}
-	if(end<p->threads)
+#if MSPACEGROWTHRESHOLD
+	if(mine>=p->threads && p->threads<MAXTHREADSINPOOL && ++p->lockfails>=MSPACEGROWTHRESHOLD)
+	{
+		ACQUIRE_LOCK(&p->mutex);
+		if(p->lockfails>=MSPACEGROWTHRESHOLD && p->threads<MAXTHREADSINPOOL)
+		{
+			p->threads++;
+			p->lockfails=0;
+			/*printf("Pool %p now allows %d mspaces\n", p, p->threads);*/
+		}
+		RELEASE_LOCK(&p->mutex);
+	}
+#endif
+	if(mine<p->threads)
 	{
 		mstate temp;
 		if(!(temp=(mstate) create_mspace(size, 1)))
 			goto badexit;
 		/* Now we're ready to modify the lists, we lock */
 		ACQUIRE_LOCK(&p->mutex);
-		while(p->m[end] && end<p->threads)
-			end++;
-		if(end>=p->threads)
+		for(mine=end=0; p->m[end]; end++)
+		{
+			if(MSPACENODE(p, end)==node) mine++;
+		}
+		if(mine>=p->threads || end>=MAXTHREADSINPOOL)
 		{	/* Drat, must destroy it now */
 			RELEASE_LOCK(&p->mutex);
 			destroy_mspace((mspace) temp);
 			goto badexit;
 		}
+#if NUMAAWARE
+		temp->extp=p;
+		p->nodes[end]=node;
+#endif
 		/* We really want to make sure this goes into memory now but we
 		have to be careful of breaking aliasing rules, so write it twice */
 		*((volatile struct malloc_state **) &p->m[end])=p->m[end]=temp;
@@ -600,6 +764,9 @@ badexit:
 	ACQUIRE_LOCK(&p->m[*lastUsed]->mutex);
 	return p->m[*lastUsed];
 found:
+#if MSPACEGROWTHRESHOLD
+	if(p->lockfails>0) p->lockfails--;
+#endif
 	*lastUsed=n;
 	if(tc)
 		tc->mymspace=n;
@@ -738,7 +905,7 @@ static FORCEINLINE void GetThreadCache(nedpool **p, threadcache **tc, int *mymsp
 		*mymspace=-mycache-1;
 	}
 	assert(*mymspace>=0);
-	assert((long)(size_t)CURRENT_THREAD==(*tc)->threadid);
+	assert(!*tc || (long)(size_t)CURRENT_THREAD==(*tc)->threadid);
 #ifdef FULLSANITYCHECKS
 	if(*tc)
 	{
@@ -790,32 +957,103 @@ void * nedpcalloc(nedpool *p, size_t no, size_t size) THROWSPEC
 	}
 	return ret;
 }
+/* Tries to make the block mem hold size bytes without copying it. A block
+from an mspace is split, and to grow takes over the next chunk if that is the
+top or free. Both rewrite chunk headers which the owning mspace may be
+changing, so this only happens if its lock can be had without waiting. A
+mmapped block is remapped, which may move it. Returns the block or zero; a
+split off remainder is returned in *extra for the caller to free */
+static void *ResizeInPlace(void *mem, size_t size, void **extra) THROWSPEC
+{
+	mchunkptr p=mem2chunk(mem), next;
+	size_t oldsize=chunksize(p), newsize=0, nb;
+	mstate m;
+	*extra=0;
+	if(size>=MAX_REQUEST) return 0;
+	nb=request2size(size);
+	m=get_mstate_for(p);
+	assert(ok_magic(m));
+	if(is_mmapped(p))
+	{	/* Remapping is worth waiting for the lock, copying is not */
+		ACQUIRE_LOCK(&m->mutex);
+		p=mmap_resize(m, p, nb);
+		RELEASE_LOCK(&m->mutex);
+		return p ? chunk2mem(p) : 0;
+	}
+	if(!TRY_LOCK(&m->mutex)) return 0;
+	next=chunk_plus_offset(p, oldsize);
+	if(oldsize>=nb)
+		newsize=oldsize;
+	else if(next==m->top)
+	{
+		if(oldsize+m->topsize>nb)
+		{	/* Extend into top, leaving the rest of it as the new top */
+			size_t newtopsize=oldsize+m->topsize-nb;
+			mchunkptr newtop=chunk_plus_offset(p, nb);
+			set_inuse(m, p, nb);
+			newtop->head=newtopsize|PINUSE_BIT;
+			m->top=newtop;
+			m->topsize=newtopsize;
+			newsize=nb;
+		}
+	}
+	else if(!cinuse(next) && oldsize+chunksize(next)>=nb)
+	{	/* Absorb the next chunk, whether it is the designated victim or binned */
+		size_t nextsize=chunksize(next);
+		if(next==m->dv)
+		{
+			m->dv=0;
+			m->dvsize=0;
+		}
+		else
+			unlink_chunk(m, next, nextsize);
+		newsize=oldsize+nextsize;
+		set_inuse(m, p, newsize);
+	}
+	if(newsize>=nb && newsize-nb>=MIN_CHUNK_SIZE)
+	{
+		mchunkptr remainder=chunk_plus_offset(p, nb);
+		set_inuse(m, p, nb);
+		set_inuse(m, remainder, (newsize-nb));
+		*extra=chunk2mem(remainder);
+	}
+	RELEASE_LOCK(&m->mutex);
+	return newsize>=nb ? mem : 0;
+}
 void * nedprealloc(nedpool *p, void *mem, size_t size) THROWSPEC
 {
-	void *ret=0;
+	void *ret=0, *extra=0;
 	threadcache *tc;
 	int mymspace;
+	size_t memsize;
 	if(!mem) return nedpmalloc(p, size);
 	GetThreadCache(&p, &tc, &mymspace, &size);
+	memsize=nedblksize(mem);
+	assert(memsize);
+	/* A block that holds size but is at most twice as big is in the bin
+	threadcache_malloc() would pick or the one above, so keep it */
+	if(size<=memsize && size>=memsize/2)
+		return mem;
+	if((ret=ResizeInPlace(mem, size, &extra)))
+	{
+		if(extra)
+		{	/* The cut off end goes to this thread's cache if it fits there */
+			size_t extrasize=nedblksize(extra);
 #if THREADCACHEMAX
-	if(tc && size && size<=THREADCACHEMAX)
-	{	/* Use the thread cache */
-		size_t memsize=nedblksize(mem);
-		assert(memsize);
-		if((ret=threadcache_malloc(p, tc, &size)))
-		{
-			memcpy(ret, mem, memsize<size ? memsize : size);
-			if(memsize<=THREADCACHEMAX)
-				threadcache_free(p, tc, mymspace, mem, memsize);
+			if(tc && extrasize>=sizeof(threadcacheblk) && extrasize<=THREADCACHEMAX+CHUNK_OVERHEAD)
+				threadcache_free(p, tc, mymspace, extra, extrasize);
 			else
-				mspace_free(0, mem);
+#endif
+				mspace_free(0, extra);
 		}
+		return ret;
 	}
-#endif
-	if(!ret)
-	{	/* Reallocs always happen in the mspace they happened in, so skip
-		locking the preferred mspace for this thread */
-		ret=mspace_realloc(0, mem, size);
+	/* Anything else is copied. Not by mspace_realloc(), whose fallback calls
+	mspace_malloc() without the lock nedmalloc otherwise takes for it */
+	if((ret=nedpmalloc(p, size)))
+	{
+		memcpy(ret, mem, memsize<size ? memsize : size);
+		nedpfree(p, mem);
 	}
 	return ret;
 }
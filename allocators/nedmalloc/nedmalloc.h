@@ -133,7 +133,10 @@ Capacity is how much to allocate immediately (if you know you'll be allocating a
 of memory very soon) which you can leave at zero. Threads specifies how many threads
 will *normally* be accessing the pool concurrently. Setting this to zero means it
 extends on demand, but be careful of this as it can rapidly consume system resources
-where bursts of concurrent threads use a pool at once.
+where bursts of concurrent threads use a pool at once. Either way the pool raises
+its limit, up to MAXTHREADSINPOOL, when threads keep finding all its mspaces in use
+(see MSPACEGROWTHRESHOLD in nedmalloc.c). If nedmalloc.c is built with NUMAAWARE,
+threads and that limit apply per NUMA node.
 */
 EXTSPEC MALLOCATTR nedpool *nedcreatepool(size_t capacity, int threads) THROWSPEC;
 
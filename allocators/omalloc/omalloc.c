@@ -34,6 +34,7 @@
 #include <sys/param.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -43,6 +44,10 @@
 
 #include <pthread.h>
 
+/*
+ * _MALLOC_LOCK only guards initialization and arc4random; the pools
+ * have locks of their own, see _POOL_LOCK.
+ */
 static pthread_mutex_t _malloclock = PTHREAD_MUTEX_INITIALIZER;
 
 inline static void _MALLOC_LOCK (void) {
@@ -75,7 +80,9 @@ inline static void _MALLOC_UNLOCK (void) {
 
 #define MALLOC_MAXCHUNK		(1 << (MALLOC_PAGESHIFT-1))
 #define MALLOC_MAXCACHE		256
+#define MALLOC_CACHE_BUCKETS	16	/* should be power of 2 */
 #define MALLOC_DELAYED_CHUNKS	16	/* should be power of 2 */
+#define MALLOC_MAXDELAYED	4096	/* largest delayed free ring */
 /*
  * When the P option is active, we move allocations between half a page
  * and a whole page towards the end, subject to alignment constraints.
@@ -84,6 +91,15 @@ inline static void _MALLOC_UNLOCK (void) {
  */
 #define MALLOC_LEEWAY		0
 
+/*
+ * Number of dir_info pools. Threads are spread over the pools round
+ * robin, and every pool has its own lock, so that up to this many
+ * threads allocate without contending.
+ */
+#ifndef MALLOC_POOLS
+#define MALLOC_POOLS		4
+#endif
+
 #define PAGEROUND(x)  (((x) + (MALLOC_PAGEMASK)) & ~MALLOC_PAGEMASK)
 
 /*
@@ -105,8 +121,27 @@ struct region_info {
 	uintptr_t size;		/* size for pages, or chunk_info pointer */
 };
 
+/*
+ * A run of cached free pages. The cache keeps these in buckets by
+ * size, so that map() and unmap() do not have to scan the whole cache.
+ * A run freed with its guard page still PROT_NONE keeps it so, and
+ * map() hands its tail out again with the guard in place.
+ */
+struct cache_region {
+	void *p;			/* first page */
+	size_t size;			/* in MALLOC_PAGESIZE units */
+	int guarded;			/* last page is PROT_NONE */
+	struct cache_region *next;	/* next in bucket or on free slots */
+};
+
+/* Bucket i holds runs of i + 1 pages, the last one all longer runs */
+#define CACHE_BUCKET(psz)	((psz) < MALLOC_CACHE_BUCKETS ? (psz) - 1 : \
+				    MALLOC_CACHE_BUCKETS - 1)
+
 struct dir_info {
 	u_int32_t canary1;
+	pthread_mutex_t lock;		/* guards everything below */
+	int active;			/* status of malloc */
 	struct region_info *r;		/* region slots */
 	size_t regions_total;		/* number of region slots */
 	size_t regions_bits;		/* log2 of total */
@@ -116,10 +151,16 @@ struct dir_info {
 					/* lists of chunks with free slots */
 	struct chunk_info *chunk_dir[MALLOC_MAXSHIFT];
 	size_t free_regions_size;	/* free pages cached */
-					/* free pages cache */
-	struct region_info free_regions[MALLOC_MAXCACHE];
-					/* delayed free chunk slots */
-	void *delayed_chunks[MALLOC_DELAYED_CHUNKS];
+					/* free pages cache, by size */
+	struct cache_region *free_buckets[MALLOC_CACHE_BUCKETS];
+					/* unused free_regions */
+	struct cache_region *free_slots;
+	struct cache_region free_regions[MALLOC_MAXCACHE];
+					/* delayed free chunk ring */
+	void **delayed_chunks;
+	size_t delayed_used;		/* chunks waiting in the ring */
+	size_t malloc_guarded;		/* bytes used for guards */
+	size_t malloc_used;		/* bytes allocated */
 #ifdef MALLOC_STATS
 	size_t inserts;
 	size_t insert_collisions;
@@ -140,6 +181,9 @@ struct dir_info {
 #define DIR_INFO_RSZ	((sizeof(struct dir_info) + MALLOC_PAGEMASK) & \
 			~MALLOC_PAGEMASK)
 
+#define _POOL_LOCK(d)	pthread_mutex_lock(&(d)->lock)
+#define _POOL_UNLOCK(d)	pthread_mutex_unlock(&(d)->lock)
+
 /*
  * This structure describes a page worth of chunks.
  *
@@ -159,7 +203,8 @@ struct chunk_info {
 };
 
 struct malloc_readonly {
-	struct dir_info *g_pool;	/* Main bookkeeping information */
+					/* Main bookkeeping information */
+	struct dir_info *malloc_pool[MALLOC_POOLS];
 	int	malloc_abort;		/* abort() on error */
 	int	malloc_freeprot;	/* mprotect free pages PROT_NONE? */
 	int	malloc_hint;		/* call madvice on free pages?  */
@@ -170,10 +215,11 @@ struct malloc_readonly {
 	int	malloc_zero;		/* zero fill? */
 	size_t	malloc_guard;		/* use guard pages after allocations? */
 	u_int	malloc_cache;		/* free pages we cache */
+	u_int	malloc_delayed;		/* chunks we hold back on free */
 #ifdef MALLOC_STATS
 	int	malloc_stats;		/* dump statistics at end */
 #endif
-	u_int32_t malloc_canary;	/* Matched against ones in g_pool */
+	u_int32_t malloc_canary;	/* Matched against ones in the pools */
 };
 
 /* This object is mapped PROT_READ after initialisation to prevent tampering */
@@ -182,18 +228,12 @@ static union {
 	u_char _pad[MALLOC_PAGESIZE];
 } malloc_readonly __attribute__((aligned(MALLOC_PAGESIZE)));
 #define mopts	malloc_readonly.mopts
-#define g_pool	mopts.g_pool
 
 char		*malloc_options;	/* compile-time options */
 
-static char	*malloc_func;		/* current function */
-static int	malloc_active;		/* status of malloc */
+static __thread char *malloc_func;	/* current function */
+static __thread u_int malloc_poolid;	/* pool of this thread, plus one */
 
-static size_t	malloc_guarded;		/* bytes used for guards */
-static size_t	malloc_used;		/* bytes allocated */
-
-static size_t rbytesused;		/* random bytes used */
-static u_char rbytes[512];		/* random bytes */
 static u_char getrbyte(void);
 
 extern char	*__progname;
@@ -271,12 +311,13 @@ dump_free_page_info(int fd, struct dir_info *d)
 	snprintf(buf, sizeof(buf), "Free pages cached: %zu\n",
 	    d->free_regions_size);
 	write(fd, buf, strlen(buf));
-	for (i = 0; i < mopts.malloc_cache; i++) {
+	for (i = 0; i < MALLOC_MAXCACHE; i++) {
 		if (d->free_regions[i].p != NULL) {
 			snprintf(buf, sizeof(buf), "%2d) ", i);
 			write(fd, buf, strlen(buf));
-			snprintf(buf, sizeof(buf), "free at %p: %zu\n",
-			    d->free_regions[i].p, d->free_regions[i].size);
+			snprintf(buf, sizeof(buf), "free at %p: %zu%s\n",
+			    d->free_regions[i].p, d->free_regions[i].size,
+			    d->free_regions[i].guarded ? " guarded" : "");
 			write(fd, buf, strlen(buf));
 		}
 	}
@@ -329,9 +370,9 @@ malloc_dump1(int fd, struct dir_info *d)
 	}
 	dump_free_chunk_info(fd, d);
 	dump_free_page_info(fd, d);
-	snprintf(buf, sizeof(buf), "In use %zu\n", malloc_used);
+	snprintf(buf, sizeof(buf), "In use %zu\n", d->malloc_used);
 	write(fd, buf, strlen(buf));
-	snprintf(buf, sizeof(buf), "Guarded %zu\n", malloc_guarded);
+	snprintf(buf, sizeof(buf), "Guarded %zu\n", d->malloc_guarded);
 	write(fd, buf, strlen(buf));
 }
 
@@ -339,7 +380,10 @@ malloc_dump1(int fd, struct dir_info *d)
 void
 malloc_dump(int fd)
 {
-	malloc_dump1(fd, g_pool);
+	int i;
+
+	for (i = 0; i < MALLOC_POOLS; i++)
+		malloc_dump1(fd, mopts.malloc_pool[i]);
 }
 
 static void
@@ -387,19 +431,59 @@ wrterror(char *p)
 		abort();
 }
 
+/*
+ * Give cached runs back to the system, with one munmap for each stretch
+ * of them that lie next to each other, and put their slots back on the
+ * free list.
+ */
+static void
+unmap_runs(struct dir_info *d, struct cache_region **runs, size_t n)
+{
+	struct cache_region *r;
+	size_t i, j, rsz;
+	char *start;
+
+	/* Sort by address; there are few, so insertion sort will do */
+	for (i = 1; i < n; i++) {
+		r = runs[i];
+		for (j = i; j > 0 && runs[j - 1]->p > r->p; j--)
+			runs[j] = runs[j - 1];
+		runs[j] = r;
+	}
+	for (i = 0; i < n; i = j) {
+		start = runs[i]->p;
+		rsz = 0;
+		for (j = i; j < n && (char *)runs[j]->p == start + rsz; j++)
+			rsz += runs[j]->size << MALLOC_PAGESHIFT;
+		if (munmap(start, rsz))
+			wrterror("munmap");
+		d->malloc_used -= rsz;
+	}
+	for (i = 0; i < n; i++) {
+		r = runs[i];
+		r->p = NULL;
+		r->size = 0;
+		r->guarded = 0;
+		r->next = d->free_slots;
+		d->free_slots = r;
+	}
+}
+
 /*
  * Cache maintenance. We keep at most malloc_cache pages cached.
  * If the cache is becoming full, unmap pages in the cache for real,
  * and then add the region to the cache
  * Opposed to the regular region data structure, the sizes in the
  * cache are in MALLOC_PAGESIZE units.
+ * If guarded, the last page of the region is PROT_NONE (a guard page,
+ * or a malloc(0) page), and is cached so.
  */
 static void
-unmap(struct dir_info *d, void *p, size_t sz)
+unmap(struct dir_info *d, void *p, size_t sz, int guarded)
 {
 	size_t psz = sz >> MALLOC_PAGESHIFT;
-	size_t rsz, tounmap;
-	struct region_info *r;
+	size_t rsz, tounmap, nevict;
+	struct cache_region *r, **rp, *evict[MALLOC_MAXCACHE];
 	u_int i, offset;
 
 	if (sz != PAGEROUND(sz)) {
@@ -410,7 +494,7 @@ unmap(struct dir_info *d, void *p, size_t sz)
 	if (psz > mopts.malloc_cache) {
 		if (munmap(p, sz))
 			wrterror("munmap");
-		malloc_used -= sz;
+		d->malloc_used -= sz;
 		return;
 	}
 	tounmap = 0;
@@ -418,44 +502,50 @@ unmap(struct dir_info *d, void *p, size_t sz)
 	if (psz > rsz)
 		tounmap = psz - rsz;
 	offset = getrbyte();
-	for (i = 0; tounmap > 0 && i < mopts.malloc_cache; i++) {
-		r = &d->free_regions[(i + offset) & (mopts.malloc_cache - 1)];
-		if (r->p != NULL) {
-			rsz = r->size << MALLOC_PAGESHIFT;
-			if (munmap(r->p, rsz))
-				wrterror("munmap");
-			r->p = NULL;
+	nevict = 0;
+	for (i = 0; tounmap > 0 && i < MALLOC_CACHE_BUCKETS; i++) {
+		rp = &d->free_buckets[(i + offset) &
+		    (MALLOC_CACHE_BUCKETS - 1)];
+		while (tounmap > 0 && (r = *rp) != NULL) {
+			*rp = r->next;
 			if (tounmap > r->size)
 				tounmap -= r->size;
 			else
 				tounmap = 0;
 			d->free_regions_size -= r->size;
-			r->size = 0;
-			malloc_used -= rsz;
+			evict[nevict++] = r;
 		}
 	}
+	unmap_runs(d, evict, nevict);
 	if (tounmap > 0)
 		wrterror("malloc cache underflow");
-	for (i = 0; i < mopts.malloc_cache; i++) {
-		r = &d->free_regions[i];
-		if (r->p == NULL) {
-			if (mopts.malloc_hint)
+	r = d->free_slots;
+	if (r == NULL) {
+		wrterror("malloc free slot lost");
+		return;
+	}
+	d->free_slots = r->next;
+	if (mopts.malloc_hint)
 #if defined(linux)
-				madvise(p, sz, MADV_DONTNEED);
+		madvise(p, sz, MADV_DONTNEED);
 #else
-				madvise(p, sz, MADV_FREE);
+		madvise(p, sz, MADV_FREE);
 #endif
 
-			if (mopts.malloc_freeprot)
-				mprotect(p, sz, PROT_NONE);
-			r->p = p;
-			r->size = psz;
-			d->free_regions_size += psz;
-			break;
-		}
+	if (mopts.malloc_freeprot) {
+		/* A guard page is PROT_NONE already */
+		if (!guarded || psz > 1)
+			mprotect(p, guarded ? sz - MALLOC_PAGESIZE : sz,
+			    PROT_NONE);
+		guarded = 1;
 	}
-	if (i == mopts.malloc_cache)
-		wrterror("malloc free slot lost");
+	r->p = p;
+	r->size = psz;
+	r->guarded = guarded;
+	rp = &d->free_buckets[CACHE_BUCKET(psz)];
+	r->next = *rp;
+	*rp = r;
+	d->free_regions_size += psz;
 	if (d->free_regions_size > mopts.malloc_cache)
 		wrterror("malloc cache overflow");
 }
@@ -464,117 +554,271 @@ static void
 zapcacheregion(struct dir_info *d, void *p)
 {
 	u_int i;
-	struct region_info *r;
-	size_t rsz;
-
-	for (i = 0; i < mopts.malloc_cache; i++) {
-		r = &d->free_regions[i];
-		if (r->p == p) {
-			rsz = r->size << MALLOC_PAGESHIFT;
-			if (munmap(r->p, rsz))
-				wrterror("munmap");
-			r->p = NULL;
-			d->free_regions_size -= r->size;
-			r->size = 0;
-			malloc_used -= rsz;
+	struct cache_region *r, **rp;
+
+	for (i = 0; i < MALLOC_CACHE_BUCKETS; i++) {
+		for (rp = &d->free_buckets[i]; (r = *rp) != NULL;
+		    rp = &r->next) {
+			if (r->p == p) {
+				*rp = r->next;
+				d->free_regions_size -= r->size;
+				unmap_runs(d, &r, 1);
+				return;
+			}
 		}
 	}
 }
 
+/*
+ * Map new pages, of which the first usz bytes are to be accessible and
+ * the rest a guard.
+ */
 static void *
-map(struct dir_info *d, size_t sz, int zero_fill)
+map_fresh(struct dir_info *d, size_t sz, size_t usz)
+{
+	void *p;
+
+	p = MMAP(sz);
+	if (p == MAP_FAILED)
+		return p;
+	d->malloc_used += sz;
+	if (usz < sz && mprotect((char *)p + usz, sz - usz, PROT_NONE)) {
+		wrterror("mprotect");
+		munmap(p, sz);
+		d->malloc_used -= sz;
+		return MAP_FAILED;
+	}
+	/* zero fill not needed */
+	return p;
+}
+
+/*
+ * Get sz bytes of pages, from the cache if it has them. If guard, the
+ * last page comes PROT_NONE: the tail of a run that was cached with
+ * its guard page still in place is handed out as it is, so that only a
+ * run without one takes an mprotect.
+ */
+static void *
+map(struct dir_info *d, size_t sz, int zero_fill, int guard)
 {
 	size_t psz = sz >> MALLOC_PAGESHIFT;
-	struct region_info *r, *big = NULL;
-	u_int i, offset;
+	size_t usz;			/* bytes to be accessible */
+	struct cache_region *r, **rp;
+	u_int i;
 	void *p;
 
 	if (mopts.malloc_canary != (d->canary1 ^ (u_int32_t)(uintptr_t)d) ||
 	    d->canary1 != ~d->canary2)
 		wrterror("internal struct corrupt");
-	if (sz != PAGEROUND(sz)) {
+	if (sz != PAGEROUND(sz) || sz == 0) {
 		wrterror("map round");
 		return NULL;
 	}
-	if (psz > d->free_regions_size) {
-		p = MMAP(sz);
-		if (p != MAP_FAILED)
-			malloc_used += sz;
-		/* zero fill not needed */
-		return p;
-	}
-	offset = getrbyte();
-	for (i = 0; i < mopts.malloc_cache; i++) {
-		r = &d->free_regions[(i + offset) & (mopts.malloc_cache - 1)];
-		if (r->p != NULL) {
-			if (r->size == psz) {
-				p = r->p;
-				if (mopts.malloc_freeprot)
-					mprotect(p, sz, PROT_READ | PROT_WRITE);
-				if (mopts.malloc_hint)
-					madvise(p, sz, MADV_NORMAL);
-				r->p = NULL;
-				r->size = 0;
-				d->free_regions_size -= psz;
-				if (zero_fill)
-					memset(p, 0, sz);
-				else if (mopts.malloc_junk &&
-				    mopts.malloc_freeprot)
-					memset(p, SOME_FREEJUNK, sz);
-				return p;
-			} else if (r->size > psz)
-				big = r;
-		}
+	usz = guard ? sz - MALLOC_PAGESIZE : sz;
+	if (psz > d->free_regions_size)
+		return map_fresh(d, sz, usz);
+	/*
+	 * Take the first run of the smallest bucket that fits; only the
+	 * last bucket holds runs of different sizes.
+	 */
+	r = NULL;
+	for (i = CACHE_BUCKET(psz); r == NULL && i < MALLOC_CACHE_BUCKETS;
+	    i++) {
+		for (rp = &d->free_buckets[i]; (r = *rp) != NULL;
+		    rp = &r->next)
+			if (r->size >= psz)
+				break;
 	}
-	if (big != NULL) {
-		r = big;
+	if (r != NULL) {
+		*rp = r->next;
+		/* The tail, which holds the run's last page */
 		p = (char *)r->p + ((r->size - psz) << MALLOC_PAGESHIFT);
-		if (mopts.malloc_freeprot)
-			mprotect(p, sz, PROT_READ | PROT_WRITE);
+		if (mopts.malloc_freeprot) {
+			if (usz > 0)
+				mprotect(p, usz, PROT_READ | PROT_WRITE);
+		} else if (guard && !r->guarded) {
+			if (mprotect((char *)p + usz, MALLOC_PAGESIZE,
+			    PROT_NONE))
+				wrterror("mprotect");
+		} else if (!guard && r->guarded)
+			mprotect((char *)p + sz - MALLOC_PAGESIZE,
+			    MALLOC_PAGESIZE, PROT_READ | PROT_WRITE);
 		if (mopts.malloc_hint)
 			madvise(p, sz, MADV_NORMAL);
 		r->size -= psz;
 		d->free_regions_size -= psz;
-		if (zero_fill)
-			memset(p, 0, sz);
+		if (r->size == 0) {
+			r->p = NULL;
+			r->guarded = 0;
+			r->next = d->free_slots;
+			d->free_slots = r;
+			if (zero_fill)
+				memset(p, 0, usz);
+			else if (mopts.malloc_junk &&
+			    mopts.malloc_freeprot)
+				memset(p, SOME_FREEJUNK, usz);
+		} else {
+			/* The rest, whose last page is not a guard now,
+			   goes to the bucket of its new size */
+			r->guarded = mopts.malloc_freeprot;
+			rp = &d->free_buckets[CACHE_BUCKET(r->size)];
+			r->next = *rp;
+			*rp = r;
+			if (zero_fill)
+				memset(p, 0, usz);
+		}
 		return p;
 	}
-	p = MMAP(sz);
-	if (p != MAP_FAILED)
-		malloc_used += sz;
 	if (d->free_regions_size > mopts.malloc_cache)
 		wrterror("malloc cache");
-	/* zero fill not needed */
-	return p;
+	return map_fresh(d, sz, usz);
+}
+
+/*
+ * Random bytes come from a ChaCha20 keystream of the calling thread,
+ * keyed from the kernel, so that getting them takes neither a lock nor
+ * RC4. The stream is keyed anew every RS_REKEY blocks and in the child
+ * after fork().
+ */
+#define RS_REKEY	1024
+
+static __thread struct {
+	u_int32_t input[16];		/* ChaCha20 state */
+	u_char buf[64];			/* current keystream block */
+	size_t left;			/* bytes of buf not used */
+	size_t blocks;			/* blocks until rekey */
+	pid_t pid;			/* process the stream was keyed in */
+} rs;
+
+#define ROTL32(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) do {				\
+	a += b; d ^= a; d = ROTL32(d, 16);			\
+	c += d; b ^= c; b = ROTL32(b, 12);			\
+	a += b; d ^= a; d = ROTL32(d, 8);			\
+	c += d; b ^= c; b = ROTL32(b, 7);			\
+} while (0)
+
+static void
+rs_rekey(void)
+{
+	static const u_int32_t sigma[4] =
+	    { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+
+	memcpy(rs.input, sigma, sizeof(sigma));
+	/* key, counter and nonce */
+#ifdef SYS_getrandom
+	if (syscall(SYS_getrandom, &rs.input[4], 12 * sizeof(u_int32_t),
+	    0) != 12 * sizeof(u_int32_t))
+#endif
+	{
+		_MALLOC_LOCK();
+		arc4random_buf(&rs.input[4], 12 * sizeof(u_int32_t));
+		_MALLOC_UNLOCK();
+	}
+	rs.blocks = RS_REKEY;
+	rs.pid = getpid();
 }
 
 static void
-rbytes_init(void)
+rs_refill(void)
 {
-	arc4random_buf(rbytes, sizeof(rbytes));
-	rbytesused = 0;
+	u_int32_t x[16];
+	int i;
+
+	if (rs.blocks == 0 || rs.pid != getpid())
+		rs_rekey();
+	memcpy(x, rs.input, sizeof(x));
+	for (i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+		x[i] += rs.input[i];
+	memcpy(rs.buf, x, sizeof(rs.buf));
+	if (++rs.input[12] == 0)
+		rs.input[13]++;
+	rs.blocks--;
+	rs.left = sizeof(rs.buf);
 }
 
-static u_char
+static inline u_char
 getrbyte(void)
 {
-	if (rbytesused >= sizeof(rbytes))
-		rbytes_init();
-	return rbytes[rbytesused++];
+	if (rs.left == 0)
+		rs_refill();
+	return rs.buf[--rs.left];
 }
 
 /*
- * Initialize a dir_info, which should have been cleared by caller
+ * Allocate and initialize a dir_info
  */
 static int
-omalloc_init(struct dir_info **dp)
+omalloc_poolinit(struct dir_info **dp)
 {
-	char *p, b[64];
-	int i, j;
+	char *p;
+	int i;
 	size_t d_avail, regioninfo_size;
 	struct dir_info *d;
 
-	rbytes_init();
+	/*
+	 * Allocate dir_info with a guard page on either side. Also
+	 * randomise offset inside the page at which the dir_info
+	 * lies (subject to alignment by 1 << MALLOC_MINSHIFT)
+	 */
+	if ((p = MMAP(DIR_INFO_RSZ + (MALLOC_PAGESIZE * 2))) == MAP_FAILED)
+		return -1;
+	mprotect(p, MALLOC_PAGESIZE, PROT_NONE);
+	mprotect(p + MALLOC_PAGESIZE + DIR_INFO_RSZ,
+	    MALLOC_PAGESIZE, PROT_NONE);
+	d_avail = (DIR_INFO_RSZ - sizeof(*d)) >> MALLOC_MINSHIFT;
+	d = (struct dir_info *)(p + MALLOC_PAGESIZE +
+	    (arc4random_uniform(d_avail) << MALLOC_MINSHIFT));
+
+	d->regions_bits = 9;
+	d->regions_free = d->regions_total = 1 << d->regions_bits;
+	regioninfo_size = d->regions_total * sizeof(struct region_info);
+	d->r = MMAP(regioninfo_size);
+	if (d->r == MAP_FAILED) {
+		wrterror("malloc init mmap failed");
+		d->regions_total = 0;
+		return 1;
+	}
+	d->malloc_used += regioninfo_size;
+	memset(d->r, 0, regioninfo_size);
+	if (mopts.malloc_delayed > 0) {
+		d->delayed_chunks = MMAP(PAGEROUND(mopts.malloc_delayed *
+		    sizeof(void *)));
+		if (d->delayed_chunks == MAP_FAILED) {
+			wrterror("malloc init mmap failed");
+			return 1;
+		}
+		d->malloc_used += PAGEROUND(mopts.malloc_delayed *
+		    sizeof(void *));
+	}
+	for (i = 0; i < MALLOC_MAXCACHE; i++) {
+		d->free_regions[i].next = d->free_slots;
+		d->free_slots = &d->free_regions[i];
+	}
+	pthread_mutex_init(&d->lock, NULL);
+	d->canary1 = mopts.malloc_canary ^ (u_int32_t)(uintptr_t)d;
+	d->canary2 = ~d->canary1;
+
+	*dp = d;
+	return 0;
+}
+
+static int
+omalloc_init(void)
+{
+	char *p, b[64];
+	int i, j;
+	struct dir_info *d;
 
 	/*
 	 * Default options
@@ -582,6 +826,7 @@ omalloc_init(struct dir_info **dp)
 	mopts.malloc_abort = 1;
 	mopts.malloc_move = 1;
 	mopts.malloc_cache = 64;
+	mopts.malloc_delayed = MALLOC_DELAYED_CHUNKS;
 
 	for (i = 0; i < 3; i++) {
 		switch (i) {
@@ -662,6 +907,15 @@ omalloc_init(struct dir_info **dp)
 			case 'P':
 				mopts.malloc_move = 1;
 				break;
+			case 'q':
+				mopts.malloc_delayed >>= 1;
+				break;
+			case 'Q':
+				if (mopts.malloc_delayed == 0)
+					mopts.malloc_delayed = 1;
+				else if (mopts.malloc_delayed < MALLOC_MAXDELAYED)
+					mopts.malloc_delayed <<= 1;
+				break;
 			case 'r':
 				mopts.malloc_realloc = 0;
 				break;
@@ -709,34 +963,15 @@ omalloc_init(struct dir_info **dp)
 		;
 
 	/*
-	 * Allocate dir_info with a guard page on either side. Also
-	 * randomise offset inside the page at which the dir_info
-	 * lies (subject to alignment by 1 << MALLOC_MINSHIFT)
+	 * Pool 0 goes last: once it is set, getpool() no longer takes
+	 * _MALLOC_LOCK.
 	 */
-	if ((p = MMAP(DIR_INFO_RSZ + (MALLOC_PAGESIZE * 2))) == NULL)
-		return -1;
-	mprotect(p, MALLOC_PAGESIZE, PROT_NONE);
-	mprotect(p + MALLOC_PAGESIZE + DIR_INFO_RSZ,
-	    MALLOC_PAGESIZE, PROT_NONE);
-	d_avail = (DIR_INFO_RSZ - sizeof(*d)) >> MALLOC_MINSHIFT;
-	d = (struct dir_info *)(p + MALLOC_PAGESIZE +
-	    (arc4random_uniform(d_avail) << MALLOC_MINSHIFT));
-
-	d->regions_bits = 9;
-	d->regions_free = d->regions_total = 1 << d->regions_bits;
-	regioninfo_size = d->regions_total * sizeof(struct region_info);
-	d->r = MMAP(regioninfo_size);
-	if (d->r == MAP_FAILED) {
-		wrterror("malloc init mmap failed");
-		d->regions_total = 0;
-		return 1;
+	for (i = MALLOC_POOLS - 1; i >= 0; i--) {
+		if (omalloc_poolinit(i == 0 ? &d : &mopts.malloc_pool[i]))
+			return -1;
 	}
-	malloc_used += regioninfo_size;
-	memset(d->r, 0, regioninfo_size);
-	d->canary1 = mopts.malloc_canary ^ (u_int32_t)(uintptr_t)d;
-	d->canary2 = ~d->canary1;
-
-	*dp = d;
+	__sync_synchronize();
+	mopts.malloc_pool[0] = d;
 
 	/*
 	 * Options have been set and will never be reset.
@@ -770,7 +1005,7 @@ omalloc_grow(struct dir_info *d)
 	if (p == MAP_FAILED)
 		return 1;
 	
-	malloc_used += newsize;
+	d->malloc_used += newsize;
 	memset(p, 0, newsize);
 	STATS_ZERO(d->inserts);
 	STATS_ZERO(d->insert_collisions);
@@ -790,7 +1025,7 @@ omalloc_grow(struct dir_info *d)
 	if (munmap(d->r, d->regions_total * sizeof(struct region_info))) 
 		wrterror("munmap");
 	else
-		malloc_used -= d->regions_total * sizeof(struct region_info);
+		d->malloc_used -= d->regions_total * sizeof(struct region_info);
 	d->regions_free = d->regions_free + d->regions_total;
 	d->regions_total = newtotal;
 	d->regions_bits = newbits;
@@ -808,7 +1043,7 @@ alloc_chunk_info(struct dir_info *d)
 		p = MMAP(MALLOC_PAGESIZE);
 		if (p == MAP_FAILED)
 			return NULL;
-		malloc_used += MALLOC_PAGESIZE;
+		d->malloc_used += MALLOC_PAGESIZE;
 		for (i = 0; i < MALLOC_PAGESIZE / sizeof(*p); i++) {
 			p[i].next = d->chunk_info_list;
 			d->chunk_info_list = &p[i];
@@ -889,7 +1124,7 @@ delete(struct dir_info *d, struct region_info *ri)
 	if (d->regions_total & (d->regions_total - 1))
 		wrterror("regions_total not 2^x");
 	d->regions_free++;
-	STATS_INC(g_pool->deletes);
+	STATS_INC(d->deletes);
 
 	i = ri - d->r;
 	for (;;) {
@@ -905,7 +1140,7 @@ delete(struct dir_info *d, struct region_info *ri)
 			    (j < i && i <= r))
 				continue;
 			d->r[j] = d->r[i];
-			STATS_INC(g_pool->delete_moves);
+			STATS_INC(d->delete_moves);
 			break;
 		}
 
@@ -922,18 +1157,20 @@ omalloc_make_chunks(struct dir_info *d, int bits)
 	void		*pp;
 	long		i, k;
 
-	/* Allocate a new bucket */
-	pp = map(d, MALLOC_PAGESIZE, 0);
+	/*
+	 * Allocate a new bucket; in the malloc(0) case the page comes
+	 * memory protected, like a guard page
+	 */
+	pp = map(d, MALLOC_PAGESIZE, 0, bits == 0);
 	if (pp == MAP_FAILED)
 		return NULL;
 
 	bp = alloc_chunk_info(d);
 	if (bp == NULL) {
-		unmap(d, pp, MALLOC_PAGESIZE);
+		unmap(d, pp, MALLOC_PAGESIZE, bits == 0);
 		return NULL;
 	}
 
-	/* memory protect the page allocated in the malloc(0) case */
 	if (bits == 0) {
 		bp->size = 0;
 		bp->shift = 1;
@@ -942,13 +1179,6 @@ omalloc_make_chunks(struct dir_info *d, int bits)
 			bp->shift++;
 		bp->total = bp->free = MALLOC_PAGESIZE >> bp->shift;
 		bp->page = pp;
-
-		k = mprotect(pp, MALLOC_PAGESIZE, PROT_NONE);
-		if (k < 0) {
-			unmap(d, pp, MALLOC_PAGESIZE);
-			put_chunk_info(d, bp);
-			return NULL;
-		}
 	} else {
 		bp->size = (1UL << bits);
 		bp->shift = bits;
@@ -1121,9 +1351,8 @@ free_bytes(struct dir_info *d, struct region_info *r, void *ptr)
 	}
 	*mp = info->next;
 
-	if (info->size == 0 && !mopts.malloc_freeprot)
-		mprotect(info->page, MALLOC_PAGESIZE, PROT_READ | PROT_WRITE);
-	unmap(d, info->page, MALLOC_PAGESIZE);
+	/* A malloc(0) page is cached still protected */
+	unmap(d, info->page, MALLOC_PAGESIZE, info->size == 0);
 
 	delete(d, r);
 	put_chunk_info(d, info);
@@ -1132,7 +1361,7 @@ free_bytes(struct dir_info *d, struct region_info *r, void *ptr)
 
 
 static void *
-omalloc(size_t sz, int zero_fill)
+omalloc(struct dir_info *d, size_t sz, int zero_fill)
 {
 	void *p;
 	size_t psz;
@@ -1144,22 +1373,19 @@ omalloc(size_t sz, int zero_fill)
 		}
 		sz += mopts.malloc_guard;
 		psz = PAGEROUND(sz);
-		p = map(g_pool, psz, zero_fill);
+		/* map() puts the guard page in place */
+		p = map(d, psz, zero_fill, mopts.malloc_guard != 0);
 		if (p == MAP_FAILED) {
 			errno = ENOMEM;
 			return NULL;
 		}
-		if (insert(g_pool, p, sz)) {
-			unmap(g_pool, p, psz);
+		if (insert(d, p, sz)) {
+			unmap(d, p, psz, mopts.malloc_guard != 0);
 			errno = ENOMEM;
 			return NULL;
 		}
-		if (mopts.malloc_guard) {
-			if (mprotect((char *)p + psz - mopts.malloc_guard,
-			    mopts.malloc_guard, PROT_NONE))
-				wrterror("mprotect");
-			malloc_guarded += mopts.malloc_guard;
-		}
+		if (mopts.malloc_guard)
+			d->malloc_guarded += mopts.malloc_guard;
 
 		if (mopts.malloc_move &&
 		    sz - mopts.malloc_guard < MALLOC_PAGESIZE -
@@ -1186,7 +1412,7 @@ omalloc(size_t sz, int zero_fill)
 
 	} else {
 		/* takes care of SOME_JUNK */
-		p = malloc_bytes(g_pool, sz);
+		p = malloc_bytes(d, sz);
 		if (zero_fill && p != NULL && sz > 0)
 			memset(p, 0, sz);
 	}
@@ -1200,7 +1426,7 @@ omalloc(size_t sz, int zero_fill)
  * potentially worse.
  */
 static void  
-malloc_recurse(void)
+malloc_recurse(struct dir_info *d)
 {
 	static int noprint;
 
@@ -1208,15 +1434,15 @@ malloc_recurse(void)
 		noprint = 1;
 		wrterror("recursive call");
 	}
-	malloc_active--;
-	_MALLOC_UNLOCK();
+	d->active--;
+	_POOL_UNLOCK(d);
 	errno = EDEADLK;
 }
 
 static int
 malloc_init(void)
 {
-	if (omalloc_init(&g_pool)) {
+	if (omalloc_init()) {
 		_MALLOC_UNLOCK();
 		if (mopts.malloc_xmalloc)
 			wrterror("out of memory");
@@ -1226,25 +1452,72 @@ malloc_init(void)
 	return 0;
 }
 
+/*
+ * The pool of the calling thread, initializing malloc if need be.
+ */
+static struct dir_info *
+getpool(void)
+{
+	static u_int nextpool;
+
+	if (mopts.malloc_pool[0] == NULL) {
+		_MALLOC_LOCK();
+		if (mopts.malloc_pool[0] == NULL && malloc_init() != 0)
+			return NULL;
+		_MALLOC_UNLOCK();
+	}
+	if (malloc_poolid == 0)
+		malloc_poolid = __sync_fetch_and_add(&nextpool, 1) %
+		    MALLOC_POOLS + 1;
+	return mopts.malloc_pool[malloc_poolid - 1];
+}
+
+/*
+ * Find the pool p belongs to, starting with that of the calling
+ * thread, and return it locked.
+ */
+static struct dir_info *
+findpool(void *p)
+{
+	struct dir_info *d, *own;
+	int i;
+
+	if ((own = getpool()) == NULL)
+		return NULL;
+	_POOL_LOCK(own);
+	if (find(own, p) != NULL)
+		return own;
+	_POOL_UNLOCK(own);
+	for (i = 0; i < MALLOC_POOLS; i++) {
+		d = mopts.malloc_pool[i];
+		if (d == own)
+			continue;
+		_POOL_LOCK(d);
+		if (find(d, p) != NULL)
+			return d;
+		_POOL_UNLOCK(d);
+	}
+	return NULL;
+}
+
 void *
 openbsd_malloc(size_t size)
 {
+	struct dir_info *d;
 	void *r;
 	int saved_errno = errno;
 
-	_MALLOC_LOCK();
 	malloc_func = " in malloc():";
-	if (g_pool == NULL) {
-		if (malloc_init() != 0)
-			return NULL;
-	}
-	if (malloc_active++) {
-		malloc_recurse();
+	if ((d = getpool()) == NULL)
+		return NULL;
+	_POOL_LOCK(d);
+	if (d->active++) {
+		malloc_recurse(d);
 		return NULL;
 	}
-	r = omalloc(size, mopts.malloc_zero);
-	malloc_active--;
-	_MALLOC_UNLOCK();
+	r = omalloc(d, size, mopts.malloc_zero);
+	d->active--;
+	_POOL_UNLOCK(d);
 	if (r == NULL && mopts.malloc_xmalloc) {
 		wrterror("out of memory");
 		errno = ENOMEM;
@@ -1255,12 +1528,76 @@ openbsd_malloc(size_t size)
 }
 
 static void
-ofree(void *p)
+sort_pointers(void **v, size_t n)
+{
+	size_t gap, i, j;
+	void *t;
+
+	/* Shell sort; qsort(3) may call malloc */
+	for (gap = n / 2; gap > 0; gap /= 2) {
+		for (i = gap; i < n; i++) {
+			t = v[i];
+			for (j = i; j >= gap && (uintptr_t)v[j - gap] >
+			    (uintptr_t)t; j -= gap)
+				v[j] = v[j - gap];
+			v[j] = t;
+		}
+	}
+}
+
+/*
+ * Really free the chunks in the delayed free ring. Sorted by address,
+ * the chunks of a page come together, so that every page is looked up
+ * once and a run of adjacent chunks is junked with a single memset.
+ */
+static void
+delayed_drain(struct dir_info *d)
+{
+	void **q = d->delayed_chunks;
+	size_t n = d->delayed_used;
+	size_t i, j, sz;
+	struct region_info *r = NULL;
+	struct chunk_info *info;
+	void *page = NULL;
+
+	d->delayed_used = 0;
+	sort_pointers(q, n);
+	for (i = 0; i < n; i = j) {
+		if (MASK_POINTER(q[i]) != page) {
+			page = MASK_POINTER(q[i]);
+			r = find(d, q[i]);
+		}
+		if (r == NULL) {
+			wrterror("bogus pointer (double free?)");
+			j = i + 1;
+			continue;
+		}
+		REALSIZE(sz, r);
+		for (j = i + 1; j < n && sz > 0 &&
+		    q[j] == (char *)q[j - 1] + sz; j++)
+			if (MASK_POINTER(q[j]) != page)
+				break;
+		if (mopts.malloc_junk && sz > 0)
+			memset(q[i], SOME_FREEJUNK, (j - i) * sz);
+		for (; i < j; i++) {
+			/* the last chunk takes the page and its slot along */
+			info = (struct chunk_info *)r->size;
+			if (info->free + 1 == info->total) {
+				page = NULL;
+				j = i + 1;
+			}
+			free_bytes(d, r, q[i]);
+		}
+	}
+}
+
+static void
+ofree(struct dir_info *d, void *p)
 {
 	struct region_info *r;
 	size_t sz;
 
-	r = find(g_pool, p);
+	r = find(d, p);
 	if (r == NULL) {
 		wrterror("bogus pointer (double free?)");
 		return;
@@ -1286,80 +1623,66 @@ ofree(void *p)
 		if (mopts.malloc_guard) {
 			if (sz < mopts.malloc_guard)
 				wrterror("guard size");
-			if (!mopts.malloc_freeprot) {
-				if (mprotect((char *)p + PAGEROUND(sz) -
-				    mopts.malloc_guard, mopts.malloc_guard,
-				    PROT_READ | PROT_WRITE))
-					wrterror("mprotect");
-			}
-			malloc_guarded -= mopts.malloc_guard;
+			/* The guard page stays, and is cached with the pages */
+			d->malloc_guarded -= mopts.malloc_guard;
 		}
 		if (mopts.malloc_junk && !mopts.malloc_freeprot)
 			memset(p, SOME_FREEJUNK,
 			    PAGEROUND(sz) - mopts.malloc_guard);
-		unmap(g_pool, p, PAGEROUND(sz));
-		delete(g_pool, r);
-	} else {
-		void *tmp;
-		int i;
-
+		unmap(d, p, PAGEROUND(sz), mopts.malloc_guard != 0);
+		delete(d, r);
+	} else if (mopts.malloc_freeprot || mopts.malloc_delayed == 0) {
 		if (mopts.malloc_junk && sz > 0)
 			memset(p, SOME_FREEJUNK, sz);
-		if (!mopts.malloc_freeprot) {
-			i = getrbyte() & (MALLOC_DELAYED_CHUNKS - 1);
-			tmp = p;
-			p = g_pool->delayed_chunks[i];
-			g_pool->delayed_chunks[i] = tmp;
-		}
-		if (p != NULL) {
-			r = find(g_pool, p);
-			if (r == NULL) {
-				wrterror("bogus pointer (double free?)");
-				return;
-			}
-			free_bytes(g_pool, r, p);
-		}
+		free_bytes(d, r, p);
+	} else {
+		d->delayed_chunks[d->delayed_used++] = p;
+		if (d->delayed_used == mopts.malloc_delayed)
+			delayed_drain(d);
 	}
 }
 
 void
 openbsd_free(void *ptr)
 {
+	struct dir_info *d;
 	int saved_errno = errno;
 
 	/* This is legal. */
 	if (ptr == NULL)
 		return;
 
-	_MALLOC_LOCK();
 	malloc_func = " in free():";  
-	if (g_pool == NULL) {
-		_MALLOC_UNLOCK();
+	if (mopts.malloc_pool[0] == NULL) {
 		wrterror("free() called before allocation");
 		return;
 	}
-	if (malloc_active++) {
-		malloc_recurse();
+	if ((d = findpool(ptr)) == NULL) {
+		wrterror("bogus pointer (double free?)");
+		return;
+	}
+	if (d->active++) {
+		malloc_recurse(d);
 		return;
 	}
-	ofree(ptr);
-	malloc_active--;
-	_MALLOC_UNLOCK();
+	ofree(d, ptr);
+	d->active--;
+	_POOL_UNLOCK(d);
 	errno = saved_errno;
 }
 
 
 static void *
-orealloc(void *p, size_t newsz)
+orealloc(struct dir_info *d, void *p, size_t newsz)
 {
 	struct region_info *r;
 	size_t oldsz, goldsz, gnewsz;
 	void *q;
 
 	if (p == NULL)
-		return omalloc(newsz, 0);
+		return omalloc(d, newsz, 0);
 
-	r = find(g_pool, p);
+	r = find(d, p);
 	if (r == NULL) {
 		wrterror("bogus pointer (double free?)");
 		return NULL;
@@ -1388,32 +1711,30 @@ orealloc(void *p, size_t newsz)
 
 		if (rnewsz > roldsz) {
 			if (!mopts.malloc_guard) {
-				STATS_INC(g_pool.cheap_realloc_tries);
-				zapcacheregion(g_pool, p + roldsz);
+				STATS_INC(d->cheap_realloc_tries);
+				zapcacheregion(d, p + roldsz);
 				q = MMAPA(p + roldsz, rnewsz - roldsz);
 				if (q == p + roldsz) {
-					malloc_used += rnewsz - roldsz;
+					d->malloc_used += rnewsz - roldsz;
 					if (mopts.malloc_junk)
 						memset(q, SOME_JUNK,
 						    rnewsz - roldsz);
 					r->size = newsz;
-					STATS_INC(g_pool->cheap_reallocs);
+					STATS_INC(d->cheap_reallocs);
 					return p;
 				} else if (q != MAP_FAILED)
 					munmap(q, rnewsz - roldsz);
 			}
 		} else if (rnewsz < roldsz) {
+			/* The old guard page goes to the cache as it is */
 			if (mopts.malloc_guard) {
-				if (mprotect((char *)p + roldsz -
-				    mopts.malloc_guard, mopts.malloc_guard,
-				    PROT_READ | PROT_WRITE))
-					wrterror("mprotect");
 				if (mprotect((char *)p + rnewsz -
 				    mopts.malloc_guard, mopts.malloc_guard,
 				    PROT_NONE))
 					wrterror("mprotect");
 			}
-			unmap(g_pool, (char *)p + rnewsz, roldsz - rnewsz);
+			unmap(d, (char *)p + rnewsz, roldsz - rnewsz,
+			    mopts.malloc_guard != 0);
 			r->size = gnewsz;
 			return p;
 		} else {
@@ -1429,12 +1750,12 @@ orealloc(void *p, size_t newsz)
 			memset((char *)p + newsz, SOME_JUNK, oldsz - newsz);
 		return p;
 	} else if (newsz != oldsz || mopts.malloc_realloc) {
-		q = omalloc(newsz, 0);
+		q = omalloc(d, newsz, 0);
 		if (q == NULL)
 			return NULL;
 		if (newsz != 0 && oldsz != 0)
 			memcpy(q, p, oldsz < newsz ? oldsz : newsz);
-		ofree(p);
+		ofree(d, p);
 		return q;
 	} else
 		return p;
@@ -1443,23 +1764,27 @@ orealloc(void *p, size_t newsz)
 void *
 openbsd_realloc(void *ptr, size_t size)
 {
+	struct dir_info *d;
 	void *r;
 	int saved_errno = errno;
   
-	_MALLOC_LOCK();
 	malloc_func = " in realloc():";  
-	if (g_pool == NULL) {
-		if (malloc_init() != 0)
+	if (ptr == NULL) {
+		if ((d = getpool()) == NULL)
 			return NULL;
+		_POOL_LOCK(d);
+	} else if ((d = findpool(ptr)) == NULL) {
+		wrterror("bogus pointer (double free?)");
+		return NULL;
 	}
-	if (malloc_active++) {
-		malloc_recurse();
+	if (d->active++) {
+		malloc_recurse(d);
 		return NULL;
 	}
-	r = orealloc(ptr, size);
+	r = orealloc(d, ptr, size);
   
-	malloc_active--;
-	_MALLOC_UNLOCK();
+	d->active--;
+	_POOL_UNLOCK(d);
 	if (r == NULL && mopts.malloc_xmalloc) {
 		wrterror("out of memory");
 		errno = ENOMEM;
@@ -1475,34 +1800,32 @@ openbsd_realloc(void *ptr, size_t size)
 void *
 openbsd_calloc(size_t nmemb, size_t size)
 {
+	struct dir_info *d;
 	void *r;
 	int saved_errno = errno;
 
-	_MALLOC_LOCK();
 	malloc_func = " in calloc():";  
-	if (g_pool == NULL) {
-		if (malloc_init() != 0)
-			return NULL;
-	}
+	if ((d = getpool()) == NULL)
+		return NULL;
 	if ((nmemb >= MUL_NO_OVERFLOW || size >= MUL_NO_OVERFLOW) &&
 	    nmemb > 0 && SIZE_MAX / nmemb < size) {
-		_MALLOC_UNLOCK();
 		if (mopts.malloc_xmalloc)
 			wrterror("out of memory");
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	if (malloc_active++) {
-		malloc_recurse();
+	_POOL_LOCK(d);
+	if (d->active++) {
+		malloc_recurse(d);
 		return NULL;
 	}
 
 	size *= nmemb;
-	r = omalloc(size, 1);
+	r = omalloc(d, size, 1);
   
-	malloc_active--;
-	_MALLOC_UNLOCK();
+	d->active--;
+	_POOL_UNLOCK(d);
 	if (r == NULL && mopts.malloc_xmalloc) {
 		wrterror("out of memory");
 		errno = ENOMEM;
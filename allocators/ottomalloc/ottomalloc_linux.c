@@ -35,6 +35,7 @@
 #include <sys/queue.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -228,8 +229,6 @@ static int	malloc_active;		/* status of malloc */
 static size_t	malloc_guarded;		/* bytes used for guards */
 static size_t	malloc_used;		/* bytes allocated */
 
-static size_t rnibblesused;		/* random nibbles used */
-static u_char rbytes[512];		/* random bytes */
 static u_char getrnibble(void);
 
 /* low bits of r->p determine size: 0 means >= page size and p->size holding
@@ -430,11 +429,73 @@ wrterror(char *p)
 		abort();
 }
 
+/*
+ * Random nibbles come from a ChaCha20 keystream of the calling thread,
+ * keyed from the kernel instead of RC4. The stream is keyed anew every
+ * RS_REKEY blocks and in the child after fork().
+ */
+#define RS_REKEY	1024
+
+static __thread struct {
+	u_int32_t input[16];		/* ChaCha20 state */
+	u_char buf[64];			/* current keystream block */
+	size_t left;			/* nibbles of buf not used */
+	size_t blocks;			/* blocks until rekey */
+	pid_t pid;			/* process the stream was keyed in */
+} rs;
+
+#define ROTL32(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) do {				\
+	a += b; d ^= a; d = ROTL32(d, 16);			\
+	c += d; b ^= c; b = ROTL32(b, 12);			\
+	a += b; d ^= a; d = ROTL32(d, 8);			\
+	c += d; b ^= c; b = ROTL32(b, 7);			\
+} while (0)
+
+static void
+rs_rekey(void)
+{
+	static const u_int32_t sigma[4] =
+	    { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+
+	memcpy(rs.input, sigma, sizeof(sigma));
+	/* key, counter and nonce */
+#ifdef SYS_getrandom
+	if (syscall(SYS_getrandom, &rs.input[4], 12 * sizeof(u_int32_t),
+	    0) != 12 * sizeof(u_int32_t))
+#endif
+		/* callers hold _MALLOC_LOCK */
+		arc4random_buf(&rs.input[4], 12 * sizeof(u_int32_t));
+	rs.blocks = RS_REKEY;
+	rs.pid = getpid();
+}
+
 static void
-rbytes_init(void)
+rs_refill(void)
 {
-	arc4random_buf(rbytes, sizeof(rbytes));
-	rnibblesused = 0;
+	u_int32_t x[16];
+	int i;
+
+	if (rs.blocks == 0 || rs.pid != getpid())
+		rs_rekey();
+	memcpy(x, rs.input, sizeof(x));
+	for (i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+		x[i] += rs.input[i];
+	memcpy(rs.buf, x, sizeof(rs.buf));
+	if (++rs.input[12] == 0)
+		rs.input[13]++;
+	rs.blocks--;
+	rs.left = 2 * sizeof(rs.buf);
 }
 
 static inline u_char
@@ -442,10 +503,10 @@ getrnibble(void)
 {
 	u_char x;
 
-	if (rnibblesused >= 2 * sizeof(rbytes))
-		rbytes_init();
-	x = rbytes[rnibblesused++ / 2];
-	return (rnibblesused & 1 ? x & 0xf : x >> 4);
+	if (rs.left == 0)
+		rs_refill();
+	x = rs.buf[--rs.left / 2];
+	return (rs.left & 1 ? x >> 4 : x & 0xf);
 }
 
 /*
@@ -617,8 +678,6 @@ omalloc_init(struct dir_info **dp)
 	size_t d_avail, regioninfo_size;
 	struct dir_info *d;
 
-	rbytes_init();
-
 	/*
 	 * Default options
 	 */
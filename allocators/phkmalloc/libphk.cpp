@@ -1,9 +1,11 @@
 #include <stdlib.h>
+#include <unistd.h>
 
 extern "C" {
   void * phkmalloc (size_t);
   void phkfree (void *);
   size_t phkmalloc_usable_size (void *);
+  int phkmalloc_object_bounds (void *, void **, void **);
 }
 
 
@@ -26,3 +28,17 @@ TheCustomHeapType * getCustomHeap (void) {
 }
 
 #include "wrapper.cpp"
+
+extern "C" int xxmalloc_object_bounds (void * ptr, void ** start, void ** end) {
+  return phkmalloc_object_bounds (ptr, start, end);
+}
+
+// Chunks are powers of two, aligned to their size, and bigger objects
+// start on a page, so any object of at least the alignment is aligned
+// (up to a page). phkfree takes nothing but an object's start.
+extern "C" void * xxmemalign (size_t alignment, size_t sz) {
+  if (alignment > (size_t) getpagesize()) {
+    return NULL;
+  }
+  return phkmalloc ((sz < alignment) ? alignment : sz);
+}
@@ -201,8 +201,33 @@ struct pgfree {
 #define malloc_pagemask	((malloc_pagesize)-1)
 
 #define pageround(foo) (((foo) + (malloc_pagemask))&(~(malloc_pagemask)))
-#define ptr2index(foo) (((u_long)(foo) >> malloc_pageshift)-malloc_origo)
-#define index2ptr(foo) (((u_long)(foo) << malloc_pageshift)+malloc_origo)
+#define ptr2index(foo) ((u_long)(foo) >> malloc_pageshift)
+#define index2ptr(foo) (((u_long)(foo)) << malloc_pageshift)
+
+/*
+ * The page directory is a radix tree over page numbers: a static root,
+ * whose slots point to middle nodes, whose slots point to leaves of one
+ * page each.  Nodes are mmap'ed when pages under them are first mapped,
+ * so the directory costs one leaf per leaf's worth of heap, wherever
+ * in the address space the heap is, and never has to be copied.
+ */
+#if defined(__LP64__) || defined(_LP64)
+#define PD_ADDRBITS	48
+#define PD_PTRSHIFT	3
+#else
+#define PD_ADDRBITS	32
+#define PD_PTRSHIFT	2
+#endif
+
+#define PD_INDEXBITS	(PD_ADDRBITS - malloc_pageshift)
+#define PD_LEAFBITS	(malloc_pageshift - PD_PTRSHIFT)
+#define PD_MIDBITS	((PD_INDEXBITS - PD_LEAFBITS + 1) / 2)
+#define PD_ROOTBITS	(PD_INDEXBITS - PD_LEAFBITS - PD_MIDBITS)
+
+#define PD_LEAFMASK	((1UL << PD_LEAFBITS) - 1)
+#define PD_ROOT(index)	((index) >> (PD_LEAFBITS + PD_MIDBITS))
+#define PD_MID(index)	(((index) >> PD_LEAFBITS) & ((1UL << PD_MIDBITS) - 1))
+#define PD_LEAF(index)	((index) & PD_LEAFMASK)
 
 #ifndef _MALLOC_LOCK
 #define _MALLOC_LOCK()
@@ -223,17 +248,17 @@ struct pgfree {
 /* Number of free pages we cache */
 static unsigned malloc_cache = 16;
 
-/* The offset from pagenumber to index into the page directory */
+/* The first page of the heap */
 static u_long malloc_origo;
 
 /* The last index in the page directory we care about */
 static u_long last_index;
 
-/* Pointer to page directory. Allocated "as if with" malloc */
-static struct	pginfo **page_dir;
+/* Root of the page directory */
+static struct	pginfo ***page_dir[1UL << PD_ROOTBITS];
 
-/* How many slots in the page directory */
-static unsigned	malloc_ninfo;
+/* Pages with free chunks, by the shift of their chunk size */
+static struct	pginfo *chunk_dir[malloc_pageshift];
 
 /* Free pages line up here */
 static struct pgfree free_list;
@@ -300,7 +325,6 @@ static const char *malloc_func;
 /*
  * Necessary function declarations
  */
-static int extend_pgdir(u_long index);
 static void *imalloc(size_t size);
 static void ifree(void *ptr);
 static void *irealloc(void *ptr, size_t size);
@@ -340,6 +364,89 @@ wrtwarning(char *p)
     _malloc_message(_getprogname(), malloc_func, " warning: ", p);
 }
 
+/*
+ * Look up a page in the page directory
+ */
+static __inline struct pginfo *
+pd_get(u_long index)
+{
+    struct pginfo ***mid;
+    struct pginfo **leaf;
+
+    if (index >> PD_INDEXBITS)
+	return (MALLOC_NOT_MINE);
+    mid = page_dir[PD_ROOT(index)];
+    if (mid == NULL)
+	return (MALLOC_NOT_MINE);
+    leaf = mid[PD_MID(index)];
+    if (leaf == NULL)
+	return (MALLOC_NOT_MINE);
+    return (leaf[PD_LEAF(index)]);
+}
+
+/*
+ * Set the entry of a page, whose leaf pd_extend() has made
+ */
+static __inline void
+pd_set(u_long index, struct pginfo *info)
+{
+
+    page_dir[PD_ROOT(index)][PD_MID(index)][PD_LEAF(index)] = info;
+}
+
+/*
+ * Make the leaves of the page directory for pages first to last
+ */
+static int
+pd_extend(u_long first, u_long last)
+{
+    struct pginfo ***mid;
+    struct pginfo **leaf;
+    u_long index;
+
+    if (last >> PD_INDEXBITS)
+	return (0);
+
+    for (index = first & ~PD_LEAFMASK; index <= last;
+	index += PD_LEAFMASK + 1) {
+	mid = page_dir[PD_ROOT(index)];
+	if (mid == NULL) {
+	    mid = (struct pginfo ***)
+		MMAP((1UL << PD_MIDBITS) * sizeof *mid);
+	    if (mid == MAP_FAILED)
+		return (0);
+	    page_dir[PD_ROOT(index)] = mid;
+	}
+	if (mid[PD_MID(index)] == NULL) {
+	    leaf = (struct pginfo **) MMAP(malloc_pagesize);
+	    if (leaf == MAP_FAILED)
+		return (0);
+	    mid[PD_MID(index)] = leaf;
+	}
+    }
+    return (1);
+}
+
+/*
+ * Unmap the leaves of the page directory that lie wholly in pages
+ * first to last.  Their entries must all be MALLOC_NOT_MINE.
+ */
+static void
+pd_trim(u_long first, u_long last)
+{
+    struct pginfo ***mid;
+    u_long index;
+
+    for (index = (first + PD_LEAFMASK) & ~PD_LEAFMASK;
+	index + PD_LEAFMASK <= last; index += PD_LEAFMASK + 1) {
+	mid = page_dir[PD_ROOT(index)];
+	if (mid != NULL && mid[PD_MID(index)] != NULL) {
+	    munmap(mid[PD_MID(index)], malloc_pagesize);
+	    mid[PD_MID(index)] = NULL;
+	}
+    }
+}
+
 /*
  * Allocate a number of pages from the OS
  */
@@ -353,6 +460,9 @@ map_pages(size_t pages)
     if (tail < result)
 	return (NULL);
 
+    if (!pd_extend(ptr2index(result), ptr2index(tail) - 1))
+	return (NULL);
+
     if (brk(tail)) {
 #ifdef MALLOC_EXTRA_SANITY
 	wrterror("(ES): map_pages fails\n");
@@ -363,65 +473,9 @@ map_pages(size_t pages)
     last_index = ptr2index(tail) - 1;
     malloc_brk = tail;
 
-    if ((last_index+1) >= malloc_ninfo && !extend_pgdir(last_index))
-	return (NULL);
-
     return (result);
 }
 
-/*
- * Extend page directory
- */
-static int
-extend_pgdir(u_long index)
-{
-    struct  pginfo **nEW, **old;
-    u_long i, oldlen;
-
-    /* Make it this many pages */
-    i = index * sizeof *page_dir;
-    i /= malloc_pagesize;
-    i += 2;
-
-    /* remember the old mapping size */
-    oldlen = malloc_ninfo * sizeof *page_dir;
-
-    /*
-     * NOTE: we allocate new pages and copy the directory rather than tempt
-     * fate by trying to "grow" the region.. There is nothing to prevent
-     * us from accidently re-mapping space that's been allocated by our caller
-     * via dlopen() or other mmap().
-     *
-     * The copy problem is not too bad, as there is 4K of page index per
-     * 4MB of malloc arena.
-     *
-     * We can totally avoid the copy if we open a file descriptor to associate
-     * the anon mappings with.  Then, when we remap the pages at the new
-     * address, the old pages will be "magically" remapped..  But this means
-     * keeping open a "secret" file descriptor.....
-     */
-
-    /* Get new pages */
-    nEW = (struct pginfo**) MMAP(i * malloc_pagesize);
-    if (nEW == MAP_FAILED)
-	return (0);
-
-    /* Copy the old stuff */
-    memcpy(nEW, page_dir,
-	    malloc_ninfo * sizeof *page_dir);
-
-    /* register the new size */
-    malloc_ninfo = i * malloc_pagesize / sizeof *page_dir;
-
-    /* swap the pointers */
-    old = page_dir;
-    page_dir = nEW;
-
-    /* Now free the old stuff */
-    munmap(old, oldlen);
-    return (1);
-}
-
 /*
  * Initialize the world
  */
@@ -495,20 +549,7 @@ malloc_init(void)
     if (malloc_zero)
 	malloc_junk=1;
 
-    /* Allocate one page for the page directory */
-    page_dir = (struct pginfo **) MMAP(malloc_pagesize);
-
-    if (page_dir == MAP_FAILED)
-	wrterror("mmap(2) failed, check limits\n");
-
-    /*
-     * We need a maximum of malloc_pageshift buckets, steal these from the
-     * front of the page_directory;
-     */
-    malloc_origo = ((u_long)pageround((u_long)sbrk(0))) >> malloc_pageshift;
-    malloc_origo -= malloc_pageshift;
-
-    malloc_ninfo = malloc_pagesize / sizeof *page_dir;
+    malloc_origo = ptr2index(pageround((u_long)sbrk(0)));
 
     /* Recalculate the cache size in bytes, and make sure it's nonzero */
 
@@ -554,9 +595,9 @@ malloc_pages(size_t size)
 	    wrterror("(ES): sick entry on free_list\n");
 	if ((void*)pf->page >= (void*)sbrk(0))
 	    wrterror("(ES): entry on free_list past brk\n");
-	if (page_dir[ptr2index(pf->page)] != MALLOC_FREE)
+	if (pd_get(ptr2index(pf->page)) != MALLOC_FREE)
 	    wrterror("(ES): non-free first page on free-list\n");
-	if (page_dir[ptr2index(pf->end)-1] != MALLOC_FREE)
+	if (pd_get(ptr2index(pf->end)-1) != MALLOC_FREE)
 	    wrterror("(ES): non-free last page on free-list\n");
 #endif /* MALLOC_EXTRA_SANITY */
 
@@ -579,7 +620,7 @@ malloc_pages(size_t size)
     }
 
 #ifdef MALLOC_EXTRA_SANITY
-    if (p != NULL && page_dir[ptr2index(p)] != MALLOC_FREE)
+    if (p != NULL && pd_get(ptr2index(p)) != MALLOC_FREE)
 	wrterror("(ES): allocated non-free page on free-list\n");
 #endif /* MALLOC_EXTRA_SANITY */
 
@@ -592,9 +633,9 @@ malloc_pages(size_t size)
     if (p != NULL) {
 
 	index = ptr2index(p);
-	page_dir[index] = MALLOC_FIRST;
+	pd_set(index, MALLOC_FIRST);
 	for (i=1;i<size;i++)
-	    page_dir[index+i] = MALLOC_FOLLOW;
+	    pd_set(index+i, MALLOC_FOLLOW);
 
 	if (malloc_junk)
 	    memset(p, SOME_JUNK, size << malloc_pageshift);
@@ -670,10 +711,10 @@ malloc_make_chunks(int bits)
 
     /* MALLOC_LOCK */
 
-    page_dir[ptr2index(pp)] = bp;
+    pd_set(ptr2index(pp), bp);
 
-    bp->next = page_dir[bits];
-    page_dir[bits] = bp;
+    bp->next = chunk_dir[bits];
+    chunk_dir[bits] = bp;
 
     /* MALLOC_UNLOCK */
 
@@ -703,10 +744,10 @@ malloc_bytes(size_t size)
 	j++;
 
     /* If it's empty, make a page more of that size chunks */
-    if (page_dir[j] == NULL && !malloc_make_chunks(j))
+    if (chunk_dir[j] == NULL && !malloc_make_chunks(j))
 	return (NULL);
 
-    bp = page_dir[j];
+    bp = chunk_dir[j];
 
     /* Find first word of bitmap which isn't empty */
     for (lp = bp->bits; !*lp; lp++)
@@ -723,7 +764,7 @@ malloc_bytes(size_t size)
 
     /* If there are no more free, remove from free-list */
     if (!--bp->free) {
-	page_dir[j] = bp->next;
+	chunk_dir[j] = bp->next;
 	bp->next = NULL;
     }
 
@@ -750,8 +791,8 @@ imalloc(size_t size)
 
     if ((size + malloc_pagesize) < size)	/* Check for overflow */
 	result = NULL;
-    else if ((size + malloc_pagesize) >= (uintptr_t)page_dir)
-	result = NULL;
+    else if (((size + malloc_pagesize) >> malloc_pageshift) >> PD_INDEXBITS)
+	result = NULL;				/* More than the address space */
     else if (size <= malloc_maxsize)
 	result = malloc_bytes(size);
     else
@@ -770,8 +811,8 @@ static void *
 irealloc(void *ptr, size_t size)
 {
     void *p;
-    u_long osize, index;
-    struct pginfo **mp;
+    u_long osize, index, j;
+    struct pginfo *info;
     int i;
 
     if (suicide)
@@ -780,7 +821,7 @@ irealloc(void *ptr, size_t size)
     index = ptr2index(ptr);
 
 #ifdef MALLOC_SANITY	/* <eric> */
-    if (index < malloc_pageshift) {
+    if (index < malloc_origo) {
 	wrtwarning("junk pointer, too low to make sense\n");
 	return (NULL);
     }
@@ -791,9 +832,9 @@ irealloc(void *ptr, size_t size)
     }
 #endif	/* <eric> MALLOC_SANITY */
 
-    mp = &page_dir[index];
+    info = pd_get(index);
 
-    if (*mp == MALLOC_FIRST) {			/* Page allocation */
+    if (info == MALLOC_FIRST) {			/* Page allocation */
 
 #ifdef MALLOC_SANITY	/* <eric> */
 	/* Check the pointer */
@@ -804,7 +845,8 @@ irealloc(void *ptr, size_t size)
 #endif	/* <eric> MALLOC_SANITY	*/
 
 	/* Find the size in bytes */
-	for (osize = malloc_pagesize; *(++mp) == MALLOC_FOLLOW;)
+	for (osize = malloc_pagesize, j = index + 1;
+	    pd_get(j) == MALLOC_FOLLOW; j++)
 	    osize += malloc_pagesize;
 
         if (!malloc_realloc && 			/* Unless we have to, */
@@ -815,26 +857,26 @@ irealloc(void *ptr, size_t size)
 	    return (ptr);			/* ..don't do anything else. */
 	}
 
-    } else if (*mp >= MALLOC_MAGIC) {		/* Chunk allocation */
+    } else if (info >= MALLOC_MAGIC) {		/* Chunk allocation */
 
 #ifdef MALLOC_SANITY	/* <eric> */
 	/* Check the pointer for sane values */
-	if (((u_long)ptr & ((*mp)->size-1))) {
+	if (((u_long)ptr & (info->size-1))) {
 	    wrtwarning("modified (chunk-) pointer\n");
 	    return (NULL);
 	}
 #endif	/* <eric> MALLOC_SANITY */
 
 	/* Find the chunk index in the page */
-	i = ((u_long)ptr & malloc_pagemask) >> (*mp)->shift;
+	i = ((u_long)ptr & malloc_pagemask) >> info->shift;
 
 	/* Verify that it isn't a free chunk already */
-        if ((*mp)->bits[i/MALLOC_BITS] & (1<<(i%MALLOC_BITS))) {
+        if (info->bits[i/MALLOC_BITS] & (1<<(i%MALLOC_BITS))) {
 	    wrtwarning("chunk is already free\n");
 	    return (NULL);
 	}
 
-	osize = (*mp)->size;
+	osize = info->size;
 
 	if (!malloc_realloc &&		/* Unless we have to, */
 	  size <= osize && 		/* ..or are too small, */
@@ -895,9 +937,9 @@ free_pages(void *ptr, u_long index, struct pginfo const *info)
 #endif	/* <eric> MALLOC_SANITY	*/
 
     /* Count how many pages and mark them free at the same time */
-    page_dir[index] = MALLOC_FREE;
-    for (i = 1; page_dir[index+i] == MALLOC_FOLLOW; i++)
-	page_dir[index + i] = MALLOC_FREE;
+    pd_set(index, MALLOC_FREE);
+    for (i = 1; pd_get(index+i) == MALLOC_FOLLOW; i++)
+	pd_set(index + i, MALLOC_FREE);
 
     l = i << malloc_pageshift;
 
@@ -992,11 +1034,10 @@ free_pages(void *ptr, u_long index, struct pginfo const *info)
 	index = ptr2index(pf->end);
 
 	for(i=index;i <= last_index;)
-	    page_dir[i++] = MALLOC_NOT_MINE;
+	    pd_set(i++, MALLOC_NOT_MINE);
 
+	pd_trim(index, last_index);
 	last_index = index - 1;
-
-	/* XXX: We could realloc/shrink the pagedir here I guess. */
     }
     if (pt != NULL)
 	ifree(pt);
@@ -1034,13 +1075,13 @@ free_bytes(void *ptr, u_long index, struct pginfo *info)
     info->bits[i/MALLOC_BITS] |= 1<<(i%MALLOC_BITS);
     info->free++;
 
-    mp = page_dir + info->shift;
+    mp = chunk_dir + info->shift;
 
     if (info->free == 1) {
 
 	/* Page became non-full */
 
-	mp = page_dir + info->shift;
+	mp = chunk_dir + info->shift;
 	/* Insert in address order */
 	while (*mp && (*mp)->next && (*mp)->next->page < info->page)
 	    mp = &(*mp)->next;
@@ -1063,7 +1104,7 @@ free_bytes(void *ptr, u_long index, struct pginfo *info)
     *mp = info->next;
 
     /* Free the page & the info structure if need be */
-    page_dir[ptr2index(info->page)] = MALLOC_FIRST;
+    pd_set(ptr2index(info->page), MALLOC_FIRST);
     vp = info->page;		/* Order is important ! */
     if(vp != (void*)info)
 	ifree(info);
@@ -1087,7 +1128,7 @@ ifree(void *ptr)
     index = ptr2index(ptr);
 
 #ifdef MALLOC_SANITY	/* <eric> */
-    if (index < malloc_pageshift) {
+    if (index < malloc_origo) {
 	wrtwarning("junk pointer, too low to make sense\n");
 	return;
     }
@@ -1098,7 +1139,7 @@ ifree(void *ptr)
     }
 #endif	/* <eric> MALLOC_SANITY */
 
-    info = page_dir[index];
+    info = pd_get(index);
 
     if (info < MALLOC_MAGIC)
         free_pages(ptr, index, info);
@@ -1213,11 +1254,11 @@ phkmalloc_usable_size(void * ptr) {			/* <eric> */
   //	malloc_func = " in getsize():";
   u_long index = ptr2index(ptr);
 
-  if ((index < malloc_pageshift) || (index > last_index)) {
+  if ((index < malloc_origo) || (index > last_index)) {
     return sz; // Maximum possible size.
   }
 
-  struct pginfo * info = page_dir[index];
+  struct pginfo * info = pd_get(index);
   
   if (info < MALLOC_MAGIC) {
     if (info == MALLOC_FREE) {
@@ -1245,10 +1286,10 @@ phkmalloc_usable_size(void * ptr) {			/* <eric> */
        to the end of the allocated space for this object. */
 
     u_long i;
-    for (i = 1; page_dir[index+i] == MALLOC_FOLLOW; i++)
+    for (i = 1; pd_get(index+i) == MALLOC_FOLLOW; i++)
       ;
     
-    sz = i << malloc_pageshift  - ((size_t) ptr & (malloc_pagesize - 1));
+    sz = (i << malloc_pageshift) - ((size_t) ptr & (malloc_pagesize - 1));
   }
   else {
     sz = info->size - ((size_t) ptr & (info->size - 1));
@@ -1257,17 +1298,57 @@ phkmalloc_usable_size(void * ptr) {			/* <eric> */
 }
 
 
+/* <EDB> The allocated object that ptr points into (at its start or
+   anywhere inside it), without a lock: [*start, *end). Returns 0 if
+   ptr is not in one. Chunks are found with one page directory lookup;
+   multi-page objects by scanning the directory across them. */
+int
+phkmalloc_object_bounds (void * ptr, void ** start, void ** end) {
+  u_long index = ptr2index(ptr);
+  u_long i, j;
+  struct pginfo * info;
+
+  if ((index < malloc_origo) || (index > last_index)) {
+    return 0;
+  }
+
+  info = pd_get(index);
+
+  if (info < MALLOC_MAGIC) {
+    if ((info != MALLOC_FIRST) && (info != MALLOC_FOLLOW)) {
+      return 0;
+    }
+    for (i = index; pd_get(i) == MALLOC_FOLLOW; i--)
+      ;
+    for (j = index + 1; (j <= last_index) && (pd_get(j) == MALLOC_FOLLOW); j++)
+      ;
+    *start = (void *) index2ptr(i);
+    *end = (void *) index2ptr(j);
+  } else {
+    /* Chunks are aligned to their (power of two) size. */
+    i = ((u_long) ptr & malloc_pagemask) >> info->shift;
+    if (info->bits[i / MALLOC_BITS] & (1 << (i % MALLOC_BITS))) {
+      /* A free chunk. */
+      return 0;
+    }
+    *start = (void *) ((u_long) ptr & ~((u_long) info->size - 1));
+    *end = (char *) *start + info->size;
+  }
+  return 1;
+}
+
+
 void *
 phkmalloc_normalize (void * ptr) {
   // First, check to see if this is a heap object.
   // If not, return NULL.
   u_long index = ptr2index(ptr);
 
-  if ((index < malloc_pageshift) || (index > last_index)) {
+  if ((index < malloc_origo) || (index > last_index)) {
     return NULL;
   }
 
-  struct pginfo * info = page_dir[index];
+  struct pginfo * info = pd_get(index);
   
   if (info < MALLOC_MAGIC) {
     if (info == MALLOC_FREE) {
@@ -1293,7 +1374,7 @@ phkmalloc_normalize (void * ptr) {
     /* March backwards until we find the first page. */
 
     u_long i;
-    for (i = 0; page_dir[index-i] != MALLOC_FIRST; i++)
+    for (i = 0; pd_get(index-i) != MALLOC_FIRST; i++)
       ;
 
     return (void *) index2ptr(index-i);
@@ -153,6 +153,8 @@ struct pginfo {
     u_short		bumped;
     u_char		*cur_ptr;
     size_t		*free_list;
+    struct reap		*reap;	/* Reap owning this page, or NULL */
+    struct pginfo	*reap_next; /* next page of the same reap */
 };
 
 /*
@@ -222,6 +224,22 @@ struct pgfree {
 #endif
 /* <eric> end */
 
+/*
+ * A region of chunks and page runs that is released all at once.  Its
+ * chunk pages line up in their own buckets (like the size classes in
+ * front of page_dir) and stay with the reap until reap_destroy() hands
+ * them back, so that never has to look at individual chunks.
+ */
+
+struct reap {
+    struct pginfo	*buckets[malloc_sizeclasses]; /* pages with free chunks */
+    struct pginfo	*pages;	/* every chunk page of this reap */
+    struct pgfree	runs;	/* page runs of this reap */
+};
+
+/* The buckets chunks of reap r come from */
+#define reap_buckets(r)	((r) != NULL ? (r)->buckets : page_dir)
+
 /* A mask for the offset inside a page.  */
 #define malloc_pagemask	((malloc_pagesize)-1)
 
@@ -316,6 +334,9 @@ const char *_malloc_options;
 /* Name of the current public function */
 static const char *malloc_func;
 
+/* Set when initialization has been done */
+static unsigned malloc_started;
+
 /* Macro for mmap */
 #define MMAP(size) \
 	mmap(NULL, (size), PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, \
@@ -646,7 +667,7 @@ malloc_pages(size_t size)
 
 static __inline int
 /* <eric> malloc_make_chunks(int bits) */
-malloc_make_chunks(int chunksize)	/* <eric> the input is now the chunk size */
+malloc_make_chunks(struct reap *r, int chunksize)	/* <eric> the input is now the chunk size */
 {
     struct  pginfo *bp;
     void *pp;
@@ -691,6 +712,12 @@ malloc_make_chunks(int chunksize)	/* <eric> the input is now the chunk size */
 		}
     }
 
+    bp->reap = r;
+    if (r != NULL) {
+	bp->reap_next = r->pages;
+	r->pages = bp;
+    }
+
     /* MALLOC_LOCK */
 
     page_dir[ptr2index(pp)] = bp;
@@ -701,8 +728,8 @@ malloc_make_chunks(int chunksize)	/* <eric> the input is now the chunk size */
 	*/
 
 	/* <eric> start */
-    bp->next = page_dir[chunksize / malloc_sizedistance - 1];
-    page_dir[chunksize / malloc_sizedistance - 1] = bp;
+    bp->next = reap_buckets(r)[chunksize / malloc_sizedistance - 1];
+    reap_buckets(r)[chunksize / malloc_sizedistance - 1] = bp;
 	/* <eric> end */
 
     /* MALLOC_UNLOCK */
@@ -714,7 +741,7 @@ malloc_make_chunks(int chunksize)	/* <eric> the input is now the chunk size */
  * Allocate a fragment
  */
 static void *
-malloc_bytes(size_t size)
+malloc_bytes(struct reap *r, size_t size)
 {
     int i,j;
     u_int u;
@@ -737,10 +764,10 @@ malloc_bytes(size_t size)
 
     /* If it's empty, make a page more of that size chunks */
     /* <eric> if (page_dir[j] == NULL && !malloc_make_chunks(j)) */
-    if (page_dir[j] == NULL && !malloc_make_chunks((j + 1) * malloc_sizedistance))	/* <eric> */
+    if (reap_buckets(r)[j] == NULL && !malloc_make_chunks(r, (j + 1) * malloc_sizedistance))	/* <eric> */
 	return (NULL);
 
-    bp = page_dir[j];
+    bp = reap_buckets(r)[j];
 
 	u_char *ptr;
 	if (bp->bumped < bp->total) {	/* <eric> we can still do pointer-bumping */
@@ -755,7 +782,7 @@ malloc_bytes(size_t size)
 
     /* If there are no more free, remove from free-list */
     if (!--bp->free) {
-	page_dir[j] = bp->next;
+	reap_buckets(r)[j] = bp->next;
 	bp->next = NULL;
     }
 
@@ -781,7 +808,7 @@ imalloc(size_t size)
     else if ((size + malloc_pagesize) >= (uintptr_t)page_dir)
 	result = NULL;
     else if (size <= malloc_maxsize)
-	result = malloc_bytes(size);
+	result = malloc_bytes(NULL, size);
     else
 	result = malloc_pages(size);
 
@@ -1052,7 +1079,7 @@ free_bytes(void *ptr, u_long index, struct pginfo *info)
     info->free++;
 
     /* <eric> mp = page_dir + info->shift; */
-    mp = page_dir + info->size / malloc_sizedistance - 1;	/* <eric> */
+    mp = reap_buckets(info->reap) + info->size / malloc_sizedistance - 1;	/* <eric> */
 
     if (info->free == 1) {
 
@@ -1067,7 +1094,8 @@ free_bytes(void *ptr, u_long index, struct pginfo *info)
 	return;
     }
 
-    if (info->free != info->total)
+    /* Pages of a reap are only given back by reap_destroy() */
+    if (info->free != info->total || info->reap != NULL)
 	return;
 
     /* Find & remove this page in the queue */
@@ -1132,7 +1160,6 @@ pubrealloc(void *ptr, size_t size, const char *func)
     void *r;
     int err = 0;
     static int malloc_active; /* Recusion flag for public interface. */
-    static unsigned malloc_started; /* Set when initialization has been done */
 
 #ifdef MALLOC_SANITY	/* <eric> */
     /*
@@ -1267,3 +1294,140 @@ phkgetsize(void * ptr) {			/* <eric> */
 	else
 		return info->size;
 }
+
+/*
+ * The reap interface.  All objects of a reap are released together by
+ * reap_destroy(), which walks the reap's pages and runs instead of its
+ * objects.  reap_free() may still give single objects back early, but
+ * their pages stay with the reap until it is destroyed.  Objects of
+ * more than malloc_maxsize must not be passed to phkfree() or phkrealloc().
+ */
+
+struct reap *
+reap_create(void)	/* <eric> */
+{
+    struct reap *r;
+
+    _MALLOC_LOCK();
+    malloc_func = " in reap_create():";
+    if (!malloc_started) {
+	malloc_init();
+	malloc_started = 1;
+    }
+    r = (struct reap *)imalloc(sizeof *r);
+    if (r != NULL)
+	memset(r, 0, sizeof *r);
+    _MALLOC_UNLOCK();
+    if (r == NULL)
+	errno = ENOMEM;
+    return (r);
+}
+
+void *
+reap_malloc(struct reap *r, size_t size)	/* <eric> */
+{
+    struct pgfree *pf;
+    void *result;
+
+    _MALLOC_LOCK();
+    malloc_func = " in reap_malloc():";
+    if (!size)
+	size = 1;
+
+    if (size <= malloc_maxsize) {
+	result = malloc_bytes(r, size);
+    } else if (size + malloc_pagesize < size) {	/* Check for overflow */
+	result = NULL;
+    } else if ((pf = (struct pgfree *)imalloc(sizeof *pf)) == NULL) {
+	result = NULL;
+    } else if ((result = malloc_pages(size)) == NULL) {
+	ifree(pf);
+    } else {
+	/* Remember the run, so that reap_destroy() finds it */
+	pf->page = result;
+	pf->size = pageround(size);
+	pf->end = (char *)result + pf->size;
+	pf->prev = &r->runs;
+	pf->next = r->runs.next;
+	if (pf->next != NULL)
+	    pf->next->prev = pf;
+	r->runs.next = pf;
+    }
+
+    if (malloc_zero && result != NULL)
+	memset(result, 0, size);
+    _MALLOC_UNLOCK();
+
+    if (result == NULL)
+	errno = ENOMEM;
+    return (result);
+}
+
+void
+reap_free(struct reap *r, void *ptr)	/* <eric> */
+{
+    struct pginfo *info;
+    struct pgfree *pf;
+
+    if (ptr == NULL)
+	return;
+
+    _MALLOC_LOCK();
+    malloc_func = " in reap_free():";
+    info = page_dir[ptr2index(ptr)];
+
+    if (info >= MALLOC_MAGIC) {
+	if (info->reap != r)
+	    wrtwarning("chunk is not from this reap\n");
+	else
+	    free_bytes(ptr, ptr2index(ptr), info);
+	_MALLOC_UNLOCK();
+	return;
+    }
+
+    for (pf = r->runs.next; pf != NULL && pf->page != ptr; pf = pf->next)
+	;
+    if (pf == NULL) {
+	wrtwarning("pages are not from this reap\n");
+    } else {
+	pf->prev->next = pf->next;
+	if (pf->next != NULL)
+	    pf->next->prev = pf->prev;
+	ifree(pf);
+	ifree(ptr);
+    }
+    _MALLOC_UNLOCK();
+}
+
+void
+reap_destroy(struct reap *r)	/* <eric> */
+{
+    struct pginfo *info, *next;
+    struct pgfree *pf, *pfnext;
+    void *vp;
+
+    if (r == NULL)
+	return;
+
+    _MALLOC_LOCK();
+    malloc_func = " in reap_destroy():";
+
+    /* Hand back every chunk page, whatever is still allocated on it */
+    for (info = r->pages; info != NULL; info = next) {
+	next = info->reap_next;
+	page_dir[ptr2index(info->page)] = MALLOC_FIRST;
+	vp = info->page;		/* Order is important ! */
+	if (vp != (void *)info)
+	    ifree(info);
+	ifree(vp);
+    }
+
+    for (pf = r->runs.next; pf != NULL; pf = pfnext) {
+	pfnext = pf->next;
+	ifree(pf->page);
+	ifree(pf);
+    }
+
+    ifree(r);
+    _MALLOC_UNLOCK();
+}
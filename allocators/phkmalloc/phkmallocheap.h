@@ -6,6 +6,13 @@ extern "C" {
 	void phkfree(void *);
 	//void * phkrealloc(void *, size_t);
 	size_t phkgetsize(void *);
+
+	/* Regions, only in phkmalloc_reap.c */
+	struct reap;
+	struct reap * reap_create(void);
+	void * reap_malloc(struct reap *, size_t);
+	void reap_free(struct reap *, void *);
+	void reap_destroy(struct reap *);
 }
 
 namespace HL {
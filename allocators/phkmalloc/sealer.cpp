@@ -16,6 +16,18 @@ extern "C" {
   typedef void * memcpy_function_type (void *, const void *, size_t);
   typedef size_t fread_function_type (void *, size_t, size_t, FILE *);
   size_t phkmalloc_usable_size (void * ptr);
+  int phkmalloc_object_bounds (void * ptr, void ** start, void ** end);
+}
+
+// The space from ptr to the end of the heap object it is in, or -1
+// if it is not in the heap (and 0 if it is in a free page).
+static size_t roomAt (void * ptr) {
+  void * start;
+  void * end;
+  if (phkmalloc_object_bounds (ptr, &start, &end)) {
+    return (char *) end - (char *) ptr;
+  }
+  return phkmalloc_usable_size (ptr);
 }
 
 static sprintf_function_type * my_sprintf_fn;
@@ -61,7 +73,7 @@ extern "C" {
   size_t fread (void * ptr, size_t size, size_t nmemb, FILE * stream)
   {
     Initialize me;
-    size_t sz = phkmalloc_usable_size (ptr);
+    size_t sz = roomAt (ptr);
     if (sz == -1) {
       return (*my_fread_fn)(ptr, size, nmemb, stream);
     } else {
@@ -73,7 +85,7 @@ extern "C" {
 
   void * memcpy (void * dest, const void * src, size_t n) {
     Initialize me;
-    size_t sz = phkmalloc_usable_size (dest);
+    size_t sz = roomAt (dest);
     size_t s = (n < sz) ? n : sz;
     return (*my_memcpy_fn) (dest, src, s);
   }
@@ -82,7 +94,7 @@ extern "C" {
     Initialize me;
     va_list ap;
     va_start (ap, format);
-    size_t sz = phkmalloc_usable_size (str);
+    size_t sz = roomAt (str);
     if (sz == -1) {
       int r = vsprintf (str, format, ap);
       va_end (ap);
@@ -98,7 +110,7 @@ extern "C" {
     Initialize me;
     va_list ap;
     va_start (ap, format);
-    size_t sz = phkmalloc_usable_size (str);
+    size_t sz = roomAt (str);
     size_t s = (n < sz) ? n : sz;
     int r = vsnprintf (str, s, format, ap);
     va_end (ap);
@@ -107,7 +119,7 @@ extern "C" {
 
   char * fgets (char * s, int size, FILE * stream) {
     Initialize me;
-    size_t sz = phkmalloc_usable_size (s);
+    size_t sz = roomAt (s);
     if (sz == -1) {
       return (*my_fgets_fn) (s, size, stream);
     } else {
@@ -118,12 +130,12 @@ extern "C" {
 
   char * gets (char * s) {
     Initialize me;
-    return (*my_fgets_fn) (s, phkmalloc_usable_size(s), stdin);
+    return (*my_fgets_fn) (s, roomAt (s), stdin);
   }
 
   char * strcpy (char * dest, const char * src) {
     Initialize me;
-    size_t sz = phkmalloc_usable_size (dest);
+    size_t sz = roomAt (dest);
     if (sz == -1) {
       return (*my_strcpy_fn) (dest, src);
     } else {
@@ -135,14 +147,14 @@ extern "C" {
 
   char * strncpy (char * dest, const char * src, size_t n) {
     Initialize me;
-    size_t sz = phkmalloc_usable_size (dest);
+    size_t sz = roomAt (dest);
     size_t s = (n < sz) ? n : sz;
     return (*my_strncpy_fn) (dest, src, s);
   }
 
   char * strcat (char * dest, const char * src) {
     Initialize me;
-    size_t sz = phkmalloc_usable_size (dest);
+    size_t sz = roomAt (dest);
     if (sz == -1) {
       return (*my_strcat_fn) (dest, src);
     } else {
@@ -152,7 +164,7 @@ extern "C" {
 
   char * strncat (char * dest, const char * src, size_t n) {
     Initialize me;
-    size_t sz = phkmalloc_usable_size (dest);
+    size_t sz = roomAt (dest);
     size_t s = (n < sz) ? n : sz;
     return (*my_strncat_fn) (dest, src, s);
   }
@@ -35,6 +35,15 @@
    threshold can be fulfilled without creating too many heaps.  */
 
 
+/* Maximum number of arenas that arena_get2() selects from by hashing,
+   and how many of them it tries before creating a new one.  */
+#ifndef ARENA_MAX
+#define ARENA_MAX 256
+#endif
+#ifndef ARENA_PROBE_MAX
+#define ARENA_PROBE_MAX 4
+#endif
+
 #ifndef THREAD_STATS
 #define THREAD_STATS 0
 #endif
@@ -42,6 +51,44 @@
 /* If THREAD_STATS is non-zero, some statistics on mutex locking are
    computed.  */
 
+/* If ARENA_RECLAIM is non-zero, an arena is considered idle once the
+   last thread attached to it exits.  The pages inside its free chunks
+   are then returned to the system with madvise(), and the arena is
+   put on a free list, to be handed to the next thread that would
+   otherwise create a new arena.  This needs a thread exit hook from
+   thread-m.h.  */
+
+#ifndef ARENA_RECLAIM
+#if USE_ARENAS && defined thread_exit_key_create && defined MADV_DONTNEED
+#define ARENA_RECLAIM 1
+#else
+#define ARENA_RECLAIM 0
+#endif
+#endif
+
+/* If THREAD_CACHE is non-zero, each thread keeps small freed chunks
+   in a private cache and hands them out again without locking any
+   arena.  This needs __thread support and a thread exit hook from
+   thread-m.h.  */
+
+#ifndef THREAD_CACHE
+#if !defined NO_THREADS && defined thread_exit_key_create && \
+    defined __GNUC__ && !defined _LIBC
+#define THREAD_CACHE 1
+#else
+#define THREAD_CACHE 0
+#endif
+#endif
+
+/* Compiler barriers for publishing new arenas; enough on the
+   platforms with strongly ordered stores that this runs on.  */
+#ifndef atomic_write_barrier
+#define atomic_write_barrier() __asm ("" ::: "memory")
+#endif
+#ifndef atomic_read_barrier
+#define atomic_read_barrier() atomic_write_barrier ()
+#endif
+
 /***************************************************************************/
 
 #define top(ar_ptr) ((ar_ptr)->top)
@@ -63,6 +110,31 @@ typedef struct _heap_info {
 static tsd_key_t arena_key;
 static mutex_t list_lock;
 
+/* The first ARENA_MAX arenas, main_arena first.  Entries are only
+   ever appended (under list_lock), so the vector can be read without
+   locking once narenas has been read.  */
+
+static mstate arena_vec[ARENA_MAX];
+static int narenas;
+
+/* Idle arenas, linked through next_free.  free_list_lock is always
+   the innermost lock and only held briefly, so the fork handlers
+   just re-initialize it in the child. */
+
+static mstate free_list;
+static mutex_t free_list_lock;
+#if ARENA_RECLAIM
+static thread_exit_key_t arena_exit_key;
+static void arena_thread_exit __MALLOC_P((Void_t *));
+#endif
+#if USE_ARENAS
+static void arena_thread_attach __MALLOC_P((mstate));
+#endif
+#if THREAD_CACHE
+static thread_exit_key_t tcache_key;
+static void tcache_thread_exit __MALLOC_P((Void_t *));
+#endif
+
 #if THREAD_STATS
 static int stat_n_heaps;
 #define THREAD_STAT(x) x
@@ -82,21 +154,37 @@ int __malloc_initialized = -1;
 
 /* arena_get() acquires an arena and locks the corresponding mutex.
    First, try the one last locked successfully by this thread.  (This
-   is the common case and handled with a macro for speed.)  Then, loop
-   once over the circularly linked list of arenas.  If no arena is
-   readily available, create a new one.  In this latter case, `size'
-   is just a hint as to how much memory will be required immediately
-   in the new arena. */
+   is the common case and handled with a macro for speed.)  Then, try
+   up to ARENA_PROBE_MAX arenas, starting at a slot of arena_vec[]
+   derived from the calling thread, so that threads whose own arena
+   is busy spread out instead of all walking the list from
+   main_arena.  If no arena is readily available, create a new one.
+   In this latter case, `size' is just a hint as to how much memory
+   will be required immediately in the new arena. */
 
 #define arena_get(ptr, size) do { \
   Void_t *vptr = NULL; \
   ptr = (mstate)tsd_getspecific(arena_key, vptr); \
   if(ptr && !mutex_trylock(&ptr->mutex)) { \
     THREAD_STAT(++(ptr->stat_lock_direct)); \
+    arena_thread_check(ptr); \
   } else \
     ptr = arena_get2(ptr, (size)); \
 } while(0)
 
+/* The thread-specific arena pointer may be shared with other threads
+   (see USE_TSD_DATA_HACK), so also make sure that a thread using its
+   arena is counted as attached to it. */
+
+#if ARENA_RECLAIM
+#define arena_thread_check(a) do { \
+  if(thread_exit_get(arena_exit_key) != (Void_t *)(a)) \
+    arena_thread_attach(a); \
+} while(0)
+#else
+#define arena_thread_check(a) do ; while(0)
+#endif
+
 /* find the heap and corresponding arena for a given ptr */
 
 #define heap_for_ptr(ptr) \
@@ -275,6 +363,7 @@ ptmalloc_unlock_all2 __MALLOC_P((void))
     if(ar_ptr == &main_arena) break;
   }
   (void)mutex_init(&list_lock);
+  (void)mutex_init(&free_list_lock);
 }
 
 #else
@@ -357,10 +446,23 @@ ptmalloc_init __MALLOC_P((void))
 #endif /* !defined NO_THREADS */
   mutex_init(&main_arena.mutex);
   main_arena.next = &main_arena;
+  arena_vec[0] = &main_arena;
+  narenas = 1;
+
+  main_arena.attached_threads = 1;
 
   mutex_init(&list_lock);
+  mutex_init(&free_list_lock);
   tsd_key_create(&arena_key, NULL);
   tsd_setspecific(arena_key, (Void_t *)&main_arena);
+#if THREAD_CACHE
+  /* Created first, so that an exiting thread flushes its cache before
+     it detaches from its arena. */
+  thread_exit_key_create(&tcache_key, tcache_thread_exit);
+#endif
+#if ARENA_RECLAIM
+  thread_exit_key_create(&arena_exit_key, arena_thread_exit);
+#endif
   thread_atfork(ptmalloc_lock_all, ptmalloc_unlock_all, ptmalloc_unlock_all2);
 #ifndef NO_THREADS
   __malloc_hook = save_malloc_hook;
@@ -635,6 +737,151 @@ heap_trim(heap, pad) heap_info *heap; size_t pad;
   return 1;
 }
 
+#if ARENA_RECLAIM
+
+/* Remove an arena from free_list, if it is there.  Called with
+   free_list_lock held. */
+
+static void
+#if __STD_C
+free_list_remove(mstate a)
+#else
+free_list_remove(a) mstate a;
+#endif
+{
+  mstate *link;
+
+  for(link = &free_list; *link; link = &(*link)->next_free)
+    if(*link == a) {
+      *link = a->next_free;
+      a->next_free = 0;
+      break;
+    }
+}
+
+/* Release the pages inside a free chunk, keeping its header and bin
+   links. */
+
+static void
+#if __STD_C
+chunk_discard(mchunkptr p, unsigned long pagesz)
+#else
+chunk_discard(p, pagesz) mchunkptr p; unsigned long pagesz;
+#endif
+{
+  unsigned long start, end;
+
+  start = ((unsigned long)p + sizeof(struct malloc_chunk) + pagesz - 1) &
+    ~(pagesz - 1);
+  end = ((unsigned long)p + chunksize(p)) & ~(pagesz - 1);
+  if(end > start)
+    madvise((char *)start, end - start, MADV_DONTNEED);
+}
+
+/* Trim an arena and release the pages inside all its free chunks,
+   not just top, while keeping them mapped. */
+
+static void
+internal_function
+#if __STD_C
+arena_discard(mstate a)
+#else
+arena_discard(a) mstate a;
+#endif
+{
+  unsigned long pagesz = mp_.pagesize;
+  mbinptr b;
+  mchunkptr p;
+  int i;
+
+  if(have_fastchunks(a))
+    malloc_consolidate(a);
+  heap_trim(heap_for_ptr(top(a)), mp_.top_pad);
+  for(i = 1; i < NBINS; i++) {
+    b = bin_at(a, i);
+    for(p = last(b); p != b; p = p->bk)
+      chunk_discard(p, pagesz);
+  }
+  chunk_discard(top(a), pagesz);
+}
+
+/* Destructor for arena_exit_key.  If the exiting thread was the last
+   one attached to its arena, put the arena on free_list and trim
+   it. */
+
+static void
+#if __STD_C
+arena_thread_exit(Void_t *arg)
+#else
+arena_thread_exit(arg) Void_t *arg;
+#endif
+{
+  mstate a = (mstate)arg;
+  int idle;
+
+  (void)mutex_lock(&free_list_lock);
+  idle = --a->attached_threads == 0 && a != &main_arena;
+  if(idle) {
+    free_list_remove(a);
+    a->next_free = free_list;
+    free_list = a;
+  }
+  (void)mutex_unlock(&free_list_lock);
+  if(!idle)
+    return;
+
+  /* Threads looking for an arena may take this one from free_list
+     right away; they wait for the trim below instead of creating
+     another arena.  If the arena is locked already, it is in use
+     again, so leave it alone. */
+  if(mutex_trylock(&a->mutex))
+    return;
+  arena_discard(a);
+  (void)mutex_unlock(&a->mutex);
+}
+
+#endif /* ARENA_RECLAIM */
+
+/* Record that the calling thread now works with arena a, which it has
+   locked. */
+
+static void
+#if __STD_C
+arena_thread_attach(mstate a)
+#else
+arena_thread_attach(a) mstate a;
+#endif
+{
+#if ARENA_RECLAIM
+  mstate old = (mstate)thread_exit_get(arena_exit_key);
+
+  if(old == a)
+    return;
+  (void)mutex_lock(&free_list_lock);
+  if(old)
+    old->attached_threads--;
+  if(a->attached_threads++ == 0)
+    free_list_remove(a);
+  (void)mutex_unlock(&free_list_lock);
+  thread_exit_register(arena_exit_key, (Void_t *)a);
+#endif
+}
+
+/* Hash the calling thread to a starting slot in arena_vec[].  Thread
+   stacks are separate mappings, so the address of a local variable
+   differs between threads in its upper bits and is always at hand,
+   whatever the thread library.  */
+
+static unsigned int
+arena_hash(void)
+{
+  char c;
+  unsigned long h = (unsigned long)&c >> 16;
+
+  h *= 2654435761UL;
+  return (unsigned int)(h >> 8);
+}
+
 static mstate
 internal_function
 #if __STD_C
@@ -644,39 +891,43 @@ arena_get2(a_tsd, size) mstate a_tsd; size_t size;
 #endif
 {
   mstate a;
-  int err;
-
-  if(!a_tsd)
-    a = a_tsd = &main_arena;
-  else {
-    a = a_tsd->next;
-    if(!a) {
-      /* This can only happen while initializing the new arena. */
-      (void)mutex_lock(&main_arena.mutex);
-      THREAD_STAT(++(main_arena.stat_lock_wait));
-      return &main_arena;
-    }
-  }
+  int i, n, start, err;
 
-  /* Check the global, circularly linked list for available arenas. */
  repeat:
-  do {
-    if(!mutex_trylock(&a->mutex)) {
+  n = narenas;
+  atomic_read_barrier ();
+  start = arena_hash() % n;
+  for(i = 0; i < n && i < ARENA_PROBE_MAX; i++) {
+    a = arena_vec[(start + i) % n];
+    if(a != a_tsd && !mutex_trylock(&a->mutex)) {
       THREAD_STAT(++(a->stat_lock_loop));
       tsd_setspecific(arena_key, (Void_t *)a);
+      arena_thread_attach(a);
       return a;
     }
-    a = a->next;
-  } while(a != a_tsd);
+  }
+
+  /* Prefer an arena left behind by exited threads to a new one. */
+  (void)mutex_lock(&free_list_lock);
+  a = free_list;
+  (void)mutex_unlock(&free_list_lock);
+  if(!a && n >= ARENA_MAX)
+    /* Enough arenas already; wait for the one this thread hashes to. */
+    a = arena_vec[start];
+  if(a) {
+    (void)mutex_lock(&a->mutex);
+    THREAD_STAT(++(a->stat_lock_wait));
+    tsd_setspecific(arena_key, (Void_t *)a);
+    arena_thread_attach(a);
+    return a;
+  }
 
   /* If not even the list_lock can be obtained, try again.  This can
      happen during `atfork', or for example on systems where thread
      creation makes it temporarily impossible to obtain _any_
      locks. */
-  if(mutex_trylock(&list_lock)) {
-    a = a_tsd;
+  if(mutex_trylock(&list_lock))
     goto repeat;
-  }
   (void)mutex_unlock(&list_lock);
 
   /* Nothing immediately available, so generate a new arena.  */
@@ -684,19 +935,28 @@ arena_get2(a_tsd, size) mstate a_tsd; size_t size;
   if(!a)
     return 0;
 
-  tsd_setspecific(arena_key, (Void_t *)a);
   mutex_init(&a->mutex);
   err = mutex_lock(&a->mutex); /* remember result */
 
-  /* Add the new arena to the global list.  */
+  /* Add the new arena to the global list, and to arena_vec[] unless
+     other threads have filled it in the meantime.  */
   (void)mutex_lock(&list_lock);
   a->next = main_arena.next;
+  atomic_write_barrier ();
   main_arena.next = a;
+  if(narenas < ARENA_MAX) {
+    arena_vec[narenas] = a;
+    atomic_write_barrier ();
+    narenas++;
+  }
   (void)mutex_unlock(&list_lock);
+  tsd_setspecific(arena_key, (Void_t *)a);
 
   if(err) /* locking failed; keep arena for further attempts later */
     return 0;
 
+  arena_thread_attach(a);
+
   THREAD_STAT(++(a->stat_lock_loop));
   return a;
 }
@@ -745,6 +1005,153 @@ _int_new_arena(size_t size)
 
 #endif /* USE_ARENAS */
 
+/**************************************************************************/
+
+#if THREAD_CACHE
+
+/* Thread cache.  free() puts non-mmapped chunks for requests of at
+   most TCACHE_MAX_SIZE bytes on a list private to the calling
+   thread, binned by chunk size, and malloc() takes them from there
+   without locking any arena.  Cached chunks are still in use as far
+   as their arena is concerned, so neither the fastbins nor
+   consolidation ever see them, and they can be returned with
+   _int_free() at any time.  An empty bin is refilled with up to
+   TCACHE_FILL chunks under one arena lock; a full bin gives back its
+   older half, locking each owning arena once per run of chunks from
+   it.  The cache is flushed when the thread exits.  */
+
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE   256
+#endif
+#ifndef TCACHE_COUNT_MAX
+#define TCACHE_COUNT_MAX  32
+#endif
+#ifndef TCACHE_FILL
+#define TCACHE_FILL       8
+#endif
+
+/* Bin for a chunk of size sz; every chunk in it is at least that
+   large.  */
+#define tcache_csize2bin(sz) (((sz) - MINSIZE)/MALLOC_ALIGNMENT)
+
+#define TCACHE_BINS (tcache_csize2bin(request2size(TCACHE_MAX_SIZE)) + 1)
+
+struct tcache_bin {
+  Void_t* head;               /* linked through the first word */
+  unsigned int count;
+};
+
+struct thread_cache {
+  int state;                  /* 0: unused, 1: active, 2: exiting */
+  struct tcache_bin bins[TCACHE_BINS];
+};
+
+static __thread struct thread_cache tcache
+  __attribute__ ((tls_model ("initial-exec")));
+
+/* Return all but the first `keep' chunks of a bin to their arenas. */
+
+static void
+#if __STD_C
+tcache_flush_bin(struct tcache_bin* b, unsigned int keep)
+#else
+tcache_flush_bin(b, keep) struct tcache_bin* b; unsigned int keep;
+#endif
+{
+  mstate locked = 0;
+  Void_t** link = &b->head;
+  Void_t* mem;
+  unsigned int i;
+
+  for(i = 0; i < keep && *link; i++)
+    link = (Void_t**)*link;
+  mem = *link;
+  *link = 0;
+  b->count = i;
+
+  while(mem) {
+    Void_t* next = *(Void_t**)mem;
+    mstate ar_ptr = arena_for_chunk(mem2chunk(mem));
+
+    if(ar_ptr != locked) {
+      if(locked)
+	(void)mutex_unlock(&locked->mutex);
+      (void)mutex_lock(&ar_ptr->mutex);
+      locked = ar_ptr;
+    }
+    _int_free(ar_ptr, mem);
+    mem = next;
+  }
+  if(locked)
+    (void)mutex_unlock(&locked->mutex);
+}
+
+/* Destructor for tcache_key.  Later calls from this thread (e.g. from
+   other thread-specific data destructors) bypass the cache. */
+
+static void
+#if __STD_C
+tcache_thread_exit(Void_t *unused)
+#else
+tcache_thread_exit(unused) Void_t *unused;
+#endif
+{
+  int i;
+
+  tcache.state = 2;
+  for(i = 0; i < TCACHE_BINS; i++)
+    tcache_flush_bin(&tcache.bins[i], 0);
+}
+
+/* Return non-zero if the calling thread may use its cache, activating
+   it on first use.  */
+
+static int
+tcache_usable __MALLOC_P((void))
+{
+  if(tcache.state == 0 && __malloc_initialized > 0) {
+    tcache.state = 1;
+    if(thread_exit_register(tcache_key, (Void_t *)&tcache) != 0)
+      tcache.state = 2;
+  }
+  return tcache.state == 1;
+}
+
+/* Allocate from an arena for the empty bin b, and keep some more
+   chunks of the same size in it.  Returns 0 if the arena has no
+   memory, leaving the retries to the caller.  */
+
+static Void_t*
+#if __STD_C
+tcache_fill(struct tcache_bin* b, size_t bytes)
+#else
+tcache_fill(b, bytes) struct tcache_bin* b; size_t bytes;
+#endif
+{
+  mstate ar_ptr;
+  Void_t *victim, *mem;
+  int i;
+
+  arena_get(ar_ptr, bytes);
+  if(!ar_ptr)
+    return 0;
+  victim = _int_malloc(ar_ptr, bytes);
+  if(victim) {
+    for(i = 1; i < TCACHE_FILL; i++) {
+      mem = _int_malloc(ar_ptr, bytes);
+      if(!mem)
+	break;
+      *(Void_t**)mem = b->head;
+      b->head = mem;
+      b->count++;
+    }
+  }
+  (void)mutex_unlock(&ar_ptr->mutex);
+  return victim;
+}
+
+#endif /* THREAD_CACHE */
+
 /*
  * Local variables:
  * c-basic-offset: 2
@@ -2183,6 +2183,12 @@ struct malloc_state {
   /* Linked list */
   struct malloc_state *next;
 
+  /* Linked list of arenas no thread is attached to (see arena.c). */
+  struct malloc_state *next_free;
+
+  /* Number of threads that selected this arena in arena_get2(). */
+  INTERNAL_SIZE_T attached_threads;
+
   /* Memory allocated from the system in this arena.  */
   INTERNAL_SIZE_T system_mem;
   INTERNAL_SIZE_T max_system_mem;
@@ -3253,6 +3259,22 @@ public_mALLOc(size_t bytes)
   if (hook != NULL)
     return (*hook)(bytes, RETURN_ADDRESS (0));
 
+#if THREAD_CACHE
+  if (bytes <= TCACHE_MAX_SIZE && tcache_usable()) {
+    struct tcache_bin* b = &tcache.bins[tcache_csize2bin(request2size(bytes))];
+
+    victim = b->head;
+    if (victim) {
+      b->head = *(Void_t**)victim;
+      b->count--;
+      return victim;
+    }
+    victim = tcache_fill(b, bytes);
+    if (victim)
+      return victim;
+  }
+#endif
+
   arena_get(ar_ptr, bytes);
   if(!ar_ptr)
     return 0;
@@ -3308,6 +3330,19 @@ public_fREe(Void_t* mem)
   }
 #endif
 
+#if THREAD_CACHE
+  if (chunksize(p) <= request2size(TCACHE_MAX_SIZE) && tcache_usable()) {
+    struct tcache_bin* b = &tcache.bins[tcache_csize2bin(chunksize(p))];
+
+    if (b->count >= TCACHE_COUNT_MAX)
+      tcache_flush_bin(b, TCACHE_COUNT_MAX/2);
+    *(Void_t**)mem = b->head;
+    b->head = mem;
+    b->count++;
+    return;
+  }
+#endif
+
   ar_ptr = arena_for_chunk(p);
 #if THREAD_STATS
   if(!mutex_trylock(&ar_ptr->mutex))
@@ -68,12 +68,34 @@ PERFORMANCE OF THIS SOFTWARE.
 #endif
 #define HAVE_MEMCPY        1
 
+/* Maximum number of arenas that arena_get2() selects from by hashing,
+   and how many of them it tries before creating a new one.  */
+#ifndef ARENA_MAX
+# define ARENA_MAX         256
+#endif
+#ifndef ARENA_PROBE_MAX
+# define ARENA_PROBE_MAX   4
+#endif
+
 /* If THREAD_STATS is non-zero, some statistics on mutex locking are
    computed.  */
 #ifndef THREAD_STATS
 # define THREAD_STATS 0
 #endif
 
+/* If THREAD_CACHE is non-zero, each thread keeps small freed chunks
+   in a private cache and hands them out again without locking any
+   arena.  This needs __thread support and a thread exit hook from
+   malloc-machine.h.  */
+#ifndef THREAD_CACHE
+# if !defined NO_THREADS && defined thread_exit_key_create && \
+     defined __GNUC__ && !defined _LIBC
+#  define THREAD_CACHE 1
+# else
+#  define THREAD_CACHE 0
+# endif
+#endif
+
 #ifndef MALLOC_DEBUG
 # define MALLOC_DEBUG 0
 #endif
@@ -218,6 +240,12 @@ static struct malloc_arena* _int_new_arena(size_t size);
 /* Buffer for the main arena. */
 static struct malloc_arena main_arena;
 
+/* The first ARENA_MAX arenas, main_arena first.  Entries are only
+   ever appended (under list_lock), so the vector can be read without
+   locking once narenas has been read.  */
+static struct malloc_arena* arena_vec[ARENA_MAX];
+static int narenas;
+
 /* For now, store arena in footer.  This means typically 4bytes more
    overhead for each non-main-arena chunk, but is fast and easy to
    compute.  Note that the pointer stored in the extra footer must be
@@ -247,11 +275,13 @@ static struct malloc_arena main_arena;
 
 /* arena_get() acquires an arena and locks the corresponding mutex.
    First, try the one last locked successfully by this thread.  (This
-   is the common case and handled with a macro for speed.)  Then, loop
-   once over the circularly linked list of arenas.  If no arena is
-   readily available, create a new one.  In this latter case, `size'
-   is just a hint as to how much memory will be required immediately
-   in the new arena. */
+   is the common case and handled with a macro for speed.)  Then, try
+   up to ARENA_PROBE_MAX arenas, starting at a slot of arena_vec[]
+   derived from the calling thread, so that threads whose own arena
+   is busy spread out instead of all walking the list from
+   main_arena.  If no arena is readily available, create a new one.
+   In this latter case, `size' is just a hint as to how much memory
+   will be required immediately in the new arena. */
 
 #define arena_get(ptr, size) do { \
   void *vptr = NULL; \
@@ -262,43 +292,55 @@ static struct malloc_arena main_arena;
     ptr = arena_get2(ptr, (size)); \
 } while(0)
 
+/* Hash the calling thread to a starting slot in arena_vec[].  Thread
+   stacks are separate mappings, so the address of a local variable
+   differs between threads in its upper bits and is always at hand,
+   whatever the thread library.  */
+
+static unsigned int
+arena_hash(void)
+{
+  char c;
+  unsigned long h = (unsigned long)&c >> 16;
+
+  h *= 2654435761UL;
+  return (unsigned int)(h >> 8);
+}
+
 static struct malloc_arena*
 arena_get2(struct malloc_arena* a_tsd, size_t size)
 {
   struct malloc_arena* a;
-  int err;
-
-  if(!a_tsd)
-    a = a_tsd = &main_arena;
-  else {
-    a = a_tsd->next;
-    if(!a) {
-      /* This can only happen while initializing the new arena. */
-      (void)mutex_lock(&main_arena.mutex);
-      THREAD_STAT(++(main_arena.stat_lock_wait));
-      return &main_arena;
-    }
-  }
+  int i, n, start, err;
 
-  /* Check the global, circularly linked list for available arenas. */
  repeat:
-  do {
-    if(!mutex_trylock(&a->mutex)) {
+  n = narenas;
+  atomic_read_barrier ();
+  start = arena_hash() % n;
+  for(i = 0; i < n && i < ARENA_PROBE_MAX; i++) {
+    a = arena_vec[(start + i) % n];
+    if(a != a_tsd && !mutex_trylock(&a->mutex)) {
       THREAD_STAT(++(a->stat_lock_loop));
       tsd_setspecific(arena_key, (void *)a);
       return a;
     }
-    a = a->next;
-  } while(a != a_tsd);
+  }
+
+  if(n >= ARENA_MAX) {
+    /* Enough arenas already; wait for the one this thread hashes to. */
+    a = arena_vec[start];
+    (void)mutex_lock(&a->mutex);
+    THREAD_STAT(++(a->stat_lock_wait));
+    tsd_setspecific(arena_key, (void *)a);
+    return a;
+  }
 
   /* If not even the list_lock can be obtained, try again.  This can
      happen during `atfork', or for example on systems where thread
      creation makes it temporarily impossible to obtain _any_
      locks. */
-  if(mutex_trylock(&list_lock)) {
-    a = a_tsd;
+  if(mutex_trylock(&list_lock))
     goto repeat;
-  }
   (void)mutex_unlock(&list_lock);
 
   /* Nothing immediately available, so generate a new arena.  */
@@ -306,16 +348,22 @@ arena_get2(struct malloc_arena* a_tsd, size_t size)
   if(!a)
     return 0;
 
-  tsd_setspecific(arena_key, (void *)a);
   mutex_init(&a->mutex);
   err = mutex_lock(&a->mutex); /* remember result */
 
-  /* Add the new arena to the global list.  */
+  /* Add the new arena to the global list, and to arena_vec[] unless
+     other threads have filled it in the meantime.  */
   (void)mutex_lock(&list_lock);
   a->next = main_arena.next;
   atomic_write_barrier ();
   main_arena.next = a;
+  if(narenas < ARENA_MAX) {
+    arena_vec[narenas] = a;
+    atomic_write_barrier ();
+    narenas++;
+  }
   (void)mutex_unlock(&list_lock);
+  tsd_setspecific(arena_key, (void *)a);
 
   if(err) /* locking failed; keep arena for further attempts later */
     return 0;
@@ -358,6 +406,158 @@ _int_new_arena(size_t size)
 
 /*------------------------------------------------------------------------*/
 
+#if THREAD_CACHE
+
+/* Thread cache.  free() puts non-mmapped chunks with at most
+   TCACHE_MAX_SIZE usable bytes on a list private to the calling
+   thread, binned by usable size in MALLOC_ALIGNMENT steps, and
+   malloc() takes them from there without locking any arena.  Cached
+   chunks are still in use as far as their mspace is concerned and
+   keep their arena footer, so they can be returned with mspace_free()
+   at any time.  An empty bin is refilled with up to TCACHE_FILL
+   chunks under one arena lock; a full bin gives back its older half,
+   locking each owning arena once per run of chunks from it.  The
+   cache is flushed when the thread exits.  */
+
+#ifndef TCACHE_MAX_SIZE
+# define TCACHE_MAX_SIZE   256
+#endif
+#ifndef TCACHE_COUNT_MAX
+# define TCACHE_COUNT_MAX  32
+#endif
+#ifndef TCACHE_FILL
+# define TCACHE_FILL       8
+#endif
+
+#define TCACHE_BINS        (TCACHE_MAX_SIZE/MALLOC_ALIGNMENT + 1)
+
+/* Bin for a request of n bytes; every chunk in it has at least that
+   many usable bytes.  */
+#define tcache_request2bin(n) (((n) + CHUNK_ALIGN_MASK)/MALLOC_ALIGNMENT)
+
+/* Bin for an in-use, non-mmapped chunk. */
+#define tcache_chunk2bin(p) \
+ ((chunksize(p) - CHUNK_OVERHEAD - \
+   (chunk_non_main_arena(p) ? FOOTER_OVERHEAD : 0))/MALLOC_ALIGNMENT)
+
+struct tcache_bin {
+  void* head;                 /* linked through the first word */
+  unsigned int count;
+};
+
+struct thread_cache {
+  int state;                  /* 0: unused, 1: active, 2: exiting */
+  struct tcache_bin bins[TCACHE_BINS];
+};
+
+static __thread struct thread_cache tcache
+  __attribute__ ((tls_model ("initial-exec")));
+static thread_exit_key_t tcache_key;
+
+/* Return all but the first `keep' chunks of a bin to their arenas. */
+
+static void
+tcache_flush_bin(struct tcache_bin* b, unsigned int keep)
+{
+  struct malloc_arena* locked = 0;
+  void** link = &b->head;
+  void* mem;
+  unsigned int i;
+
+  for(i = 0; i < keep && *link; i++)
+    link = (void**)*link;
+  mem = *link;
+  *link = 0;
+  b->count = i;
+
+  while(mem) {
+    void* next = *(void**)mem;
+    struct malloc_arena* ar_ptr = arena_for_chunk(mem2chunk(mem));
+
+    if(ar_ptr != locked) {
+      if(locked)
+	(void)mutex_unlock(&locked->mutex);
+      (void)mutex_lock(&ar_ptr->mutex);
+      locked = ar_ptr;
+    }
+    mspace_free(arena_to_mspace(ar_ptr), mem);
+    mem = next;
+  }
+  if(locked)
+    (void)mutex_unlock(&locked->mutex);
+}
+
+static void
+tcache_flush(void)
+{
+  int i;
+
+  for(i = 0; i < TCACHE_BINS; i++)
+    tcache_flush_bin(&tcache.bins[i], 0);
+}
+
+/* Destructor for tcache_key.  Later calls from this thread (e.g. from
+   other thread-specific data destructors) bypass the cache. */
+
+static void
+tcache_thread_exit(void* unused)
+{
+  tcache.state = 2;
+  tcache_flush();
+}
+
+/* Return non-zero if the calling thread may use its cache, activating
+   it on first use.  */
+
+static int
+tcache_usable(void)
+{
+  if(tcache.state == 0 && __malloc_initialized > 0) {
+    tcache.state = 1;
+    if(thread_exit_register(tcache_key, &tcache) != 0)
+      tcache.state = 2;
+  }
+  return tcache.state == 1;
+}
+
+/* Allocate from an arena for an empty bin b, and keep some more
+   chunks of the same size in it.  */
+
+static void*
+tcache_fill(struct tcache_bin* b, size_t bytes)
+{
+  struct malloc_arena* ar_ptr;
+  void *victim, *mem;
+  int i;
+
+  arena_get(ar_ptr, bytes + FOOTER_OVERHEAD);
+  if(!ar_ptr)
+    return 0;
+  if(ar_ptr != &main_arena)
+    bytes += FOOTER_OVERHEAD;
+  victim = mspace_malloc(arena_to_mspace(ar_ptr), bytes);
+  if(victim) {
+    if(ar_ptr != &main_arena)
+      set_non_main_arena(victim, ar_ptr);
+    for(i = 1; i < TCACHE_FILL; i++) {
+      mem = mspace_malloc(arena_to_mspace(ar_ptr), bytes);
+      if(!mem)
+	break;
+      if(ar_ptr != &main_arena)
+	set_non_main_arena(mem, ar_ptr);
+      *(void**)mem = b->head;
+      b->head = mem;
+      b->count++;
+    }
+  }
+  (void)mutex_unlock(&ar_ptr->mutex);
+  return victim;
+}
+
+#endif /* THREAD_CACHE */
+
+/*------------------------------------------------------------------------*/
+
 /* Hook mechanism for proper initialization and atfork support. */
 
 /* Define and initialize the hook variables.  These weak definitions must
@@ -674,9 +874,15 @@ ptmalloc_init(void)
 				   0);
   assert(mspace == arena_to_mspace(&main_arena));
 
+  arena_vec[0] = &main_arena;
+  narenas = 1;
+
   mutex_init(&list_lock);
   tsd_key_create(&arena_key, NULL);
   tsd_setspecific(arena_key, (void *)&main_arena);
+#if THREAD_CACHE
+  thread_exit_key_create(&tcache_key, tcache_thread_exit);
+#endif
   thread_atfork(ptmalloc_lock_all, ptmalloc_unlock_all, ptmalloc_unlock_all2);
 #ifndef NO_THREADS
 # if USE_STARTER & 1
@@ -727,6 +933,22 @@ public_mALLOc(size_t bytes)
   if (hook != NULL)
     return (*hook)(bytes, RETURN_ADDRESS (0));
 
+#if THREAD_CACHE
+  if (bytes <= TCACHE_MAX_SIZE && tcache_usable()) {
+    struct tcache_bin* b = &tcache.bins[tcache_request2bin(bytes)];
+
+    victim = b->head;
+    if (victim) {
+      b->head = *(void**)victim;
+      b->count--;
+      return victim;
+    }
+    /* Ask for the bin's full size, so the chunks fit any request
+       that maps to it when they come back. */
+    return tcache_fill(b, tcache_request2bin(bytes)*MALLOC_ALIGNMENT);
+  }
+#endif
+
   arena_get(ar_ptr, bytes + FOOTER_OVERHEAD);
   if (!ar_ptr)
     return 0;
@@ -767,6 +989,23 @@ public_fREe(void* mem)
     return;
   }
 
+#if THREAD_CACHE
+  if (tcache_usable()) {
+    size_t idx = tcache_chunk2bin(p);
+
+    if (idx < TCACHE_BINS) {
+      struct tcache_bin* b = &tcache.bins[idx];
+
+      if (b->count >= TCACHE_COUNT_MAX)
+	tcache_flush_bin(b, TCACHE_COUNT_MAX/2);
+      *(void**)mem = b->head;
+      b->head = mem;
+      b->count++;
+      return;
+    }
+  }
+#endif
+
   ar_ptr = arena_for_chunk(p);
 #if THREAD_STATS
   if(!mutex_trylock(&ar_ptr->mutex))
@@ -1058,6 +1297,10 @@ public_mTRIm(size_t s)
 {
   int result;
 
+#if THREAD_CACHE
+  if (tcache.state == 1)
+    tcache_flush();
+#endif
   (void)mutex_lock(&main_arena.mutex);
   result = mspace_trim(arena_to_mspace(&main_arena), s);
   (void)mutex_unlock(&main_arena.mutex);
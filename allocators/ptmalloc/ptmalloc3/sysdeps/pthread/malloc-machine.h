@@ -122,6 +122,14 @@ typedef pthread_key_t tsd_key_t;
 
 #endif
 
+/* A key whose destructor runs when a thread exits, even when
+   USE_TSD_DATA_HACK is in effect.  Used by the thread cache, which
+   registers one value per thread; pthread_setspecific() does not need
+   malloc() for the first few keys of a process.  */
+typedef pthread_key_t thread_exit_key_t;
+#define thread_exit_key_create(key, destr) pthread_key_create(key, destr)
+#define thread_exit_register(key, data)    pthread_setspecific(key, data)
+
 /* at fork */
 #define thread_atfork(prepare, parent, child) \
                                    pthread_atfork(prepare, parent, child)
@@ -0,0 +1,361 @@
+/*
+ * t-dist.h
+ * Size and lifetime distributions and phase schedules for t-test1 and
+ * t-test2, in place of their uniform sizes and random frees, and a
+ * one-line CSV report of a run.
+ *
+ * Options, before the tests' usual arguments:
+ *
+ *   -s file    draw sizes from the distribution in file
+ *   -l file    free each object after a lifetime drawn from file
+ *   -p file    run the phases of the schedule in file
+ *   -o file    append a CSV row for the run to file
+ *   -t label   the row's first four fields (default: the library in
+ *              LD_PRELOAD or "system", the test, the threads and 1)
+ *
+ * A distribution file is either a StatsRegistry dump (the JSON that
+ * Heap Layers writes on HL_STATS_SIGNAL), whose first "allocs" array,
+ * a SizeClassStatsHeap's, weighs each power-of-two class of sizes
+ * [2^c, 2^(c+1)), or text, with a range and its weight per line:
+ *
+ *	lo [hi] weight		# a comment
+ *
+ * Sizes are in bytes; a size is drawn from a range at random.
+ * Lifetimes are in allocations: the number the thread makes (in
+ * t-test2, that all threads make) between an object's malloc and its
+ * free.  The stats layer does not keep lifetimes, so those come from
+ * text files.
+ *
+ * A schedule file has one phase per line, run in order, for the given
+ * number of actions each, and over again until the test is done:
+ *
+ *	actions sizes|- [lifetimes|-]
+ *
+ * where '-' is the test's own uniform sizes, or random frees.
+ *
+ * The CSV row has the schema of util/bench/run's runs.csv, with the
+ * latency and blowup fields empty:
+ *
+ *	allocator,workload,threads,rep,status,wall_s,user_s,sys_s,
+ *	maxrss_kb,minflt,majflt,ops_per_sec,p50,p99,p999,blowup
+ */
+
+#ifndef _T_DIST_H
+#define _T_DIST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define TDIST_MAX_PHASES	64
+
+struct dist {
+	int n;
+	unsigned long *lo, *hi;
+	double *cum;				/* the weights up to and including each range */
+};
+
+struct phase {
+	long actions;
+	struct dist *sizes;			/* NULL for uniform */
+	struct dist *lifetimes;		/* NULL for random frees */
+};
+
+static struct phase tdist_phases[TDIST_MAX_PHASES];
+static int tdist_nphases;
+static long tdist_period;		/* the actions in a pass of the schedule */
+static const char *tdist_csv, *tdist_label, *tdist_test;
+static volatile long tdist_actions;
+static struct timeval tdist_t0;
+
+static void
+tdist_fail(const char *what, const char *file)
+{
+	fprintf(stderr, "%s: %s\n", file, what);
+	exit(1);
+}
+
+static void
+dist_add(struct dist *d, unsigned long lo, unsigned long hi, double w)
+{
+	if(w <= 0) return;
+	if(lo < 1) lo = 1;
+	if(hi < lo) hi = lo;
+	if((d->n & (d->n - 1)) == 0) {
+		int cap = d->n ? 2 * d->n : 16;
+		d->lo = (unsigned long *)realloc(d->lo, cap * sizeof(*d->lo));
+		d->hi = (unsigned long *)realloc(d->hi, cap * sizeof(*d->hi));
+		d->cum = (double *)realloc(d->cum, cap * sizeof(*d->cum));
+		if(!d->lo || !d->hi || !d->cum) tdist_fail("out of memory", "t-dist");
+	}
+	d->lo[d->n] = lo;
+	d->hi[d->n] = hi;
+	d->cum[d->n] = (d->n ? d->cum[d->n - 1] : 0) + w;
+	d->n++;
+}
+
+static struct dist *
+dist_load(const char *file)
+{
+	struct dist *d;
+	FILE *fp;
+	char *buf, *s, *e, *line;
+	long len;
+	int c;
+
+	if((fp = fopen(file, "r")) == NULL) tdist_fail("cannot open", file);
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	buf = (char *)malloc(len + 1);
+	d = (struct dist *)calloc(1, sizeof(*d));
+	if(!buf || !d) tdist_fail("out of memory", file);
+	len = fread(buf, 1, len, fp);
+	buf[len] = '\0';
+	fclose(fp);
+
+	for(s = buf; *s == ' ' || *s == '\t' || *s == '\n' || *s == '\r'; s++)
+		;
+	if(*s == '{') {
+		/* A stats dump: class c of "allocs" is [2^c, 2^(c+1)). */
+		if((s = strstr(s, "\"allocs\"")) == NULL || (s = strchr(s, '[')) == NULL)
+			tdist_fail("no \"allocs\" array", file);
+		for(c = 0, s++; c < (int)(8 * sizeof(long)); c++) {
+			double w = strtod(s, &e);
+			if(e == s) break;
+			dist_add(d, 1UL << c, (c + 1 < (int)(8 * sizeof(long))) ?
+					 (1UL << (c + 1)) - 1 : ~0UL, w);
+			for(s = e; *s == ' ' || *s == ','; s++)
+				;
+		}
+	} else {
+		for(line = strtok(s, "\n"); line; line = strtok(NULL, "\n")) {
+			double v[3];
+			int n;
+
+			if((e = strchr(line, '#')) != NULL) *e = '\0';
+			for(n = 0, s = line; n < 3; n++, s = e) {
+				v[n] = strtod(s, &e);
+				if(e == s) break;
+			}
+			if(n == 2)
+				dist_add(d, (unsigned long)v[0], (unsigned long)v[0], v[1]);
+			else if(n == 3)
+				dist_add(d, (unsigned long)v[0], (unsigned long)v[1], v[2]);
+			else if(n != 0)
+				tdist_fail("lines are \"lo [hi] weight\"", file);
+		}
+	}
+	free(buf);
+	if(d->n == 0) tdist_fail("empty distribution", file);
+	return d;
+}
+
+/* A random number in [0, n), from two draws for ranges past LRAN2_MAX. */
+static unsigned long
+dist_random(struct lran2_st *ld, unsigned long n)
+{
+	unsigned long r = (unsigned long)lran2(ld);
+
+	if(n > (unsigned long)LRAN2_MAX)
+		r = r * LRAN2_MAX + lran2(ld);
+	return r % n;
+}
+
+static unsigned long
+dist_draw(struct dist *d, struct lran2_st *ld)
+{
+	double u;
+	int lo = 0, hi = d->n - 1, mid;
+
+	u = ((double)lran2(ld) * LRAN2_MAX + lran2(ld)) /
+		((double)LRAN2_MAX * LRAN2_MAX) * d->cum[d->n - 1];
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(d->cum[mid] > u) hi = mid;
+		else lo = mid + 1;
+	}
+	return d->lo[lo] + dist_random(ld, d->hi[lo] - d->lo[lo] + 1);
+}
+
+static double
+dist_mean(struct dist *d)
+{
+	double sum = 0, prev = 0;
+	int i;
+
+	for(i = 0; i < d->n; i++) {
+		sum += (d->cum[i] - prev) * ((double)d->lo[i] + d->hi[i]) / 2;
+		prev = d->cum[i];
+	}
+	return sum / d->cum[d->n - 1];
+}
+
+static struct dist *
+dist_arg(const char *file)
+{
+	return strcmp(file, "-") == 0 ? NULL : dist_load(file);
+}
+
+static void
+sched_load(const char *file)
+{
+	FILE *fp;
+	char line[1024], sizes[512], lifetimes[512];
+	long actions;
+	int n;
+
+	if((fp = fopen(file, "r")) == NULL) tdist_fail("cannot open", file);
+	while(fgets(line, sizeof(line), fp)) {
+		char *hash = strchr(line, '#');
+		if(hash) *hash = '\0';
+		strcpy(lifetimes, "-");
+		n = sscanf(line, "%ld %511s %511s", &actions, sizes, lifetimes);
+		if(n <= 0) continue;
+		if(n < 2 || actions < 1)
+			tdist_fail("lines are \"actions sizes|- [lifetimes|-]\"", file);
+		if(tdist_nphases == TDIST_MAX_PHASES) tdist_fail("too many phases", file);
+		tdist_phases[tdist_nphases].actions = actions;
+		tdist_phases[tdist_nphases].sizes = dist_arg(sizes);
+		tdist_phases[tdist_nphases].lifetimes = dist_arg(lifetimes);
+		tdist_period += actions;
+		tdist_nphases++;
+	}
+	fclose(fp);
+	if(tdist_nphases == 0) tdist_fail("no phases", file);
+}
+
+/*
+ * Parse the options; return how many arguments they took, so that the
+ * test's own arguments start at argv[1 + that].
+ */
+static int
+tdist_options(int argc, char *argv[], const char *test)
+{
+	const char *sizes = NULL, *lifetimes = NULL, *sched = NULL;
+	int ch;
+
+	tdist_test = test;
+	while((ch = getopt(argc, argv, "s:l:p:o:t:")) != -1) {
+		switch(ch) {
+		case 's': sizes = optarg; break;
+		case 'l': lifetimes = optarg; break;
+		case 'p': sched = optarg; break;
+		case 'o': tdist_csv = optarg; break;
+		case 't': tdist_label = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-s sizes] [-l lifetimes] [-p schedule] "
+					"[-o csv] [-t label] [args ...]\n", test);
+			exit(2);
+		}
+	}
+	if(sched) {
+		if(sizes || lifetimes)
+			tdist_fail("-p takes the place of -s and -l", sched);
+		sched_load(sched);
+	} else if(sizes || lifetimes) {
+		tdist_phases[0].actions = 1;
+		tdist_phases[0].sizes = sizes ? dist_load(sizes) : NULL;
+		tdist_phases[0].lifetimes = lifetimes ? dist_load(lifetimes) : NULL;
+		tdist_period = 1;
+		tdist_nphases = 1;
+	}
+	gettimeofday(&tdist_t0, NULL);
+	return optind - 1;
+}
+
+/* The phase that action i of a thread is in (NULL without distributions). */
+static struct phase *
+tdist_phase(long i)
+{
+	int p;
+
+	if(tdist_nphases == 0) return NULL;
+	i %= tdist_period;
+	for(p = 0; i >= tdist_phases[p].actions; p++)
+		i -= tdist_phases[p].actions;
+	return &tdist_phases[p];
+}
+
+/* A size to allocate, in [1, size] if the phase has no distribution. */
+static unsigned long
+tdist_size(struct phase *ph, struct lran2_st *ld, unsigned long size)
+{
+	if(ph && ph->sizes) return dist_draw(ph->sizes, ld);
+	return (unsigned long)(lran2(ld) % size) + 1;
+}
+
+static unsigned long
+tdist_lifetime(struct phase *ph, struct lran2_st *ld)
+{
+	return dist_draw(ph->lifetimes, ld);
+}
+
+/*
+ * The size that, drawn uniformly up to, would average the largest mean
+ * size of the phases, those with uniform sizes up to size included; the
+ * tests size their pools by it.
+ */
+static unsigned long
+tdist_size_bound(unsigned long size)
+{
+	double m, most = 0;
+	int p;
+
+	if(tdist_nphases == 0) return size;
+	for(p = 0; p < tdist_nphases; p++) {
+		m = tdist_phases[p].sizes ? 2 * dist_mean(tdist_phases[p].sizes) : size;
+		if(m > most) most = m;
+	}
+	return most < 2 ? 2 : (unsigned long)most;
+}
+
+static void
+tdist_count(long actions)
+{
+	__sync_fetch_and_add(&tdist_actions, actions);
+}
+
+/* Print the rate, and append the CSV row if asked to. */
+static void
+tdist_report(int threads)
+{
+	struct timeval t1;
+	struct rusage ru;
+	double wall;
+	const char *lib, *slash;
+	FILE *fp;
+
+	gettimeofday(&t1, NULL);
+	wall = (t1.tv_sec - tdist_t0.tv_sec) + (t1.tv_usec - tdist_t0.tv_usec) / 1e6;
+	printf("%.0f operations per second, %ld actions, %.3f seconds\n",
+		   wall > 0 ? tdist_actions / wall : 0, tdist_actions, wall);
+	if(!tdist_csv) return;
+	if((fp = fopen(tdist_csv, "a")) == NULL) tdist_fail("cannot open", tdist_csv);
+	if(tdist_label) {
+		fprintf(fp, "%s", tdist_label);
+	} else {
+		lib = getenv("LD_PRELOAD");
+		if(!lib || !*lib) lib = "system";
+		else if((slash = strrchr(lib, '/')) != NULL) lib = slash + 1;
+		fprintf(fp, "%s,%s,%d,1", lib, tdist_test, threads);
+	}
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(fp, ",0,%.6f,%.6f,%.6f,%ld,%ld,%ld,%.0f,,,,\n", wall,
+			ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+			(long)ru.ru_maxrss, (long)ru.ru_minflt, (long)ru.ru_majflt,
+			wall > 0 ? tdist_actions / wall : 0);
+	fclose(fp);
+}
+
+#endif /* _T_DIST_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * End:
+ */
@@ -24,6 +24,7 @@
 
 #include "lran2.h"
 #include "t-test.h"
+#include "t-dist.h"
 
 struct user_data {
 	int bins, max;
@@ -73,11 +74,92 @@ bin_test(struct bin_info *p)
 
 #endif
 
+/* Bins freed by their deadlines, for phases with lifetimes: the live
+   ones in a heap by deadline, and a stack of the empty ones. */
+struct lifetime_info {
+	unsigned long tick;		/* allocations so far */
+	unsigned long *death;	/* per bin */
+	int *heap, nheap;
+	int *empty, nempty;
+};
+
+static void
+lt_push(struct lifetime_info *lt, int b)
+{
+	int c = lt->nheap++, parent;
+
+	for(; c > 0; c = parent) {
+		parent = (c - 1) / 2;
+		if(lt->death[lt->heap[parent]] <= lt->death[b]) break;
+		lt->heap[c] = lt->heap[parent];
+	}
+	lt->heap[c] = b;
+}
+
+static int
+lt_pop(struct lifetime_info *lt)
+{
+	int top = lt->heap[0], last = lt->heap[--lt->nheap], c = 0, child;
+
+	for(; (child = 2*c + 1) < lt->nheap; c = child) {
+		if(child + 1 < lt->nheap &&
+		   lt->death[lt->heap[child + 1]] < lt->death[lt->heap[child]])
+			child++;
+		if(lt->death[last] <= lt->death[lt->heap[child]]) break;
+		lt->heap[c] = lt->heap[child];
+	}
+	lt->heap[c] = last;
+	return top;
+}
+
+/* Start a phase with lifetimes: the bins left live get a deadline. */
+static void
+lt_enter(struct bin_info *p, struct lifetime_info *lt, struct phase *ph,
+		 struct lran2_st *ld)
+{
+	int b;
+
+	lt->nheap = lt->nempty = 0;
+	for(b=0; b<p->bins; b++) {
+		if(p->m[b].size == 0) {
+			lt->empty[lt->nempty++] = b;
+		} else {
+			lt->death[b] = lt->tick + tdist_lifetime(ph, ld);
+			lt_push(lt, b);
+		}
+	}
+}
+
+/* Make one allocation, first freeing the bins whose time is up, or
+   the one due first if none are empty.  Returns the actions taken. */
+static int
+lt_alloc(struct bin_info *p, struct lifetime_info *lt, struct phase *ph,
+		 struct lran2_st *ld)
+{
+	int b, actions = 1;
+
+	lt->tick++;
+	while(lt->nheap > 0 &&
+		  (lt->death[lt->heap[0]] <= lt->tick || lt->nempty == 0)) {
+		b = lt_pop(lt);
+		bin_free(&p->m[b]);
+		lt->empty[lt->nempty++] = b;
+		actions++;
+	}
+	b = lt->empty[--lt->nempty];
+	bin_alloc(&p->m[b], tdist_size(ph, ld, p->size), lran2(ld));
+	lt->death[b] = lt->tick + tdist_lifetime(ph, ld);
+	lt_push(lt, b);
+	return actions;
+}
+
 void
 malloc_test(struct thread_st *st)
 {
-	int b, i, j, actions, pid = 1;
+	int b, i, j, actions, pid = 1, lt_on = 0;
 	struct bin_info p;
+	struct lifetime_info lt;
+	struct phase *ph;
 	struct lran2_st ld; /* data for random number generator */
 
 	lran2_init(&ld, st->u.seed);
@@ -106,16 +188,31 @@ malloc_test(struct thread_st *st)
 	p.m = (struct bin *)malloc(st->u.bins*sizeof(*p.m));
 	p.bins = st->u.bins;
 	p.size = st->u.size;
+	lt.tick = 0;
+	lt.death = (unsigned long *)malloc(p.bins*sizeof(*lt.death));
+	lt.heap = (int *)malloc(p.bins*sizeof(*lt.heap));
+	lt.empty = (int *)malloc(p.bins*sizeof(*lt.empty));
+	ph = tdist_phase(0);
 	for(b=0; b<p.bins; b++) {
 		p.m[b].size = 0;
 		p.m[b].ptr = NULL;
 		if(RANDOM(&ld, 2) == 0)
-			bin_alloc(&p.m[b], RANDOM(&ld, p.size) + 1, lran2(&ld));
+			bin_alloc(&p.m[b], tdist_size(ph, &ld, p.size), lran2(&ld));
 	}
 	for(i=0; i<=st->u.max;) {
 #if TEST > 1
 		bin_test(&p);
 #endif
+		ph = tdist_phase(i);
+		if(ph && ph->lifetimes) {
+			if(!lt_on) lt_enter(&p, &lt, ph, &ld);
+			lt_on = 1;
+			actions = RANDOM(&ld, ACTIONS_MAX);
+			for(j=0; j<actions; j++)
+				i += lt_alloc(&p, &lt, ph, &ld);
+			continue;
+		}
+		lt_on = 0;
 		actions = RANDOM(&ld, ACTIONS_MAX);
 #if USE_MALLOC && MALLOC_DEBUG
 		if(actions < 2) { mallinfo(); }
@@ -128,7 +225,7 @@ malloc_test(struct thread_st *st)
 		actions = RANDOM(&ld, ACTIONS_MAX);
 		for(j=0; j<actions; j++) {
 			b = RANDOM(&ld, p.bins);
-			bin_alloc(&p.m[b], RANDOM(&ld, p.size) + 1, lran2(&ld));
+			bin_alloc(&p.m[b], tdist_size(ph, &ld, p.size), lran2(&ld));
 #if TEST > 2
 			bin_test(&p);
 #endif
@@ -149,6 +246,10 @@ malloc_test(struct thread_st *st)
 	for(b=0; b<p.bins; b++)
 		bin_free(&p.m[b]);
 	free(p.m);
+	free(lt.death);
+	free(lt.heap);
+	free(lt.empty);
+	tdist_count(i);
 	if(pid == 0)
 		exit(0);
 }
@@ -207,6 +308,9 @@ main(int argc, char *argv[])
 	printf("ptmalloc_init\n");
 #endif
 
+	i = tdist_options(argc, argv, "t-test1");
+	argc -= i;
+	argv += i;
 	if(argc > 1) n_total_max = atoi(argv[1]);
 	if(n_total_max < 1) n_thr = 1;
 	if(argc > 2) n_thr = atoi(argv[2]);
@@ -217,7 +321,7 @@ main(int argc, char *argv[])
 	if(argc > 4) size = atol(argv[4]);
 	if(size < 2) size = 2;
 
-	bins = MEMORY/(size*n_thr);
+	bins = MEMORY/(tdist_size_bound(size)*n_thr);
 	if(argc > 5) bins = atoi(argv[5]);
 	if(bins < 4) bins = 4;
 
@@ -271,6 +375,7 @@ main(int argc, char *argv[])
 		free(st[i].sp);
 	}
 	free(st);
+	tdist_report(n_thr);
 #if USE_MALLOC
 	malloc_stats();
 #endif
@@ -23,6 +23,7 @@
 
 #include "lran2.h"
 #include "t-test.h"
+#include "t-dist.h"
 
 struct user_data {
 	int max;
@@ -51,11 +52,16 @@ struct user_data {
 
 struct block {
 	struct bin b[BINS_PER_BLOCK];
+	unsigned long death[BINS_PER_BLOCK]; /* in phases with lifetimes */
 	mutex_t mutex;
 } *blocks;
 
 int n_blocks;
 
+/* Allocations by all threads, the clock of lifetimes.  A bin outlives
+   its deadline until a thread next visits its block. */
+static volatile unsigned long ticks;
+
 #if TEST > 0
 
 void
@@ -83,17 +89,40 @@ malloc_test(struct thread_st *st)
 	struct block *bl;
 	int i, b, r;
 	struct lran2_st ld; /* data for random number generator */
-	unsigned long rsize[BINS_PER_BLOCK];
+	unsigned long rsize[BINS_PER_BLOCK], rlife[BINS_PER_BLOCK], now;
 	int rnum[BINS_PER_BLOCK];
+	struct phase *ph;
 
 	lran2_init(&ld, st->u.seed);
 	for(i=0; i<=st->u.max;) {
 #if TEST > 1
 		bin_test();
 #endif
+		ph = tdist_phase(i);
 		bl = &blocks[RANDOM(&ld, n_blocks)];
 		r = RANDOM(&ld, 1024);
-		if(r < 200) { /* free only */
+		if(ph && ph->lifetimes) {
+			/* Free the bins whose time is up, and unless this is a
+			   free only, refill the empty ones. */
+			for(b=0; b<BINS_PER_BLOCK; b++) {
+				rsize[b] = tdist_size(ph, &ld, st->u.size);
+				rnum[b] = lran2(&ld);
+				rlife[b] = tdist_lifetime(ph, &ld);
+			}
+			now = ticks;
+			mutex_lock(&bl->mutex);
+			for(b=0; b<BINS_PER_BLOCK; b++) {
+				if(bl->b[b].size > 0 && bl->death[b] > now)
+					continue;
+				bin_free(&bl->b[b]);
+				if(r < 200)
+					continue;
+				bin_alloc(&bl->b[b], rsize[b], rnum[b]);
+				bl->death[b] = __sync_add_and_fetch(&ticks, 1) + rlife[b];
+			}
+			mutex_unlock(&bl->mutex);
+			i += BINS_PER_BLOCK;
+		} else if(r < 200) { /* free only */
 			mutex_lock(&bl->mutex);
 			for(b=0; b<BINS_PER_BLOCK; b++)
 				bin_free(&bl->b[b]);
@@ -102,12 +131,14 @@ malloc_test(struct thread_st *st)
 		} else { /* alloc/realloc */
 			/* Generate random numbers in advance. */
 			for(b=0; b<BINS_PER_BLOCK; b++) {
-				rsize[b] = RANDOM(&ld, st->u.size) + 1;
+				rsize[b] = tdist_size(ph, &ld, st->u.size);
 				rnum[b] = lran2(&ld);
 			}
 			mutex_lock(&bl->mutex);
-			for(b=0; b<BINS_PER_BLOCK; b++)
+			for(b=0; b<BINS_PER_BLOCK; b++) {
 				bin_alloc(&bl->b[b], rsize[b], rnum[b]);
+				bl->death[b] = 0;
+			}
 			mutex_unlock(&bl->mutex);
 			i += BINS_PER_BLOCK;
 		}
@@ -115,6 +146,7 @@ malloc_test(struct thread_st *st)
 		bin_test();
 #endif
 	}
+	tdist_count(i);
 }
 
 int n_total=0, n_total_max=N_TOTAL, n_running;
@@ -152,6 +184,9 @@ main(int argc, char *argv[])
 	printf("ptmalloc_init\n");
 #endif
 
+	i = tdist_options(argc, argv, "t-test2");
+	argc -= i;
+	argv += i;
 	if(argc > 1) n_total_max = atoi(argv[1]);
 	if(n_total_max < 1) n_thr = 1;
 	if(argc > 2) n_thr = atoi(argv[2]);
@@ -162,7 +197,7 @@ main(int argc, char *argv[])
 	if(argc > 4) size = atol(argv[4]);
 	if(size < 2) size = 2;
 
-	bins = MEMORY/size;
+	bins = MEMORY/tdist_size_bound(size);
 	if(argc > 5) bins = atoi(argv[5]);
 	if(bins < BINS_PER_BLOCK) bins = BINS_PER_BLOCK;
 
@@ -177,7 +212,10 @@ main(int argc, char *argv[])
 
 	for(i=0; i<n_blocks; i++) {
 		mutex_init(&blocks[i].mutex);
-		for(j=0; j<BINS_PER_BLOCK; j++) blocks[i].b[j].size = 0;
+		for(j=0; j<BINS_PER_BLOCK; j++) {
+			blocks[i].b[j].size = 0;
+			blocks[i].death[j] = 0;
+		}
 	}
 
 	st = (struct thread_st *)malloc(n_thr*sizeof(*st));
@@ -217,6 +255,7 @@ main(int argc, char *argv[])
 	}
 	free(st);
 	free(blocks);
+	tdist_report(n_thr);
 #if USE_MALLOC
 	malloc_stats();
 #endif
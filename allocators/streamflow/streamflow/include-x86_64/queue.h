@@ -4,8 +4,9 @@
 #include "atomic.h"
 #include <stdlib.h>
 
+/* x86_64 user space addresses take 47 bits. */
 typedef struct {
-	volatile unsigned long long top:46, ocount:18;
+	volatile unsigned long long top:47, ocount:17;
 } top_aba_t;
 
 // Pseudostructure for lock-free list elements.
@@ -56,7 +57,7 @@ static inline void *lf_lifo_dequeue(lf_lifo_queue_t *queue)
 		if (head.top == 0)
 			return NULL;
 		next.top = (unsigned long)((struct queue_elem_t *)head.top)->next;
-		next.ocount += 1;
+		next.ocount = head.ocount + 1;
 		if (compare_and_swap64((unsigned long long *)&(queue->both), *((unsigned long long*)&head), *((unsigned long long*)&next))) {
 			return((void *)head.top);
 		}
@@ -76,7 +77,7 @@ static inline int lf_lifo_enqueue(lf_lifo_queue_t *queue, void *element)
 
 		((struct queue_elem_t *)element)->next = (struct queue_elem_t *)old_top.top;
 		new_top.top = (unsigned long)element;
-		new_top.ocount += 1;
+		new_top.ocount = old_top.ocount + 1;
 		if (compare_and_swap64((unsigned long long *)&(queue->both), *((unsigned long long*)&old_top), *((unsigned long long*)&new_top))) {
 			return 0;
 		}
@@ -103,6 +103,10 @@ void QueryPerformanceFrequency(long * x)
 #include  <time.h>
 #include  <assert.h>
 
+#ifdef PERFCOUNT
+#include "perfcount.h"
+#endif
+
 #define _REENTRANT 1
 #include <pthread.h>
 #ifdef __sun
@@ -212,6 +216,10 @@ typedef struct thr_data {
   volatile int finished ;
   struct lran2_st rgen ;
 
+#ifdef PERFCOUNT
+  struct perfcount pc ;        /* over the slot's threads this round */
+#endif
+
 } thread_data;
 
 void runthreads(long sleep_cnt, int min_threads, int max_threads, 
@@ -240,6 +248,112 @@ extern  int   cFreeSpace ;
 
 int cChecked=0 ;
 
+/* Latency mode (-l, or -lN to sample one operation pair in N): time
+ * malloc and free with get_cycles() into per-thread histograms, merged
+ * and printed after each round.  The timer costs a few dozen cycles a
+ * call, so sampling keeps it from swamping throughput.
+ *
+ * The histograms are log-linear, as in HdrHistogram: values below
+ * 2*LAT_SUB get a bucket each, and every power of two above that is
+ * split into LAT_SUB buckets, which keeps each bucket within 1/LAT_SUB
+ * (about 3%) of the values it counts. */
+#define LAT_SUB_BITS    5
+#define LAT_SUB         (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS     ((64 - LAT_SUB_BITS) * LAT_SUB)
+
+enum { LAT_MALLOC, LAT_FREE, LAT_OPS } ;
+
+int             latency=0 ;          /* sampling period, 0 if off */
+static unsigned long long lat_hist[MAX_THREADS][LAT_OPS][LAT_BUCKETS] ;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LAT_UNIT        "cycles"
+static inline unsigned long long get_cycles(void)
+{
+  unsigned int lo, hi ;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi)) ;
+  return ((unsigned long long)hi << 32) | lo ;
+}
+#else
+#define LAT_UNIT        "ns"
+static inline unsigned long long get_cycles(void)
+{
+  struct timespec ts ;
+  clock_gettime(CLOCK_MONOTONIC, &ts) ;
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec ;
+}
+#endif
+
+static inline int lat_bucket(unsigned long long v)
+{
+  int shift = 0 ;
+
+  if (v >= 2 * LAT_SUB)
+    shift = 64 - __builtin_clzll(v) - (LAT_SUB_BITS + 1) ;
+  return (shift << LAT_SUB_BITS) + (int)(v >> shift) ;
+}
+
+/* The smallest value counted in bucket b. */
+static unsigned long long lat_value(int b)
+{
+  int shift ;
+
+  if (b < 2 * LAT_SUB)
+    return b ;
+  shift = (b >> LAT_SUB_BITS) - 1 ;
+  return (unsigned long long)((b & (LAT_SUB - 1)) + LAT_SUB) << shift ;
+}
+
+static unsigned long long lat_percentile(unsigned long long *h,
+					 unsigned long long n, double pct)
+{
+  unsigned long long want = (unsigned long long)(n * pct / 100.0) + 1 ;
+  unsigned long long seen = 0 ;
+  int b ;
+
+  if (want > n)
+    want = n ;
+  for (b = 0; b < LAT_BUCKETS; b++) {
+    seen += h[b] ;
+    if (seen >= want)
+      return lat_value(b) ;
+  }
+  return 0 ;
+}
+
+/* Merge the histograms of the first nthreads threads, print the
+ * percentiles of each operation and clear them for the next round. */
+static void lat_report(int nthreads)
+{
+  static const char *name[LAT_OPS] = { "malloc", "free" } ;
+  static unsigned long long h[LAT_BUCKETS] ;
+  unsigned long long n ;
+  int op, i, b, max ;
+
+  for (op = 0; op < LAT_OPS; op++) {
+    memset(h, 0, sizeof(h)) ;
+    for (i = 0; i < nthreads; i++) {
+      for (b = 0; b < LAT_BUCKETS; b++)
+	h[b] += lat_hist[i][op][b] ;
+      memset(lat_hist[i][op], 0, sizeof(lat_hist[i][op])) ;
+    }
+    n = 0 ;
+    max = 0 ;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      n += h[b] ;
+      if (h[b])
+	max = b ;
+    }
+    if (n == 0)
+      continue ;
+    printf("%s latency (%s): p50 %llu p90 %llu p99 %llu p999 %llu max %llu, %llu samples\n",
+	   name[op], LAT_UNIT,
+	   lat_percentile(h, n, 50.0), lat_percentile(h, n, 90.0),
+	   lat_percentile(h, n, 99.0), lat_percentile(h, n, 99.9),
+	   lat_value(max), n) ;
+  }
+}
+
 #if defined(_WIN32)
 extern "C" {
   extern HANDLE crtheap;
@@ -284,6 +398,19 @@ int main (int argc, char *argv[])
   int          num_chunks=10000;
   long sleep_cnt;
 
+  /* -l[N] turns on latency mode; take it out before the positional args */
+  for (int a = 1; a < argc; a++) {
+    if (strncmp(argv[a], "-l", 2) == 0) {
+      latency = argv[a][2] ? atoi(&argv[a][2]) : 1 ;
+      if (latency < 1)
+	latency = 1 ;
+      for (int b = a; b < argc; b++)
+	argv[b] = argv[b + 1] ;
+      argc-- ;
+      a-- ;
+    }
+  }
+
   if (argc > 7) {
     sleep_cnt = atol(argv[1]);
     min_size = atoi(argv[2]);
@@ -514,6 +641,9 @@ void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthrea
 	de_area[i].cThreads    = 0 ;
 	de_area[i].finished    = FALSE ;
 	lran2_init(&de_area[i].rgen, de_area[i].seed) ;
+#ifdef PERFCOUNT
+	perfcount_init(&de_area[i].pc) ;
+#endif
 
 #ifdef __WIN32__
 	_beginthread((void (__cdecl*)(void *)) exercise_heap, 0, &de_area[i]) ;  
@@ -578,6 +708,22 @@ void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthrea
       used_space = 0;
       
       printf ("%8.0f operations per second, %2d threads.\n", sum_allocs / duration, sum_threads);
+      if (latency)
+	lat_report(num_threads) ;
+#ifdef PERFCOUNT
+      {
+	struct perfcount all ;
+	char label[32] ;
+
+	perfcount_init(&all) ;
+	for (i = 0; i < num_threads; i++) {
+	  sprintf(label, "thread %d", i + 1) ;
+	  perfcount_print(stdout, label, &de_area[i].pc) ;
+	  perfcount_add(&all, &de_area[i].pc) ;
+	}
+	perfcount_print(stdout, "all", &all) ;
+      }
+#endif
 
 #if 0
       printf("%2d ", num_threads ) ;
@@ -606,23 +752,37 @@ static void * exercise_heap( void *pinput)
   long          blk_size ;
   int           range ;
   volatile char	ch = '0';
+  unsigned long long (*lat)[LAT_BUCKETS] ;
+  unsigned long long t0 = 0 ;
+  int           countdown = 1, timed ;
 
   if( stopflag ) return 0;
 
   pdea = (thread_data *)pinput ;
+  lat = lat_hist[pdea->threadno - 1] ;
   pdea->finished = FALSE ;
   pdea->cThreads++ ;
   range = pdea->max_size - pdea->min_size ;
+#ifdef PERFCOUNT
+  perfcount_start(&pdea->pc) ;
+#endif
 
   /* allocate NumBlocks chunks of random size */
   for( cblks=0; cblks<pdea->NumBlocks; cblks++){
     victim = lran2(&pdea->rgen)%pdea->asize ;
     assert(victim >= 0 && victim < pdea->asize);
+    timed = latency && --countdown == 0 ;
+    if (timed) {
+      countdown = latency ;
+      t0 = get_cycles() ;
+    }
 #ifdef CPP
     delete pdea->array[victim] ;
 #else
     free(pdea->array[victim]) ;
 #endif
+    if (timed)
+      lat[LAT_FREE][lat_bucket(get_cycles() - t0)]++ ;
     pdea->cFrees++ ;
 
     if (range == 0) {
@@ -630,11 +790,15 @@ static void * exercise_heap( void *pinput)
     } else {
       blk_size = pdea->min_size+lran2(&pdea->rgen)%range ;
     }
+    if (timed)
+      t0 = get_cycles() ;
 #ifdef CPP
     pdea->array[victim] = new char[blk_size] ;
 #else
     pdea->array[victim] = (char *) malloc(blk_size) ;
 #endif
+    if (timed)
+      lat[LAT_MALLOC][lat_bucket(get_cycles() - t0)]++ ;
     pdea->blksize[victim] = blk_size ;
     assert(pdea->array[victim] != NULL) ;
 
@@ -651,6 +815,9 @@ static void * exercise_heap( void *pinput)
 
   //  	printf("Thread %u terminating: %d allocs, %d frees\n",
   //		      pdea->threadno, pdea->cAllocs, pdea->cFrees) ;
+#ifdef PERFCOUNT
+  perfcount_stop(&pdea->pc) ;
+#endif
   pdea->finished = TRUE ;
 
   if( !stopflag ){
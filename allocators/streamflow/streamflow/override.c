@@ -129,106 +129,62 @@ void pthread_exit(void* arg)
 }
 
 #ifdef NUMA
-/* Discover, through the /proc filesystem, what cpu we're on. */
+/* Record which node the calling thread is on. Threads are not bound, so this 
+ * is the node it started out on. */
 void discover_cpu()
 {
-	FILE* stats;
-	unsigned int cpu;
-	int dint;
-	char tcomm[16];
-	char stat;
-	long dlong;
-	unsigned long dulong;
-	unsigned long long dullong;
-	char buffer[512];
-	char proc[] = "/proc/self/task/";
-
-	strcpy(buffer, proc);
-	sprintf(buffer + strlen(proc), "%lu", syscall(__NR_gettid));
-	strcpy(buffer + strlen(buffer), "/stat");
-
-	if ((stats = fopen(buffer, "r")) == NULL) {
-		perror("discover_cpu");
-		exit(1);
-	}
+	int cpu = sched_getcpu();
 
-	fscanf(stats, "%d %s %c %d %d %d %d %d %lu %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %d %ld %llu %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %d %d %lu %lu\n",
-			&dint,
-			tcomm,
-			&stat,
-			&dint, &dint, &dint, &dint, &dint,
-			&dulong, &dulong, &dulong, &dulong, &dulong, &dulong, &dulong,
-			&dlong, &dlong, &dlong, &dlong,
-			&dint, 
-			&dlong,
-			&dullong,
-			&dulong,
-			&dlong,
-			&dulong, &dulong, &dulong, &dulong, &dulong, &dulong, &dulong, 
-			&dulong, &dulong, &dulong, &dulong, &dulong, &dulong,
-			&dint, 
-			&cpu, 
-			&dulong,
-			&dulong);
-
-	printf("thread %d on cpu %d and node%d\n", thread_id, cpu, cpu_to_node[cpu]);
-	fflush(stdout);
-
-	fclose(stats);
+	if (cpu >= 0 && cpu < NUMA_MAX_CPUS) {
+		thread_node = cpu_to_node[cpu];
+	}
+	else {
+		thread_node = 0;
+	}
 }
 
-/* Determine the cpu-to-node mapping, bind the first thread. */
+/* Determine the cpu-to-node mapping from the cpulist of each node in sysfs. 
+ * This runs from inside the allocator, so it must not call malloc(); hence 
+ * open() and read() instead of opendir() and stdio. Cpus of absent nodes, 
+ * or every cpu on a kernel without NUMA support, stay on node 0. */
 void numa_start()
 {
-	DIR* root_dir;
-	struct dirent* root_entry;
 	char path[NAME_MAX];
-	size_t root_path_length;
-
-	if (numa_available() < 0) {
-		fprintf(stderr, "No NUMA support. Exiting.\n");
-		exit(1);
-	}
-
-	strcpy(path, NODE_MAP_PATH);
-	root_path_length = strlen(path);
-	root_dir = opendir(path);
-	if (!root_dir) {
-		perror("numa_start");
-		exit(1);
-	}
+	char buffer[4096];
+	int node;
 
-	while ((root_entry = readdir(root_dir)) != NULL) {
-		DIR* node_dir;
-		struct dirent* node_entry;
-		unsigned long node;
+	for (node = 0; node < NUM_NUMA_NODES; ++node) {
+		char* curr;
+		ssize_t length;
+		int fd;
 
-		if (strncmp(root_entry->d_name, "node", 4)) {
+		snprintf(path, sizeof(path), NODE_MAP_PATH "node%d/cpulist", node);
+		if ((fd = open(path, O_RDONLY)) < 0) {
 			continue;
 		}
-		
-		node = strtoul(root_entry->d_name + 4, NULL, 0);
-		strcpy(path + root_path_length, root_entry->d_name);
-		node_dir = opendir(path);
-		if (!root_dir) {
-			perror("numa_start");
-			exit(1);
+		length = read(fd, buffer, sizeof(buffer) - 1);
+		close(fd);
+		if (length <= 0) {
+			continue;
 		}
+		buffer[length] = '\0';
 
-		while ((node_entry = readdir(node_dir)) != NULL) {
-			unsigned long cpu;
+		/* The list looks like "0-3,8-11". */
+		curr = buffer;
+		while (isdigit(*curr)) {
+			unsigned long first, last, cpu;
 
-			if (strncmp(node_entry->d_name, "cpu", 3) || isalpha(node_entry->d_name[3])) {
-				continue;
+			first = last = strtoul(curr, &curr, 10);
+			if (*curr == '-') {
+				last = strtoul(curr + 1, &curr, 10);
+			}
+			for (cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; ++cpu) {
+				cpu_to_node[cpu] = node;
+			}
+			if (*curr == ',') {
+				++curr;
 			}
-
-			cpu = strtoul(node_entry->d_name + 3, NULL, 0);
-			cpu_to_node[cpu] = node;
 		}
-
 	}
-
-	discover_cpu();
 }
 #endif
-
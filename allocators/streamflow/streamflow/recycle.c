@@ -22,6 +22,9 @@
 #include <stdio.h>
 #include <pthread.h>
 /* EDB DISABLED #include <numa.h> */
+#ifdef PERFCOUNT
+#include "perfcount.h"
+#endif
 
 size_t min_size;
 size_t max_size;
@@ -56,6 +59,9 @@ void* simulate_work(void* arg)
 	double rand;
 	size_t object_size;
 
+#ifdef PERFCOUNT
+	perfcount_start((struct perfcount*)arg);
+#endif
 	for (i = 0; i < iterations; ++i) {
 
 		if (i % rate == 0 && i != 0) {
@@ -70,6 +76,9 @@ void* simulate_work(void* arg)
 	}
 
 	free(reserve);
+#ifdef PERFCOUNT
+	perfcount_stop((struct perfcount*)arg);
+#endif
 
 	return NULL;
 }
@@ -79,6 +88,11 @@ void numa_start(void);
 int main(int argc, char* argv[])
 {
 	pthread_t* threads;
+#ifdef PERFCOUNT
+	struct perfcount* pcs;
+	struct perfcount all;
+	char label[32];
+#endif
 
 	//numa_start();
 
@@ -97,16 +111,39 @@ int main(int argc, char* argv[])
 	threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
 
 	int i;
+#ifdef PERFCOUNT
+	pcs = (struct perfcount*)malloc(num_threads * sizeof(struct perfcount));
+	for (i = 0; i < num_threads; ++i) {
+		perfcount_init(&pcs[i]);
+	}
+	for (i = 0; i < num_threads-1; ++i) {
+		pthread_create(&threads[i], NULL, simulate_work, &pcs[i]);
+	}
+
+	simulate_work(&pcs[num_threads-1]);
+#else
 	for (i = 0; i < num_threads-1; ++i) {
 		pthread_create(&threads[i], NULL, simulate_work, NULL);
 	}
 
 	simulate_work(NULL);
+#endif
 	
 	for (i = 0; i < num_threads-1; ++i) {
 		pthread_join(threads[i], NULL);
 	}
 
+#ifdef PERFCOUNT
+	perfcount_init(&all);
+	for (i = 0; i < num_threads; ++i) {
+		sprintf(label, "thread %d", i + 1);
+		perfcount_print(stdout, label, &pcs[i]);
+		perfcount_add(&all, &pcs[i]);
+	}
+	perfcount_print(stdout, "all", &all);
+	free(pcs);
+#endif
+
 	return 0;
 }
 
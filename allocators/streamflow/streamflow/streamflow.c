@@ -54,8 +54,10 @@ static int init_flag;
 static lock_t init_lock;
 #endif
 
-__thread counting_queue_t remote_cache;
-__thread unsigned int remote_cache_total;
+/* Remote frees not yet published. Initial-exec, since the general dynamic 
+ * model costs a __tls_get_addr() call each time the compiler needs the 
+ * address, which would otherwise eat up what batching saves. */
+static __thread remote_outboxes_t remote_outboxes __attribute__((tls_model("initial-exec")));
 
 /* Global thread_id counter. */
 unsigned int global_id_counter = 0;
@@ -65,23 +67,45 @@ __thread unsigned int thread_id = 0;
 
 #ifdef NUMA
 /* Maps a cpu to the node its on. */
-int cpu_to_node[NUM_NUMA_NODES];
+int cpu_to_node[NUMA_MAX_CPUS];
+
+/* The node this thread allocates superpages on; -1 until discovered. */
+__thread int thread_node = -1;
+
+static int numa_init_flag;
+static lock_t numa_init_lock;
+
+/* From <numaif.h>; we call mbind() directly so we do not need libnuma. */
+#define MPOL_PREFERRED 1
 #endif
 
-static radix_interior_t* radix_root;
+static radix_interior_t* volatile radix_root;
 
 /* All superpage related structures. The lock protects 
- * the other two structures. */
+ * the list. */
 #ifdef NUMA
 static __thread lock_t super_lock;
 static __thread double_list_t superpage_list;
-static __thread quickieblock_t sph_pageblocks;
 #else
 static lock_t super_lock;
 static double_list_t superpage_list;
-static quickieblock_t sph_pageblocks;
 #endif
 
+/* Internal metadata (superpage headers and radix tree nodes) comes from a 
+ * pool shared by all threads: a lock-free list of free objects per class, 
+ * in front of which each thread keeps a magazine of up to META_MAGAZINE_SIZE 
+ * of them. A thread that frees metadata, whoever allocated it, keeps it in 
+ * its magazine or passes half the magazine on to the shared list, and a 
+ * thread that exits passes on all of it, so the metadata is bounded by what 
+ * is live at once rather than growing with every thread ever created. The 
+ * pool's pages are never unmapped, which keeps the lock-free list safe to 
+ * read from. */
+static counting_lf_lifo_queue_t meta_pool[META_CLASSES];
+static __thread counting_queue_t meta_magazines[META_CLASSES];
+static const size_t meta_object_size[META_CLASSES] = {
+	sizeof(superpage_t), sizeof(radix_interior_t), sizeof(radix_leaf_t)
+};
+
 #ifdef BIBOP
 /* Each page in virtual memory has an entry in the page vector that records two 
  * pieces of information: is this a "large" or small object, and the offset to 
@@ -95,17 +119,28 @@ static page_record_t bibop[PAGES_IN_ADDR_SPACE];
  * 		thread local active pageblocks, indexed by object class; the address 
  * 		doubles as the thread id
  * 	local_inactive_pageblocks:
- * 		thread local cached inactive pageblocks, indexed by pageblock size
+ * 		thread local cached inactive pageblocks, indexed by pageblock size, 
+ * 		with their limits in local_inactive_limits
  * 	global_partial_pageblocks:
  * 		global orphaned pageblocks whose owning thread has terminated, 
- * 		indexed by object class 
+ * 		indexed by node and object class 
  * 	global_free_pageblocks:
- * 		global cached completely free pageblocks, indexed by pageblock size 
+ * 		global cached completely free pageblocks, indexed by node and 
+ * 		pageblock size, with their limits in global_inactive_limits
+ *
+ * The global lists are kept per NUMA node, so threads only pick up 
+ * pageblocks whose memory is local to them.
  */
 static __thread heap_t local_heap[OBJECT_SIZE_CLASSES];
 static __thread counting_queue_t local_inactive_pageblocks[PAGEBLOCK_SIZE_CLASSES];
-static counting_lf_lifo_queue_t global_partial_pageblocks[OBJECT_SIZE_CLASSES];
-static counting_lf_lifo_queue_t global_free_pageblocks[PAGEBLOCK_SIZE_CLASSES];
+static counting_lf_lifo_queue_t global_partial_pageblocks[GLOBAL_NODES][OBJECT_SIZE_CLASSES];
+static counting_lf_lifo_queue_t global_free_pageblocks[GLOBAL_NODES][PAGEBLOCK_SIZE_CLASSES];
+static __thread inactive_limit_t local_inactive_limits[PAGEBLOCK_SIZE_CLASSES];
+
+/* Thread local cached free medium objects, indexed by log2 of their size in 
+ * pages, so that most medium allocations don't need the superpage lock. */
+static __thread counting_queue_t medium_cache[MEDIUM_CACHE_BINS];
+static inactive_limit_t global_inactive_limits[GLOBAL_NODES][PAGEBLOCK_SIZE_CLASSES];
 
 static inline unsigned int quick_log2(unsigned int x);
 static inline int max(int a, int b);
@@ -115,6 +150,7 @@ static inline int free_compute_size_class(size_t size);
 static inline int reverse_size_class(size_t size_class);
 
 /* Radix tree operations. */
+static inline radix_leaf_t* radix_find_leaf(unsigned long page, int create);
 static void radix_register(void* start, int num_pages, void* ptr, size_t size, short object_type);
 static inline void radix_extract(void* object, void** ptr, size_t* size, short* is_large);
 static inline radix_interior_t* radix_interior_alloc(void);
@@ -122,9 +158,11 @@ static inline radix_leaf_t* radix_leaf_alloc(void);
 static inline void radix_interior_free(radix_interior_t* node);
 static inline void radix_leaf_free(radix_leaf_t* node);
 
-/* Operations on quickie pageblocks. */
-static void* quickie_alloc(quickieblock_t* quickie, size_t object_size);
-static inline void quickie_free(quickieblock_t* quickie, void* object);
+/* Operations on the metadata pool. */
+static void meta_refill(int meta_class);
+static inline void* meta_alloc(int meta_class);
+static inline void meta_free(int meta_class, void* object);
+static void meta_flush_magazines(void);
 
 /* Buddy operations on superpages. */
 static inline int find_index(superpage_t* super, page_chunk_t* chunk, int order);
@@ -134,6 +172,8 @@ static void* buddy_alloc(superpage_t* super, size_t size);
 static void buddy_free(superpage_t* super, void* start, size_t length);
 
 /* All other superpage operations. */
+static inline int local_node(void);
+static inline void superpage_bind(void* start, size_t length, int node);
 static void get_free_superpage(superpage_t** sp, size_t size);
 static void* supermap(size_t size);
 static void superunmap(void* start, size_t length);
@@ -141,10 +181,14 @@ static void superunmap(void* start, size_t length);
 /* All virtual page operations. */
 static inline void register_pages(void* start, int num_pages, void* ptr, size_t size, short object_type);
 static inline void* page_alloc(size_t size);
+static void* superpage_pool_alloc(void);
 static inline void page_free(void* start, size_t length);
+static void* medium_alloc(size_t size);
+static void medium_free(void* start, size_t length);
 static void* medium_or_large_alloc(size_t size);
 
 /* All operations on the global free list. */
+static inline int pageblock_node(pageblock_t* pageblock);
 static void insert_global_free_pageblocks(pageblock_t* pageblock);
 static void insert_global_partial_pageblocks(pageblock_t* pageblock, int class_index);
 static pageblock_t* remove_global_pageblocks(int class_index, int pageblock_size);
@@ -156,12 +200,17 @@ static void double_list_remove(void* node, double_list_t* list);
 
 /* Helper functions for malloc */
 static inline void headerize_object(void** object, void* ptr, size_t size, short object_type);
-static inline int compute_pageblock_size(int index);
+static inline int pageblock_size_index(unsigned long pageblock_size);
+static inline int compute_pageblock_size(int index, int objects);
+static inline int adapt_pageblock_size(heap_t* heap, int index, int grow);
+static inline void inactive_request(inactive_limit_t* limit, int hit, unsigned int max_limit);
 static pageblock_t* get_free_pageblock(heap_t* heap, int index);
 
 /* Helper functions for free. */
 static inline void local_free(void* object, pageblock_t* pageblock, heap_t* my_heap);
 static void remote_free(void* object, pageblock_t* pageblock, heap_t* my_heap);
+static void flush_remote_outbox(remote_outbox_t* outbox);
+static void flush_remote_outboxes(void);
 static void adopt_pageblock(void* object, pageblock_t* pageblock, heap_t* my_heap);
 
 static const int base[] = {	0, 16, 24, 28, 30, 31, 31, 32, 32, 32, 
@@ -370,38 +419,72 @@ static inline int reverse_size_class(size_t size_class)
 	return reverse[size_class];
 }
 
+/* Radix nodes must start out empty; a node from the pool may have been 
+ * used before (by a lost race in radix_find_leaf()), and it keeps the 
+ * pointer the pool links it by. */
 static inline radix_interior_t* radix_interior_alloc(void)
 {
-	void* node = page_alloc(sizeof(radix_interior_t));
-	return (radix_interior_t*)node;
+	radix_interior_t* node = (radix_interior_t*)meta_alloc(META_RADIX_INTERIOR);
+	memset(node, 0, sizeof(radix_interior_t));
+	return node;
 }
 
 static inline radix_leaf_t* radix_leaf_alloc(void)
 {
-	void* node = page_alloc(sizeof(radix_leaf_t));
-	return (radix_leaf_t*)node;
+	radix_leaf_t* node = (radix_leaf_t*)meta_alloc(META_RADIX_LEAF);
+	memset(node, 0, sizeof(radix_leaf_t));
+	return node;
 }
 
 static inline void radix_interior_free(radix_interior_t* node)
 {
-	page_free(node, sizeof(radix_interior_t));
+	meta_free(META_RADIX_INTERIOR, node);
 }
 
 static inline void radix_leaf_free(radix_leaf_t* node)
 {
-	page_free(node, sizeof(radix_leaf_t));
+	meta_free(META_RADIX_LEAF, node);
 }
 
-static void radix_register(void* start, int num_pages, void* ptr, size_t size, short object_type)
+/* Returns the leaf that holds the record for page. If create is set, missing 
+ * nodes on the way down are allocated and installed in a lock-free manner; 
+ * whoever loses the race frees its node and uses the winner's. Otherwise, 
+ * the nodes are assumed to exist. */
+static inline radix_leaf_t* radix_find_leaf(unsigned long page, int create)
 {
-	/* Ensure in a lock-free manner that we have a root node. */
-	if (radix_root == NULL) {
-		radix_interior_t* temp_root = radix_interior_alloc();
-		if (!compare_and_swap_ptr(&radix_root, NULL, temp_root)) {
-			radix_interior_free(temp_root);
+	radix_interior_t* volatile* slot = &radix_root;
+	radix_interior_t* node;
+	int shift = RADIX_LEAF_BITS + (RADIX_DEPTH - 2) * RADIX_INTERIOR_BITS;
+	int level;
+
+	for (level = 0; level < RADIX_DEPTH - 1; ++level) {
+		node = *slot;
+		if (create && node == NULL) {
+			node = radix_interior_alloc();
+			if (!compare_and_swap_ptr(slot, NULL, node)) {
+				radix_interior_free(node);
+				node = *slot;
+			}
+		}
+		slot = (radix_interior_t* volatile*)&node->prefixes[(page >> shift) & (RADIX_INTERIOR_SIZE - 1)];
+		shift -= RADIX_INTERIOR_BITS;
+	}
+
+	node = *slot;
+	if (create && node == NULL) {
+		node = (radix_interior_t*)radix_leaf_alloc();
+		if (!compare_and_swap_ptr(slot, NULL, node)) {
+			radix_leaf_free((radix_leaf_t*)node);
+			node = *slot;
 		}
 	}
 
+	return (radix_leaf_t*)node;
+}
+
+static void radix_register(void* start, int num_pages, void* ptr, size_t size, short object_type)
+{
+	radix_leaf_t* leaf = NULL;
 	int i;
 
 	unsigned int log_size = 0;
@@ -410,28 +493,23 @@ static void radix_register(void* start, int num_pages, void* ptr, size_t size, s
 	}
 
 	unsigned long page = (unsigned long)start >> PAGE_BITS;
+	if (unlikely((page + num_pages - 1) >> RADIX_BITS)) {
+		fprintf(stderr, "radix_register() address %p is beyond the %d-bit address space\n", start, ADDR_SPACE_BITS);
+		fflush(stderr);
+		exit(1);
+	}
+
 	for (i = 0; i < num_pages; ++i) {
-		unsigned long level1 = page >> (RADIX_INTERIOR_BITS + RADIX_LEAF_BITS);
-		unsigned long level2 = (page >> RADIX_LEAF_BITS) & (RADIX_INTERIOR_SIZE - 1);
-		unsigned long level3 = page & (RADIX_LEAF_SIZE - 1);
+		unsigned long index = page & (RADIX_LEAF_SIZE - 1);
 		page_record_t record;
 
-		if (radix_root->prefixes[level1] == NULL) {
-			radix_interior_t* temp_interior = radix_interior_alloc();
-			if (!compare_and_swap_ptr(&radix_root->prefixes[level1], NULL, temp_interior)) {
-				radix_interior_free(temp_interior);
-			}
-		}
-
-		if (radix_root->prefixes[level1]->prefixes[level2] == NULL) {
-			radix_leaf_t* temp_leaf = radix_leaf_alloc();
-			if (!compare_and_swap_ptr(&radix_root->prefixes[level1]->prefixes[level2], NULL, temp_leaf)) {
-				radix_leaf_free(temp_leaf);
-			}
+		/* Only walk the tree again when we cross into the next leaf. */
+		if (leaf == NULL || index == 0) {
+			leaf = radix_find_leaf(page, 1);
 		}
 
-		/* Accessing the third level does not need any synchronization. Since there is a 
-		 * one-to-one correspondence between pages in the system and third level values, 
+		/* Accessing the leaf level does not need any synchronization. Since there is a 
+		 * one-to-one correspondence between pages in the system and leaf values, 
 		 * and we assume the OS will not return the same page multiple times, we know 
 		 * that we are the only one accessing this location. */
 		record.object_type = object_type;
@@ -447,7 +525,7 @@ static void radix_register(void* start, int num_pages, void* ptr, size_t size, s
 						break;
 		}
 
-		((radix_leaf_t*)radix_root->prefixes[level1]->prefixes[level2])->values[level3] = record;
+		leaf->values[index] = record;
 
 		page += 1;	
 	}
@@ -458,11 +536,8 @@ static void radix_register(void* start, int num_pages, void* ptr, size_t size, s
 static inline void radix_extract(void* object, void** ptr, size_t* size, short* object_type)
 {
 	unsigned long page = (unsigned long)object >> PAGE_BITS;
-	unsigned long level1 = page >> (RADIX_INTERIOR_BITS + RADIX_LEAF_BITS);
-	unsigned long level2 = (page >> RADIX_LEAF_BITS) & (RADIX_INTERIOR_SIZE - 1);
-	unsigned long level3 = page & (RADIX_LEAF_SIZE - 1);
 	page_record_t record;
-	record = ((radix_leaf_t*)radix_root->prefixes[level1]->prefixes[level2])->values[level3];
+	record = radix_find_leaf(page, 0)->values[page & (RADIX_LEAF_SIZE - 1)];
 
 	*object_type = record.object_type;
 	switch (*object_type) {
@@ -599,49 +674,139 @@ static void buddy_free(superpage_t* super, void* start, size_t length)
 
 	/* If there are still used page chunks, add it to the appropriate 
 	 * free list. Otherwise, we merged page chunks all the way back up 
-	 * to an entire superpage, which means we can return it to the OS. */
+	 * to an entire superpage, which means we can return it to the OS. 
+	 * With huge pages, the last superpage on the list is kept instead, 
+	 * since remapping it would cost us its huge pages again. */
 	if (curr_order < BUDDY_ORDER_MAX - 1) {
 		double_list_insert_front(chunk, &super->buddy[curr_order].free_list);
 		if (curr_order > super->largest_free_order || super->largest_free_order > BUDDY_ORDER_MAX) {
 			super->largest_free_order = curr_order;
 		}
 	}
+#if SUPERPAGE_BACKING != SUPERPAGE_SMALL
+	else if (super->list->head == (double_list_elem_t*)super && super->list->tail == (double_list_elem_t*)super) {
+		double_list_insert_front(chunk, &super->buddy[BUDDY_ORDER_MAX - 1].free_list);
+		super->largest_free_order = BUDDY_ORDER_MAX - 1;
+	}
+#endif
 	else {
 		page_free(chunk, SUPERPAGE_SIZE);
 		double_list_remove(super, super->list);
-		quickie_free(super->quickie, super);
+		meta_free(META_SUPERPAGE, super);
 	}
 }
 
-static void* quickie_alloc(quickieblock_t* quickie, size_t object_size)
+/* Fills this thread's empty magazine of meta_class with up to half a 
+ * magazine from the shared pool, or, if the pool has none, with the 
+ * objects carved out of a fresh page (or a single object, if it is 
+ * bigger than a page). Objects are carved at multiples of their size, 
+ * which keeps superpage headers aligned as their type requires. */
+static void meta_refill(int meta_class)
 {
+	counting_queue_t* magazine = &meta_magazines[meta_class];
+	counting_lf_lifo_queue_t* pool = &meta_pool[meta_class];
+	size_t size = meta_object_size[meta_class];
+	size_t slab_size = size < PAGE_SIZE ? PAGE_SIZE : size;
+	size_t offset;
+	char* slab;
 	void* object;
 
-	/* We need to allocate space for a new pageblock in two cases: the first time 
-	 * this function is called (in which case unallocated will not point to 
-	 * anything), and when there is no more space in the last pageblock we allocated. */
-	if (quickie->unallocated == NULL || quickie->num_free_objects == 0) {
-		quickie->unallocated = page_alloc(PAGE_SIZE);
-		quickie->num_free_objects = PAGE_SIZE / object_size;
+	while (magazine->count < META_MAGAZINE_SIZE / 2 && pool->count > 0) {
+		if ((object = lf_lifo_dequeue(&pool->queue)) == NULL) {
+			break;
+		}
+		atmc_add32(&pool->count, -1);
+		seq_lifo_enqueue(&magazine->queue, object);
+		++magazine->count;
+	}
+	if (magazine->count > 0) {
+		return;
 	}
 
-	if (quickie->freed != NULL) {
-		object = quickie->freed;
-		quickie->freed = *((void**)(quickie->freed));
+	slab = (char*)page_alloc(slab_size);
+	for (offset = 0; offset + size <= slab_size; offset += size) {
+		seq_lifo_enqueue(&magazine->queue, slab + offset);
+		++magazine->count;
 	}
-	else {
-		object = (superpage_t*)quickie->unallocated;
-		quickie->unallocated += object_size;
+}
+
+static inline void* meta_alloc(int meta_class)
+{
+	counting_queue_t* magazine = &meta_magazines[meta_class];
+
+	if (unlikely(magazine->count == 0)) {
+		meta_refill(meta_class);
+	}
+	--magazine->count;
+	return seq_lifo_dequeue(&magazine->queue);
+}
+
+/* Frees into this thread's magazine; a full one passes half its objects 
+ * on to the shared pool, so that a thread that only frees metadata (of 
+ * superpages other threads allocated) does not hoard it. */
+static inline void meta_free(int meta_class, void* object)
+{
+	counting_queue_t* magazine = &meta_magazines[meta_class];
+	counting_lf_lifo_queue_t* pool = &meta_pool[meta_class];
+
+	seq_lifo_enqueue(&magazine->queue, object);
+	if (unlikely(++magazine->count > META_MAGAZINE_SIZE)) {
+		while (magazine->count > META_MAGAZINE_SIZE / 2) {
+			object = seq_lifo_dequeue(&magazine->queue);
+			--magazine->count;
+			atmc_add32(&pool->count, 1);
+			lf_lifo_enqueue(&pool->queue, object);
+		}
+	}
+}
+
+/* Passes all of this thread's cached metadata on to the shared pool. */
+static void meta_flush_magazines(void)
+{
+	void* object;
+	int i;
+
+	for (i = 0; i < META_CLASSES; ++i) {
+		while ((object = seq_lifo_dequeue(&meta_magazines[i].queue)) != NULL) {
+			atmc_add32(&meta_pool[i].count, 1);
+			lf_lifo_enqueue(&meta_pool[i].queue, object);
+		}
+		meta_magazines[i].count = 0;
+	}
+}
+
+/* Returns the node of the calling thread, reading the node map the 
+ * first time any thread asks. */
+static inline int local_node(void)
+{
+#ifdef NUMA
+	if (unlikely(thread_node < 0)) {
+		if (!numa_init_flag) {
+			spin_lock(&numa_init_lock);
+			if (!numa_init_flag) {
+				numa_start();
+				numa_init_flag = 1;
+			}
+			spin_unlock(&numa_init_lock);
+		}
+		discover_cpu();
 	}
-	--(quickie->num_free_objects);
 
-	return object;
+	return thread_node;
+#else
+	return 0;
+#endif
 }
 
-static inline void quickie_free(quickieblock_t* quickie, void* object)
+/* Asks the kernel to place the pages of a fresh superpage on node. This is 
+ * only a preference, so it is fine if the kernel ignores it. */
+static inline void superpage_bind(void* start, size_t length, int node)
 {
-	*((void**)object) = quickie->freed;
-	quickie->freed = (void*)object;
+#ifdef NUMA
+	unsigned long mask = 1UL << node;
+
+	syscall(SYS_mbind, start, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+#endif
 }
 
 static void get_free_superpage(superpage_t** super, size_t size)
@@ -674,8 +839,10 @@ static void get_free_superpage(superpage_t** super, size_t size)
 
 	/* If we couldn't find an existing superpage, get a new one from OS. */
 	if (*super == NULL) {
-		*super = (superpage_t*)quickie_alloc(&sph_pageblocks, sizeof(superpage_t));
-		(*super)->page_pool = page_alloc(SUPERPAGE_SIZE);
+		*super = (superpage_t*)meta_alloc(META_SUPERPAGE);
+		(*super)->page_pool = superpage_pool_alloc();
+		(*super)->node = local_node();
+		superpage_bind((*super)->page_pool, SUPERPAGE_SIZE, (*super)->node);
 		
 		/* Initialize bitmaps for buddy allocation */
 		int byte = 0;
@@ -690,7 +857,6 @@ static void get_free_superpage(superpage_t** super, size_t size)
 		 * this thread. It doubles as a thread ID. */
 		(*super)->lock = &super_lock;
 		(*super)->list = &superpage_list;
-		(*super)->quickie = &sph_pageblocks;
 
 		/* Stick the entire superpage into the buddy allocation scheme. */
 		double_list_insert_front((*super)->page_pool, &((*super)->buddy[BUDDY_ORDER_MAX - 1].free_list));
@@ -796,12 +962,101 @@ static inline void* page_alloc(size_t size)
 	return addr;
 }
 
+/* Gets the memory for a new superpage, backed by huge pages as configured 
+ * by SUPERPAGE_BACKING. The result is always SUPERPAGE_SIZE bytes that 
+ * page_free() can give back in one piece. */
+static void* superpage_pool_alloc(void)
+{
+#if SUPERPAGE_BACKING == SUPERPAGE_SMALL
+	return page_alloc(SUPERPAGE_SIZE);
+#else
+	void* addr;
+	unsigned long start;
+	unsigned long aligned;
+	size_t length;
+
+#if SUPERPAGE_BACKING == SUPERPAGE_HUGETLB && defined(MAP_HUGETLB)
+	addr = mmap(NULL, SUPERPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+	if (addr != MAP_FAILED) {
+		return addr;
+	}
+#endif
+
+	/* Over-allocate so that we can cut an aligned superpage out of the 
+	 * mapping, and return the slop on both sides. Every huge page in the 
+	 * superpage can then be backed by a transparent huge page. */
+	length = SUPERPAGE_SIZE + HUGE_PAGE_SIZE - PAGE_SIZE;
+	addr = page_alloc(length);
+	start = (unsigned long)addr;
+	aligned = (start + HUGE_PAGE_SIZE - 1) & ~((unsigned long)HUGE_PAGE_SIZE - 1);
+
+	if (aligned > start) {
+		page_free(addr, aligned - start);
+	}
+	if (start + length > aligned + SUPERPAGE_SIZE) {
+		page_free((void*)(aligned + SUPERPAGE_SIZE), start + length - aligned - SUPERPAGE_SIZE);
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise((void*)aligned, SUPERPAGE_SIZE, MADV_HUGEPAGE);
+#endif
+
+	return (void*)aligned;
+#endif
+}
+
 /* Frees length bytes to the system. */
 static inline void page_free(void* start, size_t length)
 {
 	munmap(start, length);
 }
 
+/* Gets a medium object of size bytes, a power-of-2 number of pages that is 
+ * at most SUPERPAGE_SIZE, with the superpage header pointer in its first 
+ * word, from the thread's cache if possible. */
+static void* medium_alloc(size_t size)
+{
+	void* mem;
+
+	if (size <= MEDIUM_CACHE_MAX_SIZE) {
+		counting_queue_t* bin = &medium_cache[quick_log2(size / PAGE_SIZE)];
+
+		mem = seq_lifo_dequeue(&bin->queue);
+		if (mem != NULL) {
+			--bin->count;
+			return mem;
+		}
+	}
+
+	mem = supermap(size);
+
+	/* Optimization: since we really only care about the first
+	 * page with large objects (that's the only page that free() 
+	 * ever gets), we only need to register the first page. A cached 
+	 * object keeps its registration. */
+	register_pages(mem, 1, ((pageblock_t*)mem)->sph, size, OBJECT_MEDIUM);
+
+	return mem;
+}
+
+/* Frees a medium object, with the superpage header pointer in its first 
+ * word, to the thread's cache, or to its superpage once the cache holds 
+ * MEDIUM_CACHE_BIN_BYTES of that size. */
+static void medium_free(void* start, size_t length)
+{
+	if (length <= MEDIUM_CACHE_MAX_SIZE) {
+		counting_queue_t* bin = &medium_cache[quick_log2(length / PAGE_SIZE)];
+
+		if ((bin->count + 1) * length <= MEDIUM_CACHE_BIN_BYTES) {
+			seq_lifo_enqueue(&bin->queue, start);
+			++bin->count;
+			return;
+		}
+	}
+
+	superunmap(start, length);
+}
+
 /* Gets a large amount of memory from the OS and tags it appropriately. */
 static void* medium_or_large_alloc(size_t size)
 {
@@ -812,12 +1067,7 @@ static void* medium_or_large_alloc(size_t size)
 		size = ceil((double)size / PAGE_SIZE) * PAGE_SIZE;
 		unsigned int pow = (size_t)ceil(log2(size));
 		size = 1 << pow;
-		mem = supermap(size);
-
-		/* Optimization: since we really only care about the first
-		 * page with large objects (that's the only page that free() 
-		 * ever gets), we only need to register the first page. */
-		register_pages(mem, 1, ((pageblock_t*)mem)->sph, size, OBJECT_MEDIUM);
+		mem = medium_alloc(size);
 		headerize_object(&mem, ((pageblock_t*)mem)->sph, size, OBJECT_MEDIUM);
 
 		memory_add32(&num_total_medium, 1);
@@ -835,41 +1085,58 @@ static void* medium_or_large_alloc(size_t size)
 	return mem;
 }
 
+/* The node whose global lists a pageblock belongs on. */
+static inline int pageblock_node(pageblock_t* pageblock)
+{
+#ifdef NUMA
+	return pageblock->sph->node;
+#else
+	return 0;
+#endif
+}
+
 /* Adds a pageblock to one of the global lists, or frees it to the OS/page manager. */
 static void insert_global_free_pageblocks(pageblock_t* pageblock)
 {
-	int size_index = quick_log2((pageblock->mem_pool_size + (unsigned long)pageblock->mem_pool - (unsigned long)pageblock) / PAGE_SIZE)
-			- quick_log2(MIN_PAGEBLOCK_SIZE / PAGE_SIZE);
+	int size_index = pageblock_size_index(pageblock->mem_pool_size + (unsigned long)pageblock->mem_pool - (unsigned long)pageblock);
+	int node = pageblock_node(pageblock);
+	counting_lf_lifo_queue_t* list = &global_free_pageblocks[node][size_index];
 
-	if (global_free_pageblocks[size_index].count >= MAX_GLOBAL_INACTIVE) {
+	if (list->count >= global_inactive_limits[node][size_index].limit) {
+		global_inactive_limits[node][size_index].overflowed = 1;
 		superunmap(pageblock, pageblock->mem_pool_size + CACHE_LINE_SIZE);
 	}
 	else {
-		atmc_add32(&global_free_pageblocks[size_index].count, 1);
-		lf_lifo_enqueue(&global_free_pageblocks[size_index].queue, pageblock);
+		atmc_add32(&list->count, 1);
+		lf_lifo_enqueue(&list->queue, pageblock);
 	}
 }
 
 static void insert_global_partial_pageblocks(pageblock_t* pageblock, int class_index)
 {
-	atmc_add32(&global_partial_pageblocks[class_index].count, 1);
-	lf_lifo_enqueue(&global_partial_pageblocks[class_index].queue, pageblock);
+	counting_lf_lifo_queue_t* list = &global_partial_pageblocks[pageblock_node(pageblock)][class_index];
+
+	atmc_add32(&list->count, 1);
+	lf_lifo_enqueue(&list->queue, pageblock);
 }
 
-/* Attempts to get a global pageblock. */
+/* Attempts to get a global pageblock from our own node. Pageblocks on other 
+ * nodes are left alone; a fresh local superpage serves us better. */
 static pageblock_t* remove_global_pageblocks(int class_index, int pageblock_size)
 {
-	pageblock_t* pageblock = (pageblock_t*)lf_lifo_dequeue(&global_partial_pageblocks[class_index].queue);
+	int node = local_node();
+	pageblock_t* pageblock = (pageblock_t*)lf_lifo_dequeue(&global_partial_pageblocks[node][class_index].queue);
 	if (pageblock) {
-		atmc_add32(&global_partial_pageblocks[class_index].count, -1);
+		atmc_add32(&global_partial_pageblocks[node][class_index].count, -1);
 	}
 	else {
-		int size_index = quick_log2(pageblock_size / PAGE_SIZE) - quick_log2(MIN_PAGEBLOCK_SIZE / PAGE_SIZE);
+		int size_index = pageblock_size_index(pageblock_size);
 
-		pageblock = (pageblock_t*)lf_lifo_dequeue(&global_free_pageblocks[size_index].queue);
+		pageblock = (pageblock_t*)lf_lifo_dequeue(&global_free_pageblocks[node][size_index].queue);
 		if (pageblock) {
-			atmc_add32(&global_free_pageblocks[size_index].count, -1);
+			atmc_add32(&global_free_pageblocks[node][size_index].count, -1);
 		}
+		inactive_request(&global_inactive_limits[node][size_index], pageblock != NULL, MAX_GLOBAL_INACTIVE);
 	}
 
 	return pageblock;
@@ -968,6 +1235,9 @@ void streamflow_thread_finalize(void)
 	int i;
 	pageblock_t *pageblock, *next_pageblock;
 
+	/* Adopting pageblocks of terminated threads here puts them on our lists. */
+	flush_remote_outboxes();
+
 	for (i = 0; i < OBJECT_SIZE_CLASSES; ++i) {
 		heap_t* heap = &local_heap[i];
 
@@ -1012,13 +1282,32 @@ void streamflow_thread_finalize(void)
 			insert_global_free_pageblocks(pageblock);
 		}
 	}
+
+	for (i = 0; i < MEDIUM_CACHE_BINS; ++i) {
+		void* object;
+
+		while ((object = seq_lifo_dequeue(&medium_cache[i].queue)) != NULL) {
+			superunmap(object, (size_t)(1 << i) * PAGE_SIZE);
+		}
+		medium_cache[i].count = 0;
+	}
+
+	/* Last, since giving back superpages above frees their headers. */
+	meta_flush_magazines();
 }
 
-/* Returns a pageblock size that is a power-of-2. */
-static inline int compute_pageblock_size(int index)
+/* The index of pageblock_size in the lists of inactive pageblocks. */
+static inline int pageblock_size_index(unsigned long pageblock_size)
+{
+	return quick_log2(pageblock_size / PAGE_SIZE) - quick_log2(MIN_PAGEBLOCK_SIZE / PAGE_SIZE);
+}
+
+/* Returns a pageblock size that is a power-of-2, for about "objects" 
+ * objects of class index. */
+static inline int compute_pageblock_size(int index, int objects)
 {
 	/* Make sure that the suggestion is a page multiple. */
-	unsigned int suggestion = ceil((double)(reverse_size_class(index) * OBJECTS_PER_PAGEBLOCK) / PAGE_SIZE) * PAGE_SIZE;
+	unsigned int suggestion = ceil((double)(reverse_size_class(index) * objects) / PAGE_SIZE) * PAGE_SIZE;
 
 	/* 2^pow is the closest power-of-2 to suggestion. */
 	unsigned int pow = (unsigned int)ceil(((log2(suggestion)) + 0.5));
@@ -1036,6 +1325,51 @@ static inline int compute_pageblock_size(int index)
 	return suggestion;
 }
 
+/* Returns, and adapts, the size index of the next pageblock of class index 
+ * for this thread. A class starts with pageblocks for MIN_OBJECTS_PER_PAGEBLOCK 
+ * objects, so rare classes do not strand big pageblocks in every thread. If 
+ * "grow", all its pageblocks are full, and the next one is twice as big, up 
+ * to a pageblock for OBJECTS_PER_PAGEBLOCK objects; otherwise one of its 
+ * pageblocks has become empty, and the next one will be half as big. */
+static inline int adapt_pageblock_size(heap_t* heap, int index, int grow)
+{
+	int low = pageblock_size_index(compute_pageblock_size(index, MIN_OBJECTS_PER_PAGEBLOCK));
+	int high = pageblock_size_index(compute_pageblock_size(index, OBJECTS_PER_PAGEBLOCK));
+
+	if (heap->pageblock_size_index == 0) {
+		heap->pageblock_size_index = low + 1;
+	}
+	else if (grow && heap->pageblock_size_index <= high) {
+		heap->pageblock_size_index++;
+	}
+	else if (!grow && heap->pageblock_size_index > low + 1) {
+		heap->pageblock_size_index--;
+	}
+
+	return heap->pageblock_size_index - 1;
+}
+
+/* Records a request for a pageblock from the inactive list of "limit"; 
+ * see struct inactive_limit. */
+static inline void inactive_request(inactive_limit_t* limit, int hit, unsigned int max_limit)
+{
+	if (!hit && limit->overflowed) {
+		limit->overflowed = 0;
+		limit->misses++;
+		if (limit->limit < max_limit) {
+			limit->limit++;
+		}
+	}
+
+	if (++limit->requests >= INACTIVE_ADAPT_PERIOD) {
+		if (limit->misses == 0 && limit->limit > 0) {
+			limit->limit--;
+		}
+		limit->requests = 0;
+		limit->misses = 0;
+	}
+}
+
 /* At the end of this function, pageblock is guarenteed to point to a pageblock 
  * with a free object. */
 static pageblock_t* get_free_pageblock(heap_t* heap, int index)
@@ -1048,11 +1382,17 @@ static pageblock_t* get_free_pageblock(heap_t* heap, int index)
 	unsigned long long local_get_pgblk_cycles = get_cycles();
 #endif
 
-	pageblock_size = compute_pageblock_size(index);
-	size_index = quick_log2(pageblock_size / PAGE_SIZE) - quick_log2(MIN_PAGEBLOCK_SIZE / PAGE_SIZE);
+	/* This is infrequent enough to hand our remote frees to their owners, 
+	 * who may be waiting for them, without hurting the batching. */
+	flush_remote_outboxes();
+
+	/* If we still have active pageblocks, they are all full. */
+	size_index = adapt_pageblock_size(heap, index, heap->active_pageblocks.head != NULL);
+	pageblock_size = MIN_PAGEBLOCK_SIZE << size_index;
 
 	/* Check our inactive pageblocks. */
 	pageblock = (pageblock_t*)seq_lifo_dequeue(&local_inactive_pageblocks[size_index].queue);
+	inactive_request(&local_inactive_limits[size_index], pageblock != NULL, MAX_PRIVATE_INACTIVE);
 	
 	/* If none are on inactive, check the global list. */
 	if (pageblock == NULL) {		
@@ -1066,6 +1406,12 @@ static pageblock_t* get_free_pageblock(heap_t* heap, int index)
 		--local_inactive_pageblocks[size_index].count;
 	}
 
+	/* Hand what the (maybe lowered) limit no longer lets us keep to the global list. */
+	while (local_inactive_pageblocks[size_index].count > local_inactive_limits[size_index].limit) {
+		insert_global_free_pageblocks((pageblock_t*)seq_lifo_dequeue(&local_inactive_pageblocks[size_index].queue));
+		--local_inactive_pageblocks[size_index].count;
+	}
+
 	/* If there were no pre-allocated pageblocks, we need to grab one from the OS. */
 	if (pageblock == NULL) {
 		pageblock = (pageblock_t*)supermap(pageblock_size);
@@ -1267,14 +1613,16 @@ static inline void local_free(void* object, pageblock_t* pageblock, heap_t* my_h
 	/* If the pageblock is now completely empty, remove it from the active 
 	 * list and add it to the inactive list. */
 	if (pageblock->num_free_objects == (pageblock->mem_pool_size / pageblock->object_size)) {
-		int size_index = quick_log2((pageblock->mem_pool_size + (unsigned long)pageblock->mem_pool - (unsigned long)pageblock) / PAGE_SIZE) - quick_log2(MIN_PAGEBLOCK_SIZE / PAGE_SIZE);
+		int size_index = pageblock_size_index(pageblock->mem_pool_size + (unsigned long)pageblock->mem_pool - (unsigned long)pageblock);
 
 		double_list_remove(pageblock, &my_heap->active_pageblocks);
-		if (local_inactive_pageblocks[size_index].count < MAX_PRIVATE_INACTIVE) {
+		adapt_pageblock_size(my_heap, my_heap - local_heap, 0);
+		if (local_inactive_pageblocks[size_index].count < local_inactive_limits[size_index].limit) {
 			seq_lifo_enqueue(&local_inactive_pageblocks[size_index].queue, pageblock);
 			local_inactive_pageblocks[size_index].count++;
 		}
 		else {
+			local_inactive_limits[size_index].overflowed = 1;
 			insert_global_free_pageblocks(pageblock);
 		}
 	}
@@ -1312,12 +1660,15 @@ static void adopt_pageblock(void* object, pageblock_t* pageblock, heap_t* my_hea
 #endif
 }
 
+/* Puts an object freed by a thread that does not own its pageblock in the 
+ * pageblock's outbox. A burst of remote frees to one pageblock then costs 
+ * one compare-and-swap on the owner's cache line per REMOTE_BATCH objects 
+ * instead of one per object. */
 static void remote_free(void* object, pageblock_t* pageblock, heap_t* my_heap)
 {
-	queue_node_t temp_head, index;
-	unsigned int temp_id;
-	unsigned long long old_value;
-	unsigned long long new_value;
+	/* Pageblocks are aligned to their size, so hash the page number. */
+	remote_outboxes_t* outboxes = &remote_outboxes;
+	remote_outbox_t* outbox = &outboxes->outboxes[((unsigned int)((unsigned long)pageblock >> PAGE_BITS) * 2654435761U) >> (32 - REMOTE_OUTBOX_BITS)];
 
 #ifdef PROFILE
 	unsigned long long local_remote_free_cycles = get_cycles();
@@ -1325,62 +1676,89 @@ static void remote_free(void* object, pageblock_t* pageblock, heap_t* my_heap)
 
 	memory_add32(&num_remote_frees, 1);
 
-	index.next = ((unsigned long)object - (unsigned long)pageblock->mem_pool) / pageblock->object_size + 1;
-	do {
-		temp_id = pageblock->owning_thread;
+	if (outbox->pageblock != pageblock) {
+		flush_remote_outbox(outbox);
+		outbox->pageblock = pageblock;
+		outbox->tail = object;
+	}
 
-		if (temp_id == ORPHAN) {
-			adopt_pageblock(object, pageblock, my_heap);
-			break;
-		}
-		
-		temp_head = pageblock->garbage_head;
-		((queue_node_t *)object)->next = temp_head.next;
-		index.count = temp_head.count + 1;
+	((queue_node_t *)object)->next = outbox->head;
+	outbox->head = ((unsigned long)object - (unsigned long)pageblock->mem_pool) / pageblock->object_size + 1;
+	++outbox->count;
 
-		((unsigned int*)&old_value)[0] = temp_id;
-		((unsigned int*)&old_value)[1] = *((unsigned int*)&temp_head);
-		((unsigned int*)&new_value)[0] = temp_id;
-		((unsigned int*)&new_value)[1] = *((unsigned int*)&index);
-	} while(!compare_and_swap64(&pageblock->together, old_value, new_value));
+	if (outbox->count >= REMOTE_BATCH) {
+		flush_remote_outbox(outbox);
+	}
+
+	/* Don't let objects sit in outboxes for pageblocks we stopped freeing to. */
+	if (++outboxes->frees_since_flush >= REMOTE_FLUSH_PERIOD) {
+		flush_remote_outboxes();
+	}
 
 #ifdef PROFILE
 	remote_free_cycles += get_cycles() - local_remote_free_cycles;
 #endif
 }
 
-/*
-static void chain_remote_free(void* object, pageblock_t* pageblock, heap_t* my_heap)
+/* Publishes the objects in an outbox on their pageblock's garbage_head, or, 
+ * if the owner has terminated, adopts the pageblock and frees them locally. */
+static void flush_remote_outbox(remote_outbox_t* outbox)
 {
+	pageblock_t* pageblock = outbox->pageblock;
 	queue_node_t temp_head, index;
 	unsigned int temp_id;
 	unsigned long long old_value;
 	unsigned long long new_value;
-	void* tail;
 
-	memory_add32(&num_remote_frees, 1);
+	if (pageblock == NULL) {
+		return;
+	}
 
-	index.next = ((unsigned long)object - (unsigned long)pageblock->mem_pool) / pageblock->object_size + 1;
-	tail = pageblock->mem_pool + (((queue_node_t *)object)->count - 1) * pageblock->object_size;
+	index.next = outbox->head;
 	do {
 		temp_id = pageblock->owning_thread;
 
-		if (temp_id == ORPHAN) {
-			adopt_pageblock(object, pageblock, my_heap);
+		if (temp_id == ORPHAN && compare_and_swap32(&pageblock->owning_thread, ORPHAN, thread_id)) {
+			heap_t* my_heap = &local_heap[free_compute_size_class(pageblock->object_size)];
+			unsigned short next = outbox->head;
+
+			double_list_insert_front(pageblock, &my_heap->active_pageblocks);
+			((queue_node_t *)outbox->tail)->next = 0;
+			while (next != 0) {
+				void* object = pageblock->mem_pool + (next - 1) * pageblock->object_size;
+
+				next = ((queue_node_t *)object)->next;
+				local_free(object, pageblock, my_heap);
+			}
+
+			memory_add32(&num_adoptions, 1);
 			break;
 		}
 		
 		temp_head = pageblock->garbage_head;
-		((queue_node_t *)tail)->next = temp_head.next;
-		index.count = temp_head.count + 1;
+		((queue_node_t *)outbox->tail)->next = temp_head.next;
+		index.count = temp_head.count + outbox->count;
 
 		((unsigned int*)&old_value)[0] = temp_id;
 		((unsigned int*)&old_value)[1] = *((unsigned int*)&temp_head);
 		((unsigned int*)&new_value)[0] = temp_id;
 		((unsigned int*)&new_value)[1] = *((unsigned int*)&index);
-	} while(!compare_and_swap64(&pageblock->together, old_value, new_value));
+	} while(temp_id == ORPHAN || !compare_and_swap64(&pageblock->together, old_value, new_value));
+
+	outbox->pageblock = NULL;
+	outbox->head = 0;
+	outbox->count = 0;
+}
+
+static void flush_remote_outboxes(void)
+{
+	int i;
+
+	for (i = 0; i < REMOTE_OUTBOXES; ++i) {
+		flush_remote_outbox(&remote_outboxes.outboxes[i]);
+	}
+	remote_outboxes.frees_since_flush = 0;
 }
-*/
 
 /* Extracts the meta information for an object for free(). */
 static inline void object_extract(void** object, void** ptr, size_t* size, short* object_type)
@@ -1448,7 +1826,7 @@ void free(void* object)
 	}
 	else if (unlikely(object_type == OBJECT_MEDIUM)) {
 		((pageblock_t*)object)->sph = (superpage_t*)ptr;
-		superunmap(object, size);
+		medium_free(object, size);
 		return;
 	}
 
@@ -1467,51 +1845,6 @@ void free(void* object)
 		
 	/* Someone else owns the pageblock. */
 	else {
-		/*
-		if (remote_cache_total < 1000) {
-			void* head_object = seq_lifo_dequeue(&remote_cache.queue);
-
-			if (head_object != NULL) {
-				--remote_cache.count;
-				object_extract(&head_object, &ptr, &size, &object_type);
-				pageblock_t* head_pageblock = (pageblock_t*)ptr;
-
-				if (head_pageblock == pageblock) {
-					((queue_node_t *)object)->next = ((unsigned long)head_object - (unsigned long)pageblock->mem_pool)
-									/ pageblock->object_size + 1;
-					((queue_node_t *)object)->count = ((queue_node_t *)head_object)->count;
-
-				}
-				else {
-					seq_lifo_enqueue(&remote_cache.queue, head_object);
-					++remote_cache.count;
-				}
-			}
-			else {
-				((queue_node_t *)object)->count = ((unsigned long)object - (unsigned long)pageblock->mem_pool)
-							/ pageblock->object_size + 1;
-			}
-
-			seq_lifo_enqueue(&remote_cache.queue, object);
-			++remote_cache.count;
-			++remote_cache_total;
-		}
-		else {
-			remote_free(object, pageblock, my_heap);
-			while (remote_cache.count > 0) {
-				object = seq_lifo_dequeue(&remote_cache.queue);
-				--remote_cache.count;
-
-				object_extract(&object, &ptr, &size, &object_type);
-				pageblock = (pageblock_t*)ptr;
-				heap_t* my_heap = &local_heap[compute_size_class(pageblock->object_size)];
-
-				chain_remote_free(object, pageblock, my_heap);
-			}
-			remote_cache_total = 0;
-		}
-		*/
-
 		remote_free(object, pageblock, my_heap);
 	}
 
@@ -1657,8 +1990,7 @@ void *realloc(void *object, size_t size)
 				return original_object;
 			}
 
-			new_object = supermap(super_size);
-			register_pages(new_object, 1, ((pageblock_t*)new_object)->sph, super_size, OBJECT_MEDIUM);
+			new_object = medium_alloc(super_size);
 			headerize_object(&new_object, ((pageblock_t*)new_object)->sph, super_size, OBJECT_MEDIUM);
 		}
 
@@ -1670,10 +2002,10 @@ void *realloc(void *object, size_t size)
 			}
 		}
 
-		memcpy(new_object, object, old_size);
+		memcpy(new_object, object, size < old_size ? size : old_size);
 
 		((pageblock_t*)object)->sph = (superpage_t*)ptr;
-		superunmap(object, old_size);
+		medium_free(object, old_size);
 
 		return new_object;
 	}
@@ -1697,7 +2029,7 @@ void *realloc(void *object, size_t size)
 	if (new_object == NULL) {
 		return (void *)MAP_FAILED;
 	}
-	memcpy(new_object, object, old_size);
+	memcpy(new_object, object, size < old_size ? size : old_size);
 	free(original_object);
 
 	return new_object;
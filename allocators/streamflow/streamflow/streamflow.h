@@ -34,7 +34,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
-/* EDB DISABLED #include <numa.h> */
+#ifdef NUMA
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 #include <stddef.h>
 #include <dirent.h>
@@ -52,7 +55,7 @@
 #define SUPERPAGE_SIZE (4 * 1024 * 1024)
 #define BUDDY_ORDER_MAX 11
 #define BUDDY_BITMAP_SIZE 148
-#define PAGES_IN_ADDR_SPACE 1048676 /* (4 gig address space) / (page size) = # of pages in system */
+#define ADDR_SPACE_BITS 32
 
 #elif ppc64
 
@@ -62,6 +65,7 @@
 #define SUPERPAGE_SIZE (16 * 1024 * 1024)
 #define BUDDY_ORDER_MAX 13
 #define BUDDY_BITMAP_SIZE 560
+#define ADDR_SPACE_BITS 64
 
 #elif ia64
 
@@ -72,6 +76,7 @@
 #define BUDDY_ORDER_MAX 15
 #define BUDDY_BITMAP_SIZE 2068
 #define NUM_NUMA_NODES 16
+#define ADDR_SPACE_BITS 64
 
 #elif x86_64
 
@@ -82,6 +87,12 @@
 #define BUDDY_ORDER_MAX 12
 #define BUDDY_BITMAP_SIZE 560
 #define NUM_NUMA_NODES 8
+/* User space gets 47 bits with 4-level page tables. Build with 
+ * -DADDR_SPACE_BITS=57 for programs that map memory above that 
+ * with 5-level paging. */
+#ifndef ADDR_SPACE_BITS
+#define ADDR_SPACE_BITS 48
+#endif
 
 #else
 
@@ -89,36 +100,85 @@
 
 #endif
 
+#ifndef NUM_NUMA_NODES
+#define NUM_NUMA_NODES 8
+#endif
+
+/* How superpages are backed by the hardware's huge pages:
+ * 	SUPERPAGE_SMALL:	plain mmap, the kernel decides
+ * 	SUPERPAGE_THP:		HUGE_PAGE_SIZE aligned and madvise(MADV_HUGEPAGE)
+ * 	SUPERPAGE_HUGETLB:	MAP_HUGETLB from the hugetlbfs pool, falling 
+ * 				back to SUPERPAGE_THP when the pool is empty */
+#define SUPERPAGE_SMALL 0
+#define SUPERPAGE_THP 1
+#define SUPERPAGE_HUGETLB 2
+
+#ifndef SUPERPAGE_BACKING
+#define SUPERPAGE_BACKING SUPERPAGE_SMALL
+#endif
+
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+#if SUPERPAGE_BACKING != SUPERPAGE_SMALL && SUPERPAGE_SIZE % HUGE_PAGE_SIZE != 0
+#error "SUPERPAGE_SIZE must be a multiple of HUGE_PAGE_SIZE."
+#endif
+
 #if !defined(HEADERS) && !defined(BIBOP) && !defined(RADIX_TREE)
 #error "Must define a meta-information method (HEADERS, BIBOP or RADIX_TREE)."
 #endif
 
+#if defined(BIBOP) && ADDR_SPACE_BITS > 32
+#error "BIBOP needs a 32-bit address space; use RADIX_TREE instead."
+#endif
+
 extern unsigned int global_id_counter;
 extern __thread unsigned int thread_id;
 
 #ifdef NUMA
-extern int cpu_to_node[NUM_NUMA_NODES];
+#define NUMA_MAX_CPUS 1024
+extern int cpu_to_node[NUMA_MAX_CPUS];
+extern __thread int thread_node;
 #endif
 
 /* System parameters */
 #define PAGES_PER_SUPERPAGE (SUPERPAGE_SIZE / PAGE_SIZE)
+#define PAGES_IN_ADDR_SPACE (1UL << (ADDR_SPACE_BITS - PAGE_BITS))
 
 #define NODE_MAP_PATH "/sys/devices/system/node/"
 
+/* Without NUMA, all memory belongs to node 0. */
+#ifdef NUMA
+#define GLOBAL_NODES NUM_NUMA_NODES
+#else
+#define GLOBAL_NODES 1
+#endif
+
 #define PAGE_PTR_BITS ((sizeof(void*) * 8) - PAGE_BITS)
 #define HEADER_SIZE sizeof(void*)
 #define SUPERPAGE_BITS 10
 #define SUPERPAGE_PTR_BITS ((sizeof(void*) * 8) - SUPERPAGE_BITS)		
 
 /* Policy parameters */
-#define MAX_PRIVATE_INACTIVE 4	
-#define MAX_GLOBAL_INACTIVE 0
+#define MAX_PRIVATE_INACTIVE 4	/* The inactive limits adapt up to these; */
+#define MAX_GLOBAL_INACTIVE 16	/* see struct inactive_limit. */
+#define INACTIVE_ADAPT_PERIOD 64
 #define MIN_PAGEBLOCK_SIZE (4 * PAGE_SIZE) /* Must be a power-of-2. */
 #define MAX_PAGEBLOCK_SIZE (4 * 16 * PAGE_SIZE) /* Must be a power-of-2. */
 #define OBJECT_GRANULARITY HEADER_SIZE
 #define MAX_OBJECT_SIZE 16576 /*(4 * PAGE_SIZE) */
 #define OBJECT_SIZE_CLASSES 256
-#define OBJECTS_PER_PAGEBLOCK 1024
+#define MIN_OBJECTS_PER_PAGEBLOCK 32	/* Pageblock sizes adapt between these; */
+#define OBJECTS_PER_PAGEBLOCK 1024	/* see adapt_pageblock_size(). */
+#define REMOTE_OUTBOX_BITS 5
+#define REMOTE_OUTBOXES (1 << REMOTE_OUTBOX_BITS)
+#define REMOTE_BATCH 64			/* remote frees published at once */
+#define REMOTE_FLUSH_PERIOD 1024	/* remote frees between flushing all outboxes */
+#define MEDIUM_CACHE_MAX_SIZE (1024 * 1024)	/* Must be a power-of-2. */
+#define MEDIUM_CACHE_BIN_BYTES (1024 * 1024)	/* most memory cached per medium size */
+#define MEDIUM_CACHE_BINS 9 /* log(MEDIUM_CACHE_MAX_SIZE/PAGE_SIZE) + 1 with the smallest PAGE_SIZE */
+#define META_MAGAZINE_SIZE 16		/* metadata objects a thread caches per class */
 
 #define PAGEBLOCK_SIZE_CLASSES 5 /* log(MAX_PAGEBLOCK_SIZE/PAGE_SIZE) - log(MIN_PAGEBLOCK_SIZE/PAGE_SIZE) + 1 */
 #define ORPHAN UINT_MAX
@@ -126,11 +186,15 @@ extern int cpu_to_node[NUM_NUMA_NODES];
 /* The radix tree is RADIX_DEPTH levels deep. Hence, we need to split 
  * a page pointer into RADIX_DEPTH prefixes. If the page pointer is not 
  * evenly divisible by RADIX_DEPTH, then the intertior nodes have the 
- * greater number of bits, and the leaves less. */
-#define RADIX_BITS PAGE_PTR_BITS
-#define RADIX_DEPTH 3
+ * greater number of bits, and the leaves less. The tree only covers 
+ * ADDR_SPACE_BITS of address, and is made as deep as it takes to keep 
+ * every node at about RADIX_NODE_BITS bits; nodes are only allocated 
+ * for the parts of the address space that we actually use. */
+#define RADIX_BITS (ADDR_SPACE_BITS - PAGE_BITS)
+#define RADIX_NODE_BITS 12
+#define RADIX_DEPTH ((RADIX_BITS + RADIX_NODE_BITS - 1) / RADIX_NODE_BITS)
 #define RADIX_INTERIOR_BITS (((RADIX_BITS + (RADIX_DEPTH - 1)) / RADIX_DEPTH))
-#define RADIX_LEAF_BITS (RADIX_BITS - 2 * (RADIX_INTERIOR_BITS))
+#define RADIX_LEAF_BITS (RADIX_BITS - (RADIX_DEPTH - 1) * (RADIX_INTERIOR_BITS))
 #define RADIX_INTERIOR_SIZE (1UL << RADIX_INTERIOR_BITS)
 #define RADIX_LEAF_SIZE (1UL << RADIX_LEAF_BITS)
 
@@ -138,6 +202,12 @@ extern int cpu_to_node[NUM_NUMA_NODES];
 #define OBJECT_MEDIUM 1
 #define OBJECT_LARGE 2
 
+/* Classes of internal metadata, which comes from the shared metadata pool. */
+#define META_SUPERPAGE 0
+#define META_RADIX_INTERIOR 1
+#define META_RADIX_LEAF 2
+#define META_CLASSES 3
+
 struct queue_node {
 	unsigned short next;
 	unsigned short count;
@@ -182,13 +252,44 @@ struct counting_queue {
 	unsigned int count;
 };
 
+/* Objects a thread freed to a pageblock owned by another thread, chained 
+ * through their queue_node_t headers so they can be pushed on the 
+ * pageblock's garbage_head with one compare-and-swap; see remote_free(). */
+struct remote_outbox {
+	struct pageblock*	pageblock;	/* NULL if the outbox is empty */
+	void*			tail;		/* first object put in; ends the chain */
+	unsigned short		head;		/* index, plus one, of the last object put in */
+	unsigned short		count;
+};
+
+/* All of a thread's outboxes, kept in one thread local variable so that a 
+ * remote free looks up thread local storage once. */
+struct remote_outboxes {
+	struct remote_outbox	outboxes[REMOTE_OUTBOXES];	/* indexed by a hash of the pageblock */
+	unsigned int		frees_since_flush;
+};
+
 struct counting_lf_lifo_queue {
 	lf_lifo_queue_t queue;
 	unsigned int count;
 };
 
+/* The number of inactive pageblocks a list may keep follows demand: the 
+ * limit grows by one when a request finds the list empty after a pageblock 
+ * was turned away for lack of room, and shrinks by one after each 
+ * INACTIVE_ADAPT_PERIOD requests that had no such miss. The global 
+ * limits are updated without synchronization; races only blur them. */
+struct inactive_limit {
+	unsigned int limit;
+	unsigned int overflowed;	/* turned a pageblock away since the last miss */
+	unsigned int requests;		/* in this period */
+	unsigned int misses;		/* in this period */
+};
+
 struct heap {
 	struct double_list active_pageblocks; /* active pageblocks that don't need synchronization */
+	int pageblock_size_index;	/* size index of new pageblocks plus one, 
+					 * adapted to demand; 0 until first used */
 };
 
 /* An array of these gives us the main data structure necessary for 
@@ -210,13 +311,13 @@ struct superpage {
 	lock_t*			lock;			/* points to the lock that belongs to the thread
 							 * that allocated it. */
 	struct double_list*	list;
-	struct quickieblock*	quickie;
 
 	/* Data structures and values used for buddy 
 	 * allocation.*/
 	struct buddy_order	buddy[BUDDY_ORDER_MAX];
 	char			bitmaps[BUDDY_BITMAP_SIZE];
 	unsigned short		largest_free_order;
+	int			node;			/* NUMA node the pages are bound to */
 } __attribute__((aligned(1 << SUPERPAGE_BITS)));
 
 struct pageblock {
@@ -246,15 +347,6 @@ struct pageblock {
 	char*			mem_pool;
 };
 
-/* A quickieblock is used to keep track of headers for internal data structures. 
- * It doesn't need the same level of organization that a normal pageblock does, but 
- * the same-named fields do the same thing. */
-struct quickieblock {
-	void*	freed;
-	void*	unallocated;
-	int	num_free_objects;
-};
-
 /* A page_chunk_t is used to represent chunks of pages in the buddy allocation 
  * algorithm. We just use the empty space of the chunk itself to contain this 
  * information, which conveniently means that &page_chunk_variable is the address 
@@ -271,14 +363,17 @@ typedef struct double_list_elem		double_list_elem_t;
 typedef struct double_list		double_list_t;
 typedef struct counting_lf_lifo_queue	counting_lf_lifo_queue_t;
 typedef struct counting_queue		counting_queue_t;
+typedef struct inactive_limit		inactive_limit_t;
+typedef struct remote_outbox		remote_outbox_t;
+typedef struct remote_outboxes		remote_outboxes_t;
 typedef struct heap			heap_t;
 typedef struct superpage		superpage_t;
 typedef struct pageblock		pageblock_t;
-typedef struct quickieblock		quickieblock_t;
 typedef struct buddy_order		buddy_order_t;
 
 /* public streamflow operations */
 void numa_start(void);
+void discover_cpu(void);
 void streamflow_thread_finalize(void);
 void* malloc(size_t requested_size);
 void free(void* object);
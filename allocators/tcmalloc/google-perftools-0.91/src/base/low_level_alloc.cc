@@ -46,10 +46,17 @@
 #include <new>                   // for placement-new
 
 // A first-fit allocator with amortized logarithmic free() time.
+// Small blocks, such as the fixed-size nodes of the profilers' tables,
+// are freed onto exact-size lists instead, and reused from them in
+// constant time.
 
 // ---------------------------------------------------------------------------
 static const int kMaxLevel = 30;
 
+// Freed blocks of fewer than kCachedSizes*arena->roundup bytes go on
+// the arena's exact-size lists.
+static const int kCachedSizes = 16;
+
 namespace {
   // This struct describes one allocated block, or one free block.
   struct AllocList {
@@ -69,6 +76,13 @@ namespace {
                                   // all kMaxLevel entries.  See max_fit in
                                   // LLA_SkiplistLevels()
   };
+
+  // This struct starts each region mmapped for an arena, taking up the
+  // first arena->roundup bytes of it.
+  struct Region {
+    Region *next;     // next region of the same arena
+    size_t size;      // size of the entire region, including this struct
+  };
 }
 
 // ---------------------------------------------------------------------------
@@ -171,9 +185,12 @@ struct LowLevelAlloc::Arena {
   explicit Arena(int) : pagesize(0) {}  // set pagesize to zero explicitly
                                         // for non-static init
 
-  SpinLock mu;            // protects freelist, allocation_count,
-                          // pagesize, roundup, min_size
+  SpinLock mu;            // protects freelist, cached, regions,
+                          // allocation_count, pagesize, roundup, min_size
   AllocList freelist;     // head of free list; sorted by addr (under mu)
+  AllocList *cached[kCachedSizes]; // lists of freed blocks, by size/roundup,
+                                   // linked through next[0] (under mu)
+  Region *regions;        // regions mmapped for the arena (under mu)
   int32 allocation_count; // count of allocated blocks (under mu)
   int32 flags;            // flags passed to NewArena (ro after init)
   size_t pagesize;        // ==getpagesize()  (init under mu, then ro)
@@ -190,6 +207,7 @@ static struct LowLevelAlloc::Arena default_arena;
 // magic numbers to identify allocated and unallocated blocks
 static const intptr_t kMagicAllocated = 0x4c833e95;
 static const intptr_t kMagicUnallocated = ~kMagicAllocated;
+static const intptr_t kMagicCached = 0x2ad9c4b7;  // on an exact-size list
 
 // create an appropriate magic number for an object at "ptr"
 // "magic" should be kMagicAllocated or kMagicUnallocated
@@ -215,6 +233,8 @@ static void ArenaInit(LowLevelAlloc::Arena *arena) {
     arena->freelist.header.arena = arena;
     arena->freelist.levels = 0;
     memset(arena->freelist.next, 0, sizeof (arena->freelist.next));
+    memset(arena->cached, 0, sizeof (arena->cached));
+    arena->regions = 0;
     arena->allocation_count = 0;
     arena->flags = 0;
   }
@@ -233,6 +253,17 @@ LowLevelAlloc::Arena *LowLevelAlloc::NewArena(int32 flags,
   return result;
 }
 
+// Unmaps all the regions of an arena that is being deleted, and so
+// all its blocks.
+static void UnmapRegions(LowLevelAlloc::Arena *arena) {
+  while (arena->regions != 0) {
+    Region *region = arena->regions;
+    arena->regions = region->next;
+    RAW_CHECK(munmap(region, region->size) == 0,
+              "LowLevelAlloc::DeleteArena:  munmap failed address");
+  }
+}
+
 // L < arena->mu, L < arena->arena->mu
 bool LowLevelAlloc::DeleteArena(Arena *arena) {
   RAW_CHECK(arena != 0 && arena != &default_arena,
@@ -241,27 +272,37 @@ bool LowLevelAlloc::DeleteArena(Arena *arena) {
   bool empty = (arena->allocation_count == 0);
   arena->mu.Unlock();
   if (empty) {
-    while (arena->freelist.next[0] != 0) {
-      AllocList *region = arena->freelist.next[0];
-      size_t size = region->header.size;
-      arena->freelist.next[0] = region->next[0];
-      RAW_CHECK(region->header.magic ==
-                Magic(kMagicUnallocated, &region->header),
+    for (AllocList *block = arena->freelist.next[0]; block != 0;
+         block = block->next[0]) {
+      RAW_CHECK(block->header.magic ==
+                Magic(kMagicUnallocated, &block->header),
                 "bad magic number in DeleteArena()");
-      RAW_CHECK(region->header.arena == arena,
+      RAW_CHECK(block->header.arena == arena,
                 "bad arena pointer in DeleteArena()");
-      RAW_CHECK(size % arena->pagesize == 0,
-                "empty arena has non-page-aligned block size");
-      RAW_CHECK(reinterpret_cast<intptr_t>(region) % arena->pagesize == 0,
-                "empty arena has non-page-aligned block");
-      RAW_CHECK(munmap(region, size) == 0,
-                "LowLevelAlloc::DeleteArena:  munmap failed address");
     }
+    for (int i = 0; i != kCachedSizes; i++) {
+      for (AllocList *block = arena->cached[i]; block != 0;
+           block = block->next[0]) {
+        RAW_CHECK(block->header.magic == Magic(kMagicCached, &block->header),
+                  "bad magic number in DeleteArena()");
+      }
+    }
+    UnmapRegions(arena);
     Free(arena);
   }
   return empty;
 }
 
+// L < arena->mu, L < arena->arena->mu
+void LowLevelAlloc::DeleteArenaAndBlocks(Arena *arena) {
+  RAW_CHECK(arena != 0 && arena != &default_arena,
+            "may not delete default arena");
+  RAW_CHECK((arena->flags & kCallMallocHook) == 0,
+            "may not delete blocks of an arena that calls malloc hooks");
+  UnmapRegions(arena);
+  Free(arena);
+}
+
 // ---------------------------------------------------------------------------
 
 // Return value rounded up to next multiple of align.
@@ -339,13 +380,77 @@ void LowLevelAlloc::Free(void *v) {
       MallocHook::InvokeDeleteHook(v);
     }
     arena->mu.Lock();
-    AddToFreelist(v, arena);
+    const size_t c = f->header.size / arena->roundup;
+    if (c < kCachedSizes) {
+      f->header.magic = Magic(kMagicCached, &f->header);
+      f->next[0] = arena->cached[c];
+      arena->cached[c] = f;
+    } else {
+      AddToFreelist(v, arena);
+    }
     RAW_CHECK(arena->allocation_count > 0, "nothing in arena to free");
     arena->allocation_count--;
     arena->mu.Unlock();
   }
 }
 
+// Takes a block of req_rnd bytes from the freelist, mapping more memory
+// if there is no block big enough.  (In malloc_hook_callers like
+// Alloc(), since it calls mmap().)
+// L >= arena->mu
+static AllocList *AllocFromFreelist(size_t req_rnd,
+                                    LowLevelAlloc::Arena *arena)
+  ATTRIBUTE_SECTION(malloc_hook_callers);
+static AllocList *AllocFromFreelist(size_t req_rnd,
+                                    LowLevelAlloc::Arena *arena) {
+  AllocList *s;       // will point to region that satisfies request
+  for (;;) {      // loop until we find a suitable region
+    // find the minimum levels that a block of this size must have
+    int i = LLA_SkiplistLevels(req_rnd, arena->min_size, false) - 1;
+    if (i < arena->freelist.levels) {   // potential blocks exist
+      AllocList *before = &arena->freelist; // predecessor of s
+      while ((s = Next(i, before, arena)) != 0 && s->header.size < req_rnd) {
+        before = s;
+      }
+      if (s != 0) {       // we found a region
+        break;
+      }
+    }
+    // we unlock before mmap() both because mmap() may call a callback hook,
+    // and because it may be slow.
+    arena->mu.Unlock();
+    size_t new_pages_size = RoundUp(req_rnd + arena->roundup, arena->pagesize);
+    void *new_pages = mmap(0, new_pages_size,
+                   PROT_WRITE|PROT_READ, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    RAW_CHECK(new_pages != MAP_FAILED, "mmap error");
+    Region *region = reinterpret_cast<Region *>(new_pages);
+    region->size = new_pages_size;
+    s = reinterpret_cast<AllocList *>(
+        reinterpret_cast<char *>(new_pages) + arena->roundup);
+    s->header.size = new_pages_size - arena->roundup;
+    // Pretend the block is allocated; call AddToFreelist() to free it.
+    s->header.magic = Magic(kMagicAllocated, &s->header);
+    s->header.arena = arena;
+    arena->mu.Lock();
+    region->next = arena->regions;
+    arena->regions = region;
+    AddToFreelist(&s->levels, arena);  // insert new region into free list
+  }
+  AllocList *prev[kMaxLevel];
+  LLA_SkiplistDelete(&arena->freelist, s, prev);    // remove from free list
+  // s points to the first free region that's big enough
+  if (req_rnd + arena->min_size <= s->header.size) { // big enough to split
+    AllocList *n = reinterpret_cast<AllocList *>
+                      (req_rnd + reinterpret_cast<char *>(s));
+    n->header.size = s->header.size - req_rnd;
+    n->header.magic = Magic(kMagicAllocated, &n->header);
+    n->header.arena = arena;
+    s->header.size = req_rnd;
+    AddToFreelist(&n->levels, arena);
+  }
+  return s;
+}
+
 // allocates and returns a block of size bytes, to be freed with Free()
 // L < arena->mu
 void *LowLevelAlloc::Alloc(size_t request, Arena *arena) {
@@ -359,44 +464,14 @@ void *LowLevelAlloc::Alloc(size_t request, Arena *arena) {
     ArenaInit(arena);
     // round up with header
     size_t req_rnd = RoundUp(request + sizeof (s->header), arena->roundup);
-    for (;;) {      // loop until we find a suitable region
-      // find the minimum levels that a block of this size must have
-      int i = LLA_SkiplistLevels(req_rnd, arena->min_size, false) - 1;
-      if (i < arena->freelist.levels) {   // potential blocks exist
-        AllocList *before = &arena->freelist; // predecessor of s
-        while ((s = Next(i, before, arena)) != 0 && s->header.size < req_rnd) {
-          before = s;
-        }
-        if (s != 0) {       // we found a region
-          break;
-        }
-      }
-      // we unlock before mmap() both because mmap() may call a callback hook,
-      // and because it may be slow.
-      arena->mu.Unlock();
-      size_t new_pages_size = RoundUp(req_rnd, arena->pagesize);
-      void *new_pages = mmap(0, new_pages_size,
-                     PROT_WRITE|PROT_READ, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
-      RAW_CHECK(new_pages != MAP_FAILED, "mmap error");
-      s = reinterpret_cast<AllocList *>(new_pages);
-      s->header.size = new_pages_size;
-      // Pretend the block is allocated; call AddToFreelist() to free it.
-      s->header.magic = Magic(kMagicAllocated, &s->header);
-      s->header.arena = arena;
-      arena->mu.Lock();
-      AddToFreelist(&s->levels, arena);  // insert new region into free list
-    }
-    AllocList *prev[kMaxLevel];
-    LLA_SkiplistDelete(&arena->freelist, s, prev);    // remove from free list
-    // s points to the first free region that's big enough
-    if (req_rnd + arena->min_size <= s->header.size) { // big enough to split
-      AllocList *n = reinterpret_cast<AllocList *>
-                        (req_rnd + reinterpret_cast<char *>(s));
-      n->header.size = s->header.size - req_rnd;
-      n->header.magic = Magic(kMagicAllocated, &n->header);
-      n->header.arena = arena;
-      s->header.size = req_rnd;
-      AddToFreelist(&n->levels, arena);
+    const size_t c = req_rnd / arena->roundup;
+    if (c < kCachedSizes && arena->cached[c] != 0) {
+      s = arena->cached[c];           // reuse a block of exactly this size
+      arena->cached[c] = s->next[0];
+      RAW_CHECK(s->header.magic == Magic(kMagicCached, &s->header),
+                "bad magic number in Alloc()");
+    } else {
+      s = AllocFromFreelist(req_rnd, arena);
     }
     s->header.magic = Magic(kMagicAllocated, &s->header);
     RAW_CHECK(s->header.arena == arena, "");
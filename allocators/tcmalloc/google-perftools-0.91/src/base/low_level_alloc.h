@@ -83,6 +83,13 @@ class LowLevelAlloc {
   // It is illegal to attempt to destroy the default arena.
   static bool DeleteArena(Arena *arena);
 
+  // Destroys an arena allocated by NewArena, together with any blocks
+  // still allocated in it, which must not be used again.  This unmaps
+  // the arena's memory in one step, instead of freeing it block by block.
+  // It is illegal to destroy the default arena, or an arena that calls
+  // the MallocHook interface this way.
+  static void DeleteArenaAndBlocks(Arena *arena);
+
  private:
   LowLevelAlloc();      // no instances
 };
@@ -116,5 +116,6 @@ void SpinLock::SlowLock() {
     tm.tv_nsec = 2000001;
     nanosleep(&tm, NULL);
   }
+  contentions_++;
   errno = saved_errno;
 }
@@ -48,7 +48,7 @@
 
 class SpinLock {
  public:
-  SpinLock() : lockword_(0) { }
+  SpinLock() : lockword_(0), contentions_(0) { }
 
   // Special constructor for use with static SpinLock objects.  E.g.,
   //
@@ -70,6 +70,11 @@ class SpinLock {
     }
   }
 
+  // Take the lock if it is free; never waits.  Returns true on success.
+  inline bool TryLock() {
+    return Acquire_CompareAndSwap(&lockword_, 0, 1) == 0;
+  }
+
   inline void Unlock() {
     Release_Store(&lockword_, 0);
   }
@@ -82,9 +87,17 @@ class SpinLock {
     return lockword_ != 0;
   }
 
+  // Number of times Lock() found the lock held and had to wait.  Read
+  // without the lock, so it may lag a little.
+  inline int64 Contentions() const {
+    return contentions_;
+  }
+
  private:
   // Lock-state: 0 means unlocked, 1 means locked
   volatile AtomicWord lockword_;
+  // Incremented by SlowLock() once it holds the lock
+  volatile int64 contentions_;
 
   void SlowLock();
 
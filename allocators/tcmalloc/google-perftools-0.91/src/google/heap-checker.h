@@ -336,6 +336,13 @@ class HeapLeakChecker {
   // in a debug message to describe what kind of live object sources
   // are being used.
   static void IgnoreLiveObjectsLocked(const char* name, const char* name2);
+  // Helper for IgnoreLiveObjectsLocked that does its work
+  // with FLAGS_heap_check_mark_threads threads,
+  // adding to *live_object_count and *live_byte_count what it finds.
+  static void IgnoreLiveObjectsInParallelLocked(int64_t* live_object_count,
+                                                int64_t* live_byte_count);
+  // The body of each of the threads of IgnoreLiveObjectsInParallelLocked.
+  static int MarkLiveObjects(void* worker);
   // Heap profile object filtering callback to filter out live objects.
   static bool HeapProfileFilter(void* ptr, size_t size);
   // Runs REGISTER_HEAPCHECK_CLEANUP cleanups and potentially
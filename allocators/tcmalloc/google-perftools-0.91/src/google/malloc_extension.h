@@ -43,6 +43,40 @@
 
 static const int kMallocHistogramSize = 64;
 
+// A source of memory for the page heap, such as a hugetlbfs file, a
+// memfd with MFD_HUGETLB, a region reserved at startup, or persistent
+// memory.  See MallocExtension::AddSystemAllocator().
+//
+// Its methods are called with an internal lock held, so they must not
+// call malloc or take locks that a thread in malloc may hold.
+class SysAllocator {
+ public:
+  SysAllocator() { }
+  virtual ~SysAllocator();
+
+  // Return at least "size" bytes aligned to "alignment" (a power of
+  // two, no smaller than Alignment()), and set "*actual_size" to how
+  // many bytes that is.  Return NULL if this allocator is out of
+  // memory; it is then not asked again until every allocator fails.
+  virtual void* Alloc(size_t size, size_t* actual_size,
+                      size_t alignment) = 0;
+
+  // The alignment of all the memory this allocator returns, such as
+  // the huge page size; requests are also rounded up to a multiple
+  // of it.  0 means no more than the page heap asks for.
+  virtual size_t Alignment() { return 0; }
+
+  // If [start, start+length) lies in memory this allocator returned,
+  // give its pages back to the system (or do nothing, if they cannot
+  // be given back) and return true.  Return false to have tcmalloc
+  // release them with madvise(MADV_DONTNEED), as for its own memory.
+  virtual bool Release(void* start, size_t length) { return false; }
+
+  // Whether the memory Alloc returns, and released memory when it is
+  // next touched, reads as zero.
+  virtual bool ReturnsZeroedMemory() { return false; }
+};
+
 // The default implementations of the following routines do nothing.
 class MallocExtension {
  public:
@@ -73,12 +107,34 @@ class MallocExtension {
   // Get a string that contains a sample of live objects and the stack
   // traces that allocated these objects.  The format of the returned
   // string is equivalent to the output of the heap profiler and can
-  // therefore be passed to "pprof".
+  // therefore be passed to "pprof".  If the implementation reports
+  // "tcmalloc.sampling_period_bytes", the profile says so, and pprof
+  // scales the samples up to estimate the whole heap.
   //
   // The generated data is *appended* to "*result".  I.e., the old
   // contents of "*result" are preserved.
   virtual void GetHeapSample(std::string* result);
 
+  // Get a machine-readable report on how fragmented the heap is and
+  // how long objects live.  Each line is a record of space-separated
+  // fields, and lines starting with "#" are comments naming them:
+  //    class <class> <object size> <pages per span> <spans> <pages>
+  //          <objects> <live objects> <stranded bytes> <occupancy...>
+  //      One line per size class with spans.  "Stranded" bytes are
+  //      free objects in spans that cannot be returned to the page
+  //      heap because some of their objects are live.  The occupancy
+  //      fields count spans by fraction of live objects, in tenths
+  //      (the last field counts full spans).
+  //    sampling_period_bytes <bytes>
+  //      Average number of bytes allocated between sampled objects.
+  //    lifetime <from usec> <freed samples> <live samples>
+  //      Sampled objects whose lifetime (or, if still live, age) is
+  //      at least <from> and less than twice that.
+  //
+  // The generated data is *appended* to "*result".  Implementations
+  // that do not support this leave "*result" alone.
+  virtual void GetFragmentationReport(std::string* result);
+
   // Get a string that contains the stack traces that caused growth in
   // the addres sspace size.  The format of the returned string is
   // equivalent to the output of the heap profiler and can therefore
@@ -121,6 +177,68 @@ class MallocExtension {
   //      allocation without needing more bytes from system.
   //      This property is not writable.
   //
+  // "tcmalloc.background_release_rate"
+  //      Bytes per second that a background thread returns to the
+  //      system from long-unused free memory.  Setting this to a
+  //      non-zero value starts the thread.  Default: 0 (no thread),
+  //      or $TCMALLOC_BACKGROUND_RELEASE_RATE.
+  //
+  // "tcmalloc.background_release_age"
+  //      Seconds that free memory must stay unused before the
+  //      background thread returns it.  Default: 10, or
+  //      $TCMALLOC_BACKGROUND_RELEASE_AGE.
+  //
+  // "tcmalloc.prefault_bytes"
+  //      Bytes of memory that a background thread keeps faulted in
+  //      and zeroed in each page heap, for allocations of 1MB or more
+  //      (up to 16MB at a time).  Setting this to a non-zero value
+  //      starts the thread.  Default: 0 (no thread), or
+  //      $TCMALLOC_PREFAULT_BYTES.
+  //
+  // "tcmalloc.prefaulted_bytes"
+  //      Number of bytes the background thread has ready.  These are
+  //      included in "tcmalloc.slack_bytes".
+  //      This property is not writable.
+  //
+  // "tcmalloc.async_release_bytes"
+  //      Bytes of large free spans (1MB or more) that may be waiting
+  //      for a background thread to return them to the system, rather
+  //      than the freeing thread doing it.  Past that, they are
+  //      returned inline.  Setting this to a non-zero value starts the
+  //      thread.  Default: 0 (no thread), or
+  //      $TCMALLOC_ASYNC_RELEASE_BYTES.
+  //
+  // "tcmalloc.pending_release_bytes"
+  //      Number of bytes waiting for the background thread.  These are
+  //      included in "tcmalloc.slack_bytes".
+  //      This property is not writable.
+  //
+  // "tcmalloc.span_cache_bytes"
+  //      Bytes of freed objects of more than the largest size class,
+  //      and no more than 1MB, that each thread (or CPU) cache keeps
+  //      to hand out again for allocations of the same number of
+  //      pages, so that they need not go to the page heap.  Zero turns
+  //      the span cache off.  Default: 1MB, or
+  //      $TCMALLOC_SPAN_CACHE_BYTES.
+  //
+  // "tcmalloc.sampling_period_bytes"
+  //      Average number of bytes allocated between two allocations
+  //      sampled for GetHeapSample().  Zero turns sampling off.
+  //      Default: 128KB, or half of $TCMALLOC_SAMPLE_PARAMETER.
+  //
+  // "tcmalloc.pageheap_frees"
+  //      Number of spans returned to the page heap.
+  //      This property is not writable.
+  //
+  // "tcmalloc.pageheap_coalesces"
+  //      Number of times a span returned to the page heap was merged
+  //      with a free neighbour (a span merged on both sides counts
+  //      twice).  This property is not writable.
+  //
+  // "tcmalloc.pageheap_large_spans"
+  //      Number of free spans in the page heap of 1MB or more.
+  //      This property is not writable.
+  //
   // TODO: Add more properties as necessary
   // -------------------------------------------------------------------
 
@@ -157,6 +275,22 @@ class MallocExtension {
   // tcmalloc.)
   virtual void ReleaseFreeMemory();
 
+  // Have the page heap grow from "allocator" (which must live for the
+  // rest of the program) before its own sources, /dev/mem, sbrk and
+  // mmap, and before any allocator added after it.  tcmalloc's
+  // metadata still comes from its own sources.  Returns false if
+  // this malloc does not support it, or too many are registered.
+  virtual bool AddSystemAllocator(SysAllocator* allocator);
+
+  // Keep a page of heap statistics in the file at "path" up to date,
+  // for agents outside the process to read; see
+  // <google/malloc_telemetry.h> for its layout and how to read it.  A
+  // "%d" in "path" is replaced by the process id.  Setting
+  // TCMALLOC_TELEMETRY_PATH does this at startup.  Returns false if
+  // the page could not be set up, is already kept at another path,
+  // or this malloc does not support it.
+  virtual bool PublishTelemetry(const char* path);
+
   // The current malloc implementation.  Always non-NULL.
   static MallocExtension* instance();
 
@@ -47,32 +47,51 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+// Branch hint for the Invoke* fast paths, which nearly always find no
+// hook set.
+#if defined(__GNUC__)
+# define MALLOC_HOOK_UNLIKELY(x) (__builtin_expect(!!(x), 0))
+#else
+# define MALLOC_HOOK_UNLIKELY(x) (x)
+#endif
+
+// Each kind of hook can be set in two ways.  Set*Hook installs "the"
+// hook of that kind, returning the one it replaces, which callers may
+// daisy-chain to.  Add*Hook adds one of up to kMaxHooks more, which
+// are all invoked (after "the" hook) until Remove*Hook removes them;
+// it returns false if the hook is NULL or there is no room left.
+// Adding and removing take a lock, but invoking does not.
+//
+// When no hook of a kind is set, its Invoke*Hook costs one test of a
+// flag word that has a cache line to itself, so the allocators can
+// call them unconditionally.
 class MallocHook {
  public:
+  // The most hooks of one kind Add*Hook can add.
+  static const int kMaxHooks = 7;
+
   // The NewHook is invoked whenever an object is allocated.
   // It may be passed NULL if the allocator returned NULL.
   typedef void (*NewHook)(void* ptr, size_t size);
   inline static NewHook GetNewHook() { return new_hook_; }
-  inline static NewHook SetNewHook(NewHook hook) {
-    NewHook result = new_hook_;
-    new_hook_ = hook;
-    return result;
-  }
+  static NewHook SetNewHook(NewHook hook);
+  static bool AddNewHook(NewHook hook);
+  static bool RemoveNewHook(NewHook hook);
   inline static void InvokeNewHook(void* p, size_t s) {
-    if (new_hook_ != NULL) (*new_hook_)(p, s);
+    if (MALLOC_HOOK_UNLIKELY(active_.kinds & kNewHookBit))
+      InvokeNewHookSlow(p, s);
   }
 
   // The DeleteHook is invoked whenever an object is deallocated.
   // It may be passed NULL if the caller is trying to delete NULL.
   typedef void (*DeleteHook)(void* ptr);
   inline static DeleteHook GetDeleteHook() { return delete_hook_; }
-  inline static DeleteHook SetDeleteHook(DeleteHook hook) {
-    DeleteHook result = delete_hook_;
-    delete_hook_ = hook;
-    return result;
-  }
+  static DeleteHook SetDeleteHook(DeleteHook hook);
+  static bool AddDeleteHook(DeleteHook hook);
+  static bool RemoveDeleteHook(DeleteHook hook);
   inline static void InvokeDeleteHook(void* p) {
-    if (delete_hook_ != NULL) (*delete_hook_)(p);
+    if (MALLOC_HOOK_UNLIKELY(active_.kinds & kDeleteHookBit))
+      InvokeDeleteHookSlow(p);
   }
 
   // The MmapHook is invoked whenever a region of memory is mapped.
@@ -85,11 +104,9 @@ class MallocHook {
                            int fd,
                            off_t offset);
   inline static MmapHook GetMmapHook() { return mmap_hook_; }
-  inline static MmapHook SetMmapHook(MmapHook hook) {
-    MmapHook result = mmap_hook_;
-    mmap_hook_ = hook;
-    return result;
-  }
+  static MmapHook SetMmapHook(MmapHook hook);
+  static bool AddMmapHook(MmapHook hook);
+  static bool RemoveMmapHook(MmapHook hook);
   inline static void InvokeMmapHook(void* result,
                                     void* start,
                                     size_t size,
@@ -97,22 +114,19 @@ class MallocHook {
                                     int flags,
                                     int fd,
                                     off_t offset) {
-    if (mmap_hook_ != NULL) (*mmap_hook_)(result,
-                                          start, size,
-                                          protection, flags,
-                                          fd, offset);
+    if (MALLOC_HOOK_UNLIKELY(active_.kinds & kMmapHookBit))
+      InvokeMmapHookSlow(result, start, size, protection, flags, fd, offset);
   }
 
   // The MunmapHook is invoked whenever a region of memory is unmapped.
   typedef void (*MunmapHook)(void* ptr, size_t size);
   inline static MunmapHook GetMunmapHook() { return munmap_hook_; }
-  inline static MunmapHook SetMunmapHook(MunmapHook hook) {
-    MunmapHook result = munmap_hook_;
-    munmap_hook_ = hook;
-    return result;
-  }
+  static MunmapHook SetMunmapHook(MunmapHook hook);
+  static bool AddMunmapHook(MunmapHook hook);
+  static bool RemoveMunmapHook(MunmapHook hook);
   inline static void InvokeMunmapHook(void* p, size_t size) {
-    if (munmap_hook_ != NULL) (*munmap_hook_)(p, size);
+    if (MALLOC_HOOK_UNLIKELY(active_.kinds & kMunmapHookBit))
+      InvokeMunmapHookSlow(p, size);
   }
 
   // The MremapHook is invoked whenever a region of memory is remapped.
@@ -123,32 +137,29 @@ class MallocHook {
                              int flags,
                              void* new_addr);
   inline static MremapHook GetMremapHook() { return mremap_hook_; }
-  inline static MremapHook SetMremapHook(MremapHook hook) {
-    MremapHook result = mremap_hook_;
-    mremap_hook_ = hook;
-    return result;
-  }
+  static MremapHook SetMremapHook(MremapHook hook);
+  static bool AddMremapHook(MremapHook hook);
+  static bool RemoveMremapHook(MremapHook hook);
   inline static void InvokeMremapHook(void* result,
                                       void* old_addr,
                                       size_t old_size,
                                       size_t new_size,
                                       int flags,
                                       void* new_addr) {
-    if (mremap_hook_ != NULL) (*mremap_hook_)(result,
-                                              old_addr, old_size,
-                                              new_size, flags, new_addr);
+    if (MALLOC_HOOK_UNLIKELY(active_.kinds & kMremapHookBit))
+      InvokeMremapHookSlow(result, old_addr, old_size, new_size, flags,
+                           new_addr);
   }
 
   // The SbrkHook is invoked whenever sbrk is called.
   typedef void (*SbrkHook)(void* result, ptrdiff_t increment);
   inline static SbrkHook GetSbrkHook() { return sbrk_hook_; }
-  inline static SbrkHook SetSbrkHook(SbrkHook hook) {
-    SbrkHook result = sbrk_hook_;
-    sbrk_hook_ = hook;
-    return result;
-  }
+  static SbrkHook SetSbrkHook(SbrkHook hook);
+  static bool AddSbrkHook(SbrkHook hook);
+  static bool RemoveSbrkHook(SbrkHook hook);
   inline static void InvokeSbrkHook(void* result, ptrdiff_t increment) {
-    if (sbrk_hook_ != NULL) (*sbrk_hook_)(result, increment);
+    if (MALLOC_HOOK_UNLIKELY(active_.kinds & kSbrkHookBit))
+      InvokeSbrkHookSlow(result, increment);
   }
 
   // Get the current stack trace.  Try to skip all routines up to and
@@ -160,6 +171,43 @@ class MallocHook {
 
  private:
 
+  // The bits of active_.kinds: which kinds of hook are set.
+  enum {
+    kNewHookBit    = 1 << 0,
+    kDeleteHookBit = 1 << 1,
+    kMmapHookBit   = 1 << 2,
+    kMunmapHookBit = 1 << 3,
+    kMremapHookBit = 1 << 4,
+    kSbrkHookBit   = 1 << 5
+  };
+
+  // Padded out to a cache line, so that writes to its neighbours never
+  // take the line away from the allocators that read it.
+  struct HookFlags {
+    volatile int kinds;
+    char pad[64 - sizeof(int)];
+  };
+
+  static void InvokeNewHookSlow(void* p, size_t s);
+  static void InvokeDeleteHookSlow(void* p);
+  static void InvokeMmapHookSlow(void* result,
+                                 void* start,
+                                 size_t size,
+                                 int protection,
+                                 int flags,
+                                 int fd,
+                                 off_t offset);
+  static void InvokeMunmapHookSlow(void* p, size_t size);
+  static void InvokeMremapHookSlow(void* result,
+                                   void* old_addr,
+                                   size_t old_size,
+                                   size_t new_size,
+                                   int flags,
+                                   void* new_addr);
+  static void InvokeSbrkHookSlow(void* result, ptrdiff_t increment);
+
+  static HookFlags   active_;
+
   static NewHook     new_hook_;
   static DeleteHook  delete_hook_;
   static MmapHook    mmap_hook_;
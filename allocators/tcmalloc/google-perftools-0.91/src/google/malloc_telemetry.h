@@ -0,0 +1,105 @@
+// Copyright (c) 2005, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// The layout of the telemetry page that tcmalloc publishes when
+// TCMALLOC_TELEMETRY_PATH is set.  A background thread in the process
+// rewrites the page every TCMALLOC_TELEMETRY_INTERVAL_MS milliseconds;
+// another process maps the file read-only and copies the page out with
+// TCMallocTelemetryRead(), which takes no lock in either process and
+// sends the target no signal.  This header is plain C so that agents
+// need not link against anything.
+//
+// The page is guarded by a sequence count: the writer makes "seq" odd
+// before it changes anything and even again when it is done, so a
+// reader that sees the same even count before and after its copy has
+// a consistent one.  Readers must check "magic" and "version" first;
+// fields are only ever added at the end, with a new version, and
+// "size" is the number of bytes the writer fills in.
+
+#ifndef _MALLOC_TELEMETRY_H
+#define _MALLOC_TELEMETRY_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define TCMALLOC_TELEMETRY_MAGIC    0x4d4c4554u     /* "TELM" */
+#define TCMALLOC_TELEMETRY_VERSION  1
+#define TCMALLOC_TELEMETRY_MAX_CLASSES 128
+
+struct TCMallocTelemetryClass {
+  uint64_t size;                   /* Bytes per object of the class */
+  uint64_t cached_bytes;           /* Free in thread, central, transfer caches */
+};
+
+struct TCMallocTelemetry {
+  uint32_t magic;                  /* TCMALLOC_TELEMETRY_MAGIC */
+  uint32_t version;                /* TCMALLOC_TELEMETRY_VERSION */
+  uint32_t size;                   /* sizeof(struct TCMallocTelemetry) */
+  uint32_t num_classes;            /* Entries of "classes" in use */
+  volatile uint64_t seq;           /* Odd while the page is being written */
+  uint64_t pid;                    /* Process that writes the page */
+  uint64_t updates;                /* Times the page has been written */
+  uint64_t timestamp_us;           /* gettimeofday() of the last update */
+
+  uint64_t mapped_bytes;           /* Bytes obtained from the system */
+  uint64_t live_bytes;             /* Bytes in use by the application */
+  uint64_t thread_cache_bytes;     /* Free in per-thread and per-CPU caches */
+  uint64_t central_cache_bytes;    /* Free in central free lists */
+  uint64_t transfer_cache_bytes;   /* Free in central transfer caches */
+  uint64_t pageheap_free_bytes;    /* Free in the page heaps */
+  uint64_t metadata_bytes;         /* Bytes used for tcmalloc's own metadata */
+
+  uint64_t pageheap_lock_contentions;  /* Acquisitions that had to wait */
+  uint64_t central_lock_contentions;   /* Summed over all size classes */
+
+  struct TCMallocTelemetryClass classes[TCMALLOC_TELEMETRY_MAX_CLASSES];
+};
+
+/* Copy the page at "page" to "out".  Returns 1 on success, or 0 if the
+   page is not (yet) a telemetry page of this version, or kept changing
+   under the copy for "tries" attempts. */
+static inline int TCMallocTelemetryRead(const struct TCMallocTelemetry* page,
+                                        struct TCMallocTelemetry* out,
+                                        int tries) {
+  while (tries-- > 0) {
+    const uint64_t seq = page->seq;
+    __sync_synchronize();
+    if (seq & 1) continue;
+    memcpy(out, (const void*) page, sizeof(*out));
+    __sync_synchronize();
+    if (page->seq != seq) continue;
+    return out->magic == TCMALLOC_TELEMETRY_MAGIC &&
+           out->version == TCMALLOC_TELEMETRY_VERSION;
+  }
+  return 0;
+}
+
+#endif /* _MALLOC_TELEMETRY_H */
@@ -39,10 +39,12 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>               // for clone() and sched_yield()
 #include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <assert.h>
 
 #ifdef HAVE_LINUX_PTRACE_H
@@ -73,6 +75,7 @@
 #include <google/malloc_extension.h>
 #include "memory_region_map.h"
 #include "base/spinlock.h"
+#include "base/atomicops.h"
 #include "base/sysinfo.h"
 #include "base/stl_allocator.h"
 
@@ -137,6 +140,11 @@ DEFINE_bool(heap_check_ignore_thread_live,
             "If set to true, objects reachable from thread stacks "
             "and registers are not reported as leaks");
 
+DEFINE_int32(heap_check_mark_threads,
+             EnvToInt("HEAP_CHECK_MARK_THREADS", 1),
+             "Number of threads to use for finding the heap objects "
+             "reachable from the live data");
+
 DEFINE_bool(heap_check_test_pointer_alignment,
             EnvToBool("HEAP_CHECK_TEST_POINTER_ALIGNMENT", false),
             "Set to true to check if the found leak can be due to "
@@ -458,9 +466,9 @@ static void RegisterStack(void* top_ptr) {
           uintptr_t stack_start = start;
           uintptr_t stack_end = end;
           // can optimize-away this loop, but it does not run often
-          for (MemoryRegionMap::RegionIterator r =
-                 MemoryRegionMap::BeginRegionLocked();
-               r != MemoryRegionMap::EndRegionLocked(); ++r) {
+          MemoryRegionMap::Snapshot regions;
+          for (MemoryRegionMap::RegionIterator r = regions.begin();
+               r != regions.end(); ++r) {
             if (top < r->start_addr  &&  r->start_addr < stack_end) {
               stack_end = r->start_addr;
             }
@@ -869,16 +877,13 @@ void HeapLeakChecker::IgnoreNonThreadLiveObjectsLocked() {
       RAW_CHECK(live_objects->empty(), "");
       // Process library_live_objects in l->second
       // filtering them by MemoryRegionMap:
-      // It's safe to iterate over MemoryRegionMap
-      // w/o locks here as we are inside MemoryRegionMap::Lock().
       // The only change to MemoryRegionMap possible in this loop
       // is region addition as a result of allocating more memory
-      // for live_objects. This won't invalidate the RegionIterator
-      // or the intent of the loop.
-      // --see the comment by MemoryRegionMap::BeginRegionLocked().
-      for (MemoryRegionMap::RegionIterator region =
-             MemoryRegionMap::BeginRegionLocked();
-           region != MemoryRegionMap::EndRegionLocked(); ++region) {
+      // for live_objects, which our snapshot does not see.
+      // That does not change the intent of the loop.
+      MemoryRegionMap::Snapshot regions;
+      for (MemoryRegionMap::RegionIterator region = regions.begin();
+           region != regions.end(); ++region) {
         // "region" from MemoryRegionMap is to be subtracted from
         // (tentatively live) regions in l->second
         // if it has a stack inside or it was allocated by
@@ -1038,6 +1043,10 @@ void HeapLeakChecker::IgnoreLiveObjectsLocked(const char* name,
                                               const char* name2) {
   int64 live_object_count = 0;
   int64 live_byte_count = 0;
+  if (FLAGS_heap_check_mark_threads > 1  &&  !live_objects->empty()) {
+    // This empties live_objects:
+    IgnoreLiveObjectsInParallelLocked(&live_object_count, &live_byte_count);
+  }
   while (!live_objects->empty()) {
     void* object = live_objects->back().ptr;
     size_t size = live_objects->back().size;
@@ -1096,6 +1105,359 @@ void HeapLeakChecker::IgnoreLiveObjectsLocked(const char* name,
   }
 }
 
+//----------------------------------------------------------------------
+// Parallel live heap walking
+//----------------------------------------------------------------------
+
+// With FLAGS_heap_check_mark_threads > 1 IgnoreLiveObjectsLocked does its
+// flood traversal of the live heap with that many threads.
+// Each thread keeps the memory regions it has yet to scan in a deque of its
+// own: it takes the newest region itself and idle threads steal the oldest.
+// Regions over kMarkChunk bytes are split as they are taken,
+// so that a big data section or stack gets scanned by several threads.
+// A region that finds its deque full goes to a shared overflow stack instead.
+// The live heap objects found are claimed in a lock-free hash set so that
+// each is scanned once, and go to profile_adjust_objects when the walk ends.
+//
+// The extra threads are made with clone() (like in linuxthreads.c)
+// and call into libc only for system call wrappers that take no locks:
+// the other threads of the program are stopped at arbitrary points
+// while we are here, possibly holding libc locks.
+
+static const size_t kMarkChunk = 64 << 10;   // bytes to scan per region taken
+static const int kMarkDequeSize = 1 << 14;    // regions per deque
+static const int kMarkOverflowBlockSize = 1 << 12;  // regions per block
+static const int kMarkStackSize = 64 << 10;   // stack of an extra thread
+static const int kMaxMarkThreads = 64;
+static const size_t kMarkPrefetchAhead = 256;  // bytes
+
+// A piece of memory to look for heap pointers in.
+struct MarkRegion {
+  char* ptr;
+  size_t size;
+};
+
+// Fixed-size work-stealing deque (Chase and Lev, SPAA 2005).
+// Only the owning thread calls Push and Pop; any thread can call Steal.
+class MarkDeque {
+ public:
+  void Init() { top_ = bottom_ = 0; }
+
+  bool Empty() const {
+    return Acquire_Load(&top_) >= Acquire_Load(&bottom_);
+  }
+
+  // Return false if the deque is full.
+  bool Push(const MarkRegion& r) {
+    const AtomicWord b = bottom_;
+    if (b - Acquire_Load(&top_) >= kMarkDequeSize) return false;
+    regions_[b & (kMarkDequeSize - 1)] = r;
+    Release_Store(&bottom_, b + 1);
+    return true;
+  }
+
+  bool Pop(MarkRegion* r) {
+    const AtomicWord b = bottom_ - 1;
+    bottom_ = b;
+    MemoryBarrier();
+    const AtomicWord t = top_;
+    if (t > b) {  // empty
+      bottom_ = b + 1;
+      return false;
+    }
+    *r = regions_[b & (kMarkDequeSize - 1)];
+    if (t == b) {  // the last one: race the thieves for it
+      const bool won = CompareAndSwap(&top_, t, t + 1) == t;
+      bottom_ = b + 1;
+      return won;
+    }
+    return true;
+  }
+
+  bool Steal(MarkRegion* r) {
+    const AtomicWord t = Acquire_Load(&top_);
+    MemoryBarrier();
+    const AtomicWord b = Acquire_Load(&bottom_);
+    if (t >= b) return false;
+    *r = regions_[t & (kMarkDequeSize - 1)];
+    return CompareAndSwap(&top_, t, t + 1) == t;
+  }
+
+ private:
+  volatile AtomicWord top_;
+  char pad_[64];  // keep the owner's and the thieves' ends apart
+  volatile AtomicWord bottom_;
+  MarkRegion regions_[kMarkDequeSize];
+};
+
+struct MarkOverflowBlock {
+  MarkOverflowBlock* next;
+  int count;
+  MarkRegion regions[kMarkOverflowBlockSize];
+};
+
+// State of one of the threads of the walk
+struct MarkWorker {
+  MarkDeque deque;
+  int index;
+  pid_t pid;       // 0 for the calling thread, -1 if clone failed
+  char* stack;
+  int64 object_count;
+  int64 byte_count;
+};
+
+static MarkWorker* mark_workers = NULL;
+static int num_mark_workers = 0;
+// Open-addressing hash set of the heap objects claimed in this walk;
+// 0 marks an empty slot.  It has room for twice the objects in heap_profile.
+static volatile AtomicWord* mark_claimed = NULL;
+static uintptr_t mark_claimed_mask = 0;
+// Shared overflow stack of regions; a chain of blocks, newest first
+static SpinLock mark_overflow_lock(SpinLock::LINKER_INITIALIZED);
+static MarkOverflowBlock* mark_overflow = NULL;
+static volatile AtomicWord mark_overflow_count = 0;
+// Number of threads that found no work anywhere
+static volatile AtomicWord mark_idle_count = 0;
+
+// Return true iff ptr was not claimed yet and now is claimed by us.
+static bool ClaimLiveObject(void* ptr) {
+  // what earlier walks found is only read during this one:
+  if (profile_adjust_objects->find(ptr) != profile_adjust_objects->end()) {
+    return false;
+  }
+  const AtomicWord key = reinterpret_cast<AtomicWord>(ptr);
+  uintptr_t i = ((reinterpret_cast<uintptr_t>(ptr) >> 3) * 0x9E3779B97F4A7C15ULL)
+                & mark_claimed_mask;
+  while (true) {
+    const AtomicWord v = Acquire_Load(&mark_claimed[i]);
+    if (v == key) return false;
+    if (v == 0) {
+      const AtomicWord prev = CompareAndSwap(&mark_claimed[i], 0, key);
+      if (prev == 0) return true;
+      if (prev == key) return false;
+    }
+    i = (i + 1) & mark_claimed_mask;
+  }
+}
+
+// Align r to pointer_alignment as IgnoreLiveObjectsLocked does.
+static void AlignMarkRegion(MarkRegion* r) {
+  const size_t remainder =
+    reinterpret_cast<uintptr_t>(r->ptr) % pointer_alignment;
+  if (remainder) {
+    r->ptr += pointer_alignment - remainder;
+    if (r->size >= pointer_alignment - remainder) {
+      r->size -= pointer_alignment - remainder;
+    } else {
+      r->size = 0;
+    }
+  }
+}
+
+static void PushMarkRegion(MarkWorker* w, const MarkRegion& r) {
+  if (w->deque.Push(r)) return;
+  mark_overflow_lock.Lock();
+  if (mark_overflow == NULL  ||
+      mark_overflow->count == kMarkOverflowBlockSize) {
+    MarkOverflowBlock* b = reinterpret_cast<MarkOverflowBlock*>(
+      HeapLeakChecker::Allocator::Allocate(sizeof(MarkOverflowBlock)));
+    if (b == NULL) RAW_LOG(FATAL, "Out of memory for the live heap walk");
+    b->next = mark_overflow;
+    b->count = 0;
+    mark_overflow = b;
+  }
+  mark_overflow->regions[mark_overflow->count++] = r;
+  AtomicIncrement(&mark_overflow_count, 1);
+  mark_overflow_lock.Unlock();
+}
+
+static bool PopOverflowMarkRegion(MarkRegion* r) {
+  if (Acquire_Load(&mark_overflow_count) == 0) return false;
+  bool found = false;
+  mark_overflow_lock.Lock();
+  if (mark_overflow != NULL  &&  mark_overflow->count == 0  &&
+      mark_overflow->next != NULL) {
+    MarkOverflowBlock* b = mark_overflow;
+    mark_overflow = b->next;
+    HeapLeakChecker::Allocator::Free(b);
+  }
+  if (mark_overflow != NULL  &&  mark_overflow->count > 0) {
+    *r = mark_overflow->regions[--mark_overflow->count];
+    AtomicIncrement(&mark_overflow_count, -1);
+    found = true;
+  }
+  mark_overflow_lock.Unlock();
+  return found;
+}
+
+// Is there work that some idle thread could take?
+static bool HaveMarkWork() {
+  if (Acquire_Load(&mark_overflow_count) != 0) return true;
+  for (int i = 0; i < num_mark_workers; ++i) {
+    if (!mark_workers[i].deque.Empty()) return true;
+  }
+  return false;
+}
+
+// Get the next region for w to scan;
+// return false when all the threads have run out of work.
+static bool TakeMarkRegion(MarkWorker* w, MarkRegion* r) {
+  if (w->deque.Pop(r)) return true;
+  while (true) {
+    if (PopOverflowMarkRegion(r)) return true;
+    for (int i = 1; i < num_mark_workers; ++i) {
+      MarkWorker* victim = &mark_workers[(w->index + i) % num_mark_workers];
+      if (victim->deque.Steal(r)) return true;
+    }
+    // Nothing found: wait for work to show up or for everybody to be idle.
+    // Only busy threads make work, so once all are idle the walk is done.
+    AtomicIncrement(&mark_idle_count, 1);
+    while (true) {
+      if (Acquire_Load(&mark_idle_count) == num_mark_workers) return false;
+      if (HaveMarkWork()) break;
+      sched_yield();
+    }
+    AtomicIncrement(&mark_idle_count, -1);
+  }
+}
+
+int HeapLeakChecker::MarkLiveObjects(void* worker) {
+  MarkWorker* w = reinterpret_cast<MarkWorker*>(worker);
+  MarkRegion r;
+  while (TakeMarkRegion(w, &r)) {
+    // Leave the rest of a big region for whoever gets to it first;
+    // scan up to the last pointer that starts in our part.
+    size_t size = r.size;
+    if (size > kMarkChunk) {
+      MarkRegion rest = { r.ptr + kMarkChunk, r.size - kMarkChunk };
+      PushMarkRegion(w, rest);
+      size = kMarkChunk + sizeof(void*) - pointer_alignment;
+    }
+    char* object = r.ptr;
+    while (size >= sizeof(void*)) {
+      if ((reinterpret_cast<uintptr_t>(object) & 63) < pointer_alignment) {
+        __builtin_prefetch(object + kMarkPrefetchAhead);
+      }
+      void* ptr = reinterpret_cast<void*>(UNALIGNED_LOAD32(object));
+      object += pointer_alignment;
+      size -= pointer_alignment;
+      if (ptr == NULL)  continue;
+      size_t object_size;
+      if (HaveOnHeapLocked(&ptr, &object_size)  &&  ClaimLiveObject(ptr)) {
+        w->object_count += 1;
+        w->byte_count += object_size;
+        // We will likely scan it next: start bringing it in.
+        __builtin_prefetch(ptr);
+        MarkRegion found = { reinterpret_cast<char*>(ptr), object_size };
+        AlignMarkRegion(&found);
+        PushMarkRegion(w, found);
+      }
+    }
+  }
+  return 0;
+}
+
+void HeapLeakChecker::IgnoreLiveObjectsInParallelLocked(
+    int64* live_object_count, int64* live_byte_count) {
+  const int num_threads = FLAGS_heap_check_mark_threads < kMaxMarkThreads
+                          ? FLAGS_heap_check_mark_threads : kMaxMarkThreads;
+  // Make the claimed set at most half full
+  const HeapProfileTable::Stats& total = heap_profile->total();
+  const size_t max_objects = 2 * (total.allocs - total.frees) + 1;
+  size_t capacity = 1024;
+  while (capacity < max_objects) capacity <<= 1;
+  mark_claimed = reinterpret_cast<volatile AtomicWord*>(
+                   Allocator::Allocate(capacity * sizeof(*mark_claimed)));
+  mark_workers = reinterpret_cast<MarkWorker*>(
+                   Allocator::Allocate(num_threads * sizeof(*mark_workers)));
+  if (mark_claimed == NULL  ||  mark_workers == NULL) {
+    RAW_LOG(FATAL, "Out of memory for the live heap walk");
+  }
+  memset(const_cast<AtomicWord*>(mark_claimed), 0,
+         capacity * sizeof(*mark_claimed));
+  mark_claimed_mask = capacity - 1;
+  num_mark_workers = num_threads;
+  mark_overflow = NULL;
+  mark_overflow_count = 0;
+  mark_idle_count = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    mark_workers[i].deque.Init();
+    mark_workers[i].index = i;
+    mark_workers[i].pid = 0;
+    mark_workers[i].stack = NULL;
+    mark_workers[i].object_count = 0;
+    mark_workers[i].byte_count = 0;
+  }
+
+  // Deal the live object sources out to the threads,
+  // accounting for them like IgnoreLiveObjectsLocked does.
+  for (size_t i = 0; i < live_objects->size(); ++i) {
+    const AllocObject& source = (*live_objects)[i];
+    void* object = source.ptr;
+    size_t object_size;
+    if (source.place == MUST_BE_ON_HEAP  &&
+        HaveOnHeapLocked(&object, &object_size)  &&
+        profile_adjust_objects->insert(object).second) {
+      *live_object_count += 1;
+      *live_byte_count += source.size;
+    }
+    MarkRegion r = { reinterpret_cast<char*>(object), source.size };
+    AlignMarkRegion(&r);
+    PushMarkRegion(&mark_workers[i % num_threads], r);
+  }
+  live_objects->clear();
+
+  // Start the extra threads; we are thread 0.
+  for (int i = 1; i < num_threads; ++i) {
+    MarkWorker* w = &mark_workers[i];
+    w->stack = reinterpret_cast<char*>(Allocator::Allocate(kMarkStackSize));
+    w->pid = -1;
+    if (w->stack != NULL) {
+      char* top = reinterpret_cast<char*>(
+        reinterpret_cast<uintptr_t>(w->stack + kMarkStackSize) & ~15);
+      w->pid = clone(MarkLiveObjects, top,
+                     CLONE_VM|CLONE_FS|CLONE_FILES|CLONE_UNTRACED, w);
+    }
+    if (w->pid < 0) {
+      // Count it as idle for good; the others will steal its deque.
+      AtomicIncrement(&mark_idle_count, 1);
+    }
+  }
+  MarkLiveObjects(&mark_workers[0]);
+
+  int started = 1;
+  for (int i = 1; i < num_threads; ++i) {
+    MarkWorker* w = &mark_workers[i];
+    if (w->pid > 0) {
+      while (waitpid(w->pid, NULL, __WALL) < 0  &&  errno == EINTR) { }
+      started += 1;
+    }
+    Allocator::Free(w->stack);
+  }
+
+  for (uintptr_t i = 0; i < capacity; ++i) {
+    if (mark_claimed[i] != 0) {
+      profile_adjust_objects->insert(reinterpret_cast<void*>(mark_claimed[i]));
+    }
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    *live_object_count += mark_workers[i].object_count;
+    *live_byte_count += mark_workers[i].byte_count;
+  }
+  RAW_VLOG(2, "Walked the live heap with %d threads", started);
+
+  while (mark_overflow != NULL) {
+    MarkOverflowBlock* b = mark_overflow;
+    mark_overflow = b->next;
+    Allocator::Free(b);
+  }
+  Allocator::Free(const_cast<AtomicWord*>(mark_claimed));
+  Allocator::Free(mark_workers);
+  mark_claimed = NULL;
+  mark_workers = NULL;
+  num_mark_workers = 0;
+}
+
 bool HeapLeakChecker::HeapProfileFilter(void* ptr, size_t size) {
   if (profile_adjust_objects->find(ptr) != profile_adjust_objects->end()) {
     RAW_VLOG(4, "Ignoring object at %p of %"PRIuS" bytes", ptr, size);
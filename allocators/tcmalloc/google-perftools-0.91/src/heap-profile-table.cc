@@ -119,7 +119,7 @@ static int FillProcSelfMaps(char buf[], int size) {
 // Dump the same data as FillProcSelfMaps reads to fd.
 // It seems easier to repeat parts of FillProcSelfMaps here than to
 // reuse it via a call.
-static void DumpProcSelfMaps(int fd) {
+void HeapProfileTable::DumpProcSelfMaps(int fd) {
   FDWrite(fd, kProcSelfMapsHeader, sizeof(kProcSelfMapsHeader)-1);  // chop \0
   int maps = open("/proc/self/maps", O_RDONLY);
   if (maps >= 0) {
@@ -148,6 +148,7 @@ HeapProfileTable::HeapProfileTable(Allocator alloc, DeAllocator dealloc)
   // init the rest:
   memset(&total_, 0, sizeof(total_));
   num_buckets_ = 0;
+  num_delta_sites_ = 0;
 }
 
 HeapProfileTable::~HeapProfileTable() {
@@ -294,6 +295,63 @@ int HeapProfileTable::UnparseBucket(const Bucket& b,
   return buflen;
 }
 
+int HeapProfileTable::UnparseBucketDelta(Bucket* b,
+                                         char* buf, int buflen, int bufsize) {
+  int len = buflen;
+  const int id = (b->id != 0) ? b->id : num_delta_sites_ + 1;
+  int printed;
+  if (b->id == 0) {
+    printed = snprintf(buf + len, bufsize - len, "s %d @", id);
+    if (printed < 0 || printed >= bufsize - len) return buflen;
+    len += printed;
+    for (int d = 0; d < b->depth; d++) {
+      printed = snprintf(buf + len, bufsize - len, " 0x%08lx",
+                         (unsigned long)b->stack[d]);
+      if (printed < 0 || printed >= bufsize - len) return buflen;
+      len += printed;
+    }
+    printed = snprintf(buf + len, bufsize - len, "\n");
+    if (printed < 0 || printed >= bufsize - len) return buflen;
+    len += printed;
+  }
+  printed = snprintf(buf + len, bufsize - len,
+                     "d %d %d %"PRId64" %d %"PRId64"\n",
+                     id,
+                     b->allocs - b->emitted.allocs,
+                     b->alloc_size - b->emitted.alloc_size,
+                     b->frees - b->emitted.frees,
+                     b->free_size - b->emitted.free_size);
+  if (printed < 0 || printed >= bufsize - len) return buflen;
+  len += printed;
+  // All of it fit: only now is it written.
+  if (b->id == 0) {
+    b->id = id;
+    num_delta_sites_++;
+  }
+  b->emitted.allocs = b->allocs;
+  b->emitted.alloc_size = b->alloc_size;
+  b->emitted.frees = b->frees;
+  b->emitted.free_size = b->free_size;
+  return len;
+}
+
+int HeapProfileTable::FillProfileDelta(char buf[], int size, bool* complete) {
+  int buflen = 0;
+  *complete = false;
+  for (int b = 0; b < kHashTableSize; b++) {
+    for (Bucket* x = table_[b]; x != 0; x = x->next) {
+      if (x->allocs == x->emitted.allocs && x->frees == x->emitted.frees) {
+        continue;  // nothing new here
+      }
+      const int printed = UnparseBucketDelta(x, buf, buflen, size);
+      if (printed == buflen) return buflen;  // out of room
+      buflen = printed;
+    }
+  }
+  *complete = true;
+  return buflen;
+}
+
 int HeapProfileTable::FillOrderedProfile(char buf[], int size) const {
   // We can't allocate list on the stack, as this would overflow on threads
   // running with a small stack size.
@@ -124,6 +124,20 @@ class HeapProfileTable {
                            bool dump_alloc_addresses,
                            Stats* profile_stats) const;
 
+  // Fill into buffer 'buf' of size 'size' the changes to the profile
+  // since the previous call, as lines of an incremental profile stream:
+  //   "s <id> @ <stack>" for each bucket that appears for the first time,
+  //   "d <id> <allocs> <alloc_size> <frees> <free_size>" for each bucket
+  //     whose stats changed, giving the change.
+  // Lines are never split; if 'buf' fills up, the buckets not yet
+  // written are kept for the next call and *complete is set to false.
+  // Return the actual size occupied in 'buf'.
+  // We do not provision for 0-terminating 'buf'.
+  int FillProfileDelta(char buf[], int size, bool* complete);
+
+  // Write the "MAPPED_LIBRARIES:" section of a profile to fd.
+  static void DumpProcSelfMaps(int fd);
+
   // Cleanup any old profile files matching prefix + ".*" + kFileExt.
   static void CleanupOldProfiles(const char* prefix);
 
@@ -138,6 +152,8 @@ class HeapProfileTable {
     int       depth;  // Depth of stack trace
     void**    stack;  // Stack trace
     Bucket*   next;   // Next entry in hash-table
+    int       id;     // Id in the delta stream, 0 until first written
+    Stats     emitted;  // Stats as of the last delta written
   };
 
   // Info stored in the address map
@@ -170,6 +186,11 @@ class HeapProfileTable {
                            char* buf, int buflen, int bufsize,
                            Stats* profile_stats);
 
+  // Same for the delta stream: print bucket b's changes since its last
+  // delta into buf, and mark them as written.  Either all of b's lines
+  // fit or nothing is printed.
+  int UnparseBucketDelta(Bucket* b, char* buf, int buflen, int bufsize);
+
   // Get the bucket for the current stack trace creating one if needed
   // (skip "skip_count" most recent frames).
   Bucket* GetBucket(int skip_count);
@@ -207,6 +228,9 @@ class HeapProfileTable {
   Bucket** table_;
   int num_buckets_;
 
+  // Number of buckets given an id in the delta stream.
+  int num_delta_sites_;
+
   // Map of all currently allocated objects we know about.
   AllocationMap* allocation_;
 
@@ -38,6 +38,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <assert.h>
 
@@ -87,6 +88,16 @@ DEFINE_bool(mmap_log,
 DEFINE_bool(mmap_profile,
             EnvToBool("HEAP_PROFILE_MMAP", false),
             "If heap-profiling on, also profile mmaps");
+DEFINE_bool(heap_profile_incremental,
+            EnvToBool("HEAP_PROFILE_INCREMENTAL", false),
+            "Instead of writing a full profile at every dump, append "
+            "the changes since the previous dump to a single "
+            "<prefix>.heapdelta stream.");
+DEFINE_int64(heap_profile_delta_interval,
+             EnvToInt64("HEAP_PROFILE_DELTA_INTERVAL", 16 << 20 /*16MB*/),
+             "In incremental mode, append to the stream once every "
+             "specified number of bytes allocated by the program "
+             "(in place of heap_profile_allocation_interval).");
 
 //----------------------------------------------------------------------
 // Locking
@@ -127,6 +138,162 @@ static int64 high_water_mark = 0;     // In-use-bytes at last high-water dump
 
 static HeapProfileTable* heap_profile = NULL;  // the heap profile table
 
+//----------------------------------------------------------------------
+// Incremental profile stream
+//----------------------------------------------------------------------
+
+// With FLAGS_heap_profile_incremental a dump appends to the stream
+//   heap delta stream: 1 <start time in usec since the epoch>
+//   t <usec since start> <allocs> <alloc_size> <frees> <free_size> <reason>
+//   s <id> @ <stack>
+//   d <id> <allocs> <alloc_size> <frees> <free_size>
+//   ...
+// a "t" line of running totals and then a line per new or changed
+// bucket (see HeapProfileTable::FillProfileDelta), so the cost of a
+// dump is the number of buckets that changed, not the profile size.
+// The stream is written through a window of the file mapped shared;
+// the file is kept one window past the end of the stream, and cut to
+// size, with the mapped libraries appended, when the stream finishes.
+// Readers stop at the first NUL byte, as in a stream cut short by a
+// crash.  src/heap-timeline reads the stream back.
+
+static const int kDeltaWindowSize = 1 << 20;
+
+static int   delta_fd = -1;             // stream file, or -1
+static char* delta_window = NULL;       // mapping of the window
+static int64 delta_window_start = 0;    // file offset of the window
+static int64 delta_length = 0;          // bytes in the stream so far
+static int64 delta_start_usec = 0;      // time the stream started
+
+static int64 NowUsec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<int64>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// Map the window at the end of the stream, growing the file to cover it.
+// Called without heap_lock held: mmap and munmap run the MallocHook
+// mmap hooks, which take it.
+static bool MapDeltaWindow(int fd, int64 length,
+                           char** window, int64* window_start) {
+  const int64 page = getpagesize();
+  const int64 start = length - length % page;
+  if (ftruncate(fd, start + kDeltaWindowSize) != 0) return false;
+  void* p = mmap(NULL, kDeltaWindowSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, start);
+  if (p == MAP_FAILED) return false;
+  *window = reinterpret_cast<char*>(p);
+  *window_start = start;
+  return true;
+}
+
+// Move the window to the end of the stream.
+// heap_lock is held on entry and exit, but released while remapping.
+static bool AdvanceDeltaWindowLocked() {
+  const int fd = delta_fd;
+  char* old_window = delta_window;
+  const int64 length = delta_length;
+  char* window;
+  int64 window_start;
+  heap_lock.Unlock();
+  munmap(old_window, kDeltaWindowSize);
+  const bool ok = MapDeltaWindow(fd, length, &window, &window_start);
+  heap_lock.Lock();
+  if (ok && delta_fd != fd) {
+    // The stream was finished meanwhile.
+    munmap(window, kDeltaWindowSize);
+    return false;
+  }
+  if (ok) {
+    delta_window = window;
+    delta_window_start = window_start;
+  } else {
+    RAW_LOG(ERROR, "Failed extending the heap profile stream; "
+            "closing it at %"PRId64" bytes", length);
+    delta_window = NULL;
+    close(fd);
+    delta_fd = -1;
+  }
+  return ok;
+}
+
+// Room left in the window.
+static int DeltaWindowRoom() {
+  return static_cast<int>(delta_window_start + kDeltaWindowSize -
+                          delta_length);
+}
+
+static char* DeltaWindowEnd() {
+  return delta_window + (delta_length - delta_window_start);
+}
+
+// Append the changes since the last append to the stream.
+static void AppendDeltaLocked(const char* reason) {
+  if (delta_fd < 0) return;
+  dumping = true;
+  const HeapProfileTable::Stats& total = heap_profile->total();
+  char line[256];
+  const int n = snprintf(line, sizeof(line),
+                         "t %"PRId64" %d %"PRId64" %d %"PRId64" %s\n",
+                         NowUsec() - delta_start_usec,
+                         total.allocs, total.alloc_size,
+                         total.frees, total.free_size, reason);
+  if (n > 0 && n < static_cast<int>(sizeof(line)) &&
+      (DeltaWindowRoom() >= n || AdvanceDeltaWindowLocked())) {
+    memcpy(DeltaWindowEnd(), line, n);
+    delta_length += n;
+    bool complete = false;
+    while (!complete) {
+      delta_length += heap_profile->FillProfileDelta(
+                          DeltaWindowEnd(), DeltaWindowRoom(), &complete);
+      if (!complete && !AdvanceDeltaWindowLocked()) break;
+    }
+  }
+  dumping = false;
+}
+
+// Begin the stream at <prefix>.heapdelta.
+static void StartDeltaStream(const char* prefix) {
+  char file_name[1000];
+  snprintf(file_name, sizeof(file_name), "%s.heapdelta", prefix);
+  const int fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  char* window;
+  int64 window_start;
+  if (fd < 0 || !MapDeltaWindow(fd, 0, &window, &window_start)) {
+    RAW_LOG(ERROR, "Failed starting heap profile stream %s", file_name);
+    if (fd >= 0) close(fd);
+    return;
+  }
+  RAW_VLOG(0, "Streaming heap profile deltas to %s", file_name);
+  heap_lock.Lock();
+  delta_start_usec = NowUsec();
+  delta_length = snprintf(window, kDeltaWindowSize,
+                          "heap delta stream: 1 %"PRId64"\n",
+                          delta_start_usec);
+  delta_window = window;
+  delta_window_start = window_start;
+  delta_fd = fd;
+  heap_lock.Unlock();
+}
+
+// End the stream: cut the file to the stream and add the mapped
+// libraries, which pprof needs to symbolize the stacks.
+static void FinishDeltaStream() {
+  heap_lock.Lock();
+  const int fd = delta_fd;
+  char* window = delta_window;
+  const int64 length = delta_length;
+  delta_fd = -1;
+  delta_window = NULL;
+  heap_lock.Unlock();
+  if (fd < 0) return;
+  munmap(window, kDeltaWindowSize);
+  if (ftruncate(fd, length) == 0 && lseek(fd, length, SEEK_SET) == length) {
+    HeapProfileTable::DumpProcSelfMaps(fd);
+  }
+  close(fd);
+}
+
 //----------------------------------------------------------------------
 // Profile generation
 //----------------------------------------------------------------------
@@ -157,6 +324,11 @@ static void DumpProfileLocked(const char* reason) {
   
   if (filename_prefix == NULL) return;  // we do not yet need dumping
 
+  if (FLAGS_heap_profile_incremental) {
+    AppendDeltaLocked(reason);
+    return;
+  }
+
   dumping = true;
 
   // Make file name
@@ -200,8 +372,10 @@ static void RecordAlloc(void* ptr, size_t bytes, int skip_count) {
     if (!dumping) {
       bool need_to_dump = false;
       char buf[128];
-      if (total.alloc_size >=
-          last_dump + FLAGS_heap_profile_allocation_interval) {
+      const int64 interval = FLAGS_heap_profile_incremental
+                             ? FLAGS_heap_profile_delta_interval
+                             : FLAGS_heap_profile_allocation_interval;
+      if (total.alloc_size >= last_dump + interval) {
         snprintf(buf, sizeof(buf), "%"PRId64" MB allocated",
                  total.alloc_size >> 20);
         // Track that we made a "total allocation size" dump
@@ -320,12 +494,21 @@ void HeapProfilerStart(const char* prefix) {
 
   heap_lock.Unlock();
 
+  if (FLAGS_heap_profile_incremental) {
+    StartDeltaStream(prefix);
+  }
+
   // This should be done before the hooks are set up, since it should
   // call new, and we want that to be accounted for correctly.
   MallocExtension::Initialize();
 }
 
 void HeapProfilerStop() {
+  if (FLAGS_heap_profile_incremental) {
+    HeapProfilerDump("Stopping");
+    FinishDeltaStream();
+  }
+
   heap_lock.Lock();
 
   if (!is_on) return;
@@ -335,18 +518,12 @@ void HeapProfilerStop() {
   MallocHook::SetNewHook(NULL);
   MallocHook::SetDeleteHook(NULL);
 
-  // free profile
-  heap_profile->~HeapProfileTable();
-  ProfilerFree(heap_profile);
+  // free profile and prefix: everything the profiler allocated is in
+  // heap_profiler_memory, so we drop the whole arena at once rather
+  // than freeing each bucket and allocation record
   heap_profile = NULL;
-  
-  // free prefix
-  ProfilerFree(filename_prefix);
-  filename_prefix = NULL;
-
-  if (!LowLevelAlloc::DeleteArena(heap_profiler_memory)) {
-    RAW_LOG(FATAL, "Memory leak in HeapProfiler:");
-  }
+  LowLevelAlloc::DeleteArenaAndBlocks(heap_profiler_memory);
+  heap_profiler_memory = NULL;
 
   is_on = false;
 
@@ -416,7 +593,10 @@ static void HeapProfilerInit() {
 
 // class used for finalization -- dumps the heap-profile at program exit
 struct HeapProfileEndWriter {
-  ~HeapProfileEndWriter() { HeapProfilerDump("Exiting"); }
+  ~HeapProfileEndWriter() {
+    HeapProfilerDump("Exiting");
+    FinishDeltaStream();
+  }
 };
 
 REGISTER_MODULE_INITIALIZER(heapprofiler, HeapProfilerInit());
@@ -96,6 +96,10 @@ void MallocExtension::GetStats(char* buffer, int length) {
   buffer[0] = '\0';
 }
 
+void MallocExtension::GetFragmentationReport(string* result) {
+  // Not supported
+}
+
 bool MallocExtension::MallocMemoryStats(int* blocks, size_t* total,
                                        int histogram[kMallocHistogramSize]) {
   *blocks = 0;
@@ -120,6 +124,16 @@ void MallocExtension::ReleaseFreeMemory() {
   // Default implementation does nothing
 }
 
+bool MallocExtension::AddSystemAllocator(SysAllocator* allocator) {
+  return false;
+}
+
+bool MallocExtension::PublishTelemetry(const char* path) {
+  return false;
+}
+
+SysAllocator::~SysAllocator() { }
+
 // The current malloc extension object.  We also keep a pointer to
 // the default implementation so that the heap-leak checker does not
 // complain about a memory leak.
@@ -229,9 +243,11 @@ void PrintHeader(string* result, const char* label, void** entries) {
 
 void PrintStackEntry(string* result, void** entry) {
   char buf[100];
-  snprintf(buf, sizeof(buf), "%6d: %8d [%6d: %8d] @",
-           int(Count(entry)), int(Size(entry)),
-           int(Count(entry)), int(Size(entry)));
+  snprintf(buf, sizeof(buf), "%6lld: %8lld [%6lld: %8lld] @",
+           static_cast<long long>(Count(entry)),
+           static_cast<long long>(Size(entry)),
+           static_cast<long long>(Count(entry)),
+           static_cast<long long>(Size(entry)));
   *result += buf;
   for (int i = 0; i < Depth(entry); i++) {
     snprintf(buf, sizeof(buf), " %p", PC(entry, i));
@@ -251,6 +267,20 @@ void MallocExtension::GetHeapSample(string* result) {
     return;
   }
 
+  // Objects were sampled once every "period" allocated bytes on
+  // average (as a Poisson process); tell pprof, which undoes it.
+  char label[64];
+  size_t period = 0;
+  if (GetNumericProperty("tcmalloc.sampling_period_bytes", &period) &&
+      period > 0) {
+    snprintf(label, sizeof(label), "heap_v2/%llu",
+             static_cast<unsigned long long>(period));
+  } else {
+    snprintf(label, sizeof(label), "heap");
+  }
+  // (Print the header first: grouping adds counts into the entries)
+  PrintHeader(result, label, entries);
+
   // Group together all entries with same stack trace
   StackTraceTable table;
   for (void** entry = entries; Count(entry) != 0; entry += 3 + Depth(entry)) {
@@ -265,7 +295,6 @@ void MallocExtension::GetHeapSample(string* result) {
     }
   }
 
-  PrintHeader(result, "heap", entries);
   for (StackTraceTable::iterator iter = table.begin();
        iter != table.end();
        ++iter) {
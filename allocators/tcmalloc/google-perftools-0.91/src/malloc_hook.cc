@@ -42,6 +42,8 @@
 #include <google/malloc_hook.h>
 #include "base/basictypes.h"
 #include "base/logging.h"
+#include "base/atomicops.h"
+#include "base/spinlock.h"
 #include <google/stacktrace.h>
 
 // __THROW is defined in glibc systems.  It means, counter-intuitively,
@@ -87,6 +89,16 @@ MallocHook::MunmapHook MallocHook::munmap_hook_ = NULL;
 MallocHook::MremapHook MallocHook::mremap_hook_ = NULL;
 MallocHook::SbrkHook   MallocHook::sbrk_hook_ = InitialMallocHook_Sbrk;
 
+// Statically initialized to match the hooks above, so that it is right
+// even for allocations made before any constructor runs.
+MallocHook::HookFlags  MallocHook::active_
+#ifdef HAVE___ATTRIBUTE__
+    __attribute__((aligned(64)))
+#endif
+    = { MallocHook::kNewHookBit |
+        MallocHook::kMmapHookBit |
+        MallocHook::kSbrkHookBit };
+
 // The definitions of weak default malloc hooks (New, MMap, and Sbrk)
 // that self deinstall on their first call.  This is entirely for
 // efficiency: the default version of these functions will be called a
@@ -130,6 +142,163 @@ void InitialMallocHook_Sbrk(void* result, ptrdiff_t increment) {
     MallocHook::SetSbrkHook(NULL);
 }
 
+// The hooks added with Add*Hook, one list per kind.  Writers hold
+// hooklist_lock; Invoke*HookSlow reads a list without it, so a slot is
+// filled before the list grows to cover it, and a removed hook's slot
+// is cleared before the list shrinks.  A hook removed while a Invoke*
+// runs on another thread may be called once more.
+static SpinLock hooklist_lock(SpinLock::LINKER_INITIALIZED);
+
+template <typename T>
+struct HookList {
+  AtomicWord end;                               // one past the last slot used
+  AtomicWord slots[MallocHook::kMaxHooks];
+
+  bool Add(T hook) {
+    if (hook == NULL) return false;
+    for (int i = 0; i < MallocHook::kMaxHooks; i++) {
+      if (slots[i] == 0) {
+        Release_Store(&slots[i], reinterpret_cast<AtomicWord>(hook));
+        if (i >= end) Release_Store(&end, i + 1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool Remove(T hook) {
+    int i = 0;
+    while (i < end && slots[i] != reinterpret_cast<AtomicWord>(hook)) i++;
+    if (i == end) return false;
+    Release_Store(&slots[i], 0);
+    AtomicWord e = end;
+    while (e > 0 && slots[e - 1] == 0) e--;
+    Release_Store(&end, e);
+    return true;
+  }
+
+  bool empty() const { return end == 0; }
+
+  // Copies the hooks into out, returning how many there are.
+  int Get(T* out) const {
+    const int e = Acquire_Load(&end);
+    int n = 0;
+    for (int i = 0; i < e; i++) {
+      T hook = reinterpret_cast<T>(Acquire_Load(&slots[i]));
+      if (hook != NULL) out[n++] = hook;
+    }
+    return n;
+  }
+};
+
+static HookList<MallocHook::NewHook>    new_hooks;
+static HookList<MallocHook::DeleteHook> delete_hooks;
+static HookList<MallocHook::MmapHook>   mmap_hooks;
+static HookList<MallocHook::MunmapHook> munmap_hooks;
+static HookList<MallocHook::MremapHook> mremap_hooks;
+static HookList<MallocHook::SbrkHook>   sbrk_hooks;
+
+// Sets or clears a bit of active_.kinds; called with hooklist_lock held.
+#define UPDATE_HOOK_BIT(bit, hook, list)                        \
+  active_.kinds = ((hook) != NULL || !(list).empty())           \
+                  ? (active_.kinds | (bit))                     \
+                  : (active_.kinds & ~(bit))
+
+#define DEFINE_HOOK_SETTERS(Kind, hook, list, bit)              \
+  MallocHook::Kind##Hook MallocHook::Set##Kind##Hook(Kind##Hook h) { \
+    SpinLockHolder l(&hooklist_lock);                           \
+    Kind##Hook result = hook;                                   \
+    hook = h;                                                   \
+    UPDATE_HOOK_BIT(bit, hook, list);                           \
+    return result;                                              \
+  }                                                             \
+  bool MallocHook::Add##Kind##Hook(Kind##Hook h) {              \
+    SpinLockHolder l(&hooklist_lock);                           \
+    const bool added = list.Add(h);                             \
+    UPDATE_HOOK_BIT(bit, hook, list);                           \
+    return added;                                               \
+  }                                                             \
+  bool MallocHook::Remove##Kind##Hook(Kind##Hook h) {           \
+    SpinLockHolder l(&hooklist_lock);                           \
+    const bool removed = list.Remove(h);                        \
+    UPDATE_HOOK_BIT(bit, hook, list);                           \
+    return removed;                                             \
+  }
+
+DEFINE_HOOK_SETTERS(New, new_hook_, new_hooks, kNewHookBit)
+DEFINE_HOOK_SETTERS(Delete, delete_hook_, delete_hooks, kDeleteHookBit)
+DEFINE_HOOK_SETTERS(Mmap, mmap_hook_, mmap_hooks, kMmapHookBit)
+DEFINE_HOOK_SETTERS(Munmap, munmap_hook_, munmap_hooks, kMunmapHookBit)
+DEFINE_HOOK_SETTERS(Mremap, mremap_hook_, mremap_hooks, kMremapHookBit)
+DEFINE_HOOK_SETTERS(Sbrk, sbrk_hook_, sbrk_hooks, kSbrkHookBit)
+
+#undef DEFINE_HOOK_SETTERS
+#undef UPDATE_HOOK_BIT
+
+// The slow paths of Invoke*Hook: "the" hook, then the added ones.
+
+void MallocHook::InvokeNewHookSlow(void* p, size_t s) {
+  NewHook hooks[kMaxHooks];
+  const NewHook hook = new_hook_;
+  if (hook != NULL) (*hook)(p, s);
+  const int n = new_hooks.Get(hooks);
+  for (int i = 0; i < n; i++) (*hooks[i])(p, s);
+}
+
+void MallocHook::InvokeDeleteHookSlow(void* p) {
+  DeleteHook hooks[kMaxHooks];
+  const DeleteHook hook = delete_hook_;
+  if (hook != NULL) (*hook)(p);
+  const int n = delete_hooks.Get(hooks);
+  for (int i = 0; i < n; i++) (*hooks[i])(p);
+}
+
+void MallocHook::InvokeMmapHookSlow(void* result,
+                                    void* start,
+                                    size_t size,
+                                    int protection,
+                                    int flags,
+                                    int fd,
+                                    off_t offset) {
+  MmapHook hooks[kMaxHooks];
+  const MmapHook hook = mmap_hook_;
+  if (hook != NULL) (*hook)(result, start, size, protection, flags, fd, offset);
+  const int n = mmap_hooks.Get(hooks);
+  for (int i = 0; i < n; i++)
+    (*hooks[i])(result, start, size, protection, flags, fd, offset);
+}
+
+void MallocHook::InvokeMunmapHookSlow(void* p, size_t size) {
+  MunmapHook hooks[kMaxHooks];
+  const MunmapHook hook = munmap_hook_;
+  if (hook != NULL) (*hook)(p, size);
+  const int n = munmap_hooks.Get(hooks);
+  for (int i = 0; i < n; i++) (*hooks[i])(p, size);
+}
+
+void MallocHook::InvokeMremapHookSlow(void* result,
+                                      void* old_addr,
+                                      size_t old_size,
+                                      size_t new_size,
+                                      int flags,
+                                      void* new_addr) {
+  MremapHook hooks[kMaxHooks];
+  const MremapHook hook = mremap_hook_;
+  if (hook != NULL) (*hook)(result, old_addr, old_size, new_size, flags,
+                            new_addr);
+  const int n = mremap_hooks.Get(hooks);
+  for (int i = 0; i < n; i++)
+    (*hooks[i])(result, old_addr, old_size, new_size, flags, new_addr);
+}
+
+void MallocHook::InvokeSbrkHookSlow(void* result, ptrdiff_t increment) {
+  SbrkHook hooks[kMaxHooks];
+  const SbrkHook hook = sbrk_hook_;
+  if (hook != NULL) (*hook)(result, increment);
+  const int n = sbrk_hooks.Get(hooks);
+  for (int i = 0; i < n; i++) (*hooks[i])(result, increment);
+}
+
 DECLARE_ATTRIBUTE_SECTION(google_malloc_allocators);
   // actual functions are in debugallocation.cc or tcmalloc.cc
 DECLARE_ATTRIBUTE_SECTION(malloc_hook_callers);
@@ -181,7 +350,9 @@ int MallocHook::GetCallerStackTrace(void** result, int max_depth,
     // Note: this path is inaccurate when a hook is not called directly by an
     // allocation function but is daisy-chained through another hook,
     // search for MallocHook::(Get|Set|Invoke)* to find such cases.
-    return GetStackTrace(result, max_depth, skip_count + int(DEBUG_MODE));
+    // The 1 is for the Invoke*HookSlow frame.
+    return GetStackTrace(result, max_depth,
+                         skip_count + 1 + int(DEBUG_MODE));
              // due to -foptimize-sibling-calls in opt mode
              // there's no need for extra frame skip here then
   }
@@ -93,3 +93,14 @@ int perftools_pthread_once(pthread_once_t *ctl,
     return 0;
   }
 }
+
+// Without pthreads there are no other threads to keep out of the way
+// of fork(), so the handlers are not needed.
+int perftools_pthread_atfork(void (*prepare) (void), void (*parent) (void),
+                             void (*child) (void)) {
+  if (pthread_atfork) {
+    return pthread_atfork(prepare, parent, child);
+  } else {
+    return 0;
+  }
+}
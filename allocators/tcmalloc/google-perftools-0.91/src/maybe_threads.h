@@ -43,3 +43,5 @@ void *perftools_pthread_getspecific(pthread_key_t key);
 int perftools_pthread_setspecific(pthread_key_t key, void *val);
 int perftools_pthread_once(pthread_once_t *ctl,  
                            void  (*init_routine) (void));
+int perftools_pthread_atfork(void (*prepare) (void), void (*parent) (void),
+                             void (*child) (void));
@@ -34,8 +34,6 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
-#include <set>
-
 #include "memory_region_map.h"
 
 #include "base/linux_syscall_support.h"
@@ -48,7 +46,9 @@
 // ========================================================================= //
 
 bool MemoryRegionMap::have_initialized_ = false;
-MemoryRegionMap::RegionSet* MemoryRegionMap::regions_ = NULL;
+MemoryRegionMap::RegionNode* MemoryRegionMap::root_ = NULL;
+volatile AtomicWord MemoryRegionMap::readers_ = 0;
+MemoryRegionMap::RegionNode* MemoryRegionMap::retired_ = NULL;
 LowLevelAlloc::Arena* MemoryRegionMap::arena_ = NULL;
 SpinLock MemoryRegionMap::lock_(SpinLock::LINKER_INITIALIZED);
 int MemoryRegionMap::recursion_count_ = 0;
@@ -70,13 +70,34 @@ static inline pthread_t safe_pthread_self() {
 
 // ========================================================================= //
 
-union MemoryRegionMap::RegionSetRep {
-  char rep[sizeof(RegionSet)];
-  void* align_it;
+// A node of the tree of regions: a treap ordered by end_addr.
+// Once a node is in a published tree, only region.is_stack changes,
+// and only in place under Lock().
+struct MemoryRegionMap::RegionNode {
+  Region region;
+  uint32 priority;        // higher than that of the children
+  RegionNode* left;       // regions with lower end_addr
+  RegionNode* right;      // regions with higher end_addr
+  RegionNode* next_retired;
 };
 
-// The bytes where MemoryRegionMap::regions_ will point to
-static MemoryRegionMap::RegionSetRep regions_rep;
+// Number of regions in the tree (under Lock())
+static size_t region_count = 0;
+
+// Return the first node in "root" with an end_addr above "addr"
+static const MemoryRegionMap::RegionNode*
+FirstNodeAfter(const MemoryRegionMap::RegionNode* root, uintptr_t addr) {
+  const MemoryRegionMap::RegionNode* result = NULL;
+  while (root != NULL) {
+    if (root->region.end_addr > addr) {
+      result = root;
+      root = root->left;
+    } else {
+      root = root->right;
+    }
+  }
+  return result;
+}
 
 // ========================================================================= //
 
@@ -106,13 +127,17 @@ bool MemoryRegionMap::Shutdown() {
   MallocHook::SetMremapHook(NULL);
   MallocHook::SetSbrkHook(NULL);
   MallocHook::SetMunmapHook(NULL);
-  regions_->~RegionSet();
-  regions_ = NULL;
-  bool deleted_arena = LowLevelAlloc::DeleteArena(arena_);
+  bool deleted_arena = (Acquire_Load(&readers_) == 0);
   if (deleted_arena) {
+    // all nodes, in the tree or retired, are in arena_
+    root_ = NULL;
+    retired_ = NULL;
+    region_count = 0;
+    LowLevelAlloc::DeleteArenaAndBlocks(arena_);
     arena_ = 0;
   } else {
-    RAW_LOG(WARNING, "Can't delete LowLevelAlloc arena: it's being used");
+    RAW_LOG(WARNING, "Can't delete LowLevelAlloc arena: "
+                     "a snapshot of it is being used");
   }
   have_initialized_ = false;
   Unlock();
@@ -154,57 +179,205 @@ bool MemoryRegionMap::LockIsHeldByThisThread() {
 }
 
 bool MemoryRegionMap::FindStackRegion(uintptr_t stack_top, Region* result) {
-  bool found = false;
-  Lock();
-  if (regions_ != NULL) {
-    Region sample;
-    sample.end_addr = stack_top;
-    RegionSet::iterator region = regions_->lower_bound(sample);
-    if (region != regions_->end()) {
-      RAW_CHECK(stack_top <= region->end_addr, "");
-      if (region->start_addr <= stack_top  &&  stack_top < region->end_addr) {
-        RAW_VLOG(2, "Stack at %p is inside region %p..%p",
-                    reinterpret_cast<void*>(stack_top),
-                    reinterpret_cast<void*>(region->start_addr),
-                    reinterpret_cast<void*>(region->end_addr));
-        const_cast<Region*>(&*region)->is_stack = true;  // now we know
-        *result = *region;
-        found = true;
+  bool found;
+  {
+    Snapshot snapshot;
+    found = snapshot.FindRegion(stack_top, result);
+  }
+  if (found) {
+    RAW_VLOG(2, "Stack at %p is inside region %p..%p",
+                reinterpret_cast<void*>(stack_top),
+                reinterpret_cast<void*>(result->start_addr),
+                reinterpret_cast<void*>(result->end_addr));
+    if (!result->is_stack) {
+      Lock();
+      // the region may have been changed since our snapshot
+      RegionNode* node = const_cast<RegionNode*>(
+                             FirstNodeAfter(root_, stack_top));
+      if (node != NULL  &&  node->region.start_addr <= stack_top) {
+        node->region.is_stack = true;  // now we know
       }
+      Unlock();
+      result->is_stack = true;
     }
   }
-  Unlock();
   return found;
 }
 
-MemoryRegionMap::RegionIterator MemoryRegionMap::BeginRegionLocked() {
-  RAW_CHECK(LockIsHeldByThisThread(), "should be held (by this thread)");
-  RAW_CHECK(regions_ != NULL, "");
-  return regions_->begin();
+// ========================================================================= //
+
+MemoryRegionMap::Snapshot::Snapshot() {
+  AtomicIncrement(&readers_, 1);
+  // Order the increment before the load:
+  // see the comment in PublishLocked()
+  MemoryBarrier();
+  root_ = reinterpret_cast<const RegionNode*>(
+      Acquire_Load(reinterpret_cast<volatile const AtomicWord*>(
+                       &MemoryRegionMap::root_)));
+}
+
+MemoryRegionMap::Snapshot::~Snapshot() {
+  MemoryBarrier();  // finish our reads before the nodes can be freed
+  AtomicIncrement(&readers_, -1);
+}
+
+MemoryRegionMap::RegionIterator MemoryRegionMap::Snapshot::begin() const {
+  return RegionIterator(root_, FirstNodeAfter(root_, 0));
+}
+
+bool MemoryRegionMap::Snapshot::FindRegion(uintptr_t addr,
+                                           Region* result) const {
+  const RegionNode* node = FirstNodeAfter(root_, addr);
+  if (node != NULL  &&  node->region.start_addr <= addr) {
+    *result = node->region;
+    return true;
+  }
+  return false;
+}
+
+const MemoryRegionMap::Region&
+MemoryRegionMap::RegionIterator::operator*() const {
+  return node_->region;
+}
+
+MemoryRegionMap::RegionIterator&
+MemoryRegionMap::RegionIterator::operator++() {
+  node_ = FirstNodeAfter(root_, node_->region.end_addr);
+  return *this;
+}
+
+// ========================================================================= //
+
+MemoryRegionMap::RegionNode*
+MemoryRegionMap::NewNode(const Region& region) {
+  static uint32 random = 1;     // under Lock()
+  RegionNode* node = reinterpret_cast<RegionNode*>(
+                         LowLevelAlloc::Alloc(sizeof(RegionNode), arena_));
+  node->region = region;
+  random = random * 1103515245 + 12345;
+  node->priority = random;
+  node->left = NULL;
+  node->right = NULL;
+  node->next_retired = NULL;
+  return node;
+}
+
+MemoryRegionMap::RegionNode* MemoryRegionMap::CopyNode(RegionNode* node) {
+  RegionNode* copy = reinterpret_cast<RegionNode*>(
+                         LowLevelAlloc::Alloc(sizeof(RegionNode), arena_));
+  *copy = *node;
+  node->next_retired = retired_;
+  retired_ = node;
+  return copy;
+}
+
+MemoryRegionMap::RegionNode*
+MemoryRegionMap::InsertNode(RegionNode* root, RegionNode* node) {
+  if (root == NULL) return node;
+  if (node->priority > root->priority) {
+    SplitNodes(root, node->region.end_addr, &node->left, &node->right);
+    return node;
+  }
+  RegionNode* copy = CopyNode(root);
+  if (node->region.end_addr < root->region.end_addr) {
+    copy->left = InsertNode(root->left, node);
+  } else {
+    copy->right = InsertNode(root->right, node);
+  }
+  return copy;
 }
 
-MemoryRegionMap::RegionIterator MemoryRegionMap::EndRegionLocked() {
+// Set *less to the nodes of "root" with end_addr below "end_addr",
+// and *rest to the others.
+void MemoryRegionMap::SplitNodes(RegionNode* root, uintptr_t end_addr,
+                                 RegionNode** less, RegionNode** rest) {
+  if (root == NULL) {
+    *less = NULL;
+    *rest = NULL;
+    return;
+  }
+  RegionNode* copy = CopyNode(root);
+  if (root->region.end_addr < end_addr) {
+    *less = copy;
+    SplitNodes(root->right, end_addr, &copy->right, rest);
+  } else {
+    *rest = copy;
+    SplitNodes(root->left, end_addr, less, &copy->left);
+  }
+}
+
+// Join two trees, where all of "less" go before all of "rest"
+MemoryRegionMap::RegionNode*
+MemoryRegionMap::JoinNodes(RegionNode* less, RegionNode* rest) {
+  if (less == NULL) return rest;
+  if (rest == NULL) return less;
+  RegionNode* copy;
+  if (less->priority > rest->priority) {
+    copy = CopyNode(less);
+    copy->right = JoinNodes(less->right, rest);
+  } else {
+    copy = CopyNode(rest);
+    copy->left = JoinNodes(less, rest->left);
+  }
+  return copy;
+}
+
+// Remove the node with "end_addr", which must be in "root"
+MemoryRegionMap::RegionNode*
+MemoryRegionMap::EraseNode(RegionNode* root, uintptr_t end_addr) {
+  RAW_CHECK(root != NULL, "region not in the tree");
+  if (root->region.end_addr == end_addr) {
+    RegionNode* result = JoinNodes(root->left, root->right);
+    root->next_retired = retired_;
+    retired_ = root;
+    return result;
+  }
+  RegionNode* copy = CopyNode(root);
+  if (end_addr < root->region.end_addr) {
+    copy->left = EraseNode(root->left, end_addr);
+  } else {
+    copy->right = EraseNode(root->right, end_addr);
+  }
+  return copy;
+}
+
+void MemoryRegionMap::PublishLocked(RegionNode* root) {
   RAW_CHECK(LockIsHeldByThisThread(), "should be held (by this thread)");
-  RAW_CHECK(regions_ != NULL, "");
-  return regions_->end();
+  Release_Store(reinterpret_cast<volatile AtomicWord*>(&root_),
+                reinterpret_cast<AtomicWord>(root));
+  // A snapshot increments readers_ and then loads root_, while we store
+  // root_ and then load readers_: with the barriers on both sides,
+  // if we see no readers, any later snapshot sees the new root,
+  // which none of the retired nodes are in.
+  MemoryBarrier();
+  if (Acquire_Load(&readers_) == 0) {
+    while (retired_ != NULL) {
+      RegionNode* node = retired_;
+      retired_ = node->next_retired;
+      LowLevelAlloc::Free(node);
+    }
+  }
 }
 
+// ========================================================================= //
+
 inline void MemoryRegionMap::DoInsertRegionLocked(const Region region) {
   if (DEBUG_MODE) {
-    RegionSet::const_iterator i = regions_->lower_bound(region);
-    RAW_CHECK(i == regions_->end()  ||  !region.Overlaps(*i),
-              "Wow, overlapping memory regions");
-    Region sample;
-    sample.end_addr = region.start_addr;
-    i = regions_->lower_bound(sample);
-    RAW_CHECK(i == regions_->end()  ||  !region.Overlaps(*i),
+    // the only region that can overlap "region" without also overlapping
+    // its first byte is the first one to end after that byte
+    const RegionNode* i = FirstNodeAfter(root_, region.start_addr);
+    RAW_CHECK(i == NULL  ||  !region.Overlaps(i->region),
               "Wow, overlapping memory regions");
   }
   RAW_VLOG(4, "Inserting region %p..%p from %p",
               reinterpret_cast<void*>(region.start_addr),
               reinterpret_cast<void*>(region.end_addr),
               reinterpret_cast<void*>(region.caller));
-  regions_->insert(region);
+  // NewNode() can call the allocator, and with it our hooks:
+  // they save their regions, as recursive_insert is set
+  RegionNode* node = NewNode(region);
+  PublishLocked(InsertNode(root_, node));
+  region_count++;
   RAW_VLOG(4, "Inserted region %p..%p :",
               reinterpret_cast<void*>(region.start_addr),
               reinterpret_cast<void*>(region.end_addr));
@@ -224,22 +397,11 @@ static MemoryRegionMap::Region saved_regions[10];
 
 inline void MemoryRegionMap::InsertRegionLocked(const Region& region) {
   RAW_CHECK(LockIsHeldByThisThread(), "should be held (by this thread)");
-  // We can be called recursively, because RegionSet constructor
-  // and DoInsertRegionLocked() (called below) can call the allocator.
+  // We can be called recursively, because the tree updates
+  // in DoInsertRegionLocked() (called below) can call the allocator.
   // recursive_insert tells us if that's the case. When this happens,
   // region insertion information is recorded in saved_regions[],
   // and taken into account when the recursion unwinds.
-  if (regions_ == NULL) {  // init regions_
-    RAW_VLOG(4, "Initializing region set");
-    regions_ = reinterpret_cast<RegionSet*>(&regions_rep.rep);
-    recursive_insert = true;
-    new(regions_) RegionSet();
-    while (saved_regions_count > 0) {
-      DoInsertRegionLocked(saved_regions[--saved_regions_count]);
-    }
-    recursive_insert = false;
-  }
-  // Do the insert:
   if (recursive_insert) {  // recursion
     RAW_VLOG(4, "Saving recursive insert of region %p..%p from %p",
                 reinterpret_cast<void*>(region.start_addr),
@@ -290,73 +452,52 @@ void MemoryRegionMap::RecordRegionAddition(void* start, size_t size) {
 
 void MemoryRegionMap::RecordRegionRemoval(void* start, size_t size) {
   Lock();
+  recursive_insert = true;
   // first handle saved regions if any
   while (saved_regions_count > 0) {
     DoInsertRegionLocked(saved_regions[--saved_regions_count]);
   }
   uintptr_t start_addr = reinterpret_cast<uintptr_t>(start);
   uintptr_t end_addr = start_addr + size;
-  // subtract start_addr, end_addr from all the regions
+  // subtract start_addr, end_addr from the regions overlapping it
   RAW_VLOG(2, "Removing global region %p..%p; have %"PRIuS" regions",
               reinterpret_cast<void*>(start_addr),
               reinterpret_cast<void*>(end_addr),
-              regions_->size());
-  for (RegionSet::iterator region = regions_->begin();
-       region != regions_->end(); /*noop*/) {
-    RAW_VLOG(5, "Looking at region %p..%p",
-                reinterpret_cast<void*>(region->start_addr),
-                reinterpret_cast<void*>(region->end_addr));
-    if (start_addr <= region->start_addr  &&
-        region->end_addr <= end_addr) {  // full deletion
-      RAW_VLOG(4, "Deleting region %p..%p",
-                  reinterpret_cast<void*>(region->start_addr),
-                  reinterpret_cast<void*>(region->end_addr));
-      RegionSet::iterator d = region;
-      ++region;
-      regions_->erase(d);
-      continue;
-    } else if (region->start_addr < start_addr  &&
-               end_addr < region->end_addr) {  // cutting-out split
-      RAW_VLOG(4, "Splitting region %p..%p in two",
-                  reinterpret_cast<void*>(region->start_addr),
-                  reinterpret_cast<void*>(region->end_addr));
-      // Make another region for the start portion:
-      // The new region has to be the start portion because we can't
-      // just modify region->end_addr as it's the sorting key.
-      Region r;
-      r.start_addr = region->start_addr;
-      r.end_addr = start_addr;
-      r.caller = region->caller;
-      r.is_stack = region->is_stack;
-      InsertRegionLocked(r);
-      // cut region from start
-      const_cast<Region*>(&*region)->start_addr = end_addr;
-    } else if (end_addr > region->start_addr  &&
-               start_addr <= region->start_addr) {  // cut from start
-      RAW_VLOG(4, "Start-chopping region %p..%p",
-                  reinterpret_cast<void*>(region->start_addr),
-                  reinterpret_cast<void*>(region->end_addr));
-      const_cast<Region*>(&*region)->start_addr = end_addr;
-    } else if (start_addr > region->start_addr  &&
-               start_addr < region->end_addr) {  // cut from end
-      RAW_VLOG(4, "End-chopping region %p..%p",
-                  reinterpret_cast<void*>(region->start_addr),
-                  reinterpret_cast<void*>(region->end_addr));
-      // Can't just modify region->end_addr (it's the sorting key):
-      Region r = *region;
+              region_count);
+  RegionNode* root = root_;  // published when we are done
+  for (;;) {
+    const RegionNode* node = FirstNodeAfter(root, start_addr);
+    if (node == NULL  ||  node->region.start_addr >= end_addr) break;
+    const Region region = node->region;
+    RAW_VLOG(4, "Cutting %p..%p out of region %p..%p",
+                reinterpret_cast<void*>(start_addr),
+                reinterpret_cast<void*>(end_addr),
+                reinterpret_cast<void*>(region.start_addr),
+                reinterpret_cast<void*>(region.end_addr));
+    root = EraseNode(root, region.end_addr);
+    region_count--;
+    if (region.start_addr < start_addr) {  // keep the start portion
+      Region r = region;
       r.end_addr = start_addr;
-      RegionSet::iterator d = region;
-      ++region;
-      regions_->erase(d);
-      InsertRegionLocked(r);
-      continue;
+      root = InsertNode(root, NewNode(r));
+      region_count++;
     }
-    ++region;
+    if (end_addr < region.end_addr) {  // keep the end portion
+      Region r = region;
+      r.start_addr = end_addr;
+      root = InsertNode(root, NewNode(r));
+      region_count++;
+    }
+  }
+  PublishLocked(root);
+  while (saved_regions_count > 0) {
+    DoInsertRegionLocked(saved_regions[--saved_regions_count]);
   }
+  recursive_insert = false;
   RAW_VLOG(4, "Removed region %p..%p; have %"PRIuS" regions",
               reinterpret_cast<void*>(start_addr),
               reinterpret_cast<void*>(end_addr),
-              regions_->size());
+              region_count);
   if (VLOG_IS_ON(4))  LogAllLocked();
   Unlock();
 }
@@ -419,13 +560,13 @@ void MemoryRegionMap::LogAllLocked() {
   RAW_CHECK(LockIsHeldByThisThread(), "should be held (by this thread)");
   RAW_LOG(INFO, "List of regions:");
   uintptr_t previous = 0;
-  for (RegionSet::const_iterator r = regions_->begin();
-       r != regions_->end(); ++r) {
+  Snapshot snapshot;
+  for (RegionIterator r = snapshot.begin(); r != snapshot.end(); ++r) {
     RAW_LOG(INFO, "Memory region 0x%"PRIxS"..0x%"PRIxS" "
                   "from 0x%"PRIxS" stack=%d",
                   r->start_addr, r->end_addr, r->caller, r->is_stack);
     RAW_CHECK(previous < r->end_addr, "wow, we messed up the set order");
-      // this must be caused by uncontrolled recursive operations on regions_
+      // this must be caused by uncontrolled recursive tree updates
     previous = r->end_addr;
   }
   RAW_LOG(INFO, "End of regions list");
@@ -35,8 +35,7 @@
 #define BASE_MEMORY_REGION_MAP_H__
 
 #include <pthread.h>
-#include <set>
-#include "base/stl_allocator.h"
+#include "base/atomicops.h"
 #include "base/spinlock.h"
 #include "base/low_level_alloc.h"
 
@@ -49,6 +48,10 @@
 // we collect the map by installing and monitoring MallocHook-s
 // to mmap, munmap, mremap, sbrk.
 // At any time one can query this map via provided interface.
+//
+// The regions are kept in a persistent tree: writers (the hooks) copy
+// the nodes on the path to a change under Lock() and then publish the
+// new root, so readers can take a Snapshot of the map without locking.
 class MemoryRegionMap {
  public:  // interface
 
@@ -92,67 +95,87 @@ class MemoryRegionMap {
 
   // Find the region that contains stack_top, mark that region as
   // a stack region, and write its data into *result.
-  // Returns success. Uses Lock/Unlock inside.
+  // Returns success. Uses Lock/Unlock inside
+  // if the region is not marked yet.
   static bool FindStackRegion(uintptr_t stack_top, Region* result);
 
- private:  // our internal types
+ public:  // effectively private type
 
-  // Region comparator for sorting with STL
-  struct RegionCmp {
-    bool operator()(const Region& x, const Region& y) const {
-      return x.end_addr < y.end_addr;
-    }
-  };
+  struct RegionNode;  // in .cc
 
-  // We allocate STL objects in our own arena.
-  struct MyAllocator {
-    static void *Allocate(size_t n) {
-      return LowLevelAlloc::Alloc(n, arena_);
-    }
-    static void Free(void *p) { LowLevelAlloc::Free(p); }
-  };
+ public:  // more in-depth interface
 
-  // Set of the memory regions
-  typedef std::set<Region, RegionCmp,
-              STL_Allocator<Region, MyAllocator> > RegionSet;
+  class Snapshot;
 
- public:  // more in-depth interface
+  // Iterator over the regions of a Snapshot in address order
+  class RegionIterator {
+   public:
+    const Region& operator*() const;
+    const Region* operator->() const { return &**this; }
+    RegionIterator& operator++();
+    bool operator==(const RegionIterator& x) const { return node_ == x.node_; }
+    bool operator!=(const RegionIterator& x) const { return node_ != x.node_; }
+
+   private:
+    friend class Snapshot;
+    RegionIterator(const RegionNode* root, const RegionNode* node)
+      : root_(root), node_(node) { }
 
-  // STL iterator with values of Region
-  typedef RegionSet::const_iterator RegionIterator;
+    const RegionNode* root_;  // of the snapshot
+    const RegionNode* node_;  // current node; NULL at the end
+  };
 
-  // Return the begin/end iterators to all the regions.
-  // Ideally these need Lock/Unlock protection around their whole usage (loop),
-  // but LockOther/UnlockOther is usually sufficient:
-  // in this case of single-threaded mutability (achieved by (Un)lockOther)
-  // via region additions/modifications
-  // the loop iterator will still be valid as log as its region
-  // has not been deleted and EndRegionLocked should be
-  // re-evaluated whenever the set of regions has changed.
-  static RegionIterator BeginRegionLocked();
-  static RegionIterator EndRegionLocked();
+  // The set of regions as it was when the snapshot was taken.
+  // Neither taking a snapshot nor reading it needs Lock(),
+  // and it does not change while it lives, so one can e.g. allocate
+  // memory while iterating over it.  Memory of regions changed since
+  // the oldest live snapshot was taken is only reclaimed when no
+  // snapshots are left, so snapshots should not be kept for long.
+  class Snapshot {
+   public:
+    Snapshot();
+    ~Snapshot();
 
- public:  // effectively private type
+    RegionIterator begin() const;
+    RegionIterator end() const { return RegionIterator(root_, NULL); }
+
+    // Find the region that contains addr
+    // and write its data into *result. Returns success.
+    bool FindRegion(uintptr_t addr, Region* result) const;
+
+   private:
+    const RegionNode* root_;
 
-  union RegionSetRep;  // in .cc
+    DISALLOW_EVIL_CONSTRUCTORS(Snapshot);
+  };
 
  private:  // representation
 
+  friend class Snapshot;
+
   // If have initialized this module
   static bool have_initialized_;
 
-  // Arena used for our allocations in regions_.
+  // Arena used for the nodes of our tree of regions.
   static LowLevelAlloc::Arena* arena_;
 
-  // Set of the mmap/sbrk/mremap-ed memory regions
-  // To be accessed *only* when Lock() is held.
+  // Root of the tree of the mmap/sbrk/mremap-ed memory regions
+  // last published to readers.  It is changed, and the nodes of the
+  // tree are allocated, *only* when Lock() is held.
   // Hence we protect the non-recursive lock used inside of arena_
   // with our recursive Lock(). This lets a user prevent deadlocks
   // when threads are stopped by ListAllProcessThreads at random spots
   // simply by acquiring our recursive Lock() before that.
-  static RegionSet* regions_;
+  static RegionNode* root_;
+
+  // Number of live Snapshot-s.
+  static volatile AtomicWord readers_;
+
+  // Nodes that are no longer in the tree, but may still be seen by
+  // snapshots: freed once there are no snapshots.  Under Lock().
+  static RegionNode* retired_;
 
-  // Lock to protect regions_ variable and the data behind.
+  // Lock to protect root_ variable and the data behind.
   static SpinLock lock_;
 
   // Recursion count for the recursive lock.
@@ -162,7 +185,21 @@ class MemoryRegionMap {
 
  private:  // helpers
 
-  // Verifying wrapper around regions_->insert(region)
+  // Tree updates, which copy rather than change the nodes they are
+  // given.  They need Lock(), and recursive_insert set (in .cc) so
+  // that regions added by our own allocations wait till they are done.
+  static RegionNode* NewNode(const Region& region);
+  static RegionNode* CopyNode(RegionNode* node);  // retires "node"
+  static RegionNode* InsertNode(RegionNode* root, RegionNode* node);
+  static void SplitNodes(RegionNode* root, uintptr_t end_addr,
+                         RegionNode** less, RegionNode** rest);
+  static RegionNode* JoinNodes(RegionNode* less, RegionNode* rest);
+  static RegionNode* EraseNode(RegionNode* root, uintptr_t end_addr);
+  // Make "root" the tree that new snapshots see,
+  // and free the retired nodes if possible.
+  static void PublishLocked(RegionNode* root);
+
+  // Verifying wrapper around inserting "region" into the tree
   // To be called by InsertRegionLocked only!
   // Passing "region" by value is important:
   // for many calls the memory the argument is located-in in the caller
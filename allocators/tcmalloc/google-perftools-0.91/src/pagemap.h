@@ -41,6 +41,18 @@
 // The BITS parameter should be the number of bits required to hold
 // a page number.  E.g., with 32 bit pointers and 4K pages (i.e.,
 // page offset fits in lower 12 bits), BITS == 20.
+//
+// get() may be called without the lock that serializes set() and
+// Ensure(), for a key whose value was set before the caller could
+// have come by it (e.g. the page of an object it was handed).
+// Ensure() publishes new nodes with release stores so that such a
+// reader never sees a node before its memset().  Nodes are never
+// freed.
+//
+// If the allocator is known to return zeroed memory ("zeroed"), nodes
+// are not memset(): a 64-bit map's root alone is 2MB, and leaving its
+// pages untouched until they are used saves a new process from
+// faulting them all in on its first malloc.
 
 #ifndef TCMALLOC_PAGEMAP_H__
 #define TCMALLOC_PAGEMAP_H__
@@ -54,6 +66,7 @@
 #include <sys/types.h>
 #endif
 #include "internal_logging.h"
+#include "base/atomicops.h"
 
 // Single-level array
 template <int BITS>
@@ -64,9 +77,10 @@ class TCMalloc_PageMap1 {
  public:
   typedef uintptr_t Number;
 
-  explicit TCMalloc_PageMap1(void* (*allocator)(size_t)) {
+  explicit TCMalloc_PageMap1(void* (*allocator)(size_t),
+                             bool zeroed = false) {
     array_ = reinterpret_cast<void**>((*allocator)(sizeof(void*) << BITS));
-    memset(array_, 0, sizeof(void*) << BITS);
+    if (!zeroed) memset(array_, 0, sizeof(void*) << BITS);
   }
 
   // Ensure that the map contains initialized entries "x .. x+n-1".
@@ -114,12 +128,15 @@ class TCMalloc_PageMap2 {
 
   Leaf* root_[ROOT_LENGTH];             // Pointers to 32 child nodes
   void* (*allocator_)(size_t);          // Memory allocator
+  bool zeroed_;                         // It returns zeroed memory
 
  public:
   typedef uintptr_t Number;
 
-  explicit TCMalloc_PageMap2(void* (*allocator)(size_t)) {
+  explicit TCMalloc_PageMap2(void* (*allocator)(size_t),
+                             bool zeroed = false) {
     allocator_ = allocator;
+    zeroed_ = zeroed;
     memset(root_, 0, sizeof(root_));
   }
 
@@ -145,8 +162,9 @@ class TCMalloc_PageMap2 {
       if (root_[i1] == NULL) {
         Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
         if (leaf == NULL) return false;
-        memset(leaf, 0, sizeof(*leaf));
-        root_[i1] = leaf;
+        if (!zeroed_) memset(leaf, 0, sizeof(*leaf));
+        Release_Store(reinterpret_cast<volatile AtomicWord*>(&root_[i1]),
+                      reinterpret_cast<AtomicWord>(leaf));
       }
 
       // Advance key past whatever is covered by this leaf node
@@ -185,10 +203,11 @@ class TCMalloc_PageMap3 {
 
   Node* root_;                          // Root of radix tree
   void* (*allocator_)(size_t);          // Memory allocator
+  bool zeroed_;                         // It returns zeroed memory
 
   Node* NewNode() {
     Node* result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
-    if (result != NULL) {
+    if (result != NULL && !zeroed_) {
       memset(result, 0, sizeof(*result));
     }
     return result;
@@ -197,8 +216,10 @@ class TCMalloc_PageMap3 {
  public:
   typedef uintptr_t Number;
 
-  explicit TCMalloc_PageMap3(void* (*allocator)(size_t)) {
+  explicit TCMalloc_PageMap3(void* (*allocator)(size_t),
+                             bool zeroed = false) {
     allocator_ = allocator;
+    zeroed_ = zeroed;
     root_ = NewNode();
   }
 
@@ -227,15 +248,18 @@ class TCMalloc_PageMap3 {
       if (root_->ptrs[i1] == NULL) {
         Node* n = NewNode();
         if (n == NULL) return false;
-        root_->ptrs[i1] = n;
+        Release_Store(reinterpret_cast<volatile AtomicWord*>(&root_->ptrs[i1]),
+                      reinterpret_cast<AtomicWord>(n));
       }
 
       // Make leaf node if necessary
       if (root_->ptrs[i1]->ptrs[i2] == NULL) {
         Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
         if (leaf == NULL) return false;
-        memset(leaf, 0, sizeof(*leaf));
-        root_->ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
+        if (!zeroed_) memset(leaf, 0, sizeof(*leaf));
+        Release_Store(
+            reinterpret_cast<volatile AtomicWord*>(&root_->ptrs[i1]->ptrs[i2]),
+            reinterpret_cast<AtomicWord>(leaf));
       }
 
       // Advance key past whatever is covered by this leaf node
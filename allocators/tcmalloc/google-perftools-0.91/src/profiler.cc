@@ -74,6 +74,21 @@
 #endif
 #include "base/logging.h"
 
+// With CPUPROFILE_PERF_EVENTS set, each registered thread is sampled by
+// a perf_event counter of its own cpu time instead of the interval
+// timer.  That needs a kernel (and headers) with perf_event_open and
+// thread-directed SIGIO (F_SETOWN_EX), and a GetPC we can feed from an
+// SA_SIGINFO handler's ucontext.
+#include <sys/syscall.h>
+#if defined(__linux) && defined(__NR_perf_event_open) && \
+    defined(F_SETOWN_EX) && (defined(__i386) || defined(__x86_64__))
+#define CPU_PROFILER_PERF_EVENTS 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <ucontext.h>
+#include "base/atomicops.h"
+#endif
+
 using std::string;
 
 DEFINE_string(cpu_profile, "",
@@ -215,6 +230,19 @@ inline void* GetPC(const SigStructure& sig_structure ) {
 
 #endif
 
+#ifdef CPU_PROFILER_PERF_EVENTS
+// The PC from the ucontext_t that an SA_SIGINFO handler gets.
+inline void* GetPCFromUContext(void* uc) {
+#if defined HAVE_STRUCT_UCONTEXT_UC_MCONTEXT
+  return GetPC(*reinterpret_cast<const SigStructure*>(uc));
+#else
+  // On i386 linux, uc_mcontext is laid out as a struct sigcontext
+  return GetPC(*reinterpret_cast<const SigStructure*>(
+                   &reinterpret_cast<ucontext_t*>(uc)->uc_mcontext));
+#endif
+}
+#endif
+
 // This takes as an argument an environment-variable name (like
 // CPUPROFILE) whose value is supposed to be a file-path, and sets
 // path to that path, and returns true.  If the env var doesn't exist,
@@ -279,7 +307,10 @@ class ProfileData {
   void Stop();
 
   void GetCurrentState(ProfilerState* state);
-  
+
+  // Start sampling the calling thread
+  void RegisterThread();
+
  private:
   static const int kMaxStackDepth = 64;         // Max stack depth profiled
   static const int kMaxFrequency = 4000;        // Largest allowed frequency
@@ -287,6 +318,9 @@ class ProfileData {
   static const int kAssociativity = 4;          // For hashtable
   static const int kBuckets = 1 << 10;          // For hashtable
   static const int kBufferLength = 1 << 18;     // For eviction buffer
+  static const int kMaxThreads = 1024;          // Threads with perf counters
+  static const int kThreadTableSize = 2 * kMaxThreads;
+  static const int kThreadBufferLength = 1 << 12; // Slots per thread buffer
 
   // Type of slots: each slot can be either a count, or a PC value
   typedef uintptr_t Slot;
@@ -303,6 +337,21 @@ class ProfileData {
     Entry entry[kAssociativity];
   };
 
+#ifdef CPU_PROFILER_PERF_EVENTS
+  // The samples of one thread on the perf_event backend: a ring of
+  // (depth, stack[depth]) records written only by the signal handler
+  // running on that thread, and read only under table_lock_, so
+  // recording a sample takes no lock.
+  struct ThreadBuffer {
+    int                 fd;             // the perf event sampling it
+    pid_t               tid;            // the thread
+    volatile AtomicWord head;           // slots written
+    volatile AtomicWord tail;           // slots merged into hash_
+    volatile AtomicWord dropped;        // samples lost to a full ring
+    Slot                ring[kThreadBufferLength];
+  };
+#endif
+
   // Invariant: table_lock_ is only grabbed by handler, or by other code
   // when the signal is being ignored (via SIG_IGN).
   //
@@ -320,6 +369,40 @@ class ProfileData {
   char*         fname_;         // Profile file name
   int           frequency_;     // Interrupts per second
   time_t        start_time_;    // Start time, or 0
+  bool          use_perf_events_;     // Sampling with perf_event counters?
+
+#ifdef CPU_PROFILER_PERF_EVENTS
+  // Buffers of the threads with counters, hashed by their fd (which
+  // is what the handler learns from siginfo).  Entries are never
+  // removed: a thread that exits leaves its buffer to the next thread
+  // that registers.
+  SpinLock      threads_lock_;  // Serializes RegisterThread
+  volatile AtomicWord thread_table_[kThreadTableSize];
+  int           num_threads_;   // Entries in thread_table_
+
+  // Open a counter that raises SIGPROF on thread "tid" (the caller)
+  // every 1/frequency_ seconds of its cpu time, under fd "reuse_fd"
+  // if that is not -1.  Returns the fd, or -1.
+  int OpenThreadCounter(pid_t tid, int reuse_fd);
+
+  // The buffer of the counter on "fd", or NULL
+  ThreadBuffer* FindThreadBuffer(int fd);
+
+  // Record an interrupt at "pc" in the buffer of the current thread
+  void RecordThreadSample(ThreadBuffer* b, unsigned long pc);
+
+  // Move all buffered samples into the hash table
+  void MergeThreadBuffersLocked();
+
+  // Samples lost to full thread buffers
+  int DroppedSamples();
+
+  // Handler for the perf_event backend
+  static void perf_handler(int sig, siginfo_t* info, void* ucontext);
+#endif
+
+  // Add the trace "stack[0..depth-1]" to the hash table
+  void AddTraceLocked(const Slot* stack, int depth);
 
   // Add "pc -> count" to eviction buffer
   void Evict(const Entry& entry);
@@ -332,6 +415,9 @@ class ProfileData {
 
   // Sets the timer interrupt signal handler to the specified routine
   static void SetHandler(void (*handler)(int));
+
+  // Sets the handler that records samples, for whichever backend is used
+  void EnableHandler();
 };
 
 // Evict the specified entry to the evicted-entry buffer
@@ -360,7 +446,8 @@ ProfileData::ProfileData() :
   total_bytes_(0),
   fname_(0),
   frequency_(0),
-  start_time_(0) {
+  start_time_(0),
+  use_perf_events_(false) {
 
   // Get frequency of interrupts (if specified)
   char junk;
@@ -376,7 +463,28 @@ ProfileData::ProfileData() :
   // Ignore signals until we decide to turn profiling on
   SetHandler(SIG_IGN);
 
-  ProfilerRegisterThread();
+  // Sample with per-thread perf_event counters, if asked to
+  const char* pe = getenv("CPUPROFILE_PERF_EVENTS");
+  if (pe != NULL && *pe != '\0' && strcmp(pe, "0") != 0) {
+#ifdef CPU_PROFILER_PERF_EVENTS
+    memset(const_cast<AtomicWord*>(thread_table_), 0, sizeof(thread_table_));
+    num_threads_ = 0;
+    use_perf_events_ = true;
+    RegisterThread();
+    if (num_threads_ == 0) {
+      fprintf(stderr, "PROFILE: no perf_event counters (%s), "
+              "using the interval timer\n", strerror(errno));
+      use_perf_events_ = false;
+    }
+#else
+    fprintf(stderr, "PROFILE: perf_event counters are not supported here, "
+            "using the interval timer\n");
+#endif
+  }
+
+  if (!use_perf_events_) {
+    RegisterThread();
+  }
 
   // Should profiling be enabled automatically at start?
   string fname;
@@ -435,12 +543,24 @@ bool ProfileData::Start(const char* fname) {
     evict_[num_evicted_++] = 1000000 / frequency_;  // Period (microseconds)
     evict_[num_evicted_++] = 0;                     // Padding
 
+#ifdef CPU_PROFILER_PERF_EVENTS
+    // Forget what a handler still running at the last Stop() recorded
+    for (int i = 0; i < kThreadTableSize; i++) {
+      ThreadBuffer* b =
+          reinterpret_cast<ThreadBuffer*>(Acquire_Load(&thread_table_[i]));
+      if (b != NULL) {
+        Release_Store(&b->tail, Acquire_Load(&b->head));
+        b->dropped = 0;
+      }
+    }
+#endif
+
     // Must unlock before setting prof_handler to avoid deadlock
     // with signal delivered to this thread.
   }
 
   // Setup handler for SIGPROF interrupts
-  SetHandler((void (*)(int)) prof_handler);
+  EnableHandler();
 
   return true;
 }
@@ -465,6 +585,12 @@ void ProfileData::Stop() {
     return;
   }
 
+#ifdef CPU_PROFILER_PERF_EVENTS
+  if (use_perf_events_) {
+    MergeThreadBuffersLocked();
+  }
+#endif
+
   // Move data from hash table to eviction buffer
   for (int b = 0; b < kBuckets; b++) {
     Bucket* bucket = &hash_[b];
@@ -500,6 +626,12 @@ void ProfileData::Stop() {
   close(out_);
   fprintf(stderr, "PROFILE: interrupts/evictions/bytes = %d/%d/%" PRIuS "\n",
           count_, evictions_, total_bytes_);
+#ifdef CPU_PROFILER_PERF_EVENTS
+  if (use_perf_events_ && DroppedSamples() > 0) {
+    fprintf(stderr, "PROFILE: %d samples dropped by full thread buffers\n",
+            DroppedSamples());
+  }
+#endif
   delete[] hash_;
   hash_ = 0;
   delete[] evict_;
@@ -539,6 +671,23 @@ void ProfileData::SetHandler(void (*handler)(int)) {
   }
 }
 
+void ProfileData::EnableHandler() {
+#ifdef CPU_PROFILER_PERF_EVENTS
+  if (use_perf_events_) {
+    struct sigaction sa;
+    sa.sa_sigaction = perf_handler;
+    sa.sa_flags     = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) {
+      perror("sigaction(SIGPROF)");
+      exit(1);
+    }
+    return;
+  }
+#endif
+  SetHandler((void (*)(int)) prof_handler);
+}
+
 void ProfileData::FlushTable() {
   MutexLock l(&state_lock_);
   if (out_ < 0) {
@@ -549,6 +698,11 @@ void ProfileData::FlushTable() {
   {
     // Move data from hash table to eviction buffer
     SpinLockHolder l(&table_lock_);
+#ifdef CPU_PROFILER_PERF_EVENTS
+    if (use_perf_events_) {
+      MergeThreadBuffersLocked();
+    }
+#endif
     for (int b = 0; b < kBuckets; b++) {
       Bucket* bucket = &hash_[b];
       for (int a = 0; a < kAssociativity; a++) {
@@ -563,7 +717,7 @@ void ProfileData::FlushTable() {
     // Write out all pending data
     FlushEvicted();
   }
-  SetHandler((void (*)(int)) prof_handler);
+  EnableHandler();
 }
 
 // Record the specified "pc" in the profile data
@@ -583,15 +737,19 @@ void ProfileData::Add(unsigned long pc) {
   int depth = GetStackTrace(stack+1, kMaxStackDepth-1, 3);
   depth++;              // To account for pc value
 
+  SpinLockHolder l(&table_lock_);
+  AddTraceLocked(reinterpret_cast<const Slot*>(stack), depth);
+}
+
+void ProfileData::AddTraceLocked(const Slot* stack, int depth) {
   // Make hash-value
   Slot h = 0;
   for (int i = 0; i < depth; i++) {
-    Slot slot = reinterpret_cast<Slot>(stack[i]);
+    Slot slot = stack[i];
     h = (h << 8) | (h >> (8*(sizeof(h)-1)));
     h += (slot * 31) + (slot * 7) + (slot * 3);
   }
 
-  SpinLockHolder l(&table_lock_);
   count_++;
 
   // See if table already has an entry for this stack trace
@@ -602,7 +760,7 @@ void ProfileData::Add(unsigned long pc) {
     if (e->depth == depth) {
       bool match = true;
       for (int i = 0; i < depth; i++) {
-        if (e->stack[i] != reinterpret_cast<Slot>(stack[i])) {
+        if (e->stack[i] != stack[i]) {
           match = false;
           break;
         }
@@ -632,7 +790,7 @@ void ProfileData::Add(unsigned long pc) {
     e->depth = depth;
     e->count = 1;
     for (int i = 0; i < depth; i++) {
-      e->stack[i] = reinterpret_cast<Slot>(stack[i]);
+      e->stack[i] = stack[i];
     }
   }
 }
@@ -667,19 +825,216 @@ void ProfileData::prof_handler(int sig, SigStructure sig_structure) {
   errno = saved_errno;
 }
 
-// Start interval timer for the current thread.  We do this for
-// every known thread.  If profiling is off, the generated signals
-// are ignored, otherwise they are captured by prof_handler().
-void ProfilerRegisterThread() {
+#ifdef CPU_PROFILER_PERF_EVENTS
+// Signal handler of the perf_event backend: the counter that overflowed
+// tells us which thread buffer to record in.
+void ProfileData::perf_handler(int sig, siginfo_t* info, void* ucontext) {
+  int saved_errno = errno;
+  if (info->si_code == POLL_IN) {        // and not some other SIGPROF
+    ThreadBuffer* b = pdata.FindThreadBuffer(info->si_fd);
+    if (b != NULL) {
+      pdata.RecordThreadSample(
+          b, (unsigned long int)GetPCFromUContext(ucontext));
+    }
+  }
+  errno = saved_errno;
+}
+
+int ProfileData::OpenThreadCounter(pid_t tid, int reuse_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_SW_TASK_CLOCK;       // cpu time, in ns
+  attr.sample_period = 1000000000 / frequency_;
+  attr.disabled = 1;
+  // Kernels that only let us watch user mode still give a profile
+  int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+    attr.exclude_kernel = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  if (reuse_fd >= 0) {
+    // This closes the counter that was there.  It has to come before
+    // O_ASYNC, as the fd the signal reports is the one that set it.
+    if (dup3(fd, reuse_fd, O_CLOEXEC) < 0) {
+      const int saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return -1;
+    }
+    close(fd);
+    fd = reuse_fd;
+  }
+  // Deliver the overflow signal to this thread only
+  struct f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = tid;
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+      fcntl(fd, F_SETOWN_EX, &owner) != 0 ||
+      fcntl(fd, F_SETSIG, SIGPROF) != 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) != 0 ||
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) != 0) {
+    const int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+ProfileData::ThreadBuffer* ProfileData::FindThreadBuffer(int fd) {
+  for (int i = fd % kThreadTableSize; ; i = (i + 1) % kThreadTableSize) {
+    ThreadBuffer* b =
+        reinterpret_cast<ThreadBuffer*>(Acquire_Load(&thread_table_[i]));
+    if (b == NULL || b->fd == fd) {
+      return b;
+    }
+  }
+}
+
+void ProfileData::RecordThreadSample(ThreadBuffer* b, unsigned long pc) {
+  void* stack[kMaxStackDepth];
+
+  // As in Add(): the pc, then the stack above the signal frames
+  stack[0] = (void*)pc;
+  int depth = GetStackTrace(stack+1, kMaxStackDepth-1, 3);
+  depth++;
+
+  const AtomicWord head = b->head;     // nobody else writes it
+  const AtomicWord used = head - Acquire_Load(&b->tail);
+  if (used + depth + 1 > kThreadBufferLength) {
+    b->dropped++;
+  } else {
+    b->ring[head % kThreadBufferLength] = depth;
+    for (int i = 0; i < depth; i++) {
+      b->ring[(head + 1 + i) % kThreadBufferLength] =
+          reinterpret_cast<Slot>(stack[i]);
+    }
+    Release_Store(&b->head, head + depth + 1);
+  }
+
+  // Empty the buffers once this one is half full, unless someone else
+  // (perhaps the code this signal interrupted) is in the table already
+  if (used > kThreadBufferLength / 2 && table_lock_.TryLock()) {
+    MergeThreadBuffersLocked();
+    table_lock_.Unlock();
+  }
+}
+
+void ProfileData::MergeThreadBuffersLocked() {
+  if (hash_ == NULL) {
+    return;                             // a handler still running at Stop()
+  }
+  Slot stack[kMaxStackDepth];
+  for (int i = 0; i < kThreadTableSize; i++) {
+    ThreadBuffer* b =
+        reinterpret_cast<ThreadBuffer*>(Acquire_Load(&thread_table_[i]));
+    if (b == NULL) {
+      continue;
+    }
+    const AtomicWord head = Acquire_Load(&b->head);
+    AtomicWord tail = b->tail;
+    while (tail != head) {
+      const int depth = b->ring[tail % kThreadBufferLength];
+      for (int d = 0; d < depth; d++) {
+        stack[d] = b->ring[(tail + 1 + d) % kThreadBufferLength];
+      }
+      tail += depth + 1;
+      AddTraceLocked(stack, depth);
+    }
+    Release_Store(&b->tail, tail);
+  }
+}
+
+int ProfileData::DroppedSamples() {
+  int dropped = 0;
+  for (int i = 0; i < kThreadTableSize; i++) {
+    ThreadBuffer* b =
+        reinterpret_cast<ThreadBuffer*>(Acquire_Load(&thread_table_[i]));
+    if (b != NULL) {
+      dropped += b->dropped;
+    }
+  }
+  return dropped;
+}
+#endif
+
+// Start sampling the current thread.  We do this for every known
+// thread.  If profiling is off, the generated signals are ignored,
+// otherwise they are captured by prof_handler() or perf_handler().
+void ProfileData::RegisterThread() {
+#ifdef CPU_PROFILER_PERF_EVENTS
+  if (use_perf_events_) {
+    const pid_t tid = syscall(SYS_gettid);
+    SpinLockHolder l(&threads_lock_);
+
+    // A thread registering again keeps its buffer.  Failing that, take
+    // the buffer of a thread that has exited, samples and all.
+    ThreadBuffer* reuse = NULL;
+    for (int i = 0; i < kThreadTableSize && reuse == NULL; i++) {
+      ThreadBuffer* b = reinterpret_cast<ThreadBuffer*>(thread_table_[i]);
+      if (b != NULL && b->tid == tid) {
+        reuse = b;
+      }
+    }
+    for (int i = 0; i < kThreadTableSize && reuse == NULL; i++) {
+      ThreadBuffer* b = reinterpret_cast<ThreadBuffer*>(thread_table_[i]);
+      if (b != NULL && syscall(SYS_tgkill, getpid(), b->tid, 0) != 0 &&
+          errno == ESRCH) {
+        reuse = b;
+      }
+    }
+    if (reuse == NULL && num_threads_ == kMaxThreads) {
+      fprintf(stderr, "PROFILE: more than %d threads, "
+              "thread %d is not profiled\n", kMaxThreads, int(tid));
+      return;
+    }
+
+    // A reused buffer keeps the fd it is hashed by
+    const int fd = OpenThreadCounter(tid, reuse != NULL ? reuse->fd : -1);
+    if (fd < 0) {
+      if (num_threads_ > 0) {
+        perror("PROFILE: perf_event_open");
+      }
+      return;
+    }
+    if (reuse != NULL) {
+      reuse->tid = tid;
+      return;
+    }
+
+    ThreadBuffer* b = new ThreadBuffer;
+    b->fd = fd;
+    b->tid = tid;
+    b->head = 0;
+    b->tail = 0;
+    b->dropped = 0;
+    int i = fd % kThreadTableSize;
+    while (thread_table_[i] != 0) {
+      i = (i + 1) % kThreadTableSize;
+    }
+    Release_Store(&thread_table_[i], reinterpret_cast<AtomicWord>(b));
+    num_threads_++;
+    return;
+  }
+#endif
   // TODO: Randomize the initial interrupt value?
   // TODO: Randomize the inter-interrupt period on every interrupt?
   struct itimerval timer;
   timer.it_interval.tv_sec = 0;
-  timer.it_interval.tv_usec = 1000000 / pdata.frequency();
+  timer.it_interval.tv_usec = 1000000 / frequency();
   timer.it_value = timer.it_interval;
   setitimer(ITIMER_PROF, &timer, 0);
 }
 
+void ProfilerRegisterThread() {
+  pdata.RegisterThread();
+}
+
 // DEPRECATED routines
 void ProfilerEnable() { }
 void ProfilerDisable() { }
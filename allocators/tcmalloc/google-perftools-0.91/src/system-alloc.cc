@@ -42,8 +42,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include "system-alloc.h"
 #include "internal_logging.h"
+#include <google/malloc_extension.h>
 #include "base/commandlineflags.h"
 #include "base/spinlock.h"
 
@@ -87,6 +91,16 @@ static bool devmem_failure = false;
 static bool sbrk_failure = false;
 static bool mmap_failure = false;
 
+// Allocators added with TCMalloc_AddSystemAllocator, in the order
+// TCMalloc_SystemAllocPages tries them, with their own failure flags.
+static const int kMaxSysAllocators = 8;
+static SysAllocator* sys_allocators[kMaxSysAllocators];
+static bool sys_allocator_failure[kMaxSysAllocators];
+static int num_sys_allocators = 0;
+
+// Whether all of those return zeroed memory
+static bool sys_allocators_zero = true;
+
 DEFINE_int32(malloc_devmem_start, 0,
              "Physical memory starting location in MB for /dev/mem allocation."
              "  Setting this to 0 disables /dev/mem allocation");
@@ -261,15 +275,29 @@ static void* TryDevMem(size_t size, size_t alignment) {
   return reinterpret_cast<void*>(ptr);
 }
 
-void* TCMalloc_SystemAlloc(size_t size, size_t alignment) {
-  // Discard requests that overflow
-  if (size + alignment < size) return NULL;
-
-  SpinLockHolder lock_holder(&spinlock);
-
-  // Enforce minimum alignment
-  if (alignment < sizeof(MemoryAligner)) alignment = sizeof(MemoryAligner);
+static void* TrySysAllocator(int i, size_t size, size_t* actual_size,
+                             size_t alignment) {
+  SysAllocator* allocator = sys_allocators[i];
+  const size_t unit = allocator->Alignment();
+  if (unit > alignment) alignment = unit;
+  if (unit > 1) {
+    if (size + unit < size) return NULL;
+    size = ((size + unit - 1) / unit) * unit;
+  }
+  size_t actual = size;
+  void* result = allocator->Alloc(size, &actual, alignment);
+  if (result == NULL) {
+    sys_allocator_failure[i] = true;
+    return NULL;
+  }
+  ASSERT((reinterpret_cast<uintptr_t>(result) & (alignment - 1)) == 0);
+  ASSERT(actual >= size);
+  *actual_size = actual;
+  return result;
+}
 
+// Requires that spinlock is held.
+static void* SystemAllocLocked(size_t size, size_t alignment) {
   // Try twice, once avoiding allocators that failed before, and once
   // more trying all allocators even if they failed before.
   for (int i = 0; i < 2; i++) {
@@ -300,7 +328,67 @@ void* TCMalloc_SystemAlloc(size_t size, size_t alignment) {
   return NULL;
 }
 
+void* TCMalloc_SystemAlloc(size_t size, size_t alignment) {
+  // Discard requests that overflow
+  if (size + alignment < size) return NULL;
+
+  SpinLockHolder lock_holder(&spinlock);
+
+  // Enforce minimum alignment
+  if (alignment < sizeof(MemoryAligner)) alignment = sizeof(MemoryAligner);
+
+  return SystemAllocLocked(size, alignment);
+}
+
+void* TCMalloc_SystemAllocPages(size_t size, size_t* actual_size,
+                                size_t alignment) {
+  // Discard requests that overflow
+  if (size + alignment < size) return NULL;
+
+  SpinLockHolder lock_holder(&spinlock);
+
+  // Enforce minimum alignment
+  if (alignment < sizeof(MemoryAligner)) alignment = sizeof(MemoryAligner);
+
+  // Try the added allocators that have not failed, then our own; if
+  // all of those fail, try the added ones again.
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < num_sys_allocators; i++) {
+      if (sys_allocator_failure[i]) continue;
+      void* result = TrySysAllocator(i, size, actual_size, alignment);
+      if (result != NULL) return result;
+    }
+    if (pass == 0) {
+      void* result = SystemAllocLocked(size, alignment);
+      if (result != NULL) {
+        *actual_size = size;
+        return result;
+      }
+    }
+    for (int i = 0; i < num_sys_allocators; i++) {
+      sys_allocator_failure[i] = false;
+    }
+  }
+  return NULL;
+}
+
+bool TCMalloc_AddSystemAllocator(SysAllocator* allocator) {
+  SpinLockHolder lock_holder(&spinlock);
+  if (num_sys_allocators == kMaxSysAllocators) return false;
+  if (!allocator->ReturnsZeroedMemory()) sys_allocators_zero = false;
+  sys_allocators[num_sys_allocators] = allocator;
+  sys_allocator_failure[num_sys_allocators] = false;
+  num_sys_allocators++;
+  return true;
+}
+
 void TCMalloc_SystemRelease(void* start, size_t length) {
+  {
+    SpinLockHolder lock_holder(&spinlock);
+    for (int i = 0; i < num_sys_allocators; i++) {
+      if (sys_allocators[i]->Release(start, length)) return;
+    }
+  }
 #ifdef MADV_DONTNEED
   if (FLAGS_malloc_devmem_start) {
     // It's not safe to use MADV_DONTNEED if we've been mapping
@@ -335,3 +423,112 @@ void TCMalloc_SystemRelease(void* start, size_t length) {
   }
 #endif
 }
+
+void TCMalloc_SystemAdviseHugePages(void* start, size_t length) {
+#ifdef MADV_HUGEPAGE
+  if (FLAGS_malloc_devmem_start) return;
+  madvise(reinterpret_cast<char*>(start), length, MADV_HUGEPAGE);
+#endif
+}
+
+void TCMalloc_SystemPrefault(void* start, size_t length) {
+#ifdef MADV_POPULATE_WRITE
+  // Linux 5.14 and later fault the whole range in at once
+  if (madvise(reinterpret_cast<char*>(start), length,
+              MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+#endif
+  // Otherwise write a zero to every page
+  static size_t pagesize = 0;
+  if (pagesize == 0) pagesize = getpagesize();
+  volatile char* p = reinterpret_cast<volatile char*>(start);
+  for (size_t i = 0; i < length; i += pagesize) {
+    p[i] = 0;
+  }
+}
+
+// Parse a kernel CPU list ("0-3,8,10-11") in buf[0..len-1], assigning
+// every CPU in it below num_cpus to "node".
+static void AssignCPUList(const char* buf, int len, int node,
+                          unsigned char* cpu_to_node, int num_cpus) {
+  int i = 0;
+  while (i < len) {
+    if (buf[i] < '0' || buf[i] > '9') {
+      i++;
+      continue;
+    }
+    long first = 0;
+    while (i < len && buf[i] >= '0' && buf[i] <= '9') {
+      first = first * 10 + (buf[i++] - '0');
+    }
+    long last = first;
+    if (i < len && buf[i] == '-') {
+      i++;
+      last = 0;
+      while (i < len && buf[i] >= '0' && buf[i] <= '9') {
+        last = last * 10 + (buf[i++] - '0');
+      }
+    }
+    for (long cpu = first; cpu <= last && cpu < num_cpus; cpu++) {
+      cpu_to_node[cpu] = node;
+    }
+  }
+}
+
+int TCMalloc_SystemNumaTopology(unsigned char* cpu_to_node,
+                                int num_cpus, int max_nodes) {
+  for (int i = 0; i < num_cpus; i++) cpu_to_node[i] = 0;
+  int nodes = 1;
+#ifdef __linux__
+  // We are called on the first malloc, so build the path by hand
+  // rather than with snprintf (which may allocate)
+  static const char kPrefix[] = "/sys/devices/system/node/node";
+  static const char kSuffix[] = "/cpulist";
+  for (int node = 0; node < max_nodes && node < 100; node++) {
+    char path[sizeof(kPrefix) + 2 + sizeof(kSuffix)];
+    char* p = path;
+    for (const char* q = kPrefix; *q; q++) *p++ = *q;
+    if (node >= 10) *p++ = '0' + node / 10;
+    *p++ = '0' + node % 10;
+    for (const char* q = kSuffix; *q; q++) *p++ = *q;
+    *p = '\0';
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) continue;         // Node numbers may have holes
+    char buf[4096];
+    const ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len <= 0) continue;
+    AssignCPUList(buf, len, node, cpu_to_node, num_cpus);
+    nodes = node + 1;
+  }
+#endif
+  return nodes;
+}
+
+void TCMalloc_SystemBindToNode(void* start, size_t length, int node) {
+#if defined(__linux__) && defined(__NR_mbind)
+  if (FLAGS_malloc_devmem_start) return;
+  // MPOL_PREFERRED rather than MPOL_BIND: if the node runs out of
+  // memory we would rather get remote pages than fail
+  static const int kMpolPreferred = 1;
+  unsigned long mask = 1UL << node;
+  syscall(__NR_mbind, start, length, kMpolPreferred, &mask,
+          sizeof(mask) * 8, 0);
+#endif
+}
+
+bool TCMalloc_SystemReleaseZeroes() {
+  if (!sys_allocators_zero) return false;
+#ifdef MADV_DONTNEED
+  // /dev/mem is neither zero-filled nor released (see above)
+  return !FLAGS_malloc_devmem_start;
+#else
+  return false;
+#endif
+}
+
+bool TCMalloc_SystemAllocZeroes() {
+  return !FLAGS_malloc_devmem_start;
+}
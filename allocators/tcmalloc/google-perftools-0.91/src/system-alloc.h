@@ -43,6 +43,18 @@
 // when out of memory.
 extern void* TCMalloc_SystemAlloc(size_t bytes, size_t alignment = 0);
 
+// Like TCMalloc_SystemAlloc, but for the page heap: tries the
+// allocators added with TCMalloc_AddSystemAllocator first, and sets
+// "*actual_bytes" to the number of bytes returned (which may be more
+// than "bytes" if an allocator has a coarser granularity).
+extern void* TCMalloc_SystemAllocPages(size_t bytes, size_t* actual_bytes,
+                                       size_t alignment = 0);
+
+// Add "allocator" to the end of the chain TCMalloc_SystemAllocPages
+// tries.  Returns false if the chain is full.
+class SysAllocator;
+extern bool TCMalloc_AddSystemAllocator(SysAllocator* allocator);
+
 // This call is a hint to the operating system that the pages
 // contained in the specified range of memory will not be used for a
 // while, and can be released for use by other processes or the OS.
@@ -51,7 +63,43 @@ extern void* TCMalloc_SystemAlloc(size_t bytes, size_t alignment = 0);
 // use by the system, the cost is that the pages are faulted back into
 // the address space next time they are touched, which can impact
 // performance.  (Only pages fully covered by the memory region will
-// be released, partial pages will not.)
+// be released, partial pages will not.)  Memory from an added
+// allocator is released by that allocator, if it says so.
 extern void TCMalloc_SystemRelease(void* start, size_t length);
 
+// Returns true if pages passed to TCMalloc_SystemRelease() are
+// guaranteed to read back as zero the next time they are touched (as
+// with MADV_DONTNEED on anonymous memory).  When this holds, pages
+// fresh from TCMalloc_SystemAlloc() and TCMalloc_SystemAllocPages()
+// are also known to be zero.  It does not hold if any added allocator
+// does not return zeroed memory.
+extern bool TCMalloc_SystemReleaseZeroes();
+
+// Returns true if memory from TCMalloc_SystemAlloc() is known to be
+// zero, so that callers need not clear it: sbrk() and anonymous mmap()
+// memory is, /dev/mem memory is not.
+extern bool TCMalloc_SystemAllocZeroes();
+
+// Hint to the operating system that the specified range of memory
+// should be backed by transparent huge pages.  A no-op where that is
+// not supported.
+extern void TCMalloc_SystemAdviseHugePages(void* start, size_t length);
+
+// Fault in the specified range of memory (which is zero, and stays so)
+// ahead of its first use, so that touching it does not page-fault.
+extern void TCMalloc_SystemPrefault(void* start, size_t length);
+
+// Set cpu_to_node[i] to the NUMA node of CPU i, for 0 <= i < num_cpus,
+// reading the topology the kernel reports; CPUs on nodes at or above
+// "max_nodes" (or not listed at all) are put on node 0.  Returns the
+// number of nodes (one more than the highest node used), which is 1
+// if the system is not NUMA or does not tell us.  Does not allocate.
+extern int TCMalloc_SystemNumaTopology(unsigned char* cpu_to_node,
+                                       int num_cpus, int max_nodes);
+
+// Ask the operating system to back the specified range of memory with
+// pages from NUMA node "node" where possible.  A no-op where that is
+// not supported.
+extern void TCMalloc_SystemBindToNode(void* start, size_t length, int node);
+
 #endif /* TCMALLOC_SYSTEM_ALLOC_H__ */
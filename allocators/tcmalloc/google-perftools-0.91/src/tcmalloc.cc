@@ -78,14 +78,42 @@
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>                         // for open() of size class tables
 #include <errno.h>
 #include <stdarg.h>
+#include <sys/time.h>
+#include <sys/mman.h>                      // for the telemetry page
+#include <semaphore.h>
+#if defined(__linux__)
+#include <sched.h>                         // for sched_getcpu
+#endif
+// glibc 2.35 and later register an rseq area for every thread, whose
+// cpu_id field the kernel keeps current.
+#if defined(__linux__) && defined(__GLIBC__) && defined(__GNUC__) && \
+    (__GNUC__ >= 11) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define TCMALLOC_USE_RSEQ 1
+#include <sys/rseq.h>
+#endif
+// USDT probes (provider "tcmalloc") on the slow paths, for bpftrace,
+// perf and SystemTap.  Each is a NOP until a tracer attaches to it.
+// A slow path has a *_start and a *_done probe, and the tracer times
+// the interval, so untraced code reads no clocks.  They need
+// <sys/sdt.h>; define TCMALLOC_NO_PROBES to leave them out.
+#if !defined(TCMALLOC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TCMALLOC_PROBES 1
+#endif
+#endif
 #include "base/commandlineflags.h"
 #include "base/basictypes.h"               // gets us PRIu64
 #include "base/sysinfo.h"
 #include "base/spinlock.h"
+#include "base/atomicops.h"
 #include <google/malloc_hook.h>
 #include <google/malloc_extension.h>
+#include <google/malloc_telemetry.h>
 #include <google/stacktrace.h>
 #include "internal_logging.h"
 #include "pagemap.h"
@@ -141,14 +169,22 @@
 //-------------------------------------------------------------------
 
 // Not all possible combinations of the following parameters make
-// sense.  In particular, if kMaxSize increases, you may have to
+// sense.  In particular, if kMaxSizeLimit increases, you may have to
 // increase kNumClasses as well.
 static const size_t kPageShift  = 12;
 static const size_t kPageSize   = 1 << kPageShift;
-static const size_t kMaxSize    = 8u * kPageSize;
 static const size_t kAlignShift = 3;
 static const size_t kAlignment  = 1 << kAlignShift;
-static const size_t kNumClasses = 68;
+
+// Objects up to max_class_size (see below) get size classes, and so
+// are cached per thread; larger ones come straight from the page heap.
+// The default size class policy stops at kDefaultMaxSize, but other
+// policies may go up to kMaxSizeLimit.
+static const size_t kDefaultMaxSize = 8u * kPageSize;
+static const size_t kMaxSizeLimit = 8u * kDefaultMaxSize;
+
+// Upper bound on the number of size classes of any policy
+static const size_t kNumClasses = 68 + 24;
 
 // Allocates a big block of memory for the pagemap once we reach more than
 // 128MB
@@ -162,13 +198,6 @@ static const size_t kPageMapBigAllocationThreshold = 128 << 20;
 // address-space.
 static const int kMinSystemAlloc = 1 << (20 - kPageShift);
 
-// Number of objects to move between a per-thread list and a central
-// list in one shot.  We want this to be not too small so we can
-// amortize the lock overhead for accessing the central list.  Making
-// it too big may temporarily cause unnecessary memory wastage in the
-// per-thread free list until the scavenger cleans up the list.
-static int num_objects_to_move[kNumClasses];
-
 // Maximum length we allow a per-thread free-list to have before we
 // move objects from it into the corresponding central free-list.  We
 // want this big to avoid locking the central free-list too often.  It
@@ -177,35 +206,70 @@ static int num_objects_to_move[kNumClasses];
 static const int kMaxFreeListLength = 256;
 
 // Lower and upper bounds on the per-thread cache sizes
-static const size_t kMinThreadCacheSize = kMaxSize * 2;
+static const size_t kMinThreadCacheSize = kDefaultMaxSize * 2;
 static const size_t kMaxThreadCacheSize = 2 << 20;
 
 // Default bound on the total amount of thread caches
 static const size_t kDefaultOverallThreadCacheSize = 16 << 20;
 
+// A thread cache that fetches from the central cache at least this
+// many times between two scavenges is using more than its budget, so
+// its budget grows by kStealAmount (taken from unclaimed space if
+// there is any, otherwise from some other thread's cache).
+static const int kMissesBeforeGrowth = 16;
+static const size_t kStealAmount = 1 << 16;
+
+// Each thread (or CPU) cache also keeps up to kSpanCacheSlots large
+// objects of up to kMaxCachedSpanPages pages that were freed, to hand
+// out again to allocations of the same number of pages without going
+// to the page heap (see tcmalloc_span_cache_bytes).
+static const int kSpanCacheSlots = 16;
+static const size_t kMaxCachedSpanPages = 1 << (20 - kPageShift);
+
+// Size of a transparent huge page.  In huge page mode (see
+// TCMalloc_PageHeap) the heap grows, and returns memory to the
+// system, only in whole huge pages.
+static const size_t kHugePageShift = 21;
+static const size_t kHugePageSize = 1 << kHugePageShift;
+static const size_t kPagesPerHugePage = 1 << (kHugePageShift - kPageShift);
+
+// Most NUMA nodes we give their own page heap and central cache to.
+// CPUs on higher-numbered nodes share node 0's.
+static const int kMaxNumaNodes = 8;
+
+// Number of NUMA nodes we are using (see InitNumaNodes()).  Written
+// once during module initialization.
+static int num_numa_nodes = 1;
+
 // For all span-lengths < kMaxPages we keep an exact-size list.
 // REQUIRED: kMaxPages >= kMinSystemAlloc;
 static const size_t kMaxPages = kMinSystemAlloc;
 
-/* The smallest prime > 2^n */
-static unsigned int primes_list[] = {
-	// Small values might cause high rates of sampling
-	// and hence commented out.
-	// 2, 5, 11, 17, 37, 67, 131, 257,
-	// 521, 1031, 2053, 4099, 8209, 16411,
-	32771, 65537, 131101, 262147, 524309, 1048583,
-	2097169, 4194319, 8388617, 16777259, 33554467 };
-
-// Twice the approximate gap between sampling actions.
-// I.e., we take one sample approximately once every
+// Allocations of at least kMinPrefaultPages are served from the pool
+// of prefaulted spans, if there is one (see tcmalloc_prefault_bytes).
+// The pool is refilled kMaxPrefaultPages at a time, so allocations of
+// up to 16MB fit in a single refill.
+static const size_t kMinPrefaultPages = kMaxPages;
+static const size_t kMaxPrefaultPages = 1 << (24 - kPageShift);
+
+// Spans of at least kMinDeferredReleasePages that IncrementalScavenge()
+// releases are handed to the background releaser, if there is one
+// (see tcmalloc_async_release_bytes), up to kReleaseQueueSize at a time.
+static const size_t kMinDeferredReleasePages = kMaxPages;
+static const int kReleaseQueueSize = 64;
+
+// Twice the average gap between sampling actions.
+// I.e., we take one sample on average once every
 //      tcmalloc_sample_parameter/2
-// bytes of allocation, i.e., ~ once every 128KB.
-// Must be a prime number.
-DEFINE_int64(tcmalloc_sample_parameter, 262147,
-	     "Twice the approximate gap between sampling actions."
-	     " Must be a prime number. Otherwise will be rounded up to a "
-	     " larger prime number");
-static size_t sample_period = 262147;
+// bytes of allocation, i.e., ~ once every 128KB.  The gaps are
+// exponentially distributed (see PickNextSample()).
+DEFINE_int64(tcmalloc_sample_parameter,
+             EnvToInt64("TCMALLOC_SAMPLE_PARAMETER", 262147),
+             "Twice the average gap in bytes between sampling actions."
+             " Zero turns sampling off.");
+// Average gap between sampling actions, derived from
+// FLAGS_tcmalloc_sample_parameter
+static size_t sample_period = 262147 / 2;
 // Protects sample_period above
 static SpinLock sample_period_lock(SpinLock::LINKER_INITIALIZED);
 
@@ -218,6 +282,39 @@ DEFINE_double(tcmalloc_release_rate, 1,
               "to return memory slower.  Reasonable rates are in the "
               "range [0,10]");
 
+DEFINE_int64(tcmalloc_background_release_rate,
+             EnvToInt64("TCMALLOC_BACKGROUND_RELEASE_RATE", 0),
+             "Bytes per second that a background thread returns to the "
+             "system from free spans that have not been reused for "
+             "tcmalloc_background_release_age seconds.  Zero means no "
+             "background thread is started.");
+DEFINE_int64(tcmalloc_background_release_age,
+             EnvToInt64("TCMALLOC_BACKGROUND_RELEASE_AGE", 10),
+             "How many seconds a span must stay free before the "
+             "background thread returns it to the system.");
+DEFINE_int64(tcmalloc_prefault_bytes,
+             EnvToInt64("TCMALLOC_PREFAULT_BYTES", 0),
+             "Bytes of pre-faulted, zeroed memory that a background "
+             "thread keeps ready in each page heap for large "
+             "allocations, so that they need not fault their pages in.  "
+             "Zero means no background thread is started.");
+DEFINE_int64(tcmalloc_async_release_bytes,
+             EnvToInt64("TCMALLOC_ASYNC_RELEASE_BYTES", 0),
+             "Bytes of large free spans that may be waiting for a "
+             "background thread to return them to the system, instead "
+             "of the thread that freed them doing it.  Past that, "
+             "spans are returned inline again.  Zero means no "
+             "background thread is started.");
+DEFINE_int64(tcmalloc_span_cache_bytes,
+             EnvToInt64("TCMALLOC_SPAN_CACHE_BYTES", 1 << 20),
+             "Bytes of freed large objects, of up to 1MB each, that each "
+             "thread or CPU cache keeps to reuse for allocations of the "
+             "same number of pages.  Zero turns the span cache off.");
+DEFINE_int64(tcmalloc_telemetry_interval_ms,
+             EnvToInt64("TCMALLOC_TELEMETRY_INTERVAL_MS", 1000),
+             "How often, in milliseconds, the telemetry page named by "
+             "TCMALLOC_TELEMETRY_PATH is rewritten.");
+
 //-------------------------------------------------------------------
 // Mapping from size to size_class and vice versa
 //-------------------------------------------------------------------
@@ -247,22 +344,76 @@ DEFINE_double(tcmalloc_release_rate, 1,
 //   1025       120 + ((1025+127) / 128)        129
 //   ...
 //   32768      120 + ((32768+127) / 128)       376
+//   ...
+//   262144     120 + ((262144+127) / 128)      2168
+//
+// The size class tables are computed by ComputeSizeClasses() below.
+// Where the compiler can evaluate it (C++14 constexpr), the tables of
+// the default policy are computed and checked at compile time, and a
+// program that keeps the default does no work for them at startup.
+#if __cplusplus >= 201402L
+#define TCMALLOC_CONSTEXPR constexpr
+#define TCMALLOC_CONSTEXPR_SIZE_CLASSES 1
+#else
+#define TCMALLOC_CONSTEXPR
+#endif
+
 static const int kMaxSmallSize = 1024;
-static const int shift_amount[2] = { 3, 7 };  // For divides by 8 or 128
-static const int base_index[2] = { -15, 120 }; // For finding array bases
-static unsigned char class_array[377];
+// For divides by 8 or 128, and for finding array bases
+static TCMALLOC_CONSTEXPR const int shift_amount[2] = { 3, 7 };
+static TCMALLOC_CONSTEXPR const int base_index[2] = { -15, 120 };
+static const size_t kClassArraySize = 2169;
 
 // Compute index of the class_array[] entry for a given size
-static inline int ClassIndex(size_t s) {
+static inline TCMALLOC_CONSTEXPR int ClassIndex(size_t s) {
   const int i = (s > kMaxSmallSize);
   return base_index[i] + ((s+127) >> shift_amount[i]);
 }
 
-// Mapping from size class to max size storable in that class
-static size_t class_to_size[kNumClasses];
+struct SizeClassTables {
+  // Largest size with a size class, and the number of size classes in
+  // use (class 0 included)
+  size_t max_class_size;
+  size_t num_size_classes;
+
+  // Mapping from ClassIndex(size) to size class
+  unsigned char class_array[kClassArraySize];
+
+  // Mapping from size class to max size storable in that class
+  size_t class_to_size[kNumClasses];
 
-// Mapping from size class to number of pages to allocate at a time
-static size_t class_to_pages[kNumClasses];
+  // Mapping from size class to number of pages to allocate at a time
+  size_t class_to_pages[kNumClasses];
+
+  // Number of objects to move between a per-thread list and a central
+  // list in one shot.  We want this to be not too small so we can
+  // amortize the lock overhead for accessing the central list.  Making
+  // it too big may temporarily cause unnecessary memory wastage in the
+  // per-thread free list until the scavenger cleans up the list.
+  int num_objects_to_move[kNumClasses];
+};
+
+// A size class policy says how to lay out classes beyond
+// kDefaultMaxSize: up to what size, and how many classes to make per
+// doubling of the size.  It is picked by name from
+// $TCMALLOC_SIZE_CLASSES when the module is initialized.  A value
+// with a '/' in it instead names a file of class sizes, one per line
+// (see LoadSizeClasses()), such as util/bench/sizeclasses writes.
+struct SizeClassPolicy {
+  const char* name;
+  size_t      max_size;           // Largest size to give a class
+  int         lg_per_doubling;    // lg(classes per doubling), beyond
+                                  // kDefaultMaxSize
+};
+static const SizeClassPolicy size_class_policies[] = {
+  { "default", kDefaultMaxSize, 0 },
+  { "medium",  kMaxSizeLimit,   3 },   // at most 12.5% internal waste
+  { "medium_coarse", kMaxSizeLimit, 2 },
+};
+
+// Spans for classes beyond kDefaultMaxSize hold this many objects, so
+// that the central cache does not go to the page heap for every one.
+static const int kMediumObjectsPerSpan = 4;
 
 // TransferCache is used to cache transfers of num_objects_to_move[size_class]
 // back and forth between thread caches and the central cache for a given size
@@ -280,7 +431,7 @@ static const int kNumTransferEntries = kNumClasses;
 
 // Note: the following only works for "n"s that fit in 32-bits, but
 // that is fine since we only use it for small sizes.
-static inline int LgFloor(size_t n) {
+static inline TCMALLOC_CONSTEXPR int LgFloor(size_t n) {
   int log = 0;
   for (int i = 4; i >= 0; --i) {
     int shift = (1 << i);
@@ -357,17 +508,7 @@ static inline size_t SLL_Size(void *head) {
 
 // Setup helper functions.
 
-static inline int SizeClass(size_t size) {
-  return class_array[ClassIndex(size)];
-}
-
-// Get the byte-size for a specified class
-static inline size_t ByteSizeForClass(size_t cl) {
-  return class_to_size[cl];
-}
-
-
-static int NumMoveSize(size_t size) {
+static TCMALLOC_CONSTEXPR int NumMoveSize(size_t size) {
   if (size == 0) return 0;
   // Use approx 64k transfers between thread and central caches.
   int num = static_cast<int>(64.0 * 1024.0 / size);
@@ -390,23 +531,56 @@ static int NumMoveSize(size_t size) {
   return num;
 }
 
-// Initialize the mapping arrays
-static void InitSizeClasses() {
-  // Do some sanity checking on base_index[]/shift_amount[]/class_array[]
-  if (ClassIndex(0) < 0) {
-    MESSAGE("Invalid class index %d for size 0\n", ClassIndex(0));
-    abort();
+// The pages of a span of objects of "size" bytes
+static TCMALLOC_CONSTEXPR size_t ClassPages(size_t size) {
+  if (size > kDefaultMaxSize) {
+    return (kMediumObjectsPerSpan * size + kPageSize - 1) >> kPageShift;
   }
-  if (ClassIndex(kMaxSize) >= sizeof(class_array)) {
-    MESSAGE("Invalid class index %d for kMaxSize\n", ClassIndex(kMaxSize));
-    abort();
+  // Allocate enough pages so leftover is less than 1/8 of total.
+  // This bounds wasted space to at most 12.5%.
+  size_t psize = kPageSize;
+  while ((psize % size) > (psize >> 3)) {
+    psize += kPageSize;
+  }
+  return psize >> kPageShift;
+}
+
+// Fill in the mapping arrays and num_objects_to_move of "t", whose
+// first "sc" classes (class 0 included) have their sizes and pages
+static TCMALLOC_CONSTEXPR void FinishSizeClasses(SizeClassTables* t, int sc) {
+  t->num_size_classes = sc;
+
+  // Initialize the mapping arrays
+  size_t next_size = 0;
+  for (int c = 1; c < sc; c++) {
+    const size_t max_size_in_class = t->class_to_size[c];
+    for (size_t s = next_size; s <= max_size_in_class; s += kAlignment) {
+      t->class_array[ClassIndex(s)] = c;
+    }
+    next_size = max_size_in_class + kAlignment;
+  }
+
+  // Initialize the num_objects_to_move array.
+  for (size_t cl = 1; cl  < kNumClasses; ++cl) {
+    t->num_objects_to_move[cl] = NumMoveSize(t->class_to_size[cl]);
   }
+}
+
+// Compute the size class tables for classes up to "max_size", with
+// 2^lg_per_doubling classes per doubling of the size beyond
+// kDefaultMaxSize.  Returns tables with num_size_classes == 0 if there
+// would be more than kNumClasses classes.
+static TCMALLOC_CONSTEXPR SizeClassTables ComputeSizeClasses(
+    size_t max_size, int lg_per_doubling) {
+  SizeClassTables t = SizeClassTables();
+  t.max_class_size = max_size;
 
   // Compute the size classes we want to use
   int sc = 1;   // Next size class to assign
   int alignshift = kAlignShift;
   int last_lg = -1;
-  for (size_t size = kAlignment; size <= kMaxSize; size += (1 << alignshift)) {
+  for (size_t size = kAlignment; size <= max_size;
+       size += (1 << alignshift)) {
     int lg = LgFloor(size);
     if (lg > last_lg) {
       // Increase alignment every so often.
@@ -419,86 +593,208 @@ static void InitSizeClasses() {
       if ((lg >= 7) && (alignshift < 8)) {
         alignshift++;
       }
+      // Beyond the default classes, the policy sets the spacing.
+      if (size >= kDefaultMaxSize) {
+        alignshift = lg - lg_per_doubling;
+      }
       last_lg = lg;
     }
 
-    // Allocate enough pages so leftover is less than 1/8 of total.
-    // This bounds wasted space to at most 12.5%.
-    size_t psize = kPageSize;
-    while ((psize % size) > (psize >> 3)) {
-      psize += kPageSize;
-    }
-    const size_t my_pages = psize >> kPageShift;
+    // Sizes beyond kDefaultMaxSize are multiples of the page size
+    ASSERT(size <= kDefaultMaxSize || size % kPageSize == 0);
+    const size_t my_pages = ClassPages(size);
 
-    if (sc > 1 && my_pages == class_to_pages[sc-1]) {
+    if (sc > 1 && my_pages == t.class_to_pages[sc-1]) {
       // See if we can merge this into the previous class without
       // increasing the fragmentation of the previous class.
       const size_t my_objects = (my_pages << kPageShift) / size;
-      const size_t prev_objects = (class_to_pages[sc-1] << kPageShift)
-                                  / class_to_size[sc-1];
+      const size_t prev_objects = (t.class_to_pages[sc-1] << kPageShift)
+                                  / t.class_to_size[sc-1];
       if (my_objects == prev_objects) {
         // Adjust last class to include this size
-        class_to_size[sc-1] = size;
+        t.class_to_size[sc-1] = size;
         continue;
       }
     }
 
     // Add new class
-    class_to_pages[sc] = my_pages;
-    class_to_size[sc] = size;
+    if (sc == kNumClasses) {
+      t.num_size_classes = 0;
+      return t;
+    }
+    t.class_to_pages[sc] = my_pages;
+    t.class_to_size[sc] = size;
     sc++;
   }
-  if (sc != kNumClasses) {
-    MESSAGE("wrong number of size classes: found %d instead of %d\n",
-            sc, int(kNumClasses));
-    abort();
-  }
+  FinishSizeClasses(&t, sc);
+  return t;
+}
 
-  // Initialize the mapping arrays
-  int next_size = 0;
-  for (int c = 1; c < kNumClasses; c++) {
-    const int max_size_in_class = class_to_size[c];
-    for (int s = next_size; s <= max_size_in_class; s += kAlignment) {
-      class_array[ClassIndex(s)] = c;
+// Compute the size class tables for the "n" class sizes in "sizes",
+// which must be ascending multiples of kAlignment (and of 128 beyond
+// kMaxSmallSize, the granularity of ClassIndex() there), up to
+// kMaxSizeLimit.  Returns tables with num_size_classes == 0 if they
+// are not, or if there are too many.
+static SizeClassTables SizeClassesFromList(const size_t* sizes, int n) {
+  SizeClassTables t = SizeClassTables();
+  if (n == 0 || n >= kNumClasses) return t;
+  for (int i = 0; i < n; i++) {
+    const size_t size = sizes[i];
+    if (size == 0 || size > kMaxSizeLimit || size % kAlignment != 0 ||
+        (size > kMaxSmallSize && size % 128 != 0) ||
+        (i > 0 && size <= sizes[i-1])) {
+      return t;
     }
-    next_size = max_size_in_class + kAlignment;
+    t.class_to_size[i+1] = size;
+    t.class_to_pages[i+1] = ClassPages(size);
   }
+  t.max_class_size = sizes[n-1];
+  FinishSizeClasses(&t, n + 1);
+  return t;
+}
 
-  // Double-check sizes just to be safe
-  for (size_t size = 0; size <= kMaxSize; size++) {
-    const int sc = SizeClass(size);
-    if (sc == 0) {
-      MESSAGE("Bad size class %d for %" PRIuS "\n", sc, size);
-      abort();
-    }
-    if (sc > 1 && size <= class_to_size[sc-1]) {
-      MESSAGE("Allocating unnecessarily large class %d for %" PRIuS
-              "\n", sc, size);
-      abort();
+// Double-check the tables: every size up to max_class_size must map to
+// the smallest class that holds it.  Returns 0 if they are right, and
+// otherwise one more than the first size they get wrong.
+static TCMALLOC_CONSTEXPR size_t CheckSizeClasses(const SizeClassTables& t) {
+  for (size_t size = 0; size <= t.max_class_size; size++) {
+    const size_t sc = t.class_array[ClassIndex(size)];
+    if (sc == 0 || sc >= t.num_size_classes ||
+        (sc > 1 && size <= t.class_to_size[sc-1]) ||
+        size > t.class_to_size[sc]) {
+      return size + 1;
     }
-    if (sc >= kNumClasses) {
-      MESSAGE("Bad size class %d for %" PRIuS "\n", sc, size);
-      abort();
+  }
+  return 0;
+}
+
+#ifdef TCMALLOC_CONSTEXPR_SIZE_CLASSES
+// The tables of the default policy (size_class_policies[0])
+static constexpr SizeClassTables kDefaultSizeClasses =
+    ComputeSizeClasses(kDefaultMaxSize, 0);
+static_assert(kDefaultSizeClasses.num_size_classes != 0,
+              "too many size classes for kNumClasses");
+static_assert(CheckSizeClasses(kDefaultSizeClasses) == 0,
+              "bad default size classes");
+static SizeClassTables size_classes = kDefaultSizeClasses;
+#else
+// Set by InitSizeClasses()
+static SizeClassTables size_classes = { kDefaultMaxSize, kNumClasses };
+#endif
+
+// The tables by their own names
+static unsigned char (&class_array)[kClassArraySize] = size_classes.class_array;
+static size_t (&class_to_size)[kNumClasses] = size_classes.class_to_size;
+static size_t (&class_to_pages)[kNumClasses] = size_classes.class_to_pages;
+static int (&num_objects_to_move)[kNumClasses] =
+    size_classes.num_objects_to_move;
+static size_t& max_class_size = size_classes.max_class_size;
+static size_t& num_size_classes = size_classes.num_size_classes;
+
+static inline int SizeClass(size_t size) {
+  return class_array[ClassIndex(size)];
+}
+
+// Get the byte-size for a specified class
+static inline size_t ByteSizeForClass(size_t cl) {
+  return class_to_size[cl];
+}
+
+// Read the class sizes in file "path" into "sizes" (room for
+// kNumClasses - 1), returning how many there are, or -1 if the file
+// cannot be read or has too many.  Each line holds a size, and lines
+// starting with '#' are comments.  This runs on the first malloc, so
+// it reads with read() into a static buffer rather than with stdio.
+static int LoadSizeClasses(const char* path, size_t* sizes) {
+  static char buf[16384];
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  size_t len = 0;
+  ssize_t r;
+  while (len < sizeof(buf) - 1 &&
+         (r = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+    len += r;
+  }
+  close(fd);
+  buf[len] = '\0';
+  int n = 0;
+  for (char* line = buf; *line != '\0'; ) {
+    char* end = strchr(line, '\n');
+    if (end != NULL) *end = '\0';
+    while (*line == ' ' || *line == '\t') line++;
+    if (*line != '#' && *line != '\0' && *line != '\r') {
+      if (n == kNumClasses - 1) return -1;
+      sizes[n++] = strtoul(line, NULL, 10);
     }
-    const size_t s = class_to_size[sc];
-    if (size > s) {
-      MESSAGE("Bad size %" PRIuS " for %" PRIuS " (sc = %d)\n", s, size, sc);
-      abort();
+    if (end == NULL) break;
+    line = end + 1;
+  }
+  return n;
+}
+
+// Initialize the mapping arrays
+static void InitSizeClasses() {
+  // Do some sanity checking on base_index[]/shift_amount[]/class_array[]
+  if (ClassIndex(0) < 0) {
+    MESSAGE("Invalid class index %d for size 0\n", ClassIndex(0));
+    abort();
+  }
+  if (ClassIndex(kMaxSizeLimit) >= sizeof(class_array)) {
+    MESSAGE("Invalid class index %d for kMaxSizeLimit\n",
+            ClassIndex(kMaxSizeLimit));
+    abort();
+  }
+
+  // Read the environment directly: we get here on the first malloc,
+  // which may come before flags are constructed.
+  const SizeClassPolicy* policy = &size_class_policies[0];
+  const char* name = getenv("TCMALLOC_SIZE_CLASSES");
+  if (name != NULL && strchr(name, '/') != NULL) {
+    static size_t sizes[kNumClasses];
+    const int n = LoadSizeClasses(name, sizes);
+    if (n < 0) {
+      MESSAGE("tcmalloc: cannot read size classes from %s\n", name);
+    } else {
+      const SizeClassTables t = SizeClassesFromList(sizes, n);
+      if (t.num_size_classes != 0 && CheckSizeClasses(t) == 0) {
+        size_classes = t;
+        return;
+      }
+      MESSAGE("tcmalloc: bad size classes in %s\n", name);
     }
-    if (s == 0) {
-      MESSAGE("Bad size %" PRIuS " for %" PRIuS " (sc = %d)\n", s, size, sc);
-      abort();
+    name = NULL;
+  }
+  if (name != NULL) {
+    const int n = sizeof(size_class_policies) / sizeof(size_class_policies[0]);
+    int i = 0;
+    while (i < n && strcmp(name, size_class_policies[i].name) != 0) i++;
+    if (i < n) {
+      policy = &size_class_policies[i];
+    } else {
+      MESSAGE("tcmalloc: unknown size class policy %s\n", name);
     }
   }
+#ifdef TCMALLOC_CONSTEXPR_SIZE_CLASSES
+  // The default tables were built, and checked, by the compiler
+  if (policy == &size_class_policies[0]) return;
+#endif
 
-  // Initialize the num_objects_to_move array.
-  for (size_t cl = 1; cl  < kNumClasses; ++cl) {
-    num_objects_to_move[cl] = NumMoveSize(ByteSizeForClass(cl));
+  size_classes = ComputeSizeClasses(policy->max_size,
+                                    policy->lg_per_doubling);
+  if (num_size_classes == 0) {
+    MESSAGE("too many size classes: room for %d\n", int(kNumClasses));
+    abort();
+  }
+  const size_t bad = CheckSizeClasses(size_classes);
+  if (bad != 0) {
+    MESSAGE("Bad size class %d for %" PRIuS "\n",
+            int(class_array[ClassIndex(bad - 1)]), bad - 1);
+    abort();
   }
 
   if (false) {
     // Dump class sizes and maximum external wastage per size class
-    for (size_t cl = 1; cl  < kNumClasses; ++cl) {
+    for (size_t cl = 1; cl  < num_size_classes; ++cl) {
       const int alloc_size = class_to_pages[cl] << kPageShift;
       const int alloc_objs = alloc_size / class_to_size[cl];
       const int min_used = (class_to_size[cl-1] + 1) * alloc_objs;
@@ -608,7 +904,7 @@ static inline Length pages(size_t bytes) {
 // Convert a user size into the number of bytes that will actually be
 // allocated
 static size_t AllocationSize(size_t bytes) {
-  if (bytes > kMaxSize) {
+  if (bytes > max_class_size) {
     // Large object: we allocate an integral number of pages
     return pages(bytes) << kPageShift;
   } else {
@@ -628,6 +924,12 @@ struct Span {
   unsigned int  sample : 1;     // Sampled object?
   unsigned int  sizeclass : 8;  // Size-class for small objects (or 0)
   unsigned int  refcount : 11;  // Number of non-free objects
+  unsigned int  zeroed : 1;     // Pages known to be zero when allocated?
+  unsigned int  node : 3;       // NUMA node of the page heap that owns it
+  unsigned int  returned : 1;   // On a "returned" free list?
+  uint32_t      free_since;     // Page heap clock when span became free
+  Span*         left;           // Children in the large span tree, if
+  Span*         right;          //   it is a free span of >= kMaxPages
 
 #undef SPAN_HISTORY
 #ifdef SPAN_HISTORY
@@ -649,6 +951,16 @@ void Event(Span* span, char op, int v = 0) {
 #define Event(s,o,v) ((void) 0)
 #endif
 
+#ifdef TCMALLOC_PROBES
+#define PROBE1(name, a)        DTRACE_PROBE1(tcmalloc, name, a)
+#define PROBE2(name, a, b)     DTRACE_PROBE2(tcmalloc, name, a, b)
+#define PROBE3(name, a, b, c)  DTRACE_PROBE3(tcmalloc, name, a, b, c)
+#else
+#define PROBE1(name, a)        ((void) 0)
+#define PROBE2(name, a, b)     ((void) 0)
+#define PROBE3(name, a, b, c)  ((void) 0)
+#endif
+
 // Allocator/deallocator for spans
 static PageHeapAllocator<Span> span_allocator;
 static Span* NewSpan(PageID p, Length len) {
@@ -717,6 +1029,93 @@ static void DLL_Prepend(Span* list, Span* span) {
   list->next = span;
 }
 
+// -------------------------------------------------------------------------
+// Tree of large free spans, ordered by (length, start), so that the
+// best fit (the shortest span that is long enough, and the lowest of
+// those) is found in O(log n).  It is a treap: each span's priority is
+// a hash of its start, and a span has a higher priority than its
+// children, which keeps the tree balanced with high probability.
+// -------------------------------------------------------------------------
+
+static inline uint32_t SpanPriority(const Span* span) {
+  return static_cast<uint32_t>(
+      (static_cast<uint64_t>(span->start) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static inline bool SpanLess(const Span* a, const Span* b) {
+  return (a->length < b->length)
+      || ((a->length == b->length) && (a->start < b->start));
+}
+
+static Span* SpanTree_Insert(Span* root, Span* span) {
+  if (root == NULL) {
+    span->left = NULL;
+    span->right = NULL;
+    return span;
+  }
+  if (SpanLess(span, root)) {
+    root->left = SpanTree_Insert(root->left, span);
+    if (SpanPriority(root->left) > SpanPriority(root)) {
+      Span* top = root->left;
+      root->left = top->right;
+      top->right = root;
+      return top;
+    }
+  } else {
+    root->right = SpanTree_Insert(root->right, span);
+    if (SpanPriority(root->right) > SpanPriority(root)) {
+      Span* top = root->right;
+      root->right = top->left;
+      top->left = root;
+      return top;
+    }
+  }
+  return root;
+}
+
+// Join two trees, where every span in "a" is less than every one in "b".
+static Span* SpanTree_Join(Span* a, Span* b) {
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (SpanPriority(a) > SpanPriority(b)) {
+    a->right = SpanTree_Join(a->right, b);
+    return a;
+  } else {
+    b->left = SpanTree_Join(a, b->left);
+    return b;
+  }
+}
+
+static Span* SpanTree_Remove(Span* root, Span* span) {
+  ASSERT(root != NULL);
+  if (root == span) {
+    Span* result = SpanTree_Join(span->left, span->right);
+    span->left = NULL;
+    span->right = NULL;
+    return result;
+  }
+  if (SpanLess(span, root)) {
+    root->left = SpanTree_Remove(root->left, span);
+  } else {
+    root->right = SpanTree_Remove(root->right, span);
+  }
+  return root;
+}
+
+// The least span of length >= n, or NULL.
+static Span* SpanTree_BestFit(Span* root, Length n) {
+  Span* best = NULL;
+  while (root != NULL) {
+    if (root->length >= n) {
+      best = root;
+      root = root->left;
+    } else {
+      root = root->right;
+    }
+  }
+  return best;
+}
+
 // -------------------------------------------------------------------------
 // Stack traces kept for sampled allocations
 //   The following state is protected by pageheap_lock_.
@@ -727,10 +1126,32 @@ struct StackTrace {
   uintptr_t size;          // Size of object
   int       depth;         // Number of PC values stored in array below
   void*     stack[kMaxStackDepth];
+  uint64_t  alloc_time;    // When a sampled object was allocated (usec)
 };
 static PageHeapAllocator<StackTrace> stacktrace_allocator;
 static Span sampled_objects;
 
+// Lifetimes of sampled objects, in buckets of powers of two
+// microseconds: bucket 0 counts lifetimes under 1 usec, and bucket i
+// lifetimes in [2^(i-1), 2^i) usec; the last bucket takes the rest.
+static const int kLifetimeBuckets = 40;
+static uint64_t sampled_lifetimes[kLifetimeBuckets];
+
+static inline uint64_t NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static inline int LifetimeBucket(uint64_t usec) {
+  int bucket = 0;
+  while (usec > 0 && bucket < kLifetimeBuckets - 1) {
+    usec >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
 // Linked list of stack traces recorded every time we allocated memory
 // from the system.  Useful for finding allocation sites that cause
 // increase in the footprint of the system.  The linked list pointer
@@ -755,6 +1176,69 @@ template <> class MapSelector<32> {
   typedef TCMalloc_PageMap2<32-kPageShift> Type;
 };
 
+// Pick the appropriate map type based on pointer size
+typedef MapSelector<8*sizeof(uintptr_t)>::Type PageMap;
+
+// The map is shared by the page heaps of all NUMA nodes, so that the
+// span of any object can be found without knowing its node.  It is
+// constructed in TCMalloc_ThreadCache::InitModule(), and updated under
+// pageheap_lock like the page heaps.  Reads of the entries for pages
+// of live objects (as in do_free()) need no lock.
+static char pagemap_memory[sizeof(PageMap)];
+#define pagemap (reinterpret_cast<PageMap*>(pagemap_memory))
+
+// -------------------------------------------------------------------------
+// Size-class cache
+//
+// Finding the size class of an object through the pagemap costs a
+// walk of the radix tree and then a load from the span: dependent
+// cache misses on every free().  This direct-mapped cache, indexed by
+// the low bits of the page number, answers with a single load.  An
+// entry holds the rest of the page number as a tag, and the node and
+// size class of the page's span; the empty entry has size class 0,
+// which no small object has.
+//
+// The cache is read and filled without a lock.  An entry is written
+// in one store, and the entry for page "p" is only filled by freeing
+// an object on "p", and only cleared when the span holding "p" goes
+// back to the page heap -- when it has no objects left to free.
+// -------------------------------------------------------------------------
+
+static const int kPageMapCacheBits = 14;
+static const int kPageMapCacheValueBits = 8 + 3;  // Span::sizeclass, ::node
+static volatile uintptr_t pagemap_cache[1 << kPageMapCacheBits];
+
+static inline volatile uintptr_t* PageMapCache_Entry(PageID p) {
+  return &pagemap_cache[p & ((1 << kPageMapCacheBits) - 1)];
+}
+
+static inline uintptr_t PageMapCache_Tag(PageID p) {
+  return (p >> kPageMapCacheBits) << kPageMapCacheValueBits;
+}
+
+// Return the size class cached for page "p" and store its node in
+// "*node", or return 0 if it is not cached.
+static inline size_t PageMapCache_Get(PageID p, int* node) {
+  const uintptr_t entry = *PageMapCache_Entry(p);
+  if ((entry >> kPageMapCacheValueBits) != (p >> kPageMapCacheBits)) {
+    return 0;
+  }
+  *node = (entry >> 8) & 7;
+  return entry & 0xff;
+}
+
+static inline void PageMapCache_Put(PageID p, size_t cl, int node) {
+  ASSERT(cl > 0 && cl < 256 && node < 8);
+  *PageMapCache_Entry(p) = PageMapCache_Tag(p) | (node << 8) | cl;
+}
+
+static inline void PageMapCache_Clear(PageID p) {
+  volatile uintptr_t* entry = PageMapCache_Entry(p);
+  if ((*entry >> kPageMapCacheValueBits) == (p >> kPageMapCacheBits)) {
+    *entry = 0;
+  }
+}
+
 // -------------------------------------------------------------------------
 // Page-level allocator
 //  * Eager coalescing
@@ -763,9 +1247,20 @@ template <> class MapSelector<32> {
 // contiguous runs of pages (called a "span").
 // -------------------------------------------------------------------------
 
+// Ask the background prefaulter to refill the pools of prefaulted
+// spans (see "Background prefaulter" below).  REQUIRES: pageheap_lock
+static void WakePrefaulter();
+
+// Queue free span "span" (on no list) for the background releaser
+// (see "Background releaser" below), returning false if the caller
+// should release it itself.  REQUIRES: pageheap_lock
+static bool DeferRelease(Span* span);
+
 class TCMalloc_PageHeap {
  public:
-  TCMalloc_PageHeap();
+  // Create the page heap for NUMA node "node" (0 if we are not
+  // NUMA-aware).  Its system memory is bound to that node.
+  explicit TCMalloc_PageHeap(int node);
 
   // Allocate a run of "n" pages.  Returns zero if out of memory.
   // Caller should not pass "n == 0" -- instead, n should have
@@ -793,9 +1288,10 @@ class TCMalloc_PageHeap {
   // REQUIRES: span->sizeclass == 0
   Span* Split(Span* span, Length n);
 
-  // Return the descriptor for the specified page.
-  inline Span* GetDescriptor(PageID p) const {
-    return reinterpret_cast<Span*>(pagemap_.get(p));
+  // Return the descriptor for the specified page, whichever page heap
+  // it belongs to.
+  static inline Span* GetDescriptor(PageID p) {
+    return reinterpret_cast<Span*>(pagemap->get(p));
   }
 
   // Dump state to stderr
@@ -806,7 +1302,8 @@ class TCMalloc_PageHeap {
 
   // Return number of free bytes in heap
   uint64_t FreeBytes() const {
-    return (static_cast<uint64_t>(free_pages_) << kPageShift);
+    return (static_cast<uint64_t>(free_pages_ + prefaulted_pages_)
+            << kPageShift);
   }
 
   bool Check();
@@ -815,10 +1312,45 @@ class TCMalloc_PageHeap {
   // Release all pages on the free list for reuse by the OS:
   void ReleaseFreePages();
 
+  // Number of spans freed, and how many of them were merged with the
+  // free span before them, and after them.
+  uint64_t deletes() const { return deletes_; }
+  uint64_t coalesced_prev() const { return coalesced_prev_; }
+  uint64_t coalesced_next() const { return coalesced_next_; }
+
+  // Number of free spans of length >= kMaxPages
+  int large_spans() const { return large_spans_[0] + large_spans_[1]; }
+
+  // Are we only growing and releasing in whole huge pages?
+  bool huge_pages() const { return huge_pages_; }
+
+  // Pages in prefaulted spans, waiting for large allocations
+  Length prefaulted_pages() const { return prefaulted_pages_; }
+
+  // Number of pages the background prefaulter should take for the
+  // pool of prefaulted spans (0 once it holds "target" pages), and a
+  // span of that many pages for it to fault in with the lock dropped.
+  // AddPrefaulted() then puts the span, now backed and zero, in the
+  // pool.
+  Length PrefaultDeficit(Length target) const;
+  Span* NewForPrefault(Length n) { return Allocate(n); }
+  void AddPrefaulted(Span* span);
+
+  // Put a span that the background releaser has returned to the
+  // system on a "returned" list.  Until then it is on no list, and
+  // marked in use so that Delete() does not coalesce with it, but its
+  // pages still count as free.
+  void FinishRelease(Span* span);
+
+  // Advance the clock used to stamp free spans to "now" (in seconds),
+  // then release free spans that have not been reused for at least
+  // "age" seconds, stopping once at least "max_pages" pages have been
+  // released.  Returns the number of pages released.
+  Length ReleaseAgedPages(uint32_t now, uint32_t age, Length max_pages);
+
  private:
-  // Pick the appropriate map type based on pointer size
-  typedef MapSelector<8*sizeof(uintptr_t)>::Type PageMap;
-  PageMap pagemap_;
+  // NUMA node this heap gets its memory from
+  int node_;
 
   // We segregate spans of a given size into two circular linked
   // lists: one for normal spans, and one for spans whose memory
@@ -831,6 +1363,12 @@ class TCMalloc_PageHeap {
   // List of free spans of length >= kMaxPages
   SpanList large_;
 
+  // The same spans, in trees for best-fit searches: [0] for those on
+  // large_.normal, and [1] for those on large_.returned.  The lists
+  // keep the order they were freed in, for the scavengers.
+  Span* large_tree_[2];
+  int large_spans_[2];
+
   // Array mapping from span length to a doubly linked list of free spans
   SpanList free_[kMaxPages];
 
@@ -840,8 +1378,25 @@ class TCMalloc_PageHeap {
   // Bytes allocated from system
   uint64_t system_bytes_;
 
+  // Spans that the background prefaulter has faulted in and zeroed.
+  // As far as the rest of the heap is concerned they are allocated,
+  // but they count as free bytes.
+  Span prefaulted_;
+  Length prefaulted_pages_;
+
   bool GrowHeap(Length n);
 
+  // New() without the pool of prefaulted spans
+  Span* Allocate(Length n);
+
+  // Take a span of exactly "n" pages from the pool of prefaulted
+  // spans, leaving the rest of what it is cut from in the pool.
+  // Returns NULL if no span in the pool is big enough.
+  Span* TakePrefaulted(Length n);
+
+  // Give the pool back to the free lists
+  void DeletePrefaulted();
+
   // REQUIRES   span->length >= n
   // Remove span from its free list, and move any leftover part of
   // span into appropriate free lists.  Also update "span" to have
@@ -852,15 +1407,41 @@ class TCMalloc_PageHeap {
   void Carve(Span* span, Length n, bool released);
 
   void RecordSpan(Span* span) {
-    pagemap_.set(span->start, span);
+    span->node = node_;
+    pagemap->set(span->start, span);
     if (span->length > 1) {
-      pagemap_.set(span->start + span->length - 1, span);
+      pagemap->set(span->start + span->length - 1, span);
     }
   }
 
   // Allocate a large span of length == n.  If successful, returns a
   // span of exactly the specified length.  Else, returns NULL.
-  Span* AllocLarge(Length n);
+  // Spans on the "returned" list are only considered if
+  // "search_released" is true.
+  Span* AllocLarge(Length n, bool search_released);
+
+  // Split free span "span" (on no list) after its first "n" pages,
+  // and return the second part (also free and on no list).
+  Span* SplitFree(Span* span, Length n);
+
+  // Put free span "span" (on no list) on the list for its length.
+  // "old" spans go to the back of the list, others to the front.
+  void InsertFree(Span* span, bool released, bool old);
+
+  // Take free span "span" off its list.
+  void RemoveFree(Span* span);
+
+  // Check a large span tree, returning the number of spans in it.
+  int CheckTree(Span* root, bool released, const Span* lower,
+                const Span* upper);
+
+  // Return the pages of free span "span" (on no list) to the system,
+  // moving it to a "returned" list.  In huge page mode only the whole
+  // huge pages inside it are released: the unaligned ends are split
+  // off and stay on the normal lists.  Returns the number of pages
+  // released.  With "defer", a large span may instead be queued for
+  // the background releaser, and counts as released.
+  Length ReleaseSpan(Span* span, bool defer);
 
   // Incrementally release some memory to the system.
   // IncrementalScavenge(n) is called whenever n pages are freed.
@@ -871,17 +1452,42 @@ class TCMalloc_PageHeap {
 
   // Index of last free list we scavenged
   int scavenge_index_;
+
+  // Set from $TCMALLOC_HUGE_PAGES when the heap is created.  Keeping
+  // memory in whole, huge-page-aligned units lets the kernel back it
+  // with transparent huge pages, and releasing only fully free huge
+  // pages avoids breaking them up again.
+  bool huge_pages_;
+
+  // Time (as last passed to ReleaseAgedPages) to stamp free spans with.
+  // Spans are prepended to the normal lists as they become free, so
+  // each list is ordered from newest to oldest.
+  uint32_t clock_;
+
+  // Coalescing counters (see deletes())
+  uint64_t deletes_;
+  uint64_t coalesced_prev_;
+  uint64_t coalesced_next_;
 };
 
-TCMalloc_PageHeap::TCMalloc_PageHeap()
-    : pagemap_(MetaDataAlloc),
+TCMalloc_PageHeap::TCMalloc_PageHeap(int node)
+    : node_(node),
       free_pages_(0),
       system_bytes_(0),
+      prefaulted_pages_(0),
       scavenge_counter_(0),
       // Start scavenging at kMaxPages list
-      scavenge_index_(kMaxPages-1) {
+      scavenge_index_(kMaxPages-1),
+      huge_pages_(EnvToBool("TCMALLOC_HUGE_PAGES", false)),
+      clock_(0),
+      deletes_(0),
+      coalesced_prev_(0),
+      coalesced_next_(0) {
   DLL_Init(&large_.normal);
   DLL_Init(&large_.returned);
+  DLL_Init(&prefaulted_);
+  large_tree_[0] = large_tree_[1] = NULL;
+  large_spans_[0] = large_spans_[1] = 0;
   for (int i = 0; i < kMaxPages; i++) {
     DLL_Init(&free_[i].normal);
     DLL_Init(&free_[i].returned);
@@ -889,11 +1495,43 @@ TCMalloc_PageHeap::TCMalloc_PageHeap()
 }
 
 Span* TCMalloc_PageHeap::New(Length n) {
-  ASSERT(Check());
-
   // n==0 occurs iff pages() overflowed when we added kPageSize-1 to n
   if (n == 0) return NULL;
 
+  PROBE1(pageheap_new_start, n);
+  Span* result = NULL;
+  if (n >= kMinPrefaultPages && FLAGS_tcmalloc_prefault_bytes > 0) {
+    result = TakePrefaulted(n);
+    if (PrefaultDeficit(pages(FLAGS_tcmalloc_prefault_bytes)) > 0) {
+      WakePrefaulter();
+    }
+  }
+  if (result == NULL) result = Allocate(n);
+  PROBE2(pageheap_new_done, n, result);
+  return result;
+}
+
+Span* TCMalloc_PageHeap::Allocate(Length n) {
+  ASSERT(Check());
+  ASSERT(n > 0);
+
+  // In huge page mode, look at memory that is still backed first, so
+  // that spans are packed into huge pages that are already in use
+  // instead of faulting released ones back in.
+  if (huge_pages_) {
+    for (Length s = n; s < kMaxPages; s++) {
+      if (!DLL_IsEmpty(&free_[s].normal)) {
+        Span* result = free_[s].normal.next;
+        Carve(result, n, false);
+        ASSERT(Check());
+        free_pages_ -= n;
+        return result;
+      }
+    }
+    Span* result = AllocLarge(n, false);
+    if (result != NULL) return result;
+  }
+
   // Find first size >= n that has a non-empty list
   for (Length s = n; s < kMaxPages; s++) {
     Span* ll = NULL;
@@ -917,7 +1555,7 @@ Span* TCMalloc_PageHeap::New(Length n) {
     return result;
   }
 
-  Span* result = AllocLarge(n);
+  Span* result = AllocLarge(n, true);
   if (result != NULL) return result;
 
   // Grow the heap and try again
@@ -926,40 +1564,66 @@ Span* TCMalloc_PageHeap::New(Length n) {
     return NULL;
   }
 
-  return AllocLarge(n);
+  return AllocLarge(n, true);
 }
 
-Span* TCMalloc_PageHeap::AllocLarge(Length n) {
-  // find the best span (closest to n in size).
-  // The following loops implements address-ordered best-fit.
-  bool from_released = false;
-  Span *best = NULL;
-
-  // Search through normal list
-  for (Span* span = large_.normal.next;
-       span != &large_.normal;
-       span = span->next) {
-    if (span->length >= n) {
-      if ((best == NULL)
-          || (span->length < best->length)
-          || ((span->length == best->length) && (span->start < best->start))) {
-        best = span;
-        from_released = false;
-      }
+Span* TCMalloc_PageHeap::TakePrefaulted(Length n) {
+  // The pool holds a few large spans, so a linear best-fit search
+  // is cheap enough
+  Span* best = NULL;
+  for (Span* s = prefaulted_.next; s != &prefaulted_; s = s->next) {
+    if (s->length >= n && (best == NULL || s->length < best->length)) {
+      best = s;
     }
   }
+  if (best == NULL) return NULL;
+  DLL_Remove(best);
+  if (best->length > n) {
+    Span* rest = Split(best, n);
+    rest->zeroed = 1;
+    DLL_Prepend(&prefaulted_, rest);
+  }
+  prefaulted_pages_ -= n;
+  ASSERT(best->zeroed);
+  return best;
+}
 
-  // Search through released list in case it has a better fit
-  for (Span* span = large_.returned.next;
-       span != &large_.returned;
-       span = span->next) {
-    if (span->length >= n) {
-      if ((best == NULL)
-          || (span->length < best->length)
-          || ((span->length == best->length) && (span->start < best->start))) {
-        best = span;
-        from_released = true;
-      }
+Length TCMalloc_PageHeap::PrefaultDeficit(Length target) const {
+  if (prefaulted_pages_ >= target) return 0;
+  // Refill in whole chunks, so the pool does not end up in pieces too
+  // small for the allocations it is for
+  return (target < kMaxPrefaultPages) ? target : kMaxPrefaultPages;
+}
+
+void TCMalloc_PageHeap::AddPrefaulted(Span* span) {
+  ASSERT(!span->free);
+  ASSERT(span->sizeclass == 0);
+  span->zeroed = 1;
+  DLL_Prepend(&prefaulted_, span);
+  prefaulted_pages_ += span->length;
+}
+
+void TCMalloc_PageHeap::DeletePrefaulted() {
+  while (!DLL_IsEmpty(&prefaulted_)) {
+    Span* s = prefaulted_.next;
+    DLL_Remove(s);
+    prefaulted_pages_ -= s->length;
+    Delete(s);
+  }
+}
+
+Span* TCMalloc_PageHeap::AllocLarge(Length n, bool search_released) {
+  // find the best span (closest to n in size).
+  // The trees give address-ordered best-fit.
+  bool from_released = false;
+  Span *best = SpanTree_BestFit(large_tree_[0], n);
+
+  // Search through released spans in case they have a better fit
+  if (search_released) {
+    Span* span = SpanTree_BestFit(large_tree_[1], n);
+    if (span != NULL && (best == NULL || SpanLess(span, best))) {
+      best = span;
+      from_released = true;
     }
   }
 
@@ -983,7 +1647,7 @@ Span* TCMalloc_PageHeap::Split(Span* span, Length n) {
   Span* leftover = NewSpan(span->start + n, extra);
   Event(leftover, 'U', extra);
   RecordSpan(leftover);
-  pagemap_.set(span->start + n - 1, span); // Update map from pageid to span
+  pagemap->set(span->start + n - 1, span); // Update map from pageid to span
   span->length = n;
 
   return leftover;
@@ -991,8 +1655,11 @@ Span* TCMalloc_PageHeap::Split(Span* span, Length n) {
 
 void TCMalloc_PageHeap::Carve(Span* span, Length n, bool released) {
   ASSERT(n > 0);
-  DLL_Remove(span);
+  RemoveFree(span);
   span->free = 0;
+  // Released pages were handed back to the OS, so they will be
+  // faulted back in as zeroes.
+  span->zeroed = released && TCMalloc_SystemReleaseZeroes();
   Event(span, 'A', n);
 
   const int extra = span->length - n;
@@ -1000,16 +1667,15 @@ void TCMalloc_PageHeap::Carve(Span* span, Length n, bool released) {
   if (extra > 0) {
     Span* leftover = NewSpan(span->start + n, extra);
     leftover->free = 1;
+    leftover->free_since = clock_;
     Event(leftover, 'S', extra);
     RecordSpan(leftover);
 
     // Place leftover span on appropriate free list
-    SpanList* listpair = (extra < kMaxPages) ? &free_[extra] : &large_;
-    Span* dst = released ? &listpair->returned : &listpair->normal;
-    DLL_Prepend(dst, leftover);
+    InsertFree(leftover, released, false);
 
     span->length = n;
-    pagemap_.set(span->start + n - 1, span);
+    pagemap->set(span->start + n - 1, span);
   }
 }
 
@@ -1019,6 +1685,11 @@ void TCMalloc_PageHeap::Delete(Span* span) {
   ASSERT(span->length > 0);
   ASSERT(GetDescriptor(span->start) == span);
   ASSERT(GetDescriptor(span->start + span->length - 1) == span);
+  if (span->sizeclass != 0) {
+    for (Length i = 0; i < span->length; i++) {
+      PageMapCache_Clear(span->start + i);
+    }
+  }
   span->sizeclass = 0;
   span->sample = 0;
 
@@ -1032,38 +1703,39 @@ void TCMalloc_PageHeap::Delete(Span* span) {
   // "normal" list of the appropriate size class.
   const PageID p = span->start;
   const Length n = span->length;
+  // Spans of other nodes' heaps may be adjacent; leave those alone.
   Span* prev = GetDescriptor(p-1);
-  if (prev != NULL && prev->free) {
+  if (prev != NULL && prev->free && prev->node == node_) {
     // Merge preceding span into this span
     ASSERT(prev->start + prev->length == p);
     const Length len = prev->length;
-    DLL_Remove(prev);
+    RemoveFree(prev);
     DeleteSpan(prev);
     span->start -= len;
     span->length += len;
-    pagemap_.set(span->start, span);
+    pagemap->set(span->start, span);
     Event(span, 'L', len);
+    coalesced_prev_++;
   }
   Span* next = GetDescriptor(p+n);
-  if (next != NULL && next->free) {
+  if (next != NULL && next->free && next->node == node_) {
     // Merge next span into this span
     ASSERT(next->start == p+n);
     const Length len = next->length;
-    DLL_Remove(next);
+    RemoveFree(next);
     DeleteSpan(next);
     span->length += len;
-    pagemap_.set(span->start + span->length - 1, span);
+    pagemap->set(span->start + span->length - 1, span);
     Event(span, 'R', len);
+    coalesced_next_++;
   }
 
   Event(span, 'D', span->length);
   span->free = 1;
-  if (span->length < kMaxPages) {
-    DLL_Prepend(&free_[span->length].normal, span);
-  } else {
-    DLL_Prepend(&large_.normal, span);
-  }
+  span->free_since = clock_;
+  InsertFree(span, false, false);
   free_pages_ += n;
+  deletes_++;
 
   IncrementalScavenge(n);
   ASSERT(Check());
@@ -1073,6 +1745,7 @@ void TCMalloc_PageHeap::IncrementalScavenge(Length n) {
   // Fast path; not yet time to release memory
   scavenge_counter_ -= n;
   if (scavenge_counter_ >= 0) return;  // Not yet time to scavenge
+  PROBE1(scavenge_start, n);
 
   // Never delay scavenging for more than the following number of
   // deallocated pages.  With 4K pages, this comes to 4GB of
@@ -1087,6 +1760,7 @@ void TCMalloc_PageHeap::IncrementalScavenge(Length n) {
   if (rate <= 1e-6) {
     // Tiny release rate means that releasing is disabled.
     scavenge_counter_ = kDefaultReleaseDelay;
+    PROBE1(scavenge_done, 0);
     return;
   }
 
@@ -1095,19 +1769,20 @@ void TCMalloc_PageHeap::IncrementalScavenge(Length n) {
   for (int i = 0; i < kMaxPages+1; i++) {
     if (index > kMaxPages) index = 0;
     SpanList* slist = (index == kMaxPages) ? &large_ : &free_[index];
-    if (!DLL_IsEmpty(&slist->normal)) {
+    // In huge page mode, skip lists too short to hold a huge page
+    const bool too_short =
+        huge_pages_ && index < kMaxPages && index < kPagesPerHugePage;
+    if (!DLL_IsEmpty(&slist->normal) && !too_short) {
       // Release the last span on the normal portion of this list
       Span* s = slist->normal.prev;
-      DLL_Remove(s);
-      TCMalloc_SystemRelease(reinterpret_cast<void*>(s->start << kPageShift),
-                             static_cast<size_t>(s->length << kPageShift));
-      DLL_Prepend(&slist->returned, s);
+      RemoveFree(s);
+      const Length released = ReleaseSpan(s, true);
 
       // Compute how long to wait until we return memory.
       // FLAGS_tcmalloc_release_rate==1 means wait for 1000 pages
       // after releasing one page.
       const double mult = 1000.0 / rate;
-      double wait = mult * static_cast<double>(s->length);
+      double wait = mult * static_cast<double>(released > 0 ? released : 1);
       if (wait > kMaxReleaseDelay) {
         // Avoid overflow and bound to reasonable range
         wait = kMaxReleaseDelay;
@@ -1115,6 +1790,7 @@ void TCMalloc_PageHeap::IncrementalScavenge(Length n) {
       scavenge_counter_ = static_cast<int64_t>(wait);
 
       scavenge_index_ = index;  // Scavenge at index+1 next time
+      PROBE1(scavenge_done, released);
       return;
     }
     index++;
@@ -1122,6 +1798,109 @@ void TCMalloc_PageHeap::IncrementalScavenge(Length n) {
 
   // Nothing to scavenge, delay for a while
   scavenge_counter_ = kDefaultReleaseDelay;
+  PROBE1(scavenge_done, 0);
+}
+
+Length TCMalloc_PageHeap::ReleaseAgedPages(uint32_t now, uint32_t age,
+                                           Length max_pages) {
+  clock_ = now;
+  const Length unit = huge_pages_ ? kPagesPerHugePage : 1;
+  Length released = 0;
+  for (int index = 0; index <= kMaxPages && released < max_pages; index++) {
+    // In huge page mode, skip lists too short to hold a huge page
+    if (huge_pages_ && index < kMaxPages && index < kPagesPerHugePage) continue;
+    SpanList* slist = (index == kMaxPages) ? &large_ : &free_[index];
+    // ReleaseSpan() may put what it cannot release back at the front
+    // of the list, so look at each span at most once.
+    int limit = huge_pages_ ? DLL_Length(&slist->normal) : 0;
+    // Oldest spans are at the back
+    while (!DLL_IsEmpty(&slist->normal) && released < max_pages &&
+           (!huge_pages_ || limit-- > 0)) {
+      Span* s = slist->normal.prev;
+      if (now - s->free_since < age) break;
+      RemoveFree(s);
+      // Release just the tail if the whole span is over budget, and
+      // put the (still old) rest back at the end of its list.
+      const Length budget = ((max_pages - released + unit - 1) / unit) * unit;
+      const PageID end = (s->start + s->length) & ~(unit - 1);
+      if (end > s->start + budget) {
+        Span* tail = SplitFree(s, end - budget - s->start);
+        InsertFree(s, false, true);
+        s = tail;
+      }
+      released += ReleaseSpan(s, false);
+    }
+  }
+  return released;
+}
+
+Span* TCMalloc_PageHeap::SplitFree(Span* span, Length n) {
+  ASSERT(span->free);
+  ASSERT(0 < n);
+  ASSERT(n < span->length);
+  Span* rest = NewSpan(span->start + n, span->length - n);
+  rest->free = 1;
+  rest->free_since = span->free_since;
+  RecordSpan(rest);
+  span->length = n;
+  pagemap->set(span->start + n - 1, span);
+  return rest;
+}
+
+void TCMalloc_PageHeap::InsertFree(Span* span, bool released, bool old) {
+  SpanList* listpair = (span->length < kMaxPages) ? &free_[span->length] : &large_;
+  Span* list = released ? &listpair->returned : &listpair->normal;
+  // Prepending to the last element appends to the list
+  DLL_Prepend(old ? list->prev : list, span);
+  span->returned = released;
+  if (span->length >= kMaxPages) {
+    large_tree_[released] = SpanTree_Insert(large_tree_[released], span);
+    large_spans_[released]++;
+  }
+}
+
+void TCMalloc_PageHeap::RemoveFree(Span* span) {
+  DLL_Remove(span);
+  if (span->length >= kMaxPages) {
+    const int released = span->returned;
+    large_tree_[released] = SpanTree_Remove(large_tree_[released], span);
+    large_spans_[released]--;
+  }
+}
+
+Length TCMalloc_PageHeap::ReleaseSpan(Span* span, bool defer) {
+  if (huge_pages_) {
+    const PageID mask = kPagesPerHugePage - 1;
+    const PageID start = (span->start + mask) & ~mask;
+    const PageID end = (span->start + span->length) & ~mask;
+    if (start >= end) {
+      // No whole huge page is free
+      InsertFree(span, false, false);
+      return 0;
+    }
+    if (start > span->start) {
+      Span* rest = SplitFree(span, start - span->start);
+      InsertFree(span, false, false);
+      span = rest;
+    }
+    if (end < span->start + span->length) {
+      InsertFree(SplitFree(span, end - span->start), false, false);
+    }
+  }
+  if (defer && DeferRelease(span)) return span->length;
+  TCMalloc_SystemRelease(reinterpret_cast<void*>(span->start << kPageShift),
+                         static_cast<size_t>(span->length << kPageShift));
+  InsertFree(span, true, false);
+  return span->length;
+}
+
+void TCMalloc_PageHeap::FinishRelease(Span* span) {
+  ASSERT(!span->free);
+  ASSERT(span->node == node_);
+  span->free = 1;
+  span->free_since = clock_;
+  InsertFree(span, true, false);
+  ASSERT(Check());
 }
 
 void TCMalloc_PageHeap::RegisterSizeClass(Span* span, size_t sc) {
@@ -1132,7 +1911,7 @@ void TCMalloc_PageHeap::RegisterSizeClass(Span* span, size_t sc) {
   Event(span, 'C', sc);
   span->sizeclass = sc;
   for (Length i = 1; i < span->length-1; i++) {
-    pagemap_.set(span->start+i, span);
+    pagemap->set(span->start+i, span);
   }
 }
 
@@ -1199,6 +1978,9 @@ void TCMalloc_PageHeap::Dump(TCMalloc_Printer* out) {
               PagesToMB(total_normal + total_returned),
               PagesToMB(r_pages),
               PagesToMB(total_returned));
+  out->printf("Coalescing: %" PRIu64 " spans freed; %" PRIu64 " merged with the"
+              " span before, %" PRIu64 " with the span after\n",
+              deletes_, coalesced_prev_, coalesced_next_);
 }
 
 static void RecordGrowth(size_t growth) {
@@ -1212,15 +1994,27 @@ static void RecordGrowth(size_t growth) {
 bool TCMalloc_PageHeap::GrowHeap(Length n) {
   ASSERT(kMaxPages >= kMinSystemAlloc);
   Length ask = (n>kMinSystemAlloc) ? n : static_cast<Length>(kMinSystemAlloc);
-  void* ptr = TCMalloc_SystemAlloc(ask << kPageShift, kPageSize);
+  // In huge page mode, grow by whole, aligned huge pages
+  const Length unit = huge_pages_ ? kPagesPerHugePage : 1;
+  const size_t alignment = huge_pages_ ? kHugePageSize : kPageSize;
+  if (n > (static_cast<Length>(-1) >> kPageShift) - unit) {
+    return false;               // Rounding up would overflow
+  }
+  ask = ((ask + unit - 1) / unit) * unit;
+  size_t actual;
+  void* ptr = TCMalloc_SystemAllocPages(ask << kPageShift, &actual, alignment);
   if (ptr == NULL) {
     if (n < ask) {
       // Try growing just "n" pages
-      ask = n;
-      ptr = TCMalloc_SystemAlloc(ask << kPageShift, kPageSize);
+      ask = ((n + unit - 1) / unit) * unit;
+      ptr = TCMalloc_SystemAllocPages(ask << kPageShift, &actual, alignment);
     }
     if (ptr == NULL) return false;
   }
+  // An added system allocator may have rounded the request up
+  ask = ((actual >> kPageShift) / unit) * unit;
+  if (huge_pages_) TCMalloc_SystemAdviseHugePages(ptr, ask << kPageShift);
+  if (num_numa_nodes > 1) TCMalloc_SystemBindToNode(ptr, ask << kPageShift, node_);
   RecordGrowth(ask << kPageShift);
 
   uint64_t old_system_bytes = system_bytes_;
@@ -1234,13 +2028,13 @@ bool TCMalloc_PageHeap::GrowHeap(Length n) {
 
   if (old_system_bytes < kPageMapBigAllocationThreshold
       && system_bytes_ >= kPageMapBigAllocationThreshold) {
-    pagemap_.PreallocateMoreMemory();
+    pagemap->PreallocateMoreMemory();
   }
 
   // Make sure pagemap_ has entries for all of the new pages.
   // Plus ensure one before and one after so coalescing code
   // does not need bounds-checking.
-  if (pagemap_.Ensure(p-1, ask+2)) {
+  if (pagemap->Ensure(p-1, ask+2)) {
     // Pretend the new area is allocated and then Delete() it to
     // cause any necessary coalescing to occur.
     //
@@ -1248,6 +2042,16 @@ bool TCMalloc_PageHeap::GrowHeap(Length n) {
     Span* span = NewSpan(p, ask);
     RecordSpan(span);
     Delete(span);
+    // Untouched system memory is as good as released memory: if it did
+    // not coalesce with anything, keep it on a "returned" list so that
+    // a large calloc() carved from it can skip clearing it.
+    if (TCMalloc_SystemReleaseZeroes()) {
+      span = GetDescriptor(p);
+      if (span->start == p && span->length == ask) {
+        RemoveFree(span);
+        InsertFree(span, true, false);
+      }
+    }
     ASSERT(Check());
     return true;
   } else {
@@ -1262,6 +2066,12 @@ bool TCMalloc_PageHeap::Check() {
   ASSERT(free_[0].returned.next == &free_[0].returned);
   CheckList(&large_.normal, kMaxPages, 1000000000);
   CheckList(&large_.returned, kMaxPages, 1000000000);
+  CHECK_CONDITION(CheckTree(large_tree_[0], false, NULL, NULL)
+                  == DLL_Length(&large_.normal));
+  CHECK_CONDITION(CheckTree(large_tree_[1], true, NULL, NULL)
+                  == DLL_Length(&large_.returned));
+  CHECK_CONDITION(large_spans_[0] == DLL_Length(&large_.normal));
+  CHECK_CONDITION(large_spans_[1] == DLL_Length(&large_.returned));
   for (Length s = 1; s < kMaxPages; s++) {
     CheckList(&free_[s].normal, s, s);
     CheckList(&free_[s].returned, s, s);
@@ -1280,23 +2090,44 @@ bool TCMalloc_PageHeap::CheckList(Span* list, Length min_pages, Length max_pages
   return true;
 }
 
-static void ReleaseFreeList(Span* list, Span* returned) {
-  // Walk backwards through list so that when we push these
-  // spans on the "returned" list, we preserve the order.
-  while (!DLL_IsEmpty(list)) {
-    Span* s = list->prev;
-    DLL_Remove(s);
-    DLL_Prepend(returned, s);
-    TCMalloc_SystemRelease(reinterpret_cast<void*>(s->start << kPageShift),
-                           static_cast<size_t>(s->length << kPageShift));
-  }
+int TCMalloc_PageHeap::CheckTree(Span* root, bool released,
+                                 const Span* lower, const Span* upper) {
+  if (root == NULL) return 0;
+  CHECK_CONDITION(root->free);
+  CHECK_CONDITION(root->returned == released);
+  CHECK_CONDITION(root->length >= kMaxPages);
+  CHECK_CONDITION(lower == NULL || SpanLess(lower, root));
+  CHECK_CONDITION(upper == NULL || SpanLess(root, upper));
+  CHECK_CONDITION(root->left == NULL
+                  || SpanPriority(root->left) <= SpanPriority(root));
+  CHECK_CONDITION(root->right == NULL
+                  || SpanPriority(root->right) <= SpanPriority(root));
+  return 1 + CheckTree(root->left, released, lower, root)
+           + CheckTree(root->right, released, root, upper);
 }
 
 void TCMalloc_PageHeap::ReleaseFreePages() {
-  for (Length s = 0; s < kMaxPages; s++) {
-    ReleaseFreeList(&free_[s].normal, &free_[s].returned);
+  // The prefaulter fills the pool again on the next large allocation
+  DeletePrefaulted();
+  for (Length index = 0; index <= kMaxPages; index++) {
+    Span* list = (index == kMaxPages) ? &large_.normal : &free_[index].normal;
+    if (DLL_IsEmpty(list)) continue;
+    // Detach the list first, since ReleaseSpan() may put parts it
+    // cannot release back on it
+    Span detached;
+    detached.next = list->next;
+    detached.prev = list->prev;
+    detached.next->prev = &detached;
+    detached.prev->next = &detached;
+    DLL_Init(list);
+    // Walk backwards through the list so that when we push these
+    // spans on the "returned" list, we preserve the order.
+    while (!DLL_IsEmpty(&detached)) {
+      Span* s = detached.prev;
+      RemoveFree(s);
+      ReleaseSpan(s, false);
+    }
   }
-  ReleaseFreeList(&large_.normal, &large_.returned);
   ASSERT(Check());
 }
 
@@ -1365,12 +2196,20 @@ class TCMalloc_ThreadCache {
   typedef TCMalloc_ThreadCache_FreeList FreeList;
 
   size_t        size_;                  // Combined size of data
+  size_t        max_size_;              // size_ > max_size_ --> Scavenge()
+  int           misses_;                // Central cache fetches since Scavenge()
+  int           node_;                  // NUMA node all cached objects are from
   pthread_t     tid_;                   // Which thread owns it
   bool          in_setspecific_;        // In call to pthread_setspecific?
   FreeList      list_[kNumClasses];     // Array indexed by size-class
 
+  // Freed large objects, least recently freed first
+  Span*         spans_[kSpanCacheSlots];
+  int           num_spans_;
+  size_t        span_bytes_;            // Combined size of spans_
+
   // We sample allocations, biased by the size of the allocation
-  uint32_t      rnd_;                   // Cheap random number generator
+  uint64_t      rnd_;                   // Cheap random number generator
   size_t        bytes_until_sample_;    // Bytes until we sample next
 
   // Allocate a new heap. REQUIRES: pageheap_lock is held.
@@ -1383,29 +2222,45 @@ class TCMalloc_ThreadCache {
   TCMalloc_ThreadCache* next_;
   TCMalloc_ThreadCache* prev_;
 
-  void Init(pthread_t tid);
+  // REQUIRES: pageheap_lock is held (to claim a budget)
+  void Init(pthread_t tid, int node);
   void Cleanup();
 
   // Accessors (mostly just for printing stats)
   int freelist_length(size_t cl) const { return list_[cl].length(); }
 
   // Total byte size in cache
-  size_t Size() const { return size_; }
+  size_t Size() const { return size_ + span_bytes_; }
+
+  // Only objects from this NUMA node may be put in the cache
+  int node() const { return node_; }
 
   void* Allocate(size_t size);
   void Deallocate(void* ptr, size_t size_class);
 
   void FetchFromCentralCache(size_t cl);
   void ReleaseToCentralCache(size_t cl, int N);
+
+  // Return a cached span of "n" pages, or NULL if there is none.
+  Span* AllocateSpan(Length n);
+  // Cache "span", a large object being freed, giving back older spans
+  // to make room if need be.  Returns false if "span" cannot be
+  // cached, and must go back to the page heap.
+  bool DeallocateSpan(Span* span);
+  // Give the "n" least recently freed spans back to the page heap.
+  void ReleaseSpans(int n);
   void Scavenge();
   void Print() const;
 
+  // Grow max_size_ by up to kStealAmount.  REQUIRES: pageheap_lock is held.
+  void IncreaseCacheLimitLocked();
+
   // Record allocation of "k" bytes.  Return true iff allocation
   // should be sampled
   bool SampleAllocation(size_t k);
 
   // Pick next sampling point
-  void PickNextSample(size_t k);
+  void PickNextSample();
 
   static void                  InitModule();
   static void                  InitTSD();
@@ -1419,13 +2274,129 @@ class TCMalloc_ThreadCache {
 };
 
 //-------------------------------------------------------------------
-// Data kept per size-class in central cache
+// Lock-free transfer ring
 //-------------------------------------------------------------------
 
-class TCMalloc_Central_FreeList {
+// A small bounded queue of object batches (TCEntry) that any number of
+// threads may push to and pop from without a lock, after Dmitry
+// Vyukov's bounded MPMC queue.  Every cell has a sequence number
+// saying whose turn it is: for position "pos", a producer waits for
+// sequence pos and a consumer for pos+1.  Claiming a position takes a
+// single compare-and-swap.
+class TCMalloc_TransferRing {
  public:
-  void Init(size_t cl);
-
+  void Init() {
+    for (int i = 0; i < kSize; i++) {
+      cells_[i].sequence = i;
+    }
+    enqueue_pos_ = 0;
+    dequeue_pos_ = 0;
+  }
+
+  // Returns false if the ring is full.
+  bool Push(void* head, void* tail) {
+    Atomic32 pos = Acquire_Load(&enqueue_pos_);
+    for (;;) {
+      Cell* cell = &cells_[pos & (kSize - 1)];
+      const int32_t diff = Distance(Acquire_Load(&cell->sequence), pos);
+      if (diff == 0) {
+        const Atomic32 prev = CompareAndSwap(&enqueue_pos_, pos, Next(pos, 1));
+        if (prev == pos) {
+          cell->entry.head = head;
+          cell->entry.tail = tail;
+          Release_Store(&cell->sequence, Next(pos, 1));
+          return true;
+        }
+        pos = prev;
+      } else if (diff < 0) {
+        return false;           // The consumer has not emptied this cell
+      } else {
+        pos = Acquire_Load(&enqueue_pos_);
+      }
+    }
+  }
+
+  // Returns false if the ring is empty.
+  bool Pop(void** head, void** tail) {
+    Atomic32 pos = Acquire_Load(&dequeue_pos_);
+    for (;;) {
+      Cell* cell = &cells_[pos & (kSize - 1)];
+      const int32_t diff = Distance(Acquire_Load(&cell->sequence), Next(pos, 1));
+      if (diff == 0) {
+        const Atomic32 prev = CompareAndSwap(&dequeue_pos_, pos, Next(pos, 1));
+        if (prev == pos) {
+          *head = cell->entry.head;
+          *tail = cell->entry.tail;
+          Release_Store(&cell->sequence, Next(pos, kSize));
+          return true;
+        }
+        pos = prev;
+      } else if (diff < 0) {
+        return false;           // No producer has filled this cell
+      } else {
+        pos = Acquire_Load(&dequeue_pos_);
+      }
+    }
+  }
+
+  // Number of batches in the ring (approximate while it is in use).
+  int length() const {
+    const int32_t n = Distance(Acquire_Load(&enqueue_pos_),
+                               Acquire_Load(&dequeue_pos_));
+    return (n < 0) ? 0 : (n > kSize ? kSize : n);
+  }
+
+ private:
+  // Number of cells; a power of two.  Batches in the ring are not
+  // counted against the transfer cache quota, so keep this small.
+  static const int kSize = 4;
+
+  struct Cell {
+    volatile Atomic32 sequence;
+    TCEntry           entry;
+  };
+
+  // Positions wrap around, so compare them modulo 2^32
+  static inline int32_t Distance(Atomic32 a, Atomic32 b) {
+    return static_cast<int32_t>(static_cast<uint32_t>(a) -
+                                static_cast<uint32_t>(b));
+  }
+  static inline Atomic32 Next(Atomic32 pos, int n) {
+    return static_cast<Atomic32>(static_cast<uint32_t>(pos) + n);
+  }
+
+  Cell              cells_[kSize];
+  // Keep producers and consumers off each other's cache line
+  char              pad0_[64];
+  volatile Atomic32 enqueue_pos_;
+  char              pad1_[64];
+  volatile Atomic32 dequeue_pos_;
+};
+
+//-------------------------------------------------------------------
+// Data kept per size-class in central cache
+//-------------------------------------------------------------------
+
+// Spans of one size class, for the fragmentation report.  Objects
+// count as live once they leave their span, even if they are sitting
+// in a thread cache or the transfer cache.
+static const int kOccupancyBuckets = 11;
+struct TCMalloc_ClassSpanStats {
+  uint64_t spans;               // Spans carved into objects of the class
+  uint64_t pages;               // Pages in those spans
+  uint64_t objects;             // Objects those spans hold
+  uint64_t live;                // Objects taken out of those spans
+  uint64_t stranded_bytes;      // Free bytes in spans with live objects
+  // Spans by the fraction of their objects that are live: bucket i
+  // counts [i/10, (i+1)/10), and the last bucket full spans
+  uint64_t occupancy[kOccupancyBuckets];
+};
+
+class TCMalloc_Central_FreeList {
+ public:
+  // Initialize the list for size class "cl" of NUMA node "node"
+  void Init(size_t cl, int node);
+
   // These methods all do internal locking.
 
   // Insert the specified range into the central freelist.  N is the number of
@@ -1441,12 +2412,27 @@ class TCMalloc_Central_FreeList {
     return counter_;
   }
 
+  // Add the statistics of our spans to "*stats".
+  void AddSpanStats(TCMalloc_ClassSpanStats* stats);
+
   // Returns the number of free objects in the transfer cache.
   int tc_length() {
     SpinLockHolder h(&lock_);
-    return used_slots_ * num_objects_to_move[size_class_];
+    return (used_slots_ + ring_.length()) * num_objects_to_move[size_class_];
   }
 
+  // Returns how often lock_ has been contended.  Takes no lock.
+  int64 lock_contentions() const { return lock_.Contentions(); }
+
+  // Hold the list still across fork() (see TCMalloc_PrepareFork).
+  void LockForFork() { lock_.Lock(); }
+  void UnlockForFork() { lock_.Unlock(); }
+
+  // Empty the transfer ring, which another thread may have been part
+  // way through pushing to or popping from when the child was forked.
+  // The batches in it are not freed.
+  void ResetRingAfterFork() { ring_.Init(); }
+
  private:
   // REQUIRES: lock_ is held
   // Remove object from cache and return.
@@ -1474,18 +2460,25 @@ class TCMalloc_Central_FreeList {
   // May temporarily release lock_.
   void Populate();
 
+  // Which of the nonempty_ lists "span" belongs on, by how many of its
+  // objects are live
+  int OccupancyList(const Span* span) const {
+    return span->refcount * kOccupancyLists / objects_per_span_;
+  }
+
   // REQUIRES: lock is held.
   // Tries to make room for a TCEntry.  If the cache is full it will try to
   // expand it at the cost of some other cache size.  Return false if there is
   // no space.
   bool MakeCacheSpace();
 
-  // REQUIRES: lock_ for locked_size_class is held.
+  // REQUIRES: lock_ for locked_size_class (of this node) is held.
   // Picks a "random" size class to steal TCEntry slot from.  In reality it
   // just iterates over the sizeclasses but does so without taking a lock.
   // Returns true on success.
   // May temporarily lock a "random" size class.
-  static bool EvictRandomSizeClass(int locked_size_class, bool force);
+  static bool EvictRandomSizeClass(int node, int locked_size_class,
+                                   bool force);
 
   // REQUIRES: lock_ is *not* held.
   // Tries to shrink the Cache.  If force is true it will relase objects to
@@ -1500,10 +2493,17 @@ class TCMalloc_Central_FreeList {
   // may be looked at without holding the lock.
   SpinLock lock_;
 
-  // We keep linked lists of empty and non-empty spans.
+  // We keep linked lists of empty and non-empty spans.  Non-empty
+  // spans are kept on kOccupancyLists lists by the fraction of their
+  // objects that are live, and objects are fetched from the fullest
+  // span there is, so that nearly empty spans drain and go back to the
+  // page heap instead of being kept alive by a few objects each.
+  static const int kOccupancyLists = 8;
   size_t   size_class_;     // My size class
+  int      node_;           // NUMA node whose page heap I use
+  size_t   objects_per_span_;  // Objects in a span of my size class
   Span     empty_;          // Dummy header for list of empty spans
-  Span     nonempty_;       // Dummy header for list of non-empty spans
+  Span     nonempty_[kOccupancyLists];  // Dummy headers, emptiest first
   size_t   counter_;        // Number of free objects in cache entry
 
   // Here we reserve space for TCEntry cache slots.  Since one size class can
@@ -1518,6 +2518,11 @@ class TCMalloc_Central_FreeList {
   // adaptive value that is increased if there is lots of traffic
   // on a given size class.
   int32_t cache_size_;
+
+  // Full batches go through here first, without lock_, so that a batch
+  // released by one thread can be fetched by another without either
+  // one contending for the central list.
+  TCMalloc_TransferRing ring_;
 };
 
 // Pad each CentralCache object to multiple of 64 bytes
@@ -1531,17 +2536,29 @@ class TCMalloc_Central_FreeListPadded : public TCMalloc_Central_FreeList {
 //-------------------------------------------------------------------
 
 // Central cache -- a collection of free-lists, one per size-class.
-// We have a separate lock per free-list to reduce contention.
-static TCMalloc_Central_FreeListPadded central_cache[kNumClasses];
+// We have a separate lock per free-list to reduce contention.  Each
+// NUMA node has its own central cache (node 0's is statically
+// allocated), holding only objects from that node's page heap.
+static TCMalloc_Central_FreeListPadded central_cache0[kNumClasses];
+static TCMalloc_Central_FreeListPadded* central_cache[kMaxNumaNodes] = {
+  central_cache0
+};
 
-// Page-level allocator
+// Page-level allocators, one per NUMA node.  They all share
+// pageheap_lock and pagemap.  Node 0's lives in pageheap_memory.
 static SpinLock pageheap_lock(SpinLock::LINKER_INITIALIZED);
 static char pageheap_memory[sizeof(TCMalloc_PageHeap)];
+static TCMalloc_PageHeap* pageheaps[kMaxNumaNodes];
 static bool phinited = false;
 
-// Avoid extra level of indirection by making "pageheap" be just an alias
-// of pageheap_memory.
-#define pageheap ((TCMalloc_PageHeap*) pageheap_memory)
+// NUMA node of each CPU (NULL if we are not NUMA-aware).  Written
+// once during module initialization.
+static unsigned char* cpu_to_node = NULL;
+static int num_node_cpus = 0;
+
+// The NUMA node the calling thread is running on (always 0 if we are
+// not NUMA-aware).
+static inline int CurrentNode();
 
 // If TLS is available, we also store a copy
 // of the per-thread object in a __thread variable
@@ -1571,25 +2588,89 @@ static int thread_heap_count = 0;
 // Overall thread cache size.  Protected by pageheap_lock.
 static size_t overall_thread_cache_size = kDefaultOverallThreadCacheSize;
 
-// Global per-thread cache size.  Writes are protected by
-// pageheap_lock.  Reads are done without any locking, which should be
-// fine as long as size_t can be written atomically and we don't place
-// invariants between this variable and other pieces of state.
-static volatile size_t per_thread_cache_size = kMaxThreadCacheSize;
+// Fair share of overall_thread_cache_size for each cache.  Protected
+// by pageheap_lock.  Caches start out with (up to) this much budget in
+// max_size_; busy caches then take budget from idle ones.
+static size_t per_thread_cache_size = kMaxThreadCacheSize;
+
+// Part of overall_thread_cache_size not in any cache's max_size_
+// (negative if caches have claimed more).  Protected by pageheap_lock.
+static ssize_t unclaimed_cache_space = kDefaultOverallThreadCacheSize;
+
+// Next thread cache to steal budget from.  Protected by pageheap_lock.
+static TCMalloc_ThreadCache* next_memory_steal = NULL;
+
+// Writes to each cache's max_size_ are protected by pageheap_lock.  Its
+// owner reads it without any locking, which should be fine as long as
+// size_t can be written atomically and we don't place invariants
+// between it and other pieces of state.
+
+//-------------------------------------------------------------------
+// Data kept per CPU
+//-------------------------------------------------------------------
+
+// If TCMALLOC_PER_CPU_CACHES is set when the module is initialized,
+// small objects are cached per CPU instead of per thread, so the
+// memory held in caches scales with the number of cores rather than
+// the number of threads.  Each CPU cache is an ordinary
+// TCMalloc_ThreadCache guarded by its own spinlock (a thread can be
+// preempted or migrated while using it); the lock is almost never
+// contended, since only threads running on that CPU take it.
+class TCMalloc_CPUCache {
+ private:
+  SpinLock              lock_;
+  TCMalloc_ThreadCache* heap_;
+  // Keep the locks of neighboring CPUs on separate cache lines
+  char                  pad_[64 - sizeof(SpinLock) - sizeof(void*)];
+
+ public:
+  // Lock this cache and return it
+  TCMalloc_ThreadCache* Lock() {
+    lock_.Lock();
+    return heap_;
+  }
+  void Unlock() { lock_.Unlock(); }
+
+  // Unlocked access (for stats and budget bookkeeping)
+  TCMalloc_ThreadCache* heap() const { return heap_; }
+
+  // Create the per-CPU caches, if they were asked for.
+  // REQUIRES: pageheap_lock is held.
+  static void InitModule();
+
+  // Return the cache of the CPU we are running on, or NULL if we
+  // are using per-thread caches.
+  static inline TCMalloc_CPUCache* GetCurrent();
+};
+
+// Array of per-CPU caches, or NULL if we are using per-thread caches.
+// Written once under pageheap_lock during module initialization.
+static TCMalloc_CPUCache* cpu_caches = NULL;
+static int num_cpu_caches = 0;
 
 //-------------------------------------------------------------------
 // Central cache implementation
 //-------------------------------------------------------------------
 
-void TCMalloc_Central_FreeList::Init(size_t cl) {
+void TCMalloc_Central_FreeList::Init(size_t cl, int node) {
   size_class_ = cl;
+  node_ = node;
+  // Classes past num_size_classes are never used, and have no size
+  const size_t size = ByteSizeForClass(cl);
+  objects_per_span_ = 1;
+  if (size != 0 && class_to_pages[cl] != 0) {
+    objects_per_span_ = (class_to_pages[cl] << kPageShift) / size;
+  }
   DLL_Init(&empty_);
-  DLL_Init(&nonempty_);
+  for (int i = 0; i < kOccupancyLists; i++) {
+    DLL_Init(&nonempty_[i]);
+  }
   counter_ = 0;
 
   cache_size_ = 1;
   used_slots_ = 0;
   ASSERT(cache_size_ <= kNumTransferEntries);
+  ring_.Init();
 }
 
 void TCMalloc_Central_FreeList::ReleaseListToSpans(void* start) {
@@ -1602,16 +2683,13 @@ void TCMalloc_Central_FreeList::ReleaseListToSpans(void* start) {
 
 void TCMalloc_Central_FreeList::ReleaseToSpans(void* object) {
   const PageID p = reinterpret_cast<uintptr_t>(object) >> kPageShift;
-  Span* span = pageheap->GetDescriptor(p);
+  Span* span = TCMalloc_PageHeap::GetDescriptor(p);
   ASSERT(span != NULL);
   ASSERT(span->refcount > 0);
+  ASSERT(span->node == node_);
 
-  // If span is empty, move it to non-empty list
-  if (span->objects == NULL) {
-    DLL_Remove(span);
-    DLL_Prepend(&nonempty_, span);
-    Event(span, 'N', 0);
-  }
+  // The list the span is on now, if it is non-empty
+  const int list = (span->objects == NULL) ? -1 : OccupancyList(span);
 
   // The following check is expensive, so it is disabled by default
   if (false) {
@@ -1636,17 +2714,47 @@ void TCMalloc_Central_FreeList::ReleaseToSpans(void* object) {
     lock_.Unlock();
     {
       SpinLockHolder h(&pageheap_lock);
-      pageheap->Delete(span);
+      pageheaps[node_]->Delete(span);
     }
     lock_.Lock();
   } else {
     *(reinterpret_cast<void**>(object)) = span->objects;
     span->objects = object;
+    // Move the span to the non-empty list for its new occupancy
+    const int new_list = OccupancyList(span);
+    if (new_list != list) {
+      DLL_Remove(span);
+      DLL_Prepend(&nonempty_[new_list], span);
+      if (list < 0) Event(span, 'N', 0);
+    }
+  }
+}
+
+void TCMalloc_Central_FreeList::AddSpanStats(TCMalloc_ClassSpanStats* stats) {
+  SpinLockHolder h(&lock_);
+  const size_t size = ByteSizeForClass(size_class_);
+  Span* lists[1 + kOccupancyLists];
+  lists[0] = &empty_;
+  for (int i = 0; i < kOccupancyLists; i++) {
+    lists[1 + i] = &nonempty_[i];
+  }
+  for (int i = 0; i < 1 + kOccupancyLists; i++) {
+    for (Span* span = lists[i]->next; span != lists[i]; span = span->next) {
+      const uint64_t objects = (span->length << kPageShift) / size;
+      const uint64_t live = span->refcount;
+      stats->spans++;
+      stats->pages += span->length;
+      stats->objects += objects;
+      stats->live += live;
+      // Spans with no live objects go straight back to the page heap
+      stats->stranded_bytes += (objects - live) * size;
+      stats->occupancy[live * (kOccupancyBuckets - 1) / objects]++;
+    }
   }
 }
 
 bool TCMalloc_Central_FreeList::EvictRandomSizeClass(
-    int locked_size_class, bool force) {
+    int node, int locked_size_class, bool force) {
   static int race_counter = 0;
   int t = race_counter++;  // Updated without a lock, but who cares.
   if (t >= kNumClasses) {
@@ -1658,7 +2766,7 @@ bool TCMalloc_Central_FreeList::EvictRandomSizeClass(
   ASSERT(t >= 0);
   ASSERT(t < kNumClasses);
   if (t == locked_size_class) return false;
-  return central_cache[t].ShrinkCache(locked_size_class, force);
+  return central_cache[node][t].ShrinkCache(locked_size_class, force);
 }
 
 bool TCMalloc_Central_FreeList::MakeCacheSpace() {
@@ -1667,8 +2775,8 @@ bool TCMalloc_Central_FreeList::MakeCacheSpace() {
   // Check if we can expand this cache?
   if (cache_size_ == kNumTransferEntries) return false;
   // Ok, we'll try to grab an entry from some other size class.
-  if (EvictRandomSizeClass(size_class_, false) ||
-      EvictRandomSizeClass(size_class_, true)) {
+  if (EvictRandomSizeClass(node_, size_class_, false) ||
+      EvictRandomSizeClass(node_, size_class_, true)) {
     // Succeeded in evicting, we're going to make our cache larger.
     cache_size_++;
     return true;
@@ -1698,7 +2806,7 @@ bool TCMalloc_Central_FreeList::ShrinkCache(int locked_size_class, bool force) {
   // the lock inverter to ensure that we never hold two size class locks
   // concurrently.  That can create a deadlock because there is no well
   // defined nesting order.
-  LockInverter li(&central_cache[locked_size_class].lock_, &lock_);
+  LockInverter li(&central_cache[node_][locked_size_class].lock_, &lock_);
   ASSERT(used_slots_ <= cache_size_);
   ASSERT(0 <= cache_size_);
   if (cache_size_ == 0) return false;
@@ -1716,6 +2824,9 @@ bool TCMalloc_Central_FreeList::ShrinkCache(int locked_size_class, bool force) {
 }
 
 void TCMalloc_Central_FreeList::InsertRange(void *start, void *end, int N) {
+  if (N == num_objects_to_move[size_class_] && ring_.Push(start, end)) {
+    return;
+  }
   SpinLockHolder h(&lock_);
   if (N == num_objects_to_move[size_class_] &&
     MakeCacheSpace()) {
@@ -1734,6 +2845,10 @@ void TCMalloc_Central_FreeList::RemoveRange(void **start, void **end, int *N) {
   int num = *N;
   ASSERT(num > 0);
 
+  if (num == num_objects_to_move[size_class_] && ring_.Pop(start, end)) {
+    return;
+  }
+
   SpinLockHolder h(&lock_);
   if (num == num_objects_to_move[size_class_] && used_slots_ > 0) {
     int slot = --used_slots_;
@@ -1778,8 +2893,12 @@ void* TCMalloc_Central_FreeList::FetchFromSpansSafe() {
 }
 
 void* TCMalloc_Central_FreeList::FetchFromSpans() {
-  if (DLL_IsEmpty(&nonempty_)) return NULL;
-  Span* span = nonempty_.next;
+  // Take from the fullest span
+  int list = kOccupancyLists - 1;
+  while (DLL_IsEmpty(&nonempty_[list])) {
+    if (--list < 0) return NULL;
+  }
+  Span* span = nonempty_[list].next;
 
   ASSERT(span->objects != NULL);
   span->refcount++;
@@ -1790,6 +2909,12 @@ void* TCMalloc_Central_FreeList::FetchFromSpans() {
     DLL_Remove(span);
     DLL_Prepend(&empty_, span);
     Event(span, 'E', 0);
+  } else {
+    const int new_list = OccupancyList(span);
+    if (new_list != list) {
+      DLL_Remove(span);
+      DLL_Prepend(&nonempty_[new_list], span);
+    }
   }
   counter_--;
   return result;
@@ -1804,8 +2929,8 @@ void TCMalloc_Central_FreeList::Populate() {
   Span* span;
   {
     SpinLockHolder h(&pageheap_lock);
-    span = pageheap->New(npages);
-    if (span) pageheap->RegisterSizeClass(span, size_class_);
+    span = pageheaps[node_]->New(npages);
+    if (span) pageheaps[node_]->RegisterSizeClass(span, size_class_);
   }
   if (span == NULL) {
     MESSAGE("allocation failed: %d\n", errno);
@@ -1830,9 +2955,9 @@ void TCMalloc_Central_FreeList::Populate() {
   *tail = NULL;
   span->refcount = 0; // No sub-object in use yet
 
-  // Add span to list of non-empty spans
+  // Add span to the emptiest list of non-empty spans
   lock_.Lock();
-  DLL_Prepend(&nonempty_, span);
+  DLL_Prepend(&nonempty_[0], span);
   counter_ += num;
 }
 
@@ -1842,7 +2967,7 @@ void TCMalloc_Central_FreeList::Populate() {
 
 inline bool TCMalloc_ThreadCache::SampleAllocation(size_t k) {
   if (bytes_until_sample_ < k) {
-    PickNextSample(k);
+    PickNextSample();
     return true;
   } else {
     bytes_until_sample_ -= k;
@@ -1850,8 +2975,21 @@ inline bool TCMalloc_ThreadCache::SampleAllocation(size_t k) {
   }
 }
 
-void TCMalloc_ThreadCache::Init(pthread_t tid) {
+void TCMalloc_ThreadCache::Init(pthread_t tid, int node) {
   size_ = 0;
+  misses_ = 0;
+  node_ = node;
+
+  // Start with a fair share of the budget if nobody has claimed it,
+  // and with the minimum otherwise (possibly overcommitting).
+  size_t space = kMinThreadCacheSize;
+  if (unclaimed_cache_space >= static_cast<ssize_t>(per_thread_cache_size)) {
+    space = per_thread_cache_size;
+  } else if (unclaimed_cache_space > static_cast<ssize_t>(space)) {
+    space = unclaimed_cache_space;
+  }
+  max_size_ = space;
+  unclaimed_cache_space -= space;
   next_ = NULL;
   prev_ = NULL;
   tid_  = tid;
@@ -1859,12 +2997,14 @@ void TCMalloc_ThreadCache::Init(pthread_t tid) {
   for (size_t cl = 0; cl < kNumClasses; ++cl) {
     list_[cl].Init();
   }
+  num_spans_ = 0;
+  span_bytes_ = 0;
 
   // Initialize RNG -- run it for a bit to get to good values
   bytes_until_sample_ = 0;
-  rnd_ = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(this));
+  rnd_ = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(this));
   for (int i = 0; i < 100; i++) {
-    PickNextSample(FLAGS_tcmalloc_sample_parameter * 2);
+    PickNextSample();
   }
 }
 
@@ -1875,10 +3015,11 @@ void TCMalloc_ThreadCache::Cleanup() {
       ReleaseToCentralCache(cl, list_[cl].length());
     }
   }
+  if (num_spans_ > 0) ReleaseSpans(num_spans_);
 }
 
 inline void* TCMalloc_ThreadCache::Allocate(size_t size) {
-  ASSERT(size <= kMaxSize);
+  ASSERT(size <= max_class_size);
   const size_t cl = SizeClass(size);
   FreeList* list = &list_[cl];
   if (list->empty()) {
@@ -1897,16 +3038,72 @@ inline void TCMalloc_ThreadCache::Deallocate(void* ptr, size_t cl) {
   if (list->length() > kMaxFreeListLength) {
     ReleaseToCentralCache(cl, num_objects_to_move[cl]);
   }
-  if (size_ >= per_thread_cache_size) Scavenge();
+  if (size_ >= max_size_) Scavenge();
+}
+
+inline Span* TCMalloc_ThreadCache::AllocateSpan(Length n) {
+  for (int i = num_spans_ - 1; i >= 0; i--) {
+    Span* span = spans_[i];
+    if (span->length == n) {
+      for (int j = i + 1; j < num_spans_; j++) spans_[j - 1] = spans_[j];
+      num_spans_--;
+      span_bytes_ -= n << kPageShift;
+      return span;
+    }
+  }
+  return NULL;
+}
+
+inline bool TCMalloc_ThreadCache::DeallocateSpan(Span* span) {
+  const size_t bytes = span->length << kPageShift;
+  const int64 limit = FLAGS_tcmalloc_span_cache_bytes;
+  if (span->length > kMaxCachedSpanPages ||
+      static_cast<int64>(bytes) > limit ||
+      span->node != node_) {
+    return false;
+  }
+  int drop = 0;
+  size_t kept = span_bytes_;
+  while (num_spans_ - drop == kSpanCacheSlots ||
+         static_cast<int64>(kept + bytes) > limit) {
+    kept -= spans_[drop]->length << kPageShift;
+    drop++;
+  }
+  if (drop > 0) ReleaseSpans(drop);
+#ifndef NDEBUG
+  for (int i = 0; i < num_spans_; i++) ASSERT(spans_[i] != span);
+#endif
+  // calloc() of the span must clear it again
+  span->zeroed = 0;
+  spans_[num_spans_++] = span;
+  span_bytes_ += bytes;
+  return true;
+}
+
+void TCMalloc_ThreadCache::ReleaseSpans(int n) {
+  ASSERT(n <= num_spans_);
+  {
+    SpinLockHolder h(&pageheap_lock);
+    for (int i = 0; i < n; i++) {
+      span_bytes_ -= spans_[i]->length << kPageShift;
+      pageheaps[spans_[i]->node]->Delete(spans_[i]);
+    }
+  }
+  for (int i = n; i < num_spans_; i++) spans_[i - n] = spans_[i];
+  num_spans_ -= n;
 }
 
 // Remove some objects of class "cl" from central cache and add to thread heap
 void TCMalloc_ThreadCache::FetchFromCentralCache(size_t cl) {
+  const size_t size = ByteSizeForClass(cl);
   int fetch_count = num_objects_to_move[cl];
   void *start, *end;
-  central_cache[cl].RemoveRange(&start, &end, &fetch_count);
+  PROBE2(fetch_from_central_start, cl, size);
+  central_cache[node_][cl].RemoveRange(&start, &end, &fetch_count);
+  PROBE3(fetch_from_central_done, cl, size, fetch_count);
   list_[cl].PushRange(fetch_count, start, end);
-  size_ += ByteSizeForClass(cl) * fetch_count;
+  size_ += size * fetch_count;
+  misses_++;
 }
 
 // Remove some objects of class "cl" from thread heap and add to central cache
@@ -1922,12 +3119,12 @@ void TCMalloc_ThreadCache::ReleaseToCentralCache(size_t cl, int N) {
   while (N > batch_size) {
     void *tail, *head;
     src->PopRange(batch_size, &head, &tail);
-    central_cache[cl].InsertRange(head, tail, batch_size);
+    central_cache[node_][cl].InsertRange(head, tail, batch_size);
     N -= batch_size;
   }
   void *tail, *head;
   src->PopRange(N, &head, &tail);
-  central_cache[cl].InsertRange(head, tail, N);
+  central_cache[node_][cl].InsertRange(head, tail, N);
 }
 
 // Release idle memory to the central cache
@@ -1949,56 +3146,150 @@ void TCMalloc_ThreadCache::Scavenge() {
     }
     list->clear_lowwatermark();
   }
+  // Likewise give back the older half of the cached spans
+  if (num_spans_ > 0) ReleaseSpans((num_spans_ + 1) / 2);
+
+  // If our thread has moved to another NUMA node, hand back what we
+  // have and switch to the new node's memory.  (A CPU cache never
+  // changes nodes.)
+  if (num_numa_nodes > 1 && cpu_caches == NULL) {
+    const int node = CurrentNode();
+    if (node != node_) {
+      for (int cl = 0; cl < kNumClasses; cl++) {
+        if (!list_[cl].empty()) ReleaseToCentralCache(cl, list_[cl].length());
+      }
+      if (num_spans_ > 0) ReleaseSpans(num_spans_);
+      node_ = node;
+    }
+  }
+
+  // Frequent misses mean we just released objects we soon needed again
+  if (misses_ >= kMissesBeforeGrowth) {
+    SpinLockHolder h(&pageheap_lock);
+    IncreaseCacheLimitLocked();
+  }
+  misses_ = 0;
 
   //int64 finish = CycleClock::Now();
   //CycleTimer ct;
   //MESSAGE("GC: %.0f ns\n", ct.CyclesToUsec(finish-start)*1000.0);
 }
 
-void TCMalloc_ThreadCache::PickNextSample(size_t k) {
-  // Make next "random" number
-  // x^32+x^22+x^2+x^1+1 is a primitive polynomial for random numbers
-  static const uint32_t kPoly = (1 << 22) | (1 << 2) | (1 << 1) | (1 << 0);
-  uint32_t r = rnd_;
-  rnd_ = (r << 1) ^ ((static_cast<int32_t>(r) >> 31) & kPoly);
+void TCMalloc_ThreadCache::IncreaseCacheLimitLocked() {
+  if (max_size_ + kStealAmount > kMaxThreadCacheSize) return;
+  if (unclaimed_cache_space > 0) {
+    // Possibly make unclaimed_cache_space negative
+    unclaimed_cache_space -= kStealAmount;
+    max_size_ += kStealAmount;
+    return;
+  }
+  // Don't hold pageheap_lock too long.  Try to steal from 10 other
+  // thread caches before giving up.  The i < 10 condition also
+  // prevents an infinite loop in case none of the caches has enough
+  // budget to give up.
+  for (int i = 0; i < 10; ++i, next_memory_steal = next_memory_steal->next_) {
+    if (next_memory_steal == NULL) {
+      if (thread_heaps == NULL) return;
+      next_memory_steal = thread_heaps;
+    }
+    if (next_memory_steal == this ||
+        next_memory_steal->max_size_ < kMinThreadCacheSize + kStealAmount) {
+      continue;
+    }
+    // The victim scavenges down to its new limit on its next free
+    next_memory_steal->max_size_ -= kStealAmount;
+    max_size_ += kStealAmount;
+    next_memory_steal = next_memory_steal->next_;
+    return;
+  }
+}
+
+// Fast approximation to log2(d), good to about 0.01, which is plenty
+// for picking sampling points.
+static inline double FastLog2(double d) {
+  ASSERT(d > 0);
+  union { double d; uint64_t x; } u;
+  u.d = d;
+  const int exponent = static_cast<int>((u.x >> 52) & 0x7ff) - 1023;
+  // Replace the exponent to get the mantissa m, in [1, 2)
+  u.x = (u.x & ((1ULL << 52) - 1)) | (1023ULL << 52);
+  const double m = u.d;
+  return exponent + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+}
 
-  // Next point is "rnd_ % (sample_period)".  I.e., average
-  // increment is "sample_period/2".
-  const int flag_value = FLAGS_tcmalloc_sample_parameter;
-  static int last_flag_value = -1;
+void TCMalloc_ThreadCache::PickNextSample() {
+  const int64 flag_value = FLAGS_tcmalloc_sample_parameter;
+  static int64 last_flag_value = -1;
 
   if (flag_value != last_flag_value) {
     SpinLockHolder h(&sample_period_lock);
-    int i;
-    for (i = 0; i < (sizeof(primes_list)/sizeof(primes_list[0]) - 1); i++) {
-      if (primes_list[i] >= flag_value) {
-        break;
-      }
-    }
-    sample_period = primes_list[i];
+    sample_period = (flag_value > 2) ? flag_value / 2 : 1;
     last_flag_value = flag_value;
   }
 
-  bytes_until_sample_ += rnd_ % sample_period;
-  
-  if (k > (static_cast<size_t>(-1) >> 2)) {
-    // If the user has asked for a huge allocation then it is possible
-    // for the code below to loop infinitely.  Just return (note that
-    // this throws off the sampling accuracy somewhat, but a user who
-    // is allocating more than 1G of memory at a time can live with a
-    // minor inaccuracy in profiling of small allocations, and also
-    // would rather not wait for the loop below to terminate).
-    return;
-  }
+  // Make next "random" number, with the 48-bit linear congruential
+  // generator of drand48()
+  static const uint64_t kPrngMult = 0x5DEECE66DULL;
+  static const uint64_t kPrngAdd = 0xB;
+  static const uint64_t kPrngMask = (1ULL << 48) - 1;
+  rnd_ = (kPrngMult * rnd_ + kPrngAdd) & kPrngMask;
+
+  // The gap until the next sample is exponentially distributed with
+  // mean sample_period, which makes sampling a Poisson process over
+  // allocated bytes: every byte is equally likely to be sampled,
+  // however big the allocation it is part of, so an allocation of k
+  // bytes is sampled with probability 1 - exp(-k / sample_period).
+  // With q uniform over [1, 2^26], -ln(q / 2^26) is exponential with
+  // mean 1 (and at most 18).
+  static const int kPrngBits = 26;
+  static const double kLn2 = 0.693147180559945;
+  const uint64_t q = (rnd_ >> (48 - kPrngBits)) + 1;
+  double gap = (kPrngBits - FastLog2(static_cast<double>(q))) * kLn2;
+  if (gap < 0) gap = 0;         // FastLog2() is not exact
+  bytes_until_sample_ = static_cast<size_t>(gap * sample_period);
+}
 
-  while (bytes_until_sample_ < k) {
-    // Increase bytes_until_sample_ by enough average sampling periods
-    // (sample_period >> 1) to allow us to sample past the current
-    // allocation.
-    bytes_until_sample_ += (sample_period >> 1);
+// If TCMALLOC_NUMA_AWARE is set and the machine has more than one NUMA
+// node, give every node its own page heap (whose memory the kernel is
+// asked to place on that node) and its own central cache, and have
+// each thread allocate from the node it runs on.  Objects are always
+// freed back to the node they came from, so memory freed by a thread
+// on one node is not handed out to threads on another.
+// REQUIRES: pageheap_lock is held.
+static void InitNumaNodes() {
+  // Read the environment directly: we get here on the first malloc,
+  // which may come before flags are constructed.
+  if (!EnvToBool("TCMALLOC_NUMA_AWARE", false)) return;
+
+  long cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (cpus < 1) cpus = 1;
+  unsigned char* table =
+      reinterpret_cast<unsigned char*>(MetaDataAlloc(cpus));
+  if (table == NULL) return;
+  const int nodes = TCMalloc_SystemNumaTopology(table, cpus, kMaxNumaNodes);
+  if (nodes <= 1) return;
+
+  // Allocate everything before enabling anything, so that running out
+  // of memory leaves us with a single node
+  TCMalloc_Central_FreeListPadded* caches[kMaxNumaNodes];
+  TCMalloc_PageHeap* heaps[kMaxNumaNodes];
+  for (int node = 1; node < nodes; node++) {
+    caches[node] = reinterpret_cast<TCMalloc_Central_FreeListPadded*>(
+        MetaDataAlloc(sizeof(central_cache0)));
+    heaps[node] = reinterpret_cast<TCMalloc_PageHeap*>(
+        MetaDataAlloc(sizeof(TCMalloc_PageHeap)));
+    if (caches[node] == NULL || heaps[node] == NULL) return;
+  }
+  for (int node = 1; node < nodes; node++) {
+    for (int i = 0; i < kNumClasses; ++i) {
+      new ((void*)&caches[node][i]) TCMalloc_Central_FreeListPadded;
+    }
+    central_cache[node] = caches[node];
+    pageheaps[node] = new ((void*)heaps[node]) TCMalloc_PageHeap(node);
   }
-
-  bytes_until_sample_ -= k;
+  cpu_to_node = table;
+  num_node_cpus = cpus;
+  num_numa_nodes = nodes;
 }
 
 void TCMalloc_ThreadCache::InitModule() {
@@ -2017,10 +3308,19 @@ void TCMalloc_ThreadCache::InitModule() {
     span_allocator.New(); // Reduce cache conflicts
     stacktrace_allocator.Init();
     DLL_Init(&sampled_objects);
+    new ((void*)pagemap_memory) PageMap(MetaDataAlloc,
+                                        TCMalloc_SystemAllocZeroes());
+    InitNumaNodes();
     for (int i = 0; i < kNumClasses; ++i) {
-      central_cache[i].Init(i);
+      central_cache[0][i].Init(i, 0);
+    }
+    pageheaps[0] = new ((void*)pageheap_memory) TCMalloc_PageHeap(0);
+    for (int node = 1; node < num_numa_nodes; node++) {
+      for (int i = 0; i < kNumClasses; ++i) {
+        central_cache[node][i].Init(i, node);
+      }
     }
-    new ((void*)pageheap_memory) TCMalloc_PageHeap;
+    TCMalloc_CPUCache::InitModule();
     phinited = 1;
   }
 }
@@ -2028,7 +3328,7 @@ void TCMalloc_ThreadCache::InitModule() {
 inline TCMalloc_ThreadCache* TCMalloc_ThreadCache::NewHeap(pthread_t tid) {
   // Create the heap and add it to the linked list
   TCMalloc_ThreadCache *heap = threadheap_allocator.New();
-  heap->Init(tid);
+  heap->Init(tid, CurrentNode());
   heap->next_ = thread_heaps;
   heap->prev_ = NULL;
   if (thread_heaps != NULL) thread_heaps->prev_ = heap;
@@ -2068,9 +3368,69 @@ inline TCMalloc_ThreadCache* TCMalloc_ThreadCache::GetCacheIfPresent() {
   return reinterpret_cast<TCMalloc_ThreadCache*>(p);
 }
 
+// Return the CPU the calling thread is running on (or last ran on).
+static inline int CurrentCPU() {
+#ifdef TCMALLOC_USE_RSEQ
+  if (__rseq_size > 0) {
+    const struct rseq* rs = reinterpret_cast<const struct rseq*>(
+        reinterpret_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+    const int cpu = *reinterpret_cast<volatile const int*>(&rs->cpu_id);
+    if (cpu >= 0) return cpu;
+  }
+#endif
+#if defined(__linux__)
+  const int cpu = sched_getcpu();
+  if (cpu >= 0) return cpu;
+#endif
+  return 0;
+}
+
+static inline int CurrentNode() {
+  if (cpu_to_node == NULL) return 0;
+  // CPUs may have been brought online since we read the topology
+  const int cpu = CurrentCPU();
+  return (cpu < num_node_cpus) ? cpu_to_node[cpu] : 0;
+}
+
+void TCMalloc_CPUCache::InitModule() {
+  // Read the environment directly: we get here on the first malloc,
+  // which may come before flags are constructed.
+  if (!EnvToBool("TCMALLOC_PER_CPU_CACHES", false)) return;
+
+  long n = sysconf(_SC_NPROCESSORS_CONF);
+  if (n < 1) n = 1;
+  void* result = MetaDataAlloc(n * sizeof(TCMalloc_CPUCache));
+  if (result == NULL) return;           // Fall back to per-thread caches
+  TCMalloc_CPUCache* caches = reinterpret_cast<TCMalloc_CPUCache*>(result);
+  pthread_t zero;
+  memset(&zero, 0, sizeof(zero));
+  for (long i = 0; i < n; i++) {
+    new ((void*)&caches[i]) TCMalloc_CPUCache;
+    caches[i].heap_ = threadheap_allocator.New();
+    caches[i].heap_->Init(zero, (i < num_node_cpus) ? cpu_to_node[i] : 0);
+  }
+  num_cpu_caches = n;
+  cpu_caches = caches;
+  TCMalloc_ThreadCache::RecomputeThreadCacheSize();
+}
+
+inline TCMalloc_CPUCache* TCMalloc_CPUCache::GetCurrent() {
+  if (!phinited) TCMalloc_ThreadCache::InitModule();
+  if (cpu_caches == NULL) return NULL;
+  // CPUs may have been brought online since we counted them
+  return &cpu_caches[CurrentCPU() % num_cpu_caches];
+}
+
+// The fork() handlers (see "fork() support" below)
+static void TCMalloc_PrepareFork();
+static void TCMalloc_ParentAfterFork();
+static void TCMalloc_ChildAfterFork();
+
 void TCMalloc_ThreadCache::InitTSD() {
   ASSERT(!tsd_inited);
   perftools_pthread_key_create(&heap_key, DestroyThreadCache);
+  perftools_pthread_atfork(TCMalloc_PrepareFork, TCMalloc_ParentAfterFork,
+                           TCMalloc_ChildAfterFork);
   tsd_inited = true;
 
   // We may have used a fake pthread_t for the main thread.  Fix it.
@@ -2128,6 +3488,13 @@ TCMalloc_ThreadCache* TCMalloc_ThreadCache::CreateCacheIfNecessary() {
 }
 
 void TCMalloc_ThreadCache::BecomeIdle() {
+  // The per-CPU caches are shared, and this thread may have filled
+  // any of them as it moved between CPUs, so empty them all.
+  for (int i = 0; i < num_cpu_caches; i++) {
+    cpu_caches[i].Lock()->Cleanup();
+    cpu_caches[i].Unlock();
+  }
+
   if (!tsd_inited) return;              // No caches yet
   TCMalloc_ThreadCache* heap = GetThreadHeap();
   if (heap == NULL) return;             // No thread cache to remove
@@ -2171,6 +3538,7 @@ void TCMalloc_ThreadCache::DeleteCache(TCMalloc_ThreadCache* heap) {
   if (heap->next_ != NULL) heap->next_->prev_ = heap->prev_;
   if (heap->prev_ != NULL) heap->prev_->next_ = heap->next_;
   if (thread_heaps == heap) thread_heaps = heap->next_;
+  if (next_memory_steal == heap) next_memory_steal = heap->next_;
   thread_heap_count--;
   RecomputeThreadCacheSize();
 
@@ -2178,14 +3546,28 @@ void TCMalloc_ThreadCache::DeleteCache(TCMalloc_ThreadCache* heap) {
 }
 
 void TCMalloc_ThreadCache::RecomputeThreadCacheSize() {
-  // Divide available space across threads
-  int n = thread_heap_count > 0 ? thread_heap_count : 1;
+  // Divide available space across threads (or CPUs)
+  const int caches = thread_heap_count + num_cpu_caches;
+  int n = caches > 0 ? caches : 1;
   size_t space = overall_thread_cache_size / n;
 
   // Limit to allowed range
   if (space < kMinThreadCacheSize) space = kMinThreadCacheSize;
   if (space > kMaxThreadCacheSize) space = kMaxThreadCacheSize;
 
+  // If the fair share went down, scale every budget down with it
+  const double ratio = space / static_cast<double>(per_thread_cache_size);
+  size_t claimed = 0;
+  for (TCMalloc_ThreadCache* h = thread_heaps; h != NULL; h = h->next_) {
+    if (ratio < 1.0) h->max_size_ = static_cast<size_t>(h->max_size_ * ratio);
+    claimed += h->max_size_;
+  }
+  for (int i = 0; i < num_cpu_caches; i++) {
+    TCMalloc_ThreadCache* h = cpu_caches[i].heap();
+    if (ratio < 1.0) h->max_size_ = static_cast<size_t>(h->max_size_ * ratio);
+    claimed += h->max_size_;
+  }
+  unclaimed_cache_space = overall_thread_cache_size - claimed;
   per_thread_cache_size = space;
   //MESSAGE("Threads %d => cache size %8d\n", n, int(space));
 }
@@ -2213,13 +3595,18 @@ struct TCMallocStats {
 static void ExtractStats(TCMallocStats* r, uint64_t* class_count) {
   r->central_bytes = 0;
   r->transfer_bytes = 0;
-  for (int cl = 0; cl < kNumClasses; ++cl) {
-    const int length = central_cache[cl].length();
-    const int tc_length = central_cache[cl].tc_length();
-    r->central_bytes += static_cast<uint64_t>(ByteSizeForClass(cl)) * length;
-    r->transfer_bytes +=
-      static_cast<uint64_t>(ByteSizeForClass(cl)) * tc_length;
-    if (class_count) class_count[cl] = length + tc_length;
+  if (class_count) {
+    for (int cl = 0; cl < kNumClasses; ++cl) class_count[cl] = 0;
+  }
+  for (int node = 0; node < num_numa_nodes; node++) {
+    for (int cl = 0; cl < kNumClasses; ++cl) {
+      const int length = central_cache[node][cl].length();
+      const int tc_length = central_cache[node][cl].tc_length();
+      r->central_bytes += static_cast<uint64_t>(ByteSizeForClass(cl)) * length;
+      r->transfer_bytes +=
+        static_cast<uint64_t>(ByteSizeForClass(cl)) * tc_length;
+      if (class_count) class_count[cl] += length + tc_length;
+    }
   }
 
   // Add stats from per-thread heaps
@@ -2235,15 +3622,53 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count) {
       }
     }
   }
+  // Like the thread caches, these are read without their locks
+  for (int i = 0; i < num_cpu_caches; i++) {
+    const TCMalloc_ThreadCache* h = cpu_caches[i].heap();
+    r->thread_bytes += h->Size();
+    if (class_count) {
+      for (int cl = 0; cl < kNumClasses; ++cl) {
+        class_count[cl] += h->freelist_length(cl);
+      }
+    }
+  }
 
   { //scope
     SpinLockHolder h(&pageheap_lock);
-    r->system_bytes = pageheap->SystemBytes();
+    r->system_bytes = 0;
+    r->pageheap_bytes = 0;
+    for (int node = 0; node < num_numa_nodes; node++) {
+      r->system_bytes += pageheaps[node]->SystemBytes();
+      r->pageheap_bytes += pageheaps[node]->FreeBytes();
+    }
     r->metadata_bytes = metadata_system_bytes;
-    r->pageheap_bytes = pageheap->FreeBytes();
   }
 }
 
+// WRITE a line of stats per NUMA node to "out", if we have more than one
+static void DumpNodeStats(TCMalloc_Printer* out) {
+  if (num_numa_nodes <= 1) return;
+  for (int node = 0; node < num_numa_nodes; node++) {
+    uint64_t central_bytes = 0;
+    for (int cl = 0; cl < kNumClasses; ++cl) {
+      const int length = central_cache[node][cl].length() +
+                         central_cache[node][cl].tc_length();
+      central_bytes += static_cast<uint64_t>(ByteSizeForClass(cl)) * length;
+    }
+    uint64_t system_bytes, pageheap_bytes;
+    {
+      SpinLockHolder h(&pageheap_lock);
+      system_bytes = pageheaps[node]->SystemBytes();
+      pageheap_bytes = pageheaps[node]->FreeBytes();
+    }
+    out->printf("MALLOC: node %d: %12" PRIu64 " Heap size; "
+                "%12" PRIu64 " free in page heap; "
+                "%12" PRIu64 " free in central cache\n",
+                node, system_bytes, pageheap_bytes, central_bytes);
+  }
+  out->printf("------------------------------------------------\n");
+}
+
 // WRITE stats to "out"
 static void DumpStats(TCMalloc_Printer* out, int level) {
   TCMallocStats stats;
@@ -2267,7 +3692,13 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
     }
 
     SpinLockHolder h(&pageheap_lock);
-    pageheap->Dump(out);
+    for (int node = 0; node < num_numa_nodes; node++) {
+      if (num_numa_nodes > 1) {
+        out->printf("------------------------------------------------\n"
+                    "NUMA node %d\n", node);
+      }
+      pageheaps[node]->Dump(out);
+    }
   }
 
   const uint64_t bytes_in_use = stats.system_bytes
@@ -2296,6 +3727,59 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
               uint64_t(span_allocator.inuse()),
               uint64_t(threadheap_allocator.inuse()),
               stats.metadata_bytes);
+  DumpNodeStats(out);
+}
+
+// WRITE the fragmentation report to "out".  See
+// MallocExtension::GetFragmentationReport() for the format.
+static void DumpFragmentation(TCMalloc_Printer* out) {
+  out->printf("# tcmalloc fragmentation report\n"
+              "# class <class> <object size> <pages per span> <spans> "
+              "<pages> <objects> <live objects> <stranded bytes> "
+              "<spans by occupancy: %d buckets>\n", kOccupancyBuckets);
+  for (int cl = 1; cl < num_size_classes; ++cl) {
+    TCMalloc_ClassSpanStats stats;
+    memset(&stats, 0, sizeof(stats));
+    for (int node = 0; node < num_numa_nodes; node++) {
+      central_cache[node][cl].AddSpanStats(&stats);
+    }
+    if (stats.spans == 0) continue;
+    out->printf("class %d %" PRIuS " %" PRIuS " %" PRIu64 " %" PRIu64
+                " %" PRIu64 " %" PRIu64 " %" PRIu64,
+                cl, ByteSizeForClass(cl), class_to_pages[cl],
+                stats.spans, stats.pages, stats.objects, stats.live,
+                stats.stranded_bytes);
+    for (int i = 0; i < kOccupancyBuckets; i++) {
+      out->printf(" %" PRIu64, stats.occupancy[i]);
+    }
+    out->printf("\n");
+  }
+
+  // Sampled objects that are still live are counted by their age
+  uint64_t freed[kLifetimeBuckets];
+  uint64_t live[kLifetimeBuckets];
+  memset(live, 0, sizeof(live));
+  {
+    SpinLockHolder h(&pageheap_lock);
+    memcpy(freed, sampled_lifetimes, sizeof(freed));
+    const uint64_t now = NowMicros();
+    for (Span* s = sampled_objects.next; s != &sampled_objects; s = s->next) {
+      const StackTrace* stack = reinterpret_cast<StackTrace*>(s->objects);
+      if (now >= stack->alloc_time) {
+        live[LifetimeBucket(now - stack->alloc_time)]++;
+      }
+    }
+  }
+  out->printf("# sampling_period_bytes <bytes>\n"
+              "sampling_period_bytes %" PRIu64 "\n",
+              static_cast<uint64_t>(FLAGS_tcmalloc_sample_parameter / 2));
+  out->printf("# lifetime <from usec> <freed samples> <live samples>\n");
+  for (int i = 0; i < kLifetimeBuckets; i++) {
+    if (freed[i] == 0 && live[i] == 0) continue;
+    const uint64_t from = (i == 0) ? 0 : (static_cast<uint64_t>(1) << (i-1));
+    out->printf("lifetime %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                from, freed[i], live[i]);
+  }
 }
 
 static void PrintStats(int level) {
@@ -2393,6 +3877,464 @@ static void** DumpHeapGrowthStackTraces() {
   return result;
 }
 
+//-------------------------------------------------------------------
+// Background scavenger
+//-------------------------------------------------------------------
+
+// How often the scavenger wakes up.  This is also the resolution of
+// span ages.
+static const int kScavengerIntervalSeconds = 1;
+
+static SpinLock scavenger_lock(SpinLock::LINKER_INITIALIZED);
+static bool scavenger_started = false;
+
+static void* ScavengerThread(void*) {
+  uint32_t now = 0;
+  double credit = 0;                  // Bytes we may still release
+  for (;;) {
+    sleep(kScavengerIntervalSeconds);
+    now += kScavengerIntervalSeconds;
+
+    const int64 rate = FLAGS_tcmalloc_background_release_rate;
+    const int64 age = FLAGS_tcmalloc_background_release_age;
+    // Carry at most one interval's worth of unused credit, so a long
+    // quiet period does not allow a burst later
+    const double limit = static_cast<double>(rate) * kScavengerIntervalSeconds;
+    credit += limit;
+    if (credit > limit) credit = limit;
+
+    // With no credit we still advance the clocks that stamp free spans.
+    // A span larger than the remaining credit may overdraw it.
+    SpinLockHolder h(&pageheap_lock);
+    for (int node = 0; node < num_numa_nodes; node++) {
+      const Length max_pages =
+          (credit > 0) ? static_cast<Length>(credit / kPageSize) + 1 : 0;
+      const Length released = pageheaps[node]->ReleaseAgedPages(
+          now, static_cast<uint32_t>(age < 0 ? 0 : age), max_pages);
+      credit -= static_cast<double>(released) * kPageSize;
+    }
+  }
+  return NULL;
+}
+
+// Start the background scavenger unless it is already running.
+static void StartScavenger() {
+  SpinLockHolder h(&scavenger_lock);
+  if (scavenger_started) return;
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, ScavengerThread, NULL) == 0) {
+    scavenger_started = true;
+  } else {
+    MESSAGE("tcmalloc: could not start the background scavenger\n");
+  }
+  pthread_attr_destroy(&attr);
+}
+
+//-------------------------------------------------------------------
+// Background prefaulter
+//-------------------------------------------------------------------
+
+// A large allocation carved from fresh or released pages takes a page
+// fault for each page as the program first touches it, and calloc()
+// of one that was used before has to clear it: for a few megabytes,
+// milliseconds on the allocating thread.  With tcmalloc_prefault_bytes
+// set, this thread keeps that much memory in each page heap already
+// faulted in and zeroed, in a pool that New() serves allocations of
+// kMinPrefaultPages or more from before anything else, and it refills
+// the pool when New() takes from it.
+
+static SpinLock prefaulter_lock(SpinLock::LINKER_INITIALIZED);
+static bool prefaulter_started = false;
+// Set while the prefaulter has work or has been woken up; protected
+// by pageheap_lock.  Each time it is set the semaphore is posted once.
+static bool prefaulter_awake = false;
+static sem_t prefaulter_sem;
+
+static void WakePrefaulter() {
+  if (!prefaulter_started || prefaulter_awake) return;
+  prefaulter_awake = true;
+  sem_post(&prefaulter_sem);
+}
+
+static void* PrefaulterThread(void*) {
+  for (;;) {
+    while (sem_wait(&prefaulter_sem) != 0) { }
+    for (;;) {
+      Span* span = NULL;
+      int node;
+      {
+        SpinLockHolder h(&pageheap_lock);
+        const Length target = pages(FLAGS_tcmalloc_prefault_bytes);
+        for (node = 0; node < num_numa_nodes; node++) {
+          const Length n = pageheaps[node]->PrefaultDeficit(target);
+          if (n > 0) {
+            span = pageheaps[node]->NewForPrefault(n);
+            break;
+          }
+        }
+        // Sleep until the next large allocation if the pools are
+        // full, or if we are out of memory
+        if (span == NULL) {
+          prefaulter_awake = false;
+          break;
+        }
+      }
+      // Fault the pages in (what comes off the returned lists is
+      // zero already) without holding up the rest of the heap
+      void* start = reinterpret_cast<void*>(span->start << kPageShift);
+      const size_t length = span->length << kPageShift;
+      if (span->zeroed) {
+        TCMalloc_SystemPrefault(start, length);
+      } else {
+        memset(start, 0, length);
+      }
+      SpinLockHolder h(&pageheap_lock);
+      pageheaps[node]->AddPrefaulted(span);
+    }
+  }
+  return NULL;
+}
+
+// Start the background prefaulter unless it is already running.
+static void StartPrefaulter() {
+  SpinLockHolder h(&prefaulter_lock);
+  if (prefaulter_started) return;
+  // Have it fill the pools straight away
+  sem_init(&prefaulter_sem, 0, 1);
+  prefaulter_awake = true;
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, PrefaulterThread, NULL) == 0) {
+    prefaulter_started = true;
+  } else {
+    prefaulter_awake = false;
+    sem_destroy(&prefaulter_sem);
+    MESSAGE("tcmalloc: could not start the background prefaulter\n");
+  }
+  pthread_attr_destroy(&attr);
+}
+
+//-------------------------------------------------------------------
+// Background releaser
+//-------------------------------------------------------------------
+
+// Returning a large span to the system (madvise() of every page in it,
+// which also shoots down the TLBs of every CPU running the process)
+// takes milliseconds for a few hundred megabytes, and IncrementalScavenge()
+// does it on whichever thread's free() happened to tip the scavenge
+// counter, holding pageheap_lock.  With tcmalloc_async_release_bytes
+// set, it queues large spans for this thread instead.  A queued span is
+// on no free list, so it cannot be reused before its pages have been
+// released; the releaser then puts it on a returned list.  When the
+// queue is full, or holds tcmalloc_async_release_bytes already, spans
+// are released inline again, which holds the freeing threads to the
+// pace of the releaser.
+
+static SpinLock releaser_lock(SpinLock::LINKER_INITIALIZED);
+static bool releaser_started = false;
+// The queue, protected by pageheap_lock.  The semaphore is posted once
+// for each span added, and only the releaser removes them.
+static Span* release_queue[kReleaseQueueSize];
+static int release_head = 0;
+static int release_tail = 0;
+static Length pending_release_pages = 0;
+static sem_t releaser_sem;
+
+static bool DeferRelease(Span* span) {
+  if (!releaser_started || span->length < kMinDeferredReleasePages) {
+    return false;
+  }
+  const Length limit = pages(FLAGS_tcmalloc_async_release_bytes);
+  if (limit == 0 || release_tail - release_head == kReleaseQueueSize) {
+    return false;
+  }
+  // A single span larger than the limit may still go, by itself
+  if (pending_release_pages > 0 &&
+      pending_release_pages + span->length > limit) {
+    return false;
+  }
+  span->free = 0;
+  release_queue[release_tail % kReleaseQueueSize] = span;
+  release_tail++;
+  pending_release_pages += span->length;
+  sem_post(&releaser_sem);
+  return true;
+}
+
+// Release what is still queued on this thread.  REQUIRES: pageheap_lock
+static void ReleasePendingSpans() {
+  while (release_head != release_tail) {
+    Span* span = release_queue[release_head % kReleaseQueueSize];
+    release_head++;
+    pending_release_pages -= span->length;
+    TCMalloc_SystemRelease(reinterpret_cast<void*>(span->start << kPageShift),
+                           static_cast<size_t>(span->length << kPageShift));
+    pageheaps[span->node]->FinishRelease(span);
+  }
+}
+
+static void* ReleaserThread(void*) {
+  for (;;) {
+    while (sem_wait(&releaser_sem) != 0) { }
+    // Only this thread takes spans off the queue
+    Span* span;
+    {
+      SpinLockHolder h(&pageheap_lock);
+      span = release_queue[release_head % kReleaseQueueSize];
+    }
+    TCMalloc_SystemRelease(reinterpret_cast<void*>(span->start << kPageShift),
+                           static_cast<size_t>(span->length << kPageShift));
+    SpinLockHolder h(&pageheap_lock);
+    release_head++;
+    pending_release_pages -= span->length;
+    pageheaps[span->node]->FinishRelease(span);
+  }
+  return NULL;
+}
+
+// Start the background releaser unless it is already running.  Not
+// called with pageheap_lock held, since pthread_create() allocates.
+static void StartReleaser() {
+  SpinLockHolder h(&releaser_lock);
+  if (releaser_started) return;
+  sem_init(&releaser_sem, 0, 0);
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, ReleaserThread, NULL) == 0) {
+    SpinLockHolder l(&pageheap_lock);
+    releaser_started = true;
+  } else {
+    sem_destroy(&releaser_sem);
+    MESSAGE("tcmalloc: could not start the background releaser\n");
+  }
+  pthread_attr_destroy(&attr);
+}
+
+//-------------------------------------------------------------------
+// Telemetry page
+//-------------------------------------------------------------------
+
+// With TCMALLOC_TELEMETRY_PATH set (a "%d" in it stands for the
+// process id), this thread keeps a struct TCMallocTelemetry (see
+// <google/malloc_telemetry.h>) in a shared mapping of that file up to
+// date, so that an agent outside the process can read the heap's
+// numbers from the file whenever it likes, without calling into us.
+// Point it at /dev/shm to keep the page off the disk.  The stats are
+// gathered the way MallocExtension gathers them, by this thread, and
+// the page is written under its sequence count.  A forked child
+// inherits the mapping but not the thread, so never writes to it.
+
+COMPILE_ASSERT(kNumClasses <= TCMALLOC_TELEMETRY_MAX_CLASSES,
+               telemetry_page_too_small_for_size_classes);
+
+static SpinLock telemetry_lock(SpinLock::LINKER_INITIALIZED);
+static bool telemetry_started = false;
+static TCMallocTelemetry* telemetry_page = NULL;
+static char telemetry_path[1024];
+
+static void PublishTelemetry(TCMallocTelemetry* t) {
+  TCMallocStats stats;
+  uint64_t class_count[kNumClasses];
+  ExtractStats(&stats, class_count);
+  uint64_t pageheap_contentions = pageheap_lock.Contentions();
+  uint64_t central_contentions = 0;
+  for (int node = 0; node < num_numa_nodes; node++) {
+    for (int cl = 0; cl < kNumClasses; ++cl) {
+      central_contentions += central_cache[node][cl].lock_contentions();
+    }
+  }
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  t->seq++;
+  MemoryBarrier();
+  t->updates++;
+  t->timestamp_us = static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+  t->mapped_bytes = stats.system_bytes;
+  t->live_bytes = stats.system_bytes
+                  - stats.pageheap_bytes
+                  - stats.central_bytes
+                  - stats.transfer_bytes
+                  - stats.thread_bytes;
+  t->thread_cache_bytes = stats.thread_bytes;
+  t->central_cache_bytes = stats.central_bytes;
+  t->transfer_cache_bytes = stats.transfer_bytes;
+  t->pageheap_free_bytes = stats.pageheap_bytes;
+  t->metadata_bytes = stats.metadata_bytes;
+  t->pageheap_lock_contentions = pageheap_contentions;
+  t->central_lock_contentions = central_contentions;
+  t->num_classes = num_size_classes;
+  for (size_t cl = 0; cl < num_size_classes; ++cl) {
+    t->classes[cl].size = ByteSizeForClass(cl);
+    t->classes[cl].cached_bytes = class_count[cl] * ByteSizeForClass(cl);
+  }
+  MemoryBarrier();
+  t->seq++;
+}
+
+static void* TelemetryThread(void*) {
+  int64 interval = FLAGS_tcmalloc_telemetry_interval_ms;
+  if (interval < 1) interval = 1;
+  struct timespec ts;
+  ts.tv_sec = interval / 1000;
+  ts.tv_nsec = (interval % 1000) * 1000000;
+  for (;;) {
+    PublishTelemetry(telemetry_page);
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+// Map the page at "path" and start the thread that writes it, unless
+// it is already running.  Returns false if either fails, or if the
+// page is already being written elsewhere.
+static bool StartTelemetry(const char* path) {
+  SpinLockHolder h(&telemetry_lock);
+  char expanded[sizeof(telemetry_path)];
+  snprintf(expanded, sizeof(expanded), path, static_cast<int>(getpid()));
+  if (telemetry_started) return strcmp(expanded, telemetry_path) == 0;
+  memcpy(telemetry_path, expanded, sizeof(telemetry_path));
+  const int fd = open(telemetry_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    MESSAGE("tcmalloc: could not create telemetry page %s\n", telemetry_path);
+    return false;
+  }
+  const size_t size = sizeof(TCMallocTelemetry);
+  void* page = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (page == MAP_FAILED) {
+    MESSAGE("tcmalloc: could not map telemetry page %s\n", telemetry_path);
+    unlink(telemetry_path);
+    return false;
+  }
+  // The file is all zeroes, and so has an even count, until the
+  // header is filled in; readers ignore it until the magic number is
+  // set.
+  TCMallocTelemetry* t = reinterpret_cast<TCMallocTelemetry*>(page);
+  t->version = TCMALLOC_TELEMETRY_VERSION;
+  t->size = size;
+  t->pid = getpid();
+  PublishTelemetry(t);
+  MemoryBarrier();
+  t->magic = TCMALLOC_TELEMETRY_MAGIC;
+  telemetry_page = t;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, TelemetryThread, NULL) == 0) {
+    telemetry_started = true;
+  } else {
+    MESSAGE("tcmalloc: could not start the telemetry thread\n");
+    munmap(page, size);
+    unlink(telemetry_path);
+    telemetry_page = NULL;
+  }
+  pthread_attr_destroy(&attr);
+  return telemetry_started;
+}
+
+// Remove the page at exit, so that agents do not scrape a dead
+// process.  The mapping stays, since the thread may still be writing.
+static void StopTelemetry() {
+  SpinLockHolder h(&telemetry_lock);
+  if (telemetry_started && telemetry_page->pid == getpid()) {
+    unlink(telemetry_path);
+  }
+}
+
+//-------------------------------------------------------------------
+// fork() support
+//-------------------------------------------------------------------
+
+// The child of a fork() gets the heap as it was at that moment, with
+// whatever locks other threads held then, but none of those threads.
+// So we take every lock before the fork, in the order they nest, and
+// release them on both sides afterwards (a SpinLock has no owner, so
+// the child can).
+//
+// The thread caches of the threads that did not come along are not
+// locked, and one may have been in the middle of an operation.  The
+// child drops them from thread_heaps rather than draining them: that
+// takes constant time however many threads and objects there were,
+// and leaves their pages alone, so they stay shared with the parent
+// instead of being copied.  Their objects simply stay allocated as far
+// as the central caches are concerned, and their share of the thread
+// cache budget goes back to the caches that remain.
+
+// Registered by InitTSD, after the module is initialized.
+static void TCMalloc_PrepareFork() {
+  scavenger_lock.Lock();
+  prefaulter_lock.Lock();
+  releaser_lock.Lock();
+  for (int i = 0; i < num_cpu_caches; i++) cpu_caches[i].Lock();
+  for (int node = 0; node < num_numa_nodes; node++) {
+    for (int cl = 0; cl < kNumClasses; cl++) {
+      central_cache[node][cl].LockForFork();
+    }
+  }
+  pageheap_lock.Lock();
+  sample_period_lock.Lock();
+}
+
+static void TCMalloc_ParentAfterFork() {
+  sample_period_lock.Unlock();
+  pageheap_lock.Unlock();
+  for (int node = num_numa_nodes - 1; node >= 0; node--) {
+    for (int cl = kNumClasses - 1; cl >= 0; cl--) {
+      central_cache[node][cl].UnlockForFork();
+    }
+  }
+  for (int i = num_cpu_caches - 1; i >= 0; i--) cpu_caches[i].Unlock();
+  releaser_lock.Unlock();
+  prefaulter_lock.Unlock();
+  scavenger_lock.Unlock();
+}
+
+static void TCMalloc_ChildAfterFork() {
+  // Keep only the cache of the thread that forked
+  TCMalloc_ThreadCache* self = TCMalloc_ThreadCache::GetCacheIfPresent();
+  thread_heaps = self;
+  thread_heap_count = (self != NULL) ? 1 : 0;
+  if (self != NULL) self->next_ = self->prev_ = NULL;
+  next_memory_steal = NULL;
+  TCMalloc_ThreadCache::RecomputeThreadCacheSize();
+
+  for (int node = 0; node < num_numa_nodes; node++) {
+    for (int cl = 0; cl < kNumClasses; cl++) {
+      central_cache[node][cl].ResetRingAfterFork();
+    }
+  }
+
+  // The scavenger, prefaulter and releaser threads did not come along
+  // either.  A span the prefaulter was faulting in at the time of the
+  // fork stays allocated in the child.  The spans queued for the
+  // releaser (including one it was releasing) are released here.
+  const bool restart = scavenger_started;
+  scavenger_started = false;
+  const bool restart_prefaulter = prefaulter_started;
+  prefaulter_started = false;
+  prefaulter_awake = false;
+  const bool restart_releaser = releaser_started;
+  releaser_started = false;
+  ReleasePendingSpans();
+  TCMalloc_ParentAfterFork();
+  if (restart) StartScavenger();
+  if (restart_prefaulter) StartPrefaulter();
+  if (restart_releaser) StartReleaser();
+}
+
 // TCMalloc's support for extra malloc interfaces
 class TCMallocImplementation : public MallocExtension {
  public:
@@ -2408,6 +4350,15 @@ class TCMallocImplementation : public MallocExtension {
     }
   }
 
+  virtual void GetFragmentationReport(std::string* result) {
+    const int kBufferSize = 64 << 10;
+    char* buffer = new char[kBufferSize];
+    TCMalloc_Printer printer(buffer, kBufferSize);
+    DumpFragmentation(&printer);
+    *result += buffer;
+    delete[] buffer;
+  }
+
   virtual void** ReadStackTraces() {
     return DumpStackTraces();
   }
@@ -2440,7 +4391,10 @@ class TCMallocImplementation : public MallocExtension {
       // We assume that bytes in the page heap are not fragmented too
       // badly, and are therefore available for allocation.
       SpinLockHolder l(&pageheap_lock);
-      *value = pageheap->FreeBytes();
+      *value = 0;
+      for (int node = 0; node < num_numa_nodes; node++) {
+        *value += pageheaps[node]->FreeBytes();
+      }
       return true;
     }
 
@@ -2450,6 +4404,24 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.pageheap_frees") == 0 ||
+        strcmp(name, "tcmalloc.pageheap_coalesces") == 0 ||
+        strcmp(name, "tcmalloc.pageheap_large_spans") == 0) {
+      SpinLockHolder l(&pageheap_lock);
+      *value = 0;
+      for (int node = 0; node < num_numa_nodes; node++) {
+        const TCMalloc_PageHeap* heap = pageheaps[node];
+        if (strcmp(name, "tcmalloc.pageheap_frees") == 0) {
+          *value += heap->deletes();
+        } else if (strcmp(name, "tcmalloc.pageheap_coalesces") == 0) {
+          *value += heap->coalesced_prev() + heap->coalesced_next();
+        } else {
+          *value += heap->large_spans();
+        }
+      }
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.current_total_thread_cache_bytes") == 0) {
       TCMallocStats stats;
       ExtractStats(&stats, NULL);
@@ -2457,6 +4429,51 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.background_release_rate") == 0) {
+      *value = FLAGS_tcmalloc_background_release_rate;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.background_release_age") == 0) {
+      *value = FLAGS_tcmalloc_background_release_age;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.sampling_period_bytes") == 0) {
+      *value = FLAGS_tcmalloc_sample_parameter / 2;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.prefault_bytes") == 0) {
+      *value = FLAGS_tcmalloc_prefault_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.prefaulted_bytes") == 0) {
+      SpinLockHolder l(&pageheap_lock);
+      *value = 0;
+      for (int node = 0; node < num_numa_nodes; node++) {
+        *value += pageheaps[node]->prefaulted_pages() << kPageShift;
+      }
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.async_release_bytes") == 0) {
+      *value = FLAGS_tcmalloc_async_release_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pending_release_bytes") == 0) {
+      SpinLockHolder l(&pageheap_lock);
+      *value = pending_release_pages << kPageShift;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.span_cache_bytes") == 0) {
+      *value = FLAGS_tcmalloc_span_cache_bytes;
+      return true;
+    }
+
     return false;
   }
 
@@ -2474,6 +4491,45 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.background_release_rate") == 0) {
+      FLAGS_tcmalloc_background_release_rate = value;
+      if (value > 0) StartScavenger();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.background_release_age") == 0) {
+      FLAGS_tcmalloc_background_release_age = value;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.sampling_period_bytes") == 0) {
+      // Caches pick up the new period after their next sample
+      FLAGS_tcmalloc_sample_parameter = static_cast<int64>(value) * 2;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.prefault_bytes") == 0) {
+      FLAGS_tcmalloc_prefault_bytes = value;
+      if (value > 0) {
+        StartPrefaulter();
+        SpinLockHolder l(&pageheap_lock);
+        WakePrefaulter();
+      }
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.async_release_bytes") == 0) {
+      FLAGS_tcmalloc_async_release_bytes = value;
+      if (value > 0) StartReleaser();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.span_cache_bytes") == 0) {
+      // Caches over the new limit shrink as they next cache a span
+      FLAGS_tcmalloc_span_cache_bytes = value;
+      return true;
+    }
+
     return false;
   }
 
@@ -2483,7 +4539,17 @@ class TCMallocImplementation : public MallocExtension {
 
   virtual void ReleaseFreeMemory() {
     SpinLockHolder h(&pageheap_lock);
-    pageheap->ReleaseFreePages();
+    for (int node = 0; node < num_numa_nodes; node++) {
+      pageheaps[node]->ReleaseFreePages();
+    }
+  }
+
+  virtual bool AddSystemAllocator(SysAllocator* allocator) {
+    return TCMalloc_AddSystemAllocator(allocator);
+  }
+
+  virtual bool PublishTelemetry(const char* path) {
+    return StartTelemetry(path);
   }
 };
 
@@ -2511,9 +4577,15 @@ class TCMallocGuard {
     TCMalloc_ThreadCache::InitTSD();
     free(malloc(1));
     MallocExtension::Register(new TCMallocImplementation);
+    if (FLAGS_tcmalloc_background_release_rate > 0) StartScavenger();
+    if (FLAGS_tcmalloc_prefault_bytes > 0) StartPrefaulter();
+    if (FLAGS_tcmalloc_async_release_bytes > 0) StartReleaser();
+    const char* telemetry = getenv("TCMALLOC_TELEMETRY_PATH");
+    if (telemetry != NULL && telemetry[0] != '\0') StartTelemetry(telemetry);
   }
 
   ~TCMallocGuard() {
+    StopTelemetry();
     const char* env = getenv("MALLOCSTATS");
     if (env != NULL) {
       int level = atoi(env);
@@ -2534,10 +4606,11 @@ static Span* DoSampledAllocation(size_t size) {
   StackTrace tmp;
   tmp.depth = GetStackTrace(tmp.stack, kMaxStackDepth, 1);
   tmp.size = size;
+  tmp.alloc_time = NowMicros();
 
   SpinLockHolder h(&pageheap_lock);
   // Allocate span
-  Span *span = pageheap->New(pages(size == 0 ? 1 : size));
+  Span *span = pageheaps[CurrentNode()]->New(pages(size == 0 ? 1 : size));
   if (span == NULL) {
     return NULL;
   }
@@ -2557,60 +4630,174 @@ static Span* DoSampledAllocation(size_t size) {
   return span;
 }
 
+// The number of bytes usable in the object at "ptr"
+static inline size_t AllocatedSize(void* ptr) {
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  Span* span = TCMalloc_PageHeap::GetDescriptor(p);
+  if (span->sizeclass != 0) {
+    return ByteSizeForClass(span->sizeclass);
+  } else {
+    return span->length << kPageShift;
+  }
+}
+
+// Allocate "size" bytes from "heap": a small object from its free
+// lists, or a large one from its span cache.  Returns NULL if a large
+// object has to come from the page heap.
+static inline void* CacheAllocate(TCMalloc_ThreadCache* heap, size_t size) {
+  if (size <= max_class_size) return heap->Allocate(size);
+  const Length n = pages(size);
+  if (n > kMaxCachedSpanPages) return NULL;
+  Span* span = heap->AllocateSpan(n);
+  if (span == NULL) return NULL;
+  return reinterpret_cast<void*>(span->start << kPageShift);
+}
+
+// Put "span", a large object being freed, in the span cache of the
+// current thread or CPU.  Returns false if it has to go back to the
+// page heap.
+static inline bool CacheDeallocateSpan(Span* span) {
+  if (span->length > kMaxCachedSpanPages) return false;
+  TCMalloc_CPUCache* cpu = TCMalloc_CPUCache::GetCurrent();
+  if (cpu != NULL) {
+    const bool cached = cpu->Lock()->DeallocateSpan(span);
+    cpu->Unlock();
+    return cached;
+  }
+  TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCacheIfPresent();
+  return heap != NULL && heap->DeallocateSpan(span);
+}
+
 static inline void* do_malloc(size_t size) {
   void* ret = NULL;
+  bool sample;
 
   // The following call forces module initialization
-  TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCache();
-  if ((FLAGS_tcmalloc_sample_parameter > 0) && heap->SampleAllocation(size)) {
+  TCMalloc_CPUCache* cpu = TCMalloc_CPUCache::GetCurrent();
+  if (cpu != NULL) {
+    // Sampled and large allocations are done after unlocking: they
+    // take other locks, and taking a stack trace may re-enter malloc.
+    TCMalloc_ThreadCache* heap = cpu->Lock();
+    sample = (FLAGS_tcmalloc_sample_parameter > 0) &&
+             heap->SampleAllocation(size);
+    if (!sample) ret = CacheAllocate(heap, size);
+    cpu->Unlock();
+  } else {
+    TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCache();
+    sample = (FLAGS_tcmalloc_sample_parameter > 0) &&
+             heap->SampleAllocation(size);
+    if (!sample) ret = CacheAllocate(heap, size);
+  }
+  if (sample) {
     Span* span = DoSampledAllocation(size);
     if (span != NULL) {
       ret = reinterpret_cast<void*>(span->start << kPageShift);
     }
-  } else if (size > kMaxSize) {
+  } else if (ret == NULL && size > max_class_size) {
     // Use page-level allocator
     SpinLockHolder h(&pageheap_lock);
-    Span* span = pageheap->New(pages(size));
+    Span* span = pageheaps[CurrentNode()]->New(pages(size));
     if (span != NULL) {
       ret = reinterpret_cast<void*>(span->start << kPageShift);
     }
-  } else {
-    ret = heap->Allocate(size);
   }
   if (ret == NULL) errno = ENOMEM;
   return ret;
 }
 
+// Returns true if "ptr", just returned by do_malloc(size), is a
+// large object whose pages are known to be zero.
+static inline bool IsZeroedAllocation(void* ptr, size_t size) {
+  if (size <= max_class_size) return false;
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  const Span* span = TCMalloc_PageHeap::GetDescriptor(p);
+  return span->sizeclass == 0 && span->zeroed;
+}
+
+// Free small object "ptr" of size class "cl", from the page heap of
+// NUMA node "node".
+static inline void do_free_small(void* ptr, size_t cl, int node) {
+  // Caches only take objects from their own NUMA node
+  TCMalloc_CPUCache* cpu = TCMalloc_CPUCache::GetCurrent();
+  if (cpu != NULL) {
+    TCMalloc_ThreadCache* heap = cpu->Lock();
+    const bool local = (heap->node() == node);
+    if (local) heap->Deallocate(ptr, cl);
+    cpu->Unlock();
+    if (local) return;
+  } else {
+    TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCacheIfPresent();
+    if (heap != NULL && heap->node() == node) {
+      heap->Deallocate(ptr, cl);
+      return;
+    }
+  }
+  // Delete directly into central cache
+  SLL_SetNext(ptr, NULL);
+  central_cache[node][cl].InsertRange(ptr, ptr, 1);
+}
+
 static inline void do_free(void* ptr) {
   if (ptr == NULL) return;
-  ASSERT(pageheap != NULL);  // Should not call free() before malloc()
+  ASSERT(phinited);  // Should not call free() before malloc()
   const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
-  Span* span = pageheap->GetDescriptor(p);
+#ifdef __GNUC__
+  __builtin_prefetch(ptr, 1);   // A small object gets linked into a list
+#endif
+  int node;
+  size_t cl = PageMapCache_Get(p, &node);
+  if (cl != 0) {
+    ASSERT(TCMalloc_PageHeap::GetDescriptor(p)->sizeclass == cl);
+    ASSERT(TCMalloc_PageHeap::GetDescriptor(p)->node == node);
+    do_free_small(ptr, cl, node);
+    return;
+  }
 
+  Span* span = TCMalloc_PageHeap::GetDescriptor(p);
   ASSERT(span != NULL);
   ASSERT(!span->free);
-  const size_t cl = span->sizeclass;
+  cl = span->sizeclass;
   if (cl != 0) {
     ASSERT(!span->sample);
-    TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCacheIfPresent();
-    if (heap != NULL) {
-      heap->Deallocate(ptr, cl);
-    } else {
-      // Delete directly into central cache
-      SLL_SetNext(ptr, NULL);
-      central_cache[cl].InsertRange(ptr, ptr, 1);
-    }
+    PageMapCache_Put(p, cl, span->node);
+    do_free_small(ptr, cl, span->node);
   } else {
-    SpinLockHolder h(&pageheap_lock);
     ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
     ASSERT(span->start == p);
+    if (!span->sample && CacheDeallocateSpan(span)) return;
+    SpinLockHolder h(&pageheap_lock);
     if (span->sample) {
       DLL_Remove(span);
-      stacktrace_allocator.Delete(reinterpret_cast<StackTrace*>(span->objects));
+      StackTrace* stack = reinterpret_cast<StackTrace*>(span->objects);
+      const uint64_t now = NowMicros();
+      if (now >= stack->alloc_time) {   // The clock may have been set back
+        sampled_lifetimes[LifetimeBucket(now - stack->alloc_time)]++;
+      }
+      stacktrace_allocator.Delete(stack);
       span->objects = NULL;
     }
-    pageheap->Delete(span);
+    pageheaps[span->node]->Delete(span);
+  }
+}
+
+// Free "ptr", which do_malloc(size) returned.  A small object's size
+// class follows from "size", so we can usually skip looking up its
+// span.  But we still need the span for objects that may not have
+// come from a size class: sampled objects get spans of their own, so
+// like large objects they start on a page boundary (which only a few
+// small objects do).  We also need it to find the node of the object
+// if there is more than one NUMA node.
+static inline void do_free_sized(void* ptr, size_t size) {
+  if (size > max_class_size ||
+      (reinterpret_cast<uintptr_t>(ptr) & (kPageSize - 1)) == 0 ||
+      num_numa_nodes > 1) {
+    do_free(ptr);               // Also handles ptr == NULL
+    return;
   }
+  const size_t cl = SizeClass(size);
+  ASSERT(TCMalloc_PageHeap::GetDescriptor(
+             reinterpret_cast<uintptr_t>(ptr) >> kPageShift)->sizeclass == cl);
+  do_free_small(ptr, cl, 0);
 }
 
 // For use by exported routines below that want specific alignments
@@ -2625,12 +4812,12 @@ static void* do_memalign(size_t align, size_t size) {
   ASSERT(align > 0);
   if (size + align < size) return NULL;         // Overflow
 
-  if (pageheap == NULL) TCMalloc_ThreadCache::InitModule();
+  if (!phinited) TCMalloc_ThreadCache::InitModule();
 
   // Allocate at least one byte to avoid boundary conditions below
   if (size == 0) size = 1;
 
-  if (size <= kMaxSize && align < kPageSize) {
+  if (size <= max_class_size && align < kPageSize) {
     // Search through acceptable size classes looking for one with
     // enough alignment.  This depends on the fact that
     // InitSizeClasses() currently produces several size classes that
@@ -2638,10 +4825,16 @@ static void* do_memalign(size_t align, size_t size) {
     // we miss in the size class array, but that is deemed acceptable
     // since memalign() should be used rarely.
     int cl = SizeClass(size);
-    while (cl < kNumClasses && ((class_to_size[cl] & (align - 1)) != 0)) {
+    while (cl < num_size_classes && ((class_to_size[cl] & (align - 1)) != 0)) {
       cl++;
     }
-    if (cl < kNumClasses) {
+    if (cl < num_size_classes) {
+      TCMalloc_CPUCache* cpu = TCMalloc_CPUCache::GetCurrent();
+      if (cpu != NULL) {
+        void* result = cpu->Lock()->Allocate(class_to_size[cl]);
+        cpu->Unlock();
+        return result;
+      }
       TCMalloc_ThreadCache* heap = TCMalloc_ThreadCache::GetCache();
       return heap->Allocate(class_to_size[cl]);
     }
@@ -2649,6 +4842,7 @@ static void* do_memalign(size_t align, size_t size) {
 
   // We will allocate directly from the page heap
   SpinLockHolder h(&pageheap_lock);
+  TCMalloc_PageHeap* pageheap = pageheaps[CurrentNode()];
 
   if (align <= kPageSize) {
     // Any page-level allocation will be fine
@@ -2739,6 +4933,8 @@ static inline struct mallinfo do_mallinfo() {
 extern "C" {
   void* malloc(size_t size)
       __THROW ATTRIBUTE_SECTION(google_malloc_allocators);
+  void* malloc_sized(size_t size, size_t* actual)
+      __THROW ATTRIBUTE_SECTION(google_malloc_allocators);
   void free(void* ptr)
       __THROW ATTRIBUTE_SECTION(google_malloc_allocators);
   void* realloc(void* ptr, size_t size)
@@ -2770,6 +4966,12 @@ void* operator new[](size_t size)
 void operator delete[](void* p)
     __THROW ATTRIBUTE_SECTION(google_malloc_allocators);
 
+// Sized deallocation (C++14): "size" is what was passed to new
+void operator delete(void* p, size_t size)
+    __THROW ATTRIBUTE_SECTION(google_malloc_allocators);
+void operator delete[](void* p, size_t size)
+    __THROW ATTRIBUTE_SECTION(google_malloc_allocators);
+
 // And the nothrow variants of these:
 void* operator new(size_t size, const std::nothrow_t&)
     __THROW ATTRIBUTE_SECTION(google_malloc_allocators);
@@ -2797,7 +4999,7 @@ extern "C" void* calloc(size_t n, size_t elem_size) __THROW {
   if (elem_size != 0 && size / elem_size != n) return NULL;
 
   void* result = do_malloc(size);
-  if (result != NULL) {
+  if (result != NULL && !IsZeroedAllocation(result, size)) {
     memset(result, 0, size);
   }
   MallocHook::InvokeNewHook(result, size);
@@ -2822,14 +5024,7 @@ extern "C" void* realloc(void* old_ptr, size_t new_size) __THROW {
   }
 
   // Get the size of the old entry
-  const PageID p = reinterpret_cast<uintptr_t>(old_ptr) >> kPageShift;
-  Span* span = pageheap->GetDescriptor(p);
-  size_t old_size;
-  if (span->sizeclass != 0) {
-    old_size = ByteSizeForClass(span->sizeclass);
-  } else {
-    old_size = span->length << kPageShift;
-  }
+  const size_t old_size = AllocatedSize(old_ptr);
 
   // Reallocate if the new size is larger than the old size,
   // or if the new size is significantly smaller than the old size.
@@ -2916,6 +5111,11 @@ void operator delete(void* p, const std::nothrow_t&) __THROW {
   do_free(p);
 }
 
+void operator delete(void* p, size_t size) __THROW {
+  MallocHook::InvokeDeleteHook(p);
+  do_free_sized(p, size);
+}
+
 void* operator new[](size_t size) {
   void* p = cpp_alloc(size, false);
   // We keep this next instruction out of cpp_alloc for a reason: when
@@ -2943,6 +5143,11 @@ void operator delete[](void* p, const std::nothrow_t&) __THROW {
   do_free(p);
 }
 
+void operator delete[](void* p, size_t size) __THROW {
+  MallocHook::InvokeDeleteHook(p);
+  do_free_sized(p, size);
+}
+
 extern "C" void* memalign(size_t align, size_t size) __THROW {
   void* result = do_memalign(align, size);
   MallocHook::InvokeNewHook(result, size);
@@ -2986,6 +5191,20 @@ extern "C" void* pvalloc(size_t size) __THROW {
   return result;
 }
 
+// The number of bytes malloc(size) would make usable, so that callers
+// that grow buffers can use the whole size class
+extern "C" size_t malloc_good_size(size_t size) {
+  return AllocationSize(size);
+}
+
+// Like malloc(), but also stores the usable size in "*actual"
+extern "C" void* malloc_sized(size_t size, size_t* actual) __THROW {
+  void* result = do_malloc(size);
+  MallocHook::InvokeNewHook(result, size);
+  if (result != NULL) *actual = AllocatedSize(result);
+  return result;
+}
+
 extern "C" void malloc_stats(void) {
   do_malloc_stats();
 }
@@ -1207,16 +1207,15 @@ static void* (*mmapper_addr)() = &Mmapper;
 static void VerifyMemoryRegionMapStackGet() {
   void* addr = (*mmapper_addr)();
   uintptr_t caller = 0;
-  MemoryRegionMap::Lock();
-  for (MemoryRegionMap::RegionIterator
-         i = MemoryRegionMap::BeginRegionLocked();
-         i != MemoryRegionMap::EndRegionLocked(); ++i) {
-    if (i->start_addr == reinterpret_cast<uintptr_t>(addr)) {
-      CHECK(caller == 0);
-      caller = i->caller;
+  { MemoryRegionMap::Snapshot regions;
+    for (MemoryRegionMap::RegionIterator i = regions.begin();
+         i != regions.end(); ++i) {
+      if (i->start_addr == reinterpret_cast<uintptr_t>(addr)) {
+        CHECK(caller == 0);
+        caller = i->caller;
+      }
     }
   }
-  MemoryRegionMap::Unlock();
   // caller must point into Mmapper function:
   if (!(reinterpret_cast<uintptr_t>(mmapper_addr) <= caller  &&
         caller <= reinterpret_cast<uintptr_t>(mmapper_addr) + 0x40)) {
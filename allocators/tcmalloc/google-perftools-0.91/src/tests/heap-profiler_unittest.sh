@@ -45,6 +45,7 @@
 # If not, we set them to some reasonable values
 BINDIR="${BINDIR:-.}"
 PPROF_PATH="${PPROF_PATH:-$BINDIR/src/pprof}"
+HEAP_TIMELINE="`dirname $PPROF_PATH`/heap-timeline"
 
 if [ "x$1" = "x-h" -o "x$1" = "x--help" ]; then
   echo "USAGE: $0 [unittest dir] [path to pprof]"
@@ -114,6 +115,16 @@ VerifyMemFunction Allocate $HEAPPROFILE.0700.heap $HEAPPROFILE.0760.heap
 VerifyMemFunction Allocate2 ${HEAPPROFILE}_*.0723.heap
 VerifyMemFunction Allocate ${HEAPPROFILE}_*.0700.heap ${HEAPPROFILE}_*.0760.heap
 
+# The incremental stream, read back at the same dumps, should say the same.
+export HEAPPROFILE="$TEST_TMPDIR/incremental"
+HEAP_PROFILE_INCREMENTAL=1 HEAP_PROFILE_DELTA_INTERVAL=1073741824 \
+  $HEAP_PROFILER >$TEST_TMPDIR/output 2>&1
+for dump in 0723 0700 0760; do
+  $HEAP_TIMELINE --dump=$dump $HEAPPROFILE.heapdelta >$HEAPPROFILE.$dump.heap
+done
+VerifyMemFunction Allocate2 $HEAPPROFILE.0723.heap
+VerifyMemFunction Allocate $HEAPPROFILE.0700.heap $HEAPPROFILE.0760.heap
+
 rm -rf $TMPDIR      # clean up
 
 if [ $num_failures = 0 ]; then
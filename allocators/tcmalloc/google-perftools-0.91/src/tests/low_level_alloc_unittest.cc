@@ -137,6 +137,25 @@ static void Test(bool use_new_arena, bool call_malloc_hook, int n) {
   }
 }
 
+// Check that freed small blocks are reused, and that an arena can be
+// deleted with blocks still allocated in it.
+static void TestSmallBlocksAndBulkDelete() {
+  LowLevelAlloc::Arena *arena = LowLevelAlloc::NewArena(0, 0);
+  void *p = LowLevelAlloc::Alloc(100, arena);
+  LowLevelAlloc::Free(p);
+  CHECK(LowLevelAlloc::Alloc(100, arena) == p);
+  for (int i = 0; i != 10000; i++) {
+    char *q = reinterpret_cast<char *>(
+                  LowLevelAlloc::Alloc(1 + (i % 700), arena));
+    memset(q, i, 1 + (i % 700));
+    if (i % 3 == 0) {
+      LowLevelAlloc::Free(q);
+    }
+  }
+  CHECK(!LowLevelAlloc::DeleteArena(arena));
+  LowLevelAlloc::DeleteArenaAndBlocks(arena);
+}
+
 // used for counting allocates and frees
 static int32 allocates;
 static int32 frees;
@@ -184,6 +203,7 @@ int main(int argc, char *argv[]) {
       CHECK_EQ(frees, 0);
     }
   }
+  TestSmallBlocksAndBulkDelete();
   printf("PASS\n");
   MallocHook::SetNewHook(old_alloc_hook);
   MallocHook::SetDeleteHook(old_free_hook);
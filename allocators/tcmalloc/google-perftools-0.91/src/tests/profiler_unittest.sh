@@ -181,6 +181,11 @@ VerifySimilar p9 $PROFILER4 p10 $PROFILER4 2
 $PROFILER4 2 4 $TMPDIR/p11 || RegisterFailure
 VerifyAcrossThreads p11 $PROFILER4 2
 
+# Sample with per-thread perf_event counters (where the kernel lacks
+# them, the profiler falls back to the interval timer)
+CPUPROFILE_PERF_EVENTS=1 $PROFILER4 2 4 $TMPDIR/p12 || RegisterFailure
+VerifyAcrossThreads p12 $PROFILER4 2
+
 # Make sure that when we have a process with a fork, the profiles don't
 # clobber each other
 CPUPROFILE=$TMPDIR/p6 $PROFILER1 1 -2 || RegisterFailure
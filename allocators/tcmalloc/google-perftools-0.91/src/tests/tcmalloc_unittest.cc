@@ -51,6 +51,9 @@
 #include <stdio.h>
 #include <stdint.h>      // for intptr_t
 #include <unistd.h>      // for getpid()
+#include <sys/wait.h>    // for waitpid()
+#include <sys/mman.h>    // for mmap()
+#include <fcntl.h>       // for open()
 #include <assert.h>
 #include <pthread.h>
 #include <vector>
@@ -58,9 +61,15 @@
 #include <new>
 #include "base/logging.h"
 #include "google/malloc_extension.h"
+#include "google/malloc_hook.h"
+#include "google/malloc_telemetry.h"
 
 #define LOGSTREAM   stdout
 
+// Size class queries, which tcmalloc.cc defines
+extern "C" size_t malloc_good_size(size_t size);
+extern "C" void* malloc_sized(size_t size, size_t* actual);
+
 using std::vector;
 using std::string;
 
@@ -418,6 +427,419 @@ static void TestHugeAllocations() {
   inst->ReleaseFreeMemory();
 }
 
+// A SysAllocator that hands out a region reserved in advance, in
+// 2MB units, as a hugepage-backed region might.
+class RegionAllocator : public SysAllocator {
+ public:
+  static const size_t kUnit = 2 << 20;
+
+  RegionAllocator(char* start, size_t length)
+    : start_(start), next_(start), end_(start + length),
+      allocs_(0), releases_(0) {
+  }
+
+  virtual void* Alloc(size_t size, size_t* actual_size, size_t alignment) {
+    CHECK_EQ(size % kUnit, 0);
+    CHECK_GE(alignment, kUnit);
+    uintptr_t p = reinterpret_cast<uintptr_t>(next_);
+    p = (p + alignment - 1) & ~(alignment - 1);
+    if (size > static_cast<size_t>(end_ - reinterpret_cast<char*>(p))) {
+      return NULL;
+    }
+    next_ = reinterpret_cast<char*>(p) + size;
+    *actual_size = size;
+    allocs_++;
+    return reinterpret_cast<void*>(p);
+  }
+
+  virtual size_t Alignment() { return kUnit; }
+
+  virtual bool Release(void* start, size_t length) {
+    if (!Contains(start)) return false;
+    releases_++;
+    return true;
+  }
+
+  bool Contains(void* p) const {
+    return (p >= start_) && (p < end_);
+  }
+
+  int allocs() const { return allocs_; }
+  int releases() const { return releases_; }
+
+ private:
+  char* start_;
+  char* next_;
+  char* end_;
+  int allocs_;
+  int releases_;
+};
+
+static size_t GetProperty(const char* name) {
+  size_t value = 0;
+  CHECK(MallocExtension::instance()->GetNumericProperty(name, &value));
+  return value;
+}
+
+static void TestPageHeapCoalescing() {
+  const size_t frees = GetProperty("tcmalloc.pageheap_frees");
+  const size_t coalesces = GetProperty("tcmalloc.pageheap_coalesces");
+
+  // Large objects allocated in a row are mostly neighbours, so freeing
+  // them merges their spans back together.
+  const int kObjects = 16;
+  void* objects[kObjects];
+  for (int i = 0; i < kObjects; i++) {
+    objects[i] = malloc((3 << 20) / 2);
+    CHECK(objects[i] != NULL);
+  }
+  for (int i = 0; i < kObjects; i++) {
+    free(objects[i]);
+  }
+  CHECK_GE(GetProperty("tcmalloc.pageheap_frees"), frees + kObjects);
+  CHECK_GT(GetProperty("tcmalloc.pageheap_coalesces"), coalesces);
+  CHECK_GT(GetProperty("tcmalloc.pageheap_large_spans"), 0);
+}
+
+// Large objects freed and allocated again in turn come back from the
+// span cache, and so are not returned to the page heap each time.
+static void TestSpanCache() {
+  MallocExtension* ext = MallocExtension::instance();
+  const size_t period = GetProperty("tcmalloc.sampling_period_bytes");
+  const size_t limit = GetProperty("tcmalloc.span_cache_bytes");
+  CHECK(ext->SetNumericProperty("tcmalloc.sampling_period_bytes", 0));
+  CHECK(ext->SetNumericProperty("tcmalloc.span_cache_bytes", 1 << 20));
+
+  const size_t kSize = 64 << 10;
+  const int kIters = 100;
+  size_t frees = GetProperty("tcmalloc.pageheap_frees");
+  void* first = malloc(kSize);
+  CHECK(first != NULL);
+  free(first);
+  for (int i = 0; i < kIters; i++) {
+    void* p = malloc(kSize);
+    CHECK(p == first);
+    memset(p, 1, kSize);
+    free(p);
+  }
+  CHECK_EQ(GetProperty("tcmalloc.pageheap_frees"), frees);
+  // calloc() clears what the cache hands back
+  char* p = reinterpret_cast<char*>(calloc(1, kSize));
+  CHECK(p == first);
+  for (size_t j = 0; j < kSize; j++) CHECK_EQ(p[j], 0);
+  free(p);
+
+  // The cache holds no more than the limit; the rest go back
+  vector<void*> objects;
+  for (int i = 0; i < 32; i++) objects.push_back(malloc(kSize));
+  frees = GetProperty("tcmalloc.pageheap_frees");
+  for (int i = 0; i < objects.size(); i++) free(objects[i]);
+  CHECK_GE(GetProperty("tcmalloc.pageheap_frees"), frees + 16);
+
+  // With the cache off, every free goes back
+  CHECK(ext->SetNumericProperty("tcmalloc.span_cache_bytes", 0));
+  frees = GetProperty("tcmalloc.pageheap_frees");
+  for (int i = 0; i < kIters; i++) {
+    char* q = reinterpret_cast<char*>(malloc(kSize));
+    CHECK(q != NULL);
+    q[0] = 1;
+    free(q);
+  }
+  CHECK_GE(GetProperty("tcmalloc.pageheap_frees"), frees + kIters);
+
+  CHECK(ext->SetNumericProperty("tcmalloc.span_cache_bytes", limit));
+  CHECK(ext->SetNumericProperty("tcmalloc.sampling_period_bytes", period));
+}
+
+static void TestPrefault() {
+  MallocExtension* ext = MallocExtension::instance();
+  CHECK(ext->SetNumericProperty("tcmalloc.prefault_bytes", 32 << 20));
+  CHECK_EQ(GetProperty("tcmalloc.prefault_bytes"), 32 << 20);
+  for (int i = 0; i < 1000 && GetProperty("tcmalloc.prefaulted_bytes") <
+                              static_cast<size_t>(32 << 20); i++) {
+    usleep(10000);
+  }
+  const size_t ready = GetProperty("tcmalloc.prefaulted_bytes");
+  CHECK_GE(ready, 32 << 20);
+
+  // A large calloc() comes out of the pool, and is zero.  The
+  // prefaulter may have put another 16MB in since.
+  const size_t kSize = 4 << 20;
+  char* p = reinterpret_cast<char*>(calloc(1, kSize));
+  CHECK(p != NULL);
+  const size_t left = GetProperty("tcmalloc.prefaulted_bytes");
+  CHECK(left == ready - kSize || left == ready - kSize + (16 << 20));
+  for (size_t i = 0; i < kSize; i++) CHECK_EQ(p[i], 0);
+  memset(p, 1, kSize);
+  free(p);
+
+  // Turning it off leaves the pool alone until memory is released
+  CHECK(ext->SetNumericProperty("tcmalloc.prefault_bytes", 0));
+  ext->ReleaseFreeMemory();
+  CHECK_EQ(GetProperty("tcmalloc.prefaulted_bytes"), 0);
+}
+
+static void TestAsyncRelease() {
+  MallocExtension* ext = MallocExtension::instance();
+  CHECK(ext->SetNumericProperty("tcmalloc.async_release_bytes", 256 << 20));
+  CHECK_EQ(GetProperty("tcmalloc.async_release_bytes"), 256 << 20);
+
+  // Free enough large objects for the scavenger to release some, with
+  // small ones between them so their spans do not all coalesce
+  const size_t kSize = 8 << 20;
+  vector<void*> small;
+  for (int i = 0; i < 400; i++) {
+    char* p = reinterpret_cast<char*>(malloc(kSize));
+    CHECK(p != NULL);
+    memset(p, 1, kSize);
+    small.push_back(malloc(1 << 20));
+    free(p);
+  }
+  for (int i = 0; i < 1000 && GetProperty("tcmalloc.pending_release_bytes") > 0;
+       i++) {
+    usleep(10000);
+  }
+  CHECK_EQ(GetProperty("tcmalloc.pending_release_bytes"), 0);
+
+  // Spans only become reusable once released, and calloc() of them
+  // then relies on the pages being zero
+  for (int i = 0; i < 50; i++) {
+    char* p = reinterpret_cast<char*>(calloc(1, kSize));
+    CHECK(p != NULL);
+    for (size_t j = 0; j < kSize; j += 4096) CHECK_EQ(p[j], 0);
+    memset(p, 1, kSize);
+    free(p);
+  }
+  for (int i = 0; i < small.size(); i++) {
+    free(small[i]);
+  }
+
+  CHECK(ext->SetNumericProperty("tcmalloc.async_release_bytes", 0));
+}
+
+static void TestGoodSize() {
+  for (size_t size = 1; size < (1 << 20); size += size / 8 + 1) {
+    const size_t good = malloc_good_size(size);
+    CHECK_GE(good, size);
+    // Asking for the good size gets the same class
+    CHECK_EQ(malloc_good_size(good), good);
+    size_t actual = 0;
+    char* p = reinterpret_cast<char*>(malloc_sized(size, &actual));
+    CHECK(p != NULL);
+    CHECK_GE(actual, good);
+    memset(p, 1, actual);
+    free(p);
+  }
+}
+
+static void TestSystemAllocator() {
+  const size_t kRegionSize = 64 << 20;
+  char* region = reinterpret_cast<char*>(
+      mmap(NULL, kRegionSize, PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+  CHECK(region != reinterpret_cast<char*>(MAP_FAILED));
+  static RegionAllocator* allocator = NULL;
+  allocator = new (malloc(sizeof(RegionAllocator)))
+      RegionAllocator(region, kRegionSize);
+  CHECK(MallocExtension::instance()->AddSystemAllocator(allocator));
+
+  // Once the free pages run out, the page heap grows from the region
+  // until it is used up, and then from the system again.
+  vector<char*> objects;
+  int in_region = 0;
+  bool fell_back = false;
+  for (int i = 0; i < 10000 && !fell_back; i++) {
+    char* p = reinterpret_cast<char*>(malloc(3 << 20));
+    CHECK(p != NULL);
+    if (allocator->Contains(p)) {
+      memset(p, i, 3 << 20);
+      in_region++;
+    } else if (in_region > 0) {
+      fell_back = true;
+    }
+    objects.push_back(p);
+  }
+  CHECK_GT(allocator->allocs(), 0);
+  CHECK(fell_back);
+  for (int i = 0; i < objects.size(); i++) {
+    free(objects[i]);
+  }
+
+  // Its memory is released through it.
+  MallocExtension::instance()->ReleaseFreeMemory();
+  CHECK_GT(allocator->releases(), 0);
+}
+
+// The hooks count only the test's own calls; earlier tests leave
+// threads behind that may allocate.
+static pthread_t hook_thread;
+static volatile int hook_news[2];
+static volatile int hook_deletes;
+static void* volatile hook_last_new;
+
+static void CountingNewHook0(void* ptr, size_t size) {
+  if (!pthread_equal(pthread_self(), hook_thread)) return;
+  hook_news[0]++;
+  hook_last_new = ptr;
+}
+static void CountingNewHook1(void* ptr, size_t size) {
+  if (pthread_equal(pthread_self(), hook_thread)) hook_news[1]++;
+}
+static void CountingDeleteHook(void* ptr) {
+  if (pthread_equal(pthread_self(), hook_thread) && ptr != NULL) {
+    hook_deletes++;
+  }
+}
+
+// Several hooks of a kind can be added at once, alongside the one set
+// with Set*Hook, and removed in any order.
+static void TestMallocHooks() {
+  hook_thread = pthread_self();
+  CHECK(MallocHook::AddNewHook(&CountingNewHook0));
+  CHECK(MallocHook::AddNewHook(&CountingNewHook1));
+  CHECK(MallocHook::AddDeleteHook(&CountingDeleteHook));
+  CHECK(!MallocHook::AddNewHook(NULL));
+  void* p = malloc(100);
+  CHECK_EQ(hook_news[0], 1);
+  CHECK_EQ(hook_news[1], 1);
+  CHECK(hook_last_new == p);
+  free(p);
+  CHECK_EQ(hook_deletes, 1);
+
+  CHECK(MallocHook::RemoveNewHook(&CountingNewHook0));
+  CHECK(!MallocHook::RemoveNewHook(&CountingNewHook0));
+  delete new int;
+  CHECK_EQ(hook_news[0], 1);
+  CHECK_EQ(hook_news[1], 2);
+  CHECK_EQ(hook_deletes, 2);
+
+  // A set hook is invoked too, and setting it leaves the added ones be.
+  MallocHook::NewHook old = MallocHook::SetNewHook(&CountingNewHook0);
+  free(malloc(10));
+  CHECK_EQ(hook_news[0], 2);
+  CHECK_EQ(hook_news[1], 3);
+  MallocHook::SetNewHook(old);
+
+  // Only so many fit.
+  int added = 0;
+  while (MallocHook::AddNewHook(&CountingNewHook0)) added++;
+  CHECK_EQ(added, MallocHook::kMaxHooks - 1);
+  while (MallocHook::RemoveNewHook(&CountingNewHook0)) added--;
+  CHECK_EQ(added, 0);
+
+  CHECK(MallocHook::RemoveNewHook(&CountingNewHook1));
+  CHECK(MallocHook::RemoveDeleteHook(&CountingDeleteHook));
+  free(malloc(10));
+  CHECK_EQ(hook_news[1], 3);
+  CHECK_EQ(hook_deletes, 3);
+}
+
+// Read "page" into "*t" once it has been rewritten from scratch since
+// the last read into "*t".
+static void WaitForTelemetry(const TCMallocTelemetry* page,
+                             TCMallocTelemetry* t) {
+  const uint64_t before = t->updates;
+  for (int i = 0; i < 500 && t->updates < before + 2; i++) {
+    usleep(10000);
+    CHECK(TCMallocTelemetryRead(page, t, 100));
+  }
+  CHECK_GE(t->updates, before + 2);
+}
+
+// Read the telemetry page from a mapping of our own, as an agent in
+// another process would, and see it follow a large allocation.
+static void TestTelemetry() {
+  // The page may have been started at startup already
+  const char* pattern = getenv("TCMALLOC_TELEMETRY_PATH");
+  if (pattern == NULL || pattern[0] == '\0') {
+    pattern = "/tmp/tcmalloc_unittest.%d";
+  }
+  char path[1024];
+  snprintf(path, sizeof(path), pattern, getpid());
+  CHECK(MallocExtension::instance()->PublishTelemetry(pattern));
+  const int fd = open(path, O_RDONLY);
+  CHECK_GE(fd, 0);
+  void* map = mmap(NULL, sizeof(TCMallocTelemetry), PROT_READ, MAP_SHARED,
+                   fd, 0);
+  CHECK(map != MAP_FAILED);
+  close(fd);
+  const TCMallocTelemetry* page = reinterpret_cast<TCMallocTelemetry*>(map);
+
+  TCMallocTelemetry t;
+  CHECK(TCMallocTelemetryRead(page, &t, 100));
+  CHECK_EQ(t.size, sizeof(TCMallocTelemetry));
+  CHECK_EQ(t.pid, getpid());
+  CHECK_GT(t.num_classes, 1);
+  CHECK_LE(t.num_classes, TCMALLOC_TELEMETRY_MAX_CLASSES);
+  CHECK_GT(t.classes[1].size, 0);
+  CHECK_GE(t.mapped_bytes, t.live_bytes);
+
+  WaitForTelemetry(page, &t);
+  const uint64_t live = t.live_bytes;
+  const size_t kSize = 64 << 20;
+  char* p = reinterpret_cast<char*>(malloc(kSize));
+  CHECK(p != NULL);
+  memset(p, 1, kSize);
+  WaitForTelemetry(page, &t);
+  CHECK_GE(t.live_bytes, live + kSize / 2);
+  CHECK_GE(t.mapped_bytes, t.live_bytes);
+  free(p);
+
+  munmap(map, sizeof(TCMallocTelemetry));
+  unlink(path);
+}
+
+static volatile bool fork_churn_stop = false;
+
+static void* ForkChurnThread(void* arg) {
+  void* slots[64] = { NULL };
+  for (unsigned i = 0; !fork_churn_stop; i++) {
+    const int k = (i * 7) % 64;
+    free(slots[k]);
+    slots[k] = malloc(16 + (i * 37) % 2000);
+  }
+  for (int k = 0; k < 64; k++) free(slots[k]);
+  return NULL;
+}
+
+static void* ForkChildThread(void* arg) {
+  for (int i = 0; i < 1000; i++) free(malloc(16 + i % 500));
+  return NULL;
+}
+
+// Children forked while other threads allocate can allocate, from new
+// threads too, without deadlocking on a lock those threads held.
+static void TestFork() {
+  static const int kThreads = 4;
+  static const int kForks = 20;
+  pthread_t churn[kThreads];
+  for (int i = 0; i < kThreads; i++) {
+    CHECK_EQ(pthread_create(&churn[i], NULL, ForkChurnThread, NULL), 0);
+  }
+  for (int i = 0; i < kForks; i++) {
+    const pid_t pid = fork();
+    CHECK_GE(pid, 0);
+    if (pid == 0) {
+      alarm(10);
+      vector<void*> objects;
+      for (int j = 0; j < 1000; j++) objects.push_back(malloc(j * 8 + 1));
+      for (int j = 0; j < objects.size(); j++) free(objects[j]);
+      pthread_t t;
+      if (pthread_create(&t, NULL, ForkChildThread, NULL) != 0) _exit(1);
+      pthread_join(t, NULL);
+      GetProperty("tcmalloc.current_total_thread_cache_bytes");
+      _exit(0);
+    }
+    int status;
+    CHECK_EQ(waitpid(pid, &status, 0), pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  fork_churn_stop = true;
+  for (int i = 0; i < kThreads; i++) {
+    CHECK_EQ(pthread_join(churn[i], NULL), 0);
+  }
+}
+
 static void TestCalloc(size_t n, size_t s, bool ok) {
   char* p = reinterpret_cast<char*>(calloc(n, s));
   if (FLAGS_verbose)
@@ -630,9 +1052,36 @@ int main(int argc, char** argv) {
 
   for (int i = 0; i < FLAGS_numthreads; ++i) delete threads[i];    // Cleanup
 
+  fprintf(LOGSTREAM, "Testing fork\n");
+  TestFork();
+
   // Do the memory intensive tests after threads are done, since exhausting
   // the available address space can make pthread_create to fail.
 
+  fprintf(LOGSTREAM, "Testing page heap coalescing\n");
+  TestPageHeapCoalescing();
+
+  fprintf(LOGSTREAM, "Testing the span cache\n");
+  TestSpanCache();
+
+  fprintf(LOGSTREAM, "Testing the prefaulted pool\n");
+  TestPrefault();
+
+  fprintf(LOGSTREAM, "Testing background release\n");
+  TestAsyncRelease();
+
+  fprintf(LOGSTREAM, "Testing size class queries\n");
+  TestGoodSize();
+
+  fprintf(LOGSTREAM, "Testing an added system allocator\n");
+  TestSystemAllocator();
+
+  fprintf(LOGSTREAM, "Testing malloc hooks\n");
+  TestMallocHooks();
+
+  fprintf(LOGSTREAM, "Testing the telemetry page\n");
+  TestTelemetry();
+
   // Check that huge allocations fail with NULL instead of crashing
   fprintf(LOGSTREAM, "Testing huge allocations\n");
   TestHugeAllocations();
@@ -0,0 +1,284 @@
+/*
+ * churn: what an allocator costs a program that creates and destroys
+ * threads at a high rate, each of which allocates a little.
+ *
+ *	churn [-n threads] [-c concurrent] [-a allocs] [-s size]
+ *	      [-p pass] [-x seed]
+ *
+ * Threads (10000 in all) are created concurrent (8) at a time; the
+ * creator waits for each batch before it starts the next.  Each makes
+ * allocs (100) allocations of 16 to size (512) bytes and writes them,
+ * then frees them, except for pass (10) percent, which it leaves in a
+ * pool for later threads to free: objects from a dead thread, freed by
+ * a live one, which is where per-thread heaps strand memory.  Whatever
+ * is in the pool at the end is freed.
+ *
+ * It reports the percentiles of two times, from pthread_create():
+ *
+ *   start    until the thread runs.
+ *   first    until the thread's first malloc returns: the start, plus
+ *            what the allocator takes to set up the thread's cache or
+ *            heap, or to find and adopt a dead thread's.
+ *
+ * and, as what dead threads leave behind, the growth of the resident
+ * set over the run per thread, against a first batch run beforehand to
+ * warm the thread library's stack cache and the allocator.  The rate
+ * is threads per second.
+ *
+ * The benchmark allocates through malloc and free, so it measures
+ * whatever LD_PRELOAD puts there.  Built with -DCHURN_HEAP it calls
+ * churn_malloc and churn_free instead, for heaps that cannot replace
+ * malloc: churnheap.cpp puts Heap Layers' ThreadSpecificHeap (or
+ * TLSHeap) there, and nedmalloc's calls can be named directly:
+ *
+ *	cc -O2 -D_GNU_SOURCE -DCHURN_HEAP -Dchurn_malloc=nedmalloc \
+ *	    -Dchurn_free=nedfree -I allocators/nedmalloc util/bench/churn.c \
+ *	    allocators/nedmalloc/nedmalloc.c -o churn-ned -lpthread
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef CHURN_HEAP
+void	*churn_malloc(size_t);
+void	 churn_free(void *);
+#define	MALLOC(sz)	churn_malloc(sz)
+#define	FREE(p)		churn_free(p)
+#else
+#define	MALLOC(sz)	malloc(sz)
+#define	FREE(p)		free(p)
+#endif
+
+#define	MAXCONCURRENT	1024
+#define	POOLSLOTS	4096
+
+enum { START, FIRST, NTIMES };
+
+struct worker {
+	double		created;	/* when pthread_create was called */
+	double		t[NTIMES];
+	uint64_t	x;
+};
+
+static int nthreads = 10000, concurrent = 8, nallocs = 100, pass = 10;
+static size_t maxsz = 512;
+static uint64_t seed = 1;
+
+/* Objects left by dead threads, for later threads to free */
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static void *pool[POOLSLOTS];
+static unsigned poolnext;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t
+rnd(uint64_t *x)
+{
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+	return (*x * 2685821657736338717ULL);
+}
+
+static void *
+xmalloc(size_t sz)
+{
+	void *p;
+
+	if ((p = MALLOC(sz)) == NULL) {
+		fprintf(stderr, "churn: out of memory\n");
+		exit(1);
+	}
+	return (p);
+}
+
+/* Leave p in the pool, and free what it displaces. */
+static void
+leave(void *p)
+{
+	void *old;
+
+	pthread_mutex_lock(&poollock);
+	old = pool[poolnext];
+	pool[poolnext] = p;
+	poolnext = (poolnext + 1) % POOLSLOTS;
+	pthread_mutex_unlock(&poollock);
+	if (old != NULL)
+		FREE(old);
+}
+
+static void
+drain(void)
+{
+	int i;
+
+	for (i = 0; i < POOLSLOTS; i++) {
+		if (pool[i] != NULL)
+			FREE(pool[i]);
+		pool[i] = NULL;
+	}
+}
+
+static void *
+run(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	void **objs;
+	size_t sz;
+	int i;
+
+	w->t[START] = now() - w->created;
+	objs = xmalloc(nallocs * sizeof(void *));
+	w->t[FIRST] = now() - w->created;
+	for (i = 0; i < nallocs; i++) {
+		sz = 16 + rnd(&w->x) % (maxsz - 15);
+		objs[i] = xmalloc(sz);
+		memset(objs[i], 0, sz);
+	}
+	for (i = 0; i < nallocs; i++) {
+		if (rnd(&w->x) % 100 < (uint64_t)pass)
+			leave(objs[i]);
+		else
+			FREE(objs[i]);
+	}
+	FREE(objs);
+	return (NULL);
+}
+
+/* Run threads [first, last) of w, concurrent at a time. */
+static void
+churn(struct worker *w, int first, int last)
+{
+	pthread_t tid[MAXCONCURRENT];
+	int i, j, n;
+
+	for (i = first; i < last; i += n) {
+		n = last - i < concurrent ? last - i : concurrent;
+		for (j = 0; j < n; j++) {
+			w[i + j].x = 0x9e3779b97f4a7c15ULL * (i + j + seed);
+			w[i + j].created = now();
+			if (pthread_create(&tid[j], NULL, run, &w[i + j]) != 0) {
+				perror("churn: pthread_create");
+				exit(1);
+			}
+		}
+		for (j = 0; j < n; j++)
+			pthread_join(tid[j], NULL);
+	}
+}
+
+/* The resident set, in bytes. */
+static long
+resident(void)
+{
+	FILE *fp;
+	long size, rss = 0;
+
+	if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+		if (fscanf(fp, "%ld %ld", &size, &rss) != 2)
+			rss = 0;
+		fclose(fp);
+	}
+	return (rss * sysconf(_SC_PAGESIZE));
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: churn [-n threads] [-c concurrent] "
+	    "[-a allocs] [-s size]\n"
+	    "             [-p pass] [-x seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *names[NTIMES] = { "start", "first" };
+	struct worker *w;
+	double start, elapsed, *v;
+	long rss0, rss1;
+	int ch, e, i;
+
+	while ((ch = getopt(argc, argv, "n:c:a:s:p:x:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nthreads = atoi(optarg);
+			break;
+		case 'c':
+			concurrent = atoi(optarg);
+			break;
+		case 'a':
+			nallocs = atoi(optarg);
+			break;
+		case 's':
+			maxsz = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			pass = atoi(optarg);
+			break;
+		case 'x':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nthreads < 1 || concurrent < 1 || concurrent > MAXCONCURRENT ||
+	    nallocs < 1 || maxsz < 16 || pass < 0 || pass > 100)
+		usage();
+
+	printf("threads %d concurrent %d allocs %d size %zu pass %d%%\n",
+	    nthreads, concurrent, nallocs, maxsz, pass);
+	if ((w = calloc(nthreads + concurrent, sizeof(*w))) == NULL ||
+	    (v = malloc(nthreads * sizeof(double))) == NULL) {
+		fprintf(stderr, "churn: out of memory\n");
+		exit(1);
+	}
+
+	/* A batch to warm up */
+	churn(w + nthreads, 0, concurrent);
+	drain();
+	rss0 = resident();
+
+	start = now();
+	churn(w, 0, nthreads);
+	elapsed = now() - start;
+	drain();
+	rss1 = resident();
+
+	for (e = 0; e < NTIMES; e++) {
+		for (i = 0; i < nthreads; i++)
+			v[i] = w[i].t[e];
+		qsort(v, nthreads, sizeof(double), cmp);
+		printf("%s: p50 %.1f us p99 %.1f us max %.1f us\n", names[e],
+		    v[nthreads / 2] * 1e6, v[(int)(nthreads * 0.99)] * 1e6,
+		    v[nthreads - 1] * 1e6);
+	}
+	printf("retained %.0f bytes per dead thread (resident %+ld KB)\n",
+	    (double)(rss1 - rss0) / nthreads, (rss1 - rss0) / 1024);
+	printf("%.0f operations per second\n", nthreads / elapsed);
+	return (0);
+}
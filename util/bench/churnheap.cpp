@@ -0,0 +1,53 @@
+/*
+ * churnheap: Heap Layers' per-thread heaps behind churn's churn_malloc
+ * and churn_free, for a churn built with -DCHURN_HEAP:
+ *
+ *	g++ -std=gnu++98 -O2 -I Heap-Layers -c util/bench/churnheap.cpp
+ *	cc -O2 -DCHURN_HEAP util/bench/churn.c churnheap.o -o churn-tsh \
+ *	    -lstdc++ -lpthread
+ *
+ * ThreadSpecificHeap by default, or TLSHeap with -DCHURN_TLSHEAP, over
+ * the per-thread Kingsley heap of layers' "threadspecific" composition.
+ * Both hand the heap of a dead thread to the next thread that needs
+ * one, so a churn of them should retain little per thread; objects
+ * freed after their thread died go to the heap of the thread freeing.
+ */
+
+#include "heaplayers.h"
+
+#include <stddef.h>
+
+using namespace HL;
+
+volatile bool anyThreadCreated = true;
+
+typedef FreelistHeap<BumpAlloc<65536, MmapHeap> >	FreelistStack;
+typedef SizeHeap<FreelistStack>				SizeStack;
+typedef KingsleyHeap<SizeStack, MmapHeap>		KingsleyStack;
+#ifdef CHURN_TLSHEAP
+typedef TLSHeap<KingsleyStack>				PerThreadStack;
+#else
+typedef ThreadSpecificHeap<KingsleyStack>		PerThreadStack;
+#endif
+
+static PerThreadStack *
+heap(void)
+{
+	static char buf[sizeof(PerThreadStack)];
+	static PerThreadStack *h = new (buf) PerThreadStack;
+
+	return (h);
+}
+
+extern "C" void *
+churn_malloc(size_t sz)
+{
+	return (heap()->malloc(sz));
+}
+
+extern "C" void
+churn_free(void *p)
+{
+	if (p != NULL)
+		heap()->free(p);
+}
@@ -0,0 +1,270 @@
+/*
+ * forklat: how long fork() takes out of a process with a large heap
+ * and busy allocating threads, and how soon the child can allocate.
+ *
+ *	forklat [-m megabytes] [-s size] [-t threads] [-f forks]
+ *	        [-a allocs] [-x seed]
+ *
+ * The main thread fills a heap of megabytes (1024) in objects of 16 to
+ * size (512) bytes, and starts threads (4) that keep allocating and
+ * freeing small objects, so that at any moment some of them are inside
+ * the allocator and all of them have something in their thread caches.
+ * Then it forks forks (100) times.  Each child makes allocs (1000)
+ * small allocations and frees, tells the parent how long it took, and
+ * exits; the parent waits for it before the next fork.  A child that
+ * has not finished in 10 seconds (an allocator that deadlocks after
+ * fork) is killed and counted as failed.
+ *
+ * It reports the percentiles of three times:
+ *
+ *   fork     from calling fork() to its return in the parent: the
+ *            allocator's prepare and parent handlers, and the kernel
+ *            copying the page tables.
+ *   child    from calling fork() to its return in the child, which
+ *            adds the allocator's child handler.
+ *   malloc   the child's first malloc, which is where an allocator
+ *            that resets its state lazily pays for it.
+ *
+ * and forks per second as its rate.  An allocator that takes every lock
+ * before the fork waits for the threads inside it; one that walks its
+ * thread caches or heaps in the child pays for each, and writes to
+ * (so copies) pages that the child would otherwise share.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	MAXTHREADS	256
+#define	CHURNSLOTS	1024
+
+enum { FORK, CHILD, MALLOC, NTIMES };
+
+static size_t heapmb = 1024, maxsz = 512;
+static int nthreads = 4, nforks = 100, nallocs = 1000;
+static uint64_t seed = 1;
+static volatile int stop;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t
+rnd(uint64_t *x)
+{
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+	return (*x * 2685821657736338717ULL);
+}
+
+static void *
+xmalloc(size_t sz)
+{
+	void *p;
+
+	if ((p = malloc(sz)) == NULL) {
+		fprintf(stderr, "forklat: out of memory\n");
+		exit(1);
+	}
+	return (p);
+}
+
+/* Replace random slots of a small working set until told to stop. */
+static void *
+churn(void *arg)
+{
+	void *slot[CHURNSLOTS];
+	uint64_t x = 0x9e3779b97f4a7c15ULL * ((uintptr_t)arg + seed);
+	size_t sz;
+	int i;
+
+	memset(slot, 0, sizeof(slot));
+	while (!stop) {
+		i = rnd(&x) % CHURNSLOTS;
+		free(slot[i]);
+		sz = 16 + rnd(&x) % 241;
+		slot[i] = xmalloc(sz);
+		memset(slot[i], 0, 16);
+	}
+	for (i = 0; i < CHURNSLOTS; i++)
+		free(slot[i]);
+	return (NULL);
+}
+
+/*
+ * What the child does: allocate, and report its times up the pipe.  A
+ * child that deadlocks in the allocator is killed, and counted as failed.
+ */
+static void
+child(int fd, double t0)
+{
+	double t[NTIMES], t1;
+	void **p;
+	int i;
+
+	t[CHILD] = now() - t0;
+	alarm(10);
+	t1 = now();
+	p = malloc(nallocs * sizeof(void *));
+	t[MALLOC] = now() - t1;
+	if (p != NULL) {
+		for (i = 0; i < nallocs; i++)
+			p[i] = malloc(16 + i % 241);
+		for (i = 0; i < nallocs; i++)
+			free(p[i]);
+		free(p);
+	}
+	if (write(fd, t + CHILD, sizeof(t) - sizeof(t[0])) !=
+	    sizeof(t) - sizeof(t[0]))
+		_exit(1);
+	_exit(p == NULL);
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void
+report(const char *name, double *v, int n)
+{
+	qsort(v, n, sizeof(double), cmp);
+	printf("%s: p50 %.1f us p99 %.1f us max %.1f us\n", name,
+	    v[n / 2] * 1e6, v[(int)(n * 0.99)] * 1e6, v[n - 1] * 1e6);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: forklat [-m megabytes] [-s size] "
+	    "[-t threads] [-f forks]\n"
+	    "               [-a allocs] [-x seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *names[NTIMES] = { "fork", "child", "malloc" };
+	pthread_t tid[MAXTHREADS];
+	double *times[NTIMES], t[NTIMES], t0, start, elapsed;
+	size_t bytes = 0, n = 0, cap = 1024, sz;
+	uint64_t x;
+	void **heap;
+	int ch, e, fd[2], i, status, failed = 0;
+	pid_t pid;
+
+	while ((ch = getopt(argc, argv, "m:s:t:f:a:x:")) != -1) {
+		switch (ch) {
+		case 'm':
+			heapmb = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			maxsz = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'f':
+			nforks = atoi(optarg);
+			break;
+		case 'a':
+			nallocs = atoi(optarg);
+			break;
+		case 'x':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (maxsz < 16 || nthreads < 0 || nthreads > MAXTHREADS ||
+	    nforks < 1 || nallocs < 0)
+		usage();
+
+	printf("heap %zu MB size %zu threads %d forks %d allocs %d\n",
+	    heapmb, maxsz, nthreads, nforks, nallocs);
+	x = 0x9e3779b97f4a7c15ULL * seed;
+	heap = xmalloc(cap * sizeof(void *));
+	t0 = now();
+	while (bytes < heapmb << 20) {
+		if (n == cap) {
+			cap *= 2;
+			if ((heap = realloc(heap, cap * sizeof(void *))) ==
+			    NULL) {
+				fprintf(stderr, "forklat: out of memory\n");
+				exit(1);
+			}
+		}
+		sz = 16 + rnd(&x) % (maxsz - 15);
+		heap[n] = xmalloc(sz);
+		memset(heap[n++], 0, sz);
+		bytes += sz;
+	}
+	printf("built %zu objects in %.2f s\n", n, now() - t0);
+
+	for (e = 0; e < NTIMES; e++)
+		times[e] = xmalloc(nforks * sizeof(double));
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&tid[i], NULL, churn, (void *)(uintptr_t)i);
+	usleep(100000);
+
+	start = now();
+	for (i = 0; i < nforks; i++) {
+		if (pipe(fd) != 0) {
+			perror("forklat: pipe");
+			exit(1);
+		}
+		t0 = now();
+		if ((pid = fork()) == 0) {
+			close(fd[0]);
+			child(fd[1], t0);
+		}
+		t[FORK] = now() - t0;
+		if (pid < 0) {
+			perror("forklat: fork");
+			exit(1);
+		}
+		close(fd[1]);
+		if (read(fd[0], t + CHILD, sizeof(t) - sizeof(t[0])) !=
+		    sizeof(t) - sizeof(t[0]))
+			t[CHILD] = t[MALLOC] = 0;
+		close(fd[0]);
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			failed++;
+		for (e = 0; e < NTIMES; e++)
+			times[e][i] = t[e];
+	}
+	elapsed = now() - start;
+
+	stop = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+	while (n > 0)
+		free(heap[--n]);
+	free(heap);
+
+	for (e = 0; e < NTIMES; e++)
+		report(names[e], times[e], nforks);
+	if (failed)
+		printf("%d children failed\n", failed);
+	printf("%.0f operations per second\n", nforks / elapsed);
+	return (failed != 0);
+}
@@ -0,0 +1,450 @@
+/*
+ * frag: fragmentation benchmarks, which report how much memory an
+ * allocator holds for the bytes a program has live.
+ *
+ *	frag [-w robson|phases|alternate] [-t threads] [-m MB] [-s min]
+ *	     [-S max] [-p phases] [-o ops] [-k percent] [-i ms] [-v]
+ *
+ * Each of the threads runs the pattern on its share of MB megabytes of
+ * live data (64 by default):
+ *
+ *   robson     After Robson's worst case: fill up with objects of size
+ *              min, then free all but those that keep every hole smaller
+ *              than twice that size, and fill up again with objects of
+ *              twice the size, which fit in none of the holes; and so on
+ *              up to max (defaults 16 and 64K).
+ *   phases     A program whose size distribution changes: each of the
+ *              phases (8) draws sizes from its own power of two between
+ *              min and max, frees all but percent (10) of what the phase
+ *              before left live (those stay to the end), fills back up,
+ *              and then replaces ops (200000) objects picked at random.
+ *   alternate  tcmalloc's frag_unittest: fill up with objects of size
+ *              min (default 36K), free every other one, and fill up
+ *              again with objects half again as large, which fit in
+ *              none of the holes.
+ *
+ * A producer-consumer pattern, where objects are freed by other threads,
+ * is xfree's.
+ *
+ * Every interval (10ms by default) the main thread samples the resident
+ * set and the bytes live (malloced and not yet freed, by the requested
+ * sizes); -v prints each sample, with the blowup so far.  At the end it
+ * prints the peak RSS and live bytes and the blowup: the peak RSS growth
+ * over the peak live bytes.  The benchmark's own tables are mapped and
+ * touched before the starting RSS is taken.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	CACHELINE	64
+#define	MAXTHREADS	256
+
+enum { ROBSON, PHASES, ALTERNATE };
+
+struct obj {
+	char	*p;
+	size_t	sz;
+};
+
+/* Per-thread counters, on their own lines. */
+struct counter {
+	volatile size_t	bytes;
+	volatile int	done;
+	char		pad[CACHELINE - sizeof(size_t) - sizeof(int)];
+};
+
+struct worker {
+	int		id;
+	size_t		budget;		/* live bytes to keep */
+	struct obj	*objs;		/* the live objects */
+	size_t		nobjs;
+	size_t		maxobjs;
+	size_t		keep;		/* phases: objs[0, keep) stay */
+	uint64_t	x;
+};
+
+static int pattern = ROBSON, nthreads = 1, nphases = 8, keeppct = 10;
+static size_t live = 64, minsz, maxsz, nops = 200000;
+static struct counter allocated[MAXTHREADS], freed[MAXTHREADS];
+static struct worker workers[MAXTHREADS];
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static size_t
+rss(void)
+{
+	unsigned long size, res = 0;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+		return (0);
+	if (fscanf(fp, "%lu %lu", &size, &res) != 2)
+		res = 0;
+	fclose(fp);
+	return (res * sysconf(_SC_PAGESIZE));
+}
+
+static void *
+allocate(size_t sz)
+{
+	void *p;
+
+	p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("frag: mmap");
+		exit(1);
+	}
+	memset(p, 0, sz);
+	return (p);
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t
+rnd(uint64_t *x)
+{
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+	return (*x * 2685821657736338717ULL);
+}
+
+static void
+get(struct worker *w, size_t sz)
+{
+	struct obj *o;
+
+	if (w->nobjs == w->maxobjs) {
+		fprintf(stderr, "frag: too many objects\n");
+		exit(1);
+	}
+	o = &w->objs[w->nobjs++];
+	if ((o->p = malloc(sz)) == NULL) {
+		fprintf(stderr, "frag: out of memory\n");
+		exit(1);
+	}
+	o->sz = sz;
+	/* touch every page, as a program that used it would */
+	memset(o->p, w->id, sz);
+	allocated[w->id].bytes += sz;
+}
+
+static void
+put(struct worker *w, struct obj *o)
+{
+	free(o->p);
+	freed[w->id].bytes += o->sz;
+	*o = w->objs[--w->nobjs];
+}
+
+static size_t
+inuse(struct worker *w)
+{
+	return (allocated[w->id].bytes - freed[w->id].bytes);
+}
+
+/* Sort objects by address, in place (qsort may call malloc). */
+static void
+sift(struct obj *v, size_t i, size_t n)
+{
+	struct obj t;
+	size_t c;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && v[c + 1].p > v[c].p)
+			c++;
+		if (v[i].p >= v[c].p)
+			break;
+		t = v[i];
+		v[i] = v[c];
+		v[c] = t;
+	}
+}
+
+static void
+sortobjs(struct obj *v, size_t n)
+{
+	struct obj t;
+	size_t i;
+
+	for (i = n / 2; i > 0; i--)
+		sift(v, i - 1, n);
+	for (i = n; i > 1; i--) {
+		t = v[0];
+		v[0] = v[i - 1];
+		v[i - 1] = t;
+		sift(v, 0, i - 1);
+	}
+}
+
+static void
+robson(struct worker *w)
+{
+	size_t sz, i, j, end;
+
+	for (sz = minsz; sz <= maxsz; sz *= 2) {
+		while (inuse(w) < w->budget)
+			get(w, sz);
+		if (sz * 2 > maxsz)
+			break;
+		/*
+		 * Free each object unless that would leave a hole (from the
+		 * end of the last object kept to the start of the next one)
+		 * that an object of the next size fits in.
+		 */
+		sortobjs(w->objs, w->nobjs);
+		end = 0;
+		for (i = j = 0; i < w->nobjs; i++) {
+			struct obj o = w->objs[i];
+			size_t next = i + 1 < w->nobjs ?
+			    (size_t)w->objs[i + 1].p : (size_t)-1;
+
+			if (end != 0 && next - end < 2 * sz) {
+				free(o.p);
+				freed[w->id].bytes += o.sz;
+			} else {
+				w->objs[j++] = o;
+				end = (size_t)o.p + o.sz;
+			}
+		}
+		w->nobjs = j;
+	}
+}
+
+static size_t
+band(struct worker *w, int b)
+{
+	size_t lo = minsz << b, hi = lo * 2 - 1;
+
+	if (hi > maxsz)
+		hi = maxsz;
+	return (lo + rnd(&w->x) % (hi - lo + 1));
+}
+
+static void
+phases(struct worker *w)
+{
+	size_t i, n, j;
+	int p, b, nbands;
+
+	for (nbands = 1; (minsz << nbands) <= maxsz; nbands++)
+		;
+	for (p = 0; p < nphases; p++) {
+		/* visit the bands out of order, so phases differ a lot */
+		b = (p * 5) % nbands;
+		if (p > 0) {
+			/* the last phase's survivors join those that stay */
+			n = w->nobjs - w->keep;
+			for (i = 0; i < n; i++) {
+				j = w->keep + rnd(&w->x) % (w->nobjs - w->keep);
+				if (rnd(&w->x) % 100 < (uint64_t)keeppct) {
+					struct obj t = w->objs[w->keep];
+					w->objs[w->keep++] = w->objs[j];
+					w->objs[j] = t;
+				} else
+					put(w, &w->objs[j]);
+			}
+		}
+		while (inuse(w) < w->budget)
+			get(w, band(w, b));
+		for (i = 0; i < nops && w->nobjs > w->keep; i++) {
+			j = w->keep + rnd(&w->x) % (w->nobjs - w->keep);
+			put(w, &w->objs[j]);
+			get(w, band(w, b));
+		}
+	}
+}
+
+static void
+alternate(struct worker *w)
+{
+	size_t i, j;
+
+	while (inuse(w) < w->budget)
+		get(w, minsz);
+	for (i = j = 0; i < w->nobjs; i++) {
+		if (i % 2 == 0) {
+			free(w->objs[i].p);
+			freed[w->id].bytes += w->objs[i].sz;
+		} else
+			w->objs[j++] = w->objs[i];
+	}
+	w->nobjs = j;
+	while (inuse(w) < w->budget)
+		get(w, minsz + minsz / 2);
+}
+
+static void *
+run(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+
+	switch (pattern) {
+	case ROBSON:
+		robson(w);
+		break;
+	case PHASES:
+		phases(w);
+		break;
+	case ALTERNATE:
+		alternate(w);
+		break;
+	}
+	__atomic_store_n(&allocated[w->id].done, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: frag [-w robson|phases|alternate] "
+	    "[-t threads] [-m MB] [-s min]\n"
+	    "            [-S max] [-p phases] [-o ops] [-k percent] "
+	    "[-i ms] [-v]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *names[] = { "robson", "phases", "alternate" };
+	pthread_t tid[MAXTHREADS];
+	size_t base, r, l, peakrss = 0, peaklive = 0, a, f;
+	double t0, t, next, interval = 0.01;
+	int ch, i, verbose = 0, running;
+	struct timespec nap;
+
+	while ((ch = getopt(argc, argv, "w:t:m:s:S:p:o:k:i:v")) != -1) {
+		switch (ch) {
+		case 'w':
+			for (i = 0; i < 3 && strcmp(optarg, names[i]) != 0; i++)
+				;
+			if (i == 3)
+				usage();
+			pattern = i;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'm':
+			live = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			minsz = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			maxsz = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			nphases = atoi(optarg);
+			break;
+		case 'o':
+			nops = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keeppct = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg) / 1000.0;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (minsz == 0)
+		minsz = pattern == ALTERNATE ? 36 * 1024 : 16;
+	if (maxsz == 0)
+		maxsz = 64 * 1024;
+	if (maxsz < minsz)
+		maxsz = minsz;
+	if (nthreads < 1 || nthreads > MAXTHREADS || live == 0 ||
+	    nphases < 1 || keeppct < 0 || keeppct > 100 || interval <= 0)
+		usage();
+
+	/*
+	 * Room for a budget of the smallest objects, twice over: robson
+	 * frees lazily, and phases' survivors are on top of a budget.
+	 */
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+
+		w->id = i;
+		w->budget = (live << 20) / nthreads;
+		w->maxobjs = 2 * (w->budget / minsz + 1);
+		w->objs = allocate(w->maxobjs * sizeof(struct obj));
+		w->x = 0x9e3779b97f4a7c15ULL * (i + 1);
+	}
+
+	printf("pattern %s threads %d live %zu MB sizes %zu-%zu\n",
+	    names[pattern], nthreads, live, minsz, maxsz);
+	base = rss();
+	t0 = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&tid[i], NULL, run, &workers[i]);
+
+	nap.tv_sec = 0;
+	nap.tv_nsec = 1000000;
+	next = t0;
+	do {
+		running = 0;
+		for (i = 0; i < nthreads; i++)
+			if (!__atomic_load_n(&allocated[i].done,
+			    __ATOMIC_ACQUIRE))
+				running = 1;
+		t = now();
+		if (t < next && running) {
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		next = t + interval;
+		for (a = f = 0, i = 0; i < nthreads; i++) {
+			a += allocated[i].bytes;
+			f += freed[i].bytes;
+		}
+		/* the counters are read unsynchronized; clamp the skew */
+		l = a > f ? a - f : 0;
+		r = rss();
+		if (r > peakrss)
+			peakrss = r;
+		if (l > peaklive)
+			peaklive = l;
+		if (verbose)
+			printf("t %.3f rss_kb %zu live_kb %zu blowup %.2f\n",
+			    t - t0, r / 1024, l / 1024, peaklive ?
+			    (double)(peakrss > base ? peakrss - base : 0) /
+			    peaklive : 0);
+	} while (running);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+	t = now() - t0;
+
+	for (i = 0; i < nthreads; i++) {
+		while (workers[i].nobjs > 0)
+			put(&workers[i], &workers[i].objs[0]);
+	}
+	for (a = 0, i = 0; i < nthreads; i++)
+		a += allocated[i].bytes;
+	printf("%.3f seconds, %zu MB allocated in all\n", t, a >> 20);
+	printf("peak rss %zu kB (%zu kB at start), peak live %zu kB, blowup %.2f\n",
+	    peakrss / 1024, base / 1024, peaklive / 1024,
+	    peaklive ? (double)(peakrss > base ? peakrss - base : 0) / peaklive : 0);
+	return (0);
+}
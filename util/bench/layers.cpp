@@ -0,0 +1,435 @@
+/*
+ * layers: what each Heap Layers layer adds to the cost of malloc and free.
+ *
+ *	layers [-n pairs] [-o ops] [-s size] [-S maxsize] [-w maxset]
+ *	       [-t maxthreads] [-r reps] [composition ...]
+ *
+ * Each composition is the one before it (or the one named in its "adds"
+ * column) with one more layer on top, from a bare FreelistHeap up to a
+ * locked, counted Kingsley heap; "system" is the C library's malloc, for
+ * scale.  Each runs, in-process:
+ *
+ *	pairs	pairs malloc/free of one object, back to back;
+ *	set	with W objects live, ops replacements (a free and a malloc)
+ *		of objects picked at random, for W = 1, 8, 64 ... maxset;
+ *	threads	each of T threads making pairs on the one shared heap, for
+ *		T = 1, 2, 4 ... maxthreads (the thread-safe compositions).
+ *
+ * Sizes are random in [size, maxsize] (both 64 by default); the
+ * compositions that serve only one size are left out when they differ.
+ * Every new object is written once.  The output is CSV,
+ *
+ *	composition,adds,test,param,threads,ns_op,cycles_op
+ *
+ * with the best time of reps runs: nanoseconds (by HL::Timer) and time
+ * stamp counter cycles (on x86; empty elsewhere) per operation, where an
+ * operation is a malloc/free pair or a replacement.  For the threads
+ * test, ns_op is the wall time over the pairs made by each thread, so a
+ * heap that scales keeps it flat.  Spin locks take the atomic path even
+ * with one thread (anyThreadCreated is always set), as they would in a
+ * threaded program.
+ *
+ * Build it by itself, optimized, and pin it for steady numbers:
+ *
+ *	g++ -std=gnu++98 -O2 -I Heap-Layers util/bench/layers.cpp -o layers -lpthread
+ *	taskset -c 0-7 ./layers > layers.csv
+ */
+
+#include "heaplayers.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace HL;
+
+volatile bool anyThreadCreated = true;
+
+#define	NSIZES		4096		/* sizes drawn before timing */
+#define	NSLOTS		65536		/* random slots drawn before timing */
+#define	MAXTHREADS	256
+
+enum { FixedSize = 1, ThreadSafe = 2 };
+
+struct setup {
+	long	pairs;
+	long	ops;
+	size_t	minsize;
+	size_t	maxsize;
+	long	maxset;
+	int	maxthreads;
+	int	reps;
+};
+
+struct result {
+	double	ns;
+	double	cycles;
+};
+
+static struct setup S;
+static size_t sizes[NSIZES];
+static uint32_t slots[NSLOTS];
+
+static inline unsigned long long
+cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	unsigned int lo, hi;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return (((unsigned long long)hi << 32) | lo);
+#else
+	return (0);
+#endif
+}
+
+/* Keep the compiler from eliding a malloc/free pair. */
+static inline void
+escape(void *p)
+{
+#if defined(__GNUC__)
+	asm volatile ("" : : "r" (p) : "memory");
+#else
+	*(void * volatile *)&p = p;
+#endif
+}
+
+static void *
+allocate(size_t sz)
+{
+	void *p;
+
+	p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("layers: mmap");
+		exit(1);
+	}
+	return (p);
+}
+
+/*
+ * The tests, for one composition.  Its heap is made on first use and
+ * lives until exit.
+ */
+template <class Heap>
+class Bench {
+public:
+	static struct result
+	pairs(void)
+	{
+		Heap& h = heap();
+		const long n = S.pairs;
+		Timer t;
+		unsigned long long c;
+
+		t.start();
+		c = cycles();
+		for (long i = 0; i < n; i++) {
+			char *p = (char *)h.malloc(sizes[i & (NSIZES - 1)]);
+			*p = (char)i;
+			escape(p);
+			h.free(p);
+		}
+		c = cycles() - c;
+		t.stop();
+		return (per(t, c, n));
+	}
+
+	static struct result
+	set(long w)
+	{
+		Heap& h = heap();
+		const long n = S.ops;
+		void **objs;
+		Timer t;
+		unsigned long long c;
+		long i;
+
+		objs = (void **)allocate(w * sizeof(void *));
+		for (i = 0; i < w; i++) {
+			objs[i] = h.malloc(sizes[i & (NSIZES - 1)]);
+			*(char *)objs[i] = 0;
+		}
+		t.start();
+		c = cycles();
+		for (i = 0; i < n; i++) {
+			const uint32_t j = slots[i & (NSLOTS - 1)] & (w - 1);
+			h.free(objs[j]);
+			char *p = (char *)h.malloc(sizes[i & (NSIZES - 1)]);
+			*p = (char)i;
+			escape(p);
+			objs[j] = p;
+		}
+		c = cycles() - c;
+		t.stop();
+		for (i = 0; i < w; i++)
+			h.free(objs[i]);
+		munmap(objs, w * sizeof(void *));
+		return (per(t, c, n));
+	}
+
+	static struct result
+	threads(int nthreads)
+	{
+		pthread_t tid[MAXTHREADS];
+		Timer t;
+		unsigned long long c;
+		int i;
+
+		heap();
+		go = 0;
+		ready = 0;
+		for (i = 0; i < nthreads; i++)
+			pthread_create(&tid[i], NULL, worker, NULL);
+		while (__atomic_load_n(&ready, __ATOMIC_ACQUIRE) < nthreads)
+			sched_yield();
+		t.start();
+		c = cycles();
+		__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(tid[i], NULL);
+		c = cycles() - c;
+		t.stop();
+		return (per(t, c, S.pairs));
+	}
+
+private:
+	static Heap&
+	heap(void)
+	{
+		static Heap h;
+
+		return (h);
+	}
+
+	static struct result
+	per(Timer& t, unsigned long long c, long n)
+	{
+		struct result r;
+
+		r.ns = (double)t * 1e9 / n;
+		r.cycles = (double)c / n;
+		return (r);
+	}
+
+	static void *
+	worker(void *)
+	{
+		Heap& h = heap();
+		const long n = S.pairs;
+
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&go, __ATOMIC_ACQUIRE) == 0)
+			;
+		for (long i = 0; i < n; i++) {
+			char *p = (char *)h.malloc(sizes[i & (NSIZES - 1)]);
+			*p = (char)i;
+			escape(p);
+			h.free(p);
+		}
+		return (NULL);
+	}
+
+	static int go;
+	static int ready;
+};
+
+template <class Heap> int Bench<Heap>::go;
+template <class Heap> int Bench<Heap>::ready;
+
+/*
+ * The compositions.  Each adds one layer to the one named in its adds
+ * column.
+ */
+typedef FreelistHeap<BumpAlloc<65536, MmapHeap> >	FreelistStack;
+typedef SizeHeap<FreelistStack>				SizeStack;
+typedef KingsleyHeap<SizeStack, MmapHeap>		KingsleyStack;
+typedef LockedHeap<SpinLockType, KingsleyStack>		SpinLockStack;
+typedef LockedHeap<PosixLockType, KingsleyStack>	PosixLockStack;
+typedef ThreadStatsHeap<SpinLockStack>			StatsStack;
+typedef ThreadSpecificHeap<KingsleyStack>		PerThreadStack;
+
+struct composition {
+	const char	*name;
+	const char	*adds;
+	int		flags;
+	struct result	(*pairs)(void);
+	struct result	(*set)(long);
+	struct result	(*threads)(int);
+};
+
+#define	COMPOSITION(name, adds, flags, heap)				\
+	{ name, adds, flags, Bench<heap >::pairs, Bench<heap >::set,	\
+	    Bench<heap >::threads }
+
+static const struct composition compositions[] = {
+	COMPOSITION("freelist", "FreelistHeap<BumpAlloc<MmapHeap>>",
+	    FixedSize, FreelistStack),
+	COMPOSITION("size", "SizeHeap", FixedSize, SizeStack),
+	COMPOSITION("kingsley", "KingsleyHeap", 0, KingsleyStack),
+	COMPOSITION("spinlock", "LockedHeap<SpinLockType>", ThreadSafe,
+	    SpinLockStack),
+	COMPOSITION("posixlock", "LockedHeap<PosixLockType> (over kingsley)",
+	    ThreadSafe, PosixLockStack),
+	COMPOSITION("threadstats", "ThreadStatsHeap (over spinlock)",
+	    ThreadSafe, StatsStack),
+	COMPOSITION("threadspecific", "ThreadSpecificHeap (over kingsley)",
+	    ThreadSafe, PerThreadStack),
+	COMPOSITION("system", "MallocHeap", ThreadSafe, MallocHeap),
+};
+
+#define	NCOMPOSITIONS	(sizeof(compositions) / sizeof(compositions[0]))
+
+static void
+report(const struct composition *k, const char *test, long param,
+    int nthreads, struct result (*run)(const struct composition *, long))
+{
+	struct result best, r;
+	int i;
+
+	best.ns = 0;
+	best.cycles = 0;
+	for (i = 0; i < S.reps; i++) {
+		r = run(k, param);
+		if (i == 0 || r.ns < best.ns)
+			best = r;
+	}
+	printf("%s,\"%s\",%s,%ld,%d,%.2f,", k->name, k->adds, test, param,
+	    nthreads, best.ns);
+	if (best.cycles > 0)
+		printf("%.1f", best.cycles);
+	printf("\n");
+	fflush(stdout);
+}
+
+static struct result
+runpairs(const struct composition *k, long)
+{
+	return (k->pairs());
+}
+
+static struct result
+runset(const struct composition *k, long w)
+{
+	return (k->set(w));
+}
+
+static struct result
+runthreads(const struct composition *k, long t)
+{
+	return (k->threads((int)t));
+}
+
+static void
+usage(void)
+{
+	size_t i;
+
+	fprintf(stderr, "usage: layers [-n pairs] [-o ops] [-s size] "
+	    "[-S maxsize] [-w maxset]\n"
+	    "              [-t maxthreads] [-r reps] [composition ...]\n"
+	    "compositions:");
+	for (i = 0; i < NCOMPOSITIONS; i++)
+		fprintf(stderr, " %s", compositions[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct composition *k;
+	uint64_t rng = 0x9e3779b97f4a7c15ULL;
+	size_t i;
+	long w;
+	int ch, t, a;
+
+	S.pairs = 4000000;
+	S.ops = 4000000;
+	S.minsize = 64;
+	S.maxsize = 0;
+	S.maxset = 262144;
+	S.maxthreads = 8;
+	S.reps = 3;
+	while ((ch = getopt(argc, argv, "n:o:s:S:w:t:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			S.pairs = atol(optarg);
+			break;
+		case 'o':
+			S.ops = atol(optarg);
+			break;
+		case 's':
+			S.minsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			S.maxsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			S.maxset = atol(optarg);
+			break;
+		case 't':
+			S.maxthreads = atoi(optarg);
+			break;
+		case 'r':
+			S.reps = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (S.maxsize < S.minsize)
+		S.maxsize = S.minsize;
+	if (S.pairs <= 0 || S.ops <= 0 || S.minsize == 0 || S.maxset <= 0 ||
+	    S.maxthreads <= 0 || S.maxthreads > MAXTHREADS || S.reps <= 0)
+		usage();
+	for (a = 0; a < argc; a++) {
+		for (i = 0; i < NCOMPOSITIONS; i++)
+			if (strcmp(argv[a], compositions[i].name) == 0)
+				break;
+		if (i == NCOMPOSITIONS)
+			usage();
+	}
+
+	/* xorshift64*, drawn ahead so the loops time only the heap. */
+	for (i = 0; i < NSIZES + NSLOTS; i++) {
+		rng ^= rng >> 12;
+		rng ^= rng << 25;
+		rng ^= rng >> 27;
+		const uint64_t x = (rng * 2685821657736338717ULL) >> 16;
+		if (i < NSIZES)
+			sizes[i] = S.minsize + x % (S.maxsize - S.minsize + 1);
+		else
+			slots[i - NSIZES] = (uint32_t)x;
+	}
+
+	printf("composition,adds,test,param,threads,ns_op,cycles_op\n");
+	for (i = 0; i < NCOMPOSITIONS; i++) {
+		k = &compositions[i];
+		if (argc > 0) {
+			for (a = 0; a < argc; a++)
+				if (strcmp(argv[a], k->name) == 0)
+					break;
+			if (a == argc)
+				continue;
+		}
+		if ((k->flags & FixedSize) && S.minsize != S.maxsize)
+			continue;
+		report(k, "pairs", 0, 1, runpairs);
+		for (w = 1; w <= S.maxset; w *= 8)
+			report(k, "set", w, 1, runset);
+		if (k->flags & ThreadSafe)
+			for (t = 1; t <= S.maxthreads; t *= 2)
+				report(k, "threads", t, t, runthreads);
+	}
+	return (0);
+}
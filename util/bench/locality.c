@@ -0,0 +1,410 @@
+/*
+ * locality: how well an allocator places objects that are used
+ * together, by what walking them costs the program.
+ *
+ *	locality [-w list|tree|all] [-t threads] [-n nodes] [-s size]
+ *	         [-i interleave] [-a age] [-r rounds] [-x seed]
+ *
+ * Each of the threads builds its own structure of nodes (1M nodes of
+ * size 64 by default) through malloc, then walks it rounds (10) times:
+ *
+ *   list     appends to a singly linked list, and walks it front to
+ *            back: allocation order.
+ *   tree     inserts random keys into an unbalanced binary search tree,
+ *            and walks it in key order, which jumps around allocation
+ *            order the way lookups do.
+ *
+ * Between two nodes, a thread allocates interleave (0) other objects
+ * of 16 to 256 bytes, which stay live, like the rest of a program's
+ * data built alongside.  Before building, a thread ages the heap by
+ * allocating age percent (0) as many objects again, of 16 bytes up to
+ * four times size, and freeing every other one, leaving holes the
+ * nodes may go into.
+ *
+ * For each walk it reports, per node, the time and, where
+ * perf_event_open lets it count the benchmark's own user-mode events,
+ * the last level cache read misses and data TLB misses.  An allocator
+ * that places nodes in the order they are allocated (bump pointers,
+ * BiBOP pages, CAMA's coloring) walks a list in a few ns a node; one
+ * that scatters them takes a cache miss or worse on every node.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	MAXTHREADS	256
+
+enum { LIST, TREE, ALL };
+enum { LLC, DTLB, NEVENTS };
+
+struct node {
+	struct node	*next;		/* list: the next node; tree: left */
+	struct node	*right;
+	uint64_t	key;
+};
+
+struct worker {
+	int		id;
+	uint64_t	x;
+	void		**others;	/* interleaved and aging survivors */
+	size_t		nothers;
+	double		build, walk;	/* seconds */
+	uint64_t	events[NEVENTS];
+	int		counted;	/* the events were counted */
+	uint64_t	sum;
+};
+
+static int shape = LIST, nthreads = 1, interleave = 0, agepct = 0;
+static int rounds = 10;
+static size_t nnodes = 1000000, nodesz = 64;
+static uint64_t seed = 1;
+static struct worker workers[MAXTHREADS];
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t
+rnd(uint64_t *x)
+{
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+	return (*x * 2685821657736338717ULL);
+}
+
+static void *
+xmalloc(size_t sz)
+{
+	void *p;
+
+	if ((p = malloc(sz)) == NULL) {
+		fprintf(stderr, "locality: out of memory\n");
+		exit(1);
+	}
+	return (p);
+}
+
+/*
+ * A counter of the calling thread's user-mode cache event, or -1 where
+ * the kernel or the machine has none.
+ */
+static int
+counter(int event)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HW_CACHE;
+	pe.size = sizeof(pe);
+	pe.config = (event == LLC ? PERF_COUNT_HW_CACHE_LL :
+	    PERF_COUNT_HW_CACHE_DTLB) |
+	    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	return ((int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0));
+}
+
+static void
+other(struct worker *w, size_t sz)
+{
+	char *p;
+
+	p = xmalloc(sz);
+	memset(p, 0, sz);
+	w->others[w->nothers++] = p;
+}
+
+/* Leave every other one of a run of objects live, and free the rest. */
+static void
+age(struct worker *w)
+{
+	size_t i, n = nnodes * agepct / 100;
+	void *p;
+
+	for (i = 0; i < n; i++) {
+		p = xmalloc(16 + rnd(&w->x) % (4 * nodesz - 15));
+		memset(p, 0, 16);
+		if (i % 2 == 0)
+			w->others[w->nothers++] = p;
+		else
+			free(p);
+	}
+}
+
+static struct node *
+newnode(struct worker *w, uint64_t key)
+{
+	struct node *n;
+	int i;
+
+	n = xmalloc(nodesz);
+	memset(n, 0, nodesz);
+	n->key = key;
+	for (i = 0; i < interleave; i++)
+		other(w, 16 + rnd(&w->x) % 241);
+	return (n);
+}
+
+static struct node *
+buildlist(struct worker *w)
+{
+	struct node *head = NULL, **tail = &head;
+	size_t i;
+
+	for (i = 0; i < nnodes; i++) {
+		*tail = newnode(w, i);
+		tail = &(*tail)->next;
+	}
+	return (head);
+}
+
+static struct node *
+buildtree(struct worker *w)
+{
+	struct node *root = NULL, **p;
+	uint64_t key;
+	size_t i;
+
+	for (i = 0; i < nnodes; i++) {
+		key = rnd(&w->x);
+		for (p = &root; *p != NULL;
+		    p = key < (*p)->key ? &(*p)->next : &(*p)->right)
+			;
+		*p = newnode(w, key);
+	}
+	return (root);
+}
+
+static uint64_t
+walklist(struct node *n)
+{
+	uint64_t sum = 0;
+
+	for (; n != NULL; n = n->next)
+		sum += n->key;
+	return (sum);
+}
+
+/* In order, with an explicit stack: a random tree is too deep to recurse. */
+static uint64_t
+walktree(struct node *n, struct node **stack)
+{
+	uint64_t sum = 0;
+	size_t sp = 0;
+
+	for (;;) {
+		for (; n != NULL; n = n->next)
+			stack[sp++] = n;
+		if (sp == 0)
+			break;
+		n = stack[--sp];
+		sum += n->key;
+		n = n->right;
+	}
+	return (sum);
+}
+
+static void
+freelist(struct node *n)
+{
+	struct node *next;
+
+	for (; n != NULL; n = next) {
+		next = n->next;
+		free(n);
+	}
+}
+
+static void
+freetree(struct node *n, struct node **stack)
+{
+	size_t sp = 0;
+
+	if (n != NULL)
+		stack[sp++] = n;
+	while (sp > 0) {
+		n = stack[--sp];
+		if (n->next != NULL)
+			stack[sp++] = n->next;
+		if (n->right != NULL)
+			stack[sp++] = n->right;
+		free(n);
+	}
+}
+
+static void *
+run(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct node *root, **stack = NULL;
+	uint64_t v;
+	double t;
+	int fd[NEVENTS], e, r;
+
+	w->others = xmalloc((nnodes * interleave + nnodes * agepct / 200 + 1) *
+	    sizeof(void *));
+	if (shape == TREE)
+		stack = xmalloc(nnodes * sizeof(struct node *));
+	for (e = 0; e < NEVENTS; e++)
+		fd[e] = counter(e);
+	age(w);
+
+	t = now();
+	root = shape == LIST ? buildlist(w) : buildtree(w);
+	w->build = now() - t;
+
+	/* One walk to warm up, then the measured ones. */
+	w->sum = shape == LIST ? walklist(root) : walktree(root, stack);
+	for (e = 0; e < NEVENTS; e++)
+		if (fd[e] >= 0) {
+			ioctl(fd[e], PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd[e], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	t = now();
+	for (r = 0; r < rounds; r++)
+		w->sum += shape == LIST ? walklist(root) : walktree(root, stack);
+	w->walk = now() - t;
+	w->counted = 1;
+	for (e = 0; e < NEVENTS; e++) {
+		if (fd[e] >= 0 && (ioctl(fd[e], PERF_EVENT_IOC_DISABLE, 0),
+		    read(fd[e], &v, sizeof(v)) == sizeof(v)))
+			w->events[e] = v;
+		else
+			w->counted = 0;
+		if (fd[e] >= 0)
+			close(fd[e]);
+	}
+
+	if (shape == LIST)
+		freelist(root);
+	else
+		freetree(root, stack);
+	while (w->nothers > 0)
+		free(w->others[--w->nothers]);
+	free(w->others);
+	free(stack);
+	return (NULL);
+}
+
+static void
+report(const char *name)
+{
+	double build = 0, walk = 0, nodes, walked;
+	uint64_t events[NEVENTS] = { 0, 0 };
+	int counted = 1, e, i;
+
+	for (i = 0; i < nthreads; i++) {
+		if (workers[i].build > build)
+			build = workers[i].build;
+		if (workers[i].walk > walk)
+			walk = workers[i].walk;
+		for (e = 0; e < NEVENTS; e++)
+			events[e] += workers[i].events[e];
+		counted &= workers[i].counted;
+	}
+	nodes = (double)nnodes * nthreads;
+	walked = nodes * rounds;
+	printf("%s: build %.1f ns/node, walk %.2f ns/node", name,
+	    build * 1e9 / nnodes, walk * 1e9 / ((double)nnodes * rounds));
+	if (counted)
+		printf(", llc %.3f misses/node, dtlb %.3f misses/node",
+		    events[LLC] / walked, events[DTLB] / walked);
+	else
+		printf(", llc - misses/node, dtlb - misses/node");
+	printf("\n");
+	printf("%.0f operations per second\n", walk > 0 ? walked / walk : 0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: locality [-w list|tree|all] [-t threads] "
+	    "[-n nodes] [-s size]\n"
+	    "                [-i interleave] [-a age] [-r rounds] "
+	    "[-x seed]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *names[] = { "list", "tree", "all" };
+	pthread_t tid[MAXTHREADS];
+	int ch, i, which = ALL;
+
+	while ((ch = getopt(argc, argv, "w:t:n:s:i:a:r:x:")) != -1) {
+		switch (ch) {
+		case 'w':
+			for (i = 0; i < 3 && strcmp(optarg, names[i]) != 0; i++)
+				;
+			if (i == 3)
+				usage();
+			which = i;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			nnodes = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			nodesz = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interleave = atoi(optarg);
+			break;
+		case 'a':
+			agepct = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'x':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nthreads < 1 || nthreads > MAXTHREADS || nnodes == 0 ||
+	    interleave < 0 || agepct < 0 || rounds < 1)
+		usage();
+	if (nodesz < sizeof(struct node))
+		nodesz = sizeof(struct node);
+
+	printf("threads %d nodes %zu size %zu interleave %d age %d%% "
+	    "rounds %d\n", nthreads, nnodes, nodesz, interleave, agepct,
+	    rounds);
+	for (shape = LIST; shape <= TREE; shape++) {
+		if (which != ALL && which != shape)
+			continue;
+		for (i = 0; i < nthreads; i++) {
+			memset(&workers[i], 0, sizeof(workers[i]));
+			workers[i].id = i;
+			workers[i].x = 0x9e3779b97f4a7c15ULL * (i + seed);
+			pthread_create(&tid[i], NULL, run, &workers[i]);
+		}
+		for (i = 0; i < nthreads; i++)
+			pthread_join(tid[i], NULL);
+		report(names[shape]);
+	}
+	return (0);
+}
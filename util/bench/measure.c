@@ -0,0 +1,105 @@
+/*
+ * measure: run a benchmark under an allocator and record what it cost.
+ *
+ *	measure [-p lib.so] [-o file] [-t label] command [args ...]
+ *
+ * The command runs with LD_PRELOAD set to lib.so (only the command and
+ * its children see it, not measure itself).  When it exits, one CSV row
+ *
+ *	label,status,wall_s,user_s,sys_s,maxrss_kb,minflt,majflt
+ *
+ * is appended to file (default: standard error).  maxrss_kb is the peak
+ * resident set of the command, as reported by wait4(2).  The exit status
+ * of measure is that of the command.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: measure [-p lib.so] [-o file] [-t label] command [args ...]\n");
+	exit(2);
+}
+
+static double
+tvsec(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *lib = NULL, *out = NULL, *label = "-";
+	struct timespec t0, t1;
+	struct rusage ru;
+	FILE *fp;
+	pid_t pid;
+	int c, status;
+
+	while ((c = getopt(argc, argv, "+p:o:t:")) != -1) {
+		switch (c) {
+		case 'p':
+			lib = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 't':
+			label = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((pid = fork()) == -1) {
+		perror("measure: fork");
+		return (1);
+	}
+	if (pid == 0) {
+		if (lib != NULL && *lib != '\0')
+			setenv("LD_PRELOAD", lib, 1);
+		execvp(argv[0], argv);
+		fprintf(stderr, "measure: %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	while (wait4(pid, &status, 0, &ru) == -1) {
+		if (errno != EINTR) {
+			perror("measure: wait4");
+			return (1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (out == NULL)
+		fp = stderr;
+	else if ((fp = fopen(out, "a")) == NULL) {
+		perror(out);
+		return (1);
+	}
+	fprintf(fp, "%s,%d,%.6f,%.6f,%.6f,%ld,%ld,%ld\n", label,
+	    WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+	    (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+	    tvsec(&ru.ru_utime), tvsec(&ru.ru_stime),
+	    ru.ru_maxrss, ru.ru_minflt, ru.ru_majflt);
+	if (fp != stderr)
+		fclose(fp);
+	return (WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
@@ -0,0 +1,412 @@
+/*
+ * numa: where an allocator's memory ends up on a NUMA machine, and the
+ * bandwidth a program gets out of it.
+ *
+ *	numa [-w local|handoff|all] [-t threads] [-m MB] [-s size]
+ *	     [-r rounds]
+ *
+ * Threads are pinned round robin to the nodes that have CPUs (thread i
+ * to node i % nodes), so that neighbouring threads sit on different
+ * nodes.  Each builds a working set of three arrays, each of MB / 3
+ * megabytes (64 in all by default) made of objects of size (16K) bytes
+ * allocated through malloc, and writes all of it:
+ *
+ *   local    each thread allocates its working set from scratch.
+ *   handoff  each thread first allocates and writes a working set,
+ *            hands it to the next thread, which is on another node,
+ *            and frees the one it is handed by the thread before it;
+ *            then it allocates its working set.  An allocator that
+ *            gives the freed objects back to their node's heap keeps
+ *            the new working set local; one that caches them where
+ *            they were freed hands out remote memory.
+ *
+ * Then each thread finds the node of every page of its working set
+ * (with move_pages, or get_mempolicy where that is not allowed) and
+ * runs rounds (10) STREAM triads, a[i] = b[i] + q * c[i], over it,
+ * all threads at once.  For each workload it prints the pages local
+ * to the thread's node, remote, and of no known node, and the triad
+ * bandwidth of all threads together, as STREAM counts it (three arrays
+ * moved per round).  The rate in "operations per second" is bytes per
+ * second of that.  As with STREAM, the bandwidth is the memory's only
+ * if the working sets together are several times the last level cache.
+ *
+ * On a machine with one node every page is local; the placement is
+ * then only worth as much as the process's memory policy, which is
+ * printed first.
+ */
+
+#define	_GNU_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	MAXTHREADS	256
+#define	MAXNODES	64
+#define	MAXCPUS		1024
+#define	BATCH		1024		/* pages per move_pages call */
+
+enum { LOCAL, HANDOFF, ALL };
+enum { A, B, C, NARRAYS };
+enum { ONNODE, OFFNODE, UNKNOWN, NPLACES };
+
+struct set {
+	double		**obj[NARRAYS];	/* nobj objects each */
+};
+
+struct worker {
+	int		id;
+	int		node;
+	int		cpu;
+	struct set	mine;
+	struct set	*handed;	/* by the thread before */
+	uint64_t	pages[NPLACES];
+	double		triad;		/* seconds */
+	double		sum;
+};
+
+static int workload, nthreads = 1, rounds = 10;
+static size_t megabytes = 64, objsz = 16384, nobj, perobj;
+static int nnodes, nodeid[MAXNODES], ncpus[MAXNODES];
+static int cpus[MAXNODES][MAXCPUS];
+static long pagesz;
+static pthread_barrier_t barrier;
+static struct worker workers[MAXTHREADS];
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void *
+xmalloc(size_t sz)
+{
+	void *p;
+
+	if ((p = malloc(sz)) == NULL) {
+		fprintf(stderr, "numa: out of memory\n");
+		exit(1);
+	}
+	return (p);
+}
+
+/* Parse a sysfs list such as "0-3,8-11" into ids; return how many. */
+static int
+parselist(const char *s, int *ids, int max)
+{
+	int n = 0, lo, hi;
+	char *end;
+
+	while (*s != '\0' && !isspace((unsigned char)*s)) {
+		lo = hi = (int)strtol(s, &end, 10);
+		if (end == s)
+			break;
+		if (*end == '-')
+			hi = (int)strtol(end + 1, &end, 10);
+		for (; lo <= hi && n < max; lo++)
+			ids[n++] = lo;
+		s = *end == ',' ? end + 1 : end;
+	}
+	return (n);
+}
+
+static int
+readlist(const char *path, int *ids, int max)
+{
+	char buf[4096];
+	FILE *f;
+	int n = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return (0);
+	if (fgets(buf, sizeof(buf), f) != NULL)
+		n = parselist(buf, ids, max);
+	fclose(f);
+	return (n);
+}
+
+/*
+ * The nodes with CPUs, and their CPUs, from sysfs; without it, one node
+ * with all the CPUs.
+ */
+static void
+topology(void)
+{
+	int online[MAXNODES], i, n;
+	char path[128];
+
+	n = readlist("/sys/devices/system/node/online", online, MAXNODES);
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path),
+		    "/sys/devices/system/node/node%d/cpulist", online[i]);
+		ncpus[nnodes] = readlist(path, cpus[nnodes], MAXCPUS);
+		if (ncpus[nnodes] > 0)
+			nodeid[nnodes++] = online[i];
+	}
+	if (nnodes == 0) {
+		nnodes = 1;
+		nodeid[0] = 0;
+		ncpus[0] = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		for (i = 0; i < ncpus[0] && i < MAXCPUS; i++)
+			cpus[0][i] = i;
+	}
+}
+
+static const char *
+policy(void)
+{
+	static const char *names[] = {
+		"default", "preferred", "bind", "interleave", "local"
+	};
+	int mode;
+
+	if (syscall(__NR_get_mempolicy, &mode, NULL, 0UL, NULL, 0UL) != 0)
+		return ("unknown");
+	mode &= ~(MPOL_F_STATIC_NODES | MPOL_F_RELATIVE_NODES);
+	return (mode >= 0 && mode < 5 ? names[mode] : "other");
+}
+
+static void
+pin(struct worker *w)
+{
+	cpu_set_t set;
+	int n = w->id % nnodes;
+
+	w->node = nodeid[n];
+	w->cpu = cpus[n][(w->id / nnodes) % ncpus[n]];
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void
+build(struct set *s)
+{
+	size_t i, j;
+	int a;
+
+	for (a = 0; a < NARRAYS; a++) {
+		s->obj[a] = xmalloc(nobj * sizeof(double *));
+		for (i = 0; i < nobj; i++) {
+			s->obj[a][i] = xmalloc(objsz);
+			for (j = 0; j < perobj; j++)
+				s->obj[a][i][j] = a == C ? 2.0 : 1.0;
+		}
+	}
+}
+
+static void
+release(struct set *s)
+{
+	size_t i;
+	int a;
+
+	for (a = 0; a < NARRAYS; a++) {
+		for (i = 0; i < nobj; i++)
+			free(s->obj[a][i]);
+		free(s->obj[a]);
+	}
+}
+
+/*
+ * Count npages pages by where they are: move_pages with no nodes to
+ * move them to only says where they are, or get_mempolicy does, page by
+ * page, where move_pages is not allowed.
+ */
+static void
+count(struct worker *w, void **pages, size_t npages)
+{
+	int status[BATCH], n;
+	size_t i;
+
+	if (syscall(__NR_move_pages, 0, (unsigned long)npages, pages, NULL,
+	    status, 0) != 0) {
+		for (i = 0; i < npages; i++)
+			if (syscall(__NR_get_mempolicy, &n, NULL, 0UL, pages[i],
+			    (unsigned long)(MPOL_F_NODE | MPOL_F_ADDR)) == 0)
+				status[i] = n;
+			else
+				status[i] = -ENOENT;
+	}
+	for (i = 0; i < npages; i++)
+		w->pages[status[i] < 0 ? UNKNOWN :
+		    status[i] == w->node ? ONNODE : OFFNODE]++;
+}
+
+/* Count the pages of each object of s (once per object they hold). */
+static void
+place(struct worker *w, struct set *s)
+{
+	void *pages[BATCH];
+	uintptr_t p, end;
+	size_t i, n = 0;
+	int a;
+
+	for (a = 0; a < NARRAYS; a++)
+		for (i = 0; i < nobj; i++) {
+			p = (uintptr_t)s->obj[a][i] & ~(uintptr_t)(pagesz - 1);
+			end = (uintptr_t)s->obj[a][i] + objsz;
+			for (; p < end; p += pagesz) {
+				pages[n++] = (void *)p;
+				if (n == BATCH) {
+					count(w, pages, n);
+					n = 0;
+				}
+			}
+		}
+	if (n > 0)
+		count(w, pages, n);
+}
+
+static void
+triad(struct worker *w)
+{
+	const double q = 3.0;
+	double *a, *b, *c, t;
+	size_t i, j;
+	int r;
+
+	pthread_barrier_wait(&barrier);
+	t = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < nobj; i++) {
+			a = w->mine.obj[A][i];
+			b = w->mine.obj[B][i];
+			c = w->mine.obj[C][i];
+			for (j = 0; j < perobj; j++)
+				a[j] = b[j] + q * c[j];
+		}
+	w->triad = now() - t;
+	w->sum = w->mine.obj[A][nobj - 1][perobj - 1];
+}
+
+static void *
+run(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct set first;
+
+	pin(w);
+	if (workload == HANDOFF) {
+		build(&first);
+		workers[(w->id + 1) % nthreads].handed = &first;
+		pthread_barrier_wait(&barrier);
+		release(w->handed);
+		pthread_barrier_wait(&barrier);
+	}
+	build(&w->mine);
+	place(w, &w->mine);
+	triad(w);
+	pthread_barrier_wait(&barrier);
+	release(&w->mine);
+	return (NULL);
+}
+
+static void
+report(const char *name)
+{
+	uint64_t pages[NPLACES] = { 0, 0, 0 }, total;
+	double t = 0, bytes;
+	int i, p;
+
+	for (i = 0; i < nthreads; i++) {
+		for (p = 0; p < NPLACES; p++)
+			pages[p] += workers[i].pages[p];
+		if (workers[i].triad > t)
+			t = workers[i].triad;
+	}
+	total = pages[ONNODE] + pages[OFFNODE] + pages[UNKNOWN];
+	if (total == 0)
+		total = 1;
+	bytes = (double)NARRAYS * nobj * perobj * sizeof(double) *
+	    nthreads * rounds;
+	printf("%s: pages local %.1f%% remote %.1f%% unknown %.1f%%, "
+	    "triad %.1f MB/s\n", name, 100.0 * pages[ONNODE] / total,
+	    100.0 * pages[OFFNODE] / total, 100.0 * pages[UNKNOWN] / total,
+	    t > 0 ? bytes / t / 1e6 : 0);
+	printf("%.0f operations per second\n", t > 0 ? bytes / t : 0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: numa [-w local|handoff|all] [-t threads] "
+	    "[-m MB] [-s size]\n"
+	    "            [-r rounds]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *names[] = { "local", "handoff", "all" };
+	pthread_t tid[MAXTHREADS];
+	int ch, i, which = ALL;
+
+	while ((ch = getopt(argc, argv, "w:t:m:s:r:")) != -1) {
+		switch (ch) {
+		case 'w':
+			for (i = 0; i < 3 && strcmp(optarg, names[i]) != 0; i++)
+				;
+			if (i == 3)
+				usage();
+			which = i;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'm':
+			megabytes = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			objsz = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nthreads < 1 || nthreads > MAXTHREADS || rounds < 1 ||
+	    objsz < sizeof(double))
+		usage();
+	objsz &= ~(sizeof(double) - 1);
+	perobj = objsz / sizeof(double);
+	nobj = (megabytes << 20) / NARRAYS / objsz;
+	if (nobj == 0)
+		usage();
+	pagesz = sysconf(_SC_PAGESIZE);
+	topology();
+
+	printf("threads %d nodes %d policy %s working set %zu MB in %zu "
+	    "objects of %zu bytes, rounds %d\n", nthreads, nnodes, policy(),
+	    megabytes, NARRAYS * nobj, objsz, rounds);
+	pthread_barrier_init(&barrier, NULL, nthreads);
+	for (workload = LOCAL; workload <= HANDOFF; workload++) {
+		if (which != ALL && which != workload)
+			continue;
+		for (i = 0; i < nthreads; i++) {
+			memset(&workers[i], 0, sizeof(workers[i]));
+			workers[i].id = i;
+			pthread_create(&tid[i], NULL, run, &workers[i]);
+		}
+		for (i = 0; i < nthreads; i++)
+			pthread_join(tid[i], NULL);
+		report(names[workload]);
+	}
+	return (0);
+}
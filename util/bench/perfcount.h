@@ -0,0 +1,156 @@
+/*
+ * perfcount.h: hardware counters over a benchmark's measured region,
+ * for the benchmark drivers (larson, recycle, malloc-test), which
+ * include it when built with -DPERFCOUNT -I util/bench.
+ *
+ * A thread calls perfcount_start() where its measured work begins and
+ * perfcount_stop() where it ends; the counts of its user-mode events
+ * in between are added to its struct perfcount.  perfcount_add() sums
+ * those over threads, and perfcount_print() prints a line of them:
+ *
+ *	perf <label>: cycles N instructions N ipc X l1d-misses N
+ *	    llc-misses N dtlb-misses N remote-dram N
+ *
+ * The events are opened in two groups, so that each group's events
+ * are counted over the same time: cycles and instructions, which most
+ * processors count in fixed counters, and the four misses.  The latter
+ * group is scaled up if the kernel had to multiplex it.  Remote DRAM
+ * accesses are the generic "node" cache read misses, which the kernel
+ * maps to the processor's remote memory event where it has one; the
+ * uncore counters, which need root, are not used.  An event that the
+ * kernel or the processor does not count is printed as "-".
+ */
+
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	PC_CYCLES, PC_INSTRUCTIONS, PC_L1D, PC_LLC, PC_DTLB, PC_REMOTE,
+	PC_NEVENTS
+};
+
+struct perfcount {
+	int		fd[PC_NEVENTS];
+	uint64_t	v[PC_NEVENTS];
+	int		counted[PC_NEVENTS];	/* stops that counted it */
+	int		stops;
+};
+
+static const struct {
+	const char	*name;
+	uint32_t	type;
+	uint64_t	config;
+	int		group;
+} perfcount_events[PC_NEVENTS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0 },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0 },
+#define	PC_MISS(c)	((c) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+			    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+	{ "l1d-misses", PERF_TYPE_HW_CACHE, PC_MISS(PERF_COUNT_HW_CACHE_L1D), 1 },
+	{ "llc-misses", PERF_TYPE_HW_CACHE, PC_MISS(PERF_COUNT_HW_CACHE_LL), 1 },
+	{ "dtlb-misses", PERF_TYPE_HW_CACHE, PC_MISS(PERF_COUNT_HW_CACHE_DTLB), 1 },
+	{ "remote-dram", PERF_TYPE_HW_CACHE, PC_MISS(PERF_COUNT_HW_CACHE_NODE), 1 },
+#undef PC_MISS
+};
+
+static inline void
+perfcount_init(struct perfcount *pc)
+{
+	memset(pc, 0, sizeof(*pc));
+}
+
+static inline void
+perfcount_start(struct perfcount *pc)
+{
+	struct perf_event_attr pe;
+	int e, leader[2] = { -1, -1 };
+
+	for (e = 0; e < PC_NEVENTS; e++) {
+		memset(&pe, 0, sizeof(pe));
+		pe.type = perfcount_events[e].type;
+		pe.size = sizeof(pe);
+		pe.config = perfcount_events[e].config;
+		pe.exclude_kernel = 1;
+		pe.exclude_hv = 1;
+		pe.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		    PERF_FORMAT_TOTAL_TIME_RUNNING;
+		pe.disabled = leader[perfcount_events[e].group] < 0;
+		pc->fd[e] = (int)syscall(__NR_perf_event_open, &pe, 0, -1,
+		    leader[perfcount_events[e].group], 0);
+		if (pc->fd[e] >= 0 && leader[perfcount_events[e].group] < 0)
+			leader[perfcount_events[e].group] = pc->fd[e];
+	}
+	for (e = 0; e < 2; e++)
+		if (leader[e] >= 0)
+			ioctl(leader[e], PERF_EVENT_IOC_ENABLE,
+			    PERF_IOC_FLAG_GROUP);
+}
+
+static inline void
+perfcount_stop(struct perfcount *pc)
+{
+	uint64_t r[3];
+	int e;
+
+	for (e = 0; e < PC_NEVENTS; e++)
+		if (pc->fd[e] >= 0)
+			ioctl(pc->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+	for (e = 0; e < PC_NEVENTS; e++) {
+		if (pc->fd[e] < 0)
+			continue;
+		/* value, time enabled, time running */
+		if (read(pc->fd[e], r, sizeof(r)) == sizeof(r) && r[2] > 0) {
+			pc->v[e] += r[2] < r[1] ?
+			    (uint64_t)((double)r[0] * r[1] / r[2]) : r[0];
+			pc->counted[e]++;
+		}
+		close(pc->fd[e]);
+		pc->fd[e] = -1;
+	}
+	pc->stops++;
+}
+
+static inline void
+perfcount_add(struct perfcount *sum, const struct perfcount *pc)
+{
+	int e;
+
+	for (e = 0; e < PC_NEVENTS; e++) {
+		sum->v[e] += pc->v[e];
+		sum->counted[e] += pc->counted[e];
+	}
+	sum->stops += pc->stops;
+}
+
+static inline void
+perfcount_print(FILE *fp, const char *label, const struct perfcount *pc)
+{
+	int e;
+
+	fprintf(fp, "perf %s:", label);
+	for (e = 0; e < PC_NEVENTS; e++) {
+		if (pc->stops > 0 && pc->counted[e] == pc->stops)
+			fprintf(fp, " %s %llu", perfcount_events[e].name,
+			    (unsigned long long)pc->v[e]);
+		else
+			fprintf(fp, " %s -", perfcount_events[e].name);
+		if (e == PC_INSTRUCTIONS && pc->stops > 0 &&
+		    pc->counted[PC_CYCLES] == pc->stops &&
+		    pc->counted[PC_INSTRUCTIONS] == pc->stops &&
+		    pc->v[PC_CYCLES] > 0)
+			fprintf(fp, " ipc %.2f",
+			    (double)pc->v[PC_INSTRUCTIONS] / pc->v[PC_CYCLES]);
+	}
+	fprintf(fp, "\n");
+}
+
+#endif /* PERFCOUNT_H */
@@ -0,0 +1,239 @@
+/*
+ * replay: play back a BinaryTraceHeap trace against the malloc in use.
+ *
+ *	replay [-t] trace-N.bin
+ *
+ * Every thread of the trace gets a thread of its own, which makes that
+ * thread's mallocs and frees in their recorded order, with the recorded
+ * sizes.  A free of an object from another thread waits until that
+ * thread has made the malloc.  With -t, each call also waits for its
+ * recorded time; otherwise calls go as fast as they can.  Frees of
+ * objects allocated before the trace began are dropped.
+ *
+ * Run it under an allocator with LD_PRELOAD, as util/bench/run does.  The
+ * trace and the replay's own tables are mapped, not malloced, so the
+ * heap sees only the calls in the trace (but they do count toward the
+ * peak RSS that measure reports).
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utility/traceformat.h"
+
+#define	MAXTHREADS	1024
+
+/* An operation of one replay thread: a malloc or free of object id. */
+struct op {
+	uint64_t	time;
+	uint64_t	size;		/* 0 for a free */
+	uint64_t	id;
+};
+
+struct stream {
+	struct op	*ops;
+	size_t		nops;
+	pthread_t	tid;
+};
+
+static struct stream streams[MAXTHREADS];
+static int nstreams;
+static void * volatile *objs;		/* [object id], set by its malloc */
+static int paced;
+static double start;
+
+static void *
+allocate(size_t sz)
+{
+	void *p;
+
+	p = mmap(NULL, sz ? sz : 1, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("replay: mmap");
+		exit(1);
+	}
+	return (p);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void *
+play(void *arg)
+{
+	struct stream *s = (struct stream *)arg;
+	struct op *o;
+	void *p;
+	size_t i;
+
+	for (i = 0; i < s->nops; i++) {
+		o = &s->ops[i];
+		if (paced)
+			while (now() - start < o->time / 1e9)
+				sched_yield();
+		if (o->size) {
+			if ((p = malloc(o->size)) != NULL)
+				*(volatile char *)p = 0;
+			else
+				p = (void *)1;	/* failed: never freed */
+			__atomic_store_n(&objs[o->id], p, __ATOMIC_RELEASE);
+		} else {
+			while ((p = __atomic_load_n(&objs[o->id],
+			    __ATOMIC_ACQUIRE)) == NULL)
+				sched_yield();
+			if (p != (void *)1)
+				free(p);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * An open-addressing map from the traced addresses of live objects to
+ * their object ids.  Deleted slots keep their key with id ~0.
+ */
+static uint64_t *keys, *vals;
+static size_t mapmask;
+
+static size_t
+slot(uint64_t key)
+{
+	size_t i = (size_t)((key >> 4) * 0x9e3779b97f4a7c15ULL) & mapmask;
+
+	while (keys[i] != 0 && keys[i] != key)
+		i = (i + 1) & mapmask;
+	return (i);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const HL::TraceHeader *h;
+	const HL::TraceRecord *rec;
+	size_t n, i, j, nobj = 0, dropped = 0;
+	uint32_t tids[MAXTHREADS];
+	struct stat st;
+	int ch, fd, t;
+	char *map;
+	double elapsed;
+
+	while ((ch = getopt(argc, argv, "t")) != -1) {
+		switch (ch) {
+		case 't':
+			paced = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) {
+usage:
+		fprintf(stderr, "usage: replay [-t] trace-N.bin\n");
+		return (2);
+	}
+
+	if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(argv[optind]);
+		return (1);
+	}
+	map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	h = (const HL::TraceHeader *)map;
+	if (map == MAP_FAILED || (size_t)st.st_size < sizeof(*h) ||
+	    memcmp(h->magic, "HLTRACE", 8) != 0 ||
+	    h->version != HL::TraceHeader::Version ||
+	    h->recordSize != sizeof(HL::TraceRecord)) {
+		fprintf(stderr, "replay: %s: not a version %d trace\n",
+		    argv[optind], HL::TraceHeader::Version);
+		return (1);
+	}
+	rec = (const HL::TraceRecord *)(h + 1);
+	n = (st.st_size - sizeof(*h)) / sizeof(*rec);
+
+	/*
+	 * Number the objects and threads, and count each thread's
+	 * operations.  Records are in call order, so an address maps to
+	 * the object of its latest malloc.
+	 */
+	for (mapmask = 1; mapmask < 2 * n; mapmask <<= 1)
+		;
+	keys = (uint64_t *)allocate(mapmask * sizeof(uint64_t));
+	vals = (uint64_t *)allocate(mapmask * sizeof(uint64_t));
+	mapmask--;
+	uint64_t *ids = (uint64_t *)allocate(n * sizeof(uint64_t));
+	int *thr = (int *)allocate(n * sizeof(int));
+	for (i = 0; i < n; i++) {
+		for (t = 0; t < nstreams && tids[t] != rec[i].thread; t++)
+			;
+		if (t == nstreams) {
+			if (nstreams == MAXTHREADS) {
+				fprintf(stderr, "replay: more than %d threads\n",
+				    MAXTHREADS);
+				return (1);
+			}
+			tids[nstreams++] = rec[i].thread;
+		}
+		thr[i] = t;
+		j = slot(rec[i].ptr);
+		if (rec[i].op == HL::TraceMalloc) {
+			keys[j] = rec[i].ptr;
+			vals[j] = ids[i] = nobj++;
+		} else if (keys[j] == 0 || vals[j] == ~0ULL) {
+			thr[i] = -1;
+			dropped++;
+			continue;
+		} else {
+			ids[i] = vals[j];
+			vals[j] = ~0ULL;
+		}
+		streams[t].nops++;
+	}
+
+	objs = (void * volatile *)allocate(nobj * sizeof(void *));
+	for (t = 0; t < nstreams; t++) {
+		streams[t].ops = (struct op *)allocate(streams[t].nops *
+		    sizeof(struct op));
+		streams[t].nops = 0;
+	}
+	for (i = 0; i < n; i++) {
+		if ((t = thr[i]) < 0)
+			continue;
+		struct op *o = &streams[t].ops[streams[t].nops++];
+		o->time = rec[i].time;
+		o->size = rec[i].op == HL::TraceMalloc ?
+		    (rec[i].size ? rec[i].size : 1) : 0;
+		o->id = ids[i];
+	}
+	munmap(keys, (mapmask + 1) * sizeof(uint64_t));
+	munmap(vals, (mapmask + 1) * sizeof(uint64_t));
+	munmap(ids, n * sizeof(uint64_t));
+	munmap(thr, n * sizeof(int));
+
+	printf("%zu records, %zu objects, %d threads, %zu frees dropped%s\n",
+	    n, nobj, nstreams, dropped, paced ? ", paced" : "");
+	start = now();
+	for (t = 0; t < nstreams; t++)
+		pthread_create(&streams[t].tid, NULL, play, &streams[t]);
+	for (t = 0; t < nstreams; t++)
+		pthread_join(streams[t].tid, NULL);
+	elapsed = now() - start;
+	printf("%.0f operations per second, %.3f seconds\n",
+	    (n - dropped) / elapsed, elapsed);
+	return (0);
+}
@@ -0,0 +1,334 @@
+/*
+ * sizeclasses: fit size classes to the sizes a program asks for.
+ *
+ *	sizeclasses [-n classes] [-g granularity] [-m max] [-H name]
+ *	    [-T table] input ...
+ *
+ * Each input is a BinaryTraceHeap trace (HLTRACE), an AsyncLogHeap log
+ * (HLLOG), or a histogram in text, one "size count" pair per line (as a
+ * sampling profile gives).  Every malloc of at most max bytes (32768)
+ * counts toward its size; larger ones are left to the large-object
+ * heap and only reported.
+ *
+ * Sizes are first rounded up to a grid that both allocators can use:
+ * multiples of granularity (16) up to 1024 bytes, and of 128 beyond, as
+ * tcmalloc's class index requires.  Then a dynamic program over the
+ * grid points that occur picks the set of at most the given number of
+ * classes (64) that wastes the fewest bytes to internal fragmentation,
+ * counting every malloc once.  The largest size seen is always a class.
+ *
+ * The classes, with the waste of each, go to the standard output.
+ * With -H, a header for Heap Layers goes there too: a table named name
+ * and a TableSizeClasses over it (see utility/tablesizeclasses.h), to
+ * give to SegHeap or StrictSegHeap.  With -T, the sizes are written to
+ * the file table, one per line, which tcmalloc loads when
+ * $TCMALLOC_SIZE_CLASSES names it (tcmalloc takes at most 91 classes).
+ *
+ * Build it as util/bench/run builds replay:
+ *
+ *	g++ -O2 -IHeap-Layers util/bench/sizeclasses.cpp -o sizeclasses
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utility/traceformat.h"
+
+#define	SMALLMAX	1024		/* tcmalloc's kMaxSmallSize */
+#define	LARGESTEP	128		/* its granularity beyond that */
+
+static size_t granularity = 16;
+static size_t maxsize = 32768;
+static uint64_t *counts, *bytes;	/* [grid point] */
+static size_t npoints;
+static uint64_t nlarge, nmalloc;
+
+/* The grid point of sz, and the size of point i. */
+static size_t
+point(size_t sz)
+{
+	if (sz == 0)
+		sz = 1;
+	if (sz <= SMALLMAX)
+		return ((sz + granularity - 1) / granularity - 1);
+	return (SMALLMAX / granularity +
+	    (sz - SMALLMAX + LARGESTEP - 1) / LARGESTEP - 1);
+}
+
+static size_t
+pointsize(size_t i)
+{
+	if (i < SMALLMAX / granularity)
+		return ((i + 1) * granularity);
+	return (SMALLMAX + (i + 1 - SMALLMAX / granularity) * LARGESTEP);
+}
+
+static void
+add(uint64_t sz, uint64_t n)
+{
+	nmalloc += n;
+	if (sz > maxsize)
+		nlarge += n;
+	else {
+		counts[point(sz)] += n;
+		bytes[point(sz)] += n * (sz ? sz : 1);
+	}
+}
+
+static int
+readtext(const char *name, const char *map, size_t len)
+{
+	unsigned long long sz, n;
+	const char *p, *end = map + len;
+	char line[128];
+	size_t l;
+
+	for (p = map; p < end; p += l + 1) {
+		for (l = 0; p + l < end && p[l] != '\n'; l++)
+			;
+		if (l == 0 || p[0] == '#')
+			continue;
+		if (l >= sizeof(line))
+			goto bad;
+		memcpy(line, p, l);
+		line[l] = '\0';
+		n = 1;
+		if (sscanf(line, "%llu %llu", &sz, &n) < 1)
+			goto bad;
+		add(sz, n);
+	}
+	return (0);
+bad:
+	fprintf(stderr, "sizeclasses: %s: not a trace, log or histogram\n",
+	    name);
+	return (-1);
+}
+
+static int
+readfile(const char *name)
+{
+	struct stat st;
+	char *map;
+	size_t i, n;
+	int fd, error = 0;
+
+	if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(name);
+		return (-1);
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return (0);
+	}
+	map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(name);
+		return (-1);
+	}
+
+	const HL::TraceHeader *th = (const HL::TraceHeader *)map;
+	const HL::LogHeader *lh = (const HL::LogHeader *)map;
+	if ((size_t)st.st_size >= sizeof(*th) &&
+	    memcmp(th->magic, "HLTRACE", 8) == 0) {
+		if (th->version != HL::TraceHeader::Version ||
+		    th->recordSize != sizeof(HL::TraceRecord)) {
+			fprintf(stderr, "sizeclasses: %s: not a version %d "
+			    "trace\n", name, HL::TraceHeader::Version);
+			error = -1;
+		} else {
+			const HL::TraceRecord *rec =
+			    (const HL::TraceRecord *)(th + 1);
+			n = (st.st_size - sizeof(*th)) / sizeof(*rec);
+			for (i = 0; i < n; i++)
+				if (rec[i].op == HL::TraceMalloc)
+					add(rec[i].size, 1);
+		}
+	} else if ((size_t)st.st_size >= sizeof(*lh) &&
+	    memcmp(lh->magic, "HLLOG\0\0", 8) == 0) {
+		if (lh->version != HL::LogHeader::Version ||
+		    lh->recordSize != sizeof(HL::LogRecord)) {
+			fprintf(stderr, "sizeclasses: %s: not a version %d "
+			    "log\n", name, HL::LogHeader::Version);
+			error = -1;
+		} else {
+			const HL::LogRecord *rec =
+			    (const HL::LogRecord *)(lh + 1);
+			n = (st.st_size - sizeof(*lh)) / sizeof(*rec);
+			for (i = 0; i < n; i++)
+				if (rec[i].op == HL::TraceMalloc)
+					add(rec[i].size, 1);
+		}
+	} else
+		error = readtext(name, map, st.st_size);
+	munmap(map, st.st_size);
+	return (error);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *hname = NULL, *tname = NULL;
+	size_t nclasses = 64, *pts, *sizes, *ends, n, i, j, k, best;
+	uint64_t *c, *s, *cost, *prev, w, total;
+	FILE *f;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "g:H:m:n:T:")) != -1) {
+		switch (ch) {
+		case 'g':
+			granularity = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			hname = optarg;
+			break;
+		case 'm':
+			maxsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nclasses = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			tname = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc || nclasses == 0 || granularity == 0 ||
+	    (granularity & (granularity - 1)) != 0 ||
+	    granularity > SMALLMAX || maxsize == 0) {
+usage:
+		fprintf(stderr, "usage: sizeclasses [-n classes] "
+		    "[-g granularity] [-m max] [-H name] [-T table] "
+		    "input ...\n");
+		return (2);
+	}
+
+	npoints = point(maxsize) + 1;
+	counts = (uint64_t *)calloc(npoints, sizeof(uint64_t));
+	bytes = (uint64_t *)calloc(npoints, sizeof(uint64_t));
+	for (; optind < argc; optind++)
+		if (readfile(argv[optind]) < 0)
+			return (1);
+
+	/*
+	 * The points that occur, with prefix sums of their counts and
+	 * requested bytes: c[j] and s[j] cover the first j of them.  A class of
+	 * size pointsize(pts[j-1]) holding points i..j-1 wastes
+	 * size * (c[j] - c[i]) - (s[j] - s[i]) bytes.
+	 */
+	pts = (size_t *)malloc(npoints * sizeof(size_t));
+	for (n = i = 0; i < npoints; i++)
+		if (counts[i] != 0)
+			pts[n++] = i;
+	if (n == 0) {
+		fprintf(stderr, "sizeclasses: no mallocs of at most %zu "
+		    "bytes\n", maxsize);
+		return (1);
+	}
+	if (nclasses > n)
+		nclasses = n;
+	c = (uint64_t *)calloc(n + 1, sizeof(uint64_t));
+	s = (uint64_t *)calloc(n + 1, sizeof(uint64_t));
+	for (j = 0; j < n; j++) {
+		c[j + 1] = c[j] + counts[pts[j]];
+		s[j + 1] = s[j] + bytes[pts[j]];
+	}
+
+	/*
+	 * cost[k][j] is the least waste covering the first j points with
+	 * k classes, the last of them ending at point j-1; prev[k][j] is
+	 * where that class begins.
+	 */
+#define	AT(a, k, j)	((a)[(k) * (n + 1) + (j)])
+	cost = (uint64_t *)malloc((nclasses + 1) * (n + 1) * sizeof(uint64_t));
+	prev = (uint64_t *)malloc((nclasses + 1) * (n + 1) * sizeof(uint64_t));
+	for (j = 0; j <= n; j++)
+		AT(cost, 0, j) = j == 0 ? 0 : UINT64_MAX;
+	for (k = 1; k <= nclasses; k++) {
+		for (j = 0; j <= n; j++) {
+			AT(cost, k, j) = UINT64_MAX;
+			if (j < k)
+				continue;
+			const uint64_t sz = pointsize(pts[j - 1]);
+			for (i = k - 1; i < j; i++) {
+				if (AT(cost, k - 1, i) == UINT64_MAX)
+					continue;
+				w = AT(cost, k - 1, i) + sz * (c[j] - c[i]) -
+				    (s[j] - s[i]);
+				if (w < AT(cost, k, j)) {
+					AT(cost, k, j) = w;
+					AT(prev, k, j) = i;
+				}
+			}
+		}
+	}
+	best = nclasses;
+	for (k = 1; k <= nclasses; k++)
+		if (AT(cost, k, n) < AT(cost, best, n))
+			best = k;
+
+	/*
+	 * Walk back from the last point for the class sizes; class k
+	 * holds points ends[k]..ends[k+1]-1.
+	 */
+	sizes = (size_t *)malloc(best * sizeof(size_t));
+	ends = (size_t *)malloc((best + 1) * sizeof(size_t));
+	for (k = best, j = n; k > 0; j = AT(prev, k, j), k--) {
+		sizes[k - 1] = pointsize(pts[j - 1]);
+		ends[k] = j;
+	}
+	ends[0] = 0;
+
+	total = s[n];
+	printf("%llu mallocs, %llu bytes; %llu larger than %zu bytes\n",
+	    (unsigned long long)nmalloc, (unsigned long long)total,
+	    (unsigned long long)nlarge, maxsize);
+	printf("%zu classes waste %llu bytes (%.2f%%)\n", best,
+	    (unsigned long long)AT(cost, best, n),
+	    total ? 100.0 * AT(cost, best, n) / total : 0.0);
+	for (k = 0; k < best; k++) {
+		i = ends[k];
+		j = ends[k + 1];
+		w = AT(cost, k + 1, j) - AT(cost, k, i);
+		printf("# class %zu: %zu bytes, %llu mallocs, %llu wasted\n",
+		    k, sizes[k], (unsigned long long)(c[j] - c[i]),
+		    (unsigned long long)w);
+	}
+
+	if (hname != NULL) {
+		printf("\n#include \"utility/tablesizeclasses.h\"\n\n");
+		printf("struct %sTable {\n", hname);
+		printf("  enum { NumBins = %zu };\n", best);
+		printf("  static inline const size_t * sizes (void) {\n");
+		printf("    static const size_t s[NumBins] = {");
+		for (k = 0; k < best; k++)
+			printf("%s%s%zu", k ? "," : "",
+			    k % 8 == 0 ? "\n      " : " ", sizes[k]);
+		printf("\n    };\n    return s;\n  }\n};\n\n");
+		printf("typedef HL::TableSizeClasses<%sTable> %s;\n", hname,
+		    hname);
+	}
+
+	if (tname != NULL) {
+		if ((f = fopen(tname, "w")) == NULL) {
+			perror(tname);
+			return (1);
+		}
+		fprintf(f, "# %zu size classes from sizeclasses, wasting "
+		    "%.2f%%\n", best,
+		    total ? 100.0 * AT(cost, best, n) / total : 0.0);
+		for (k = 0; k < best; k++)
+			fprintf(f, "%zu\n", sizes[k]);
+		fclose(f);
+	}
+	return (0);
+}
@@ -0,0 +1,301 @@
+/*
+ * xfree: a producer-consumer benchmark, where every object is freed by
+ * a different thread than the one that allocated it.
+ *
+ *	xfree [-p producers] [-c consumers] [-q depth] [-n objects]
+ *	      [-s min] [-S max] [-d uniform|log] [-i ms] [-v]
+ *
+ * Each producer allocates objects (n in all, shared out among the
+ * producers), writes them and passes them round robin to the consumers,
+ * through one bounded single-producer single-consumer queue of depth
+ * slots per producer and consumer pair.  Consumers read each object and
+ * free it.  Sizes are drawn from [min, max], either uniformly or spread
+ * evenly over the powers of two in between (log).
+ *
+ * Every interval (10ms by default) the main thread samples the resident set and the bytes
+ * in flight (allocated but not yet freed); -v prints each sample.  At the
+ * end it prints the throughput (mallocs plus frees), the peak RSS and
+ * live bytes, and the blowup: the peak RSS growth over the peak live
+ * bytes.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	CACHELINE	64
+#define	MAXTHREADS	256
+
+struct queue {
+	volatile size_t	head;		/* next slot to take, consumer's */
+	char		pad0[CACHELINE - sizeof(size_t)];
+	volatile size_t	tail;		/* next slot to fill, producer's */
+	char		pad1[CACHELINE - sizeof(size_t)];
+	void		**slot;
+};
+
+/* Per-thread counters, on their own lines. */
+struct counter {
+	volatile size_t	bytes;
+	volatile int	done;
+	char		pad[CACHELINE - sizeof(size_t) - sizeof(int)];
+};
+
+static int nprod = 1, ncons = 1, lsize;
+static size_t depth = 1024, nobj = 10000000, minsz = 16, maxsz = 512;
+static struct queue *queues;		/* [producer * ncons + consumer] */
+static struct counter allocated[MAXTHREADS], freed[MAXTHREADS];
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static size_t
+rss(void)
+{
+	unsigned long size, res = 0;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+		return (0);
+	if (fscanf(fp, "%lu %lu", &size, &res) != 2)
+		res = 0;
+	fclose(fp);
+	return (res * sysconf(_SC_PAGESIZE));
+}
+
+/* xorshift64*, one state per thread */
+static uint64_t
+rnd(uint64_t *x)
+{
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+	return (*x * 2685821657736338717ULL);
+}
+
+static size_t
+draw(uint64_t *x)
+{
+	size_t lo, hi;
+	int b;
+
+	if (!lsize)
+		return (minsz + rnd(x) % (maxsz - minsz + 1));
+	/* pick a power of two, then a size within it */
+	lo = minsz;
+	for (b = rnd(x) % lsize; b > 0; b--)
+		lo <<= 1;
+	hi = lo * 2 - 1 < maxsz ? lo * 2 - 1 : maxsz;
+	return (lo + rnd(x) % (hi - lo + 1));
+}
+
+static void *
+producer(void *arg)
+{
+	int id = (int)(intptr_t)arg, c = 0;
+	size_t i, n, sz, bytes = 0;
+	uint64_t x = 0x9e3779b97f4a7c15ULL * (id + 1);
+	struct queue *q;
+	size_t *p;
+
+	n = nobj / nprod + (id < (int)(nobj % nprod));
+	for (i = 0; i < n; i++) {
+		sz = draw(&x);
+		if ((p = malloc(sz)) == NULL) {
+			fprintf(stderr, "xfree: out of memory\n");
+			exit(1);
+		}
+		p[0] = sz;
+		memset(p + 1, id, sz < CACHELINE ? sz - sizeof(*p) :
+		    CACHELINE - sizeof(*p));
+		bytes += sz;
+		allocated[id].bytes = bytes;
+
+		q = &queues[id * ncons + c];
+		while (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)
+		    == depth)
+			sched_yield();
+		q->slot[q->tail % depth] = p;
+		__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+		if (++c == ncons)
+			c = 0;
+	}
+	__atomic_store_n(&allocated[id].done, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+static void *
+consumer(void *arg)
+{
+	int id = (int)(intptr_t)arg, p, idle, done;
+	size_t tail, bytes = 0;
+	struct queue *q;
+	size_t *obj;
+
+	for (;;) {
+		idle = 1;
+		done = 1;
+		for (p = 0; p < nprod; p++) {
+			if (!__atomic_load_n(&allocated[p].done, __ATOMIC_ACQUIRE))
+				done = 0;
+			q = &queues[p * ncons + id];
+			tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+			if (q->head == tail)
+				continue;
+			idle = 0;
+			while (q->head != tail) {
+				obj = q->slot[q->head % depth];
+				bytes += obj[0];
+				free(obj);
+				__atomic_store_n(&q->head, q->head + 1,
+				    __ATOMIC_RELEASE);
+			}
+			freed[id].bytes = bytes;
+		}
+		if (idle) {
+			/* the done flags were read before the queues */
+			if (done)
+				break;
+			sched_yield();
+		}
+	}
+	return (NULL);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: xfree [-p producers] [-c consumers] "
+	    "[-q depth] [-n objects]\n"
+	    "             [-s min] [-S max] [-d uniform|log] [-i ms] [-v]\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pthread_t tid[2 * MAXTHREADS];
+	size_t base, r, live, peakrss = 0, peaklive = 0, a, f;
+	double t0, t, next, interval = 0.01;
+	int ch, i, verbose = 0, running;
+	struct timespec nap;
+
+	while ((ch = getopt(argc, argv, "p:c:q:n:s:S:d:i:v")) != -1) {
+		switch (ch) {
+		case 'p':
+			nprod = atoi(optarg);
+			break;
+		case 'c':
+			ncons = atoi(optarg);
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nobj = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			minsz = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			maxsz = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			if (strcmp(optarg, "log") == 0)
+				lsize = 1;
+			else if (strcmp(optarg, "uniform") != 0)
+				usage();
+			break;
+		case 'i':
+			interval = atoi(optarg) / 1000.0;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nprod < 1 || nprod > MAXTHREADS || ncons < 1 ||
+	    ncons > MAXTHREADS || depth < 1 || interval <= 0)
+		usage();
+	if (minsz < sizeof(size_t))
+		minsz = sizeof(size_t);
+	if (maxsz < minsz)
+		maxsz = minsz;
+	if (lsize) {
+		/* the number of powers of two from minsz up to maxsz */
+		for (lsize = 1, r = minsz; r * 2 <= maxsz; r <<= 1)
+			lsize++;
+	}
+
+	queues = calloc(nprod * ncons, sizeof(*queues));
+	for (i = 0; queues != NULL && i < nprod * ncons; i++)
+		if ((queues[i].slot = calloc(depth, sizeof(void *))) == NULL)
+			queues = NULL;
+	if (queues == NULL) {
+		fprintf(stderr, "xfree: out of memory\n");
+		return (1);
+	}
+
+	printf("producers %d consumers %d depth %zu objects %zu sizes %zu-%zu %s\n",
+	    nprod, ncons, depth, nobj, minsz, maxsz, lsize ? "log" : "uniform");
+	base = rss();
+	t0 = now();
+	for (i = 0; i < ncons; i++)
+		pthread_create(&tid[i], NULL, consumer, (void *)(intptr_t)i);
+	for (i = 0; i < nprod; i++)
+		pthread_create(&tid[ncons + i], NULL, producer,
+		    (void *)(intptr_t)i);
+
+	nap.tv_sec = 0;
+	nap.tv_nsec = 1000000;
+	next = t0;
+	do {
+		running = 0;
+		for (i = 0; i < nprod; i++)
+			if (!allocated[i].done)
+				running = 1;
+		t = now();
+		if (t < next && running) {
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		next = t + interval;
+		for (a = f = 0, i = 0; i < MAXTHREADS; i++) {
+			a += allocated[i].bytes;
+			f += freed[i].bytes;
+		}
+		/* the counters are read unsynchronized; clamp the skew */
+		live = a > f ? a - f : 0;
+		r = rss();
+		if (r > peakrss)
+			peakrss = r;
+		if (live > peaklive)
+			peaklive = live;
+		if (verbose)
+			printf("t %.3f rss_kb %zu live_kb %zu\n", t - t0,
+			    r / 1024, live / 1024);
+	} while (running);
+	for (i = 0; i < nprod + ncons; i++)
+		pthread_join(tid[i], NULL);
+	t = now() - t0;
+
+	printf("%.0f operations per second, %.3f seconds\n", 2.0 * nobj / t, t);
+	printf("peak rss %zu kB (%zu kB at start), peak live %zu kB, blowup %.2f\n",
+	    peakrss / 1024, base / 1024, peaklive / 1024,
+	    peaklive ? (double)(peakrss > base ? peakrss - base : 0) / peaklive : 0);
+	return (0);
+}
@@ -46,11 +46,13 @@ strcpy, strlen, sprintf
 
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
 
 #if !defined(_WIN32)
 #include <dlfcn.h>
+#include <pthread.h>
 #endif
 
 #ifndef CUSTOM_PREFIX
@@ -62,122 +64,209 @@ strcpy, strlen, sprintf
 
 extern bool malloc_hooked;
 
+extern "C" {
+  size_t CUSTOM_PREFIX(malloc_usable_size)(void *);
+
+  // The allocator can call this with the range its objects live in,
+  // so that only pointers inside it are looked up; otherwise, every
+  // pointer not on the stack is.
+  void heapshield_set_range (void * low, void * high);
+
+#if defined(__GNUC__)
+  // If the allocator has it (see wrapper.cpp), the object an interior
+  // pointer is in, so the room left is measured from the pointer.
+  int xxmalloc_object_bounds (void *, void **, void **) __attribute__((weak));
+#endif
+}
+
+/// The length limit of unbounded operations (the largest object).
+static const size_t NoLimit = ((size_t) -1) >> 1;
+
+static char * heapLow = NULL;
+static char * heapHigh = NULL;
+
+void heapshield_set_range (void * low, void * high) {
+  heapLow = (char *) low;
+  heapHigh = (char *) high;
+}
+
+/// The top of this thread's stack, or else the top of the address
+/// space (so that everything above the caller counts as stack).
+static char * stackTop (void) {
+#if defined(__GLIBC__)
+  static __thread char * top = NULL;
+  static __thread bool finding = false;
+  if (top == NULL) {
+    if (finding) {
+      // pthread_getattr_np can itself allocate and copy.
+      return (char *) -1;
+    }
+    finding = true;
+    pthread_attr_t attr;
+    void * addr;
+    size_t size;
+    if ((pthread_getattr_np (pthread_self(), &attr) == 0) &&
+	(pthread_attr_getstack (&attr, &addr, &size) == 0)) {
+      top = (char *) addr + size;
+      pthread_attr_destroy (&attr);
+    } else {
+      top = (char *) -1;
+    }
+    finding = false;
+  }
+  return top;
+#else
+  return (char *) -1;
+#endif
+}
+
+/// Whether ptr is in the stack, between this frame and its top.  (The
+/// stack grows down on every platform HeapShield runs on.)
 inline static 
 bool onStack (void * ptr) {
-  volatile int a;
-  volatile int b;
-  if ((size_t) &b > (size_t) &a) {
-    // Stack grows up.
-    return ((size_t) ptr < (size_t) &a);
-  } else {
-    // Stack grows down.
-    return ((size_t) ptr > (size_t) &b);
+  volatile char here;
+  return (((char *) ptr >= (char *) &here) && ((char *) ptr < stackTop()));
+}
+
+/// Whether ptr might be in a heap object (and so should be checked).
+inline static
+bool inHeap (const void * ptr) {
+  if (!malloc_hooked) {
+    return false;
+  }
+  if (heapHigh != NULL) {
+    return (((char *) ptr >= heapLow) && ((char *) ptr < heapHigh));
   }
+  return !onStack ((void *) ptr);
 }
 
-extern "C" {
-  size_t CUSTOM_PREFIX(malloc_usable_size)(void *);
+/// The space left in the heap object at ptr, or -1 if it is not in one.
+inline static
+size_t roomAt (const void * ptr) {
+  if (!inHeap (ptr)) {
+    return (size_t) -1;
+  }
+#if defined(__GNUC__)
+  if (xxmalloc_object_bounds) {
+    void * start;
+    void * end;
+    if (!xxmalloc_object_bounds ((void *) ptr, &start, &end)) {
+      return (size_t) -1;
+    }
+    return (char *) end - (const char *) ptr;
+  }
+#endif
+  return CUSTOM_PREFIX(malloc_usable_size) ((void *) ptr);
 }
 
+/// n, or less if that would run past the end of the heap object at ptr.
+inline static
+size_t clamp (const void * ptr, size_t n) {
+  const size_t sz = roomAt (ptr);
+  return (n < sz) ? n : sz;
+}
 
-static size_t local_strlen (const char * str)
-{
-  int len = 0;
-  char * ch = (char *) str;
-  size_t maxLen;
-  if (onStack((void *) str) || !malloc_hooked) {
-    maxLen = UINT_MAX;
-  } else {
-    maxLen = CUSTOM_PREFIX(malloc_usable_size) ((void *) str);
-  }
-  const char *p = ch;
-  /* Loop over the data in s.  */
-  while (*p != '\0')
-    p++;
-  len = (size_t)(p - ch);
-  if (len > maxLen) {
-    len = maxLen;
+/// As clamp, for n characters and then a nul.
+inline static
+size_t clampString (const void * ptr, size_t n) {
+  const size_t sz = roomAt (ptr);
+  if (sz == (size_t) -1) {
+    return n;
   }
-  return len;
+  return (sz == 0) ? 0 : ((n < sz - 1) ? n : sz - 1);
 }
 
 
-static char * local_strcat (char * dest, const char * src) 
-{
-  size_t d = local_strlen (dest);
-  char * dptr = dest + d;
-  size_t s = local_strlen (src);
-  char * sptr = (char *) src;
-  for (int i = 0; i <= s; i++) {
-    *dptr++ = *sptr++;
+// Since memcpy and memset are replaced here, the checked versions call
+// libc's (vectorized) ones through dlsym, or plain loops until those
+// are found.
+
+typedef void * memcpyFunction (void *, const void *, size_t);
+typedef void * memsetFunction (void *, int, size_t);
+
+template <class Function>
+static Function * libcFunction (const char * name) {
+#if !defined(_WIN32)
+  static __thread bool resolving = false;
+  if (!resolving) {
+    // dlsym itself may copy memory.
+    resolving = true;
+    Function * fn = reinterpret_cast<Function *>(dlsym (RTLD_NEXT, name));
+    resolving = false;
+    return fn;
   }
-  return dest;
+#endif
+  return NULL;
 }
 
-static char * local_strncat (char * dest, const char * src, size_t sz)
+static void * local_memcpy (void * dest, const void * src, size_t n)
 {
-  size_t d = local_strlen (dest);
-  char * dptr = dest + d;
-  size_t s = local_strlen (src);
-  char * sptr = (char *) src;
-  for (int i = 0; i <= s && i < sz; i++) {
-    *dptr++ = *sptr++;
+  static memcpyFunction * real_memcpy = libcFunction<memcpyFunction> ("memcpy");
+  if (real_memcpy != NULL) {
+    return (*real_memcpy) (dest, src, n);
+  }
+  char * dptr = (char *) dest;
+  const char * sptr = (const char *) src;
+  for (size_t i = 0; i < n; i++) {
+    dptr[i] = sptr[i];
   }
-  // Add a trailing nul.
-  *dptr = '\0';
   return dest;
 }
 
-static char * local_strncpy (char * dest, const char * src, size_t n)
+static void * local_memset (void * dest, int val, size_t n)
 {
-  char * sptr = (char *) src;
-  char * dptr = dest;
-  int destLength;
-  if (!malloc_hooked) {
-    destLength = n;
-  } else {
-    destLength = CUSTOM_PREFIX(malloc_usable_size) (dest) - 1;
+  static memsetFunction * real_memset = libcFunction<memsetFunction> ("memset");
+  if (real_memset != NULL) {
+    return (*real_memset) (dest, val, n);
   }
-  int lengthToCopy = (n < destLength) ? n : destLength;
-  while (lengthToCopy && (*dptr++ = *sptr++)) {
-    lengthToCopy--;
+  char * dptr = (char *) dest;
+  for (size_t i = 0; i < n; i++) {
+    dptr[i] = val;
   }
-  *dptr = '\0';
   return dest;
 }
 
+static size_t local_strlen (const char * str)
+{
+  // Scan no further than the end of the object.
+  return strnlen (str, clamp (str, NoLimit));
+}
 
-static char * local_strcpy (char * dest, const char * src) 
+/// Copy up to n characters of src to dest, and then a nul.
+static char * local_strncpy (char * dest, const char * src, size_t n)
 {
-  return local_strncpy (dest, src, INT_MAX);
+  const size_t lengthToCopy = strnlen (src, n);
+  local_memcpy (dest, src, lengthToCopy);
+  dest[lengthToCopy] = '\0';
+  return dest;
 }
 
-static void * local_strdup (const char * s) {
-  size_t len = local_strlen((char *) s);
-  char * n = (char *) malloc (len + 1);
-  if (n) {
-    local_strncpy (n, s, len);
-  }
-  return n;
+static char * local_strcpy (char * dest, const char * src) 
+{
+  return local_strncpy (dest, src, clampString (dest, NoLimit));
 }
 
-static void * local_memcpy (void * dest, const void * src, size_t n)
+/// Append up to n characters of src to dest (as far as it has room),
+/// and then a nul.
+static char * local_strncat (char * dest, const char * src, size_t n)
 {
-  char * dptr = (char *) dest;
-  char * sptr = (char *) src;
-  for (int i = 0; i < n; i++) {
-    dptr[i] = sptr[i];
-  }
+  char * dptr = dest + local_strlen (dest);
+  local_strncpy (dptr, src, clampString (dptr, n));
   return dest;
 }
 
-static void * local_memset (void * dest, int val, size_t n)
+static char * local_strcat (char * dest, const char * src) 
 {
-  char * dptr = (char *) dest;
-  for (int i = 0; i < n; i++) {
-    dptr[i] = val;
+  return local_strncat (dest, src, NoLimit);
+}
+
+static void * local_strdup (const char * s) {
+  size_t len = local_strlen((char *) s);
+  char * n = (char *) malloc (len + 1);
+  if (n) {
+    local_strncpy (n, s, len);
   }
-  return dest;
+  return n;
 }
 
 extern "C" {
@@ -204,46 +293,17 @@ extern "C" {
 #endif
 
   void * memcpy (void * dest, const void * src, size_t n) {
-    size_t sz;
-    if (onStack(dest) || !malloc_hooked) {
-      sz = n;
-    } else {
-      sz = CUSTOM_PREFIX(malloc_usable_size) (dest);
-      if (sz == -1) {
-	sz = n;
-      } else {
-	size_t s = (n < sz) ? n : sz;
-	if (sz < n) {
-#if 0
-	  // Overflow.
-	  fprintf (stderr, "Overflow detected in memcpy: dest (%x) size = %d, n = %d\n", dest, sz, n);
-#endif
-	}
-	sz = s;
-      }
-    }
-    return local_memcpy (dest, src, sz);
+    return local_memcpy (dest, src, clamp (dest, n));
   }
 
   void * memset (void * dest, int val, size_t n) {
-    size_t sz;
-    if (onStack(dest) || !malloc_hooked) {
-      sz = n;
-    } else {
-      sz = CUSTOM_PREFIX(malloc_usable_size) (dest);
-      if (sz == -1) {
-	sz = n;
-      } else {
-	size_t s = (n < sz) ? n : sz;
-	if (sz < n) {
+    const size_t sz = clamp (dest, n);
 #if 1
-	  // Overflow.
-	  fprintf (stderr, "Overflow detected in memset: dest (%x) size = %d, n = %d\n", dest, sz, n);
-#endif
-	}
-	sz = s;
-      }
+    if (sz < n) {
+      // Overflow.
+      fprintf (stderr, "Overflow detected in memset: dest (%p) size = %lu, n = %lu\n", dest, (unsigned long) sz, (unsigned long) n);
     }
+#endif
     return local_memset (dest, val, sz);
   }
 
@@ -276,103 +336,30 @@ extern "C" {
   int snprintf (char * str, size_t n, const char * format, ...) {
     va_list ap;
     va_start (ap, format);
-    if (onStack(str) || !malloc_hooked) {
-      int r = vsnprintf (str, n, format, ap);
-      va_end (ap);
-      return r;
-    }
-    size_t sz = CUSTOM_PREFIX(malloc_usable_size) (str);
-    if (sz == -1) {
-      int r = vsnprintf (str, n, format, ap);
-      va_end (ap);
-      return r;
-    }
-    size_t s = (n < sz) ? n : sz;
-    int r = vsnprintf (str, s, format, ap);
+    int r = vsnprintf (str, clamp (str, n), format, ap);
     va_end (ap);
     return r;
   }
 
   char * gets (char * s) {
-    size_t sz;
-    if (onStack(s)) {
-      sz = INT_MAX;
-    } else {
-      sz = CUSTOM_PREFIX(malloc_usable_size)(s);
-    }
-    return fgets (s, sz, stdin);
+    return fgets (s, (int) clamp (s, INT_MAX), stdin);
   }
 
-#if 1
   char * strcpy (char * dest, const char * src) {
-    if (onStack(dest) || !malloc_hooked) {
-      return local_strcpy (dest, src);
-    }
-    size_t sz = CUSTOM_PREFIX(malloc_usable_size) (dest);
-    if (sz == -1) {
-      return local_strcpy (dest, src);
-    } else {
-      // DieFast: check for an error (would we have overflowed?)
-#if 0
-      if (sz < strlen(src) + 1) {
-	fprintf (stderr, "Overflow detected in strcpy! dest (%x) size = %d, src (%x) length = %d (%s)\n", dest, sz, src, strlen(src), src); 
-      }
-#endif
-      return local_strncpy (dest, src, sz);
-    }
+    return local_strcpy (dest, src);
   }
-#endif
 
   char * strncpy (char * dest, const char * src, size_t n) {
-    if (onStack(dest) || !malloc_hooked) {
-      return local_strncpy (dest, src, n);
-    }
-    size_t sz = CUSTOM_PREFIX(malloc_usable_size) (dest);
-    if (sz == -1) {
-      return local_strncpy (dest, src, n);
-    } else {
-      size_t s = (n < sz) ? n : sz;
-      // DieFast: check for an error (would we have overflowed?)
-      if (n > s) {
-	// fprintf (stderr, "Overflow detected in strncpy!\n");
-      }
-      return local_strncpy (dest, src, s);
-    }
+    // DieFast: we could check for an error (would we have overflowed?)
+    return local_strncpy (dest, src, clampString (dest, n));
   }
 
   char * strcat (char * dest, const char * src) {
-    if (onStack(dest) || !malloc_hooked) {
-      return local_strncat (dest, src, INT_MAX);
-    }
-    size_t sz = CUSTOM_PREFIX(malloc_usable_size) (dest + strlen(dest));
-    if (sz == -1) {
-      return local_strncat (dest, src, INT_MAX);
-    } else {
-      // DieFast: check for an error (would we have overflowed?)
-      //if (strlen(src) + strlen(dest) > sz) {
-      //	fprintf (stderr, "Overflow detected in strcat!\n");
-      //}
-      return local_strncat (dest, src, sz);
-    }
+    return local_strcat (dest, src);
   }
 
   char * strncat (char * dest, const char * src, size_t n) {
-    if (onStack(dest) || !malloc_hooked) {
-      return local_strncat (dest, src, n);
-    }      
-    size_t sz = CUSTOM_PREFIX(malloc_usable_size) (dest + strlen(dest));
-    if (sz == -1) {
-      return local_strncat (dest, src, n);
-    } else {
-      size_t s = (n < (sz-1)) ? n : (sz-1);
-#if 0
-      // DieFast: check for an error (would we have overflowed?)
-      if (strlen(dest) + s > sz) {
-	// fprintf (stderr, "Overflow detected in strncat!\n");
-      }
-#endif
-      return local_strncat (dest, src, s);
-    }
+    return local_strncat (dest, src, n);
   }
 
 